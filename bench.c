@@ -1,154 +1,635 @@
+/**
+ * Load generator for bloomd.
+ *
+ * Each thread drives a number of connections, keeping up to a
+ * pipeline depth of requests outstanding on each. Requests are
+ * single key check and set commands, or multi and bulk commands
+ * when the batch size is more than one. The keys are loaded into
+ * the filter first, and then a mix of checks and sets is run with
+ * keys drawn from a uniform or zipf distribution. Checks look up
+ * a loaded key with the hit ratio, and a key that was never set
+ * otherwise. The latency of each request is recorded in a log
+ * linear histogram, and the percentiles are reported at the end.
+ *
+ * The keys can be spread over many filters, each holding a
+ * contiguous range of the keys, so the cost of looking up and
+ * locking filters among many others is measured too.
+ *
+ * Run with -? for the options.
+ */
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-static int NUM_THREADS = 1;
-static int NUM_KEYS = 1000000;
+/**
+ * Histograms have 2^HIST_SUB_BITS buckets for each power
+ * of two, so values are recorded within 1% of their value.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+#define OP_CHECK 0
+#define OP_SET 1
+#define NUM_OPS 2
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+
 static char* HOST = "127.0.0.1";
 static int PORT = 8673;
-static char *FILTER_NAME = "foobar%d";
+static int NUM_THREADS = 1;
+static int NUM_CONNS = 1;           // Connections per thread
+static int DEPTH = 1;               // Outstanding requests per connection
+static int BATCH = 1;               // Keys per request
+static uint64_t NUM_KEYS = 1000000; // Keys loaded, and drawn from by the run
+static uint64_t NUM_REQUESTS = 1000000;
+static int READ_PERCENT = 90;       // Percent of requests that are checks
+static double HIT_RATIO = 1.0;      // Fraction of checked keys that were loaded
+static int DISTRIBUTION = DIST_UNIFORM;
+static double ZIPF_THETA = 0.99;
+static int LOAD = 1;                // Load the keys before the run
+static int DROP = 0;                // Drop the filter at the end
+static char *FILTER_NAME = "bench";
+static uint64_t NUM_FILTERS = 1;    // Filters the keys are spread over
+static uint64_t CAPACITY = 0;       // Capacity of the created filters, 0 for the default
+static uint64_t KEYS_PER_FILTER;
+
+static const char *OP_NAMES[NUM_OPS] = {"check", "set"};
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram;
 
+/**
+ * The zipf generator of "Quickly Generating Billion-Record
+ * Synthetic Databases", Gray et al. The constants are shared
+ * by all the threads.
+ */
 typedef struct {
-    int conn_fd;
-    char filter_name[32];
-    char cmd_buf[128];
-} conn_info;
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    double half_pow;
+} zipf_gen;
+
+typedef struct {
+    int fd;
+    char *out;              // Commands not yet sent
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    char *in;               // Partial response
+    size_t in_len;
+    size_t in_cap;
+    uint64_t *sent_at;      // Ring of the outstanding requests
+    unsigned char *ops;
+    int head;
+    int outstanding;
+} bench_conn;
+
+typedef struct {
+    int id;
+    uint64_t rand_state;
+    int loading;            // Set while loading the keys
+    uint64_t next_load;     // Next key to load
+    uint64_t load_end;
+    uint64_t requests;      // Requests left to issue
+    histogram hist[NUM_OPS];
+    uint64_t keys[NUM_OPS];
+    uint64_t hits;          // Checked keys that were found
+    uint64_t errors;
+    bench_conn *conns;
+} bench_thread;
+
+static zipf_gen ZIPF;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * xorshift64*, a thread local generator.
+ */
+static uint64_t next_rand(bench_thread *t) {
+    uint64_t x = t->rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t->rand_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_double(bench_thread *t) {
+    return (next_rand(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i=1; i <= n; i++) sum += 1 / pow((double)i, theta);
+    return sum;
+}
+
+static void zipf_init(zipf_gen *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+    z->half_pow = 1 + pow(0.5, theta);
+}
+
+static uint64_t zipf_next(zipf_gen *z, bench_thread *t) {
+    double u = next_double(t);
+    double uz = u * z->zetan;
+    if (uz < 1) return 0;
+    if (uz < z->half_pow) return 1;
+    uint64_t v = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return (v < z->n) ? v : z->n - 1;
+}
+
+/**
+ * Returns the next key of the run, drawn from the distribution.
+ */
+static uint64_t next_key(bench_thread *t) {
+    if (DISTRIBUTION == DIST_ZIPF) return zipf_next(&ZIPF, t);
+    return next_rand(t) % NUM_KEYS;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - HIST_SUB_COUNT);
+}
 
-int connect_fd(conn_info *info) {
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB_COUNT) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)((idx & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+    // Report the middle of the bucket
+    return base + ((1ULL << shift) >> 1);
+}
+
+static void hist_record(histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(histogram *into, histogram *h) {
+    for (int i=0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static uint64_t hist_percentile(histogram *h, double p) {
+    uint64_t rank = (uint64_t)ceil(p * h->total);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static int connect_fd(void) {
     struct sockaddr_in addr;
     bzero(&addr, sizeof(addr));
     addr.sin_family = PF_INET;
     addr.sin_port = htons(PORT);
     inet_pton(PF_INET, HOST, &addr.sin_addr);
 
-    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
-    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
-}
-
-int timediff(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
-}
-
-void *thread_main(void *in) {
-    printf("Thread started.");
-    conn_info info;
-    int sets = 0;
-    int checks = 0;
-
-    // Generate a filter name
-    char *buf = (char*)&info.filter_name;
-    sprintf(buf, FILTER_NAME, rand());
-    printf("Using filter: %s\n", buf);
-
-    struct timeval start_connect, start_create, start_set, start_check, end;
-    char out_buf[16];
-    int num, sent, len;
-
-    // Connect
-    gettimeofday(&start_connect, NULL);
-    int res = connect_fd(&info);
-    if (res) {
-        printf("Failed to connect!");
-        return NULL;
-    }
-    gettimeofday(&end, NULL);
-    printf("Connect: %d msec\n", timediff(&start_connect, &end));
-
-    // Make filer
-    gettimeofday(&start_create, NULL);
-
-    len = sprintf((char*)&info.cmd_buf, "create %s\n", buf);
-    send(info.conn_fd, info.cmd_buf, len, 0);
-    num = recv(info.conn_fd, (char*)&out_buf, 5, 0);
-    if (strcmp(out_buf, "Done\n") != 0) {
-        printf("Failed to create filter!");
-        return NULL;
-   }
-
-    gettimeofday(&end, NULL);
-    printf("Create: %d msec\n", timediff(&start_create, &end));
-
-    // Set
-    gettimeofday(&start_set, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "set %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send!");
-            return NULL;
-        }
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
     }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return fd;
+}
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read!");
-            return NULL;
-        }
-        if (out_buf[0] == 'Y') {
-            sets++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
+/**
+ * Sends a command on a blocking socket, and reads the one line reply.
+ */
+static int command(int fd, char *cmd, char *reply, int reply_len) {
+    int len = strlen(cmd);
+    if (send(fd, cmd, len, 0) != len) return -1;
+    int pos = 0;
+    while (pos < reply_len - 1) {
+        int num = recv(fd, reply + pos, 1, 0);
+        if (num <= 0) return -1;
+        if (reply[pos++] == '\n') break;
+    }
+    reply[pos] = 0;
+    return 0;
+}
+
+static void append(bench_conn *c, const char *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        while (c->out_len + len > c->out_cap) c->out_cap *= 2;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static void append_key(bench_conn *c, const char *prefix, uint64_t key) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), " %s%llu", prefix, (unsigned long long)key);
+    append(c, buf, len);
+}
+
+static void append_filter(bench_conn *c, uint64_t filter) {
+    if (NUM_FILTERS == 1) {
+        append(c, FILTER_NAME, strlen(FILTER_NAME));
+        return;
+    }
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%s%llu", FILTER_NAME, (unsigned long long)filter);
+    append(c, buf, len);
+}
+
+/**
+ * Returns a key of the run in the range of a filter.
+ */
+static uint64_t next_filter_key(bench_thread *t, uint64_t filter) {
+    uint64_t key = next_key(t);
+    if (NUM_FILTERS == 1) return key;
+    uint64_t base = filter * KEYS_PER_FILTER;
+    uint64_t range = (NUM_KEYS - base < KEYS_PER_FILTER) ? NUM_KEYS - base : KEYS_PER_FILTER;
+    return base + key % range;
+}
+
+/**
+ * Queues the next request on a connection.
+ * @return 1 if a request was queued, 0 if there are none left.
+ */
+static int queue_request(bench_thread *t, bench_conn *c) {
+    int op;
+    int num = BATCH;
+    uint64_t filter;
+    if (t->loading) {
+        if (t->next_load >= t->load_end) return 0;
+        op = OP_SET;
+
+        // A batch does not cross into the keys of the next filter
+        filter = t->next_load / KEYS_PER_FILTER;
+        uint64_t end = (filter + 1) * KEYS_PER_FILTER;
+        if (t->load_end < end) end = t->load_end;
+        if (end - t->next_load < (uint64_t)num) num = end - t->next_load;
+    } else {
+        if (!t->requests) return 0;
+        t->requests--;
+        op = ((int)(next_rand(t) % 100) < READ_PERCENT) ? OP_CHECK : OP_SET;
+        filter = next_key(t) / KEYS_PER_FILTER;
+    }
+
+    const char *cmd;
+    if (op == OP_CHECK) cmd = (BATCH > 1) ? "m " : "c ";
+    else cmd = (BATCH > 1) ? "b " : "s ";
+    append(c, cmd, 2);
+    append_filter(c, filter);
+    for (int i=0; i < num; i++) {
+        if (t->loading) {
+            append_key(c, "key", t->next_load++);
+        } else if (op == OP_CHECK && next_double(t) >= HIT_RATIO) {
+            // Keys that were never set are misses
+            append_key(c, "miss", next_rand(t));
         } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
+            append_key(c, "key", next_filter_key(t, filter));
         }
     }
-    gettimeofday(&end, NULL);
-    printf("Set: %d msec. Num: %d\n", timediff(&start_set, &end), sets);
+    append(c, "\n", 1);
 
-    // Check
-    gettimeofday(&start_check, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "check %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send! (check)");
-            return NULL;
+    int slot = (c->head + c->outstanding) % DEPTH;
+    c->sent_at[slot] = now_nsec();
+    c->ops[slot] = op;
+    c->outstanding++;
+    t->keys[op] += num;
+    return 1;
+}
+
+/**
+ * Completes the oldest outstanding request of a connection.
+ */
+static void complete_request(bench_thread *t, bench_conn *c, char *line, uint64_t now) {
+    int op = c->ops[c->head];
+    if (!t->loading) hist_record(&t->hist[op], now - c->sent_at[c->head]);
+    c->head = (c->head + 1) % DEPTH;
+    c->outstanding--;
+
+    if (line[0] != 'Y' && line[0] != 'N') {
+        t->errors++;
+        return;
+    }
+    if (op == OP_CHECK && !t->loading) {
+        for (char *p=line; *p; p++) {
+            if (*p == 'Y' && (p == line || p[-1] == ' ')) t->hits++;
         }
     }
+}
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        num = recv(info.conn_fd, (char*)out_buf, 1, 0);
-        if (num == -1) {
-            printf("Failed to read! (check)");
-            return NULL;
+/**
+ * Reads the responses available on a connection.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int read_responses(bench_thread *t, bench_conn *c) {
+    if (c->in_cap - c->in_len < 4096) {
+        c->in_cap *= 2;
+        c->in = realloc(c->in, c->in_cap);
+    }
+    ssize_t num = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len - 1, 0);
+    if (num == 0) return -1;
+    if (num < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->in_len += num;
+
+    uint64_t now = now_nsec();
+    char *start = c->in;
+    char *end = c->in + c->in_len;
+    char *nl;
+    while (start < end && (nl = memchr(start, '\n', end - start))) {
+        *nl = 0;
+        if (c->outstanding) complete_request(t, c, start, now);
+        start = nl + 1;
+    }
+    c->in_len = end - start;
+    memmove(c->in, start, c->in_len);
+    return 0;
+}
+
+/**
+ * Runs requests on all the connections of a thread, until
+ * none are left to issue and all have completed.
+ */
+static int run_phase(bench_thread *t) {
+    struct pollfd *fds = calloc(NUM_CONNS, sizeof(struct pollfd));
+    int res = 0;
+    while (1) {
+        int active = 0;
+        for (int i=0; i < NUM_CONNS; i++) {
+            bench_conn *c = t->conns + i;
+            while (c->outstanding < DEPTH && queue_request(t, c));
+            fds[i].fd = c->fd;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (c->outstanding) fds[i].events |= POLLIN;
+            if (c->out_sent < c->out_len) fds[i].events |= POLLOUT;
+            if (fds[i].events) active = 1;
         }
-        if (out_buf[0] == 'Y') {
-            checks++;
-            recv(info.conn_fd, (char*)out_buf, 3, 0); // Yes\n
-        } else {
-            recv(info.conn_fd, (char*)out_buf, 2, 0); // No\n
+        if (!active) break;
+
+        if (poll(fds, NUM_CONNS, 1000) < 0) {
+            if (errno == EINTR) continue;
+            res = -1;
+            break;
+        }
+
+        for (int i=0; i < NUM_CONNS && !res; i++) {
+            bench_conn *c = t->conns + i;
+            if (fds[i].revents & (POLLERR | POLLHUP)) res = -1;
+            if (fds[i].revents & POLLOUT) {
+                ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, 0);
+                if (sent < 0 && errno != EAGAIN && errno != EINTR) res = -1;
+                if (sent > 0) c->out_sent += sent;
+                if (c->out_sent == c->out_len) c->out_sent = c->out_len = 0;
+            }
+            if (fds[i].revents & POLLIN) {
+                if (read_responses(t, c)) res = -1;
+            }
+        }
+        if (res) break;
+    }
+    free(fds);
+    return res;
+}
+
+static void *thread_main(void *in) {
+    bench_thread *t = in;
+    t->conns = calloc(NUM_CONNS, sizeof(bench_conn));
+    for (int i=0; i < NUM_CONNS; i++) {
+        bench_conn *c = t->conns + i;
+        c->fd = connect_fd();
+        if (c->fd < 0) {
+            fprintf(stderr, "Thread %d failed to connect!\n", t->id);
+            t->errors++;
+            return NULL;
         }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        c->out_cap = 4096;
+        c->out = malloc(c->out_cap);
+        c->in_cap = 8192 + 8 * BATCH;
+        c->in = malloc(c->in_cap);
+        c->sent_at = calloc(DEPTH, sizeof(uint64_t));
+        c->ops = calloc(DEPTH, 1);
     }
-    gettimeofday(&end, NULL);
-    printf("Check: %d msec. Num: %d\n", timediff(&start_check, &end), checks);
 
+    // The loaded keys are split between the threads
+    if (t->loading) {
+        t->next_load = NUM_KEYS * t->id / NUM_THREADS;
+        t->load_end = NUM_KEYS * (t->id + 1) / NUM_THREADS;
+    }
+    if (run_phase(t)) {
+        fprintf(stderr, "Thread %d lost its connection!\n", t->id);
+        t->errors++;
+    }
+
+    for (int i=0; i < NUM_CONNS; i++) {
+        bench_conn *c = t->conns + i;
+        close(c->fd);
+        free(c->out);
+        free(c->in);
+        free(c->sent_at);
+        free(c->ops);
+    }
+    free(t->conns);
     return NULL;
 }
 
-int main(int argc, char **argv) {
-    // Read random seed
-    int randfh = open("/dev/random", O_RDONLY);
-    unsigned seed = 0;
-    read(randfh, &seed, sizeof(seed));
-    close(randfh);
+/**
+ * Runs a phase on all the threads.
+ * @return The time taken in nsec.
+ */
+static uint64_t run_threads(bench_thread *threads, int loading) {
+    pthread_t *ids = calloc(NUM_THREADS, sizeof(pthread_t));
+    uint64_t start = now_nsec();
+    for (int i=0; i < NUM_THREADS; i++) {
+        bench_thread *t = threads + i;
+        t->loading = loading;
+        t->requests = NUM_REQUESTS / NUM_THREADS + ((uint64_t)i < NUM_REQUESTS % NUM_THREADS);
+        pthread_create(ids + i, NULL, thread_main, t);
+    }
+    for (int i=0; i < NUM_THREADS; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+    return now_nsec() - start;
+}
 
-    srand(seed);
-    pthread_t t[NUM_THREADS];
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_create(&t[i], NULL, thread_main, NULL);
+static void usage(char *name) {
+    printf("Usage: %s [options]\n\
+    -h host       Server address. Default 127.0.0.1\n\
+    -p port       Server port. Default 8673\n\
+    -t threads    Client threads. Default 1\n\
+    -c conns      Connections per thread. Default 1\n\
+    -d depth      Requests in flight per connection. Default 1\n\
+    -b batch      Keys per request, using multi and bulk if above 1. Default 1\n\
+    -k keys       Keys loaded and used by the run. Default 1000000\n\
+    -n requests   Requests in the run. Default 1000000\n\
+    -r percent    Percent of requests that are checks. Default 90\n\
+    -H ratio      Fraction of checked keys that were loaded. Default 1.0\n\
+    -D dist       Key distribution, uniform or zipf. Default uniform\n\
+    -s theta      Zipf skew, below 1. Default 0.99\n\
+    -f filter     Filter to use, or the prefix of the filters. Default bench\n\
+    -F filters    Filters the keys are spread over. Default 1\n\
+    -C capacity   Capacity of the created filters. Default the server's\n\
+    -L            Skip loading the keys\n\
+    -X            Drop the filter at the end\n", name);
+}
+
+static int parse_args(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:t:c:d:b:k:n:r:H:D:s:f:F:C:LX?")) != -1) {
+        switch (opt) {
+            case 'h': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 't': NUM_THREADS = atoi(optarg); break;
+            case 'c': NUM_CONNS = atoi(optarg); break;
+            case 'd': DEPTH = atoi(optarg); break;
+            case 'b': BATCH = atoi(optarg); break;
+            case 'k': NUM_KEYS = strtoull(optarg, NULL, 10); break;
+            case 'n': NUM_REQUESTS = strtoull(optarg, NULL, 10); break;
+            case 'r': READ_PERCENT = atoi(optarg); break;
+            case 'H': HIT_RATIO = atof(optarg); break;
+            case 's': ZIPF_THETA = atof(optarg); break;
+            case 'f': FILTER_NAME = optarg; break;
+            case 'F': NUM_FILTERS = strtoull(optarg, NULL, 10); break;
+            case 'C': CAPACITY = strtoull(optarg, NULL, 10); break;
+            case 'L': LOAD = 0; break;
+            case 'X': DROP = 1; break;
+            case 'D':
+                if (strcmp(optarg, "zipf") == 0) DISTRIBUTION = DIST_ZIPF;
+                else if (strcmp(optarg, "uniform") == 0) DISTRIBUTION = DIST_UNIFORM;
+                else return -1;
+                break;
+            default:
+                return -1;
+        }
     }
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_join(t[i], NULL);
+    if (NUM_THREADS < 1 || NUM_CONNS < 1 || DEPTH < 1 || BATCH < 1 || !NUM_KEYS ||
+            READ_PERCENT < 0 || READ_PERCENT > 100 || HIT_RATIO < 0 || HIT_RATIO > 1 ||
+            ZIPF_THETA <= 0 || ZIPF_THETA >= 1 || !NUM_FILTERS || NUM_FILTERS > NUM_KEYS) {
+        return -1;
     }
     return 0;
 }
+
+static void report_op(bench_thread *threads, int op, uint64_t nsec) {
+    histogram *h = calloc(1, sizeof(histogram));
+    uint64_t keys = 0, hits = 0;
+    for (int i=0; i < NUM_THREADS; i++) {
+        hist_merge(h, &threads[i].hist[op]);
+        keys += threads[i].keys[op];
+        if (op == OP_CHECK) hits += threads[i].hits;
+    }
+    if (!h->total) {
+        free(h);
+        return;
+    }
+
+    printf("%s: requests %llu keys %llu keys/sec %.0f", OP_NAMES[op],
+            (unsigned long long)h->total, (unsigned long long)keys, keys * 1e9 / nsec);
+    if (op == OP_CHECK) printf(" hit_ratio %.4f", (double)hits / keys);
+    printf("\n%s latency usec: p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", OP_NAMES[op],
+            hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+            hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    free(h);
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Create the filters, which may already exist
+    char cmd[512], reply[128], name[256];
+    int fd = connect_fd();
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to %s:%d!\n", HOST, PORT);
+        return 1;
+    }
+    KEYS_PER_FILTER = (NUM_KEYS + NUM_FILTERS - 1) / NUM_FILTERS;
+    for (uint64_t f=0; f < NUM_FILTERS; f++) {
+        if (NUM_FILTERS == 1) snprintf(name, sizeof(name), "%s", FILTER_NAME);
+        else snprintf(name, sizeof(name), "%s%llu", FILTER_NAME, (unsigned long long)f);
+        if (CAPACITY) snprintf(cmd, sizeof(cmd), "create %s capacity=%llu\n", name, (unsigned long long)CAPACITY);
+        else snprintf(cmd, sizeof(cmd), "create %s\n", name);
+        if (command(fd, cmd, reply, sizeof(reply)) ||
+                (strcmp(reply, "Done\n") && strcmp(reply, "Exists\n"))) {
+            fprintf(stderr, "Failed to create filter %s!\n", name);
+            return 1;
+        }
+    }
+    if (DISTRIBUTION == DIST_ZIPF) zipf_init(&ZIPF, NUM_KEYS, ZIPF_THETA);
+
+    bench_thread *threads = calloc(NUM_THREADS, sizeof(bench_thread));
+    for (int i=0; i < NUM_THREADS; i++) {
+        threads[i].id = i;
+        threads[i].rand_state = (now_nsec() ^ ((uint64_t)i << 32)) | 1;
+    }
+
+    uint64_t errors = 0;
+    if (LOAD) {
+        uint64_t nsec = run_threads(threads, 1);
+        printf("load: keys %llu msec %llu keys/sec %.0f\n", (unsigned long long)NUM_KEYS,
+                (unsigned long long)(nsec / 1000000), NUM_KEYS * 1e9 / nsec);
+        for (int i=0; i < NUM_THREADS; i++) {
+            errors += threads[i].errors;
+            threads[i].errors = 0;
+            threads[i].keys[OP_SET] = 0;
+        }
+    }
+
+    uint64_t nsec = run_threads(threads, 0);
+    printf("run: requests %llu msec %llu requests/sec %.0f threads %d conns %d depth %d batch %d filters %llu\n",
+            (unsigned long long)NUM_REQUESTS, (unsigned long long)(nsec / 1000000),
+            NUM_REQUESTS * 1e9 / nsec, NUM_THREADS, NUM_CONNS, DEPTH, BATCH,
+            (unsigned long long)NUM_FILTERS);
+    for (int op=0; op < NUM_OPS; op++) report_op(threads, op, nsec);
+    for (int i=0; i < NUM_THREADS; i++) errors += threads[i].errors;
+    printf("errors: %llu\n", (unsigned long long)errors);
+
+    for (uint64_t f=0; DROP && f < NUM_FILTERS; f++) {
+        if (NUM_FILTERS == 1) snprintf(cmd, sizeof(cmd), "drop %s\n", FILTER_NAME);
+        else snprintf(cmd, sizeof(cmd), "drop %s%llu\n", FILTER_NAME, (unsigned long long)f);
+        command(fd, cmd, reply, sizeof(reply));
+    }
+    close(fd);
+    free(threads);
+    return (errors) ? 1 : 0;
+}
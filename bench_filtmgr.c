@@ -0,0 +1,420 @@
+/**
+ * Concurrency stress benchmark for the filter manager.
+ *
+ * Runs many threads against a bloom_filtmgr in-process, without
+ * the networking, each doing a mix of checks and sets on a shared
+ * set of filters, creating and dropping filters of its own, and
+ * unmapping and flushing the shared filters underneath the others.
+ * The manager vacuums in its own thread as in bloomd, and how far
+ * it falls behind is sampled while the threads run.
+ *
+ * Each thread only checks keys it has set, so any check that
+ * misses is a lost update. Every key that was set is checked
+ * again once the threads stop.
+ *
+ * Results are written to stdout as CSV, one line per operation:
+ *
+ *  op,ops,ns_per_op,ops_per_sec
+ *
+ * followed by a summary line with the vacuum lag and lost updates.
+ * The exit code is 1 if any update was lost. Progress and errors go
+ * to stderr. Run with -? for the options.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "filter_manager.h"
+
+static int NUM_THREADS = 4;
+static int NUM_FILTERS = 8;
+static int DURATION = 5;
+static int BATCH = 16;
+static int CHECK_PCT = 70;
+static int CHURN_PCT = 1;       // Creates and drops of a filter
+static int UNMAP_PCT = 1;
+static int FLUSH_PCT = 1;
+static uint64_t CAPACITY = 100000;
+static int IN_MEMORY = 0;
+static char *DATA_DIR = NULL;
+
+// Operations are checkpointed with the manager this often
+#define CHECKPOINT_OPS 64
+
+typedef enum {
+    OP_CHECK,
+    OP_SET,
+    OP_CHURN,
+    OP_UNMAP,
+    OP_FLUSH,
+    NUM_OPS
+} bench_op;
+
+static const char *OP_NAMES[] = {"check", "set", "create_drop", "unmap", "flush"};
+
+typedef struct {
+    int id;
+    bloom_filtmgr *mgr;
+    volatile int *should_run;
+    uint64_t *next_key;         // Keys set in each filter, [0, next)
+    uint64_t ops[NUM_OPS];
+    uint64_t nsec[NUM_OPS];
+    uint64_t errors;
+    uint64_t lost;
+    unsigned int seed;
+} bench_thread;
+
+typedef struct {
+    bloom_filtmgr *mgr;
+    volatile int *should_run;
+    uint64_t samples;
+    uint64_t total;
+    uint64_t max;
+} lag_sampler;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void filter_name(char *buf, size_t len, int filter) {
+    snprintf(buf, len, "bench%d", filter);
+}
+
+/**
+ * Keys are owned by a thread, so it knows
+ * exactly which it has set.
+ */
+static void key_name(char *buf, size_t len, int thread, uint64_t key) {
+    snprintf(buf, len, "t%d.%llu", thread, (unsigned long long)key);
+}
+
+/**
+ * Checks a batch of random keys the thread
+ * already set, counting the misses as lost.
+ */
+static int do_check(bench_thread *t, int filter) {
+    uint64_t set = t->next_key[filter];
+    if (!set) return 0;
+    char bufs[BATCH][32];
+    char *keys[BATCH];
+    char result[BATCH];
+    for (int i=0; i < BATCH; i++) {
+        key_name(bufs[i], 32, t->id, rand_r(&t->seed) % set);
+        keys[i] = bufs[i];
+    }
+
+    char name[32];
+    filter_name(name, sizeof(name), filter);
+    int res = filtmgr_check_keys(t->mgr, name, keys, BATCH, result);
+    if (res) return res;
+    for (int i=0; i < BATCH; i++) {
+        if (!result[i]) {
+            if (!t->lost) fprintf(stderr, "Lost update of %s in %s!\n", keys[i], name);
+            t->lost++;
+        }
+    }
+    return 0;
+}
+
+// Sets a batch of new keys
+static int do_set(bench_thread *t, int filter) {
+    char bufs[BATCH][32];
+    char *keys[BATCH];
+    char result[BATCH];
+    uint64_t start = t->next_key[filter];
+    for (int i=0; i < BATCH; i++) {
+        key_name(bufs[i], 32, t->id, start + i);
+        keys[i] = bufs[i];
+    }
+
+    char name[32];
+    filter_name(name, sizeof(name), filter);
+    int res = filtmgr_set_keys(t->mgr, name, keys, BATCH, result);
+    if (!res) t->next_key[filter] += BATCH;
+    return res;
+}
+
+// Creates a filter of our own, sets a batch and drops it
+static int do_churn(bench_thread *t, uint64_t n) {
+    char name[48];
+    snprintf(name, sizeof(name), "churn%d.%llu", t->id, (unsigned long long)n);
+    int res = filtmgr_create_filter(t->mgr, name, NULL);
+    if (res) return res;
+
+    char bufs[BATCH][32];
+    char *keys[BATCH];
+    char result[BATCH];
+    for (int i=0; i < BATCH; i++) {
+        key_name(bufs[i], 32, t->id, i);
+        keys[i] = bufs[i];
+    }
+    res = filtmgr_set_keys(t->mgr, name, keys, BATCH, result);
+    int drop = filtmgr_drop_filter(t->mgr, name);
+    return (res) ? res : drop;
+}
+
+static bench_op pick_op(bench_thread *t) {
+    int r = rand_r(&t->seed) % 100;
+    if (r < CHURN_PCT) return OP_CHURN;
+    r -= CHURN_PCT;
+    if (r < UNMAP_PCT) return OP_UNMAP;
+    r -= UNMAP_PCT;
+    if (r < FLUSH_PCT) return OP_FLUSH;
+    r -= FLUSH_PCT;
+    return (r < CHECK_PCT) ? OP_CHECK : OP_SET;
+}
+
+static void* bench_thread_main(void *in) {
+    bench_thread *t = in;
+    filtmgr_client_checkpoint(t->mgr);
+    char name[32];
+    uint64_t n = 0;
+    while (*t->should_run) {
+        bench_op op = pick_op(t);
+        int filter = rand_r(&t->seed) % NUM_FILTERS;
+        uint64_t start = now_nsec();
+        int res = 0;
+        switch (op) {
+            case OP_CHECK:
+                res = do_check(t, filter);
+                break;
+            case OP_SET:
+                res = do_set(t, filter);
+                break;
+            case OP_CHURN:
+                res = do_churn(t, n);
+                break;
+            case OP_UNMAP:
+                filter_name(name, sizeof(name), filter);
+                res = filtmgr_unmap_filter(t->mgr, name);
+                break;
+            case OP_FLUSH:
+                filter_name(name, sizeof(name), filter);
+                res = filtmgr_flush_filter(t->mgr, name);
+                break;
+            default:
+                break;
+        }
+        t->nsec[op] += now_nsec() - start;
+        t->ops[op]++;
+        if (res) t->errors++;
+        if (!(++n % CHECKPOINT_OPS)) filtmgr_client_checkpoint(t->mgr);
+    }
+    filtmgr_client_leave(t->mgr);
+    return NULL;
+}
+
+static void* lag_thread_main(void *in) {
+    lag_sampler *s = in;
+    while (*s->should_run) {
+        uint64_t lag = filtmgr_vacuum_lag(s->mgr);
+        s->samples++;
+        s->total += lag;
+        if (lag > s->max) s->max = lag;
+        usleep(10000);
+    }
+    return NULL;
+}
+
+/**
+ * Checks every key that each thread set,
+ * once the threads have stopped.
+ * @return The number of keys that are missing.
+ */
+static uint64_t verify_keys(bloom_filtmgr *mgr, bench_thread *threads) {
+    uint64_t lost = 0;
+    char bufs[BATCH][32];
+    char *keys[BATCH];
+    char result[BATCH];
+    char name[32];
+    filtmgr_client_checkpoint(mgr);
+    for (int t=0; t < NUM_THREADS; t++) {
+        for (int f=0; f < NUM_FILTERS; f++) {
+            filter_name(name, sizeof(name), f);
+            for (uint64_t base=0; base < threads[t].next_key[f]; base += BATCH) {
+                for (int i=0; i < BATCH; i++) {
+                    key_name(bufs[i], 32, t, base + i);
+                    keys[i] = bufs[i];
+                }
+                int res = filtmgr_check_keys(mgr, name, keys, BATCH, result);
+                for (int i=0; i < BATCH; i++) lost += (res || !result[i]);
+                filtmgr_client_checkpoint(mgr);
+            }
+        }
+    }
+    filtmgr_client_leave(mgr);
+    return lost;
+}
+
+// Removes the data dir, with what is left of the filters
+static void remove_data_dir(char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *e;
+    char path[1024];
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_type == DT_DIR)
+            remove_data_dir(path);
+        else
+            unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [options]\n\
+    -t threads    Threads running operations. Default 4\n\
+    -f filters    Filters shared by the threads. Default 8\n\
+    -s seconds    How long to run. Default 5\n\
+    -b keys       Keys in each check and set. Default 16\n\
+    -r percent    Checks, of the checks and sets. Default 70\n\
+    -c percent    Operations that create and drop a filter. Default 1\n\
+    -u percent    Operations that unmap a filter. Default 1\n\
+    -F percent    Operations that flush a filter. Default 1\n\
+    -C capacity   Initial capacity of the filters. Default 100000\n\
+    -m            Keep the filters in memory\n\
+    -d dir        Data dir, which must not exist. Default /tmp/bench_filtmgr.<pid>\n", name);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:s:b:r:c:u:F:C:md:?")) != -1) {
+        switch (opt) {
+            case 't': NUM_THREADS = atoi(optarg); break;
+            case 'f': NUM_FILTERS = atoi(optarg); break;
+            case 's': DURATION = atoi(optarg); break;
+            case 'b': BATCH = atoi(optarg); break;
+            case 'r': CHECK_PCT = atoi(optarg); break;
+            case 'c': CHURN_PCT = atoi(optarg); break;
+            case 'u': UNMAP_PCT = atoi(optarg); break;
+            case 'F': FLUSH_PCT = atoi(optarg); break;
+            case 'C': CAPACITY = strtoull(optarg, NULL, 10); break;
+            case 'm': IN_MEMORY = 1; break;
+            case 'd': DATA_DIR = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (NUM_THREADS < 1 || NUM_FILTERS < 1 || DURATION < 1 || BATCH < 1 || BATCH > 1024 ||
+            CHECK_PCT < 0 || CHECK_PCT > 100 || CHURN_PCT < 0 || UNMAP_PCT < 0 || FLUSH_PCT < 0 ||
+            CHURN_PCT + UNMAP_PCT + FLUSH_PCT > 100 || !CAPACITY) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Only log the errors
+    openlog("bench_filtmgr", LOG_PERROR, LOG_LOCAL0);
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    char default_dir[64];
+    if (!DATA_DIR) {
+        snprintf(default_dir, sizeof(default_dir), "/tmp/bench_filtmgr.%d", getpid());
+        DATA_DIR = default_dir;
+    }
+    if (mkdir(DATA_DIR, 0755)) {
+        fprintf(stderr, "Failed to make the data dir %s! %s\n", DATA_DIR, strerror(errno));
+        return 1;
+    }
+
+    bloom_config config;
+    config_from_filename(NULL, &config);
+    config.data_dir = DATA_DIR;
+    config.initial_capacity = CAPACITY;
+    config.in_memory = IN_MEMORY;
+
+    bloom_filtmgr *mgr;
+    if (init_filter_manager(&config, 1, &mgr)) {
+        fprintf(stderr, "Failed to start the filter manager!\n");
+        return 1;
+    }
+    char name[32];
+    for (int f=0; f < NUM_FILTERS; f++) {
+        filter_name(name, sizeof(name), f);
+        if (filtmgr_create_filter(mgr, name, NULL)) {
+            fprintf(stderr, "Failed to create filter %s!\n", name);
+            return 1;
+        }
+    }
+    filtmgr_client_leave(mgr);
+
+    // Run the threads
+    volatile int should_run = 1;
+    bench_thread *threads = calloc(NUM_THREADS, sizeof(bench_thread));
+    pthread_t *tids = calloc(NUM_THREADS, sizeof(pthread_t));
+    for (int i=0; i < NUM_THREADS; i++) {
+        threads[i].id = i;
+        threads[i].mgr = mgr;
+        threads[i].should_run = &should_run;
+        threads[i].next_key = calloc(NUM_FILTERS, sizeof(uint64_t));
+        threads[i].seed = i * 7919 + 1;
+        pthread_create(tids + i, NULL, bench_thread_main, threads + i);
+    }
+    lag_sampler sampler = {mgr, &should_run, 0, 0, 0};
+    pthread_t lag_tid;
+    pthread_create(&lag_tid, NULL, lag_thread_main, &sampler);
+
+    fprintf(stderr, "Running %d threads on %d filters for %d seconds.\n",
+            NUM_THREADS, NUM_FILTERS, DURATION);
+    sleep(DURATION);
+    should_run = 0;
+    for (int i=0; i < NUM_THREADS; i++) pthread_join(tids[i], NULL);
+    pthread_join(lag_tid, NULL);
+
+    // Add up the threads
+    uint64_t ops[NUM_OPS], nsec[NUM_OPS], errors = 0, lost = 0;
+    memset(ops, 0, sizeof(ops));
+    memset(nsec, 0, sizeof(nsec));
+    for (int i=0; i < NUM_THREADS; i++) {
+        for (int op=0; op < NUM_OPS; op++) {
+            ops[op] += threads[i].ops[op];
+            nsec[op] += threads[i].nsec[op];
+        }
+        errors += threads[i].errors;
+        lost += threads[i].lost;
+    }
+
+    // Throughput is over the wall clock, latency over each thread
+    printf("op,ops,ns_per_op,ops_per_sec\n");
+    uint64_t total = 0, total_nsec = 0;
+    for (int op=0; op < NUM_OPS; op++) {
+        total += ops[op];
+        total_nsec += nsec[op];
+        printf("%s,%llu,%.0f,%.0f\n", OP_NAMES[op], (unsigned long long)ops[op],
+                (ops[op]) ? (double)nsec[op] / ops[op] : 0.0, (double)ops[op] / DURATION);
+    }
+    printf("total,%llu,%.0f,%.0f\n", (unsigned long long)total,
+            (total) ? (double)total_nsec / total : 0.0, (double)total / DURATION);
+
+    uint64_t missing = verify_keys(mgr, threads);
+    printf("vacuum_lag_mean=%.1f vacuum_lag_max=%llu errors=%llu lost_updates=%llu missing_keys=%llu\n",
+            (sampler.samples) ? (double)sampler.total / sampler.samples : 0.0,
+            (unsigned long long)sampler.max, (unsigned long long)errors,
+            (unsigned long long)lost, (unsigned long long)missing);
+
+    // Drop the shared filters and cleanup
+    for (int f=0; f < NUM_FILTERS; f++) {
+        filter_name(name, sizeof(name), f);
+        filtmgr_drop_filter(mgr, name);
+    }
+    filtmgr_client_leave(mgr);
+    destroy_filter_manager(mgr);
+    remove_data_dir(DATA_DIR);
+    for (int i=0; i < NUM_THREADS; i++) free(threads[i].next_key);
+    free(threads);
+    free(tids);
+    return (lost || missing) ? 1 : 0;
+}
@@ -0,0 +1,332 @@
+/**
+ * Microbenchmarks for libbloom.
+ *
+ * Times the hashing of keys, adds and checks on bloom filters
+ * of each layout, both small enough to stay in cache and far
+ * larger than the last level cache, adds and checks on scalable
+ * filters with a growing number of layers, and flushes of file
+ * backed bitmaps in each mode.
+ *
+ * Results are written to stdout as CSV, one line per benchmark,
+ * so runs can be compared to track regressions:
+ *
+ *  benchmark,params,ops,ns_per_op,ops_per_sec
+ *
+ * Params are key=value pairs separated by semicolons. Progress
+ * and errors go to stderr. Run with -? for the options.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "bloom.h"
+#include "sbf.h"
+
+static uint64_t NUM_OPS = 1000000;
+static uint64_t SMALL_CAPACITY = 10000;     // Fits in the L2 cache
+static uint64_t LARGE_CAPACITY = 20000000;  // Well past the LLC
+static uint32_t MAX_LAYERS = 4;
+static uint64_t NUM_FLUSHES = 20;
+static uint32_t MAX_K = 0;                  // Probe budget of the filters, 0 for the ideal k
+static char *DATA_DIR = "/tmp";
+static char *ONLY = NULL;                   // Only run matching benchmarks
+
+static const char *LAYOUTS[] = {"partitioned", "blocked", "counting", "aging"};
+static const char *SCHEMES[] = {"legacy", "murmur"};
+
+/**
+ * Keys are a fixed buffer with a counter
+ * written over the start, so building one costs
+ * the same regardless of the key length.
+ */
+typedef struct {
+    char *buf;
+    int len;
+} bench_key;
+
+static uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void key_init(bench_key *k, int len) {
+    k->len = (len < 17) ? 17 : len;
+    k->buf = malloc(k->len + 1);
+    memset(k->buf, 'x', k->len);
+    k->buf[k->len] = 0;
+}
+
+/**
+ * Sets the key to a value. Keys with the high bit
+ * set are never added, and are used as misses.
+ */
+static char *key_set(bench_key *k, uint64_t val) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i=0; i < 16; i++) {
+        k->buf[i] = hex[(val >> (i * 4)) & 15];
+    }
+    return k->buf;
+}
+
+/**
+ * Spreads sequential values over the key space, so
+ * checks do not follow the order of the adds.
+ */
+static uint64_t scramble(uint64_t i) {
+    return (i * 0x9E3779B97F4A7C15ULL) >> 1;
+}
+
+static int should_run(const char *benchmark) {
+    return !ONLY || strstr(benchmark, ONLY);
+}
+
+static void report(const char *benchmark, const char *params, uint64_t ops, uint64_t nsec) {
+    if (!nsec) nsec = 1;
+    printf("%s,%s,%llu,%.2f,%.0f\n", benchmark, params, (unsigned long long)ops,
+            (double)nsec / ops, ops * 1e9 / nsec);
+    fflush(stdout);
+}
+
+static void bench_hashes(void) {
+    if (!should_run("hash")) return;
+    int key_lens[] = {8, 32, 128, 1024};
+    uint64_t hashes[8];
+    uint64_t sink = 0;
+    char params[128];
+    for (int s=0; s < 2; s++) {
+        for (int l=0; l < 4; l++) {
+            bench_key k;
+            key_init(&k, key_lens[l]);
+            uint64_t start = now_nsec();
+            for (uint64_t i=0; i < NUM_OPS; i++) {
+                // Shorter keys only keep the start of the counter
+                key_set(&k, i);
+                k.buf[key_lens[l]] = 0;
+                bf_compute_hashes_scheme(s, 8, k.buf, hashes);
+                sink += hashes[7];
+            }
+            uint64_t nsec = now_nsec() - start;
+            snprintf(params, sizeof(params), "scheme=%s;key_bytes=%d;k=8", SCHEMES[s], key_lens[l]);
+            report("bf_compute_hashes", params, NUM_OPS, nsec);
+            free(k.buf);
+        }
+    }
+    if (sink == 1) fprintf(stderr, "\n");
+}
+
+/**
+ * Times adds and then checks against a bloom filter,
+ * half of which are for keys that were added.
+ */
+static int bench_bloom_filter(int layout, uint64_t capacity, bitmap_mode mode) {
+    bloom_filter_format format = {layout, BLOOM_HASH_MURMUR, BLOOM_REDUCE_MULTIPLY, 32, MAX_K, 0, 0};
+    bloom_filter_params params = {0, 0, capacity, 1e-4};
+    if (bf_params_for_capacity_format(&params, &format)) return -1;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/bench_libbloom.%d.mmap", DATA_DIR, getpid());
+    bloom_bitmap map;
+    int res;
+    if (mode == ANONYMOUS)
+        res = bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    else
+        res = bitmap_from_filename(path, params.bytes, 1, mode, &map);
+    if (res) {
+        fprintf(stderr, "Failed to make a %llu byte bitmap!\n", (unsigned long long)params.bytes);
+        return -1;
+    }
+    bloom_bloomfilter filter;
+    if (bf_from_bitmap_format(&map, params.k_num, &format, 1, &filter)) {
+        bitmap_close(&map);
+        return -1;
+    }
+
+    char desc[256];
+    const char *mode_name = (mode == ANONYMOUS) ? "anonymous" : (mode == SHARED) ? "shared" : "persistent";
+    snprintf(desc, sizeof(desc), "layout=%s;mode=%s;capacity=%llu;bytes=%llu;k=%u",
+            LAYOUTS[layout], mode_name, (unsigned long long)capacity,
+            (unsigned long long)params.bytes, params.k_num);
+
+    // Adds never exceed the capacity, so the false positive
+    // rate matches a full filter at worst
+    uint64_t adds = (NUM_OPS < capacity) ? NUM_OPS : capacity;
+    bench_key k;
+    key_init(&k, 16);
+    uint64_t start = now_nsec();
+    for (uint64_t i=0; i < adds; i++) {
+        bf_add(&filter, key_set(&k, scramble(i)));
+    }
+    report("bf_add", desc, adds, now_nsec() - start);
+
+    uint64_t found = 0;
+    start = now_nsec();
+    for (uint64_t i=0; i < NUM_OPS; i++) {
+        uint64_t val = (i & 1) ? scramble(i % adds) : (scramble(i) | (1ULL << 63));
+        found += bf_contains(&filter, key_set(&k, val));
+    }
+    report("bf_contains", desc, NUM_OPS, now_nsec() - start);
+    if (found < NUM_OPS / 2) fprintf(stderr, "Missing keys in %s!\n", desc);
+
+    free(k.buf);
+    bf_close(&filter);
+    if (mode != ANONYMOUS) unlink(path);
+    return 0;
+}
+
+static void bench_bloom(void) {
+    if (!should_run("bf_")) return;
+    uint64_t capacities[] = {SMALL_CAPACITY, LARGE_CAPACITY};
+    bitmap_mode modes[] = {ANONYMOUS, PERSISTENT};
+    for (int l=0; l < 4; l++) {
+        for (int c=0; c < 2; c++) {
+            for (int m=0; m < 2; m++) {
+                if (bench_bloom_filter(l, capacities[c], modes[m]))
+                    fprintf(stderr, "Failed to bench the %s layout!\n", LAYOUTS[l]);
+            }
+        }
+    }
+}
+
+/**
+ * Grows a scalable filter one layer at a time, and
+ * times the adds of each layer, then checks for keys
+ * that were added and keys that were not. Misses must
+ * check every layer.
+ */
+static void bench_sbf(void) {
+    if (!should_run("sbf")) return;
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = SMALL_CAPACITY * 10;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    if (sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf)) {
+        fprintf(stderr, "Failed to make the SBF!\n");
+        return;
+    }
+
+    bench_key k;
+    key_init(&k, 16);
+    char desc[128];
+    uint64_t added = 0;
+    for (uint32_t layers=1; layers <= MAX_LAYERS; layers++) {
+        // Fill up to the capacity of this many layers
+        uint64_t target = 0;
+        bloom_filter_params layer;
+        for (uint32_t i=0; i < layers; i++) {
+            sbf_layer_params(&params, i, &layer);
+            target += layer.capacity;
+        }
+        uint64_t start = now_nsec();
+        uint64_t first = added;
+        for (; added < target; added++) {
+            sbf_add(&sbf, key_set(&k, scramble(added)));
+        }
+        snprintf(desc, sizeof(desc), "layers=%u;keys=%llu;bytes=%llu", sbf.num_filters,
+                (unsigned long long)added, (unsigned long long)sbf_total_byte_size(&sbf));
+        report("sbf_add", desc, added - first, now_nsec() - start);
+
+        start = now_nsec();
+        for (uint64_t i=0; i < NUM_OPS; i++) {
+            sbf_contains(&sbf, key_set(&k, scramble(i % added)));
+        }
+        report("sbf_contains_hit", desc, NUM_OPS, now_nsec() - start);
+
+        start = now_nsec();
+        for (uint64_t i=0; i < NUM_OPS; i++) {
+            sbf_contains(&sbf, key_set(&k, scramble(i) | (1ULL << 63)));
+        }
+        report("sbf_contains_miss", desc, NUM_OPS, now_nsec() - start);
+    }
+    free(k.buf);
+    sbf_close(&sbf);
+}
+
+/**
+ * Times flushes of a file backed bitmap, after
+ * dirtying a fraction of its pages.
+ */
+static void bench_flush(void) {
+    if (!should_run("bitmap_flush")) return;
+    uint64_t sizes[] = {1 << 20, 64 << 20};
+    int percents[] = {1, 100};
+    bitmap_mode modes[] = {SHARED, PERSISTENT};
+    char path[512], desc[128];
+    snprintf(path, sizeof(path), "%s/bench_libbloom.%d.flush", DATA_DIR, getpid());
+
+    for (int m=0; m < 2; m++) {
+        for (int s=0; s < 2; s++) {
+            bloom_bitmap map;
+            if (bitmap_from_filename(path, sizes[s], 1, modes[m], &map)) {
+                fprintf(stderr, "Failed to make the bitmap in %s!\n", DATA_DIR);
+                return;
+            }
+            uint64_t pages = sizes[s] / 4096;
+            for (int p=0; p < 2; p++) {
+                uint64_t stride = 100 / percents[p];
+                uint64_t total = 0;
+                for (uint64_t f=0; f < NUM_FLUSHES; f++) {
+                    for (uint64_t page=f % stride; page < pages; page += stride) {
+                        bitmap_setbit(&map, (page * 4096 + f) * 8);
+                    }
+                    uint64_t start = now_nsec();
+                    bitmap_flush(&map);
+                    total += now_nsec() - start;
+                }
+                snprintf(desc, sizeof(desc), "mode=%s;bytes=%llu;dirty_percent=%d",
+                        (modes[m] == SHARED) ? "shared" : "persistent",
+                        (unsigned long long)sizes[s], percents[p]);
+                report("bitmap_flush", desc, NUM_FLUSHES, total);
+            }
+            bitmap_close(&map);
+            unlink(path);
+        }
+    }
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [options]\n\
+    -n ops        Operations timed by each benchmark. Default 1000000\n\
+    -s capacity   Capacity of the in-cache filters. Default 10000\n\
+    -l capacity   Capacity of the out of cache filters. Default 20000000\n\
+    -L layers     Most SBF layers to grow to. Default 4\n\
+    -f flushes    Flushes timed for each bitmap. Default 20\n\
+    -k probes     Most bits probed per key by the filters. Default 0, the ideal k\n\
+    -d dir        Directory for file backed bitmaps. Default /tmp\n\
+    -o name       Only run benchmarks whose name contains this\n", name);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:l:L:f:k:d:o:?")) != -1) {
+        switch (opt) {
+            case 'n': NUM_OPS = strtoull(optarg, NULL, 10); break;
+            case 's': SMALL_CAPACITY = strtoull(optarg, NULL, 10); break;
+            case 'l': LARGE_CAPACITY = strtoull(optarg, NULL, 10); break;
+            case 'L': MAX_LAYERS = atoi(optarg); break;
+            case 'f': NUM_FLUSHES = strtoull(optarg, NULL, 10); break;
+            case 'k': MAX_K = atoi(optarg); break;
+            case 'd': DATA_DIR = optarg; break;
+            case 'o': ONLY = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!NUM_OPS || !SMALL_CAPACITY || !LARGE_CAPACITY || !NUM_FLUSHES ||
+            MAX_LAYERS < 1 || MAX_LAYERS > SBF_ORDER_LAYERS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("benchmark,params,ops,ns_per_op,ops_per_sec\n");
+    bench_hashes();
+    bench_bloom();
+    bench_sbf();
+    bench_flush();
+    return 0;
+}
@@ -0,0 +1,347 @@
+/**
+ * Builds a filter offline from a key file.
+ *
+ * The key file has a key on each line, and the filter is written
+ * to the bloomd.<name> folder of the data_dir, the same as if the
+ * keys were set on a server. It is sized for the number of lines
+ * in the key file, so it is a single layer at the probability
+ * asked for, instead of growing into more layers as the keys
+ * are set. The config of the server is used for the rest of the
+ * settings of the filter.
+ *
+ * The key file is mapped and split into chunks, which the threads
+ * take until none are left, first to count the keys and then to
+ * set them. A line belongs to the chunk it starts in. Empty lines
+ * and a trailing \r are ignored, as with the load command.
+ *
+ * The data_dir is created if needed, but the filter must not
+ * exist yet. A server picks up the filter on its next start, or
+ * the folder can be built elsewhere and moved into the data_dir
+ * of a stopped server. Run with -h for the options.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "filter.h"
+
+// Each thread takes this many bytes of the key file at a time
+#define CHUNK_BYTES (4 * 1024 * 1024)
+
+// Keys are copied out of the mapped file and set in batches
+#define BATCH_KEYS 4096
+#define BATCH_BYTES (256 * 1024)
+
+// Must match VALID_FILTER_NAMES_PATTERN of the conn_handler
+#define VALID_NAME_PATTERN "^[^@ \t\n\r][^ \t\n\r]{0,199}$"
+
+typedef struct {
+    char *data;                 // The mapped key file
+    uint64_t size;
+    uint64_t next_chunk;
+    bloom_filter *filter;
+    pthread_rwlock_t rwlock;    // Held exclusive to grow the filter
+    uint64_t keys;
+    uint64_t added;
+    int failed;
+} build_run;
+
+static void* count_keys_main(void *in);
+static void* set_keys_main(void *in);
+static int set_batch(build_run *run, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Prints our usage to stderr
+ */
+static void show_usage(char *name) {
+    fprintf(stderr, "usage: %s [-h] [-f filename] [-d dir] [-p probability] [-t threads] name keyfile\n\
+\n\
+    -h : Displays this help info\n\
+    -f : Reads the bloomd configuration from this file\n\
+    -d : Builds into this data dir, instead of the one of the configuration\n\
+    -p : The false positive probability, instead of default_probability\n\
+    -t : The number of threads. Default one for each CPU\n\
+\n", name);
+}
+
+/**
+ * Returns the next line of a chunk.
+ * @arg run The build
+ * @arg pos The position, advanced past the line
+ * @arg len Output, the length of the line without
+ * a trailing \r. 0 for an empty line.
+ * @return The line
+ */
+static inline char* next_line(build_run *run, uint64_t *pos, uint64_t *len) {
+    char *line = run->data + *pos;
+    char *nl = memchr(line, '\n', run->size - *pos);
+    uint64_t l = (nl) ? (uint64_t)(nl - line) : run->size - *pos;
+    *pos += l + 1;
+    if (l && line[l - 1] == '\r') l--;
+    *len = l;
+    return line;
+}
+
+/**
+ * Takes the next chunk of the key file.
+ * @arg run The build
+ * @arg start Output, the position of the first line
+ * that starts in the chunk
+ * @arg end Output, the end of the chunk
+ * @return 1 if a chunk was taken, 0 if none are left.
+ */
+static int next_chunk(build_run *run, uint64_t *start, uint64_t *end) {
+    uint64_t chunks = (run->size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    uint64_t chunk = __atomic_fetch_add(&run->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= chunks || __atomic_load_n(&run->failed, __ATOMIC_RELAXED)) return 0;
+
+    uint64_t pos = chunk * CHUNK_BYTES;
+    *end = (pos + CHUNK_BYTES < run->size) ? pos + CHUNK_BYTES : run->size;
+    if (pos && run->data[pos - 1] != '\n') {
+        char *nl = memchr(run->data + pos, '\n', run->size - pos);
+        pos = (nl) ? (uint64_t)(nl - run->data) + 1 : run->size;
+    }
+    *start = pos;
+    return 1;
+}
+
+/**
+ * Runs a pass over the key file with every thread.
+ * @arg run The build, its next chunk is reset
+ * @arg threads The number of threads
+ * @arg main The thread to run
+ * @return 0 on success, -1 if a thread could not be started.
+ */
+static int run_threads(build_run *run, int threads, void *(*main)(void*)) {
+    run->next_chunk = 0;
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(tids + started, NULL, main, run)) break;
+    }
+    for (int i=0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    if (!started) {
+        fprintf(stderr, "Failed to start the threads!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Counts the keys of the chunks it takes, the
+ * non-empty lines that fit in a batch.
+ */
+static void* count_keys_main(void *in) {
+    build_run *run = in;
+    uint64_t pos, end, len, keys = 0;
+    while (next_chunk(run, &pos, &end)) {
+        while (pos < end) {
+            next_line(run, &pos, &len);
+            if (len && len < BATCH_BYTES) keys++;
+        }
+    }
+    __atomic_add_fetch(&run->keys, keys, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * Sets the keys of the chunks it takes in batches.
+ * The keys are copied out of the mapped file, so they
+ * are terminated.
+ */
+static void* set_keys_main(void *in) {
+    build_run *run = in;
+    char **keys = malloc(BATCH_KEYS * sizeof(char*));
+    int *key_lens = malloc(BATCH_KEYS * sizeof(int));
+    char *result = malloc(BATCH_KEYS);
+    char *buf = malloc(BATCH_BYTES);
+
+    uint64_t pos, end, len;
+    while (next_chunk(run, &pos, &end)) {
+        int num = 0, used = 0;
+        while (pos < end) {
+            char *line = next_line(run, &pos, &len);
+            if (!len || len >= BATCH_BYTES) continue;
+
+            // Set the batch once it is full
+            if (num == BATCH_KEYS || used + len + 1 > BATCH_BYTES) {
+                if (set_batch(run, keys, key_lens, num, result)) break;
+                num = used = 0;
+            }
+            memcpy(buf + used, line, len);
+            buf[used + len] = '\0';
+            keys[num] = buf + used;
+            key_lens[num++] = len;
+            used += len + 1;
+        }
+        if (num && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+            set_batch(run, keys, key_lens, num, result);
+    }
+
+    free(keys);
+    free(key_lens);
+    free(result);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Sets a batch of keys. The threads set keys together with
+ * bloomf_try_add_many_len, and only grow the filter alone,
+ * which a filter sized for the keys should never need.
+ * @return 0 on success, -1 if the keys could not be set.
+ */
+static int set_batch(build_run *run, char **keys, int *key_lens, int num_keys, char *result) {
+    pthread_rwlock_rdlock(&run->rwlock);
+    int res = bloomf_try_add_many_len(run->filter, keys, key_lens, num_keys, result);
+    pthread_rwlock_unlock(&run->rwlock);
+
+    if (res >= 0 && res < num_keys) {
+        pthread_rwlock_wrlock(&run->rwlock);
+        int grow = bloomf_add_many_len(run->filter, keys + res, key_lens + res,
+                num_keys - res, result + res);
+        pthread_rwlock_unlock(&run->rwlock);
+        res = (grow) ? grow : num_keys;
+    }
+    if (res != num_keys) {
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    int added = 0;
+    for (int i=0; i < num_keys; i++) added += (result[i] == 1);
+    __atomic_add_fetch(&run->added, added, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *config_file = NULL, *data_dir = NULL;
+    double prob = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    while ((c = getopt(argc, argv, "hf:d:p:t:")) != -1) {
+        switch (c) {
+            case 'f': config_file = optarg; break;
+            case 'd': data_dir = optarg; break;
+            case 'p': prob = strtod(optarg, NULL); break;
+            case 't': threads = strtol(optarg, NULL, 10); break;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || threads < 1 || prob < 0 || prob >= 1) {
+        show_usage(argv[0]);
+        return 1;
+    }
+    char *name = argv[optind];
+    char *key_file = argv[optind + 1];
+
+    // Only log the errors
+    openlog("bloomd-build", LOG_PERROR, LOG_LOCAL0);
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    regex_t valid_name;
+    regcomp(&valid_name, VALID_NAME_PATTERN, REG_EXTENDED|REG_NOSUB);
+    int bad_name = regexec(&valid_name, name, 0, NULL, 0);
+    regfree(&valid_name);
+    if (bad_name || strchr(name, '/')) {
+        fprintf(stderr, "Bad filter name %s!\n", name);
+        return 1;
+    }
+
+    bloom_config config;
+    if (config_from_filename(config_file, &config)) {
+        fprintf(stderr, "Failed to read the configuration file!\n");
+        return 1;
+    }
+    if (data_dir) config.data_dir = data_dir;
+    if (prob) config.default_probability = prob;
+    config.in_memory = 0;
+    if (validate_config(&config)) {
+        fprintf(stderr, "Invalid configuration!\n");
+        return 1;
+    }
+
+    // Map the key file
+    build_run run;
+    memset(&run, 0, sizeof(run));
+    int fd = open(key_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Failed to open the key file %s! %s\n", key_file, strerror(errno));
+        return 1;
+    }
+    run.size = st.st_size;
+    if (run.size) {
+        run.data = mmap(NULL, run.size, PROT_READ, MAP_SHARED, fd, 0);
+        if (run.data == MAP_FAILED) {
+            fprintf(stderr, "Failed to map the key file %s! %s\n", key_file, strerror(errno));
+            return 1;
+        }
+        madvise(run.data, run.size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // The lines of the key file are the capacity, so the filter
+    // is one layer. Duplicate keys only leave it less full.
+    struct timespec begin, counted, done;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (run_threads(&run, threads, count_keys_main)) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &counted);
+    config.initial_capacity = (run.keys) ? run.keys : 1;
+
+    // Refuse to write over an existing filter
+    if (mkdir(config.data_dir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Failed to make the data dir %s! %s\n", config.data_dir, strerror(errno));
+        return 1;
+    }
+    char *folder = NULL;
+    if (asprintf(&folder, "%s/bloomd.%s", config.data_dir, name) == -1) return 1;
+    if (!stat(folder, &st)) {
+        fprintf(stderr, "The filter %s already exists in %s!\n", name, config.data_dir);
+        return 1;
+    }
+
+    if (init_bloom_filter(&config, name, 1, &run.filter)) {
+        fprintf(stderr, "Failed to create the filter %s!\n", name);
+        return 1;
+    }
+    pthread_rwlock_init(&run.rwlock, NULL);
+    int res = run_threads(&run, threads, set_keys_main);
+    if (!res && run.failed) {
+        fprintf(stderr, "Failed to set the keys of the filter %s!\n", name);
+        res = -1;
+    }
+    if (!res && (bloomf_flush(run.filter) || bloomf_close(run.filter))) {
+        fprintf(stderr, "Failed to write the filter %s!\n", name);
+        res = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+
+    if (!res) {
+        fprintf(stderr, "Built %s from %llu keys, %llu added, with %ld threads in %.2fs (counting %.2fs).\n",
+                folder, (unsigned long long)run.keys, (unsigned long long)run.added, threads,
+                (done.tv_sec - begin.tv_sec) + (done.tv_nsec - begin.tv_nsec) / 1e9,
+                (counted.tv_sec - begin.tv_sec) + (counted.tv_nsec - begin.tv_nsec) / 1e9);
+    } else {
+        // Do not leave a partial filter for a server to find
+        bloomf_delete(run.filter);
+    }
+    destroy_bloom_filter(run.filter);
+    pthread_rwlock_destroy(&run.rwlock);
+    if (run.size) munmap(run.data, run.size);
+    free(folder);
+    return (res) ? 1 : 0;
+}
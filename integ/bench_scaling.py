@@ -0,0 +1,231 @@
+"""
+Scalability benchmarks of bloomd.
+
+Starts a bloomd for each combination of worker threads, filter
+count, filter capacity and storage mode, drives it with ./bench,
+and records the throughput and latency percentiles of each run.
+The results are printed as a table and written as CSV, and are
+plotted as throughput and p99 latency against the worker threads,
+with a curve for each filter count and mode, if matplotlib is
+installed. Comparing the curves of two builds shows regressions
+in the filter manager, the lock paths or the networking. Each
+filter is created at the given capacity, so the largest filter
+counts need the memory or disk of all of them.
+
+Run from the top of the repository, after building bloomd and
+bench with scons:
+
+    python integ/bench_scaling.py --workers 1,2,4 --filters 10,1000 \\
+        --csv scaling.csv --plot scaling.png
+"""
+from __future__ import print_function
+
+import argparse
+import csv
+import os
+import os.path
+import random
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Settings of each storage mode
+MODES = {
+    "default": "",
+    "mmap": "use_mmap = 1\n",
+    "in_memory": "in_memory = 1\n",
+}
+
+FIELDS = ["workers", "filters", "capacity", "mode", "requests_per_sec",
+          "check_p50", "check_p99", "check_p999", "set_p50", "set_p99",
+          "set_p999", "errors"]
+
+
+def int_list(value):
+    return [int(v) for v in value.split(",")]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Scalability benchmarks of bloomd")
+    parser.add_argument("--bloomd", default="./bloomd", help="bloomd binary")
+    parser.add_argument("--bench", default="./bench", help="bench binary")
+    parser.add_argument("--workers", type=int_list, default=[1, 2, 4, 8],
+                        help="worker_threads values, comma separated")
+    parser.add_argument("--filters", type=int_list, default=[10, 1000, 100000],
+                        help="filter counts, comma separated")
+    parser.add_argument("--capacity", type=int_list, default=[20000],
+                        help="filter capacities, comma separated")
+    parser.add_argument("--modes", default="default,mmap,in_memory",
+                        help="storage modes, comma separated: " + ", ".join(sorted(MODES)))
+    parser.add_argument("--keys", type=int, default=1000000,
+                        help="keys loaded, at least one per filter")
+    parser.add_argument("--requests", type=int, default=500000, help="requests per run")
+    parser.add_argument("--threads", type=int, default=4, help="bench threads")
+    parser.add_argument("--conns", type=int, default=8, help="connections per bench thread")
+    parser.add_argument("--depth", type=int, default=16, help="requests in flight per connection")
+    parser.add_argument("--batch", type=int, default=1, help="keys per request")
+    parser.add_argument("--read-percent", type=int, default=90, help="percent of checks")
+    parser.add_argument("--dist", default="uniform", help="key distribution, uniform or zipf")
+    parser.add_argument("--csv", help="file the results are written to")
+    parser.add_argument("--plot", help="image the curves are plotted to")
+    args = parser.parse_args()
+
+    args.modes = args.modes.split(",")
+    for mode in args.modes:
+        if mode not in MODES:
+            parser.error("unknown mode %s" % mode)
+    return args
+
+
+def start_server(bloomd, workers, mode):
+    "Starts a bloomd on a random port, returns the process, port and data dir"
+    tmpdir = tempfile.mkdtemp()
+    port = random.randint(2000, 60000)
+    config_path = os.path.join(tmpdir, "config.cfg")
+    conf = """[bloomd]
+data_dir = %(dir)s
+tcp_port = %(port)d
+udp_port = %(udp)d
+worker_threads = %(workers)d
+log_level = WARN
+%(mode)s""" % {"dir": tmpdir, "port": port, "udp": port + 1,
+               "workers": workers, "mode": MODES[mode]}
+    with open(config_path, "w") as fh:
+        fh.write(conf)
+
+    proc = subprocess.Popen([bloomd, "-f", config_path])
+    for _ in range(50):
+        try:
+            conn = socket.create_connection(("127.0.0.1", port), 1)
+            conn.close()
+            return proc, port, tmpdir
+        except socket.error:
+            if proc.poll() is not None:
+                break
+            time.sleep(0.1)
+    stop_server(proc, tmpdir)
+    raise EnvironmentError("Failed to start bloomd!")
+
+
+def stop_server(proc, tmpdir):
+    "Kills the server without flushing, and removes its data"
+    if proc.poll() is None:
+        proc.kill()
+        proc.wait()
+    shutil.rmtree(tmpdir, ignore_errors=True)
+
+
+def parse_bench(output):
+    "Returns the results of a bench run"
+    result = {"requests_per_sec": 0, "errors": 0}
+    m = re.search(r"^run: .* requests/sec (\d+)", output, re.M)
+    if m:
+        result["requests_per_sec"] = int(m.group(1))
+    for op in ("check", "set"):
+        m = re.search(r"^%s latency usec: p50 ([\d.]+) p90 [\d.]+ p99 ([\d.]+) p999 ([\d.]+)" % op,
+                      output, re.M)
+        if m:
+            result[op + "_p50"] = float(m.group(1))
+            result[op + "_p99"] = float(m.group(2))
+            result[op + "_p999"] = float(m.group(3))
+    m = re.search(r"^errors: (\d+)", output, re.M)
+    if m:
+        result["errors"] = int(m.group(1))
+    return result
+
+
+def run_one(args, workers, filters, capacity, mode):
+    "Benchmarks one configuration"
+    proc, port, tmpdir = start_server(args.bloomd, workers, mode)
+    try:
+        cmd = [args.bench, "-p", str(port), "-t", str(args.threads),
+               "-c", str(args.conns), "-d", str(args.depth), "-b", str(args.batch),
+               "-k", str(max(args.keys, filters)), "-n", str(args.requests),
+               "-r", str(args.read_percent), "-D", args.dist,
+               "-F", str(filters), "-C", str(capacity)]
+        bench = subprocess.Popen(cmd, stdout=subprocess.PIPE, universal_newlines=True)
+        output = bench.communicate()[0]
+    finally:
+        stop_server(proc, tmpdir)
+
+    result = parse_bench(output)
+    result.update({"workers": workers, "filters": filters,
+                   "capacity": capacity, "mode": mode})
+    if bench.returncode:
+        result["errors"] = max(result["errors"], 1)
+    return result
+
+
+def print_table(results):
+    print("%8s %8s %10s %10s %12s %10s %10s %10s" % (
+        "workers", "filters", "capacity", "mode", "req/sec", "check p99", "set p99", "errors"))
+    for r in results:
+        print("%8d %8d %10d %10s %12d %10.1f %10.1f %10d" % (
+            r["workers"], r["filters"], r["capacity"], r["mode"], r["requests_per_sec"],
+            r.get("check_p99", 0), r.get("set_p99", 0), r["errors"]))
+
+
+def write_csv(path, results):
+    with open(path, "w") as fh:
+        writer = csv.DictWriter(fh, FIELDS)
+        writer.writeheader()
+        for r in results:
+            writer.writerow(dict((f, r.get(f, "")) for f in FIELDS))
+
+
+def plot(path, results):
+    "Plots throughput and check p99 against the workers"
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print("matplotlib is not installed, skipping the plot", file=sys.stderr)
+        return
+
+    fig, (tput, lat) = plt.subplots(1, 2, figsize=(12, 5))
+    curves = {}
+    for r in results:
+        key = (r["filters"], r["capacity"], r["mode"])
+        curves.setdefault(key, []).append(r)
+    for (filters, capacity, mode), runs in sorted(curves.items()):
+        runs.sort(key=lambda r: r["workers"])
+        label = "%d filters x %d %s" % (filters, capacity, mode)
+        workers = [r["workers"] for r in runs]
+        tput.plot(workers, [r["requests_per_sec"] for r in runs], marker="o", label=label)
+        lat.plot(workers, [r.get("check_p99", 0) for r in runs], marker="o", label=label)
+    tput.set_xlabel("worker threads")
+    tput.set_ylabel("requests/sec")
+    lat.set_xlabel("worker threads")
+    lat.set_ylabel("check p99 usec")
+    tput.legend(fontsize="small")
+    fig.tight_layout()
+    fig.savefig(path)
+
+
+def main():
+    args = parse_args()
+    results = []
+    for filters in args.filters:
+        for capacity in args.capacity:
+            for mode in args.modes:
+                for workers in args.workers:
+                    r = run_one(args, workers, filters, capacity, mode)
+                    print("workers %d filters %d capacity %d mode %s: %d requests/sec" % (
+                        workers, filters, capacity, mode, r["requests_per_sec"]))
+                    results.append(r)
+
+    print_table(results)
+    if args.csv:
+        write_csv(args.csv, results)
+    if args.plot:
+        plot(args.plot, results)
+    return 1 if any(r["errors"] for r in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -450,6 +450,219 @@ class TestInteg(object):
         assert "test:create:filter:with:long:prefix:1" in fh.readline()
         assert "test:create:filter:with:long:prefix:2" in fh.readline()
         assert fh.readline() == "END\n"
+    def test_create_drop_multi(self, servers):
+        "Tests creating and dropping several filters at once"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create_multi multi1 multi2 multi1 in_memory=1\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "multi1 Done\n"
+        assert fh.readline() == "multi2 Done\n"
+        assert fh.readline() == "multi1 Exists\n"
+        assert fh.readline() == "END\n"
+
+        server.sendall("drop_multi multi1 missing\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "multi1 Done\n"
+        assert fh.readline() == "missing Filter does not exist\n"
+        assert fh.readline() == "END\n"
+
+        server.sendall("drop_prefix multi\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "multi2 Done\n"
+        assert fh.readline() == "END\n"
+
+        server.sendall("list multi\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "END\n"
+
+    def test_rotating_filter(self, servers):
+        "Tests that a rotating filter forgets keys once they expire"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create rotating window=2 generations=2\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("s rotating foo\n")
+        assert fh.readline() == "Yes\n"
+
+        # Still seen in the previous generation
+        time.sleep(1.5)
+        server.sendall("s rotating foo\n")
+        assert fh.readline() == "No\n"
+
+        # Expired once both generations holding it are gone
+        time.sleep(8)
+        server.sendall("c rotating foo\n")
+        assert fh.readline() == "No\n"
+
+        server.sendall("snapshot rotating\n")
+        assert fh.readline() == "Filter is rotating\n"
+
+    def test_counting_delete(self, servers):
+        "Tests deleting keys from a counting filter"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create counting layout=counting\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b counting foo bar\n")
+        assert fh.readline() == "Yes Yes\n"
+        server.sendall("delete counting foo baz\n")
+        assert fh.readline() == "Yes No\n"
+        server.sendall("m counting foo bar\n")
+        assert fh.readline() == "No Yes\n"
+
+        server.sendall("create plain\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("d plain foo\n")
+        assert fh.readline() == "Filter does not support deletes\n"
+
+    def test_freeze(self, servers):
+        "Tests freezing a freezable filter"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create frozen freezable=1\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b frozen foo bar\n")
+        assert fh.readline() == "Yes Yes\n"
+        server.sendall("freeze frozen\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("m frozen foo bar baz\n")
+        assert fh.readline() == "Yes Yes No\n"
+        server.sendall("s frozen baz\n")
+        assert fh.readline() == "Filter is frozen\n"
+        server.sendall("freeze frozen\n")
+        assert fh.readline() == "Filter is frozen\n"
+
+        server.sendall("create unfrozen\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("freeze unfrozen\n")
+        assert fh.readline() == "Filter is not freezable\n"
+
+    def test_compact(self, servers):
+        "Tests compacting the layers of a freezable filter"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create compacted capacity=20000 freezable=1\n")
+        assert fh.readline() == "Done\n"
+        keys = ["key%d" % i for i in xrange(40000)]
+        server.sendall("b compacted %s\n" % " ".join(keys))
+        assert fh.readline().count("Yes") > 39990
+        server.sendall("compact compacted\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("m compacted %s\n" % " ".join(keys))
+        assert fh.readline() == " ".join(["Yes"] * 40000) + "\n"
+        server.sendall("s compacted newkey\n")
+        assert fh.readline() == "Yes\n"
+
+        server.sendall("create uncompacted\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("compact uncompacted\n")
+        assert fh.readline() == "Filter is not freezable\n"
+        server.sendall("compact nope\n")
+        assert fh.readline() == "Filter does not exist\n"
+
+    def test_summary(self, servers):
+        "Tests a filter with a summary"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create summarized summary=1000\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+        server.sendall("create summarized summary=100000\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b summarized foo bar\n")
+        assert fh.readline() == "Yes Yes\n"
+        server.sendall("m summarized foo bar baz\n")
+        assert fh.readline() == "Yes Yes No\n"
+        server.sendall("info summarized\n")
+        lines = []
+        line = fh.readline()
+        while line != "END\n":
+            lines.append(line)
+            line = fh.readline()
+        assert "summary 100000\n" in lines
+
+    def test_sharded(self, servers):
+        "Tests a filter with key shards"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create sharded shards=4 window=60\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+        server.sendall("create sharded shards=4 capacity=40000\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b sharded foo bar baz\n")
+        assert fh.readline() == "Yes Yes Yes\n"
+        server.sendall("m sharded foo bar baz zab\n")
+        assert fh.readline() == "Yes Yes Yes No\n"
+        server.sendall("info sharded\n")
+        lines = []
+        line = fh.readline()
+        while line != "END\n":
+            lines.append(line)
+            line = fh.readline()
+        assert "shards 4\n" in lines
+        assert "size 3\n" in lines
+        assert "capacity 40000\n" in lines
+        server.sendall("snapshot sharded\n")
+        assert fh.readline() == "Filter is sharded\n"
+
+    def test_stats(self, servers):
+        "Tests the latency stats"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create timed\n")
+        assert fh.readline() == "Done\n"
+        for i in xrange(32):
+            server.sendall("c timed foo%d\n" % i)
+            assert fh.readline() == "No\n"
+        server.sendall("stats\n")
+        assert fh.readline() == "START\n"
+        lines = []
+        line = fh.readline()
+        while line != "END\n":
+            lines.append(line.split())
+            line = fh.readline()
+        stages = dict((l[1], l) for l in lines if l[0] == "check")
+        for stage in ("parse", "lookup", "lock", "op", "send", "total"):
+            assert stages[stage][2] == "samples"
+        assert int(stages["total"][3]) >= 1
+        server.sendall("info timed\n")
+        assert fh.readline() == "START\n"
+        info = {}
+        line = fh.readline()
+        while line != "END\n":
+            key, val = line.split()
+            info[key] = val
+            line = fh.readline()
+        for key in ("lock_waits", "lock_wait_usec", "fault_lock_waits",
+                    "fault_lock_wait_usec", "fault_usec"):
+            assert key in info
+        server.sendall("stats foo\n")
+        assert fh.readline() == "Client Error: Unexpected arguments\n"
+
+    def test_pipelined_checks(self, servers):
+        "Tests pipelined checks are answered in order"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create piped\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("s piped foo\n")
+        assert fh.readline() == "Yes\n"
+        cmds = ["c piped foo", "c piped bar", "c nopiped foo", "c piped foo",
+                "s piped bar", "c piped bar", "c piped"]
+        server.sendall("\n".join(cmds) + "\n")
+        assert fh.readline() == "Yes\n"
+        assert fh.readline() == "No\n"
+        assert fh.readline() == "Filter does not exist\n"
+        assert fh.readline() == "Yes\n"
+        assert fh.readline() == "Yes\n"
+        assert fh.readline() == "Yes\n"
+        assert fh.readline() == "Client Error: Must provide filter name and key\n"
+        keys = ["foo%d" % i for i in xrange(1000)]
+        server.sendall("b piped %s\n" % " ".join(keys))
+        assert fh.readline() == " ".join(["Yes"] * 1000) + "\n"
+        server.sendall("".join("c piped %s\n" % k for k in keys))
+        for i in xrange(1000):
+            assert fh.readline() == "Yes\n"
 
 if __name__ == "__main__":
     sys.exit(pytest.main(args="-k TestInteg."))
@@ -0,0 +1,532 @@
+/**
+ * Replays a command stream captured by bloomd with capture_file.
+ *
+ * The commands are sent at the pace they were captured at, or
+ * scaled by a speed multiplier, over one connection for each of
+ * the captured connections, so the pipelining and the mix of the
+ * clients is kept. The replay is open loop: a command is sent when
+ * it is due, whether or not the earlier ones were answered, and
+ * its latency is measured from when it was due, so a server that
+ * falls behind is not hidden by the replay slowing down with it.
+ *
+ * Keys captured with capture_keys = hash are sent as the hex of
+ * their hash, so the same keys are hit as in the capture. Keys
+ * captured without their contents are replaced by new keys. The
+ * export, import and migrate commands stream data over the
+ * connection, and are skipped.
+ *
+ * The latency of each command is recorded in a log linear
+ * histogram, and the percentiles are reported by opcode.
+ *
+ * Run with -? for the options.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+
+/**
+ * Histograms have 2^HIST_SUB_BITS buckets for each power
+ * of two, so values are recorded within 1% of their value.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+// Key modes of the capture, as bloom_capture_keys
+#define KEYS_NONE 0
+#define KEYS_HASH 1
+#define KEYS_RAW 2
+
+static char* HOST = "127.0.0.1";
+static int PORT = 8673;
+static double SPEED = 1.0;          // Multiplier of the captured pace, 0 for no pacing
+static int MAX_CONNS = 256;         // Captured connections are folded onto this many
+static char *CAPTURE_PATH = NULL;
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram;
+
+typedef struct {
+    uint64_t due;           // When the command was due, in usec
+    unsigned char opcode;
+} pending_cmd;
+
+typedef struct {
+    int fd;
+    char *out;              // Commands not yet sent
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    char *in;               // Partial response
+    size_t in_len;
+    size_t in_cap;
+    pending_cmd *pending;   // Ring of the outstanding commands
+    int head;
+    int outstanding;
+    int pending_cap;
+    int in_block;           // Reading a START to END response
+} replay_conn;
+
+static histogram HISTS[128];
+static uint64_t ERRORS = 0;
+static uint64_t SKIPPED = 0;
+static uint64_t NEW_KEYS = 0;
+
+static uint64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB_COUNT) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)((idx & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+    // Report the middle of the bucket
+    return base + ((1ULL << shift) >> 1);
+}
+
+static void hist_record(histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(histogram *into, histogram *h) {
+    for (int i=0; i < HIST_BUCKETS; i++) into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static uint64_t hist_percentile(histogram *h, double p) {
+    uint64_t rank = (uint64_t)ceil(p * h->total);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i=0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static int connect_fd(void) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(PF_INET, HOST, &addr.sin_addr);
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Reads the whole capture file.
+ * @return The contents, or NULL on error.
+ */
+static char *read_file(char *path, size_t *len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t cap = 1 << 20, pos = 0;
+    char *buf = malloc(cap);
+    size_t num;
+    while ((num = fread(buf + pos, 1, cap - pos, f)) > 0) {
+        pos += num;
+        if (pos == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    fclose(f);
+    *len = pos;
+    return buf;
+}
+
+static void append(replay_conn *c, const char *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        while (c->out_len + len > c->out_cap) c->out_cap *= 2;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/**
+ * Parses the record at the cursor, and queues it as a command
+ * on its connection, unless it is skipped.
+ * @return The length of the record, or 0 if it is truncated.
+ */
+static size_t queue_record(char *buf, size_t len, int key_mode, replay_conn *conns,
+        int num_conns, uint64_t due) {
+    capture_record rec;
+    if (len < sizeof(rec)) return 0;
+    memcpy(&rec, buf, sizeof(rec));
+    size_t key_size = (key_mode == KEYS_HASH) ? 8 : 0;
+    size_t need = sizeof(rec) + rec.name_len + rec.args_len + key_size * rec.num_keys;
+    if (need > len) return 0;
+
+    // Raw keys have their own lengths
+    char *keys = buf + sizeof(rec) + rec.name_len + rec.args_len;
+    if (key_mode == KEYS_RAW) {
+        char *p = keys;
+        for (uint32_t i=0; i < rec.num_keys; i++) {
+            uint16_t l;
+            if ((size_t)(p - buf) + sizeof(l) > len) return 0;
+            memcpy(&l, p, sizeof(l));
+            p += sizeof(l) + l;
+            if ((size_t)(p - buf) > len) return 0;
+        }
+        need = p - buf;
+    }
+
+    // Streaming commands can not be replayed
+    if (rec.opcode == 'Q' || rec.opcode == 'J' || rec.opcode == 'G' || rec.opcode >= 128) {
+        SKIPPED++;
+        return need;
+    }
+
+    replay_conn *c = conns + ((rec.conn_id - 1) % num_conns);
+    char cmd[2] = {rec.opcode, ' '};
+    append(c, cmd, (rec.name_len || rec.args_len) ? 2 : 1);
+    append(c, buf + sizeof(rec), rec.name_len);
+    if (rec.args_len) {
+        append(c, " ", 1);
+        append(c, buf + sizeof(rec) + rec.name_len, rec.args_len);
+    }
+
+    char *p = keys;
+    char key[32];
+    for (uint32_t i=0; i < rec.num_keys; i++) {
+        if (key_mode == KEYS_RAW) {
+            uint16_t l;
+            memcpy(&l, p, sizeof(l));
+            append(c, " ", 1);
+            append(c, p + sizeof(l), l);
+            p += sizeof(l) + l;
+        } else if (key_mode == KEYS_HASH) {
+            uint64_t h;
+            memcpy(&h, p, sizeof(h));
+            p += sizeof(h);
+            append(c, key, snprintf(key, sizeof(key), " k%016llx", (unsigned long long)h));
+        } else {
+            append(c, key, snprintf(key, sizeof(key), " n%llu", (unsigned long long)NEW_KEYS++));
+        }
+    }
+    append(c, "\n", 1);
+
+    if (c->outstanding == c->pending_cap) {
+        pending_cmd *ring = malloc(2 * c->pending_cap * sizeof(pending_cmd));
+        for (int i=0; i < c->outstanding; i++)
+            ring[i] = c->pending[(c->head + i) % c->pending_cap];
+        free(c->pending);
+        c->pending = ring;
+        c->head = 0;
+        c->pending_cap *= 2;
+    }
+    pending_cmd *slot = c->pending + (c->head + c->outstanding) % c->pending_cap;
+    slot->due = due;
+    slot->opcode = rec.opcode;
+    c->outstanding++;
+    return need;
+}
+
+/**
+ * Handles a line of the responses of a connection. Commands
+ * answer with a single line, or with a block from START to END.
+ */
+static void handle_line(replay_conn *c, char *line, uint64_t now) {
+    if (!c->outstanding) return;
+    if (c->in_block) {
+        if (strcmp(line, "END")) return;
+        c->in_block = 0;
+    } else if (!strcmp(line, "START")) {
+        c->in_block = 1;
+        return;
+    } else if (!strncmp(line, "Client Error", 12) || !strncmp(line, "Internal Error", 14)) {
+        ERRORS++;
+    }
+
+    pending_cmd *cmd = c->pending + c->head;
+    hist_record(&HISTS[cmd->opcode], (now > cmd->due) ? now - cmd->due : 0);
+    c->head = (c->head + 1) % c->pending_cap;
+    c->outstanding--;
+}
+
+/**
+ * Reads the responses available on a connection.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int read_responses(replay_conn *c) {
+    if (c->in_cap - c->in_len < 4096) {
+        c->in_cap *= 2;
+        c->in = realloc(c->in, c->in_cap);
+    }
+    ssize_t num = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len - 1, 0);
+    if (num == 0) return -1;
+    if (num < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->in_len += num;
+
+    uint64_t now = now_usec();
+    char *start = c->in;
+    char *end = c->in + c->in_len;
+    char *nl;
+    while (start < end && (nl = memchr(start, '\n', end - start))) {
+        *nl = 0;
+        handle_line(c, start, now);
+        start = nl + 1;
+    }
+    c->in_len = end - start;
+    memmove(c->in, start, c->in_len);
+    return 0;
+}
+
+/**
+ * Sends the records as they come due, until all
+ * of them are sent and have been answered.
+ * @return 0 on success, -1 if a connection failed.
+ */
+static int run_replay(char *buf, size_t len, int key_mode, replay_conn *conns, int num_conns,
+        uint64_t *commands) {
+    struct pollfd *fds = calloc(num_conns, sizeof(struct pollfd));
+    uint64_t start = now_usec(), offset = 0;
+    size_t pos = sizeof(capture_header);
+    int res = 0;
+    while (1) {
+        // Queue the records that are due
+        uint64_t now = now_usec(), wait = 0;
+        while (pos < len) {
+            capture_record rec;
+            if (len - pos < sizeof(rec)) {
+                pos = len;
+                break;
+            }
+            memcpy(&rec, buf + pos, sizeof(rec));
+            uint64_t next = offset + rec.delta_usec;
+            uint64_t due = start + ((SPEED > 0) ? (uint64_t)(next / SPEED) : 0);
+            if (due > now) {
+                wait = due - now;
+                break;
+            }
+            size_t used = queue_record(buf + pos, len - pos, key_mode, conns, num_conns, due);
+            if (!used) {
+                fprintf(stderr, "Capture is truncated, stopping the replay.\n");
+                pos = len;
+                break;
+            }
+            pos += used;
+            offset = next;
+            (*commands)++;
+        }
+
+        int active = 0;
+        for (int i=0; i < num_conns; i++) {
+            replay_conn *c = conns + i;
+            fds[i].fd = c->fd;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (c->outstanding) fds[i].events |= POLLIN;
+            if (c->out_sent < c->out_len) fds[i].events |= POLLOUT;
+            if (fds[i].events) active = 1;
+        }
+        if (!active && pos >= len) break;
+
+        struct timespec ts = {0, 100 * 1000000};
+        if (wait && wait < 100000) ts.tv_nsec = wait * 1000;
+        if (ppoll(fds, num_conns, &ts, NULL) < 0) {
+            if (errno == EINTR) continue;
+            res = -1;
+            break;
+        }
+
+        for (int i=0; i < num_conns && !res; i++) {
+            replay_conn *c = conns + i;
+            if (fds[i].revents & (POLLERR | POLLHUP)) res = -1;
+            if (fds[i].revents & POLLOUT) {
+                ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, 0);
+                if (sent < 0 && errno != EAGAIN && errno != EINTR) res = -1;
+                if (sent > 0) c->out_sent += sent;
+                if (c->out_sent == c->out_len) c->out_sent = c->out_len = 0;
+            }
+            if (fds[i].revents & POLLIN) {
+                if (read_responses(c)) res = -1;
+            }
+        }
+        if (res) break;
+    }
+    free(fds);
+    return res;
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [options] capture_file\n\
+    -h host       Server address. Default 127.0.0.1\n\
+    -p port       Server port. Default 8673\n\
+    -x speed      Multiplier of the captured pace, 0 to send as fast as possible. Default 1\n\
+    -c conns      Most connections, the captured ones are folded onto. Default 256\n", name);
+}
+
+static int parse_args(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:x:c:?")) != -1) {
+        switch (opt) {
+            case 'h': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 'x': SPEED = atof(optarg); break;
+            case 'c': MAX_CONNS = atoi(optarg); break;
+            default:
+                return -1;
+        }
+    }
+    if (optind != argc - 1 || SPEED < 0 || MAX_CONNS < 1) return -1;
+    CAPTURE_PATH = argv[optind];
+    return 0;
+}
+
+/**
+ * Finds the highest connection id of the capture,
+ * so that there is a connection for each.
+ */
+static uint32_t max_conn_id(char *buf, size_t len, int key_mode) {
+    uint32_t max = 0;
+    size_t pos = sizeof(capture_header);
+    while (len - pos >= sizeof(capture_record)) {
+        capture_record rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        if (rec.conn_id > max) max = rec.conn_id;
+        size_t size = sizeof(rec) + rec.name_len + rec.args_len;
+        if (key_mode == KEYS_HASH) {
+            size += 8 * (size_t)rec.num_keys;
+        } else if (key_mode == KEYS_RAW) {
+            for (uint32_t i=0; i < rec.num_keys && pos + size + 2 <= len; i++) {
+                uint16_t l;
+                memcpy(&l, buf + pos + size, sizeof(l));
+                size += sizeof(l) + l;
+            }
+        }
+        if (size > len - pos) break;
+        pos += size;
+    }
+    return max;
+}
+
+static void report(uint64_t commands, uint64_t usec) {
+    histogram *all = calloc(1, sizeof(histogram));
+    for (int op=0; op < 128; op++) {
+        histogram *h = HISTS + op;
+        if (!h->total) continue;
+        hist_merge(all, h);
+        printf("%c latency usec: commands %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+                op, (unsigned long long)h->total,
+                (unsigned long long)hist_percentile(h, 0.5),
+                (unsigned long long)hist_percentile(h, 0.9),
+                (unsigned long long)hist_percentile(h, 0.99),
+                (unsigned long long)hist_percentile(h, 0.999),
+                (unsigned long long)h->max);
+    }
+    if (all->total) {
+        printf("all latency usec: commands %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+                (unsigned long long)all->total,
+                (unsigned long long)hist_percentile(all, 0.5),
+                (unsigned long long)hist_percentile(all, 0.9),
+                (unsigned long long)hist_percentile(all, 0.99),
+                (unsigned long long)hist_percentile(all, 0.999),
+                (unsigned long long)all->max);
+    }
+    printf("replay: commands %llu msec %llu commands/sec %.0f speed %g skipped %llu errors %llu\n",
+            (unsigned long long)commands, (unsigned long long)(usec / 1000),
+            usec ? commands * 1e6 / usec : 0.0, SPEED,
+            (unsigned long long)SKIPPED, (unsigned long long)ERRORS);
+    free(all);
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    char *buf = read_file(CAPTURE_PATH, &len);
+    capture_header header;
+    if (!buf || len < sizeof(header)) {
+        fprintf(stderr, "Failed to read the capture %s!\n", CAPTURE_PATH);
+        return 1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION ||
+            header.key_mode > KEYS_RAW) {
+        fprintf(stderr, "%s is not a bloomd capture!\n", CAPTURE_PATH);
+        return 1;
+    }
+
+    // Captured connections map onto the replay connections by id
+    uint32_t max_id = max_conn_id(buf, len, header.key_mode);
+    int num_conns = (max_id < (uint32_t)MAX_CONNS) ? (int)max_id : MAX_CONNS;
+    if (num_conns < 1) num_conns = 1;
+    replay_conn *conns = calloc(num_conns, sizeof(replay_conn));
+    for (int i=0; i < num_conns; i++) {
+        replay_conn *c = conns + i;
+        c->fd = connect_fd();
+        if (c->fd < 0) {
+            fprintf(stderr, "Failed to connect to %s:%d!\n", HOST, PORT);
+            return 1;
+        }
+        c->out_cap = 4096;
+        c->out = malloc(c->out_cap);
+        c->in_cap = 8192;
+        c->in = malloc(c->in_cap);
+        c->pending_cap = 64;
+        c->pending = calloc(c->pending_cap, sizeof(pending_cmd));
+    }
+
+    uint64_t commands = 0;
+    uint64_t start = now_usec();
+    int res = run_replay(buf, len, header.key_mode, conns, num_conns, &commands);
+    uint64_t usec = now_usec() - start;
+    if (res) fprintf(stderr, "Lost a connection to the server!\n");
+    report(commands, usec);
+
+    for (int i=0; i < num_conns; i++) {
+        replay_conn *c = conns + i;
+        close(c->fd);
+        free(c->out);
+        free(c->in);
+        free(c->pending);
+    }
+    free(conns);
+    free(buf);
+    return (res || ERRORS) ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "arena.h"
+
+/**
+ * Allocations are rounded up to this alignment,
+ * which is the alignment of the data of a chunk
+ */
+#define ARENA_ALIGN 16
+
+/**
+ * Chunks larger than this are not kept across resets,
+ * so a single huge batch does not pin its memory
+ */
+#define ARENA_MAX_KEEP (4 * 1024 * 1024)
+
+/* Static declarations */
+static bloom_arena_chunk* alloc_chunk(size_t size, bloom_arena_chunk *next);
+
+/**
+ * Creates an arena.
+ * @arg chunk_size The size of the first chunk, and
+ * the smallest chunk allocated after it
+ * @arg arena Output, the new arena
+ * @return 0 on success, -1 if out of memory.
+ */
+int init_arena(size_t chunk_size, bloom_arena **arena) {
+    bloom_arena *a = malloc(sizeof(bloom_arena));
+    if (!a) return -1;
+
+    // Chunks hold a whole number of aligned allocations
+    a->chunk_size = (chunk_size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+    a->head = alloc_chunk(a->chunk_size, NULL);
+    if (!a->head) {
+        free(a);
+        return -1;
+    }
+    *arena = a;
+    return 0;
+}
+
+/**
+ * Destroys an arena, freeing everything allocated from it.
+ * @arg arena The arena
+ */
+void destroy_arena(bloom_arena *arena) {
+    bloom_arena_chunk *chunk = arena->head;
+    while (chunk) {
+        bloom_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/**
+ * Allocates from an arena. The memory is aligned for any
+ * type, and is valid until the arena is reset.
+ * @arg arena The arena
+ * @arg size The number of bytes
+ * @return The memory, or NULL if out of memory.
+ */
+void* arena_alloc(bloom_arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+    bloom_arena_chunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = (size > arena->chunk_size) ? size : arena->chunk_size;
+        chunk = alloc_chunk(chunk_size, arena->head);
+        if (!chunk) return NULL;
+        arena->head = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/**
+ * Formats a string into memory allocated from an arena.
+ * @arg arena The arena
+ * @arg len Optional output, the length of the string
+ * @arg fmt The format, as with printf
+ * @return The string, or NULL if out of memory.
+ */
+char* arena_sprintf(bloom_arena *arena, int *len, const char *fmt, ...) {
+    // Format into the rest of the chunk, and only
+    // format again if the string did not fit
+    bloom_arena_chunk *chunk = arena->head;
+    size_t avail = (chunk) ? chunk->size - chunk->used : 0;
+    va_list args;
+    va_start(args, fmt);
+    int res = vsnprintf((chunk) ? chunk->data + chunk->used : NULL, avail, fmt, args);
+    va_end(args);
+    if (res < 0) return NULL;
+
+    // The string is allocated where it was formatted if it fit,
+    // since chunks end on the alignment the size is rounded to
+    int fit = (size_t)res < avail;
+    char *buf = arena_alloc(arena, res + 1);
+    if (!buf) return NULL;
+    if (!fit) {
+        va_start(args, fmt);
+        vsnprintf(buf, res + 1, fmt, args);
+        va_end(args);
+    }
+    if (len) *len = res;
+    return buf;
+}
+
+/**
+ * Resets an arena, releasing everything allocated from it.
+ * Only the largest chunk is kept, up to a limit.
+ * @arg arena The arena
+ */
+void arena_reset(bloom_arena *arena) {
+    bloom_arena_chunk *keep = NULL;
+    bloom_arena_chunk *chunk = arena->head;
+    while (chunk) {
+        bloom_arena_chunk *next = chunk->next;
+        if (chunk->size <= ARENA_MAX_KEEP && (!keep || chunk->size > keep->size)) {
+            if (keep) free(keep);
+            keep = chunk;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    // Always keep a chunk, allocations assume there is one
+    if (!keep) keep = alloc_chunk(arena->chunk_size, NULL);
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena->head = keep;
+}
+
+/**
+ * Allocates a chunk
+ * @arg size The usable size of the chunk
+ * @arg next The chunk before it
+ * @return The chunk, or NULL if out of memory.
+ */
+static bloom_arena_chunk* alloc_chunk(size_t size, bloom_arena_chunk *next) {
+    bloom_arena_chunk *chunk = malloc(sizeof(bloom_arena_chunk) + size);
+    if (!chunk) return NULL;
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
@@ -0,0 +1,69 @@
+#ifndef BLOOM_ARENA_H
+#define BLOOM_ARENA_H
+#include <stddef.h>
+
+/*
+ * An arena is a bump allocator for the transient allocations
+ * made while handling commands, such as copies of wrapped
+ * command lines, parsed options and response lines. Each
+ * worker owns an arena, which is reset once a batch of
+ * commands is handled, so nothing allocated from it is freed
+ * on its own. Allocations that do not fit the current chunk
+ * start a new one, and the largest chunk is kept across resets,
+ * so a worker settles on a chunk that fits its batches and
+ * stops calling malloc on the command path.
+ */
+typedef struct bloom_arena_chunk {
+    struct bloom_arena_chunk *next; // The previous chunk
+    size_t size;                    // Usable bytes of the chunk
+    size_t used;                    // Bytes allocated from the chunk
+    char data[] __attribute__ ((aligned (16)));
+} bloom_arena_chunk;
+
+typedef struct {
+    bloom_arena_chunk *head;    // The chunk allocations are made from, or NULL
+    size_t chunk_size;          // The smallest chunk to allocate
+} bloom_arena;
+
+/**
+ * Creates an arena.
+ * @arg chunk_size The size of the first chunk, and
+ * the smallest chunk allocated after it
+ * @arg arena Output, the new arena
+ * @return 0 on success, -1 if out of memory.
+ */
+int init_arena(size_t chunk_size, bloom_arena **arena);
+
+/**
+ * Destroys an arena, freeing everything allocated from it.
+ * @arg arena The arena
+ */
+void destroy_arena(bloom_arena *arena);
+
+/**
+ * Allocates from an arena. The memory is aligned for any
+ * type, and is valid until the arena is reset.
+ * @arg arena The arena
+ * @arg size The number of bytes
+ * @return The memory, or NULL if out of memory.
+ */
+void* arena_alloc(bloom_arena *arena, size_t size);
+
+/**
+ * Formats a string into memory allocated from an arena.
+ * @arg arena The arena
+ * @arg len Optional output, the length of the string
+ * @arg fmt The format, as with printf
+ * @return The string, or NULL if out of memory.
+ */
+char* arena_sprintf(bloom_arena *arena, int *len, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+/**
+ * Resets an arena, releasing everything allocated from it.
+ * Only the largest chunk is kept, up to a limit.
+ * @arg arena The arena
+ */
+void arena_reset(bloom_arena *arena);
+
+#endif
@@ -5,12 +5,12 @@
 #include <assert.h>
 #include "art.h"
 
-#ifdef __i386__
-#include <emmintrin.h>
-#else
-#ifdef __amd64__
+#if defined(__x86_64__) || defined(__i386__)
 #include <emmintrin.h>
-#endif
+#define ART_HAVE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ART_HAVE_NEON
 #endif
 
 /**
@@ -21,31 +21,107 @@
 #define LEAF_RAW(x) ((void*)((uintptr_t)x & ~1))
 
 /**
- * Allocates a node of the given type,
+ * Size of each node type, indexed by type - 1
+ */
+static const size_t NODE_SIZES[4] = {
+    sizeof(art_node4),
+    sizeof(art_node16),
+    sizeof(art_node48),
+    sizeof(art_node256)
+};
+
+/**
+ * Allocates a node of the given type from the arena,
  * initializes to zero and sets the type.
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
-    switch (type) {
-        case NODE4:
-            n = calloc(1, sizeof(art_node4));
-            break;
-        case NODE16:
-            n = calloc(1, sizeof(art_node16));
-            break;
-        case NODE48:
-            n = calloc(1, sizeof(art_node48));
-            break;
-        case NODE256:
-            n = calloc(1, sizeof(art_node256));
-            break;
-        default:
-            abort();
+static art_node* alloc_node(art_arena *a, uint8_t type) {
+    if (type < NODE4 || type > NODE256) abort();
+    int class = type - 1;
+    size_t size = NODE_SIZES[class];
+
+    // Reuse a freed node if we can
+    art_node *n = a->free_nodes[class];
+    if (n) {
+        a->free_nodes[class] = *(void**)n;
+    } else {
+        // Start a new slab if the current one is full
+        if (!a->next[class] || (size_t)(a->end[class] - a->next[class]) < size) {
+            art_slab *slab = malloc(ART_SLAB_SIZE);
+            if (!slab) abort();
+            slab->next = a->slabs;
+            a->slabs = slab;
+            a->next[class] = (unsigned char*)slab + sizeof(art_slab);
+            a->end[class] = (unsigned char*)slab + ART_SLAB_SIZE;
+        }
+        n = (art_node*)a->next[class];
+        a->next[class] += size;
     }
+    memset(n, 0, size);
     n->type = type;
     return n;
 }
 
+/**
+ * Returns a node to the free list of the arena.
+ */
+static void free_node(art_arena *a, art_node *n) {
+    int class = n->type - 1;
+    *(void**)n = a->free_nodes[class];
+    a->free_nodes[class] = n;
+}
+
+/**
+ * The state of a copy-on-write update. Each inner node on
+ * the path is copied before it is changed, and the nodes
+ * and leaves it replaces are retired with the epoch.
+ */
+typedef struct {
+    art_tree *t;
+    uint64_t epoch;
+} art_cow;
+
+/**
+ * Retires a node or a tagged leaf that is no longer
+ * reachable from the new root.
+ */
+static void retire(art_cow *cow, art_node *n) {
+    art_garbage *g = malloc(sizeof(art_garbage));
+    if (!g) abort();
+    g->epoch = cow->epoch;
+    g->node = n;
+    g->next = cow->t->garbage;
+    cow->t->garbage = g;
+}
+
+/**
+ * Copies an inner node that is about to be changed
+ * and retires the original.
+ * @return The copy, which is not yet visible to readers.
+ */
+static art_node* cow_node(art_cow *cow, art_node *n) {
+    art_node *copy = alloc_node(&cow->t->arena, n->type);
+    memcpy(copy, n, NODE_SIZES[n->type - 1]);
+    retire(cow, n);
+    return copy;
+}
+
+/**
+ * Frees a retired node or tagged leaf
+ */
+static void free_garbage(art_tree *t, art_garbage *g) {
+    while (g) {
+        art_garbage *next = g->next;
+        if (IS_LEAF(g->node)) {
+            art_leaf *l = LEAF_RAW(g->node);
+            if (!__sync_sub_and_fetch(&l->ref_count, 1))
+                free(l);
+        } else
+            free_node(&t->arena, g->node);
+        free(g);
+        g = next;
+    }
+}
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
@@ -53,10 +129,13 @@ static art_node* alloc_node(uint8_t type) {
 int init_art_tree(art_tree *t) {
     t->root = NULL;
     t->size = 0;
+    t->garbage = NULL;
+    memset(&t->arena, 0, sizeof(art_arena));
     return 0;
 }
 
-// Recursively destroys the tree
+// Recursively releases the leaves of the tree,
+// the nodes are freed with the arena
 static void destroy_node(art_node *n) {
     // Break if null
     if (!n) return;
@@ -95,8 +174,9 @@ static void destroy_node(art_node *n) {
             break;
 
         case NODE48:
+            // Removals leave holes in the children
             p.p3 = (art_node48*)n;
-            for (i=0;i<n->num_children;i++) {
+            for (i=0;i<48;i++) {
                 destroy_node(p.p3->children[i]);
             }
             break;
@@ -112,9 +192,6 @@ static void destroy_node(art_node *n) {
         default:
             abort();
     }
-
-    // Free ourself on the way up
-    free(n);
 }
 
 /**
@@ -123,6 +200,19 @@ static void destroy_node(art_node *n) {
  */
 int destroy_art_tree(art_tree *t) {
     destroy_node(t->root);
+    free_garbage(t, t->garbage);
+    t->garbage = NULL;
+
+    // Release all the nodes at once
+    art_slab *slab = t->arena.slabs;
+    while (slab) {
+        art_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(&t->arena, 0, sizeof(art_arena));
+    t->root = NULL;
+    t->size = 0;
     return 0;
 }
 
@@ -131,8 +221,68 @@ int destroy_art_tree(art_tree *t) {
  */
 extern inline uint64_t art_size(art_tree *t);
 
+#ifdef ART_HAVE_NEON
+/**
+ * Packs the result of a NEON byte compare into a bitfield,
+ * NEON lacks a movemask so the lanes are weighted and summed.
+ */
+static inline unsigned neon_movemask(uint8x16_t cmp) {
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                        1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(cmp, vld1q_u8(weights));
+    return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
+}
+#endif
+
+/**
+ * Compares a key to all 16 keys of a node16.
+ * @return A bitfield with a bit set for each equal key.
+ * Bits past the number of children must be masked off.
+ */
+static inline unsigned node16_eq_mask(const unsigned char *keys, unsigned char c) {
+#if defined(ART_HAVE_SSE2)
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
+            _mm_loadu_si128((const __m128i*)keys));
+    return _mm_movemask_epi8(cmp);
+#elif defined(ART_HAVE_NEON)
+    return neon_movemask(vceqq_u8(vdupq_n_u8(c), vld1q_u8(keys)));
+#else
+    unsigned bitfield = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (keys[i] == c)
+            bitfield |= (1 << i);
+    }
+    return bitfield;
+#endif
+}
+
+/**
+ * Compares a key to all 16 keys of a node16, as unsigned bytes.
+ * @return A bitfield with a bit set for each key greater than c.
+ * Bits past the number of children must be masked off.
+ */
+static inline unsigned node16_lt_mask(const unsigned char *keys, unsigned char c) {
+#if defined(ART_HAVE_SSE2)
+    // SSE2 only has a signed compare, flip the sign bits
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i cmp = _mm_cmplt_epi8(_mm_xor_si128(_mm_set1_epi8(c), bias),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*)keys), bias));
+    return _mm_movemask_epi8(cmp);
+#elif defined(ART_HAVE_NEON)
+    return neon_movemask(vcltq_u8(vdupq_n_u8(c), vld1q_u8(keys)));
+#else
+    unsigned bitfield = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (c < keys[i])
+            bitfield |= (1 << i);
+    }
+    return bitfield;
+#endif
+}
+
 static art_node** find_child(art_node *n, unsigned char c) {
-    int i, mask, bitfield;
+    int i;
+    unsigned mask, bitfield;
     union {
         art_node4 *p1;
         art_node16 *p2;
@@ -148,42 +298,13 @@ static art_node** find_child(art_node *n, unsigned char c) {
             }
             break;
 
-        {
         case NODE16:
             p.p2 = (art_node16*)n;
 
-            // support non-86 architectures
-            #ifdef __i386__
-                // Compare the key to all 16 stored keys
-                __m128i cmp;
-                cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                        _mm_loadu_si128((__m128i*)p.p2->keys));
-                
-                // Use a mask to ignore children that don't exist
-                mask = (1 << n->num_children) - 1;
-                bitfield = _mm_movemask_epi8(cmp) & mask;
-            #else
-            #ifdef __amd64__
-                // Compare the key to all 16 stored keys
-                __m128i cmp;
-                cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
-                        _mm_loadu_si128((__m128i*)p.p2->keys));
-
-                // Use a mask to ignore children that don't exist
-                mask = (1 << n->num_children) - 1;
-                bitfield = _mm_movemask_epi8(cmp) & mask;
-            #else
-                // Compare the key to all 16 stored keys
-                unsigned bitfield = 0;
-                for (short i = 0; i < 16; ++i) {
-                    if (p.p2->keys[i] == c)
-                        bitfield |= (1 << i);
-                }
-
-                // Use a mask to ignore children that don't exist
-                bitfield &= mask;
-            #endif
-            #endif
+            // Compare the key to all 16 stored keys, using
+            // a mask to ignore children that don't exist
+            mask = (1 << n->num_children) - 1;
+            bitfield = node16_eq_mask(p.p2->keys, c) & mask;
 
             /*
              * If we have a match (any bit set) then we can
@@ -193,7 +314,6 @@ static art_node** find_child(art_node *n, unsigned char c) {
             if (bitfield)
                 return &p.p2->children[__builtin_ctz(bitfield)];
             break;
-        }
 
         case NODE48:
             p.p3 = (art_node48*)n;
@@ -225,8 +345,20 @@ static inline int min(int a, int b) {
  */
 static int check_prefix(art_node *n, unsigned char *key, int key_len, int depth) {
     int max_cmp = min(min(n->partial_len, MAX_PREFIX_LEN), key_len - depth);
-    int idx;
-    for (idx=0; idx < max_cmp; idx++) {
+    int idx = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Compare a word at a time, the first differing byte
+    // is the lowest non-zero byte of the xor
+    for (; idx + 8 <= max_cmp; idx += 8) {
+        uint64_t a, b;
+        memcpy(&a, n->partial + idx, sizeof(a));
+        memcpy(&b, key + depth + idx, sizeof(b));
+        if (a != b)
+            return idx + (__builtin_ctzll(a ^ b) >> 3);
+    }
+#endif
+    for (; idx < max_cmp; idx++) {
         if (n->partial[idx] != key[depth+idx])
             return idx;
     }
@@ -256,7 +388,7 @@ static int leaf_matches(art_leaf *n, unsigned char *key, int key_len, int depth)
  */
 void* art_search(art_tree *t, unsigned char *key, int key_len) {
     art_node **child;
-    art_node *n = t->root;
+    art_node *n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
@@ -341,14 +473,14 @@ static art_leaf* maximum(art_node *n) {
  * Returns the minimum valued leaf
  */
 art_leaf* art_minimum(art_tree *t) {
-    return minimum((art_node*)t->root);
+    return minimum(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE));
 }
 
 /**
  * Returns the maximum valued leaf
  */
 art_leaf* art_maximum(art_tree *t) {
-    return maximum((art_node*)t->root);
+    return maximum(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE));
 }
 
 static art_leaf* make_leaf(unsigned char *key, int key_len, void *value) {
@@ -376,13 +508,14 @@ static void copy_header(art_node *dest, art_node *src) {
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_arena *a, art_node256 *n, art_node **ref, unsigned char c, void *child) {
+    (void)a;
     (void)ref;
     n->n.num_children++;
     n->children[c] = child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_arena *a, art_node48 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
         int pos = 0;
         while (n->children[pos]) pos++;
@@ -390,7 +523,7 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         n->keys[c] = pos + 1;
         n->n.num_children++;
     } else {
-        art_node256 *new = (art_node256*)alloc_node(NODE256);
+        art_node256 *new = (art_node256*)alloc_node(a, NODE256);
         for (int i=0;i<256;i++) {
             if (n->keys[i]) {
                 new->children[i] = n->children[n->keys[i] - 1];
@@ -398,47 +531,18 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child256(new, ref, c, child);
+        free_node(a, (art_node*)n);
+        add_child256(a, new, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_arena *a, art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
         unsigned mask = (1 << n->n.num_children) - 1;
-        
-        // support non-x86 architectures
-        #ifdef __i386__
-            __m128i cmp;
-
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)n->keys));
-
-            // Use a mask to ignore children that don't exist
-            unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
-        #else
-        #ifdef __amd64__
-            __m128i cmp;
-
-            // Compare the key to all 16 stored keys
-            cmp = _mm_cmplt_epi8(_mm_set1_epi8(c),
-                    _mm_loadu_si128((__m128i*)n->keys));
-
-            // Use a mask to ignore children that don't exist
-            unsigned bitfield = _mm_movemask_epi8(cmp) & mask;
-        #else
-            // Compare the key to all 16 stored keys
-            unsigned bitfield = 0;
-            for (short i = 0; i < 16; ++i) {
-                if (c < n->keys[i])
-                    bitfield |= (1 << i);
-            }
 
-            // Use a mask to ignore children that don't exist
-            bitfield &= mask;    
-        #endif
-        #endif
+        // Find the first key greater than c, ignoring
+        // children that don't exist
+        unsigned bitfield = node16_lt_mask(n->keys, c) & mask;
 
         // Check if less than any
         unsigned idx;
@@ -456,7 +560,7 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         n->n.num_children++;
 
     } else {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(a, NODE48);
 
         // Copy the child pointers and populate the key map
         memcpy(new->children, n->children,
@@ -466,12 +570,12 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child48(new, ref, c, child);
+        free_node(a, (art_node*)n);
+        add_child48(a, new, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_arena *a, art_node4 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
         for (idx=0; idx < n->n.num_children; idx++) {
@@ -489,7 +593,7 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
         n->n.num_children++;
 
     } else {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(a, NODE16);
 
         // Copy the child pointers and the key map
         memcpy(new->children, n->children,
@@ -498,21 +602,21 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
                 sizeof(unsigned char)*n->n.num_children);
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child16(new, ref, c, child);
+        free_node(a, (art_node*)n);
+        add_child16(a, new, ref, c, child);
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+static void add_child(art_arena *a, art_node *n, art_node **ref, unsigned char c, void *child) {
     switch (n->type) {
         case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
+            return add_child4(a, (art_node4*)n, ref, c, child);
         case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
+            return add_child16(a, (art_node16*)n, ref, c, child);
         case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
+            return add_child48(a, (art_node48*)n, ref, c, child);
         case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
+            return add_child256(a, (art_node256*)n, ref, c, child);
         default:
             abort();
     }
@@ -522,12 +626,10 @@ static void add_child(art_node *n, art_node **ref, unsigned char c, void *child)
  * Calculates the index at which the prefixes mismatch
  */
 static int prefix_mismatch(art_node *n, unsigned char *key, int key_len, int depth) {
-    int max_cmp = min(min(MAX_PREFIX_LEN, n->partial_len), key_len - depth);
-    int idx;
-    for (idx=0; idx < max_cmp; idx++) {
-        if (n->partial[idx] != key[depth+idx])
-            return idx;
-    }
+    int max_cmp;
+    int idx = check_prefix(n, key, key_len, depth);
+    if (idx < min(MAX_PREFIX_LEN, n->partial_len))
+        return idx;
 
     // If the prefix is short we can avoid finding a leaf
     if (n->partial_len > MAX_PREFIX_LEN) {
@@ -542,7 +644,7 @@ static int prefix_mismatch(art_node *n, unsigned char *key, int key_len, int dep
     return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
+static void* recursive_insert(art_arena *a, art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old, art_cow *cow) {
     // If we are at a NULL node, inject a leaf
     if (!n) {
         *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
@@ -557,12 +659,17 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         if (!leaf_matches(l, key, key_len, depth)) {
             *old = 1;
             void *old_val = l->value;
-            l->value = value;
+            if (cow) {
+                // Readers may hold the leaf, replace it
+                *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+                retire(cow, n);
+            } else
+                l->value = value;
             return old_val;
         }
 
         // New value, we must split the leaf into a node4
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(a, NODE4);
 
         // Create a new leaf
         art_leaf *l2 = make_leaf(key, key_len, value);
@@ -573,11 +680,17 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         memcpy(new->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
         // Add the leafs to the new node4
         *ref = (art_node*)new;
-        add_child4(new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-        add_child4(new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
+        add_child4(a, new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
+        add_child4(a, new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
         return NULL;
     }
 
+    // Work on a private copy of the node
+    if (cow) {
+        n = cow_node(cow, n);
+        *ref = n;
+    }
+
     // Check if given node has a prefix
     if (n->partial_len) {
         // Determine if the prefixes differ, since we need to split
@@ -588,28 +701,28 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // Create a new node
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(a, NODE4);
         *ref = (art_node*)new;
         new->n.partial_len = prefix_diff;
         memcpy(new->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
 
         // Adjust the prefix of the old node
         if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new, ref, n->partial[prefix_diff], n);
+            add_child4(a, new, ref, n->partial[prefix_diff], n);
             n->partial_len -= (prefix_diff+1);
             memmove(n->partial, n->partial+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         } else {
             n->partial_len -= (prefix_diff+1);
             art_leaf *l = minimum(n);
-            add_child4(new, ref, l->key[depth+prefix_diff], n);
+            add_child4(a, new, ref, l->key[depth+prefix_diff], n);
             memcpy(n->partial, l->key+depth+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         }
 
         // Insert the new leaf
         art_leaf *l = make_leaf(key, key_len, value);
-        add_child4(new, ref, key[depth+prefix_diff], SET_LEAF(l));
+        add_child4(a, new, ref, key[depth+prefix_diff], SET_LEAF(l));
         return NULL;
     }
 
@@ -618,12 +731,12 @@ RECURSE_SEARCH:;
     // Find a child to recurse to
     art_node **child = find_child(n, key[depth]);
     if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old);
+        return recursive_insert(a, *child, child, key, key_len, value, depth+1, old, cow);
     }
 
     // No child, node goes within us
     art_leaf *l = make_leaf(key, key_len, value);
-    add_child(n, ref, key[depth], SET_LEAF(l));
+    add_child(a, n, ref, key[depth], SET_LEAF(l));
     return NULL;
 }
 
@@ -638,19 +751,42 @@ RECURSE_SEARCH:;
  */
 void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value) {
     int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val);
+    void *old = recursive_insert(&t->arena, t->root, &t->root, key, key_len, value, 0, &old_val, NULL);
+    if (!old_val) t->size++;
+    return old;
+}
+
+/**
+ * Inserts a new value without changing any node reachable
+ * by readers. The nodes on the path are copied and the new
+ * root is published atomically, the replaced nodes are kept
+ * until reclaimed.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg epoch The epoch the replaced nodes are retired with
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_cow_insert(art_tree *t, unsigned char *key, int key_len, void *value, uint64_t epoch) {
+    art_cow cow = {t, epoch};
+    art_node *root = t->root;
+    int old_val = 0;
+    void *old = recursive_insert(&t->arena, root, &root, key, key_len, value, 0, &old_val, &cow);
+    __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
     if (!old_val) t->size++;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
+static void remove_child256(art_arena *a, art_node256 *n, art_node **ref, unsigned char c) {
     n->children[c] = NULL;
     n->n.num_children--;
 
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
     if (n->n.num_children == 37) {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(a, NODE48);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -662,18 +798,18 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node(a, (art_node*)n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_arena *a, art_node48 *n, art_node **ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
     n->children[pos-1] = NULL;
     n->n.num_children--;
 
     if (n->n.num_children == 12) {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(a, NODE16);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -686,27 +822,27 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node(a, (art_node*)n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_arena *a, art_node16 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(a, NODE4);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
         memcpy(new->keys, n->keys, 4);
         memcpy(new->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node(a, (art_node*)n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
+static void remove_child4(art_arena *a, art_node4 *n, art_node **ref, art_node **l, art_cow *cow) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
@@ -716,6 +852,9 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
     if (n->n.num_children == 1) {
         art_node *child = n->children[0];
         if (!IS_LEAF(child)) {
+            // The prefix of the child changes, copy it too
+            if (cow) child = cow_node(cow, child);
+
             // Concatenate the prefixes
             int prefix = n->n.partial_len;
             if (prefix < MAX_PREFIX_LEN) {
@@ -733,26 +872,26 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node(a, (art_node*)n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child(art_arena *a, art_node *n, art_node **ref, unsigned char c, art_node **l, art_cow *cow) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(a, (art_node4*)n, ref, l, cow);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(a, (art_node16*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(a, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(a, (art_node256*)n, ref, c);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
+static art_leaf* recursive_delete(art_arena *a, art_node *n, art_node **ref, unsigned char *key, int key_len, int depth, art_cow *cow) {
     // Search terminated
     if (!n) return NULL;
 
@@ -766,6 +905,13 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
         return NULL;
     }
 
+    // Work on a private copy of the node, the caller
+    // has checked that the key is present
+    if (cow) {
+        n = cow_node(cow, n);
+        *ref = n;
+    }
+
     // Bail if the prefix does not match
     if (n->partial_len) {
         int prefix_len = check_prefix(n, key, key_len, depth);
@@ -783,14 +929,14 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
     if (IS_LEAF(*child)) {
         art_leaf *l = LEAF_RAW(*child);
         if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
+            remove_child(a, n, ref, key[depth], child, cow);
             return l;
         }
         return NULL;
 
     // Recurse
     } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
+        return recursive_delete(a, *child, child, key, key_len, depth+1, cow);
     }
 }
 
@@ -803,7 +949,7 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, &t->root, key, key_len, 0);
+    art_leaf *l = recursive_delete(&t->arena, t->root, &t->root, key, key_len, 0, NULL);
     if (l) {
         t->size--;
         void *old = l->value;
@@ -818,6 +964,62 @@ void* art_delete(art_tree *t, unsigned char *key, int key_len) {
     return NULL;
 }
 
+/**
+ * Deletes a value without changing any node reachable
+ * by readers. The nodes on the path are copied and the new
+ * root is published atomically, the replaced nodes and the
+ * leaf are kept until reclaimed.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg epoch The epoch the replaced nodes are retired with
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_cow_delete(art_tree *t, unsigned char *key, int key_len, uint64_t epoch) {
+    // Only copy the path if there is something to delete
+    if (!art_search(t, key, key_len)) return NULL;
+
+    art_cow cow = {t, epoch};
+    art_node *root = t->root;
+    art_leaf *l = recursive_delete(&t->arena, root, &root, key, key_len, 0, &cow);
+    __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
+    t->size--;
+    retire(&cow, (art_node*)SET_LEAF(l));
+    return l->value;
+}
+
+/**
+ * Frees the nodes retired by copy-on-write updates up to an
+ * epoch. The caller must know no reader still holds a root
+ * from before the update of that epoch.
+ * @arg t The tree
+ * @arg epoch The newest epoch to reclaim
+ * @return The number of nodes and leaves freed.
+ */
+int art_reclaim(art_tree *t, uint64_t epoch) {
+    // The list is newest first, cut off the tail
+    art_garbage **ref = &t->garbage;
+    while (*ref && (*ref)->epoch > epoch)
+        ref = &(*ref)->next;
+
+    int num = 0;
+    for (art_garbage *g = *ref; g; g = g->next) num++;
+    free_garbage(t, *ref);
+    *ref = NULL;
+    return num;
+}
+
+/**
+ * Returns the oldest epoch with nodes waiting to be reclaimed.
+ * @return The epoch, or 0 if nothing is retired.
+ */
+uint64_t art_oldest_garbage(art_tree *t) {
+    art_garbage *g = t->garbage;
+    while (g && g->next) g = g->next;
+    return (g) ? g->epoch : 0;
+}
+
 // Recursively iterates over the tree
 static int recursive_iter(art_node *n, art_callback cb, void *data) {
     // Handle base cases
@@ -878,7 +1080,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
  * @return 0 on success, or the return of the callback.
  */
 int art_iter(art_tree *t, art_callback cb, void *data) {
-    return recursive_iter(t->root, cb, data);
+    return recursive_iter(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE), cb, data);
 }
 
 /**
@@ -907,7 +1109,7 @@ static int leaf_prefix_matches(art_leaf *n, unsigned char *prefix, int prefix_le
  */
 int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
     art_node **child;
-    art_node *n = t->root;
+    art_node *n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
@@ -955,7 +1157,7 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
 }
 
 // Recursively copies a tree
-static art_node* recursive_copy(art_node *n) {
+static art_node* recursive_copy(art_arena *a, art_node *n) {
     // Handle the NULL nodes
     if (!n) return NULL;
 
@@ -975,37 +1177,37 @@ static art_node* recursive_copy(art_node *n) {
     } p;
     switch (n->type) {
         case NODE4:
-            p.p1 = (art_node4*)alloc_node(NODE4);
+            p.p1 = (art_node4*)alloc_node(a, NODE4);
             copy_header((art_node*)p.p1, n);
             memcpy(p.p1->keys, ((art_node4*)n)->keys, 4);
             for (int i=0; i < n->num_children; i++) {
-                p.p1->children[i] = recursive_copy(((art_node4*)n)->children[i]);
+                p.p1->children[i] = recursive_copy(a, ((art_node4*)n)->children[i]);
             }
             return (art_node*)p.p1;
 
         case NODE16:
-            p.p2 = (art_node16*)alloc_node(NODE16);
+            p.p2 = (art_node16*)alloc_node(a, NODE16);
             copy_header((art_node*)p.p2, n);
             memcpy(p.p1->keys, ((art_node16*)n)->keys, 16);
             for (int i=0; i < n->num_children; i++) {
-                p.p2->children[i] = recursive_copy(((art_node16*)n)->children[i]);
+                p.p2->children[i] = recursive_copy(a, ((art_node16*)n)->children[i]);
             }
             return (art_node*)p.p2;
 
         case NODE48:
-            p.p3 = (art_node48*)alloc_node(NODE48);
+            p.p3 = (art_node48*)alloc_node(a, NODE48);
             copy_header((art_node*)p.p3, n);
             memcpy(p.p3->keys, ((art_node48*)n)->keys, 256);
-            for (int i=0; i < n->num_children; i++) {
-                p.p3->children[i] = recursive_copy(((art_node48*)n)->children[i]);
+            for (int i=0; i < 48; i++) {
+                p.p3->children[i] = recursive_copy(a, ((art_node48*)n)->children[i]);
             }
             return (art_node*)p.p3;
 
         case NODE256:
-            p.p4 = (art_node256*)alloc_node(NODE256);
+            p.p4 = (art_node256*)alloc_node(a, NODE256);
             copy_header((art_node*)p.p4, n);
             for (int i=0; i < 256; i++) {
-                p.p4->children[i] = recursive_copy(((art_node256*)n)->children[i]);
+                p.p4->children[i] = recursive_copy(a, ((art_node256*)n)->children[i]);
             }
             return (art_node*)p.p4;
 
@@ -1026,8 +1228,10 @@ static art_node* recursive_copy(art_node *n) {
  * @return 0 on success.
  */
 int art_copy(art_tree *dst, art_tree *src) {
+    memset(&dst->arena, 0, sizeof(art_arena));
+    dst->garbage = NULL;
     dst->size = src->size;
-    dst->root = recursive_copy(src->root);
+    dst->root = recursive_copy(&dst->arena, src->root);
     return 0;
 }
 
@@ -69,12 +69,52 @@ typedef struct {
     unsigned char key[];
 } art_leaf;
 
+/**
+ * Size of the slabs inner nodes are carved from
+ */
+#define ART_SLAB_SIZE 65536
+
+/**
+ * A slab of inner nodes. The nodes
+ * follow the header.
+ */
+typedef struct art_slab {
+    struct art_slab *next;
+} art_slab;
+
+/**
+ * Allocates the inner nodes of a tree. There is a
+ * size class for each node type, nodes are carved
+ * out of slabs and freed nodes are kept on a free
+ * list for reuse. The slabs are only returned when
+ * the tree is destroyed, all at once.
+ */
+typedef struct {
+    void *free_nodes[4];        // Free list per node type
+    unsigned char *next[4];     // Next free node in the current slab
+    unsigned char *end[4];      // End of the current slab
+    art_slab *slabs;            // All the slabs of the tree
+} art_arena;
+
+/**
+ * A node or tagged leaf replaced by a copy-on-write
+ * update. It is kept until no reader can hold a root
+ * from before the update.
+ */
+typedef struct art_garbage {
+    struct art_garbage *next;
+    uint64_t epoch;             // Epoch of the update that replaced it
+    art_node *node;
+} art_garbage;
+
 /**
  * Main struct, points to root.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    art_arena arena;
+    art_garbage *garbage;       // Retired nodes, newest first
 } art_tree;
 
 /**
@@ -117,6 +157,51 @@ void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value);
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len);
 
+/**
+ * Inserts a new value without changing any node reachable
+ * by readers. The nodes on the path are copied and the new
+ * root is published atomically, the replaced nodes are kept
+ * until reclaimed.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg epoch The epoch the replaced nodes are retired with
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_cow_insert(art_tree *t, unsigned char *key, int key_len, void *value, uint64_t epoch);
+
+/**
+ * Deletes a value without changing any node reachable
+ * by readers. The nodes on the path are copied and the new
+ * root is published atomically, the replaced nodes and the
+ * leaf are kept until reclaimed.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg epoch The epoch the replaced nodes are retired with
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_cow_delete(art_tree *t, unsigned char *key, int key_len, uint64_t epoch);
+
+/**
+ * Frees the nodes retired by copy-on-write updates up to an
+ * epoch. The caller must know no reader still holds a root
+ * from before the update of that epoch.
+ * @arg t The tree
+ * @arg epoch The newest epoch to reclaim
+ * @return The number of nodes and leaves freed.
+ */
+int art_reclaim(art_tree *t, uint64_t epoch);
+
+/**
+ * Returns the oldest epoch with nodes waiting to be reclaimed.
+ * @return The epoch, or 0 if nothing is retired.
+ */
+uint64_t art_oldest_garbage(art_tree *t);
+
 /**
  * Searches for a value in the ART tree
  * @arg t The tree
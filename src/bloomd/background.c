@@ -1,21 +1,23 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include "background.h"
 #include "libmemory.h"
+#include "numa.h"
+#include "scheduler.h"
+#include "set_log.h"
 
 /**
- * This defines how log we sleep between loop ticks
- * in microseconds
+ * This defines how long the event driven threads wait
+ * before checking if they should exit, in microseconds
  */
 #define PERIODIC_TIME_USEC 250000
 
-/**
- * Based on the PERIODIC_TIME_USEC, this should
- * convert seconds to tick counts. One tick occurs
- * each PERIODIC_TIME_USEC interval
- */
-#define SEC_TO_TICKS(sec) ((sec * 4))
-
 /*
 * After how many background operations should we force a client
 * checkpoint. This allows the vacuum thread to make progress even
@@ -23,14 +25,120 @@
 */
 #define PERIODIC_CHECKPOINT 16
 
-static void* flush_thread_main(void *in);
-static void* unmap_thread_main(void *in);
+/**
+ * The pre-warm job records accesses once a minute, and
+ * warms the filters used in the next hour this many minutes
+ * before the hour starts.
+ */
+#define PREWARM_POLL_SEC 60
+#define PREWARM_LEAD_MIN 5
+
+/**
+ * How often the memory budget is enforced, the rotating
+ * and aging filters are checked, the filters are checked
+ * for being over flush_dirty_mb, and the scrub verifies
+ * its share of scrub_rate_mb, in milliseconds
+ */
+#define BUDGET_POLL_MSEC 1000
+#define ROTATE_POLL_MSEC 1000
+#define DIRTY_POLL_MSEC 1000
+#define SCRUB_POLL_MSEC 1000
+
+/**
+ * The workers of each priority class of the scheduler. The
+ * memory budget, rotations and refreshes run at the normal
+ * priority, as clients notice when they are late. The flushes,
+ * cold unmaps, pre-warms and snapshots run in the background
+ * class, with a worker to spare so a long flush does not hold
+ * up the unmaps. The scrub and residency scans only use the
+ * idle time of the disks.
+ */
+static const int CLASS_WORKERS[SCHED_CLASSES] = {1, 2, 1};
+
 typedef struct {
     bloom_config *config;
     bloom_filtmgr *mgr;
     int *should_run;
 } background_thread_args;
 
+/**
+ * Shared state of the flush threads. The flush job
+ * queues the dirty filters each interval, and the helper
+ * IO threads take filters from the queue along with it.
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    int *should_run;
+    const char *cpus;           // Pinned to by the helpers, or NULL
+    pthread_mutex_t lock;       // Protects the fields below
+    pthread_cond_t work_cond;   // Signaled when a cycle starts
+    pthread_cond_t done_cond;   // Signaled when the helpers are done
+    bloom_filter_list *next;    // Next filter to flush
+    int cycle;                  // Incremented for each flush cycle
+    int busy;                   // Helpers flushing in this cycle
+    int shutdown;               // Set when the helpers should exit
+    int num_devs;               // Devices of the data dirs
+    uint64_t devs[MAX_DATA_DIRS];
+    int data_fds[MAX_DATA_DIRS];  // A data dir on each device with flush_syncfs, or -1
+
+    // Rate limiting, disabled if rate is 0
+    uint64_t rate;              // Bytes per second
+    uint64_t bytes;             // Bytes queued in this cycle
+    struct timeval start;       // Start of this cycle
+} flush_pool;
+
+struct bloom_background {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    bloom_scheduler *sched;
+
+    // Flush job
+    int flush_on;
+    flush_pool pool;
+    int helpers;
+    pthread_t *helper_threads;
+    uint64_t flush_due;         // Monotonic msec of the next scheduled flush
+
+    // Cold unmap job, whose interval shrinks under memory pressure
+    int base_interval;
+    int cold_interval;
+
+    // The filter being scrubbed, which the next run carries on with
+    char *scrub_current;
+
+    int snapshot_on;
+};
+
+static int start_flush_pool(bloom_background *bg);
+static void stop_flush_pool(bloom_background *bg);
+static int flush_job(void *in);
+static int unmap_job(void *in);
+static int prewarm_job(void *in);
+static int memory_budget_job(void *in);
+static int rotate_job(void *in);
+static int refresh_job(void *in);
+static int scrub_job(void *in);
+static int residency_job(void *in);
+static int snapshot_job(void *in);
+static void job_offline(void *arg);
+static void job_leave(void *arg);
+static uint64_t now_msec(void);
+static void* flush_io_thread_main(void *in);
+static void* set_log_thread_main(void *in);
+static void* fault_thread_main(void *in);
+static void* load_thread_main(void *in);
+static void flush_dirty_filters(bloom_background *bg, int scheduled, uint64_t min_dirty);
+static void snapshot_memory_filters(bloom_filtmgr *mgr, int *should_run);
+static void reclaim_cold_pages(bloom_filtmgr *mgr, int pageout, int *should_run);
+static int select_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head *head, uint64_t min_dirty);
+static void flush_filters(flush_pool *pool, bloom_filter_list_head *head);
+static void flush_pool_work(flush_pool *pool);
+static void flush_rate_limit(flush_pool *pool, uint64_t bytes);
+static void commit_filters(flush_pool *pool, bloom_filter_list_head *head);
+static void open_data_devices(bloom_config *config, flush_pool *pool);
+static void spread_over_devices(flush_pool *pool, bloom_filter_list_head *head);
+
 /**
  * Helper macro to pack and unpack the arguments
  * to the thread, and free the memory.
@@ -51,8 +159,158 @@ typedef struct {
 
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the filters.
+ * Schedules the periodic background jobs that are
+ * configured, which are run by a single scheduler.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the jobs should stop.
+ * @arg bg Output, the background jobs
+ * @return 1 if any jobs were scheduled
+ */
+int start_background_jobs(bloom_config *config, bloom_filtmgr *mgr, int *should_run, bloom_background **bg) {
+    bloom_background *b = calloc(1, sizeof(bloom_background));
+    if (!b) return 0;
+    b->config = config;
+    b->mgr = mgr;
+    b->should_run = should_run;
+
+    // The workers go offline after each job, so they
+    // never hold back the vacuum between the jobs
+    if (init_scheduler(CLASS_WORKERS, job_offline, job_leave, mgr, &b->sched)) {
+        syslog(LOG_ERR, "Failed to start the background scheduler!");
+        free(b);
+        return 0;
+    }
+    int jobs = 0;
+
+    // Flush unless we are not scheduled, or never write. The
+    // first run checks the dirty filters, or does the first flush.
+    if (config->flush_interval > 0 && !config->read_only && !start_flush_pool(b)) {
+        b->flush_due = now_msec() + (uint64_t)config->flush_interval * 1000;
+        int interval = (config->flush_dirty_mb) ? DIRTY_POLL_MSEC : config->flush_interval * 1000;
+        jobs += !sched_add_job(b->sched, "flush", SCHED_CLASS_BACKGROUND, interval,
+                config->flush_cpus, flush_job, b);
+        syslog(LOG_INFO, "Flush job started. Interval: %d seconds. Threads: %d. Devices: %d.",
+                config->flush_interval, b->helpers + 1, b->pool.num_devs);
+    }
+
+    // Unmap the cold filters if we are scheduled
+    if (config->cold_interval > 0) {
+        b->base_interval = b->cold_interval = config->cold_interval;
+        jobs += !sched_add_job(b->sched, "cold unmap", SCHED_CLASS_BACKGROUND, config->cold_interval * 1000,
+                config->unmap_cpus, unmap_job, b);
+        syslog(LOG_INFO, "Cold unmap job started. Interval: %d seconds.", config->cold_interval);
+    }
+
+    // Pre-warm unless we never unmap
+    if (config->prewarm && config->cold_interval > 0 && !config->in_memory) {
+        jobs += !sched_add_job(b->sched, "pre-warm", SCHED_CLASS_BACKGROUND, PREWARM_POLL_SEC * 1000,
+                NULL, prewarm_job, b);
+        syslog(LOG_INFO, "Pre-warm job started.");
+    }
+
+    // Enforce the memory budget if there is one
+    if (config->memory_budget_mb > 0 && !config->in_memory) {
+        jobs += !sched_add_job(b->sched, "memory budget", SCHED_CLASS_NORMAL, BUDGET_POLL_MSEC,
+                NULL, memory_budget_job, b);
+        syslog(LOG_INFO, "Memory budget job started. Budget: %d MB.", config->memory_budget_mb);
+    }
+
+    // Rotating filters can be created at any time, so
+    // they are always checked, unless we never write
+    if (!config->read_only) {
+        jobs += !sched_add_job(b->sched, "rotate", SCHED_CLASS_NORMAL, ROTATE_POLL_MSEC,
+                NULL, rotate_job, b);
+        syslog(LOG_INFO, "Rotation job started.");
+    }
+
+    // Refresh unless we are the writer
+    if (config->read_only) {
+        jobs += !sched_add_job(b->sched, "refresh", SCHED_CLASS_NORMAL, config->refresh_interval * 1000,
+                NULL, refresh_job, b);
+        syslog(LOG_INFO, "Refresh job started. Interval: %d seconds.", config->refresh_interval);
+    }
+
+    // Read-only servers leave the checksums to the writer
+    if (config->page_checksums && !config->read_only) {
+        jobs += !sched_add_job(b->sched, "scrub", SCHED_CLASS_IDLE, SCRUB_POLL_MSEC,
+                NULL, scrub_job, b);
+        syslog(LOG_INFO, "Scrub job started. Rate: %d MB/s.", config->scrub_rate_mb);
+    }
+
+    // Measure the residency if we are scheduled
+    if (config->residency_interval > 0) {
+        jobs += !sched_add_job(b->sched, "residency", SCHED_CLASS_IDLE, config->residency_interval * 1000,
+                NULL, residency_job, b);
+        syslog(LOG_INFO, "Residency job started. Interval: %d seconds.", config->residency_interval);
+    }
+
+    // Snapshot unless we are not scheduled, or never write
+    if (config->snapshot_interval > 0 && !config->read_only) {
+        b->snapshot_on = !sched_add_job(b->sched, "snapshot", SCHED_CLASS_BACKGROUND,
+                config->snapshot_interval * 1000, NULL, snapshot_job, b);
+        jobs += b->snapshot_on;
+        syslog(LOG_INFO, "Snapshot job started. Interval: %d seconds.", config->snapshot_interval);
+    }
+
+    if (!jobs) {
+        stop_background_jobs(b);
+        return 0;
+    }
+    *bg = b;
+    return 1;
+}
+
+/**
+ * Stops the background jobs once should_run is set to 0,
+ * waiting for the running jobs, and takes the final
+ * snapshots of the in-memory filters.
+ * @arg bg The background jobs
+ */
+void stop_background_jobs(bloom_background *bg) {
+    destroy_scheduler(bg->sched);
+    if (bg->flush_on) stop_flush_pool(bg);
+    free(bg->scrub_current);
+
+    // Take a last snapshot on shutdown, so nothing set
+    // before a clean shutdown is lost
+    if (bg->snapshot_on) {
+        int run = 1;
+        syslog(LOG_INFO, "Taking the final snapshots of the in-memory filters.");
+        filtmgr_client_checkpoint(bg->mgr);
+        snapshot_memory_filters(bg->mgr, &run);
+        filtmgr_client_leave(bg->mgr);
+    }
+    free(bg);
+}
+
+/**
+ * Starts a set log thread which on every set log
+ * sync interval, syncs the set logs that were written.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_set_log_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not logging sets
+    if (!config->use_set_log || config->in_memory || config->read_only) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, set_log_thread_main, args);
+    return 1;
+}
+
+/**
+ * Starts a fault thread, which faults in the filters that
+ * commands found were not in memory, with fault_retry.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -60,22 +318,22 @@ typedef struct {
  * @arg t The output thread
  * @return 1 if the thread was started
  */
-int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
-    // Return if we are not scheduled
-    if(config->flush_interval <= 0) {
+int start_fault_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if workers fault in the filters themselves
+    if (!config->fault_retry) {
         return 0;
     }
 
     // Start thread
     background_thread_args *args;
     PACK_ARGS();
-    pthread_create(t, NULL, flush_thread_main, args);
+    pthread_create(t, NULL, fault_thread_main, args);
     return 1;
 }
 
 /**
- * Starts a cold unmap thread which on every
- * cold interval unmaps cold filters.
+ * Starts a load thread, which loads the key files queued
+ * by the load command, if load_dir is set.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -83,123 +341,776 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  * @arg t The output thread
  * @return 1 if the thread was started
  */
-int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
-    // Return if we are not scheduled
-    if(config->cold_interval <= 0) {
+int start_load_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if no key files can be loaded
+    if (!config->load_dir || config->read_only) {
         return 0;
     }
 
     // Start thread
     background_thread_args *args;
     PACK_ARGS();
-    pthread_create(t, NULL, unmap_thread_main, args);
+    pthread_create(t, NULL, load_thread_main, args);
     return 1;
 }
 
-static void* flush_thread_main(void *in) {
+/**
+ * Invoked by the scheduler workers after each job.
+ */
+static void job_offline(void *arg) {
+    filtmgr_client_offline(arg);
+}
+
+/**
+ * Invoked by the scheduler workers before they exit.
+ */
+static void job_leave(void *arg) {
+    filtmgr_client_leave(arg);
+}
+
+/**
+ * Returns the monotonic time in milliseconds.
+ */
+static uint64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Starts the helper IO threads of the flush job. The flush
+ * job also flushes, so one fewer is needed.
+ * @arg bg The background jobs
+ * @return 0 on success.
+ */
+static int start_flush_pool(bloom_background *bg) {
+    bloom_config *config = bg->config;
+    flush_pool *pool = &bg->pool;
+    pool->mgr = bg->mgr;
+    pool->should_run = bg->should_run;
+    pool->cpus = config->flush_cpus;
+    pool->rate = (uint64_t)config->flush_rate_limit * 1024 * 1024;
+    open_data_devices(config, pool);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    bg->flush_on = 1;
+
+    // Each device gets a thread, so the disks are flushed in parallel
+    int helpers = ((config->flush_threads > pool->num_devs) ? config->flush_threads : pool->num_devs) - 1;
+    bg->helper_threads = calloc(helpers + 1, sizeof(pthread_t));
+    for (int i=0; i < helpers; i++) {
+        if (pthread_create(bg->helper_threads + i, NULL, flush_io_thread_main, pool)) {
+            syslog(LOG_ERR, "Failed to start flush thread!");
+            break;
+        }
+        bg->helpers++;
+    }
+    return 0;
+}
+
+/**
+ * Stops the helper IO threads of the flush job,
+ * once the flush job is no longer running.
+ * @arg bg The background jobs
+ */
+static void stop_flush_pool(bloom_background *bg) {
+    flush_pool *pool = &bg->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0; i < bg->helpers; i++) pthread_join(bg->helper_threads[i], NULL);
+    free(bg->helper_threads);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    for (int i=0; i < pool->num_devs; i++) {
+        if (pool->data_fds[i] >= 0) close(pool->data_fds[i]);
+    }
+}
+
+static int flush_job(void *in) {
+    bloom_background *bg = in;
+    bloom_config *config = bg->config;
+    filtmgr_client_checkpoint(bg->mgr);
+    if (!*bg->should_run) return 0;
+
+    // Every filter is flushed on the interval, and between
+    // them the busy filters are flushed once enough of them
+    // is dirty, so a flush never has too much to write
+    int scheduled = now_msec() >= bg->flush_due;
+    if (scheduled) bg->flush_due = now_msec() + (uint64_t)config->flush_interval * 1000;
+    uint64_t min_dirty = (uint64_t)config->flush_dirty_mb * 1024 * 1024;
+    if (scheduled || min_dirty) flush_dirty_filters(bg, scheduled, min_dirty);
+
+    // Sleep until the next scheduled flush, checking
+    // the dirty filters every second until then
+    uint64_t now = now_msec();
+    uint64_t wait = (bg->flush_due > now) ? bg->flush_due - now : 1;
+    if (min_dirty && wait > DIRTY_POLL_MSEC) wait = DIRTY_POLL_MSEC;
+    return wait;
+}
+
+/**
+ * Flushes the dirty filters, in parallel.
+ * @arg bg The background jobs
+ * @arg scheduled Is this the scheduled flush of every dirty filter
+ * @arg min_dirty Otherwise, the dirty bytes a filter is flushed at
+ */
+static void flush_dirty_filters(bloom_background *bg, int scheduled, uint64_t min_dirty) {
+    // List all the filters
+    if (scheduled) syslog(LOG_INFO, "Scheduled flush started.");
+    bg->pool.rate = (uint64_t)bg->config->flush_rate_limit * 1024 * 1024;
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(bg->mgr, NULL, &head);
+    if (res != 0) {
+        syslog(LOG_WARNING, "Failed to list filters for flushing!");
+        return;
+    }
+
+    // Flush only the dirty filters, in parallel. Errors are
+    // ignored since filters might get deleted in the process
+    int dirty = select_dirty_filters(bg->mgr, head, (scheduled) ? 0 : min_dirty);
+    if (dirty) flush_filters(&bg->pool, head);
+    if (scheduled) {
+        syslog(LOG_INFO, "Scheduled flush finished. Filters flushed: %d.", dirty);
+    } else if (dirty) {
+        syslog(LOG_DEBUG, "Flushed %d filters over the dirty threshold.", dirty);
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+}
+
+/**
+ * Finds the devices of the data dirs, and with flush_syncfs
+ * opens a data dir on each for syncing. The data_dir is first,
+ * and devices that can not be read are left to it.
+ * @arg config The configuration
+ * @arg pool The flush pool
+ */
+static void open_data_devices(bloom_config *config, flush_pool *pool) {
+    char *buf, *dirs[MAX_DATA_DIRS];
+    int num = data_dir_list(config, &buf, dirs);
+    for (int i=0; i < num; i++) {
+        struct stat st;
+        if (stat(dirs[i], &st)) {
+            if (i) continue;
+            st.st_dev = 0;
+        }
+        int known = 0;
+        for (int d=0; d < pool->num_devs && !known; d++) known = (pool->devs[d] == (uint64_t)st.st_dev);
+        if (known) continue;
+
+        int dev = pool->num_devs++;
+        pool->devs[dev] = st.st_dev;
+        pool->data_fds[dev] = -1;
+        if (config->flush_syncfs && (pool->data_fds[dev] = open(dirs[i], O_RDONLY)) < 0)
+            syslog(LOG_WARNING, "Failed to open the data dir %s for syncing! Syncing each filter.", dirs[i]);
+    }
+    free(buf);
+
+    // Syncing each filter is needed if any device can not be synced
+    for (int d=0; d < pool->num_devs; d++) {
+        if (pool->data_fds[d] >= 0) continue;
+        for (int o=0; o < pool->num_devs; o++) {
+            if (pool->data_fds[o] >= 0) close(pool->data_fds[o]);
+            pool->data_fds[o] = -1;
+        }
+        break;
+    }
+}
+
+/**
+ * Callback used to get the device of a filter.
+ */
+static void filter_dev_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(uint64_t*)data = filter->data_dev;
+}
+
+/**
+ * Reorders a list of filters to take turns between the devices
+ * of the data dirs, so the flush threads write to all of the
+ * disks at once instead of to one at a time.
+ * @arg pool The flush pool
+ * @arg head The list of filters, updated in place
+ */
+static void spread_over_devices(flush_pool *pool, bloom_filter_list_head *head) {
+    if (pool->num_devs < 2 || head->size < 2) return;
+
+    // Split the list by device, keeping the order of each
+    bloom_filter_list *lists[MAX_DATA_DIRS], **tails[MAX_DATA_DIRS];
+    for (int d=0; d < pool->num_devs; d++) {
+        lists[d] = NULL;
+        tails[d] = &lists[d];
+    }
+    unsigned int cmds = 0;
+    for (bloom_filter_list *node = head->head, *next; node; node = next) {
+        next = node->next;
+        uint64_t dev = 0;
+        filtmgr_filter_cb(pool->mgr, node->filter_name, filter_dev_cb, &dev);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(pool->mgr);
+        int d = pool->num_devs - 1;
+        while (d && pool->devs[d] != dev) d--;
+        node->next = NULL;
+        *tails[d] = node;
+        tails[d] = &node->next;
+    }
+
+    // Take a filter of each device in turn
+    bloom_filter_list **prev = &head->head;
+    head->tail = NULL;
+    for (int left = 1; left; ) {
+        left = 0;
+        for (int d=0; d < pool->num_devs; d++) {
+            if (!lists[d]) continue;
+            *prev = head->tail = lists[d];
+            prev = &lists[d]->next;
+            lists[d] = lists[d]->next;
+            left = 1;
+        }
+    }
+    *prev = NULL;
+}
+
+/**
+ * Callback used to check if a filter is dirty.
+ */
+static void dirty_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(int*)data = bloomf_is_dirty(filter);
+}
+
+/**
+ * Removes the filters that have not changed since they
+ * were last flushed from a list, so they are not queued.
+ * @arg mgr The filter manager
+ * @arg head The list of filters, updated in place
+ * @arg min_dirty If set, filters with fewer dirty bytes
+ * are also removed
+ * @return The number of dirty filters left in the list
+ */
+static int select_dirty_filters(bloom_filtmgr *mgr, bloom_filter_list_head *head, uint64_t min_dirty) {
+    bloom_filter_list **prev = &head->head, *node;
+    head->tail = NULL;
+    head->size = 0;
+    unsigned int cmds = 0;
+    while ((node = *prev)) {
+        int dirty = 0;
+        if (min_dirty) {
+            uint64_t bytes = 0;
+            dirty = !filtmgr_dirty_bytes(mgr, node->filter_name, &bytes) && bytes >= min_dirty;
+        } else {
+            filtmgr_filter_cb(mgr, node->filter_name, dirty_filter_cb, &dirty);
+        }
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        if (dirty) {
+            head->tail = node;
+            head->size++;
+            prev = &node->next;
+        } else {
+            *prev = node->next;
+            free(node->filter_name);
+            free(node);
+        }
+    }
+    return head->size;
+}
+
+/**
+ * Flushes a list of filters using the pool, and
+ * waits for all of the flushes to complete.
+ * @arg pool The flush pool
+ * @arg head The filters to flush
+ */
+static void flush_filters(flush_pool *pool, bloom_filter_list_head *head) {
+    spread_over_devices(pool, head);
+    pthread_mutex_lock(&pool->lock);
+    pool->next = head->head;
+    pool->bytes = 0;
+    gettimeofday(&pool->start, NULL);
+    pool->cycle++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Do our share of the work
+    flush_pool_work(pool);
+
+    // Wait for the helpers to finish
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy) pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->data_fds[0] >= 0) commit_filters(pool, head);
+}
+
+/**
+ * Syncs the data dir once the filters of a cycle were
+ * written back, so they are all made durable in a few
+ * journal commits instead of one fsync per layer. The
+ * filters can then drop the set logs the writes covered.
+ * @arg pool The flush pool
+ * @arg head The filters that were written
+ */
+static void commit_filters(flush_pool *pool, bloom_filter_list_head *head) {
+#ifdef __linux__
+    int res = 0;
+    for (int d=0; d < pool->num_devs && !res; d++) res = syncfs(pool->data_fds[d]);
+#else
+    sync();
+    int res = 0;
+#endif
+    if (res) {
+        syslog(LOG_ERR, "Failed to sync the data dir! %s", strerror(errno));
+        return;
+    }
+
+    unsigned int cmds = 0;
+    for (bloom_filter_list *node = head->head; node && *pool->should_run; node = node->next) {
+        filtmgr_commit_filter(pool->mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(pool->mgr);
+    }
+}
+
+/**
+ * Entry point for the helper IO threads. Waits
+ * for a flush cycle to start, and then takes
+ * filters to flush until there are none left.
+ */
+static void* flush_io_thread_main(void *in) {
+    flush_pool *pool = in;
+    int cycle = 0;
+
+    // The helpers run as the flush job does, on its CPUs and at its priority
+    if (pool->cpus && numa_pin_thread(pool->cpus, -1))
+        syslog(LOG_WARNING, "Failed to pin a flush thread to CPUs %s.", pool->cpus);
+    sched_set_class(SCHED_CLASS_BACKGROUND);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown) {
+        if (pool->cycle == cycle || !pool->next) {
+            cycle = pool->cycle;
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+        cycle = pool->cycle;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Only register with the manager while flushing,
+        // so an idle thread does not hold back the vacuum
+        filtmgr_client_checkpoint(pool->mgr);
+        flush_pool_work(pool);
+        filtmgr_client_leave(pool->mgr);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->busy) pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Callback used to get the byte size of a filter.
+ */
+static void filter_bytes_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(uint64_t*)data = bloomf_byte_size(filter);
+}
+
+/**
+ * Takes filters from the pool and flushes them until
+ * there are none left, or we should stop running.
+ * @arg pool The flush pool
+ */
+static void flush_pool_work(flush_pool *pool) {
+    bloom_filter_list *node;
+    unsigned int cmds = 0;
+    while (*pool->should_run) {
+        pthread_mutex_lock(&pool->lock);
+        node = pool->next;
+        if (node) pool->next = node->next;
+        pthread_mutex_unlock(&pool->lock);
+        if (!node) break;
+
+        uint64_t bytes = 0;
+        filtmgr_filter_cb(pool->mgr, node->filter_name, filter_bytes_cb, &bytes);
+        flush_rate_limit(pool, bytes);
+        if (pool->data_fds[0] >= 0)
+            filtmgr_write_filter(pool->mgr, node->filter_name);
+        else
+            filtmgr_flush_filter(pool->mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(pool->mgr);
+    }
+}
+
+/**
+ * Accounts for the bytes of a filter that is about to
+ * be flushed, and sleeps if the flushes of this cycle are
+ * ahead of the rate limit. The first flush never waits.
+ * @arg pool The flush pool
+ * @arg bytes The byte size of the filter
+ */
+static void flush_rate_limit(flush_pool *pool, uint64_t bytes) {
+    if (!pool->rate) return;
+
+    // Reserve our bytes, and find when the
+    // bytes before us are allowed to be done
+    pthread_mutex_lock(&pool->lock);
+    uint64_t ahead = pool->bytes;
+    pool->bytes += bytes;
+    struct timeval start = pool->start;
+    pthread_mutex_unlock(&pool->lock);
+
+    uint64_t allowed_usec = ahead * 1000000 / pool->rate;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t elapsed_usec = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+
+    // Sleep in intervals so that we stop promptly on shutdown
+    while (elapsed_usec < allowed_usec && *pool->should_run) {
+        uint64_t wait = allowed_usec - elapsed_usec;
+        if (wait > PERIODIC_TIME_USEC) wait = PERIODIC_TIME_USEC;
+        filtmgr_client_offline(pool->mgr);
+        usleep(wait);
+        elapsed_usec += wait;
+        filtmgr_client_checkpoint(pool->mgr);
+    }
+}
+
+static int unmap_job(void *in) {
+    bloom_background *bg = in;
+    bloom_config *config = bg->config;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run) return 0;
+
+    // The interval may be changed by a reload
+    if (config->cold_interval != bg->base_interval) {
+        bg->base_interval = config->cold_interval;
+        bg->cold_interval = bg->base_interval;
+    }
+
+    // List the cold filters
+    syslog(LOG_INFO, "Cold unmap started.");
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_cold_filters(mgr, &head);
+    if (res != 0) {
+        return bg->cold_interval * 1000;
+    }
+
+    // Close the filters, save memory
+    syslog(LOG_INFO, "Cold filter count: %d", head->size);
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        // A cold filter will not fill up soon, so it is
+        // folded down to its keys before it is unmapped
+        if (config->auto_shrink && !config->read_only)
+            filtmgr_shrink_filter(mgr, node->filter_name);
+        syslog(LOG_INFO, "Unmapping filter '%s' for being cold.", node->filter_name);
+        filtmgr_unmap_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+
+    if (config->memory_check){
+        // check to see if we are exceeding allowed RAM size. If so, start scaling the cold interval to make
+        // cold scans happen more often. Do this by cutting in half the cold_interval with a minimum of
+        // 2 seconds. If we are below the safe RAM size, scale the cold interval back up again, to a maxmimum
+        // of config->cold_interval
+        size_t all_memory = getMemorySize();
+        size_t max_memory = (size_t)(config->max_memory_percent * all_memory * 0.01);
+        size_t safe_memory = (size_t)(config->safe_memory_percent * all_memory * 0.01);
+        size_t current_memory = getCurrentRSS();
+
+        // Under pressure, let the kernel take back the clean pages
+        // of the filters that stay mapped, before anything is unmapped
+        if (current_memory > safe_memory)
+            reclaim_cold_pages(mgr, current_memory > max_memory, bg->should_run);
+
+        if (current_memory > max_memory){
+            bg->cold_interval = bg->cold_interval/2;
+            if (bg->cold_interval < 2) bg->cold_interval = 2;
+            syslog(LOG_INFO, "Scaling cold_interval to preserve RAM. New interval: %d", bg->cold_interval);
+        } else if ((current_memory < safe_memory) && (bg->cold_interval != bg->base_interval)){
+            bg->cold_interval = bg->cold_interval * 2;
+            if (bg->cold_interval > bg->base_interval) {
+                bg->cold_interval = bg->base_interval;
+            }
+            syslog(LOG_INFO, "Unscaling cold_interval since RAM is at safe level. New interval: %d", bg->cold_interval);
+        }
+    }
+    return bg->cold_interval * 1000;
+}
+
+static void reclaim_cold_pages(bloom_filtmgr *mgr, int pageout, int *should_run) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return;
+
+    unsigned int cmds = 0;
+    uint64_t total = 0, bytes;
+    for (bloom_filter_list *node = head->head; node && *should_run; node = node->next) {
+        int res = filtmgr_reclaim_filter(mgr, node->filter_name, pageout, &bytes);
+        if (!res) total += bytes;
+        else if (res != -1)
+            syslog(LOG_ERR, "Failed to hint the reclaim of filter '%s'.", node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+    filtmgr_cleanup_list(head);
+    syslog(LOG_INFO, "Hinted %llu MB of clean filter pages for %s.",
+            (unsigned long long)(total >> 20), (pageout) ? "page out" : "reclaim");
+}
+
+
+static int prewarm_job(void *in) {
+    bloom_background *bg = in;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run) return 0;
+
+    // Find the hour we are in, and if the next one is close
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    int upcoming = -1;
+    if (local.tm_min >= 60 - PREWARM_LEAD_MIN) upcoming = (local.tm_hour + 1) % 24;
+
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_warm_filters(mgr, local.tm_hour, upcoming, &head);
+    if (res != 0) return 0;
+
+    // Fault in the filters expected to be used
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        syslog(LOG_INFO, "Pre-warming filter '%s'.", node->filter_name);
+        filtmgr_warm_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+static int memory_budget_job(void *in) {
+    bloom_background *bg = in;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run) return 0;
+
+    uint64_t budget = (uint64_t)bg->config->memory_budget_mb * 1024 * 1024;
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_evict_filters(mgr, budget, &head);
+    if (res != 0) return 0;
+
+    // Unmap the least valuable filters
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        syslog(LOG_INFO, "Unmapping filter '%s' to stay within the memory budget.", node->filter_name);
+        filtmgr_unmap_filter(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+static int rotate_job(void *in) {
+    bloom_background *bg = in;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run) return 0;
+
+    uint64_t now = time(NULL);
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_rotate_filters(mgr, now, &head);
+    if (res != 0) return 0;
+
+    // Rotate the filters whose window has passed
+    bloom_filter_list *node = head->head;
+    unsigned int cmds = 0;
+    while (node) {
+        syslog(LOG_INFO, "Rotating filter '%s'.", node->filter_name);
+        filtmgr_rotate_filter(mgr, node->filter_name, now);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        node = node->next;
+    }
+
+    // Cleanup
+    filtmgr_cleanup_list(head);
+
+    // Age the filters that are due a tick, which is too
+    // frequent to be worth logging
+    res = filtmgr_list_age_filters(mgr, now, &head);
+    if (res != 0) return 0;
+    for (node = head->head; node; node = node->next) {
+        filtmgr_age_filter(mgr, node->filter_name, now);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+static int refresh_job(void *in) {
+    bloom_background *bg = in;
+    filtmgr_client_checkpoint(bg->mgr);
+    if (*bg->should_run) filtmgr_refresh(bg->mgr);
+
+    // The interval may be changed by a reload
+    return bg->config->refresh_interval * 1000;
+}
+
+static void* fault_thread_main(void *in) {
     bloom_config *config;
     bloom_filtmgr *mgr;
     int *should_run;
     UNPACK_ARGS();
+    (void)config;
 
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
-    unsigned int ticks = 0;
+    // Stay offline while waiting, so we never hold back the vacuum
+    syslog(LOG_INFO, "Fault thread started.");
     while (*should_run) {
-        usleep(PERIODIC_TIME_USEC);
+        filtmgr_client_offline(mgr);
+        int queued = filtmgr_wait_faults(mgr, PERIODIC_TIME_USEC / 1000);
         filtmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->flush_interval)) == 0 && *should_run) {
-            // List all the filters
-            syslog(LOG_INFO, "Scheduled flush started.");
-            bloom_filter_list_head *head;
-            int res = filtmgr_list_filters(mgr, NULL, &head);
-            if (res != 0) {
-                syslog(LOG_WARNING, "Failed to list filters for flushing!");
-                continue;
-            }
-
-            // Flush all, ignore errors since
-            // filters might get deleted in the process
-            bloom_filter_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                filtmgr_flush_filter(mgr, node->filter_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
-
-            // Cleanup
-            filtmgr_cleanup_list(head);
-        }
+        if (queued && *should_run) filtmgr_run_faults(mgr);
     }
     return NULL;
 }
 
-static void* unmap_thread_main(void *in) {
+static void* load_thread_main(void *in) {
     bloom_config *config;
     bloom_filtmgr *mgr;
     int *should_run;
     UNPACK_ARGS();
+    (void)config;
 
-    // Perform the initial checkpoint with the manager
+    // The loads hold their filters, so we stay offline throughout
     filtmgr_client_checkpoint(mgr);
+    filtmgr_client_offline(mgr);
 
-    size_t all_memory = getMemorySize();
-    size_t max_memory = (size_t)(config->max_memory_percent * all_memory * 0.01);
-    size_t safe_memory = (size_t)(config->safe_memory_percent * all_memory * 0.01);
-    size_t current_memory;
-    int cold_interval = config->cold_interval;
+    syslog(LOG_INFO, "Load thread started.");
+    while (*should_run) {
+        int queued = filtmgr_wait_loads(mgr, PERIODIC_TIME_USEC / 1000);
+        if (queued && *should_run) filtmgr_run_loads(mgr, should_run);
+    }
+    return NULL;
+}
 
 
-    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
-    unsigned int ticks = 0;
-    while (*should_run) {
-        usleep(PERIODIC_TIME_USEC);
-        filtmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(cold_interval)) == 0 && *should_run) {
-            // List the cold filters
-            syslog(LOG_INFO, "Cold unmap started.");
-            bloom_filter_list_head *head;
-            int res = filtmgr_list_cold_filters(mgr, &head);
-            if (res != 0) {
-                continue;
-            }
+static int scrub_job(void *in) {
+    bloom_background *bg = in;
+    bloom_config *config = bg->config;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run || config->scrub_rate_mb <= 0) return 0;
 
-            // Close the filters, save memory
-            syslog(LOG_INFO, "Cold filter count: %d", head->size);
-            bloom_filter_list *node = head->head;
-            unsigned int cmds = 0;
-            while (node) {
-                syslog(LOG_INFO, "Unmapping filter '%s' for being cold.", node->filter_name);
-                filtmgr_unmap_filter(mgr, node->filter_name);
-                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
-                node = node->next;
-            }
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    if (res != 0) return 0;
 
-            // Cleanup
-            filtmgr_cleanup_list(head);
-
-            if (config->memory_check){
-                // check to see if we are exceeding allowed RAM size. If so, start scaling the cold interval to make
-                // cold scans happen more often. Do this by cutting in half the cold_interval with a minimum of
-                // 2 seconds. If we are below the safe RAM size, scale the cold interval back up again, to a maxmimum
-                // of config->cold_interval
-                current_memory = getCurrentRSS();
-                if (current_memory > max_memory){
-                    cold_interval = cold_interval/2;
-                    if (cold_interval < 2) cold_interval = 2;
-                    syslog(LOG_INFO, "Scaling cold_interval to preserve RAM. New interval: %d", cold_interval);
-                } else if ((current_memory < safe_memory) && (cold_interval != config->cold_interval)){
-                    cold_interval = cold_interval * 2;
-                    if (cold_interval > config->cold_interval) {
-                        cold_interval = config->cold_interval;
-                    }
-                    syslog(LOG_INFO, "Unscaling cold_interval since RAM is at safe level. New interval: %d", cold_interval);
-                }
-            }
-        }
+    // Resume with the current filter, or start over
+    bloom_filter_list *node = head->head;
+    while (bg->scrub_current && node && strcmp(node->filter_name, bg->scrub_current)) node = node->next;
+    if (!node) node = head->head;
+
+    // Each run verifies the pages of a second of the rate
+    uint64_t budget = (uint64_t)config->scrub_rate_mb * 1024 * 1024 / 4096 *
+        SCRUB_POLL_MSEC / 1000;
+    unsigned int cmds = 0;
+    while (node && budget) {
+        int64_t verified = filtmgr_scrub_filter(mgr, node->filter_name, budget);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+        if (verified > 0) budget -= verified;
+        if (budget) node = node->next;
+    }
+
+    // Remember where we stopped
+    free(bg->scrub_current);
+    bg->scrub_current = (node) ? strdup(node->filter_name) : NULL;
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+static int residency_job(void *in) {
+    bloom_background *bg = in;
+    bloom_filtmgr *mgr = bg->mgr;
+    filtmgr_client_checkpoint(mgr);
+    if (!*bg->should_run) return 0;
+
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    if (res != 0) return bg->config->residency_interval * 1000;
+
+    // Scan every filter, checkpointing between batches
+    unsigned int cmds = 0;
+    for (bloom_filter_list *node = head->head; node && *bg->should_run; node = node->next) {
+        filtmgr_scan_residency(mgr, node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+    filtmgr_cleanup_list(head);
+    return bg->config->residency_interval * 1000;
+}
+
+static int snapshot_job(void *in) {
+    bloom_background *bg = in;
+    filtmgr_client_checkpoint(bg->mgr);
+    if (*bg->should_run) snapshot_memory_filters(bg->mgr, bg->should_run);
+    return bg->config->snapshot_interval * 1000;
+}
+
+/**
+ * Snapshots every in-memory filter that changed
+ * since its last snapshot.
+ * @arg mgr The filter manager
+ * @arg should_run Stops the snapshots once set to 0
+ */
+static void snapshot_memory_filters(bloom_filtmgr *mgr, int *should_run) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return;
+
+    unsigned int cmds = 0;
+    int taken = 0;
+    for (bloom_filter_list *node = head->head; node && *should_run; node = node->next) {
+        int res = filtmgr_snapshot_memory_filter(mgr, node->filter_name);
+        if (!res) taken++;
+        else if (res < 0 && res != -1 && res != -3)
+            syslog(LOG_ERR, "Failed to snapshot in-memory filter '%s'.", node->filter_name);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+    filtmgr_cleanup_list(head);
+    if (taken) syslog(LOG_DEBUG, "Snapshot %d in-memory filters.", taken);
+}
+
+static void* set_log_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+    (void)mgr;
+
+    // The logs are synced directly, without going through the
+    // filter manager, so we never hold back the vacuum. Each sync
+    // commits every set appended since the last one.
+    syslog(LOG_INFO, "Set log thread started. Interval: %d msec.", config->set_log_sync_msec);
+    while (*should_run) {
+        usleep(config->set_log_sync_msec * 1000);
+        setlog_sync_all();
     }
+    setlog_sync_all();
     return NULL;
 }
@@ -5,8 +5,53 @@
 #include "filter_manager.h"
 
 /**
- * Starts a flushing thread which on every
- * configured flush interval, flushes all the filters.
+ * Opaque handle to the periodic background jobs
+ */
+typedef struct bloom_background bloom_background;
+
+/**
+ * Schedules the periodic background jobs that are
+ * configured, which are run by a single scheduler:
+ * - flush, which on every flush interval flushes the dirty
+ *   filters, with helper threads to flush in parallel.
+ * - cold unmap, which on every cold interval unmaps the
+ *   cold filters.
+ * - pre-warm, which records the hours of the day each filter
+ *   is used in, and faults filters back in shortly before an
+ *   hour they were used in the day before.
+ * - memory budget, which unmaps the least valuable filters
+ *   while the mapped filters use more than memory_budget_mb.
+ * - rotate, which starts new generations of the rotating
+ *   filters and expires their oldest ones, and ages the aging
+ *   filters.
+ * - refresh, which for read-only servers picks up the filters
+ *   the writer created, dropped or grew.
+ * - scrub, which verifies the page checksums of the filters
+ *   at scrub_rate_mb, if page_checksums is set.
+ * - residency, which measures how much of each filter is
+ *   in memory.
+ * - snapshot, which snapshots the in-memory filters that
+ *   changed, so they are restored when loaded.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the jobs should stop.
+ * @arg bg Output, the background jobs
+ * @return 1 if any jobs were scheduled
+ */
+int start_background_jobs(bloom_config *config, bloom_filtmgr *mgr, int *should_run, bloom_background **bg);
+
+/**
+ * Stops the background jobs once should_run is set to 0,
+ * waiting for the running jobs, and takes the final
+ * snapshots of the in-memory filters.
+ * @arg bg The background jobs
+ */
+void stop_background_jobs(bloom_background *bg);
+
+/**
+ * Starts a set log thread which on every set log
+ * sync interval, syncs the set logs that were written.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -14,11 +59,11 @@
  * @arg t The output thread
  * @return 1 if the thread was started
  */
-int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+int start_set_log_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
 
 /**
- * Starts a cold unmap thread which on every
- * cold interval unamps cold filtesr.
+ * Starts a fault thread, which faults in the filters that
+ * commands found were not in memory, with fault_retry.
  * @arg config The configuration
  * @arg mgr The filter manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -26,7 +71,18 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  * @arg t The output thread
  * @return 1 if the thread was started
  */
-int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *);
+int start_fault_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
 
+/**
+ * Starts a load thread, which loads the key files queued
+ * by the load command, if load_dir is set.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_load_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
 
 #endif
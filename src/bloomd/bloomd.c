@@ -19,11 +19,21 @@
 #include "networking.h"
 #include "filter_manager.h"
 #include "background.h"
+#include "latency.h"
+#include "slowlog.h"
+#include "capture.h"
+#include "metrics.h"
+#include "shm_ring.h"
+#include "replication.h"
+#include "numa.h"
+#include "cluster.h"
 
 // Simple struct that holds args for the workers
 typedef struct {
     bloom_filtmgr *mgr;
     bloom_networking *netconf;
+    bloom_config *config;
+    int next_worker;        // Index of the next worker to start
 } worker_args;
 static void worker_main(worker_args *args);
 
@@ -34,6 +44,13 @@ static void worker_main(worker_args *args);
  */
 static int SHOULD_RUN = 1;
 
+/**
+ * The state used to reload the configuration on SIGHUP
+ */
+static char *CONFIG_FILE = NULL;
+static bloom_config *CONFIG = NULL;
+static bloom_networking *NETCONF = NULL;
+
 /**
  * Prints our usage to stderr
  */
@@ -117,6 +134,38 @@ void signal_handler(int signum) {
 }
 
 
+/**
+ * Invoked on SIGHUP, asks the main loop to reload
+ * the configuration. The reload is not done here,
+ * since parsing the file is not signal safe.
+ */
+void reload_signal_handler(int signum) {
+    (void)signum;
+    if (NETCONF) request_reload(NETCONF);
+}
+
+
+/**
+ * Reloads the configuration file on the main loop, and
+ * applies the settings that can change while running.
+ */
+static void reload_hook_main(void *arg) {
+    (void)arg;
+    if (!CONFIG_FILE) {
+        syslog(LOG_WARNING, "No configuration file to reload!");
+        return;
+    }
+    syslog(LOG_INFO, "Reloading the configuration.");
+    if (reload_config(CONFIG_FILE, CONFIG)) {
+        syslog(LOG_ERR, "Failed to reload the configuration!");
+        return;
+    }
+    setlogmask(CONFIG->syslog_log_level);
+    latency_init(CONFIG->latency_sample);
+    slowlog_init(CONFIG->slowlog_usec, CONFIG->slowlog_size);
+}
+
+
 int main(int argc, char **argv) {
     // Initialize syslog
     setup_syslog();
@@ -148,9 +197,33 @@ int main(int argc, char **argv) {
     // Set the syslog mask
     setlogmask(config->syslog_log_level);
 
+    // Time the sampled commands, and any slow ones
+    latency_init(config->latency_sample);
+    if (slowlog_init(config->slowlog_usec, config->slowlog_size)) return 1;
+
+    // Record the commands for replay
+    if (config->capture_file && capture_init(config->capture_file, config->capture_keys)) {
+        syslog(LOG_ERR, "Failed to start capturing the commands!");
+        return 1;
+    }
+
+    // Read the NUMA topology before any threads are pinned
+    if (config->use_numa) {
+        int nodes = numa_topology_init();
+        syslog(LOG_INFO, "Using %d NUMA node(s).", nodes);
+    }
+
     // Log that we are starting up
     syslog(LOG_INFO, "Starting bloomd.");
 
+    // Take over the listeners of a previous server. This waits
+    // for it to exit, so its filters are flushed before we load them.
+    bloom_listeners listeners;
+    if (inherit_listeners(config, &listeners)) {
+        syslog(LOG_ERR, "Failed to take over the listeners!");
+        return 1;
+    }
+
     // Initialize the filters
     bloom_filtmgr *mgr;
     int mgr_res = init_filter_manager(config, 1, &mgr);
@@ -159,45 +232,94 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Join the cluster, if we are in one
+    bloom_cluster *cluster = NULL;
+    if (init_cluster(config, &cluster)) {
+        syslog(LOG_ERR, "Failed to initialize the bloomd cluster!");
+        return 1;
+    }
+
     // Start the background tasks
-    int flush_on, unmap_on;
-    pthread_t flush_thread, unmap_thread;
-    flush_on = start_flush_thread(config, mgr, &SHOULD_RUN, &flush_thread);
-    unmap_on = start_cold_unmap_thread(config, mgr, &SHOULD_RUN, &unmap_thread);
+    int jobs_on, set_log_on, metrics_on;
+    bloom_background *jobs;
+    pthread_t set_log_thread;
+    int repl_on, replica_on, fault_on, cluster_on, shm_on;
+    pthread_t metrics_thread, repl_thread, replica_thread, fault_thread, shm_thread;
+    pthread_t load_thread;
+    int load_on;
+    pthread_t cluster_listener, cluster_migrator;
+    jobs_on = start_background_jobs(config, mgr, &SHOULD_RUN, &jobs);
+    set_log_on = start_set_log_thread(config, mgr, &SHOULD_RUN, &set_log_thread);
+    fault_on = start_fault_thread(config, mgr, &SHOULD_RUN, &fault_thread);
+    load_on = start_load_thread(config, mgr, &SHOULD_RUN, &load_thread);
+    metrics_on = start_metrics_thread(config, mgr, &SHOULD_RUN, &metrics_thread);
+    shm_on = start_shm_thread(config, mgr, &SHOULD_RUN, &shm_thread);
+    repl_on = start_replication_thread(config, mgr, &SHOULD_RUN, &repl_thread);
+    replica_on = start_replica_thread(config, mgr, &SHOULD_RUN, &replica_thread);
+    cluster_on = start_cluster_threads(config, mgr, cluster, &SHOULD_RUN,
+            &cluster_listener, &cluster_migrator);
 
     // Initialize the networking
     bloom_networking *netconf = NULL;
-    int net_res = init_networking(config, mgr, &netconf);
+    int net_res = init_networking(config, mgr, cluster, &listeners, &netconf);
+    close_listeners(&listeners);
     if (net_res != 0) {
         syslog(LOG_ERR, "Failed to initialize bloomd networking!");
         return 1;
     }
 
+    // Thread-per-core needs a CPU for each worker
+    workers = networking_workers(netconf);
+    if (config->worker_cpus &&
+            numa_parse_cpus(config->worker_cpus, NULL, 0) < workers) {
+        syslog(LOG_WARNING, "Fewer worker CPUs than workers! Some workers share a CPU.");
+    }
+
     // Start the network workers
-    worker_args wargs = {mgr, netconf};
-    pthread_t *threads = calloc(config->worker_threads, sizeof(pthread_t));
-    for (int i=0; i < config->worker_threads; i++) {
+    worker_args wargs = {mgr, netconf, config, 0};
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    for (int i=0; i < workers; i++) {
         pthread_create(&threads[i], NULL, (void*(*)(void*))worker_main, &wargs);
     }
 
+    // Reload the configuration on SIGHUP
+    CONFIG_FILE = config_file;
+    CONFIG = config;
+    NETCONF = netconf;
+    set_reload_hook(netconf, reload_hook_main, NULL);
+
     // Prepare our signal handlers to loop until we are signaled to quit
     signal(SIGPIPE, SIG_IGN);       // Ignore SIG_IGN
-    signal(SIGHUP, SIG_IGN);        // Ignore SIG_IGN
+    signal(SIGHUP, reload_signal_handler);
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
     // Loop forever
     enter_main_loop(netconf, &SHOULD_RUN, threads);
+    signal(SIGHUP, SIG_IGN);
 
     // Begin the shutdown/cleanup
     shutdown_networking(netconf, threads);
+    capture_close();
 
     // Shutdown the background tasks
-    if (flush_on) pthread_join(flush_thread, NULL);
-    if (unmap_on) pthread_join(unmap_thread, NULL);
+    if (jobs_on) stop_background_jobs(jobs);
+    if (set_log_on) pthread_join(set_log_thread, NULL);
+    if (fault_on) pthread_join(fault_thread, NULL);
+    if (load_on) pthread_join(load_thread, NULL);
+    if (metrics_on) pthread_join(metrics_thread, NULL);
+    if (shm_on) pthread_join(shm_thread, NULL);
+    if (repl_on) pthread_join(repl_thread, NULL);
+    if (replica_on) pthread_join(replica_thread, NULL);
+    if (cluster_on) {
+        pthread_join(cluster_listener, NULL);
+        pthread_join(cluster_migrator, NULL);
+    }
 
-    // Cleanup the filters
+    // Cleanup the filters, once no export or import uses them
+    repl_stop_transfers();
     destroy_filter_manager(mgr);
+    destroy_cluster(cluster);
 
     // Free our memory
     free(threads);
@@ -209,6 +331,19 @@ int main(int argc, char **argv) {
 
 // Main entry point for the worker threads
 static void worker_main(worker_args *args) {
+    // Pin the worker to its own CPU, or spread the workers over the NUMA nodes
+    int idx = __sync_fetch_and_add(&args->next_worker, 1);
+    if (args->config->worker_cpus) {
+        if (numa_pin_thread(args->config->worker_cpus, idx)) {
+            syslog(LOG_WARNING, "Failed to pin worker %d to CPUs %s.", idx, args->config->worker_cpus);
+        }
+    } else if (args->config->use_numa && numa_nodes() > 1) {
+        int node = idx % numa_nodes();
+        if (numa_bind_thread(node)) {
+            syslog(LOG_WARNING, "Failed to pin worker %d to NUMA node %d.", idx, node);
+        }
+    }
+
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(args->mgr);
 
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "capture.h"
+#include "config.h"
+
+/*
+ * Commands are written through a large stdio buffer,
+ * with a single lock ordering the records of all the workers.
+ */
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+static FILE *CAPTURE_FILE = NULL;
+static int CAPTURE_KEY_MODE = CAPTURE_KEYS_HASH;
+static int CAPTURE_ON = 0;
+static uint32_t NEXT_CONN_ID = 0;
+static uint64_t LAST_USEC;
+static char *CAPTURE_BUFFER = NULL;
+static pthread_mutex_t CAPTURE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Static declarations
+static uint64_t now_usec(clockid_t clock);
+static uint64_t hash_key(const char *key, int len);
+
+/**
+ * Starts capturing the commands to a file.
+ * The file is truncated if it exists.
+ * @arg path The path of the capture file
+ * @arg key_mode How the keys are recorded, see bloom_capture_keys
+ * @return 0 on success.
+ */
+int capture_init(const char *path, int key_mode) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        syslog(LOG_ERR, "Failed to open the capture file %s! %s", path, strerror(errno));
+        return -1;
+    }
+    CAPTURE_BUFFER = malloc(CAPTURE_BUFFER_SIZE);
+    if (CAPTURE_BUFFER) setvbuf(f, CAPTURE_BUFFER, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION, key_mode, now_usec(CLOCK_REALTIME)};
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        syslog(LOG_ERR, "Failed to write the capture file %s! %s", path, strerror(errno));
+        fclose(f);
+        free(CAPTURE_BUFFER);
+        CAPTURE_BUFFER = NULL;
+        return -1;
+    }
+
+    CAPTURE_FILE = f;
+    CAPTURE_KEY_MODE = key_mode;
+    LAST_USEC = now_usec(CLOCK_MONOTONIC);
+    __atomic_store_n(&CAPTURE_ON, 1, __ATOMIC_RELEASE);
+    syslog(LOG_INFO, "Capturing the commands to %s.", path);
+    return 0;
+}
+
+/**
+ * @return 1 if the commands are being captured.
+ */
+int capture_enabled(void) {
+    return __atomic_load_n(&CAPTURE_ON, __ATOMIC_RELAXED);
+}
+
+/**
+ * Assigns an id to a new connection.
+ * @return The id, starting from 1.
+ */
+uint32_t capture_conn_id(void) {
+    return __atomic_add_fetch(&NEXT_CONN_ID, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a command, if the commands are being captured.
+ * @arg conn_id The id of the connection of the command
+ * @arg opcode The opcode of the command
+ * @arg is_keys 1 if the arguments are a filter and keys
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ */
+void capture_command(uint32_t conn_id, char opcode, int is_keys, const char *args, int args_len) {
+    if (!capture_enabled()) return;
+
+    // The arguments are NULL terminated within their length
+    int len = args ? strnlen(args, args_len) : 0;
+    const char *name = args, *rest = NULL;
+    int name_len = len, rest_len = 0;
+    const char *space = len ? memchr(args, ' ', len) : NULL;
+    if (space) {
+        name_len = space - args;
+        rest = space + 1;
+        rest_len = len - name_len - 1;
+    }
+    if (name_len > UINT16_MAX) return;
+
+    // Count the keys of key commands
+    uint32_t num_keys = 0;
+    if (is_keys) {
+        for (int i=0; i < rest_len; i++) {
+            if (rest[i] != ' ' && (i == 0 || rest[i-1] == ' ')) num_keys++;
+        }
+    }
+
+    capture_record rec = {0, conn_id, opcode, 0, name_len, is_keys ? 0 : rest_len, num_keys};
+    pthread_mutex_lock(&CAPTURE_LOCK);
+    if (!CAPTURE_FILE) {
+        pthread_mutex_unlock(&CAPTURE_LOCK);
+        return;
+    }
+    uint64_t now = now_usec(CLOCK_MONOTONIC);
+    uint64_t delta = now - LAST_USEC;
+    rec.delta_usec = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+    LAST_USEC = now;
+
+    fwrite_unlocked(&rec, sizeof(rec), 1, CAPTURE_FILE);
+    fwrite_unlocked(name, 1, name_len, CAPTURE_FILE);
+    if (!is_keys) {
+        fwrite_unlocked(rest, 1, rest_len, CAPTURE_FILE);
+    } else if (CAPTURE_KEY_MODE != CAPTURE_KEYS_NONE) {
+        int i = 0;
+        while (i < rest_len) {
+            if (rest[i] == ' ') {
+                i++;
+                continue;
+            }
+            const char *key = rest + i;
+            int key_len = 0;
+            while (i < rest_len && rest[i] != ' ') {
+                key_len++;
+                i++;
+            }
+            if (CAPTURE_KEY_MODE == CAPTURE_KEYS_HASH) {
+                uint64_t h = hash_key(key, key_len);
+                fwrite_unlocked(&h, sizeof(h), 1, CAPTURE_FILE);
+            } else {
+                uint16_t l = (key_len > UINT16_MAX) ? UINT16_MAX : key_len;
+                fwrite_unlocked(&l, sizeof(l), 1, CAPTURE_FILE);
+                fwrite_unlocked(key, 1, l, CAPTURE_FILE);
+            }
+        }
+    }
+    pthread_mutex_unlock(&CAPTURE_LOCK);
+}
+
+/**
+ * Stops capturing, and writes out the buffered commands.
+ */
+void capture_close(void) {
+    pthread_mutex_lock(&CAPTURE_LOCK);
+    __atomic_store_n(&CAPTURE_ON, 0, __ATOMIC_RELEASE);
+    if (CAPTURE_FILE) {
+        if (fclose(CAPTURE_FILE))
+            syslog(LOG_ERR, "Failed to write the capture file! %s", strerror(errno));
+        CAPTURE_FILE = NULL;
+    }
+    free(CAPTURE_BUFFER);
+    CAPTURE_BUFFER = NULL;
+    pthread_mutex_unlock(&CAPTURE_LOCK);
+}
+
+// Returns the time of a clock in microseconds
+static uint64_t now_usec(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Hashes a captured key with 64bit FNV-1a
+static uint64_t hash_key(const char *key, int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i=0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
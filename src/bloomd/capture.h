@@ -0,0 +1,76 @@
+#ifndef BLOOM_CAPTURE_H
+#define BLOOM_CAPTURE_H
+#include <stdint.h>
+
+/*
+ * Capture of the command stream to a file, so that the traffic
+ * of a server can be replayed against another one with the
+ * replay tool. Each text command is recorded with the time since
+ * the previous command, the connection it came on, its opcode,
+ * the filter name and its keys. The keys are recorded as set by
+ * capture_keys: only their number, a 64bit hash of each key, so
+ * the stream hits the same keys without revealing them, or the
+ * keys themselves. The arguments of the commands that are not
+ * key commands, such as the options of a create, are kept as is.
+ *
+ * The file starts with a capture_header, and each command is a
+ * capture_record followed by the filter name, the arguments,
+ * and then the keys. A hashed key is 8 bytes, and a raw key is
+ * a 16bit length and the key bytes. Integers are in host order.
+ */
+#define CAPTURE_MAGIC 0x434d4c42    // "BLMC"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t key_mode;      // See bloom_capture_keys
+    uint64_t start_usec;    // Wall clock time the capture started
+} capture_header;
+
+typedef struct {
+    uint32_t delta_usec;    // Time since the previous command
+    uint32_t conn_id;       // Connection of the command, from 1
+    uint8_t opcode;         // The single letter opcode of the command
+    uint8_t reserved;
+    uint16_t name_len;      // Length of the filter name
+    uint32_t args_len;      // Length of the arguments, 0 for key commands
+    uint32_t num_keys;      // Number of keys of key commands
+} capture_record;
+
+/**
+ * Starts capturing the commands to a file.
+ * The file is truncated if it exists.
+ * @arg path The path of the capture file
+ * @arg key_mode How the keys are recorded, see bloom_capture_keys
+ * @return 0 on success.
+ */
+int capture_init(const char *path, int key_mode);
+
+/**
+ * @return 1 if the commands are being captured.
+ */
+int capture_enabled(void);
+
+/**
+ * Assigns an id to a new connection.
+ * @return The id, starting from 1.
+ */
+uint32_t capture_conn_id(void);
+
+/**
+ * Records a command, if the commands are being captured.
+ * @arg conn_id The id of the connection of the command
+ * @arg opcode The opcode of the command
+ * @arg is_keys 1 if the arguments are a filter and keys
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ */
+void capture_command(uint32_t conn_id, char opcode, int is_keys, const char *args, int args_len);
+
+/**
+ * Stops capturing, and writes out the buffered commands.
+ */
+void capture_close(void);
+
+#endif
@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "cluster.h"
+#include "art.h"
+#include "filter.h"
+#include "replication.h"
+
+/**
+ * Points each node has on the hash ring. More points
+ * spread the filters more evenly over the nodes.
+ */
+#define CLUSTER_VNODES 128
+
+/**
+ * How long the threads wait before checking
+ * if they should exit, in milliseconds.
+ */
+#define CLUSTER_POLL_MSEC 250
+
+/**
+ * How long a migration waits on the other node
+ * before giving up, in seconds.
+ */
+#define CLUSTER_TIMEOUT_SEC 30
+
+/**
+ * How long a migration waits between checks for
+ * the delete of the source filter, in microseconds.
+ */
+#define CLUSTER_WAIT_USEC 10000
+
+/**
+ * File of the data dir the moved filters are kept in
+ */
+static const char MOVED_FILENAME[] = "cluster.moved";
+
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+typedef struct {
+    char *host;
+    char *port;             // Client port, as a string for getaddrinfo
+    char *cluster_port;     // Port receiving migrations
+    char *addr;             // host:port, sent in redirects
+} cluster_node;
+
+typedef struct {
+    uint64_t point;
+    int node;
+} ring_point;
+
+// A filter queued to migrate
+typedef struct migration {
+    char *filter_name;
+    int node;
+    struct migration *next;
+} migration;
+
+struct bloom_cluster {
+    bloom_config *config;
+    cluster_node nodes[CLUSTER_MAX_NODES];
+    int num_nodes;
+    int self;               // Our node
+
+    ring_point *ring;       // Sorted by point
+    int ring_size;
+
+    pthread_mutex_t lock;   // Protects the moved filters and the queue
+    pthread_cond_t cond;    // Signaled when a migration is queued
+    art_tree moved;         // Filter name -> node index + 1
+    migration *queue;
+    migration *queue_tail;
+};
+
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    bloom_cluster *cluster;
+    int *should_run;
+    int listen_fd;
+} cluster_thread_args;
+
+/*
+ * Static declarations
+ */
+static int parse_nodes(bloom_cluster *c);
+static int compare_points(const void *a, const void *b);
+static uint64_t hash_name(const char *name, int len);
+static char* moved_path(bloom_config *config);
+static void load_moved(bloom_cluster *c);
+static int save_moved(bloom_cluster *c);
+static int save_moved_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int bind_cluster_listener(bloom_cluster *c, int *fd_out);
+static void* listener_main(void *in);
+static void* migrator_main(void *in);
+static int migrate_filter(bloom_cluster *c, bloom_filtmgr *mgr, int *should_run, char *filter_name, int node);
+static int connect_node(cluster_node *n);
+static int send_line(int fd, const char *line);
+static int expect_ok(int fd);
+static void set_timeouts(int fd);
+
+/**
+ * Initializes the cluster from the cluster_nodes, and
+ * reads the filters that were migrated away from the data dir.
+ * @arg config The configuration
+ * @arg cluster Output, the cluster. Set to NULL if the
+ * node is not in a cluster.
+ * @return 0 on success.
+ */
+int init_cluster(bloom_config *config, bloom_cluster **cluster) {
+    *cluster = NULL;
+    if (!config->cluster_nodes) return 0;
+
+    bloom_cluster *c = calloc(1, sizeof(bloom_cluster));
+    c->config = config;
+    c->self = -1;
+    if (parse_nodes(c) || c->self < 0) {
+        syslog(LOG_ERR, "Failed to parse the cluster nodes!");
+        destroy_cluster(c);
+        return -1;
+    }
+
+    // Hash the points of every node onto the ring
+    c->ring_size = c->num_nodes * CLUSTER_VNODES;
+    c->ring = malloc(c->ring_size * sizeof(ring_point));
+    char buf[320];
+    for (int i=0; i < c->num_nodes; i++) {
+        for (int j=0; j < CLUSTER_VNODES; j++) {
+            int len = snprintf(buf, sizeof(buf), "%s#%d", c->nodes[i].addr, j);
+            c->ring[i * CLUSTER_VNODES + j].point = hash_name(buf, len);
+            c->ring[i * CLUSTER_VNODES + j].node = i;
+        }
+    }
+    qsort(c->ring, c->ring_size, sizeof(ring_point), compare_points);
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    init_art_tree(&c->moved);
+    load_moved(c);
+
+    syslog(LOG_INFO, "Cluster of %d nodes, serving as %s.", c->num_nodes, c->nodes[c->self].addr);
+    *cluster = c;
+    return 0;
+}
+
+/**
+ * Destroys a cluster
+ * @arg cluster The cluster, may be NULL
+ */
+void destroy_cluster(bloom_cluster *cluster) {
+    if (!cluster) return;
+    for (int i=0; i < cluster->num_nodes; i++) {
+        free(cluster->nodes[i].host);
+        free(cluster->nodes[i].addr);
+    }
+    if (cluster->ring) {
+        destroy_art_tree(&cluster->moved);
+        pthread_mutex_destroy(&cluster->lock);
+        pthread_cond_destroy(&cluster->cond);
+        free(cluster->ring);
+    }
+    while (cluster->queue) {
+        migration *next = cluster->queue->next;
+        free(cluster->queue->filter_name);
+        free(cluster->queue);
+        cluster->queue = next;
+    }
+    free(cluster);
+}
+
+/**
+ * Returns the node a filter name hashes to.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @return The index of the node
+ */
+int cluster_owner(bloom_cluster *cluster, char *filter_name) {
+    uint64_t point = hash_name(filter_name, strlen(filter_name));
+
+    // Find the first point at or after the hash, wrapping around
+    int low = 0, high = cluster->ring_size;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (cluster->ring[mid].point < point)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return cluster->ring[(low == cluster->ring_size) ? 0 : low].node;
+}
+
+/**
+ * Finds the node that serves a filter we do not have,
+ * to redirect a client to it.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @return The node as host:port, or NULL if the filter
+ * belongs on this node. Valid for the life of the cluster.
+ */
+const char* cluster_redirect(bloom_cluster *cluster, char *filter_name) {
+    pthread_mutex_lock(&cluster->lock);
+    intptr_t moved = (intptr_t)art_search(&cluster->moved,
+            (unsigned char*)filter_name, strlen(filter_name)+1);
+    pthread_mutex_unlock(&cluster->lock);
+
+    int node = (moved) ? (int)moved - 1 : cluster_owner(cluster, filter_name);
+    return (node == cluster->self) ? NULL : cluster->nodes[node].addr;
+}
+
+/**
+ * Finds a node of the cluster.
+ * @arg cluster The cluster
+ * @arg addr The node as host:port
+ * @return The index of the node, or -1 if unknown.
+ */
+int cluster_find_node(bloom_cluster *cluster, char *addr) {
+    for (int i=0; i < cluster->num_nodes; i++) {
+        if (!strcmp(cluster->nodes[i].addr, addr)) return i;
+    }
+    return -1;
+}
+
+/**
+ * Queues a filter to be migrated to another node,
+ * by the migration thread.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @arg node The index of the target node
+ * @return 0 on success, -1 if the node is this node.
+ */
+int cluster_migrate(bloom_cluster *cluster, char *filter_name, int node) {
+    if (node == cluster->self || node < 0 || node >= cluster->num_nodes) return -1;
+    migration *m = malloc(sizeof(migration));
+    m->filter_name = strdup(filter_name);
+    m->node = node;
+    m->next = NULL;
+
+    pthread_mutex_lock(&cluster->lock);
+    if (cluster->queue_tail)
+        cluster->queue_tail->next = m;
+    else
+        cluster->queue = m;
+    cluster->queue_tail = m;
+    pthread_cond_signal(&cluster->cond);
+    pthread_mutex_unlock(&cluster->lock);
+    return 0;
+}
+
+/**
+ * Records that a filter moved, so commands for it are
+ * redirected to its node. Moves to the node the filter hashes
+ * to are forgotten, since the hash already leads there.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @arg node The index of the node, or -1 if the filter
+ * moved to this node.
+ * @return 0 on success, -1 if the moves could not be saved.
+ */
+int cluster_set_moved(bloom_cluster *cluster, char *filter_name, int node) {
+    if (node < 0) node = cluster->self;
+    int key_len = strlen(filter_name) + 1;
+    pthread_mutex_lock(&cluster->lock);
+    if (node == cluster_owner(cluster, filter_name)) {
+        art_delete(&cluster->moved, (unsigned char*)filter_name, key_len);
+    } else {
+        art_insert(&cluster->moved, (unsigned char*)filter_name, key_len, (void*)(intptr_t)(node + 1));
+    }
+    int res = save_moved(cluster);
+    pthread_mutex_unlock(&cluster->lock);
+    return res;
+}
+
+/**
+ * Starts the cluster threads. The listener receives the
+ * filters other nodes migrate to us on the cluster port,
+ * and the migrator streams the queued migrations.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg cluster The cluster, may be NULL
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the threads should exit.
+ * @arg listener The output listener thread
+ * @arg migrator The output migrator thread
+ * @return 1 if the threads were started
+ */
+int start_cluster_threads(bloom_config *config, bloom_filtmgr *mgr, bloom_cluster *cluster,
+        int *should_run, pthread_t *listener, pthread_t *migrator) {
+    // Return if we are not in a cluster
+    if (!cluster) return 0;
+
+    int fd;
+    if (bind_cluster_listener(cluster, &fd)) return 0;
+
+    for (int i=0; i < 2; i++) {
+        cluster_thread_args *args = malloc(sizeof(cluster_thread_args));
+        args->config = config;
+        args->mgr = mgr;
+        args->cluster = cluster;
+        args->should_run = should_run;
+        args->listen_fd = (i == 0) ? fd : -1;
+        if (i == 0)
+            pthread_create(listener, NULL, listener_main, args);
+        else
+            pthread_create(migrator, NULL, migrator_main, args);
+    }
+    return 1;
+}
+
+/**
+ * Parses the cluster_nodes, each as host:port:cluster_port,
+ * and finds our node by cluster_self.
+ * @return 0 on success.
+ */
+static int parse_nodes(bloom_cluster *c) {
+    char *list = strdup(c->config->cluster_nodes), *rest = list, *entry;
+    int res = 0;
+    while (!res && (entry = strsep(&rest, ","))) {
+        while (*entry == ' ') entry++;
+        char *end = entry + strlen(entry);
+        while (end > entry && end[-1] == ' ') *--end = 0;
+
+        char *cluster_port = strrchr(entry, ':');
+        if (c->num_nodes == CLUSTER_MAX_NODES || !cluster_port) {
+            res = -1;
+            break;
+        }
+        *cluster_port = 0;
+        char *port = strrchr(entry, ':');
+        if (!port) {
+            res = -1;
+            break;
+        }
+
+        cluster_node *n = c->nodes + c->num_nodes++;
+        n->addr = strdup(entry);
+        *port = 0;
+        n->host = malloc(strlen(entry) + strlen(port + 1) + strlen(cluster_port + 1) + 3);
+        strcpy(n->host, entry);
+        n->port = n->host + strlen(entry) + 1;
+        strcpy(n->port, port + 1);
+        n->cluster_port = n->port + strlen(n->port) + 1;
+        strcpy(n->cluster_port, cluster_port + 1);
+        if (!strcmp(n->addr, c->config->cluster_self)) c->self = c->num_nodes - 1;
+    }
+    free(list);
+    return res;
+}
+
+static int compare_points(const void *a, const void *b) {
+    uint64_t pa = ((ring_point*)a)->point, pb = ((ring_point*)b)->point;
+    return (pa < pb) ? -1 : (pa > pb);
+}
+
+static uint64_t hash_name(const char *name, int len) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(name, len, 0, out);
+    return out[0];
+}
+
+static char* moved_path(bloom_config *config) {
+    return join_path(config->data_dir, (char*)MOVED_FILENAME);
+}
+
+/**
+ * Reads the moved filters, each as a line with the
+ * filter name and the node. Moves to nodes that left
+ * the cluster are dropped.
+ */
+static void load_moved(bloom_cluster *c) {
+    char *path = moved_path(c->config);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) return;
+
+    char line[512], filter_name[256], addr[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%255s %255s", filter_name, addr) != 2) continue;
+        int node = cluster_find_node(c, addr);
+        if (node < 0) {
+            syslog(LOG_WARNING, "Filter '%s' moved to %s, which is no longer in the cluster.",
+                    filter_name, addr);
+            continue;
+        }
+        art_insert(&c->moved, (unsigned char*)filter_name, strlen(filter_name)+1,
+                (void*)(intptr_t)(node + 1));
+    }
+    fclose(f);
+}
+
+/**
+ * Writes out the moved filters. The file is replaced
+ * atomically. Must be called with the lock.
+ * @return 0 on success.
+ */
+static int save_moved(bloom_cluster *c) {
+    char *path = moved_path(c->config);
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", path) < 0) {
+        free(path);
+        return -1;
+    }
+
+    int res = -1;
+    FILE *f = fopen(tmp_path, "w");
+    if (f) {
+        art_iter(&c->moved, save_moved_cb, (void*[]){c, f});
+        res = (fclose(f) || rename(tmp_path, path)) ? -1 : 0;
+    }
+    if (res) syslog(LOG_ERR, "Failed to save the moved filters! %s", strerror(errno));
+    free(tmp_path);
+    free(path);
+    return res;
+}
+
+static int save_moved_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    bloom_cluster *c = ((void**)data)[0];
+    FILE *f = ((void**)data)[1];
+    fprintf(f, "%s %s\n", (char*)key, c->nodes[(intptr_t)value - 1].addr);
+    return 0;
+}
+
+/**
+ * Creates the listening socket for migrations,
+ * on the cluster port of our node.
+ * @return 0 on success.
+ */
+static int bind_cluster_listener(bloom_cluster *c, int *fd_out) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(atoi(c->nodes[c->self].cluster_port));
+    if (inet_pton(AF_INET, c->config->bind_address, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", c->config->bind_address);
+        return 1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on cluster socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (listen(fd, 16) != 0) {
+        syslog(LOG_ERR, "Failed to listen on cluster socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    *fd_out = fd;
+    return 0;
+
+ERROR:
+    close(fd);
+    return 1;
+}
+
+/**
+ * Receives the filters migrated to us, one at a time.
+ */
+static void* listener_main(void *in) {
+    cluster_thread_args *args = in;
+    bloom_cluster *c = args->cluster;
+    syslog(LOG_INFO, "Cluster listener started. Port: %s.", c->nodes[c->self].cluster_port);
+
+    struct pollfd pfd = {args->listen_fd, POLLIN, 0};
+    while (*args->should_run) {
+        if (poll(&pfd, 1, CLUSTER_POLL_MSEC) <= 0) continue;
+        int fd = accept(args->listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        set_timeouts(fd);
+
+        char *filter_name = NULL;
+        if (!repl_receive_filter(args->config, args->mgr, fd, args->should_run, &filter_name)) {
+            cluster_set_moved(c, filter_name, -1);
+            syslog(LOG_INFO, "Filter '%s' migrated to us.", filter_name);
+            free(filter_name);
+        } else {
+            syslog(LOG_WARNING, "Failed to receive a migrated filter!");
+        }
+        close(fd);
+    }
+    close(args->listen_fd);
+    filtmgr_client_leave(args->mgr);
+    free(args);
+    return NULL;
+}
+
+/**
+ * Runs the queued migrations, one at a time.
+ */
+static void* migrator_main(void *in) {
+    cluster_thread_args *args = in;
+    bloom_cluster *c = args->cluster;
+    while (*args->should_run) {
+        pthread_mutex_lock(&c->lock);
+        migration *m = c->queue;
+        if (m) {
+            c->queue = m->next;
+            if (!c->queue) c->queue_tail = NULL;
+        } else {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += CLUSTER_POLL_MSEC * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (!m) continue;
+
+        syslog(LOG_INFO, "Migrating filter '%s' to %s.", m->filter_name, c->nodes[m->node].addr);
+        if (!migrate_filter(c, args->mgr, args->should_run, m->filter_name, m->node))
+            syslog(LOG_INFO, "Migrated filter '%s' to %s.", m->filter_name, c->nodes[m->node].addr);
+        filtmgr_client_offline(args->mgr);
+        free(m->filter_name);
+        free(m);
+    }
+    filtmgr_client_leave(args->mgr);
+    free(args);
+    return NULL;
+}
+
+/**
+ * Migrates a filter to another node. The keys set while the
+ * files stream are recorded in a log. Once the target has loaded
+ * the filter, we redirect to it and drop our copy, and then send
+ * the log, which is complete once the delete is done.
+ * @return 0 on success.
+ */
+static int migrate_filter(bloom_cluster *c, bloom_filtmgr *mgr, int *should_run, char *filter_name, int node) {
+    // The handle keeps the filter and its log alive past the drop
+    bloom_filter_handle *handle;
+    if (filtmgr_open_handle(mgr, filter_name, &handle)) {
+        syslog(LOG_ERR, "Can not migrate filter '%s', it does not exist.", filter_name);
+        return -1;
+    }
+
+    int res = -1;
+    int fd = connect_node(c->nodes + node);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to connect to %s to migrate filter '%s'.",
+                c->nodes[node].addr, filter_name);
+        goto LEAVE;
+    }
+
+    bloom_repl_log *log;
+    if (init_repl_log((uint64_t)c->config->replication_buffer_mb * 1024 * 1024, &log)) goto LEAVE;
+    if (filtmgr_set_migration_log(mgr, handle, log)) {
+        destroy_repl_log(log);
+        syslog(LOG_ERR, "Filter '%s' is already migrating.", filter_name);
+        goto LEAVE;
+    }
+
+    uint64_t offset = 0;
+    res = repl_send_filter(c->config, mgr, fd, filter_name);
+    if (res == -4) syslog(LOG_ERR, "Can not migrate in-memory filter '%s'.", filter_name);
+    if (res == -3) syslog(LOG_ERR, "Can not migrate filter '%s' during a snapshot.", filter_name);
+    if (!res) res = repl_send_log(log, fd, &offset);
+    if (!res) res = send_line(fd, "ready\n");
+    filtmgr_client_offline(mgr);
+    if (!res) res = expect_ok(fd);
+    filtmgr_client_checkpoint(mgr);
+    if (res) {
+        syslog(LOG_ERR, "Failed to migrate filter '%s' to %s.", filter_name, c->nodes[node].addr);
+        goto LEAVE;
+    }
+
+    // The target has the filter, send the clients there
+    cluster_set_moved(c, filter_name, node);
+    filtmgr_drop_filter(mgr, filter_name);
+    while (*should_run && filtmgr_delete_pending(mgr, filter_name)) {
+        filtmgr_client_offline(mgr);
+        usleep(CLUSTER_WAIT_USEC);
+        filtmgr_client_checkpoint(mgr);
+    }
+
+    // Nothing sets the filter by name any more, send the rest of the log
+    int sent = repl_send_log(log, fd, &offset);
+    if (!sent) sent = send_line(fd, "done\n");
+    if (!sent) sent = expect_ok(fd);
+    if (sent) syslog(LOG_WARNING, "Some keys set during the migration of filter '%s' may be lost!", filter_name);
+
+LEAVE:
+    if (fd >= 0) close(fd);
+    filtmgr_release_handle(mgr, handle);
+    return res;
+}
+
+// Connects to the cluster port of a node
+static int connect_node(cluster_node *n) {
+    struct addrinfo hints, *addrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(n->host, n->cluster_port, &hints, &addrs)) return -1;
+
+    int fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen)) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd >= 0) set_timeouts(fd);
+    return fd;
+}
+
+// Sends a line, returns 0 on success
+static int send_line(int fd, const char *line) {
+    int len = strlen(line);
+    while (len > 0) {
+        int n = send(fd, line, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        line += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads the answer of the other node, returns 0 if it is ok
+static int expect_ok(int fd) {
+    char buf[16];
+    int len = 0;
+    while (len < (int)sizeof(buf) - 1) {
+        int n = recv(fd, buf + len, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (buf[len++] == '\n') break;
+    }
+    buf[len] = 0;
+    return strcmp(buf, "ok\n") ? -1 : 0;
+}
+
+static void set_timeouts(int fd) {
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    struct timeval tv = {CLUSTER_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
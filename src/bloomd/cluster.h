@@ -0,0 +1,116 @@
+#ifndef BLOOM_CLUSTER_H
+#define BLOOM_CLUSTER_H
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+
+/*
+ * A cluster is a set of nodes sharing a membership list, set
+ * by cluster_nodes. The filters are placed on the nodes by
+ * consistent hashing of their names, so every node agrees on
+ * where a filter lives without talking to the others, and
+ * adding a node only moves the filters it takes over.
+ *
+ * A node serves the filters it has. A command for a filter it
+ * does not have is answered with "MOVED host:port", naming the
+ * node the filter was migrated to, or else the node it hashes
+ * to. Clients follow the redirect and cache the placement.
+ *
+ * Filters are migrated between nodes by streaming their files to
+ * the cluster port of the target. The keys set while the files
+ * are streamed are recorded, and replayed on the target once it
+ * has loaded the filter. The source then redirects to the target,
+ * and remembers the move in the data dir across restarts.
+ */
+
+/**
+ * The most nodes in a cluster
+ */
+#define CLUSTER_MAX_NODES 64
+
+/**
+ * Opaque handle to the cluster
+ */
+typedef struct bloom_cluster bloom_cluster;
+
+/**
+ * Initializes the cluster from the cluster_nodes, and
+ * reads the filters that were migrated away from the data dir.
+ * @arg config The configuration
+ * @arg cluster Output, the cluster. Set to NULL if the
+ * node is not in a cluster.
+ * @return 0 on success.
+ */
+int init_cluster(bloom_config *config, bloom_cluster **cluster);
+
+/**
+ * Destroys a cluster
+ * @arg cluster The cluster, may be NULL
+ */
+void destroy_cluster(bloom_cluster *cluster);
+
+/**
+ * Returns the node a filter name hashes to.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @return The index of the node
+ */
+int cluster_owner(bloom_cluster *cluster, char *filter_name);
+
+/**
+ * Finds the node that serves a filter we do not have,
+ * to redirect a client to it.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @return The node as host:port, or NULL if the filter
+ * belongs on this node. Valid for the life of the cluster.
+ */
+const char* cluster_redirect(bloom_cluster *cluster, char *filter_name);
+
+/**
+ * Finds a node of the cluster.
+ * @arg cluster The cluster
+ * @arg addr The node as host:port
+ * @return The index of the node, or -1 if unknown.
+ */
+int cluster_find_node(bloom_cluster *cluster, char *addr);
+
+/**
+ * Queues a filter to be migrated to another node,
+ * by the migration thread.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @arg node The index of the target node
+ * @return 0 on success, -1 if the node is this node.
+ */
+int cluster_migrate(bloom_cluster *cluster, char *filter_name, int node);
+
+/**
+ * Records that a filter moved, so commands for it are
+ * redirected to its node. Moves to the node the filter hashes
+ * to are forgotten, since the hash already leads there.
+ * @arg cluster The cluster
+ * @arg filter_name The name of the filter
+ * @arg node The index of the node, or -1 if the filter
+ * moved to this node.
+ * @return 0 on success, -1 if the moves could not be saved.
+ */
+int cluster_set_moved(bloom_cluster *cluster, char *filter_name, int node);
+
+/**
+ * Starts the cluster threads. The listener receives the
+ * filters other nodes migrate to us on the cluster port,
+ * and the migrator streams the queued migrations.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg cluster The cluster, may be NULL
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the threads should exit.
+ * @arg listener The output listener thread
+ * @arg migrator The output migrator thread
+ * @return 1 if the threads were started
+ */
+int start_cluster_threads(bloom_config *config, bloom_filtmgr *mgr, bloom_cluster *cluster,
+        int *should_run, pthread_t *listener, pthread_t *migrator);
+
+#endif
@@ -1,14 +1,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 #include "config.h"
+#include "bloom.h"
 #include "ini.h"
+#include "numa.h"
+#include "uring.h"
 
 /**
  * Default bloom_config values. Should create
@@ -33,10 +39,143 @@ static const bloom_config DEFAULT_CONFIG = {
     0,                  // Do NOT use mmap by default
     0,                  // Do not enable memory checking by default
     80,                 // default max memory percent = 80%
-    60                  // default safe memory percent = 60%
-
+    60,                 // default safe memory percent = 60%
+    BLOOM_LAYOUT_PARTITIONED, // Partitioned filters by default
+    BLOOM_HASH_LEGACY,  // Hash with both murmur and spooky by default
+    0,                  // Do not use hugepages by default
+    0,                  // Accept on a single listener by default
+    0,                  // Use libev for client IO by default
+    1,                  // Flush with a single thread by default
+    0,                  // Do not rate limit flushes by default
+    0,                  // Only flush on the interval by default
+    0,                  // Do not log sets by default
+    10,                 // Sync the set log every 10 msec
+    0,                  // Do not compress cold filters by default
+    4,                  // Load existing filters with 4 threads
+    0,                  // Do not pre-warm filters by default
+    0,                  // No memory budget by default
+    0,                  // Filters do not rotate unless created to
+    24,                 // Rotating filters keep 24 generations by default
+    0,                  // Filters can not be frozen unless created to
+    0,                  // Filters have no summary by default
+    0,                  // Filters are not sharded unless created to
+    16,                 // Time one in 16 commands
+    0,                  // The slow log is disabled by default
+    128,                // Keep the last 128 slow commands
+    0,                  // Do not serve metrics by default
+    10,                 // Snapshot the metrics every 10 seconds
+    0,                  // Do not place threads and filters on NUMA nodes by default
+    1024,               // Interleave layers of 1GB or more
+    NULL,               // Workers are not pinned by default
+    NULL,               // Flush threads are not pinned by default
+    NULL,               // Cold unmap thread is not pinned by default
+    NULL,               // Vacuum thread is not pinned by default
+    0,                  // Workers sleep when idle by default
+    0,                  // Do not serve replicas by default
+    NULL,               // Do not replicate by default
+    64,                 // Keep 64MB of changes for the replicas
+    0,                  // Serve and change the filters by default
+    5,                  // Check for changes to shared filters every 5 seconds
+    NULL,               // Not in a cluster by default
+    NULL,
+    0,                  // Filters have no quota by default
+    0,                  // Prefixes have no quota by default
+    ":",                // Prefixes end at a colon, as in tenant:filter
+    0,                  // Reject sets that grow a filter over a quota
+    0,                  // Workers fault in the filters they use
+    0,                  // Each filter is synced as it is flushed
+    0,                  // Layers are written through the page cache
+    0,                  // Each layer is kept in its own file
+    WARMUP_WILLNEED,    // Read filters ahead in the background
+    0,                  // Every layer is kept in memory
+    0,                  // Older layers stay writable
+    1024,               // Handle up to 1024 keys per lock acquire
+    256,                // Handle 256 commands per turn of a connection
+    1024,               // Handle 1MB of input per turn of a connection
+    0,                  // Do not limit the commands of a connection
+    0,                  // Do not limit the keys of a connection
+    0,                  // Do not limit the keys of a filter
+    0,                  // Do not shed commands of busy workers
+    0,                  // Do not shed commands of connections with a backlog
+    0,                  // No priority lane
+    1,                  // A single worker for the priority lane
+    0,                  // Run the commands on the workers
+    1,                  // Park clients on filters being faulted in
+    1024,               // Queue up to 1024 connections to accept
+    0,                  // Accept connections without waiting for data
+    0,                  // No busy polling of the client sockets
+    0,                  // Default kernel send buffers
+    0,                  // Default kernel receive buffers
+    0,                  // Delayed acks
+    4,                  // 4KB connection buffers
+    8,                  // Grow connection buffers 8 times
+    NULL,               // No unix socket
+    NULL,               // No TLS certificate
+    NULL,               // No TLS key
+    20480,              // Cache 20K TLS sessions
+    NULL,               // No listener handoff
+    0,                  // Keys do not expire unless created to
+    0,                  // Probe the space-optimal number of bits by default
+    NULL,               // Do not capture the commands by default
+    CAPTURE_KEYS_HASH,  // Capture the hashes of the keys
+    0,                  // Do not cache the found keys
+    NULL,               // No shared memory clients
+    1024,               // 1MB rings
+    50,                 // Poll idle rings for 50 usec
+    0,                  // Do not checksum the pages by default
+    16,                 // Verify 16MB of pages a second
+    0,                  // Do not scan the resident pages by default
+    NULL,               // No key files can be loaded
+    NULL,               // Keep every filter in the data_dir
+    0,                  // Do not snapshot the in-memory filters by default
+    0,                  // New layers are dense, readable by older versions
+    0,                  // Cold filters are unmapped as they are
+    0,                  // New filters can be unmapped
+    NULL                // No templates
 };
 
+/*
+ * The binary record of a filter config. The fields have fixed
+ * sizes and are in the byte order of the host, since the data
+ * files of a filter are not portable between hosts either.
+ */
+#define FILTER_META_MAGIC 0x424c4d46    // "BLMF"
+#define FILTER_META_VERSION 3
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;                // Bytes of the record
+    uint64_t initial_capacity;
+    double default_probability;
+    double probability_reduction;
+    uint64_t summary_capacity;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t bytes;
+    int32_t scale_size;
+    int32_t in_memory;
+    int32_t layout;
+    int32_t hash_scheme;
+    int32_t rotate_window;
+    int32_t rotate_generations;
+    int32_t freezable;
+    int32_t frozen;
+    int32_t shards;
+    int32_t warmup;
+    int32_t key_ttl;
+    int32_t max_probes;             // Added in version 2
+    int32_t pinned;                 // Added in version 3
+    uint32_t checksum;              // FNV-1a of the preceding bytes
+} filter_meta_record;
+
+// Version 1 records end with the checksum in place of max_probes
+#define FILTER_META_V1_LENGTH (offsetof(filter_meta_record, max_probes) + sizeof(uint32_t))
+
+// Version 2 records end with the checksum in place of pinned, padded to 8 bytes
+#define FILTER_META_V2_LENGTH ((offsetof(filter_meta_record, pinned) + sizeof(uint32_t) + 7) & ~(size_t)7)
+
+static uint32_t meta_checksum(filter_meta_record *r, size_t len);
+
 /**
  * Attempts to convert a string to an integer,
  * and write the value out.
@@ -85,6 +224,130 @@ static int value_to_double(const char *val, double *result) {
     return 0;
 }
 
+/**
+ * Converts a filter layout name to its bloom_layout value.
+ * @arg name The name of the layout, "partitioned", "blocked", "counting", "aging" or "quotient"
+ * @return The layout, or -1 if the name is not known.
+ */
+int layout_from_name(const char *name) {
+    if (strcasecmp(name, "partitioned") == 0) {
+        return BLOOM_LAYOUT_PARTITIONED;
+    } else if (strcasecmp(name, "blocked") == 0) {
+        return BLOOM_LAYOUT_BLOCKED;
+    } else if (strcasecmp(name, "counting") == 0) {
+        return BLOOM_LAYOUT_COUNTING;
+    } else if (strcasecmp(name, "aging") == 0) {
+        return BLOOM_LAYOUT_AGING;
+    } else if (strcasecmp(name, "quotient") == 0) {
+        return BLOOM_LAYOUT_QUOTIENT;
+    }
+    return -1;
+}
+
+/**
+ * Converts a filter layout to its name.
+ * @arg layout The layout
+ * @return The name of the layout
+ */
+const char* layout_name(int layout) {
+    switch (layout) {
+        case BLOOM_LAYOUT_BLOCKED:
+            return "blocked";
+        case BLOOM_LAYOUT_COUNTING:
+            return "counting";
+        case BLOOM_LAYOUT_AGING:
+            return "aging";
+        case BLOOM_LAYOUT_QUOTIENT:
+            return "quotient";
+        default:
+            return "partitioned";
+    }
+}
+
+/**
+ * Converts a hash scheme name to its bloom_hash_scheme value.
+ * @arg name The name of the scheme, "legacy", "murmur", "crc32c" or "short"
+ * @return The scheme, or -1 if the name is not known.
+ */
+int hash_scheme_from_name(const char *name) {
+    if (strcasecmp(name, "legacy") == 0) {
+        return BLOOM_HASH_LEGACY;
+    } else if (strcasecmp(name, "murmur") == 0) {
+        return BLOOM_HASH_MURMUR;
+    } else if (strcasecmp(name, "crc32c") == 0) {
+        return BLOOM_HASH_CRC32C;
+    } else if (strcasecmp(name, "short") == 0) {
+        return BLOOM_HASH_SHORT;
+    }
+    return -1;
+}
+
+/**
+ * Converts a hash scheme to its name.
+ * @arg scheme The scheme
+ * @return The name of the scheme
+ */
+const char* hash_scheme_name(int scheme) {
+    switch (scheme) {
+        case BLOOM_HASH_MURMUR:
+            return "murmur";
+        case BLOOM_HASH_CRC32C:
+            return "crc32c";
+        case BLOOM_HASH_SHORT:
+            return "short";
+        default:
+            return "legacy";
+    }
+}
+
+/**
+ * Converts a warm-up name to its bloom_warmup value.
+ * @arg name The name of the warm-up, "willneed", "populate" or "lazy"
+ * @return The warm-up, or -1 if the name is not known.
+ */
+int warmup_from_name(const char *name) {
+    if (strcasecmp(name, "willneed") == 0) {
+        return WARMUP_WILLNEED;
+    } else if (strcasecmp(name, "populate") == 0) {
+        return WARMUP_POPULATE;
+    } else if (strcasecmp(name, "lazy") == 0) {
+        return WARMUP_LAZY;
+    }
+    return -1;
+}
+
+/**
+ * Converts a warm-up to its name.
+ * @arg warmup The warm-up
+ * @return The name of the warm-up
+ */
+const char* warmup_name(int warmup) {
+    switch (warmup) {
+        case WARMUP_POPULATE:
+            return "populate";
+        case WARMUP_LAZY:
+            return "lazy";
+        default:
+            return "willneed";
+    }
+}
+
+/**
+ * Converts a capture key mode name to its bloom_capture_keys value.
+ * @arg name The name of the mode, "none", "hash" or "raw"
+ * @return The mode, or -1 if the name is not known.
+ */
+int capture_keys_from_name(const char *name) {
+    if (strcasecmp(name, "none") == 0) {
+        return CAPTURE_KEYS_NONE;
+    } else if (strcasecmp(name, "hash") == 0) {
+        return CAPTURE_KEYS_HASH;
+    } else if (strcasecmp(name, "raw") == 0) {
+        return CAPTURE_KEYS_RAW;
+    }
+    return -1;
+}
+
 /**
  * Callback function to use with INI-H.
  * @arg user Opaque user value. We use the bloom_config pointer
@@ -94,14 +357,25 @@ static int value_to_double(const char *val, double *result) {
  * @return 1 on success.
  */
 static int config_callback(void* user, const char* section, const char* name, const char* value) {
+    // Cast the user handle
+    bloom_config *config = (bloom_config*)user;
+
+    // Each line of the templates is a name and its create options
+    if (strcasecmp("templates", section) == 0) {
+        bloom_template *t = calloc(1, sizeof(bloom_template));
+        if (!t) return 0;
+        t->name = strdup(name);
+        t->options = strdup(value);
+        t->next = config->templates;
+        config->templates = t;
+        return 1;
+    }
+
     // Ignore any non-bloomd sections
     if (strcasecmp("bloomd", section) != 0) {
         return 0;
     }
 
-    // Cast the user handle
-    bloom_config *config = (bloom_config*)user;
-
     // Switch on the config
     #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
 
@@ -114,6 +388,8 @@ static int config_callback(void* user, const char* section, const char* name, co
         return value_to_int(value, &config->udp_port);
     } else if (NAME_MATCH("scale_size")) {
         return value_to_int(value, &config->scale_size);
+    } else if (NAME_MATCH("max_probes")) {
+        return value_to_int(value, &config->max_probes);
     } else if (NAME_MATCH("flush_interval")) {
          return value_to_int(value, &config->flush_interval);
     } else if (NAME_MATCH("cold_interval")) {
@@ -122,8 +398,150 @@ static int config_callback(void* user, const char* section, const char* name, co
          return value_to_int(value, &config->in_memory);
     } else if (NAME_MATCH("use_mmap")) {
          return value_to_int(value, &config->use_mmap);
+    } else if (NAME_MATCH("use_hugepages")) {
+         return value_to_int(value, &config->use_hugepages);
+    } else if (NAME_MATCH("use_reuseport")) {
+         return value_to_int(value, &config->use_reuseport);
+    } else if (NAME_MATCH("use_io_uring")) {
+         return value_to_int(value, &config->use_io_uring);
     } else if (NAME_MATCH("workers")) {
          return value_to_int(value, &config->worker_threads);
+    } else if (NAME_MATCH("flush_threads")) {
+         return value_to_int(value, &config->flush_threads);
+    } else if (NAME_MATCH("flush_rate_limit")) {
+         return value_to_int(value, &config->flush_rate_limit);
+    } else if (NAME_MATCH("flush_dirty_mb")) {
+         return value_to_int(value, &config->flush_dirty_mb);
+    } else if (NAME_MATCH("use_set_log")) {
+         return value_to_int(value, &config->use_set_log);
+    } else if (NAME_MATCH("set_log_sync_msec")) {
+         return value_to_int(value, &config->set_log_sync_msec);
+    } else if (NAME_MATCH("compress_cold")) {
+         return value_to_int(value, &config->compress_cold);
+    } else if (NAME_MATCH("load_threads")) {
+         return value_to_int(value, &config->load_threads);
+    } else if (NAME_MATCH("prewarm")) {
+         return value_to_int(value, &config->prewarm);
+    } else if (NAME_MATCH("memory_budget_mb")) {
+         return value_to_int(value, &config->memory_budget_mb);
+    } else if (NAME_MATCH("latency_sample")) {
+         return value_to_int(value, &config->latency_sample);
+    } else if (NAME_MATCH("slowlog_usec")) {
+         return value_to_int(value, &config->slowlog_usec);
+    } else if (NAME_MATCH("slowlog_size")) {
+         return value_to_int(value, &config->slowlog_size);
+    } else if (NAME_MATCH("metrics_port")) {
+         return value_to_int(value, &config->metrics_port);
+    } else if (NAME_MATCH("metrics_interval")) {
+         return value_to_int(value, &config->metrics_interval);
+    } else if (NAME_MATCH("use_numa")) {
+         return value_to_int(value, &config->use_numa);
+    } else if (NAME_MATCH("numa_interleave_mb")) {
+         return value_to_int(value, &config->numa_interleave_mb);
+    } else if (NAME_MATCH("busy_poll_usec")) {
+         return value_to_int(value, &config->busy_poll_usec);
+    } else if (NAME_MATCH("replication_port")) {
+         return value_to_int(value, &config->replication_port);
+    } else if (NAME_MATCH("replication_buffer_mb")) {
+         return value_to_int(value, &config->replication_buffer_mb);
+    } else if (NAME_MATCH("read_only")) {
+         return value_to_int(value, &config->read_only);
+    } else if (NAME_MATCH("refresh_interval")) {
+         return value_to_int(value, &config->refresh_interval);
+    } else if (NAME_MATCH("filter_quota_mb")) {
+         return value_to_int(value, &config->filter_quota_mb);
+    } else if (NAME_MATCH("prefix_quota_mb")) {
+         return value_to_int(value, &config->prefix_quota_mb);
+    } else if (NAME_MATCH("quota_degrade")) {
+         return value_to_int(value, &config->quota_degrade);
+    } else if (NAME_MATCH("fault_retry")) {
+         return value_to_int(value, &config->fault_retry);
+    } else if (NAME_MATCH("flush_syncfs")) {
+         return value_to_int(value, &config->flush_syncfs);
+    } else if (NAME_MATCH("use_direct_io")) {
+         return value_to_int(value, &config->use_direct_io);
+    } else if (NAME_MATCH("pack_layers")) {
+         return value_to_int(value, &config->pack_layers);
+    } else if (NAME_MATCH("tier_layers")) {
+         return value_to_int(value, &config->tier_layers);
+    } else if (NAME_MATCH("seal_layers")) {
+         return value_to_int(value, &config->seal_layers);
+    } else if (NAME_MATCH("multi_batch_size")) {
+         return value_to_int(value, &config->multi_batch_size);
+    } else if (NAME_MATCH("command_budget")) {
+         return value_to_int(value, &config->command_budget);
+    } else if (NAME_MATCH("command_budget_kb")) {
+         return value_to_int(value, &config->command_budget_kb);
+    } else if (NAME_MATCH("conn_command_rate")) {
+         return value_to_int(value, &config->conn_command_rate);
+    } else if (NAME_MATCH("conn_key_rate")) {
+         return value_to_int(value, &config->conn_key_rate);
+    } else if (NAME_MATCH("filter_key_rate")) {
+         return value_to_int(value, &config->filter_key_rate);
+    } else if (NAME_MATCH("shed_backlog")) {
+         return value_to_int(value, &config->shed_backlog);
+    } else if (NAME_MATCH("shed_input_kb")) {
+         return value_to_int(value, &config->shed_input_kb);
+    } else if (NAME_MATCH("priority_port")) {
+         return value_to_int(value, &config->priority_port);
+    } else if (NAME_MATCH("priority_workers")) {
+         return value_to_int(value, &config->priority_workers);
+    } else if (NAME_MATCH("exec_threads")) {
+         return value_to_int(value, &config->exec_threads);
+    } else if (NAME_MATCH("fault_park")) {
+         return value_to_int(value, &config->fault_park);
+    } else if (NAME_MATCH("tcp_backlog")) {
+         return value_to_int(value, &config->tcp_backlog);
+    } else if (NAME_MATCH("positive_cache")) {
+         return value_to_int(value, &config->positive_cache);
+    } else if (NAME_MATCH("shm_ring_kb")) {
+         return value_to_int(value, &config->shm_ring_kb);
+    } else if (NAME_MATCH("shm_spin_usec")) {
+         return value_to_int(value, &config->shm_spin_usec);
+    } else if (NAME_MATCH("page_checksums")) {
+         return value_to_int(value, &config->page_checksums);
+    } else if (NAME_MATCH("scrub_rate_mb")) {
+         return value_to_int(value, &config->scrub_rate_mb);
+    } else if (NAME_MATCH("residency_interval")) {
+         return value_to_int(value, &config->residency_interval);
+    } else if (NAME_MATCH("snapshot_interval")) {
+         return value_to_int(value, &config->snapshot_interval);
+    } else if (NAME_MATCH("sparse_layers")) {
+         return value_to_int(value, &config->sparse_layers);
+    } else if (NAME_MATCH("auto_shrink")) {
+         return value_to_int(value, &config->auto_shrink);
+    } else if (NAME_MATCH("tcp_defer_accept")) {
+         return value_to_int(value, &config->tcp_defer_accept);
+    } else if (NAME_MATCH("tcp_busy_poll_usec")) {
+         return value_to_int(value, &config->tcp_busy_poll_usec);
+    } else if (NAME_MATCH("tcp_sndbuf_kb")) {
+         return value_to_int(value, &config->tcp_sndbuf_kb);
+    } else if (NAME_MATCH("tcp_rcvbuf_kb")) {
+         return value_to_int(value, &config->tcp_rcvbuf_kb);
+    } else if (NAME_MATCH("tcp_quickack")) {
+         return value_to_int(value, &config->tcp_quickack);
+    } else if (NAME_MATCH("conn_buf_kb")) {
+         return value_to_int(value, &config->conn_buf_kb);
+    } else if (NAME_MATCH("conn_buf_multiplier")) {
+         return value_to_int(value, &config->conn_buf_multiplier);
+    } else if (NAME_MATCH("unix_socket")) {
+        config->unix_socket = strdup(value);
+    } else if (NAME_MATCH("tls_cert_file")) {
+        config->tls_cert_file = strdup(value);
+    } else if (NAME_MATCH("tls_key_file")) {
+        config->tls_key_file = strdup(value);
+    } else if (NAME_MATCH("tls_session_cache")) {
+         return value_to_int(value, &config->tls_session_cache);
+    } else if (NAME_MATCH("handoff_socket")) {
+        config->handoff_socket = strdup(value);
+    } else if (NAME_MATCH("capture_file")) {
+        config->capture_file = strdup(value);
+    } else if (NAME_MATCH("shm_socket")) {
+        config->shm_socket = strdup(value);
+    } else if (NAME_MATCH("load_dir")) {
+        config->load_dir = strdup(value);
+    } else if (NAME_MATCH("data_dirs")) {
+        config->data_dirs = strdup(value);
     } else if (NAME_MATCH("memory_check")) {
         return value_to_int(value, &config->memory_check);
     } else if (NAME_MATCH("max_memory_percent")) {
@@ -134,6 +552,8 @@ static int config_callback(void* user, const char* section, const char* name, co
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
          return value_to_int64(value, &config->initial_capacity);
+    } else if (NAME_MATCH("summary_capacity")) {
+         return value_to_int64(value, &config->summary_capacity);
 
     // Handle the double cases
     } else if (NAME_MATCH("default_probability")) {
@@ -148,6 +568,30 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("worker_cpus")) {
+        config->worker_cpus = strdup(value);
+    } else if (NAME_MATCH("flush_cpus")) {
+        config->flush_cpus = strdup(value);
+    } else if (NAME_MATCH("unmap_cpus")) {
+        config->unmap_cpus = strdup(value);
+    } else if (NAME_MATCH("vacuum_cpus")) {
+        config->vacuum_cpus = strdup(value);
+    } else if (NAME_MATCH("replicate_from")) {
+        config->replicate_from = strdup(value);
+    } else if (NAME_MATCH("cluster_nodes")) {
+        config->cluster_nodes = strdup(value);
+    } else if (NAME_MATCH("cluster_self")) {
+        config->cluster_self = strdup(value);
+    } else if (NAME_MATCH("quota_separator")) {
+        config->quota_separator = strdup(value);
+    } else if (NAME_MATCH("layout")) {
+        config->layout = layout_from_name(value);
+    } else if (NAME_MATCH("hash_scheme")) {
+        config->hash_scheme = hash_scheme_from_name(value);
+    } else if (NAME_MATCH("warmup")) {
+        config->warmup = warmup_from_name(value);
+    } else if (NAME_MATCH("capture_keys")) {
+        config->capture_keys = capture_keys_from_name(value);
 
     // Unknown parameter?
     } else {
@@ -209,6 +653,30 @@ char* join_path(char *path, char *part2) {
     return buf;
 }
 
+/**
+ * Lists the directories filters are stored in, the
+ * data_dir followed by each of the data_dirs.
+ * @param config The configuration
+ * @param buf Output, a malloc()'d buffer the directories
+ * point into, which must be freed.
+ * @param dirs Output, room for MAX_DATA_DIRS directories
+ * @return The number of directories, at least 1.
+ */
+int data_dir_list(bloom_config *config, char **buf, char **dirs) {
+    int num = 0;
+    dirs[num++] = config->data_dir;
+    *buf = (config->data_dirs) ? strdup(config->data_dirs) : NULL;
+    char *save = NULL;
+    for (char *d = (*buf) ? strtok_r(*buf, ",", &save) : NULL;
+            d && num < MAX_DATA_DIRS; d = strtok_r(NULL, ",", &save)) {
+        while (*d == ' ') d++;
+        int len = strlen(d);
+        while (len && d[len - 1] == ' ') d[--len] = 0;
+        if (len) dirs[num++] = d;
+    }
+    return num;
+}
+
 int sane_data_dir(char *data_dir) {
     // Check if the path exists, and it is not a dir
     struct stat buf;
@@ -376,6 +844,45 @@ int sane_use_mmap(int use_mmap) {
     return 0;
 }
 
+int sane_use_hugepages(int use_hugepages) {
+    if (use_hugepages != 0 && use_hugepages != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_hugepages. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_reuseport(int use_reuseport) {
+    if (use_reuseport != 0 && use_reuseport != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_reuseport. Must be 0 or 1.");
+        return 1;
+    }
+#ifndef SO_REUSEPORT
+    if (use_reuseport) {
+        syslog(LOG_ERR,
+               "use_reuseport is not supported on this platform.");
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int sane_use_io_uring(int use_io_uring) {
+    if (use_io_uring != 0 && use_io_uring != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_io_uring. Must be 0 or 1.");
+        return 1;
+    }
+    if (use_io_uring && !uring_supported()) {
+        syslog(LOG_ERR,
+               "use_io_uring is not supported on this system.");
+        return 1;
+    }
+    return 0;
+}
+
 int sane_worker_threads(int threads) {
     if (threads <= 0) {
         syslog(LOG_ERR,
@@ -385,136 +892,1312 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_flush_threads(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR,
+               "Cannot have fewer than one flush thread!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_ERR,
+               "Cannot have more than 64 flush threads!");
+        return 1;
+    }
+    return 0;
+}
 
-/**
- * Validates the configuration
- * @arg config The config object to validate.
- * @return 0 on success.
- */
-int validate_config(bloom_config *config) {
-    int res = 0;
-
-    res |= sane_data_dir(config->data_dir);
-    res |= sane_log_level(config->log_level, &config->syslog_log_level);
-    res |= sane_initial_capacity(config->initial_capacity);
-    res |= sane_default_probability(config->default_probability);
-    res |= sane_scale_size(config->scale_size);
-    res |= sane_probability_reduction(config->probability_reduction);
-    res |= sane_flush_interval(config->flush_interval);
-    res |= sane_cold_interval(config->cold_interval);
-    res |= sane_in_memory(config->in_memory);
-    res |= sane_use_mmap(config->use_mmap);
-    res |= sane_worker_threads(config->worker_threads);
-
-    return res;
+int sane_load_threads(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR,
+               "Cannot have fewer than one load thread!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_ERR,
+               "Cannot have more than 64 load threads!");
+        return 1;
+    }
+    return 0;
 }
 
-/**
- * Callback function to use with INI-H.
- * @arg user Opaque user value. We use the bloom_config pointer
- * @arg section The INI seciton
- * @arg name The config name
- * @arg value The config value
- * @return 1 on success.
- */
-static int filter_config_callback(void* user, const char* section, const char* name, const char* value) {
-    // Ignore any non-bloomd sections
-    if (strcasecmp("bloomd", section) != 0) {
-        return 0;
+int sane_prewarm(int prewarm) {
+    if (prewarm != 0 && prewarm != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for prewarm. Must be 0 or 1.");
+        return 1;
     }
+    return 0;
+}
 
-    // Cast the user handle
-    bloom_filter_config *config = (bloom_filter_config*)user;
+int sane_memory_budget_mb(int budget) {
+    if (budget < 0) {
+        syslog(LOG_ERR, "Memory budget cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Switch on the config
-    #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
+int sane_rotate_window(int window) {
+    if (window < 0) {
+        syslog(LOG_ERR, "Rotation window cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Handle the int cases
-    if (NAME_MATCH("scale_size")) {
-        return value_to_int(value, &config->scale_size);
-    } else if (NAME_MATCH("in_memory")) {
-         return value_to_int(value, &config->in_memory);
+int sane_key_ttl(int ttl, int layout) {
+    if (ttl < 0) {
+        syslog(LOG_ERR, "Key TTL cannot be negative!");
+        return 1;
+    }
+    if ((ttl > 0) != (layout == BLOOM_LAYOUT_AGING)) {
+        syslog(LOG_ERR, "Aging filters must have a key TTL, and other filters can not!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Handle the int64 cases
-    } else if (NAME_MATCH("initial_capacity")) {
-         return value_to_int64(value, &config->initial_capacity);
-    } else if (NAME_MATCH("size")) {
-         return value_to_int64(value, &config->size);
-    } else if (NAME_MATCH("capacity")) {
-         return value_to_int64(value, &config->capacity);
-    } else if (NAME_MATCH("bytes")) {
-         return value_to_int64(value, &config->bytes);
+int sane_freezable(int freezable) {
+    if (freezable != 0 && freezable != 1) {
+        syslog(LOG_ERR, "Freezable must be 0 or 1!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Handle the double cases
-    } else if (NAME_MATCH("default_probability")) {
-         return value_to_double(value, &config->default_probability);
-    } else if (NAME_MATCH("probability_reduction")) {
-         return value_to_double(value, &config->probability_reduction);
+int sane_pinned(int pinned) {
+    if (pinned != 0 && pinned != 1) {
+        syslog(LOG_ERR, "Pinned must be 0 or 1!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Unknown parameter?
-    } else {
-        // Log it, but ignore
-        syslog(LOG_NOTICE, "Unrecognized filter config parameter: %s", value);
+int sane_summary_capacity(int64_t summary_capacity) {
+    if (summary_capacity < 0 || (summary_capacity && summary_capacity < 10000)) {
+        syslog(LOG_ERR,
+               "Summary capacity must be 0, or at least 10K!");
+        return 1;
     }
+    return 0;
+}
 
-    // Success
-    return 1;
+int sane_max_probes(int probes) {
+    if (probes < 0 || probes > MAX_FILTER_PROBES) {
+        syslog(LOG_ERR, "Max probes must be at most %d, or 0 for the space-optimal number!",
+               MAX_FILTER_PROBES);
+        return 1;
+    }
+    return 0;
 }
 
-/**
- * Updates the configuration from a filename.
- * Reads the file as an INI configuration and updates the config.
- * @arg filename The name of the file to read.
- * @arg config Output. The config object to update. Does not initialize!
- * @return 0 on success, negative on error.
- */
-int filter_config_from_filename(char *filename, bloom_filter_config *config) {
-    // If there is no filename, return now
-    if (filename == NULL)
-        return 0;
+int sane_shards(int shards) {
+    if (shards < 0 || shards > MAX_FILTER_SHARDS) {
+        syslog(LOG_ERR, "Sharded filters must have at most %d shards!",
+               MAX_FILTER_SHARDS);
+        return 1;
+    }
+    return 0;
+}
 
-    // Try to open the file
-    int res = ini_parse(filename, filter_config_callback, config);
-    if (res == -1) {
-        return -ENOENT;
+int sane_latency_sample(int sample) {
+    if (sample < 0) {
+        syslog(LOG_ERR,
+               "Latency sample must be positive, or 0 to disable!");
+        return 1;
     }
+    return 0;
+}
 
+int sane_slowlog(int usec, int size) {
+    if (usec < 0) {
+        syslog(LOG_ERR,
+               "Slow log threshold must be positive, or 0 to disable!");
+        return 1;
+    }
+    if (size < 1 || size > 65536) {
+        syslog(LOG_ERR, "Slow log size must be between 1 and 65536!");
+        return 1;
+    }
     return 0;
 }
 
-/**
- * Writes the configuration to a filename.
- * Writes the file as an INI configuration
- * @arg filename The name of the file to write.
- * @arg config The config object to write out.
- * @return 0 on success, negative on error.
- */
-int update_filename_from_filter_config(char *filename, bloom_filter_config *config) {
-    // Try to open the file
-    FILE* f = fopen(filename, "w+");
-    if (!f) return -errno;
+int sane_metrics_port(int port) {
+    if (port < 0 || port > 65535) {
+        syslog(LOG_ERR, "Metrics port must be between 0 and 65535!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Write out
-    fprintf(f, "[bloomd]\n\
-initial_capacity = %llu\n\
-default_probability = %f\n\
-scale_size = %d\n\
-probability_reduction = %f\n\
-in_memory = %d\n\
-size = %llu\n\
-capacity = %llu\n\
-bytes = %llu\n", (unsigned long long)config->initial_capacity,
-                 config->default_probability,
-                 config->scale_size,
-                 config->probability_reduction,
-                 config->in_memory,
-                 (unsigned long long)config->size,
-                 (unsigned long long)config->capacity,
-                 (unsigned long long)config->bytes
-    );
+int sane_metrics_interval(int interval) {
+    if (interval <= 0) {
+        syslog(LOG_ERR, "Metrics interval must be positive!");
+        return 1;
+    }
+    return 0;
+}
 
-    // Close
-    fclose(f);
+int sane_use_numa(int use_numa) {
+    if (use_numa != 0 && use_numa != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_numa. Must be 0 or 1.");
+        return 1;
+    }
     return 0;
 }
 
+int sane_numa_interleave_mb(int mb) {
+    if (mb < 0) {
+        syslog(LOG_ERR, "NUMA interleave size cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cpu_list(const char *name, const char *list) {
+    if (list && numa_parse_cpus(list, NULL, 0) <= 0) {
+        syslog(LOG_ERR,
+               "Illegal value for %s. Must be a list of CPUs, such as 0-3,8.", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_busy_poll_usec(int usec) {
+    if (usec < 0) {
+        syslog(LOG_ERR, "Busy poll time cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replication_port(int port) {
+    if (port < 0 || port > 65535) {
+        syslog(LOG_ERR, "Replication port must be between 0 and 65535!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replicate_from(const char *primary) {
+    if (!primary) return 0;
+    const char *sep = strrchr(primary, ':');
+    int port = (sep) ? atoi(sep + 1) : 0;
+    if (!sep || sep == primary || port <= 0 || port > 65535) {
+        syslog(LOG_ERR, "Illegal value for replicate_from. Must be host:port.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_replication_buffer_mb(int mb) {
+    if (mb < 1) {
+        syslog(LOG_ERR, "Replication buffer must be at least 1MB!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_read_only(int read_only) {
+    if (read_only != 0 && read_only != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for read_only. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_refresh_interval(int interval) {
+    if (interval < 1) {
+        syslog(LOG_ERR, "Refresh interval must be at least 1 second!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_quota_mb(const char *name, int mb) {
+    if (mb < 0) {
+        syslog(LOG_ERR, "%s cannot be negative!", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_quota_separator(const char *separator) {
+    if (!separator || !*separator) {
+        syslog(LOG_ERR, "quota_separator must have at least one character!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_quota_degrade(int degrade) {
+    if (degrade != 0 && degrade != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for quota_degrade. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_fault_retry(int retry) {
+    if (retry != 0 && retry != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for fault_retry. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_syncfs(int syncfs) {
+    if (syncfs != 0 && syncfs != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for flush_syncfs. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_direct_io(int direct_io) {
+    if (direct_io != 0 && direct_io != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_direct_io. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_warmup(int warmup) {
+    if (warmup != WARMUP_WILLNEED && warmup != WARMUP_POPULATE && warmup != WARMUP_LAZY) {
+        syslog(LOG_ERR,
+               "Illegal value for warmup. Must be willneed, populate or lazy.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_capture_keys(int keys) {
+    if (keys != CAPTURE_KEYS_NONE && keys != CAPTURE_KEYS_HASH && keys != CAPTURE_KEYS_RAW) {
+        syslog(LOG_ERR,
+               "Illegal value for capture_keys. Must be none, hash or raw.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_positive_cache(int entries) {
+    if (entries < 0 || entries > (1 << 24) || (entries & (entries - 1))) {
+        syslog(LOG_ERR,
+               "Illegal value for positive_cache. Must be 0 or a power of 2 up to 16777216.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_pack_layers(int pack_layers) {
+    if (pack_layers != 0 && pack_layers != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for pack_layers. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tier_layers(int tier_layers) {
+    if (tier_layers < 0) {
+        syslog(LOG_ERR,
+               "Illegal value for tier_layers. Must be at least 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_seal_layers(int seal_layers) {
+    if (seal_layers != 0 && seal_layers != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for seal_layers. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_multi_batch_size(int size) {
+    if (size < 32 || size > 65536) {
+        syslog(LOG_ERR,
+               "Illegal value for multi_batch_size. Must be between 32 and 65536.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_command_budget(const char *name, int budget) {
+    if (budget < 0) {
+        syslog(LOG_ERR, "Illegal value for %s. Must be at least 0.", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_rate_limit(const char *name, int limit) {
+    if (limit < 0) {
+        syslog(LOG_ERR, "Illegal value for %s. Must be at least 0.", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_priority_port(int port, int tcp_port) {
+    if (port < 0 || port > 65535) {
+        syslog(LOG_ERR, "Illegal value for priority_port. Must be between 0 and 65535.");
+        return 1;
+    } else if (port && port == tcp_port) {
+        syslog(LOG_ERR, "The priority_port must differ from the tcp_port!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_priority_workers(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR,
+               "Cannot have fewer than one priority worker!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_exec_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR, "Illegal value for exec_threads. Must be at least 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_fault_park(int park) {
+    if (park != 0 && park != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for fault_park. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tcp_backlog(int backlog) {
+    if (backlog <= 0) {
+        syslog(LOG_ERR, "Illegal value for tcp_backlog. Must be greater than 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tcp_option(const char *name, int value) {
+    if (value < 0) {
+        syslog(LOG_ERR, "Illegal value for %s. Must be at least 0.", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tcp_quickack(int quickack) {
+    if (quickack != 0 && quickack != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for tcp_quickack. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_conn_buf(int kb, int multiplier) {
+    // Input buffers are mirrored, which needs whole pages
+    if (kb < 4 || kb % 4 || kb > 65536) {
+        syslog(LOG_ERR,
+               "Illegal value for conn_buf_kb. Must be a multiple of 4, up to 65536.");
+        return 1;
+    }
+    if (multiplier < 2 || multiplier > 64) {
+        syslog(LOG_ERR,
+               "Illegal value for conn_buf_multiplier. Must be between 2 and 64.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_unix_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (path && (!*path || strlen(path) >= sizeof(addr.sun_path))) {
+        syslog(LOG_ERR,
+               "Illegal value for unix_socket. Must be a path of at most %d characters.",
+               (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tls(const char *cert_file, const char *key_file, int session_cache, int use_io_uring) {
+    if (!cert_file && !key_file) return 0;
+    if (!cert_file || !key_file) {
+        syslog(LOG_ERR, "TLS needs both tls_cert_file and tls_key_file!");
+        return 1;
+    }
+    if (access(cert_file, R_OK) || access(key_file, R_OK)) {
+        syslog(LOG_ERR, "Can not read the TLS certificate or key! Err: %s", strerror(errno));
+        return 1;
+    }
+    if (session_cache < 0) {
+        syslog(LOG_ERR, "Illegal value for tls_session_cache. Must be at least 0.");
+        return 1;
+    }
+    // The handshake is done on the socket before a ring takes over
+    if (use_io_uring) {
+        syslog(LOG_ERR, "TLS can not be used with use_io_uring!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_handoff_socket(const char *path, const char *unix_socket) {
+    struct sockaddr_un addr;
+    if (!path) return 0;
+    if (!*path || strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR,
+               "Illegal value for handoff_socket. Must be a path of at most %d characters.",
+               (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    if (unix_socket && !strcmp(path, unix_socket)) {
+        syslog(LOG_ERR, "The handoff_socket can not be the unix_socket!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shm(const char *path, const char *unix_socket, const char *handoff_socket,
+        int ring_kb, int spin_usec) {
+    struct sockaddr_un addr;
+    if (!path) return 0;
+    if (!*path || strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR,
+               "Illegal value for shm_socket. Must be a path of at most %d characters.",
+               (int)sizeof(addr.sun_path) - 1);
+        return 1;
+    }
+    if ((unix_socket && !strcmp(path, unix_socket)) ||
+            (handoff_socket && !strcmp(path, handoff_socket))) {
+        syslog(LOG_ERR, "The shm_socket can not be the unix_socket or handoff_socket!");
+        return 1;
+    }
+    if (ring_kb < 64 || ring_kb > (1 << 20) || (ring_kb & (ring_kb - 1))) {
+        syslog(LOG_ERR,
+               "Illegal value for shm_ring_kb. Must be a power of 2 from 64 to 1048576.");
+        return 1;
+    }
+    if (spin_usec < 0) {
+        syslog(LOG_ERR, "Illegal value for shm_spin_usec. Must be at least 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_page_checksums(int page_checksums, int scrub_rate_mb) {
+    if (page_checksums != 0 && page_checksums != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for page_checksums. Must be 0 or 1.");
+        return 1;
+    }
+    if (scrub_rate_mb < 0) {
+        syslog(LOG_ERR, "Illegal value for scrub_rate_mb. Must be at least 0.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_residency_interval(int interval) {
+    if (interval < 0) {
+        syslog(LOG_ERR, "Residency interval must be positive, or 0 to disable!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_snapshot_interval(int interval) {
+    if (interval < 0) {
+        syslog(LOG_ERR, "Snapshot interval must be positive, or 0 to disable!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_sparse_layers(int sparse_layers) {
+    if (sparse_layers != 0 && sparse_layers != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for sparse_layers. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_auto_shrink(int auto_shrink) {
+    if (auto_shrink != 0 && auto_shrink != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for auto_shrink. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_load_dir(const char *dir) {
+    if (dir && *dir != '/') {
+        syslog(LOG_ERR, "Illegal value for load_dir. Must be an absolute path.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_data_dirs(const char *data_dir, const char *dirs) {
+    if (!dirs) return 0;
+    bloom_config config;
+    memset(&config, 0, sizeof(config));
+    config.data_dir = (char*)data_dir;
+    config.data_dirs = (char*)dirs;
+    char *buf, *list[MAX_DATA_DIRS];
+    int num = data_dir_list(&config, &buf, list);
+
+    // Each is made and checked like the data_dir
+    int res = 0, commas = 0;
+    for (const char *c = dirs; *c; c++) commas += (*c == ',');
+    if (commas + 2 > MAX_DATA_DIRS) {
+        syslog(LOG_ERR, "Illegal value for data_dirs. At most %d directories.", MAX_DATA_DIRS - 1);
+        res = 1;
+    }
+    for (int i=1; i < num && !res; i++) {
+        if (*list[i] != '/') {
+            syslog(LOG_ERR, "Illegal value for data_dirs. Each must be an absolute path.");
+            res = 1;
+        } else {
+            res = sane_data_dir(list[i]);
+        }
+    }
+    free(buf);
+    return res;
+}
+
+int sane_cluster(const char *nodes, const char *self) {
+    if (!nodes && !self) return 0;
+    if (!nodes || !self) {
+        syslog(LOG_ERR, "cluster_nodes and cluster_self must be set together!");
+        return 1;
+    }
+
+    // Each node is host:port:cluster_port, and we must be one of them
+    char *list = strdup(nodes), *rest = list, *node;
+    int res = 0, found = 0;
+    while (!res && (node = strsep(&rest, ","))) {
+        while (*node == ' ') node++;
+        char host[256], addr[320], tail;
+        int port, cluster_port;
+        if (sscanf(node, "%255[^:]:%d:%d %c", host, &port, &cluster_port, &tail) != 3 ||
+                port <= 0 || port > 65535 || cluster_port <= 0 || cluster_port > 65535) {
+            syslog(LOG_ERR, "Illegal cluster node '%s'. Must be host:port:cluster_port.", node);
+            res = 1;
+            break;
+        }
+        snprintf(addr, sizeof(addr), "%s:%d", host, port);
+        if (!strcmp(addr, self)) found = 1;
+    }
+    free(list);
+    if (!res && !found) {
+        syslog(LOG_ERR, "cluster_self must be the host:port of one of the cluster_nodes!");
+        res = 1;
+    }
+    return res;
+}
+
+int sane_rotate_generations(int generations) {
+    if (generations < 1 || generations > MAX_ROTATE_GENERATIONS) {
+        syslog(LOG_ERR, "Rotating filters must have between 1 and %d generations!",
+               MAX_ROTATE_GENERATIONS);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_rate_limit(int limit) {
+    if (limit < 0) {
+        syslog(LOG_ERR, "Flush rate limit cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_dirty_mb(int mb) {
+    if (mb < 0) {
+        syslog(LOG_ERR, "Flush dirty threshold cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_use_set_log(int use_set_log) {
+    if (use_set_log != 0 && use_set_log != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for use_set_log. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_set_log_sync_msec(int msec) {
+    if (msec <= 0) {
+        syslog(LOG_ERR, "Set log sync interval must be positive!");
+        return 1;
+    } else if (msec > 60000) {
+        syslog(LOG_ERR, "Set log sync interval cannot exceed 60000 msec!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_compress_cold(int compress) {
+    if (compress != 0 && compress != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for compress_cold. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_layout(int layout) {
+    if (layout != BLOOM_LAYOUT_PARTITIONED && layout != BLOOM_LAYOUT_BLOCKED &&
+            layout != BLOOM_LAYOUT_COUNTING && layout != BLOOM_LAYOUT_AGING &&
+            layout != BLOOM_LAYOUT_QUOTIENT) {
+        syslog(LOG_ERR,
+               "Illegal value for layout. Must be partitioned, blocked, counting, aging or quotient.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_hash_scheme(int scheme) {
+    if (scheme != BLOOM_HASH_LEGACY && scheme != BLOOM_HASH_MURMUR &&
+            scheme != BLOOM_HASH_CRC32C && scheme != BLOOM_HASH_SHORT) {
+        syslog(LOG_ERR,
+               "Illegal value for hash_scheme. Must be legacy, murmur, crc32c or short.");
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Validates the configuration
+ * @arg config The config object to validate.
+ * @return 0 on success.
+ */
+int validate_config(bloom_config *config) {
+    int res = 0;
+
+    res |= sane_data_dir(config->data_dir);
+    res |= sane_log_level(config->log_level, &config->syslog_log_level);
+    res |= sane_initial_capacity(config->initial_capacity);
+    res |= sane_default_probability(config->default_probability);
+    res |= sane_scale_size(config->scale_size);
+    res |= sane_probability_reduction(config->probability_reduction);
+    res |= sane_flush_interval(config->flush_interval);
+    res |= sane_cold_interval(config->cold_interval);
+    res |= sane_in_memory(config->in_memory);
+    res |= sane_use_mmap(config->use_mmap);
+    res |= sane_use_hugepages(config->use_hugepages);
+    res |= sane_use_reuseport(config->use_reuseport);
+    res |= sane_use_io_uring(config->use_io_uring);
+    res |= sane_worker_threads(config->worker_threads);
+    res |= sane_flush_threads(config->flush_threads);
+    res |= sane_flush_rate_limit(config->flush_rate_limit);
+    res |= sane_flush_dirty_mb(config->flush_dirty_mb);
+    res |= sane_use_set_log(config->use_set_log);
+    res |= sane_set_log_sync_msec(config->set_log_sync_msec);
+    res |= sane_compress_cold(config->compress_cold);
+    res |= sane_load_threads(config->load_threads);
+    res |= sane_prewarm(config->prewarm);
+    res |= sane_memory_budget_mb(config->memory_budget_mb);
+    res |= sane_rotate_window(config->rotate_window);
+    res |= sane_rotate_generations(config->rotate_generations);
+    res |= sane_key_ttl(config->key_ttl, config->layout);
+    res |= sane_max_probes(config->max_probes);
+    res |= sane_freezable(config->freezable);
+    res |= sane_pinned(config->pinned);
+    res |= sane_summary_capacity(config->summary_capacity);
+    res |= sane_shards(config->shards);
+    res |= sane_latency_sample(config->latency_sample);
+    res |= sane_slowlog(config->slowlog_usec, config->slowlog_size);
+    res |= sane_metrics_port(config->metrics_port);
+    res |= sane_metrics_interval(config->metrics_interval);
+    res |= sane_use_numa(config->use_numa);
+    res |= sane_numa_interleave_mb(config->numa_interleave_mb);
+    res |= sane_cpu_list("worker_cpus", config->worker_cpus);
+    res |= sane_cpu_list("flush_cpus", config->flush_cpus);
+    res |= sane_cpu_list("unmap_cpus", config->unmap_cpus);
+    res |= sane_cpu_list("vacuum_cpus", config->vacuum_cpus);
+    res |= sane_busy_poll_usec(config->busy_poll_usec);
+    res |= sane_replication_port(config->replication_port);
+    res |= sane_replicate_from(config->replicate_from);
+    res |= sane_replication_buffer_mb(config->replication_buffer_mb);
+    res |= sane_read_only(config->read_only);
+    res |= sane_refresh_interval(config->refresh_interval);
+
+    // A read-only server can not apply the changes of a primary
+    if (config->read_only && config->replicate_from) {
+        syslog(LOG_ERR, "A read-only server can not be a replica!");
+        res |= 1;
+    }
+
+    // Filters are migrated into the nodes of a cluster
+    res |= sane_cluster(config->cluster_nodes, config->cluster_self);
+    if (config->read_only && config->cluster_nodes) {
+        syslog(LOG_ERR, "A read-only server can not be in a cluster!");
+        res |= 1;
+    }
+    res |= sane_layout(config->layout);
+    if (config->layout == BLOOM_LAYOUT_QUOTIENT && (config->rotate_window ||
+                config->shards || config->freezable || config->summary_capacity)) {
+        syslog(LOG_ERR, "Quotient filters can not rotate, be sharded, frozen or summarized!");
+        res |= 1;
+    }
+    res |= sane_hash_scheme(config->hash_scheme);
+    res |= sane_quota_mb("filter_quota_mb", config->filter_quota_mb);
+    res |= sane_quota_mb("prefix_quota_mb", config->prefix_quota_mb);
+    res |= sane_quota_separator(config->quota_separator);
+    res |= sane_quota_degrade(config->quota_degrade);
+    res |= sane_fault_retry(config->fault_retry);
+    res |= sane_flush_syncfs(config->flush_syncfs);
+    res |= sane_use_direct_io(config->use_direct_io);
+    res |= sane_pack_layers(config->pack_layers);
+    res |= sane_warmup(config->warmup);
+    res |= sane_tier_layers(config->tier_layers);
+    res |= sane_seal_layers(config->seal_layers);
+    res |= sane_multi_batch_size(config->multi_batch_size);
+    res |= sane_command_budget("command_budget", config->command_budget);
+    res |= sane_command_budget("command_budget_kb", config->command_budget_kb);
+    res |= sane_rate_limit("conn_command_rate", config->conn_command_rate);
+    res |= sane_rate_limit("conn_key_rate", config->conn_key_rate);
+    res |= sane_rate_limit("filter_key_rate", config->filter_key_rate);
+    res |= sane_rate_limit("shed_backlog", config->shed_backlog);
+    res |= sane_rate_limit("shed_input_kb", config->shed_input_kb);
+    res |= sane_priority_port(config->priority_port, config->tcp_port);
+    res |= sane_priority_workers(config->priority_workers);
+    res |= sane_exec_threads(config->exec_threads);
+    res |= sane_fault_park(config->fault_park);
+    res |= sane_tcp_backlog(config->tcp_backlog);
+    res |= sane_tcp_option("tcp_defer_accept", config->tcp_defer_accept);
+    res |= sane_tcp_option("tcp_busy_poll_usec", config->tcp_busy_poll_usec);
+    res |= sane_tcp_option("tcp_sndbuf_kb", config->tcp_sndbuf_kb);
+    res |= sane_tcp_option("tcp_rcvbuf_kb", config->tcp_rcvbuf_kb);
+    res |= sane_tcp_quickack(config->tcp_quickack);
+    res |= sane_conn_buf(config->conn_buf_kb, config->conn_buf_multiplier);
+    res |= sane_unix_socket(config->unix_socket);
+    res |= sane_tls(config->tls_cert_file, config->tls_key_file,
+            config->tls_session_cache, config->use_io_uring);
+    res |= sane_handoff_socket(config->handoff_socket, config->unix_socket);
+    res |= sane_capture_keys(config->capture_keys);
+    res |= sane_positive_cache(config->positive_cache);
+    res |= sane_shm(config->shm_socket, config->unix_socket, config->handoff_socket,
+            config->shm_ring_kb, config->shm_spin_usec);
+    res |= sane_page_checksums(config->page_checksums, config->scrub_rate_mb);
+    res |= sane_residency_interval(config->residency_interval);
+    res |= sane_snapshot_interval(config->snapshot_interval);
+    res |= sane_sparse_layers(config->sparse_layers);
+    res |= sane_auto_shrink(config->auto_shrink);
+    res |= sane_load_dir(config->load_dir);
+    res |= sane_data_dirs(config->data_dir, config->data_dirs);
+
+    return res;
+}
+
+/**
+ * Frees the strings of a configuration that were set from
+ * the file, rather than left at their defaults.
+ */
+static void free_config_strings(bloom_config *config) {
+    char **fields[] = {&config->bind_address, &config->data_dir, &config->log_level,
+        &config->worker_cpus, &config->flush_cpus, &config->unmap_cpus,
+        &config->vacuum_cpus, &config->replicate_from, &config->cluster_nodes,
+        &config->cluster_self, &config->quota_separator, &config->unix_socket,
+        &config->tls_cert_file, &config->tls_key_file, &config->handoff_socket,
+        &config->capture_file, &config->shm_socket, &config->load_dir,
+        &config->data_dirs};
+    const char * const defaults[] = {DEFAULT_CONFIG.bind_address, DEFAULT_CONFIG.data_dir,
+        DEFAULT_CONFIG.log_level, DEFAULT_CONFIG.worker_cpus, DEFAULT_CONFIG.flush_cpus,
+        DEFAULT_CONFIG.unmap_cpus, DEFAULT_CONFIG.vacuum_cpus, DEFAULT_CONFIG.replicate_from,
+        DEFAULT_CONFIG.cluster_nodes, DEFAULT_CONFIG.cluster_self,
+        DEFAULT_CONFIG.quota_separator, DEFAULT_CONFIG.unix_socket,
+        DEFAULT_CONFIG.tls_cert_file, DEFAULT_CONFIG.tls_key_file,
+        DEFAULT_CONFIG.handoff_socket, DEFAULT_CONFIG.capture_file,
+        DEFAULT_CONFIG.shm_socket, DEFAULT_CONFIG.load_dir, DEFAULT_CONFIG.data_dirs};
+    for (unsigned i=0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (*fields[i] != defaults[i]) free(*fields[i]);
+    }
+
+    bloom_template *next;
+    for (bloom_template *t = config->templates; t; t = next) {
+        next = t->next;
+        free(t->name);
+        free(t->options);
+        free(t);
+    }
+}
+
+/**
+ * Finds a template of the configuration
+ * @arg config The configuration
+ * @arg name The name of the template
+ * @return The create options of the template, or NULL.
+ */
+const char* config_template(bloom_config *config, const char *name) {
+    for (bloom_template *t = config->templates; t; t = t->next) {
+        if (!strcmp(t->name, name)) return t->options;
+    }
+    return NULL;
+}
+
+/**
+ * Reads the configuration file again, and applies the settings
+ * that can change at runtime to a running configuration. The
+ * threads read these settings as they go, so the new values are
+ * picked up without a restart. Settings that need a restart are
+ * left as they are, and logged if they changed.
+ * @arg filename The name of the file to read
+ * @arg config The running configuration, updated in place
+ * @return 0 on success, -1 if the file could not be read
+ * or is invalid, in which case nothing is changed.
+ */
+int reload_config(char *filename, bloom_config *config) {
+    bloom_config *fresh = calloc(1, sizeof(bloom_config));
+    if (!fresh) return -1;
+    int res = -1;
+    if (config_from_filename(filename, fresh)) {
+        syslog(LOG_ERR, "Failed to read the configuration file!");
+        goto LEAVE;
+    }
+
+    // The workers may be set on the command line
+    fresh->worker_threads = config->worker_threads;
+    if (validate_config(fresh)) {
+        syslog(LOG_ERR, "Invalid configuration! Keeping the running one.");
+        goto LEAVE;
+    }
+
+// Applies a setting, the readers do not take a lock
+#define RELOAD(field) \
+    if (memcmp(&config->field, &fresh->field, sizeof(config->field))) { \
+        __atomic_store(&config->field, &fresh->field, __ATOMIC_RELAXED); \
+        syslog(LOG_INFO, "Reloaded setting " #field "."); \
+    }
+
+// Intervals whose thread is only started if they are set
+#define RELOAD_INTERVAL(field) \
+    if (config->field && fresh->field) { \
+        RELOAD(field) \
+    } else if (config->field != fresh->field) { \
+        syslog(LOG_WARNING, "Enabling or disabling " #field " needs a restart."); \
+    }
+
+#define RESTART_ONLY(field) \
+    if (config->field != fresh->field) { \
+        syslog(LOG_WARNING, "Setting " #field " needs a restart to change."); \
+    }
+
+    RELOAD(syslog_log_level);
+    RELOAD_INTERVAL(flush_interval);
+    RELOAD_INTERVAL(cold_interval);
+    RELOAD_INTERVAL(refresh_interval);
+    RELOAD_INTERVAL(residency_interval);
+    RELOAD_INTERVAL(snapshot_interval);
+    RELOAD(sparse_layers);
+    RELOAD(auto_shrink);
+    RELOAD_INTERVAL(memory_budget_mb);
+    RELOAD(memory_check);
+    RELOAD(max_memory_percent);
+    RELOAD(safe_memory_percent);
+    RELOAD(flush_rate_limit);
+    RELOAD(flush_dirty_mb);
+    RELOAD(set_log_sync_msec);
+    RELOAD(busy_poll_usec);
+    RELOAD(latency_sample);
+    RELOAD(slowlog_usec);
+    RELOAD(slowlog_size);
+    RELOAD(initial_capacity);
+    RELOAD(default_probability);
+    RELOAD(scale_size);
+    RELOAD(probability_reduction);
+    RELOAD(max_probes);
+    RELOAD(filter_quota_mb);
+    RELOAD(prefix_quota_mb);
+    RELOAD(quota_degrade);
+    RELOAD(multi_batch_size);
+    RELOAD(command_budget);
+    RELOAD(command_budget_kb);
+    RELOAD(conn_command_rate);
+    RELOAD(conn_key_rate);
+    RELOAD(filter_key_rate);
+    RELOAD(shed_backlog);
+    RELOAD(shed_input_kb);
+    RELOAD(tcp_quickack);
+    RELOAD(positive_cache);
+    RELOAD(scrub_rate_mb);
+
+    RESTART_ONLY(tcp_port);
+    RESTART_ONLY(udp_port);
+    RESTART_ONLY(worker_threads);
+    RESTART_ONLY(priority_port);
+    RESTART_ONLY(priority_workers);
+    RESTART_ONLY(flush_threads);
+    RESTART_ONLY(exec_threads);
+    RESTART_ONLY(in_memory);
+    RESTART_ONLY(use_mmap);
+    RESTART_ONLY(use_reuseport);
+    RESTART_ONLY(use_io_uring);
+    RESTART_ONLY(fault_retry);
+    RESTART_ONLY(conn_buf_kb);
+    RESTART_ONLY(page_checksums);
+#undef RELOAD
+#undef RELOAD_INTERVAL
+#undef RESTART_ONLY
+    if (strcmp(config->data_dir, fresh->data_dir))
+        syslog(LOG_WARNING, "Setting data_dir needs a restart to change.");
+    if ((config->data_dirs || fresh->data_dirs) && (!config->data_dirs ||
+                !fresh->data_dirs || strcmp(config->data_dirs, fresh->data_dirs)))
+        syslog(LOG_WARNING, "Setting data_dirs needs a restart to change.");
+    res = 0;
+
+LEAVE:
+    free_config_strings(fresh);
+    free(fresh);
+    return res;
+}
+
+/**
+ * Callback function to use with INI-H.
+ * @arg user Opaque user value. We use the bloom_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int filter_config_callback(void* user, const char* section, const char* name, const char* value) {
+    // Ignore any non-bloomd sections
+    if (strcasecmp("bloomd", section) != 0) {
+        return 0;
+    }
+
+    // Cast the user handle
+    bloom_filter_config *config = (bloom_filter_config*)user;
+
+    // Switch on the config
+    #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
+
+    // Handle the int cases
+    if (NAME_MATCH("scale_size")) {
+        return value_to_int(value, &config->scale_size);
+    } else if (NAME_MATCH("in_memory")) {
+         return value_to_int(value, &config->in_memory);
+    } else if (NAME_MATCH("rotate_window")) {
+         return value_to_int(value, &config->rotate_window);
+    } else if (NAME_MATCH("rotate_generations")) {
+         return value_to_int(value, &config->rotate_generations);
+    } else if (NAME_MATCH("freezable")) {
+         return value_to_int(value, &config->freezable);
+    } else if (NAME_MATCH("frozen")) {
+         return value_to_int(value, &config->frozen);
+    } else if (NAME_MATCH("shards")) {
+         return value_to_int(value, &config->shards);
+    } else if (NAME_MATCH("key_ttl")) {
+         return value_to_int(value, &config->key_ttl);
+    } else if (NAME_MATCH("max_probes")) {
+         return value_to_int(value, &config->max_probes);
+    } else if (NAME_MATCH("pinned")) {
+         return value_to_int(value, &config->pinned);
+
+    // Handle the int64 cases
+    } else if (NAME_MATCH("initial_capacity")) {
+         return value_to_int64(value, &config->initial_capacity);
+    } else if (NAME_MATCH("summary_capacity")) {
+         return value_to_int64(value, &config->summary_capacity);
+    } else if (NAME_MATCH("size")) {
+         return value_to_int64(value, &config->size);
+    } else if (NAME_MATCH("capacity")) {
+         return value_to_int64(value, &config->capacity);
+    } else if (NAME_MATCH("bytes")) {
+         return value_to_int64(value, &config->bytes);
+
+    // Handle the double cases
+    } else if (NAME_MATCH("default_probability")) {
+         return value_to_double(value, &config->default_probability);
+    } else if (NAME_MATCH("probability_reduction")) {
+         return value_to_double(value, &config->probability_reduction);
+
+    // Handle the string cases
+    } else if (NAME_MATCH("layout")) {
+        config->layout = layout_from_name(value);
+    } else if (NAME_MATCH("hash_scheme")) {
+        config->hash_scheme = hash_scheme_from_name(value);
+    } else if (NAME_MATCH("warmup")) {
+        config->warmup = warmup_from_name(value);
+
+    // Unknown parameter?
+    } else {
+        // Log it, but ignore
+        syslog(LOG_NOTICE, "Unrecognized filter config parameter: %s", value);
+    }
+
+    // Success
+    return 1;
+}
+
+/**
+ * Updates the configuration from a filename.
+ * Reads the file as an INI configuration and updates the config.
+ * @arg filename The name of the file to read.
+ * @arg config Output. The config object to update. Does not initialize!
+ * @return 0 on success, negative on error.
+ */
+int filter_config_from_filename(char *filename, bloom_filter_config *config) {
+    // If there is no filename, return now
+    if (filename == NULL)
+        return 0;
+
+    // Try to open the file
+    int res = ini_parse(filename, filter_config_callback, config);
+    if (res == -1) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the configuration to a filename.
+ * Writes the file as an INI configuration. The file
+ * is replaced atomically.
+ * @arg filename The name of the file to write.
+ * @arg config The config object to write out.
+ * @return 0 on success, negative on error.
+ */
+int update_filename_from_filter_config(char *filename, bloom_filter_config *config) {
+    // Write a temporary file and rename it over the config, so
+    // readers of the config never see a partial file
+    char *tmp_name;
+    if (asprintf(&tmp_name, "%s.tmp", filename) < 0) return -ENOMEM;
+    FILE* f = fopen(tmp_name, "w+");
+    if (!f) {
+        free(tmp_name);
+        return -errno;
+    }
+
+    // Write out
+    fprintf(f, "[bloomd]\n\
+initial_capacity = %llu\n\
+default_probability = %f\n\
+scale_size = %d\n\
+probability_reduction = %f\n\
+in_memory = %d\n\
+layout = %s\n\
+hash_scheme = %s\n\
+rotate_window = %d\n\
+rotate_generations = %d\n\
+freezable = %d\n\
+frozen = %d\n\
+summary_capacity = %llu\n\
+shards = %d\n\
+warmup = %s\n\
+key_ttl = %d\n\
+max_probes = %d\n\
+pinned = %d\n\
+size = %llu\n\
+capacity = %llu\n\
+bytes = %llu\n", (unsigned long long)config->initial_capacity,
+                 config->default_probability,
+                 config->scale_size,
+                 config->probability_reduction,
+                 config->in_memory,
+                 layout_name(config->layout),
+                 hash_scheme_name(config->hash_scheme),
+                 config->rotate_window,
+                 config->rotate_generations,
+                 config->freezable,
+                 config->frozen,
+                 (unsigned long long)config->summary_capacity,
+                 config->shards,
+                 warmup_name(config->warmup),
+                 config->key_ttl,
+                 config->max_probes,
+                 config->pinned,
+                 (unsigned long long)config->size,
+                 (unsigned long long)config->capacity,
+                 (unsigned long long)config->bytes
+    );
+
+    // Close, and replace the config
+    int res = (fclose(f) || rename(tmp_name, filename)) ? -errno : 0;
+    if (res) unlink(tmp_name);
+    free(tmp_name);
+    return res;
+}
+
+/**
+ * Encodes a filter configuration as the binary record of
+ * update_binary_from_filter_config, for files holding the
+ * records of many filters.
+ * @arg config The config object to encode.
+ * @arg buf Output, the record
+ * @arg len The size of the buffer
+ * @return The bytes of the record, or -1 if the buffer is too small.
+ */
+int filter_config_to_record(bloom_filter_config *config, void *buf, size_t len) {
+    if (len < sizeof(filter_meta_record)) return -1;
+    filter_meta_record r;
+    memset(&r, 0, sizeof(r));
+    r.magic = FILTER_META_MAGIC;
+    r.version = FILTER_META_VERSION;
+    r.length = sizeof(r);
+    r.initial_capacity = config->initial_capacity;
+    r.default_probability = config->default_probability;
+    r.probability_reduction = config->probability_reduction;
+    r.summary_capacity = config->summary_capacity;
+    r.size = config->size;
+    r.capacity = config->capacity;
+    r.bytes = config->bytes;
+    r.scale_size = config->scale_size;
+    r.in_memory = config->in_memory;
+    r.layout = config->layout;
+    r.hash_scheme = config->hash_scheme;
+    r.rotate_window = config->rotate_window;
+    r.rotate_generations = config->rotate_generations;
+    r.freezable = config->freezable;
+    r.frozen = config->frozen;
+    r.shards = config->shards;
+    r.warmup = config->warmup;
+    r.key_ttl = config->key_ttl;
+    r.max_probes = config->max_probes;
+    r.pinned = config->pinned;
+    r.checksum = meta_checksum(&r, offsetof(filter_meta_record, checksum));
+    memcpy(buf, &r, sizeof(r));
+    return sizeof(r);
+}
+
+/**
+ * Decodes a binary record of filter_config_to_record. Records
+ * of version 1, which predate max_probes, and of version 2,
+ * which predate pinned, are also accepted.
+ * @arg buf The record
+ * @arg len The bytes available in the buffer
+ * @arg config Output. The config object to update.
+ * @return The bytes of the record, or -EINVAL if
+ * the record is not valid.
+ */
+int filter_config_from_record(const void *buf, size_t len, bloom_filter_config *config) {
+    filter_meta_record r;
+    memset(&r, 0, sizeof(r));
+    if (len < offsetof(filter_meta_record, initial_capacity)) return -EINVAL;
+    memcpy(&r, buf, offsetof(filter_meta_record, initial_capacity));
+
+    size_t expect = sizeof(r);
+    if (r.version == 1) expect = FILTER_META_V1_LENGTH;
+    else if (r.version == 2) expect = FILTER_META_V2_LENGTH;
+    if (r.magic != FILTER_META_MAGIC || r.version < 1 || r.version > FILTER_META_VERSION ||
+            r.length != expect || len < expect)
+        return -EINVAL;
+    memcpy(&r, buf, expect);
+    size_t checked = offsetof(filter_meta_record, checksum);
+    if (r.version == 1) {
+        r.checksum = r.max_probes;
+        r.max_probes = 0;
+        checked = offsetof(filter_meta_record, max_probes);
+    } else if (r.version == 2) {
+        r.checksum = r.pinned;
+        r.pinned = 0;
+        checked = offsetof(filter_meta_record, pinned);
+    }
+    if (r.checksum != meta_checksum(&r, checked))
+        return -EINVAL;
+
+    config->initial_capacity = r.initial_capacity;
+    config->default_probability = r.default_probability;
+    config->probability_reduction = r.probability_reduction;
+    config->summary_capacity = r.summary_capacity;
+    config->size = r.size;
+    config->capacity = r.capacity;
+    config->bytes = r.bytes;
+    config->scale_size = r.scale_size;
+    config->in_memory = r.in_memory;
+    config->layout = r.layout;
+    config->hash_scheme = r.hash_scheme;
+    config->rotate_window = r.rotate_window;
+    config->rotate_generations = r.rotate_generations;
+    config->freezable = r.freezable;
+    config->frozen = r.frozen;
+    config->shards = r.shards;
+    config->warmup = r.warmup;
+    config->key_ttl = r.key_ttl;
+    config->max_probes = r.max_probes;
+    config->pinned = r.pinned;
+    return r.length;
+}
+
+/**
+ * Reads a filter configuration written by
+ * update_binary_from_filter_config.
+ * @arg filename The name of the file to read.
+ * @arg config Output. The config object to update.
+ * @return 0 on success, -ENOENT if there is no file,
+ * or -EINVAL if the record is not valid.
+ */
+int filter_config_from_binary(char *filename, bloom_filter_config *config) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -errno;
+    filter_meta_record r;
+    ssize_t len = read(fd, &r, sizeof(r));
+    close(fd);
+    if (len < 0 || filter_config_from_record(&r, len, config) != len)
+        return -EINVAL;
+    return 0;
+}
+
+/**
+ * Writes a filter configuration as a compact binary record,
+ * which is much cheaper to write and read than the INI file.
+ * The file is replaced atomically.
+ * @arg filename The name of the file to write.
+ * @arg config The config object to write out.
+ * @return 0 on success, negative on error.
+ */
+int update_binary_from_filter_config(char *filename, bloom_filter_config *config) {
+    filter_meta_record r;
+    filter_config_to_record(config, &r, sizeof(r));
+
+    // Write a temporary file and rename it over the record,
+    // so readers of the record never see a partial one
+    char *tmp_name;
+    if (asprintf(&tmp_name, "%s.tmp", filename) < 0) return -ENOMEM;
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp_name);
+        return -errno;
+    }
+    int res = (write(fd, &r, sizeof(r)) != sizeof(r)) ? -EIO : 0;
+    if (close(fd) && !res) res = -errno;
+    if (!res && rename(tmp_name, filename)) res = -errno;
+    if (res) unlink(tmp_name);
+    free(tmp_name);
+    return res;
+}
+
+// Checksums the first len bytes of a binary record
+static uint32_t meta_checksum(filter_meta_record *r, size_t len) {
+    uint32_t hash = 2166136261u;
+    unsigned char *c = (unsigned char*)r;
+    for (size_t i=0; i < len; i++) {
+        hash ^= c[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
@@ -1,8 +1,19 @@
 #ifndef BLOOM_CONFIG_H
 #define BLOOM_CONFIG_H
 #include <stdint.h>
+#include <stddef.h>
 #include <syslog.h>
 
+/**
+ * A named set of create options, from the
+ * [templates] section of the configuration
+ */
+typedef struct bloom_template {
+    char *name;
+    char *options;              // Space separated, as given to create
+    struct bloom_template *next;
+} bloom_template;
+
 /**
  * Stores our configuration
  */
@@ -25,8 +36,119 @@ typedef struct {
     int memory_check;
     int max_memory_percent;
     int safe_memory_percent;
+    int layout;             // Default filter layout, see bloom_layout
+    int hash_scheme;        // Default hash scheme, see bloom_hash_scheme
+    int use_hugepages;      // Back anonymous bitmaps with hugepages
+    int use_reuseport;      // Give each worker its own TCP listener
+    int use_io_uring;       // Use io_uring for client IO
+    int flush_threads;      // Threads used to flush filters
+    int flush_rate_limit;   // Max MB per second flushed, 0 for unlimited
+    int flush_dirty_mb;     // Flush a filter early once this many MB are dirty, 0 to disable
+    int use_set_log;        // Log sets to disk between flushes
+    int set_log_sync_msec;  // Interval between set log syncs
+    int compress_cold;      // Compress the layers of cold filters
+    int load_threads;       // Threads used to load filters at startup
+    int prewarm;            // Fault in filters before their expected use
+    int memory_budget_mb;   // Memory for mapped filters, 0 for unlimited
+    int rotate_window;      // Seconds per generation of new rotating filters, 0 if not rotating
+    int rotate_generations; // Generations kept by new rotating filters
+    int freezable;          // New filters stage their keys so they can be frozen
+    uint64_t summary_capacity; // Keys the summary of new filters is sized for, 0 for none
+    int shards;             // Key shards of new filters, 0 if not sharded
+    int latency_sample;     // Time one in this many commands, 0 to disable
+    int slowlog_usec;       // Commands slower than this are kept in the slow log, 0 to disable
+    int slowlog_size;       // Commands kept in the slow log
+    int metrics_port;       // Port serving metrics over HTTP, 0 to disable
+    int metrics_interval;   // Seconds between metrics snapshots
+    int use_numa;           // Pin workers to NUMA nodes, and place filters on them
+    int numa_interleave_mb; // Layers of at least this many MB are interleaved, 0 to never
+    char *worker_cpus;      // CPUs the workers are pinned to one each, NULL to float
+    char *flush_cpus;       // CPUs of the flush threads, NULL to float
+    char *unmap_cpus;       // CPUs of the cold unmap thread, NULL to float
+    char *vacuum_cpus;      // CPUs of the filter manager vacuum thread, NULL to float
+    int busy_poll_usec;     // Workers poll without sleeping this long after an event
+    int replication_port;   // Port serving the replicas, 0 if not a primary
+    char *replicate_from;   // Primary to replicate, as host:port, NULL if not a replica
+    int replication_buffer_mb; // Size of the replication log
+    int read_only;          // Only serve checks, sharing the files of another server
+    int refresh_interval;   // Seconds between checks for changes to shared filters
+    char *cluster_nodes;    // Nodes of the cluster, as host:port:cluster_port, NULL if not clustered
+    char *cluster_self;     // Our node of the cluster, as host:port
+    int filter_quota_mb;    // Max MB of the layers of a filter, 0 for unlimited
+    int prefix_quota_mb;    // Max MB of the filters sharing a name prefix, 0 for unlimited
+    char *quota_separator;  // The name prefix of a filter ends at the first of these
+    int quota_degrade;      // Filters over a quota overfill their newest layer instead of rejecting sets
+    int fault_retry;        // Answer with a retry instead of faulting in filters on the workers
+    int flush_syncfs;       // Write back all the filters, then sync the data dir once
+    int use_direct_io;      // Write PERSISTENT layers with O_DIRECT, so they are cached once
+    int pack_layers;        // New filters keep all of their layers in a single file
+    int warmup;             // Default warm-up of faulted in filters, see bloom_warmup
+    int tier_layers;        // Newest layers kept in memory, older ones move to the page cache, 0 for all
+    int seal_layers;        // Map the layers older than the newest read-only, without dirty tracking
+    int multi_batch_size;   // Most keys of a multi command handled under one lock acquire
+    int command_budget;     // Commands of a connection handled per turn, 0 for unlimited
+    int command_budget_kb;  // KB of input of a connection handled per turn, 0 for unlimited
+    int conn_command_rate;  // Commands per second of a connection, 0 for unlimited
+    int conn_key_rate;      // Keys per second a connection checks, sets or deletes, 0 for unlimited
+    int filter_key_rate;    // Keys per second checked, set or deleted in a filter, 0 for unlimited
+    int shed_backlog;       // Key commands are answered Busy once this many events wait on a worker, 0 to disable
+    int shed_input_kb;      // Key commands of a connection with this much unread input are answered Busy, 0 to disable
+    int priority_port;      // TCP port of the priority lane, served by workers of its own, 0 to disable
+    int priority_workers;   // Worker threads of the priority lane
+    int exec_threads;       // Threads running the commands, 0 to run them on the workers
+    int fault_park;         // With fault_retry, park clients until the filter is faulted in
+    int tcp_backlog;        // Listen backlog of the TCP listeners
+    int tcp_defer_accept;   // Seconds to wait for data before accepting, 0 to disable
+    int tcp_busy_poll_usec; // SO_BUSY_POLL of the client sockets, 0 to disable
+    int tcp_sndbuf_kb;      // SO_SNDBUF of the client sockets, 0 for the kernel default
+    int tcp_rcvbuf_kb;      // SO_RCVBUF of the client sockets, 0 for the kernel default
+    int tcp_quickack;       // Ack every read of a client right away
+    int conn_buf_kb;        // Initial size of the connection buffers
+    int conn_buf_multiplier;    // Growth factor of the connection buffers
+    char *unix_socket;      // Path of the unix socket, '@' for the abstract namespace
+    char *tls_cert_file;    // PEM certificate chain, enables TLS on the TCP listener
+    char *tls_key_file;     // PEM private key of the certificate
+    int tls_session_cache;  // TLS sessions cached for resumption, 0 to disable
+    char *handoff_socket;   // Unix socket a new process takes the listeners over from, NULL to disable
+    int key_ttl;            // Seconds the keys of new aging filters live for, 0 if keys do not expire
+    int max_probes;         // Most bits probed per key by new filters, 0 for the space-optimal number
+    char *capture_file;     // File the command stream is captured to, NULL to disable
+    int capture_keys;       // How the keys are captured, see bloom_capture_keys
+    int positive_cache;     // Found keys each worker caches per filter, 0 to disable
+    char *shm_socket;       // Unix socket shared memory clients connect to, NULL to disable
+    int shm_ring_kb;        // KB of each ring of a shared memory client, a power of 2
+    int shm_spin_usec;      // Microseconds the shm thread polls idle rings before sleeping
+    int page_checksums;     // Keep a checksum of each page of the data files, 0 or 1
+    int scrub_rate_mb;      // MB per second of pages the scrub thread verifies, 0 to disable
+    int residency_interval; // Seconds between scans of the filter pages in memory, 0 to disable
+    char *load_dir;         // Directory the load command reads key files from, NULL to disable
+    char *data_dirs;        // More directories new filters are placed in, comma separated, NULL for none
+    int snapshot_interval;  // Seconds between snapshots of the in-memory filters, 0 to disable
+    int sparse_layers;      // Start new layers as a sparse set of bits, 0 or 1
+    int auto_shrink;        // Shrink oversized filters when they go cold, 0 or 1
+    int pinned;             // New filters are locked in memory and never unmapped for being cold
+    bloom_template *templates;  // Create options filters can be created from by name
 } bloom_config;
 
+/**
+ * How the pages of a filter mapped with use_mmap are
+ * faulted in, when the filter is faulted in
+ */
+typedef enum {
+    WARMUP_WILLNEED = 0,    // Read the data ahead in the background
+    WARMUP_POPULATE = 1,    // Read the data in before the filter is used
+    WARMUP_LAZY = 2         // Read each page on its first use
+} bloom_warmup;
+
+/**
+ * How the keys of the captured commands are recorded
+ */
+typedef enum {
+    CAPTURE_KEYS_NONE = 0,  // Only the number of keys
+    CAPTURE_KEYS_HASH = 1,  // A 64bit hash of each key
+    CAPTURE_KEYS_RAW = 2    // The keys themselves
+} bloom_capture_keys;
+
 /**
  * This structure is used to persist
  * filter specific settings to an INI file.
@@ -37,11 +159,41 @@ typedef struct {
     int scale_size;
     double probability_reduction;
     int in_memory;
+    int layout;             // Layout of new filters, see bloom_layout
+    int hash_scheme;        // Hash scheme of new filters, see bloom_hash_scheme
+    int rotate_window;      // Seconds per generation, 0 if the filter does not rotate
+    int rotate_generations; // The number of live generations
+    int freezable;          // Are the set keys staged, so the filter can be frozen
+    int frozen;             // Has the filter been frozen into an xor filter
+    uint64_t summary_capacity; // Keys the summary is sized for, 0 if there is none
+    int shards;             // The number of key shards, 0 if the filter is not sharded
+    int warmup;             // How the filter is warmed up when faulted in, see bloom_warmup
+    int key_ttl;            // Seconds a key lives for after it is set, 0 unless the layout is aging
+    int max_probes;         // Most bits probed per key of new layers, 0 for the space-optimal number
+    int pinned;             // Are the layers locked in memory, exempt from cold unmaps and eviction
     uint64_t size;          // Total size
     uint64_t capacity;      // Total capacity
     uint64_t bytes;         // Total byte size
 } bloom_filter_config;
 
+/**
+ * The maximum number of generations
+ * kept by a rotating filter.
+ */
+#define MAX_ROTATE_GENERATIONS 1024
+
+/**
+ * The maximum number of key shards
+ * of a sharded filter.
+ */
+#define MAX_FILTER_SHARDS 256
+
+/**
+ * The most bits a key can be limited
+ * to probing in each layer.
+ */
+#define MAX_FILTER_PROBES 64
+
 
 /**
  * Initializes the configuration from a filename.
@@ -64,13 +216,55 @@ int filter_config_from_filename(char *filename, bloom_filter_config *config);
 
 /**
  * Writes the configuration to a filename.
- * Writes the file as an INI configuration
+ * Writes the file as an INI configuration. The file
+ * is replaced atomically.
  * @arg filename The name of the file to write.
  * @arg config The config object to write out.
  * @return 0 on success, negative on error.
  */
 int update_filename_from_filter_config(char *filename, bloom_filter_config *config);
 
+/**
+ * Encodes a filter configuration as the binary record of
+ * update_binary_from_filter_config, for files holding the
+ * records of many filters.
+ * @arg config The config object to encode.
+ * @arg buf Output, the record
+ * @arg len The size of the buffer
+ * @return The bytes of the record, or -1 if the buffer is too small.
+ */
+int filter_config_to_record(bloom_filter_config *config, void *buf, size_t len);
+
+/**
+ * Decodes a binary record of filter_config_to_record.
+ * @arg buf The record
+ * @arg len The bytes available in the buffer
+ * @arg config Output. The config object to update.
+ * @return The bytes of the record, or -EINVAL if
+ * the record is not valid.
+ */
+int filter_config_from_record(const void *buf, size_t len, bloom_filter_config *config);
+
+/**
+ * Reads a filter configuration written by
+ * update_binary_from_filter_config.
+ * @arg filename The name of the file to read.
+ * @arg config Output. The config object to update.
+ * @return 0 on success, -ENOENT if there is no file,
+ * or -EINVAL if the record is not valid.
+ */
+int filter_config_from_binary(char *filename, bloom_filter_config *config);
+
+/**
+ * Writes a filter configuration as a compact binary record,
+ * which is much cheaper to write and read than the INI file.
+ * The file is replaced atomically.
+ * @arg filename The name of the file to write.
+ * @arg config The config object to write out.
+ * @return 0 on success, negative on error.
+ */
+int update_binary_from_filter_config(char *filename, bloom_filter_config *config);
+
 /**
  * Validates the configuration
  * @arg config The config object to validate.
@@ -78,6 +272,27 @@ int update_filename_from_filter_config(char *filename, bloom_filter_config *conf
  */
 int validate_config(bloom_config *config);
 
+/**
+ * Finds a template of the configuration
+ * @arg config The configuration
+ * @arg name The name of the template
+ * @return The create options of the template, or NULL.
+ */
+const char* config_template(bloom_config *config, const char *name);
+
+/**
+ * Reads the configuration file again, and applies the settings
+ * that can change at runtime to a running configuration. The
+ * threads read these settings as they go, so the new values are
+ * picked up without a restart. Settings that need a restart are
+ * left as they are, and logged if they changed.
+ * @arg filename The name of the file to read
+ * @arg config The running configuration, updated in place
+ * @return 0 on success, -1 if the file could not be read
+ * or is invalid, in which case nothing is changed.
+ */
+int reload_config(char *filename, bloom_config *config);
+
 // Configuration validation methods
 int sane_data_dir(char *data_dir);
 int sane_log_level(char *log_level, int *syslog_level);
@@ -89,7 +304,127 @@ int sane_flush_interval(int intv);
 int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
+int sane_use_hugepages(int use_hugepages);
+int sane_use_reuseport(int use_reuseport);
+int sane_use_io_uring(int use_io_uring);
 int sane_worker_threads(int threads);
+int sane_flush_threads(int threads);
+int sane_flush_rate_limit(int limit);
+int sane_flush_dirty_mb(int mb);
+int sane_use_set_log(int use_set_log);
+int sane_set_log_sync_msec(int msec);
+int sane_compress_cold(int compress);
+int sane_load_threads(int threads);
+int sane_prewarm(int prewarm);
+int sane_memory_budget_mb(int budget);
+int sane_rotate_window(int window);
+int sane_rotate_generations(int generations);
+int sane_key_ttl(int ttl, int layout);
+int sane_max_probes(int probes);
+int sane_freezable(int freezable);
+int sane_pinned(int pinned);
+int sane_summary_capacity(int64_t summary_capacity);
+int sane_shards(int shards);
+int sane_latency_sample(int sample);
+int sane_slowlog(int usec, int size);
+int sane_metrics_port(int port);
+int sane_metrics_interval(int interval);
+int sane_use_numa(int use_numa);
+int sane_numa_interleave_mb(int mb);
+int sane_cpu_list(const char *name, const char *list);
+int sane_busy_poll_usec(int usec);
+int sane_replication_port(int port);
+int sane_replicate_from(const char *primary);
+int sane_replication_buffer_mb(int mb);
+int sane_read_only(int read_only);
+int sane_refresh_interval(int interval);
+int sane_cluster(const char *nodes, const char *self);
+int sane_quota_mb(const char *name, int mb);
+int sane_quota_separator(const char *separator);
+int sane_quota_degrade(int degrade);
+int sane_fault_retry(int retry);
+int sane_flush_syncfs(int syncfs);
+int sane_use_direct_io(int direct_io);
+int sane_pack_layers(int pack_layers);
+int sane_warmup(int warmup);
+int sane_capture_keys(int keys);
+int sane_positive_cache(int entries);
+int sane_tier_layers(int tier_layers);
+int sane_seal_layers(int seal_layers);
+int sane_multi_batch_size(int size);
+int sane_command_budget(const char *name, int budget);
+int sane_rate_limit(const char *name, int limit);
+int sane_priority_port(int port, int tcp_port);
+int sane_priority_workers(int threads);
+int sane_exec_threads(int threads);
+int sane_fault_park(int park);
+int sane_tcp_backlog(int backlog);
+int sane_tcp_option(const char *name, int value);
+int sane_tcp_quickack(int quickack);
+int sane_conn_buf(int kb, int multiplier);
+int sane_unix_socket(const char *path);
+int sane_handoff_socket(const char *path, const char *unix_socket);
+int sane_shm(const char *path, const char *unix_socket, const char *handoff_socket,
+        int ring_kb, int spin_usec);
+int sane_page_checksums(int page_checksums, int scrub_rate_mb);
+int sane_residency_interval(int interval);
+int sane_load_dir(const char *dir);
+int sane_data_dirs(const char *data_dir, const char *dirs);
+int sane_snapshot_interval(int interval);
+int sane_sparse_layers(int sparse_layers);
+int sane_auto_shrink(int auto_shrink);
+int sane_tls(const char *cert_file, const char *key_file, int session_cache, int use_io_uring);
+int sane_layout(int layout);
+int sane_hash_scheme(int scheme);
+
+/**
+ * Converts a filter layout name to its bloom_layout value.
+ * @arg name The name of the layout, "partitioned", "blocked", "counting", "aging" or "quotient"
+ * @return The layout, or -1 if the name is not known.
+ */
+int layout_from_name(const char *name);
+
+/**
+ * Converts a filter layout to its name.
+ * @arg layout The layout
+ * @return The name of the layout
+ */
+const char* layout_name(int layout);
+
+/**
+ * Converts a hash scheme name to its bloom_hash_scheme value.
+ * @arg name The name of the scheme, "legacy", "murmur", "crc32c" or "short"
+ * @return The scheme, or -1 if the name is not known.
+ */
+int hash_scheme_from_name(const char *name);
+
+/**
+ * Converts a warm-up name to its bloom_warmup value.
+ * @arg name The name of the warm-up, "willneed", "populate" or "lazy"
+ * @return The warm-up, or -1 if the name is not known.
+ */
+int warmup_from_name(const char *name);
+
+/**
+ * Converts a warm-up to its name.
+ * @arg warmup The warm-up
+ * @return The name of the warm-up
+ */
+const char* warmup_name(int warmup);
+
+/**
+ * Converts a capture key mode name to its bloom_capture_keys value.
+ * @arg name The name of the mode, "none", "hash" or "raw"
+ * @return The mode, or -1 if the name is not known.
+ */
+int capture_keys_from_name(const char *name);
+
+/**
+ * Converts a hash scheme to its name.
+ * @arg scheme The scheme
+ * @return The name of the scheme
+ */
+const char* hash_scheme_name(int scheme);
 
 /**
  * Joins two strings as part of a path,
@@ -100,4 +435,21 @@ int sane_worker_threads(int threads);
  */
 char* join_path(char *path, char *part2);
 
+/**
+ * The most directories filters can be stored in,
+ * the data_dir and the data_dirs together.
+ */
+#define MAX_DATA_DIRS 64
+
+/**
+ * Lists the directories filters are stored in, the
+ * data_dir followed by each of the data_dirs.
+ * @param config The configuration
+ * @param buf Output, a malloc()'d buffer the directories
+ * point into, which must be freed.
+ * @param dirs Output, room for MAX_DATA_DIRS directories
+ * @return The number of directories, at least 1.
+ */
+int data_dir_list(bloom_config *config, char **buf, char **dirs);
+
 #endif
@@ -3,29 +3,206 @@
 #include <string.h>
 #include <regex.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <syslog.h>
 #include "conn_handler.h"
+#include "tokenize.h"
+#include "latency.h"
+#include "slowlog.h"
+#include "capture.h"
+#include "replication.h"
+#include "rate_limit.h"
+#include "probes.h"
 #include "handler_constants.c"
 
 /**
  * Defines the number of keys we set/check in a single
- * iteration for our multi commands. We do not do all the
- * keys at one time to prevent a client from holding locks
- * for too long. This is especially critical for set
- * operations which serialize access.
+ * iteration for our multi commands while the worker has
+ * other events waiting, and the fewest otherwise. Idle
+ * workers use batches of up to multi_batch_size keys. We do
+ * not do all the keys at one time to prevent a client from
+ * holding locks for too long. This is especially critical
+ * for set operations which serialize access. Each iteration
+ * is checked as a batch, so this should be a multiple of
+ * BLOOM_BATCH_SIZE to keep the prefetches full.
  */
 #define MULTI_OP_SIZE 32
 
+/**
+ * Defines the most pipelined check commands that are
+ * run together. A client that sends many single key checks
+ * of the same filter gets them checked as one batch, so the
+ * lookups of the keys overlap like those of a multi command.
+ */
+#define CHECK_RUN_SIZE 128
+
 /**
  * Invoked in any context with a bloom_conn_handler
  * to send out an INTERNAL_ERROR message to the client.
  */
 #define INTERNAL_ERROR() (handle_client_resp(handle->conn, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN))
 
+/**
+ * The number of filter handles a single connection
+ * can have open at once.
+ */
+#define MAX_CONN_HANDLES 64
+
+/**
+ * The most filters a check_any or set_any
+ * command can check the keys against.
+ */
+#define MAX_ANY_FILTERS 32
+
+/**
+ * The most filters a single provision
+ * command can create.
+ */
+#define MAX_PROVISION 100000
+
+/**
+ * Once this many bytes of a multi or bulk command are
+ * buffered without a newline, the command is streamed.
+ * The keys that have arrived are applied, and the rest
+ * are handled as they are read, so very long commands
+ * do not need to be buffered in full.
+ */
+#define STREAM_MIN_SIZE 16384
+
+/**
+ * The most bytes of a command, filter name and
+ * separators that may preceed the first key.
+ */
+#define STREAM_PREFIX_SIZE 208
+
+/**
+ * The list command is sent in batches of about this
+ * many bytes, so a large listing is streamed to the
+ * client instead of being built in full.
+ */
+#define LIST_BATCH_SIZE 65536
+
+/**
+ * Checks or sets keys in a filter, given either a filter
+ * name or a handle reference, or an open handle if filt is
+ * not NULL. The key lengths are optional, as with
+ * filtmgr_check_keys_len, which has the same return values.
+ */
+typedef int(*keys_func)(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Checks or sets keys against several filters, like check_any_keys.
+ * The filter that failed is returned in failed on an error.
+ */
+typedef int(*any_keys_func)(bloom_conn_handler *handle, char **filter_names, int num_filters,
+        char **keys, int *key_lens, int num_keys, char *result, char **failed);
+
+/**
+ * The buffers of the batches of keys of a command,
+ * allocated from the arena
+ */
+typedef struct {
+    int size;       // The most keys in a batch
+    char **keys;
+    int *lens;
+    char *result;
+} key_batch;
+
+/**
+ * The formats of the responses to the multi key commands
+ */
+typedef enum {
+    RESP_TEXT = 0,      // Yes or No for each key, space separated
+    RESP_COMPACT,       // Y or N for each key
+    RESP_HEX,           // The keys as a bitset in hex, 4 keys per digit
+} multi_resp_format;
+
+/**
+ * The response of a multi key command being built. The
+ * results are written into one buffer, which is sent with
+ * a single write. A streamed command sends the buffer as
+ * each piece is handled, and keeps the rest of the state.
+ */
+typedef struct {
+    char *buf;      // The output, allocated from the arena
+    int len;        // The length of the output
+    int format;     // The multi_resp_format
+    int keys;       // The number of results added
+    int bits;       // Results of the partial hex digit
+} multi_resp;
+
+/**
+ * Per-connection state, allocated when the first handle is
+ * opened, a command is streamed or the format is changed,
+ * or for every connection while the commands are captured
+ * or the connections are rate limited.
+ */
+typedef struct {
+    bloom_filter_handle *handles[MAX_CONN_HANDLES];
+    int resp_format;        // The multi_resp_format of the connection
+
+    // Streaming multi or bulk command
+    char *stream_filter;    // Filter name, NULL if not streaming
+    keys_func stream_func;  // Checks or sets the keys
+    bloom_filter_handle *stream_handle; // The filter of the command, NULL to look it up by name
+    multi_resp stream_resp; // The response of the command
+    int stream_failed;      // An error was sent, discard until the newline
+
+    // Command waiting on its filter to be faulted in
+    char *parked_args;      // Arguments of the command, NULL if none
+    int parked_len;
+    conn_cmd_type parked_type;
+
+    int close_conn;         // Close the connection once the responses are sent
+    uint32_t capture_id;    // Id of the connection in the capture file, 0 if not yet assigned
+
+    // Rate limits of the connection
+    bloom_rate_limit cmd_rate;  // Commands, limited by conn_command_rate
+    bloom_rate_limit key_rate;  // Keys, limited by conn_key_rate
+} conn_state;
+
+/**
+ * A run of pipelined check commands of one filter, which
+ * are checked as a batch once a command does not join it.
+ * The keys point into the input of the connection, or into
+ * lines that were copied out of it, which are kept until then.
+ */
+typedef struct {
+    char *filter_name;              // The filter name of the run, NULL if empty
+    int name_len;
+    int num_keys;
+    char *keys[CHECK_RUN_SIZE];
+    char *copied[CHECK_RUN_SIZE];   // Lines to free once the run is checked
+    int num_copied;
+} check_run;
+
+/**
+ * The batch of lines of a list command being built
+ */
+typedef struct {
+    bloom_conn_handler *handle;
+    char *buf;
+    int len;
+} list_batch;
+
+/**
+ * The output of an info command being built
+ */
+typedef struct {
+    bloom_arena *arena;
+    char *buf;
+} info_output;
+
 /* Static method declarations */
 static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_check_any_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_set_any_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_filt_any_key_cmd(bloom_conn_handler *handle, char *args, int args_len, any_keys_func func);
 static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_delete_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len);
@@ -33,8 +210,82 @@ static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_le
 static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len);
-
-static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input);
+static void handle_use_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_release_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_snapshot_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_warm_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_freeze_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_compact_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_reset_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_slowlog_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_alias_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_load_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_migrate_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_export_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_import_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void reject_import(bloom_conn_handler *handle, char *msg, int msg_len);
+static void handle_format_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_merge_cmd(bloom_conn_handler *handle, char *args, int args_len, int intersect);
+static void handle_create_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_drop_multi_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_drop_prefix_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int parse_create_options(bloom_conn_handler *handle, char *options, int options_len, bloom_config **config_out);
+static int apply_create_options(bloom_conn_handler *handle, bloom_config *config, char *options, int options_len,
+        uint64_t *max_capacity, int *layout_set, int in_template);
+static void handle_provision_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int split_filter_names(bloom_conn_handler *handle, char *args, int args_len, char ***names, char **options, int *options_len);
+static void handle_filt_result(bloom_conn_handler *handle, char *filter_name, int res);
+static void handle_filters_response(bloom_conn_handler *handle, char **names, int *results, int num, const char *exists_resp);
+
+static int check_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result);
+static int check_hashed(bloom_conn_handler *handle, char *filter_name, bloom_hashed_key *keys, int num_keys, char *result);
+static int check_any_keys(bloom_conn_handler *handle, char **filter_names, int num_filters,
+        char **keys, int *key_lens, int num_keys, char *result, char **failed);
+static int set_any_keys(bloom_conn_handler *handle, char **filter_names, int num_filters,
+        char **keys, int *key_lens, int num_keys, char *result, char **failed);
+static int init_key_batch(bloom_conn_handler *handle, key_batch *batch);
+static bloom_filter_handle* open_batch_filter(bloom_conn_handler *handle, char *filter_name);
+static int set_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result);
+static int delete_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result);
+static bloom_filter_handle** lookup_handle(bloom_conn_handler *handle, char *ref);
+static conn_state* get_conn_state(bloom_conn_handler *handle);
+static int budget_spent(bloom_conn_handler *handle, int commands, int start_input);
+static int admit_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int admit_keys(bloom_conn_handler *handle, int is_keys, int num_keys);
+static int is_key_command(conn_cmd_type type);
+static int filter_over_rate(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt, int num_keys);
+static void dispatch_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static void capture_client_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int park_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len);
+static int join_check_run(check_run *run, conn_cmd_type type, char *args, int args_len,
+        char *line, int should_free);
+static void flush_check_run(bloom_conn_handler *handle, check_run *run);
+static int resume_command(bloom_conn_handler *handle, conn_state *state);
+
+static int reject_read_only(bloom_conn_handler *handle);
+static int filter_exists(bloom_conn_handler *handle, char *filter_name);
+static int redirect_filter(bloom_conn_handler *handle, char *filter_name);
+static void handle_filter_missing(bloom_conn_handler *handle, char *filter_name);
+static int start_stream_cmd(bloom_conn_handler *handle);
+static int handle_stream_cmd(bloom_conn_handler *handle, conn_state *state);
+static void handle_stream_keys(bloom_conn_handler *handle, conn_state *state, char *keys, int end_of_input);
+static void handle_stream_batch(bloom_conn_handler *handle, conn_state *state, key_batch *batch, int num_keys);
+
+static int handle_binary_cmd(bloom_conn_handler *handle);
+static void handle_binary_keys(bloom_conn_handler *handle, int opcode, char *filter_name, char *body, uint32_t body_len);
+static void handle_binary_hashes(bloom_conn_handler *handle, char *filter_name, char *body, uint32_t body_len);
+static uint64_t read_be64(const char *buf);
+static void handle_binary_resp(bloom_conn_info *conn, int status, char *body, uint32_t body_len);
+static void init_multi_resp(multi_resp *resp, int format);
+static void reserve_multi_resp(bloom_conn_handler *handle, multi_resp *resp, int keys_len);
+static int conn_resp_format(bloom_conn_handler *handle);
+static int add_multi_results(bloom_conn_handler *handle, multi_resp *resp, char *filter_name, int cmd_res, int num_keys, char *res_buf);
+static void send_multi_resp(bloom_conn_handler *handle, multi_resp *resp, int end_of_input);
 static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len);
 static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len);
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
@@ -55,69 +306,543 @@ void init_conn_handler() {
  * Invoked by the networking layer when there is new
  * data to be handled. The connection handler should
  * consume all the input possible, and generate responses
- * to all requests.
+ * to all requests, up to the command budget.
  * @arg handle The connection related information
- * @return 0 on success.
+ * @return 0 on success, 1 if the connection should be
+ * closed, or 2 if the budget was spent with input left.
+ * The handler should then be invoked again once the other
+ * connections of the worker had a turn. Returns 3 if a
+ * command waits on a filter being faulted in, and the
+ * handler should be invoked again once the fault thread
+ * has faulted in filters.
  */
 int handle_client_connect(bloom_conn_handler *handle) {
     // Look for the next command line
     char *buf, *arg_buf;
     int buf_len, arg_buf_len, should_free;
     int status;
+    unsigned char magic;
+    conn_state *state;
+    int commands = 0;
+    int start_input = client_input_avail(handle->conn);
+    check_run run;
+    run.filter_name = NULL;
+    run.num_keys = 0;
+    run.num_copied = 0;
     while (1) {
+        // Yield once the budget is spent, so a client with a
+        // long pipeline does not stall the rest of the worker
+        if (budget_spent(handle, commands++, start_input)) {
+            flush_check_run(handle, &run);
+            return 2;
+        }
+
+        // Resume a command waiting on its filter
+        state = *(conn_state**)client_handler_state(handle->conn);
+        if (state && state->parked_args) {
+            if (resume_command(handle, state)) return 3;
+            continue;
+        }
+
+        // Continue a streaming command
+        if (state && state->stream_filter) {
+            if (handle_stream_cmd(handle, state)) break;
+            continue;
+        }
+
+        // Check for a binary message
+        if (peek_client_bytes(handle->conn, (char*)&magic, 1)) break;
+        if (magic == BIN_MAGIC) {
+            flush_check_run(handle, &run);
+            status = handle_binary_cmd(handle);
+            if (status == -1) break;    // Wait for the rest of the message
+            if (status == 1) return 1;  // Cannot recover the framing
+            continue;
+        }
+
         status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
-        if (status == -1) break; // Return if no command is available
+        if (status == -1) {
+            // Return if no command is available, unless
+            // a long command can be streamed
+            flush_check_run(handle, &run);
+            if (start_stream_cmd(handle)) break;
+            continue;
+        }
 
         // Determine the command type
         conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
+        BLOOM_PROBE2(command, type, arg_buf);
+        if (capture_enabled()) capture_client_command(handle, type, arg_buf, arg_buf_len);
+
+        // Commands over the rate limits, or shed while the
+        // worker is overloaded, are answered right away
+        if (!admit_command(handle, type, arg_buf, arg_buf_len)) {
+            flush_check_run(handle, &run);
+            handle_client_resp(handle->conn, (char*)BUSY_RESP, BUSY_RESP_LEN);
+            if (should_free) free(buf);
+            continue;
+        }
 
-        // Handle an error or unknown response
-        switch(type) {
-            case CHECK:
-                handle_check_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CHECK_MULTI:
-                handle_check_multi_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case SET:
-                handle_set_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case SET_MULTI:
-                handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CREATE:
-                handle_create_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case DROP:
-                handle_drop_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CLOSE:
-                handle_close_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case CLEAR:
-                handle_clear_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case LIST:
-                handle_list_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case INFO:
-                handle_info_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            case FLUSH:
-                handle_flush_cmd(handle, arg_buf, arg_buf_len);
-                break;
-            default:
-                handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
-                break;
+        // Checks of the filter of the run join it, anything
+        // else is handled once the run is checked
+        if (run.filter_name && join_check_run(&run, type, arg_buf, arg_buf_len, buf, should_free))
+            continue;
+        flush_check_run(handle, &run);
+        latency_begin();
+
+        // Wait for the filter of a key command to be faulted in
+        if (park_command(handle, type, arg_buf, arg_buf_len)) {
+            if (should_free) free(buf);
+            return 3;
         }
 
+        // A check that can be batched starts a new run
+        if (type == CHECK && join_check_run(&run, type, arg_buf, arg_buf_len, buf, should_free)) continue;
+        dispatch_command(handle, type, arg_buf, arg_buf_len);
+        latency_end(type);
+        BLOOM_PROBE1(command__done, type);
+
         // Make sure to free the command buffer if we need to
         if (should_free) free(buf);
+
+        // A failed import leaves its stream in the input
+        state = *(conn_state**)client_handler_state(handle->conn);
+        if (state && state->close_conn) return 1;
+    }
+
+    flush_check_run(handle, &run);
+    return 0;
+}
+
+/**
+ * Adds a check command to the run of checks, or starts a new
+ * run if it is empty. A check of another filter, a full run,
+ * or any other command does not join.
+ * @arg run The run of checks
+ * @arg type The command
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ * @arg line The line of the command, freed with the run if should_free
+ * @return 1 if the command joined the run.
+ */
+static int join_check_run(check_run *run, conn_cmd_type type, char *args, int args_len,
+        char *line, int should_free) {
+    if (type != CHECK || !args || run->num_keys == CHECK_RUN_SIZE) return 0;
+
+    // A new run takes the filter of its first check. The key
+    // must be valid, so errors are left to the command.
+    char *space = memchr(args, ' ', args_len);
+    if (!space) return 0;
+    int name_len = space - args;
+    if (run->filter_name && (name_len != run->name_len || memcmp(args, run->filter_name, name_len)))
+        return 0;
+
+    char *key;
+    int key_len;
+    if (buffer_after_terminator(args, args_len, ' ', &key, &key_len) || key_len <= 1) {
+        *space = ' ';
+        return 0;
+    }
+    if (!run->filter_name) {
+        run->filter_name = args;
+        run->name_len = name_len;
+    }
+    run->keys[run->num_keys++] = key;
+    if (should_free) run->copied[run->num_copied++] = line;
+    return 1;
+}
+
+/**
+ * Checks the keys of a run of check commands as one batch,
+ * and sends the result of each command in order.
+ * @arg run The run of checks, which is emptied
+ */
+static void flush_check_run(bloom_conn_handler *handle, check_run *run) {
+    if (!run->num_keys) return;
+    char results[CHECK_RUN_SIZE];
+    int res = check_keys(handle, run->filter_name, NULL, run->keys, NULL, run->num_keys, results);
+
+    // Every command gets its own line, or the error
+    multi_resp resp;
+    init_multi_resp(&resp, RESP_TEXT);
+    if (res) {
+        for (int i=0; i < run->num_keys; i++) {
+            add_multi_results(handle, &resp, run->filter_name, res, 1, results);
+        }
+    } else {
+        char *out = arena_alloc(handle->arena, run->num_keys * YES_RESP_LEN);
+        int out_len = 0;
+        for (int i=0; i < run->num_keys; i++) {
+            if (results[i]) {
+                memcpy(out + out_len, YES_RESP, YES_RESP_LEN);
+                out_len += YES_RESP_LEN;
+            } else {
+                memcpy(out + out_len, NO_RESP, NO_RESP_LEN);
+                out_len += NO_RESP_LEN;
+            }
+        }
+        send_client_response(handle->conn, &out, &out_len, 1);
+    }
+    latency_end(CHECK);
+
+    for (int i=0; i < run->num_copied; i++) free(run->copied[i]);
+    run->filter_name = NULL;
+    run->num_keys = 0;
+    run->num_copied = 0;
+}
+
+/**
+ * Records a command in the capture file, by its short opcode,
+ * before it is handled and its arguments are split up.
+ * @arg type The command
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ */
+static void capture_client_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    char opcode = 0;
+    for (int c='A'; c < 128 && !opcode; c++) {
+        if (SHORT_COMMANDS[c] == type) opcode = c;
+    }
+    if (!opcode) return;
+
+    conn_state *state = get_conn_state(handle);
+    if (!state) return;
+    if (!state->capture_id) state->capture_id = capture_conn_id();
+
+    capture_command(state->capture_id, opcode, is_key_command(type), args, args_len);
+}
+
+/**
+ * Invokes the handler of a command
+ * @arg type The command
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ */
+static void dispatch_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    switch(type) {
+        case CHECK:
+            handle_check_cmd(handle, args, args_len);
+            break;
+        case CHECK_MULTI:
+            handle_check_multi_cmd(handle, args, args_len);
+            break;
+        case CHECK_ANY:
+            handle_check_any_cmd(handle, args, args_len);
+            break;
+        case SET_ANY:
+            handle_set_any_cmd(handle, args, args_len);
+            break;
+        case UNION:
+            handle_merge_cmd(handle, args, args_len, 0);
+            break;
+        case INTERSECT:
+            handle_merge_cmd(handle, args, args_len, 1);
+            break;
+        case SET:
+            handle_set_cmd(handle, args, args_len);
+            break;
+        case SET_MULTI:
+            handle_set_multi_cmd(handle, args, args_len);
+            break;
+        case CREATE:
+            handle_create_cmd(handle, args, args_len);
+            break;
+        case DROP:
+            handle_drop_cmd(handle, args, args_len);
+            break;
+        case CLOSE:
+            handle_close_cmd(handle, args, args_len);
+            break;
+        case CLEAR:
+            handle_clear_cmd(handle, args, args_len);
+            break;
+        case LIST:
+            handle_list_cmd(handle, args, args_len);
+            break;
+        case INFO:
+            handle_info_cmd(handle, args, args_len);
+            break;
+        case FLUSH:
+            handle_flush_cmd(handle, args, args_len);
+            break;
+        case USE:
+            handle_use_cmd(handle, args, args_len);
+            break;
+        case RELEASE:
+            handle_release_cmd(handle, args, args_len);
+            break;
+        case SNAPSHOT:
+            handle_snapshot_cmd(handle, args, args_len);
+            break;
+        case WARM:
+            handle_warm_cmd(handle, args, args_len);
+            break;
+        case CREATE_MULTI:
+            handle_create_multi_cmd(handle, args, args_len);
+            break;
+        case DROP_MULTI:
+            handle_drop_multi_cmd(handle, args, args_len);
+            break;
+        case DROP_PREFIX:
+            handle_drop_prefix_cmd(handle, args, args_len);
+            break;
+        case DELETE:
+            handle_delete_cmd(handle, args, args_len);
+            break;
+        case FREEZE:
+            handle_freeze_cmd(handle, args, args_len);
+            break;
+        case COMPACT:
+            handle_compact_cmd(handle, args, args_len);
+            break;
+        case SHRINK:
+            handle_shrink_cmd(handle, args, args_len);
+            break;
+        case RESET:
+            handle_reset_cmd(handle, args, args_len);
+            break;
+        case STATS:
+            handle_stats_cmd(handle, args, args_len);
+            break;
+        case SLOWLOG:
+            handle_slowlog_cmd(handle, args, args_len);
+            break;
+        case ALIAS:
+            handle_alias_cmd(handle, args, args_len);
+            break;
+        case LOAD:
+            handle_load_cmd(handle, args, args_len);
+            break;
+        case MIGRATE:
+            handle_migrate_cmd(handle, args, args_len);
+            break;
+        case EXPORT:
+            handle_export_cmd(handle, args, args_len);
+            break;
+        case IMPORT:
+            handle_import_cmd(handle, args, args_len);
+            break;
+        case PROVISION:
+            handle_provision_cmd(handle, args, args_len);
+            break;
+        case FORMAT:
+            handle_format_cmd(handle, args, args_len);
+            break;
+        default:
+            handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+            break;
     }
+}
+
+/**
+ * With fault_retry and fault_park, a key command on a filter
+ * that is not in memory waits for the fault thread, instead of
+ * being answered with a retry. The command is kept in the state
+ * of the connection, and the networking layer stops reading the
+ * connection until it is resumed.
+ * @arg type The command
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ * @return 1 if the command was parked.
+ */
+static int park_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    if (!handle->config->fault_retry || !handle->config->fault_park || !args) return 0;
+    switch (type) {
+        case CHECK:
+        case CHECK_MULTI:
+        case SET:
+        case SET_MULTI:
+        case DELETE:
+            break;
+        default:
+            return 0;
+    }
+    if (!client_can_park(handle->conn)) return 0;
+
+    // The filter name ends at the first space
+    char *space = memchr(args, ' ', args_len);
+    int name_len = (space) ? space - args : args_len;
+    char *name = arena_alloc(handle->arena, name_len + 1);
+    if (!name) return 0;
+    memcpy(name, args, name_len);
+    name[name_len] = '\0';
+    if (!filtmgr_queue_fault(handle->mgr, name)) return 0;
+
+    // Keep a copy of the command, the input is reused
+    conn_state *state = get_conn_state(handle);
+    char *copy = (state) ? malloc(args_len + 1) : NULL;
+    if (!copy) return 0;
+    memcpy(copy, args, args_len);
+    copy[args_len] = '\0';
+    state->parked_type = type;
+    state->parked_args = copy;
+    state->parked_len = args_len;
+    return 1;
+}
 
+/**
+ * Resumes a parked command, once its filter is in memory.
+ * @arg state The state of the connection
+ * @return 1 if the filter is still being faulted in.
+ */
+static int resume_command(bloom_conn_handler *handle, conn_state *state) {
+    char *args = state->parked_args;
+    char *space = memchr(args, ' ', state->parked_len);
+    if (space) *space = '\0';
+    int loading = filtmgr_queue_fault(handle->mgr, args);
+    if (space) *space = ' ';
+    if (loading) return 1;
+
+    state->parked_args = NULL;
+    latency_begin();
+    dispatch_command(handle, state->parked_type, args, state->parked_len);
+    latency_end(state->parked_type);
+    free(args);
     return 0;
 }
 
+/**
+ * Checks if a connection has used up its turn, by the
+ * commands handled or the input consumed, while it still
+ * has input left. A zero budget is unlimited.
+ * @arg commands The commands handled in this turn
+ * @arg start_input The input buffered at the start of the turn
+ * @return 1 if the connection should yield.
+ */
+static int budget_spent(bloom_conn_handler *handle, int commands, int start_input) {
+    bloom_config *config = handle->config;
+    if (!config->command_budget && !config->command_budget_kb) return 0;
+    int avail = client_input_avail(handle->conn);
+    if (!avail) return 0;
+    if (config->command_budget && commands >= config->command_budget) return 1;
+    return config->command_budget_kb && start_input - avail >= config->command_budget_kb * 1024;
+}
+
+/**
+ * Checks if a command checks or changes keys of filters.
+ */
+static int is_key_command(conn_cmd_type type) {
+    return (type == CHECK || type == CHECK_MULTI || type == SET || type == SET_MULTI ||
+            type == DELETE || type == CHECK_ANY || type == SET_ANY);
+}
+
+/**
+ * Checks a command against the rate limits of the connection,
+ * using admit_keys. The keys of a command are counted by the
+ * spaces between them.
+ * @arg type The command
+ * @arg args The arguments of the command, or NULL
+ * @arg args_len The length of the arguments
+ * @return 1 if the command is admitted, 0 if it should be
+ * answered with Busy.
+ */
+static int admit_command(bloom_conn_handler *handle, conn_cmd_type type, char *args, int args_len) {
+    bloom_config *config = handle->config;
+    if (!config->conn_command_rate && !config->conn_key_rate &&
+            !config->shed_backlog && !config->shed_input_kb) return 1;
+
+    // Single key commands have no spaces in the key
+    int is_keys = is_key_command(type), num_keys = 0;
+    if (is_keys && args) {
+        num_keys = 1;
+        char *key = memchr(args, ' ', args_len);
+        if (type != CHECK && type != SET) {
+            for (char *end = args + args_len; key && (key = memchr(key + 1, ' ', end - key - 1)); )
+                num_keys++;
+        }
+    }
+    return admit_keys(handle, is_keys, num_keys);
+}
+
+/**
+ * Checks a command against the rate limits of the connection,
+ * and sheds the key commands while the worker has a backlog or
+ * the connection has too much input buffered.
+ * @arg is_keys Does the command check or change keys
+ * @arg num_keys The keys of the command, charged to conn_key_rate
+ * @return 1 if the command is admitted, 0 if it should be
+ * answered with Busy.
+ */
+static int admit_keys(bloom_conn_handler *handle, int is_keys, int num_keys) {
+    // Shed the key commands first, they are the bulk of the work
+    bloom_config *config = handle->config;
+    if (is_keys && config->shed_backlog && client_worker_backlog(handle->conn) >= config->shed_backlog)
+        return 0;
+    if (is_keys && config->shed_input_kb && client_input_avail(handle->conn) > config->shed_input_kb * 1024)
+        return 0;
+    if (!config->conn_command_rate && !config->conn_key_rate) return 1;
+
+    conn_state *state = get_conn_state(handle);
+    if (!state) return 1;
+    uint64_t now = rate_limit_now();
+    if (!rate_limit_take(&state->cmd_rate, config->conn_command_rate, 1, now)) return 0;
+    if (!is_keys || !num_keys) return 1;
+    return rate_limit_take(&state->key_rate, config->conn_key_rate, num_keys, now);
+}
+
+/**
+ * Invoked by the networking layer when a connection
+ * that has handler state is closed, so that the state
+ * can be released.
+ * @arg handle The connection related information
+ */
+void handle_client_close(bloom_conn_handler *handle) {
+    conn_state **state = (conn_state**)client_handler_state(handle->conn);
+    if (!*state) return;
+    for (int i=0; i < MAX_CONN_HANDLES; i++) {
+        if ((*state)->handles[i]) filtmgr_release_handle(handle->mgr, (*state)->handles[i]);
+    }
+    if ((*state)->stream_filter) free((*state)->stream_filter);
+    if ((*state)->stream_handle) filtmgr_release_handle(handle->mgr, (*state)->stream_handle);
+    if ((*state)->parked_args) free((*state)->parked_args);
+    free(*state);
+    *state = NULL;
+}
+
+/**
+ * Invoked by the networking layer when a UDP datagram
+ * is received. The datagram may hold many command lines, and
+ * the last line does not need a newline. Only the set and bulk
+ * commands are applied, and no responses are sent.
+ * @arg handle The connection related information, conn must be NULL
+ * @arg buf The datagram buffer. Must have room for one extra byte.
+ * @arg buf_len The length of the datagram
+ * @return The number of commands applied.
+ */
+int handle_udp_message(bloom_conn_handler *handle, char *buf, int buf_len) {
+    // Make sure the last line is terminated. Sets are
+    // dropped by read-only servers.
+    if (buf_len == 0 || handle->config->read_only) return 0;
+    if (buf[buf_len-1] != '\n') buf[buf_len++] = '\n';
+
+    char *line = buf, *term, *arg_buf;
+    int line_len, arg_buf_len, applied = 0;
+    while ((term = memchr(line, '\n', buf_len - (line - buf)))) {
+        *term = '\0';
+        line_len = term - line + 1;
+
+        // Skip any blank lines
+        if (line_len > 2 || (line_len == 2 && *line != '\r')) {
+            conn_cmd_type type = determine_client_command(line, line_len, &arg_buf, &arg_buf_len);
+            switch (type) {
+                case SET:
+                    handle_set_cmd(handle, arg_buf, arg_buf_len);
+                    applied++;
+                    break;
+                case SET_MULTI:
+                    handle_set_multi_cmd(handle, arg_buf, arg_buf_len);
+                    applied++;
+                    break;
+                default:
+                    syslog(LOG_DEBUG, "Ignoring unsupported UDP command: %s", line);
+                    break;
+            }
+        }
+        line = term + 1;
+    }
+    return applied;
+}
+
 /**
  * Periodic update is used to update our checkpoint with
  * the filter manager, so that vacuum progress can be made.
@@ -126,14 +851,22 @@ void periodic_update(bloom_conn_handler *handle) {
     filtmgr_client_checkpoint(handle->mgr);
 }
 
+/**
+ * Idle update is used to stop holding back the vacuum
+ * while a worker is blocked waiting for events.
+ */
+void idle_update(bloom_conn_handler *handle) {
+    filtmgr_client_offline(handle->mgr);
+}
+
 
 /**
  * Internal method to handle a command that relies
  * on a filter name and a single key, responses are handled using
- * handle_multi_response.
+ * add_multi_results, and are always text.
  */
 static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+        keys_func func) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
@@ -152,26 +885,169 @@ static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args
     char result_buf[1];
 
     // Call into the filter manager
-    int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, 1, (char*)&result_buf);
-    handle_multi_response(handle, res, 1, (char*)&result_buf, 1);
+    int res = func(handle, args, NULL, (char**)&key_buf, NULL, 1, (char*)&result_buf);
+    multi_resp resp;
+    init_multi_resp(&resp, RESP_TEXT);
+    reserve_multi_resp(handle, &resp, 1);
+    if (add_multi_results(handle, &resp, args, res, 1, (char*)&result_buf)) return;
+    send_multi_resp(handle, &resp, 1);
+}
+
+/**
+ * Resolves a handle reference of the form @N to the
+ * slot of the connection that holds the handle.
+ * @return The slot, or NULL if the reference is not valid.
+ */
+static bloom_filter_handle** lookup_handle(bloom_conn_handler *handle, char *ref) {
+    // UDP messages have no connection state
+    if (!handle->conn || *ref != '@') return NULL;
+    conn_state *state = *(conn_state**)client_handler_state(handle->conn);
+    if (!state) return NULL;
+
+    char *end;
+    long index = strtol(ref + 1, &end, 10);
+    if (end == ref + 1 || *end != '\0' || index < 0 || index >= MAX_CONN_HANDLES)
+        return NULL;
+    return (state->handles[index]) ? state->handles + index : NULL;
+}
+
+/**
+ * Returns the state of a connection, allocating it on first use.
+ * @return The state, or NULL if it could not be allocated.
+ */
+static conn_state* get_conn_state(bloom_conn_handler *handle) {
+    conn_state **state = (conn_state**)client_handler_state(handle->conn);
+    if (!*state) *state = calloc(1, sizeof(conn_state));
+    return *state;
+}
+
+/**
+ * Charges the keys of a command to the key rate of its filter,
+ * when the filters are limited. A filter that does not exist is
+ * not limited, so the command gets the usual error.
+ * @arg filter_name The filter name or handle reference
+ * @arg filt The handle of the filter, or NULL to use the name
+ * @arg num_keys The keys to charge
+ * @return 1 if the filter is over its rate.
+ */
+static int filter_over_rate(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt, int num_keys) {
+    if (!handle->config->filter_key_rate) return 0;
+    if (filt) return filtmgr_limit_keys(handle->mgr, filt, num_keys);
+    if (*filter_name == '@') {
+        bloom_filter_handle **slot = lookup_handle(handle, filter_name);
+        return (slot) ? filtmgr_limit_keys(handle->mgr, *slot, num_keys) : 0;
+    }
+    if (filtmgr_open_handle(handle->mgr, filter_name, &filt)) return 0;
+    int over = filtmgr_limit_keys(handle->mgr, filt, num_keys);
+    filtmgr_release_handle(handle->mgr, filt);
+    return over;
+}
+
+static int check_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result) {
+    if (filter_over_rate(handle, filter_name, filt, num_keys)) return -7;
+    if (!filt && *filter_name != '@')
+        return filtmgr_check_keys_len(handle->mgr, filter_name, keys, key_lens, num_keys, result);
+    if (!filt) {
+        bloom_filter_handle **slot = lookup_handle(handle, filter_name);
+        if (!slot) return -1;
+        filt = *slot;
+    }
+    return filtmgr_check_keys_handle_len(handle->mgr, filt, keys, key_lens, num_keys, result);
+}
+
+static int check_hashed(bloom_conn_handler *handle, char *filter_name, bloom_hashed_key *keys, int num_keys, char *result) {
+    if (filter_over_rate(handle, filter_name, NULL, num_keys)) return -7;
+    if (*filter_name != '@')
+        return filtmgr_check_hashed(handle->mgr, filter_name, keys, num_keys, result);
+    bloom_filter_handle **slot = lookup_handle(handle, filter_name);
+    if (!slot) return -1;
+    return filtmgr_check_hashed_handle(handle->mgr, *slot, keys, num_keys, result);
+}
+
+static int set_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result) {
+    if (filter_over_rate(handle, filter_name, filt, num_keys)) return -7;
+    if (!filt && *filter_name != '@')
+        return filtmgr_set_keys_len(handle->mgr, filter_name, keys, key_lens, num_keys, result);
+    if (!filt) {
+        bloom_filter_handle **slot = lookup_handle(handle, filter_name);
+        if (!slot) return -1;
+        filt = *slot;
+    }
+    return filtmgr_set_keys_handle_len(handle->mgr, filt, keys, key_lens, num_keys, result);
+}
+
+static int delete_keys(bloom_conn_handler *handle, char *filter_name, bloom_filter_handle *filt,
+        char **keys, int *key_lens, int num_keys, char *result) {
+    if (filter_over_rate(handle, filter_name, filt, num_keys)) return -7;
+    if (!filt && *filter_name != '@')
+        return filtmgr_delete_keys_len(handle->mgr, filter_name, keys, key_lens, num_keys, result);
+    if (!filt) {
+        bloom_filter_handle **slot = lookup_handle(handle, filter_name);
+        if (!slot) return -1;
+        filt = *slot;
+    }
+    return filtmgr_delete_keys_handle_len(handle->mgr, filt, keys, key_lens, num_keys, result);
+}
+
+/**
+ * Rejects a command that changes the filters, if we
+ * are a read-only server sharing the files of a writer.
+ * @return 1 if the command was rejected.
+ */
+static int reject_read_only(bloom_conn_handler *handle) {
+    if (!handle->config->read_only) return 0;
+    handle_client_err(handle->conn, (char*)&READ_ONLY_ERR, READ_ONLY_ERR_LEN);
+    return 1;
+}
+
+// Checks if we have a filter
+static int filter_exists(bloom_conn_handler *handle, char *filter_name) {
+    bloom_filter_handle *filt;
+    if (filtmgr_open_handle(handle->mgr, filter_name, &filt)) return 0;
+    filtmgr_release_handle(handle->mgr, filt);
+    return 1;
+}
+
+/**
+ * Redirects the client to the node that serves a filter
+ * we do not have, if we are in a cluster.
+ * @return 1 if the client was redirected.
+ */
+static int redirect_filter(bloom_conn_handler *handle, char *filter_name) {
+    if (!handle->cluster || *filter_name == '@') return 0;
+    const char *addr = cluster_redirect(handle->cluster, filter_name);
+    if (!addr) return 0;
+    char resp[320];
+    int resp_len = snprintf(resp, sizeof(resp), "%s%s\n", MOVED_RESP, addr);
+    handle_client_resp(handle->conn, resp, resp_len);
+    return 1;
+}
+
+// Responds to a command for a filter we do not have
+static void handle_filter_missing(bloom_conn_handler *handle, char *filter_name) {
+    if (!redirect_filter(handle, filter_name))
+        handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
 }
 
 static void handle_check_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_check_keys);
+    handle_filt_key_cmd(handle, args, args_len, check_keys);
 }
 
 static void handle_set_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_key_cmd(handle, args, args_len, filtmgr_set_keys);
+    if (reject_read_only(handle)) return;
+    handle_filt_key_cmd(handle, args, args_len, set_keys);
 }
 
 
 /**
  * Internal method to handle a command that relies
  * on a filter name and multiple keys, responses are handled using
- * handle_multi_response.
+ * add_multi_results, and sent once all the keys are handled.
  */
 static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+        keys_func func) {
     #define CHECK_ARG_ERR() { \
         handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
         return; \
@@ -179,63 +1055,442 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
     // If we have no args, complain.
     if (!args) CHECK_ARG_ERR();
 
-    // Setup the buffers
-    char *key_buf[MULTI_OP_SIZE];
-    char result_buf[MULTI_OP_SIZE];
-
     // Scan all the keys
     char *key;
     int key_len;
     int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (err || key_len <= 1) CHECK_ARG_ERR();
 
-    // Parse any options
-    char *curr_key = key;
-    int index = 0;
-    #define HAS_ANOTHER_KEY() (curr_key && *curr_key != '\0')
-    while (HAS_ANOTHER_KEY()) {
-        // Adds a zero terminator to the current key, scans forward
-        buffer_after_terminator(key, key_len, ' ', &key, &key_len);
-
-        // Set the key
-        key_buf[index] = curr_key;
-
-        // Advance to the next key
-        curr_key = key;
-        index++;
-
-        // If we have filled the buffer, check now
-        if (index == MULTI_OP_SIZE) {
-            //  Handle the keys now
-            int res = filtmgr_func(handle->mgr, args, (char**)&key_buf, index, (char*)&result_buf);
-            res = handle_multi_response(handle, res, index, (char*)&result_buf, !HAS_ANOTHER_KEY());
-            if (res) return;
-
-            // Reset the index
-            index = 0;
-        }
+    // Setup the buffers
+    key_batch batch;
+    if (init_key_batch(handle, &batch)) {
+        INTERNAL_ERROR();
+        return;
     }
+    multi_resp resp;
+    init_multi_resp(&resp, conn_resp_format(handle));
+    reserve_multi_resp(handle, &resp, key_len);
+
+    // Split the keys a batch at a time, and handle each batch.
+    // The filter is looked up once if there is more than one.
+    bloom_filter_handle *filt = NULL;
+    int offset = 0, index, failed = 0;
+    do {
+        index = tokenize_keys(key, key_len - 1, &offset, batch.keys, batch.lens, batch.size);
+        if (!index) break;
+        int res = func(handle, args, filt, batch.keys, batch.lens, index, batch.result);
+        failed = add_multi_results(handle, &resp, args, res, index, batch.result);
+        if (index == batch.size && !filt && !failed) filt = open_batch_filter(handle, args);
+    } while (index == batch.size && !failed);
+    if (filt) filtmgr_release_handle(handle->mgr, filt);
+    if (failed) return;
+    if (!resp.keys) CHECK_ARG_ERR();
+    send_multi_resp(handle, &resp, 1);
+}
 
-    // Handle any remaining keys
-    if (index) {
-        int res = filtmgr_func(handle->mgr, args, key_buf, index, result_buf);
-        handle_multi_response(handle, res, index, (char*)&result_buf, 1);
-    }
+/**
+ * Sets up the batches of keys of a command. Up to multi_batch_size
+ * keys are handled under one acquire of the filter lock, but when
+ * other events of the worker are waiting, the batches drop back to
+ * MULTI_OP_SIZE keys so long commands release the lock sooner.
+ * @return 0 on success, -1 if the buffers could not be allocated.
+ */
+static int init_key_batch(bloom_conn_handler *handle, key_batch *batch) {
+    int size = handle->config->multi_batch_size;
+    if (size > MULTI_OP_SIZE && handle->conn && client_worker_busy(handle->conn))
+        size = MULTI_OP_SIZE;
+    batch->size = size;
+    batch->keys = arena_alloc(handle->arena, size * sizeof(char*));
+    batch->lens = arena_alloc(handle->arena, size * sizeof(int));
+    batch->result = arena_alloc(handle->arena, size);
+    return (batch->keys && batch->lens && batch->result) ? 0 : -1;
+}
+
+/**
+ * Opens a handle to the filter of a command with more batches
+ * of keys to handle, so the rest of the batches do not look up
+ * the filter again. Handle references are already resolved.
+ * @return The handle to release, or NULL to use the name.
+ */
+static bloom_filter_handle* open_batch_filter(bloom_conn_handler *handle, char *filter_name) {
+    bloom_filter_handle *filt;
+    if (*filter_name == '@' || filtmgr_open_handle(handle->mgr, filter_name, &filt)) return NULL;
+    return filt;
 }
 
 static void handle_check_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_check_keys);
+    handle_filt_multi_key_cmd(handle, args, args_len, check_keys);
 }
 
-static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_multi_key_cmd(handle, args, args_len, filtmgr_set_keys);
+/**
+ * Internal command used to check keys against several filters,
+ * given as a comma separated list. A key is Yes if any of the
+ * filters has it, and the response is one line, like multi.
+ */
+static void handle_check_any_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_any_key_cmd(handle, args, args_len, check_any_keys);
 }
 
+/**
+ * Internal command used to set the keys that none of several
+ * filters has. The keys are set in the first filter, and a key
+ * is Yes if it was absent from all of them, like bulk.
+ */
+static void handle_set_any_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_any_key_cmd(handle, args, args_len, set_any_keys);
+}
 
 /**
- * Internal command used to handle filter creation.
+ * Internal method to handle a command with a comma separated
+ * list of filters and multiple keys. The responses are handled
+ * using add_multi_results, like handle_filt_multi_key_cmd.
  */
-static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+static void handle_filt_any_key_cmd(bloom_conn_handler *handle, char *args, int args_len,
+        any_keys_func func) {
+    #define CHECK_ARG_ERR() { \
+        handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) CHECK_ARG_ERR();
+
+    // Scan past the filter names
+    char *key;
+    int key_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (err || key_len <= 1) CHECK_ARG_ERR();
+
+    // Split the filter names
+    char *filter_names[MAX_ANY_FILTERS];
+    int num_filters = 0;
+    char *rest = args, *name;
+    while ((name = strsep(&rest, ","))) {
+        if (*name == '\0') continue;
+        if (num_filters == MAX_ANY_FILTERS) {
+            handle_client_err(handle->conn, (char*)&TOO_MANY_FILTS, TOO_MANY_FILTS_LEN);
+            return;
+        }
+        filter_names[num_filters++] = name;
+    }
+    if (!num_filters) CHECK_ARG_ERR();
+
+    // Setup the buffers
+    key_batch batch;
+    if (init_key_batch(handle, &batch)) {
+        INTERNAL_ERROR();
+        return;
+    }
+    char *failed = filter_names[0];
+    multi_resp resp;
+    init_multi_resp(&resp, conn_resp_format(handle));
+    reserve_multi_resp(handle, &resp, key_len);
+
+    // Check the keys in batches, like multi
+    int offset = 0, index;
+    do {
+        index = tokenize_keys(key, key_len - 1, &offset, batch.keys, batch.lens, batch.size);
+        if (!index) break;
+        int res = func(handle, filter_names, num_filters, batch.keys, batch.lens, index, batch.result, &failed);
+        if (add_multi_results(handle, &resp, failed, res, index, batch.result)) return;
+    } while (index == batch.size);
+    if (!resp.keys) CHECK_ARG_ERR();
+    send_multi_resp(handle, &resp, 1);
+}
+
+/**
+ * Checks a batch of keys against several filters. Each key is
+ * hashed once, and the filters after the first that has a key
+ * only check the keys that are still missing.
+ * @arg failed Output, the filter that failed on an error
+ * @return 0 on success, or the error of the filter that failed.
+ */
+static int check_any_keys(bloom_conn_handler *handle, char **filter_names, int num_filters,
+        char **keys, int *key_lens, int num_keys, char *result, char **failed) {
+    bloom_hashed_key *hashed = arena_alloc(handle->arena, num_keys * sizeof(bloom_hashed_key));
+    int *index = arena_alloc(handle->arena, num_keys * sizeof(int));
+    char *found = arena_alloc(handle->arena, num_keys);
+    if (!hashed || !index || !found) return -2;
+    for (int i=0; i < num_keys; i++) {
+        bf_hashed_key_init_len(hashed + i, keys[i], key_lens[i]);
+        index[i] = i;
+        result[i] = 0;
+    }
+
+    // Every filter is checked, so a missing one is always an error
+    int pending = num_keys;
+    for (int f=0; f < num_filters; f++) {
+        int res = check_hashed(handle, filter_names[f], hashed, pending, found);
+        if (res) {
+            *failed = filter_names[f];
+            return res;
+        }
+
+        // Keep the missing keys, with their cached hashes
+        int missing = 0;
+        for (int j=0; j < pending; j++) {
+            if (found[j]) {
+                result[index[j]] = 1;
+            } else {
+                hashed[missing] = hashed[j];
+                index[missing++] = index[j];
+            }
+        }
+        pending = missing;
+    }
+    return 0;
+}
+
+/**
+ * Sets a batch of keys in the first of several filters, unless
+ * one of the other filters has them. Setting a key tests it first
+ * under the filter lock, so the first filter needs no check.
+ * @arg failed Output, the filter that failed on an error
+ * @return 0 on success, or the error of the filter that failed.
+ */
+static int set_any_keys(bloom_conn_handler *handle, char **filter_names, int num_filters,
+        char **keys, int *key_lens, int num_keys, char *result, char **failed) {
+    *failed = filter_names[0];
+    if (num_filters == 1)
+        return set_keys(handle, filter_names[0], NULL, keys, key_lens, num_keys, result);
+
+    char *found = arena_alloc(handle->arena, num_keys);
+    if (!found) return -2;
+    int res = check_any_keys(handle, filter_names + 1, num_filters - 1,
+            keys, key_lens, num_keys, found, failed);
+    if (res) return res;
+
+    // Gather the keys none of the others has. The target is
+    // set even without any, so a missing one is an error.
+    char **absent = arena_alloc(handle->arena, num_keys * sizeof(char*));
+    int *absent_lens = arena_alloc(handle->arena, num_keys * sizeof(int));
+    char *set = arena_alloc(handle->arena, num_keys);
+    if (!absent || !absent_lens || !set) return -2;
+    int num_absent = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (found[i]) continue;
+        absent[num_absent] = keys[i];
+        absent_lens[num_absent++] = key_lens[i];
+    }
+    res = set_keys(handle, filter_names[0], NULL, absent, absent_lens, num_absent, set);
+    if (res) return res;
+
+    // Spread the results back over the keys
+    for (int i=0, j=0; i < num_keys; i++)
+        result[i] = (found[i]) ? 0 : set[j++];
+    return 0;
+}
+
+static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_multi_key_cmd(handle, args, args_len, set_keys);
+}
+
+static void handle_delete_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_multi_key_cmd(handle, args, args_len, delete_keys);
+}
+
+
+/**
+ * Starts streaming a multi or bulk command, once
+ * enough of it is buffered and it has no newline yet.
+ * The keys that have arrived are handled right away.
+ * @return 0 if the command is streamed, -1 to wait for more input.
+ */
+static int start_stream_cmd(bloom_conn_handler *handle) {
+    // Only long commands are streamed
+    if (client_input_avail(handle->conn) < STREAM_MIN_SIZE) return -1;
+
+    // Check the command, and that the filter name has arrived
+    char prefix[STREAM_PREFIX_SIZE];
+    if (peek_client_bytes(handle->conn, prefix, sizeof(prefix))) return -1;
+    keys_func func;
+    int cmd_len;
+    if (!memcmp(prefix, "b ", 2) || !memcmp(prefix, "m ", 2)) {
+        cmd_len = 2;
+    } else if (!memcmp(prefix, "bulk ", 5) || !memcmp(prefix, "multi ", 6)) {
+        cmd_len = (*prefix == 'b') ? 5 : 6;
+    } else {
+        return -1;
+    }
+    func = (*prefix == 'b') ? set_keys : check_keys;
+    if (func == set_keys && handle->config->read_only) return -1;
+    char *name_end = memchr(prefix + cmd_len, ' ', sizeof(prefix) - cmd_len);
+    if (!name_end || name_end == prefix + cmd_len) return -1;
+
+    conn_state *state = get_conn_state(handle);
+    if (!state) return -1;
+    state->stream_filter = strndup(prefix + cmd_len, name_end - prefix - cmd_len);
+    if (!state->stream_filter) return -1;
+    state->stream_func = func;
+    state->stream_handle = open_batch_filter(handle, state->stream_filter);
+    init_multi_resp(&state->stream_resp, state->resp_format);
+    state->stream_failed = 0;
+
+    // A command that is not admitted is discarded as it arrives,
+    // its keys are charged as they are handled
+    if (!admit_keys(handle, 1, 0)) {
+        handle_client_resp(handle->conn, (char*)BUSY_RESP, BUSY_RESP_LEN);
+        state->stream_failed = 1;
+    }
+
+    // Handle the keys after the filter name
+    char *buf;
+    int buf_len, should_free;
+    extract_to_last_terminator(handle->conn, ' ', &buf, &buf_len, &should_free);
+    int keys_offset = name_end - prefix + 1;
+    handle_stream_keys(handle, state, (keys_offset < buf_len) ? buf + keys_offset : buf + buf_len - 1, 0);
+    if (should_free) free(buf);
+    return 0;
+}
+
+
+/**
+ * Continues a streaming command, handling the keys that
+ * have arrived. The command ends at the next newline.
+ * @return 0 if keys were handled, -1 to wait for more input.
+ */
+static int handle_stream_cmd(bloom_conn_handler *handle, conn_state *state) {
+    char *buf;
+    int buf_len, should_free, end_of_input = 1;
+    if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free)) {
+        if (extract_to_last_terminator(handle->conn, ' ', &buf, &buf_len, &should_free)) return -1;
+        end_of_input = 0;
+    } else if (buf_len >= 2 && buf[buf_len-2] == '\r') {
+        buf[buf_len-2] = '\0';
+    }
+    handle_stream_keys(handle, state, buf, end_of_input);
+    if (should_free) free(buf);
+    return 0;
+}
+
+
+/**
+ * Handles a piece of a streaming command. The results are
+ * sent once the piece is handled, and the response is ended
+ * with the command.
+ * @arg keys The null terminated keys, separated by spaces
+ * @arg end_of_input Does this end the command
+ */
+static void handle_stream_keys(bloom_conn_handler *handle, conn_state *state, char *keys, int end_of_input) {
+    int keys_len = strlen(keys);
+    multi_resp *resp = &state->stream_resp;
+    reserve_multi_resp(handle, resp, keys_len + 1);
+
+    key_batch batch;
+    if (init_key_batch(handle, &batch) && !state->stream_failed) {
+        INTERNAL_ERROR();
+        state->stream_failed = 1;
+    }
+    int offset = 0, index;
+    while (!state->stream_failed) {
+        index = tokenize_keys(keys, keys_len, &offset, batch.keys, batch.lens, batch.size);
+        if (index) handle_stream_batch(handle, state, &batch, index);
+        if (index < batch.size) break;
+    }
+
+    // Send the results, and finish the response
+    if (!state->stream_failed) {
+        if (!end_of_input || resp->keys)
+            send_multi_resp(handle, resp, end_of_input);
+        else
+            handle_client_err(handle->conn, (char*)&FILT_KEY_NEEDED, FILT_KEY_NEEDED_LEN);
+    }
+    if (!end_of_input) return;
+    free(state->stream_filter);
+    state->stream_filter = NULL;
+    if (state->stream_handle) filtmgr_release_handle(handle->mgr, state->stream_handle);
+    state->stream_handle = NULL;
+}
+
+
+/**
+ * Checks or sets a batch of keys for a streaming command,
+ * and adds the results to its response.
+ */
+static void handle_stream_batch(bloom_conn_handler *handle, conn_state *state, key_batch *batch, int num_keys) {
+    if (state->stream_failed) return;
+    int res = -7;
+    if (rate_limit_take(&state->key_rate, handle->config->conn_key_rate, num_keys, rate_limit_now()))
+        res = state->stream_func(handle, state->stream_filter, state->stream_handle,
+                batch->keys, batch->lens, num_keys, batch->result);
+
+    // Errors end the response, and the rest of the command is discarded
+    if (add_multi_results(handle, &state->stream_resp, state->stream_filter, res, num_keys, batch->result))
+        state->stream_failed = 1;
+}
+
+
+/**
+ * Internal command used to open a filter handle. The handle
+ * is bound to the connection, and is returned as @N, which
+ * can be used in place of the filter name.
+ */
+static void handle_use_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Allocate the connection state on first use
+    conn_state *state = get_conn_state(handle);
+    if (!state) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    // Find a free slot
+    int index;
+    for (index=0; index < MAX_CONN_HANDLES; index++) {
+        if (!state->handles[index]) break;
+    }
+    if (index == MAX_CONN_HANDLES) {
+        handle_client_err(handle->conn, (char*)&TOO_MANY_HANDLES, TOO_MANY_HANDLES_LEN);
+        return;
+    }
+
+    // Open the handle
+    if (filtmgr_open_handle(handle->mgr, args, state->handles + index)) {
+        handle_filter_missing(handle, args);
+        return;
+    }
+
+    char resp[16];
+    int resp_len = snprintf(resp, sizeof(resp), "@%d\n", index);
+    handle_client_resp(handle->conn, resp, resp_len);
+}
+
+
+/**
+ * Internal command used to release a filter handle.
+ */
+static void handle_release_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&HANDLE_NEEDED, HANDLE_NEEDED_LEN);
+        return;
+    }
+
+    bloom_filter_handle **slot = lookup_handle(handle, args);
+    if (!slot) {
+        handle_client_resp(handle->conn, (char*)HANDLE_NOT_EXIST, HANDLE_NOT_EXIST_LEN);
+        return;
+    }
+    filtmgr_release_handle(handle->mgr, *slot);
+    *slot = NULL;
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+
+/**
+ * Internal command used to handle filter creation.
+ */
+static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
     // If we have no args, complain.
     if (!args) {
         handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
@@ -254,111 +1509,1260 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
         return;
     }
 
+    // In a cluster, filters are created on the node they hash to
+    if (handle->cluster && !filter_exists(handle, filter_name) &&
+            redirect_filter(handle, filter_name))
+        return;
+
     // Parse the options
     bloom_config *config = NULL;
-    int err = 0;
-    if (res == 0) {
-        // Make a new config store, copy the current
+    if (res == 0 && parse_create_options(handle, options, options_len, &config))
+        return;
+
+    // The filter keeps its config, so move it out of the arena
+    if (config) {
+        bloom_config *arena_config = config;
         config = malloc(sizeof(bloom_config));
-        memcpy(config, handle->config, sizeof(bloom_config));
-
-        // Parse any options
-        char *param = options;
-        while (param) {
-            // Adds a zero terminator to the current param, scans forward
-            buffer_after_terminator(options, options_len, ' ', &options, &options_len);
-
-            // Check for the custom params
-            int match = 0;
-            match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
-            match |= sscanf(param, "prob=%lf", &config->default_probability);
-            match |= sscanf(param, "in_memory=%d", &config->in_memory);
-
-            // Check if there was no match
-            if (!match) {
-                err = 1;
-                handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
-                break;
-            }
+        memcpy(config, arena_config, sizeof(bloom_config));
+    }
+
+    // Create a new filter
+    res = filtmgr_create_filter(handle->mgr, filter_name, config);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
+            if (config) free(config);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
+            if (config) free(config);
+            break;
+        default:
+            INTERNAL_ERROR();
+            if (config) free(config);
+            break;
+    }
+}
+
+
+/**
+ * Parses the options of a create command into a copy
+ * of the default config. Sends an error on bad options.
+ * @arg options The space separated options
+ * @arg config Output, the new config, allocated from the arena.
+ * @return 0 on success, -1 if an error was sent.
+ */
+static int parse_create_options(bloom_conn_handler *handle, char *options, int options_len, bloom_config **config_out) {
+    // Make a new config store, copy the current
+    bloom_config *config = arena_alloc(handle->arena, sizeof(bloom_config));
+    memcpy(config, handle->config, sizeof(bloom_config));
+
+    // Parse any options
+    uint64_t max_capacity = 0;
+    int layout_set = 0;
+    int err = apply_create_options(handle, config, options, options_len, &max_capacity, &layout_set, 0);
+
+    // A filter expected to reach a size is created with a first
+    // layer that holds it, so it only scales if it outgrows it
+    if (max_capacity > config->initial_capacity) config->initial_capacity = max_capacity;
+
+    // Keys only expire in aging filters, so a TTL implies one
+    if (config->key_ttl > 0 && !layout_set) config->layout = BLOOM_LAYOUT_AGING;
+
+    // Validate the params
+    int invalid_config = 0;
+    invalid_config |= sane_initial_capacity(config->initial_capacity);
+    invalid_config |= sane_default_probability(config->default_probability);
+    invalid_config |= sane_scale_size(config->scale_size);
+    invalid_config |= sane_probability_reduction(config->probability_reduction);
+    invalid_config |= sane_in_memory(config->in_memory);
+    invalid_config |= sane_layout(config->layout);
+    invalid_config |= sane_hash_scheme(config->hash_scheme);
+    invalid_config |= sane_warmup(config->warmup);
+    invalid_config |= sane_rotate_window(config->rotate_window);
+    invalid_config |= sane_rotate_generations(config->rotate_generations);
+    invalid_config |= sane_key_ttl(config->key_ttl, config->layout);
+    invalid_config |= sane_max_probes(config->max_probes);
+    invalid_config |= sane_freezable(config->freezable);
+    invalid_config |= sane_pinned(config->pinned);
+    invalid_config |= sane_summary_capacity(config->summary_capacity);
+    invalid_config |= sane_shards(config->shards);
+
+    // Freezing needs the keys staged on disk, and can not
+    // preserve rotation, deletes or expiry
+    if (config->freezable && (config->in_memory || config->rotate_window ||
+                config->layout == BLOOM_LAYOUT_COUNTING || config->key_ttl)) {
+        invalid_config = 1;
+    }
+
+    // The shards are plain filters, so keys can not also rotate
+    if (config->shards && (config->rotate_window || config->freezable)) {
+        invalid_config = 1;
+    }
+
+    // Keys are aged in place, not in generations or shards
+    if (config->key_ttl && (config->rotate_window || config->shards)) {
+        invalid_config = 1;
+    }
+
+    // A quotient filter replaces the layers of a plain filter
+    if (config->layout == BLOOM_LAYOUT_QUOTIENT && (config->rotate_window ||
+                config->shards || config->freezable || config->summary_capacity)) {
+        invalid_config = 1;
+    }
+
+    // Barf if the configs are bad
+    if (!err && invalid_config) {
+        err = 1;
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+    }
+
+    // Leave on errors, the config is reclaimed with the arena
+    if (err) return -1;
+    *config_out = config;
+    return 0;
+}
 
-            // Advance to the next param
+/**
+ * Applies the options of a create command to a config. A
+ * template option applies the options of the template in its
+ * place, so the options that follow it override the template.
+ * @arg config The config to update
+ * @arg options The space separated options, modified in place
+ * @arg max_capacity Updated by a max_capacity option
+ * @arg layout_set Set to 1 by a layout option
+ * @arg in_template Are these the options of a template,
+ * which can not name another template
+ * @return 0 on success, 1 if an error was sent.
+ */
+static int apply_create_options(bloom_conn_handler *handle, bloom_config *config, char *options, int options_len,
+        uint64_t *max_capacity, int *layout_set, int in_template) {
+    char *param = options;
+    while (param) {
+        // Adds a zero terminator to the current param, scans forward
+        buffer_after_terminator(options, options_len, ' ', &options, &options_len);
+
+        // Expand a template, from a copy since parsing modifies it
+        if (!in_template && !strncmp(param, "template=", 9)) {
+            const char *template = config_template(handle->config, param + 9);
+            if (!template) {
+                handle_client_err(handle->conn, (char*)&UNKNOWN_TEMPLATE, UNKNOWN_TEMPLATE_LEN);
+                return 1;
+            }
+            int len = strlen(template);
+            char *copy = arena_alloc(handle->arena, len + 1);
+            memcpy(copy, template, len + 1);
+            if (apply_create_options(handle, config, copy, len, max_capacity, layout_set, 1)) return 1;
             param = options;
+            continue;
         }
 
-        // Validate the params
-        int invalid_config = 0;
-        invalid_config |= sane_initial_capacity(config->initial_capacity);
-        invalid_config |= sane_default_probability(config->default_probability);
-        invalid_config |= sane_in_memory(config->in_memory);
+        // Check for the custom params
+        int match = 0;
+        char name[16];
+        match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
+        match |= sscanf(param, "max_capacity=%llu", (unsigned long long*)max_capacity);
+        match |= sscanf(param, "prob=%lf", &config->default_probability);
+        match |= sscanf(param, "scale=%d", &config->scale_size);
+        match |= sscanf(param, "reduction=%lf", &config->probability_reduction);
+        match |= sscanf(param, "in_memory=%d", &config->in_memory);
+        match |= sscanf(param, "window=%d", &config->rotate_window);
+        match |= sscanf(param, "generations=%d", &config->rotate_generations);
+        match |= sscanf(param, "freezable=%d", &config->freezable);
+        match |= sscanf(param, "summary=%llu", (unsigned long long*)&config->summary_capacity);
+        match |= sscanf(param, "shards=%d", &config->shards);
+        match |= sscanf(param, "ttl=%d", &config->key_ttl);
+        match |= sscanf(param, "probes=%d", &config->max_probes);
+        match |= sscanf(param, "pinned=%d", &config->pinned);
+        if (sscanf(param, "layout=%15s", name) == 1) {
+            config->layout = layout_from_name(name);
+            *layout_set = 1;
+            match = 1;
+        }
+        if (sscanf(param, "hash=%15s", name) == 1) {
+            config->hash_scheme = hash_scheme_from_name(name);
+            match = 1;
+        }
+        if (sscanf(param, "warmup=%15s", name) == 1) {
+            config->warmup = warmup_from_name(name);
+            match = 1;
+        }
+
+        // Check if there was no match
+        if (!match) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return 1;
+        }
+
+        // Advance to the next param
+        param = options;
+    }
+    return 0;
+}
+
+
+/**
+ * Internal method to handle a command that relies
+ * on a filter name only.
+ */
+static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len,
+        int(*filtmgr_func)(bloom_filtmgr *, char*)) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Call into the filter manager
+    handle_filt_result(handle, args, filtmgr_func(handle->mgr, args));
+}
+
+/**
+ * Responds with the result of a filter manager
+ * call on a single filter.
+ * @arg filter_name The filter
+ * @arg res The result of the call
+ */
+static void handle_filt_result(bloom_conn_handler *handle, char *filter_name, int res) {
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_filter_missing(handle, filter_name);
+            break;
+        case -2:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_PROXIED, FILT_NOT_PROXIED_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)SNAPSHOT_IN_PROGRESS, SNAPSHOT_IN_PROGRESS_LEN);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)FILT_IN_MEMORY, FILT_IN_MEMORY_LEN);
+            break;
+        case -6:
+            handle_client_resp(handle->conn, (char*)FILT_ROTATING, FILT_ROTATING_LEN);
+            break;
+        case -7:
+            handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+            break;
+        case -8:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_FREEZABLE, FILT_NOT_FREEZABLE_LEN);
+            break;
+        case -9:
+            handle_client_resp(handle->conn, (char*)FILT_SHARDED, FILT_SHARDED_LEN);
+            break;
+        case -10:
+            handle_client_resp(handle->conn, (char*)FILT_CANT_SHRINK, FILT_CANT_SHRINK_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_drop_filter);
+}
+
+static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_cmd(handle, args, args_len, filtmgr_unmap_filter);
+}
+
+static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_cmd(handle, args, args_len, filtmgr_clear_filter);
+}
+
+static void handle_snapshot_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_snapshot_filter);
+}
+
+static void handle_warm_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    handle_filt_cmd(handle, args, args_len, filtmgr_warm_filter);
+}
+
+static void handle_freeze_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_freeze_filter);
+}
+
+static void handle_compact_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_compact_filter);
+}
+
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_shrink_filter);
+}
+
+static void handle_reset_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    handle_filt_cmd(handle, args, args_len, filtmgr_reset_filter);
+}
+
+
+/**
+ * Internal command used to create a filter from the union
+ * or intersection of other filters. The new filter name is
+ * followed by the space separated sources.
+ */
+static void handle_merge_cmd(bloom_conn_handler *handle, char *args, int args_len, int intersect) {
+    if (reject_read_only(handle)) return;
+    #define MERGE_ARG_ERR() { \
+        handle_client_err(handle->conn, (char*)&FILT_SOURCES_NEEDED, FILT_SOURCES_NEEDED_LEN); \
+        return; \
+    }
+    // If we have no args, complain.
+    if (!args) MERGE_ARG_ERR();
+
+    // Scan past the new filter name
+    char *rest;
+    int rest_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &rest, &rest_len);
+    if (err || rest_len <= 1) MERGE_ARG_ERR();
+
+    // Verify the filter name is valid
+    char *filter_name = args;
+    if (regexec(&VALID_FILTER_NAMES_RE, filter_name, 0, NULL, 0) != 0) {
+        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+        return;
+    }
+
+    // Split the sources
+    char *sources[MAX_ANY_FILTERS];
+    int num_sources = 0;
+    char *name;
+    while ((name = strsep(&rest, " "))) {
+        if (*name == '\0') continue;
+        if (num_sources == MAX_ANY_FILTERS) {
+            handle_client_err(handle->conn, (char*)&TOO_MANY_FILTS, TOO_MANY_FILTS_LEN);
+            return;
+        }
+        sources[num_sources++] = name;
+    }
+    if (!num_sources) MERGE_ARG_ERR();
+
+    int res = filtmgr_merge_filters(handle->mgr, filter_name, sources, num_sources, intersect);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            // Name the first missing source, so a cluster can redirect
+            for (int i=0; i < num_sources; i++) {
+                if (!filter_exists(handle, sources[i])) {
+                    handle_filter_missing(handle, sources[i]);
+                    return;
+                }
+            }
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_CANT_MERGE, FILT_CANT_MERGE_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Internal command used to create several filters at
+ * once, as a single version. The options apply to all
+ * the filters, and follow the names.
+ */
+static void handle_create_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Split the names from the options
+    char **names, *options;
+    int options_len;
+    int num = split_filter_names(handle, args, args_len, &names, &options, &options_len);
+    if (num < 0) {
+        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+        return;
+    } else if (num == 0) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Parse the options, every filter gets a copy
+    bloom_config *config = NULL;
+    if (options && parse_create_options(handle, options, options_len, &config))
+        return;
+
+    int *results = arena_alloc(handle->arena, num * sizeof(int));
+    filtmgr_create_filters(handle->mgr, names, num, config, results);
+    handle_filters_response(handle, names, results, num, EXISTS_RESP);
+}
+
+
+/**
+ * Internal command used to create a numbered range of
+ * filters at once, as a single version. The filters are
+ * named by the prefix and the numbers from 0 to count - 1,
+ * and all get the same options, such as a template.
+ */
+static void handle_provision_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&PREFIX_COUNT_NEEDED, PREFIX_COUNT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the prefix and the count
+    char *count_buf, *options;
+    int count_len, options_len;
+    if (buffer_after_terminator(args, args_len, ' ', &count_buf, &count_len)) {
+        handle_client_err(handle->conn, (char*)&PREFIX_COUNT_NEEDED, PREFIX_COUNT_NEEDED_LEN);
+        return;
+    }
+    int has_options = !buffer_after_terminator(count_buf, count_len, ' ', &options, &options_len);
+    char *end;
+    long count = strtol(count_buf, &end, 10);
+    if (*end || count <= 0 || count > MAX_PROVISION) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // Parse the options once, every filter gets a copy
+    bloom_config *config = NULL;
+    if (has_options && parse_create_options(handle, options, options_len, &config))
+        return;
+
+    // The last name is the longest, so it checks the length too
+    char **names = arena_alloc(handle->arena, count * sizeof(char*));
+    for (int i=0; i < count; i++) {
+        names[i] = arena_sprintf(handle->arena, NULL, "%s%d", args, i);
+        assert(names[i]);
+    }
+    if (regexec(&VALID_FILTER_NAMES_RE, names[count - 1], 0, NULL, 0) != 0) {
+        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+        return;
+    }
+
+    int *results = arena_alloc(handle->arena, count * sizeof(int));
+    filtmgr_create_filters(handle->mgr, names, count, config, results);
+    handle_filters_response(handle, names, results, count, EXISTS_RESP);
+}
+
+
+/**
+ * Internal command used to drop several filters
+ * at once, as a single version.
+ */
+static void handle_drop_multi_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    char **names, *options;
+    int options_len;
+    int num = split_filter_names(handle, args, args_len, &names, &options, &options_len);
+    if (num <= 0 || options) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    int *results = arena_alloc(handle->arena, num * sizeof(int));
+    filtmgr_drop_filters(handle->mgr, names, num, results);
+    handle_filters_response(handle, names, results, num, FILT_NOT_EXIST);
+}
+
+
+/**
+ * Internal command used to drop all the filters
+ * matching a prefix, as a single version.
+ */
+static void handle_drop_prefix_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the prefix
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // List the matching filters
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(handle->mgr, args, &head);
+    if (res != 0) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    char **names = arena_alloc(handle->arena, (head->size + 1) * sizeof(char*));
+    int *results = arena_alloc(handle->arena, (head->size + 1) * sizeof(int));
+    int num = 0;
+    for (bloom_filter_list *node=head->head; node; node=node->next)
+        names[num++] = node->filter_name;
+
+    filtmgr_drop_filters(handle->mgr, names, num, results);
+    handle_filters_response(handle, names, results, num, FILT_NOT_EXIST);
+    filtmgr_cleanup_list(head);
+}
+
+
+/**
+ * Splits the arguments of a multi filter command into
+ * the filter names and any trailing create options. The
+ * options start at the first argument with an '='.
+ * @arg names Output, the names, allocated from the arena.
+ * @arg options Output, the options, or NULL.
+ * @arg options_len Output, the length of the options.
+ * @return The number of names, or -1 if a name is not valid.
+ */
+static int split_filter_names(bloom_conn_handler *handle, char *args, int args_len, char ***names, char **options, int *options_len) {
+    *options = NULL;
+    *options_len = 0;
+
+    // Count the arguments to size the names
+    int max = 1;
+    for (int i=0; i < args_len; i++) {
+        if (args[i] == ' ') max++;
+    }
+    *names = arena_alloc(handle->arena, max * sizeof(char*));
+
+    int num = 0;
+    char *name = args;
+    while (name && *name != '\0') {
+        if (memchr(name, '=', strcspn(name, " "))) {
+            *options = name;
+            *options_len = args_len - (name - args);
+            break;
+        }
+        char *next;
+        int next_len;
+        buffer_after_terminator(name, args_len - (name - args), ' ', &next, &next_len);
+        if (regexec(&VALID_FILTER_NAMES_RE, name, 0, NULL, 0) != 0)
+            return -1;
+        (*names)[num++] = name;
+        name = next;
+    }
+    return num;
+}
+
+
+/**
+ * Sends the result of each filter of a multi filter
+ * command, one line per filter.
+ * @arg exists_resp The response for a result of -1
+ */
+static void handle_filters_response(bloom_conn_handler *handle, char **names, int *results, int num, const char *exists_resp) {
+    int num_out = num + 2;
+    char **output_bufs = arena_alloc(handle->arena, num_out * sizeof(char*));
+    int *output_bufs_len = arena_alloc(handle->arena, num_out * sizeof(int));
+    output_bufs[0] = (char*)&START_RESP;
+    output_bufs_len[0] = START_RESP_LEN;
+    output_bufs[num+1] = (char*)&END_RESP;
+    output_bufs_len[num+1] = END_RESP_LEN;
+
+    for (int i=0; i < num; i++) {
+        const char *resp;
+        switch (results[i]) {
+            case 0:
+                resp = DONE_RESP;
+                break;
+            case -1:
+                resp = exists_resp;
+                break;
+            case -3:
+                resp = DELETE_IN_PROGRESS;
+                break;
+            default:
+                resp = INTERNAL_ERR;
+                break;
+        }
+        output_bufs[i+1] = arena_sprintf(handle->arena, output_bufs_len + i + 1,
+                "%s %s", names[i], resp);
+        assert(output_bufs[i+1]);
+    }
+
+    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
+}
+
+// Callback invoked by list command to append an output
+// line for each filter to the batch. This only reads the
+// cached metadata, so the filter is never faulted or walked
+static void list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    list_batch *batch = data;
+    filter_meta meta;
+    bloomf_meta(filter, &meta);
+
+    // Send the batch if the line does not fit, and retry
+    for (;;) {
+        int avail = LIST_BATCH_SIZE - batch->len;
+        int res = snprintf(batch->buf + batch->len, avail, "%s %f %llu %llu %llu\n",
+                filter_name,
+                filter->filter_config.default_probability,
+                (unsigned long long)meta.bytes,
+                (unsigned long long)meta.capacity,
+                (unsigned long long)meta.size);
+        assert(res >= 0 && res < LIST_BATCH_SIZE);
+        if (res < avail) {
+            batch->len += res;
+            return;
+        }
+        send_client_response(batch->handle->conn, &batch->buf, &batch->len, 1);
+        batch->len = 0;
+    }
+}
+
+static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+
+    // Send the START line first, and stream the filters in batches
+    char *start = (char*)&START_RESP;
+    int start_len = START_RESP_LEN;
+    send_client_response(handle->conn, &start, &start_len, 1);
+
+    list_batch batch = {handle, arena_alloc(handle->arena, LIST_BATCH_SIZE), 0};
+    filtmgr_iter_filters(handle->mgr, args, list_filter_cb, &batch);
+
+    // Send the last batch with the END line
+    char *output[] = {batch.buf, (char*)&END_RESP};
+    int lens[] = {batch.len, END_RESP_LEN};
+    send_client_response(handle->conn, output, lens, 2);
+}
+
+
+// Callback invoked by list command to create an output
+// line for each filter. We hold a filter handle which we
+// can use to get some info about it
+static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+
+    // Cast the intput
+    info_output *info = data;
+    char **out = &info->buf;
+
+    // Get some metrics
+    filter_counters c;
+    filter_counters *counters = &c;
+    bloomf_counters(filter, counters);
+    filter_meta meta;
+    bloomf_meta(filter, &meta);
+    uint64_t capacity = meta.capacity;
+    uint64_t storage = meta.bytes;
+    uint64_t size = meta.size;
+    uint64_t checks = counters->check_hits + counters->check_misses;
+    uint64_t sets = counters->set_hits + counters->set_misses;
+
+    // Generate a formatted string output
+    *out = arena_sprintf(info->arena, NULL, "capacity %llu\n\
+checks %llu\n\
+check_hits %llu\n\
+check_misses %llu\n\
+fault_lock_waits %llu\n\
+fault_lock_wait_usec %llu\n\
+fault_usec %llu\n\
+in_memory %d\n\
+lock_waits %llu\n\
+lock_wait_usec %llu\n\
+page_ins %llu\n\
+page_outs %llu\n\
+probability %f\n\
+sets %llu\n\
+set_hits %llu\n\
+set_misses %llu\n\
+size %llu\n\
+storage %llu\n",
+    (unsigned long long)capacity, (unsigned long long)checks,
+    (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
+    (unsigned long long)counters->fault_lock_waits,
+    (unsigned long long)(counters->fault_lock_wait_nsec / 1000),
+    (unsigned long long)(counters->fault_nsec / 1000),
+    ((bloomf_is_proxied(filter)) ? 0 : 1),
+    (unsigned long long)counters->lock_waits,
+    (unsigned long long)(counters->lock_wait_nsec / 1000),
+    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
+    filter->filter_config.default_probability,
+    (unsigned long long)sets, (unsigned long long)counters->set_hits,
+    (unsigned long long)counters->set_misses, (unsigned long long)size, (unsigned long long)storage);
+    assert(*out);
+
+    // Describe the generations of rotating filters
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sgenerations %u\nwindow %d\n", base, gens->num,
+                filter->filter_config.rotate_window);
+        assert(*out);
+    }
+
+    // Describe the checksums of the pages, once they are kept
+    if (filter->config->page_checksums) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%schecksum_errors %llu\n", base,
+                (unsigned long long)counters->checksum_errors);
+        assert(*out);
+    }
+
+    // Describe freezable filters
+    if (filter->filter_config.freezable) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sfrozen %d\n", base, filter->filter_config.frozen);
+        assert(*out);
+    }
+
+    // Describe aging filters
+    if (filter->filter_config.key_ttl) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sttl %d\n", base, filter->filter_config.key_ttl);
+        assert(*out);
+    }
+
+    // Describe filters limited to fewer probes
+    if (filter->filter_config.max_probes) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sprobes %d\n", base, filter->filter_config.max_probes);
+        assert(*out);
+    }
+
+    // Describe pinned filters, with the bytes locked in memory
+    if (filter->filter_config.pinned) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%spinned_bytes %llu\n", base,
+                (unsigned long long)((bloomf_is_proxied(filter)) ? 0 : storage));
+        assert(*out);
+    }
+
+    // Describe sharded filters
+    if (filter->filter_config.shards) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sshards %d\n", base, filter->filter_config.shards);
+        assert(*out);
+    }
+
+    // Describe the fill counted by the last flush
+    bloom_filter_fill fill;
+    if (!bloomf_fill(filter, &fill)) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%sfill_keys %llu\nfill_probability %f\nfill_ratio %f\n", base,
+                (unsigned long long)fill.keys, fill.fp_probability,
+                (double)fill.bits_set / fill.bits);
+        assert(*out);
+    }
+
+    // Describe the pages in memory, once they were scanned
+    filter_residency residency;
+    bloomf_residency(filter, &residency);
+    if (residency.scanned) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%smapped_bytes %llu\nresident_bytes %llu\nresident_layers ", base,
+                (unsigned long long)residency.mapped, (unsigned long long)residency.resident);
+        assert(*out);
+        for (uint32_t i=0; i < residency.num_layers; i++) {
+            base = *out;
+            *out = arena_sprintf(info->arena, NULL, "%s%s%llu", base, (i) ? "," : "",
+                    (unsigned long long)residency.layers[i]);
+            assert(*out);
+        }
+        base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%s%s\n", base, (residency.num_layers) ? "" : "-");
+        assert(*out);
+    }
+
+    // Describe filters with a summary
+    if (filter->filter_config.summary_capacity) {
+        char *base = *out;
+        *out = arena_sprintf(info->arena, NULL, "%ssummary %llu\n", base,
+                (unsigned long long)filter->filter_config.summary_capacity);
+        assert(*out);
+    }
+}
+
+static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Invoke the callback to get the filter stats
+    info_output info = {handle->arena, NULL};
+    int res = filtmgr_filter_cb(handle->mgr, args, info_filter_cb, &info);
+
+    // Check for no filter
+    if (res != 0) {
+        switch (res) {
+            case -1:
+                handle_filter_missing(handle, args);
+                break;
+            default:
+                INTERNAL_ERROR();
+                break;
+        }
+        return;
+    }
+
+    // Describe the last load of a key file
+    bloom_load_progress load;
+    if (!filtmgr_load_progress(handle->mgr, args, &load) && load.state != LOAD_NONE) {
+        static const char *states[] = {"none", "queued", "running", "done", "failed"};
+        char *base = info.buf;
+        info.buf = arena_sprintf(handle->arena, NULL,
+                "%sload_state %s\nload_size %llu\nload_bytes %llu\nload_keys %llu\nload_added %llu\n",
+                base, states[load.state], (unsigned long long)load.size,
+                (unsigned long long)load.bytes, (unsigned long long)load.keys,
+                (unsigned long long)load.added);
+        assert(info.buf);
+    }
+
+    // Write out the bufs
+    char *output[] = {(char*)&START_RESP, info.buf, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, strlen(info.buf), END_RESP_LEN};
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+}
+
+
+/**
+ * Internal command used to migrate a filter to another
+ * node of the cluster. The migration is queued, and once it
+ * is done the clients are redirected to the node.
+ */
+static void handle_migrate_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NODE_NEEDED, FILT_NODE_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *node;
+    int node_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &node, &node_len);
+    if (err || node_len <= 1) {
+        handle_client_err(handle->conn, (char*)&FILT_NODE_NEEDED, FILT_NODE_NEEDED_LEN);
+        return;
+    }
+    if (!handle->cluster) {
+        handle_client_err(handle->conn, (char*)&NOT_CLUSTERED, NOT_CLUSTERED_LEN);
+        return;
+    }
+
+    int index = cluster_find_node(handle->cluster, node);
+    if (index < 0) {
+        handle_client_err(handle->conn, (char*)&UNKNOWN_NODE, UNKNOWN_NODE_LEN);
+    } else if (!filter_exists(handle, args)) {
+        handle_filter_missing(handle, args);
+    } else if (cluster_migrate(handle->cluster, args, index)) {
+        handle_client_err(handle->conn, (char*)&SAME_NODE, SAME_NODE_LEN);
+    } else {
+        handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+    }
+}
+
+
+/**
+ * Internal command used to export a filter. A snapshot of the
+ * filter is written, and its files are then streamed over the
+ * connection by another thread, which closes it when done.
+ */
+static void handle_export_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+    char *rest;
+    int rest_len;
+    if (!buffer_after_terminator(args, args_len, ' ', &rest, &rest_len)) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    bloom_export *export;
+    int res = repl_open_export(handle->mgr, args, &export);
+    if (res) {
+        handle_filt_result(handle, args, res);
+        return;
+    }
+
+    char *input;
+    int input_len;
+    int fd = client_take_socket(handle->conn, &input, &input_len);
+    if (fd < 0) {
+        repl_free_export(export);
+        handle_client_err(handle->conn, (char*)&NO_TRANSFERS, NO_TRANSFERS_LEN);
+        return;
+    }
+    free(input);
+    repl_start_export(export, fd);
+}
+
+
+/**
+ * Internal command used to import a filter. The rest of the
+ * connection is the stream of an export, which is loaded as a
+ * new filter by another thread, which answers once the stream
+ * is read. An existing filter is never replaced.
+ */
+static void handle_import_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) {
+        reject_import(handle, NULL, 0);
+        return;
+    }
+    if (!args) {
+        reject_import(handle, (char*)FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+    char *rest;
+    int rest_len;
+    if (!buffer_after_terminator(args, args_len, ' ', &rest, &rest_len)) {
+        reject_import(handle, (char*)UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+    if (regexec(&VALID_FILTER_NAMES_RE, args, 0, NULL, 0) != 0) {
+        reject_import(handle, (char*)BAD_FILT_NAME, BAD_FILT_NAME_LEN);
+        return;
+    }
+
+    // In a cluster, filters are imported on the node they hash to
+    if (handle->cluster && !filter_exists(handle, args) && redirect_filter(handle, args)) {
+        reject_import(handle, NULL, 0);
+        return;
+    }
+
+    char *input;
+    int input_len;
+    int fd = client_take_socket(handle->conn, &input, &input_len);
+    if (fd < 0) {
+        reject_import(handle, (char*)NO_TRANSFERS, NO_TRANSFERS_LEN);
+        return;
+    }
+    repl_start_import(handle->config, handle->mgr, args, fd, input, input_len);
+}
+
+
+/**
+ * Refuses an import. The connection is closed once the
+ * response is sent, since the rest of the input is the
+ * stream and not commands.
+ * @arg msg The client error, or NULL if a response was already sent
+ * @arg msg_len The length of the error
+ */
+static void reject_import(bloom_conn_handler *handle, char *msg, int msg_len) {
+    if (msg)
+        handle_client_err(handle->conn, msg, msg_len);
+    conn_state *state = get_conn_state(handle);
+    if (state) state->close_conn = 1;
+}
+
+
+/**
+ * Internal command used to set the format of the responses
+ * to the multi key commands on the connection.
+ */
+static void handle_format_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    int format;
+    if (!strcmp(args, "text")) {
+        format = RESP_TEXT;
+    } else if (!strcmp(args, "compact")) {
+        format = RESP_COMPACT;
+    } else if (!strcmp(args, "hex")) {
+        format = RESP_HEX;
+    } else {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // Text is the default, so only other formats need state
+    conn_state *state = *(conn_state**)client_handler_state(handle->conn);
+    if (!state && format != RESP_TEXT && !(state = get_conn_state(handle))) {
+        INTERNAL_ERROR();
+        return;
+    }
+    if (state) state->resp_format = format;
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+
+/**
+ * Sends the latency histograms of the commands that
+ * have been timed. Each line is a command and stage,
+ * with the number of samples and the mean, percentiles
+ * and max in nanoseconds.
+ */
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    int buf_size = (NUM_LATENCY_COMMANDS + 1) * LATENCY_STAGES * 160;
+    char *buf = arena_alloc(handle->arena, buf_size);
+    latency_histogram *hist = arena_alloc(handle->arena, sizeof(latency_histogram));
+    int len = 0;
+    for (int cmd=0; cmd < LATENCY_COMMANDS; cmd++) {
+        // The filter manager records its grace periods after the commands
+        const char *name = NULL;
+        if (cmd < NUM_LATENCY_COMMANDS)
+            name = LATENCY_COMMAND_NAMES[cmd];
+        else if (cmd == LATENCY_GRACE_PERIOD)
+            name = "grace_period";
+        if (!name) continue;
+
+        for (int stage=0; stage < LATENCY_STAGES; stage++) {
+            latency_merge(cmd, stage, hist);
+            if (!hist->samples) continue;
+            len += snprintf(buf + len, buf_size - len,
+                    "%s %s samples %llu mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+                    name, latency_stage_name(stage),
+                    (unsigned long long)hist->samples,
+                    (unsigned long long)(hist->sum / hist->samples),
+                    (unsigned long long)latency_percentile(hist, 0.5),
+                    (unsigned long long)latency_percentile(hist, 0.9),
+                    (unsigned long long)latency_percentile(hist, 0.99),
+                    (unsigned long long)latency_percentile(hist, 0.999),
+                    (unsigned long long)hist->max);
+        }
+    }
+
+    char *output[] = {(char*)&START_RESP, buf, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, len, END_RESP_LEN};
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+}
+
+/**
+ * Sends the slow log, newest first. Each line is a command,
+ * with the time of each of its stages in nanoseconds.
+ * With "reset", the log is emptied instead.
+ */
+static void handle_slowlog_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        if (!strcmp(args, "reset")) {
+            slowlog_reset();
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+        } else {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        }
+        return;
+    }
+
+    int max = handle->config->slowlog_size;
+    slowlog_entry *entries = arena_alloc(handle->arena, max * sizeof(slowlog_entry));
+    int buf_size = max * (SLOWLOG_NAME_LEN + 128 + LATENCY_STAGES * 32);
+    char *buf = arena_alloc(handle->arena, buf_size);
+    if (!entries || !buf) {
+        INTERNAL_ERROR();
+        return;
+    }
+
+    int num = slowlog_read(entries, max);
+    int len = 0;
+    for (int i=0; i < num; i++) {
+        slowlog_entry *e = entries + i;
+        const char *name = "unknown";
+        if (e->command >= 0 && e->command < NUM_LATENCY_COMMANDS)
+            name = LATENCY_COMMAND_NAMES[e->command];
+        len += snprintf(buf + len, buf_size - len, "%llu %lld %s %s keys %d total %llu",
+                (unsigned long long)e->id, (long long)e->when, name,
+                (e->filter_name[0]) ? e->filter_name : "-", e->num_keys,
+                (unsigned long long)e->stages[LATENCY_TOTAL]);
+        for (int stage=0; stage < LATENCY_TOTAL; stage++) {
+            len += snprintf(buf + len, buf_size - len, " %s %llu",
+                    latency_stage_name(stage), (unsigned long long)e->stages[stage]);
+        }
+        buf[len++] = '\n';
+    }
+
+    char *output[] = {(char*)&START_RESP, buf, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, len, END_RESP_LEN};
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+}
+
+
+/**
+ * Manages the aliases of filters. "create A F" and "swap A F"
+ * point the alias A at the filter F, "drop A" removes the alias
+ * and "list" sends each alias with its filter.
+ */
+static void handle_alias_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&ALIAS_NEEDED, ALIAS_NEEDED_LEN);
+        return;
+    }
 
-        // Barf if the configs are bad
-        if (invalid_config) {
-            err = 1;
-            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+    // Split the subcommand, alias and filter name
+    char *alias = NULL, *filter_name = NULL;
+    int alias_len = 0, filter_len = 0;
+    if (!buffer_after_terminator(args, args_len, ' ', &alias, &alias_len))
+        buffer_after_terminator(alias, alias_len, ' ', &filter_name, &filter_len);
+
+    if (!strcmp(args, "list")) {
+        if (alias) {
+            handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+            return;
+        }
+        bloom_filter_list_head *head;
+        if (filtmgr_list_aliases(handle->mgr, &head)) {
+            INTERNAL_ERROR();
+            return;
+        }
+        int buf_size = 0;
+        for (bloom_filter_list *node=head->head; node; node=node->next)
+            buf_size += strlen(node->filter_name) + 1;
+        char *buf = arena_alloc(handle->arena, buf_size + 1);
+        if (!buf) {
+            filtmgr_cleanup_list(head);
+            INTERNAL_ERROR();
+            return;
         }
+        int len = 0;
+        for (bloom_filter_list *node=head->head; node; node=node->next)
+            len += snprintf(buf + len, buf_size + 1 - len, "%s\n", node->filter_name);
+
+        char *output[] = {(char*)&START_RESP, buf, (char*)&END_RESP};
+        int lens[] = {START_RESP_LEN, len, END_RESP_LEN};
+        send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+        filtmgr_cleanup_list(head);
+        return;
     }
 
-    // Clean up an leave on errors
-    if (err) {
-        if (config) free(config);
+    int is_drop = !strcmp(args, "drop");
+    if (!is_drop && strcmp(args, "create") && strcmp(args, "swap")) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    if (!alias || alias_len <= 1 || (is_drop == (filter_name != NULL)) ||
+            (filter_name && filter_len <= 1)) {
+        handle_client_err(handle->conn, (char*)&ALIAS_NEEDED, ALIAS_NEEDED_LEN);
+        return;
+    }
+    if (reject_read_only(handle)) return;
+    if (regexec(&VALID_FILTER_NAMES_RE, alias, 0, NULL, 0) != 0) {
+        handle_client_err(handle->conn, (char*)&BAD_FILT_NAME, BAD_FILT_NAME_LEN);
         return;
     }
 
-    // Create a new filter
-    res = filtmgr_create_filter(handle->mgr, filter_name, config);
+    int res;
+    if (is_drop) {
+        res = filtmgr_drop_alias(handle->mgr, alias);
+        if (res == -1) res = -4;
+    } else if (!strcmp(args, "swap")) {
+        res = filtmgr_swap_alias(handle->mgr, alias, filter_name);
+        if (res == -2) res = -4;
+    } else {
+        res = filtmgr_create_alias(handle->mgr, alias, filter_name);
+    }
+
     switch (res) {
         case 0:
             handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -2:
             handle_client_resp(handle->conn, (char*)EXISTS_RESP, EXISTS_RESP_LEN);
-            if (config) free(config);
             break;
         case -3:
             handle_client_resp(handle->conn, (char*)DELETE_IN_PROGRESS, DELETE_IN_PROGRESS_LEN);
-            if (config) free(config);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)ALIAS_NOT_EXIST, ALIAS_NOT_EXIST_LEN);
             break;
         default:
             INTERNAL_ERROR();
-            if (config) free(config);
             break;
     }
 }
 
 
 /**
- * Internal method to handle a command that relies
- * on a filter name and a single key, responses are handled using
- * handle_multi_response.
+ * Queues a key file of the load_dir to be loaded into a
+ * filter. The response is sent once the load is queued,
+ * and info shows its progress.
  */
-static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len,
-        int(*filtmgr_func)(bloom_filtmgr *, char*)) {
-    // If we have no args, complain.
+static void handle_load_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    if (reject_read_only(handle)) return;
     if (!args) {
-        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        handle_client_err(handle->conn, (char*)&FILT_PATH_NEEDED, FILT_PATH_NEEDED_LEN);
         return;
     }
 
     // Scan past the filter name
-    char *key;
-    int key_len;
-    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (after == 0) {
-        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+    char *path;
+    int path_len;
+    int err = buffer_after_terminator(args, args_len, ' ', &path, &path_len);
+    if (err || path_len <= 1) {
+        handle_client_err(handle->conn, (char*)&FILT_PATH_NEEDED, FILT_PATH_NEEDED_LEN);
         return;
     }
 
-    // Call into the filter manager
-    int res = filtmgr_func(handle->mgr, args);
+    int res = filtmgr_queue_load(handle->mgr, args, path);
     switch (res) {
         case 0:
             handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
             break;
         case -1:
-            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            handle_filter_missing(handle, args);
             break;
         case -2:
-            handle_client_resp(handle->conn, (char*)FILT_NOT_PROXIED, FILT_NOT_PROXIED_LEN);
+            handle_client_resp(handle->conn, (char*)KEY_FILE_ERR, KEY_FILE_ERR_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)LOAD_IN_PROGRESS, LOAD_IN_PROGRESS_LEN);
+            break;
+        case -4:
+            handle_client_err(handle->conn, (char*)&NO_LOAD_DIR, NO_LOAD_DIR_LEN);
             break;
         default:
             INTERNAL_ERROR();
@@ -366,218 +2770,388 @@ static void handle_filt_cmd(bloom_conn_handler *handle, char *args, int args_len
     }
 }
 
-static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_cmd(handle, args, args_len, filtmgr_drop_filter);
-}
-
-static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_cmd(handle, args, args_len, filtmgr_unmap_filter);
-}
-
-static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    handle_filt_cmd(handle, args, args_len, filtmgr_clear_filter);
-}
-
-// Callback invoked by list command to create an output
-// line for each filter. We hold a filter handle which we
-// can use to get some info about it
-static void list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    char **out = data;
-    int res;
-    res = asprintf(out, "%s %f %llu %llu %llu\n",
-            filter_name,
-            filter->filter_config.default_probability,
-            (unsigned long long)bloomf_byte_size(filter),
-            (unsigned long long)bloomf_capacity(filter),
-            (unsigned long long)bloomf_size(filter));
-    assert(res != -1);
-}
-
-static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
+static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have a specfic filter, use filt_cmd
+    if (args) {
+        handle_filt_cmd(handle, args, args_len, filtmgr_flush_filter);
+        return;
+    }
 
     // List all the filters
     bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, args, &head);
+    int res = filtmgr_list_filters(handle->mgr, NULL, &head);
     if (res != 0) {
         INTERNAL_ERROR();
         return;
     }
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
-
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
-
-    // Generate the responses
-    char *resp;
+    // Flush all, ignore errors since
+    // filters might get deleted in the process
     bloom_filter_list *node = head->head;
-    for (int i=0; i < head->size; i++) {
-        res = filtmgr_filter_cb(handle->mgr, node->filter_name, list_filter_cb, &resp);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
-        }
+    while (node) {
+        filtmgr_flush_filter(handle->mgr, node->filter_name);
         node = node->next;
     }
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
+    // Respond
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
 
     // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
     filtmgr_cleanup_list(head);
 }
 
 
-// Callback invoked by list command to create an output
-// line for each filter. We hold a filter handle which we
-// can use to get some info about it
-static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    (void)filter_name;
-
-    // Cast the intput
-    char **out = data;
+/**
+ * Handles a single binary message, if it is fully buffered.
+ * @return 0 on success, -1 if more data is needed, 1 if
+ * the connection should be closed.
+ */
+static int handle_binary_cmd(bloom_conn_handler *handle) {
+    // Read the header
+    unsigned char header[BIN_HEADER_LEN];
+    if (peek_client_bytes(handle->conn, (char*)header, BIN_HEADER_LEN)) return -1;
+    int opcode = header[1];
+    uint16_t name_len;
+    uint32_t body_len;
+    memcpy(&name_len, header + 2, sizeof(name_len));
+    memcpy(&body_len, header + 4, sizeof(body_len));
+    name_len = ntohs(name_len);
+    body_len = ntohl(body_len);
+
+    // We cannot skip an oversized message without buffering it
+    if (body_len > BIN_MAX_BODY) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        return 1;
+    }
 
-    // Get some metrics
-    filter_counters *counters = bloomf_counters(filter);
-    uint64_t capacity = bloomf_capacity(filter);
-    uint64_t storage = bloomf_byte_size(filter);
-    uint64_t size = bloomf_size(filter);
-    uint64_t checks = counters->check_hits + counters->check_misses;
-    uint64_t sets = counters->set_hits + counters->set_misses;
+    // Wait for the whole message
+    char *buf;
+    int should_free;
+    if (extract_client_bytes(handle->conn, BIN_HEADER_LEN + name_len + body_len,
+                &buf, &should_free)) return -1;
+    latency_begin();
+
+    // Copy out the filter name, so it is terminated
+    char filter_name[256];
+    if (name_len == 0 || name_len >= sizeof(filter_name)) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        goto LEAVE;
+    }
+    memcpy(filter_name, buf + BIN_HEADER_LEN, name_len);
+    filter_name[name_len] = '\0';
+
+    switch (opcode) {
+        case BIN_CHECK:
+        case BIN_SET:
+            handle_binary_keys(handle, opcode, filter_name,
+                    buf + BIN_HEADER_LEN + name_len, body_len);
+            break;
+        case BIN_CHECK_HASHED:
+            handle_binary_hashes(handle, filter_name, buf + BIN_HEADER_LEN + name_len, body_len);
+            break;
+        default:
+            handle_binary_resp(handle->conn, BIN_CMD_NOT_SUP, NULL, 0);
+            break;
+    }
 
-    // Generate a formatted string output
-    int res;
-    res = asprintf(out, "capacity %llu\n\
-checks %llu\n\
-check_hits %llu\n\
-check_misses %llu\n\
-in_memory %d\n\
-page_ins %llu\n\
-page_outs %llu\n\
-probability %f\n\
-sets %llu\n\
-set_hits %llu\n\
-set_misses %llu\n\
-size %llu\n\
-storage %llu\n",
-    (unsigned long long)capacity, (unsigned long long)checks,
-    (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
-    ((bloomf_is_proxied(filter)) ? 0 : 1),
-    (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
-    filter->filter_config.default_probability,
-    (unsigned long long)sets, (unsigned long long)counters->set_hits,
-    (unsigned long long)counters->set_misses, (unsigned long long)size, (unsigned long long)storage);
-    assert(res != -1);
+LEAVE:
+    latency_end((opcode >= BIN_CHECK && opcode <= BIN_CHECK_HASHED) ? BIN_LATENCY_COMMAND(opcode) : UNKNOWN);
+    if (should_free) free(buf);
+    return 0;
 }
 
-static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    // If we have no args, complain.
-    if (!args) {
-        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+
+/**
+ * Handles a binary check or set of a key vector. The keys are
+ * terminated in place by shifting each one over its length prefix,
+ * so no copies are needed.
+ * @arg handle The conn handle
+ * @arg opcode BIN_CHECK or BIN_SET
+ * @arg filter_name The filter name
+ * @arg body The message body, modified in place
+ * @arg body_len The length of the body
+ */
+static void handle_binary_keys(bloom_conn_handler *handle, int opcode, char *filter_name, char *body, uint32_t body_len) {
+    keys_func func = (opcode == BIN_SET) ? set_keys : check_keys;
+    if (opcode == BIN_SET && handle->config->read_only) {
+        handle_binary_resp(handle->conn, BIN_READ_ONLY, NULL, 0);
         return;
     }
 
-    // Scan past the filter name
-    char *key;
-    int key_len;
-    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
-    if (after == 0) {
-        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+    // Read the key count
+    uint32_t num_keys;
+    uint16_t key_len;
+    if (body_len < sizeof(num_keys)) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        return;
+    }
+    memcpy(&num_keys, body, sizeof(num_keys));
+    num_keys = ntohl(num_keys);
+
+    // Validate the key vector before modifying it
+    uint32_t offset = sizeof(num_keys);
+    uint32_t i;
+    for (i=0; i < num_keys && offset + sizeof(key_len) <= body_len; i++) {
+        memcpy(&key_len, body + offset, sizeof(key_len));
+        key_len = ntohs(key_len);
+        if (key_len == 0) break;
+        offset += sizeof(key_len) + key_len;
+    }
+    if (num_keys == 0 || i != num_keys || offset != body_len) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        return;
+    }
+    if (!admit_keys(handle, 1, num_keys)) {
+        handle_binary_resp(handle->conn, BIN_BUSY, NULL, 0);
         return;
     }
 
-    // Create output buffers
-    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
-    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
-
-    // Invoke the callback to get the filter stats
-    int res = filtmgr_filter_cb(handle->mgr, args, info_filter_cb, &output[1]);
-
-    // Check for no filter
-    if (res != 0) {
-        switch (res) {
-            case -1:
-                handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
-                break;
-            default:
-                INTERNAL_ERROR();
-                break;
+    // Allocate the response body
+    uint32_t resp_len = sizeof(num_keys) + (num_keys + 7) / 8;
+    char *resp = arena_alloc(handle->arena, resp_len);
+    if (!resp) {
+        handle_binary_resp(handle->conn, BIN_INTERNAL_ERR, NULL, 0);
+        return;
+    }
+    memset(resp, 0, resp_len);
+    uint32_t count = htonl(num_keys);
+    memcpy(resp, &count, sizeof(count));
+    unsigned char *bits = (unsigned char*)resp + sizeof(count);
+
+    // Handle the keys in batches, like the multi commands
+    key_batch batch;
+    if (init_key_batch(handle, &batch)) {
+        handle_binary_resp(handle->conn, BIN_INTERNAL_ERR, NULL, 0);
+        return;
+    }
+    bloom_filter_handle *filt = NULL;
+    int index = 0, res = 0;
+    uint32_t done = 0;
+    char *key;
+    offset = sizeof(num_keys);
+    for (i=0; i < num_keys; i++) {
+        // Shift the key over its prefix and terminate it
+        memcpy(&key_len, body + offset, sizeof(key_len));
+        key_len = ntohs(key_len);
+        key = body + offset;
+        memmove(key, key + sizeof(key_len), key_len);
+        key[key_len] = '\0';
+        offset += sizeof(key_len) + key_len;
+        batch.keys[index] = key;
+        batch.lens[index++] = key_len;
+
+        // Handle a full batch, or the last keys. The keys may
+        // hold zero bytes, so their lengths are passed along
+        if (index < batch.size && i != num_keys - 1) continue;
+        res = func(handle, filter_name, filt, batch.keys, batch.lens, index, batch.result);
+        if (res) break;
+        for (int j=0; j < index; j++, done++) {
+            if (batch.result[j]) bits[done >> 3] |= 1 << (done & 7);
         }
+        if (i != num_keys - 1 && !filt) filt = open_batch_filter(handle, filter_name);
+        index = 0;
+    }
+    if (filt) filtmgr_release_handle(handle->mgr, filt);
+
+    if (res) {
+        const char *addr = (res == -1 && handle->cluster && *filter_name != '@') ?
+            cluster_redirect(handle->cluster, filter_name) : NULL;
+        if (addr) {
+            handle_binary_resp(handle->conn, BIN_MOVED, (char*)addr, strlen(addr));
+            return;
+        }
+        handle_binary_resp(handle->conn, (res == -1) ? BIN_FILT_NOT_EXIST :
+                (res == -4) ? BIN_FILT_FROZEN :
+                (res == -5) ? BIN_FILT_OVER_QUOTA :
+                (res == -6) ? BIN_FILT_LOADING :
+                (res == -7) ? BIN_BUSY : BIN_INTERNAL_ERR, NULL, 0);
         return;
     }
 
-    // Adjust the buffer size
-    lens[1] = strlen(output[1]);
-
-    // Write out the bufs
-    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
-    free(output[1]);
+    handle_binary_resp(handle->conn, BIN_OK, resp, resp_len);
 }
 
 
-static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    // If we have a specfic filter, use filt_cmd
-    if (args) {
-        handle_filt_cmd(handle, args, args_len, filtmgr_flush_filter);
+/**
+ * Handles a binary check of a vector of key hashes. Each key
+ * is given as its 128bit MurmurHash3, so long keys are neither
+ * sent nor hashed again, see bf_hashed_key_init_hash.
+ * @arg handle The conn handle
+ * @arg filter_name The filter name
+ * @arg body The message body
+ * @arg body_len The length of the body
+ */
+static void handle_binary_hashes(bloom_conn_handler *handle, char *filter_name, char *body, uint32_t body_len) {
+    // Read the key count, and check it matches the hashes
+    uint32_t num_keys;
+    if (body_len < sizeof(num_keys)) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        return;
+    }
+    memcpy(&num_keys, body, sizeof(num_keys));
+    num_keys = ntohl(num_keys);
+    if (num_keys == 0 || num_keys != (body_len - sizeof(num_keys)) / 16 ||
+            (body_len - sizeof(num_keys)) % 16) {
+        handle_binary_resp(handle->conn, BIN_BAD_ARGS, NULL, 0);
+        return;
+    }
+    if (!admit_keys(handle, 1, num_keys)) {
+        handle_binary_resp(handle->conn, BIN_BUSY, NULL, 0);
         return;
     }
 
-    // List all the filters
-    bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, NULL, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
+    // Allocate the response body
+    uint32_t resp_len = sizeof(num_keys) + (num_keys + 7) / 8;
+    char *resp = arena_alloc(handle->arena, resp_len);
+    key_batch batch;
+    bloom_hashed_key *hashed = NULL;
+    if (resp && !init_key_batch(handle, &batch))
+        hashed = arena_alloc(handle->arena, batch.size * sizeof(bloom_hashed_key));
+    if (!hashed) {
+        handle_binary_resp(handle->conn, BIN_INTERNAL_ERR, NULL, 0);
         return;
     }
+    memset(resp, 0, resp_len);
+    uint32_t count = htonl(num_keys);
+    memcpy(resp, &count, sizeof(count));
+    unsigned char *bits = (unsigned char*)resp + sizeof(count);
+
+    // Check the hashes in batches, like the keys
+    const char *hash = body + sizeof(num_keys);
+    uint64_t words[2];
+    int res = 0;
+    for (uint32_t done=0; done < num_keys && !res;) {
+        int index = 0;
+        for (; index < batch.size && done + index < num_keys; index++, hash += 16) {
+            words[0] = read_be64(hash);
+            words[1] = read_be64(hash + 8);
+            bf_hashed_key_init_hash(hashed + index, words);
+        }
+        res = check_hashed(handle, filter_name, hashed, index, batch.result);
+        for (int j=0; j < index && !res; j++, done++) {
+            if (batch.result[j]) bits[done >> 3] |= 1 << (done & 7);
+        }
+    }
 
-    // Flush all, ignore errors since
-    // filters might get deleted in the process
-    bloom_filter_list *node = head->head;
-    while (node) {
-        filtmgr_flush_filter(handle->mgr, node->filter_name);
-        node = node->next;
+    if (res) {
+        const char *addr = (res == -1 && handle->cluster && *filter_name != '@') ?
+            cluster_redirect(handle->cluster, filter_name) : NULL;
+        if (addr) {
+            handle_binary_resp(handle->conn, BIN_MOVED, (char*)addr, strlen(addr));
+            return;
+        }
+        handle_binary_resp(handle->conn, (res == -1) ? BIN_FILT_NOT_EXIST :
+                (res == -6) ? BIN_FILT_LOADING :
+                (res == -7) ? BIN_BUSY :
+                (res == -8) ? BIN_NOT_HASHABLE : BIN_INTERNAL_ERR, NULL, 0);
+        return;
     }
+    handle_binary_resp(handle->conn, BIN_OK, resp, resp_len);
+}
 
-    // Respond
-    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+// Reads a big-endian 64bit integer
+static uint64_t read_be64(const char *buf) {
+    uint32_t hi, lo;
+    memcpy(&hi, buf, sizeof(hi));
+    memcpy(&lo, buf + sizeof(hi), sizeof(lo));
+    return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
 
-    // Cleanup
-    filtmgr_cleanup_list(head);
+
+/**
+ * Sends a binary response, with an optional body.
+ */
+static void handle_binary_resp(bloom_conn_info *conn, int status, char *body, uint32_t body_len) {
+    unsigned char header[BIN_HEADER_LEN] = {BIN_MAGIC, status, 0, 0};
+    uint32_t len = htonl(body_len);
+    memcpy(header + 4, &len, sizeof(len));
+
+    char *buffers[] = {(char*)header, body};
+    int sizes[] = {BIN_HEADER_LEN, body_len};
+    send_client_response(conn, (char**)&buffers, (int*)&sizes, (body_len) ? 2 : 1);
+}
+
+
+/**
+ * Starts the response of a multi key command.
+ * @arg resp The response
+ * @arg format The multi_resp_format
+ */
+static void init_multi_resp(multi_resp *resp, int format) {
+    resp->buf = NULL;
+    resp->len = 0;
+    resp->format = format;
+    resp->keys = 0;
+    resp->bits = 0;
+}
+
+
+/**
+ * Allocates the output of a multi key response from the
+ * arena, with room for the results of some keys.
+ * @arg handle The conn handle
+ * @arg resp The response
+ * @arg keys_len The length of the keys, which bounds their count
+ */
+static void reserve_multi_resp(bloom_conn_handler *handle, multi_resp *resp, int keys_len) {
+    // Every key takes two bytes with its separator, and its
+    // result at most four, plus the separator, hex digit and newline
+    resp->buf = arena_alloc(handle->arena, 2 * keys_len + 8);
+    resp->len = 0;
 }
 
 
 /**
- * Helper to handle sending the response to the multi commands,
- * either multi or bulk.
+ * Returns the format of the multi key responses of a connection.
+ */
+static int conn_resp_format(bloom_conn_handler *handle) {
+    // UDP messages have no connection state
+    if (!handle->conn) return RESP_TEXT;
+    conn_state *state = *(conn_state**)client_handler_state(handle->conn);
+    return (state) ? state->resp_format : RESP_TEXT;
+}
+
+
+/**
+ * Adds the results of a batch of keys to the response of a multi
+ * key command. On an error, the results so far are sent, followed
+ * by a space and the error.
  * @arg handle The conn handle
+ * @arg resp The response
+ * @arg filter_name The filter name or handle reference
  * @arg cmd_res The result of the command
- * @arg num_keys The number of keys in the result buffer. This should NOT be
- * more than MULTI_OP_SIZE.
+ * @arg num_keys The number of keys in the result buffer
  * @arg res_buf The result buffer
- * @arg end_of_input Should the last result include a new line
  * @return 0 on success, 1 if we should stop.
  */
-static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input) {
-    // Do nothing if we get too many keys
-    if (num_keys > MULTI_OP_SIZE || num_keys <= 0) return 1;
-
+static int add_multi_results(bloom_conn_handler *handle, multi_resp *resp, char *filter_name, int cmd_res, int num_keys, char *res_buf) {
     if (cmd_res != 0) {
+        // Separate the error from any results
+        if (resp->keys) {
+            if (resp->format == RESP_HEX && (resp->keys & 3))
+                resp->buf[resp->len++] = HEX_DIGITS[resp->bits];
+            resp->buf[resp->len++] = ' ';
+        }
+        send_multi_resp(handle, resp, 0);
+
         switch (cmd_res) {
             case -1:
-                handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+                handle_filter_missing(handle, filter_name);
+                break;
+            case -3:
+                handle_client_resp(handle->conn, (char*)FILT_NO_DELETES, FILT_NO_DELETES_LEN);
+                break;
+            case -4:
+                handle_client_resp(handle->conn, (char*)FILT_FROZEN, FILT_FROZEN_LEN);
+                break;
+            case -5:
+                handle_client_resp(handle->conn, (char*)FILT_OVER_QUOTA, FILT_OVER_QUOTA_LEN);
+                break;
+            case -6:
+                handle_client_resp(handle->conn, (char*)FILT_LOADING, FILT_LOADING_LEN);
+                break;
+            case -7:
+                handle_client_resp(handle->conn, (char*)BUSY_RESP, BUSY_RESP_LEN);
                 break;
             default:
                 INTERNAL_ERROR();
@@ -586,35 +3160,61 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
         return 1;
     }
 
-    // Allocate buffers for our response, plus a newline
-    char *resp_bufs[MULTI_OP_SIZE];
-    int resp_buf_lens[MULTI_OP_SIZE];
-
-    // Set the response buffers according to the results
-    int last_key = 1;
-    for (int i=0; i < num_keys; i++) {
-        last_key = end_of_input && (i == (num_keys - 1));
-        switch (res_buf[i]) {
-            case 0:
-                resp_bufs[i] = (char*)((last_key) ? NO_RESP : NO_SPACE);
-                resp_buf_lens[i] = (last_key) ? NO_RESP_LEN: NO_SPACE_LEN;
+    // Write the results in place
+    char *out = resp->buf + resp->len;
+    for (int i=0; i < num_keys; i++, resp->keys++) {
+        if (res_buf[i] != 0 && res_buf[i] != 1) {
+            INTERNAL_ERROR();
+            return 1;
+        }
+        switch (resp->format) {
+            case RESP_COMPACT:
+                *out++ = (res_buf[i]) ? 'Y' : 'N';
                 break;
-            case 1:
-                resp_bufs[i] = (char*)((last_key) ? YES_RESP : YES_SPACE);
-                resp_buf_lens[i] = (last_key) ? YES_RESP_LEN: YES_SPACE_LEN;
+            case RESP_HEX:
+                // The first key of a digit is its high bit
+                resp->bits |= res_buf[i] << (3 - (resp->keys & 3));
+                if ((resp->keys & 3) == 3) {
+                    *out++ = HEX_DIGITS[resp->bits];
+                    resp->bits = 0;
+                }
                 break;
             default:
-                INTERNAL_ERROR();
-                return 1;
+                if (resp->keys) *out++ = ' ';
+                if (res_buf[i]) {
+                    memcpy(out, YES_RESP, YES_RESP_LEN - 1);
+                    out += YES_RESP_LEN - 1;
+                } else {
+                    memcpy(out, NO_RESP, NO_RESP_LEN - 1);
+                    out += NO_RESP_LEN - 1;
+                }
+                break;
         }
     }
-
-    // Write out!
-    send_client_response(handle->conn, (char**)&resp_bufs, (int*)&resp_buf_lens, num_keys);
+    resp->len = out - resp->buf;
     return 0;
 }
 
 
+/**
+ * Sends the output of the response of a multi key command.
+ * @arg handle The conn handle
+ * @arg resp The response
+ * @arg end_of_input Does this end the response
+ */
+static void send_multi_resp(bloom_conn_handler *handle, multi_resp *resp, int end_of_input) {
+    if (end_of_input) {
+        if (resp->format == RESP_HEX && (resp->keys & 3))
+            resp->buf[resp->len++] = HEX_DIGITS[resp->bits];
+        resp->buf[resp->len++] = '\n';
+        resp->keys = 0;
+        resp->bits = 0;
+    }
+    if (resp->len) send_client_response(handle->conn, &resp->buf, &resp->len, 1);
+    resp->len = 0;
+}
+
+
 /**
  * Sends a client response message back. Simple convenience wrapper
  * around handle_client_resp.
@@ -659,32 +3259,73 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
     // at the space, so we can compare the cmd_buf to the commands.
     buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len);
 
-    // Search for the command
+    // Switch on the length of the command, so at most a few
+    // commands of the same length are compared
     conn_cmd_type type = UNKNOWN;
-    #define CMD_MATCH(name) (strcmp(name, cmd_buf) == 0)
-    if (CMD_MATCH("c") || CMD_MATCH("check")) {
-        type = CHECK;
-    } else if (CMD_MATCH("m") || CMD_MATCH("multi")) {
-        type = CHECK_MULTI;
-    } else if (CMD_MATCH("s") || CMD_MATCH("set")) {
-        type = SET;
-    } else if (CMD_MATCH("b") || CMD_MATCH("bulk")) {
-        type = SET_MULTI;
-    } else if (CMD_MATCH("list")) {
-        type = LIST;
-    } else if (CMD_MATCH("info")) {
-        type = INFO;
-    } else if (CMD_MATCH("create")) {
-        type = CREATE;
-    } else if (CMD_MATCH("drop")) {
-        type = DROP;
-    } else if (CMD_MATCH("close")) {
-        type = CLOSE;
-    } else if (CMD_MATCH("clear")) {
-        type = CLEAR;
-    } else if (CMD_MATCH("flush")) {
-        type = FLUSH;
+    #define CMD_MATCH(name) (memcmp(name, cmd_buf, sizeof(name) - 1) == 0)
+    switch (strlen(cmd_buf)) {
+        case 1:
+            if ((unsigned char)*cmd_buf < 128)
+                type = SHORT_COMMANDS[(unsigned char)*cmd_buf];
+            break;
+        case 3:
+            if (CMD_MATCH("set")) type = SET;
+            else if (CMD_MATCH("use")) type = USE;
+            break;
+        case 4:
+            if (CMD_MATCH("bulk")) type = SET_MULTI;
+            else if (CMD_MATCH("list")) type = LIST;
+            else if (CMD_MATCH("info")) type = INFO;
+            else if (CMD_MATCH("drop")) type = DROP;
+            else if (CMD_MATCH("warm")) type = WARM;
+            else if (CMD_MATCH("load")) type = LOAD;
+            break;
+        case 5:
+            if (CMD_MATCH("check")) type = CHECK;
+            else if (CMD_MATCH("multi")) type = CHECK_MULTI;
+            else if (CMD_MATCH("union")) type = UNION;
+            else if (CMD_MATCH("close")) type = CLOSE;
+            else if (CMD_MATCH("clear")) type = CLEAR;
+            else if (CMD_MATCH("flush")) type = FLUSH;
+            else if (CMD_MATCH("reset")) type = RESET;
+            else if (CMD_MATCH("stats")) type = STATS;
+            else if (CMD_MATCH("alias")) type = ALIAS;
+            break;
+        case 6:
+            if (CMD_MATCH("create")) type = CREATE;
+            else if (CMD_MATCH("delete")) type = DELETE;
+            else if (CMD_MATCH("freeze")) type = FREEZE;
+            else if (CMD_MATCH("format")) type = FORMAT;
+            else if (CMD_MATCH("export")) type = EXPORT;
+            else if (CMD_MATCH("import")) type = IMPORT;
+            else if (CMD_MATCH("shrink")) type = SHRINK;
+            break;
+        case 7:
+            if (CMD_MATCH("release")) type = RELEASE;
+            else if (CMD_MATCH("set_any")) type = SET_ANY;
+            else if (CMD_MATCH("compact")) type = COMPACT;
+            else if (CMD_MATCH("migrate")) type = MIGRATE;
+            else if (CMD_MATCH("slowlog")) type = SLOWLOG;
+            break;
+        case 8:
+            if (CMD_MATCH("snapshot")) type = SNAPSHOT;
+            break;
+        case 9:
+            if (CMD_MATCH("check_any")) type = CHECK_ANY;
+            else if (CMD_MATCH("intersect")) type = INTERSECT;
+            else if (CMD_MATCH("provision")) type = PROVISION;
+            break;
+        case 10:
+            if (CMD_MATCH("drop_multi")) type = DROP_MULTI;
+            break;
+        case 11:
+            if (CMD_MATCH("drop_prefix")) type = DROP_PREFIX;
+            break;
+        case 12:
+            if (CMD_MATCH("create_multi")) type = CREATE_MULTI;
+            break;
     }
+    #undef CMD_MATCH
 
     return type;
 }
@@ -3,6 +3,8 @@
 #include "config.h"
 #include "networking.h"
 #include "filter_manager.h"
+#include "cluster.h"
+#include "arena.h"
 
 /**
  * This structure is used to communicate
@@ -12,7 +14,9 @@
 typedef struct {
     bloom_config *config;     // Global bloom configuration
     bloom_filtmgr *mgr;       // Filter manager
+    bloom_cluster *cluster;   // Cluster the filters are placed in, NULL if not clustered
     bloom_conn_info *conn;    // Opaque handle into the networking stack
+    bloom_arena *arena;       // Transient allocations of the commands, reset after each batch
 } bloom_conn_handler;
 
 /**
@@ -24,12 +28,38 @@ void init_conn_handler();
  * Invoked by the networking layer when there is new
  * data to be handled. The connection handler should
  * consume all the input possible, and generate responses
- * to all requests.
+ * to all requests, up to the command budget.
  * @arg handle The connection related information
- * @return 0 on success.
+ * @return 0 on success, 1 if the connection should be
+ * closed, or 2 if the budget was spent with input left.
+ * The handler should then be invoked again once the other
+ * connections of the worker had a turn. Returns 3 if a
+ * command waits on a filter being faulted in, and the
+ * handler should be invoked again once the fault thread
+ * has faulted in filters.
  */
 int handle_client_connect(bloom_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer when a connection
+ * that has handler state is closed, so that the state
+ * can be released.
+ * @arg handle The connection related information
+ */
+void handle_client_close(bloom_conn_handler *handle);
+
+/**
+ * Invoked by the networking layer when a UDP datagram
+ * is received. The datagram may hold many command lines, and
+ * the last line does not need a newline. Only the set and bulk
+ * commands are applied, and no responses are sent.
+ * @arg handle The connection related information, conn must be NULL
+ * @arg buf The datagram buffer. Must have room for one extra byte.
+ * @arg buf_len The length of the datagram
+ * @return The number of commands applied.
+ */
+int handle_udp_message(bloom_conn_handler *handle, char *buf, int buf_len);
+
 /**
  * Invoked by the networking layer periodically to
  * handle state updates. Does not provide
@@ -39,4 +69,14 @@ int handle_client_connect(bloom_conn_handler *handle);
  */
 void periodic_update(bloom_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer before a worker
+ * blocks waiting for events. The worker must invoke
+ * periodic_update once it is woken, before handling
+ * any connections. Does not provide a connection object
+ * as part of the handle.
+ * @arg handle The connection related information
+ */
+void idle_update(bloom_conn_handler *handle);
+
 #endif
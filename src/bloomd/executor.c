@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <syslog.h>
+#include "executor.h"
+#include "spinlock.h"
+
+/**
+ * The queue of a thread. Queues are padded to
+ * a cache line, since other threads steal from them.
+ */
+typedef struct {
+    bloom_spinlock lock;
+    bloom_job *head;
+    bloom_job *tail;
+} __attribute__ ((aligned (64))) job_queue;
+
+/**
+ * The arguments of a thread
+ */
+typedef struct {
+    bloom_executor *exec;
+    int index;
+} executor_thread;
+
+struct bloom_executor {
+    int num_threads;
+    job_queue *queues;
+    pthread_t *threads;
+    executor_thread *thread_args;
+
+    executor_hook idle;
+    executor_hook leave;
+    void *arg;
+
+    uint64_t pending;           // Queued jobs, atomic
+    int should_run;
+
+    // Threads without jobs sleep on the cond. The
+    // sleepers are counted, so submits only signal
+    // when a thread is sleeping.
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond;
+    int sleepers;               // Atomic, changed under sleep_lock
+};
+
+/*
+ * Static declarations
+ */
+static void* executor_main(void *in);
+static bloom_job* queue_pop(job_queue *q);
+static bloom_job* next_job(bloom_executor *exec, int index);
+
+
+/**
+ * Creates an executor and starts its threads.
+ * @arg threads The number of threads
+ * @arg idle Optional, invoked by a thread before it sleeps
+ * @arg leave Optional, invoked by a thread before it exits
+ * @arg arg Passed to the hooks
+ * @arg exec Output, the new executor
+ * @return 0 on success.
+ */
+int init_executor(int threads, executor_hook idle, executor_hook leave,
+        void *arg, bloom_executor **exec) {
+    bloom_executor *e = calloc(1, sizeof(bloom_executor));
+    if (!e) return -1;
+    e->num_threads = threads;
+    e->idle = idle;
+    e->leave = leave;
+    e->arg = arg;
+    e->should_run = 1;
+    pthread_mutex_init(&e->sleep_lock, NULL);
+    pthread_cond_init(&e->sleep_cond, NULL);
+
+    e->threads = calloc(threads, sizeof(pthread_t));
+    e->thread_args = calloc(threads, sizeof(executor_thread));
+    if (!e->threads || !e->thread_args ||
+            posix_memalign((void**)&e->queues, 64, threads * sizeof(job_queue))) {
+        free(e->threads);
+        free(e->thread_args);
+        free(e);
+        return -1;
+    }
+    for (int i=0; i < threads; i++) {
+        INIT_BLOOM_SPIN(&e->queues[i].lock);
+        e->queues[i].head = e->queues[i].tail = NULL;
+    }
+
+    // Start the threads
+    for (int i=0; i < threads; i++) {
+        e->thread_args[i].exec = e;
+        e->thread_args[i].index = i;
+        if (pthread_create(&e->threads[i], NULL, executor_main, &e->thread_args[i])) {
+            syslog(LOG_ERR, "Failed to start executor thread!");
+            e->num_threads = i;
+            destroy_executor(e);
+            return -1;
+        }
+    }
+
+    *exec = e;
+    return 0;
+}
+
+
+/**
+ * Stops the threads of an executor once the queued
+ * jobs have run, and destroys it. No jobs may be
+ * submitted once this is called.
+ * @arg exec The executor
+ */
+void destroy_executor(bloom_executor *exec) {
+    pthread_mutex_lock(&exec->sleep_lock);
+    exec->should_run = 0;
+    pthread_cond_broadcast(&exec->sleep_cond);
+    pthread_mutex_unlock(&exec->sleep_lock);
+
+    for (int i=0; i < exec->num_threads; i++) {
+        pthread_join(exec->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&exec->sleep_lock);
+    pthread_cond_destroy(&exec->sleep_cond);
+    free(exec->queues);
+    free(exec->threads);
+    free(exec->thread_args);
+    free(exec);
+}
+
+
+/**
+ * Returns the number of threads of an executor.
+ * @arg exec The executor
+ * @return The number of threads
+ */
+int executor_threads(bloom_executor *exec) {
+    return exec->num_threads;
+}
+
+
+/**
+ * Queues a job to run on an executor.
+ * @arg exec The executor
+ * @arg queue The queue to use, taken modulo the number of
+ * threads. Submitters that use their own queue spread the
+ * jobs, while the threads steal to balance them.
+ * @arg job The job. It must stay valid until it has run.
+ */
+void executor_submit(bloom_executor *exec, unsigned queue, bloom_job *job) {
+    job_queue *q = exec->queues + (queue % exec->num_threads);
+    job->next = NULL;
+
+    // Counted before it is queued, so the count never goes
+    // below zero. A sleeper checks the count after it is counted
+    // itself, so either it sees this job, or we see it and wake it.
+    __atomic_add_fetch(&exec->pending, 1, __ATOMIC_SEQ_CST);
+    LOCK_BLOOM_SPIN(&q->lock);
+    if (q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    UNLOCK_BLOOM_SPIN(&q->lock);
+    if (__atomic_load_n(&exec->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&exec->sleep_lock);
+        pthread_cond_signal(&exec->sleep_cond);
+        pthread_mutex_unlock(&exec->sleep_lock);
+    }
+}
+
+
+/**
+ * Returns the number of jobs that are queued
+ * but not yet running.
+ * @arg exec The executor
+ * @return The number of jobs
+ */
+uint64_t executor_pending(bloom_executor *exec) {
+    return __atomic_load_n(&exec->pending, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Takes the oldest job of a queue.
+ * @return The job, or NULL if the queue is empty.
+ */
+static bloom_job* queue_pop(job_queue *q) {
+    // Skip the lock of an empty queue
+    if (!__atomic_load_n(&q->head, __ATOMIC_RELAXED)) return NULL;
+    LOCK_BLOOM_SPIN(&q->lock);
+    bloom_job *job = q->head;
+    if (job) {
+        q->head = job->next;
+        if (!q->head) q->tail = NULL;
+    }
+    UNLOCK_BLOOM_SPIN(&q->lock);
+    return job;
+}
+
+
+/**
+ * Finds the next job for a thread, from its own queue
+ * first, and then by stealing from the queues after it.
+ * @return The job, or NULL if every queue is empty.
+ */
+static bloom_job* next_job(bloom_executor *exec, int index) {
+    for (int i=0; i < exec->num_threads; i++) {
+        bloom_job *job = queue_pop(exec->queues + (index + i) % exec->num_threads);
+        if (job) {
+            __atomic_sub_fetch(&exec->pending, 1, __ATOMIC_SEQ_CST);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Main loop of the threads of an executor. Runs jobs
+ * until there are none, and sleeps until more are queued.
+ * Queued jobs are still run once asked to exit.
+ */
+static void* executor_main(void *in) {
+    executor_thread *t = in;
+    bloom_executor *exec = t->exec;
+    bloom_job *job;
+    while (1) {
+        while ((job = next_job(exec, t->index))) {
+            job->func(job, t->index);
+        }
+
+        if (exec->idle) exec->idle(exec->arg, t->index);
+        pthread_mutex_lock(&exec->sleep_lock);
+        __atomic_add_fetch(&exec->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (exec->should_run && !__atomic_load_n(&exec->pending, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&exec->sleep_cond, &exec->sleep_lock);
+        }
+        __atomic_sub_fetch(&exec->sleepers, 1, __ATOMIC_SEQ_CST);
+        int exit = !exec->should_run && !__atomic_load_n(&exec->pending, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&exec->sleep_lock);
+        if (exit) break;
+    }
+
+    if (exec->leave) exec->leave(exec->arg, t->index);
+    return NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef BLOOM_EXECUTOR_H
+#define BLOOM_EXECUTOR_H
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * An executor is a pool of threads that run jobs handed to
+ * them by other threads. It is used to run the commands of the
+ * clients away from the workers doing their IO, so a command
+ * stalled on a page fault or a flush only holds up its own
+ * connection, not every connection of the worker.
+ *
+ * Every thread has its own queue, which the submitter picks, and
+ * runs its jobs in the order they were queued. A thread with an
+ * empty queue steals the oldest job of the other threads before
+ * it sleeps, so a thread stuck in a slow job does not strand the
+ * jobs queued behind it.
+ */
+
+/**
+ * A job to run. Jobs are embedded in the structure they
+ * work on, so queueing one does not allocate.
+ */
+typedef struct bloom_job {
+    void (*func)(struct bloom_job *job, int thread);  // Invoked with the job and the index of the thread
+    struct bloom_job *next;                           // Used by the queues
+} bloom_job;
+
+/**
+ * Opaque handle to an executor
+ */
+typedef struct bloom_executor bloom_executor;
+
+/**
+ * Invoked by each thread of an executor on events of the
+ * thread, such as before it sleeps waiting for jobs.
+ * @arg arg The argument given to the executor
+ * @arg thread The index of the thread
+ */
+typedef void (*executor_hook)(void *arg, int thread);
+
+/**
+ * Creates an executor and starts its threads.
+ * @arg threads The number of threads
+ * @arg idle Optional, invoked by a thread before it sleeps
+ * @arg leave Optional, invoked by a thread before it exits
+ * @arg arg Passed to the hooks
+ * @arg exec Output, the new executor
+ * @return 0 on success.
+ */
+int init_executor(int threads, executor_hook idle, executor_hook leave,
+        void *arg, bloom_executor **exec);
+
+/**
+ * Stops the threads of an executor once the queued
+ * jobs have run, and destroys it. No jobs may be
+ * submitted once this is called.
+ * @arg exec The executor
+ */
+void destroy_executor(bloom_executor *exec);
+
+/**
+ * Returns the number of threads of an executor.
+ * @arg exec The executor
+ * @return The number of threads
+ */
+int executor_threads(bloom_executor *exec);
+
+/**
+ * Queues a job to run on an executor.
+ * @arg exec The executor
+ * @arg queue The queue to use, taken modulo the number of
+ * threads. Submitters that use their own queue spread the
+ * jobs, while the threads steal to balance them.
+ * @arg job The job. It must stay valid until it has run.
+ */
+void executor_submit(bloom_executor *exec, unsigned queue, bloom_job *job);
+
+/**
+ * Returns the number of jobs that are queued
+ * but not yet running.
+ * @arg exec The executor
+ * @return The number of jobs
+ */
+uint64_t executor_pending(bloom_executor *exec);
+
+#endif
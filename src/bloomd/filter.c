@@ -1,14 +1,21 @@
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
 #include "filter.h"
+#include "compress.h"
+#include "latency.h"
+#include "numa.h"
+#include "probes.h"
 #include "type_compat.h"
 
 /*
@@ -21,22 +28,267 @@ static const char* FILTER_FOLDER_NAME = "bloomd.%s";
  */
 static const char* DATA_FILE_NAME = "data.%03d.mmap";
 
+/**
+ * Suffixes of the data files, and of the
+ * compressed data files of cold filters.
+ */
+static const char* DATA_FILE_SUFFIX = ".mmap";
+static const char* COMPRESSED_FILE_SUFFIX = ".cmp";
+
+/*
+ * Generates the folder name of a generation of a
+ * rotating filter, given the time bucket it starts at.
+ */
+static const char* GENERATION_FOLDER_NAME = "gen.%llu";
+
+/*
+ * Generates the folder name of a shard of a
+ * sharded filter, given its index.
+ */
+static const char* SHARD_FOLDER_NAME = "shard.%u";
+
+/*
+ * The folder holding the staged keys of a freezable
+ * filter, and the file its xor filter is stored in.
+ */
+static const char* STAGED_FOLDER_NAME = "staged";
+static const char* FROZEN_FILE_NAME = "frozen.xor";
+static const char* FROZEN_TMP_NAME = "frozen.xor.tmp";
+
+/*
+ * The file the quotient filter of a filter with the quotient
+ * layout is stored in, and the file it is resized or merged
+ * into before it is renamed over it.
+ */
+static const char* QUOTIENT_FILE_NAME = "quotient.qf";
+static const char* QUOTIENT_TMP_NAME = "quotient.qf.tmp";
+
+/**
+ * A compacted layer is built here, then renamed
+ * over the first data file.
+ */
+static const char* COMPACT_TMP_NAME = "compact.tmp";
+
+/**
+ * A shrunk layer is folded into here, then renamed
+ * over the first data file.
+ */
+static const char* SHRINK_TMP_NAME = "shrink.tmp";
+
+/**
+ * A layer is only folded while it keeps at least this
+ * capacity, the smallest a filter can be created with.
+ */
+static const uint64_t SHRINK_MIN_CAPACITY = 10000;
+
+/**
+ * The next layer is created here ahead of time, then renamed
+ * into place when the filter grows. It does not end in
+ * ".mmap", so it is never discovered as a layer.
+ */
+static const char* SPARE_FILE_NAME = "spare.layer";
+
+/**
+ * The layers of a filter created with pack_layers are appended
+ * to a single file, after a header indexing them. Its compressed
+ * form is kept alongside the compressed layers of other filters.
+ */
+static const char* PACK_FILE_NAME = "data.pack";
+static const char* PACK_CMP_NAME = "data.pack.cmp";
+static const char PACK_MAGIC[8] = {'B', 'L', 'M', 'D', 'P', 'A', 'C', 'K'};
+
+/**
+ * The most layers a pack holds, which fills a 4K header
+ */
+#define PACK_MAX_LAYERS 255
+#define PACK_HEADER_SIZE 4096
+
+/*
+ * The header of a pack. Each layer is aligned to the page
+ * size, so it can be mapped on its own.
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} pack_layer;
+
+typedef struct {
+    char magic[8];
+    uint32_t num_layers;
+    uint32_t reserved;
+    pack_layer layers[PACK_MAX_LAYERS];
+} pack_header;
+
+/**
+ * The summary of a filter with a summary_capacity
+ */
+static const char* SUMMARY_FILE_NAME = "summary.bits";
+
 /*
- * Generates the config file name
+ * The binary record of the filter config, and the INI file
+ * that older versions kept it in. The INI file is read if
+ * there is no record, and is only written as an export of
+ * the config in snapshots.
  */
+static const char* META_FILENAME = "config.bin";
 static const char* CONFIG_FILENAME = "config.ini";
 
+/*
+ * The folder in the data dir holding snapshots, and the
+ * suffixes used while a snapshot is replaced.
+ */
+static const char* SNAPSHOT_FOLDER_NAME = "snapshots";
+static const char* SNAPSHOT_TMP_SUFFIX = ".tmp";
+static const char* SNAPSHOT_OLD_SUFFIX = ".old";
+
+/**
+ * A snapshot copies the pages changed during the previous
+ * copy up to this many times without a lock, stopping early
+ * once fewer than SNAPSHOT_SETTLE_RUNS runs of pages changed.
+ */
+#define SNAPSHOT_ROUNDS 3
+#define SNAPSHOT_SETTLE_RUNS 64
+
+/**
+ * The next layer is prepared once the newest
+ * layer has this share of its capacity.
+ */
+#define SPARE_LAYER_FILL 0.75
+
+/*
+ * Each thread is assigned a counter shard on first use
+ */
+static int next_counter_shard = 0;
+static __thread int counter_shard = -1;
+
+/*
+ * The next stamp of the positive check caches, see bloomf_cache_stamp
+ */
+static uint64_t next_cache_stamp = 1;
+
+/*
+ * The operations applied to the shards of a sharded filter
+ */
+typedef enum {
+    SHARD_CONTAINS,
+    SHARD_ADD,
+    SHARD_REMOVE
+} shard_op_type;
+
 /*
  * Static delarations
  */
+static int init_filter(bloom_config *config, char *filter_name, char *full_path,
+        bloom_filter_config *filter_config, int discover, int known, bloom_filter **filter);
+static char* filter_folder(bloom_config *config, char *filter_name);
+static void place_filter_folder(bloom_config *config, char *filter_name, char *full_path);
+static int remove_filter_folder(char *full_path);
 static int thread_safe_fault(bloom_filter *f);
+static bloom_sbf* faulted_sbf(bloom_filter *f);
+static int write_filter_config(bloom_filter *f);
+static int read_filter_config(char *dir, bloom_filter_config *config, int *legacy);
+static filter_counter_shard* thread_counter_shard(bloom_filter *f);
+static void forget_cached_keys(bloom_filter *f);
+static int bloomf_internal_add(bloom_filter *filter, char *key, int can_grow);
+static int bloomf_internal_add_many(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result, int can_grow);
+static void bloomf_count_results(uint64_t *hits, uint64_t *misses, char *result, int num_keys);
+static void bloomf_count_added(uint64_t *counter, char *result, int num_keys);
+static uint64_t shard_size_delta(bloom_filter *f);
+static uint64_t shard_changes(bloom_filter *f);
+static void refresh_meta(bloom_filter *f);
+static void refresh_fill(bloom_filter *f);
+static void add_fill(bloom_filter_fill *total, bloom_filter_fill *fill, double *miss);
+static uint64_t config_generation(bloom_filter *f);
+static int count_data_files(bloom_filter *f);
 static int discover_existing_filters(bloom_filter *f);
+static int restore_memory_snapshot(bloom_filter *f);
+static int expand_compressed_layers(bloom_filter *f);
+static uint64_t get_size(char* filename);
+static int filter_data_files(CONST_DIRENT_T *d);
+static int filter_compressed_files(CONST_DIRENT_T *d);
+static int filter_layer_files(CONST_DIRENT_T *d);
+static char* compressed_name(char *name);
+static char* expanded_name(char *name);
+static int open_pack(bloom_filter *f, pack_header *header);
+static int discover_packed_layers(bloom_filter *f, int fd, pack_header *header);
+static int restore_sbf(bloom_filter *f, int num, bloom_bitmap **maps, bloom_bloomfilter **filters);
+static int append_packed_layer(bloom_filter *f, bloom_bitmap *newest, uint64_t bytes, bloom_bitmap *out);
+static char* swap_suffix(char *name, const char *old_suffix, const char *new_suffix);
+static int sync_filter_dir(bloom_filter *f);
 static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters);
+static void filter_sbf_params(bloom_filter *f, bloom_sbf_params *params);
+static void attach_summary(bloom_filter *f, int num, bloom_sbf *sbf);
 static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out);
+static bitmap_mode bloomf_bitmap_mode(bloom_filter *f, int anonymous);
+static bitmap_mode warmup_mode(bloom_filter *f);
+static int tiered_layer(bloom_filter *f, int layer);
+static uint64_t age_tick_secs(bloom_filter *f);
+static bitmap_mode layer_bitmap_mode(bloom_filter *f, int layer);
+static int seal_older_layers(bloom_filter *f, bloom_sbf *sbf);
+static void place_layer(bloom_filter *f, bloom_bitmap *map);
+static int changes_trackable(bloom_filter *f);
+static int use_spare_layer(bloom_filter *f, bloom_bitmap *spare, uint64_t bytes, bloom_bitmap *out);
+static void discard_spare_layer(bloom_filter *f);
+static void rename_checksums(char *from, char *to);
+static int64_t scrub_layers(bloom_filter *f, bloom_sbf *sbf, uint64_t max_pages, uint64_t *bad_pages);
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
+static int flush_filter(bloom_filter *filter, int sync);
+static int bloomf_replay_callback(void *in, char **keys, int *key_lens, int num_keys);
+static char* snapshot_path(bloom_filter *f, const char *suffix);
+static int open_snapshot_layer(char *dir, int num, uint64_t size);
+static void delete_flat_dir(char *path);
 
 static int filter_out_special(CONST_DIRENT_T *d);
 
+static int init_generation(bloom_filter *f, uint64_t bucket, bloom_filter **gen);
+static int discover_generations(bloom_filter *f);
+static int filter_generation_dirs(CONST_DIRENT_T *d);
+static int compare_generations(const void *a, const void *b);
+static bloom_filter_generations* alloc_generations(uint32_t num);
+static int generations_contains(bloom_filter_generations *gens, uint32_t start,
+        char **keys, int *key_lens, int num_keys, char *found);
+static int generations_contains_hashed(bloom_filter_generations *gens,
+        bloom_hashed_key *keys, int num_keys, char *found);
+static int flush_generations(bloom_filter *f, int force, int sync);
+
+static int init_keyshards(bloom_filter *f, int discover);
+static int flush_keyshards(bloom_filter *f, int force, int sync);
+static void keyshards_meta(bloom_filter *f, filter_meta *meta);
+static uint32_t key_shard(bloom_filter_keyshards *ks, char *key, int len);
+static int keyshards_op(bloom_filter *f, char **keys, int *key_lens, int num_keys, char *result, shard_op_type op);
+static int shard_op(bloom_filter_shard *s, char **keys, int *key_lens, int num_keys, char *result, shard_op_type op);
+static void lock_shard(bloom_filter_shard *s, int exclusive);
+static int add_residency(filter_residency *r, bloom_bitmap *map, int layer);
+static int scan_residency(bloom_filter *f, filter_residency *r);
+static int reclaim_layers(bloom_filter *f, int pageout, uint64_t *bytes);
+static int reclaim_map(bloom_bitmap *map, int pageout, uint64_t *bytes);
+static uint64_t layer_dirty_bytes(bloom_filter *f);
+
+static int load_frozen_filter(bloom_filter *f);
+static bloom_xorfilter* faulted_frozen(bloom_filter *f);
+static int frozen_contains_many(bloom_xorfilter *xf, char **keys, int *key_lens, int num_keys, char *result);
+static int bloomf_stage_callback(void *in, char **keys, int *key_lens, int num_keys);
+static int build_frozen_file(bloom_filter *f, uint64_t *num_keys, uint64_t *bytes);
+static void delete_sbf_files(bloom_filter *f);
+
+static int load_quotient_filter(bloom_filter *f);
+static bloom_qf* faulted_qf(bloom_filter *f);
+static int open_quotient_filter(bloom_filter *f, char *path, uint32_t q_bits, uint32_t r_bits, bloom_qf **out);
+static void close_quotient_filter(bloom_qf *qf);
+static int replace_quotient_filter(bloom_filter *f, bloom_qf *a, bloom_qf *b, int intersect, bloom_qf **out);
+static void publish_quotient_filter(bloom_filter *f, bloom_qf *qf);
+static int quotient_add_many(bloom_filter *f, bloom_qf **qf, int publish, char **keys,
+        int *key_lens, int num_keys, char *result);
+static int quotient_internal_add_many(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result, int can_grow);
+static int quotient_contains_many(bloom_qf *qf, char **keys, int *key_lens, int num_keys, char *result);
+static int quotient_replay_callback(void *in, char **keys, int *key_lens, int num_keys);
+static int bloomf_compact_callback(void *in, char **keys, int *key_lens, int num_keys);
+static int build_compact_file(bloom_filter *f, bloom_sbf_params *params,
+        bloom_filter_params *layer, uint64_t *num_keys);
+static int replace_layers(bloom_filter *f, const char *tmp_name, uint32_t num_layers);
+static uint32_t shrink_folds(bloom_sbf *sbf);
+static int build_shrink_file(bloom_filter *f, bloom_bloomfilter *layer, uint32_t folds, uint64_t *bytes);
+
 /**
  * Initializes a bloom filter wrapper.
  * @arg config The configuration to use
@@ -47,51 +299,266 @@ static int filter_out_special(CONST_DIRENT_T *d);
  * @return 0 on success
  */
 int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter) {
+    // Copy filter configs
+    bloom_filter_config filter_config;
+    memset(&filter_config, 0, sizeof(filter_config));
+    filter_config.initial_capacity = config->initial_capacity;
+    filter_config.capacity = config->initial_capacity;
+    filter_config.default_probability = config->default_probability;
+    filter_config.scale_size = config->scale_size;
+    filter_config.probability_reduction = config->probability_reduction;
+    filter_config.in_memory = config->in_memory;
+    filter_config.layout = config->layout;
+    filter_config.hash_scheme = config->hash_scheme;
+    filter_config.rotate_window = config->rotate_window;
+    filter_config.rotate_generations = config->rotate_generations;
+    filter_config.freezable = config->freezable;
+    filter_config.summary_capacity = config->summary_capacity;
+    filter_config.shards = config->shards;
+    filter_config.warmup = config->warmup;
+    filter_config.key_ttl = config->key_ttl;
+    filter_config.max_probes = config->max_probes;
+    filter_config.pinned = config->pinned;
+
+    char *full_path = filter_folder(config, filter_name);
+    if (config->data_dirs && !config->read_only) place_filter_folder(config, filter_name, full_path);
+    int res = init_filter(config, filter_name, full_path, &filter_config, discover, 0, filter);
+    if (!res) refresh_meta(*filter);
+    return res;
+}
+
+/**
+ * Initializes an existing bloom filter from a config that
+ * is already known, such as from the manifest of the data_dir.
+ * This neither creates the folder of the filter, nor reads
+ * its config file. The filter is left proxied.
+ * @arg config The configuration to use
+ * @arg filter_name The name of the filter
+ * @arg filter_config The config of the filter
+ * @arg filter Output parameter, the new filter
+ * @return 0 on success
+ */
+int load_bloom_filter(bloom_config *config, char *filter_name,
+        bloom_filter_config *filter_config, bloom_filter **filter) {
+    char *full_path = filter_folder(config, filter_name);
+    int res = init_filter(config, filter_name, full_path, filter_config, 0, 1, filter);
+    if (!res) refresh_meta(*filter);
+    return res;
+}
+
+// Returns the folder of a top level filter, which the caller owns
+static char* filter_folder(bloom_config *config, char *filter_name) {
+    char *folder_name = NULL;
+    int res = asprintf(&folder_name, FILTER_FOLDER_NAME, filter_name);
+    assert(res != -1);
+    char *full_path = join_path(config->data_dir, folder_name);
+    free(folder_name);
+    return full_path;
+}
+
+/**
+ * Places the folder of a new filter on the data directory with
+ * the most free space, of the data_dir and the data_dirs. A
+ * folder on one of the data_dirs is linked from the data_dir,
+ * so the filters are still found and named by the data_dir.
+ * An existing folder is left alone, and a folder that can not
+ * be placed is made in the data_dir as usual.
+ * @arg config The configuration
+ * @arg filter_name The name of the filter
+ * @arg full_path The folder of the filter in the data_dir
+ */
+static void place_filter_folder(bloom_config *config, char *filter_name, char *full_path) {
+    struct stat st;
+    if (!lstat(full_path, &st) || errno != ENOENT) return;
+
+    char *buf, *dirs[MAX_DATA_DIRS];
+    int num = data_dir_list(config, &buf, dirs);
+    int best = 0;
+    uint64_t best_free = 0;
+    for (int i=0; i < num; i++) {
+        struct statvfs vfs;
+        if (statvfs(dirs[i], &vfs)) continue;
+        uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+        if (avail > best_free) {
+            best = i;
+            best_free = avail;
+        }
+    }
+
+    char *folder_name = NULL, *target = NULL;
+    if (best && asprintf(&folder_name, FILTER_FOLDER_NAME, filter_name) != -1) {
+        target = join_path(dirs[best], folder_name);
+        free(folder_name);
+    }
+    if (target && !mkdir(target, 0755)) {
+        if (symlink(target, full_path)) {
+            syslog(LOG_ERR, "Failed to link filter directory '%s' to '%s'. %s",
+                    full_path, target, strerror(errno));
+            rmdir(target);
+        } else {
+            syslog(LOG_INFO, "Placed filter '%s' in data dir %s.", filter_name, dirs[best]);
+        }
+    } else if (target) {
+        syslog(LOG_ERR, "Failed to create filter directory '%s'. %s", target, strerror(errno));
+    }
+    free(target);
+    free(buf);
+}
+
+/**
+ * Removes the folder of a filter once it is empty. A folder
+ * placed on one of the data_dirs is removed along with its link.
+ * @arg full_path The folder of the filter
+ * @return 0 on success.
+ */
+static int remove_filter_folder(char *full_path) {
+    struct stat st;
+    if (lstat(full_path, &st) || !S_ISLNK(st.st_mode)) return rmdir(full_path);
+    char *target = realpath(full_path, NULL);
+    int res = (target) ? rmdir(target) : -1;
+    if (!res) res = unlink(full_path);
+    free(target);
+    return res;
+}
+
+/**
+ * Initializes a filter stored in the given directory. Used
+ * for both top level filters, and the generations of a
+ * rotating filter.
+ * @arg full_path The directory of the filter, which is owned by the filter
+ * @arg filter_config The initial filter config, updated from
+ * the config file if there is one
+ * @arg known Is the filter config already that of an existing
+ * filter, so the folder and config file are left alone
+ * @return 0 on success. The filter is set to NULL if
+ * it could not be allocated.
+ */
+static int init_filter(bloom_config *config, char *filter_name, char *full_path,
+        bloom_filter_config *filter_config, int discover, int known, bloom_filter **filter) {
     // Allocate the buffers
     bloom_filter *f = *filter = calloc(1, sizeof(bloom_filter));
+    if (!f) {
+        free(full_path);
+        return -1;
+    }
 
     // Store the things
     f->config = config;
     f->filter_name = strdup(filter_name);
-
-    // Copy filter configs
-    f->filter_config.initial_capacity = config->initial_capacity;
-    f->filter_config.capacity = config->initial_capacity;
-    f->filter_config.default_probability = config->default_probability;
-    f->filter_config.scale_size = config->scale_size;
-    f->filter_config.probability_reduction = config->probability_reduction;
-    f->filter_config.in_memory = config->in_memory;
-
-    // Get the folder name
-    char *folder_name = NULL;
-    int res;
-    res = asprintf(&folder_name, FILTER_FOLDER_NAME, f->filter_name);
-    assert(res != -1);
-
-    // Compute the full path
-    f->full_path = join_path(config->data_dir, folder_name);
-    free(folder_name);
+    f->full_path = full_path;
+    f->filter_config = *filter_config;
+    f->numa_node = -1;
+    f->cache_stamp = __atomic_fetch_add(&next_cache_stamp, 1, __ATOMIC_RELAXED);
 
     // Initialize the locks
-    INIT_BLOOM_SPIN(&f->counter_lock);
     pthread_mutex_init(&f->sbf_lock, NULL);
+    pthread_mutex_init(&f->flush_lock, NULL);
+
+    // Allocate the counter shards, aligned to cache lines
+    if (posix_memalign((void**)&f->shards, sizeof(filter_counter_shard),
+                FILTER_COUNTER_SHARDS * sizeof(filter_counter_shard))) {
+        syslog(LOG_ERR, "Failed to allocate counters for filter '%s'.", f->filter_name);
+        pthread_mutex_destroy(&f->sbf_lock);
+        pthread_mutex_destroy(&f->flush_lock);
+        free(f->filter_name);
+        free(f->full_path);
+        free(f);
+        *filter = NULL;
+        return -1;
+    }
+    memset(f->shards, 0, FILTER_COUNTER_SHARDS * sizeof(filter_counter_shard));
 
-    // Try to create the folder path
-    res = mkdir(f->full_path, 0755);
+    // Try to create the folder path. A read-only filter
+    // only reads the folder the writer created.
+    int res = (config->read_only || known) ? 0 : mkdir(f->full_path, 0755);
     if (res && errno != EEXIST) {
         syslog(LOG_ERR, "Failed to create filter directory '%s'. Err: %d [%d]", f->full_path, res, errno);
         return res;
     }
 
+    // Remember the device, so flushes can be spread over the data dirs
+    struct stat st;
+    if (!stat(f->full_path, &st)) f->data_dev = st.st_dev;
+
     // Read in the filter_config
-    char *config_name = join_path(f->full_path, (char*)CONFIG_FILENAME);
-    res = filter_config_from_filename(config_name, &f->filter_config);
-    free(config_name);
+    int legacy = 0;
+    if (!known) res = read_filter_config(f->full_path, &f->filter_config, &legacy);
     if (res && res != -ENOENT) {
         syslog(LOG_ERR, "Failed to read filter '%s' configuration. Err: %d [%d]", f->filter_name, res, errno);
         return res;
     }
 
+    // Move the config of an older version into the record
+    if (legacy && !config->read_only && !write_filter_config(f)) {
+        char *config_name = join_path(f->full_path, (char*)CONFIG_FILENAME);
+        unlink(config_name);
+        free(config_name);
+    }
+
+    // A read-only filter maps the files of the writer. In-memory
+    // filters have none, and rotating and sharded filters change
+    // their layout on disk, so they are not shared.
+    if (config->read_only) {
+        if (res || f->filter_config.in_memory || f->filter_config.rotate_window ||
+                f->filter_config.shards) {
+            syslog(LOG_ERR, "Filter '%s' can not be served read-only.", f->filter_name);
+            return -1;
+        }
+        f->generation = config_generation(f);
+        return (discover) ? thread_safe_fault(f) : 0;
+    }
+
+    // A rotating filter keeps its keys in the generations, which are
+    // always discovered, and faulted in on-demand like any other filter
+    if (f->filter_config.rotate_window) {
+        res = discover_generations(f);
+        if (!res) res = bloomf_rotate(f, time(NULL));
+        if (!res && discover) res = bloomf_fault(f);
+        if (!res) res = flush_generations(f, 1, 1);
+        return res;
+    }
+
+    // A sharded filter keeps its keys in the shards, which are
+    // always discovered, and faulted in on-demand like any other filter
+    if (f->filter_config.shards) {
+        res = init_keyshards(f, discover);
+        if (!res) res = flush_keyshards(f, 1, 1);
+        return res;
+    }
+
+    // A frozen filter only has its xor filter to load. The SBF and
+    // staged keys may be left over if the freeze was interrupted.
+    if (f->filter_config.frozen) {
+        char *staged_path = join_path(f->full_path, (char*)STAGED_FOLDER_NAME);
+        delete_flat_dir(staged_path);
+        free(staged_path);
+        delete_sbf_files(f);
+        return (discover) ? bloomf_fault(f) : 0;
+    }
+
+    // Freezable filters stage every key that is set, since the
+    // keys can not be recovered from the SBF when it is frozen
+    if (f->filter_config.freezable) {
+        char *staged_path = join_path(f->full_path, (char*)STAGED_FOLDER_NAME);
+        res = mkdir(staged_path, 0755);
+        if (!res || errno == EEXIST) res = setlog_open(staged_path, &f->staged);
+        free(staged_path);
+        if (res) {
+            syslog(LOG_ERR, "Failed to open the staged keys of filter '%s'. Err: %d",
+                    f->filter_name, res);
+            return res;
+        }
+    }
+
+    // Open the set log, which is replayed when the SBF is loaded.
+    // Counting filters count every set, so replaying the sets that
+    // already reached the data files would inflate the counters.
+    if (config->use_set_log && !f->filter_config.in_memory &&
+            f->filter_config.layout != BLOOM_LAYOUT_COUNTING) {
+        res = setlog_open(f->full_path, &f->set_log);
+        if (res) return res;
+    }
+
     // Discover the existing filters if we need to
     res = 0;
     if (discover) {
@@ -118,515 +585,4890 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
 int destroy_bloom_filter(bloom_filter *filter) {
     // Close first
     bloomf_close(filter);
+    if (filter->set_log) setlog_close(filter->set_log);
+    if (filter->staged) setlog_close(filter->staged);
+    if (filter->gens) {
+        for (uint32_t i=0; i < filter->gens->num; i++) {
+            destroy_bloom_filter(filter->gens->gens[i].filter);
+        }
+        free(filter->gens);
+    }
+    if (filter->keyshards) {
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            destroy_bloom_filter(filter->keyshards->shards[i].filter);
+            pthread_rwlock_destroy(&filter->keyshards->shards[i].lock);
+        }
+        free(filter->keyshards);
+    }
 
     // Cleanup
     free(filter->filter_name);
     free(filter->full_path);
+    free(filter->shards);
     free(filter);
     return 0;
 }
 
 /**
- * Gets the counters that belong to a filter
+ * Gets the counters that belong to a filter,
+ * aggregating the per-thread shards.
  * @notes Thread safe, but may be inconsistent.
  * @arg filter The filter
- * @return A reference to the counters of a filter
+ * @arg counters Output, set to the current counters
  */
-filter_counters* bloomf_counters(bloom_filter *filter) {
-    return &filter->counters;
+void bloomf_counters(bloom_filter *filter, filter_counters *counters) {
+    memcpy(counters, &filter->counters, sizeof(filter_counters));
+    counters->check_hits = 0;
+    counters->check_misses = 0;
+    counters->set_hits = 0;
+    counters->set_misses = 0;
+
+    filter_counter_shard *shard;
+    for (int i=0; i < FILTER_COUNTER_SHARDS; i++) {
+        shard = filter->shards + i;
+        counters->check_hits += __atomic_load_n(&shard->c.check_hits, __ATOMIC_RELAXED);
+        counters->check_misses += __atomic_load_n(&shard->c.check_misses, __ATOMIC_RELAXED);
+        counters->set_hits += __atomic_load_n(&shard->c.set_hits, __ATOMIC_RELAXED);
+        counters->set_misses += __atomic_load_n(&shard->c.set_misses, __ATOMIC_RELAXED);
+    }
+
+    // Pages are faulted by the generations of a rotating filter
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    for (uint32_t i=0; gens && i < gens->num; i++) {
+        filter_counters *gen = &gens->gens[i].filter->counters;
+        counters->page_ins += gen->page_ins;
+        counters->page_outs += gen->page_outs;
+        counters->fault_lock_waits += gen->fault_lock_waits;
+        counters->fault_lock_wait_nsec += gen->fault_lock_wait_nsec;
+        counters->fault_nsec += gen->fault_nsec;
+    }
+
+    // Sharded filters are checked and set through their shards
+    bloom_filter_keyshards *ks = filter->keyshards;
+    for (uint32_t i=0; ks && i < ks->num; i++) {
+        filter_counters shard;
+        bloomf_counters(ks->shards[i].filter, &shard);
+        counters->check_hits += shard.check_hits;
+        counters->check_misses += shard.check_misses;
+        counters->set_hits += shard.set_hits;
+        counters->set_misses += shard.set_misses;
+        counters->page_ins += shard.page_ins;
+        counters->page_outs += shard.page_outs;
+        counters->lock_waits += shard.lock_waits;
+        counters->lock_wait_nsec += shard.lock_wait_nsec;
+        counters->fault_lock_waits += shard.fault_lock_waits;
+        counters->fault_lock_wait_nsec += shard.fault_lock_wait_nsec;
+        counters->fault_nsec += shard.fault_nsec;
+        counters->checksum_errors += shard.checksum_errors;
+    }
 }
 
 /**
- * Checks if a filter is currectly mapped into
- * memory or if it is proxied.
- * @notes Thread safe.
- * @return 0 if in-memory, 1 if proxied.
+ * Gets the cached size, capacity and byte size of a filter.
+ * Unlike bloomf_size and friends, the layers are never read,
+ * so this is cheap for any number of filters and safe while
+ * the filter is being faulted in or closed. The size includes
+ * the keys set since the metadata was refreshed, which happens
+ * whenever the filter is faulted, grown, flushed or closed.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg meta Output, set to the cached metadata
  */
-int bloomf_is_proxied(bloom_filter *filter) {
-    return !(filter->sbf);
+void bloomf_meta(bloom_filter *filter, filter_meta *meta) {
+    if (filter->keyshards) {
+        keyshards_meta(filter, meta);
+        return;
+    }
+    meta->size = __atomic_load_n(&filter->meta.size, __ATOMIC_RELAXED) + shard_size_delta(filter);
+    meta->capacity = __atomic_load_n(&filter->meta.capacity, __ATOMIC_RELAXED);
+    meta->bytes = __atomic_load_n(&filter->meta.bytes, __ATOMIC_RELAXED);
 }
 
 /**
- * Flushes the filter. Idempotent if the
- * filter is proxied or not dirty.
- * @arg filter The filter to close
- * @return 0 on success.
+ * Gets the estimated fill of a filter, from the bits set in
+ * its layers. Unlike the size, it is still right after filters
+ * are merged or their layers are restored. It is counted in the
+ * background when the filter is flushed, and only for the layers
+ * that changed, so it lags behind the latest sets.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg fill Output, set to the estimated fill
+ * @return 0 on success, -1 if the fill is not known, such
+ * as for a filter that was not flushed since it was loaded,
+ * a frozen filter or the counting layout.
  */
-int bloomf_flush(bloom_filter *filter) {
-    // Only do things if we are non-proxied
-    if (filter->sbf) {
-        // Time how long this takes
-        struct timeval start, end;
-        gettimeofday(&start, NULL);
-
-        // If our size has not changed, there is no need to flush
-        uint64_t new_size = bloomf_size(filter);
-        if (new_size == filter->filter_config.size && filter->filter_config.bytes != 0) {
-            return 0;
+int bloomf_fill(bloom_filter *filter, bloom_filter_fill *fill) {
+    memset(fill, 0, sizeof(bloom_filter_fill));
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens || filter->keyshards) {
+        // Generations are all checked, like layers, while a key
+        // is only checked in its own shard
+        uint32_t num = (gens) ? gens->num : filter->keyshards->num;
+        double miss = 1, sum = 0;
+        for (uint32_t i=0; i < num; i++) {
+            bloom_filter *part = (gens) ? gens->gens[i].filter : filter->keyshards->shards[i].filter;
+            bloom_filter_fill part_fill;
+            if (bloomf_fill(part, &part_fill)) continue;
+            add_fill(fill, &part_fill, &miss);
+            sum += part_fill.fp_probability;
         }
+        fill->fp_probability = (gens) ? 1 - miss : sum / num;
+        return (fill->bits) ? 0 : -1;
+    }
 
-        // Store our properties for a future unmap
-        filter->filter_config.size = new_size;
-        filter->filter_config.capacity = bloomf_capacity(filter);
-        filter->filter_config.bytes = bloomf_byte_size(filter);
+    fill->bits = __atomic_load_n(&filter->fill.bits, __ATOMIC_RELAXED);
+    fill->bits_set = __atomic_load_n(&filter->fill.bits_set, __ATOMIC_RELAXED);
+    fill->keys = __atomic_load_n(&filter->fill.keys, __ATOMIC_RELAXED);
+    __atomic_load(&filter->fill.fp_probability, &fill->fp_probability, __ATOMIC_RELAXED);
+    return (fill->bits) ? 0 : -1;
+}
 
-        // Write out filter_config
-        char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
-        int res = update_filename_from_filter_config(config_name, &filter->filter_config);
-        free(config_name);
-        if (res) {
-            syslog(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
-                    filter->filter_name, res);
-        }
+// Adds the fill of a part of a filter to a total, and
+// the chance the part has no false positive to miss
+static void add_fill(bloom_filter_fill *total, bloom_filter_fill *fill, double *miss) {
+    total->bits += fill->bits;
+    total->bits_set += fill->bits_set;
+    total->keys += fill->keys;
+    *miss *= 1 - fill->fp_probability;
+}
 
-        // Flush the filter
-        res = 0;
-        if (!filter->filter_config.in_memory) {
-            res = sbf_flush((bloom_sbf*)filter->sbf);
-        }
+/**
+ * Counts the fill of the layers again, for bloomf_fill.
+ * Only the layers that changed since they were last
+ * counted are read.
+ */
+static void refresh_fill(bloom_filter *f) {
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    bloom_filter_fill fill;
+    if (!sbf || f->filter_config.frozen || sbf_fill(sbf, &fill)) return;
+    __atomic_store_n(&f->fill.bits, fill.bits, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->fill.bits_set, fill.bits_set, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->fill.keys, fill.keys, __ATOMIC_RELAXED);
+    __atomic_store(&f->fill.fp_probability, &fill.fp_probability, __ATOMIC_RELAXED);
+}
 
-        // Compute the elapsed time
-        gettimeofday(&end, NULL);
-        syslog(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
-                filter->filter_name, timediff_msec(&start, &end));
-        return res;
+/**
+ * Measures how much of each layer of a filter is resident
+ * in memory, for bloomf_residency. Proxied filters have
+ * nothing resident. The layers of rotating and sharded
+ * filters are only counted in the totals.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_scan_residency(bloom_filter *filter) {
+    filter_residency r;
+    memset(&r, 0, sizeof(r));
+    int res = 0;
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens || filter->keyshards) {
+        uint32_t num = (gens) ? gens->num : filter->keyshards->num;
+        for (uint32_t i=0; i < num && !res; i++) {
+            filter_residency part;
+            memset(&part, 0, sizeof(part));
+            if (gens) {
+                res = scan_residency(gens->gens[i].filter, &part);
+            } else {
+                bloom_filter_shard *s = filter->keyshards->shards + i;
+                lock_shard(s, 0);
+                res = scan_residency(s->filter, &part);
+                pthread_rwlock_unlock(&s->lock);
+            }
+            r.resident += part.resident;
+            r.mapped += part.mapped;
+        }
+    } else {
+        res = scan_residency(filter, &r);
     }
+    if (res) return -1;
+
+    // Only the scan thread writes, readers may see a mix of two scans
+    r.scanned = time(NULL);
+    memcpy(&filter->residency, &r, sizeof(r));
     return 0;
 }
 
 /**
- * Gracefully closes a bloom filter.
- * @arg filter The filter to close
- * @return 0 on success.
+ * Hints the kernel to reclaim the clean pages of a filter that
+ * are mapped from its files, while it stays mapped and serving.
+ * The older layers are marked cold, or with pageout reclaimed now,
+ * in which case the newest layer, which takes the sets, is marked
+ * cold too. Layers in bloomd's own memory are left alone, since
+ * they would only be swapped, and so are the layers of pinned
+ * filters, which are locked in memory.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @arg pageout If 1, reclaim the older layers now
+ * @arg bytes Output, the bytes of the pages that were hinted
+ * @return 0 on success, -1 on error.
  */
-int bloomf_close(bloom_filter *filter) {
-    // Acquire lock
-    pthread_mutex_lock(&filter->sbf_lock);
+int bloomf_reclaim(bloom_filter *filter, int pageout, uint64_t *bytes) {
+    *bytes = 0;
+    if (filter->filter_config.pinned) return 0;
+    int res = 0;
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens || filter->keyshards) {
+        uint32_t num = (gens) ? gens->num : filter->keyshards->num;
+        for (uint32_t i=0; i < num && !res; i++) {
+            if (gens) {
+                res = reclaim_layers(gens->gens[i].filter, pageout, bytes);
+            } else {
+                bloom_filter_shard *s = filter->keyshards->shards + i;
+                lock_shard(s, 0);
+                res = reclaim_layers(s->filter, pageout, bytes);
+                pthread_rwlock_unlock(&s->lock);
+            }
+        }
+    } else {
+        res = reclaim_layers(filter, pageout, bytes);
+    }
+    return res;
+}
 
-    // Only act if we are non-proxied
-    if (filter->sbf) {
-        bloomf_flush(filter);
+/**
+ * Gets how much of a filter was resident in
+ * memory at the last bloomf_scan_residency.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg residency Output, set to the residency
+ */
+void bloomf_residency(bloom_filter *filter, filter_residency *residency) {
+    memcpy(residency, &filter->residency, sizeof(filter_residency));
+}
 
-        bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
-        filter->sbf = NULL;
+// Adds the residency of the layers of a plain filter
+static int scan_residency(bloom_filter *f, filter_residency *r) {
+    bloom_xorfilter *frozen = (bloom_xorfilter*)__atomic_load_n(&f->frozen, __ATOMIC_ACQUIRE);
+    bloom_qf *qf = (bloom_qf*)__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE);
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    if (frozen) return add_residency(r, frozen->map, 0);
+    if (qf) return add_residency(r, qf->map, 0);
+    if (!sbf) return 0;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (add_residency(r, sbf->filters[i]->map, i)) return -1;
+    }
+    return (sbf->summary) ? add_residency(r, sbf->summary, -1) : 0;
+}
 
-        sbf_close(sbf);
-        free(sbf);
+// Hints the reclaim of the layers of a plain filter
+static int reclaim_layers(bloom_filter *f, int pageout, uint64_t *bytes) {
+    bloom_xorfilter *frozen = (bloom_xorfilter*)__atomic_load_n(&f->frozen, __ATOMIC_ACQUIRE);
+    bloom_qf *qf = (bloom_qf*)__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE);
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    if (frozen) return (pageout) ? reclaim_map(frozen->map, 0, bytes) : 0;
+    if (qf) return (pageout) ? reclaim_map(qf->map, 0, bytes) : 0;
+    if (!sbf) return 0;
 
-        filter->counters.page_outs += 1;
+    // The newest layer is first, and the summary is always hot
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (!i && !pageout) continue;
+        if (reclaim_map(sbf->filters[i]->map, pageout && i, bytes)) return -1;
+    }
+    return 0;
+}
+
+// Hints the reclaim of a bitmap, if it is mapped from its file
+static int reclaim_map(bloom_bitmap *map, int pageout, uint64_t *bytes) {
+    uint64_t hinted;
+    int res = bitmap_reclaim(map, pageout, &hinted);
+    if (res == -EINVAL) return 0;
+    if (res) {
+        syslog(LOG_ERR, "Failed to hint the reclaim of a layer! %s", strerror(-res));
+        return -1;
     }
+    *bytes += hinted;
+    return 0;
+}
 
-    // Release lock
-    pthread_mutex_unlock(&filter->sbf_lock);
+// Adds the residency of a bitmap, to a layer unless it is negative
+static int add_residency(filter_residency *r, bloom_bitmap *map, int layer) {
+    uint64_t resident;
+    int res = bitmap_resident(map, &resident);
+    if (res) {
+        syslog(LOG_ERR, "Failed to count the resident pages of a layer! %s", strerror(-res));
+        return -1;
+    }
+    r->resident += resident;
+    r->mapped += map->size;
+    if (layer < 0) return 0;
+
+    int idx = (layer < FILTER_RESIDENCY_LAYERS) ? layer : FILTER_RESIDENCY_LAYERS - 1;
+    r->layers[idx] += resident;
+    if ((uint32_t)idx >= r->num_layers) r->num_layers = idx + 1;
     return 0;
 }
 
 /**
- * Deletes the bloom filter with
- * extreme prejudice.
- * @arg filter The filter to delete
- * @return 0 on success.
+ * Records a contended acquisition of the lock that
+ * guards a filter, which is held by its caller.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @arg wait_nsec The time spent waiting for the lock
  */
-int bloomf_delete(bloom_filter *filter) {
-    // Close first
-    bloomf_close(filter);
+void bloomf_record_lock_wait(bloom_filter *filter, uint64_t wait_nsec) {
+    __atomic_add_fetch(&filter->counters.lock_waits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&filter->counters.lock_wait_nsec, wait_nsec, __ATOMIC_RELAXED);
+}
 
-    // Delete the files
-    struct dirent **namelist = NULL;
+/**
+ * Returns the stamp positive checks of a filter are cached
+ * under. A key that was found stays found while the stamp
+ * is unchanged, and the stamp changes whenever keys may be
+ * lost, such as on a reset. Stamps are never reused, even
+ * by other filters.
+ * @notes Thread safe. Load the stamp before checking keys,
+ * so their results are not cached under a later stamp.
+ * @arg filter The filter
+ * @return The stamp, or 0 if keys can expire or be deleted,
+ * so positive checks must not be cached.
+ */
+uint64_t bloomf_cache_stamp(bloom_filter *filter) {
+    bloom_filter_config *fc = &filter->filter_config;
+    if (fc->layout == BLOOM_LAYOUT_COUNTING || fc->layout == BLOOM_LAYOUT_AGING ||
+            fc->key_ttl || fc->rotate_window) return 0;
+    return __atomic_load_n(&filter->cache_stamp, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Counts the keys found by cached checks, which never
+ * reach the filter.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg num_keys The number of keys found
+ */
+void bloomf_count_cached(bloom_filter *filter, int num_keys) {
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    __atomic_fetch_add(&shard->c.check_hits, num_keys, __ATOMIC_RELAXED);
+}
+
+/**
+ * Moves a filter to a new cache stamp once it may have lost
+ * keys, or changed its false positives. This must follow
+ * the change, so a check racing with it can not cache a key
+ * under the new stamp before the key is lost.
+ */
+static void forget_cached_keys(bloom_filter *f) {
+    uint64_t stamp = __atomic_fetch_add(&next_cache_stamp, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->cache_stamp, stamp, __ATOMIC_RELEASE);
+}
+
+/**
+ * Checks if a filter is currectly mapped into
+ * memory or if it is proxied.
+ * @notes Thread safe.
+ * @return 0 if in-memory, 1 if proxied.
+ */
+int bloomf_is_proxied(bloom_filter *filter) {
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    for (uint32_t i=0; gens && i < gens->num; i++) {
+        if (gens->gens[i].filter->sbf) return 0;
+    }
+    bloom_filter_keyshards *ks = filter->keyshards;
+    for (uint32_t i=0; ks && i < ks->num; i++) {
+        if (ks->shards[i].filter->sbf) return 0;
+    }
+    if (filter->filter_config.frozen) return !(filter->frozen);
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) return !(filter->qf);
+    return !(filter->sbf);
+}
+
+/**
+ * Faults in a proxied filter, without
+ * checking or setting any keys.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_fault(bloom_filter *filter) {
+    if (filter->gens) {
+        for (uint32_t i=0; i < filter->gens->num; i++) {
+            if (bloomf_fault(filter->gens->gens[i].filter)) return -1;
+        }
+        return 0;
+    }
+    if (filter->keyshards) {
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            if (bloomf_fault(filter->keyshards->shards[i].filter)) return -1;
+        }
+        return 0;
+    }
+    if (__atomic_load_n(&filter->sbf, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&filter->frozen, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&filter->qf, __ATOMIC_ACQUIRE)) return 0;
+    return (thread_safe_fault(filter) != 0) ? -1 : 0;
+}
+
+/**
+ * Picks up the changes the writer made to the files of a
+ * read-only filter. The filter config is read again when it
+ * was replaced, and the filter is closed if the writer added
+ * layers, resized it or froze it, so the next use faults in the
+ * new files.
+ * @notes Must be called with the filter locked exclusively.
+ * @arg filter The filter
+ * @return 0 if unchanged, 1 if refreshed,
+ * -1 if the filter is gone.
+ */
+int bloomf_refresh(bloom_filter *filter) {
+    uint64_t generation = config_generation(filter);
+    if (!generation) return -1;
+    if (generation == filter->generation) return 0;
+
+    // The config is replaced atomically, so it is never partial
+    bloom_filter_config filter_config = filter->filter_config;
+    int legacy;
+    if (read_filter_config(filter->full_path, &filter_config, &legacy)) return -1;
+
+    // Layers are only added or frozen, and the layers we have
+    // mapped keep the keys that were set in them. A quotient
+    // filter is replaced by a new file whenever it is resized.
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (filter_config.frozen != filter->filter_config.frozen ||
+            (sbf && (int)sbf->num_filters != count_data_files(filter)) ||
+            (filter->qf && filter_config.capacity != filter->filter_config.capacity)) {
+        bloomf_close(filter);
+    }
+
+    pthread_mutex_lock(&filter->sbf_lock);
+    filter->filter_config = filter_config;
+    filter->generation = generation;
+    refresh_meta(filter);
+    pthread_mutex_unlock(&filter->sbf_lock);
+    forget_cached_keys(filter);
+    return 1;
+}
+
+/**
+ * Checks if a filter has changed since it was last
+ * flushed, and would be written out by bloomf_flush.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @return 1 if dirty, 0 otherwise.
+ */
+int bloomf_is_dirty(bloom_filter *filter) {
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens) {
+        for (uint32_t i=0; i < gens->num; i++) {
+            if (bloomf_is_dirty(gens->gens[i].filter)) return 1;
+        }
+        return bloomf_size(filter) != filter->filter_config.size ||
+               bloomf_capacity(filter) != filter->filter_config.capacity ||
+               bloomf_byte_size(filter) != filter->filter_config.bytes;
+    }
+
+    // The shard lock excludes a shard growing while it is read
+    bloom_filter_keyshards *ks = filter->keyshards;
+    if (ks) {
+        int dirty = 0;
+        for (uint32_t i=0; i < ks->num && !dirty; i++) {
+            pthread_rwlock_rdlock(&ks->shards[i].lock);
+            dirty = bloomf_is_dirty(ks->shards[i].filter);
+            pthread_rwlock_unlock(&ks->shards[i].lock);
+        }
+        return dirty;
+    }
+    if (!filter->sbf && !filter->qf) return 0;
+
+    // A remove and an add leave the size as it was, so the
+    // changes counted in the shards are checked as well
+    return bloomf_size(filter) != filter->filter_config.size ||
+           filter->filter_config.bytes == 0 ||
+           shard_changes(filter) != __atomic_load_n(&filter->flushed_changes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts the bytes of a filter in pages that changed since
+ * they were last flushed, summed over its layers, so busy
+ * filters can be flushed before their interval is up.
+ * Proxied and in-memory filters have none.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The dirty bytes.
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter) {
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (!gens && !filter->keyshards) return layer_dirty_bytes(filter);
+    uint64_t bytes = 0;
+    uint32_t num = (gens) ? gens->num : filter->keyshards->num;
+    for (uint32_t i=0; i < num; i++) {
+        if (gens) {
+            bytes += layer_dirty_bytes(gens->gens[i].filter);
+        } else {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            lock_shard(s, 0);
+            bytes += layer_dirty_bytes(s->filter);
+            pthread_rwlock_unlock(&s->lock);
+        }
+    }
+    return bytes;
+}
+
+// Adds up the dirty bytes of the layers of a plain filter
+static uint64_t layer_dirty_bytes(bloom_filter *f) {
+    bloom_qf *qf = (bloom_qf*)__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE);
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    if (qf) return bitmap_dirty_bytes(qf->map);
+    if (!sbf) return 0;
+    uint64_t bytes = 0;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        bytes += bitmap_dirty_bytes(sbf->filters[i]->map);
+    }
+    if (sbf->summary) bytes += bitmap_dirty_bytes(sbf->summary);
+    return bytes;
+}
+
+/**
+ * Flushes the filter. Idempotent if the
+ * filter is proxied or not dirty.
+ * @arg filter The filter to close
+ * @return 0 on success.
+ */
+int bloomf_flush(bloom_filter *filter) {
+    return flush_filter(filter, 1);
+}
+
+/**
+ * Writes back the filter like bloomf_flush, without waiting
+ * for its layers to be durable, so many filters can be made
+ * durable with a single sync of the file system afterwards.
+ * The keys of the set log that the write covers are kept
+ * until bloomf_commit.
+ * @arg filter The filter to write
+ * @return 0 on success.
+ */
+int bloomf_write(bloom_filter *filter) {
+    return flush_filter(filter, 0);
+}
+
+/**
+ * Commits a bloomf_write, once the file system holding the
+ * filter was synced. Removes the set log the write covered.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_commit(bloom_filter *filter) {
+    int res = 0;
+    if (filter->gens) {
+        for (uint32_t i=0; i < filter->gens->num; i++)
+            res |= bloomf_commit(filter->gens->gens[i].filter);
+        return res;
+    }
+    if (filter->keyshards) {
+        bloom_filter_keyshards *ks = filter->keyshards;
+        for (uint32_t i=0; i < ks->num; i++) {
+            pthread_rwlock_rdlock(&ks->shards[i].lock);
+            res |= bloomf_commit(ks->shards[i].filter);
+            pthread_rwlock_unlock(&ks->shards[i].lock);
+        }
+        return res;
+    }
+
+    // Only release the log rotated by the write, and not one
+    // rotated by a flush that may still be in progress
+    if (filter->set_log && __atomic_exchange_n(&filter->write_pending, 0, __ATOMIC_ACQ_REL))
+        res = setlog_release(filter->set_log);
+    return res;
+}
+
+/**
+ * Flushes or writes back the filter
+ * @arg sync If 0, does not wait for the layers to be durable,
+ * and keeps the rotated set log for bloomf_commit.
+ */
+static int flush_filter(bloom_filter *filter, int sync) {
+    // Read-only filters are written by another server
+    if (filter->config->read_only) return 0;
+    if (filter->gens) return flush_generations(filter, 0, sync);
+    if (filter->keyshards) return flush_keyshards(filter, 0, sync);
+
+    // Only do things if we are non-proxied
+    if (filter->sbf || filter->qf) {
+        // Time how long this takes
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+
+        // Closes swap the layers out under the flush lock, so they
+        // can not be freed while they are flushed, and tiering is
+        // excluded. The filter may have been closed meanwhile.
+        pthread_mutex_lock(&filter->flush_lock);
+        bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+        bloom_qf *qf = (bloom_qf*)filter->qf;
+        if (!sbf && !qf) {
+            pthread_mutex_unlock(&filter->flush_lock);
+            return 0;
+        }
+
+        // Check the quota again on the next growth, since
+        // the filters sharing it may have shrunk or gone
+        if (sbf && __atomic_load_n(&sbf->capped, __ATOMIC_RELAXED))
+            __atomic_store_n(&sbf->capped, 0, __ATOMIC_RELAXED);
+
+        // If our size has not changed, there is no need to flush
+        if (!bloomf_is_dirty(filter)) {
+            pthread_mutex_unlock(&filter->flush_lock);
+            return 0;
+        }
+
+        // Rotate the set log, so the sets the flush does not
+        // cover are kept. The rotated log can go once it is done.
+        uint64_t changes = shard_changes(filter);
+        int rotated = filter->set_log && !setlog_rotate(filter->set_log);
+        uint64_t new_size = bloomf_size(filter);
+
+        // Store our properties for a future unmap
+        filter->filter_config.size = new_size;
+        filter->filter_config.capacity = bloomf_capacity(filter);
+        filter->filter_config.bytes = bloomf_byte_size(filter);
+        refresh_meta(filter);
+        refresh_fill(filter);
+
+        // Write out filter_config
+        write_filter_config(filter);
+
+        // Flush the filter
+        int res = 0;
+        if (!filter->filter_config.in_memory) {
+            if (qf)
+                res = (sync) ? qf_flush(qf) : bitmap_write(qf->map);
+            else
+                res = (sync) ? sbf_flush(sbf) : sbf_write(sbf);
+        }
+        if (!res) __atomic_store_n(&filter->flushed_changes, changes, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&filter->flush_lock);
+        if (!res && rotated) {
+            if (sync) setlog_release(filter->set_log);
+            else __atomic_store_n(&filter->write_pending, 1, __ATOMIC_RELEASE);
+        }
+
+        // Compute the elapsed time
+        gettimeofday(&end, NULL);
+        syslog(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
+                filter->filter_name, timediff_msec(&start, &end));
+        return res;
+    }
+    return 0;
+}
+
+/**
+ * Creates the next layer of a filter ahead of time, once its
+ * newest layer is nearly full, so a growth only has to rename
+ * the file instead of creating and mapping it with the filter
+ * locked. Does nothing if the layer is not nearly full yet, or
+ * the filter is proxied, in-memory, read-only or rotating.
+ * @note The caller must prevent concurrent growths and closes.
+ * @arg filter The filter
+ * @return 0 on success, -1 if the layer could not be created.
+ */
+int bloomf_prepare_layer(bloom_filter *filter) {
+    if (filter->keyshards) {
+        int res = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            lock_shard(s, 0);
+            res |= bloomf_prepare_layer(s->filter);
+            pthread_rwlock_unlock(&s->lock);
+        }
+        return res;
+    }
+
+    // Generations are bounded by the window, and rarely grow.
+    // In-memory layers are cheap to create on demand.
+    if (filter->gens || filter->filter_config.in_memory ||
+            filter->config->read_only) return 0;
+    if (__atomic_load_n(&filter->spare, __ATOMIC_ACQUIRE)) return 0;
+
+    // Acquire lock, which excludes a concurrent fault
+    pthread_mutex_lock(&filter->sbf_lock);
+    int res = 0;
+    char *spare_path = NULL;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!sbf || !sbf->num_filters || filter->spare) goto LEAVE;
+    if (bf_size(sbf->filters[0]) < SPARE_LAYER_FILL * sbf->capacities[0]) goto LEAVE;
+
+    // Packed layers are appended in place, which is as cheap
+    if (sbf->filters[0]->map->file_refs) goto LEAVE;
+
+    bloom_filter_params params;
+    if (sbf_layer_params(&sbf->params, sbf->num_filters, &params)) goto LEAVE;
+
+    // Remove a spare left behind by a crash, it may not be empty
+    spare_path = join_path(filter->full_path, (char*)SPARE_FILE_NAME);
+    bitmap_unlink(spare_path);
+
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    res = bitmap_from_filename(spare_path, params.bytes, 1, bloomf_bitmap_mode(filter, 0), map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create the next layer of filter '%s'. %s",
+                filter->filter_name, strerror(-res));
+        free(map);
+        bitmap_unlink(spare_path);
+        res = -1;
+        goto LEAVE;
+    }
+    place_layer(filter, map);
+    __atomic_store_n(&filter->spare, map, __ATOMIC_RELEASE);
+    syslog(LOG_INFO, "Created the next layer of filter '%s' ahead of time. Size: %llu",
+            filter->filter_name, (unsigned long long)params.bytes);
+
+LEAVE:
+    free(spare_path);
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return res;
+}
+
+/**
+ * Moves the older layers of a filter out of memory, onto shared
+ * mmaps of their files, keeping only the newest tier_layers in
+ * bloomd's buffers. The layers are written out first, and later
+ * flushes skip them unless they change. Does nothing unless
+ * tier_layers is set, or for filters that are proxied, in-memory,
+ * read-only, rotating, mapped with use_mmap, or using the
+ * counting layout, whose deletes change every layer.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The number of layers moved, or -1 on error.
+ */
+int bloomf_tier_layers(bloom_filter *filter) {
+    if (filter->keyshards) {
+        int moved = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            lock_shard(s, 0);
+            int res = bloomf_tier_layers(s->filter);
+            pthread_rwlock_unlock(&s->lock);
+            if (res < 0) return -1;
+            moved += res;
+        }
+        return moved;
+    }
+    if (filter->gens) return 0;
+
+    // Only the layers past the tier move, and sets only go to the newest
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!sbf || !tiered_layer(filter, sbf->num_filters - 1)) return 0;
+
+    // Exclude flushes, which could write back a page behind the move
+    pthread_mutex_lock(&filter->flush_lock);
+    int moved = 0, res = 0;
+    for (uint32_t i=filter->config->tier_layers; i < sbf->num_filters; i++) {
+        bloom_bitmap *map = sbf->filters[i]->map;
+        if (map->mode != PERSISTENT) continue;
+
+        // Layers on explicit hugepages stay, and snapshotted
+        // layers are moved by a later flush
+        res = bitmap_demote(map);
+        if (res == -EINVAL || res == -EBUSY) {
+            res = 0;
+            continue;
+        } else if (res) {
+            syslog(LOG_ERR, "Failed to move layer %u of filter '%s' out of memory. %s",
+                    i, filter->filter_name, strerror(-res));
+            break;
+        }
+        moved++;
+    }
+    pthread_mutex_unlock(&filter->flush_lock);
+
+    if (moved) {
+        syslog(LOG_INFO, "Moved %d layers of filter '%s' out of memory.",
+                moved, filter->filter_name);
+    }
+    return (res) ? -1 : moved;
+}
+
+/**
+ * Seals the layers of a filter older than its newest, if
+ * seal_layers is set. A sealed layer is written out, mapped
+ * read-only, and no longer tracks its dirty pages, so flushes
+ * skip it. Does nothing for filters that are proxied, in-memory,
+ * read-only, rotating, or using the counting layout.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The number of layers sealed, or -1 on error.
+ */
+int bloomf_seal_layers(bloom_filter *filter) {
+    if (filter->keyshards) {
+        int sealed = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            lock_shard(s, 0);
+            int res = bloomf_seal_layers(s->filter);
+            pthread_rwlock_unlock(&s->lock);
+            if (res < 0) return -1;
+            sealed += res;
+        }
+        return sealed;
+    }
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (filter->gens || !sbf) return 0;
+
+    // Exclude flushes, which scan the dirty pages being freed
+    pthread_mutex_lock(&filter->flush_lock);
+    int sealed = seal_older_layers(filter, sbf);
+    pthread_mutex_unlock(&filter->flush_lock);
+    return sealed;
+}
+
+/**
+ * Verifies the page checksums of the next pages of a filter,
+ * if page_checksums is set. Each call carries on where the
+ * last one stopped, and starts over once every layer was verified.
+ * Pages that do not match are logged and counted. Does nothing
+ * for filters that are proxied, rotating or frozen.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @arg max_pages The most pages to verify
+ * @return The number of pages verified, which is less than
+ * max_pages once the last layer is done, or -1 on error.
+ */
+int64_t bloomf_scrub(bloom_filter *filter, uint64_t max_pages) {
+    if (filter->keyshards) {
+        // The cursor is the shard being verified
+        int64_t verified = 0;
+        while (filter->scrub_page < filter->keyshards->num && (uint64_t)verified < max_pages) {
+            bloom_filter_shard *s = filter->keyshards->shards + filter->scrub_page;
+            lock_shard(s, 0);
+            uint64_t budget = max_pages - verified;
+            int64_t res = bloomf_scrub(s->filter, budget);
+            pthread_rwlock_unlock(&s->lock);
+            if (res < 0) return -1;
+            verified += res;
+            if ((uint64_t)res < budget) filter->scrub_page++;
+        }
+        if (filter->scrub_page >= filter->keyshards->num) filter->scrub_page = 0;
+        return verified;
+    }
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!filter->config->page_checksums || filter->gens || !sbf) return 0;
+
+    // Exclude flushes, which update the checksums
+    uint64_t bad_pages = 0;
+    pthread_mutex_lock(&filter->flush_lock);
+    int64_t verified = scrub_layers(filter, sbf, max_pages, &bad_pages);
+    pthread_mutex_unlock(&filter->flush_lock);
+
+    if (bad_pages) {
+        pthread_mutex_lock(&filter->sbf_lock);
+        filter->counters.checksum_errors += bad_pages;
+        pthread_mutex_unlock(&filter->sbf_lock);
+    }
+    return verified;
+}
+
+/**
+ * Verifies the next pages of the layers of a filter. The
+ * cursor counts pages over the layers, oldest first.
+ * @note The caller must prevent flushes of the layers.
+ * @arg bad_pages Output, the number of pages that do not match
+ * @return The number of pages verified.
+ */
+static int64_t scrub_layers(bloom_filter *f, bloom_sbf *sbf, uint64_t max_pages, uint64_t *bad_pages) {
+    uint64_t base = 0, verified = 0;
+    for (uint32_t i=0; i < sbf->num_filters && verified < max_pages; i++) {
+        bloom_bitmap *map = sbf->filters[i]->map;
+        uint64_t pages = (map->size + 4095) / 4096;
+        if (f->scrub_page >= base + pages) {
+            base += pages;
+            continue;
+        }
+
+        // Layers without checksums, such as packed ones, are skipped
+        uint64_t bad = 0;
+        int64_t res = bitmap_verify(map, f->scrub_page - base, max_pages - verified, &bad);
+        if (res == -EINVAL) res = pages - (f->scrub_page - base);
+        if (bad) {
+            syslog(LOG_ERR, "Found %llu pages that do not match their checksums in layer %u of filter '%s'!",
+                    (unsigned long long)bad, i, f->filter_name);
+            *bad_pages += bad;
+        }
+        f->scrub_page += res;
+        verified += res;
+        base += pages;
+    }
+
+    // Start over after the last layer
+    if (verified < max_pages) f->scrub_page = 0;
+    return verified;
+}
+
+/**
+ * Seals the layers older than the newest, which sets
+ * no longer change, if the filter seals its layers.
+ * @note The caller must prevent flushes of the layers.
+ * @return The number of layers sealed, or -1 on error.
+ */
+static int seal_older_layers(bloom_filter *f, bloom_sbf *sbf) {
+    if (!f->config->seal_layers || f->config->read_only || f->filter_config.in_memory ||
+            f->filter_config.layout == BLOOM_LAYOUT_COUNTING ||
+            f->filter_config.layout == BLOOM_LAYOUT_AGING) return 0;
+
+    int sealed = 0;
+    for (uint32_t i=1; i < sbf->num_filters; i++) {
+        bloom_bitmap *map = sbf->filters[i]->map;
+        if (map->sealed) continue;
+
+        // Snapshotted layers are sealed by a later flush
+        int res = bitmap_seal(map);
+        if (res == -EINVAL || res == -EBUSY) {
+            continue;
+        } else if (res) {
+            syslog(LOG_ERR, "Failed to seal layer %u of filter '%s'. %s",
+                    i, f->filter_name, strerror(-res));
+            return -1;
+        }
+        sealed++;
+    }
+    return sealed;
+}
+
+/**
+ * Gracefully closes a bloom filter.
+ * @arg filter The filter to close
+ * @return 0 on success.
+ */
+int bloomf_close(bloom_filter *filter) {
+    if (filter->gens) {
+        for (uint32_t i=0; i < filter->gens->num; i++) {
+            bloomf_close(filter->gens->gens[i].filter);
+        }
+        flush_generations(filter, 0, 1);
+        return 0;
+    }
+    if (filter->keyshards) {
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloomf_close(filter->keyshards->shards[i].filter);
+        }
+        flush_keyshards(filter, 0, 1);
+        return 0;
+    }
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->sbf_lock);
+
+    // Only act if we are non-proxied
+    if (filter->sbf) {
+        bloomf_flush(filter);
+
+        // Wait for a flush that is using the layers
+        pthread_mutex_lock(&filter->flush_lock);
+        bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+        filter->sbf = NULL;
+        pthread_mutex_unlock(&filter->flush_lock);
+
+        sbf_close(sbf);
+        free(sbf);
+
+        filter->counters.page_outs += 1;
+    }
+    discard_spare_layer(filter);
+
+    // Quotient filters are flushed like the layers
+    if (filter->qf) {
+        bloomf_flush(filter);
+        pthread_mutex_lock(&filter->flush_lock);
+        bloom_qf *qf = (bloom_qf*)filter->qf;
+        filter->qf = NULL;
+        pthread_mutex_unlock(&filter->flush_lock);
+        close_quotient_filter(qf);
+        filter->counters.page_outs += 1;
+    }
+
+    // Frozen filters are never dirty, there is nothing to flush
+    if (filter->frozen) {
+        bloom_xorfilter *xf = (bloom_xorfilter*)filter->frozen;
+        filter->frozen = NULL;
+
+        bloom_bitmap *map = xf->map;
+        xf_close(xf);
+        free(map);
+        free(xf);
+
+        filter->counters.page_outs += 1;
+    }
+
+    // The metadata is now read from the filter config
+    refresh_meta(filter);
+
+    // Release lock
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return 0;
+}
+
+/**
+ * Detaches the layers of a filter, so that they can be
+ * unmapped by bloomf_unmap_detached without the filter locked.
+ * The layers are flushed first, so a fault that follows loads
+ * every key from the files. Rotating, sharded, frozen and
+ * quotient filters are closed in place.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return The detached layers, or NULL if there are none.
+ */
+bloom_sbf* bloomf_detach(bloom_filter *filter) {
+    if (filter->gens || filter->keyshards || filter->filter_config.frozen ||
+            filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        bloomf_close(filter);
+        return NULL;
+    }
+
+    // Acquire lock, which excludes a concurrent fault
+    pthread_mutex_lock(&filter->sbf_lock);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (sbf) {
+        bloomf_flush(filter);
+
+        // The detached layers are closed once we return,
+        // so wait for a flush that is using them
+        pthread_mutex_lock(&filter->flush_lock);
+        __atomic_store_n(&filter->sbf, NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&filter->flush_lock);
+        filter->counters.page_outs += 1;
+    }
+    discard_spare_layer(filter);
+
+    // The metadata is now read from the filter config
+    refresh_meta(filter);
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return sbf;
+}
+
+/**
+ * Unmaps the layers detached by bloomf_detach. They were
+ * flushed when detached, so only the maps and files are closed.
+ * @note Thread safe, the filter may be faulted in again meanwhile.
+ * @arg sbf The detached layers, may be NULL
+ */
+void bloomf_unmap_detached(bloom_sbf *sbf) {
+    if (!sbf) return;
+    sbf_close(sbf);
+    free(sbf);
+}
+
+/**
+ * Compresses the layers of a closed filter, to reduce
+ * the disk space of cold filters. The layers are expanded
+ * again when the filter is next faulted in. Does nothing
+ * if the filter is not proxied or is in-memory.
+ * @arg filter The filter to compress
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_compress(bloom_filter *filter) {
+    // The fingerprints of frozen and quotient filters are random, and do
+    // not compress. Read-only filters must leave the files of the writer alone.
+    if (filter->filter_config.in_memory || filter->filter_config.frozen ||
+            filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT ||
+            filter->config->read_only) return 0;
+    if (filter->gens) {
+        int res = 0;
+        for (uint32_t i=0; i < filter->gens->num; i++) {
+            res |= bloomf_compress(filter->gens->gens[i].filter);
+        }
+        return res;
+    }
+    if (filter->keyshards) {
+        int res = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            res |= bloomf_compress(filter->keyshards->shards[i].filter);
+        }
+        return res;
+    }
+
+    // Acquire lock, which excludes a concurrent fault
+    pthread_mutex_lock(&filter->sbf_lock);
+    int res = 0;
+    if (filter->sbf) goto LEAVE;
+
+    struct dirent **namelist;
+    int num = scandir(filter->full_path, &namelist, filter_layer_files, alphasort);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+                filter->filter_name, strerror(errno));
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Compress each layer, then remove the original
+    uint64_t before = 0, after = 0;
+    for (int i=0; i < num; i++) {
+        if (!res) {
+            char *cmp_name = compressed_name(namelist[i]->d_name);
+            char *data_path = join_path(filter->full_path, namelist[i]->d_name);
+            char *cmp_path = join_path(filter->full_path, cmp_name);
+            int err = bitmap_compress_file(data_path, cmp_path);
+            if (err) {
+                syslog(LOG_ERR, "Failed to compress %s. %s", data_path, strerror(-err));
+                res = -1;
+            } else {
+                before += get_size(data_path);
+                after += get_size(cmp_path);
+                bitmap_unlink(data_path);
+            }
+            free(cmp_name);
+            free(data_path);
+            free(cmp_path);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    if (num) {
+        sync_filter_dir(filter);
+        syslog(LOG_INFO, "Compressed filter '%s' from %llu to %llu bytes.",
+                filter->filter_name, (unsigned long long)before, (unsigned long long)after);
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return res;
+}
+
+/**
+ * Deletes the bloom filter with
+ * extreme prejudice.
+ * @arg filter The filter to delete
+ * @return 0 on success.
+ */
+int bloomf_delete(bloom_filter *filter) {
+    // Close first
+    bloomf_close(filter);
+    if (filter->set_log) {
+        setlog_close(filter->set_log);
+        filter->set_log = NULL;
+    }
+
+    // Delete the staged keys
+    if (filter->staged) {
+        setlog_close(filter->staged);
+        filter->staged = NULL;
+    }
+    char *staged_path = join_path(filter->full_path, (char*)STAGED_FOLDER_NAME);
+    delete_flat_dir(staged_path);
+    free(staged_path);
+
+    // The snapshot of an in-memory filter is its data, and
+    // must not be restored into a filter of the same name
+    if (filter->filter_config.in_memory && !filter->config->read_only) {
+        char *snap_path = snapshot_path(filter, "");
+        delete_flat_dir(snap_path);
+        free(snap_path);
+    }
+
+    // Delete the generation directories
+    for (uint32_t i=0; filter->gens && i < filter->gens->num; i++) {
+        bloomf_delete(filter->gens->gens[i].filter);
+    }
+
+    // Delete the shard directories
+    for (uint32_t i=0; filter->keyshards && i < filter->keyshards->num; i++) {
+        bloomf_delete(filter->keyshards->shards[i].filter);
+    }
+
+    // Delete the files
+    struct dirent **namelist = NULL;
+    int num;
+
+    // Filter only data dirs, in sorted order
+    num = scandir(filter->full_path, &namelist, filter_out_special, NULL);
+    syslog(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) {
+        char *file_path = join_path(filter->full_path, namelist[i]->d_name);
+        syslog(LOG_INFO, "Deleting: %s.", file_path);
+        if (unlink(file_path)) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
+        }
+        free(file_path);
+    }
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) {
+        free(namelist[i]);
+    }
+    if (namelist)
+        free(namelist);
+
+    // Delete the directory
+    if (remove_filter_folder(filter->full_path)) {
+        syslog(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
+    }
+
+    return 0;
+}
+
+/**
+ * Starts a snapshot of the filter, faulting it in if
+ * needed. The snapshot is written to a directory named
+ * like the filter directory, under "snapshots" in the data_dir.
+ * @note The caller must prevent concurrent sets and closes.
+ * @arg filter The filter
+ * @arg snap Output, the snapshot state
+ * @return 0 on success.
+ */
+int bloomf_snapshot_begin(bloom_filter *filter, bloom_filter_snapshot **snap) {
+    if (filter->gens) {
+        syslog(LOG_ERR, "Cannot snapshot rotating filter '%s'.", filter->filter_name);
+        return -1;
+    }
+    if (filter->filter_config.frozen) {
+        syslog(LOG_ERR, "Cannot snapshot frozen filter '%s'.", filter->filter_name);
+        return -1;
+    }
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        syslog(LOG_ERR, "Cannot snapshot quotient filter '%s'.", filter->filter_name);
+        return -1;
+    }
+
+    // Make sure we are faulted in
+    if (!filter->sbf && thread_safe_fault(filter) != 0) return -1;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+
+    // Start from an empty directory
+    char *snap_dir = join_path(filter->config->data_dir, (char*)SNAPSHOT_FOLDER_NAME);
+    int res = mkdir(snap_dir, 0755);
+    free(snap_dir);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create snapshot directory for '%s'. %s",
+                filter->filter_name, strerror(errno));
+        return -1;
+    }
+    char *path = snapshot_path(filter, SNAPSHOT_TMP_SUFFIX);
+    delete_flat_dir(path);
+    if (mkdir(path, 0755)) {
+        syslog(LOG_ERR, "Failed to create snapshot directory '%s'. %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    // Track each layer, oldest first to match the data file names
+    bloom_filter_snapshot *s = *snap = calloc(1, sizeof(bloom_filter_snapshot));
+    s->path = path;
+    s->size = sbf_size(sbf);
+    s->maps = calloc(sbf->num_filters, sizeof(bloom_bitmap*));
+    s->fds = calloc(sbf->num_filters, sizeof(int));
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        bloom_bitmap *map = sbf->filters[sbf->num_filters - i - 1]->map;
+        s->fds[i] = open_snapshot_layer(path, i, map->size);
+        if (s->fds[i] < 0 || bitmap_snapshot_begin(map)) {
+            if (s->fds[i] >= 0) close(s->fds[i]);
+            bloomf_snapshot_finish(filter, s, 0);
+            return -1;
+        }
+        s->maps[i] = map;
+        s->num_layers++;
+    }
+    syslog(LOG_INFO, "Started snapshot of filter '%s'. Layers: %d.",
+            filter->filter_name, s->num_layers);
+    return 0;
+}
+
+/**
+ * Copies the layers of a started snapshot. This is the bulk of
+ * the work, and can run concurrently with checks and sets. The
+ * caller must still prevent the filter from being closed.
+ * @arg filter The filter
+ * @arg snap The snapshot state
+ * @return 0 on success.
+ */
+int bloomf_snapshot_copy(bloom_filter *filter, bloom_filter_snapshot *snap) {
+    int res, runs = 0;
+    for (uint32_t i=0; i < snap->num_layers; i++) {
+        res = bitmap_snapshot_copy(snap->maps[i], snap->fds[i], 1);
+        if (res < 0) goto ERR;
+    }
+
+    // Catch up on the pages that were changed while copying,
+    // so the final copy under the lock has little to do
+    for (int round=0; round < SNAPSHOT_ROUNDS; round++) {
+        runs = 0;
+        for (uint32_t i=0; i < snap->num_layers; i++) {
+            res = bitmap_snapshot_copy(snap->maps[i], snap->fds[i], 0);
+            if (res < 0) goto ERR;
+            runs += res;
+        }
+        if (runs < SNAPSHOT_SETTLE_RUNS) break;
+    }
+    return 0;
+
+ERR:
+    syslog(LOG_ERR, "Failed to copy snapshot of filter '%s'. Err: %d", filter->filter_name, res);
+    return -1;
+}
+
+/**
+ * Finishes a snapshot. If committing, the pages that changed
+ * during the copy and any new layers are copied, and the
+ * snapshot replaces the previous one. The snapshot state is freed.
+ * @note The caller must prevent concurrent sets and closes.
+ * @arg filter The filter
+ * @arg snap The snapshot state
+ * @arg commit If 0, the snapshot is abandoned
+ * @return 0 on success.
+ */
+int bloomf_snapshot_finish(bloom_filter *filter, bloom_filter_snapshot *snap, int commit) {
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    int res = 0;
+
+    // Bring the tracked layers up to date
+    for (uint32_t i=0; i < snap->num_layers && commit && !res; i++) {
+        if (bitmap_snapshot_copy(snap->maps[i], snap->fds[i], 0) < 0) res = -1;
+    }
+
+    // Copy the layers added since the start in full
+    for (uint32_t i=snap->num_layers; commit && !res && i < sbf->num_filters; i++) {
+        bloom_bitmap *map = sbf->filters[sbf->num_filters - i - 1]->map;
+        int fd = open_snapshot_layer(snap->path, i, map->size);
+        if (fd < 0 || bitmap_snapshot_begin(map) || bitmap_snapshot_copy(map, fd, 1) < 0) res = -1;
+        bitmap_snapshot_end(map);
+        if (fd >= 0) {
+            if (fsync(fd)) res = -1;
+            close(fd);
+        }
+    }
+
+    // Stop tracking, and make the copies durable
+    for (uint32_t i=0; i < snap->num_layers; i++) {
+        bitmap_snapshot_end(snap->maps[i]);
+        if (commit && !res && fsync(snap->fds[i])) res = -1;
+        close(snap->fds[i]);
+    }
+
+    // Write out the filter config as of now, and an
+    // INI copy of it for the tools reading snapshots
+    if (commit && !res) {
+        bloom_filter_config config = filter->filter_config;
+        config.size = bloomf_size(filter);
+        config.capacity = bloomf_capacity(filter);
+        config.bytes = bloomf_byte_size(filter);
+        char *config_name = join_path(snap->path, (char*)META_FILENAME);
+        res = update_binary_from_filter_config(config_name, &config);
+        free(config_name);
+        config_name = join_path(snap->path, (char*)CONFIG_FILENAME);
+        if (!res) res = update_filename_from_filter_config(config_name, &config);
+        free(config_name);
+    }
+
+    // Replace the previous snapshot
+    if (commit && !res) {
+        char *final_path = snapshot_path(filter, "");
+        char *old_path = snapshot_path(filter, SNAPSHOT_OLD_SUFFIX);
+        delete_flat_dir(old_path);
+        if (rename(final_path, old_path) && errno != ENOENT) res = -1;
+        if (!res && rename(snap->path, final_path)) res = -1;
+        if (!res) delete_flat_dir(old_path);
+        free(final_path);
+        free(old_path);
+    }
+
+    if (commit && res) {
+        syslog(LOG_ERR, "Failed to finish snapshot of filter '%s'. %s",
+                filter->filter_name, strerror(errno));
+    } else if (commit) {
+        __atomic_store_n(&filter->snapshot_size, snap->size, __ATOMIC_RELAXED);
+        syslog(LOG_INFO, "Finished snapshot of filter '%s'. Layers: %d.",
+                filter->filter_name, sbf->num_filters);
+    }
+
+    // Remove any partial snapshot
+    if (!commit || res) delete_flat_dir(snap->path);
+    free(snap->path);
+    free(snap->maps);
+    free(snap->fds);
+    free(snap);
+    return res;
+}
+
+
+/**
+ * Returns the directory the committed snapshot of a filter
+ * is in, the same as in the data_dir of a filter folder.
+ * @arg filter The filter
+ * @return The path, to be freed by the caller.
+ */
+char* bloomf_snapshot_path(bloom_filter *filter) {
+    return snapshot_path(filter, "");
+}
+
+
+/**
+ * Freezes a freezable filter. The staged keys are built into
+ * an xor filter, which replaces the SBF and the staged keys.
+ * A frozen filter can be checked, but no longer set.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EINVAL if the filter is not freezable,
+ * -EEXIST if it is already frozen, -1 on error.
+ */
+int bloomf_freeze(bloom_filter *filter) {
+    if (filter->filter_config.frozen) return -EEXIST;
+    if (!filter->filter_config.freezable || !filter->staged) return -EINVAL;
+
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Build the xor filter next to the SBF, which stays
+    // in use until the frozen filter is durable
+    uint64_t num_keys, bytes;
+    if (build_frozen_file(filter, &num_keys, &bytes)) return -1;
+
+    // Switch over by committing the filter config. The SBF is
+    // closed first, so a flush can not write the config back.
+    bloomf_close(filter);
+    filter->filter_config.frozen = 1;
+    filter->filter_config.size = num_keys;
+    filter->filter_config.capacity = num_keys;
+    filter->filter_config.bytes = bytes;
+    if (write_filter_config(filter)) {
+        filter->filter_config.frozen = 0;
+        return -1;
+    }
+
+    // The SBF, its set log and the staged keys are no longer needed
+    if (filter->set_log) {
+        unlink(filter->set_log->path);
+        unlink(filter->set_log->old_path);
+        setlog_close(filter->set_log);
+        filter->set_log = NULL;
+    }
+    setlog_close(filter->staged);
+    filter->staged = NULL;
+    char *staged_path = join_path(filter->full_path, (char*)STAGED_FOLDER_NAME);
+    delete_flat_dir(staged_path);
+    free(staged_path);
+    delete_sbf_files(filter);
+    sync_filter_dir(filter);
+    refresh_meta(filter);
+    forget_cached_keys(filter);
+
+    gettimeofday(&end, NULL);
+    syslog(LOG_INFO, "Froze filter '%s'. Keys: %llu. Bytes: %llu. Total time: %d msec.",
+            filter->filter_name, (unsigned long long)num_keys,
+            (unsigned long long)bytes, timediff_msec(&start, &end));
+    return 0;
+}
+
+/**
+ * Compacts the SBF of a freezable filter into a single layer.
+ * The staged keys are replayed into a new layer, sized for
+ * the capacity of all the current layers, which replaces them.
+ * Checks then probe one layer, and the filter can still be set.
+ * The filter is left proxied.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EINVAL if the filter is not freezable,
+ * -EEXIST if it is frozen, -1 on error.
+ */
+int bloomf_compact(bloom_filter *filter) {
+    if (filter->filter_config.frozen) return -EEXIST;
+    if (!filter->filter_config.freezable || !filter->staged) return -EINVAL;
+
+    // Fault in to expand any compressed layers
+    bloom_sbf *sbf = faulted_sbf(filter);
+    if (!sbf) return -1;
+    uint32_t num_layers = sbf->num_filters;
+    if (num_layers <= 1) return 0;
+
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // The new layer is the first layer of an SBF with the
+    // capacity of all the layers, so it keeps the same headroom
+    // and later layers keep bounding the false positive rate
+    bloom_sbf_params params;
+    filter_sbf_params(filter, &params);
+    params.initial_capacity = sbf_total_capacity(sbf);
+    params.format.sparse = 0;  // It is filled at once, and never young
+    bloom_filter_params layer;
+    if (sbf_layer_params(&params, 0, &layer)) return -1;
+
+    uint64_t num_keys;
+    if (build_compact_file(filter, &params, &layer, &num_keys)) return -1;
+    bloomf_close(filter);
+
+    if (replace_layers(filter, COMPACT_TMP_NAME, num_layers)) return -1;
+
+    // Later layers are sized from the new initial capacity
+    filter->filter_config.initial_capacity = params.initial_capacity;
+    filter->filter_config.capacity = params.initial_capacity;
+    filter->filter_config.size = num_keys;
+    filter->filter_config.bytes = layer.bytes;
+    refresh_meta(filter);
+    forget_cached_keys(filter);
+    if (write_filter_config(filter)) return -1;
+
+    gettimeofday(&end, NULL);
+    syslog(LOG_INFO, "Compacted filter '%s' from %u layers. Keys: %llu. Bytes: %llu. Total time: %d msec.",
+            filter->filter_name, num_layers, (unsigned long long)num_keys,
+            (unsigned long long)layer.bytes, timediff_msec(&start, &end));
+    return 0;
+}
+
+/**
+ * Shrinks a filter that was created far larger than the keys it
+ * holds, by folding its layer onto itself, see bf_fold. The layer
+ * is halved as long as it keeps room for as many keys again, and
+ * the filter is sized as if it had been created for the folded
+ * capacity, so it keeps the same false positive rate at capacity.
+ * A filter that grew more layers is left alone, since only its
+ * newest layer is not full. Keyshards are shrunk one at a time.
+ * The filter is left proxied if it was shrunk.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg folds Output, the number of times the layer was halved
+ * @return 0 on success, -EEXIST if the filter is frozen,
+ * -EINVAL if it rotates, -EROFS if it is in-memory, -ENOTSUP if
+ * its layout can not be folded, -1 on error.
+ */
+int bloomf_shrink(bloom_filter *filter, uint32_t *folds) {
+    *folds = 0;
+    if (filter->filter_config.frozen) return -EEXIST;
+    if (filter->gens) return -EINVAL;
+    if (filter->filter_config.in_memory) return -EROFS;
+    if (filter->filter_config.layout != BLOOM_LAYOUT_PARTITIONED &&
+            filter->filter_config.layout != BLOOM_LAYOUT_BLOCKED) return -ENOTSUP;
+    if (filter->keyshards) {
+        int res = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            uint32_t shard_folds;
+            lock_shard(s, 1);
+            res |= bloomf_shrink(s->filter, &shard_folds);
+            pthread_rwlock_unlock(&s->lock);
+            if (shard_folds > *folds) *folds = shard_folds;
+        }
+        refresh_meta(filter);
+        forget_cached_keys(filter);
+        return (res) ? -1 : 0;
+    }
+
+    // Fault in to expand any compressed layers
+    bloom_sbf *sbf = faulted_sbf(filter);
+    if (!sbf) return -1;
+    uint32_t num_folds = shrink_folds(sbf);
+    if (!num_folds) return 0;
+
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    uint64_t capacity = sbf->capacities[0], bytes;
+    if (build_shrink_file(filter, sbf->filters[0], num_folds, &bytes)) return -1;
+    bloomf_close(filter);
+    if (replace_layers(filter, SHRINK_TMP_NAME, 1)) return -1;
+
+    // Later layers are sized from the folded capacity
+    filter->filter_config.initial_capacity = capacity >> num_folds;
+    filter->filter_config.capacity = filter->filter_config.initial_capacity;
+    filter->filter_config.bytes = bytes;
+    refresh_meta(filter);
+    forget_cached_keys(filter);
+    if (write_filter_config(filter)) return -1;
+
+    gettimeofday(&end, NULL);
+    syslog(LOG_INFO, "Shrunk filter '%s' by %u folds. Capacity: %llu. Bytes: %llu. Total time: %d msec.",
+            filter->filter_name, num_folds, (unsigned long long)filter->filter_config.capacity,
+            (unsigned long long)bytes, timediff_msec(&start, &end));
+    *folds = num_folds;
+    return 0;
+}
+
+/**
+ * Empties a filter in place, for filters that are rotated by
+ * hand. The layers are deleted without being flushed, and the
+ * filter starts over with one empty layer, which is sparse on
+ * disk, so a reset takes the same time however large the filter
+ * grew. The set log and the staged keys are emptied too, so the
+ * old keys are not replayed. A proxied filter stays proxied.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EEXIST if the filter is frozen,
+ * -EINVAL if it rotates, -1 on error.
+ */
+int bloomf_reset(bloom_filter *filter) {
+    if (filter->filter_config.frozen) return -EEXIST;
+    if (filter->gens) return -EINVAL;
+    if (filter->keyshards) {
+        int res = 0;
+        for (uint32_t i=0; i < filter->keyshards->num; i++) {
+            bloom_filter_shard *s = filter->keyshards->shards + i;
+            lock_shard(s, 1);
+            res |= bloomf_reset(s->filter);
+            pthread_rwlock_unlock(&s->lock);
+        }
+        flush_keyshards(filter, 1, 1);
+        forget_cached_keys(filter);
+        return (res) ? -1 : 0;
+    }
+
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Acquire lock, which excludes a concurrent fault
+    pthread_mutex_lock(&filter->sbf_lock);
+    bloom_sbf *old = (bloom_sbf*)filter->sbf;
+    filter->sbf = NULL;
+    bloom_qf *old_qf = (bloom_qf*)filter->qf;
+    filter->qf = NULL;
+    discard_spare_layer(filter);
+
+    // Unlink the layers before unmapping them, so their
+    // dirty pages are dropped rather than written back. An
+    // in-memory filter is not restored from its snapshot.
+    if (!filter->filter_config.in_memory) {
+        delete_sbf_files(filter);
+        char *qf_path = join_path(filter->full_path, (char*)QUOTIENT_FILE_NAME);
+        unlink(qf_path);
+        free(qf_path);
+        sync_filter_dir(filter);
+    } else {
+        char *snap_path = snapshot_path(filter, "");
+        delete_flat_dir(snap_path);
+        free(snap_path);
+        filter->snapshot_size = 0;
+    }
+    if (old) {
+        sbf_discard(old);
+        free(old);
+        filter->counters.page_outs += 1;
+    }
+    if (old_qf) {
+        bitmap_discard(old_qf->map);
+        free(old_qf->map);
+        free(old_qf);
+        filter->counters.page_outs += 1;
+    }
+    if (filter->set_log) setlog_truncate(filter->set_log);
+    if (filter->staged) setlog_truncate(filter->staged);
+
+    // A faulted filter gets its new layer right away
+    filter->filter_config.size = 0;
+    filter->filter_config.capacity = filter->filter_config.initial_capacity;
+    filter->filter_config.bytes = 0;
+    int res = 0;
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        if (old_qf || filter->filter_config.in_memory) res = load_quotient_filter(filter);
+        if (!res && filter->qf) filter->filter_config.bytes = bloomf_byte_size(filter);
+    } else if (old || filter->filter_config.in_memory) {
+        res = create_sbf(filter, 0, NULL);
+        bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+        if (!res) filter->filter_config.bytes = sbf_total_byte_size(sbf);
+    }
+    if (!res && !filter->filter_config.in_memory) res = write_filter_config(filter);
+    refresh_meta(filter);
+    refresh_fill(filter);
+    pthread_mutex_unlock(&filter->sbf_lock);
+    forget_cached_keys(filter);
+
+    gettimeofday(&end, NULL);
+    if (res) {
+        syslog(LOG_ERR, "Failed to reset filter '%s'.", filter->filter_name);
+        return -1;
+    }
+    syslog(LOG_INFO, "Reset filter '%s'. Total time: %d msec.",
+            filter->filter_name, timediff_msec(&start, &end));
+    return 0;
+}
+
+/**
+ * Merges the layers of another filter into this one, so it
+ * has the keys of either for a union, or of both for an
+ * intersection. The filters must be created with the same
+ * capacity, probability, layout and hash scheme, and not be
+ * counting, rotating, sharded or frozen. Intersections are only
+ * exact for filters of one layer, so others are rejected. Quotient
+ * filters are merged exactly, into a new filter that replaces this one.
+ * @note The caller must hold the filter exclusively, and
+ * prevent changes to the other filter.
+ * @arg filter The filter to merge into
+ * @arg other The filter to merge
+ * @arg intersect 1 to intersect, 0 for a union
+ * @return 0 on success, -EINVAL if the filters can not be
+ * merged, -1 on error.
+ */
+int bloomf_merge(bloom_filter *filter, bloom_filter *other, int intersect) {
+    // Only a plain SBF has layers to merge
+    if (filter->gens || filter->keyshards || filter->filter_config.frozen ||
+            other->gens || other->keyshards || other->filter_config.frozen) {
+        return -EINVAL;
+    }
+
+    // Quotient filters are merged into a new filter in one pass
+    int quotient = (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT);
+    if (quotient != (other->filter_config.layout == BLOOM_LAYOUT_QUOTIENT)) return -EINVAL;
+    if (quotient) {
+        bloom_qf *qf = faulted_qf(filter);
+        bloom_qf *other_qf = faulted_qf(other);
+        if (!qf || !other_qf) return -1;
+        bloom_qf *merged;
+        int res = replace_quotient_filter(filter, qf, other_qf, intersect, &merged);
+        if (res == -EINVAL) return -EINVAL;
+        if (res) {
+            syslog(LOG_ERR, "Failed to merge filter '%s' into '%s'!", other->filter_name, filter->filter_name);
+            return -1;
+        }
+        publish_quotient_filter(filter, merged);
+        if (intersect) forget_cached_keys(filter);
+        refresh_meta(filter);
+        return 0;
+    }
+
+    bloom_sbf *sbf = faulted_sbf(filter);
+    bloom_sbf *other_sbf = faulted_sbf(other);
+    if (!sbf || !other_sbf) return -1;
+
+    // The merge changes every layer, they are sealed again once flushed
+    pthread_mutex_lock(&filter->flush_lock);
+    int res = 0;
+    for (uint32_t i=0; i < sbf->num_filters && !res; i++) {
+        res = bitmap_unseal(sbf->filters[i]->map);
+    }
+    pthread_mutex_unlock(&filter->flush_lock);
+    if (res) {
+        syslog(LOG_ERR, "Failed to unseal filter '%s' to merge into it!", filter->filter_name);
+        return -1;
+    }
+
+    res = sbf_merge(sbf, other_sbf, intersect);
+    if (intersect && res != -EINVAL) forget_cached_keys(filter);
+    if (res == -EINVAL) return -EINVAL;
+    if (res) {
+        syslog(LOG_ERR, "Failed to merge filter '%s' into '%s'!", other->filter_name, filter->filter_name);
+        return -1;
+    }
+    refresh_meta(filter);
+    refresh_fill(filter);
+    return 0;
+}
+
+/**
+ * Starts stamping the pages that change in the layers of a filter
+ * with the generation of a clock, see bitmap_track_changes. The
+ * layers are tracked as they are loaded or created. Only plain
+ * filters whose layers are changed by setting bits are tracked,
+ * so rotating, sharded, freezable, counting, aging, quotient and
+ * summarized filters are not.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg clock The current generation, which must outlive the filter
+ * @return 0 on success, -EINVAL if the filter can not be tracked.
+ */
+int bloomf_track_changes(bloom_filter *filter, uint32_t *clock) {
+    if (!changes_trackable(filter)) return -EINVAL;
+    filter->sync_clock = clock;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    for (uint32_t i=0; sbf && i < sbf->num_filters; i++) {
+        if (bitmap_track_changes(sbf->filters[i]->map, clock)) return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Copies the runs of pages of a filter that changed in a generation
+ * of its clock or later, see bloomf_track_changes. The layers are
+ * walked oldest first, from a cursor counting their pages, so the
+ * copy can be made over several calls. Every call copies the layers
+ * that existed on the first one, and the pages may change while
+ * they are copied.
+ * @note The caller must prevent the filter from growing or
+ * being closed during the call.
+ * @arg filter The filter
+ * @arg gen The generation
+ * @arg cursor In/out, the next page to copy, 0 on the first call
+ * @arg num_layers In/out, the layers copied, 0 on the first call
+ * @arg max_run The most bytes given to the callback at once
+ * @arg cb The callback, invoked with data
+ * @return 1 if the callback stopped the copy, 0 once the pages are
+ * copied, -EINVAL if the filter is not tracked, or -ENOENT if it is
+ * not in memory, or a layer was not tracked before the generation.
+ */
+int bloomf_changed_pages(bloom_filter *filter, uint32_t gen, uint64_t *cursor, uint32_t *num_layers,
+        uint64_t max_run, bloom_pages_cb cb, void *data) {
+    if (!filter->sync_clock) return -EINVAL;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!sbf) return -ENOENT;
+    if (!*num_layers) *num_layers = sbf->num_filters;
+    if (*num_layers > sbf->num_filters) return -ENOENT;
+
+    uint64_t base = 0;
+    for (uint32_t i=0; i < *num_layers; i++) {
+        // A layer made since the generation may be missing in the copy,
+        // and the bits of a sparse layer are not where they will be
+        bloom_bloomfilter *layer = sbf->filters[sbf->num_filters - 1 - i];
+        bloom_bitmap *map = layer->map;
+        if (!map->page_gens || map->gen_start >= gen || bf_is_sparse(layer)) return -ENOENT;
+
+        uint64_t pages = (map->size + 4095) / 4096;
+        for (uint64_t page=*cursor - base; *cursor < base + pages; page=*cursor - base) {
+            if (!bitmap_page_changed(map, page, gen)) {
+                (*cursor)++;
+                continue;
+            }
+
+            // Copy the run of changed pages at once
+            uint64_t end = page + 1;
+            while (end < pages && (end - page) * 4096 < max_run && bitmap_page_changed(map, end, gen)) end++;
+            uint64_t offset = page * 4096;
+            uint64_t len = ((end * 4096 < map->size) ? end * 4096 : map->size) - offset;
+            if (cb(data, i, map->size, offset, map->mmap + offset, len)) return 1;
+            *cursor = base + end;
+        }
+        base += pages;
+    }
+    return 0;
+}
+
+/**
+ * Merges the pages of a copy of the filter, as given by
+ * bloomf_changed_pages, into the same layer of the filter,
+ * see sbf_merge_bytes. The filter is faulted in if needed.
+ * @note The caller must hold the filter exclusively.
+ * @arg filter The filter to merge into
+ * @arg num_layers The number of layers of the copy
+ * @arg layer The layer of the pages, counted from the oldest
+ * @arg layer_bytes The size of the layer in the copy
+ * @arg offset The offset of the pages in the layer
+ * @arg bytes The pages
+ * @arg len The length of the pages
+ * @return 0 on success, -EINVAL if the layers differ from the
+ * copy, or the filter is not one that can be tracked, -1 on error.
+ */
+int bloomf_merge_pages(bloom_filter *filter, uint32_t num_layers, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, const unsigned char *bytes, uint64_t len) {
+    if (!changes_trackable(filter)) return -EINVAL;
+    bloom_sbf *sbf = faulted_sbf(filter);
+    if (!sbf) return -1;
+    if (num_layers != sbf->num_filters || layer >= num_layers) return -EINVAL;
+
+    // A sealed layer is sealed again once flushed
+    pthread_mutex_lock(&filter->flush_lock);
+    int res = bitmap_unseal(sbf->filters[num_layers - 1 - layer]->map);
+    pthread_mutex_unlock(&filter->flush_lock);
+    if (res) {
+        syslog(LOG_ERR, "Failed to unseal filter '%s' to merge into it!", filter->filter_name);
+        return -1;
+    }
+
+    res = sbf_merge_bytes(sbf, num_layers, layer, layer_bytes, offset, bytes, len);
+    if (res == -EINVAL) return -EINVAL;
+    if (res) {
+        syslog(LOG_ERR, "Failed to merge pages into filter '%s'!", filter->filter_name);
+        return -1;
+    }
+    refresh_meta(filter);
+    return 0;
+}
+
+/**
+ * Checks if a rotating filter has a generation that
+ * expired, or should start a new generation.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 1 if bloomf_rotate should be called, 0 otherwise.
+ */
+int bloomf_needs_rotate(bloom_filter *filter, uint64_t now) {
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (!gens) return 0;
+    if (!gens->num) return 1;
+
+    uint64_t bucket = now / filter->filter_config.rotate_window;
+    uint64_t oldest = gens->gens[gens->num - 1].bucket;
+    return gens->gens[0].bucket < bucket ||
+           oldest + filter->filter_config.rotate_generations <= bucket;
+}
+
+/**
+ * Rotates a rotating filter. A new generation is started
+ * once the window of the newest one has passed, and the
+ * generations outside of the live window are deleted.
+ * Does nothing for filters that do not rotate.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_rotate(bloom_filter *filter, uint64_t now) {
+    if (!filter->filter_config.rotate_window) return 0;
+    bloom_filter_generations *old = filter->gens;
+    uint64_t bucket = now / filter->filter_config.rotate_window;
+    uint64_t generations = filter->filter_config.rotate_generations;
+
+    // Count the generations that are still live. A generation from
+    // the future is kept, in case the clock was set back.
+    uint32_t live = 0;
+    for (uint32_t i=0; old && i < old->num; i++) {
+        if (old->gens[i].bucket + generations > bucket) live++;
+    }
+    int start = !old || !old->num || old->gens[0].bucket < bucket;
+    if (!start && live == old->num) return 0;
+
+    // Build the new set of generations, newest first
+    bloom_filter_generations *gens = alloc_generations(live + start);
+    if (start) {
+        gens->gens[0].bucket = bucket;
+        if (init_generation(filter, bucket, &gens->gens[0].filter)) {
+            syslog(LOG_ERR, "Failed to start a new generation of filter '%s'.", filter->filter_name);
+            free(gens);
+            return -1;
+        }
+        gens->num = 1;
+    }
+    for (uint32_t i=0; old && i < old->num; i++) {
+        if (old->gens[i].bucket + generations > bucket)
+            gens->gens[gens->num++] = old->gens[i];
+    }
+    __atomic_store_n(&filter->gens, gens, __ATOMIC_RELEASE);
+
+    // Delete the expired generations, keeping their page counters
+    for (uint32_t i=0; old && i < old->num; i++) {
+        if (old->gens[i].bucket + generations > bucket) continue;
+        bloom_filter *gen = old->gens[i].filter;
+        syslog(LOG_INFO, "Expiring generation %llu of filter '%s'.",
+                (unsigned long long)old->gens[i].bucket, filter->filter_name);
+        bloomf_delete(gen);
+        pthread_mutex_lock(&filter->sbf_lock);
+        filter->counters.page_ins += gen->counters.page_ins;
+        filter->counters.page_outs += gen->counters.page_outs;
+        filter->counters.fault_lock_waits += gen->counters.fault_lock_waits;
+        filter->counters.fault_lock_wait_nsec += gen->counters.fault_lock_wait_nsec;
+        filter->counters.fault_nsec += gen->counters.fault_nsec;
+        pthread_mutex_unlock(&filter->sbf_lock);
+        destroy_bloom_filter(gen);
+    }
+    free(old);
+    refresh_meta(filter);
+    return 0;
+}
+
+/**
+ * Returns the length in seconds of a tick of an aging filter
+ */
+static uint64_t age_tick_secs(bloom_filter *f) {
+    return (f->filter_config.key_ttl + FILTER_AGE_TICKS - 1) / FILTER_AGE_TICKS;
+}
+
+/**
+ * Checks if an aging filter is due a tick, which
+ * expires the keys that were not set for its TTL.
+ * Filters that are not faulted in are aged when they are.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 1 if bloomf_age should be called, 0 otherwise.
+ */
+int bloomf_needs_age(bloom_filter *filter, uint64_t now) {
+    if (filter->filter_config.layout != BLOOM_LAYOUT_AGING) return 0;
+    if (!__atomic_load_n(&filter->sbf, __ATOMIC_ACQUIRE)) return 0;
+    return now / age_tick_secs(filter) > __atomic_load_n(&filter->age_clock, __ATOMIC_RELAXED);
+}
+
+/**
+ * Ages an aging filter, expiring the keys that were not
+ * set for its TTL. Does nothing for other filters.
+ * @note Thread safe with checks and bloomf_try_add calls,
+ * but the caller must prevent other calls.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_age(bloom_filter *filter, uint64_t now) {
+    if (filter->filter_config.layout != BLOOM_LAYOUT_AGING) return 0;
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&filter->sbf, __ATOMIC_ACQUIRE);
+    if (!sbf) return 0;
+    uint64_t clock = now / age_tick_secs(filter);
+    if (sbf_age(sbf, clock)) return -1;
+    __atomic_store_n(&filter->age_clock, clock, __ATOMIC_RELAXED);
+    refresh_meta(filter);
+    return 0;
+}
+
+/**
+ * Checks if the filter contains a given key
+ * @note Thread safe with other bloomf_contains and
+ * bloomf_try_add calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @return 0 if not contained, 1 if contained.
+ */
+int bloomf_contains(bloom_filter *filter, char *key) {
+    // Rotating and sharded filters check the key as a batch
+    if (filter->gens || filter->keyshards) {
+        char found;
+        if (bloomf_contains_many(filter, &key, 1, &found)) return -1;
+        return found;
+    }
+
+    // Check the SBF, or the filter that replaced it
+    int res;
+    if (filter->filter_config.frozen) {
+        bloom_xorfilter *xf = faulted_frozen(filter);
+        if (!xf) return -1;
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, key);
+        res = xf_contains(xf, &hk);
+    } else if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        bloom_qf *qf = faulted_qf(filter);
+        if (!qf) return -1;
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, key);
+        res = qf_contains(qf, &hk);
+    } else {
+        bloom_sbf *sbf = faulted_sbf(filter);
+        if (!sbf) return -1;
+        res = sbf_contains(sbf, key);
+    }
+
+    // Update our counter shard. The add is uncontended
+    // unless there are more threads than shards.
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    if (res == 1)
+        __atomic_fetch_add(&shard->c.check_hits, 1, __ATOMIC_RELAXED);
+    else if (res == 0)
+        __atomic_fetch_add(&shard->c.check_misses, 1, __ATOMIC_RELAXED);
+
+    return res;
+}
+
+/**
+ * Checks if the filter contains many keys at once
+ * @note Thread safe with other bloomf_contains and
+ * bloomf_try_add calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_many(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    return bloomf_contains_many_len(filter, keys, NULL, num_keys, result);
+}
+
+/**
+ * Checks if the filter contains many keys of known lengths,
+ * so the keys are not measured again by every layer.
+ * @note Thread safe like bloomf_contains_many.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result) {
+    // The shards count their own checks
+    if (filter->keyshards) return keyshards_op(filter, keys, key_lens, num_keys, result, SHARD_CONTAINS);
+
+    if (filter->gens) {
+        // Check each generation for the keys not found in the newer ones
+        memset(result, 0, num_keys);
+        if (generations_contains(filter->gens, 0, keys, key_lens, num_keys, result)) return -1;
+    } else if (filter->filter_config.frozen) {
+        // Check the xor filter
+        bloom_xorfilter *xf = faulted_frozen(filter);
+        if (!xf || frozen_contains_many(xf, keys, key_lens, num_keys, result)) return -1;
+    } else if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        // Check the quotient filter
+        bloom_qf *qf = faulted_qf(filter);
+        if (!qf || quotient_contains_many(qf, keys, key_lens, num_keys, result)) return -1;
+    } else {
+        // Check the SBF
+        bloom_sbf *sbf = faulted_sbf(filter);
+        if (!sbf || sbf_contains_many_len(sbf, keys, key_lens, num_keys, result) != 0) return -1;
+    }
+
+    // Update our counter shard once for the batch
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    bloomf_count_results(&shard->c.check_hits, &shard->c.check_misses, result, num_keys);
+    return 0;
+}
+
+/**
+ * Checks if the filter contains many keys that are already
+ * hashed. The hashes are cached in the keys, so checking the
+ * same keys against several filters hashes each key once,
+ * whatever the hash schemes of the filters. Keys given as
+ * their hash, see bf_hashed_key_init_hash, can only be checked
+ * in filters that bloomf_accepts_hashes.
+ * @note Thread safe like bloomf_contains_many.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -EINVAL if the keys are prehashed
+ * and the filter does not accept hashes, -1 on error.
+ */
+int bloomf_contains_hashed(bloom_filter *filter, bloom_hashed_key *keys, int num_keys, char *result) {
+    if (num_keys && keys->prehashed && !bloomf_accepts_hashes(filter)) return -EINVAL;
+
+    // Sharded filters check the keys themselves
+    if (filter->keyshards) {
+        char *batch[BLOOM_BATCH_SIZE];
+        int lens[BLOOM_BATCH_SIZE];
+        for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+            int n = num_keys - base;
+            if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+            for (int i=0; i < n; i++) {
+                batch[i] = keys[base + i].key;
+                lens[i] = keys[base + i].len;
+            }
+            if (bloomf_contains_many_len(filter, batch, lens, n, result + base)) return -1;
+        }
+        return 0;
+    }
+
+    if (filter->gens) {
+        memset(result, 0, num_keys);
+        if (generations_contains_hashed(filter->gens, keys, num_keys, result)) return -1;
+    } else if (filter->filter_config.frozen) {
+        bloom_xorfilter *xf = faulted_frozen(filter);
+        if (!xf) return -1;
+        memset(result, 0, num_keys);
+        xf_contains_many(xf, keys, num_keys, result);
+    } else if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        bloom_qf *qf = faulted_qf(filter);
+        if (!qf) return -1;
+        memset(result, 0, num_keys);
+        qf_contains_many(qf, keys, num_keys, result);
+    } else {
+        bloom_sbf *sbf = faulted_sbf(filter);
+        if (!sbf || sbf_contains_hashed_many(sbf, keys, num_keys, result) != 0) return -1;
+    }
+
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    bloomf_count_results(&shard->c.check_hits, &shard->c.check_misses, result, num_keys);
+    return 0;
+}
+
+/**
+ * Checks if keys given as their hash can be checked in a
+ * filter. Only the MurmurHash3 of such keys is known, which is
+ * all that filters using BLOOM_HASH_MURMUR, quotient filters and
+ * frozen filters need. Sharded filters pick the shard of a key
+ * from the key itself.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return 1 if the filter accepts hashed keys, 0 otherwise.
+ */
+int bloomf_accepts_hashes(bloom_filter *filter) {
+    if (filter->filter_config.shards) return 0;
+    if (filter->filter_config.frozen) return 1;
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) return 1;
+    return filter->filter_config.hash_scheme == BLOOM_HASH_MURMUR;
+}
+
+/**
+ * Adds a key to the given filter
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added. -EROFS if the
+ * filter is frozen, -EDQUOT if it is over a quota
+ * and can not grow.
+ */
+int bloomf_add(bloom_filter *filter, char *key) {
+    return bloomf_internal_add(filter, key, 1);
+}
+
+/**
+ * Adds a key to the given filter, without growing it.
+ * @note Thread safe with other bloomf_try_add and bloomf_contains
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added. -EAGAIN if the
+ * filter must grow, and bloomf_add should be used instead.
+ * -EROFS if the filter is frozen, -EDQUOT if it is over a quota.
+ */
+int bloomf_try_add(bloom_filter *filter, char *key) {
+    return bloomf_internal_add(filter, key, 0);
+}
+
+/**
+ * Adds many keys to the given filter
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return 0 on success, -EROFS if the filter is frozen,
+ * -EDQUOT if it is over a quota and can not grow, -1 on error.
+ */
+int bloomf_add_many(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    return bloomf_add_many_len(filter, keys, NULL, num_keys, result);
+}
+
+/**
+ * Adds many keys of known lengths to the given filter.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are measured.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return 0 on success, -EROFS if the filter is frozen,
+ * -EDQUOT if it is over a quota and can not grow, -1 on error.
+ */
+int bloomf_add_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result) {
+    int res = bloomf_internal_add_many(filter, keys, key_lens, num_keys, result, 1);
+    if (res == -EROFS || res == -EDQUOT) return res;
+    return (res < 0) ? -1 : 0;
+}
+
+/**
+ * Adds many keys to the given filter, without growing it.
+ * @note Thread safe with other bloomf_try_add and bloomf_contains
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return The number of keys processed, -EROFS if the filter is
+ * frozen, -EDQUOT if it is over a quota, or -1 on error. If the filter must grow, this is less
+ * than num_keys, and bloomf_add_many should be used for the rest.
+ */
+int bloomf_try_add_many(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    return bloomf_internal_add_many(filter, keys, NULL, num_keys, result, 0);
+}
+
+/**
+ * Adds many keys of known lengths to the given filter,
+ * without growing it, as with bloomf_try_add_many.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are measured.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return The number of keys processed, as with bloomf_try_add_many.
+ */
+int bloomf_try_add_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result) {
+    return bloomf_internal_add_many(filter, keys, key_lens, num_keys, result, 0);
+}
+
+/**
+ * Internal add many method, faults the filter in if needed.
+ * @arg can_grow Can the underlying SBF be grown
+ * @return The number of keys processed, -EROFS if frozen,
+ * -EDQUOT if over a quota, or -1 on error.
+ */
+static int bloomf_internal_add_many(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result, int can_grow) {
+    // Sharded filters grow each shard under its own lock,
+    // so every key is processed regardless of can_grow
+    if (filter->keyshards) {
+        int res = keyshards_op(filter, keys, key_lens, num_keys, result, SHARD_ADD);
+        return (res) ? res : num_keys;
+    }
+
+    // Rotating filters set the keys in the newest generation
+    bloom_filter_generations *gens = filter->gens;
+    bloom_filter *target = filter;
+    if (gens) {
+        if (!gens->num) return -1;
+        target = gens->gens[0].filter;
+    }
+    if (filter->filter_config.frozen) return -EROFS;
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT)
+        return quotient_internal_add_many(filter, keys, key_lens, num_keys, result, can_grow);
+    bloom_sbf *sbf = faulted_sbf(target);
+    if (!sbf) return -1;
+
+    // Add to the SBF
+    int res;
+    uint32_t layers = sbf->num_filters;
+    if (can_grow) {
+        res = sbf_add_many_len(sbf, keys, key_lens, num_keys, result);
+        if (res == 0) res = num_keys;
+    } else
+        res = sbf_try_add_many_len(sbf, keys, key_lens, num_keys, result);
+    if (res < 0) return (res == -EDQUOT) ? res : -1;
+
+    // Count the keys added to the layers for the cached size,
+    // and refresh the rest of the metadata if we grew
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    bloomf_count_added(&shard->c.added, result, res);
+    if (sbf->num_filters != layers) refresh_meta(filter);
+
+    // Log the keys that were added, and stage all of them
+    if (target->set_log) setlog_append(target->set_log, keys, key_lens, result, res);
+    if (target->staged && res > 0) setlog_append(target->staged, keys, key_lens, NULL, res);
+
+    // Keys that were set in an older generation are reported as
+    // present, since they were already seen within the window
+    if (gens && gens->num > 1 && res > 0) {
+        for (int i=0; i < res; i++) result[i] = !result[i];
+        int err = generations_contains(gens, 1, keys, key_lens, res, result);
+        for (int i=0; i < res; i++) result[i] = !result[i];
+        if (err) return -1;
+    }
+
+    // Update our counter shard once for the batch
+    bloomf_count_results(&shard->c.set_hits, &shard->c.set_misses, result, res);
+    return res;
+}
+
+/**
+ * Removes many keys from a filter using the counting layout.
+ * Each key is removed once, so a key that was set more than
+ * once stays present until it is removed as many times.
+ * Rotating filters remove the keys from every generation.
+ * @note Thread safe with bloomf_contains and bloomf_try_add
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to remove from
+ * @arg keys The keys to remove
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was removed and 0 otherwise.
+ * @return 0 on success, -EINVAL if the filter does not use
+ * the counting layout, -1 on error.
+ */
+int bloomf_remove_many(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    return bloomf_remove_many_len(filter, keys, NULL, num_keys, result);
+}
+
+/**
+ * Removes many keys of known lengths from a filter
+ * using the counting layout, as with bloomf_remove_many.
+ * @arg filter The filter to remove from
+ * @arg keys The keys to remove
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was removed and 0 otherwise.
+ * @return 0 on success, -EINVAL if the filter does not use
+ * the counting layout, -1 on error.
+ */
+int bloomf_remove_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result) {
+    if (filter->filter_config.layout != BLOOM_LAYOUT_COUNTING) return -EINVAL;
+    if (filter->keyshards) return keyshards_op(filter, keys, key_lens, num_keys, result, SHARD_REMOVE);
+
+    // Rotating filters may have set the key in several generations
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    bloom_filter_generations *gens = filter->gens;
+    if (gens) {
+        char *removed = alloca(num_keys);
+        memset(result, 0, num_keys);
+        for (uint32_t i=0; i < gens->num; i++) {
+            if (bloomf_remove_many_len(gens->gens[i].filter, keys, key_lens, num_keys, removed)) return -1;
+            bloomf_count_added(&shard->c.removed, removed, num_keys);
+            for (int j=0; j < num_keys; j++) result[j] |= removed[j];
+        }
+        return 0;
+    }
+
+    bloom_sbf *sbf = faulted_sbf(filter);
+    if (!sbf || sbf_remove_many_len(sbf, keys, key_lens, num_keys, result)) return -1;
+    bloomf_count_added(&shard->c.removed, result, num_keys);
+    return 0;
+}
+
+/**
+ * Adds the hits and misses of a batch to a pair of counters.
+ */
+static void bloomf_count_results(uint64_t *hits, uint64_t *misses, char *result, int num_keys) {
+    uint64_t num_hits = 0;
+    for (int i=0; i < num_keys; i++) {
+        num_hits += result[i];
+    }
+    if (num_hits)
+        __atomic_fetch_add(hits, num_hits, __ATOMIC_RELAXED);
+    if (num_keys - num_hits)
+        __atomic_fetch_add(misses, num_keys - num_hits, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the number of keys flagged in a batch to a counter.
+ */
+static void bloomf_count_added(uint64_t *counter, char *result, int num_keys) {
+    uint64_t num = 0;
+    for (int i=0; i < num_keys; i++) {
+        num += result[i];
+    }
+    if (num) __atomic_fetch_add(counter, num, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the keys added less the keys removed, over
+ * every shard of a filter. This wraps around, since
+ * only the difference from an earlier call matters.
+ */
+static uint64_t shard_size_delta(bloom_filter *f) {
+    uint64_t delta = 0;
+    for (int i=0; i < FILTER_COUNTER_SHARDS; i++) {
+        filter_counter_shard *shard = f->shards + i;
+        delta += __atomic_load_n(&shard->c.added, __ATOMIC_RELAXED);
+        delta -= __atomic_load_n(&shard->c.removed, __ATOMIC_RELAXED);
+    }
+    return delta;
+}
+
+/**
+ * Returns the keys added and removed, over every shard
+ * of a filter. This only grows, so any change since an
+ * earlier call shows as a different value.
+ */
+static uint64_t shard_changes(bloom_filter *f) {
+    uint64_t changes = 0;
+    for (int i=0; i < FILTER_COUNTER_SHARDS; i++) {
+        filter_counter_shard *shard = f->shards + i;
+        changes += __atomic_load_n(&shard->c.added, __ATOMIC_RELAXED);
+        changes += __atomic_load_n(&shard->c.removed, __ATOMIC_RELAXED);
+    }
+    return changes;
+}
+
+/**
+ * Caches the metadata of a filter, see bloomf_meta. The
+ * size is stored less the keys counted in the shards, which
+ * bloomf_meta adds back, so sets keep the size current
+ * without reading the layers. Called whenever the layers are
+ * loaded, grown, flushed or replaced.
+ */
+static void refresh_meta(bloom_filter *f) {
+    uint64_t size = bloomf_size(f) - shard_size_delta(f);
+    __atomic_store_n(&f->meta.size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&f->meta.capacity, bloomf_capacity(f), __ATOMIC_RELAXED);
+    __atomic_store_n(&f->meta.bytes, bloomf_byte_size(f), __ATOMIC_RELAXED);
+}
+
+/**
+ * Internal add method, faults the filter in if needed.
+ * @arg can_grow Can the underlying SBF be grown
+ */
+static int bloomf_internal_add(bloom_filter *filter, char *key, int can_grow) {
+    // Rotating filters must check the older generations as well,
+    // and sharded filters set the key in its shard
+    if (filter->gens || filter->keyshards) {
+        char added;
+        int res = bloomf_internal_add_many(filter, &key, NULL, 1, &added, can_grow);
+        if (res < 0) return (res == -EDQUOT) ? res : -1;
+        return (res) ? added : -EAGAIN;
+    }
+    if (filter->filter_config.frozen) return -EROFS;
+    if (filter->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        char added;
+        int res = quotient_internal_add_many(filter, &key, NULL, 1, &added, can_grow);
+        if (res < 0) return res;
+        return (res) ? added : -EAGAIN;
+    }
+    bloom_sbf *sbf = faulted_sbf(filter);
+    if (!sbf) return -1;
+
+    // Add the SBF
+    uint32_t layers = sbf->num_filters;
+    int res = (can_grow) ? sbf_add(sbf, key) : sbf_try_add(sbf, key);
+
+    // Log the key if it was added
+    if (res == 1 && filter->set_log) setlog_append(filter->set_log, &key, NULL, NULL, 1);
+    if (res >= 0 && filter->staged) setlog_append(filter->staged, &key, NULL, NULL, 1);
+
+    // Update our counter shard
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    if (res == 1) {
+        __atomic_fetch_add(&shard->c.set_hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shard->c.added, 1, __ATOMIC_RELAXED);
+    } else if (res == 0)
+        __atomic_fetch_add(&shard->c.set_misses, 1, __ATOMIC_RELAXED);
+
+    if (sbf->num_filters != layers) refresh_meta(filter);
+    return res;
+}
+
+/**
+ * Gets the size of the filter in keys
+ * @note Thread safe.
+ * @arg filter The filter to check
+ * @return The total size of the filter
+ */
+uint64_t bloomf_size(bloom_filter *filter) {
+    if (filter->keyshards) {
+        filter_meta meta;
+        keyshards_meta(filter, &meta);
+        return meta.size;
+    }
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens) {
+        uint64_t total = 0;
+        for (uint32_t i=0; i < gens->num; i++) {
+            total += bloomf_size(gens->gens[i].filter);
+        }
+        return total;
+    } else if (filter->sbf) {
+        return sbf_size((bloom_sbf*)filter->sbf);
+    } else if (filter->qf) {
+        return qf_size((bloom_qf*)filter->qf);
+    } else {
+        return filter->filter_config.size;
+    }
+}
+
+/**
+ * Gets the maximum capacity of the filter
+ * @note Thread safe.
+ * @arg filter The filter to check
+ * @return The total capacity of the filter
+ */
+uint64_t bloomf_capacity(bloom_filter *filter) {
+    if (filter->keyshards) {
+        filter_meta meta;
+        keyshards_meta(filter, &meta);
+        return meta.capacity;
+    }
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens) {
+        uint64_t total = 0;
+        for (uint32_t i=0; i < gens->num; i++) {
+            total += bloomf_capacity(gens->gens[i].filter);
+        }
+        return total;
+    } else if (filter->sbf) {
+        return sbf_total_capacity((bloom_sbf*)filter->sbf);
+    } else if (filter->qf) {
+        return qf_capacity((bloom_qf*)filter->qf);
+    } else {
+        return filter->filter_config.capacity;
+    }
+}
+
+/**
+ * Gets the current byte size of the filter
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return The total byte size of the filter
+ */
+uint64_t bloomf_byte_size(bloom_filter *filter) {
+    if (filter->keyshards) {
+        filter_meta meta;
+        keyshards_meta(filter, &meta);
+        return meta.bytes;
+    }
+    bloom_filter_generations *gens = __atomic_load_n(&filter->gens, __ATOMIC_ACQUIRE);
+    if (gens) {
+        uint64_t total = 0;
+        for (uint32_t i=0; i < gens->num; i++) {
+            total += bloomf_byte_size(gens->gens[i].filter);
+        }
+        return total;
+    } else if (filter->sbf) {
+        return sbf_total_byte_size((bloom_sbf*)filter->sbf);
+    } else if (filter->qf) {
+        return filter->qf->map->size;
+    } else {
+        return filter->filter_config.bytes;
+    }
+}
+
+/**
+ * Returns the counter shard the calling thread
+ * should use. Threads are assigned shards round-robin
+ * the first time they touch any filter.
+ */
+static filter_counter_shard* thread_counter_shard(bloom_filter *f) {
+    if (counter_shard < 0) {
+        counter_shard = __atomic_fetch_add(&next_counter_shard, 1, __ATOMIC_RELAXED) % FILTER_COUNTER_SHARDS;
+    }
+    return f->shards + counter_shard;
+}
+
+/**
+ * Provides a thread safe faulting of filters.
+ * The main use case of this is to allow
+ * bloomf_contains to be safe. The SBF is only
+ * published once fully built, so concurrent readers
+ * either fault or see a complete SBF.
+ */
+static int thread_safe_fault(bloom_filter *f) {
+    // The fault is its own stage of the command being timed
+    latency_mark(LATENCY_OP);
+
+    // Acquire lock, timing the wait if another thread holds it
+    uint64_t start;
+    if (pthread_mutex_trylock(&f->sbf_lock)) {
+        start = latency_now();
+        pthread_mutex_lock(&f->sbf_lock);
+        f->counters.fault_lock_waits++;
+        f->counters.fault_lock_wait_nsec += latency_now() - start;
+    }
+
+    // Another thread may have faulted in the filter while we waited
+    int res = 0;
+    BLOOM_PROBE1(fault__start, f->filter_name);
+    start = latency_now();
+    if (f->filter_config.frozen) {
+        if (__atomic_load_n(&f->frozen, __ATOMIC_ACQUIRE)) goto LEAVE;
+        res = load_frozen_filter(f);
+    } else if (f->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) {
+        if (__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE)) goto LEAVE;
+        res = load_quotient_filter(f);
+    } else {
+        if (__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE)) goto LEAVE;
+        if (f->filter_config.in_memory) {
+            res = restore_memory_snapshot(f);
+            if (res > 0) res = create_sbf(f, 0, NULL);
+        } else {
+            res = discover_existing_filters(f);
+        }
+    }
+    start = latency_now() - start;
+    f->counters.fault_nsec += start;
+    BLOOM_PROBE3(fault__done, f->filter_name, res, start);
+    if (!res) refresh_meta(f);
+
+LEAVE:
+    // Release lock
+    pthread_mutex_unlock(&f->sbf_lock);
+    latency_mark(LATENCY_FAULT);
+    return res;
+}
+
+/**
+ * Returns the SBF of a filter, faulting it in if needed.
+ * @return The SBF, or NULL if it could not be faulted in.
+ */
+static bloom_sbf* faulted_sbf(bloom_filter *f) {
+    bloom_sbf *sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    if (!sbf) {
+        if (thread_safe_fault(f) != 0) return NULL;
+        sbf = (bloom_sbf*)__atomic_load_n(&f->sbf, __ATOMIC_ACQUIRE);
+    }
+    return sbf;
+}
+
+/**
+ * Returns a stamp that changes whenever the config of a
+ * filter is replaced, or 0 if there is no config.
+ */
+static uint64_t config_generation(bloom_filter *f) {
+    char *config_name = join_path(f->full_path, (char*)META_FILENAME);
+    struct stat buf;
+    int res = stat(config_name, &buf);
+    free(config_name);
+
+    // A writer of an older version keeps the INI file
+    if (res) {
+        config_name = join_path(f->full_path, (char*)CONFIG_FILENAME);
+        res = stat(config_name, &buf);
+        free(config_name);
+    }
+    if (res) return 0;
+    uint64_t stamp = ((uint64_t)buf.st_ino << 32) ^ ((uint64_t)buf.st_mtime << 8) ^ buf.st_size;
+#ifdef __linux__
+    // Inodes are reused, so tell rewrites within a second apart
+    stamp ^= (uint64_t)buf.st_mtim.tv_nsec << 20;
+#endif
+    return (stamp) ? stamp : 1;
+}
+
+// Returns the number of data files of a filter, or of its packed layers
+static int count_data_files(bloom_filter *f) {
+    pack_header header;
+    int fd = open_pack(f, &header);
+    if (fd == -2) return -1;
+    if (fd >= 0) {
+        close(fd);
+        return header.num_layers;
+    }
+
+    struct dirent **namelist;
+    int num = scandir(f->full_path, &namelist, filter_data_files, NULL);
+    for (int i=0; i < num; i++) free(namelist[i]);
+    if (num >= 0) free(namelist);
+    return num;
+}
+
+/**
+ * Writes out the filter config of a filter.
+ * @return 0 on success.
+ */
+static int write_filter_config(bloom_filter *f) {
+    char *config_name = join_path(f->full_path, (char*)META_FILENAME);
+    int res = update_binary_from_filter_config(config_name, &f->filter_config);
+    free(config_name);
+    if (res) {
+        syslog(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+                f->filter_name, res);
+    }
+    return res;
+}
+
+/**
+ * Reads the filter config of a filter directory, from the
+ * binary record, or the INI file if there is no record.
+ * @arg dir The directory of the filter
+ * @arg config The config to update
+ * @arg legacy Output, set if the INI file was read
+ * @return 0 on success, -ENOENT if there is no config.
+ */
+static int read_filter_config(char *dir, bloom_filter_config *config, int *legacy) {
+    char *config_name = join_path(dir, (char*)META_FILENAME);
+    int res = filter_config_from_binary(config_name, config);
+    free(config_name);
+    *legacy = (res == -ENOENT);
+    if (!*legacy) return res;
+
+    config_name = join_path(dir, (char*)CONFIG_FILENAME);
+    res = filter_config_from_filename(config_name, config);
+    free(config_name);
+    if (res) *legacy = 0;
+    return res;
+}
+
+/**
+ * Discovers existing filters, and faults them in.
+ */
+static uint64_t get_size(char* filename) {
+    struct stat buf;
+    buf.st_size = 0;
+    stat(filename, &buf);
+    return buf.st_size;
+}
+
+/**
+ * Works with scandir to filter out special files
+ */
+static int filter_out_special(CONST_DIRENT_T *d) {
+    // Get the file name
+    char *name = (char*)d->d_name;
+
+    // Make sure its not speci
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Works with scandir to filter out non-data files.
+ */
+static int filter_data_files(CONST_DIRENT_T *d) {
+    // Get the file name
+    char *name = (char*)d->d_name;
+
+    // Look if it ends in ".data"
+    int name_len = strlen(name);
+
+    // Too short
+    if (name_len < 6) return 0;
+
+    // Compare the ending
+    if (strcmp(name+(name_len-5), ".mmap") == 0) {
+        return 1;
+    }
+
+    // Do not store
+    return 0;
+}
+
+/**
+ * Works with scandir to filter out non-compressed data files.
+ */
+static int filter_compressed_files(CONST_DIRENT_T *d) {
+    char *name = (char*)d->d_name;
+    int name_len = strlen(name);
+    int suffix_len = strlen(COMPRESSED_FILE_SUFFIX);
+    if (name_len <= suffix_len) return 0;
+    return strcmp(name+(name_len-suffix_len), COMPRESSED_FILE_SUFFIX) == 0;
+}
+
+/**
+ * This beast mode method scans the data directory
+ * belonging to this filter for any existing filters,
+ * and restores the SBF
+ * @return 0 on success. -1 on error.
+ */
+static int discover_existing_filters(bloom_filter *f) {
+    // Restore any layers that were compressed when the filter went cold
+    if (expand_compressed_layers(f)) return -1;
+
+    // A packed filter has all of its layers in the pack
+    pack_header header;
+    int pack_fd = open_pack(f, &header);
+    if (pack_fd == -2) return -1;
+    if (pack_fd >= 0) return discover_packed_layers(f, pack_fd, &header);
+
+    // Scan through the folder looking for data files
+    struct dirent **namelist;
     int num;
 
-    // Filter only data dirs, in sorted order
-    num = scandir(filter->full_path, &namelist, filter_out_special, NULL);
-    syslog(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
+    // Filter only data dirs, in sorted order
+    num = scandir(f->full_path, &namelist, filter_data_files, alphasort);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+    syslog(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
+
+    // Speical case when there are no filters
+    if (num == 0) {
+        int res = create_sbf(f, 0, NULL);
+        return res;
+    }
+
+    // Allocate space for all the filter
+    bloom_bitmap **maps = malloc(num * sizeof(bloom_bitmap*));
+    bloom_bloomfilter **filters = malloc(num * sizeof(bloom_bloomfilter*));
+
+    // Initialize the bitmaps and bloom filters
+    int res;
+    int err = 0;
+    uint64_t size;
+    for (int i=0; i < num && !err; i++) {
+        // Get the full path to the bitmap
+        char *bitmap_path = join_path(f->full_path, namelist[i]->d_name);
+        syslog(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
+
+        // Get the size
+        size = get_size(bitmap_path);
+        if (size == 0) {
+            err = 1;
+            syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", bitmap_path, strerror(errno));
+            free(bitmap_path);
+            break;
+        }
+
+        // Create the bitmap
+        bloom_bitmap *bitmap = maps[num - i - 1] = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_filename(bitmap_path, size, 0, layer_bitmap_mode(f, num - i - 1), bitmap);
+        if (res != 0) {
+            err = 1;
+            syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
+            free(bitmap);
+            free(bitmap_path);
+            break;
+        }
+        place_layer(f, bitmap);
+
+        // Create the bloom filter
+        bloom_bloomfilter *filter = filters[num - i - 1] = malloc(sizeof(bloom_bloomfilter));
+        res = bf_from_bitmap(bitmap, 1, 0, filter);
+        if (res != 0) {
+            err = 1;
+            syslog(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
+            free(filter);
+            bitmap_close(bitmap);
+            free(bitmap);
+            free(bitmap_path);
+            break;
+        }
+
+        // Cleanup
+        free(bitmap_path);
+    }
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) free(namelist[i]);
+    free(namelist);
+
+    // Return if there was an error
+    if (err) return -1;
+    return restore_sbf(f, num, maps, filters);
+}
+
+/**
+ * Restores the layers of an in-memory filter from its last
+ * snapshot, reading each into anonymous memory. The layers
+ * are not file backed afterwards, and the snapshot is only
+ * replaced by the next one.
+ * @return 0 on success, 1 if there is no snapshot, -1 on error.
+ */
+static int restore_memory_snapshot(bloom_filter *f) {
+    char *path = snapshot_path(f, "");
+    struct dirent **namelist;
+    int num = scandir(path, &namelist, filter_data_files, alphasort);
+    if (num <= 0) {
+        if (!num) free(namelist);
+        free(path);
+        return 1;
+    }
+
+    bloom_bitmap **maps = malloc(num * sizeof(bloom_bitmap*));
+    bloom_bloomfilter **filters = malloc(num * sizeof(bloom_bloomfilter*));
+    int loaded = 0, err = 0;
+    for (; loaded < num && !err; loaded++) {
+        char *layer_path = join_path(path, namelist[loaded]->d_name);
+        int fd = open(layer_path, O_RDONLY);
+        struct stat st;
+        bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+        err = (fd < 0 || fstat(fd, &st) || !st.st_size ||
+                bitmap_from_file(-1, st.st_size, bloomf_bitmap_mode(f, 1), map));
+        if (err) {
+            free(map);
+        } else {
+            // Read in the layer, retrying short reads
+            uint64_t done = 0;
+            while (!err && done < (uint64_t)st.st_size) {
+                ssize_t r = pread(fd, map->mmap + done, st.st_size - done, done);
+                if (r > 0) done += r;
+                else if (r == 0 || errno != EINTR) err = 1;
+            }
+            place_layer(f, map);
+            bloom_bloomfilter *filter = malloc(sizeof(bloom_bloomfilter));
+            if (!err && bf_from_bitmap(map, 1, 0, filter)) err = 1;
+            if (err) {
+                free(filter);
+                bitmap_close(map);
+                free(map);
+            } else {
+                maps[num - loaded - 1] = map;
+                filters[num - loaded - 1] = filter;
+            }
+        }
+        if (err) syslog(LOG_ERR, "Failed to restore snapshot layer %s. %s", layer_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        free(layer_path);
+    }
+    for (int i=0; i < num; i++) free(namelist[i]);
+    free(namelist);
+    free(path);
+
+    // Cleanup the layers read before an error
+    if (err) {
+        for (int i=0; i < loaded - 1; i++) {
+            bf_close(filters[num - i - 1]);
+            bitmap_close(maps[num - i - 1]);
+            free(filters[num - i - 1]);
+            free(maps[num - i - 1]);
+        }
+        free(maps);
+        free(filters);
+        return -1;
+    }
+    syslog(LOG_INFO, "Restoring %d layers of in-memory filter %s from its snapshot.", num, f->filter_name);
+    int res = restore_sbf(f, num, maps, filters);
+    if (!res) f->snapshot_size = sbf_size((bloom_sbf*)f->sbf);
+    return res;
+}
+
+/**
+ * Opens the pack of a filter, and reads its header. An empty
+ * pack is left behind by a crash while the first layer was
+ * appended, and is removed by the writer.
+ * @arg header Output, the header of the pack
+ * @return The file descriptor, -1 if the filter has
+ * no packed layers, or -2 if the pack is corrupt.
+ */
+static int open_pack(bloom_filter *f, pack_header *header) {
+    char *pack_path = join_path(f->full_path, (char*)PACK_FILE_NAME);
+    int fd = open(pack_path, (f->config->read_only) ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        free(pack_path);
+        return -1;
+    }
+
+    // Check the header against the file, so a torn
+    // header is never mapped past the end of it
+    struct stat buf;
+    int res = (fstat(fd, &buf) || pread(fd, header, sizeof(pack_header), 0) != sizeof(pack_header)) ? -2 : 0;
+    if (!res && (memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) ||
+            header->num_layers > PACK_MAX_LAYERS)) res = -2;
+    for (uint32_t i=0; !res && i < header->num_layers; i++) {
+        pack_layer *layer = header->layers + i;
+        if (layer->offset < PACK_HEADER_SIZE || !layer->size ||
+                layer->offset + layer->size > (uint64_t)buf.st_size) res = -2;
+    }
+
+    if (res) {
+        syslog(LOG_ERR, "The pack %s of filter '%s' is corrupt.", pack_path, f->filter_name);
+    } else if (!header->num_layers) {
+        if (!f->config->read_only) unlink(pack_path);
+        res = -1;
+    }
+    if (res) close(fd);
+    free(pack_path);
+    return (res) ? res : fd;
+}
+
+/**
+ * Maps the layers of a pack. The layers share the descriptor
+ * of the pack, and are mapped newest first, each next to
+ * the one before it, so the mappings can be merged.
+ * @arg fd The pack, which is owned by the layers
+ * @arg header The header of the pack
+ * @return 0 on success. -1 on error.
+ */
+static int discover_packed_layers(bloom_filter *f, int fd, pack_header *header) {
+    int num = header->num_layers;
+    syslog(LOG_INFO, "Found %d packed layers for filter %s.", num, f->filter_name);
+
+    bloom_bitmap **maps = malloc(num * sizeof(bloom_bitmap*));
+    bloom_bloomfilter **filters = malloc(num * sizeof(bloom_bloomfilter*));
+    int loaded = 0, res = 0;
+    for (; loaded < num; loaded++) {
+        pack_layer *layer = header->layers + (num - loaded - 1);
+        bloom_bitmap *map = maps[loaded] = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_file_at(fd, (loaded) ? maps[loaded - 1] : NULL,
+                layer->offset, layer->size, layer_bitmap_mode(f, loaded), map);
+        if (res) {
+            syslog(LOG_ERR, "Failed to load packed layer %d of filter '%s'. %s",
+                    num - loaded - 1, f->filter_name, strerror(-res));
+            free(map);
+            break;
+        }
+        place_layer(f, map);
+
+        bloom_bloomfilter *filter = filters[loaded] = malloc(sizeof(bloom_bloomfilter));
+        res = bf_from_bitmap(map, 1, 0, filter);
+        if (res) {
+            syslog(LOG_ERR, "Failed to load packed layer %d of filter '%s'. [%d]",
+                    num - loaded - 1, f->filter_name, res);
+            free(filter);
+            bitmap_close(map);
+            free(map);
+            break;
+        }
+    }
+
+    // The last layer to close also closes the pack
+    if (res) {
+        for (int i=0; i < loaded; i++) {
+            bf_close(filters[i]);
+            bitmap_close(maps[i]);
+            free(filters[i]);
+            free(maps[i]);
+        }
+        if (!loaded) close(fd);
+        free(maps);
+        free(filters);
+        return -1;
+    }
+    return restore_sbf(f, num, maps, filters);
+}
+
+/**
+ * Creates the SBF of a filter from its discovered layers.
+ * The layers are closed if it can not be created.
+ * @arg num The number of layers
+ * @arg maps The bitmaps of the layers, newest first. Freed.
+ * @arg filters The bloom filters of the layers. Freed.
+ * @return 0 on success. -1 on error.
+ */
+static int restore_sbf(bloom_filter *f, int num, bloom_bitmap **maps, bloom_bloomfilter **filters) {
+    // Create the SBF
+    int res = create_sbf(f, num, filters);
+
+    // Cleanup on err
+    if (res != 0) {
+        syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
+
+        // For fucks sake. We need to clean up so much shit now.
+        for (int i=0; i < num; i++) {
+            bf_close(filters[i]);
+            bitmap_close(maps[i]);
+            free(filters[i]);
+            free(maps[i]);
+        }
+    }
+
+    // Increase our page ins
+    f->counters.page_ins += 1;
+
+    // Remove the filters list
+    free(maps);
+    free(filters);
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Expands the compressed layers of a filter back into data
+ * files. If a data file already exists, the compressed layer
+ * is left over from an interrupted compression and is removed.
+ * @return 0 on success, -1 on error.
+ */
+static int expand_compressed_layers(bloom_filter *f) {
+    struct dirent **namelist;
+    int num = scandir(f->full_path, &namelist, filter_compressed_files, alphasort);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+
+    // The writer expands its own layers
+    int res = 0;
+    if (num && f->config->read_only) {
+        syslog(LOG_ERR, "Filter '%s' is compressed, and can not be read. "
+                "Disable compress_cold on the writer.", f->filter_name);
+        res = -1;
+    }
+    for (int i=0; i < num; i++) {
+        if (!res) {
+            char *data_name = expanded_name(namelist[i]->d_name);
+            char *cmp_path = join_path(f->full_path, namelist[i]->d_name);
+            char *data_path = join_path(f->full_path, data_name);
+            if (access(data_path, F_OK)) {
+                int err = bitmap_decompress_file(cmp_path, data_path);
+                if (err) {
+                    syslog(LOG_ERR, "Failed to expand %s. %s", cmp_path, strerror(-err));
+                    res = -1;
+                }
+            }
+            if (!res) unlink(cmp_path);
+            free(data_name);
+            free(cmp_path);
+            free(data_path);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    if (num && !res) {
+        sync_filter_dir(f);
+        syslog(LOG_INFO, "Expanded %d compressed layers for filter %s.", num, f->filter_name);
+    }
+    return res;
+}
+
+/**
+ * Works with scandir to filter out all but the data files
+ * and the pack, which hold the layers of a filter.
+ */
+static int filter_layer_files(CONST_DIRENT_T *d) {
+    return filter_data_files(d) || strcmp(d->d_name, PACK_FILE_NAME) == 0;
+}
+
+/**
+ * Returns the name a data file or pack is compressed to.
+ * @return A new string, which must be freed.
+ */
+static char* compressed_name(char *name) {
+    if (strcmp(name, PACK_FILE_NAME) == 0) return strdup(PACK_CMP_NAME);
+    return swap_suffix(name, DATA_FILE_SUFFIX, COMPRESSED_FILE_SUFFIX);
+}
+
+/**
+ * Returns the name a compressed layer is expanded to.
+ * @return A new string, which must be freed.
+ */
+static char* expanded_name(char *name) {
+    if (strcmp(name, PACK_CMP_NAME) == 0) return strdup(PACK_FILE_NAME);
+    return swap_suffix(name, COMPRESSED_FILE_SUFFIX, DATA_FILE_SUFFIX);
+}
+
+/**
+ * Replaces the suffix of a file name.
+ * @return A new string, which must be freed.
+ */
+static char* swap_suffix(char *name, const char *old_suffix, const char *new_suffix) {
+    int base_len = strlen(name) - strlen(old_suffix);
+    char *result = NULL;
+    int res = asprintf(&result, "%.*s%s", base_len, name, new_suffix);
+    assert(res != -1);
+    return result;
+}
+
+/**
+ * Syncs the filter directory, so renames
+ * and removals are durable.
+ */
+static int sync_filter_dir(bloom_filter *f) {
+    int fd = open(f->full_path, O_RDONLY);
+    if (fd < 0) return -1;
+    int res = fsync(fd);
+    close(fd);
+    return res;
+}
+
+/**
+ * Internal method to create the SBF
+ */
+static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters) {
+    // Setup the SBF params
+    bloom_sbf_params params;
+    filter_sbf_params(f, &params);
+
+    // Create the SBF
+    bloom_sbf *sbf = malloc(sizeof(bloom_sbf));
+    int res = sbf_from_filters(&params, bloomf_sbf_callback, f, num, filters, sbf);
+    sbf->overfill = f->config->quota_degrade;
+
+    // Attach the summary before the replay, so it has the replayed keys
+    if (res == 0 && f->filter_config.summary_capacity) {
+        attach_summary(f, num, sbf);
+    }
+
+    // Expire the keys that aged while the filter was not loaded,
+    // before the replay stamps the keys that were set meanwhile
+    if (res == 0 && f->filter_config.layout == BLOOM_LAYOUT_AGING) {
+        f->age_clock = time(NULL) / age_tick_secs(f);
+        res = sbf_age(sbf, f->age_clock);
+    }
+
+    // Replay the sets since the last flush before publishing.
+    // If that fails, stop logging so the logs are left in place
+    // to be replayed on the next load.
+    if (res == 0 && f->set_log) {
+        int keys = setlog_replay(f->set_log, bloomf_replay_callback, sbf);
+        if (keys < 0) {
+            syslog(LOG_ERR, "Failed to replay the set log of %s. Disabling the set log.", f->filter_name);
+            setlog_close(f->set_log);
+            f->set_log = NULL;
+        } else if (keys > 0) {
+            syslog(LOG_INFO, "Replayed %d keys from the set log of %s.", keys, f->filter_name);
+        }
+    }
+
+    // Seal the older layers while no flush can see them
+    if (res == 0) seal_older_layers(f, sbf);
+
+    // Handle a failure
+    if (res != 0) {
+        syslog(LOG_ERR, "Failed to create SBF: %s. Err: %d", f->filter_name, res);
+        free(sbf);
+    } else {
+        // Publish the SBF only once it is fully initialized, since
+        // readers may be checking f->sbf without holding sbf_lock
+        __atomic_store_n(&f->sbf, sbf, __ATOMIC_RELEASE);
+        syslog(LOG_INFO, "Loaded SBF: %s. Num filters: %d.", f->filter_name, num);
+    }
+
+    return res;
+}
+
+/**
+ * Sets up the SBF params from the filter config.
+ */
+static void filter_sbf_params(bloom_filter *f, bloom_sbf_params *params) {
+    bloom_sbf_params p = {
+        f->filter_config.initial_capacity,
+        f->filter_config.default_probability,
+        f->filter_config.scale_size,
+        f->filter_config.probability_reduction,
+        {f->filter_config.layout, f->filter_config.hash_scheme,
+         // Filters using the newer hash schemes can already not be read by
+         // older versions, so they always get the faster range reduction
+         (f->filter_config.hash_scheme != BLOOM_HASH_LEGACY) ?
+            BLOOM_REDUCE_MULTIPLY : BLOOM_REDUCE_MODULO,
+         // A key lives for the ticks its TTL spans, and one more for
+         // the partial tick it was set in. It is stamped with the
+         // previous tick until the filter ages, which costs another.
+         (f->filter_config.key_ttl) ?
+            (f->filter_config.key_ttl + age_tick_secs(f) - 1) / age_tick_secs(f) + 2 : 0,
+         f->filter_config.max_probes,
+         f->config->sparse_layers,
+         // Sized so an oversized layer can be shrunk
+         1}
+    };
+    *params = p;
+}
+
+/**
+ * Attaches the summary of a filter to its SBF. The summary is
+ * created with the first layer, since it must have every key in
+ * the layers. If layers exist without a valid summary, the filter
+ * is used without one.
+ * @arg num The number of existing layers
+ */
+static void attach_summary(bloom_filter *f, int num, bloom_sbf *sbf) {
+    // One byte per key keeps about 88% of misses out of the layers
+    uint64_t bytes = f->filter_config.summary_capacity;
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    int res;
+    if (f->filter_config.in_memory && num) {
+        // Restored layers have no summary, which is not snapshot
+        free(map);
+        return;
+    } else if (f->filter_config.in_memory) {
+        res = bitmap_from_file(-1, bytes, bloomf_bitmap_mode(f, 1), map);
+    } else {
+        char *path = join_path(f->full_path, (char*)SUMMARY_FILE_NAME);
+        res = bitmap_from_filename(path, bytes, num == 0, bloomf_bitmap_mode(f, 0), map);
+        free(path);
+    }
+    if (res) {
+        syslog(LOG_WARNING, "Failed to open the summary of filter '%s'. Using no summary.",
+                f->filter_name);
+        free(map);
+        return;
+    }
+
+    res = sbf_set_summary(sbf, map);
+    if (res) {
+        bitmap_close(map);
+        free(map);
+    }
+}
+
+/**
+ * Returns the bitmap mode to use for the filter.
+ * @arg anonymous Should the bitmap have no file backing
+ */
+static bitmap_mode bloomf_bitmap_mode(bloom_filter *f, int anonymous) {
+    // The pages of PERSISTENT layers are always read in
+    bitmap_mode warmup = warmup_mode(f);
+    bitmap_mode mode;
+    if (anonymous)
+        mode = ANONYMOUS;
+    else if (f->config->read_only)
+        return SHARED | READ_ONLY | warmup;
+    else
+        mode = (f->config->use_mmap) ? SHARED | warmup : PERSISTENT;
+
+    if (f->config->use_direct_io && mode == PERSISTENT) mode |= DIRECT_IO;
+
+    // The generations of a rotating filter are not scrubbed
+    int rotating = f->owner && f->owner->filter_config.rotate_window;
+    if (f->config->page_checksums && !anonymous && !rotating) mode |= CHECKSUMS;
+
+    // Hugepages only apply to anonymous memory, bitmap.c ignores them for SHARED
+    if (f->config->use_hugepages) mode |= HUGEPAGES;
+    return mode;
+}
+
+/**
+ * Returns the flags that read in a SHARED layer
+ * as set by the warm-up of the filter.
+ */
+static bitmap_mode warmup_mode(bloom_filter *f) {
+    if (f->filter_config.warmup == WARMUP_POPULATE) return POPULATE;
+    if (f->filter_config.warmup == WARMUP_LAZY) return NO_READAHEAD;
+    return 0;
+}
+
+/**
+ * Checks if a layer is past the tier kept in memory, and
+ * belongs on a shared mmap of its file instead.
+ * @arg layer The index of the layer, 0 being the newest
+ * @return 1 if the layer is tiered out of memory
+ */
+static int tiered_layer(bloom_filter *f, int layer) {
+    int tier = f->config->tier_layers;
+    return tier > 0 && layer >= tier && !f->config->use_mmap &&
+        !f->config->read_only && !f->filter_config.in_memory &&
+        f->filter_config.layout != BLOOM_LAYOUT_COUNTING &&
+        f->filter_config.layout != BLOOM_LAYOUT_AGING;
+}
+
+/**
+ * Returns the mode to load an existing layer with
+ * @arg layer The index of the layer, 0 being the newest
+ */
+static bitmap_mode layer_bitmap_mode(bloom_filter *f, int layer) {
+    if (tiered_layer(f, layer)) return SHARED | warmup_mode(f);
+    return bloomf_bitmap_mode(f, 0);
+}
+
+/**
+ * Callback used with SBF to generate file names.
+ */
+static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
+    // Cast the input pointer
+    bloom_filter *filt = in;
+
+    // Growths past a quota are refused, but the first layer is always made
+    bloom_filter *owner = (filt->owner) ? filt->owner : filt;
+    if (owner->quota_cb && filt->sbf && owner->quota_cb(owner->quota_in, owner, bytes)) {
+        syslog(LOG_WARNING, "Filter '%s' is over its quota, and will not grow. %s",
+                owner->filter_name, (filt->config->quota_degrade) ?
+                "Sets will raise its false positive rate." : "Sets that need to grow it will fail.");
+        return -EDQUOT;
+    }
+
+    // Check if we are in-memory. A read-only filter with no layers
+    // yet is given an empty one, which is replaced once the
+    // writer creates its first layer.
+    if (filt->filter_config.in_memory || filt->config->read_only) {
+        syslog(LOG_INFO, "Creating new in-memory bitmap for filter %s. Size: %llu",
+            filt->filter_name, (unsigned long long)bytes);
+        int res = bitmap_from_file(-1, bytes, bloomf_bitmap_mode(filt, 1), out);
+        if (!res) place_layer(filt, out);
+        return res;
+    }
+
+    // A filter stays in the layout it was created with
+    bloom_sbf *sbf = (bloom_sbf*)filt->sbf;
+    bloom_bitmap *newest = (sbf && sbf->num_filters) ? sbf->filters[0]->map : NULL;
+    if ((newest) ? newest->file_refs != NULL : filt->config->pack_layers) {
+        return append_packed_layer(filt, newest, bytes, out);
+    }
+
+    // Use the layer prepared ahead of time, if it fits
+    bloom_bitmap *spare = __atomic_exchange_n(&filt->spare, NULL, __ATOMIC_ACQ_REL);
+    if (spare && !use_spare_layer(filt, spare, bytes, out)) return 0;
+
+    // Scan through the folder looking for data files
+    struct dirent **namelist = NULL;
+    int num_files;
+
+    // Filter only data dirs, in sorted order
+    num_files = scandir(filt->full_path, &namelist, filter_data_files, NULL);
+    syslog(LOG_INFO, "Found %d files for filter %s.", num_files, filt->filter_name);
+    if (num_files < 0) {
+        syslog(LOG_ERR, "Error discovering files for filter '%s'. %s",
+                filt->filter_name, strerror(errno));
+        return -1;
+    }
+
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num_files; i++) {
+        free(namelist[i]);
+    }
+    if (namelist) free(namelist);
+
+    // Generate the new file name
+    char *filename = NULL;
+    int file_name_len;
+    file_name_len = asprintf(&filename, DATA_FILE_NAME, num_files);
+    assert(file_name_len != -1);
+
+    // Get the full path
+    char *full_path = join_path(filt->full_path, filename);
+    free(filename);
+    syslog(LOG_INFO, "Creating new file: %s for filter %s. Size: %llu",
+            full_path, filt->filter_name, (unsigned long long)bytes);
+
+    // Create the bitmap
+    bitmap_mode mode = bloomf_bitmap_mode(filt, 0);
+    int res = bitmap_from_filename(full_path, bytes, 1, mode, out);
+    if (res) {
+        syslog(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
+            full_path, filt->filter_name, strerror(errno));
+    } else
+        place_layer(filt, out);
+    free(full_path);
+    return res;
+}
+
+/**
+ * Appends a layer to the pack of a filter, creating the pack
+ * for the first layer. The space is reserved and mapped before
+ * the layer is added to the header, so a crash part way leaves
+ * only unused space at the end of the pack. The header is made
+ * durable by the next flush of any layer, which syncs the pack.
+ * @arg newest The bitmap of the newest layer, or NULL if
+ * there are no layers yet
+ * @arg bytes The size of the new layer
+ * @arg out Output, set to the bitmap of the new layer
+ * @return 0 on success, negative on error.
+ */
+static int append_packed_layer(bloom_filter *f, bloom_bitmap *newest, uint64_t bytes, bloom_bitmap *out) {
+    char *pack_path = join_path(f->full_path, (char*)PACK_FILE_NAME);
+    pack_header header;
+    int res = -1;
+
+    // A pack left behind without layers is started over
+    int fd = (newest) ? newest->fileno : open(pack_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_CRIT, "Failed to create the pack %s for filter %s. Err: %s",
+                pack_path, f->filter_name, strerror(errno));
+        goto LEAVE;
+    }
+    if (newest) {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            syslog(LOG_ERR, "Failed to read the pack %s. %s", pack_path, strerror(errno));
+            goto LEAVE;
+        }
+    } else {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    }
+    uint32_t num = header.num_layers;
+    if (num >= PACK_MAX_LAYERS) {
+        syslog(LOG_ERR, "Filter '%s' has the most layers a pack can hold, and will not grow.",
+                f->filter_name);
+        res = -EFBIG;
+        goto LEAVE;
+    }
+
+    // Layers start on a page, after the header or the previous layer
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t offset = (num) ? header.layers[num - 1].offset + header.layers[num - 1].size : PACK_HEADER_SIZE;
+    offset += (page - offset % page) % page;
+    syslog(LOG_INFO, "Appending layer %u to %s for filter %s. Size: %llu",
+            num, pack_path, f->filter_name, (unsigned long long)bytes);
+    if (ftruncate(fd, offset + bytes)) {
+        syslog(LOG_CRIT, "Failed to grow the pack %s for filter %s. Err: %s",
+                pack_path, f->filter_name, strerror(errno));
+        goto LEAVE;
+    }
+    res = bitmap_from_file_at(fd, newest, offset, bytes, bloomf_bitmap_mode(f, 0) | NEW_BITMAP, out);
+    if (res) {
+        syslog(LOG_CRIT, "Failed to map layer %u of the pack %s for filter %s. Err: %s",
+                num, pack_path, f->filter_name, strerror(-res));
+        goto LEAVE;
+    }
+
+    // Add the layer before counting it, so a reader
+    // never counts a layer that is not indexed yet
+    header.layers[num].offset = offset;
+    header.layers[num].size = bytes;
+    header.num_layers = num + 1;
+    uint64_t entry = offsetof(pack_header, layers) + num * sizeof(pack_layer);
+    if ((!newest && pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) ||
+            (newest && (pwrite(fd, header.layers + num, sizeof(pack_layer), entry) != sizeof(pack_layer) ||
+            pwrite(fd, &header.num_layers, sizeof(uint32_t), offsetof(pack_header, num_layers)) != sizeof(uint32_t)))) {
+        syslog(LOG_CRIT, "Failed to write the header of the pack %s for filter %s. Err: %s",
+                pack_path, f->filter_name, strerror(errno));
+        bitmap_close(out);
+        fd = -1;
+        res = -1;
+        goto LEAVE;
+    }
+    place_layer(f, out);
+
+LEAVE:
+    // The new layer owns the pack once it is mapped
+    if (res && !newest) {
+        if (fd >= 0) close(fd);
+        unlink(pack_path);
+    }
+    free(pack_path);
+    return res;
+}
+
+/**
+ * Renames a layer prepared by bloomf_prepare_layer into place
+ * as the next layer. The spare is discarded if it does not fit,
+ * such as when the filter was compacted since it was prepared.
+ * @arg spare The spare layer, which is freed
+ * @arg bytes The size of the next layer
+ * @arg out Output, set to the bitmap of the next layer
+ * @return 0 on success, -1 if the spare was discarded.
+ */
+static int use_spare_layer(bloom_filter *f, bloom_bitmap *spare, uint64_t bytes, bloom_bitmap *out) {
+    char *spare_path = join_path(f->full_path, (char*)SPARE_FILE_NAME);
+    bloom_sbf *sbf = (bloom_sbf*)f->sbf;
+    int res = -1;
+
+    // Layers are numbered in order, linking fails
+    // rather than replace an existing layer
+    if (sbf && spare->size == bytes) {
+        char *filename = NULL;
+        int file_name_len = asprintf(&filename, DATA_FILE_NAME, sbf->num_filters);
+        assert(file_name_len != -1);
+        char *full_path = join_path(f->full_path, filename);
+        free(filename);
+
+        res = link(spare_path, full_path);
+        if (!res) {
+            rename_checksums(spare_path, full_path);
+            unlink(spare_path);
+            memcpy(out, spare, sizeof(bloom_bitmap));
+
+            // The layer is new from now on, not from when it was made
+            if (f->sync_clock) bitmap_track_changes(out, f->sync_clock);
+            syslog(LOG_INFO, "Using the prepared layer %s for filter %s.",
+                    full_path, f->filter_name);
+        }
+        free(full_path);
+    }
+
+    if (res) {
+        bitmap_close(spare);
+        bitmap_unlink(spare_path);
+    }
+    free(spare);
+    free(spare_path);
+    return res;
+}
+
+/**
+ * Closes and removes the spare layer of a filter, if any.
+ */
+static void discard_spare_layer(bloom_filter *f) {
+    bloom_bitmap *spare = __atomic_exchange_n(&f->spare, NULL, __ATOMIC_ACQ_REL);
+    if (!spare) return;
+    bitmap_close(spare);
+    free(spare);
+
+    char *spare_path = join_path(f->full_path, (char*)SPARE_FILE_NAME);
+    bitmap_unlink(spare_path);
+    free(spare_path);
+}
+
+/**
+ * Moves the checksums of a layer along with its file. The
+ * checksums stay mapped, and match the file by its inode.
+ */
+static void rename_checksums(char *from, char *to) {
+    char *from_crc = NULL, *to_crc = NULL;
+    if (asprintf(&from_crc, "%s%s", from, BITMAP_CHECKSUM_SUFFIX) != -1 &&
+            asprintf(&to_crc, "%s%s", to, BITMAP_CHECKSUM_SUFFIX) != -1) {
+        if (rename(from_crc, to_crc) && errno != ENOENT) {
+            syslog(LOG_WARNING, "Failed to rename %s. %s", from_crc, strerror(errno));
+        }
+    }
+    free(from_crc);
+    free(to_crc);
+}
+
+/**
+ * Places a layer on the NUMA node of the filter, which is the
+ * node of the thread that first faults it in. Layers of at least
+ * numa_interleave_mb are interleaved over every node instead, so
+ * one huge filter does not fill up a single node. The layers of a
+ * pinned filter are then faulted in and locked in memory, so its
+ * checks never wait on the disk.
+ */
+static void place_layer(bloom_filter *f, bloom_bitmap *map) {
+    int res;
+    if (f->config->use_numa && numa_nodes() > 1) {
+        if (f->numa_node < 0) f->numa_node = numa_this_node();
+
+        uint64_t interleave = (uint64_t)f->config->numa_interleave_mb * 1024 * 1024;
+        int node = (interleave && map->size >= interleave) ? -1 : f->numa_node;
+        res = bitmap_numa_place(map, node, numa_nodes());
+        if (res) {
+            syslog(LOG_WARNING, "Failed to place a layer of filter '%s' on NUMA node %d. %s",
+                    f->filter_name, node, strerror(-res));
+        }
+    }
+
+    // Stamp the pages that change for catching up replicas
+    if (f->sync_clock && bitmap_track_changes(map, f->sync_clock)) {
+        syslog(LOG_WARNING, "Failed to track the changes of a layer of filter '%s'.", f->filter_name);
+    }
+
+    // Locked once placed, so the pages fault in on the right node
+    if (!f->filter_config.pinned) return;
+    res = bitmap_lock(map);
+    if (res && res != -EINVAL) {
+        syslog(LOG_WARNING, "Failed to lock a layer of filter '%s' in memory. %s",
+                f->filter_name, strerror(-res));
+    }
+}
+
+/**
+ * Checks if the layers of a filter only ever change by bits
+ * being set, so their changed pages can be merged into a copy.
+ */
+static int changes_trackable(bloom_filter *f) {
+    bloom_filter_config *fc = &f->filter_config;
+    return !fc->rotate_window && !fc->shards && !fc->freezable && !fc->frozen &&
+        !fc->summary_capacity && !fc->key_ttl &&
+        (fc->layout == BLOOM_LAYOUT_PARTITIONED || fc->layout == BLOOM_LAYOUT_BLOCKED);
+}
+
+/**
+ * Callback used with the set log to replay keys into an SBF.
+ */
+static int bloomf_replay_callback(void *in, char **keys, int *key_lens, int num_keys) {
+    char result[num_keys];
+    return sbf_add_many_len((bloom_sbf*)in, keys, key_lens, num_keys, result);
+}
+
+/**
+ * Returns the path of the snapshot directory of a filter,
+ * which the caller must free.
+ * @arg suffix Appended to the directory name
+ */
+static char* snapshot_path(bloom_filter *f, const char *suffix) {
+    char *folder_name = NULL, *snap_name = NULL;
+    int res = asprintf(&folder_name, FILTER_FOLDER_NAME, f->filter_name);
+    assert(res != -1);
+    res = asprintf(&snap_name, "%s/%s%s", SNAPSHOT_FOLDER_NAME, folder_name, suffix);
+    assert(res != -1);
+    char *path = join_path(f->config->data_dir, snap_name);
+    free(folder_name);
+    free(snap_name);
+    return path;
+}
+
+/**
+ * Creates the file a snapshot layer is copied to.
+ * @arg dir The snapshot directory
+ * @arg num The number of the data file
+ * @arg size The size of the layer
+ * @return The file descriptor, or -1 on error.
+ */
+static int open_snapshot_layer(char *dir, int num, uint64_t size) {
+    char *filename = NULL;
+    int res = asprintf(&filename, DATA_FILE_NAME, num);
+    assert(res != -1);
+    char *full_path = join_path(dir, filename);
+    free(filename);
+
+    int fd = open(full_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size)) {
+        syslog(LOG_ERR, "Failed to create snapshot file '%s'. %s", full_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    free(full_path);
+    return fd;
+}
 
-    // Free the memory associated with scandir
+/**
+ * Deletes a directory and the files in it, if it exists.
+ */
+static void delete_flat_dir(char *path) {
+    struct dirent **namelist = NULL;
+    int num = scandir(path, &namelist, filter_out_special, NULL);
     for (int i=0; i < num; i++) {
-        char *file_path = join_path(filter->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Deleting: %s.", file_path);
-        if (unlink(file_path)) {
-            syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
-        }
+        char *file_path = join_path(path, namelist[i]->d_name);
+        unlink(file_path);
         free(file_path);
+        free(namelist[i]);
     }
+    if (namelist) free(namelist);
+    if (num >= 0) rmdir(path);
+}
 
-    // Free the memory associated with scandir
+/**
+ * Initializes a generation of a rotating filter. The generation
+ * is a plain filter in a sub-directory, faulted in on-demand.
+ * @arg bucket The time bucket the generation starts at
+ * @arg gen Output, the new generation
+ * @return 0 on success.
+ */
+static int init_generation(bloom_filter *f, uint64_t bucket, bloom_filter **gen) {
+    // The generations share the settings of the filter
+    bloom_filter_config filter_config = f->filter_config;
+    filter_config.rotate_window = 0;
+    filter_config.rotate_generations = 0;
+    filter_config.size = 0;
+    filter_config.capacity = filter_config.initial_capacity;
+    filter_config.bytes = 0;
+
+    char *folder_name = NULL, *gen_name = NULL;
+    int res = asprintf(&folder_name, GENERATION_FOLDER_NAME, (unsigned long long)bucket);
+    assert(res != -1);
+    res = asprintf(&gen_name, "%s@%llu", f->filter_name, (unsigned long long)bucket);
+    assert(res != -1);
+
+    char *full_path = join_path(f->full_path, folder_name);
+    res = init_filter(f->config, gen_name, full_path, &filter_config, 0, 0, gen);
+    free(folder_name);
+    free(gen_name);
+    if (res) {
+        if (*gen) destroy_bloom_filter(*gen);
+        *gen = NULL;
+    } else
+        (*gen)->owner = f;
+    return res;
+}
+
+/**
+ * Discovers the existing generations of a rotating filter.
+ * Expired generations are deleted by the bloomf_rotate that follows.
+ * @return 0 on success. -1 on error.
+ */
+static int discover_generations(bloom_filter *f) {
+    struct dirent **namelist;
+    int num = scandir(f->full_path, &namelist, filter_generation_dirs, NULL);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan generations for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+    syslog(LOG_INFO, "Found %d generations for filter %s.", num, f->filter_name);
+
+    int res = 0;
+    bloom_filter_generations *gens = alloc_generations(num);
     for (int i=0; i < num; i++) {
+        unsigned long long bucket;
+        sscanf(namelist[i]->d_name, GENERATION_FOLDER_NAME, &bucket);
+        if (!res) {
+            gens->gens[gens->num].bucket = bucket;
+            res = init_generation(f, bucket, &gens->gens[gens->num].filter);
+            if (!res) gens->num++;
+        }
         free(namelist[i]);
     }
-    if (namelist)
-        free(namelist);
+    free(namelist);
 
-    // Delete the directory
-    if (rmdir(filter->full_path)) {
-        syslog(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
+    // Keep the newest generation first
+    qsort(gens->gens, gens->num, sizeof(bloom_filter_generation), compare_generations);
+    f->gens = gens;
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Works with scandir to find the generation directories
+ */
+static int filter_generation_dirs(CONST_DIRENT_T *d) {
+    unsigned long long bucket;
+    int len = 0;
+    if (sscanf(d->d_name, "gen.%llu%n", &bucket, &len) != 1) return 0;
+    return d->d_name[len] == '\0';
+}
+
+/**
+ * Orders the generations newest first
+ */
+static int compare_generations(const void *a, const void *b) {
+    const bloom_filter_generation *ga = a, *gb = b;
+    if (ga->bucket == gb->bucket) return 0;
+    return (ga->bucket > gb->bucket) ? -1 : 1;
+}
+
+/**
+ * Allocates an empty set of generations, with
+ * room for the given number of generations.
+ */
+static bloom_filter_generations* alloc_generations(uint32_t num) {
+    bloom_filter_generations *gens = calloc(1, sizeof(bloom_filter_generations) +
+            num * sizeof(bloom_filter_generation));
+    return gens;
+}
+
+/**
+ * Checks the generations of a rotating filter for keys. Each
+ * generation is only checked for the keys that are not yet found.
+ * @arg start The index of the first generation to check
+ * @arg found Input and output, set to 1 for each key that is found.
+ * Keys that are already set are not checked.
+ * @return 0 on success, -1 on error.
+ */
+static int generations_contains(bloom_filter_generations *gens, uint32_t start,
+        char **keys, int *key_lens, int num_keys, char *found) {
+    char **pending = malloc(num_keys * sizeof(char*));
+    int *pending_lens = malloc(num_keys * sizeof(int));
+    int *index = malloc(num_keys * sizeof(int));
+    char *result = malloc(num_keys);
+
+    // Measure the keys once for all of the generations
+    int num_pending = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (found[i]) continue;
+        index[num_pending] = i;
+        pending_lens[num_pending] = (key_lens) ? key_lens[i] : (int)strlen(keys[i]);
+        pending[num_pending++] = keys[i];
     }
 
-    return 0;
+    int res = 0;
+    for (uint32_t g=start; g < gens->num && num_pending; g++) {
+        bloom_sbf *sbf = faulted_sbf(gens->gens[g].filter);
+        if (!sbf || sbf_contains_many_len(sbf, pending, pending_lens, num_pending, result)) {
+            res = -1;
+            break;
+        }
+
+        // Keep the keys that are still missing
+        int missing = 0;
+        for (int i=0; i < num_pending; i++) {
+            if (result[i]) {
+                found[index[i]] = 1;
+            } else {
+                index[missing] = index[i];
+                pending_lens[missing] = pending_lens[i];
+                pending[missing++] = pending[i];
+            }
+        }
+        num_pending = missing;
+    }
+
+    free(pending);
+    free(pending_lens);
+    free(index);
+    free(result);
+    return res;
 }
 
 /**
- * Checks if the filter contains a given key
- * @note Thread safe, as long as bloomf_add is not invoked.
- * @arg filter The filter to check
- * @arg key The key to check
- * @return 0 if not contained, 1 if contained.
+ * Checks the generations of a filter for hashed keys, like
+ * generations_contains, so each key is hashed once for all
+ * of the generations.
+ * @arg found Set to 1 for the keys found. Keys already
+ * found are skipped.
+ * @return 0 on success, -1 on error.
  */
-int bloomf_contains(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
-        if (thread_safe_fault(filter) != 0) return -1;
+static int generations_contains_hashed(bloom_filter_generations *gens,
+        bloom_hashed_key *keys, int num_keys, char *found) {
+    bloom_hashed_key *pending = malloc(num_keys * sizeof(bloom_hashed_key));
+    int *index = malloc(num_keys * sizeof(int));
+    char *result = malloc(num_keys);
+
+    int num_pending = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (found[i]) continue;
+        index[num_pending] = i;
+        pending[num_pending++] = keys[i];
     }
 
-    // Check the SBF
-    int res = sbf_contains((bloom_sbf*)filter->sbf, key);
+    int res = 0;
+    for (uint32_t g=0; g < gens->num && num_pending; g++) {
+        bloom_sbf *sbf = faulted_sbf(gens->gens[g].filter);
+        if (!sbf || sbf_contains_hashed_many(sbf, pending, num_pending, result)) {
+            res = -1;
+            break;
+        }
 
-    // Safely update the counters
-    LOCK_BLOOM_SPIN(&filter->counter_lock);
-    if (res == 1)
-        filter->counters.check_hits += 1;
-    else if (res == 0)
-        filter->counters.check_misses += 1;
-    UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+        // Keep the keys that are still missing, with their hashes
+        int missing = 0;
+        for (int i=0; i < num_pending; i++) {
+            if (result[i]) {
+                found[index[i]] = 1;
+            } else {
+                index[missing] = index[i];
+                pending[missing++] = pending[i];
+            }
+        }
+        num_pending = missing;
+    }
 
+    free(pending);
+    free(index);
+    free(result);
     return res;
 }
 
 /**
- * Adds a key to the given filter
- * @arg filter The filter to add to
- * @arg key The key to add
- * @return 0 if not added, 1 if added.
+ * Flushes the generations of a rotating filter, and writes out
+ * the filter config if the totals of the generations changed.
+ * @arg force Write out the filter config even if nothing changed
+ * @arg sync If 0, only write back the layers, like bloomf_write
+ * @return 0 on success.
  */
-int bloomf_add(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
-        if (thread_safe_fault(filter) != 0) return -1;
+static int flush_generations(bloom_filter *f, int force, int sync) {
+    int res = 0;
+    bloom_filter_generations *gens = f->gens;
+    for (uint32_t i=0; i < gens->num; i++) {
+        res |= flush_filter(gens->gens[i].filter, sync);
     }
 
-    // Add the SBF
-    int res = sbf_add((bloom_sbf*)filter->sbf, key);
+    uint64_t size = bloomf_size(f);
+    uint64_t capacity = bloomf_capacity(f);
+    uint64_t bytes = bloomf_byte_size(f);
+    if (force || size != f->filter_config.size || capacity != f->filter_config.capacity ||
+            bytes != f->filter_config.bytes) {
+        f->filter_config.size = size;
+        f->filter_config.capacity = capacity;
+        f->filter_config.bytes = bytes;
+        write_filter_config(f);
+    }
+    refresh_meta(f);
+    return res;
+}
 
-    // Safely update the counters
-    LOCK_BLOOM_SPIN(&filter->counter_lock);
-    if (res == 1)
-        filter->counters.set_hits += 1;
-    else if (res == 0)
-        filter->counters.set_misses += 1;
-    UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+/**
+ * Initializes the shards of a sharded filter. The shards
+ * share the settings of the filter, and split its capacity.
+ * @arg discover Should the shards be faulted in
+ * @return 0 on success.
+ */
+static int init_keyshards(bloom_filter *f, int discover) {
+    uint32_t num = f->filter_config.shards;
+    bloom_filter_keyshards *ks = calloc(1, sizeof(bloom_filter_keyshards) +
+            num * sizeof(bloom_filter_shard));
+    f->keyshards = ks;
 
+    bloom_filter_config filter_config = f->filter_config;
+    filter_config.shards = 0;
+    filter_config.initial_capacity = (filter_config.initial_capacity + num - 1) / num;
+    filter_config.size = 0;
+    filter_config.capacity = filter_config.initial_capacity;
+    filter_config.bytes = 0;
+
+    int res = 0;
+    for (uint32_t i=0; i < num && !res; i++) {
+        char *folder_name = NULL, *shard_name = NULL;
+        res = asprintf(&folder_name, SHARD_FOLDER_NAME, i);
+        assert(res != -1);
+        res = asprintf(&shard_name, "%s#%u", f->filter_name, i);
+        assert(res != -1);
+
+        bloom_filter_shard *s = ks->shards + i;
+        char *full_path = join_path(f->full_path, folder_name);
+        res = init_filter(f->config, shard_name, full_path, &filter_config, discover, 0, &s->filter);
+        free(folder_name);
+        free(shard_name);
+        if (res) {
+            syslog(LOG_ERR, "Failed to initialize shard %u of filter '%s'. Err: %d",
+                    i, f->filter_name, res);
+            if (s->filter) destroy_bloom_filter(s->filter);
+            s->filter = NULL;
+            break;
+        }
+        pthread_rwlock_init(&s->lock, NULL);
+        s->filter->owner = f;
+        refresh_meta(s->filter);
+        ks->num++;
+    }
     return res;
 }
 
 /**
- * Gets the size of the filter in keys
- * @note Thread safe.
- * @arg filter The filter to check
- * @return The total size of the filter
+ * Flushes the shards of a sharded filter, and writes out
+ * the filter config if the totals of the shards changed.
+ * Each shard is flushed under its own lock, so only the
+ * shard being flushed waits to grow.
+ * @arg force Write out the filter config even if nothing changed
+ * @arg sync If 0, only write back the layers, like bloomf_write
+ * @return 0 on success.
  */
-uint64_t bloomf_size(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_size((bloom_sbf*)filter->sbf);
-    } else {
-        return filter->filter_config.size;
+static int flush_keyshards(bloom_filter *f, int force, int sync) {
+    int res = 0;
+    bloom_filter_keyshards *ks = f->keyshards;
+    for (uint32_t i=0; i < ks->num; i++) {
+        pthread_rwlock_rdlock(&ks->shards[i].lock);
+        res |= flush_filter(ks->shards[i].filter, sync);
+        pthread_rwlock_unlock(&ks->shards[i].lock);
+    }
+
+    filter_meta meta;
+    keyshards_meta(f, &meta);
+    if (force || meta.size != f->filter_config.size || meta.capacity != f->filter_config.capacity ||
+            meta.bytes != f->filter_config.bytes) {
+        f->filter_config.size = meta.size;
+        f->filter_config.capacity = meta.capacity;
+        f->filter_config.bytes = meta.bytes;
+        write_filter_config(f);
     }
+    return res;
 }
 
 /**
- * Gets the maximum capacity of the filter
- * @note Thread safe.
- * @arg filter The filter to check
- * @return The total capacity of the filter
+ * Sums the cached metadata of the shards of a filter. The
+ * layers of a shard may be growing, so they are never read.
  */
-uint64_t bloomf_capacity(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_total_capacity((bloom_sbf*)filter->sbf);
-    } else {
-        return filter->filter_config.capacity;
+static void keyshards_meta(bloom_filter *f, filter_meta *meta) {
+    memset(meta, 0, sizeof(filter_meta));
+    bloom_filter_keyshards *ks = f->keyshards;
+    for (uint32_t i=0; i < ks->num; i++) {
+        filter_meta shard;
+        bloomf_meta(ks->shards[i].filter, &shard);
+        meta->size += shard.size;
+        meta->capacity += shard.capacity;
+        meta->bytes += shard.bytes;
     }
 }
 
 /**
- * Gets the current byte size of the filter
- * @note Thread safe.
- * @arg filter The filter
- * @return The total byte size of the filter
+ * Hashes a key to its shard. FNV-1a is independent of the
+ * hashes used by the layers, so the keys of each shard are
+ * still spread evenly over its bits.
  */
-uint64_t bloomf_byte_size(bloom_filter *filter) {
-    if (filter->sbf) {
-        return sbf_total_byte_size((bloom_sbf*)filter->sbf);
+static uint32_t key_shard(bloom_filter_keyshards *ks, char *key, int len) {
+    uint32_t hash = 2166136261U;
+    unsigned char *c = (unsigned char*)key;
+    for (int i=0; i < len; i++) {
+        hash ^= c[i];
+        hash *= 16777619U;
+    }
+    return ((uint64_t)hash * ks->num) >> 32;
+}
+
+/**
+ * Applies an operation to keys of a sharded filter. The keys
+ * are grouped by shard, so each shard is locked once.
+ * @return 0 on success, or the error of the shard that failed.
+ */
+static int keyshards_op(bloom_filter *f, char **keys, int *key_lens, int num_keys, char *result, shard_op_type op) {
+    bloom_filter_keyshards *ks = f->keyshards;
+    if (num_keys == 1) {
+        int len = (key_lens) ? key_lens[0] : (int)strlen(keys[0]);
+        return shard_op(ks->shards + key_shard(ks, keys[0], len), keys, &len, 1, result, op);
+    }
+
+    // Group the keys with a counting sort, keeping the
+    // position each key is moved to. The lengths measured
+    // to find the shards are passed on to the shards.
+    uint32_t *pos = malloc(num_keys * sizeof(uint32_t));
+    int *lens = malloc(num_keys * sizeof(int));
+    char **grouped = malloc(num_keys * sizeof(char*));
+    int *grouped_lens = malloc(num_keys * sizeof(int));
+    char *grouped_result = malloc(num_keys);
+    int starts[MAX_FILTER_SHARDS + 1];
+    int next[MAX_FILTER_SHARDS];
+    memset(starts, 0, sizeof(starts));
+    for (int i=0; i < num_keys; i++) {
+        lens[i] = (key_lens) ? key_lens[i] : (int)strlen(keys[i]);
+        pos[i] = key_shard(ks, keys[i], lens[i]);
+        starts[pos[i] + 1]++;
+    }
+    for (uint32_t s=0; s < ks->num; s++) {
+        starts[s + 1] += starts[s];
+        next[s] = starts[s];
+    }
+    for (int i=0; i < num_keys; i++) {
+        pos[i] = next[pos[i]]++;
+        grouped[pos[i]] = keys[i];
+        grouped_lens[pos[i]] = lens[i];
+    }
+
+    int res = 0;
+    for (uint32_t s=0; s < ks->num && !res; s++) {
+        int num = starts[s + 1] - starts[s];
+        if (num) res = shard_op(ks->shards + s, grouped + starts[s], grouped_lens + starts[s],
+                num, grouped_result + starts[s], op);
+    }
+    for (int i=0; i < num_keys && !res; i++) {
+        result[i] = grouped_result[pos[i]];
+    }
+
+    free(pos);
+    free(lens);
+    free(grouped);
+    free(grouped_lens);
+    free(grouped_result);
+    return res;
+}
+
+/**
+ * Applies an operation to keys of a single shard, under
+ * the shard lock. Sets that must grow the shard are retried
+ * under the exclusive lock, like the filter manager does
+ * for a plain filter.
+ * @return 0 on success, or the error of the operation.
+ */
+static int shard_op(bloom_filter_shard *s, char **keys, int *key_lens, int num_keys, char *result, shard_op_type op) {
+    int res;
+    lock_shard(s, 0);
+    switch (op) {
+        case SHARD_CONTAINS:
+            res = bloomf_contains_many_len(s->filter, keys, key_lens, num_keys, result);
+            break;
+        case SHARD_REMOVE:
+            res = bloomf_remove_many_len(s->filter, keys, key_lens, num_keys, result);
+            break;
+        default:
+            res = bloomf_try_add_many_len(s->filter, keys, key_lens, num_keys, result);
+            break;
+    }
+    pthread_rwlock_unlock(&s->lock);
+    if (op != SHARD_ADD || res < 0) return res;
+    if (res == num_keys) return 0;
+
+    lock_shard(s, 1);
+    res = bloomf_add_many_len(s->filter, keys + res, key_lens + res, num_keys - res, result + res);
+    pthread_rwlock_unlock(&s->lock);
+    return res;
+}
+
+/**
+ * Acquires the lock of a shard. The wait is recorded in
+ * the counters of the shard if the lock is contended.
+ * @arg exclusive Should the write lock be acquired
+ */
+static void lock_shard(bloom_filter_shard *s, int exclusive) {
+    if (!((exclusive) ? pthread_rwlock_trywrlock(&s->lock) : pthread_rwlock_tryrdlock(&s->lock))) return;
+    uint64_t start = latency_now();
+    if (exclusive)
+        pthread_rwlock_wrlock(&s->lock);
+    else
+        pthread_rwlock_rdlock(&s->lock);
+    bloomf_record_lock_wait(s->filter, latency_now() - start);
+}
+
+/**
+ * Computes the difference in time in milliseconds
+ * between two timeval structures.
+ */
+static int timediff_msec(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
+
+/**
+ * Loads the xor filter of a frozen filter.
+ * Must be called with sbf_lock held.
+ * @return 0 on success, -1 on error.
+ */
+static int load_frozen_filter(bloom_filter *f) {
+    char *path = join_path(f->full_path, (char*)FROZEN_FILE_NAME);
+    uint64_t size = get_size(path);
+    if (size == 0) {
+        syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    int res = bitmap_from_filename(path, size, 0, bloomf_bitmap_mode(f, 0) & ~CHECKSUMS, map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", path, strerror(errno));
+        free(map);
+        free(path);
+        return -1;
+    }
+
+    bloom_xorfilter *xf = malloc(sizeof(bloom_xorfilter));
+    res = xf_from_bitmap(map, xf);
+    if (res) {
+        syslog(LOG_ERR, "Failed to load xor filter for: %s. [%d]", path, res);
+        bitmap_close(map);
+        free(map);
+        free(xf);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    // Publish once loaded, readers check without the lock
+    __atomic_store_n(&f->frozen, xf, __ATOMIC_RELEASE);
+    f->counters.page_ins += 1;
+    syslog(LOG_INFO, "Loaded frozen filter: %s. Keys: %llu.", f->filter_name,
+            (unsigned long long)xf_size(xf));
+    return 0;
+}
+
+/**
+ * Returns the xor filter of a frozen filter, faulting it in if needed.
+ * @return The xor filter, or NULL if it could not be faulted in.
+ */
+static bloom_xorfilter* faulted_frozen(bloom_filter *f) {
+    bloom_xorfilter *xf = (bloom_xorfilter*)__atomic_load_n(&f->frozen, __ATOMIC_ACQUIRE);
+    if (!xf) {
+        if (thread_safe_fault(f) != 0) return NULL;
+        xf = (bloom_xorfilter*)__atomic_load_n(&f->frozen, __ATOMIC_ACQUIRE);
+    }
+    return xf;
+}
+
+/**
+ * Checks many keys against an xor filter, hashing
+ * the keys a batch at a time.
+ * @return 0 on success.
+ */
+static int frozen_contains_many(bloom_xorfilter *xf, char **keys, int *key_lens, int num_keys, char *result) {
+    bloom_hashed_key hks[BLOOM_BATCH_SIZE];
+    memset(result, 0, num_keys);
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+        for (int i=0; i < n; i++) {
+            if (key_lens)
+                bf_hashed_key_init_len(hks + i, keys[base + i], key_lens[base + i]);
+            else
+                bf_hashed_key_init(hks + i, keys[base + i]);
+        }
+        xf_contains_many(xf, hks, n, result + base);
+    }
+    return 0;
+}
+
+/*
+ * The hashes of the staged keys, gathered for a freeze.
+ */
+typedef struct {
+    uint64_t *hashes;
+    uint64_t num;
+    uint64_t size;
+} staged_hashes;
+
+/**
+ * Callback used with the staged keys to hash them for a freeze.
+ */
+static int bloomf_stage_callback(void *in, char **keys, int *key_lens, int num_keys) {
+    staged_hashes *staged = in;
+    if (staged->num + num_keys > staged->size) {
+        uint64_t size = (staged->size) ? staged->size : 4096;
+        while (size < staged->num + num_keys) size *= 2;
+        uint64_t *hashes = realloc(staged->hashes, size * sizeof(uint64_t));
+        if (!hashes) return -1;
+        staged->hashes = hashes;
+        staged->size = size;
+    }
+    for (int i=0; i < num_keys; i++) {
+        bloom_hashed_key hk;
+        bf_hashed_key_init_len(&hk, keys[i], key_lens[i]);
+        staged->hashes[staged->num++] = xf_hash_key(&hk);
+    }
+    return 0;
+}
+
+/**
+ * Builds the xor filter of the staged keys into the frozen
+ * file. The filter is written to a temporary file, which is
+ * synced and renamed into place.
+ * @arg num_keys Output, the number of unique keys
+ * @arg bytes Output, the size of the frozen file
+ * @return 0 on success, -1 on error.
+ */
+static int build_frozen_file(bloom_filter *f, uint64_t *num_keys, uint64_t *bytes) {
+    staged_hashes staged = {NULL, 0, 0};
+    int res = setlog_replay(f->staged, bloomf_stage_callback, &staged);
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to read the staged keys of filter '%s'.", f->filter_name);
+        free(staged.hashes);
+        return -1;
+    }
+    *num_keys = xf_unique_hashes(staged.hashes, staged.num);
+    uint32_t bits = xf_fingerprint_bits(f->filter_config.default_probability);
+    *bytes = xf_bytes_for_keys(*num_keys, bits);
+
+    // Build the filter in a temporary file
+    char *tmp_path = join_path(f->full_path, (char*)FROZEN_TMP_NAME);
+    char *path = join_path(f->full_path, (char*)FROZEN_FILE_NAME);
+    unlink(tmp_path);
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    res = bitmap_from_filename(tmp_path, *bytes, 1, bloomf_bitmap_mode(f, 0) & ~CHECKSUMS, map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create new file: %s for filter %s. Err: %s",
+            tmp_path, f->filter_name, strerror(errno));
+        free(map);
+        goto LEAVE;
+    }
+
+    bloom_xorfilter xf;
+    res = xf_build(map, staged.hashes, *num_keys, bits, &xf);
+    if (res) {
+        syslog(LOG_ERR, "Failed to build the xor filter of filter '%s'. Err: %d",
+                f->filter_name, res);
+        bitmap_close(map);
     } else {
-        return filter->filter_config.bytes;
+        res = xf_close(&xf);
+    }
+    free(map);
+
+    // Move the durable filter into place
+    if (!res && rename(tmp_path, path)) {
+        syslog(LOG_ERR, "Failed to rename %s. %s", tmp_path, strerror(errno));
+        res = -1;
+    }
+    if (!res) sync_filter_dir(f);
+
+LEAVE:
+    if (res) unlink(tmp_path);
+    free(tmp_path);
+    free(path);
+    free(staged.hashes);
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Removes the data files of the SBF of a filter, including
+ * the pack, any compressed layers and the summary.
+ */
+static void delete_sbf_files(bloom_filter *f) {
+    char *summary_path = join_path(f->full_path, (char*)SUMMARY_FILE_NAME);
+    unlink(summary_path);
+    free(summary_path);
+
+    int (*filters[])(CONST_DIRENT_T *) = {filter_layer_files, filter_compressed_files};
+    for (int j=0; j < 2; j++) {
+        struct dirent **namelist = NULL;
+        int num = scandir(f->full_path, &namelist, filters[j], NULL);
+        for (int i=0; i < num; i++) {
+            char *file_path = join_path(f->full_path, namelist[i]->d_name);
+            int res = bitmap_unlink(file_path);
+            if (res) {
+                syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(-res));
+            }
+            free(file_path);
+            free(namelist[i]);
+        }
+        if (namelist) free(namelist);
+    }
+}
+
+/**
+ * Callback used with the staged keys to add them to a compacted layer.
+ */
+static int bloomf_compact_callback(void *in, char **keys, int *key_lens, int num_keys) {
+    bloom_bloomfilter *bf = in;
+    bloom_hashed_key hk;
+    for (int i=0; i < num_keys; i++) {
+        bf_hashed_key_init_len(&hk, keys[i], key_lens[i]);
+        if (bf_add_hashed(bf, &hk) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Builds a single layer holding the staged keys into a
+ * temporary file, which is flushed and closed.
+ * @arg params The SBF params of the layer
+ * @arg layer The parameters of the layer
+ * @arg num_keys Output, the number of keys in the layer
+ * @return 0 on success, -1 on error.
+ */
+static int build_compact_file(bloom_filter *f, bloom_sbf_params *params,
+        bloom_filter_params *layer, uint64_t *num_keys) {
+    char *tmp_path = join_path(f->full_path, (char*)COMPACT_TMP_NAME);
+    bitmap_unlink(tmp_path);
+    bloom_bitmap map;
+    int res = bitmap_from_filename(tmp_path, layer->bytes, 1, bloomf_bitmap_mode(f, 0), &map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create new file: %s for filter %s. Err: %s",
+            tmp_path, f->filter_name, strerror(errno));
+        goto LEAVE;
+    }
+
+    bloom_bloomfilter bf;
+    res = bf_from_bitmap_format(&map, layer->k_num, &params->format, 1, &bf);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create the compacted layer of filter '%s'. Err: %d",
+                f->filter_name, res);
+        bitmap_close(&map);
+        goto LEAVE;
+    }
+
+    if (setlog_replay(f->staged, bloomf_compact_callback, &bf) < 0) {
+        syslog(LOG_ERR, "Failed to read the staged keys of filter '%s'.", f->filter_name);
+        res = -1;
     }
+    *num_keys = bf_size(&bf);
+    if (bf_close(&bf)) res = -1;
+
+LEAVE:
+    if (res) unlink(tmp_path);
+    free(tmp_path);
+    return (res) ? -1 : 0;
 }
 
 /**
- * Provides a thread safe faulting of filters.
- * The main use case of this is to allow
- * bloomf_contains to be safe.
+ * Renames a layer built in the folder of a filter over its first
+ * layer, and removes its other layers. The filter must be closed.
+ * @arg tmp_name The name of the new layer in the folder
+ * @arg num_layers The layers the filter had
+ * @return 0 on success, -1 on error.
  */
-static int thread_safe_fault(bloom_filter *f) {
-    // Acquire lock
-    pthread_mutex_lock(&f->sbf_lock);
+static int replace_layers(bloom_filter *f, const char *tmp_name, uint32_t num_layers) {
+    // Replace the first layer, then remove the newest layers first.
+    // If we crash part way, the remaining layers are still a valid
+    // SBF that contains every key.
+    char *tmp_path = join_path(f->full_path, (char*)tmp_name);
+    char *data_name = NULL;
+    int res = asprintf(&data_name, DATA_FILE_NAME, 0);
+    assert(res != -1);
+    char *data_path = join_path(f->full_path, data_name);
+    free(data_name);
+    res = rename(tmp_path, data_path);
+    if (res) {
+        syslog(LOG_ERR, "Failed to rename %s. %s", tmp_path, strerror(errno));
+        bitmap_unlink(tmp_path);
+    } else {
+        rename_checksums(tmp_path, data_path);
+    }
+    free(tmp_path);
+    free(data_path);
+    if (res) return -1;
+    sync_filter_dir(f);
 
-    int res = 0;
-    if (!f->sbf) {
-        if (f->filter_config.in_memory) {
-            res = create_sbf(f, 0, NULL);
-        } else {
-            res = discover_existing_filters(f);
+    // The layers of a packed filter are all in the pack, which
+    // is discovered ahead of the new layer until it is removed
+    char *pack_path = join_path(f->full_path, (char*)PACK_FILE_NAME);
+    int packed = (unlink(pack_path) == 0);
+    free(pack_path);
+    for (int i=num_layers-1; i > 0 && !packed; i--) {
+        res = asprintf(&data_name, DATA_FILE_NAME, i);
+        assert(res != -1);
+        data_path = join_path(f->full_path, data_name);
+        if ((res = bitmap_unlink(data_path))) {
+            syslog(LOG_ERR, "Failed to delete: %s. %s", data_path, strerror(-res));
         }
+        free(data_name);
+        free(data_path);
     }
-
-    // Release lock
-    pthread_mutex_unlock(&f->sbf_lock);
-    return res;
+    sync_filter_dir(f);
+    return 0;
 }
 
 /**
- * Discovers existing filters, and faults them in.
+ * Returns the most times the single layer of an SBF can be
+ * halved while it has room for as many keys again and the
+ * capacity of a new filter, or 0 if it should be left alone.
  */
-static uint64_t get_size(char* filename) {
-    struct stat buf;
-    buf.st_size = 0;
-    stat(filename, &buf);
-    return buf.st_size;
+static uint32_t shrink_folds(bloom_sbf *sbf) {
+    if (sbf->num_filters != 1) return 0;
+    bloom_bloomfilter *layer = sbf->filters[0];
+    uint64_t capacity = sbf->capacities[0];
+    uint64_t keys = bf_size(layer);
+    uint32_t folds = 0;
+    for (uint32_t i=1; i < 32 && (capacity >> i) >= SHRINK_MIN_CAPACITY &&
+            (capacity >> i) >= 2 * keys; i++) {
+        if (bf_fold_size(layer, i)) folds = i;
+    }
+    return folds;
 }
 
 /**
- * Works with scandir to filter out special files
+ * Folds the first layer of a filter into SHRINK_TMP_NAME.
+ * @arg bytes Output, the size of the folded layer
+ * @return 0 on success, -1 on error.
  */
-static int filter_out_special(CONST_DIRENT_T *d) {
-    // Get the file name
-    char *name = (char*)d->d_name;
+static int build_shrink_file(bloom_filter *f, bloom_bloomfilter *layer, uint32_t folds, uint64_t *bytes) {
+    char *tmp_path = join_path(f->full_path, (char*)SHRINK_TMP_NAME);
+    bitmap_unlink(tmp_path);
+    *bytes = bf_fold_size(layer, folds);
+    bloom_bitmap map;
+    int res = bitmap_from_filename(tmp_path, *bytes, 1, bloomf_bitmap_mode(f, 0), &map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create new file: %s for filter %s. Err: %s",
+            tmp_path, f->filter_name, strerror(errno));
+        goto LEAVE;
+    }
 
-    // Make sure its not speci
-    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-        return 0;
+    bloom_bloomfilter bf;
+    res = bf_fold(layer, folds, &map, &bf);
+    if (res) {
+        syslog(LOG_ERR, "Failed to fold the layer of filter '%s'. Err: %d",
+                f->filter_name, res);
+        bitmap_close(&map);
+        goto LEAVE;
     }
-    return 1;
+    if (bf_close(&bf)) res = -1;
+
+LEAVE:
+    if (res) unlink(tmp_path);
+    free(tmp_path);
+    return (res) ? -1 : 0;
 }
 
+/*
+ * A quotient filter being loaded, which the
+ * set log may resize while it is replayed.
+ */
+typedef struct {
+    bloom_filter *f;
+    bloom_qf *qf;
+} quotient_replay;
+
 /**
- * Works with scandir to filter out non-data files.
+ * Loads the quotient filter of a filter with the quotient
+ * layout, creating it if the filter is new or in-memory. The
+ * set log is replayed before the filter is published.
+ * Must be called with sbf_lock held.
+ * @return 0 on success, -1 on error.
  */
-static int filter_data_files(CONST_DIRENT_T *d) {
-    // Get the file name
-    char *name = (char*)d->d_name;
+static int load_quotient_filter(bloom_filter *f) {
+    bloom_qf *qf = NULL;
+    char *path = join_path(f->full_path, (char*)QUOTIENT_FILE_NAME);
+    uint64_t size = (f->filter_config.in_memory) ? 0 : get_size(path);
+    int res = 0;
+    if (size) {
+        bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_filename(path, size, 0, bloomf_bitmap_mode(f, 0) & ~CHECKSUMS, map);
+        if (res) {
+            syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", path, strerror(errno));
+            free(map);
+            free(path);
+            return -1;
+        }
 
-    // Look if it ends in ".data"
-    int name_len = strlen(name);
+        qf = malloc(sizeof(bloom_qf));
+        res = qf_from_bitmap(map, qf);
+        if (res) {
+            syslog(LOG_ERR, "Failed to load quotient filter for: %s. [%d]", path, res);
+            bitmap_close(map);
+            free(map);
+            free(qf);
+            free(path);
+            return -1;
+        }
+        place_layer(f, map);
 
-    // Too short
-    if (name_len < 6) return 0;
+    } else {
+        // A new filter holds the initial capacity, like the first layer
+        res = replace_quotient_filter(f, NULL, NULL, 0, &qf);
+        if (res) {
+            syslog(LOG_ERR, "Failed to create quotient filter for: %s.", f->filter_name);
+            free(path);
+            return -1;
+        }
+    }
+    free(path);
 
-    // Compare the ending
-    if (strcmp(name+(name_len-5), ".mmap") == 0) {
-        return 1;
+    // Replay the sets since the last flush before publishing,
+    // as with the SBF. The filter may be resized meanwhile.
+    if (f->set_log) {
+        quotient_replay replay = {f, qf};
+        int keys = setlog_replay(f->set_log, quotient_replay_callback, &replay);
+        qf = replay.qf;
+        if (keys < 0) {
+            syslog(LOG_ERR, "Failed to replay the set log of %s. Disabling the set log.", f->filter_name);
+            setlog_close(f->set_log);
+            f->set_log = NULL;
+        } else if (keys > 0) {
+            syslog(LOG_INFO, "Replayed %d keys from the set log of %s.", keys, f->filter_name);
+        }
     }
 
-    // Do not store
+    // Publish once loaded, readers check without the lock
+    __atomic_store_n(&f->qf, qf, __ATOMIC_RELEASE);
+    f->counters.page_ins += 1;
+    syslog(LOG_INFO, "Loaded quotient filter: %s. Keys: %llu. Slots: %llu.", f->filter_name,
+            (unsigned long long)qf_size(qf), (unsigned long long)qf->header->num_slots);
     return 0;
 }
 
 /**
- * This beast mode method scans the data directory
- * belonging to this filter for any existing filters,
- * and restores the SBF
- * @return 0 on success. -1 on error.
+ * Returns the quotient filter of a filter, faulting it in if needed.
+ * @return The quotient filter, or NULL if it could not be faulted in.
  */
-static int discover_existing_filters(bloom_filter *f) {
-    // Scan through the folder looking for data files
-    struct dirent **namelist;
-    int num;
+static bloom_qf* faulted_qf(bloom_filter *f) {
+    bloom_qf *qf = (bloom_qf*)__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE);
+    if (!qf) {
+        if (thread_safe_fault(f) != 0) return NULL;
+        qf = (bloom_qf*)__atomic_load_n(&f->qf, __ATOMIC_ACQUIRE);
+    }
+    return qf;
+}
 
-    // Filter only data dirs, in sorted order
-    num = scandir(f->full_path, &namelist, filter_data_files, alphasort);
-    if (num == -1) {
-        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
-                f->filter_name, strerror(errno));
+/**
+ * Creates a new, empty quotient filter.
+ * @arg path The file to create, or NULL for an anonymous map
+ * @arg q_bits The bits of quotient
+ * @arg r_bits The bits of remainder
+ * @arg out Output, the new filter
+ * @return 0 on success, -1 on error.
+ */
+static int open_quotient_filter(bloom_filter *f, char *path, uint32_t q_bits, uint32_t r_bits, bloom_qf **out) {
+    uint64_t bytes = qf_bytes_for_q_bits(q_bits);
+    bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
+    int res;
+    if (path)
+        res = bitmap_from_filename(path, bytes, 1, bloomf_bitmap_mode(f, 0) & ~CHECKSUMS, map);
+    else
+        res = bitmap_from_file(-1, bytes, bloomf_bitmap_mode(f, 1), map);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create the quotient filter of '%s'. Size: %llu. %s",
+                f->filter_name, (unsigned long long)bytes, strerror(errno));
+        free(map);
         return -1;
     }
-    syslog(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
+    place_layer(f, map);
 
-    // Speical case when there are no filters
-    if (num == 0) {
-        int res = create_sbf(f, 0, NULL);
-        return res;
+    bloom_qf *qf = malloc(sizeof(bloom_qf));
+    res = qf_init(map, q_bits, r_bits, qf);
+    if (res) {
+        syslog(LOG_ERR, "Failed to setup the quotient filter of '%s'. [%d]", f->filter_name, res);
+        bitmap_close(map);
+        free(map);
+        free(qf);
+        return -1;
     }
+    *out = qf;
+    return 0;
+}
 
-    // Allocate space for all the filter
-    bloom_bitmap **maps = malloc(num * sizeof(bloom_bitmap*));
-    bloom_bloomfilter **filters = malloc(num * sizeof(bloom_bloomfilter*));
+/**
+ * Flushes and closes a quotient filter, freeing it.
+ */
+static void close_quotient_filter(bloom_qf *qf) {
+    bloom_bitmap *map = qf->map;
+    qf_close(qf);
+    free(map);
+    free(qf);
+}
 
-    // Initialize the bitmaps and bloom filters
-    int res;
-    int err = 0;
-    uint64_t size;
-    bitmap_mode mode = (f->config->use_mmap) ? SHARED : PERSISTENT;
-    for (int i=0; i < num && !err; i++) {
-        // Get the full path to the bitmap
-        char *bitmap_path = join_path(f->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
+/**
+ * Builds a new quotient filter, which replaces the file of the
+ * filter once it is durable. With no filters, the new filter is
+ * empty and sized for the initial capacity. With one, it is
+ * resized to twice the slots, and with two they are merged,
+ * see qf_merge. A union gets enough slots for the keys of both.
+ * The new filter is not published.
+ * @arg a The quotient filter of the filter, or NULL
+ * @arg b Another quotient filter to merge, or NULL
+ * @arg intersect Keep only the keys in both filters
+ * @arg out Output, the new filter
+ * @return 0 on success, -EINVAL if the filters do not have the
+ * same fingerprint size, -EDQUOT if the new filter would take
+ * the filter over a quota, -1 on error.
+ */
+static int replace_quotient_filter(bloom_filter *f, bloom_qf *a, bloom_qf *b, int intersect, bloom_qf **out) {
+    uint32_t q_bits, r_bits;
+    *out = NULL;
+    if (!a) {
+        if (qf_params_for_capacity(f->filter_config.initial_capacity,
+                    f->filter_config.default_probability, &q_bits, &r_bits)) return -1;
+    } else {
+        q_bits = a->header->q_bits;
+        r_bits = a->header->r_bits;
+        if (b && b->header->q_bits + b->header->r_bits != q_bits + r_bits) return -EINVAL;
+    }
+    uint32_t bits = q_bits + r_bits;
+    if (a && b && !intersect && b->header->q_bits > q_bits) q_bits = b->header->q_bits;
+    if (a && !b) q_bits++;
 
-        // Get the size
-        size = get_size(bitmap_path);
-        if (size == 0) {
-            err = 1;
-            syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", bitmap_path, strerror(errno));
-            free(bitmap_path);
+    // Growths past a quota are refused, as with the layers
+    bloom_filter *owner = (f->owner) ? f->owner : f;
+    uint64_t old_bytes = (a) ? a->map->size : 0;
+    char *tmp_path = (f->filter_config.in_memory || f->config->read_only) ? NULL :
+        join_path(f->full_path, (char*)QUOTIENT_TMP_NAME);
+    int res = 0;
+    bloom_qf *qf = NULL;
+    for (; !res && !qf; q_bits++) {
+        r_bits = bits - q_bits;
+        uint64_t bytes = qf_bytes_for_q_bits(q_bits);
+        if (r_bits < 1 || !bytes) {
+            syslog(LOG_ERR, "Quotient filter '%s' has no bits left to grow.", f->filter_name);
+            res = -1;
             break;
         }
-
-        // Create the bitmap
-        bloom_bitmap *bitmap = maps[num - i - 1] = malloc(sizeof(bloom_bitmap));
-        res = bitmap_from_filename(bitmap_path, size, 0, mode, bitmap);
-        if (res != 0) {
-            err = 1;
-            syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
-            free(bitmap);
-            free(bitmap_path);
+        if (a && owner->quota_cb && bytes > old_bytes &&
+                owner->quota_cb(owner->quota_in, owner, bytes - old_bytes)) {
+            syslog(LOG_WARNING, "Filter '%s' is over its quota, and will not grow. "
+                    "Sets that need to grow it will fail.", owner->filter_name);
+            res = -EDQUOT;
             break;
         }
 
-        // Create the bloom filter
-        bloom_bloomfilter *filter = filters[num - i - 1] = malloc(sizeof(bloom_bloomfilter));
-        res = bf_from_bitmap(bitmap, 1, 0, filter);
-        if (res != 0) {
-            err = 1;
-            syslog(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
-            free(filter);
-            bitmap_close(bitmap);
-            free(bitmap);
-            free(bitmap_path);
+        // Remove a file left behind by a crash
+        if (tmp_path) unlink(tmp_path);
+        if (open_quotient_filter(f, tmp_path, q_bits, r_bits, &qf)) {
+            res = -1;
             break;
         }
 
-        // Cleanup
-        free(bitmap_path);
+        // The inputs may not fit if the keys cluster, or
+        // the union needs more slots, so try a larger filter
+        res = (a) ? qf_merge(a, b, intersect, qf) : 0;
+        if (res == -ENOSPC) {
+            bitmap_discard(qf->map);
+            free(qf->map);
+            free(qf);
+            qf = NULL;
+            res = 0;
+        }
+    }
+    if (res && qf) {
+        bitmap_discard(qf->map);
+        free(qf->map);
+        free(qf);
+        qf = NULL;
     }
 
-    // Free the memory associated with scandir
-    for (int i=0; i < num; i++) free(namelist[i]);
-    free(namelist);
-
-    // Return if there was an error
-    if (err) return -1;
-
-    // Create the SBF
-    res = create_sbf(f, num, filters);
-
-    // Cleanup on err
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
-
-        // For fucks sake. We need to clean up so much shit now.
-        for (int i=0; i < num; i++) {
-            bf_close(filters[i]);
-            bitmap_close(maps[i]);
-            free(filters[i]);
-            free(maps[i]);
+    // Make the new filter durable before it replaces the old one
+    if (!res && tmp_path) {
+        char *path = join_path(f->full_path, (char*)QUOTIENT_FILE_NAME);
+        res = qf_flush(qf);
+        if (!res && rename(tmp_path, path)) {
+            syslog(LOG_ERR, "Failed to rename %s. %s", tmp_path, strerror(errno));
+            res = -1;
+        }
+        if (!res) sync_filter_dir(f);
+        free(path);
+        if (res) {
+            close_quotient_filter(qf);
+            qf = NULL;
+            unlink(tmp_path);
+            res = -1;
         }
     }
-
-    // Increase our page ins
-    f->counters.page_ins += 1;
-
-    // Remove the filters list
-    free(maps);
-    free(filters);
-    return (err) ? -1 : 0;
+    if (res && tmp_path) unlink(tmp_path);
+    free(tmp_path);
+    *out = qf;
+    return res;
 }
 
 /**
- * Internal method to create the SBF
+ * Publishes a new quotient filter in place of the current one,
+ * which is closed. The file of the old filter was already
+ * replaced, so its pages are dropped rather than written back.
+ * @note The caller must hold the filter exclusively.
  */
-static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters) {
-    // Setup the SBF params
-    bloom_sbf_params params = {
-        f->filter_config.initial_capacity,
-        f->filter_config.default_probability,
-        f->filter_config.scale_size,
-        f->filter_config.probability_reduction
-    };
-
-    // Create the SBF
-    f->sbf = malloc(sizeof(bloom_sbf));
-    int res = sbf_from_filters(&params, bloomf_sbf_callback, f, num, filters, (bloom_sbf*)f->sbf);
-
-    // Handle a failure
-    if (res != 0) {
-        syslog(LOG_ERR, "Failed to create SBF: %s. Err: %d", f->filter_name, res);
-        free((bloom_sbf*)f->sbf);
-        f->sbf = NULL;
-    } else {
-        syslog(LOG_INFO, "Loaded SBF: %s. Num filters: %d.", f->filter_name, num);
+static void publish_quotient_filter(bloom_filter *f, bloom_qf *qf) {
+    pthread_mutex_lock(&f->sbf_lock);
+    pthread_mutex_lock(&f->flush_lock);
+    bloom_qf *old = (bloom_qf*)f->qf;
+    __atomic_store_n(&f->qf, qf, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&f->flush_lock);
+    pthread_mutex_unlock(&f->sbf_lock);
+    if (old) {
+        bitmap_discard(old->map);
+        free(old->map);
+        free(old);
     }
-
-    return res;
 }
 
 /**
- * Callback used with SBF to generate file names.
+ * Adds many keys to a quotient filter, resizing it whenever
+ * it fills up. Must be used exclusively, since a key shifts
+ * the keys after it.
+ * @arg qf The quotient filter, updated if it is resized
+ * @arg publish Should a resized filter replace the one of the
+ * filter, which is otherwise still being loaded
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return The number of keys processed, or a negative error
+ * from replace_quotient_filter if the filter could not grow.
  */
-static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
-    // Cast the input pointer
-    bloom_filter *filt = in;
-
-    // Check if we are in-memory
-    if (filt->filter_config.in_memory) {
-        syslog(LOG_INFO, "Creating new in-memory bitmap for filter %s. Size: %llu",
-            filt->filter_name, (unsigned long long)bytes);
-        return bitmap_from_file(-1, bytes, ANONYMOUS, out);
-    }
-
-    // Scan through the folder looking for data files
-    struct dirent **namelist = NULL;
-    int num_files;
-
-    // Filter only data dirs, in sorted order
-    num_files = scandir(filt->full_path, &namelist, filter_data_files, NULL);
-    syslog(LOG_INFO, "Found %d files for filter %s.", num_files, filt->filter_name);
-    if (num_files < 0) {
-        syslog(LOG_ERR, "Error discovering files for filter '%s'. %s",
-                filt->filter_name, strerror(errno));
-        return -1;
-    }
-
-
-    // Free the memory associated with scandir
-    for (int i=0; i < num_files; i++) {
-        free(namelist[i]);
+static int quotient_add_many(bloom_filter *f, bloom_qf **qf, int publish, char **keys,
+        int *key_lens, int num_keys, char *result) {
+    bloom_hashed_key hk;
+    for (int i=0; i < num_keys; i++) {
+        if (key_lens)
+            bf_hashed_key_init_len(&hk, keys[i], key_lens[i]);
+        else
+            bf_hashed_key_init(&hk, keys[i]);
+        int res = qf_add(*qf, &hk);
+        if (res == -ENOSPC) {
+            bloom_qf *bigger;
+            res = replace_quotient_filter(f, *qf, NULL, 0, &bigger);
+            if (res) return res;
+            syslog(LOG_INFO, "Resized quotient filter '%s' to %llu slots.", f->filter_name,
+                    (unsigned long long)bigger->header->num_slots);
+            if (publish) {
+                publish_quotient_filter(f, bigger);
+            } else {
+                bitmap_discard((*qf)->map);
+                free((*qf)->map);
+                free(*qf);
+            }
+            *qf = bigger;
+            res = qf_add(*qf, &hk);
+        }
+        result[i] = (res == 1);
     }
-    if (namelist) free(namelist);
+    return num_keys;
+}
 
-    // Generate the new file name
-    char *filename = NULL;
-    int file_name_len;
-    file_name_len = asprintf(&filename, DATA_FILE_NAME, num_files);
-    assert(file_name_len != -1);
+/**
+ * Adds many keys to a filter with the quotient layout, faulting
+ * it in if needed. Every key shifts the slots after it, which
+ * concurrent checks may be reading, so keys are only added when
+ * the filter may grow, which needs it held exclusively.
+ * @arg can_grow Is the filter held exclusively
+ * @return The number of keys processed, which is 0 unless
+ * can_grow is set, -EDQUOT if over a quota, or -1 on error.
+ */
+static int quotient_internal_add_many(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result, int can_grow) {
+    bloom_qf *qf = faulted_qf(filter);
+    if (!qf) return -1;
+    if (!can_grow) return 0;
+    bloom_qf *before = qf;
+    int res = quotient_add_many(filter, &qf, 1, keys, key_lens, num_keys, result);
+    if (res < 0) return (res == -EDQUOT) ? res : -1;
 
-    // Get the full path
-    char *full_path = join_path(filt->full_path, filename);
-    free(filename);
-    syslog(LOG_INFO, "Creating new file: %s for filter %s. Size: %llu",
-            full_path, filt->filter_name, (unsigned long long)bytes);
+    // Count the keys added for the cached size, and
+    // refresh the rest of the metadata if we resized
+    filter_counter_shard *shard = thread_counter_shard(filter);
+    bloomf_count_added(&shard->c.added, result, res);
+    if (qf != before) refresh_meta(filter);
 
-    // Create the bitmap
-    bitmap_mode mode = (filt->config->use_mmap) ? SHARED : PERSISTENT;
-    int res = bitmap_from_filename(full_path, bytes, 1, mode, out);
-    if (res) {
-        syslog(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
-            full_path, filt->filter_name, strerror(errno));
-    }
-    free(full_path);
+    // Log the keys that were added
+    if (filter->set_log) setlog_append(filter->set_log, keys, key_lens, result, res);
+    bloomf_count_results(&shard->c.set_hits, &shard->c.set_misses, result, res);
     return res;
 }
 
 /**
- * Computes the difference in time in milliseconds
- * between two timeval structures.
+ * Checks many keys against a quotient filter, hashing
+ * the keys a batch at a time.
+ * @return 0 on success.
  */
-static int timediff_msec(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
+static int quotient_contains_many(bloom_qf *qf, char **keys, int *key_lens, int num_keys, char *result) {
+    bloom_hashed_key hks[BLOOM_BATCH_SIZE];
+    memset(result, 0, num_keys);
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+        for (int i=0; i < n; i++) {
+            if (key_lens)
+                bf_hashed_key_init_len(hks + i, keys[base + i], key_lens[base + i]);
+            else
+                bf_hashed_key_init(hks + i, keys[base + i]);
+        }
+        qf_contains_many(qf, hks, n, result + base);
+    }
+    return 0;
 }
 
+/**
+ * Callback used with the set log to replay keys into
+ * a quotient filter that is being loaded.
+ */
+static int quotient_replay_callback(void *in, char **keys, int *key_lens, int num_keys) {
+    quotient_replay *replay = in;
+    char result[num_keys];
+    int res = quotient_add_many(replay->f, &replay->qf, 0, keys, key_lens, num_keys, result);
+    return (res == num_keys) ? 0 : -1;
+}
@@ -2,8 +2,10 @@
 #define BLOOM_FILTER_H
 #include <pthread.h>
 #include "config.h"
-#include "spinlock.h"
 #include "sbf.h"
+#include "xorfilter.h"
+#include "quotient.h"
+#include "set_log.h"
 
 /*
  * Functions are NOT thread safe unless explicitly documented
@@ -21,8 +23,123 @@ typedef struct {
     uint64_t set_misses;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t lock_waits;            // Contended acquisitions of the filter lock
+    uint64_t lock_wait_nsec;        // Time spent waiting for the filter lock
+    uint64_t fault_lock_waits;      // Contended acquisitions of sbf_lock to fault in
+    uint64_t fault_lock_wait_nsec;  // Time spent waiting for sbf_lock to fault in
+    uint64_t fault_nsec;            // Time spent faulting in, over page_ins
+    uint64_t checksum_errors;       // Pages that did not match their checksums
 } filter_counters;
 
+/**
+ * The number of shards used for the hot path counters.
+ * Threads are spread across the shards, so that workers
+ * hitting the same filter do not contend on a cache line.
+ */
+#define FILTER_COUNTER_SHARDS 16
+
+/**
+ * The ticks the TTL of an aging filter is split into. Keys
+ * live for at least their TTL, and at most three ticks more.
+ */
+#define FILTER_AGE_TICKS 32
+
+/**
+ * A single shard of the check and set counters,
+ * padded out to a cache line.
+ */
+typedef union {
+    struct {
+        uint64_t check_hits;
+        uint64_t check_misses;
+        uint64_t set_hits;
+        uint64_t set_misses;
+        uint64_t added;     // Keys added to the layers, for the cached size
+        uint64_t removed;   // Keys removed from the layers
+    } c;
+    char __pad[64];
+} filter_counter_shard;
+
+/**
+ * Metadata of a filter that is cached, so it can be
+ * read without touching the layers, see bloomf_meta.
+ */
+typedef struct {
+    uint64_t size;          // Keys in the filter
+    uint64_t capacity;      // Keys the filter holds before it grows
+    uint64_t bytes;         // Bytes used by the filter
+} filter_meta;
+
+/**
+ * The layers whose residency is kept separately,
+ * any newer layers are added to the last one.
+ */
+#define FILTER_RESIDENCY_LAYERS 16
+
+/**
+ * How much of a filter is in memory, as of
+ * the last bloomf_scan_residency.
+ */
+typedef struct {
+    uint64_t resident;      // Bytes of the filter in memory
+    uint64_t mapped;        // Bytes of the filter that are mapped
+    uint64_t scanned;       // Unix time of the scan, 0 if never scanned
+    uint32_t num_layers;    // Entries used in layers
+    uint64_t layers[FILTER_RESIDENCY_LAYERS]; // Resident bytes of each layer, oldest first
+} filter_residency;
+
+struct bloom_filter;
+
+/**
+ * A generation of a rotating filter. Each generation is a
+ * plain filter in a sub-directory, holding the keys set
+ * during one window.
+ */
+typedef struct {
+    uint64_t bucket;                // Start time of the generation, in windows
+    struct bloom_filter *filter;    // The keys set in the generation
+} bloom_filter_generation;
+
+/**
+ * The live generations of a rotating filter. Checks consult
+ * every generation, and sets go to the newest one. The set is
+ * replaced as a whole when the filter rotates.
+ */
+typedef struct {
+    uint32_t num;                       // The number of generations
+    bloom_filter_generation gens[];     // Newest first
+} bloom_filter_generations;
+
+/**
+ * A shard of a sharded filter. Each shard is a plain filter
+ * in a sub-directory, holding the keys that hash to it. The
+ * shard lock is held shared to use the shard, and exclusively
+ * to grow it, so a shard grows without stalling the others.
+ */
+typedef struct {
+    struct bloom_filter *filter;    // The keys of the shard
+    pthread_rwlock_t lock;          // Held exclusively to grow the shard
+} bloom_filter_shard;
+
+/**
+ * The key shards of a sharded filter
+ */
+typedef struct {
+    uint32_t num;                   // The number of shards
+    bloom_filter_shard shards[];
+} bloom_filter_keyshards;
+
+/**
+ * Checks if a filter may grow by another layer.
+ * @arg in The opaque pointer given with the callback
+ * @arg filter The filter that would grow. For a generation
+ * or shard, this is the filter it belongs to.
+ * @arg bytes The size of the new layer
+ * @return 0 if the filter may grow, or -EDQUOT if the
+ * layer would take it over a quota.
+ */
+typedef int(*bloom_filter_quota_cb)(void *in, struct bloom_filter *filter, uint64_t bytes);
+
 /**
  * Representation of a bloom filters
  */
@@ -32,14 +149,59 @@ typedef struct bloom_filter {
 
     char *filter_name;              // The name of the filter
     char *full_path;                // Path to our data
+    uint64_t data_dev;              // Device the data is on, from the stat of full_path
 
     volatile bloom_sbf *sbf;        // Underlying SBF
     pthread_mutex_t sbf_lock;       // Protects faulting in the SBF
+    pthread_mutex_t flush_lock;     // Serializes flushing the layers with tiering them
+
+    filter_counters counters;       // Page counters, protected by sbf_lock
+    filter_counter_shard *shards;   // Sharded check and set counters
+    filter_meta meta;               // Cached metadata, see bloomf_meta
+    bloom_filter_fill fill;         // Estimated fill of the layers, see bloomf_fill
+    filter_residency residency;     // Layers in memory, see bloomf_residency
+    int numa_node;                  // NUMA node the layers are placed on, -1 until faulted in
+    uint64_t generation;            // Stamp of the config last read, for read-only filters
+    bloom_set_log *set_log;         // Log of sets since the last flush, or NULL
+    int write_pending;              // Set while a bloomf_write awaits bloomf_commit, atomic
+    uint64_t snapshot_size;         // Size as of the last committed snapshot, atomic
+    uint64_t flushed_changes;       // Adds and removes counted in the shards at the last flush
+    bloom_bitmap *spare;            // The next layer, created ahead of a growth, or NULL
+    struct bloom_filter *owner;     // The filter a generation or shard belongs to, or NULL
+    bloom_filter_quota_cb quota_cb; // Checks each growth against the quotas, or NULL
+    void *quota_in;                 // Opaque pointer given to quota_cb
+    uint64_t age_clock;             // Tick of the last bloomf_age, for aging filters
+    uint64_t cache_stamp;           // Positive checks are cached under this, atomic
+    uint64_t scrub_page;            // Next page for bloomf_scrub to verify
+    uint32_t *sync_clock;           // Stamps the pages that change in the layers, or NULL
 
-    filter_counters counters;       // Counters
-    bloom_spinlock counter_lock;    // Protect the counters
+    // Only used if filter_config.rotate_window is set, in place of the SBF
+    bloom_filter_generations *gens; // Live generations, sets go to the newest
+
+    // Only used if filter_config.shards is set, in place of the SBF
+    bloom_filter_keyshards *keyshards; // Keys are spread over the shards by hash
+
+    // Only used if filter_config.freezable is set
+    bloom_set_log *staged;          // Every key set, until the filter is frozen
+    volatile bloom_xorfilter *frozen; // Replaces the SBF once frozen, protected by sbf_lock
+
+    // Only used if filter_config.layout is quotient, in place of the SBF
+    volatile bloom_qf *qf;          // Resized in place of growing, protected by sbf_lock
 } bloom_filter;
 
+/**
+ * State of a snapshot that is in progress. The layers that
+ * existed when the snapshot started are tracked, so their
+ * copies can be brought up to date when it is finished.
+ */
+typedef struct {
+    char *path;                 // Directory the snapshot is written to
+    uint32_t num_layers;        // The number of tracked layers
+    bloom_bitmap **maps;        // The tracked layers, oldest first
+    int *fds;                   // The file each layer is copied to
+    uint64_t size;              // Size of the filter when the snapshot started
+} bloom_filter_snapshot;
+
 /**
  * Initializes a bloom filter wrapper.
  * @arg config The configuration to use
@@ -51,6 +213,20 @@ typedef struct bloom_filter {
  */
 int init_bloom_filter(bloom_config *config, char *filter_name, int discover, bloom_filter **filter);
 
+/**
+ * Initializes an existing bloom filter from a config that
+ * is already known, such as from the manifest of the data_dir.
+ * This neither creates the folder of the filter, nor reads
+ * its config file. The filter is left proxied.
+ * @arg config The configuration to use
+ * @arg filter_name The name of the filter
+ * @arg filter_config The config of the filter
+ * @arg filter Output parameter, the new filter
+ * @return 0 on success
+ */
+int load_bloom_filter(bloom_config *config, char *filter_name,
+        bloom_filter_config *filter_config, bloom_filter **filter);
+
 /**
  * Destroys a bloom filter
  * @arg filter The filter to destroy
@@ -59,12 +235,109 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
 int destroy_bloom_filter(bloom_filter *filter);
 
 /**
- * Gets the counters that belong to a filter
+ * Gets the counters that belong to a filter,
+ * aggregating the per-thread shards.
  * @notes Thread safe, but may be inconsistent.
  * @arg filter The filter
- * @return A reference to the counters of a filter
+ * @arg counters Output, set to the current counters
+ */
+void bloomf_counters(bloom_filter *filter, filter_counters *counters);
+
+/**
+ * Returns the stamp positive checks of a filter are cached
+ * under. A key that was found stays found while the stamp
+ * is unchanged, and the stamp changes whenever keys may be
+ * lost, such as on a reset. Stamps are never reused, even
+ * by other filters.
+ * @notes Thread safe. Load the stamp before checking keys,
+ * so their results are not cached under a later stamp.
+ * @arg filter The filter
+ * @return The stamp, or 0 if keys can expire or be deleted,
+ * so positive checks must not be cached.
+ */
+uint64_t bloomf_cache_stamp(bloom_filter *filter);
+
+/**
+ * Counts the keys found by cached checks, which never
+ * reach the filter.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg num_keys The number of keys found
  */
-filter_counters* bloomf_counters(bloom_filter *filter);
+void bloomf_count_cached(bloom_filter *filter, int num_keys);
+
+/**
+ * Gets the cached size, capacity and byte size of a filter.
+ * Unlike bloomf_size and friends, the layers are never read,
+ * so this is cheap for any number of filters and safe while
+ * the filter is being faulted in or closed. The size includes
+ * the keys set since the metadata was refreshed, which happens
+ * whenever the filter is faulted, grown, flushed or closed.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg meta Output, set to the cached metadata
+ */
+void bloomf_meta(bloom_filter *filter, filter_meta *meta);
+
+/**
+ * Gets the estimated fill of a filter, from the bits set in
+ * its layers. Unlike the size, it is still right after filters
+ * are merged or their layers are restored. It is counted in the
+ * background when the filter is flushed, and only for the layers
+ * that changed, so it lags behind the latest sets.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg fill Output, set to the estimated fill
+ * @return 0 on success, -1 if the fill is not known, such
+ * as for a filter that was not flushed since it was loaded,
+ * a frozen filter or the counting layout.
+ */
+int bloomf_fill(bloom_filter *filter, bloom_filter_fill *fill);
+
+/**
+ * Measures how much of each layer of a filter is resident
+ * in memory, for bloomf_residency. Proxied filters have
+ * nothing resident. The layers of rotating and sharded
+ * filters are only counted in the totals.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_scan_residency(bloom_filter *filter);
+
+/**
+ * Hints the kernel to reclaim the clean pages of a filter that
+ * are mapped from its files, while it stays mapped and serving.
+ * The older layers are marked cold, or with pageout reclaimed now,
+ * in which case the newest layer, which takes the sets, is marked
+ * cold too. Layers in bloomd's own memory are left alone, since
+ * they would only be swapped, and so are the layers of pinned
+ * filters, which are locked in memory.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @arg pageout If 1, reclaim the older layers now
+ * @arg bytes Output, the bytes of the pages that were hinted
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_reclaim(bloom_filter *filter, int pageout, uint64_t *bytes);
+
+/**
+ * Gets how much of a filter was resident in
+ * memory at the last bloomf_scan_residency.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg residency Output, set to the residency
+ */
+void bloomf_residency(bloom_filter *filter, filter_residency *residency);
+
+/**
+ * Records a contended acquisition of the lock that
+ * guards a filter, which is held by its caller.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @arg wait_nsec The time spent waiting for the lock
+ */
+void bloomf_record_lock_wait(bloom_filter *filter, uint64_t wait_nsec);
 
 /**
  * Checks if a filter is currectly mapped into
@@ -74,6 +347,47 @@ filter_counters* bloomf_counters(bloom_filter *filter);
  */
 int bloomf_is_proxied(bloom_filter *filter);
 
+/**
+ * Faults in a proxied filter, without
+ * checking or setting any keys.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_fault(bloom_filter *filter);
+
+/**
+ * Picks up the changes the writer made to the files of a
+ * read-only filter. The filter config is read again when it
+ * was replaced, and the filter is closed if the writer added
+ * layers or froze it, so the next use faults in the new files.
+ * @notes Must be called with the filter locked exclusively.
+ * @arg filter The filter
+ * @return 0 if unchanged, 1 if refreshed,
+ * -1 if the filter is gone.
+ */
+int bloomf_refresh(bloom_filter *filter);
+
+/**
+ * Checks if a filter has changed since it was last
+ * flushed, and would be written out by bloomf_flush.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @return 1 if dirty, 0 otherwise.
+ */
+int bloomf_is_dirty(bloom_filter *filter);
+
+/**
+ * Counts the bytes of a filter in pages that changed since
+ * they were last flushed, summed over its layers, so busy
+ * filters can be flushed before their interval is up.
+ * Proxied and in-memory filters have none.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The dirty bytes.
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter);
+
 /**
  * Flushes the filter. Idempotent if the
  * filter is proxied or not dirty.
@@ -82,6 +396,77 @@ int bloomf_is_proxied(bloom_filter *filter);
  */
 int bloomf_flush(bloom_filter *filter);
 
+/**
+ * Writes back the filter like bloomf_flush, without waiting
+ * for its layers to be durable, so many filters can be made
+ * durable with a single sync of the file system afterwards.
+ * The keys of the set log that the write covers are kept
+ * until bloomf_commit.
+ * @arg filter The filter to write
+ * @return 0 on success.
+ */
+int bloomf_write(bloom_filter *filter);
+
+/**
+ * Commits a bloomf_write, once the file system holding the
+ * filter was synced. Removes the set log the write covered.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_commit(bloom_filter *filter);
+
+/**
+ * Creates the next layer of a filter ahead of time, once its
+ * newest layer is nearly full, so a growth only has to rename
+ * the file instead of creating and mapping it with the filter
+ * locked. Does nothing if the layer is not nearly full yet, or
+ * the filter is proxied, in-memory, read-only or rotating.
+ * @note The caller must prevent concurrent growths and closes.
+ * @arg filter The filter
+ * @return 0 on success, -1 if the layer could not be created.
+ */
+int bloomf_prepare_layer(bloom_filter *filter);
+
+/**
+ * Moves the older layers of a filter out of memory, onto shared
+ * mmaps of their files, keeping only the newest tier_layers in
+ * bloomd's buffers. The layers are written out first, and later
+ * flushes skip them unless they change. Does nothing unless
+ * tier_layers is set, or for filters that are proxied, in-memory,
+ * read-only, rotating, mapped with use_mmap, or using the
+ * counting layout, whose deletes change every layer.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The number of layers moved, or -1 on error.
+ */
+int bloomf_tier_layers(bloom_filter *filter);
+
+/**
+ * Seals the layers of a filter older than its newest, if
+ * seal_layers is set. A sealed layer is written out, mapped
+ * read-only, and no longer tracks its dirty pages, so flushes
+ * skip it. Does nothing for filters that are proxied, in-memory,
+ * read-only, rotating, or using the counting layout.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @return The number of layers sealed, or -1 on error.
+ */
+int bloomf_seal_layers(bloom_filter *filter);
+
+/**
+ * Verifies the page checksums of the next pages of a filter,
+ * if page_checksums is set. Each call carries on where the
+ * last one stopped, and starts over once every layer was verified.
+ * Pages that do not match are logged and counted. Does nothing
+ * for filters that are proxied, rotating or frozen.
+ * @note The caller must prevent concurrent growths, closes and merges.
+ * @arg filter The filter
+ * @arg max_pages The most pages to verify
+ * @return The number of pages verified, which is less than
+ * max_pages once the last layer is done, or -1 on error.
+ */
+int64_t bloomf_scrub(bloom_filter *filter, uint64_t max_pages);
+
 /**
  * Gracefully closes a bloom filter.
  * @arg filter The filter to close
@@ -89,6 +474,36 @@ int bloomf_flush(bloom_filter *filter);
  */
 int bloomf_close(bloom_filter *filter);
 
+/**
+ * Detaches the layers of a filter, so that they can be
+ * unmapped by bloomf_unmap_detached without the filter locked.
+ * The layers are flushed first, so a fault that follows loads
+ * every key from the files. Rotating, sharded and frozen
+ * filters are closed in place.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return The detached layers, or NULL if there are none.
+ */
+bloom_sbf* bloomf_detach(bloom_filter *filter);
+
+/**
+ * Unmaps the layers detached by bloomf_detach. They were
+ * flushed when detached, so only the maps and files are closed.
+ * @note Thread safe, the filter may be faulted in again meanwhile.
+ * @arg sbf The detached layers, may be NULL
+ */
+void bloomf_unmap_detached(bloom_sbf *sbf);
+
+/**
+ * Compresses the layers of a closed filter, to reduce
+ * the disk space of cold filters. The layers are expanded
+ * again when the filter is next faulted in. Does nothing
+ * if the filter is not proxied or is in-memory.
+ * @arg filter The filter to compress
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_compress(bloom_filter *filter);
+
 /**
  * Deletes the bloom filter with
  * extreme prejudice.
@@ -97,23 +512,411 @@ int bloomf_close(bloom_filter *filter);
  */
 int bloomf_delete(bloom_filter *filter);
 
+/**
+ * Starts a snapshot of the filter, faulting it in if
+ * needed. The snapshot is written to a directory named
+ * like the filter directory, under "snapshots" in the data_dir.
+ * @note The caller must prevent concurrent sets and closes.
+ * @arg filter The filter
+ * @arg snap Output, the snapshot state
+ * @return 0 on success.
+ */
+int bloomf_snapshot_begin(bloom_filter *filter, bloom_filter_snapshot **snap);
+
+/**
+ * Copies the layers of a started snapshot. This is the bulk of
+ * the work, and can run concurrently with checks and sets. The
+ * caller must still prevent the filter from being closed.
+ * @arg filter The filter
+ * @arg snap The snapshot state
+ * @return 0 on success.
+ */
+int bloomf_snapshot_copy(bloom_filter *filter, bloom_filter_snapshot *snap);
+
+/**
+ * Finishes a snapshot. If committing, the pages that changed
+ * during the copy and any new layers are copied, and the
+ * snapshot replaces the previous one. The snapshot state is freed.
+ * @note The caller must prevent concurrent sets and closes.
+ * @arg filter The filter
+ * @arg snap The snapshot state
+ * @arg commit If 0, the snapshot is abandoned
+ * @return 0 on success.
+ */
+int bloomf_snapshot_finish(bloom_filter *filter, bloom_filter_snapshot *snap, int commit);
+
+/**
+ * Returns the directory the committed snapshot of a filter
+ * is in, the same as in the data_dir of a filter folder.
+ * @arg filter The filter
+ * @return The path, to be freed by the caller.
+ */
+char* bloomf_snapshot_path(bloom_filter *filter);
+
+/**
+ * Freezes a freezable filter. The staged keys are built into
+ * an xor filter, which replaces the SBF and the staged keys.
+ * A frozen filter can be checked, but no longer set.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EINVAL if the filter is not freezable,
+ * -EEXIST if it is already frozen, -1 on error.
+ */
+int bloomf_freeze(bloom_filter *filter);
+
+/**
+ * Compacts the SBF of a freezable filter into a single layer.
+ * The staged keys are replayed into a new layer, sized for
+ * the capacity of all the current layers, which replaces them.
+ * Checks then probe one layer, and the filter can still be set.
+ * The filter is left proxied.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EINVAL if the filter is not freezable,
+ * -EEXIST if it is frozen, -1 on error.
+ */
+int bloomf_compact(bloom_filter *filter);
+
+/**
+ * Shrinks a filter that was created far larger than the keys it
+ * holds, by folding its layer onto itself, see bf_fold. The layer
+ * is halved as long as it keeps room for as many keys again, and
+ * the filter is sized as if it had been created for the folded
+ * capacity, so it keeps the same false positive rate at capacity.
+ * A filter that grew more layers is left alone, since only its
+ * newest layer is not full. Keyshards are shrunk one at a time.
+ * The filter is left proxied if it was shrunk.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg folds Output, the number of times the layer was halved
+ * @return 0 on success, -EEXIST if the filter is frozen,
+ * -EINVAL if it rotates, -EROFS if it is in-memory, -ENOTSUP if
+ * its layout can not be folded, -1 on error.
+ */
+int bloomf_shrink(bloom_filter *filter, uint32_t *folds);
+
+/**
+ * Empties a filter in place, for filters that are rotated by
+ * hand. The layers are deleted without being flushed, and the
+ * filter starts over with one empty layer, which is sparse on
+ * disk, so a reset takes the same time however large the filter
+ * grew. The set log and the staged keys are emptied too, so the
+ * old keys are not replayed. A proxied filter stays proxied.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @return 0 on success, -EEXIST if the filter is frozen,
+ * -EINVAL if it rotates, -1 on error.
+ */
+int bloomf_reset(bloom_filter *filter);
+
+/**
+ * Merges the layers of another filter into this one, so it
+ * has the keys of either for a union, or of both for an
+ * intersection. The filters must be created with the same
+ * capacity, probability, layout and hash scheme, and not be
+ * counting, rotating, sharded or frozen. Intersections are only
+ * exact for filters of one layer, so others are rejected.
+ * @note The caller must hold the filter exclusively, and
+ * prevent changes to the other filter.
+ * @arg filter The filter to merge into
+ * @arg other The filter to merge
+ * @arg intersect 1 to intersect, 0 for a union
+ * @return 0 on success, -EINVAL if the filters can not be
+ * merged, -1 on error.
+ */
+int bloomf_merge(bloom_filter *filter, bloom_filter *other, int intersect);
+
+/**
+ * Starts stamping the pages that change in the layers of a filter
+ * with the generation of a clock, see bitmap_track_changes. The
+ * layers are tracked as they are loaded or created. Only plain
+ * filters whose layers are changed by setting bits are tracked,
+ * so rotating, sharded, freezable, counting, aging, quotient and
+ * summarized filters are not.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg clock The current generation, which must outlive the filter
+ * @return 0 on success, -EINVAL if the filter can not be tracked.
+ */
+int bloomf_track_changes(bloom_filter *filter, uint32_t *clock);
+
+/**
+ * Callback used to copy the changed pages of a filter
+ * @arg data Opaque pointer
+ * @arg layer The layer of the pages, counted from the oldest
+ * @arg layer_bytes The size of the layer
+ * @arg offset The offset of the pages in the layer
+ * @arg bytes The pages
+ * @arg len The length of the pages
+ * @return 0 to continue, 1 to stop before these pages, which
+ * come first on the next call.
+ */
+typedef int(*bloom_pages_cb)(void *data, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, unsigned char *bytes, uint64_t len);
+
+/**
+ * Copies the runs of pages of a filter that changed in a generation
+ * of its clock or later, see bloomf_track_changes. The layers are
+ * walked oldest first, from a cursor counting their pages, so the
+ * copy can be made over several calls. Every call copies the layers
+ * that existed on the first one, and the pages may change while
+ * they are copied.
+ * @note The caller must prevent the filter from growing or
+ * being closed during the call.
+ * @arg filter The filter
+ * @arg gen The generation
+ * @arg cursor In/out, the next page to copy, 0 on the first call
+ * @arg num_layers In/out, the layers copied, 0 on the first call
+ * @arg max_run The most bytes given to the callback at once
+ * @arg cb The callback, invoked with data
+ * @return 1 if the callback stopped the copy, 0 once the pages are
+ * copied, -EINVAL if the filter is not tracked, or -ENOENT if it is
+ * not in memory, or a layer was not tracked before the generation.
+ */
+int bloomf_changed_pages(bloom_filter *filter, uint32_t gen, uint64_t *cursor, uint32_t *num_layers,
+        uint64_t max_run, bloom_pages_cb cb, void *data);
+
+/**
+ * Merges the pages of a copy of the filter, as given by
+ * bloomf_changed_pages, into the same layer of the filter,
+ * see sbf_merge_bytes. The filter is faulted in if needed.
+ * @note The caller must hold the filter exclusively.
+ * @arg filter The filter to merge into
+ * @arg num_layers The number of layers of the copy
+ * @arg layer The layer of the pages, counted from the oldest
+ * @arg layer_bytes The size of the layer in the copy
+ * @arg offset The offset of the pages in the layer
+ * @arg bytes The pages
+ * @arg len The length of the pages
+ * @return 0 on success, -EINVAL if the layers differ from the
+ * copy, or the filter is not one that can be tracked, -1 on error.
+ */
+int bloomf_merge_pages(bloom_filter *filter, uint32_t num_layers, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, const unsigned char *bytes, uint64_t len);
+
+/**
+ * Checks if a rotating filter has a generation that
+ * expired, or should start a new generation.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 1 if bloomf_rotate should be called, 0 otherwise.
+ */
+int bloomf_needs_rotate(bloom_filter *filter, uint64_t now);
+
+/**
+ * Rotates a rotating filter. A new generation is started
+ * once the window of the newest one has passed, and the
+ * generations outside of the live window are deleted.
+ * Does nothing for filters that do not rotate.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_rotate(bloom_filter *filter, uint64_t now);
+
+/**
+ * Checks if an aging filter is due a tick, which
+ * expires the keys that were not set for its TTL.
+ * Filters that are not faulted in are aged when they are.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 1 if bloomf_age should be called, 0 otherwise.
+ */
+int bloomf_needs_age(bloom_filter *filter, uint64_t now);
+
+/**
+ * Ages an aging filter, expiring the keys that were not
+ * set for its TTL. Does nothing for other filters.
+ * @note Thread safe with checks and bloomf_try_add calls,
+ * but the caller must prevent other calls.
+ * @arg filter The filter
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_age(bloom_filter *filter, uint64_t now);
+
 /**
  * Checks if the filter contains a given key
- * @note Thread safe, as long as bloomf_add is not invoked.
+ * @note Thread safe with other bloomf_contains and
+ * bloomf_try_add calls, as long as bloomf_add is not invoked.
  * @arg filter The filter to check
  * @arg key The key to check
  * @return 0 if not contained, 1 if contained.
  */
 int bloomf_contains(bloom_filter *filter, char *key);
 
+/**
+ * Checks if the filter contains many keys at once. This
+ * overlaps the memory accesses of the keys, and is faster
+ * than checking each key in turn.
+ * @note Thread safe with other bloomf_contains and
+ * bloomf_try_add calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_many(bloom_filter *filter, char **keys, int num_keys, char *result);
+
+/**
+ * Checks if the filter contains many keys of known lengths,
+ * so the keys are not measured again by every layer.
+ * @note Thread safe like bloomf_contains_many.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Checks if the filter contains many keys that are already
+ * hashed. The hashes are cached in the keys, so checking the
+ * same keys against several filters hashes each key once,
+ * whatever the hash schemes of the filters. Keys given as
+ * their hash, see bf_hashed_key_init_hash, can only be checked
+ * in filters that bloomf_accepts_hashes.
+ * @note Thread safe like bloomf_contains_many.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * contained and 0 otherwise.
+ * @return 0 on success, -EINVAL if the keys are prehashed
+ * and the filter does not accept hashes, -1 on error.
+ */
+int bloomf_contains_hashed(bloom_filter *filter, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Checks if keys given as their hash can be checked in a
+ * filter. Only the MurmurHash3 of such keys is known, which is
+ * all that filters using BLOOM_HASH_MURMUR, quotient filters and
+ * frozen filters need. Sharded filters pick the shard of a key
+ * from the key itself.
+ * @note Thread safe.
+ * @arg filter The filter
+ * @return 1 if the filter accepts hashed keys, 0 otherwise.
+ */
+int bloomf_accepts_hashes(bloom_filter *filter);
+
 /**
  * Adds a key to the given filter
  * @arg filter The filter to add to
  * @arg key The key to add
- * @return 0 if not added, 1 if added.
+ * @return 0 if not added, 1 if added. -EROFS if the
+ * filter is frozen, -EDQUOT if it is over a quota
+ * and can not grow.
  */
 int bloomf_add(bloom_filter *filter, char *key);
 
+/**
+ * Adds a key to the given filter, without growing it.
+ * @note Thread safe with other bloomf_try_add and bloomf_contains
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @return 0 if not added, 1 if added. -EAGAIN if the
+ * filter must grow, and bloomf_add should be used instead.
+ * -EROFS if the filter is frozen, -EDQUOT if it is over a quota.
+ */
+int bloomf_try_add(bloom_filter *filter, char *key);
+
+/**
+ * Adds many keys to the given filter
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return 0 on success, -EROFS if the filter is frozen,
+ * -EDQUOT if it is over a quota and can not grow, -1 on error.
+ */
+int bloomf_add_many(bloom_filter *filter, char **keys, int num_keys, char *result);
+
+/**
+ * Adds many keys of known lengths to the given filter.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are measured.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return 0 on success, -EROFS if the filter is frozen,
+ * -EDQUOT if it is over a quota and can not grow, -1 on error.
+ */
+int bloomf_add_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Adds many keys to the given filter, without growing it.
+ * @note Thread safe with other bloomf_try_add and bloomf_contains
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return The number of keys processed, -EROFS if the filter is
+ * frozen, -EDQUOT if it is over a quota, or -1 on error. If the filter must grow, this is less
+ * than num_keys, and bloomf_add_many should be used for the rest.
+ */
+int bloomf_try_add_many(bloom_filter *filter, char **keys, int num_keys, char *result);
+
+/**
+ * Adds many keys of known lengths to the given filter,
+ * without growing it, as with bloomf_try_add_many.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are measured.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was added and 0 otherwise.
+ * @return The number of keys processed, as with bloomf_try_add_many.
+ */
+int bloomf_try_add_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Removes many keys from a filter using the counting layout.
+ * Each key is removed once, so a key that was set more than
+ * once stays present until it is removed as many times.
+ * Rotating filters remove the keys from every generation.
+ * @note Thread safe with bloomf_contains and bloomf_try_add
+ * calls, as long as bloomf_add is not invoked.
+ * @arg filter The filter to remove from
+ * @arg keys The keys to remove
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was removed and 0 otherwise.
+ * @return 0 on success, -EINVAL if the filter does not use
+ * the counting layout, -1 on error.
+ */
+int bloomf_remove_many(bloom_filter *filter, char **keys, int num_keys, char *result);
+
+/**
+ * Removes many keys of known lengths from a filter
+ * using the counting layout, as with bloomf_remove_many.
+ * @arg filter The filter to remove from
+ * @arg keys The keys to remove
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * was removed and 0 otherwise.
+ * @return 0 on success, -EINVAL if the filter does not use
+ * the counting layout, -1 on error.
+ */
+int bloomf_remove_many_len(bloom_filter *filter, char **keys, int *key_lens, int num_keys, char *result);
+
 /**
  * Gets the size of the filter in keys
  * @note Thread safe.
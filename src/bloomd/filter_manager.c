@@ -4,77 +4,319 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <string.h>
-#include "spinlock.h"
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "filter_manager.h"
 #include "art.h"
 #include "filter.h"
+#include "latency.h"
+#include "numa.h"
+#include "replication.h"
+#include "rate_limit.h"
+#include "crc.h"
+#include "probes.h"
 #include "type_compat.h"
 
 /**
- * This defines how log we sleep between vacuum poll
- * iterations in microseconds
+ * The vacuum thread is woken as soon as a change is made.
+ * While waiting for the clients to pass a version, it polls
+ * the client epochs starting at the minimum interval and
+ * backing off to the maximum, in microseconds.
  */
-#define VACUUM_POLL_USEC 500000
+#define GRACE_MIN_POLL_USEC 100
+#define GRACE_MAX_POLL_USEC 10000
+
+/**
+ * The epoch of a client that is not using the manager,
+ * it never holds back the vacuum.
+ */
+#define QUIESCENT_VSN ULLONG_MAX
+
+/**
+ * A batch of keys waiting to be set under the write lock
+ * of a filter, by whichever thread is combining. It lives
+ * on the stack of the thread that queued it, until done.
+ */
+typedef struct set_request {
+    char **keys;
+    int *key_lens;
+    int num_keys;
+    char *result;
+    int res;                    // Result of bloomf_add_many_len
+    int done;                   // Set once the batch was applied
+    struct set_request *next;
+} set_request;
 
 /**
  * Wraps a bloom_filter to ensure only a single
  * writer access it at a time. Tracks the outstanding
  * references, to allow a sane close to take place.
+ * The filter map holds one reference, and each open
+ * handle holds another.
  */
-typedef struct {
+struct bloom_filter_wrapper {
     volatile int is_active;         // Set to 0 when we are trying to delete it
     volatile int is_hot;            // Used to mark a filter as hot
     volatile int should_delete;     // Used to control deletion
+    int refs;                       // Outstanding references, atomic
+    int aliases;                    // Aliases resolving to the filter, under the write lock
+    int snapshotting;               // Set while a snapshot is in progress, atomic
+    int fault_queued;               // Set while queued for the fault thread, atomic
+    int fault_failed;               // The fault thread failed to fault it in, atomic
+    int load_queued;                // Set while a key file is queued or loading, atomic
+    bloom_load_progress load;       // Progress of the last key file load, atomic
+    volatile int accessed;          // Set on access, cleared when recorded
+    uint32_t access_hours;          // Hours of the day with accesses, in the last day
+    volatile unsigned int last_access;  // Eviction clock at the last access
+    volatile unsigned int access_ticks; // Clock ticks with accesses, decays
 
     bloom_filter *filter;    // The actual filter object
     pthread_rwlock_t rwlock; // Protects the filter
     bloom_config *custom;   // Custom config to cleanup
-} bloom_filter_wrapper;
+
+    // Records the changes while the filter migrates, atomic
+    struct bloom_repl_log *migration;
+
+    // Keys of the clients, limited by filter_key_rate
+    bloom_rate_limit key_rate;
+
+    // Sets that need the write lock are queued, and one thread
+    // takes the lock and applies every queued batch, see combine_set
+    pthread_mutex_t combine_lock;
+    pthread_cond_t combine_cond;
+    set_request *combine_queue;
+    int combining;
+};
+typedef struct bloom_filter_wrapper bloom_filter_wrapper;
+
+/**
+ * The keys recently found by the checks of a client thread,
+ * with positive_cache set. Each entry holds the cache stamp of
+ * the filter and a hash of the key, and is only trusted while
+ * the filter keeps that stamp, so entries are never invalidated,
+ * only overwritten. Found keys stay found until the filter loses
+ * keys, so repeated checks of hot keys are answered without the
+ * filter lock or its memory.
+ */
+typedef struct {
+    uint64_t stamp;     // Cache stamp of the filter, 0 if empty
+    uint64_t tag;       // Hash of the key
+} positive_entry;
+
+typedef struct {
+    uint32_t mask;      // The number of entries, minus one
+    positive_entry entries[];
+} positive_cache;
+
+/**
+ * Checks against a cache are done in batches of at most this
+ * many keys, with the misses checked in the filter together.
+ */
+#define POSITIVE_BATCH_SIZE 128
 
 /**
- * We use a linked list of filtmgr_client
- * structs to track any clients of the filter manager.
- * Each client maintains a thread ID as well as the
- * last known version they used. The vacuum thread
- * uses this information to safely garbage collect
- * old versions.
+ * Each client thread of the filter manager owns an epoch
+ * slot, holding the thread ID and the last known version it
+ * used. The vacuum thread uses this information to safely
+ * garbage collect old versions. Slots are only ever pushed
+ * onto the list, and are reused once their thread leaves,
+ * so a checkpoint never takes a lock.
  */
 typedef struct filtmgr_client {
     pthread_t id;
-    unsigned long long vsn;
+    volatile unsigned long long vsn;    // Last version used, or QUIESCENT_VSN
+    int in_use;                         // Is the slot owned, atomic
+    positive_cache *cache;              // Found keys, owned with the slot, or NULL
     struct filtmgr_client *next;
 } filtmgr_client;
 
-// Enum of possible delta updates
-typedef enum {
-    CREATE,
-    DELETE,
-    BARRIER
-} delta_type;
+/**
+ * Caches the epoch slot of the calling thread, for the
+ * manager with the given ID.
+ */
+typedef struct {
+    unsigned long long mgr_id;
+    filtmgr_client *slot;
+} client_cache;
 
-// Simple linked list of filter wrappers
+/**
+ * Simple linked list of filter wrappers, removed
+ * from the map by the given version.
+ */
 typedef struct filter_list {
     unsigned long long vsn;
-    delta_type type;
     bloom_filter_wrapper *filter;
     struct filter_list *next;
 } filter_list;
 
+/**
+ * Shared by the threads loading the existing filters
+ * at startup. Each thread claims the next folder, and the
+ * wrappers are added to the map once all are loaded.
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    char **names;
+    bloom_filter_config *configs;   // From the manifest, or NULL
+    int num;
+    int next;                       // Next folder to load, atomic
+    bloom_filter_wrapper **filters; // Loaded wrappers, NULL on failure
+} filter_loader;
+
+/*
+ * The manifest of the data_dir, written at a clean shutdown.
+ * It lists every filter with its config record, so the next
+ * startup reads a single file instead of scanning the data_dir
+ * and reading the config of every filter. The manifest is
+ * removed as soon as it is read, so after a crash the filters
+ * are discovered from their folders again. It is stamped with
+ * the modification time of the data_dir, and ignored if the
+ * data_dir changed since, such as by a folder added or removed
+ * while the server was down.
+ *
+ * The manifest is a header, followed by the name of each filter
+ * with its length including the NUL and its config record, and
+ * a checksum of all the preceding bytes.
+ */
+#define MANIFEST_FILENAME "manifest.bin"
+
+/**
+ * The aliases are kept in the data dir, a line
+ * for each with the alias and the filter name.
+ */
+#define ALIASES_FILENAME "aliases"
+#define MANIFEST_MAGIC 0x424c4d4d       // "BLMM"
+#define MANIFEST_VERSION 1
+#define MANIFEST_RECORD_MAX 256
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t num_filters;
+} manifest_header;
+
+/**
+ * The manifest as it is built, when the filters are closed.
+ * The buffer is NULL if no manifest is written.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    uint32_t num;
+} filter_manifest;
+
+/**
+ * Shared by the threads creating the filters of a
+ * filtmgr_create_filters. Each thread claims the next
+ * filter, and the wrappers are published together.
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    char **filter_names;
+    int num;
+    int next;                       // Next filter to create, atomic
+    bloom_config *custom_config;
+    int *results;                   // Filters with a result are skipped
+    bloom_filter_wrapper **filters; // Created wrappers, NULL on failure
+} filter_creator;
+
+// Arguments of a scan for filters to warm
+typedef struct {
+    bloom_filter_list_head *head;
+    int hour;
+    int upcoming;
+    int new_hour;
+} warm_scan;
+
+// Arguments of an iteration over the filters
+typedef struct {
+    filter_cb cb;
+    void *data;
+} iter_scan;
+
+// Arguments of a scan for filters to rotate or age
+typedef struct {
+    bloom_filter_list_head *head;
+    uint64_t now;
+} rotate_scan;
+
+// A filter that may be evicted to stay within the memory budget
+typedef struct {
+    char *filter_name;
+    uint64_t bytes;
+    unsigned int age;   // Clock ticks since the last access
+    int frequent;       // Accessed in several ticks recently
+} evict_candidate;
+
+// Arguments of a scan for filters to evict
+typedef struct {
+    unsigned int clock;
+    int decay;
+    uint64_t total;     // Bytes of all the mapped filters
+    evict_candidate *candidates;
+    int num;
+    int max;
+} evict_scan;
+
+// Arguments of a scan for the aliases of a filter
+typedef struct {
+    bloom_filter_wrapper *filter;
+    bloom_filter_list *names;
+} alias_scan;
+
+/**
+ * Key files are split into chunks the threads of a load
+ * take in turn, and the keys of a chunk are set in batches
+ * of at most this many keys or bytes.
+ */
+#define LOAD_CHUNK_BYTES (4 * 1024 * 1024)
+#define LOAD_BATCH_KEYS 4096
+#define LOAD_BATCH_BYTES (256 * 1024)
+
+/**
+ * A key file queued for the load thread. It holds a
+ * reference of its filter until it is done.
+ */
+typedef struct key_load {
+    bloom_filter_wrapper *filt;
+    int fd;
+    uint64_t size;          // Bytes of the key file
+    struct key_load *next;
+} key_load;
+
+/**
+ * Shared by the threads running a load
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    key_load *load;
+    char *data;             // The mapped key file
+    uint64_t next_chunk;    // The next chunk to take, atomic
+    int failed;             // Set to stop the load, atomic
+    int *should_run;
+} load_run;
+
 /**
  * We use a a simple form of Multi-Version Concurrency Controll (MVCC)
  * to prevent locking on access to the map of filter name -> bloom_filter_wrapper.
  *
- * The way it works is we have 2 ART trees, the "primary" and an alternate.
- * All the clients of the filter manager have reads go through the primary
- * without any locking. We also maintain a delta list of new and deleted filters,
- * which is a simple linked list.
+ * The way it works is the map is a persistent ART tree. Writers never
+ * change a node that readers can reach, instead the nodes on the path
+ * are copied and the new root is published atomically, so all the
+ * clients of the filter manager read the map without any locking.
+ * Each change is a new version, and the nodes and filters it replaces
+ * are retired with that version.
  *
- * We use a separate vacuum thread to merge changes from the delta lists
- * into the alternate tree, and then do a pointer swap to rotate the
- * primary tree for the alternate.
- *
- * This mechanism ensures we have at most 2 ART trees, reads are lock-free,
- * and performance does not degrade with the number of filters.
+ * We use a separate vacuum thread to reclaim them, once every client
+ * has checkpointed at or past the version. A change costs a copy of
+ * the path to the filter, and performance does not degrade with the
+ * number of filters.
  *
  */
 struct bloom_filtmgr {
@@ -82,37 +324,66 @@ struct bloom_filtmgr {
 
     int should_run;  // Used to stop the vacuum thread
     pthread_t vacuum_thread;
+    pthread_cond_t vacuum_cond; // Signaled on changes, with the write lock
 
     /*
      * To support vacuuming of old versions, we require that
-     * workers 'periodically' checkpoint. This just updates an
-     * index to match the current version. The vacuum thread
-     * can scan for the minimum seen version and clean all older
-     * versions.
+     * workers 'periodically' checkpoint. This just updates the
+     * epoch of the worker to match the current version. Workers
+     * that are blocked go quiescent so they are ignored. The vacuum
+     * thread can scan for the minimum seen version and clean all
+     * older versions.
      */
-    filtmgr_client *clients;
-    bloom_spinlock clients_lock;
+    unsigned long long id;      // Identifies the manager to the client caches
+    filtmgr_client *clients;    // Pushed atomically
 
     // This is the current version. Should be used under the write lock.
     unsigned long long vsn;
     pthread_mutex_t write_lock;
 
-    // Maps key names -> bloom_filter_wrapper
-    unsigned long long primary_vsn; // This is the version that filter_map represents
+    // Maps key names -> bloom_filter_wrapper, updated copy-on-write
     art_tree *filter_map;
-    art_tree *alt_filter_map;
+
+    // Maps alias names -> bloom_filter_wrapper, updated copy-on-write.
+    // An alias is removed in the version that removes its filter.
+    art_tree *alias_map;
+    unsigned long long reclaimed_vsn;   // Versions up to this are reclaimed
+
+    // Filters removed from the map, newest first. The map
+    // reference is released once no client can still see them.
+    filter_list *dropped;
 
     /**
      * List of pending deletes. This is necessary
-     * because the filter may reflect that a delete has
-     * taken place, while the vacuum thread has not yet performed the
-     * delete. This allows create to return a "Delete in progress".
+     * because the filter may be gone from the map, while the
+     * vacuum thread has not yet performed the delete. This
+     * allows create to return a "Delete in progress".
+     * Both lists are used under the write lock.
      */
     bloom_filter_list *pending_deletes;
-    bloom_spinlock pending_lock;
 
-    // Delta lists for non-merged operations
-    filter_list *delta;
+    // Hour of the day the access history was last recorded in
+    int access_hour;
+
+    // Advanced by each eviction scan, and recorded on access
+    volatile unsigned int evict_clock;
+    unsigned int evict_scans;
+
+    // Records the changes for the replicas, or NULL
+    bloom_repl_log *repl;
+
+    // Filters queued for the fault thread, with fault_retry
+    pthread_mutex_t fault_lock;
+    pthread_cond_t fault_cond;  // Signaled when a filter is queued
+    bloom_filter_list *faults;
+    filtmgr_fault_hook fault_hook;  // Invoked once queued filters are faulted in
+    void *fault_hook_arg;
+
+    // Key files queued for the load thread, oldest first
+    pthread_mutex_t load_lock;
+    pthread_cond_t load_cond;   // Signaled when a load is queued
+    key_load *loads;
+    key_load *loads_tail;
 };
 
 /**
@@ -121,21 +392,82 @@ struct bloom_filtmgr {
  */
 #define WARN_THRESHOLD 32
 
+/**
+ * The access counts used to rank filters for eviction
+ * are halved every this many eviction scans, and filters
+ * accessed in at least EVICT_FREQUENT_TICKS clock ticks
+ * are only evicted after all the others.
+ */
+#define EVICT_DECAY_SCANS 60
+#define EVICT_FREQUENT_TICKS 2
+
 /*
  * Static declarations
  */
 static const char FOLDER_PREFIX[] = "bloomd.";
 static const int FOLDER_PREFIX_LEN = sizeof(FOLDER_PREFIX) - 1;
+static unsigned long long next_mgr_id = 0;
+static __thread client_cache thread_client = {0, NULL};
+
+static filtmgr_client* client_slot(bloom_filtmgr *mgr, int create);
 
 static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name);
 static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name);
 static void delete_filter(bloom_filter_wrapper *filt);
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta);
+static void release_filter(bloom_filter_wrapper *filt);
+static int check_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result);
+static int check_hashed(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, bloom_hashed_key *keys, int num_keys, char *result);
+static int check_keys_locked(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result);
+static int check_hashed_locked(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, bloom_hashed_key *keys, int num_keys, char *result);
+static positive_cache* thread_positive_cache(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, uint64_t *stamp);
+static positive_entry* positive_slot(positive_cache *cache, uint64_t stamp, const char *key, uint64_t len, uint64_t *tag);
+static int set_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result);
+static int delete_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result);
+static inline void touch_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static int defer_fault(bloom_filtmgr *mgr, bloom_filter_wrapper *filt);
+static void flush_filter(bloom_filter_wrapper *filt, int sync);
+static inline void read_lock_filter(bloom_filter_wrapper *filt);
+static inline void write_lock_filter(bloom_filter_wrapper *filt);
+static inline void unlock_filter(bloom_filter_wrapper *filt);
+static int combine_set(bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result);
+static int filter_map_evict_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int compare_evict_candidates(const void *a, const void *b);
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot);
 static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_list_warm_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_list_rotate_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_list_age_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_bytes_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int track_changes_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int check_quota(void *in, bloom_filter *filter, uint64_t bytes);
+static bloom_filter_wrapper* make_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config,
+        int is_hot, bloom_filter_config *known);
 static int load_existing_filters(bloom_filtmgr *mgr);
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt);
+static int read_manifest(bloom_filtmgr *mgr, filter_loader *loader, char **buf);
+static void init_manifest(bloom_filtmgr *mgr, filter_manifest *m);
+static void manifest_add(filter_manifest *m, bloom_filter *filter);
+static void write_manifest(bloom_filtmgr *mgr, filter_manifest *m);
+static uint32_t manifest_checksum(char *buf, size_t len);
+static void* load_thread_main(void *in);
+static void* create_thread_main(void *in);
+static void run_pool(bloom_filtmgr *mgr, void* (*func)(void*), void *arg, int num);
+static int load_batch(load_run *run, char **keys, int *key_lens, int num_keys, char *result);
+static void* load_keys_main(void *in);
+static void map_insert(bloom_filtmgr *mgr, unsigned long long vsn, bloom_filter_wrapper *filt);
+static void map_remove(bloom_filtmgr *mgr, unsigned long long vsn, bloom_filter_wrapper *filt);
+static void publish_version(bloom_filtmgr *mgr, unsigned long long vsn);
+static int alias_target_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int alias_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int alias_write_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static void write_aliases(bloom_filtmgr *mgr);
+static void load_aliases(bloom_filtmgr *mgr);
+static int can_create_filter(bloom_filtmgr *mgr, char *filter_name);
+static int filter_bloomd_folders(CONST_DIRENT_T *d);
+static void refresh_filter(bloom_filtmgr *mgr, char *filter_name);
+static int snapshot_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data);
 static void* filtmgr_thread_main(void *in);
 
 /**
@@ -152,35 +484,30 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
 
     // Copy the config
     m->config = config;
+    m->access_hour = -1;
+    m->id = __sync_add_and_fetch(&next_mgr_id, 1);
 
     // Initialize the locks
     pthread_mutex_init(&m->write_lock, NULL);
-    INIT_BLOOM_SPIN(&m->clients_lock);
-    INIT_BLOOM_SPIN(&m->pending_lock);
-
-    // Allocate storage for the art trees
-    art_tree *trees = calloc(2, sizeof(art_tree));
-    m->filter_map = trees;
-    m->alt_filter_map = trees+1;
-
-    // Allocate the initial art tree
-    int res = init_art_tree(m->filter_map);
+    pthread_cond_init(&m->vacuum_cond, NULL);
+    pthread_mutex_init(&m->fault_lock, NULL);
+    pthread_cond_init(&m->fault_cond, NULL);
+    pthread_mutex_init(&m->load_lock, NULL);
+    pthread_cond_init(&m->load_cond, NULL);
+
+    // Allocate the art trees
+    m->filter_map = malloc(sizeof(art_tree));
+    m->alias_map = malloc(sizeof(art_tree));
+    int res = init_art_tree(m->filter_map) || init_art_tree(m->alias_map);
     if (res) {
         syslog(LOG_ERR, "Failed to allocate filter map!");
         free(m);
         return -1;
     }
 
-    // Discover existing filters
+    // Discover existing filters, and then their aliases
     load_existing_filters(m);
-
-    // Initialize the alternate map
-    res = art_copy(m->alt_filter_map, m->filter_map);
-    if (res) {
-        syslog(LOG_ERR, "Failed to copy filter map to alternate!");
-        destroy_filter_manager(m);
-        return -1;
-    }
+    load_aliases(m);
 
     // Start the vacuum thread
     m->should_run = vacuum;
@@ -201,20 +528,25 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
  */
 int destroy_filter_manager(bloom_filtmgr *mgr) {
     // Stop the vacuum thread
+    pthread_mutex_lock(&mgr->write_lock);
     mgr->should_run = 0;
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->write_lock);
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
-    // Nuke all the keys in the current version.
-    art_iter(mgr->filter_map, filter_map_delete_cb, mgr);
+    // Nuke all the keys in the current version, listing
+    // the filters in a manifest for the next startup
+    filter_manifest manifest;
+    init_manifest(mgr, &manifest);
+    art_iter(mgr->filter_map, filter_map_delete_cb, &manifest);
 
-    // Handle any delta operations
-    filter_list *next, *current = mgr->delta;
+    write_manifest(mgr, &manifest);
+
+    // Finish the drops the vacuum has not gotten to
+    filter_list *next, *current = mgr->dropped;
     while (current) {
-        // Only delete pending creates, pending
-        // deletes are still in the primary tree
-        if (current->type == CREATE)
-            delete_filter(current->filter);
         next = current->next;
+        release_filter(current->filter);
         free(current);
         current = next;
     }
@@ -223,14 +555,36 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
     filtmgr_client *cl_next, *cl = mgr->clients;
     while (cl) {
         cl_next = cl->next;
+        free(cl->cache);
         free(cl);
         cl = cl_next;
     }
+    pthread_cond_destroy(&mgr->vacuum_cond);
+
+    // Forget the filters still waiting to be faulted in
+    for (bloom_filter_list *f=mgr->faults, *f_next; f; f=f_next) {
+        f_next = f->next;
+        free(f->filter_name);
+        free(f);
+    }
+    pthread_mutex_destroy(&mgr->fault_lock);
+    pthread_cond_destroy(&mgr->fault_cond);
+
+    // Drop the key files that were never loaded
+    for (key_load *l=mgr->loads, *l_next; l; l=l_next) {
+        l_next = l->next;
+        close(l->fd);
+        release_filter(l->filt);
+        free(l);
+    }
+    pthread_mutex_destroy(&mgr->load_lock);
+    pthread_cond_destroy(&mgr->load_cond);
 
     // Destroy the ART trees
     destroy_art_tree(mgr->filter_map);
-    destroy_art_tree(mgr->alt_filter_map);
-    free((mgr->filter_map < mgr->alt_filter_map) ? mgr->filter_map : mgr->alt_filter_map);
+    free(mgr->filter_map);
+    destroy_art_tree(mgr->alias_map);
+    free(mgr->alias_map);
 
     // Free the manager
     free(mgr);
@@ -246,33 +600,24 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
  * @arg mgr The manager
  */
 void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            cl->vsn = mgr->vsn;
-            return;
-        }
-        cl = cl->next;
-    }
-
-    // If we make it here, we are not a client yet
-    // so we need to safely add ourself
-    cl = malloc(sizeof(filtmgr_client));
-    cl->id = id;
+    filtmgr_client *cl = client_slot(mgr, 1);
     cl->vsn = mgr->vsn;
 
-    // Critical section for the flip
-    LOCK_BLOOM_SPIN(&mgr->clients_lock);
-
-    cl->next = mgr->clients;
-    mgr->clients = cl;
+    // Publish our epoch before reading the filter map
+    __sync_synchronize();
+}
 
-    UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+/**
+ * Should be invoked by clients before they block without
+ * using the filter manager, such as while waiting for IO.
+ * The client is ignored by the vacuum thread until its
+ * next checkpoint, which must be made before using the
+ * manager again.
+ * @arg mgr The manager
+ */
+void filtmgr_client_offline(bloom_filtmgr *mgr) {
+    filtmgr_client *cl = client_slot(mgr, 0);
+    if (cl) cl->vsn = QUIESCENT_VSN;
 }
 
 /**
@@ -282,29 +627,55 @@ void filtmgr_client_checkpoint(bloom_filtmgr *mgr) {
  * @arg mgr The manager
  */
 void filtmgr_client_leave(bloom_filtmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
+    filtmgr_client *cl = client_slot(mgr, 0);
+    if (!cl) return;
+
+    // Release the slot for reuse by another thread
+    cl->vsn = QUIESCENT_VSN;
+    __sync_lock_release(&cl->in_use);
+    thread_client.slot = NULL;
+    thread_client.mgr_id = 0;
+}
 
-    // Critical section
-    LOCK_BLOOM_SPIN(&mgr->clients_lock);
+/**
+ * Finds the epoch slot of the calling thread. The slot
+ * is cached, so this is O(1) apart from the first call.
+ * @arg mgr The manager
+ * @arg create Should a slot be claimed if we have none
+ * @return The slot, or NULL if we have none and create is 0
+ */
+static filtmgr_client* client_slot(bloom_filtmgr *mgr, int create) {
+    if (thread_client.mgr_id == mgr->id) return thread_client.slot;
 
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    filtmgr_client **last_next = &mgr->clients;
-    filtmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            // Set the last prev pointer to skip the current entry
-            *last_next = cl->next;
+    // Look for a slot we already own, a thread may use
+    // more than one manager
+    pthread_t id = pthread_self();
+    filtmgr_client *cl;
+    for (cl=mgr->clients; cl; cl=cl->next) {
+        if (cl->in_use && pthread_equal(cl->id, id)) goto CACHE;
+    }
+    if (!create) return NULL;
 
-            // Cleanup the memory associated
-            free(cl);
-            break;
+    // Claim a released slot, or push a new one
+    for (cl=mgr->clients; cl; cl=cl->next) {
+        if (!__sync_lock_test_and_set(&cl->in_use, 1)) {
+            cl->id = id;
+            goto CACHE;
         }
-        last_next = &cl->next;
-        cl = cl->next;
     }
-    UNLOCK_BLOOM_SPIN(&mgr->clients_lock);
+    cl = malloc(sizeof(filtmgr_client));
+    cl->id = id;
+    cl->vsn = QUIESCENT_VSN;
+    cl->in_use = 1;
+    cl->cache = NULL;
+    do {
+        cl->next = mgr->clients;
+    } while (!__sync_bool_compare_and_swap(&mgr->clients, cl->next, cl));
+
+CACHE:
+    thread_client.mgr_id = mgr->id;
+    thread_client.slot = cl;
+    return cl;
 }
 
 /**
@@ -316,12 +687,67 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
+    flush_filter(filt, 1);
+    return 0;
+}
 
-    // Flush
-    bloomf_flush(filt->filter);
+/**
+ * Writes back the filter with the given name, without
+ * waiting for it to be durable. Once the data dir is
+ * synced, filtmgr_commit_filter completes the flush.
+ * @arg filter_name The name of the filter to write
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_write_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    flush_filter(filt, 0);
+    return 0;
+}
+
+/**
+ * Completes the flush of a filter written back with
+ * filtmgr_write_filter, after the data dir was synced.
+ * @arg filter_name The name of the filter to commit
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_commit_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The read lock keeps a rotation from replacing the generations
+    pthread_rwlock_rdlock(&filt->rwlock);
+    bloomf_commit(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
     return 0;
 }
 
+// Flushes or writes back a filter that has been taken
+static void flush_filter(bloom_filter_wrapper *filt, int sync) {
+    // Flush. Rotating filters hold the read lock, since
+    // a rotation replaces the generations being flushed.
+    int rotating = filt->filter->filter_config.rotate_window;
+    if (rotating) pthread_rwlock_rdlock(&filt->rwlock);
+    if (sync)
+        bloomf_flush(filt->filter);
+    else
+        bloomf_write(filt->filter);
+    if (rotating) pthread_rwlock_unlock(&filt->rwlock);
+
+    // Create the next layer ahead of time, so a growth does
+    // not create it holding the write lock, then move the
+    // older layers that were written out of memory and seal
+    // them. The read lock excludes growths, closes and merges
+    // while the layers are read.
+    if (!rotating) {
+        pthread_rwlock_rdlock(&filt->rwlock);
+        bloomf_prepare_layer(filt->filter);
+        bloomf_tier_layers(filt->filter);
+        bloomf_seal_layers(filt->filter);
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+}
+
 /**
  * Checks for the presence of keys in a given filter
  * @arg filter_name The name of the filter containing the keys
@@ -330,202 +756,1931 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name) {
  * @arg result Ouput array, stores a 0 if the key does not exist
  * or 1 if the key does exist.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
  */
 int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_check_keys_len(mgr, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Like filtmgr_check_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter containing the keys
+ * @arg keys A list of points to character arrays to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result) {
     // Get the filter
+    latency_mark(LATENCY_PARSE);
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    latency_mark(LATENCY_LOOKUP);
     if (!filt) return -1;
+    return check_keys(mgr, filt, keys, key_lens, num_keys, result);
+}
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
+/**
+ * Checks for the presence of keys in a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result) {
+    return filtmgr_check_keys_handle_len(mgr, handle, keys, NULL, num_keys, result);
+}
 
-    // Check the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_contains(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
+/**
+ * Like filtmgr_check_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_mark(LATENCY_PARSE);
+    if (!handle->is_active) return -1;
+    return check_keys(mgr, handle, keys, key_lens, num_keys, result);
+}
+
+// Checks keys in a filter that has been taken
+static int check_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_note(filt->filter->filter_name, num_keys);
+    uint64_t stamp;
+    positive_cache *cache = thread_positive_cache(mgr, filt, &stamp);
+    if (!cache) return check_keys_locked(mgr, filt, keys, key_lens, num_keys, result);
+
+    // Answer the cached keys, and check the rest in the filter
+    char *miss_keys[POSITIVE_BATCH_SIZE];
+    int miss_lens[POSITIVE_BATCH_SIZE];
+    positive_entry *slots[POSITIVE_BATCH_SIZE];
+    uint64_t tags[POSITIVE_BATCH_SIZE];
+    int index[POSITIVE_BATCH_SIZE];
+    char found[POSITIVE_BATCH_SIZE];
+    int hits = 0;
+    for (int base=0; base < num_keys; base += POSITIVE_BATCH_SIZE) {
+        int n = num_keys - base, misses = 0;
+        if (n > POSITIVE_BATCH_SIZE) n = POSITIVE_BATCH_SIZE;
+        for (int i=0; i < n; i++) {
+            char *key = keys[base + i];
+            int len = (key_lens) ? key_lens[base + i] : (int)strlen(key);
+            positive_entry *slot = positive_slot(cache, stamp, key, len, tags + misses);
+            if (slot->stamp == stamp && slot->tag == tags[misses]) {
+                result[base + i] = 1;
+                hits++;
+                continue;
+            }
+            miss_keys[misses] = key;
+            miss_lens[misses] = len;
+            index[misses] = base + i;
+            slots[misses++] = slot;
+        }
+        if (!misses) continue;
+
+        int res = check_keys_locked(mgr, filt, miss_keys, miss_lens, misses, found);
+        if (res) return res;
+        for (int j=0; j < misses; j++) {
+            result[index[j]] = found[j];
+            if (found[j]) {
+                slots[j]->stamp = stamp;
+                slots[j]->tag = tags[j];
+            }
+        }
     }
+    if (hits) {
+        latency_mark(LATENCY_OP);
+        bloomf_count_cached(filt->filter, hits);
+        touch_filter(mgr, filt);
+    }
+    return 0;
+}
+
+// Checks keys in the filter itself, under its lock
+static int check_keys_locked(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result) {
+    if (defer_fault(mgr, filt)) return -6;
+
+    // Acquire the read lock. Checks are safe to run concurrently,
+    // since faulting is protected by the filter itself.
+    read_lock_filter(filt);
+    latency_mark(LATENCY_LOCK);
+
+    // Check the keys as a batch, store the results
+    int res = bloomf_contains_many_len(filt->filter, keys, key_lens, num_keys, result);
+    latency_mark(LATENCY_OP);
 
     // Mark as hot
-    filt->is_hot = 1;
+    touch_filter(mgr, filt);
 
     // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
+    unlock_filter(filt);
     return (res == -1) ? -2 : 0;
 }
 
 /**
- * Sets keys in a given filter
- * @arg filter_name The name of the filter
- * @arg keys A list of points to character arrays to add
- * @arg num_keys The number of keys to add
- * @arg result Ouput array, stores a 0 if the key already is set
- * or 1 if the key is set.
- * * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * Checks for the presence of keys that are already hashed,
+ * so the same keys can be checked in many filters while
+ * hashing each key once. The keys may also be given as
+ * their hash by the client, see bf_hashed_key_init_hash.
+ * @arg filter_name The name of the filter containing the keys
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys to check. With no keys,
+ * only checks that the filter exists.
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry. -8 if the keys are given as their
+ * hash, and the filter can not check hashes.
  */
-int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
-    // Get the filter
+int filtmgr_check_hashed(bloom_filtmgr *mgr, char *filter_name, bloom_hashed_key *keys, int num_keys, char *result) {
+    latency_mark(LATENCY_PARSE);
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    latency_mark(LATENCY_LOOKUP);
     if (!filt) return -1;
+    return check_hashed(mgr, filt, keys, num_keys, result);
+}
 
-    // Acquire the write lock
-    pthread_rwlock_wrlock(&filt->rwlock);
+/**
+ * Checks for the presence of hashed keys through a handle,
+ * like filtmgr_check_hashed.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry. -8 if the keys are given as their
+ * hash, and the filter can not check hashes.
+ */
+int filtmgr_check_hashed_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, bloom_hashed_key *keys, int num_keys, char *result) {
+    latency_mark(LATENCY_PARSE);
+    if (!handle->is_active) return -1;
+    return check_hashed(mgr, handle, keys, num_keys, result);
+}
 
-    // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_add(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
+// Checks hashed keys in a filter that has been taken
+static int check_hashed(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, bloom_hashed_key *keys, int num_keys, char *result) {
+    latency_note(filt->filter->filter_name, num_keys);
+    // Don't fault in the filter just to check no keys
+    if (!num_keys) return 0;
+    // Keys given as their hash have no key to cache
+    uint64_t stamp;
+    positive_cache *cache = (keys->prehashed) ? NULL : thread_positive_cache(mgr, filt, &stamp);
+    if (!cache) return check_hashed_locked(mgr, filt, keys, num_keys, result);
+
+    // Answer the cached keys, and check the rest in the filter
+    bloom_hashed_key miss_keys[POSITIVE_BATCH_SIZE];
+    positive_entry *slots[POSITIVE_BATCH_SIZE];
+    uint64_t tags[POSITIVE_BATCH_SIZE];
+    int index[POSITIVE_BATCH_SIZE];
+    char found[POSITIVE_BATCH_SIZE];
+    int hits = 0;
+    for (int base=0; base < num_keys; base += POSITIVE_BATCH_SIZE) {
+        int n = num_keys - base, misses = 0;
+        if (n > POSITIVE_BATCH_SIZE) n = POSITIVE_BATCH_SIZE;
+        for (int i=0; i < n; i++) {
+            bloom_hashed_key *hk = keys + base + i;
+            positive_entry *slot = positive_slot(cache, stamp, hk->key, hk->len, tags + misses);
+            if (slot->stamp == stamp && slot->tag == tags[misses]) {
+                result[base + i] = 1;
+                hits++;
+                continue;
+            }
+            miss_keys[misses] = *hk;
+            index[misses] = base + i;
+            slots[misses++] = slot;
+        }
+        if (!misses) continue;
+
+        int res = check_hashed_locked(mgr, filt, miss_keys, misses, found);
+        if (res) return res;
+        for (int j=0; j < misses; j++) {
+            // Keep the hashes computed for the other filters
+            keys[index[j]] = miss_keys[j];
+            result[index[j]] = found[j];
+            if (found[j]) {
+                slots[j]->stamp = stamp;
+                slots[j]->tag = tags[j];
+            }
+        }
     }
+    if (hits) {
+        latency_mark(LATENCY_OP);
+        bloomf_count_cached(filt->filter, hits);
+        touch_filter(mgr, filt);
+    }
+    return 0;
+}
 
-    // Mark as hot
-    filt->is_hot = 1;
-
-    // Release the lock
-    pthread_rwlock_unlock(&filt->rwlock);
+// Checks hashed keys in the filter itself, under its lock
+static int check_hashed_locked(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, bloom_hashed_key *keys, int num_keys, char *result) {
+    if (defer_fault(mgr, filt)) return -6;
+
+    read_lock_filter(filt);
+    latency_mark(LATENCY_LOCK);
+    int res = bloomf_contains_hashed(filt->filter, keys, num_keys, result);
+    latency_mark(LATENCY_OP);
+    touch_filter(mgr, filt);
+    unlock_filter(filt);
+    if (res == -EINVAL) return -8;
     return (res == -1) ? -2 : 0;
 }
 
 /**
- * Creates a new filter of the given name and parameters.
- * @arg filter_name The name of the filter
- * @arg custom_config Optional, can be null. Configs that override the defaults.
- * @return 0 on success, -1 if the filter already exists.
- * -2 for internal error. -3 if there is a pending delete.
+ * Returns the positive cache of the calling thread, if one
+ * should be used for checks of a filter. The cache is resized
+ * when positive_cache is reloaded.
+ * @arg mgr The manager
+ * @arg filt The filter being checked
+ * @arg stamp Output, the cache stamp of the filter. It is
+ * loaded before the filter is checked, so a key lost during
+ * the check is not cached under the new stamp.
+ * @return The cache, or NULL to check the filter directly.
  */
-int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+static positive_cache* thread_positive_cache(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, uint64_t *stamp) {
+    uint32_t entries = mgr->config->positive_cache;
+    if (!entries) return NULL;
+    *stamp = bloomf_cache_stamp(filt->filter);
+    if (!*stamp) return NULL;
+
+    filtmgr_client *cl = client_slot(mgr, 1);
+    positive_cache *cache = cl->cache;
+    if (cache && cache->mask + 1 == entries) return cache;
+    free(cache);
+    cache = cl->cache = calloc(1, sizeof(positive_cache) + entries * sizeof(positive_entry));
+    if (cache) cache->mask = entries - 1;
+    return cache;
+}
 
-    // Bail if the filter already exists.
-    bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
-    if (filt) {
-        res = (filt->is_active) ? -1 : -3;
-        goto LEAVE;
-    }
+/**
+ * Finds the entry of the positive cache a key of a filter uses.
+ * The key is hashed once into both the slot and the tag, and the
+ * stamp is mixed into the slot so the hot keys of many filters
+ * do not all share the same entries.
+ * @arg cache The cache
+ * @arg stamp The cache stamp of the filter
+ * @arg key The key
+ * @arg len The length of the key
+ * @arg tag Output, the tag of the key
+ * @return The entry, which holds the key if it has the stamp and tag
+ */
+static positive_entry* positive_slot(positive_cache *cache, uint64_t stamp, const char *key, uint64_t len, uint64_t *tag) {
+    uint64_t h[2];
+    bf_crc_hash128(key, len, h);
+    *tag = h[1];
+    return cache->entries + ((h[0] ^ (stamp * 0x9E3779B97F4A7C15ULL)) & cache->mask);
+}
 
-    // Scan the pending delete queue
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    if (mgr->pending_deletes) {
-        bloom_filter_list *node = mgr->pending_deletes;
-        while (node) {
-            if (!strcmp(node->filter_name, filter_name)) {
-                res = -3; // Pending delete
-                UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
-                goto LEAVE;
-            }
-            node = node->next;
-        }
+/**
+ * Records an access to a filter, for the cold scans,
+ * pre-warming and eviction. Avoids dirtying the cache
+ * line if we don't need to.
+ */
+static inline void touch_filter(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    if (!filt->is_hot) filt->is_hot = 1;
+    if (!filt->accessed) filt->accessed = 1;
+    unsigned int clock = mgr->evict_clock;
+    if (filt->last_access != clock) {
+        filt->last_access = clock;
+        filt->access_ticks++;
     }
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+}
 
-    // Use a custom config if provided, else the default
-    bloom_config *config = (custom_config) ? custom_config : mgr->config;
+/**
+ * With fault_retry, a filter that is not in memory is queued
+ * for the fault thread, rather than faulted in by the worker
+ * while its other clients wait. Until it is in memory, the
+ * commands using it are answered with a retry.
+ * @return 1 if the filter is being faulted in, 0 to use it.
+ */
+static int defer_fault(bloom_filtmgr *mgr, bloom_filter_wrapper *filt) {
+    if (!mgr->config->fault_retry || !bloomf_is_proxied(filt->filter)) return 0;
 
-    // Add the filter to the new version
-    if (add_filter(mgr, filter_name, config, 1, 1)) {
-        res = -2; // Internal error
-    }
+    // Fault in a filter the fault thread failed on ourself, so
+    // the error reaches the client rather than a retry forever
+    if (__atomic_load_n(&filt->fault_failed, __ATOMIC_ACQUIRE) &&
+            __atomic_exchange_n(&filt->fault_failed, 0, __ATOMIC_ACQ_REL)) return 0;
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
-    return res;
+    // Only queue the filter once, until the fault thread takes it
+    if (__atomic_exchange_n(&filt->fault_queued, 1, __ATOMIC_ACQ_REL)) return 1;
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup(filt->filter->filter_name);
+    pthread_mutex_lock(&mgr->fault_lock);
+    node->next = mgr->faults;
+    mgr->faults = node;
+    pthread_cond_signal(&mgr->fault_cond);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return 1;
 }
 
 /**
- * Deletes the filter entirely. This removes it from the filter
- * manager and deletes it from disk. This is a permanent operation.
- * @arg filter_name The name of the filter to delete
- * @return 0 on success, -1 if the filter does not exist.
+ * Acquires the read lock of a filter. The lock is tried
+ * first, so the clock is only read when we have to wait,
+ * and the wait is recorded in the counters of the filter.
  */
-int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
-
+static inline void read_lock_filter(bloom_filter_wrapper *filt) {
+    uint64_t wait = 0;
+    if (pthread_rwlock_tryrdlock(&filt->rwlock)) {
+        uint64_t start = latency_now();
+        pthread_rwlock_rdlock(&filt->rwlock);
+        wait = latency_now() - start;
+        bloomf_record_lock_wait(filt->filter, wait);
+    }
+    BLOOM_PROBE3(lock__acquire, filt->filter->filter_name, 0, wait);
+}
+
+/**
+ * Acquires the write lock of a filter, recording
+ * the wait if it is contended, like read_lock_filter.
+ */
+static inline void write_lock_filter(bloom_filter_wrapper *filt) {
+    uint64_t wait = 0;
+    if (pthread_rwlock_trywrlock(&filt->rwlock)) {
+        uint64_t start = latency_now();
+        pthread_rwlock_wrlock(&filt->rwlock);
+        wait = latency_now() - start;
+        bloomf_record_lock_wait(filt->filter, wait);
+    }
+    BLOOM_PROBE3(lock__acquire, filt->filter->filter_name, 1, wait);
+}
+
+/**
+ * Releases a lock taken by read_lock_filter or write_lock_filter
+ */
+static inline void unlock_filter(bloom_filter_wrapper *filt) {
+    BLOOM_PROBE1(lock__release, filt->filter->filter_name);
+    pthread_rwlock_unlock(&filt->rwlock);
+}
+
+/**
+ * Sets keys in a given filter
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_set_keys_len(mgr, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Like filtmgr_set_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result) {
+    // Get the filter
+    latency_mark(LATENCY_PARSE);
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    latency_mark(LATENCY_LOOKUP);
+    if (!filt) return -1;
+    return set_keys(mgr, filt, keys, key_lens, num_keys, result);
+}
+
+/**
+ * Sets keys in a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result) {
+    return filtmgr_set_keys_handle_len(mgr, handle, keys, NULL, num_keys, result);
+}
+
+/**
+ * Like filtmgr_set_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_mark(LATENCY_PARSE);
+    if (!handle->is_active) return -1;
+    return set_keys(mgr, handle, keys, key_lens, num_keys, result);
+}
+
+/**
+ * Sets keys in a filter under its write lock, combining the
+ * batches of concurrent callers. Each caller queues its batch,
+ * and the first to find no combiner takes the write lock once
+ * for every batch queued so far, so busy filters that grow, and
+ * quotient filters, do not hand the lock from thread to thread
+ * for each batch. The others wait for their batch to be done,
+ * or for the combiner to finish so one of them can take over.
+ * @return The result of bloomf_add_many_len for the batch.
+ */
+static int combine_set(bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result) {
+    set_request req = {keys, key_lens, num_keys, result, 0, 0, NULL};
+    pthread_mutex_lock(&filt->combine_lock);
+    req.next = filt->combine_queue;
+    filt->combine_queue = &req;
+    while (!req.done) {
+        if (filt->combining) {
+            pthread_cond_wait(&filt->combine_cond, &filt->combine_lock);
+            continue;
+        }
+
+        // Take every queued batch, including our own
+        filt->combining = 1;
+        set_request *batch = filt->combine_queue;
+        filt->combine_queue = NULL;
+        pthread_mutex_unlock(&filt->combine_lock);
+
+        write_lock_filter(filt);
+        latency_mark(LATENCY_LOCK);
+        for (set_request *r = batch; r; r = r->next) {
+            r->res = bloomf_add_many_len(filt->filter, r->keys, r->key_lens, r->num_keys, r->result);
+        }
+        unlock_filter(filt);
+
+        // The batches go away once done, so they are marked
+        // under the mutex, which their owners wait on
+        pthread_mutex_lock(&filt->combine_lock);
+        set_request *next;
+        for (set_request *r = batch; r; r = next) {
+            next = r->next;
+            r->done = 1;
+        }
+        filt->combining = 0;
+        pthread_cond_broadcast(&filt->combine_cond);
+    }
+    pthread_mutex_unlock(&filt->combine_lock);
+    latency_mark(LATENCY_OP);
+    return req.res;
+}
+
+// Sets keys in a filter that has been taken
+static int set_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_note(filt->filter->filter_name, num_keys);
+    if (defer_fault(mgr, filt)) return -6;
+
+    // Acquire the read lock. Bits are set atomically, so sets can
+    // proceed concurrently as long as the filter does not need to grow.
+    read_lock_filter(filt);
+    latency_mark(LATENCY_LOCK);
+
+    // Set the keys as a batch, store the results
+    int res = bloomf_try_add_many_len(filt->filter, keys, key_lens, num_keys, result);
+    latency_mark(LATENCY_OP);
+
+    // Mark as hot
+    touch_filter(mgr, filt);
+
+    // Release the lock
+    unlock_filter(filt);
+
+    // Growing the filter requires exclusive access,
+    // so set the remaining keys under the write lock
+    if (res >= 0 && res < num_keys) {
+        res = combine_set(filt, keys + res, (key_lens) ? key_lens + res : NULL,
+                num_keys - res, result + res);
+    }
+    if (res == -EROFS) return -4;
+    if (res == -EDQUOT) return -5;
+    if (res < 0) return -2;
+
+    // Only the keys that were added change the replicas
+    if (mgr->repl) repl_log_keys(mgr->repl, "b", filt->filter->filter_name, keys, key_lens, num_keys, result);
+    bloom_repl_log *migration = __atomic_load_n(&filt->migration, __ATOMIC_ACQUIRE);
+    if (migration) repl_log_keys(migration, "b", filt->filter->filter_name, keys, key_lens, num_keys, result);
+    return 0;
+}
+
+/**
+ * Deletes keys from a filter using the counting layout
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to delete
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
+    return filtmgr_delete_keys_len(mgr, filter_name, keys, NULL, num_keys, result);
+}
+
+/**
+ * Like filtmgr_delete_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to delete
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result) {
+    // Get the filter
+    latency_mark(LATENCY_PARSE);
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    latency_mark(LATENCY_LOOKUP);
+    if (!filt) return -1;
+    return delete_keys(mgr, filt, keys, key_lens, num_keys, result);
+}
+
+/**
+ * Deletes keys from a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to delete
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result) {
+    return filtmgr_delete_keys_handle_len(mgr, handle, keys, NULL, num_keys, result);
+}
+
+/**
+ * Like filtmgr_delete_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to delete
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_mark(LATENCY_PARSE);
+    if (!handle->is_active) return -1;
+    return delete_keys(mgr, handle, keys, key_lens, num_keys, result);
+}
+
+// Deletes keys from a filter that has been taken
+static int delete_keys(bloom_filtmgr *mgr, bloom_filter_wrapper *filt, char **keys, int *key_lens, int num_keys, char *result) {
+    latency_note(filt->filter->filter_name, num_keys);
+    if (defer_fault(mgr, filt)) return -6;
+
+    // Acquire the read lock. Counters are updated atomically,
+    // and deletes never grow the filter.
+    read_lock_filter(filt);
+    latency_mark(LATENCY_LOCK);
+
+    // Delete the keys, store the results
+    int res = bloomf_remove_many_len(filt->filter, keys, key_lens, num_keys, result);
+    latency_mark(LATENCY_OP);
+
+    // Mark as hot
+    touch_filter(mgr, filt);
+
+    // Release the lock
+    unlock_filter(filt);
+    if (res == -EINVAL) return -3;
+    if (res < 0) return -2;
+    if (mgr->repl) repl_log_keys(mgr->repl, "delete", filt->filter->filter_name, keys, key_lens, num_keys, result);
+    bloom_repl_log *migration = __atomic_load_n(&filt->migration, __ATOMIC_ACQUIRE);
+    if (migration) repl_log_keys(migration, "delete", filt->filter->filter_name, keys, key_lens, num_keys, result);
+    return 0;
+}
+
+/**
+ * Opens a handle to a filter, which can be used to check
+ * and set keys without looking up the filter name. The
+ * handle keeps the filter alive until it is released, even
+ * if the filter is dropped or cleared in the mean time.
+ * @arg filter_name The name of the filter
+ * @arg handle Output, set to the new handle
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_open_handle(bloom_filtmgr *mgr, char *filter_name, bloom_filter_handle **handle) {
+    // Get the filter. The vacuum thread cannot drop the reference
+    // of the filter map until we checkpoint, so it is safe to take one.
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    __atomic_add_fetch(&filt->refs, 1, __ATOMIC_RELAXED);
+    *handle = filt;
+    return 0;
+}
+
+/**
+ * Releases a handle returned by filtmgr_open_handle.
+ * @arg handle The handle to release
+ */
+void filtmgr_release_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle) {
+    (void)mgr;
+    release_filter(handle);
+}
+
+/**
+ * Takes keys from the rate limit of a filter, which is shared
+ * by all of its clients, as set by filter_key_rate. This is
+ * only used for the commands of the clients, so the keys the
+ * filters take from the primary or the set log are not limited.
+ * @arg handle The handle of the filter
+ * @arg num_keys The number of keys to be checked, set or deleted
+ * @return 0 if the keys may go ahead, 1 if the filter is over its rate.
+ */
+int filtmgr_limit_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, int num_keys) {
+    uint64_t rate = (uint64_t)__atomic_load_n(&mgr->config->filter_key_rate, __ATOMIC_RELAXED);
+    if (!rate || num_keys <= 0) return 0;
+    return !rate_limit_take(&handle->key_rate, rate, num_keys, rate_limit_now());
+}
+
+/**
+ * Creates a new filter of the given name and parameters.
+ * @arg filter_name The name of the filter
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error. -3 if there is a pending delete.
+ */
+int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config) {
+    pthread_mutex_lock(&mgr->write_lock);
+
+    // Bail if the filter already exists, or is being deleted
+    int res = can_create_filter(mgr, filter_name);
+    if (res) goto LEAVE;
+
+    // Use a custom config if provided, else the default
+    bloom_config *config = (custom_config) ? custom_config : mgr->config;
+
+    // Add the filter to the new version
+    if (add_filter(mgr, filter_name, config, 1)) {
+        res = -2; // Internal error
+    } else if (mgr->repl) {
+        repl_log_create(mgr->repl, filter_name, config);
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Creates new filters as a single version, so clients see
+ * them appear together. The filters are created by
+ * up to load_threads threads. Each filter has the same
+ * results as filtmgr_create_filter.
+ * @arg filter_names The names of the filters
+ * @arg num_filters The number of filters
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * Each filter gets its own copy, the caller keeps ownership.
+ * @arg results Output, the result for each filter
+ * @return The number of filters created.
+ */
+int filtmgr_create_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters,
+        bloom_config *custom_config, int *results) {
+    int created = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+    unsigned long long vsn = mgr->vsn + 1;
+
+    // Check the names first, a name repeated in the batch exists
+    art_tree batch;
+    init_art_tree(&batch);
+    for (int i=0; i < num_filters; i++) {
+        results[i] = can_create_filter(mgr, filter_names[i]);
+        if (!results[i] && art_insert(&batch, (unsigned char*)filter_names[i],
+                    strlen(filter_names[i])+1, filter_names[i]))
+            results[i] = -1;
+    }
+    destroy_art_tree(&batch);
+
+    // Create the folders and configs of the filters in parallel
+    filter_creator creator = {mgr, filter_names, num_filters, 0, custom_config, results,
+        calloc((num_filters > 0) ? num_filters : 1, sizeof(bloom_filter_wrapper*))};
+    run_pool(mgr, create_thread_main, &creator, num_filters);
+
+    for (int i=0; i < num_filters; i++) {
+        if (results[i]) continue;
+        bloom_filter_wrapper *filt = creator.filters[i];
+        if (!filt) {
+            results[i] = -2;
+            continue;
+        }
+
+        map_insert(mgr, vsn, filt);
+        created++;
+        if (mgr->repl) repl_log_create(mgr->repl, filter_names[i], (filt->custom) ? filt->custom : mgr->config);
+    }
+    free(creator.filters);
+    if (created) publish_version(mgr, vsn);
+    pthread_mutex_unlock(&mgr->write_lock);
+    return created;
+}
+
+/**
+ * Checks if a filter can be created.
+ * This must be invoked with the write lock.
+ * @return 0 if it can, -1 if the filter already exists,
+ * -3 if there is a pending delete.
+ */
+static int can_create_filter(bloom_filtmgr *mgr, char *filter_name) {
+    if (find_filter(mgr, filter_name)) return -1;
+
+    // Scan the drops the vacuum has not finished
+    for (filter_list *node=mgr->dropped; node; node=node->next) {
+        if (!strcmp(node->filter->filter->filter_name, filter_name))
+            return -3; // Pending delete
+    }
+    for (bloom_filter_list *node=mgr->pending_deletes; node; node=node->next) {
+        if (!strcmp(node->filter_name, filter_name))
+            return -3;
+    }
+    return 0;
+}
+
+/**
+ * Deletes the filter entirely. This removes it from the filter
+ * manager and deletes it from disk. This is a permanent operation.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name) {
+    int res = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) {
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Set the filter to be non-active and mark for deletion
+    filt->is_active = 0;
+    filt->should_delete = 1;
+    map_remove(mgr, mgr->vsn + 1, filt);
+    publish_version(mgr, mgr->vsn + 1);
+    if (mgr->repl) repl_log_filter_cmd(mgr->repl, "drop", filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Deletes filters entirely as a single version, so clients
+ * see them go together. Each filter has the
+ * same results as filtmgr_drop_filter.
+ * @arg filter_names The names of the filters
+ * @arg num_filters The number of filters
+ * @arg results Output, the result for each filter
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters, int *results) {
+    int dropped = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+    unsigned long long vsn = mgr->vsn + 1;
+    for (int i=0; i < num_filters; i++) {
+        bloom_filter_wrapper *filt = take_filter(mgr, filter_names[i]);
+        if (!filt) {
+            results[i] = -1;
+            continue;
+        }
+
+        // Set the filter to be non-active and mark for deletion
+        filt->is_active = 0;
+        filt->should_delete = 1;
+        map_remove(mgr, vsn, filt);
+        results[i] = 0;
+        dropped++;
+        if (mgr->repl) repl_log_filter_cmd(mgr->repl, "drop", filter_names[i]);
+    }
+    if (dropped) publish_version(mgr, vsn);
+    pthread_mutex_unlock(&mgr->write_lock);
+    return dropped;
+}
+
+/**
+ * Clears the filter from the internal data stores. This can only
+ * be performed if the filter is proxied.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist, -2
+ * if the filter is not proxied.
+ */
+int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
+    int res = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) {
+        res = -1;
+        goto LEAVE;
+    }
+
+    // Check if the filter is proxied
+    if (!bloomf_is_proxied(filt->filter)) {
+        res = -2;
+        goto LEAVE;
+    }
+
+    // This is critical, as it prevents it from
+    // being deleted. Instead, it is merely closed.
+    filt->is_active = 0;
+    filt->should_delete = 0;
+    map_remove(mgr, mgr->vsn + 1, filt);
+    publish_version(mgr, mgr->vsn + 1);
+    if (mgr->repl) repl_log_filter_cmd(mgr->repl, "clear", filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Creates an alias, a name that resolves to a filter
+ * in every command. The alias is removed with its filter.
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the filter, or of an alias of it
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the name is taken by a filter or alias,
+ * -3 if there is a pending delete of the name.
+ */
+int filtmgr_create_alias(bloom_filtmgr *mgr, char *alias, char *filter_name) {
+    pthread_mutex_lock(&mgr->write_lock);
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    int res = (filt) ? can_create_filter(mgr, alias) : -1;
+    if (!filt) goto LEAVE;
+    if (res == -1) res = -2;
+    if (res) goto LEAVE;
+
+    unsigned long long vsn = mgr->vsn + 1;
+    art_cow_insert(mgr->alias_map, (unsigned char*)alias, strlen(alias)+1, filt, vsn);
+    filt->aliases++;
+    publish_version(mgr, vsn);
+    write_aliases(mgr);
+    if (mgr->repl) repl_log_alias(mgr->repl, "alias", alias, filt->filter->filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Points an alias at another filter. Both happen in one
+ * version, so each command sees either the old or the new
+ * filter. The old filter is dropped, unless another alias
+ * still resolves to it.
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the new filter, or of an alias of it
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the alias does not exist.
+ */
+int filtmgr_swap_alias(bloom_filtmgr *mgr, char *alias, char *filter_name) {
+    int res = 0;
+    int len = strlen(alias) + 1;
+    pthread_mutex_lock(&mgr->write_lock);
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    bloom_filter_wrapper *old = art_search(mgr->alias_map, (unsigned char*)alias, len);
+    if (!filt) {
+        res = -1;
+        goto LEAVE;
+    } else if (!old) {
+        res = -2;
+        goto LEAVE;
+    } else if (old == filt) {
+        goto LEAVE;
+    }
+
+    // Repoint the alias and drop the old filter together
+    unsigned long long vsn = mgr->vsn + 1;
+    art_cow_insert(mgr->alias_map, (unsigned char*)alias, len, filt, vsn);
+    filt->aliases++;
+    if (!--old->aliases) {
+        old->is_active = 0;
+        old->should_delete = 1;
+        map_remove(mgr, vsn, old);
+    }
+    publish_version(mgr, vsn);
+    write_aliases(mgr);
+    if (mgr->repl) repl_log_alias(mgr->repl, "alias_swap", alias, filt->filter->filter_name);
+
+LEAVE:
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Removes an alias, leaving its filter.
+ * @arg alias The name of the alias
+ * @return 0 on success, -1 if the alias does not exist.
+ */
+int filtmgr_drop_alias(bloom_filtmgr *mgr, char *alias) {
+    int res = 0;
+    pthread_mutex_lock(&mgr->write_lock);
+    unsigned long long vsn = mgr->vsn + 1;
+    bloom_filter_wrapper *filt = art_cow_delete(mgr->alias_map,
+            (unsigned char*)alias, strlen(alias)+1, vsn);
+    if (!filt) {
+        res = -1;
+    } else {
+        filt->aliases--;
+        publish_version(mgr, vsn);
+        write_aliases(mgr);
+        if (mgr->repl) repl_log_filter_cmd(mgr->repl, "alias_drop", alias);
+    }
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Allocates space for and returns a linked list of the
+ * aliases. Each entry is the alias and the name of its
+ * filter, separated by a space.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_aliases(bloom_filtmgr *mgr, bloom_filter_list_head **head) {
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+    art_iter(mgr->alias_map, alias_list_cb, h);
+    return 0;
+}
+
+/**
+ * Adds a filter whose directory is already in the data dir,
+ * such as one copied in by a replica. The filter is added
+ * cold, and is faulted in from its files on first use.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error. -3 if there is a pending delete.
+ */
+int filtmgr_load_filter(bloom_filtmgr *mgr, char *filter_name) {
+    pthread_mutex_lock(&mgr->write_lock);
+    int res = can_create_filter(mgr, filter_name);
+    if (!res && add_filter(mgr, filter_name, mgr->config, 0)) {
+        res = -2;
+    }
+    pthread_mutex_unlock(&mgr->write_lock);
+    return res;
+}
+
+/**
+ * Invokes a callback to copy the files of a filter, such as to
+ * bootstrap a replica. The filter is flushed first, and is not
+ * unmapped, snapshot or rotated until the callback returns, so
+ * its files stay in place while they are read. Checks and sets
+ * continue during the copy.
+ * @arg filter_name The name of the filter
+ * @arg cb The callback, invoked with data
+ * @return The result of the callback, -1 if the filter does
+ * not exist, -3 if a snapshot is in progress.
+ */
+int filtmgr_copy_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    if (__atomic_exchange_n(&filt->snapshotting, 1, __ATOMIC_ACQ_REL)) return -3;
+    __atomic_add_fetch(&filt->refs, 1, __ATOMIC_RELAXED);
+
+    // A rotation replaces the generations, and needs the write lock
+    int rotating = filt->filter->filter_config.rotate_window;
+    if (rotating) pthread_rwlock_rdlock(&filt->rwlock);
+    bloomf_flush(filt->filter);
+    int res = cb(data, filter_name, filt->filter);
+    if (rotating) pthread_rwlock_unlock(&filt->rwlock);
+
+    __atomic_store_n(&filt->snapshotting, 0, __ATOMIC_RELEASE);
+    release_filter(filt);
+    return res;
+}
+
+/**
+ * Picks up the changes the writer made to the data dir of
+ * a read-only server. Filters the writer created are added
+ * cold, the filters it dropped are closed, and the rest are
+ * refreshed, see bloomf_refresh.
+ * @return 0 on success, -1 if the data dir can not be read.
+ */
+int filtmgr_refresh(bloom_filtmgr *mgr) {
+    struct dirent **namelist;
+    int num = scandir(mgr->config->data_dir, &namelist, filter_bloomd_folders, NULL);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan the data dir for filters!");
+        return -1;
+    }
+
+    // Add the new filters, the existing ones are refreshed below
+    for (int i=0; i < num; i++) {
+        char *filter_name = namelist[i]->d_name + FOLDER_PREFIX_LEN;
+        if (!take_filter(mgr, filter_name) && !filtmgr_load_filter(mgr, filter_name)) {
+            syslog(LOG_INFO, "Found new filter '%s'.", filter_name);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return -1;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        refresh_filter(mgr, node->filter_name);
+    }
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+/**
+ * Sets the replication log the changes made through
+ * the manager are recorded in. Must be set before any
+ * clients use the manager. The pages that change in the
+ * filters are stamped with the generations of the log
+ * from then on, see repl_log_clock.
+ * @arg log The log, or NULL to stop recording
+ */
+void filtmgr_set_repl_log(bloom_filtmgr *mgr, struct bloom_repl_log *log) {
+    mgr->repl = log;
+    if (log) art_iter(mgr->filter_map, track_changes_cb, repl_log_clock(log));
+}
+
+/**
+ * Starts recording the keys set and deleted in a filter
+ * into a log, while the filter is migrated to another
+ * node. The log is owned by the filter from then on, and
+ * is destroyed with it, so sets made through handles that
+ * outlive a drop are still recorded safely.
+ * @arg handle A handle to the filter
+ * @arg log The log
+ * @return 0 on success, -1 if the filter is already migrating.
+ */
+int filtmgr_set_migration_log(bloom_filtmgr *mgr, bloom_filter_handle *handle, struct bloom_repl_log *log) {
+    (void)mgr;
+    bloom_repl_log *expected = NULL;
+    if (__atomic_compare_exchange_n(&handle->migration, &expected, log, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return 0;
+    return -1;
+}
+
+/**
+ * Checks if a filter that was dropped is still being
+ * deleted. Once the delete is done, no client is using
+ * the filter by its name any more.
+ * @arg filter_name The name of the filter
+ * @return 1 if the delete is pending, 0 otherwise.
+ */
+int filtmgr_delete_pending(bloom_filtmgr *mgr, char *filter_name) {
+    return can_create_filter(mgr, filter_name) == -3;
+}
+
+/**
+ * Unmaps the filter from memory, but leaves it
+ * registered in the filter manager. This is rarely invoked
+ * by a client, as it can be handled automatically by bloomd,
+ * but particular clients with specific needs may use it as an
+ * optimization. The filter is only locked exclusively to
+ * detach its layers, which are flushed beforehand and unmapped
+ * afterwards, so clients using the filter do not wait on either.
+ * @arg filter_name The name of the filter to delete
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Skip if we are in memory
+    if (filt->filter->filter_config.in_memory)
+        goto LEAVE;
+
+    // Flush while the filter is still used, so the detach only
+    // writes the pages dirtied since. The read lock excludes growths
+    // and closes, like a flush of a rotating filter.
+    pthread_rwlock_rdlock(&filt->rwlock);
+    bloomf_flush(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    // Detach the layers, unless a snapshot is copying them. Checks
+    // and sets hold the read lock, so none are using the layers
+    // once we have the write lock, and a fault after we release it
+    // maps the files again.
+    bloom_sbf *detached = NULL;
+    int closed = 0;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    if (!__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE)) {
+        detached = bloomf_detach(filt->filter);
+        closed = 1;
+    }
+    pthread_rwlock_unlock(&filt->rwlock);
+    bloomf_unmap_detached(detached);
+
+    // Compressing skips a filter that was faulted in again
+    if (closed && filt->filter->config->compress_cold) {
+        pthread_rwlock_wrlock(&filt->rwlock);
+        bloomf_compress(filt->filter);
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+
+LEAVE:
+    return 0;
+}
+
+/**
+ * Faults in a filter ahead of its use, and marks it
+ * as hot so it is not unmapped by the next cold scan.
+ * @arg filter_name The name of the filter to warm
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_warm_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Faulting is protected by the filter itself
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_fault(filt->filter);
+    if (!filt->is_hot) filt->is_hot = 1;
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -5 : 0;
+}
+
+/**
+ * Waits for a filter to be queued for the fault thread,
+ * by a command that found it was not in memory.
+ * @arg timeout_msec The longest time to wait
+ * @return 1 if there are queued filters, 0 otherwise.
+ */
+int filtmgr_wait_faults(bloom_filtmgr *mgr, int timeout_msec) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_msec / 1000;
+    deadline.tv_nsec += (timeout_msec % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mgr->fault_lock);
+    if (!mgr->faults) pthread_cond_timedwait(&mgr->fault_cond, &mgr->fault_lock, &deadline);
+    int queued = mgr->faults != NULL;
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return queued;
+}
+
+/**
+ * Faults in the filters queued by commands that found them
+ * not in memory, with fault_retry. Called by the fault thread,
+ * so the workers never wait on a fault in.
+ * @return The number of filters faulted in.
+ */
+int filtmgr_run_faults(bloom_filtmgr *mgr) {
+    pthread_mutex_lock(&mgr->fault_lock);
+    bloom_filter_list *node = mgr->faults;
+    mgr->faults = NULL;
+    pthread_mutex_unlock(&mgr->fault_lock);
+
+    int faulted = 0;
+    while (node) {
+        // The filter may have been dropped since it was queued
+        bloom_filter_wrapper *filt = take_filter(mgr, node->filter_name);
+        if (filt) {
+            pthread_rwlock_rdlock(&filt->rwlock);
+            if (bloomf_fault(filt->filter)) {
+                syslog(LOG_ERR, "Failed to fault in filter '%s'.", node->filter_name);
+                __atomic_store_n(&filt->fault_failed, 1, __ATOMIC_RELEASE);
+            } else {
+                faulted++;
+            }
+            pthread_rwlock_unlock(&filt->rwlock);
+            __atomic_store_n(&filt->fault_queued, 0, __ATOMIC_RELEASE);
+        }
+
+        bloom_filter_list *next = node->next;
+        free(node->filter_name);
+        free(node);
+        node = next;
+    }
+
+    // Wake the commands waiting on the filters
+    pthread_mutex_lock(&mgr->fault_lock);
+    if (mgr->fault_hook) mgr->fault_hook(mgr->fault_hook_arg);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return faulted;
+}
+
+/**
+ * With fault_retry, queues a filter that is not in memory
+ * for the fault thread, so a command can wait for it to be
+ * faulted in rather than be answered with a retry.
+ * @arg filter_name The name of the filter
+ * @return 1 if the filter is being faulted in, 0 if it
+ * can be used, or does not exist.
+ */
+int filtmgr_queue_fault(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    return (filt) ? defer_fault(mgr, filt) : 0;
+}
+
+/**
+ * Sets the hook invoked by the fault thread each time it has
+ * faulted in the queued filters, to resume the commands that
+ * wait on them. The hook is invoked with the fault lock held,
+ * so it must not call into the manager.
+ * @arg hook The hook, or NULL to clear it. Once cleared,
+ * the previous hook is no longer invoked.
+ * @arg arg Passed to the hook
+ */
+void filtmgr_set_fault_hook(bloom_filtmgr *mgr, filtmgr_fault_hook hook, void *arg) {
+    pthread_mutex_lock(&mgr->fault_lock);
+    mgr->fault_hook = hook;
+    mgr->fault_hook_arg = arg;
+    pthread_mutex_unlock(&mgr->fault_lock);
+}
+
+/**
+ * Queues a key file to be loaded into a filter by the load
+ * thread. Each line of the file is a key, and the lines are
+ * set in parallel by load_threads threads. The file is relative
+ * to the load_dir, and must not resolve to a path outside of it.
+ * @arg filter_name The name of the filter
+ * @arg path The key file, relative to the load_dir
+ * @return 0 if the load is queued, -1 if the filter does not
+ * exist, -2 if the file can not be read, -3 if a load of the
+ * filter is already queued or running, -4 if there is no load_dir.
+ */
+int filtmgr_queue_load(bloom_filtmgr *mgr, char *filter_name, char *path) {
+    char *load_dir = mgr->config->load_dir;
+    if (!load_dir) return -4;
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Resolve the file, which must stay within the load_dir
+    char *joined = join_path(load_dir, path);
+    char *real = realpath(joined, NULL);
+    char *real_dir = realpath(load_dir, NULL);
+    free(joined);
+    int fd = -1;
+    if (real && real_dir) {
+        int dir_len = strlen(real_dir);
+        if (!strncmp(real, real_dir, dir_len) && real[dir_len] == '/')
+            fd = open(real, O_RDONLY);
+    }
+    free(real);
+    free(real_dir);
+
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) return -2;
+
+    // Only one load of a filter at a time
+    if (__atomic_exchange_n(&filt->load_queued, 1, __ATOMIC_ACQ_REL)) {
+        close(fd);
+        return -3;
+    }
+    __atomic_store_n(&filt->load.size, (uint64_t)st.st_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&filt->load.bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&filt->load.keys, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&filt->load.added, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&filt->load.state, LOAD_QUEUED, __ATOMIC_RELEASE);
+
+    // The load holds a reference, like a handle
+    __atomic_add_fetch(&filt->refs, 1, __ATOMIC_RELAXED);
+    key_load *load = calloc(1, sizeof(key_load));
+    load->filt = filt;
+    load->fd = fd;
+    load->size = st.st_size;
+
+    pthread_mutex_lock(&mgr->load_lock);
+    if (mgr->loads_tail)
+        mgr->loads_tail->next = load;
+    else
+        mgr->loads = load;
+    mgr->loads_tail = load;
+    pthread_cond_signal(&mgr->load_cond);
+    pthread_mutex_unlock(&mgr->load_lock);
+    return 0;
+}
+
+/**
+ * Waits for a key file to be queued for the load thread.
+ * @arg timeout_msec The longest time to wait
+ * @return 1 if there are queued loads, 0 otherwise.
+ */
+int filtmgr_wait_loads(bloom_filtmgr *mgr, int timeout_msec) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_msec / 1000;
+    deadline.tv_nsec += (timeout_msec % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mgr->load_lock);
+    if (!mgr->loads) pthread_cond_timedwait(&mgr->load_cond, &mgr->load_lock, &deadline);
+    int queued = mgr->loads != NULL;
+    pthread_mutex_unlock(&mgr->load_lock);
+    return queued;
+}
+
+/**
+ * Loads the queued key files, oldest first. Called by the
+ * load thread. The loads hold their filters, so this does
+ * not use the filter map, and may be called while offline.
+ * @arg should_run Pointer to an integer that is set to 0
+ * to stop the loads early, which then fail.
+ * @return The number of loads that were finished.
+ */
+int filtmgr_run_loads(bloom_filtmgr *mgr, int *should_run) {
+    int done = 0;
+    while (*should_run) {
+        pthread_mutex_lock(&mgr->load_lock);
+        key_load *load = mgr->loads;
+        if (load) {
+            mgr->loads = load->next;
+            if (!mgr->loads) mgr->loads_tail = NULL;
+        }
+        pthread_mutex_unlock(&mgr->load_lock);
+        if (!load) break;
+
+        bloom_filter_wrapper *filt = load->filt;
+        __atomic_store_n(&filt->load.state, LOAD_RUNNING, __ATOMIC_RELEASE);
+        load_run run = {mgr, load, NULL, 0, 0, should_run};
+        if (load->size) {
+            run.data = mmap(NULL, load->size, PROT_READ, MAP_PRIVATE, load->fd, 0);
+            if (run.data == MAP_FAILED) {
+                syslog(LOG_ERR, "Failed to map the key file of filter '%s'. %s",
+                        filt->filter->filter_name, strerror(errno));
+                run.data = NULL;
+                run.failed = 1;
+            } else {
+                madvise(run.data, load->size, MADV_SEQUENTIAL);
+                uint64_t chunks = (load->size + LOAD_CHUNK_BYTES - 1) / LOAD_CHUNK_BYTES;
+                run_pool(mgr, load_keys_main, &run, (chunks > INT_MAX) ? INT_MAX : (int)chunks);
+                munmap(run.data, load->size);
+            }
+        }
+
+        int failed = run.failed || !*should_run;
+        __atomic_store_n(&filt->load.state, (failed) ? LOAD_FAILED : LOAD_DONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&filt->load_queued, 0, __ATOMIC_RELEASE);
+        syslog((failed) ? LOG_WARNING : LOG_INFO, "%s %llu keys into filter '%s'.",
+                (failed) ? "Stopped the load after" : "Loaded",
+                (unsigned long long)__atomic_load_n(&filt->load.keys, __ATOMIC_RELAXED),
+                filt->filter->filter_name);
+        if (!failed) done++;
+
+        close(load->fd);
+        release_filter(filt);
+        free(load);
+    }
+    return done;
+}
+
+/**
+ * Gets the progress of the last load of a key file into a filter.
+ * @arg filter_name The name of the filter
+ * @arg progress Output, the progress. The state is LOAD_NONE
+ * if no key file was loaded into the filter.
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_load_progress(bloom_filtmgr *mgr, char *filter_name, bloom_load_progress *progress) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    progress->state = __atomic_load_n(&filt->load.state, __ATOMIC_ACQUIRE);
+    progress->size = __atomic_load_n(&filt->load.size, __ATOMIC_RELAXED);
+    progress->bytes = __atomic_load_n(&filt->load.bytes, __ATOMIC_RELAXED);
+    progress->keys = __atomic_load_n(&filt->load.keys, __ATOMIC_RELAXED);
+    progress->added = __atomic_load_n(&filt->load.added, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Rotates a rotating filter, starting a new generation
+ * and deleting the expired ones as needed.
+ * @arg filter_name The name of the filter to rotate
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_rotate_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t now) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Rotating replaces the generations, so it is exclusive
+    pthread_rwlock_wrlock(&filt->rwlock);
+    int res = bloomf_rotate(filt->filter, now);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -5 : 0;
+}
+
+/**
+ * Ages an aging filter, expiring the keys that were
+ * not set for its TTL.
+ * @arg filter_name The name of the filter to age
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_age_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t now) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Aging only clears stamps, which races safely with
+    // checks and sets, so they carry on meanwhile
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_age(filt->filter, now);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -5 : 0;
+}
+
+/**
+ * Verifies the page checksums of the next pages of a filter,
+ * carrying on where the last call stopped. Checks and sets
+ * carry on meanwhile.
+ * @arg filter_name The name of the filter to scrub
+ * @arg max_pages The most pages to verify
+ * @return The number of pages verified, which is less than
+ * max_pages once every page of the filter was verified. -1 if
+ * the filter does not exist, -5 for internal error.
+ */
+int64_t filtmgr_scrub_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t max_pages) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The read lock excludes growths, closes and merges
+    // while the layers are read
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int64_t res = bloomf_scrub(filt->filter, max_pages);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res < 0) ? -5 : res;
+}
+
+/**
+ * Measures how much of a filter is resident in memory, for
+ * the info command and the metrics. Checks and sets carry
+ * on meanwhile.
+ * @arg filter_name The name of the filter to scan
+ * @return 0 on success, -1 if the filter does not exist,
+ * -5 for internal error.
+ */
+int filtmgr_scan_residency(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The read lock excludes growths, closes and merges
+    // while the layers are scanned
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_scan_residency(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -5 : 0;
+}
+
+/**
+ * Hints the kernel to reclaim the clean pages of a filter
+ * mapped from its files, when memory is under pressure. The
+ * filter stays mapped, and checks and sets carry on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg pageout If 1, reclaim the older layers now rather
+ * than marking them cold
+ * @arg bytes Output, the bytes of the pages that were hinted
+ * @return 0 on success, -1 if the filter does not exist,
+ * -5 for internal error.
+ */
+int filtmgr_reclaim_filter(bloom_filtmgr *mgr, char *filter_name, int pageout, uint64_t *bytes) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
-    if (!filt) {
-        res = -1;
-        goto LEAVE;
-    }
+    if (!filt) return -1;
 
-    // Set the filter to be non-active and mark for deletion
-    filt->is_active = 0;
-    filt->should_delete = 1;
-    create_delta_update(mgr, DELETE, filt);
+    // The read lock excludes growths, closes and merges
+    // while the layers are hinted
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_reclaim(filt->filter, pageout, bytes);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -5 : 0;
+}
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
-    return res;
+/**
+ * Counts the bytes of a filter that changed since it was
+ * last flushed, for the flush thread. Checks and sets carry
+ * on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg bytes Output, the dirty bytes
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_dirty_bytes(bloom_filtmgr *mgr, char *filter_name, uint64_t *bytes) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The read lock excludes growths while the layers are counted
+    pthread_rwlock_rdlock(&filt->rwlock);
+    *bytes = bloomf_dirty_bytes(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return 0;
 }
 
 /**
- * Clears the filter from the internal data stores. This can only
- * be performed if the filter is proxied.
- * @arg filter_name The name of the filter to delete
- * @return 0 on success, -1 if the filter does not exist, -2
- * if the filter is not proxied.
+ * Copies the runs of pages of a filter that changed in a
+ * generation of the replication log or later, in batches,
+ * see bloomf_changed_pages. Checks and sets carry on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg gen The generation
+ * @arg cursor In/out, the next page to copy, 0 on the first call
+ * @arg num_layers In/out, the layers copied, 0 on the first call
+ * @arg max_run The most bytes given to the callback at once
+ * @arg cb The callback, invoked with data
+ * @return 1 if the callback stopped the copy, 0 once it is done,
+ * -1 if the filter does not exist, -5 if the pages of the filter
+ * are not tracked since the generation, and it must be copied whole.
  */
-int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name) {
-    int res = 0;
-    pthread_mutex_lock(&mgr->write_lock);
+int filtmgr_changed_pages(bloom_filtmgr *mgr, char *filter_name, uint32_t gen, uint64_t *cursor,
+        uint32_t *num_layers, uint64_t max_run, bloom_pages_cb cb, void *data) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // The read lock excludes growths and closes while the pages are copied
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_changed_pages(filt->filter, gen, cursor, num_layers, max_run, cb, data);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res < 0) ? -5 : res;
+}
 
+/**
+ * Merges the changed pages of a filter on another node into
+ * the filter, see bloomf_merge_pages.
+ * @arg filter_name The name of the filter
+ * @arg num_layers The number of layers of the other filter
+ * @arg layer The layer of the pages, counted from the oldest
+ * @arg layer_bytes The size of the layer
+ * @arg offset The offset of the pages in the layer
+ * @arg bytes The pages
+ * @arg len The length of the pages
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 for internal error, -5 if the layers of the filters differ.
+ */
+int filtmgr_merge_pages(bloom_filtmgr *mgr, char *filter_name, uint32_t num_layers, uint32_t layer,
+        uint64_t layer_bytes, uint64_t offset, const unsigned char *bytes, uint64_t len) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
-    if (!filt) {
-        res = -1;
-        goto LEAVE;
-    }
+    if (!filt) return -1;
 
-    // Check if the filter is proxied
-    if (!bloomf_is_proxied(filt->filter)) {
-        res = -2;
-        goto LEAVE;
+    write_lock_filter(filt);
+    int res = bloomf_merge_pages(filt->filter, num_layers, layer, layer_bytes, offset, bytes, len);
+    touch_filter(mgr, filt);
+    unlock_filter(filt);
+    return (res == -EINVAL) ? -5 : (res) ? -2 : 0;
+}
+
+/**
+ * Writes a consistent point-in-time copy of the filter to
+ * the snapshots folder of the data dir. The layers are copied
+ * while checks and sets continue, and the write lock is only
+ * held to start the snapshot and to copy the pages that
+ * changed during the copy.
+ * @arg filter_name The name of the filter to snapshot
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -6 if the filter rotates, -7 if the filter is frozen,
+ * -9 if the filter is sharded.
+ */
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name) {
+    return snapshot_filter(mgr, filter_name, NULL, NULL);
+}
+
+/**
+ * Snapshots an in-memory filter if it has changed since its
+ * last snapshot, which it is restored from when next loaded.
+ * @arg filter_name The name of the filter
+ * @return 0 if a snapshot was written, 1 if the filter is
+ * not in-memory or is unchanged, or the errors of
+ * filtmgr_snapshot_filter.
+ */
+int filtmgr_snapshot_memory_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    bloom_filter *f = filt->filter;
+    if (!f->filter_config.in_memory || !f->sbf || f->gens || f->keyshards ||
+            f->filter_config.frozen || f->filter_config.layout == BLOOM_LAYOUT_QUOTIENT) return 1;
+
+    // The size only changes with the bits, so an unchanged
+    // size is an unchanged filter
+    pthread_rwlock_rdlock(&filt->rwlock);
+    uint64_t size = bloomf_size(f);
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (size == __atomic_load_n(&f->snapshot_size, __ATOMIC_RELAXED)) return 1;
+    return snapshot_filter(mgr, filter_name, NULL, NULL);
+}
+
+/**
+ * Writes a snapshot of the filter, like filtmgr_snapshot_filter,
+ * and invokes a callback to copy its files, such as to export
+ * it. No other snapshot of the filter can replace the files
+ * until the callback returns. The files are in the directory
+ * given by bloomf_snapshot_path.
+ * @arg filter_name The name of the filter to export
+ * @arg cb The callback, invoked with data
+ * @return The result of the callback, the errors of
+ * filtmgr_snapshot_filter, or -4 if the filter is in-memory,
+ * since its files would be received as an empty filter.
+ */
+int filtmgr_export_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data) {
+    return snapshot_filter(mgr, filter_name, cb, data);
+}
+
+/**
+ * Writes a snapshot of a filter, and then invokes
+ * the callback, if any, while it is still held.
+ */
+static int snapshot_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data) {
+    // Get the filter, and hold a reference while copying
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    if (filt->filter->filter_config.rotate_window) return -6;
+    if (filt->filter->filter_config.in_memory && cb) return -4;
+    if (filt->filter->filter_config.frozen) return -7;
+    if (filt->filter->filter_config.shards) return -9;
+    if (__atomic_exchange_n(&filt->snapshotting, 1, __ATOMIC_ACQ_REL)) return -3;
+    __atomic_add_fetch(&filt->refs, 1, __ATOMIC_RELAXED);
+
+    // Start tracking changes. Unmaps are skipped until we are done,
+    // so the layers stay valid while we copy them without the lock.
+    bloom_filter_snapshot *snap;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    int res = bloomf_snapshot_begin(filt->filter, &snap);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    if (!res) {
+        res = bloomf_snapshot_copy(filt->filter, snap);
+        pthread_rwlock_wrlock(&filt->rwlock);
+        res |= bloomf_snapshot_finish(filt->filter, snap, res == 0);
+        pthread_rwlock_unlock(&filt->rwlock);
     }
+    res = (res) ? -5 : 0;
+    if (!res && cb) res = cb(data, filter_name, filt->filter);
 
-    // This is critical, as it prevents it from
-    // being deleted. Instead, it is merely closed.
-    filt->is_active = 0;
-    filt->should_delete = 0;
-    create_delta_update(mgr, DELETE, filt);
+    __atomic_store_n(&filt->snapshotting, 0, __ATOMIC_RELEASE);
+    release_filter(filt);
+    return res;
+}
 
-LEAVE:
-    pthread_mutex_unlock(&mgr->write_lock);
+/**
+ * Freezes a freezable filter into an xor filter, which
+ * is smaller and faster to check. A frozen filter can
+ * no longer be set.
+ * @arg filter_name The name of the filter to freeze
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -7 if the filter is already frozen, -8 if the filter
+ * was not created freezable.
+ */
+int filtmgr_freeze_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Freezing replaces the SBF, so it is exclusive. A snapshot
+    // copies the layers without the lock, so it must finish first.
+    int res;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    if (__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE))
+        res = -3;
+    else {
+        res = bloomf_freeze(filt->filter);
+        if (res == -EEXIST) res = -7;
+        else if (res == -EINVAL) res = -8;
+        else if (res) res = -5;
+    }
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (!res && mgr->repl) repl_log_filter_cmd(mgr->repl, "freeze", filter_name);
     return res;
 }
 
 /**
- * Unmaps the filter from memory, but leaves it
- * registered in the filter manager. This is rarely invoked
- * by a client, as it can be handled automatically by bloomd,
- * but particular clients with specific needs may use it as an
- * optimization.
- * @arg filter_name The name of the filter to delete
+ * Compacts the layers of a freezable filter into one
+ * layer, so checks probe a single bloom filter.
+ * @arg filter_name The name of the filter to compact
  * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -7 if the filter is frozen, -8 if the filter was not
+ * created freezable.
  */
-int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name) {
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name) {
     // Get the filter
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
-    // Skip if we are in memory
-    if (filt->filter->filter_config.in_memory)
-        goto LEAVE;
+    // Compacting replaces the layers, so it is exclusive like a freeze
+    int res;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    if (__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE))
+        res = -3;
+    else {
+        res = bloomf_compact(filt->filter);
+        if (res == -EEXIST) res = -7;
+        else if (res == -EINVAL) res = -8;
+        else if (res) res = -5;
+    }
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (!res && mgr->repl) repl_log_filter_cmd(mgr->repl, "compact", filter_name);
+    return res;
+}
+
+/**
+ * Shrinks a filter that holds far fewer keys than it was
+ * created for, by folding its layer onto itself.
+ * @arg filter_name The name of the filter to shrink
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -4 if the filter is
+ * in-memory, -5 for internal error, -6 if the filter rotates,
+ * -7 if the filter is frozen, -10 if its layout can not be
+ * folded.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
 
-    // Acquire the write lock
+    // Shrinking replaces the layers, so it is exclusive like a compaction
+    int res;
+    uint32_t folds = 0;
     pthread_rwlock_wrlock(&filt->rwlock);
+    if (__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE))
+        res = -3;
+    else {
+        res = bloomf_shrink(filt->filter, &folds);
+        if (res == -EROFS) res = -4;
+        else if (res == -EINVAL) res = -6;
+        else if (res == -EEXIST) res = -7;
+        else if (res == -ENOTSUP) res = -10;
+        else if (res) res = -5;
+    }
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (res || !folds) return res;
 
-    // Close the filter
-    bloomf_close(filt->filter);
+    // A migration replays the shrink over the files it sent
+    if (mgr->repl) repl_log_filter_cmd(mgr->repl, "shrink", filter_name);
+    bloom_repl_log *migration = __atomic_load_n(&filt->migration, __ATOMIC_ACQUIRE);
+    if (migration) repl_log_filter_cmd(migration, "shrink", filter_name);
+    return 0;
+}
 
-    // Release the lock
+/**
+ * Empties a filter in place, so it can be rotated without
+ * a drop and create. The layers are replaced with one empty
+ * layer while the filter is locked, so clients never see the
+ * filter missing, and the old layers are not written back.
+ * @arg filter_name The name of the filter to reset
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -6 if the filter rotates, -7 if the filter is frozen.
+ */
+int filtmgr_reset_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Resetting replaces the SBF, so it is exclusive like a freeze
+    int res;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    if (__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE))
+        res = -3;
+    else {
+        res = bloomf_reset(filt->filter);
+        if (res == -EEXIST) res = -7;
+        else if (res == -EINVAL) res = -6;
+        else if (res) res = -5;
+    }
     pthread_rwlock_unlock(&filt->rwlock);
+    if (res) return res;
 
-LEAVE:
+    // A migration replays the reset over the files it sent
+    if (mgr->repl) repl_log_filter_cmd(mgr->repl, "reset", filter_name);
+    bloom_repl_log *migration = __atomic_load_n(&filt->migration, __ATOMIC_ACQUIRE);
+    if (migration) repl_log_filter_cmd(migration, "reset", filter_name);
+    return 0;
+}
+
+/**
+ * Creates a filter from the union or intersection of
+ * existing filters, by merging their bitmaps. The new filter
+ * takes the parameters of the first source, and every source
+ * must have been created with the same parameters.
+ * @arg filter_name The name of the new filter
+ * @arg sources The names of the filters to merge
+ * @arg num_sources The number of sources, at least one
+ * @arg intersect 1 for an intersection, 0 for a union
+ * @return 0 on success, -1 if a source does not exist.
+ * -2 for internal error. -3 if there is a pending delete.
+ * -4 if the filter already exists. -5 if the sources
+ * can not be merged.
+ */
+int filtmgr_merge_filters(bloom_filtmgr *mgr, char *filter_name, char **sources, int num_sources, int intersect) {
+    if (num_sources < 1) return -1;
+    for (int i=0; i < num_sources; i++) {
+        if (!take_filter(mgr, sources[i])) return -1;
+    }
+
+    // The new filter has the parameters of the first source,
+    // but only plain filters have bitmaps that can be merged
+    bloom_filter_wrapper *first = take_filter(mgr, sources[0]);
+    bloom_filter_config *fc = &first->filter->filter_config;
+    bloom_config *config = malloc(sizeof(bloom_config));
+    memcpy(config, mgr->config, sizeof(bloom_config));
+    config->initial_capacity = fc->initial_capacity;
+    config->default_probability = fc->default_probability;
+    config->scale_size = fc->scale_size;
+    config->probability_reduction = fc->probability_reduction;
+    config->in_memory = fc->in_memory;
+    config->layout = fc->layout;
+    config->hash_scheme = fc->hash_scheme;
+    config->warmup = fc->warmup;
+    config->key_ttl = fc->key_ttl;
+    config->max_probes = fc->max_probes;
+    config->rotate_window = 0;
+    config->freezable = 0;
+    config->summary_capacity = 0;
+    config->shards = 0;
+
+    // The create is not replicated, since the replicas
+    // merge their own sources
+    pthread_mutex_lock(&mgr->write_lock);
+    int res = can_create_filter(mgr, filter_name);
+    if (res == -1) res = -4;
+    else if (!res && add_filter(mgr, filter_name, config, 1)) res = -2;
+    pthread_mutex_unlock(&mgr->write_lock);
+    if (res) {
+        free(config);
+        return res;
+    }
+
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -2;
+    write_lock_filter(filt);
+    for (int i=0; i < num_sources && !res; i++) {
+        bloom_filter_wrapper *source = take_filter(mgr, sources[i]);
+        if (!source) {
+            res = -ENOENT;
+            break;
+        }
+        read_lock_filter(source);
+        res = bloomf_merge(filt->filter, source->filter, (i) ? intersect : 0);
+        touch_filter(mgr, source);
+        unlock_filter(source);
+    }
+    if (!res && bloomf_flush(filt->filter)) res = -2;
+    touch_filter(mgr, filt);
+    unlock_filter(filt);
+
+    // Do not leave a partial filter behind
+    if (res) {
+        filtmgr_drop_filter(mgr, filter_name);
+        return (res == -EINVAL) ? -5 : (res == -ENOENT) ? -1 : -2;
+    }
+    if (mgr->repl) repl_log_keys(mgr->repl, (intersect) ? "intersect" : "union",
+            filter_name, sources, NULL, num_sources, NULL);
     return 0;
 }
 
@@ -548,28 +2703,6 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
         art_iter_prefix(mgr->filter_map, (unsigned char*)prefix, prefix_len, filter_map_list_cb, h);
     } else
         art_iter(mgr->filter_map, filter_map_list_cb, h);
-
-    // Joy... we have to potentially handle the delta updates
-    if (mgr->primary_vsn == mgr->vsn) return 0;
-
-    filter_list *current = mgr->delta;
-    bloom_filter_wrapper *f;
-    while (current) {
-        // Check if this is a match (potential prefix)
-        if (current->type == CREATE) {
-            f = current->filter;
-            if (!prefix_len || !strncmp(f->filter->filter_name, prefix, prefix_len)) {
-                f = current->filter;
-                filter_map_list_cb(h, (unsigned char*)f->filter->filter_name, 0, f);
-            }
-        }
-
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
-
     return 0;
 }
 
@@ -577,7 +2710,8 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
 /**
  * Allocates space for and returns a linked
  * list of all the cold filters. This has the side effect
- * of clearing the list of cold filters!
+ * of clearing the list of cold filters! Pinned filters
+ * are never listed.
  * @arg mgr The manager to list from
  * @arg head Output, sets to the address of the list header
  * @return 0 on success.
@@ -586,13 +2720,50 @@ int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head)
     // Allocate the head of a new hashmap
     bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
 
-    // Scan for the cold filters. Ignore deltas, since they are either
-    // new (e.g. hot), or being deleted anyways.
+    // Scan for the cold filters
     art_iter(mgr->filter_map, filter_map_list_cold_cb, h);
     return 0;
 }
 
 
+/**
+ * Allocates space for and returns a linked list of
+ * the rotating filters that should be rotated. The
+ * memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg now The current time in seconds
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_rotate_filters(bloom_filtmgr *mgr, uint64_t now, bloom_filter_list_head **head) {
+    // Allocate the head of a new hashmap
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Scan the filters
+    rotate_scan scan = {h, now};
+    art_iter(mgr->filter_map, filter_map_list_rotate_cb, &scan);
+    return 0;
+}
+
+/**
+ * Allocates space for and returns a linked list of
+ * the aging filters that are due a tick. The
+ * memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg now The current time in seconds
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_age_filters(bloom_filtmgr *mgr, uint64_t now, bloom_filter_list_head **head) {
+    // Allocate the head of a new hashmap
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Scan the filters
+    rotate_scan scan = {h, now};
+    art_iter(mgr->filter_map, filter_map_list_age_cb, &scan);
+    return 0;
+}
+
 /**
  * This method allows a callback function to be invoked with bloom filter.
  * The purpose of this is to ensure that a bloom filter is not deleted or
@@ -611,6 +2782,29 @@ int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void*
     return 0;
 }
 
+/**
+ * Invokes a callback with each of the filters, in the same
+ * order as filtmgr_list_filters, without copying the names.
+ * The same rules as filtmgr_filter_cb apply, the filters are
+ * not locked and the callback should only read metrics and
+ * cached metadata. The filters are kept alive until the
+ * caller checkpoints, so the iteration must not span one.
+ * @arg mgr The manager to iterate
+ * @arg prefix The prefix to iterate or NULL
+ * @arg cb The callback, invoked with data
+ * @return 0 on success.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, filter_cb cb, void *data) {
+    iter_scan scan = {cb, data};
+    int prefix_len = 0;
+    if (prefix) {
+        prefix_len = strlen(prefix);
+        art_iter_prefix(mgr->filter_map, (unsigned char*)prefix, prefix_len, filter_map_iter_cb, &scan);
+    } else
+        art_iter(mgr->filter_map, filter_map_iter_cb, &scan);
+    return 0;
+}
+
 
 /**
  * Convenience method to cleanup a filter list.
@@ -626,42 +2820,40 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head) {
     free(head);
 }
 
-// Searches the primary tree and the delta list for a filter
+// Searches the current version of the map for a filter, then the aliases
 static bloom_filter_wrapper* find_filter(bloom_filtmgr *mgr, char *filter_name) {
-    // Search the tree first
-    bloom_filter_wrapper *filt = art_search(mgr->filter_map,
-            (unsigned char*)filter_name, strlen(filter_name)+1);
-    if (filt) return filt;
-
-    // Check if the primary has all delta changes
-    if (mgr->primary_vsn == mgr->vsn) return NULL;
-
-    // Search the delta list
-    filter_list *current = mgr->delta;
-    while (current) {
-        // Check if this is a match
-        if (current->type != BARRIER &&
-            strcmp(current->filter->filter->filter_name, filter_name) == 0) {
-            return current->filter;
-        }
-
-        // Don't seek past what the primary map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
-
-    // Not found
-    return NULL;
+    int len = strlen(filter_name) + 1;
+    bloom_filter_wrapper *filt = art_search(mgr->filter_map, (unsigned char*)filter_name, len);
+    if (!filt) filt = art_search(mgr->alias_map, (unsigned char*)filter_name, len);
+    return filt;
 }
 
 // Gets the bloom filter in a thread safe way.
 static bloom_filter_wrapper* take_filter(bloom_filtmgr *mgr, char *filter_name) {
     bloom_filter_wrapper *filt = find_filter(mgr, filter_name);
-    return (filt && filt->is_active) ? filt : NULL;
+    if (filt && !filt->is_active) filt = NULL;
+    BLOOM_PROBE2(filter__lookup, filter_name, filt != NULL);
+    return filt;
 }
 
 
+/**
+ * Refreshes a read-only filter. A filter whose files are
+ * gone is closed and cleared, leaving the files to the writer.
+ */
+static void refresh_filter(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return;
+
+    pthread_rwlock_wrlock(&filt->rwlock);
+    int res = bloomf_refresh(filt->filter);
+    if (res == -1) bloomf_close(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    if (res == -1 && !filtmgr_clear_filter(mgr, filter_name))
+        syslog(LOG_INFO, "Filter '%s' was dropped.", filter_name);
+}
+
 /**
  * Invoked to cleanup a filter once we
  * have hit 0 remaining references.
@@ -680,28 +2872,65 @@ static void delete_filter(bloom_filter_wrapper *filt) {
     if (filt->custom) {
         free(filt->custom);
     }
+    if (filt->migration) destroy_repl_log(filt->migration);
+    pthread_cond_destroy(&filt->combine_cond);
+    pthread_mutex_destroy(&filt->combine_lock);
 
     // Release the struct
     free(filt);
     return;
 }
 
+/**
+ * Drops a reference to a filter, and cleans it up
+ * if this was the last reference.
+ */
+static void release_filter(bloom_filter_wrapper *filt) {
+    if (__atomic_sub_fetch(&filt->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        delete_filter(filt);
+}
+
 /**
  * Creates a new filter and adds it to the filter map.
  * @arg mgr The manager to add to
  * @arg filter_name The name of the filter
  * @arg config The configuration for the filter
  * @arg is_hot Is the filter hot. False for existing.
- * @arg delta Is this a delta update or should the map be updated
  * @return 0 on success, -1 on error
  */
-static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot, int delta) {
+static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config, int is_hot) {
+    bloom_filter_wrapper *filt = make_filter(mgr, filter_name, config, is_hot, NULL);
+    if (!filt) return -1;
+
+    // Add the filter as a new version
+    unsigned long long vsn = mgr->vsn + 1;
+    map_insert(mgr, vsn, filt);
+    publish_version(mgr, vsn);
+    return 0;
+}
+
+/**
+ * Creates a new filter wrapper, without adding it to
+ * the filter map. Safe to call from multiple threads.
+ * @arg mgr The manager
+ * @arg filter_name The name of the filter
+ * @arg config The configuration for the filter
+ * @arg is_hot Is the filter hot. False for existing.
+ * @arg known The config of an existing filter from the
+ * manifest, or NULL to read it from its folder
+ * @return The wrapper, or NULL on error.
+ */
+static bloom_filter_wrapper* make_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *config,
+        int is_hot, bloom_filter_config *known) {
     // Create the filter
     bloom_filter_wrapper *filt = calloc(1, sizeof(bloom_filter_wrapper));
     filt->is_active = 1;
     filt->is_hot = is_hot;
     filt->should_delete = 0;
+    filt->refs = 1;
     pthread_rwlock_init(&filt->rwlock, NULL);
+    pthread_mutex_init(&filt->combine_lock, NULL);
+    pthread_cond_init(&filt->combine_cond, NULL);
 
     // Set the custom filter if its not the same
     if (mgr->config != config) {
@@ -709,25 +2938,95 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
     }
 
     // Try to create the underlying filter. Only discover if it is hot.
-    int res = init_bloom_filter(config, filter_name, is_hot, &filt->filter);
+    int res = (known) ? load_bloom_filter(config, filter_name, known, &filt->filter) :
+        init_bloom_filter(config, filter_name, is_hot, &filt->filter);
     if (res != 0) {
         free(filt);
-        return -1;
+        return NULL;
     }
 
-    // Check if we are adding a delta value or directly updating ART tree
-    if (delta)
-        create_delta_update(mgr, CREATE, filt);
-    else
-        art_insert(mgr->filter_map, (unsigned char*)filter_name, strlen(filter_name)+1, filt);
+    // Check the growths of the filter against the quotas
+    if (mgr->config->filter_quota_mb || mgr->config->prefix_quota_mb) {
+        filt->filter->quota_cb = check_quota;
+        filt->filter->quota_in = mgr;
+    }
+
+    // Lagging replicas are sent the pages that changed
+    if (mgr->repl) bloomf_track_changes(filt->filter, repl_log_clock(mgr->repl));
+    return filt;
+}
+
+/**
+ * Checks a growth of a filter against the filter_quota_mb,
+ * and the prefix_quota_mb of the filters sharing its prefix.
+ * The prefix runs up to and including the first quota_separator
+ * in the name, and filters without one have no prefix quota.
+ * The bytes are the cached metadata of the filters, so this only
+ * walks the filters with the prefix, and touches no layers. Filters
+ * created since the last vacuum are counted once it merges them.
+ * @return 0 if the filter may grow, -EDQUOT otherwise.
+ */
+static int check_quota(void *in, bloom_filter *filter, uint64_t bytes) {
+    bloom_filtmgr *mgr = in;
+    bloom_config *config = mgr->config;
+
+    filter_meta meta;
+    bloomf_meta(filter, &meta);
+    uint64_t limit = (uint64_t)config->filter_quota_mb * 1024 * 1024;
+    if (limit && meta.bytes + bytes > limit) return -EDQUOT;
+
+    limit = (uint64_t)config->prefix_quota_mb * 1024 * 1024;
+    size_t prefix_len = strcspn(filter->filter_name, config->quota_separator);
+    if (!limit || !filter->filter_name[prefix_len]) return 0;
+
+    uint64_t total = bytes;
+    art_iter_prefix(mgr->filter_map, (unsigned char*)filter->filter_name,
+            prefix_len + 1, filter_map_bytes_cb, &total);
+    return (total > limit) ? -EDQUOT : 0;
+}
+
+/**
+ * Called as part of the hashmap callback
+ * to list all the filters. Only works if value is
+ * not NULL.
+ */
+static int filter_map_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    iter_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (filt->is_active) scan->cb(scan->data, filt->filter->filter_name, filt->filter);
+    return 0;
+}
+
+/**
+ * Called as part of the hashmap callback to
+ * track the changes of the filters.
+ */
+static int track_changes_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    bloom_filter_wrapper *filt = value;
+    bloomf_track_changes(filt->filter, data);
     return 0;
 }
 
 /**
- * Called as part of the hashmap callback
- * to list all the filters. Only works if value is
- * not NULL.
+ * Called as part of the hashmap callback to
+ * sum the bytes used by the active filters.
  */
+static int filter_map_bytes_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key;
+    (void)key_len;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active) return 0;
+
+    filter_meta meta;
+    bloomf_meta(filt->filter, &meta);
+    *(uint64_t*)data += meta.bytes;
+    return 0;
+}
+
 static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key_len;
     // Filter out the non-active nodes
@@ -763,6 +3062,187 @@ static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key
  * to list cold filters. Only works if value is
  * not NULL.
  */
+/**
+ * Records the filters accessed since the last call in the access
+ * history for the current hour, and lists the proxied filters that
+ * were accessed in the upcoming hour over the last day. Must only
+ * be called from a single thread. The memory should be free'd by
+ * the caller.
+ * @arg mgr The manager to list from
+ * @arg hour The current hour of the day, 0 to 23
+ * @arg upcoming The hour of the day to list the filters for,
+ * or -1 to only record the accesses
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_warm_filters(bloom_filtmgr *mgr, int hour, int upcoming, bloom_filter_list_head **head) {
+    // Allocate the head of a new hashmap
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Entering a new hour drops the accesses from a day ago
+    warm_scan scan = {h, hour, upcoming, hour != mgr->access_hour};
+    mgr->access_hour = hour;
+
+    // Scan the filters
+    art_iter(mgr->filter_map, filter_map_list_warm_cb, &scan);
+    return 0;
+}
+
+static int filter_map_list_warm_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    warm_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+
+    // Update the access history
+    uint32_t hour_bit = 1 << scan->hour;
+    if (scan->new_hour) filt->access_hours &= ~hour_bit;
+    if (filt->accessed) {
+        filt->accessed = 0;
+        filt->access_hours |= hour_bit;
+    }
+
+    // Check if the filter is expected to be used soon
+    if (scan->upcoming < 0 || !(filt->access_hours & (1 << scan->upcoming)))
+        return 0;
+    if (!bloomf_is_proxied(filt->filter))
+        return 0;
+
+    // Allocate a new entry
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup((char*)key);
+    node->next = scan->head->head;
+    scan->head->head = node;
+    scan->head->size++;
+    return 0;
+}
+
+static int filter_map_list_rotate_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    rotate_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || !bloomf_needs_rotate(filt->filter, scan->now))
+        return 0;
+
+    // Allocate a new entry
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup((char*)key);
+    node->next = scan->head->head;
+    scan->head->head = node;
+    scan->head->size++;
+    return 0;
+}
+
+static int filter_map_list_age_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    rotate_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+    if (!filt->is_active || !bloomf_needs_age(filt->filter, scan->now))
+        return 0;
+
+    // Allocate a new entry
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup((char*)key);
+    node->next = scan->head->head;
+    scan->head->head = node;
+    scan->head->size++;
+    return 0;
+}
+
+/**
+ * Advances the eviction clock, and if the mapped filters use more
+ * memory than the budget, lists the filters to unmap to get back
+ * within it. Filters used in few clock ticks are listed first, and
+ * otherwise the least recently used are listed first. Filters used
+ * in the last tick are never listed, and neither are pinned filters,
+ * whose memory still counts against the budget. Must only be called
+ * from a single thread. The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg budget The memory budget in bytes
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_evict_filters(bloom_filtmgr *mgr, uint64_t budget, bloom_filter_list_head **head) {
+    // Allocate the head of a new hashmap
+    bloom_filter_list_head *h = *head = calloc(1, sizeof(bloom_filter_list_head));
+
+    // Gather the mapped filters
+    evict_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.clock = __atomic_fetch_add(&mgr->evict_clock, 1, __ATOMIC_RELAXED);
+    scan.decay = (++mgr->evict_scans % EVICT_DECAY_SCANS) == 0;
+    art_iter(mgr->filter_map, filter_map_evict_cb, &scan);
+
+    // Take the least valuable filters until we are within the budget
+    if (scan.total > budget) {
+        qsort(scan.candidates, scan.num, sizeof(evict_candidate), compare_evict_candidates);
+    }
+    for (int i=0; i < scan.num; i++) {
+        if (scan.total <= budget) {
+            free(scan.candidates[i].filter_name);
+            continue;
+        }
+        bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+        node->filter_name = scan.candidates[i].filter_name;
+        node->next = NULL;
+        if (h->tail) h->tail->next = node;
+        else h->head = node;
+        h->tail = node;
+        h->size++;
+        scan.total -= scan.candidates[i].bytes;
+    }
+    free(scan.candidates);
+    return 0;
+}
+
+static int filter_map_evict_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    evict_scan *scan = data;
+    bloom_filter_wrapper *filt = value;
+
+    // Age the access counts
+    unsigned int ticks = filt->access_ticks;
+    if (scan->decay && ticks) filt->access_ticks = ticks / 2;
+
+    // Only mapped filters use memory
+    if (!filt->is_active || bloomf_is_proxied(filt->filter)) return 0;
+
+    // The size changes when the filter grows, which requires the
+    // write lock. Skip a filter that is busy growing instead of waiting.
+    if (pthread_rwlock_tryrdlock(&filt->rwlock)) return 0;
+    uint64_t bytes = bloomf_byte_size(filt->filter);
+    pthread_rwlock_unlock(&filt->rwlock);
+    scan->total += bytes;
+
+    // In-memory filters cannot be unmapped, pinned filters must
+    // not be, and filters used since the last scan are likely
+    // still in use
+    if (filt->filter->filter_config.in_memory) return 0;
+    if (filt->filter->filter_config.pinned) return 0;
+    if (filt->last_access == scan->clock) return 0;
+    if (__atomic_load_n(&filt->snapshotting, __ATOMIC_ACQUIRE)) return 0;
+
+    if (scan->num == scan->max) {
+        scan->max = (scan->max) ? scan->max * 2 : 64;
+        scan->candidates = realloc(scan->candidates, scan->max * sizeof(evict_candidate));
+    }
+    evict_candidate *c = scan->candidates + scan->num++;
+    c->filter_name = strdup((char*)key);
+    c->bytes = bytes;
+    c->age = scan->clock - filt->last_access;
+    c->frequent = ticks >= EVICT_FREQUENT_TICKS;
+    return 0;
+}
+
+/**
+ * Orders eviction candidates from the least to the most valuable.
+ */
+static int compare_evict_candidates(const void *a, const void *b) {
+    const evict_candidate *ca = a, *cb = b;
+    if (ca->frequent != cb->frequent) return ca->frequent - cb->frequent;
+    if (ca->age != cb->age) return (ca->age > cb->age) ? -1 : 1;
+    return 0;
+}
+
 static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
     (void)key_len;
     // Cast the inputs
@@ -775,8 +3255,8 @@ static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_
         return 0;
     }
 
-    // Check if proxied
-    if (bloomf_is_proxied(filt->filter)) {
+    // Check if proxied, or pinned in memory
+    if (bloomf_is_proxied(filt->filter) || filt->filter->filter_config.pinned) {
         return 0;
     }
 
@@ -798,13 +3278,17 @@ static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_
  * to cleanup the filters.
  */
 static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)data;
     (void)key;
     (void)key_len;
 
     // Cast the inputs
+    filter_manifest *manifest = data;
     bloom_filter_wrapper *filt = value;
 
+    // Close first, so the manifest has the final config
+    bloomf_close(filt->filter);
+    manifest_add(manifest, filt->filter);
+
     // Delete, but not the underlying files
     filt->should_delete = 0;
     delete_filter(filt);
@@ -838,181 +3322,606 @@ static int filter_bloomd_folders(CONST_DIRENT_T *d) {
  * safe and assumes that we are being initialized.
  */
 static int load_existing_filters(bloom_filtmgr *mgr) {
-    struct dirent **namelist;
-    int num;
-
-    num = scandir(mgr->config->data_dir, &namelist, filter_bloomd_folders, NULL);
-    if (num == -1) {
-        syslog(LOG_ERR, "Failed to scan files for existing filters!");
-        return -1;
+    filter_loader loader;
+    memset(&loader, 0, sizeof(loader));
+    loader.mgr = mgr;
+
+    // Take the filters of a clean shutdown from the manifest,
+    // and otherwise discover them from their folders
+    struct dirent **namelist = NULL;
+    char *manifest = NULL;
+    int num = read_manifest(mgr, &loader, &manifest);
+    if (num >= 0) {
+        syslog(LOG_INFO, "Found %d existing filters in the manifest", num);
+    } else {
+        num = scandir(mgr->config->data_dir, &namelist, filter_bloomd_folders, NULL);
+        if (num == -1) {
+            syslog(LOG_ERR, "Failed to scan files for existing filters!");
+            return -1;
+        }
+        syslog(LOG_INFO, "Found %d existing filters", num);
+        loader.names = calloc(num ? num : 1, sizeof(char*));
+        for (int i=0; i < num; i++)
+            loader.names[i] = namelist[i]->d_name + FOLDER_PREFIX_LEN;
     }
-    syslog(LOG_INFO, "Found %d existing filters", num);
+
+    // Load the filters with a pool of threads. The filters are left
+    // proxied, so this only reads their configs, and the bitmaps are
+    // faulted in on first access.
+    loader.num = num;
+    loader.filters = calloc(num ? num : 1, sizeof(bloom_filter_wrapper*));
+    run_pool(mgr, load_thread_main, &loader, num);
 
     // Add all the filters
-    for (int i=0; i< num; i++) {
-        char *folder_name = namelist[i]->d_name;
-        char *filter_name = folder_name + FOLDER_PREFIX_LEN;
-        if (add_filter(mgr, filter_name, mgr->config, 0, 0)) {
+    for (int i=0; i < num; i++) {
+        char *filter_name = loader.names[i];
+        if (loader.filters[i]) {
+            art_insert(mgr->filter_map, (unsigned char*)filter_name, strlen(filter_name)+1, loader.filters[i]);
+        } else {
             syslog(LOG_ERR, "Failed to load filter '%s'!", filter_name);
         }
     }
 
-    for (int i=0; i < num; i++) free(namelist[i]);
-    free(namelist);
+    free(loader.filters);
+    free(loader.names);
+    free(loader.configs);
+    free(manifest);
+    if (namelist) {
+        for (int i=0; i < num; i++) free(namelist[i]);
+        free(namelist);
+    }
     return 0;
 }
 
+/**
+ * Loads existing filters until there are none left.
+ * @arg in The filter_loader
+ */
+static void* load_thread_main(void *in) {
+    filter_loader *loader = in;
+    bloom_filtmgr *mgr = loader->mgr;
+    int i;
+    while ((i = __atomic_fetch_add(&loader->next, 1, __ATOMIC_RELAXED)) < loader->num) {
+        bloom_filter_config *known = (loader->configs) ? loader->configs + i : NULL;
+        loader->filters[i] = make_filter(mgr, loader->names[i], mgr->config, 0, known);
+    }
+    return NULL;
+}
 
 /**
- * Creates a new delta update and adds to the head of the list.
- * This must be invoked with the write lock as it is unsafe.
- * @arg mgr The manager
- * @arg type The type of delta
- * @arg filt The filter that is affected
- * @return The new version we created
+ * Reads the manifest of a clean shutdown, and removes it.
+ * Read-only servers leave the manifest to the writer.
+ * @arg loader Output, the names and configs of the filters
+ * @arg buf Output, the manifest holding the names, which
+ * the caller must free
+ * @return The number of filters, or -1 if there is no valid
+ * manifest, and the data_dir must be scanned.
  */
-static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt) {
-    filter_list *delta = malloc(sizeof(filter_list));
-    delta->vsn = ++mgr->vsn;
-    delta->type = type;
-    delta->filter = filt;
-    delta->next = mgr->delta;
-    mgr->delta = delta;
-    return delta->vsn;
+static int read_manifest(bloom_filtmgr *mgr, filter_loader *loader, char **buf) {
+    if (mgr->config->read_only) return -1;
+    char *path = join_path(mgr->config->data_dir, (char*)MANIFEST_FILENAME);
+    struct stat dir_st, st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+
+    // The manifest is only read once, since the filters change
+    // from now on. It is stale if the data_dir has changed since
+    // the manifest was written.
+    int valid = !fstat(fd, &st) && !stat(mgr->config->data_dir, &dir_st) &&
+        st.st_mtim.tv_sec == dir_st.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == dir_st.st_mtim.tv_nsec;
+    if (unlink(path)) valid = 0;
+    free(path);
+
+    size_t len = (valid) ? st.st_size : 0;
+    char *b = *buf = (valid) ? malloc(len ? len : 1) : NULL;
+    if (!b || read(fd, b, len) != (ssize_t)len) valid = 0;
+    close(fd);
+
+    manifest_header h;
+    if (valid && len >= sizeof(h) + sizeof(uint32_t)) {
+        memcpy(&h, b, sizeof(h));
+        uint32_t checksum;
+        memcpy(&checksum, b + len - sizeof(checksum), sizeof(checksum));
+        valid = h.magic == MANIFEST_MAGIC && h.version == MANIFEST_VERSION &&
+            checksum == manifest_checksum(b, len - sizeof(checksum));
+        len -= sizeof(checksum);
+    } else
+        valid = 0;
+
+    // Point the names into the manifest
+    int num = (valid) ? h.num_filters : 0;
+    if (valid) {
+        loader->names = calloc(num ? num : 1, sizeof(char*));
+        loader->configs = calloc(num ? num : 1, sizeof(bloom_filter_config));
+        valid = loader->names && loader->configs;
+    }
+    size_t offset = sizeof(h);
+    for (int i=0; valid && i < num; i++) {
+        uint16_t name_len;
+        if (offset + sizeof(name_len) > len) goto INVALID;
+        memcpy(&name_len, b + offset, sizeof(name_len));
+        offset += sizeof(name_len);
+        if (!name_len || offset + name_len > len || b[offset + name_len - 1]) goto INVALID;
+        loader->names[i] = b + offset;
+        offset += name_len;
+
+        bloom_filter_config *fc = loader->configs + i;
+        int rec = filter_config_from_record(b + offset, len - offset, fc);
+        if (rec < 0) goto INVALID;
+        offset += rec;
+    }
+    if (valid && offset == len) return num;
+
+INVALID:
+    if (b) syslog(LOG_WARNING, "Ignoring an invalid manifest of the data_dir.");
+    free(loader->names);
+    free(loader->configs);
+    loader->names = NULL;
+    loader->configs = NULL;
+    free(b);
+    *buf = NULL;
+    return -1;
 }
 
 /**
- * Merges changes into the alternate tree from the delta lists
- * Safety: Safe ONLY if no other thread is using alt_filter_map
+ * Starts the manifest of the filters, unless
+ * the server is read-only.
+ * @arg m Output, the manifest
  */
-static void merge_old_versions(bloom_filtmgr *mgr, filter_list *delta, unsigned long long min_vsn) {
-    // Handle older delta first (bottom up)
-    if (delta->next) merge_old_versions(mgr, delta->next, min_vsn);
+static void init_manifest(bloom_filtmgr *mgr, filter_manifest *m) {
+    memset(m, 0, sizeof(filter_manifest));
+    if (mgr->config->read_only) return;
+    m->size = 4096;
+    m->buf = malloc(m->size);
+    m->len = sizeof(manifest_header);
+}
 
-    // Check if we should skip this update
-    if (delta->vsn > min_vsn) return;
+/**
+ * Adds a closed filter to the manifest. The manifest
+ * is dropped if it can not grow.
+ */
+static void manifest_add(filter_manifest *m, bloom_filter *filter) {
+    if (!m->buf) return;
+    size_t name_len = strlen(filter->filter_name) + 1;
+    size_t need = m->len + sizeof(uint16_t) + name_len + MANIFEST_RECORD_MAX + sizeof(uint32_t);
+    if (need > m->size) {
+        size_t size = m->size;
+        while (size < need) size *= 2;
+        char *buf = realloc(m->buf, size);
+        if (!buf) {
+            free(m->buf);
+            m->buf = NULL;
+            return;
+        }
+        m->buf = buf;
+        m->size = size;
+    }
 
-    // Handle current update
-    bloom_filter_wrapper *s = delta->filter;
-    switch (delta->type) {
-        case CREATE:
-            art_insert(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1, s);
-            break;
-        case DELETE:
-            art_delete(mgr->alt_filter_map, (unsigned char*)s->filter->filter_name, strlen(s->filter->filter_name)+1);
-            break;
-        case BARRIER:
-            // Ignore the barrier...
-            break;
+    uint16_t len = name_len;
+    memcpy(m->buf + m->len, &len, sizeof(len));
+    memcpy(m->buf + m->len + sizeof(len), filter->filter_name, name_len);
+    m->len += sizeof(len) + name_len;
+    m->len += filter_config_to_record(&filter->filter_config, m->buf + m->len, MANIFEST_RECORD_MAX);
+    m->num++;
+}
+
+/**
+ * Writes out the manifest, and frees it. The manifest is
+ * renamed into place once it is durable, and then stamped
+ * with the modification time of the data_dir, which was
+ * last changed by that rename.
+ */
+static void write_manifest(bloom_filtmgr *mgr, filter_manifest *m) {
+    if (!m->buf) return;
+    manifest_header h = {MANIFEST_MAGIC, MANIFEST_VERSION, 0, m->num};
+    memcpy(m->buf, &h, sizeof(h));
+    uint32_t checksum = manifest_checksum(m->buf, m->len);
+    memcpy(m->buf + m->len, &checksum, sizeof(checksum));
+    m->len += sizeof(checksum);
+
+    char *path = join_path(mgr->config->data_dir, (char*)MANIFEST_FILENAME);
+    char *tmp_path = join_path(mgr->config->data_dir, (char*)MANIFEST_FILENAME ".tmp");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int res = (fd < 0 || write(fd, m->buf, m->len) != (ssize_t)m->len ||
+            fsync(fd) || rename(tmp_path, path));
+
+    struct stat dir_st;
+    if (!res && !stat(mgr->config->data_dir, &dir_st)) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, dir_st.st_mtim};
+        res = futimens(fd, times);
+
+        // File times come from the coarse clock, so wait for it to
+        // pass the stamp, or a change made to the data_dir in the
+        // same tick would go unnoticed
+        struct timespec now, tick = {0, 1000000};
+        for (int i=0; !res && i < 100; i++) {
+            clock_gettime(CLOCK_REALTIME_COARSE, &now);
+            if (now.tv_sec > dir_st.st_mtim.tv_sec || (now.tv_sec == dir_st.st_mtim.tv_sec &&
+                        now.tv_nsec > dir_st.st_mtim.tv_nsec)) break;
+            nanosleep(&tick, NULL);
+        }
+    }
+    if (res) {
+        syslog(LOG_WARNING, "Failed to write the manifest of the data_dir!");
+        unlink(tmp_path);
+        unlink(path);
+    }
+    if (fd >= 0) close(fd);
+    free(tmp_path);
+    free(path);
+    free(m->buf);
+    m->buf = NULL;
+}
+
+// Checksums the manifest with FNV-1a
+static uint32_t manifest_checksum(char *buf, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i < len; i++) {
+        hash ^= (unsigned char)buf[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Collects the names of the aliases of a filter
+static int alias_target_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    alias_scan *scan = data;
+    if (value != scan->filter) return 0;
+
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    node->filter_name = strdup((char*)key);
+    node->next = scan->names;
+    scan->names = node;
+    return 0;
+}
+
+// Appends an alias and the name of its filter to a list
+static int alias_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    bloom_filter_list_head *head = data;
+    bloom_filter_wrapper *filt = value;
+    char *filter_name = filt->filter->filter_name;
+
+    bloom_filter_list *node = malloc(sizeof(bloom_filter_list));
+    int len = key_len + strlen(filter_name) + 1;
+    node->filter_name = malloc(len);
+    snprintf(node->filter_name, len, "%s %s", (char*)key, filter_name);
+    node->next = NULL;
+
+    if (!head->head)
+        head->head = node;
+    else
+        head->tail->next = node;
+    head->tail = node;
+    head->size++;
+    return 0;
+}
+
+// Writes the line of an alias
+static int alias_write_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    bloom_filter_wrapper *filt = value;
+    return fprintf((FILE*)data, "%s %s\n", (char*)key, filt->filter->filter_name) < 0;
+}
+
+/**
+ * Rewrites the aliases file of the data dir, replacing it
+ * atomically. This must be invoked with the write lock.
+ */
+static void write_aliases(bloom_filtmgr *mgr) {
+    char *path = join_path(mgr->config->data_dir, (char*)ALIASES_FILENAME);
+    char *tmp_path = join_path(mgr->config->data_dir, (char*)ALIASES_FILENAME ".tmp");
+    FILE *f = fopen(tmp_path, "w");
+    int res = !f;
+    if (f) {
+        res = art_iter(mgr->alias_map, alias_write_cb, f);
+        res = fflush(f) || fsync(fileno(f)) || res;
+        res = fclose(f) || res;
+        res = res || rename(tmp_path, path);
+    }
+    if (res) {
+        syslog(LOG_ERR, "Failed to write the aliases of the data_dir!");
+        unlink(tmp_path);
     }
+    free(tmp_path);
+    free(path);
 }
 
 /**
- * Updates the pending deletes list with a list of pending deletes
+ * Loads the aliases of the filters in the data dir, skipping
+ * the aliases of filters that no longer exist. Must be called
+ * after the filters are loaded, before any clients.
  */
-static void mark_pending_deletes(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    bloom_filter_list *tmp, *pending = NULL;
+static void load_aliases(bloom_filtmgr *mgr) {
+    char *path = join_path(mgr->config->data_dir, (char*)ALIASES_FILENAME);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) return;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, f)) > 0) {
+        if (line[len-1] == '\n') line[--len] = '\0';
+        char *filter_name = strchr(line, ' ');
+        if (!filter_name) continue;
+        *filter_name++ = '\0';
+
+        bloom_filter_wrapper *filt = art_search(mgr->filter_map,
+                (unsigned char*)filter_name, strlen(filter_name)+1);
+        if (!filt || art_search(mgr->filter_map, (unsigned char*)line, strlen(line)+1)) {
+            syslog(LOG_WARNING, "Skipping the alias '%s' of missing filter '%s'.", line, filter_name);
+            continue;
+        }
+        if (!art_insert(mgr->alias_map, (unsigned char*)line, strlen(line)+1, filt))
+            filt->aliases++;
+    }
+    free(line);
+    fclose(f);
+}
 
-    // Add each delete
-    filter_list *delta = mgr->delta;
-    while (delta) {
-        if (delta->vsn <= min_vsn && delta->type == DELETE) {
-            tmp = malloc(sizeof(bloom_filter_list));
-            tmp->filter_name = strdup(delta->filter->filter->filter_name);
-            tmp->next = pending;
-            pending = tmp;
+/**
+ * Creates new filters until there are none left.
+ * @arg in The filter_creator
+ */
+static void* create_thread_main(void *in) {
+    filter_creator *creator = in;
+    bloom_filtmgr *mgr = creator->mgr;
+    int i;
+    while ((i = __atomic_fetch_add(&creator->next, 1, __ATOMIC_RELAXED)) < creator->num) {
+        if (creator->results[i]) continue;
+        bloom_config *config = mgr->config;
+        if (creator->custom_config) {
+            config = malloc(sizeof(bloom_config));
+            memcpy(config, creator->custom_config, sizeof(bloom_config));
         }
-        delta = delta->next;
+        creator->filters[i] = make_filter(mgr, creator->filter_names[i], config, 1, NULL);
+        if (!creator->filters[i] && creator->custom_config) free(config);
     }
+    return NULL;
+}
 
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = pending;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+/**
+ * Runs a function on up to load_threads threads, including
+ * the caller, and waits for all of them to return.
+ * @arg func The function, which claims the items itself
+ * @arg arg The argument of the function
+ * @arg num The number of items, so no more threads are started
+ */
+static void run_pool(bloom_filtmgr *mgr, void* (*func)(void*), void *arg, int num) {
+    int helpers = mgr->config->load_threads - 1;
+    if (helpers > num - 1) helpers = num - 1;
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (helpers > 0) {
+        threads = calloc(helpers, sizeof(pthread_t));
+        for (; started < helpers; started++) {
+            if (pthread_create(threads + started, NULL, func, arg)) break;
+        }
+    }
+    func(arg);
+    for (int i=0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
 }
 
 /**
- * Clears the pending deletes
+ * Sets a batch of keys of a key file. A filter that is
+ * unmapped, with fault_retry, is faulted in by the loader.
+ * @return 0 on success, or the error of set_keys.
  */
-static void clear_pending_deletes(bloom_filtmgr *mgr) {
-    // Get a reference to the head
-    bloom_filter_list *pending = mgr->pending_deletes;
-    if (!pending) return;
+static int load_batch(load_run *run, char **keys, int *key_lens, int num_keys, char *result) {
+    bloom_filter_wrapper *filt = run->load->filt;
+    int res = -1;
+    for (int tries=0; tries < 2 && filt->is_active; tries++) {
+        res = set_keys(run->mgr, filt, keys, key_lens, num_keys, result);
+        if (res != -6) break;
+        pthread_rwlock_rdlock(&filt->rwlock);
+        bloomf_fault(filt->filter);
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+    if (res) {
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+        return res;
+    }
 
-    // filter the pending list to NULL safely
-    LOCK_BLOOM_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = NULL;
-    UNLOCK_BLOOM_SPIN(&mgr->pending_lock);
+    int added = 0;
+    for (int i=0; i < num_keys; i++) added += (result[i] == 1);
+    __atomic_add_fetch(&filt->load.keys, num_keys, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&filt->load.added, added, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    // Free the nodes
-    bloom_filter_list *next;
-    while (pending) {
-        free(pending->filter_name);
-        next = pending->next;
-        free(pending);
-        pending = next;
+/**
+ * Thread of a load, along with the others of the pool. Takes
+ * chunks of the key file until none are left, and sets the keys
+ * of each chunk in batches. A line belongs to the chunk it
+ * starts in. The keys are copied out of the mapped file, so
+ * they are terminated, and longer keys than the copy buffer
+ * are skipped.
+ */
+static void* load_keys_main(void *in) {
+    load_run *run = in;
+    uint64_t size = run->load->size;
+    uint64_t chunks = (size + LOAD_CHUNK_BYTES - 1) / LOAD_CHUNK_BYTES;
+    char **keys = malloc(LOAD_BATCH_KEYS * sizeof(char*));
+    int *key_lens = malloc(LOAD_BATCH_KEYS * sizeof(int));
+    char *result = malloc(LOAD_BATCH_KEYS);
+    char *buf = malloc(LOAD_BATCH_BYTES);
+
+    uint64_t chunk;
+    while (!__atomic_load_n(&run->failed, __ATOMIC_RELAXED) && *run->should_run &&
+            (chunk = __atomic_fetch_add(&run->next_chunk, 1, __ATOMIC_RELAXED)) < chunks) {
+        uint64_t start = chunk * LOAD_CHUNK_BYTES;
+        uint64_t end = (start + LOAD_CHUNK_BYTES < size) ? start + LOAD_CHUNK_BYTES : size;
+        uint64_t pos = start;
+        if (pos && run->data[pos - 1] != '\n') {
+            char *nl = memchr(run->data + pos, '\n', size - pos);
+            pos = (nl) ? (uint64_t)(nl - run->data) + 1 : size;
+        }
+
+        int num = 0, used = 0;
+        while (pos < end) {
+            char *line = run->data + pos;
+            char *nl = memchr(line, '\n', size - pos);
+            uint64_t len = (nl) ? (uint64_t)(nl - line) : size - pos;
+            pos += len + 1;
+            if (len && line[len - 1] == '\r') len--;
+            if (!len || len >= LOAD_BATCH_BYTES) continue;
+
+            // Set the batch once it is full
+            if (num == LOAD_BATCH_KEYS || used + len + 1 > LOAD_BATCH_BYTES) {
+                if (load_batch(run, keys, key_lens, num, result)) break;
+                num = used = 0;
+            }
+            memcpy(buf + used, line, len);
+            buf[used + len] = '\0';
+            keys[num] = buf + used;
+            key_lens[num++] = len;
+            used += len + 1;
+        }
+        if (num && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+            load_batch(run, keys, key_lens, num, result);
+        __atomic_add_fetch(&run->load->filt->load.bytes, end - start, __ATOMIC_RELAXED);
     }
+
+    free(keys);
+    free(key_lens);
+    free(result);
+    free(buf);
+    return NULL;
 }
 
+
 /**
- * Swap the alternate / primary maps, filters the primary_vsn
- * This is always safe, since its just a pointer swap.
+ * Adds a filter to the map as part of a new version. The
+ * version must then be published with publish_version.
+ * This must be invoked with the write lock as it is unsafe.
+ * @arg mgr The manager
+ * @arg vsn The new version
+ * @arg filt The filter to add
  */
-static void swap_filter_maps(bloom_filtmgr *mgr, unsigned long long primary_vsn) {
-    art_tree *tmp = mgr->filter_map;
-    mgr->filter_map = mgr->alt_filter_map;
-    mgr->alt_filter_map = tmp;
-    mgr->primary_vsn = primary_vsn;
+static void map_insert(bloom_filtmgr *mgr, unsigned long long vsn, bloom_filter_wrapper *filt) {
+    char *name = filt->filter->filter_name;
+    art_cow_insert(mgr->filter_map, (unsigned char*)name, strlen(name)+1, filt, vsn);
 }
 
-/*
- * Scans a filter_list* until it finds an entry with a version
- * less than min_vsn. It NULLs the pointer to that version
- * and returns a pointer to that node.
- *
- * Safety: This is ONLY safe if the minimum client version
- * and the primary_vsn is strictly greater than the min_vsn argument.
- * This ensures access to older delta entries will not happen.
+/**
+ * Removes a filter from the map as part of a new version.
+ * The reference of the map is released by the vacuum thread,
+ * once no client can still see the filter. The version must
+ * then be published with publish_version.
+ * This must be invoked with the write lock as it is unsafe.
+ * @arg mgr The manager
+ * @arg vsn The new version
+ * @arg filt The filter to remove
  */
-static filter_list* remove_delta_versions(filter_list *init, filter_list **ref, unsigned long long min_vsn) {
-    filter_list *current = init;
-    filter_list **prev = ref;
-    while (current && current->vsn > min_vsn) {
-        prev = &current->next;
-        current = current->next;
+static void map_remove(bloom_filtmgr *mgr, unsigned long long vsn, bloom_filter_wrapper *filt) {
+    char *name = filt->filter->filter_name;
+    art_cow_delete(mgr->filter_map, (unsigned char*)name, strlen(name)+1, vsn);
+
+    // The aliases of the filter go with it
+    if (filt->aliases) {
+        alias_scan scan = {filt, NULL};
+        art_iter(mgr->alias_map, alias_target_cb, &scan);
+        bloom_filter_list *next;
+        for (bloom_filter_list *node=scan.names; node; node=next) {
+            next = node->next;
+            art_cow_delete(mgr->alias_map, (unsigned char*)node->filter_name,
+                    strlen(node->filter_name)+1, vsn);
+            free(node->filter_name);
+            free(node);
+        }
+        filt->aliases = 0;
+        write_aliases(mgr);
     }
 
-    // NULL out the reference pointer to current node if any
-    if (current) *prev = NULL;
-    return current;
+    filter_list *node = malloc(sizeof(filter_list));
+    node->vsn = vsn;
+    node->filter = filt;
+    node->next = mgr->dropped;
+    mgr->dropped = node;
 }
 
 /**
- * Deletes old versions from the delta lists, and calls
- * delete_filter on the filters in the destroyed list.
+ * Publishes a new version once all of its changes are in
+ * the map, and wakes the vacuum thread to reclaim what the
+ * changes replaced.
+ * This must be invoked with the write lock as it is unsafe.
+ * @arg mgr The manager
+ * @arg vsn The new version
+ */
+static void publish_version(bloom_filtmgr *mgr, unsigned long long vsn) {
+    __atomic_store_n(&mgr->vsn, vsn, __ATOMIC_RELEASE);
+    pthread_cond_signal(&mgr->vacuum_cond);
+}
+
+/**
+ * Frees the map nodes replaced by the versions up to
+ * min_vsn, and releases the filters they dropped. The
+ * names stay pending deletes until the filters are released.
  *
- * Safety: Same as remove_delta_versions
+ * Safety: This is ONLY safe if every client has checkpointed
+ * at or past min_vsn, so no client can still see the garbage.
  */
-static void delete_old_versions(bloom_filtmgr *mgr, unsigned long long min_vsn) {
-    // Get the merged in pending ops, lock to avoid a race
+static void reclaim_versions(bloom_filtmgr *mgr, unsigned long long min_vsn) {
     pthread_mutex_lock(&mgr->write_lock);
-    filter_list *old = remove_delta_versions(mgr->delta, &mgr->delta, min_vsn);
+    art_reclaim(mgr->filter_map, min_vsn);
+    art_reclaim(mgr->alias_map, min_vsn);
+
+    // Cut off the drops up to min_vsn, the list is newest first
+    filter_list **ref = &mgr->dropped;
+    while (*ref && (*ref)->vsn > min_vsn)
+        ref = &(*ref)->next;
+    filter_list *old = *ref;
+    *ref = NULL;
+
+    for (filter_list *current=old; current; current=current->next) {
+        bloom_filter_list *tmp = malloc(sizeof(bloom_filter_list));
+        tmp->filter_name = strdup(current->filter->filter->filter_name);
+        tmp->next = mgr->pending_deletes;
+        mgr->pending_deletes = tmp;
+    }
+    if (min_vsn > mgr->reclaimed_vsn)
+        __atomic_store_n(&mgr->reclaimed_vsn, min_vsn, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&mgr->write_lock);
+    if (!old) return;
 
-    // Delete the filters now that we have merged into both trees
-    filter_list *next, *current = old;
-    while (current) {
-        if (current->type == DELETE) delete_filter(current->filter);
+    // Delete the filters without the lock, it may take a while
+    filter_list *next;
+    for (filter_list *current=old; current; current=next) {
         next = current->next;
+        release_filter(current->filter);
         free(current);
-        current = next;
+    }
+
+    // Clear the pending deletes, now that they are done
+    pthread_mutex_lock(&mgr->write_lock);
+    bloom_filter_list *pending = mgr->pending_deletes;
+    mgr->pending_deletes = NULL;
+    pthread_mutex_unlock(&mgr->write_lock);
+
+    bloom_filter_list *pending_next;
+    while (pending) {
+        pending_next = pending->next;
+        free(pending->filter_name);
+        free(pending);
+        pending = pending_next;
     }
 }
 
 /**
- * Determines the minimum visible version from the client list
+ * Determines the minimum visible version from the client epochs.
+ * Quiescent clients are ignored.
  * Safety: Always safe
  */
 static unsigned long long client_min_vsn(bloom_filtmgr *mgr) {
+    // Order the scan after any new version
+    __sync_synchronize();
+
     // Determine the minimum version
     unsigned long long thread_vsn, min_vsn = mgr->vsn;
     for (filtmgr_client *cl=mgr->clients; cl != NULL; cl=cl->next) {
@@ -1022,111 +3931,56 @@ static unsigned long long client_min_vsn(bloom_filtmgr *mgr) {
     return min_vsn;
 }
 
-/**
- * Creates a barrier that is implicit by adding a
- * new version, and waiting for all clients to reach
- * that version. This can be used as a non-locking
- * syncronization mechanism.
- */
-static void version_barrier(bloom_filtmgr *mgr) {
-    // Create a new delta
-    pthread_mutex_lock(&mgr->write_lock);
-    unsigned long long vsn = create_delta_update(mgr, BARRIER, NULL);
-    pthread_mutex_unlock(&mgr->write_lock);
-
-    // Wait until we converge on the version
-    while (mgr->should_run && client_min_vsn(mgr) < vsn)
-        usleep(VACUUM_POLL_USEC);
-}
-
 /**
  * This thread is started after initialization to maintain
  * the state of the filter manager. It's current use is to
  * cleanup the garbage created by our MVCC model. We do this
  * by making use of periodic 'checkpoints'. Our worker threads
  * report the version they are currently using, and we are always
- * able to delete versions that are strictly less than the minimum.
+ * able to reclaim the garbage of versions up to the minimum.
+ * The thread sleeps until a change is made, and then waits for
+ * the active clients to checkpoint past it.
  */
 static void* filtmgr_thread_main(void *in) {
     // Extract our arguments
     bloom_filtmgr *mgr = in;
-    unsigned long long min_vsn, mgr_vsn;
+    unsigned long long min_vsn;
+    useconds_t wait = GRACE_MIN_POLL_USEC;
+    uint64_t start = 0;
+    if (mgr->config->vacuum_cpus && numa_pin_thread(mgr->config->vacuum_cpus, -1))
+        syslog(LOG_WARNING, "Failed to pin the vacuum thread to CPUs %s.", mgr->config->vacuum_cpus);
     while (mgr->should_run) {
-        // Do nothing if there is no changes
-        if (mgr->vsn == mgr->primary_vsn) {
-            usleep(VACUUM_POLL_USEC);
+        // Wait until there are changes
+        pthread_mutex_lock(&mgr->write_lock);
+        while (mgr->should_run && mgr->vsn == mgr->reclaimed_vsn)
+            pthread_cond_wait(&mgr->vacuum_cond, &mgr->write_lock);
+        pthread_mutex_unlock(&mgr->write_lock);
+        if (!mgr->should_run) break;
+        if (!start) start = latency_now();
+
+        // Wait until a client passes a new version. Active clients
+        // checkpoint often, so start polling quickly and back off.
+        min_vsn = client_min_vsn(mgr);
+        if (min_vsn <= mgr->reclaimed_vsn) {
+            usleep(wait);
+            if (wait < GRACE_MAX_POLL_USEC) wait *= 2;
             continue;
         }
 
-        /*
-         * Because we use a version barrier, we always
-         * end up creating a new version when we try to
-         * apply delta updates. We need to handle the special case
-         * where we are 1 version behind and the only delta is
-         * a barrier. Do this by just updating primary_vsn.
-         */
-        mgr_vsn = mgr->vsn;
-        if ((mgr_vsn - mgr->primary_vsn) == 1) {
-            pthread_mutex_lock(&mgr->write_lock);
-
-            // Ensure no version created in the mean time
-            int should_continue = 0;
-            if (mgr_vsn == mgr->vsn && mgr->delta->type == BARRIER) {
-                mgr->primary_vsn = mgr_vsn;
-                should_continue = 1;
-            }
-
-            // Release the lock and see if we should loop back
-            pthread_mutex_unlock(&mgr->write_lock);
-            if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
-                continue;
-            }
-        }
-
-        // Determine the minimum version
-        min_vsn = client_min_vsn(mgr);
-
-        // Warn if there are a lot of outstanding deltas
+        // Warn if there are a lot of outstanding versions
         if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
-            syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
-        } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
+            syslog(LOG_WARNING, "Many outstanding versions detected! min: %llu (vsn: %llu)",
                     min_vsn, mgr->vsn);
         }
 
-        // Merge the old versions into the alternate three
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        /*
-         * Mark any pending deletes so that create does not allow
-         * a filter to be created before we manage to call delete_old_versions.
-         * There is an unforunate race that can happen if a client
-         * does a create/drop/create cycle, where the create/drop are
-         * reflected in the filter_map, and thus the second create is allowed
-         * BEFORE we have had a chance to actually handle the delete.
-         */
-        mark_pending_deletes(mgr, min_vsn);
-
-        // Swap the maps
-        swap_filter_maps(mgr, min_vsn);
-
-        // Wait on a barrier until nobody is using the old tree
-        version_barrier(mgr);
-
-        // Merge the changes into the other tree now that its safe
-        merge_old_versions(mgr, mgr->delta, min_vsn);
-
-        // Both trees have the changes incorporated, safe to delete
-        delete_old_versions(mgr, min_vsn);
-
-        // Clear the pending delete list, since delete_old_versions() will
-        // block untill all deletes are completed.
-        clear_pending_deletes(mgr);
+        // Nobody can see the garbage of these versions
+        reclaim_versions(mgr, min_vsn);
+        latency_record(LATENCY_GRACE_PERIOD, LATENCY_TOTAL, latency_now() - start);
+        start = 0;
+        wait = GRACE_MIN_POLL_USEC;
 
         // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
+        syslog(LOG_INFO, "Reclaimed versions up to: %llu (vsn: %llu)",
                 min_vsn, mgr->vsn);
     }
     return NULL;
@@ -1139,10 +3993,19 @@ static void* filtmgr_thread_main(void *in) {
  * but can be used in an embeded or test environment.
  */
 void filtmgr_vacuum(bloom_filtmgr *mgr) {
-    unsigned long long vsn = mgr->vsn;
-    merge_old_versions(mgr, mgr->delta, vsn);
-    swap_filter_maps(mgr, vsn);
-    merge_old_versions(mgr, mgr->delta, vsn);
-    delete_old_versions(mgr, vsn);
+    reclaim_versions(mgr, mgr->vsn);
+}
+
+/**
+ * Returns how far the vacuum is behind, as the number of
+ * versions made since the last version it reclaimed.
+ * Clients that do not checkpoint hold it back.
+ * @notes Thread safe, but may be inconsistent.
+ * @return The number of versions not yet vacuumed.
+ */
+unsigned long long filtmgr_vacuum_lag(bloom_filtmgr *mgr) {
+    unsigned long long reclaimed = __atomic_load_n(&mgr->reclaimed_vsn, __ATOMIC_RELAXED);
+    unsigned long long vsn = __atomic_load_n(&mgr->vsn, __ATOMIC_RELAXED);
+    return (vsn > reclaimed) ? vsn - reclaimed : 0;
 }
 
@@ -9,6 +9,11 @@
  */
 typedef struct bloom_filtmgr bloom_filtmgr;
 
+/**
+ * Opaque handle to a single filter
+ */
+typedef struct bloom_filter_wrapper bloom_filter_handle;
+
 /**
  * Lists of filters
  */
@@ -23,6 +28,28 @@ typedef struct {
    bloom_filter_list *tail;
 } bloom_filter_list_head;
 
+/**
+ * State of the last load of a key file into a filter
+ */
+typedef enum {
+    LOAD_NONE = 0,      // No key file was loaded
+    LOAD_QUEUED,        // Waiting for the load thread
+    LOAD_RUNNING,       // The keys are being set
+    LOAD_DONE,          // Every key of the file was set
+    LOAD_FAILED         // The load was stopped early
+} bloom_load_state;
+
+/**
+ * Progress of a load of a key file, see filtmgr_load_progress
+ */
+typedef struct {
+    int state;          // See bloom_load_state
+    uint64_t size;      // Bytes of the key file
+    uint64_t bytes;     // Bytes of the file that were set
+    uint64_t keys;      // Keys that were set
+    uint64_t added;     // Keys that were not yet in the filter
+} bloom_load_progress;
+
 /**
  * Initializer
  * @arg config The configuration
@@ -50,6 +77,16 @@ int destroy_filter_manager(bloom_filtmgr *mgr);
  */
 void filtmgr_client_checkpoint(bloom_filtmgr *mgr);
 
+/**
+ * Should be invoked by clients before they block without
+ * using the filter manager, such as while waiting for IO.
+ * The client is ignored by the vacuum thread until its
+ * next checkpoint, which must be made before using the
+ * manager again.
+ * @arg mgr The manager
+ */
+void filtmgr_client_offline(bloom_filtmgr *mgr);
+
 /**
  * Should be invoked by clients when they no longer
  * need to make use of the filter manager. This
@@ -65,6 +102,23 @@ void filtmgr_client_leave(bloom_filtmgr *mgr);
  */
 int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Writes back the filter with the given name, without
+ * waiting for it to be durable. Once the data dir is
+ * synced, filtmgr_commit_filter completes the flush.
+ * @arg filter_name The name of the filter to write
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_write_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Completes the flush of a filter written back with
+ * filtmgr_write_filter, after the data dir was synced.
+ * @arg filter_name The name of the filter to commit
+ * @return 0 on success. -1 if the filter does not exist.
+ */
+int filtmgr_commit_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Checks for the presence of keys in a given filter
  * @arg filter_name The name of the filter containing the keys
@@ -73,10 +127,26 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name);
  * @arg result Ouput array, stores a 0 if the key does not exist
  * or 1 if the key does exist.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
  */
 int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
+/**
+ * Like filtmgr_check_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter containing the keys
+ * @arg keys A list of points to character arrays to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result);
+
 /**
  * Sets keys in a given filter
  * @arg filter_name The name of the filter
@@ -85,10 +155,203 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
  * @arg result Ouput array, stores a 0 if the key already is set
  * or 1 if the key is set.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
  */
 int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
+/**
+ * Like filtmgr_set_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Checks for the presence of keys in a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result);
+
+/**
+ * Like filtmgr_check_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry.
+ */
+int filtmgr_check_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Checks for the presence of keys that are already hashed,
+ * so the same keys can be checked in many filters while
+ * hashing each key once. The keys may also be given as
+ * their hash by the client, see bf_hashed_key_init_hash.
+ * @arg filter_name The name of the filter containing the keys
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys to check. With no keys,
+ * only checks that the filter exists.
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry. -8 if the keys are given as their
+ * hash, and the filter can not check hashes.
+ */
+int filtmgr_check_hashed(bloom_filtmgr *mgr, char *filter_name, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Checks for the presence of hashed keys through a handle,
+ * like filtmgr_check_hashed.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys to check
+ * @arg result Ouput array, stores a 0 if the key does not exist
+ * or 1 if the key does exist.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -6 if the filter is being faulted
+ * in, with fault_retry. -8 if the keys are given as their
+ * hash, and the filter can not check hashes.
+ */
+int filtmgr_check_hashed_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Sets keys in a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result);
+
+/**
+ * Like filtmgr_set_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to add
+ * @arg result Ouput array, stores a 0 if the key already is set
+ * or 1 if the key is set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -4 if the filter is frozen.
+ * -5 if the filter is over a quota, and can not grow.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_set_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Deletes keys from a filter using the counting layout
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to delete
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
+
+/**
+ * Like filtmgr_delete_keys, for keys of known lengths.
+ * @arg filter_name The name of the filter
+ * @arg keys A list of points to character arrays to delete
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_len(bloom_filtmgr *mgr, char *filter_name, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Deletes keys from a filter through a handle
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to delete
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int num_keys, char *result);
+
+/**
+ * Like filtmgr_delete_keys_handle, for keys of known lengths.
+ * @arg handle The handle from filtmgr_open_handle
+ * @arg keys A list of points to character arrays to delete
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys to delete
+ * @arg result Ouput array, stores a 1 if the key was deleted
+ * or 0 if the key was not set.
+ * @return 0 on success, -1 if the filter no longer exists.
+ * -2 on internal error. -3 if the filter does not support deletes.
+ * -6 if the filter is being faulted in, with fault_retry.
+ */
+int filtmgr_delete_keys_handle_len(bloom_filtmgr *mgr, bloom_filter_handle *handle, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Opens a handle to a filter, which can be used to check
+ * and set keys without looking up the filter name. The
+ * handle keeps the filter alive until it is released, even
+ * if the filter is dropped or cleared in the mean time.
+ * @arg filter_name The name of the filter
+ * @arg handle Output, set to the new handle
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_open_handle(bloom_filtmgr *mgr, char *filter_name, bloom_filter_handle **handle);
+
+/**
+ * Releases a handle returned by filtmgr_open_handle.
+ * @arg handle The handle to release
+ */
+void filtmgr_release_handle(bloom_filtmgr *mgr, bloom_filter_handle *handle);
+
+/**
+ * Takes keys from the rate limit of a filter, which is shared
+ * by all of its clients, as set by filter_key_rate. This is
+ * only used for the commands of the clients, so the keys the
+ * filters take from the primary or the set log are not limited.
+ * @arg handle The handle of the filter
+ * @arg num_keys The number of keys to be checked, set or deleted
+ * @return 0 if the keys may go ahead, 1 if the filter is over its rate.
+ */
+int filtmgr_limit_keys(bloom_filtmgr *mgr, bloom_filter_handle *handle, int num_keys);
+
 /**
  * Creates a new filter of the given name and parameters.
  * @arg filter_name The name of the filter
@@ -98,6 +361,21 @@ int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num
  */
 int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *custom_config);
 
+/**
+ * Creates new filters as a single version, so clients see
+ * them appear together. The filters are created by
+ * up to load_threads threads. Each filter has the same
+ * results as filtmgr_create_filter.
+ * @arg filter_names The names of the filters
+ * @arg num_filters The number of filters
+ * @arg custom_config Optional, can be null. Configs that override the defaults.
+ * Each filter gets its own copy, the caller keeps ownership.
+ * @arg results Output, the result for each filter
+ * @return The number of filters created.
+ */
+int filtmgr_create_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters,
+        bloom_config *custom_config, int *results);
+
 /**
  * Deletes the filter entirely. This removes it from the filter
  * manager and deletes it from disk. This is a permanent operation.
@@ -106,6 +384,17 @@ int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *c
  */
 int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Deletes filters entirely as a single version, so clients
+ * see them go together. Each filter has the
+ * same results as filtmgr_drop_filter.
+ * @arg filter_names The names of the filters
+ * @arg num_filters The number of filters
+ * @arg results Output, the result for each filter
+ * @return The number of filters dropped.
+ */
+int filtmgr_drop_filters(bloom_filtmgr *mgr, char **filter_names, int num_filters, int *results);
+
 /**
  * Unmaps the filter from memory, but leaves it
  * registered in the filter manager. This is rarely invoked
@@ -117,6 +406,283 @@ int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Faults in a filter ahead of its use, and marks it
+ * as hot so it is not unmapped by the next cold scan.
+ * @arg filter_name The name of the filter to warm
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_warm_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Waits for a filter to be queued for the fault thread,
+ * by a command that found it was not in memory.
+ * @arg timeout_msec The longest time to wait
+ * @return 1 if there are queued filters, 0 otherwise.
+ */
+int filtmgr_wait_faults(bloom_filtmgr *mgr, int timeout_msec);
+
+/**
+ * Faults in the filters queued by commands that found them
+ * not in memory, with fault_retry. Called by the fault thread,
+ * so the workers never wait on a fault in.
+ * @return The number of filters faulted in.
+ */
+int filtmgr_run_faults(bloom_filtmgr *mgr);
+
+/**
+ * With fault_retry, queues a filter that is not in memory
+ * for the fault thread, so a command can wait for it to be
+ * faulted in rather than be answered with a retry.
+ * @arg filter_name The name of the filter
+ * @return 1 if the filter is being faulted in, 0 if it
+ * can be used, or does not exist.
+ */
+int filtmgr_queue_fault(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Invoked by the fault thread once it has faulted in
+ * the queued filters.
+ * @arg arg The argument given with the hook
+ */
+typedef void (*filtmgr_fault_hook)(void *arg);
+
+/**
+ * Sets the hook invoked by the fault thread each time it has
+ * faulted in the queued filters, to resume the commands that
+ * wait on them. The hook is invoked with the fault lock held,
+ * so it must not call into the manager.
+ * @arg hook The hook, or NULL to clear it. Once cleared,
+ * the previous hook is no longer invoked.
+ * @arg arg Passed to the hook
+ */
+void filtmgr_set_fault_hook(bloom_filtmgr *mgr, filtmgr_fault_hook hook, void *arg);
+
+/**
+ * Queues a key file to be loaded into a filter by the load
+ * thread. Each line of the file is a key, and the lines are
+ * set in parallel by load_threads threads. The file is relative
+ * to the load_dir, and must not resolve to a path outside of it.
+ * @arg filter_name The name of the filter
+ * @arg path The key file, relative to the load_dir
+ * @return 0 if the load is queued, -1 if the filter does not
+ * exist, -2 if the file can not be read, -3 if a load of the
+ * filter is already queued or running, -4 if there is no load_dir.
+ */
+int filtmgr_queue_load(bloom_filtmgr *mgr, char *filter_name, char *path);
+
+/**
+ * Waits for a key file to be queued for the load thread.
+ * @arg timeout_msec The longest time to wait
+ * @return 1 if there are queued loads, 0 otherwise.
+ */
+int filtmgr_wait_loads(bloom_filtmgr *mgr, int timeout_msec);
+
+/**
+ * Loads the queued key files, oldest first. Called by the
+ * load thread. The loads hold their filters, so this does
+ * not use the filter map, and may be called while offline.
+ * @arg should_run Pointer to an integer that is set to 0
+ * to stop the loads early, which then fail.
+ * @return The number of loads that were finished.
+ */
+int filtmgr_run_loads(bloom_filtmgr *mgr, int *should_run);
+
+/**
+ * Gets the progress of the last load of a key file into a filter.
+ * @arg filter_name The name of the filter
+ * @arg progress Output, the progress. The state is LOAD_NONE
+ * if no key file was loaded into the filter.
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_load_progress(bloom_filtmgr *mgr, char *filter_name, bloom_load_progress *progress);
+
+/**
+ * Rotates a rotating filter, starting a new generation
+ * and deleting the expired ones as needed.
+ * @arg filter_name The name of the filter to rotate
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_rotate_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t now);
+
+/**
+ * Ages an aging filter, expiring the keys that were
+ * not set for its TTL.
+ * @arg filter_name The name of the filter to age
+ * @arg now The current time in seconds
+ * @return 0 on success, -1 if the filter does not exist.
+ * -5 for internal error.
+ */
+int filtmgr_age_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t now);
+
+/**
+ * Verifies the page checksums of the next pages of a filter,
+ * carrying on where the last call stopped. Checks and sets
+ * carry on meanwhile.
+ * @arg filter_name The name of the filter to scrub
+ * @arg max_pages The most pages to verify
+ * @return The number of pages verified, which is less than
+ * max_pages once every page of the filter was verified. -1 if
+ * the filter does not exist, -5 for internal error.
+ */
+int64_t filtmgr_scrub_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t max_pages);
+
+/**
+ * Measures how much of a filter is resident in memory, for
+ * the info command and the metrics. Checks and sets carry
+ * on meanwhile.
+ * @arg filter_name The name of the filter to scan
+ * @return 0 on success, -1 if the filter does not exist,
+ * -5 for internal error.
+ */
+int filtmgr_scan_residency(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Hints the kernel to reclaim the clean pages of a filter
+ * mapped from its files, when memory is under pressure. The
+ * filter stays mapped, and checks and sets carry on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg pageout If 1, reclaim the older layers now rather
+ * than marking them cold
+ * @arg bytes Output, the bytes of the pages that were hinted
+ * @return 0 on success, -1 if the filter does not exist,
+ * -5 for internal error.
+ */
+int filtmgr_reclaim_filter(bloom_filtmgr *mgr, char *filter_name, int pageout, uint64_t *bytes);
+
+/**
+ * Counts the bytes of a filter that changed since it was
+ * last flushed, for the flush thread. Checks and sets carry
+ * on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg bytes Output, the dirty bytes
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_dirty_bytes(bloom_filtmgr *mgr, char *filter_name, uint64_t *bytes);
+
+/**
+ * Copies the runs of pages of a filter that changed in a
+ * generation of the replication log or later, in batches,
+ * see bloomf_changed_pages. Checks and sets carry on meanwhile.
+ * @arg filter_name The name of the filter
+ * @arg gen The generation
+ * @arg cursor In/out, the next page to copy, 0 on the first call
+ * @arg num_layers In/out, the layers copied, 0 on the first call
+ * @arg max_run The most bytes given to the callback at once
+ * @arg cb The callback, invoked with data
+ * @return 1 if the callback stopped the copy, 0 once it is done,
+ * -1 if the filter does not exist, -5 if the pages of the filter
+ * are not tracked since the generation, and it must be copied whole.
+ */
+int filtmgr_changed_pages(bloom_filtmgr *mgr, char *filter_name, uint32_t gen, uint64_t *cursor,
+        uint32_t *num_layers, uint64_t max_run, bloom_pages_cb cb, void *data);
+
+/**
+ * Merges the changed pages of a filter on another node into
+ * the filter, see bloomf_merge_pages.
+ * @arg filter_name The name of the filter
+ * @arg num_layers The number of layers of the other filter
+ * @arg layer The layer of the pages, counted from the oldest
+ * @arg layer_bytes The size of the layer
+ * @arg offset The offset of the pages in the layer
+ * @arg bytes The pages
+ * @arg len The length of the pages
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 for internal error, -5 if the layers of the filters differ.
+ */
+int filtmgr_merge_pages(bloom_filtmgr *mgr, char *filter_name, uint32_t num_layers, uint32_t layer,
+        uint64_t layer_bytes, uint64_t offset, const unsigned char *bytes, uint64_t len);
+
+/**
+ * Writes a consistent point-in-time copy of the filter to
+ * the snapshots folder of the data dir. The layers are copied
+ * while checks and sets continue, and the write lock is only
+ * held to start the snapshot and to copy the pages that
+ * changed during the copy.
+ * @arg filter_name The name of the filter to snapshot
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -6 if the filter rotates, -7 if the filter is frozen,
+ * -9 if the filter is sharded.
+ */
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Snapshots an in-memory filter if it has changed since its
+ * last snapshot, which it is restored from when next loaded.
+ * @arg filter_name The name of the filter
+ * @return 0 if a snapshot was written, 1 if the filter is
+ * not in-memory or is unchanged, or the errors of
+ * filtmgr_snapshot_filter.
+ */
+int filtmgr_snapshot_memory_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Freezes a freezable filter into an xor filter, which
+ * is smaller and faster to check. A frozen filter can
+ * no longer be set.
+ * @arg filter_name The name of the filter to freeze
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -7 if the filter is already frozen, -8 if the filter
+ * was not created freezable.
+ */
+int filtmgr_freeze_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Compacts the layers of a freezable filter into one
+ * layer, so checks probe a single bloom filter.
+ * @arg filter_name The name of the filter to compact
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -7 if the filter is frozen, -8 if the filter was not
+ * created freezable.
+ */
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Shrinks a filter that holds far fewer keys than it was
+ * created for, by folding its layer onto itself.
+ * @arg filter_name The name of the filter to shrink
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -4 if the filter is
+ * in-memory, -5 for internal error, -6 if the filter rotates,
+ * -7 if the filter is frozen, -10 if its layout can not be
+ * folded.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Empties a filter in place, so it can be rotated without
+ * a drop and create. The layers are replaced with one empty
+ * layer while the filter is locked, so clients never see the
+ * filter missing, and the old layers are not written back.
+ * @arg filter_name The name of the filter to reset
+ * @return 0 on success, -1 if the filter does not exist.
+ * -3 if a snapshot is in progress, -5 for internal error,
+ * -6 if the filter rotates, -7 if the filter is frozen.
+ */
+int filtmgr_reset_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Creates a filter from the union or intersection of
+ * existing filters, by merging their bitmaps. The new filter
+ * takes the parameters of the first source, and every source
+ * must have been created with the same parameters.
+ * @arg filter_name The name of the new filter
+ * @arg sources The names of the filters to merge
+ * @arg num_sources The number of sources, at least one
+ * @arg intersect 1 for an intersection, 0 for a union
+ * @return 0 on success, -1 if a source does not exist.
+ * -2 for internal error. -3 if there is a pending delete.
+ * -4 if the filter already exists. -5 if the sources
+ * can not be merged.
+ */
+int filtmgr_merge_filters(bloom_filtmgr *mgr, char *filter_name, char **sources, int num_sources, int intersect);
+
 /**
  * Clears the filter from the internal data stores. This can only
  * be performed if the filter is proxied.
@@ -126,6 +692,137 @@ int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Creates an alias, a name that resolves to a filter
+ * in every command. The alias is removed with its filter.
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the filter, or of an alias of it
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the name is taken by a filter or alias,
+ * -3 if there is a pending delete of the name.
+ */
+int filtmgr_create_alias(bloom_filtmgr *mgr, char *alias, char *filter_name);
+
+/**
+ * Points an alias at another filter. Both happen in one
+ * version, so each command sees either the old or the new
+ * filter. The old filter is dropped, unless another alias
+ * still resolves to it.
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the new filter, or of an alias of it
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the alias does not exist.
+ */
+int filtmgr_swap_alias(bloom_filtmgr *mgr, char *alias, char *filter_name);
+
+/**
+ * Removes an alias, leaving its filter.
+ * @arg alias The name of the alias
+ * @return 0 on success, -1 if the alias does not exist.
+ */
+int filtmgr_drop_alias(bloom_filtmgr *mgr, char *alias);
+
+/**
+ * Allocates space for and returns a linked list of the
+ * aliases. Each entry is the alias and the name of its
+ * filter, separated by a space.
+ * @arg mgr The manager to list from
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_aliases(bloom_filtmgr *mgr, bloom_filter_list_head **head);
+
+/**
+ * Adds a filter whose directory is already in the data dir,
+ * such as one copied in by a replica. The filter is added
+ * cold, and is faulted in from its files on first use.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter already exists.
+ * -2 for internal error. -3 if there is a pending delete.
+ */
+int filtmgr_load_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Callback used to copy the files of a filter
+ * @arg data Opaque pointer
+ * @arg filter_name The name of the filter
+ * @arg filter The filter, whose files are in its full_path
+ * @return 0 on success
+ */
+typedef int(*filter_copy_cb)(void* data, char* filter_name, bloom_filter *filter);
+
+/**
+ * Invokes a callback to copy the files of a filter, such as to
+ * bootstrap a replica. The filter is flushed first, and is not
+ * unmapped, snapshot or rotated until the callback returns, so
+ * its files stay in place while they are read. Checks and sets
+ * continue during the copy.
+ * @arg filter_name The name of the filter
+ * @arg cb The callback, invoked with data
+ * @return The result of the callback, -1 if the filter does
+ * not exist, -3 if a snapshot is in progress.
+ */
+int filtmgr_copy_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data);
+
+/**
+ * Writes a snapshot of the filter, like filtmgr_snapshot_filter,
+ * and invokes a callback to copy its files, such as to export
+ * it. No other snapshot of the filter can replace the files
+ * until the callback returns. The files are in the directory
+ * given by bloomf_snapshot_path.
+ * @arg filter_name The name of the filter to export
+ * @arg cb The callback, invoked with data
+ * @return The result of the callback, the errors of
+ * filtmgr_snapshot_filter, or -4 if the filter is in-memory,
+ * since its files would be received as an empty filter.
+ */
+int filtmgr_export_filter(bloom_filtmgr *mgr, char *filter_name, filter_copy_cb cb, void *data);
+
+/**
+ * Opaque handle to a replication log, see replication.h
+ */
+struct bloom_repl_log;
+
+/**
+ * Picks up the changes the writer made to the data dir of
+ * a read-only server. Filters the writer created are added
+ * cold, the filters it dropped are closed, and the rest are
+ * refreshed, see bloomf_refresh.
+ * @return 0 on success, -1 if the data dir can not be read.
+ */
+int filtmgr_refresh(bloom_filtmgr *mgr);
+
+/**
+ * Sets the replication log the changes made through
+ * the manager are recorded in. Must be set before any
+ * clients use the manager. The pages that change in the
+ * filters are stamped with the generations of the log
+ * from then on, see repl_log_clock.
+ * @arg log The log, or NULL to stop recording
+ */
+void filtmgr_set_repl_log(bloom_filtmgr *mgr, struct bloom_repl_log *log);
+
+/**
+ * Starts recording the keys set and deleted in a filter
+ * into a log, while the filter is migrated to another
+ * node. The log is owned by the filter from then on, and
+ * is destroyed with it, so sets made through handles that
+ * outlive a drop are still recorded safely.
+ * @arg handle A handle to the filter
+ * @arg log The log
+ * @return 0 on success, -1 if the filter is already migrating.
+ */
+int filtmgr_set_migration_log(bloom_filtmgr *mgr, bloom_filter_handle *handle, struct bloom_repl_log *log);
+
+/**
+ * Checks if a filter that was dropped is still being
+ * deleted. Once the delete is done, no client is using
+ * the filter by its name any more.
+ * @arg filter_name The name of the filter
+ * @return 1 if the delete is pending, 0 otherwise.
+ */
+int filtmgr_delete_pending(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Allocates space for and returns a linked
  * list of all the filters. The memory should be free'd by
@@ -140,14 +837,66 @@ int filtmgr_list_filters(bloom_filtmgr *mgr, char *prefix, bloom_filter_list_hea
 /**
  * Allocates space for and returns a linked
  * list of all the cold filters. This has the side effect
- * of clearing the list of cold filters! The memory should
- * be free'd by the caller.
+ * of clearing the list of cold filters! Pinned filters
+ * are never listed. The memory should be free'd by the caller.
  * @arg mgr The manager to list from
  * @arg head Output, sets to the address of the list header
  * @return 0 on success.
  */
 int filtmgr_list_cold_filters(bloom_filtmgr *mgr, bloom_filter_list_head **head);
 
+/**
+ * Allocates space for and returns a linked list of
+ * the rotating filters that should be rotated. The
+ * memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg now The current time in seconds
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_rotate_filters(bloom_filtmgr *mgr, uint64_t now, bloom_filter_list_head **head);
+
+/**
+ * Allocates space for and returns a linked list of
+ * the aging filters that are due a tick. The
+ * memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg now The current time in seconds
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_age_filters(bloom_filtmgr *mgr, uint64_t now, bloom_filter_list_head **head);
+
+/**
+ * Records the filters accessed since the last call in the access
+ * history for the current hour, and lists the proxied filters that
+ * were accessed in the upcoming hour over the last day. Must only
+ * be called from a single thread. The memory should be free'd by
+ * the caller.
+ * @arg mgr The manager to list from
+ * @arg hour The current hour of the day, 0 to 23
+ * @arg upcoming The hour of the day to list the filters for,
+ * or -1 to only record the accesses
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_warm_filters(bloom_filtmgr *mgr, int hour, int upcoming, bloom_filter_list_head **head);
+
+/**
+ * Advances the eviction clock, and if the mapped filters use more
+ * memory than the budget, lists the filters to unmap to get back
+ * within it. Filters used in few clock ticks are listed first, and
+ * otherwise the least recently used are listed first. Filters used
+ * in the last tick are never listed, and neither are pinned filters,
+ * whose memory still counts against the budget. Must only be called
+ * from a single thread. The memory should be free'd by the caller.
+ * @arg mgr The manager to list from
+ * @arg budget The memory budget in bytes
+ * @arg head Output, sets to the address of the list header
+ * @return 0 on success.
+ */
+int filtmgr_list_evict_filters(bloom_filtmgr *mgr, uint64_t budget, bloom_filter_list_head **head);
+
 /**
  * Convenience method to cleanup a filter list.
  */
@@ -164,6 +913,20 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head);
 typedef void(*filter_cb)(void* in, char *filter_name, bloom_filter *filter);
 int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data);
 
+/**
+ * Invokes a callback with each of the filters, in the same
+ * order as filtmgr_list_filters, without copying the names.
+ * The same rules as filtmgr_filter_cb apply, the filters are
+ * not locked and the callback should only read metrics and
+ * cached metadata. The filters are kept alive until the
+ * caller checkpoints, so the iteration must not span one.
+ * @arg mgr The manager to iterate
+ * @arg prefix The prefix to iterate or NULL
+ * @arg cb The callback, invoked with data
+ * @return 0 on success.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, filter_cb cb, void *data);
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in bloomd,
@@ -171,4 +934,13 @@ int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void*
  */
 void filtmgr_vacuum(bloom_filtmgr *mgr);
 
+/**
+ * Returns how far the vacuum is behind, as the number of
+ * versions made since the last version it reclaimed.
+ * Clients that do not checkpoint hold it back.
+ * @notes Thread safe, but may be inconsistent.
+ * @return The number of versions not yet vacuumed.
+ */
+unsigned long long filtmgr_vacuum_lag(bloom_filtmgr *mgr);
+
 #endif
@@ -21,39 +21,130 @@ static const int FILT_KEY_NEEDED_LEN = sizeof(FILT_KEY_NEEDED) - 1;
 static const char FILT_NEEDED[] = "Must provide filter name";
 static const int FILT_NEEDED_LEN = sizeof(FILT_NEEDED) - 1;
 
+static const char HANDLE_NEEDED[] = "Must provide filter handle";
+static const int HANDLE_NEEDED_LEN = sizeof(HANDLE_NEEDED) - 1;
+
+static const char TOO_MANY_HANDLES[] = "Too many filter handles";
+static const int TOO_MANY_HANDLES_LEN = sizeof(TOO_MANY_HANDLES) - 1;
+
 static const char BAD_FILT_NAME[] = "Bad filter name";
 static const int BAD_FILT_NAME_LEN = sizeof(BAD_FILT_NAME) - 1;
 
+static const char UNKNOWN_TEMPLATE[] = "Template does not exist";
+static const int UNKNOWN_TEMPLATE_LEN = sizeof(UNKNOWN_TEMPLATE) - 1;
+
+static const char PREFIX_COUNT_NEEDED[] = "Must provide filter prefix and count";
+static const int PREFIX_COUNT_NEEDED_LEN = sizeof(PREFIX_COUNT_NEEDED) - 1;
+
 static const char INTERNAL_ERR[] = "Internal Error\n";
 static const int INTERNAL_ERR_LEN = sizeof(INTERNAL_ERR) - 1;
 
 static const char FILT_NOT_EXIST[] = "Filter does not exist\n";
 static const int FILT_NOT_EXIST_LEN = sizeof(FILT_NOT_EXIST) - 1;
 
+static const char HANDLE_NOT_EXIST[] = "Handle does not exist\n";
+static const int HANDLE_NOT_EXIST_LEN = sizeof(HANDLE_NOT_EXIST) - 1;
+
 static const char FILT_NOT_PROXIED[] = "Filter is not proxied. Close it first.\n";
 static const int FILT_NOT_PROXIED_LEN = sizeof(FILT_NOT_PROXIED) - 1;
 
 static const char DELETE_IN_PROGRESS[] = "Delete in progress\n";
 static const int DELETE_IN_PROGRESS_LEN = sizeof(DELETE_IN_PROGRESS) - 1;
 
+static const char SNAPSHOT_IN_PROGRESS[] = "Snapshot in progress\n";
+static const int SNAPSHOT_IN_PROGRESS_LEN = sizeof(SNAPSHOT_IN_PROGRESS) - 1;
+
+static const char FILT_IN_MEMORY[] = "Filter is in-memory\n";
+static const int FILT_IN_MEMORY_LEN = sizeof(FILT_IN_MEMORY) - 1;
+
+static const char FILT_ROTATING[] = "Filter is rotating\n";
+static const int FILT_ROTATING_LEN = sizeof(FILT_ROTATING) - 1;
+
+static const char FILT_SHARDED[] = "Filter is sharded\n";
+static const int FILT_SHARDED_LEN = sizeof(FILT_SHARDED) - 1;
+
+static const char FILT_NO_DELETES[] = "Filter does not support deletes\n";
+static const int FILT_NO_DELETES_LEN = sizeof(FILT_NO_DELETES) - 1;
+
+static const char FILT_FROZEN[] = "Filter is frozen\n";
+static const int FILT_FROZEN_LEN = sizeof(FILT_FROZEN) - 1;
+
+static const char FILT_OVER_QUOTA[] = "Filter is over its quota\n";
+static const int FILT_OVER_QUOTA_LEN = sizeof(FILT_OVER_QUOTA) - 1;
+
+static const char FILT_LOADING[] = "Filter is loading\n";
+static const int FILT_LOADING_LEN = sizeof(FILT_LOADING) - 1;
+
+static const char BUSY_RESP[] = "Busy\n";
+static const int BUSY_RESP_LEN = sizeof(BUSY_RESP) - 1;
+
+static const char FILT_NOT_FREEZABLE[] = "Filter is not freezable\n";
+static const int FILT_NOT_FREEZABLE_LEN = sizeof(FILT_NOT_FREEZABLE) - 1;
+
+static const char FILT_CANT_SHRINK[] = "Filter can not be shrunk\n";
+static const int FILT_CANT_SHRINK_LEN = sizeof(FILT_CANT_SHRINK) - 1;
+
+static const char READ_ONLY_ERR[] = "Server is read-only";
+static const int READ_ONLY_ERR_LEN = sizeof(READ_ONLY_ERR) - 1;
+
+static const char FILT_NODE_NEEDED[] = "Must provide filter name and node";
+static const int FILT_NODE_NEEDED_LEN = sizeof(FILT_NODE_NEEDED) - 1;
+
+static const char NOT_CLUSTERED[] = "Server is not in a cluster";
+static const int NOT_CLUSTERED_LEN = sizeof(NOT_CLUSTERED) - 1;
+
+static const char UNKNOWN_NODE[] = "Unknown cluster node";
+static const int UNKNOWN_NODE_LEN = sizeof(UNKNOWN_NODE) - 1;
+
+static const char SAME_NODE[] = "Filter is already on the node";
+static const int SAME_NODE_LEN = sizeof(SAME_NODE) - 1;
+
+static const char NO_TRANSFERS[] = "Connection can not stream filters";
+static const int NO_TRANSFERS_LEN = sizeof(NO_TRANSFERS) - 1;
+
+static const char MOVED_RESP[] = "MOVED ";
+
+static const char TOO_MANY_FILTS[] = "Too many filters";
+static const int TOO_MANY_FILTS_LEN = sizeof(TOO_MANY_FILTS) - 1;
+
+static const char FILT_CANT_MERGE[] = "Filters can not be merged\n";
+static const int FILT_CANT_MERGE_LEN = sizeof(FILT_CANT_MERGE) - 1;
+
+static const char FILT_SOURCES_NEEDED[] = "Must provide filter name and sources";
+static const int FILT_SOURCES_NEEDED_LEN = sizeof(FILT_SOURCES_NEEDED) - 1;
+
+static const char ALIAS_NEEDED[] = "Must provide alias and filter name";
+static const int ALIAS_NEEDED_LEN = sizeof(ALIAS_NEEDED) - 1;
+
+static const char ALIAS_NOT_EXIST[] = "Alias does not exist\n";
+static const int ALIAS_NOT_EXIST_LEN = sizeof(ALIAS_NOT_EXIST) - 1;
+
+static const char FILT_PATH_NEEDED[] = "Must provide filter name and path";
+static const int FILT_PATH_NEEDED_LEN = sizeof(FILT_PATH_NEEDED) - 1;
+
+static const char NO_LOAD_DIR[] = "Server has no load_dir";
+static const int NO_LOAD_DIR_LEN = sizeof(NO_LOAD_DIR) - 1;
+
+static const char KEY_FILE_ERR[] = "Key file can not be read\n";
+static const int KEY_FILE_ERR_LEN = sizeof(KEY_FILE_ERR) - 1;
+
+static const char LOAD_IN_PROGRESS[] = "Load in progress\n";
+static const int LOAD_IN_PROGRESS_LEN = sizeof(LOAD_IN_PROGRESS) - 1;
+
 static const char DONE_RESP[] = "Done\n";
 static const int DONE_RESP_LEN = sizeof(DONE_RESP) - 1;
 
 static const char EXISTS_RESP[] = "Exists\n";
 static const int EXISTS_RESP_LEN = sizeof(EXISTS_RESP) - 1;
 
-static const char YES_SPACE[] = "Yes ";
-static const int YES_SPACE_LEN = sizeof(YES_SPACE) - 1;
-
-static const char NO_SPACE[] = "No ";
-static const int NO_SPACE_LEN = sizeof(NO_SPACE) - 1;
-
 static const char YES_RESP[] = "Yes\n";
 static const int YES_RESP_LEN = sizeof(YES_RESP) - 1;
 
 static const char NO_RESP[] = "No\n";
 static const int NO_RESP_LEN = sizeof(NO_RESP) - 1;
 
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
 static const char NEW_LINE[] = "\n";
 static const int NEW_LINE_LEN = sizeof(NEW_LINE) - 1;
 
@@ -76,9 +167,144 @@ typedef enum {
     CLOSE,          // Close a filter
     CLEAR,          // Clears a filter from the internals
     FLUSH,          // Force flush a filter
+    USE,            // Open a filter handle
+    RELEASE,        // Release a filter handle
+    SNAPSHOT,       // Snapshot a filter
+    WARM,           // Fault in a filter
+    CREATE_MULTI,   // Creates several filters
+    DROP_MULTI,     // Drops several filters
+    DROP_PREFIX,    // Drops the filters matching a prefix
+    DELETE,         // Delete space-seperated keys from a counting filter
+    FREEZE,         // Freeze a filter into an xor filter
+    COMPACT,        // Compact the layers of a filter
+    STATS,          // Latency stats of the commands
+    MIGRATE,        // Migrate a filter to another node
+    EXPORT,         // Stream a snapshot of a filter to the client
+    IMPORT,         // Load a filter streamed by the client
+    PROVISION,      // Creates a numbered range of filters
+    CHECK_ANY,      // Check keys against several filters
+    SET_ANY,        // Set the keys absent from several filters
+    UNION,          // Create a filter from the union of filters
+    INTERSECT,      // Create a filter from the intersection of filters
+    RESET,          // Empty a filter in place
+    FORMAT,         // Set the format of the multi key responses
+    SLOWLOG,        // The slowest recent commands
+    ALIAS,          // Manage the aliases of filters
+    LOAD,           // Load the keys of a local key file
+    SHRINK,         // Fold an oversized filter onto itself
 } conn_cmd_type;
 
+/*
+ * The single letter opcodes of the commands, indexed by the letter.
+ * The key commands use lower case and the filter commands upper case.
+ */
+static const conn_cmd_type SHORT_COMMANDS[128] = {
+    ['c'] = CHECK,
+    ['m'] = CHECK_MULTI,
+    ['a'] = CHECK_ANY,
+    ['v'] = SET_ANY,
+    ['u'] = UNION,
+    ['n'] = INTERSECT,
+    ['s'] = SET,
+    ['b'] = SET_MULTI,
+    ['d'] = DELETE,
+    ['L'] = LIST,
+    ['I'] = INFO,
+    ['C'] = CREATE,
+    ['D'] = DROP,
+    ['X'] = CLOSE,
+    ['E'] = CLEAR,
+    ['F'] = FLUSH,
+    ['U'] = USE,
+    ['R'] = RELEASE,
+    ['S'] = SNAPSHOT,
+    ['W'] = WARM,
+    ['N'] = CREATE_MULTI,
+    ['O'] = DROP_MULTI,
+    ['P'] = DROP_PREFIX,
+    ['Z'] = FREEZE,
+    ['K'] = COMPACT,
+    ['Y'] = RESET,
+    ['G'] = MIGRATE,
+    ['Q'] = EXPORT,
+    ['J'] = IMPORT,
+    ['V'] = PROVISION,
+    ['T'] = STATS,
+    ['o'] = FORMAT,
+};
+
+/*
+ * Binary messages are recorded in the latency stats
+ * after the text commands, by opcode.
+ */
+#define BIN_LATENCY_COMMAND(opcode) (SHRINK + (opcode))
+
+/*
+ * Names of the commands in the latency stats, indexed
+ * by conn_cmd_type and then BIN_LATENCY_COMMAND.
+ */
+static const char *LATENCY_COMMAND_NAMES[] = {
+    "unknown", "check", "multi", "set", "bulk", "list", "info",
+    "create", "drop", "close", "clear", "flush", "use", "release",
+    "snapshot", "warm", "create_multi", "drop_multi", "drop_prefix",
+    "delete", "freeze", "compact", "stats", "migrate", "export",
+    "import", "provision", "check_any",
+    "set_any", "union", "intersect", "reset", "format", "slowlog", "alias", "load",
+    "shrink",
+    "binary_check", "binary_set", "binary_check_hashed",
+};
+static const int NUM_LATENCY_COMMANDS = sizeof(LATENCY_COMMAND_NAMES) / sizeof(char*);
+
+/*
+ * Binary protocol. A binary message starts with BIN_MAGIC,
+ * which never starts a text command, so both protocols can be
+ * used on the same connection. All integers are big-endian.
+ *
+ * Request header:
+ *  0: BIN_MAGIC
+ *  1: Opcode, see bin_opcode
+ *  2-3: Length of the filter name
+ *  4-7: Length of the body, after the filter name
+ * The body is the number of keys as a 32bit integer, followed
+ * by each key as a 16bit length and the key bytes. For
+ * BIN_CHECK_HASHED, each key is instead its 128bit MurmurHash3,
+ * as two 64bit integers.
+ *
+ * Response header:
+ *  0: BIN_MAGIC
+ *  1: Status, see bin_status
+ *  2-3: Reserved, zero
+ *  4-7: Length of the body
+ * On success, the body is the number of keys as a 32bit integer,
+ * followed by a bitset with one bit per key, in key order, starting
+ * with the least significant bit of the first byte.
+ */
+#define BIN_MAGIC 0xB1
+#define BIN_HEADER_LEN 8
+#define BIN_MAX_BODY (64 * 1024 * 1024)
+
+typedef enum {
+    BIN_CHECK = 1,          // Check a vector of keys
+    BIN_SET = 2,            // Set a vector of keys
+    BIN_CHECK_HASHED = 3,   // Check a vector of key hashes
+} bin_opcode;
+
+typedef enum {
+    BIN_OK = 0,
+    BIN_FILT_NOT_EXIST,
+    BIN_BAD_ARGS,
+    BIN_CMD_NOT_SUP,
+    BIN_INTERNAL_ERR,
+    BIN_FILT_FROZEN,
+    BIN_READ_ONLY,
+    BIN_MOVED,              // The body is the host:port serving the filter
+    BIN_FILT_OVER_QUOTA,
+    BIN_FILT_LOADING,       // Retry once the filter is faulted in
+    BIN_BUSY,               // Over a rate limit or shed, retry later
+    BIN_NOT_HASHABLE,       // The filter can not check key hashes
+} bin_status;
+
 /* Static regexes */
 static regex_t VALID_FILTER_NAMES_RE;
-static const char *VALID_FILTER_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
+static const char *VALID_FILTER_NAMES_PATTERN = "^[^@ \t\n\r][^ \t\n\r]{0,199}$";
 
@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+/**
+ * Most listeners passed in a handoff
+ */
+#define HANDOFF_MAX_FDS 256
+
+/**
+ * The first file descriptor passed by systemd
+ */
+#define SD_LISTEN_FDS_START 3
+
+/*
+ * The listeners are tagged by their kind, one byte each in
+ * the payload of the handoff message, in the order of the fds.
+ */
+#define TAG_TCP 'T'
+#define TAG_UDP 'U'
+#define TAG_UNIX 'X'
+#define TAG_WORKER 'W'
+#define TAG_PRIORITY 'P'
+
+/*
+ * Static declarations
+ */
+static socklen_t handoff_addr(char *path, struct sockaddr_un *addr);
+static void add_listener(bloom_listeners *l, char tag, int fd);
+static int inherit_systemd(bloom_config *config, bloom_listeners *l);
+static int inherit_handoff(bloom_config *config, bloom_listeners *l);
+static void check_listener_port(int *fd, int port, const char *kind);
+static int listener_port(int fd);
+
+
+/**
+ * Initializes a set of listeners, with none inherited.
+ * @arg l The listeners
+ */
+void init_listeners(bloom_listeners *l) {
+    l->tcp_fd = -1;
+    l->udp_fd = -1;
+    l->unix_fd = -1;
+    l->priority_fd = -1;
+    l->num_worker_fds = 0;
+    l->worker_fds = NULL;
+}
+
+
+/**
+ * Closes the inherited listeners that were not used,
+ * and frees the listeners.
+ * @arg l The listeners
+ */
+void close_listeners(bloom_listeners *l) {
+    if (l->tcp_fd >= 0) close(l->tcp_fd);
+    if (l->udp_fd >= 0) close(l->udp_fd);
+    if (l->unix_fd >= 0) close(l->unix_fd);
+    if (l->priority_fd >= 0) close(l->priority_fd);
+    for (int i=0; i < l->num_worker_fds; i++) {
+        if (l->worker_fds[i] >= 0) close(l->worker_fds[i]);
+    }
+    free(l->worker_fds);
+    init_listeners(l);
+}
+
+
+/**
+ * Takes the listeners of a previous process. The listeners
+ * passed by systemd are used if there are any. Otherwise, if
+ * a handoff_socket is configured and a server is listening on
+ * it, its listeners are taken over, and this blocks until that
+ * server has exited.
+ * @arg config The configuration
+ * @arg l Output, the inherited listeners
+ * @return 0 on success, including when nothing is inherited.
+ */
+int inherit_listeners(bloom_config *config, bloom_listeners *l) {
+    init_listeners(l);
+    int res = inherit_systemd(config, l);
+    if (res < 0) return -1;
+    if (!res && config->handoff_socket && inherit_handoff(config, l)) return -1;
+
+    // A listener of another port is of no use, and would serve
+    // clients on a port that is no longer configured
+    check_listener_port(&l->tcp_fd, config->tcp_port, "TCP");
+    check_listener_port(&l->udp_fd, config->udp_port, "UDP");
+    check_listener_port(&l->priority_fd, config->priority_port, "priority");
+    for (int i=0; i < l->num_worker_fds; i++) {
+        check_listener_port(l->worker_fds + i, config->tcp_port, "TCP");
+    }
+    return 0;
+}
+
+
+/**
+ * Binds the handoff socket, so a new process can take over.
+ * A socket file left by a previous process is replaced.
+ * @arg path The path, starting with '@' for the abstract namespace
+ * @return The listening socket, or -1 on error.
+ */
+int bind_handoff_socket(char *path) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = handoff_addr(path, &addr);
+    struct stat st;
+    if (path[0] != '@' && !lstat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create the handoff socket! Err: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) || listen(fd, 1)) {
+        syslog(LOG_ERR, "Failed to listen on the handoff socket '%s'! Err: %s",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Accepts a process taking over on the handoff socket,
+ * and sends it our listeners. The process must be of the
+ * same user. The returned connection must stay open until
+ * we exit, which tells the new process we are done.
+ * @arg handoff_fd The handoff socket
+ * @arg l The listeners to send
+ * @return The connection to the new process, or -1 on error.
+ */
+int send_listeners(int handoff_fd, bloom_listeners *l) {
+    int fd = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to accept on the handoff socket! Err: %s", strerror(errno));
+        return -1;
+    }
+
+    // Only hand the listeners to our own user
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || cred.uid != getuid()) {
+        syslog(LOG_WARNING, "Refused a handoff to another user!");
+        close(fd);
+        return -1;
+    }
+
+    char tags[HANDOFF_MAX_FDS];
+    int fds[HANDOFF_MAX_FDS];
+    int num = 0;
+    if (l->tcp_fd >= 0) { tags[num] = TAG_TCP; fds[num++] = l->tcp_fd; }
+    if (l->udp_fd >= 0) { tags[num] = TAG_UDP; fds[num++] = l->udp_fd; }
+    if (l->unix_fd >= 0) { tags[num] = TAG_UNIX; fds[num++] = l->unix_fd; }
+    if (l->priority_fd >= 0) { tags[num] = TAG_PRIORITY; fds[num++] = l->priority_fd; }
+    for (int i=0; i < l->num_worker_fds && num < HANDOFF_MAX_FDS; i++) {
+        tags[num] = TAG_WORKER;
+        fds[num++] = l->worker_fds[i];
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    bzero(control, sizeof(control));
+    struct iovec iov = {tags, num};
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(num * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num * sizeof(int));
+
+    if (!num || sendmsg(fd, &msg, MSG_NOSIGNAL) != num) {
+        syslog(LOG_ERR, "Failed to send the listeners! Err: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Fills the address of the handoff socket
+ * @return The length of the address
+ */
+static socklen_t handoff_addr(char *path, struct sockaddr_un *addr) {
+    bzero(addr, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    if (path[0] != '@') return sizeof(struct sockaddr_un);
+    addr->sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + strlen(path);
+}
+
+
+/**
+ * Adds an inherited listener to a set, closing it if the
+ * set already has one of its kind.
+ */
+static void add_listener(bloom_listeners *l, char tag, int fd) {
+    int *slot = NULL;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    switch (tag) {
+        case TAG_TCP:
+            slot = &l->tcp_fd;
+            break;
+        case TAG_UDP:
+            slot = &l->udp_fd;
+            break;
+        case TAG_UNIX:
+            slot = &l->unix_fd;
+            break;
+        case TAG_PRIORITY:
+            slot = &l->priority_fd;
+            break;
+        case TAG_WORKER:
+            if (l->num_worker_fds % 16 == 0) {
+                int *fds = realloc(l->worker_fds, (l->num_worker_fds + 16) * sizeof(int));
+                if (!fds) break;
+                l->worker_fds = fds;
+            }
+            l->worker_fds[l->num_worker_fds++] = fd;
+            return;
+    }
+    if (!slot || *slot >= 0) {
+        close(fd);
+        return;
+    }
+    *slot = fd;
+}
+
+
+/**
+ * Takes the listeners passed by systemd socket activation.
+ * The kind of each is found from the socket itself.
+ * @return The number of listeners, or -1 on error.
+ */
+static int inherit_systemd(bloom_config *config, bloom_listeners *l) {
+    char *pid = getenv("LISTEN_PID");
+    char *fds = getenv("LISTEN_FDS");
+    if (!pid || !fds || atoi(pid) != getpid()) return 0;
+    int num = atoi(fds);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for (int fd=SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + num; fd++) {
+        int domain, type;
+        socklen_t len = sizeof(int);
+        if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) ||
+                getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)) {
+            syslog(LOG_ERR, "Passed descriptor %d is not a socket!", fd);
+            return -1;
+        }
+        char tag = 0;
+        if (domain == AF_INET && type == SOCK_STREAM && config->priority_port &&
+                listener_port(fd) == config->priority_port)
+            tag = TAG_PRIORITY;
+        else if (domain == AF_INET && type == SOCK_STREAM)
+            tag = config->use_reuseport ? TAG_WORKER : TAG_TCP;
+        else if (domain == AF_INET && type == SOCK_DGRAM)
+            tag = TAG_UDP;
+        else if (domain == AF_UNIX && type == SOCK_STREAM)
+            tag = TAG_UNIX;
+        else
+            syslog(LOG_WARNING, "Ignoring passed socket %d of an unknown kind.", fd);
+        add_listener(l, tag, fd);
+    }
+
+    // The sockets of the workers must not block in accept
+    for (int i=0; i < l->num_worker_fds; i++) {
+        int flags = fcntl(l->worker_fds[i], F_GETFL, 0);
+        if (flags >= 0) fcntl(l->worker_fds[i], F_SETFL, flags | O_NONBLOCK);
+    }
+    if (l->udp_fd >= 0) {
+        int flags = fcntl(l->udp_fd, F_GETFL, 0);
+        if (flags >= 0) fcntl(l->udp_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    syslog(LOG_INFO, "Using %d socket(s) passed by systemd.", num);
+    return num;
+}
+
+
+/**
+ * Takes the listeners of a server on the handoff socket,
+ * and waits for that server to exit.
+ * @return 0 on success, including when no server is listening.
+ */
+static int inherit_handoff(bloom_config *config, bloom_listeners *l) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = handoff_addr(config->handoff_socket, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create the handoff socket! Err: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, addr_len)) {
+        // Nobody to take over from
+        int res = (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+        if (res) syslog(LOG_ERR, "Failed to connect to the handoff socket! Err: %s", strerror(errno));
+        close(fd);
+        return res;
+    }
+
+    char tags[HANDOFF_MAX_FDS];
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct iovec iov = {tags, sizeof(tags)};
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t num;
+    while ((num = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (num <= 0) {
+        syslog(LOG_ERR, "Failed to receive the listeners! Err: %s",
+                num ? strerror(errno) : "Closed");
+        close(fd);
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int fds[HANDOFF_MAX_FDS];
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        for (int i=0; i < count; i++) {
+            add_listener(l, i < num ? tags[i] : 0, fds[i]);
+        }
+    }
+    syslog(LOG_INFO, "Took over %d listener(s). Waiting for the previous server to exit.", (int)num);
+
+    // The connection closes once the old server has flushed and exited
+    char c;
+    ssize_t res;
+    do {
+        res = read(fd, &c, 1);
+    } while (res > 0 || (res < 0 && errno == EINTR));
+    close(fd);
+    syslog(LOG_INFO, "Previous server exited.");
+    return 0;
+}
+
+
+/**
+ * Closes an inherited inet listener if it is not bound to a port
+ */
+static void check_listener_port(int *fd, int port, const char *kind) {
+    if (*fd < 0) return;
+    if (listener_port(*fd) != port) {
+        syslog(LOG_WARNING, "Inherited %s listener is not on port %d, not using it.", kind, port);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+
+/**
+ * Returns the port an inet listener is bound to
+ * @return The port, or -1 if it is not an inet socket.
+ */
+static int listener_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET) return -1;
+    return ntohs(addr.sin_port);
+}
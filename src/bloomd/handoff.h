@@ -0,0 +1,76 @@
+#ifndef BLOOM_HANDOFF_H
+#define BLOOM_HANDOFF_H
+#include "config.h"
+
+/*
+ * Handoff of the listening sockets between processes, so that a
+ * new bloomd can take over from a running one without refusing
+ * any connection. The running process listens on handoff_socket.
+ * A new process started with the same configuration connects to
+ * it, and is sent the listeners with SCM_RIGHTS. The old process
+ * then stops accepting and shuts down as usual, flushing all the
+ * filters. The new process waits until the old one has exited
+ * before loading the filters. Clients that connect meanwhile wait
+ * in the backlog of the listeners, which stay open throughout.
+ *
+ * Listeners passed by systemd socket activation are also used.
+ */
+
+/**
+ * Listening sockets inherited from another process.
+ * A socket that was not inherited is -1.
+ */
+typedef struct {
+    int tcp_fd;
+    int udp_fd;
+    int unix_fd;
+    int priority_fd;        // TCP listener of the priority_port
+    int num_worker_fds;
+    int *worker_fds;        // Per-worker TCP listeners, with use_reuseport
+} bloom_listeners;
+
+/**
+ * Initializes a set of listeners, with none inherited.
+ * @arg l The listeners
+ */
+void init_listeners(bloom_listeners *l);
+
+/**
+ * Closes the inherited listeners that were not used,
+ * and frees the listeners.
+ * @arg l The listeners
+ */
+void close_listeners(bloom_listeners *l);
+
+/**
+ * Takes the listeners of a previous process. The listeners
+ * passed by systemd are used if there are any. Otherwise, if
+ * a handoff_socket is configured and a server is listening on
+ * it, its listeners are taken over, and this blocks until that
+ * server has exited.
+ * @arg config The configuration
+ * @arg l Output, the inherited listeners
+ * @return 0 on success, including when nothing is inherited.
+ */
+int inherit_listeners(bloom_config *config, bloom_listeners *l);
+
+/**
+ * Binds the handoff socket, so a new process can take over.
+ * A socket file left by a previous process is replaced.
+ * @arg path The path, starting with '@' for the abstract namespace
+ * @return The listening socket, or -1 on error.
+ */
+int bind_handoff_socket(char *path);
+
+/**
+ * Accepts a process taking over on the handoff socket,
+ * and sends it our listeners. The process must be of the
+ * same user. The returned connection must stay open until
+ * we exit, which tells the new process we are done.
+ * @arg handoff_fd The handoff socket
+ * @arg l The listeners to send
+ * @return The connection to the new process, or -1 on error.
+ */
+int send_listeners(int handoff_fd, bloom_listeners *l);
+
+#endif
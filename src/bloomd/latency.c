@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include "latency.h"
+#include "slowlog.h"
+
+/**
+ * The most threads that can record latencies.
+ * Threads beyond this are not timed.
+ */
+#define LATENCY_MAX_THREADS 256
+
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+
+/*
+ * The histograms of a thread. The histograms of a command
+ * are allocated the first time it is recorded, since most
+ * threads only see a few types of command.
+ */
+typedef struct {
+    latency_histogram *commands[LATENCY_COMMANDS];
+} latency_thread;
+
+/*
+ * The command being timed by a thread
+ */
+typedef struct {
+    uint64_t start;     // Start time, 0 if not timing
+    uint64_t last;      // Time of the last mark
+    uint64_t stages[LATENCY_STAGES];
+    uint32_t marked;    // Bitmask of the marked stages
+    uint32_t ticks;     // Counts commands towards the next sample
+    int sampled;        // Recorded in the histograms, not only timed for the slow log
+    int num_keys;       // Keys noted for the slow log
+    char filter_name[SLOWLOG_NAME_LEN];
+} latency_current;
+
+static const char *STAGE_NAMES[LATENCY_STAGES] = {
+    "parse", "lookup", "lock", "op", "fault", "send", "total"
+};
+
+static int sample_rate = 0;
+static latency_thread *threads[LATENCY_MAX_THREADS];
+static int num_threads = 0;
+
+static __thread latency_current current = {0, 0, {0}, 0, 0, 0, 0, {0}};
+static __thread latency_thread *thread_hists = NULL;
+static __thread int thread_untracked = 0;
+
+/*
+ * Static declarations
+ */
+static int histogram_index(uint64_t val);
+static uint64_t histogram_value(int idx);
+static void histogram_record(latency_histogram *hist, uint64_t val);
+static latency_thread* get_thread_hists();
+static latency_histogram* command_hists(int command);
+static void record_slow(int command, uint64_t total);
+
+/**
+ * Sets how often commands are timed.
+ * @arg sample One in every sample commands of each thread
+ * is timed. 0 to disable timing.
+ */
+void latency_init(int sample) {
+    sample_rate = sample;
+}
+
+/**
+ * Starts timing a command, if it is sampled.
+ */
+void latency_begin(void) {
+    int sampled = 0;
+    if (sample_rate && ++current.ticks >= (uint32_t)sample_rate) {
+        current.ticks = 0;
+        sampled = 1;
+    }
+
+    // Every command is timed while the slow log is enabled
+    if (!sampled && !slowlog_threshold()) return;
+    current.sampled = sampled;
+    current.start = current.last = latency_now();
+}
+
+/**
+ * Adds the time since the last mark to a stage
+ * of the command being timed.
+ * @arg stage The stage that just finished
+ */
+void latency_mark(latency_stage stage) {
+    if (!current.start) return;
+    uint64_t now = latency_now();
+    current.stages[stage] += now - current.last;
+    current.marked |= 1 << stage;
+    current.last = now;
+}
+
+/**
+ * Notes the filter and keys of the command being
+ * timed, for the slow log. Only the first filter is
+ * kept, but the keys of every call are counted.
+ * @arg filter_name The name of the filter
+ * @arg num_keys The number of keys
+ */
+void latency_note(const char *filter_name, int num_keys) {
+    if (!current.start) return;
+    if (!current.filter_name[0]) {
+        strncpy(current.filter_name, filter_name, SLOWLOG_NAME_LEN - 1);
+    }
+    current.num_keys += num_keys;
+}
+
+/**
+ * Finishes timing a command, and records each of
+ * the stages that were marked and the total.
+ * @arg command The type of the command, below LATENCY_COMMANDS
+ */
+void latency_end(int command) {
+    if (!current.start) return;
+    uint64_t total = latency_now() - current.start;
+
+    latency_histogram *hists = (current.sampled) ? command_hists(command) : NULL;
+    if (hists) {
+        for (int i=0; i < LATENCY_TOTAL; i++) {
+            if (current.marked & (1 << i)) histogram_record(hists + i, current.stages[i]);
+        }
+        histogram_record(hists + LATENCY_TOTAL, total);
+    }
+
+    uint64_t threshold = slowlog_threshold();
+    if (threshold && total >= threshold) record_slow(command, total);
+
+    current.start = 0;
+    current.marked = 0;
+    current.num_keys = 0;
+    current.filter_name[0] = '\0';
+    memset(current.stages, 0, sizeof(current.stages));
+}
+
+/**
+ * Records a value that was timed outside of a
+ * command. Values are always recorded, regardless
+ * of the sample rate, unless timing is disabled.
+ * @arg command The type of the command
+ * @arg stage The stage
+ * @arg nsec The value in nanoseconds
+ */
+void latency_record(int command, latency_stage stage, uint64_t nsec) {
+    if (!sample_rate) return;
+    latency_histogram *hists = command_hists(command);
+    if (hists) histogram_record(hists + stage, nsec);
+}
+
+/**
+ * Merges the histograms of every thread for a
+ * command and stage. The values being recorded are
+ * read without locks, so the result is approximate.
+ * @arg command The type of the command
+ * @arg stage The stage
+ * @arg out Output, the merged histogram
+ */
+void latency_merge(int command, latency_stage stage, latency_histogram *out) {
+    memset(out, 0, sizeof(latency_histogram));
+    if (command < 0 || command >= LATENCY_COMMANDS) return;
+
+    int num = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+    if (num > LATENCY_MAX_THREADS) num = LATENCY_MAX_THREADS;
+    for (int i=0; i < num; i++) {
+        latency_thread *t = __atomic_load_n(&threads[i], __ATOMIC_ACQUIRE);
+        if (!t) continue;
+        latency_histogram *hists = __atomic_load_n(&t->commands[command], __ATOMIC_ACQUIRE);
+        if (!hists) continue;
+
+        latency_histogram *h = hists + stage;
+        for (int j=0; j < LATENCY_BUCKETS; j++) out->counts[j] += h->counts[j];
+        out->samples += h->samples;
+        out->sum += h->sum;
+        if (h->max > out->max) out->max = h->max;
+    }
+}
+
+/**
+ * Returns a percentile of a histogram.
+ * @arg hist The histogram
+ * @arg percentile The percentile, from 0 to 1
+ * @return The value in nanoseconds, 0 if the histogram is empty.
+ */
+uint64_t latency_percentile(latency_histogram *hist, double percentile) {
+    // Sum the buckets, since the sample count may
+    // be read ahead of the bucket it was recorded in
+    uint64_t total = 0;
+    for (int i=0; i < LATENCY_BUCKETS; i++) total += hist->counts[i];
+    if (!total) return 0;
+
+    uint64_t rank = percentile * total + 0.5;
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    uint64_t seen = 0;
+    for (int i=0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t val = histogram_value(i);
+            return (val > hist->max) ? hist->max : val;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * Returns the name of a stage.
+ * @arg stage The stage
+ * @return The name
+ */
+const char* latency_stage_name(latency_stage stage) {
+    return STAGE_NAMES[stage];
+}
+
+/**
+ * Returns the monotonic time, for timing outside of commands.
+ * @return The time in nanoseconds
+ */
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Values below LATENCY_SUB_COUNT have a bucket each. Above
+ * that, each power of two is split into LATENCY_SUB_COUNT
+ * buckets, so a bucket is within 1/LATENCY_SUB_COUNT of
+ * the values recorded in it.
+ */
+static int histogram_index(uint64_t val) {
+    if (val < LATENCY_SUB_COUNT) return val;
+    int shift = 63 - __builtin_clzll(val) - LATENCY_SUB_BITS;
+    int idx = ((shift + 1) << LATENCY_SUB_BITS) + (int)((val >> shift) - LATENCY_SUB_COUNT);
+    return (idx < LATENCY_BUCKETS) ? idx : LATENCY_BUCKETS - 1;
+}
+
+// Returns the middle of the values in a bucket
+static uint64_t histogram_value(int idx) {
+    if (idx < LATENCY_SUB_COUNT) return idx;
+    int shift = (idx >> LATENCY_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)((idx & (LATENCY_SUB_COUNT - 1)) + LATENCY_SUB_COUNT) << shift;
+    return base + ((1ULL << shift) >> 1);
+}
+
+static void histogram_record(latency_histogram *hist, uint64_t val) {
+    hist->counts[histogram_index(val)]++;
+    hist->samples++;
+    hist->sum += val;
+    if (val > hist->max) hist->max = val;
+}
+
+// Returns the histograms of a command for this thread, or NULL
+static latency_histogram* command_hists(int command) {
+    latency_thread *t = get_thread_hists();
+    if (!t || command < 0 || command >= LATENCY_COMMANDS) return NULL;
+    latency_histogram *hists = t->commands[command];
+    if (!hists) {
+        hists = calloc(LATENCY_STAGES, sizeof(latency_histogram));
+        __atomic_store_n(&t->commands[command], hists, __ATOMIC_RELEASE);
+    }
+    return hists;
+}
+
+// Adds the command being timed to the slow log
+static void record_slow(int command, uint64_t total) {
+    slowlog_entry entry;
+    entry.when = time(NULL);
+    entry.command = command;
+    entry.num_keys = current.num_keys;
+    memcpy(entry.filter_name, current.filter_name, SLOWLOG_NAME_LEN);
+    memcpy(entry.stages, current.stages, sizeof(entry.stages));
+    entry.stages[LATENCY_TOTAL] = total;
+    slowlog_record(&entry);
+}
+
+// Registers the histograms of this thread on first use
+static latency_thread* get_thread_hists() {
+    if (thread_hists || thread_untracked) return thread_hists;
+    int idx = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED);
+    if (idx >= LATENCY_MAX_THREADS) {
+        syslog(LOG_WARNING, "Too many threads to record latencies!");
+        thread_untracked = 1;
+        return NULL;
+    }
+    thread_hists = calloc(1, sizeof(latency_thread));
+    __atomic_store_n(&threads[idx], thread_hists, __ATOMIC_RELEASE);
+    return thread_hists;
+}
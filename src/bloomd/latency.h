@@ -0,0 +1,133 @@
+#ifndef BLOOM_LATENCY_H
+#define BLOOM_LATENCY_H
+#include <stdint.h>
+
+/*
+ * Latency histograms of the commands, split into the
+ * stages of handling a command. Each thread records into
+ * its own histograms without locks or atomics, so timing
+ * a command only costs a few clock reads. Only one in every
+ * sample commands of each thread is timed.
+ *
+ * A timed command is started with latency_begin, and each
+ * latency_mark adds the time since the previous mark to a
+ * stage. Marks made by a thread that is not timing a command
+ * are ignored, so the filter manager can mark its stages
+ * regardless of the caller. Commands slower than the threshold
+ * of the slow log are also added to it, see slowlog.h.
+ */
+typedef enum {
+    LATENCY_PARSE = 0,  // Parsing the command and building the response
+    LATENCY_LOOKUP,     // Finding the filter by name
+    LATENCY_LOCK,       // Waiting for the filter lock
+    LATENCY_OP,         // The filter operation
+    LATENCY_FAULT,      // Faulting in the filter
+    LATENCY_SEND,       // Sending or buffering the response
+    LATENCY_TOTAL,      // The whole command
+    LATENCY_STAGES
+} latency_stage;
+
+/**
+ * The most command types that can be recorded.
+ */
+#define LATENCY_COMMANDS 64
+
+/**
+ * Command types are assigned by the caller, except for
+ * the last, which records the waits of the filter manager
+ * for the clients to pass a version before reclaiming it.
+ */
+#define LATENCY_GRACE_PERIOD (LATENCY_COMMANDS - 1)
+
+/**
+ * Histograms have 2^LATENCY_SUB_BITS buckets for each
+ * power of two of nanoseconds, and larger values are
+ * recorded in the last bucket.
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS 256
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t samples;       // Number of values recorded
+    uint64_t sum;           // Sum of the values in nanoseconds
+    uint64_t max;           // Largest value in nanoseconds
+} latency_histogram;
+
+/**
+ * Sets how often commands are timed.
+ * @arg sample One in every sample commands of each thread
+ * is timed. 0 to disable timing.
+ */
+void latency_init(int sample);
+
+/**
+ * Starts timing a command, if it is sampled.
+ */
+void latency_begin(void);
+
+/**
+ * Adds the time since the last mark to a stage
+ * of the command being timed.
+ * @arg stage The stage that just finished
+ */
+void latency_mark(latency_stage stage);
+
+/**
+ * Notes the filter and keys of the command being
+ * timed, for the slow log. Only the first filter is
+ * kept, but the keys of every call are counted.
+ * @arg filter_name The name of the filter
+ * @arg num_keys The number of keys
+ */
+void latency_note(const char *filter_name, int num_keys);
+
+/**
+ * Finishes timing a command, and records each of
+ * the stages that were marked and the total.
+ * @arg command The type of the command, below LATENCY_COMMANDS
+ */
+void latency_end(int command);
+
+/**
+ * Records a value that was timed outside of a
+ * command. Values are always recorded, regardless
+ * of the sample rate, unless timing is disabled.
+ * @arg command The type of the command
+ * @arg stage The stage
+ * @arg nsec The value in nanoseconds
+ */
+void latency_record(int command, latency_stage stage, uint64_t nsec);
+
+/**
+ * Merges the histograms of every thread for a
+ * command and stage. The values being recorded are
+ * read without locks, so the result is approximate.
+ * @arg command The type of the command
+ * @arg stage The stage
+ * @arg out Output, the merged histogram
+ */
+void latency_merge(int command, latency_stage stage, latency_histogram *out);
+
+/**
+ * Returns a percentile of a histogram.
+ * @arg hist The histogram
+ * @arg percentile The percentile, from 0 to 1
+ * @return The value in nanoseconds, 0 if the histogram is empty.
+ */
+uint64_t latency_percentile(latency_histogram *hist, double percentile);
+
+/**
+ * Returns the monotonic time, for timing outside of commands.
+ * @return The time in nanoseconds
+ */
+uint64_t latency_now(void);
+
+/**
+ * Returns the name of a stage.
+ * @arg stage The stage
+ * @return The name
+ */
+const char* latency_stage_name(latency_stage stage);
+
+#endif
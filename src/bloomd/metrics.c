@@ -0,0 +1,450 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "filter.h"
+
+/**
+ * How long the metrics thread waits for a
+ * request before checking if it should exit,
+ * in milliseconds.
+ */
+#define METRICS_POLL_MSEC 250
+
+/**
+ * How long a scrape has to send its request
+ * and read the response, in seconds.
+ */
+#define METRICS_IO_TIMEOUT_SEC 1
+
+/**
+ * Largest request we read, the remainder is ignored
+ */
+#define METRICS_MAX_REQUEST 2048
+
+/*
+* After how many filters should we force a client
+* checkpoint while rendering, so the vacuum thread
+* can make progress with many filters.
+*/
+#define PERIODIC_CHECKPOINT 16
+
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    int listen_fd;
+} metrics_thread_args;
+
+/*
+ * A growable output buffer
+ */
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+} metrics_buf;
+
+/*
+ * The metrics of each filter. The values are indexed by
+ * filter_metric, and described by FILTER_METRICS.
+ */
+typedef enum {
+    FILTER_CAPACITY = 0,
+    FILTER_SIZE,
+    FILTER_STORAGE,
+    FILTER_IN_MEMORY,
+    FILTER_CHECK_HITS,
+    FILTER_CHECK_MISSES,
+    FILTER_SET_HITS,
+    FILTER_SET_MISSES,
+    FILTER_PAGE_INS,
+    FILTER_PAGE_OUTS,
+    FILTER_LOCK_WAITS,
+    FILTER_LOCK_WAIT_NSEC,
+    FILTER_FAULT_NSEC,
+    FILTER_CHECKSUM_ERRORS,
+    FILTER_RESIDENT,
+    FILTER_PINNED,
+    FILTER_METRICS_NUM
+} filter_metric;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    int nsec;           // Is the value in nanoseconds, reported in seconds
+} metric_desc;
+
+static const metric_desc FILTER_METRICS[FILTER_METRICS_NUM] = {
+    {"bloomd_filter_capacity", "gauge", "Keys the filter holds before it grows", 0},
+    {"bloomd_filter_size", "gauge", "Keys set in the filter", 0},
+    {"bloomd_filter_storage_bytes", "gauge", "Bytes used by the filter", 0},
+    {"bloomd_filter_in_memory", "gauge", "Is the filter mapped into memory", 0},
+    {"bloomd_filter_check_hits_total", "counter", "Checks of keys that were found", 0},
+    {"bloomd_filter_check_misses_total", "counter", "Checks of keys that were not found", 0},
+    {"bloomd_filter_set_hits_total", "counter", "Sets of keys that were added", 0},
+    {"bloomd_filter_set_misses_total", "counter", "Sets of keys that were already set", 0},
+    {"bloomd_filter_page_ins_total", "counter", "Times the filter was faulted in", 0},
+    {"bloomd_filter_page_outs_total", "counter", "Times the filter was unmapped", 0},
+    {"bloomd_filter_lock_waits_total", "counter", "Commands that waited for the filter lock", 0},
+    {"bloomd_filter_lock_wait_seconds_total", "counter", "Time spent waiting for the filter lock", 1},
+    {"bloomd_filter_fault_seconds_total", "counter", "Time spent faulting the filter in", 1},
+    {"bloomd_filter_checksum_errors_total", "counter", "Pages that did not match their checksums", 0},
+    {"bloomd_filter_resident_bytes", "gauge", "Bytes of the filter in memory, as of the last residency scan", 0},
+    {"bloomd_filter_pinned_bytes", "gauge", "Bytes of the filter locked in memory, if it is pinned", 0},
+};
+
+typedef struct {
+    char *name;
+    uint64_t values[FILTER_METRICS_NUM];
+} filter_snapshot;
+
+/*
+ * The filters collected for a render
+ */
+typedef struct {
+    filter_snapshot *filters;
+    int num;
+    int size;
+} filter_snapshots;
+
+/*
+ * Static declarations
+ */
+static void buf_printf(metrics_buf *buf, const char *fmt, ...);
+static void buf_label(metrics_buf *buf, const char *value);
+static void collect_filter_cb(void *data, char *filter_name, bloom_filter *filter);
+static int bind_metrics_listener(bloom_config *config, int *fd_out);
+static void serve_metrics(int fd, char *body, int body_len);
+static int send_all(int fd, char *buf, int len);
+static uint64_t monotonic_sec(void);
+static void* metrics_thread_main(void *in);
+
+/**
+ * Renders the metrics of the server and of each filter
+ * in the Prometheus text format. This reads every filter,
+ * so it is only called by the metrics thread to refresh
+ * its snapshot, and never for a request.
+ * @arg mgr The filter manager
+ * @arg out Output, the rendered metrics. Must be freed.
+ * @arg len Output, the length of the rendered metrics
+ * @return 0 on success.
+ */
+int metrics_render(bloom_filtmgr *mgr, char **out, int *len) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    if (res != 0) return res;
+
+    // Read each filter once, they may be dropped as we go
+    filter_snapshots snaps = {NULL, 0, 0};
+    unsigned int cmds = 0;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        if (snaps.num == snaps.size) {
+            snaps.size = snaps.size ? snaps.size * 2 : 64;
+            snaps.filters = realloc(snaps.filters, snaps.size * sizeof(filter_snapshot));
+        }
+        filtmgr_filter_cb(mgr, node->filter_name, collect_filter_cb, &snaps);
+        if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+    }
+    filtmgr_cleanup_list(head);
+
+    // Server totals
+    uint64_t in_memory = 0, storage = 0, pinned = 0;
+    for (int i=0; i < snaps.num; i++) {
+        in_memory += snaps.filters[i].values[FILTER_IN_MEMORY];
+        storage += snaps.filters[i].values[FILTER_STORAGE];
+        pinned += snaps.filters[i].values[FILTER_PINNED];
+    }
+
+    metrics_buf buf = {NULL, 0, 0};
+    buf_printf(&buf, "# HELP bloomd_filters Filters that exist\n"
+            "# TYPE bloomd_filters gauge\nbloomd_filters %d\n", snaps.num);
+    buf_printf(&buf, "# HELP bloomd_filters_in_memory Filters mapped into memory\n"
+            "# TYPE bloomd_filters_in_memory gauge\nbloomd_filters_in_memory %llu\n",
+            (unsigned long long)in_memory);
+    buf_printf(&buf, "# HELP bloomd_storage_bytes Bytes used by all the filters\n"
+            "# TYPE bloomd_storage_bytes gauge\nbloomd_storage_bytes %llu\n",
+            (unsigned long long)storage);
+    buf_printf(&buf, "# HELP bloomd_pinned_bytes Bytes of the pinned filters locked in memory\n"
+            "# TYPE bloomd_pinned_bytes gauge\nbloomd_pinned_bytes %llu\n",
+            (unsigned long long)pinned);
+
+    // Each metric is written for every filter before the next
+    for (int m=0; m < FILTER_METRICS_NUM; m++) {
+        const metric_desc *desc = FILTER_METRICS + m;
+        buf_printf(&buf, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, desc->type);
+        for (int i=0; i < snaps.num; i++) {
+            buf_printf(&buf, "%s{filter=\"", desc->name);
+            buf_label(&buf, snaps.filters[i].name);
+            uint64_t val = snaps.filters[i].values[m];
+            if (desc->nsec)
+                buf_printf(&buf, "\"} %.6f\n", val / 1e9);
+            else
+                buf_printf(&buf, "\"} %llu\n", (unsigned long long)val);
+        }
+    }
+
+    for (int i=0; i < snaps.num; i++) free(snaps.filters[i].name);
+    free(snaps.filters);
+
+    // Time the render, so an expensive snapshot is visible
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    buf_printf(&buf, "# HELP bloomd_metrics_render_seconds Time spent rendering these metrics\n"
+            "# TYPE bloomd_metrics_render_seconds gauge\nbloomd_metrics_render_seconds %.6f\n", elapsed);
+
+    *out = buf.buf;
+    *len = buf.len;
+    return 0;
+}
+
+/**
+ * Starts a metrics thread, which serves the metrics over
+ * HTTP on the metrics port. The metrics are rendered into
+ * a snapshot every metrics interval, and requests are served
+ * from the snapshot, so scraping never touches the filters
+ * or takes time from the workers.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_metrics_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not serving metrics
+    if (config->metrics_port <= 0) return 0;
+
+    int fd;
+    if (bind_metrics_listener(config, &fd)) return 0;
+
+    metrics_thread_args *args = malloc(sizeof(metrics_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->should_run = should_run;
+    args->listen_fd = fd;
+    pthread_create(t, NULL, metrics_thread_main, args);
+    return 1;
+}
+
+// Appends formatted output, growing the buffer as needed
+static void buf_printf(metrics_buf *buf, const char *fmt, ...) {
+    va_list args;
+    while (1) {
+        int avail = buf->size - buf->len;
+        va_start(args, fmt);
+        int n = vsnprintf(buf->buf + buf->len, avail, fmt, args);
+        va_end(args);
+        if (n < avail) {
+            buf->len += n;
+            return;
+        }
+        buf->size = (buf->size + n + 1) * 2;
+        buf->buf = realloc(buf->buf, buf->size);
+    }
+}
+
+// Appends a label value, escaped as the text format requires
+static void buf_label(metrics_buf *buf, const char *value) {
+    for (const char *c = value; *c; c++) {
+        if (*c == '\\') buf_printf(buf, "\\\\");
+        else if (*c == '"') buf_printf(buf, "\\\"");
+        else if (*c == '\n') buf_printf(buf, "\\n");
+        else buf_printf(buf, "%c", *c);
+    }
+}
+
+// Reads the metrics of a filter into the next snapshot
+static void collect_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    filter_snapshots *snaps = data;
+    filter_snapshot *snap = snaps->filters + snaps->num++;
+    snap->name = strdup(filter_name);
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    filter_meta meta;
+    bloomf_meta(filter, &meta);
+    uint64_t *v = snap->values;
+    v[FILTER_CAPACITY] = meta.capacity;
+    v[FILTER_SIZE] = meta.size;
+    v[FILTER_STORAGE] = meta.bytes;
+    v[FILTER_IN_MEMORY] = bloomf_is_proxied(filter) ? 0 : 1;
+    v[FILTER_CHECK_HITS] = counters.check_hits;
+    v[FILTER_CHECK_MISSES] = counters.check_misses;
+    v[FILTER_SET_HITS] = counters.set_hits;
+    v[FILTER_SET_MISSES] = counters.set_misses;
+    v[FILTER_PAGE_INS] = counters.page_ins;
+    v[FILTER_PAGE_OUTS] = counters.page_outs;
+    v[FILTER_LOCK_WAITS] = counters.lock_waits;
+    v[FILTER_LOCK_WAIT_NSEC] = counters.lock_wait_nsec;
+    v[FILTER_FAULT_NSEC] = counters.fault_nsec;
+    v[FILTER_CHECKSUM_ERRORS] = counters.checksum_errors;
+
+    filter_residency residency;
+    bloomf_residency(filter, &residency);
+    v[FILTER_RESIDENT] = residency.resident;
+    v[FILTER_PINNED] = (filter->filter_config.pinned && v[FILTER_IN_MEMORY]) ? meta.bytes : 0;
+}
+
+/**
+ * Creates the non-blocking listening socket for the metrics
+ * @arg config The configuration
+ * @arg fd_out Output, the listening socket
+ * @return 0 on success.
+ */
+static int bind_metrics_listener(bloom_config *config, int *fd_out) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(config->metrics_port);
+    if (inet_pton(AF_INET, config->bind_address, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", config->bind_address);
+        return 1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    int sock_flags = fcntl(fd, F_GETFL, 0);
+    if (sock_flags < 0 || fcntl(fd, F_SETFL, sock_flags | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on metrics socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on metrics socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (listen(fd, 16) != 0) {
+        syslog(LOG_ERR, "Failed to listen on metrics socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    *fd_out = fd;
+    return 0;
+
+ERROR:
+    close(fd);
+    return 1;
+}
+
+/**
+ * Answers a scrape with the current snapshot. Only
+ * GET of / or /metrics is served, anything else is
+ * answered with a 404.
+ * @arg fd The accepted connection, closed when done
+ * @arg body The snapshot
+ * @arg body_len The length of the snapshot
+ */
+static void serve_metrics(int fd, char *body, int body_len) {
+    // The listener is non-blocking, but the scrape is served blocking
+    int sock_flags = fcntl(fd, F_GETFL, 0);
+    if (sock_flags >= 0) fcntl(fd, F_SETFL, sock_flags & ~O_NONBLOCK);
+    struct timeval tv = {METRICS_IO_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Read until the end of the request headers
+    char req[METRICS_MAX_REQUEST + 1];
+    int len = 0;
+    while (len < METRICS_MAX_REQUEST) {
+        int n = recv(fd, req + len, METRICS_MAX_REQUEST - len, 0);
+        if (n <= 0) break;
+        len += n;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    req[len] = 0;
+
+    char header[256];
+    int found = !strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6);
+    if (!found) {
+        body = "Not Found\n";
+        body_len = 10;
+    }
+    int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n",
+            found ? "200 OK" : "404 Not Found", body_len);
+    if (!send_all(fd, header, header_len)) send_all(fd, body, body_len);
+    close(fd);
+}
+
+// Sends the whole buffer, returns 0 on success
+static int send_all(int fd, char *buf, int len) {
+    while (len > 0) {
+        int n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t monotonic_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void* metrics_thread_main(void *in) {
+    metrics_thread_args *args = in;
+    bloom_config *config = args->config;
+    bloom_filtmgr *mgr = args->mgr;
+    int *should_run = args->should_run;
+    int listen_fd = args->listen_fd;
+    free(args);
+
+    syslog(LOG_INFO, "Metrics thread started. Port: %d. Interval: %d sec.",
+            config->metrics_port, config->metrics_interval);
+
+    char *snapshot = NULL;
+    int snapshot_len = 0;
+    uint64_t next_render = 0;
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (*should_run) {
+        // Refresh the snapshot each interval
+        uint64_t now = monotonic_sec();
+        if (now >= next_render) {
+            char *out;
+            int out_len;
+            filtmgr_client_checkpoint(mgr);
+            if (!metrics_render(mgr, &out, &out_len)) {
+                free(snapshot);
+                snapshot = out;
+                snapshot_len = out_len;
+            }
+            filtmgr_client_offline(mgr);
+            next_render = now + config->metrics_interval;
+        }
+
+        // Serve the scrapes that arrive in the mean time
+        if (poll(&pfd, 1, METRICS_POLL_MSEC) <= 0) continue;
+        int fd;
+        while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+            serve_metrics(fd, snapshot ? snapshot : "", snapshot_len);
+        }
+    }
+
+    close(listen_fd);
+    free(snapshot);
+    return NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef BLOOM_METRICS_H
+#define BLOOM_METRICS_H
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+
+/**
+ * Renders the metrics of the server and of each filter
+ * in the Prometheus text format. This reads every filter,
+ * so it is only called by the metrics thread to refresh
+ * its snapshot, and never for a request.
+ * @arg mgr The filter manager
+ * @arg out Output, the rendered metrics. Must be freed.
+ * @arg len Output, the length of the rendered metrics
+ * @return 0 on success.
+ */
+int metrics_render(bloom_filtmgr *mgr, char **out, int *len);
+
+/**
+ * Starts a metrics thread, which serves the metrics over
+ * HTTP on the metrics port. The metrics are rendered into
+ * a snapshot every metrics interval, and requests are served
+ * from the snapshot, so scraping never touches the filters
+ * or takes time from the workers.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_metrics_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+#endif
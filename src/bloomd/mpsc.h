@@ -0,0 +1,65 @@
+#ifndef BLOOM_MPSC_H
+#define BLOOM_MPSC_H
+#include <stddef.h>
+
+/*
+ * A lock-free queue with many producers and a single consumer.
+ * Producers push nodes onto a stack with a compare and swap, and
+ * the consumer takes the whole stack with a single exchange, which
+ * it reverses to get the nodes in the order they were pushed.
+ * Since the consumer never takes single nodes, there is no ABA
+ * problem. Nodes are embedded in the structures they pass, so
+ * pushing does not allocate.
+ */
+typedef struct bloom_mpsc_node {
+    struct bloom_mpsc_node *next;
+} bloom_mpsc_node;
+
+typedef struct {
+    bloom_mpsc_node *head;  // The last node pushed, atomic
+} bloom_mpsc;
+
+/**
+ * Initializes a queue
+ * @arg q The queue
+ */
+static inline void mpsc_init(bloom_mpsc *q) {
+    q->head = NULL;
+}
+
+/**
+ * Pushes a node. Safe to call from any thread.
+ * @arg q The queue
+ * @arg node The node, owned by the queue until taken
+ * @return 1 if the queue was empty.
+ */
+static inline int mpsc_push(bloom_mpsc *q, bloom_mpsc_node *node) {
+    bloom_mpsc_node *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&q->head, &head, node, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+/**
+ * Takes every node of a queue. Must only be
+ * called from the consumer thread.
+ * @arg q The queue
+ * @return The nodes in the order they were pushed,
+ * linked by next, or NULL if the queue is empty.
+ */
+static inline bloom_mpsc_node* mpsc_take(bloom_mpsc *q) {
+    if (!__atomic_load_n(&q->head, __ATOMIC_RELAXED)) return NULL;
+    bloom_mpsc_node *node = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+    bloom_mpsc_node *prev = NULL;
+    while (node) {
+        bloom_mpsc_node *next = node->next;
+        node->next = prev;
+        prev = node;
+        node = next;
+    }
+    return prev;
+}
+
+#endif
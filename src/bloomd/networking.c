@@ -18,41 +18,53 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stddef.h>
 #include <math.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "conn_handler.h"
 #include "spinlock.h"
 #include "barrier.h"
+#include "uring.h"
+#include "latency.h"
+#include "executor.h"
+#include "mpsc.h"
+#include "tls.h"
 
 
 /**
- * Default listen backlog size for
- * our TCP listener.
+ * How big the connection buffers start out, from
+ * conn_buf_kb. One page seems reasonable since most
+ * requests will not be this large. Set once by
+ * init_networking, before any connection exists.
  */
-#define BACKLOG_SIZE 64
+static uint32_t init_conn_buf_size = 4096;
 
 /**
- * How big should the default connection
- * buffer size be. One page seems reasonable
- * since most requests will not be this large
+ * This is the scale factor we use when
+ * we are growing our connection buffers, from
+ * conn_buf_multiplier. We want this to be aggressive
+ * enough to reduce the number of resizes, but to also
+ * avoid wasted space. With the default, we will go from:
+ * 4K -> 32K -> 256K -> 2MB -> 16MB
  */
-#define INIT_CONN_BUF_SIZE 4096
+static uint32_t conn_buf_multiplier = 8;
 
 /**
- * This is the scale factor we use when
- * we are growing our connection buffers.
- * We want this to be aggressive enough to reduce
- * the number of resizes, but to also avoid wasted
- * space. With this, we will go from:
- * 4K -> 32K -> 256K -> 2MB -> 16MB
+ * Responses to the commands handled from a single read
+ * are collected in the output buffer and sent with one writev.
+ * Once this many bytes are pending, they are sent early, so that
+ * large bulk responses do not need to be fully buffered.
  */
-#define CONN_BUF_MULTIPLIER 8
+#define BATCH_FLUSH_SIZE 65536
 
 
 /**
@@ -63,6 +75,63 @@
  */
 #define PERIODIC_TIME_SEC 0.25
 
+/**
+ * Each connection counts as this many bytes of
+ * recent input when comparing the load of the workers.
+ * This spreads idle clients evenly, while letting
+ * bulk loading clients dominate the comparison.
+ */
+#define CONN_LOAD_WEIGHT 4096
+
+/**
+ * A connection is idle if it has not sent data for
+ * this many periodic ticks. Idle connections can be
+ * migrated to a less loaded worker when they wake up.
+ */
+#define IDLE_TICKS 4
+
+/**
+ * A waking connection is only migrated if its worker
+ * is at least twice as loaded as the least loaded worker,
+ * and the difference exceeds this load. This avoids migrating
+ * connections between workers that are both lightly used.
+ */
+#define MIGRATE_MIN_LOAD (64 * 1024)
+
+/**
+ * The size of the submission queue of the io_uring
+ * used by each worker, with use_io_uring. The queue is
+ * submitted early if it fills up.
+ */
+#define URING_ENTRIES 1024
+
+/**
+ * The number of datagrams we try to read
+ * from the UDP socket per system call.
+ */
+#define UDP_BATCH_SIZE 16
+
+/**
+ * The largest datagram we accept. Anything
+ * larger is truncated by the kernel and dropped.
+ */
+#define UDP_MESG_SIZE 65536
+
+/**
+ * The size of the arena of each worker, which holds the
+ * transient allocations of the commands of a batch. A
+ * list command alone builds batches of 64K.
+ */
+#define WORKER_ARENA_SIZE (256 * 1024)
+
+/**
+ * The most closed connections each worker keeps
+ * for reuse. Pooled connections keep their buffers,
+ * so clients that connect per request avoid the
+ * allocations and page faults of new buffers.
+ */
+#define CONN_POOL_SIZE 256
+
 
 /**
  * Stores the worker thread specific user data.
@@ -71,11 +140,72 @@ typedef struct conn_info conn_info;
 typedef struct {
     bloom_networking *netconf;
     ev_loop *loop;
-    int pipefd[2];
-    ev_io pipe_client;
+
+    // Messages from other threads, such as new connections
+    // and the connections handed back by the executor. The
+    // async watcher wakes the worker, and coalesces wake ups.
+    bloom_mpsc messages;
+    ev_async message_async;
+    int quit;               // Set to ask the worker to exit, atomic
+    int wake_parked;        // Set once filters are faulted in, atomic
+    ev_io tcp_client;       // Only used with use_reuseport
+    ev_io udp_client;
     ev_timer periodic;
     int should_run;
 
+    // Ring used for client IO with use_io_uring, or NULL
+    bloom_uring *ring;
+    ev_io ring_client;
+
+    // Receive buffers for UDP datagrams, allocated on first use
+    char *udp_bufs;
+
+    // Transient allocations of the commands being handled,
+    // reset after each batch
+    bloom_arena *arena;
+
+    // Closed connections kept for reuse. Accepting threads
+    // take from the pool, so it is protected by pool_lock.
+    bloom_spinlock pool_lock;
+    conn_info *pool;
+    int pool_size;
+
+    // Load tracking. The connection count and load
+    // are read by other threads to balance clients.
+    int conns;              // Active connections, atomic
+    uint64_t load;          // Smoothed bytes read per tick, atomic
+    uint64_t tick_bytes;    // Bytes read in the current tick
+    uint64_t ticks;         // Number of periodic ticks
+
+    // Time of the last client event, used to busy poll
+    ev_tstamp last_active;
+
+    // Connections that spent their command budget with input
+    // left, handled again before the next wait for events.
+    // The idle watcher keeps the loop from blocking meanwhile.
+    conn_info *ready_head;
+    conn_info *ready_tail;
+    int num_ready;          // Connections in the ready queue
+    ev_prepare ready_prepare;
+    ev_idle ready_idle;
+
+    // With exec_threads, the connections whose commands are
+    // run by the executor are handed back as messages. Our
+    // index picks the queue of the executor.
+    unsigned index;
+    int offloaded;          // Connections on the executor, atomic
+
+    // Serves the clients of the priority_port, which are
+    // not balanced with or offloaded like the others
+    int priority;
+
+    // Connections parked until the fault thread has faulted in filters
+    conn_info *parked;
+
+    // Every connection scheduled on the worker, so the
+    // grown buffers of idle connections can be shrunk
+    conn_info *conns_list;
+
     // Used to free inactive connections
     conn_info *inactive;
 } worker_ev_userdata;
@@ -88,6 +218,7 @@ typedef struct {
     int read_cursor;
     uint32_t buf_size;
     char *buffer;
+    int mirrored;   // Buffer is mapped twice, back to back
 } circular_buffer;
 
 /**
@@ -108,21 +239,62 @@ typedef struct {
  * allows us to minimize copies and latency for most
  * clients, while still supporting the massive bulk
  * loads.
+ *
+ * While the commands from a read are being handled,
+ * batch_output is set and responses are also buffered.
+ * The batch is then flushed with a single write, so
+ * pipelined commands do not cost a write each.
  */
 struct conn_info {
     worker_ev_userdata *thread_ev;
     int active;
+    uint64_t last_tick;     // Tick of the last read, for idle detection
+    void *handler_state;    // Owned by the connection handlers
+    struct iovec uring_iov[2];  // Vectors of the operation in flight
 
     ev_io client;
     circular_buffer input;
 
     int use_write_buf;
+    int batch_output;
     ev_io write_client;
     circular_buffer output;
 
     struct conn_info *next;
+    int ready;                      // Queued to handle the rest of its input
+    struct conn_info *next_ready;   // Next in the ready queue
+
+    // While offloaded, the commands are run by the executor,
+    // and the worker does not touch the connection. The arena
+    // of the executor thread is used instead of the worker's.
+    bloom_job job;
+    int offloaded;
+    int exec_res;                   // Result of the handler
+    int exec_failed;                // A response could not be buffered
+    bloom_arena *arena;
+
+    int parked;                     // Waiting on a filter to be faulted in
+    struct conn_info *next_parked;
+
+    // Passes the connection to its worker from other threads
+    bloom_mpsc_node message;
+    int message_type;               // A conn_message
+    int is_tcp;                     // Not a unix socket, takes the TCP options
+    bloom_tls_conn *tls;            // NULL unless the client uses TLS
+
+    // Links the connections of the worker
+    struct conn_info *prev_conn;
+    struct conn_info *next_conn;
 };
 
+/**
+ * The messages a worker receives about a connection
+ */
+typedef enum {
+    CONN_ACCEPT = 0,    // Start handling a new or migrated connection
+    CONN_EXEC_DONE,     // The executor handled its commands
+} conn_message;
+
 
 /**
  * Defines a structure that is
@@ -132,27 +304,82 @@ struct conn_info {
 struct bloom_networking {
     bloom_config *config;
     bloom_filtmgr *mgr;
+    bloom_cluster *cluster;
 
     int ev_mode;
     ev_loop *default_loop;
     ev_io tcp_client;
-    ev_io udp_client;
+    int *worker_tcp_fds;    // Per-worker listeners, with use_reuseport
+    int udp_listener_fd;
+    ev_io unix_client;      // Only used with unix_socket
+    ev_io priority_client;  // Only used with priority_port
+    bloom_tls *tls;         // TLS of the TCP clients, with tls_cert_file
+
+    // Runs the reload hook on the main loop, once asked to
+    ev_async reload_async;
+    reload_hook reload;
+    void *reload_arg;
+
+    // A new process takes over the listeners, with handoff_socket
+    ev_io handoff_client;
+    int handoff_peer;       // Open until we exit, once handed off
+    int *should_run;
+
+    // Runs the commands of the clients, with exec_threads.
+    // Each thread of the executor has its own arena.
+    bloom_executor *exec;
+    bloom_arena **exec_arenas;
 
     barrier_t thread_barrier;
     pthread_t *threads; // Reference to all the workers
     worker_ev_userdata **workers;
-    unsigned last_assign;    // Last thread we assigned to
+    int num_workers;    // The worker_threads, then the priority_workers
+    unsigned last_assign;    // Last thread we assigned to, breaks ties
 };
 
 
 // Static typedefs
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_new_worker_client(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_reload(ev_loop *lp, ev_async *watcher, int ready_events);
+static void handle_handoff(ev_loop *lp, ev_io *watcher, int ready_events);
 static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_ready_conns(ev_loop *lp, ev_prepare *watcher, int ready_events);
+static void handle_ready_idle(ev_loop *lp, ev_idle *watcher, int ready_events);
+static void handle_conn_input(worker_ev_userdata *data, conn_info *conn);
+static void queue_ready_conn(worker_ev_userdata *data, conn_info *conn);
+static void dequeue_ready_conn(worker_ev_userdata *data, conn_info *conn);
+static void offload_conn(worker_ev_userdata *data, conn_info *conn);
+static void run_conn_job(bloom_job *job, int thread);
+static void handle_exec_done(worker_ev_userdata *data, conn_info *conn);
+static void handle_exec_idle(void *arg, int thread);
+static void handle_exec_leave(void *arg, int thread);
+static void park_conn(worker_ev_userdata *data, conn_info *conn);
+static void unpark_conn(worker_ev_userdata *data, conn_info *conn);
+static void handle_parked_conns(worker_ev_userdata *data);
+static void wake_parked_conns(void *arg);
+static void resume_conn(worker_ev_userdata *data, conn_info *conn);
+static int init_executor_pool(bloom_networking *netconf);
+static void destroy_executor_pool(bloom_networking *netconf);
 static int read_client_data(conn_info *conn);
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
+static void flush_client_output(conn_info *conn);
+static void handle_uring_completions(ev_loop *lp, ev_io *watcher, int ready_events);
+static void uring_read_conn(conn_info *conn);
+static void uring_write_conn(conn_info *conn);
+static void handle_worker_messages(ev_loop *lp, ev_async *watcher, int ready_events);
+static void send_conn_message(worker_ev_userdata *data, conn_info *conn, int type);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void link_conn(worker_ev_userdata *data, conn_info *conn);
+static void unlink_conn(worker_ev_userdata *data, conn_info *conn);
+static void shrink_idle_conns(worker_ev_userdata *data);
+static void rearm_quickack(conn_info *conn);
+static void continue_tls_handshake(conn_info *conn);
+static ssize_t conn_readv(conn_info *conn, struct iovec *vectors, int num_vectors);
+static ssize_t conn_writev(conn_info *conn, struct iovec *vectors, int num_vectors);
+static void handle_worker_release(ev_loop *lp);
+static void handle_worker_acquire(ev_loop *lp);
 
 static void close_client_connection(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
@@ -163,15 +390,26 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 
 
 // Utility methods
-static int set_client_sockopts(int client_fd);
-static conn_info* get_conn();
+static worker_ev_userdata* least_loaded_worker(bloom_networking *netconf, int priority, uint64_t *load_out);
+static uint64_t worker_load(worker_ev_userdata *data);
+static void schedule_conn(worker_ev_userdata *data, conn_info *conn);
+static void dispatch_conn(worker_ev_userdata *data, conn_info *conn);
+static int set_client_sockopts(bloom_config *config, int client_fd, int is_tcp);
+static conn_info* get_conn(worker_ev_userdata *data);
+static void put_conn(conn_info *conn);
+static conn_info* accept_client(int listen_fd, worker_ev_userdata *data);
+static char* copy_input(conn_info *conn, int len, int *should_free);
 
 
 // Circular buffer method
 static void circbuf_init(circular_buffer *buf);
+static void circbuf_init_mirrored(circular_buffer *buf);
+static char* circbuf_map_mirror(uint32_t size);
 static void circbuf_free(circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
+static uint64_t circbuf_used_buf(circular_buffer *buf);
 static void circbuf_grow_buf(circular_buffer *buf);
+static void circbuf_shrink_buf(circular_buffer *buf, int mirrored);
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_setup_writev_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes);
@@ -179,17 +417,21 @@ static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes);
 static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
 
 /**
- * Initializes the TCP listener
+ * Creates a listening TCP socket
  * @arg netconf The network configuration
+ * @arg port The port to listen on
+ * @arg reuseport Should SO_REUSEPORT be set, so that many
+ * sockets can listen on the same port.
+ * @arg fd_out Output, the listening socket
  * @return 0 on success.
  */
-static int setup_tcp_listener(bloom_networking *netconf) {
+static int bind_tcp_listener(bloom_networking *netconf, int port, int reuseport, int *fd_out) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
     bzero(&bind_addr, sizeof(bind_addr));
     addr.sin_family = PF_INET;
-    addr.sin_port = htons(netconf->config->tcp_port);
+    addr.sin_port = htons(port);
 
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
@@ -207,30 +449,243 @@ static int setup_tcp_listener(bloom_networking *netconf) {
         close(tcp_listener_fd);
         return 1;
     }
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(tcp_listener_fd, SOL_SOCKET,
+                SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        close(tcp_listener_fd);
+        return 1;
+    }
+#endif
+
+    // A worker must never block in accept() on its own listener
+    int sock_flags = fcntl(tcp_listener_fd, F_GETFL, 0);
+    if (reuseport && (sock_flags < 0 ||
+                fcntl(tcp_listener_fd, F_SETFL, sock_flags | O_NONBLOCK))) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on TCP socket! Err: %s", strerror(errno));
+        close(tcp_listener_fd);
+        return 1;
+    }
     if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
         return 1;
     }
-    if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
+
+    /*
+     * Accepted sockets inherit the buffer sizes of the listener.
+     * They are set before the listen, since the window scale is
+     * picked from the receive buffer during the handshake.
+     */
+    bloom_config *config = netconf->config;
+    int bufsize;
+    if (config->tcp_sndbuf_kb) {
+        bufsize = config->tcp_sndbuf_kb * 1024;
+        if (setsockopt(tcp_listener_fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)))
+            syslog(LOG_WARNING, "Failed to set SO_SNDBUF on TCP socket! Err: %s", strerror(errno));
+    }
+    if (config->tcp_rcvbuf_kb) {
+        bufsize = config->tcp_rcvbuf_kb * 1024;
+        if (setsockopt(tcp_listener_fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)))
+            syslog(LOG_WARNING, "Failed to set SO_RCVBUF on TCP socket! Err: %s", strerror(errno));
+    }
+
+    // Only wake for clients once they have sent a request
+#ifdef TCP_DEFER_ACCEPT
+    if (config->tcp_defer_accept && setsockopt(tcp_listener_fd, IPPROTO_TCP,
+                TCP_DEFER_ACCEPT, &config->tcp_defer_accept, sizeof(int))) {
+        syslog(LOG_WARNING, "Failed to set TCP_DEFER_ACCEPT on TCP socket! Err: %s", strerror(errno));
+    }
+#endif
+
+    if (listen(tcp_listener_fd, config->tcp_backlog) != 0) {
         syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
         return 1;
     }
 
-    // Create the libev objects
-    ev_io_init(&netconf->tcp_client, handle_new_client,
-                tcp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->tcp_client);
+    *fd_out = tcp_listener_fd;
+    return 0;
+}
+
+/**
+ * Initializes the TCP listener. With use_reuseport, a
+ * listener is created for each worker, which are started
+ * by the workers. Otherwise, a single listener is used by
+ * the main loop.
+ * @arg netconf The network configuration
+ * @arg inherited Listeners taken from a previous process
+ * @return 0 on success.
+ */
+static int setup_tcp_listener(bloom_networking *netconf, bloom_listeners *inherited) {
+    int tcp_listener_fd;
+    if (!netconf->config->use_reuseport) {
+        if (inherited->tcp_fd >= 0) {
+            tcp_listener_fd = inherited->tcp_fd;
+            inherited->tcp_fd = -1;
+        } else if (bind_tcp_listener(netconf, netconf->config->tcp_port, 0, &tcp_listener_fd)) {
+            return 1;
+        }
+
+        // Create the libev objects
+        ev_io_init(&netconf->tcp_client, handle_new_client,
+                    tcp_listener_fd, EV_READ);
+        ev_io_start(netconf->default_loop, &netconf->tcp_client);
+        return 0;
+    }
+
+    // Bind all the listeners now, so that failures are fatal at startup
+    int workers = netconf->config->worker_threads;
+    netconf->worker_tcp_fds = calloc(workers, sizeof(int));
+    if (!netconf->worker_tcp_fds) return 1;
+    for (int i=0; i < workers; i++) {
+        if (i < inherited->num_worker_fds && inherited->worker_fds[i] >= 0) {
+            netconf->worker_tcp_fds[i] = inherited->worker_fds[i];
+            inherited->worker_fds[i] = -1;
+            continue;
+        }
+        if (bind_tcp_listener(netconf, netconf->config->tcp_port, 1, netconf->worker_tcp_fds + i)) {
+            for (int j=0; j < i; j++) close(netconf->worker_tcp_fds[j]);
+            free(netconf->worker_tcp_fds);
+            netconf->worker_tcp_fds = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Closes the TCP listeners
+ * @arg netconf The network configuration
+ */
+static void close_tcp_listener(bloom_networking *netconf) {
+    if (!netconf->worker_tcp_fds) {
+        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
+        close(netconf->tcp_client.fd);
+        return;
+    }
+    for (int i=0; i < netconf->config->worker_threads; i++) {
+        close(netconf->worker_tcp_fds[i]);
+    }
+    free(netconf->worker_tcp_fds);
+    netconf->worker_tcp_fds = NULL;
+}
+
+/**
+ * Initializes the listener of the priority lane, if a
+ * priority_port is configured. Its clients are accepted by
+ * the main loop, and only go to the priority workers.
+ * @arg netconf The network configuration
+ * @arg inherited Listeners taken from a previous process
+ * @return 0 on success.
+ */
+static int setup_priority_listener(bloom_networking *netconf, bloom_listeners *inherited) {
+    netconf->priority_client.fd = -1;
+    if (!netconf->config->priority_port) return 0;
+    int fd = inherited->priority_fd;
+    if (fd >= 0) {
+        inherited->priority_fd = -1;
+    } else if (bind_tcp_listener(netconf, netconf->config->priority_port, 0, &fd)) {
+        return 1;
+    }
+    ev_io_init(&netconf->priority_client, handle_new_client, fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->priority_client);
+    return 0;
+}
+
+/**
+ * Closes the listener of the priority lane
+ * @arg netconf The network configuration
+ */
+static void close_priority_listener(bloom_networking *netconf) {
+    if (netconf->priority_client.fd < 0) return;
+    ev_io_stop(netconf->default_loop, &netconf->priority_client);
+    close(netconf->priority_client.fd);
+}
+
+/**
+ * Initializes the unix socket listener, if one is
+ * configured. Its clients are accepted by the main
+ * loop, like those of the TCP listener. A path starting
+ * with '@' is bound in the abstract namespace, which
+ * needs no file and disappears with the process.
+ * @arg netconf The network configuration
+ * @arg inherited Listeners taken from a previous process
+ * @return 0 on success.
+ */
+static int setup_unix_listener(bloom_networking *netconf, bloom_listeners *inherited) {
+    char *path = netconf->config->unix_socket;
+    netconf->unix_client.fd = -1;
+    if (!path) return 0;
+    if (inherited->unix_fd >= 0) {
+        ev_io_init(&netconf->unix_client, handle_new_client, inherited->unix_fd, EV_READ);
+        ev_io_start(netconf->default_loop, &netconf->unix_client);
+        inherited->unix_fd = -1;
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    socklen_t addr_len = sizeof(addr);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    } else {
+        // Remove the socket left by a previous run, but nothing else
+        struct stat st;
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create unix socket! Err: %s", strerror(errno));
+        return 1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) != 0) {
+        syslog(LOG_ERR, "Failed to bind on unix socket '%s'! Err: %s", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (listen(fd, netconf->config->tcp_backlog) != 0) {
+        syslog(LOG_ERR, "Failed to listen on unix socket '%s'! Err: %s", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    ev_io_init(&netconf->unix_client, handle_new_client, fd, EV_READ);
+    ev_io_start(netconf->default_loop, &netconf->unix_client);
     return 0;
 }
 
+/**
+ * Closes the unix socket listener, and removes its file.
+ * @arg netconf The network configuration
+ */
+static void close_unix_listener(bloom_networking *netconf) {
+    if (netconf->unix_client.fd < 0) return;
+    ev_io_stop(netconf->default_loop, &netconf->unix_client);
+    close(netconf->unix_client.fd);
+
+    // The file is still in use by the process we handed off to
+    char *path = netconf->config->unix_socket;
+    if (path[0] != '@' && netconf->handoff_peer < 0) unlink(path);
+}
+
 /**
  * Initializes the UDP Listener.
  * @arg netconf The network configuration
+ * @arg inherited Listeners taken from a previous process
  * @return 0 on success.
  */
-static int setup_udp_listener(bloom_networking *netconf) {
+static int setup_udp_listener(bloom_networking *netconf, bloom_listeners *inherited) {
+    if (inherited->udp_fd >= 0) {
+        netconf->udp_listener_fd = inherited->udp_fd;
+        inherited->udp_fd = -1;
+        return 0;
+    }
+
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -245,7 +700,7 @@ static int setup_udp_listener(bloom_networking *netconf) {
     }
     addr.sin_addr = bind_addr;
 
-    // Make the socket, bind and listen
+    // Make the socket and bind
     int udp_listener_fd = socket(PF_INET, SOCK_DGRAM, 0);
     int optval = 1;
     if (setsockopt(udp_listener_fd, SOL_SOCKET,
@@ -260,10 +715,16 @@ static int setup_udp_listener(bloom_networking *netconf) {
         return 1;
     }
 
-    // Create the libev objects
-    ev_io_init(&netconf->udp_client, handle_new_udp_mesg,
-                udp_listener_fd, EV_READ);
-    ev_io_start(netconf->default_loop, &netconf->udp_client);
+    // The socket is shared by all the workers, so the reads must not block
+    int sock_flags = fcntl(udp_listener_fd, F_GETFL, 0);
+    if (sock_flags < 0 || fcntl(udp_listener_fd, F_SETFL, sock_flags | O_NONBLOCK)) {
+        syslog(LOG_ERR, "Failed to set O_NONBLOCK on UDP socket! Err: %s", strerror(errno));
+        close(udp_listener_fd);
+        return 1;
+    }
+
+    // Each worker watches the socket from its own loop
+    netconf->udp_listener_fd = udp_listener_fd;
     return 0;
 }
 
@@ -271,16 +732,23 @@ static int setup_udp_listener(bloom_networking *netconf) {
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg cluster The cluster to pass up to the connection handlers, may be NULL
+ * @arg inherited Listeners taken from a previous process, used instead
+ * of binding new ones. The listeners that are used are set to -1.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out) {
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_cluster *cluster,
+        bloom_listeners *inherited, bloom_networking **netconf_out) {
     // Make the netconf structure
     bloom_networking *netconf = calloc(1, sizeof(struct bloom_networking));
 
     // Initialize
     netconf->config = config;
     netconf->mgr = mgr;
-    netconf->workers = calloc(config->worker_threads, sizeof(worker_ev_userdata*));
+    netconf->cluster = cluster;
+    netconf->num_workers = config->worker_threads;
+    if (config->priority_port) netconf->num_workers += config->priority_workers;
+    netconf->workers = calloc(netconf->num_workers, sizeof(worker_ev_userdata*));
     if (!netconf->workers) {
         free(netconf);
         perror("Failed to calloc() for worker threads");
@@ -288,7 +756,7 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
     }
 
     // Setup the barrier
-    if (barrier_init(&netconf->thread_barrier, config->worker_threads + 1)) {
+    if (barrier_init(&netconf->thread_barrier, netconf->num_workers + 1)) {
         free(netconf->workers);
         free(netconf);
         return 1;
@@ -312,24 +780,88 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
         return 1;
     }
 
+    // Reloads are asked for from signal handlers
+    ev_async_init(&netconf->reload_async, handle_reload);
+    netconf->reload_async.data = netconf;
+    ev_async_start(netconf->default_loop, &netconf->reload_async);
+
+    // Setup TLS for the TCP clients
+    if (config->tls_cert_file && init_tls(config, &netconf->tls)) {
+        free(netconf);
+        return 1;
+    }
+
     // Setup the TCP listener
-    int res = setup_tcp_listener(netconf);
+    int res = setup_tcp_listener(netconf, inherited);
     if (res != 0) {
+        if (netconf->tls) destroy_tls(netconf->tls);
         free(netconf);
         return 1;
     }
 
     // Setup the UDP listener
-    res = setup_udp_listener(netconf);
+    res = setup_udp_listener(netconf, inherited);
     if (res != 0) {
-        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-        close(netconf->tcp_client.fd);
+        close_tcp_listener(netconf);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the unix socket listener
+    res = setup_unix_listener(netconf, inherited);
+    if (res != 0) {
+        close_tcp_listener(netconf);
+        close(netconf->udp_listener_fd);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the listener of the priority lane
+    res = setup_priority_listener(netconf, inherited);
+    if (res != 0) {
+        close_tcp_listener(netconf);
+        close_unix_listener(netconf);
+        close(netconf->udp_listener_fd);
+        free(netconf);
+        return 1;
+    }
+
+    // Let a new process take over the listeners
+    netconf->handoff_client.fd = -1;
+    netconf->handoff_peer = -1;
+    if (config->handoff_socket) {
+        int fd = bind_handoff_socket(config->handoff_socket);
+        if (fd < 0) {
+            close_tcp_listener(netconf);
+            close_unix_listener(netconf);
+            close_priority_listener(netconf);
+            close(netconf->udp_listener_fd);
+            free(netconf);
+            return 1;
+        }
+        ev_io_init(&netconf->handoff_client, handle_handoff, fd, EV_READ);
+        netconf->handoff_client.data = netconf;
+        ev_io_start(netconf->default_loop, &netconf->handoff_client);
+    }
+
+    // Setup the executor for the commands
+    if (config->exec_threads && init_executor_pool(netconf)) {
+        close_tcp_listener(netconf);
+        close_unix_listener(netconf);
+        close_priority_listener(netconf);
+        close(netconf->udp_listener_fd);
         free(netconf);
         return 1;
     }
 
     // Prepare the conn handlers
     init_conn_handler();
+    init_conn_buf_size = config->conn_buf_kb * 1024;
+    conn_buf_multiplier = config->conn_buf_multiplier;
+
+    // Resume the parked connections once filters are faulted in
+    if (config->fault_retry && config->fault_park)
+        filtmgr_set_fault_hook(mgr, wake_parked_conns, netconf);
 
     // Success!
     *netconf_out = netconf;
@@ -338,7 +870,7 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
 
 
 /**
- * Invoked when a TCP listening socket fd is ready
+ * Invoked when a TCP or unix listening socket fd is ready
  * to accept a new client. Accepts the client, initializes
  * the connection buffers, and prepares to start listening
  * for client data
@@ -347,51 +879,120 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     // Get the network configuration
     bloom_networking *netconf = ev_userdata(lp);
 
-    // Accept the client connection
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
-    int client_fd = accept(watcher->fd,
-                        (struct sockaddr*)&client_addr,
-                        &client_addr_len);
-
-    // Check for an error
-    if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
-        return;
-    }
-
-    // Setup the socket
-    if (set_client_sockopts(client_fd)) {
-        return;
-    }
+    // Accept the client connection, from the pool of the
+    // least loaded worker thread of its lane
+    int priority = (watcher == &netconf->priority_client);
+    worker_ev_userdata *data = least_loaded_worker(netconf, priority, NULL);
+    conn_info *conn = accept_client(watcher->fd, data);
+    if (!conn) return;
 
-    // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
-            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+    // Dispatch this client to the worker
+    dispatch_conn(data, conn);
+}
 
-    // Get the associated conn object
-    conn_info *conn = get_conn();
 
-    // Initialize the libev stuff
-    ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
-    ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
+/**
+ * Invoked when a worker's own SO_REUSEPORT listener is ready
+ * to accept a new client. The client is scheduled directly
+ * on the worker, without going through the main loop.
+ */
+static void handle_new_worker_client(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
 
-    // Dispatch this client to a worker thread
-    int next_thread = netconf->last_assign++ % netconf->config->worker_threads;
-    worker_ev_userdata *data = netconf->workers[next_thread];
+    // Accept the client connection
+    conn_info *conn = accept_client(watcher->fd, data);
+    if (!conn) return;
 
-    // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+    // Schedule this connection on this thread
+    schedule_conn(data, conn);
 }
 
 
 /**
  * Invoked to handle new UDP messages being available.
+ * Every worker watches the socket, so whichever wakes up
+ * first drains a batch of datagrams and applies them. The
+ * datagrams are fire-and-forget, so no responses are sent.
  */
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // TODO: Handle UDP clients
-    syslog(LOG_WARNING, "UDP clients not currently supported!");
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+    data->last_active = ev_now(lp);
+
+    // Allocate the receive buffers, with room for a trailing newline
+    if (!data->udp_bufs) {
+        data->udp_bufs = malloc(UDP_BATCH_SIZE * (UDP_MESG_SIZE + 1));
+        if (!data->udp_bufs) {
+            syslog(LOG_ERR, "Failed to allocate UDP buffers!");
+            return;
+        }
+    }
+
+    // Prepare to invoke the handler, there is no connection to respond to
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
+    handle.conn = NULL;
+
+    int lens[UDP_BATCH_SIZE];
+    int truncated[UDP_BATCH_SIZE];
+    int num_mesg = 0;
+#ifdef __linux__
+    // Read a batch of datagrams in a single call
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec vectors[UDP_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i=0; i < UDP_BATCH_SIZE; i++) {
+        vectors[i].iov_base = data->udp_bufs + i * (UDP_MESG_SIZE + 1);
+        vectors[i].iov_len = UDP_MESG_SIZE;
+        msgs[i].msg_hdr.msg_iov = vectors + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    num_mesg = recvmmsg(watcher->fd, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    for (int i=0; i < num_mesg; i++) {
+        lens[i] = msgs[i].msg_len;
+        truncated[i] = msgs[i].msg_hdr.msg_flags & MSG_TRUNC;
+    }
+#else
+    // Fall back to reading one datagram at a time
+    ssize_t read_bytes;
+    while (num_mesg < UDP_BATCH_SIZE) {
+        struct iovec vector = {data->udp_bufs + num_mesg * (UDP_MESG_SIZE + 1), UDP_MESG_SIZE};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &vector;
+        msg.msg_iovlen = 1;
+        read_bytes = recvmsg(watcher->fd, &msg, MSG_DONTWAIT);
+        if (read_bytes < 0) {
+            if (!num_mesg) num_mesg = -1;
+            break;
+        }
+        lens[num_mesg] = read_bytes;
+        truncated[num_mesg] = msg.msg_flags & MSG_TRUNC;
+        num_mesg++;
+    }
+#endif
+
+    // Another worker may have drained the socket first
+    if (num_mesg < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to read() from UDP socket! %s.", strerror(errno));
+        }
+        return;
+    }
+
+    // Apply each datagram
+    for (int i=0; i < num_mesg; i++) {
+        if (truncated[i]) {
+            syslog(LOG_WARNING, "Dropped UDP message larger than %d bytes!", UDP_MESG_SIZE);
+            continue;
+        }
+        handle_udp_message(&handle, data->udp_bufs + i * (UDP_MESG_SIZE + 1), lens[i]);
+    }
+    arena_reset(data->arena);
 }
 
 
@@ -402,42 +1003,100 @@ static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
  * of what to do.
  */
 static int read_client_data(conn_info *conn) {
-    /**
-     * Figure out how much space we have to write.
-     * If we have < 50% free, we resize the buffer using
-     * a multiplier.
-     */
-    int avail_buf = circbuf_avail_buf(&conn->input);
-    if (avail_buf < conn->input.buf_size / 2) {
-        circbuf_grow_buf(&conn->input);
-    }
+    // Data decrypted by OpenSSL does not make the socket
+    // readable again, so it is all read in now
+    do {
+        /**
+         * Figure out how much space we have to write.
+         * If we have < 50% free, we resize the buffer using
+         * a multiplier.
+         */
+        int avail_buf = circbuf_avail_buf(&conn->input);
+        if (avail_buf < conn->input.buf_size / 2) {
+            circbuf_grow_buf(&conn->input);
+        }
 
-    // Build the IO vectors to perform the read
-    struct iovec vectors[2];
-    int num_vectors;
-    circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
+        // Build the IO vectors to perform the read
+        struct iovec vectors[2];
+        int num_vectors;
+        circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
 
-    // Issue the read
-    ssize_t read_bytes = readv(conn->client.fd, (struct iovec*)&vectors, num_vectors);
+        // Issue the read
+        ssize_t read_bytes = conn_readv(conn, (struct iovec*)&vectors, num_vectors);
 
-    // Make sure we actually read something
-    if (read_bytes == 0) {
-        syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
-        return 1;
-    } else if (read_bytes == -1) {
-        if (errno != EAGAIN && errno != EINTR) {
-            syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
-                    conn->client.fd, strerror(errno));
+        // Make sure we actually read something
+        if (read_bytes == 0) {
+            syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
+            return 1;
+        } else if (read_bytes == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+                        conn->client.fd, strerror(errno));
+            }
+            return 1;
         }
-        return 1;
-    }
 
-    // Update the write cursor
-    circbuf_advance_write(&conn->input, read_bytes);
+        // Update the write cursor
+        circbuf_advance_write(&conn->input, read_bytes);
+
+        // Track the load of the worker
+        conn->thread_ev->tick_bytes += read_bytes;
+    } while (conn->tls && tls_pending(conn->tls));
+
+    conn->last_tick = conn->thread_ev->ticks;
+    rearm_quickack(conn);
     return 0;
 }
 
 
+/**
+ * Reads from a client connection, like readv,
+ * through TLS if the client uses it.
+ */
+static ssize_t conn_readv(conn_info *conn, struct iovec *vectors, int num_vectors) {
+    if (conn->tls) return tls_readv(conn->tls, vectors, num_vectors);
+    return readv(conn->client.fd, vectors, num_vectors);
+}
+
+
+/**
+ * Writes to a client connection, like writev,
+ * through TLS if the client uses it.
+ */
+static ssize_t conn_writev(conn_info *conn, struct iovec *vectors, int num_vectors) {
+    if (conn->tls) return tls_writev(conn->tls, vectors, num_vectors);
+    return writev(conn->client.fd, vectors, num_vectors);
+}
+
+
+/**
+ * Continues the TLS handshake of a connection, waiting for the
+ * socket to be writable if needed. Once done, the commands sent
+ * along with the end of the handshake are handled.
+ * @arg conn The connection
+ */
+static void continue_tls_handshake(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    int res = tls_handshake(conn->tls);
+    if (res < 0) {
+        deactivate_client_connection(conn);
+        return;
+    }
+    if (res == 2) {
+        ev_io_start(data->loop, &conn->write_client);
+        return;
+    }
+    ev_io_stop(data->loop, &conn->write_client);
+    if (res == 0 && tls_pending(conn->tls)) {
+        if (read_client_data(conn)) {
+            deactivate_client_connection(conn);
+            return;
+        }
+        handle_conn_input(data, conn);
+    }
+}
+
+
 /**
  * Invoked when a client connection is ready to be written to.
  */
@@ -448,13 +1107,19 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
     // Bail if inactive
     if (!conn->active) return;
 
+    // The handshake may wait for the socket to be writable
+    if (conn->tls && !tls_handshake_done(conn->tls)) {
+        continue_tls_handshake(conn);
+        return;
+    }
+
     // Build the IO vectors to perform the write
     struct iovec vectors[2];
     int num_vectors;
     circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
 
     // Issue the write
-    ssize_t write_bytes = writev(watcher->fd, (struct iovec*)&vectors, num_vectors);
+    ssize_t write_bytes = conn_writev(conn, (struct iovec*)&vectors, num_vectors);
 
     if (write_bytes > 0) {
         // Update the cursor
@@ -488,68 +1153,599 @@ static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events)
     // Get the user data
     worker_ev_userdata *data = ev_userdata(lp);
     conn_info *conn = watcher->data;
+    data->last_active = ev_now(lp);
 
     // Bail if inactive
     if (!conn->active) return;
 
+    // Clients using TLS start with a handshake
+    if (conn->tls && !tls_handshake_done(conn->tls)) {
+        continue_tls_handshake(conn);
+        return;
+    }
+
+    /*
+     * If an idle connection is waking up, check if it should
+     * be moved to a less loaded worker first. This is only safe
+     * if we are not holding any input or output for it. The
+     * data is left in the socket for the new worker to read.
+     */
+    if (data->ticks - conn->last_tick >= IDLE_TICKS && !conn->use_write_buf &&
+            conn->input.read_cursor == conn->input.write_cursor) {
+        uint64_t target_load;
+        worker_ev_userdata *target = least_loaded_worker(data->netconf, data->priority, &target_load);
+        uint64_t load = worker_load(data);
+        if (target != data && load > 2 * target_load &&
+                load - target_load > MIGRATE_MIN_LOAD) {
+            ev_io_stop(lp, &conn->client);
+            unlink_conn(data, conn);
+            dispatch_conn(target, conn);
+            return;
+        }
+    }
+
     // Read in the data, and close on issues
     if (read_client_data(conn)) {
         deactivate_client_connection(conn);
         return;
     }
+    handle_conn_input(data, conn);
+}
+
+
+/**
+ * Invokes the handlers on the buffered input of a connection.
+ * A connection that spends its budget with input left is queued,
+ * and stops reading until the queue gets back to it.
+ */
+static void handle_conn_input(worker_ev_userdata *data, conn_info *conn) {
+    // Hand the commands to the executor. The priority lane
+    // runs its own, so it does not queue behind the others.
+    if (data->netconf->exec && !data->priority) {
+        offload_conn(data, conn);
+        return;
+    }
 
     // Prepare to invoke the handler
     bloom_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
     handle.conn = conn;
 
-    // Reschedule the watcher, unless it's non-active now
-    if (handle_client_connect(&handle))
+    // Collect the responses, and send them at once
+    conn->batch_output = 1;
+    int res = handle_client_connect(&handle);
+    conn->batch_output = 0;
+    arena_reset(data->arena);
+    flush_client_output(conn);
+
+    // Close the connection, queue the rest of its input,
+    // or wait for the filter of its command
+    if (res == 2)
+        queue_ready_conn(data, conn);
+    else if (res == 3)
+        park_conn(data, conn);
+    else if (res)
         deactivate_client_connection(conn);
 }
 
 
 /**
- * Invoked to handle async notifications via the thread pipes
+ * Invoked before the worker waits for events, to give each of
+ * the queued connections another turn, in the order they yielded.
+ * Connections that yield again go to the back of the queue.
  */
-static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events) {
-    // Get the user data
+static void handle_ready_conns(ev_loop *lp, ev_prepare *watcher, int ready_events) {
     worker_ev_userdata *data = ev_userdata(lp);
+    conn_info *conn = data->ready_head;
+    data->ready_head = data->ready_tail = NULL;
+    data->num_ready = 0;
+    while (conn) {
+        conn_info *next = conn->next_ready;
+        conn->ready = 0;
+        if (conn->active) {
+            resume_conn(data, conn);
+        }
+        conn = next;
+    }
+
+    if (!data->ready_head) {
+        ev_prepare_stop(lp, &data->ready_prepare);
+        ev_idle_stop(lp, &data->ready_idle);
+    }
+}
+
+
+/**
+ * The idle watcher is only active to keep the loop from
+ * blocking while connections are queued, so it does nothing.
+ */
+static void handle_ready_idle(ev_loop *lp, ev_idle *watcher, int ready_events) {
+    (void)lp;
+    (void)watcher;
+    (void)ready_events;
+}
+
+
+/**
+ * Queues a connection that has input left to handle.
+ * Its reads are stopped meanwhile, so a client sending
+ * faster than its turns is pushed back by TCP.
+ */
+static void queue_ready_conn(worker_ev_userdata *data, conn_info *conn) {
+    if (conn->ready) return;
+    conn->ready = 1;
+    conn->next_ready = NULL;
+    if (data->ready_tail)
+        data->ready_tail->next_ready = conn;
+    else
+        data->ready_head = conn;
+    data->ready_tail = conn;
+    data->num_ready++;
+
+    ev_io_stop(data->loop, &conn->client);
+    ev_prepare_start(data->loop, &data->ready_prepare);
+    ev_idle_start(data->loop, &data->ready_idle);
+}
+
+
+/**
+ * Removes a connection that is closed from the ready queue.
+ */
+static void dequeue_ready_conn(worker_ev_userdata *data, conn_info *conn) {
+    conn_info *prev = NULL;
+    for (conn_info *c = data->ready_head; c; prev = c, c = c->next_ready) {
+        if (c != conn) continue;
+        if (prev)
+            prev->next_ready = c->next_ready;
+        else
+            data->ready_head = c->next_ready;
+        if (data->ready_tail == c) data->ready_tail = prev;
+        data->num_ready--;
+        break;
+    }
+    conn->ready = 0;
+}
+
 
-    // Attempt to read a single character from the pipe
-    char cmd;
-    if (read(data->pipefd[0], &cmd, 1) != 1)
+/**
+ * Hands the buffered input of a connection to the executor.
+ * The connection is not read or written until the commands
+ * are handled, so its buffers only have one user at a time,
+ * and the responses are sent in the order of the commands.
+ */
+static void offload_conn(worker_ev_userdata *data, conn_info *conn) {
+    ev_io_stop(data->loop, &conn->client);
+    ev_io_stop(data->loop, &conn->write_client);
+    conn->offloaded = 1;
+    conn->exec_failed = 0;
+    conn->job.func = run_conn_job;
+    __atomic_add_fetch(&data->offloaded, 1, __ATOMIC_RELAXED);
+    executor_submit(data->netconf->exec, data->index, &conn->job);
+}
+
+
+/**
+ * Runs the commands of a connection on a thread of the
+ * executor. The responses are buffered, and the connection
+ * is handed back to its worker to send them.
+ */
+static void run_conn_job(bloom_job *job, int thread) {
+    conn_info *conn = (conn_info*)((char*)job - offsetof(conn_info, job));
+    worker_ev_userdata *data = conn->thread_ev;
+    bloom_networking *netconf = data->netconf;
+
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.cluster = netconf->cluster;
+    handle.arena = netconf->exec_arenas[thread];
+    handle.conn = conn;
+    periodic_update(&handle);
+
+    conn->arena = handle.arena;
+    conn->batch_output = 1;
+    int res = handle_client_connect(&handle);
+    conn->batch_output = 0;
+    conn->arena = NULL;
+    arena_reset(handle.arena);
+    conn->exec_res = (conn->exec_failed) ? 1 : res;
+
+    // Hand the connection back. The worker waits for the
+    // count to drop before it exits, so it is dropped once
+    // we no longer touch the worker.
+    send_conn_message(data, conn, CONN_EXEC_DONE);
+    __atomic_sub_fetch(&data->offloaded, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Invoked when the executor handed a connection back. Sends
+ * its responses, and resumes reading it, or hands it back
+ * again if it yielded with input left.
+ */
+static void handle_exec_done(worker_ev_userdata *data, conn_info *conn) {
+    conn->offloaded = 0;
+    if (conn->exec_res == 1) {
+        deactivate_client_connection(conn);
         return;
+    }
+
+    flush_client_output(conn);
+    if (conn->active && conn->exec_res == 2) {
+        offload_conn(data, conn);
+    } else if (conn->active && conn->exec_res == 3) {
+        park_conn(data, conn);
+    } else if (conn->active) {
+        ev_io_start(data->loop, &conn->client);
+        if (conn->use_write_buf) ev_io_start(data->loop, &conn->write_client);
+    }
+}
+
+
+/**
+ * Parks a connection whose command waits on a filter being
+ * faulted in. It is not read until it is resumed, so the
+ * worker keeps serving its other connections meanwhile.
+ */
+static void park_conn(worker_ev_userdata *data, conn_info *conn) {
+    ev_io_stop(data->loop, &conn->client);
+    if (conn->parked) return;
+    conn->parked = 1;
+    conn->next_parked = data->parked;
+    data->parked = conn;
+}
+
+
+/**
+ * Removes a connection that is closed from the parked list.
+ */
+static void unpark_conn(worker_ev_userdata *data, conn_info *conn) {
+    for (conn_info **c = &data->parked; *c; c = &(*c)->next_parked) {
+        if (*c != conn) continue;
+        *c = conn->next_parked;
+        break;
+    }
+    conn->parked = 0;
+}
+
+
+/**
+ * Invoked by the fault thread once it has faulted in filters.
+ * Wakes every worker to resume its parked connections. A
+ * connection may only be parked once the command that queued
+ * the filter returns, but the wake up is handled after that,
+ * so it is not lost.
+ * @arg arg The networking stack
+ */
+static void wake_parked_conns(void *arg) {
+    bloom_networking *netconf = arg;
+    for (int i=0; i < netconf->num_workers; i++) {
+        worker_ev_userdata *data = netconf->workers[i];
+        if (!data) continue;
+        __atomic_store_n(&data->wake_parked, 1, __ATOMIC_RELEASE);
+        ev_async_send(data->loop, &data->message_async);
+    }
+}
+
+
+/**
+ * Invoked when the fault thread has faulted in filters, to
+ * resume the parked connections. Those whose filter is still
+ * being faulted in are parked again.
+ */
+static void handle_parked_conns(worker_ev_userdata *data) {
+    conn_info *conn = data->parked;
+    data->parked = NULL;
+    while (conn) {
+        conn_info *next = conn->next_parked;
+        conn->parked = 0;
+        if (conn->active) resume_conn(data, conn);
+        conn = next;
+    }
+}
+
+
+/**
+ * Handles the input left in the buffers of a connection
+ * that was queued or parked, and resumes reading it
+ * unless it is waiting again.
+ */
+static void resume_conn(worker_ev_userdata *data, conn_info *conn) {
+    handle_conn_input(data, conn);
+    if (conn->active && !conn->ready && !conn->offloaded && !conn->parked)
+        ev_io_start(data->loop, &conn->client);
+}
+
+
+/**
+ * Invoked by the threads of the executor before they sleep,
+ * so an idle thread does not hold back the filter manager.
+ */
+static void handle_exec_idle(void *arg, int thread) {
+    (void)thread;
+    bloom_networking *netconf = arg;
+    bloom_conn_handler handle;
+    handle.config = netconf->config;
+    handle.mgr = netconf->mgr;
+    handle.cluster = netconf->cluster;
+    handle.arena = netconf->exec_arenas[thread];
+    handle.conn = NULL;
+    idle_update(&handle);
+}
+
+
+/**
+ * Invoked by the threads of the executor before they exit.
+ */
+static void handle_exec_leave(void *arg, int thread) {
+    (void)thread;
+    bloom_networking *netconf = arg;
+    filtmgr_client_leave(netconf->mgr);
+}
+
+
+/**
+ * Creates the executor and the arenas of its threads.
+ * @return 0 on success.
+ */
+static int init_executor_pool(bloom_networking *netconf) {
+    int threads = netconf->config->exec_threads;
+    netconf->exec_arenas = calloc(threads, sizeof(bloom_arena*));
+    if (!netconf->exec_arenas) return 1;
+    for (int i=0; i < threads; i++) {
+        if (init_arena(WORKER_ARENA_SIZE, netconf->exec_arenas + i)) {
+            syslog(LOG_ERR, "Failed to allocate the arena of an executor thread!");
+            destroy_executor_pool(netconf);
+            return 1;
+        }
+    }
+    if (init_executor(threads, handle_exec_idle, handle_exec_leave, netconf, &netconf->exec)) {
+        syslog(LOG_ERR, "Failed to start the executor!");
+        destroy_executor_pool(netconf);
+        return 1;
+    }
+    return 0;
+}
+
 
-    // Handle the command
+/**
+ * Stops the executor once its jobs have run,
+ * and frees the arenas of its threads.
+ */
+static void destroy_executor_pool(bloom_networking *netconf) {
+    if (netconf->exec) destroy_executor(netconf->exec);
+    netconf->exec = NULL;
+    for (int i=0; netconf->exec_arenas && i < netconf->config->exec_threads; i++) {
+        if (netconf->exec_arenas[i]) destroy_arena(netconf->exec_arenas[i]);
+    }
+    free(netconf->exec_arenas);
+    netconf->exec_arenas = NULL;
+}
+
+
+/**
+ * Sends any buffered output of a connection which is
+ * not already waiting on the write watcher. If the output
+ * cannot be sent in full, the write watcher sends the rest.
+ */
+static void flush_client_output(conn_info *conn) {
+    // With a ring, the output is sent after the commands are handled
+    if (!conn->active || conn->use_write_buf || conn->thread_ev->ring) return;
+    if (!circbuf_used_buf(&conn->output)) return;
+
+    // Build the IO vectors to perform the write
+    struct iovec vectors[2];
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+
+    // Issue the write
+    ssize_t write_bytes = conn_writev(conn, (struct iovec*)&vectors, num_vectors);
+    if (write_bytes > 0) {
+        circbuf_advance_read(&conn->output, write_bytes);
+    } else if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+        syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
+        deactivate_client_connection(conn);
+        return;
+    }
+
+    // Setup the async write for the rest
+    if (circbuf_used_buf(&conn->output)) {
+        conn->use_write_buf = 1;
+        ev_io_start(conn->thread_ev->loop, &conn->write_client);
+    }
+}
+
+
+/**
+ * Queues a read of a connection on the ring of its worker,
+ * into the free space of the input buffer.
+ */
+static void uring_read_conn(conn_info *conn) {
+    // Grow the buffer like read_client_data
+    int avail_buf = circbuf_avail_buf(&conn->input);
+    if (avail_buf < conn->input.buf_size / 2) {
+        circbuf_grow_buf(&conn->input);
+    }
+
+    int num_vectors;
+    circbuf_setup_readv_iovec(&conn->input, conn->uring_iov, &num_vectors);
+    if (uring_prep_readv(conn->thread_ev->ring, conn->client.fd, conn->uring_iov,
+                num_vectors, (uint64_t)(uintptr_t)conn)) {
+        syslog(LOG_ERR, "Failed to queue read for connection [%d]!", conn->client.fd);
+        deactivate_client_connection(conn);
+    }
+}
+
+/**
+ * Queues a write of the buffered output of a connection
+ * on the ring of its worker. Writes are tagged by setting
+ * the low bit of the user data.
+ */
+static void uring_write_conn(conn_info *conn) {
+    int num_vectors;
+    circbuf_setup_writev_iovec(&conn->output, conn->uring_iov, &num_vectors);
+    if (uring_prep_writev(conn->thread_ev->ring, conn->client.fd, conn->uring_iov,
+                num_vectors, (uint64_t)(uintptr_t)conn | 1)) {
+        syslog(LOG_ERR, "Failed to queue write for connection [%d]!", conn->client.fd);
+        deactivate_client_connection(conn);
+    }
+}
+
+/**
+ * Invoked when the ring of a worker has completions. Each
+ * connection has a single read or write in flight. Once a read
+ * completes, the commands are handled and the responses are written.
+ * Once the responses are written, the next read is queued. Nothing
+ * is in flight while the buffers are modified, so they can be grown
+ * safely. All the new operations are submitted together at the end.
+ */
+static void handle_uring_completions(ev_loop *lp, ev_io *watcher, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+    data->last_active = ev_now(lp);
+
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
+
+    uint64_t user_data;
+    int res;
     conn_info *conn;
-    switch (cmd) {
-        // Accept new connection
-        case 'a':
-            // Read the address of conn from the pipe
-            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
-                perror("Failed to read from async pipe");
-                return;
+    while (!uring_next_cqe(data->ring, &user_data, &res)) {
+        conn = (conn_info*)(uintptr_t)(user_data & ~1ULL);
+        if (!conn->active) continue;
+
+        // Retry anything that was interrupted
+        if (res == -EAGAIN || res == -EINTR) {
+            if (user_data & 1)
+                uring_write_conn(conn);
+            else
+                uring_read_conn(conn);
+            continue;
+        }
+
+        // Handle a completed write
+        if (user_data & 1) {
+            if (res < 0) {
+                syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+                        conn->client.fd, strerror(-res));
+                deactivate_client_connection(conn);
+                continue;
             }
+            circbuf_advance_read(&conn->output, res);
+            if (circbuf_used_buf(&conn->output))
+                uring_write_conn(conn);
+            else
+                uring_read_conn(conn);
+            continue;
+        }
 
-            // Schedule this connection on this thread
-            conn->thread_ev = data;
-            ev_io_start(data->loop, &conn->client);
-            break;
+        // Handle a completed read
+        if (res == 0) {
+            syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
+            deactivate_client_connection(conn);
+            continue;
+        } else if (res < 0) {
+            syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+                    conn->client.fd, strerror(-res));
+            deactivate_client_connection(conn);
+            continue;
+        }
+        circbuf_advance_write(&conn->input, res);
+        data->tick_bytes += res;
+        conn->last_tick = data->ticks;
+        rearm_quickack(conn);
+
+        // Invoke the handler, the responses are buffered. The
+        // buffers can not change while an operation is in flight,
+        // so a connection that yields is handled again right away.
+        handle.conn = conn;
+        do {
+            res = handle_client_connect(&handle);
+            arena_reset(data->arena);
+        } while (res == 2);
+        if (res) {
+            deactivate_client_connection(conn);
+            continue;
+        }
+        if (!conn->active) continue;
 
-        // Quit
-        case 'q':
-            data->should_run = 0;
-            ev_break(lp, EVBREAK_ALL);
-            break;
+        if (circbuf_used_buf(&conn->output))
+            uring_write_conn(conn);
+        else
+            uring_read_conn(conn);
+    }
 
-        default:
-            syslog(LOG_WARNING, "Received unknown comand: %c", cmd);
+    // Submit everything at once
+    res = uring_submit(data->ring);
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to submit to io_uring! %s.", strerror(-res));
+    }
+}
+
+
+/**
+ * Invoked when other threads woke the worker, to handle
+ * their messages. A single wake up may cover many messages.
+ */
+static void handle_worker_messages(ev_loop *lp, ev_async *watcher, int ready_events) {
+    // Get the user data
+    worker_ev_userdata *data = ev_userdata(lp);
+
+    // Quit
+    if (__atomic_load_n(&data->quit, __ATOMIC_ACQUIRE)) {
+        data->should_run = 0;
+        ev_break(lp, EVBREAK_ALL);
+        return;
+    }
+
+    // Resume the parked connections once filters are faulted in
+    if (__atomic_load_n(&data->wake_parked, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&data->wake_parked, 0, __ATOMIC_ACQUIRE)) {
+        handle_parked_conns(data);
+    }
+
+    // Handle the messages in the order they were sent
+    bloom_mpsc_node *node = mpsc_take(&data->messages);
+    while (node) {
+        bloom_mpsc_node *next = node->next;
+        conn_info *conn = (conn_info*)((char*)node - offsetof(conn_info, message));
+        switch (conn->message_type) {
+            case CONN_ACCEPT:
+                schedule_conn(data, conn);
+                break;
+            case CONN_EXEC_DONE:
+                handle_exec_done(data, conn);
+                break;
+        }
+        node = next;
     }
 }
 
 
+/**
+ * Sends a message about a connection to a worker. Only the
+ * sender that finds the queue empty wakes the worker, since
+ * the wake up of the earlier senders is still to be handled.
+ * @arg data The worker
+ * @arg conn The connection, which the worker owns afterwards
+ * @arg type The conn_message
+ */
+static void send_conn_message(worker_ev_userdata *data, conn_info *conn, int type) {
+    conn->message_type = type;
+    if (mpsc_push(&data->messages, &conn->message))
+        ev_async_send(data->loop, &data->message_async);
+}
+
+
 /**
  * Invoked periodically to give the connection handlers
  * time to cleanup and handle state updates
@@ -558,10 +1754,19 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
     // Get the user data
     worker_ev_userdata *data = ev_userdata(lp);
 
+    // Fold the input of this tick into the smoothed load
+    uint64_t load = (data->load + data->tick_bytes) / 2;
+    __atomic_store_n(&data->load, load, __ATOMIC_RELAXED);
+    data->tick_bytes = 0;
+    data->ticks++;
+    if (data->ticks % IDLE_TICKS == 0) shrink_idle_conns(data);
+
     // Prepare to invoke the handler
     bloom_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
     handle.conn = NULL;
 
     // Invoke the connection handler layer
@@ -569,6 +1774,95 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
 }
 
 
+/**
+ * Adds a connection to the connections of a worker.
+ * @arg data The worker
+ * @arg conn The connection
+ */
+static void link_conn(worker_ev_userdata *data, conn_info *conn) {
+    conn->prev_conn = NULL;
+    conn->next_conn = data->conns_list;
+    if (data->conns_list) data->conns_list->prev_conn = conn;
+    data->conns_list = conn;
+    __atomic_add_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Removes a connection from the connections of
+ * a worker, when it is closed or migrated.
+ * @arg data The worker
+ * @arg conn The connection
+ */
+static void unlink_conn(worker_ev_userdata *data, conn_info *conn) {
+    if (conn->prev_conn)
+        conn->prev_conn->next_conn = conn->next_conn;
+    else
+        data->conns_list = conn->next_conn;
+    if (conn->next_conn) conn->next_conn->prev_conn = conn->prev_conn;
+    conn->prev_conn = conn->next_conn = NULL;
+    __atomic_sub_fetch(&data->conns, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Shrinks the grown buffers of the idle connections of a
+ * worker back to their initial size, so that a burst of large
+ * commands does not pin the memory of a connection for good.
+ * Only empty buffers are shrunk. With a ring, a read is always
+ * in flight on the buffers, so they are left alone.
+ * @arg data The worker
+ */
+static void shrink_idle_conns(worker_ev_userdata *data) {
+    if (data->ring) return;
+    for (conn_info *conn = data->conns_list; conn; conn = conn->next_conn) {
+        if (!conn->active || conn->offloaded || conn->ready || conn->parked) continue;
+        if (data->ticks - conn->last_tick < IDLE_TICKS) continue;
+        if (conn->input.buf_size > init_conn_buf_size &&
+                conn->input.read_cursor == conn->input.write_cursor) {
+            circbuf_shrink_buf(&conn->input, 1);
+        }
+        if (!conn->use_write_buf && conn->output.buf_size > init_conn_buf_size &&
+                conn->output.read_cursor == conn->output.write_cursor) {
+            circbuf_shrink_buf(&conn->output, 0);
+        }
+    }
+}
+
+
+/**
+ * Invoked by the event loop before it blocks waiting
+ * for events, so an idle worker does not hold back
+ * the filter manager.
+ */
+static void handle_worker_release(ev_loop *lp) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
+    handle.conn = NULL;
+    idle_update(&handle);
+}
+
+
+/**
+ * Invoked by the event loop once it wakes, before
+ * any events are handled.
+ */
+static void handle_worker_acquire(ev_loop *lp) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.cluster = data->netconf->cluster;
+    handle.arena = data->arena;
+    handle.conn = NULL;
+    periodic_update(&handle);
+}
+
+
 /**
  * Entry point for threads to join the networking
  * stack. This method blocks indefinitely until the
@@ -581,12 +1875,28 @@ void start_networking_worker(bloom_networking *netconf) {
     data.netconf = netconf;
     data.should_run = 1;
     data.inactive = NULL;
-
-    // Allocate our pipe
-    if (pipe(data.pipefd)) {
-        perror("failed to allocate worker pipes!");
+    data.udp_bufs = NULL;
+    if (init_arena(WORKER_ARENA_SIZE, &data.arena)) {
+        syslog(LOG_ERR, "Failed to allocate the arena of a worker!");
         return;
     }
+    data.conns = 0;
+    data.load = 0;
+    data.tick_bytes = 0;
+    data.ticks = 0;
+    data.last_active = 0;
+    data.ring = NULL;
+    data.pool = NULL;
+    data.pool_size = 0;
+    INIT_BLOOM_SPIN(&data.pool_lock);
+    data.index = 0;
+    data.offloaded = 0;
+    data.priority = 0;
+    data.conns_list = NULL;
+    data.parked = NULL;
+    data.quit = 0;
+    data.wake_parked = 0;
+    mpsc_init(&data.messages);
 
     // Create the event loop
     if (!(data.loop = ev_loop_new(netconf->ev_mode))) {
@@ -594,39 +1904,80 @@ void start_networking_worker(bloom_networking *netconf) {
         return;
     }
 
-    // Set the user data to be for this thread
+    // Set the user data to be for this thread, and
+    // checkpoint around each wait for events
     ev_set_userdata(data.loop, &data);
-
-    // Setup the pipe listener
-    ev_io_init(&data.pipe_client, handle_worker_notification,
-                data.pipefd[0], EV_READ);
-    ev_io_start(data.loop, &data.pipe_client);
+    ev_set_loop_release_cb(data.loop, handle_worker_release, handle_worker_acquire);
+
+    // Setup the watcher for messages from other threads
+    ev_async_init(&data.message_async, handle_worker_messages);
+    ev_async_start(data.loop, &data.message_async);
+
+    // Setup the ring for client IO
+    if (netconf->config->use_io_uring) {
+        int res = uring_init(URING_ENTRIES, &data.ring);
+        if (res) {
+            syslog(LOG_ERR, "Failed to setup io_uring, using libev! %s.", strerror(-res));
+            data.ring = NULL;
+        } else {
+            ev_io_init(&data.ring_client, handle_uring_completions,
+                        uring_fd(data.ring), EV_READ);
+            ev_io_start(data.loop, &data.ring_client);
+        }
+    }
 
     // Setup the periodic timers,
     ev_timer_init(&data.periodic, handle_periodic_timeout,
                 PERIODIC_TIME_SEC, 1);
     ev_timer_start(data.loop, &data.periodic);
 
+    // Setup the queue of connections that yielded,
+    // the watchers are started once one is queued
+    data.ready_head = data.ready_tail = NULL;
+    data.num_ready = 0;
+    ev_prepare_init(&data.ready_prepare, handle_ready_conns);
+    ev_idle_init(&data.ready_idle, handle_ready_idle);
+
     // Syncronize until netconf->threads is available
     barrier_wait(&netconf->thread_barrier);
 
     // Register this thread so we can accept connections
     assert(netconf->threads);
     pthread_t id = pthread_self();
-    for (int i=0; i < netconf->config->worker_threads; i++) {
+    for (int i=0; i < netconf->num_workers; i++) {
         if (pthread_equal(id, netconf->threads[i])) {
             // Provide a pointer to our data
             netconf->workers[i] = &data;
+            data.index = i;
+            data.priority = (i >= netconf->config->worker_threads);
+
+            // Start accepting on our own listener
+            if (netconf->worker_tcp_fds && !data.priority) {
+                ev_io_init(&data.tcp_client, handle_new_worker_client,
+                            netconf->worker_tcp_fds[i], EV_READ);
+                ev_io_start(data.loop, &data.tcp_client);
+            }
             break;
         }
     }
 
+    // Setup the UDP listener, the priority lane takes no datagrams
+    ev_io_init(&data.udp_client, handle_new_udp_mesg,
+                netconf->udp_listener_fd, EV_READ);
+    if (!data.priority) ev_io_start(data.loop, &data.udp_client);
+
     // Wait for everybody to be registered
     barrier_wait(&netconf->thread_barrier);
 
-    // Run the event loop
+    // Run the event loop. With busy polling, the loop does not sleep
+    // for a while after each client event, so the next request of a
+    // client is picked up without waiting to be woken.
     while (data.should_run) {
-        ev_run(data.loop, EVRUN_ONCE);
+        ev_tstamp busy_poll = netconf->config->busy_poll_usec / 1e6;
+        if (busy_poll && ev_now(data.loop) - data.last_active < busy_poll)
+            ev_run(data.loop, EVRUN_NOWAIT);
+        else
+            ev_run(data.loop, EVRUN_ONCE);
 
         // Free inactive connections
         conn_info *c = data.inactive;
@@ -638,11 +1989,49 @@ void start_networking_worker(bloom_networking *netconf) {
         data.inactive = NULL;
     }
 
+    // Wait for the executor to hand back our connections,
+    // it still wakes our loop until then
+    while (__atomic_load_n(&data.offloaded, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    // The kernel may still read into or write from the buffers
+    // of our connections, so the sockets are shut down to end
+    // the operations in flight, and the ring is drained before
+    // any connection is closed or the pool is freed
+    if (data.ring) {
+        ev_io_stop(data.loop, &data.ring_client);
+        for (conn_info *c = data.conns_list; c; c = c->next_conn) {
+            shutdown(c->client.fd, SHUT_RDWR);
+        }
+        uring_drain(data.ring);
+        uring_destroy(data.ring);
+        data.ring = NULL;
+    }
+    conn_info *c = data.inactive;
+    while (c) {
+        conn_info *n = c->next;
+        close_client_connection(c);
+        c = n;
+    }
+    data.inactive = NULL;
+
     // Cleanup after exit
+    ev_async_stop(data.loop, &data.message_async);
     ev_timer_stop(data.loop, &data.periodic);
-    ev_io_stop(data.loop, &data.pipe_client);
-    close(data.pipefd[0]);
-    close(data.pipefd[1]);
+    ev_prepare_stop(data.loop, &data.ready_prepare);
+    ev_idle_stop(data.loop, &data.ready_idle);
+    if (netconf->worker_tcp_fds) ev_io_stop(data.loop, &data.tcp_client);
+    ev_io_stop(data.loop, &data.udp_client);
+    if (data.udp_bufs) free(data.udp_bufs);
+    destroy_arena(data.arena);
+    while (data.pool) {
+        conn_info *c = data.pool;
+        data.pool = c->next;
+        circbuf_free(&c->input);
+        circbuf_free(&c->output);
+        free(c);
+    }
     ev_loop_destroy(data.loop);
 }
 
@@ -656,6 +2045,7 @@ void start_networking_worker(bloom_networking *netconf) {
 void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads) {
     // Store a reference to the threads
     netconf->threads = threads;
+    netconf->should_run = should_run;
 
     // Set the user data of the main loop to netconf
     ev_set_userdata(netconf->default_loop, netconf);
@@ -673,6 +2063,85 @@ void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *thre
 }
 
 
+/**
+ * Sets the hook invoked on the main loop when a
+ * reload is asked for. Must be set before entering
+ * the main loop.
+ * @arg netconf The configuration for the networking stack.
+ * @arg hook The hook
+ * @arg arg Passed to the hook
+ */
+void set_reload_hook(bloom_networking *netconf, reload_hook hook, void *arg) {
+    netconf->reload = hook;
+    netconf->reload_arg = arg;
+}
+
+
+/**
+ * Asks the main loop to invoke the reload hook. This
+ * is safe to call from a signal handler. The hook runs
+ * once the main loop is running.
+ * @arg netconf The configuration for the networking stack.
+ */
+void request_reload(bloom_networking *netconf) {
+    ev_async_send(netconf->default_loop, &netconf->reload_async);
+}
+
+
+/**
+ * Invoked on the main loop when a reload is asked for
+ */
+static void handle_reload(ev_loop *lp, ev_async *watcher, int ready_events) {
+    bloom_networking *netconf = watcher->data;
+    if (netconf->reload) netconf->reload(netconf->reload_arg);
+}
+
+
+/**
+ * Invoked when a new process connects to the handoff socket.
+ * The listeners are sent to it, and we stop accepting and
+ * shut down. The new process waits for us to exit before it
+ * loads the filters, so they are flushed first.
+ */
+static void handle_handoff(ev_loop *lp, ev_io *watcher, int ready_events) {
+    bloom_networking *netconf = watcher->data;
+    bloom_listeners l;
+    init_listeners(&l);
+    if (netconf->worker_tcp_fds) {
+        l.worker_fds = netconf->worker_tcp_fds;
+        l.num_worker_fds = netconf->config->worker_threads;
+    } else {
+        l.tcp_fd = netconf->tcp_client.fd;
+    }
+    l.udp_fd = netconf->udp_listener_fd;
+    l.unix_fd = netconf->unix_client.fd;
+    l.priority_fd = netconf->priority_client.fd;
+
+    int peer = send_listeners(watcher->fd, &l);
+    if (peer < 0) return;
+    syslog(LOG_WARNING, "Handed the listeners off to a new process! Exiting...");
+    netconf->handoff_peer = peer;
+
+    // Stop accepting. The clients wait in the backlog for the new process.
+    ev_io_stop(lp, watcher);
+    if (!netconf->worker_tcp_fds) ev_io_stop(lp, &netconf->tcp_client);
+    if (netconf->unix_client.fd >= 0) ev_io_stop(lp, &netconf->unix_client);
+    if (netconf->priority_client.fd >= 0) ev_io_stop(lp, &netconf->priority_client);
+    *netconf->should_run = 0;
+}
+
+
+/**
+ * Returns the number of worker threads to start, the
+ * worker_threads and the priority_workers.
+ * @arg netconf The config for the networking stack.
+ * @return The number of workers
+ */
+int networking_workers(bloom_networking *netconf) {
+    return netconf->num_workers;
+}
+
+
 /**
  * Shuts down all the connections
  * and listeners and prepares to exit.
@@ -680,29 +2149,46 @@ void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *thre
  * @arg threads A list of worker threads
  */
 int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
-    // Stop listening for new connections
-    ev_io_stop(netconf->default_loop, &netconf->tcp_client);
-    ev_io_stop(netconf->default_loop, &netconf->udp_client);
-    close(netconf->tcp_client.fd);
-    close(netconf->udp_client.fd);
+    // Stop waking the workers, before they exit
+    filtmgr_set_fault_hook(netconf->mgr, NULL, NULL);
 
     // Tell the threads to quit, async signal
-    for (int i=0; i < netconf->config->worker_threads; i++) {
-        write(netconf->workers[i]->pipefd[1], "q", 1);
+    for (int i=0; i < netconf->num_workers; i++) {
+        worker_ev_userdata *data = netconf->workers[i];
+        __atomic_store_n(&data->quit, 1, __ATOMIC_RELEASE);
+        ev_async_send(data->loop, &data->message_async);
     }
 
     // Wait for the threads to return
     pthread_t thread;
-    for (int i=0; i < netconf->config->worker_threads; i++) {
+    for (int i=0; i < netconf->num_workers; i++) {
         thread = threads[i];
         if (thread) pthread_join(thread, NULL);
     }
 
+    // Stop listening for new connections. The workers have
+    // stopped watching the per-worker and UDP sockets.
+    close_tcp_listener(netconf);
+    close_unix_listener(netconf);
+    close_priority_listener(netconf);
+    close(netconf->udp_listener_fd);
+    if (netconf->handoff_client.fd >= 0) {
+        ev_io_stop(netconf->default_loop, &netconf->handoff_client);
+        close(netconf->handoff_client.fd);
+        char *path = netconf->config->handoff_socket;
+        if (path[0] != '@') unlink(path);
+    }
+
+    // The workers no longer submit jobs
+    destroy_executor_pool(netconf);
+    if (netconf->tls) destroy_tls(netconf->tls);
+
     // TODO: Close all the client connections
     // ??? For now, we just leak the memory
     // since we are shutdown down anyways...
 
     // Shutdown the event loo
+    ev_async_stop(netconf->default_loop, &netconf->reload_async);
     ev_loop_destroy(netconf->default_loop);
 
     // Free the netconf
@@ -728,15 +2214,31 @@ static void close_client_connection(conn_info *conn) {
     // Stop the libev clients
     ev_io_stop(conn->thread_ev->loop, &conn->client);
     ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    if (conn->ready) dequeue_ready_conn(conn->thread_ev, conn);
+    if (conn->parked) unpark_conn(conn->thread_ev, conn);
+
+    // Let the handlers cleanup any state
+    if (conn->handler_state) {
+        bloom_conn_handler handle;
+        handle.config = conn->thread_ev->netconf->config;
+        handle.mgr = conn->thread_ev->netconf->mgr;
+        handle.cluster = conn->thread_ev->netconf->cluster;
+        handle.arena = conn->thread_ev->arena;
+        handle.conn = conn;
+        handle_client_close(&handle);
+    }
 
-    // Clear everything out
-    circbuf_free(&conn->input);
-    circbuf_free(&conn->output);
+    // No longer counts towards the load
+    unlink_conn(conn->thread_ev, conn);
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
+    if (conn->tls) {
+        tls_free_conn(conn->tls);
+        conn->tls = NULL;
+    }
     close(conn->client.fd);
-    free(conn);
+    put_conn(conn);
 }
 
 /**
@@ -744,6 +2246,11 @@ static void close_client_connection(conn_info *conn) {
  * to be closed when the event loop is finished.
  */
 static void deactivate_client_connection(conn_info *conn) {
+    // The executor leaves closing to the worker
+    if (conn->offloaded) {
+        conn->exec_failed = 1;
+        return;
+    }
     if (!conn->active) return;
     conn->active = 0;
     conn->next = conn->thread_ev->inactive;
@@ -759,8 +2266,9 @@ static void deactivate_client_connection(conn_info *conn) {
  * @return 0 on success.
  */
 int send_client_response(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
-    // Silently bail of the connection is not active
-    if (!conn->active) return 0;
+    // Silently bail if there is no connection (UDP) or it is not active
+    if (!conn || !conn->active) return 0;
+    latency_mark(LATENCY_PARSE);
 
     int send_bufs, res = 0;
     for (int offset=0; offset < num_bufs && res == 0; offset += IOV_MAX) {
@@ -768,7 +2276,7 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
         send_bufs = ((num_bufs - offset) <= IOV_MAX) ? (num_bufs - offset) : IOV_MAX;
 
         // Check if we are doing buffered writes
-        if (conn->use_write_buf) {
+        if (conn->use_write_buf || conn->batch_output) {
             res = send_client_response_buffered(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
         } else {
             res = send_client_response_direct(conn, response_buffers + offset, buf_sizes + offset, send_bufs);
@@ -776,8 +2284,18 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
     }
 
     // Disable the connection on error
-    if (res) deactivate_client_connection(conn);
-    return res;
+    if (res) {
+        deactivate_client_connection(conn);
+        return res;
+    }
+
+    // Send a large batch early, unless the executor is handling
+    // the commands. The worker sends its responses once it is done.
+    if (conn->batch_output && !conn->offloaded &&
+            circbuf_used_buf(&conn->output) >= BATCH_FLUSH_SIZE)
+        flush_client_output(conn);
+    latency_mark(LATENCY_SEND);
+    return 0;
 }
 
 
@@ -805,7 +2323,7 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
     }
 
     // Perform the write
-    ssize_t sent = writev(conn->client.fd, vectors, num_bufs);
+    ssize_t sent = conn_writev(conn, vectors, num_bufs);
     if (sent == total_bytes) return 0;
 
     // Check for a fatal error
@@ -848,6 +2366,23 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 }
 
 
+/**
+ * Allocates a buffer for input that wraps around the input
+ * buffer. It comes from the arena of the worker, which is
+ * reset once the commands are handled, and only falls back
+ * to the heap if the arena is out of memory.
+ * @arg conn The client connection
+ * @arg len The length of the buffer
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return The buffer
+ */
+static char* copy_input(conn_info *conn, int len, int *should_free) {
+    char *buf = arena_alloc((conn->arena) ? conn->arena : conn->thread_ev->arena, len);
+    *should_free = (buf == NULL);
+    return (buf) ? buf : malloc(len);
+}
+
+
 /**
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
@@ -866,7 +2401,23 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
     // First we need to find the terminator...
     char *term_addr = NULL;
-    if (conn->input.write_cursor < conn->input.read_cursor) {
+    if (conn->input.mirrored) {
+        /*
+         * The buffered bytes are contiguous from the read cursor,
+         * even if they wrap, so we never need to copy.
+         */
+        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
+                           terminator,
+                           circbuf_used_buf(&conn->input));
+        if (term_addr) {
+            *buf = conn->input.buffer + conn->input.read_cursor;
+            *buf_len = term_addr - *buf + 1;
+            *term_addr = '\0';
+            *should_free = 0;
+            conn->input.read_cursor = (term_addr - conn->input.buffer + 1) % conn->input.buf_size;
+        }
+
+    } else if (conn->input.write_cursor < conn->input.read_cursor) {
         /*
          * We need to scan from the read cursor to the end of
          * the buffer, and then from the start of the buffer to
@@ -899,7 +2450,7 @@ int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, in
             int start_size = term_addr - conn->input.buffer + 1;
             int end_size = conn->input.buf_size - conn->input.read_cursor;
             *buf_len = start_size + end_size;
-            *buf = malloc(*buf_len);
+            *buf = copy_input(conn, *buf_len, should_free);
 
             // Copy from the read cursor to the end
             memcpy(*buf, conn->input.buffer+conn->input.read_cursor, end_size);
@@ -907,8 +2458,6 @@ int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, in
             // Copy from the start to the terminator
             *term_addr = '\0';              // Add a null terminator
             memcpy(*buf+end_size, conn->input.buffer, start_size);
-
-            *should_free = 1;               // Must free, not in the buffer
             conn->input.read_cursor = start_size; // Push the read cursor forward
         }
 
@@ -944,11 +2493,310 @@ int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, in
 }
 
 
+/**
+ * Computes the load of a worker. This combines the number
+ * of connections with the recent input, so that a few bulk
+ * loading clients count as much as many light clients.
+ * @notes Thread safe, but may be inconsistent.
+ * @arg data The worker
+ * @return The load of the worker
+ */
+static uint64_t worker_load(worker_ev_userdata *data) {
+    uint64_t conns = __atomic_load_n(&data->conns, __ATOMIC_RELAXED);
+    return conns * CONN_LOAD_WEIGHT + __atomic_load_n(&data->load, __ATOMIC_RELAXED);
+}
+
+/**
+ * Finds the least loaded worker of a lane. Ties are broken
+ * round-robin, so that an idle server still spreads
+ * new connections across all the workers.
+ * @arg netconf The network configuration
+ * @arg priority Pick from the priority workers, instead of the others
+ * @arg load_out Optional output, set to the load of the worker
+ * @return The least loaded worker
+ */
+static worker_ev_userdata* least_loaded_worker(bloom_networking *netconf, int priority, uint64_t *load_out) {
+    int first = (priority) ? netconf->config->worker_threads : 0;
+    int workers = (priority) ? netconf->num_workers - first : netconf->config->worker_threads;
+    unsigned start = __atomic_fetch_add(&netconf->last_assign, 1, __ATOMIC_RELAXED);
+    worker_ev_userdata *best = NULL, *data;
+    uint64_t best_load = 0, load;
+    for (int i=0; i < workers; i++) {
+        data = netconf->workers[first + (start + i) % workers];
+        load = worker_load(data);
+        if (!best || load < best_load) {
+            best = data;
+            best_load = load;
+        }
+    }
+    if (load_out) *load_out = best_load;
+    return best;
+}
+
+/**
+ * Starts handling a connection on the current worker.
+ * Must be called from the thread of the worker.
+ * @arg data The worker
+ * @arg conn The connection
+ */
+static void schedule_conn(worker_ev_userdata *data, conn_info *conn) {
+    conn->thread_ev = data;
+    conn->last_tick = data->ticks;
+    link_conn(data, conn);
+    if (!data->ring) {
+        ev_io_start(data->loop, &conn->client);
+        return;
+    }
+
+    /*
+     * With a ring, the socket is made blocking so the kernel
+     * waits for data instead of failing the read with EAGAIN.
+     * Responses are always buffered, and sent once the
+     * commands of a read are handled.
+     */
+    int sock_flags = fcntl(conn->client.fd, F_GETFL, 0);
+    if (sock_flags >= 0) fcntl(conn->client.fd, F_SETFL, sock_flags & ~O_NONBLOCK);
+    conn->batch_output = 1;
+    uring_read_conn(conn);
+    uring_submit(data->ring);
+}
+
+/**
+ * Hands a connection to a worker through its message queue.
+ * Connections accepted in a burst share the wake up of the
+ * worker, rather than costing a write each.
+ * @arg data The worker
+ * @arg conn The connection, which must not be scheduled
+ */
+static void dispatch_conn(worker_ev_userdata *data, conn_info *conn) {
+    send_conn_message(data, conn, CONN_ACCEPT);
+}
+
+/**
+ * Returns a pointer to a slot the connection handlers can use
+ * to store per-connection state. The slot is NULL for new connections,
+ * and handle_client_close is invoked on close if it is set.
+ * @arg conn The client connection
+ * @return The address of the slot
+ */
+void **client_handler_state(bloom_conn_info *conn) {
+    return &conn->handler_state;
+}
+
+
+/**
+ * Returns the number of unread bytes that are
+ * buffered for a connection.
+ * @arg conn The client connection
+ * @return The number of buffered bytes
+ */
+int client_input_avail(bloom_conn_info *conn) {
+    return circbuf_used_buf(&conn->input);
+}
+
+
+/**
+ * Checks if the worker of a connection has other events
+ * waiting to be handled, such as input from other clients.
+ * While the executor handles the commands, checks if it
+ * has other jobs waiting instead.
+ * @arg conn The client connection
+ * @return 1 if other events are waiting, 0 otherwise.
+ */
+int client_worker_busy(bloom_conn_info *conn) {
+    if (conn->offloaded) return executor_pending(conn->thread_ev->netconf->exec) > 0;
+    return ev_pending_count(conn->thread_ev->loop) > 0;
+}
+
+
+/**
+ * Returns the backlog of the worker of a connection, the
+ * events waiting to be handled and the connections queued
+ * for another turn. While the executor handles the commands,
+ * returns the jobs it has waiting instead.
+ * @arg conn The client connection
+ * @return The number of events or jobs waiting.
+ */
+int client_worker_backlog(bloom_conn_info *conn) {
+    if (conn->offloaded) return executor_pending(conn->thread_ev->netconf->exec);
+    return ev_pending_count(conn->thread_ev->loop) + conn->thread_ev->num_ready;
+}
+
+
+/**
+ * Checks if a connection can be parked while a command
+ * waits on a filter being faulted in. Connections using
+ * io_uring always have a read in flight, so they can not.
+ * @arg conn The client connection
+ * @return 1 if the connection can be parked.
+ */
+int client_can_park(bloom_conn_info *conn) {
+    return conn && !conn->thread_ev->ring;
+}
+
+
+/**
+ * Takes over the socket of a connection, such as to stream
+ * a filter over it from another thread. The buffered output
+ * is sent first, and the connection is then closed without
+ * closing the socket. Connections using TLS or io_uring can
+ * not be taken over.
+ * @arg conn The client connection
+ * @arg input Output, a copy of the input that was not handled
+ * yet, to be freed by the caller. NULL if there is none.
+ * @arg input_len Output, the length of the input
+ * @return A blocking duplicate of the socket, or -1 on error.
+ */
+int client_take_socket(bloom_conn_info *conn, char **input, int *input_len) {
+    if (!conn || !conn->active || conn->tls || conn->thread_ev->ring) return -1;
+    int fd = dup(conn->client.fd);
+    if (fd < 0) return -1;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+        close(fd);
+        return -1;
+    }
+
+    // The responses so far go out before anything else
+    while (circbuf_used_buf(&conn->output)) {
+        struct iovec vectors[2];
+        int num_vectors;
+        circbuf_setup_writev_iovec(&conn->output, (struct iovec*)&vectors, &num_vectors);
+        ssize_t write_bytes = writev(fd, (struct iovec*)&vectors, num_vectors);
+        if (write_bytes < 0 && errno == EINTR) continue;
+        if (write_bytes <= 0) {
+            close(fd);
+            deactivate_client_connection(conn);
+            return -1;
+        }
+        circbuf_advance_read(&conn->output, write_bytes);
+    }
+
+    // Nothing else reads or writes the socket from here on. An
+    // offloaded connection is already stopped by its worker.
+    if (!conn->offloaded) {
+        ev_io_stop(conn->thread_ev->loop, &conn->client);
+        ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    }
+
+    *input = NULL;
+    *input_len = client_input_avail(conn);
+    if (*input_len) {
+        char *buf;
+        int should_free;
+        *input = malloc(*input_len);
+        if (*input && !extract_client_bytes(conn, *input_len, &buf, &should_free)) {
+            memcpy(*input, buf, *input_len);
+            if (should_free) free(buf);
+        } else {
+            free(*input);
+            *input = NULL;
+            *input_len = 0;
+        }
+    }
+    deactivate_client_connection(conn);
+    return fd;
+}
+
+
+/**
+ * Copies bytes from the head of the command buffer
+ * without consuming them. This allows the connection
+ * handlers to inspect a header before the whole
+ * message is available.
+ * @arg conn The client connection
+ * @arg out The buffer to copy to
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer bytes are available.
+ */
+int peek_client_bytes(bloom_conn_info *conn, char *out, int len) {
+    if (client_input_avail(conn) < len) return -1;
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (end_size >= len || conn->input.mirrored) {
+        memcpy(out, conn->input.buffer + conn->input.read_cursor, len);
+    } else {
+        memcpy(out, conn->input.buffer + conn->input.read_cursor, end_size);
+        memcpy(out + end_size, conn->input.buffer, len - end_size);
+    }
+    return 0;
+}
+
+
+/**
+ * Extracts a fixed number of bytes from the command buffer.
+ * This is like extract_to_terminator, but for length
+ * prefixed messages. The buffer may be modified by the caller.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer bytes are available.
+ */
+int extract_client_bytes(bloom_conn_info *conn, int len, char **buf, int *should_free) {
+    if (client_input_avail(conn) < len) return -1;
+    int end_size = conn->input.buf_size - conn->input.read_cursor;
+    if (end_size >= len || conn->input.mirrored) {
+        *buf = conn->input.buffer + conn->input.read_cursor;
+        *should_free = 0;
+    } else {
+        *buf = copy_input(conn, len, should_free);
+        memcpy(*buf, conn->input.buffer + conn->input.read_cursor, end_size);
+        memcpy(*buf + end_size, conn->input.buffer, len - end_size);
+    }
+
+    // Consume the bytes. The buffer is not written to until
+    // the next read, so resetting the cursors keeps buf valid.
+    circbuf_advance_read(&conn->input, len);
+    return 0;
+}
+
+
+/**
+ * Extracts everything up to the last terminator in the
+ * command buffer. This allows a long command to be handled
+ * in pieces as it arrives, without waiting for its end.
+ * @arg conn The client connection
+ * @arg terminator The terminator charactor to look for. Replaced by null terminator.
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg buf_len Output parameter, the length of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if the terminator is not found.
+ */
+int extract_to_last_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
+    circular_buffer *input = &conn->input;
+    char *start = input->buffer + input->read_cursor;
+    char *term_addr = NULL;
+    int len = 0;
+    if (input->mirrored || input->write_cursor >= input->read_cursor) {
+        term_addr = memrchr(start, terminator, circbuf_used_buf(input));
+        if (term_addr) len = term_addr - start + 1;
+    } else {
+        // Scan the wrapped bytes first, since they are the latest
+        term_addr = memrchr(input->buffer, terminator, input->write_cursor);
+        if (term_addr) {
+            len = input->buf_size - input->read_cursor + (term_addr - input->buffer) + 1;
+        } else {
+            term_addr = memrchr(start, terminator, input->buf_size - input->read_cursor);
+            if (term_addr) len = term_addr - start + 1;
+        }
+    }
+    if (!term_addr) return -1;
+
+    extract_client_bytes(conn, len, buf, should_free);
+    (*buf)[len - 1] = '\0';
+    *buf_len = len;
+    return 0;
+}
+
+
 /**
  * Sets the client socket options.
+ * @arg config The configuration
+ * @arg client_fd The client socket
+ * @arg is_tcp Set unless it is a unix socket
  * @return 0 on success, 1 on error.
  */
-static int set_client_sockopts(int client_fd) {
+static int set_client_sockopts(bloom_config *config, int client_fd, int is_tcp) {
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
@@ -961,6 +2809,7 @@ static int set_client_sockopts(int client_fd) {
         close(client_fd);
         return 1;
     }
+    if (!is_tcp) return 0;
 
     /**
      * Set TCP_NODELAY. This will allow us to send small response packets more
@@ -976,24 +2825,138 @@ static int set_client_sockopts(int client_fd) {
         syslog(LOG_WARNING, "Failed to set SO_KEEPALIVE on connection! %s.", strerror(errno));
     }
 
+    // Let reads spin on the device queue for a while before sleeping
+#ifdef SO_BUSY_POLL
+    if (config->tcp_busy_poll_usec && setsockopt(client_fd, SOL_SOCKET,
+                SO_BUSY_POLL, &config->tcp_busy_poll_usec, sizeof(int))) {
+        syslog(LOG_WARNING, "Failed to set SO_BUSY_POLL on connection! %s.", strerror(errno));
+    }
+#endif
+
+#ifdef TCP_QUICKACK
+    if (config->tcp_quickack && setsockopt(client_fd, IPPROTO_TCP,
+                TCP_QUICKACK, &flag, sizeof(int))) {
+        syslog(LOG_WARNING, "Failed to set TCP_QUICKACK on connection! %s.", strerror(errno));
+    }
+#endif
     return 0;
 }
 
 
 /**
- * Returns a new conn_info struct
+ * Re-enables the quick acks of a connection after a read.
+ * The kernel drops back to delayed acks on its own, so
+ * with tcp_quickack this is done on every read.
+ * @arg conn The connection
+ */
+static void rearm_quickack(conn_info *conn) {
+#ifdef TCP_QUICKACK
+    if (!conn->is_tcp || !conn->thread_ev->netconf->config->tcp_quickack) return;
+    int flag = 1;
+    setsockopt(conn->client.fd, IPPROTO_TCP, TCP_QUICKACK, &flag, sizeof(int));
+#else
+    (void)conn;
+#endif
+}
+
+
+/**
+ * Accepts a client from a listening socket, and
+ * prepares a new conn_info struct for it. The caller
+ * must schedule the connection on a worker.
+ * @arg listen_fd The listening socket
+ * @arg data The worker whose pool the connection is taken from
+ * @return The new connection, or NULL on error.
+ */
+static conn_info* accept_client(int listen_fd, worker_ev_userdata *data) {
+    // Accept the client connection
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd = accept(listen_fd,
+                        (struct sockaddr*)&client_addr,
+                        &client_addr_len);
+
+    // Check for an error. The client may have gone away
+    // before the accept, which is not worth logging.
+    if (client_fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+        }
+        return NULL;
+    }
+
+    // Setup the socket
+    int is_tcp = client_addr.ss_family == AF_INET;
+    if (set_client_sockopts(data->netconf->config, client_fd, is_tcp)) {
+        return NULL;
+    }
+
+    // The TCP clients start with a TLS handshake
+    bloom_tls_conn *tls = NULL;
+    if (is_tcp && data->netconf->tls) {
+        tls = tls_new_conn(data->netconf->tls, client_fd);
+        if (!tls) {
+            close(client_fd);
+            return NULL;
+        }
+    }
+
+    // Debug info
+    if (is_tcp) {
+        struct sockaddr_in *in_addr = (struct sockaddr_in*)&client_addr;
+        syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+                inet_ntoa(in_addr->sin_addr), ntohs(in_addr->sin_port), client_fd);
+    } else
+        syslog(LOG_DEBUG, "Accepted unix socket connection. [%d]", client_fd);
+
+    // Get the associated conn object
+    conn_info *conn = get_conn(data);
+    conn->is_tcp = is_tcp;
+    conn->tls = tls;
+
+    // Initialize the libev stuff
+    ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
+    ev_io_init(&conn->write_client, handle_client_writebuf, client_fd, EV_WRITE);
+    return conn;
+}
+
+/**
+ * Returns a new conn_info struct, reusing
+ * one from the pool of the worker if possible.
+ * @arg data The worker
  */
-static conn_info* get_conn() {
+static conn_info* get_conn(worker_ev_userdata *data) {
+    // Take from the pool
+    LOCK_BLOOM_SPIN(&data->pool_lock);
+    conn_info *conn = data->pool;
+    if (conn) {
+        data->pool = conn->next;
+        data->pool_size--;
+    }
+    UNLOCK_BLOOM_SPIN(&data->pool_lock);
+
     // Allocate space
-    conn_info *conn = malloc(sizeof(conn_info));
+    if (!conn) {
+        conn = malloc(sizeof(conn_info));
+        conn->input.buffer = NULL;
+        conn->output.buffer = NULL;
+    }
 
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
-
-    // Prepare the buffers
-    circbuf_init(&conn->input);
-    circbuf_init(&conn->output);
+    conn->batch_output = 0;
+    conn->handler_state = NULL;
+    conn->ready = 0;
+    conn->offloaded = 0;
+    conn->arena = NULL;
+    conn->parked = 0;
+    conn->tls = NULL;
+
+    // Prepare the buffers. The input buffer is mirrored
+    // so that commands can be parsed in place.
+    if (!conn->input.buffer) circbuf_init_mirrored(&conn->input);
+    if (!conn->output.buffer) circbuf_init(&conn->output);
 
     // Store a reference to the conn object
     conn->client.data = conn;
@@ -1002,6 +2965,38 @@ static conn_info* get_conn() {
     return conn;
 }
 
+/**
+ * Returns a closed connection to the pool of its
+ * worker, or frees it if the pool is full.
+ * Buffers that have grown are not kept, so that the
+ * pool does not hold on to large amounts of memory.
+ * @arg conn The connection
+ */
+static void put_conn(conn_info *conn) {
+    worker_ev_userdata *data = conn->thread_ev;
+    circular_buffer *bufs[] = {&conn->input, &conn->output};
+    for (int i=0; i < 2; i++) {
+        if (bufs[i]->buf_size != init_conn_buf_size) circbuf_free(bufs[i]);
+        bufs[i]->read_cursor = 0;
+        bufs[i]->write_cursor = 0;
+    }
+
+    int pooled = 0;
+    LOCK_BLOOM_SPIN(&data->pool_lock);
+    if (data->pool_size < CONN_POOL_SIZE) {
+        conn->next = data->pool;
+        data->pool = conn;
+        data->pool_size++;
+        pooled = 1;
+    }
+    UNLOCK_BLOOM_SPIN(&data->pool_lock);
+    if (pooled) return;
+
+    circbuf_free(&conn->input);
+    circbuf_free(&conn->output);
+    free(conn);
+}
+
 /*
  * Methods for manipulating our circular buffers
  */
@@ -1010,13 +3005,70 @@ static conn_info* get_conn() {
 static void circbuf_init(circular_buffer *buf) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
-    buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
+    buf->buf_size = init_conn_buf_size * sizeof(char);
     buf->buffer = malloc(buf->buf_size);
+    buf->mirrored = 0;
+}
+
+/**
+ * Maps a buffer of the given size twice, back to back, so
+ * that the bytes at buffer[size + i] are buffer[i]. Data that
+ * wraps around the end of the buffer is then always contiguous.
+ * @arg size The size of the buffer, a multiple of the page size
+ * @return The buffer, or NULL if it could not be mapped.
+ */
+static char* circbuf_map_mirror(uint32_t size) {
+#ifdef __linux__
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0 || size % page_size) return NULL;
+
+    int fd = memfd_create("bloomd_conn", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve the whole range, then map the file into both halves
+    char *base = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * (size_t)size);
+        close(fd);
+        return NULL;
+    }
+
+    // The mappings keep the file alive
+    close(fd);
+    return base;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+// Initializes a mirrored buffer, falling back to a plain one
+static void circbuf_init_mirrored(circular_buffer *buf) {
+    buf->read_cursor = 0;
+    buf->write_cursor = 0;
+    buf->buf_size = init_conn_buf_size * sizeof(char);
+    buf->buffer = circbuf_map_mirror(buf->buf_size);
+    buf->mirrored = 1;
+    if (!buf->buffer) circbuf_init(buf);
 }
 
 // Frees a buffer
 static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
+    if (buf->buffer) {
+        if (buf->mirrored)
+            munmap(buf->buffer, 2 * (size_t)buf->buf_size);
+        else
+            free(buf->buffer);
+    }
     buf->buffer = NULL;
 }
 
@@ -1031,12 +3083,34 @@ static uint64_t circbuf_avail_buf(circular_buffer *buf) {
     return avail_buf;
 }
 
+// Calculates the number of buffered bytes
+static uint64_t circbuf_used_buf(circular_buffer *buf) {
+    if (buf->write_cursor < buf->read_cursor) {
+        return buf->buf_size - buf->read_cursor + buf->write_cursor;
+    }
+    return buf->write_cursor - buf->read_cursor;
+}
+
 // Grows the circular buffer to make room for more data
 static void circbuf_grow_buf(circular_buffer *buf) {
-    int new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
-    char *new_buf = malloc(new_size);
+    int new_size = buf->buf_size * conn_buf_multiplier * sizeof(char);
+    char *new_buf = NULL;
     int bytes_written = 0;
 
+    // Mirrored buffers stay mirrored, and the used bytes are contiguous
+    if (buf->mirrored) new_buf = circbuf_map_mirror(new_size);
+    if (new_buf) {
+        bytes_written = circbuf_used_buf(buf);
+        memcpy(new_buf, buf->buffer + buf->read_cursor, bytes_written);
+        munmap(buf->buffer, 2 * (size_t)buf->buf_size);
+        buf->buffer = new_buf;
+        buf->buf_size = new_size;
+        buf->read_cursor = 0;
+        buf->write_cursor = bytes_written;
+        return;
+    }
+    new_buf = malloc(new_size);
+
     // Check if the write has wrapped around
     if (buf->write_cursor < buf->read_cursor) {
         // Copy from the read cursor to the end of the buffer
@@ -1061,7 +3135,11 @@ static void circbuf_grow_buf(circular_buffer *buf) {
     }
 
     // Update the buffer locations and everything
-    free(buf->buffer);
+    if (buf->mirrored) {
+        munmap(buf->buffer, 2 * (size_t)buf->buf_size);
+        buf->mirrored = 0;
+    } else
+        free(buf->buffer);
     buf->buffer = new_buf;
     buf->buf_size = new_size;
     buf->read_cursor = 0;
@@ -1069,11 +3147,24 @@ static void circbuf_grow_buf(circular_buffer *buf) {
 }
 
 
+// Replaces an empty buffer with one of the initial size
+static void circbuf_shrink_buf(circular_buffer *buf, int mirrored) {
+    circbuf_free(buf);
+    if (mirrored)
+        circbuf_init_mirrored(buf);
+    else
+        circbuf_init(buf);
+}
+
+
 // Initializes a pair of iovectors to be used for readv
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors) {
     // Check if we've wrapped around
     *num_vectors = 1;
-    if (buf->write_cursor < buf->read_cursor) {
+    if (buf->mirrored) {
+        vectors[0].iov_base = buf->buffer + buf->write_cursor;
+        vectors[0].iov_len = circbuf_avail_buf(buf);
+    } else if (buf->write_cursor < buf->read_cursor) {
         vectors[0].iov_base = buf->buffer + buf->write_cursor;
         vectors[0].iov_len = buf->read_cursor - buf->write_cursor - 1;
     } else {
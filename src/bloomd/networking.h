@@ -2,6 +2,8 @@
 #define BLOOM_NETWORKING_H
 #include "config.h"
 #include "filter_manager.h"
+#include "cluster.h"
+#include "handoff.h"
 
 // Network configuration struct
 typedef struct bloom_networking bloom_networking;
@@ -11,9 +13,13 @@ typedef struct conn_info bloom_conn_info;
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg cluster The cluster to pass up to the connection handlers, may be NULL
+ * @arg inherited Listeners taken from a previous process, used instead
+ * of binding new ones. The listeners that are used are set to -1.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out);
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_cluster *cluster,
+        bloom_listeners *inherited, bloom_networking **netconf_out);
 
 /**
  * Entry point for the main thread to start accepting
@@ -23,6 +29,29 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
  */
 void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads);
 
+/**
+ * Invoked on the main loop to reload the configuration
+ */
+typedef void (*reload_hook)(void *arg);
+
+/**
+ * Sets the hook invoked on the main loop when a
+ * reload is asked for. Must be set before entering
+ * the main loop.
+ * @arg netconf The configuration for the networking stack.
+ * @arg hook The hook
+ * @arg arg Passed to the hook
+ */
+void set_reload_hook(bloom_networking *netconf, reload_hook hook, void *arg);
+
+/**
+ * Asks the main loop to invoke the reload hook. This
+ * is safe to call from a signal handler. The hook runs
+ * once the main loop is running.
+ * @arg netconf The configuration for the networking stack.
+ */
+void request_reload(bloom_networking *netconf);
+
 /**
  * Entry point for threads to join the networking
  * stack. This method blocks indefinitely until the
@@ -31,6 +60,14 @@ void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *thre
  */
 void start_networking_worker(bloom_networking *netconf);
 
+/**
+ * Returns the number of worker threads to start, the
+ * worker_threads and the priority_workers.
+ * @arg netconf The config for the networking stack.
+ * @return The number of workers
+ */
+int networking_workers(bloom_networking *netconf);
+
 /**
  * Shuts down all the connections
  * and listeners and prepares to exit.
@@ -46,7 +83,7 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads);
 
 /**
  * Sends a response to a client.
- * @arg conn The client connection
+ * @arg conn The client connection, or NULL to discard the response
  * @arg response_buffers A list of response buffers to send
  * @arg buf_sizes A list of the buffer sizes
  * @arg num_bufs The number of response buffers
@@ -71,4 +108,101 @@ int send_client_response(bloom_conn_info *conn, char **response_buffers, int *bu
  */
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Returns a pointer to a slot the connection handlers can use
+ * to store per-connection state. The slot is NULL for new connections,
+ * and handle_client_close is invoked on close if it is set.
+ * @arg conn The client connection
+ * @return The address of the slot
+ */
+void **client_handler_state(bloom_conn_info *conn);
+
+/**
+ * Copies bytes from the head of the command buffer
+ * without consuming them. This allows the connection
+ * handlers to inspect a header before the whole
+ * message is available.
+ * @arg conn The client connection
+ * @arg out The buffer to copy to
+ * @arg len The number of bytes to copy
+ * @return 0 on success, -1 if fewer bytes are available.
+ */
+int peek_client_bytes(bloom_conn_info *conn, char *out, int len);
+
+/**
+ * Extracts a fixed number of bytes from the command buffer.
+ * This is like extract_to_terminator, but for length
+ * prefixed messages. The buffer may be modified by the caller.
+ * @arg conn The client connection
+ * @arg len The number of bytes to extract
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if fewer bytes are available.
+ */
+int extract_client_bytes(bloom_conn_info *conn, int len, char **buf, int *should_free);
+
+/**
+ * Extracts everything up to the last terminator in the
+ * command buffer. This allows a long command to be handled
+ * in pieces as it arrives, without waiting for its end.
+ * @arg conn The client connection
+ * @arg terminator The terminator charactor to look for. Replaced by null terminator.
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg buf_len Output parameter, the length of the buffer.
+ * @arg should_free Output parameter, should the buffer be freed by the caller.
+ * @return 0 on success, -1 if the terminator is not found.
+ */
+int extract_to_last_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
+
+/**
+ * Returns the number of unread bytes that are
+ * buffered for a connection.
+ * @arg conn The client connection
+ * @return The number of buffered bytes
+ */
+int client_input_avail(bloom_conn_info *conn);
+
+/**
+ * Checks if the worker of a connection has other events
+ * waiting to be handled, such as input from other clients.
+ * While the executor handles the commands, checks if it
+ * has other jobs waiting instead.
+ * @arg conn The client connection
+ * @return 1 if other events are waiting, 0 otherwise.
+ */
+int client_worker_busy(bloom_conn_info *conn);
+
+/**
+ * Returns the backlog of the worker of a connection, the
+ * events waiting to be handled and the connections queued
+ * for another turn. While the executor handles the commands,
+ * returns the jobs it has waiting instead.
+ * @arg conn The client connection
+ * @return The number of events or jobs waiting.
+ */
+int client_worker_backlog(bloom_conn_info *conn);
+
+/**
+ * Checks if a connection can be parked while a command
+ * waits on a filter being faulted in. Connections using
+ * io_uring always have a read in flight, so they can not.
+ * @arg conn The client connection
+ * @return 1 if the connection can be parked.
+ */
+int client_can_park(bloom_conn_info *conn);
+
+/**
+ * Takes over the socket of a connection, such as to stream
+ * a filter over it from another thread. The buffered output
+ * is sent first, and the connection is then closed without
+ * closing the socket. Connections using TLS or io_uring can
+ * not be taken over.
+ * @arg conn The client connection
+ * @arg input Output, a copy of the input that was not handled
+ * yet, to be freed by the caller. NULL if there is none.
+ * @arg input_len Output, the length of the input
+ * @return A blocking duplicate of the socket, or -1 on error.
+ */
+int client_take_socket(bloom_conn_info *conn, char **input, int *input_len);
+
 #endif
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "numa.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/*
+ * The topology is read once at startup, and only read after
+ */
+static int num_nodes = 1;
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+
+/*
+ * Static declarations
+ */
+static int read_list(const char *path, cpu_set_t *set);
+
+/**
+ * Reads the NUMA topology. Must be called
+ * before any threads are pinned.
+ * @return The number of nodes, at least 1.
+ */
+int numa_topology_init(void) {
+    cpu_set_t online;
+    num_nodes = 1;
+    if (read_list("/sys/devices/system/node/online", &online)) {
+        syslog(LOG_INFO, "NUMA topology is not available. Using a single node.");
+        return num_nodes;
+    }
+
+    // Nodes are numbered from 0, but may have gaps. The CPUs of
+    // a node without CPUs are left empty, so it is never pinned to.
+    char path[64];
+    for (int node=0; node < NUMA_MAX_NODES; node++) {
+        CPU_ZERO(&node_cpus[node]);
+        if (!CPU_ISSET(node, &online)) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        read_list(path, &node_cpus[node]);
+        num_nodes = node + 1;
+    }
+    syslog(LOG_INFO, "Found %d NUMA nodes.", num_nodes);
+    return num_nodes;
+}
+
+/**
+ * Returns the number of NUMA nodes.
+ * @return The number of nodes, 1 until the topology is read.
+ */
+int numa_nodes(void) {
+    return num_nodes;
+}
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * @arg node The node
+ * @return 0 on success, -1 if the node has no CPUs
+ * or the thread could not be pinned.
+ */
+int numa_bind_thread(int node) {
+    if (node < 0 || node >= num_nodes || !CPU_COUNT(&node_cpus[node])) return -1;
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]);
+    if (res) {
+        syslog(LOG_WARNING, "Failed to pin thread to NUMA node %d. %s", node, strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the node the calling thread is running on.
+ * @return The node, or 0 if it is not known.
+ */
+int numa_this_node(void) {
+#ifdef SYS_getcpu
+    unsigned int cpu, node;
+    if (!syscall(SYS_getcpu, &cpu, &node, NULL) && node < (unsigned int)num_nodes)
+        return node;
+#endif
+    return 0;
+}
+
+/**
+ * Pins the calling thread to a list of CPUs.
+ * @arg list The list of CPUs
+ * @arg index The index of the thread, which is pinned to
+ * a single CPU of the list, wrapping around. -1 to pin
+ * to all the CPUs of the list.
+ * @return 0 on success, -1 if the list is empty or
+ * malformed, or the thread could not be pinned.
+ */
+int numa_pin_thread(const char *list, int index) {
+    int cpus[NUMA_MAX_CPUS];
+    int num = numa_parse_cpus(list, cpus, NUMA_MAX_CPUS);
+    if (num <= 0) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (index >= 0)
+        CPU_SET(cpus[index % num], &set);
+    else
+        for (int i=0; i < num; i++) CPU_SET(cpus[i], &set);
+
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (res) {
+        syslog(LOG_WARNING, "Failed to pin thread to CPUs '%s'. %s", list, strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads a sysfs list of ranges, such as "0-3,8-11".
+ * @arg path The file to read
+ * @arg set Output, the listed values
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int read_list(const char *path, cpu_set_t *set) {
+    CPU_ZERO(set);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char buf[4096];
+    char *line = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!line) return -1;
+
+    int cpus[NUMA_MAX_CPUS];
+    int num = numa_parse_cpus(line, cpus, NUMA_MAX_CPUS);
+    if (num < 0) return -1;
+    for (int i=0; i < num && i < NUMA_MAX_CPUS; i++) {
+        if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], set);
+    }
+    return 0;
+}
+
+#else
+
+/*
+ * The NUMA topology and thread affinity are only
+ * read and set on Linux. Elsewhere the machine is
+ * treated as a single node that is never pinned to.
+ */
+int numa_topology_init(void) {
+    return 1;
+}
+
+int numa_nodes(void) {
+    return 1;
+}
+
+int numa_bind_thread(int node) {
+    (void)node;
+    return -1;
+}
+
+int numa_this_node(void) {
+    return 0;
+}
+
+int numa_pin_thread(const char *list, int index) {
+    (void)list;
+    (void)index;
+    return -1;
+}
+
+#endif
+
+/**
+ * Parses a list of CPUs, such as "0-3,8-11".
+ * @arg list The list
+ * @arg cpus Output, the listed CPUs in order. May be NULL.
+ * @arg max The most CPUs to output
+ * @return The number of CPUs listed, or -1 if the
+ * list is malformed or lists a CPU beyond NUMA_MAX_CPUS.
+ */
+int numa_parse_cpus(const char *list, int *cpus, int max) {
+    if (!list) return -1;
+    int num = 0;
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        if (!isdigit((unsigned char)*p)) return -1;
+        long start = strtol(p, &end, 10);
+        long last = start;
+        if (*end == '-') {
+            if (!isdigit((unsigned char)end[1])) return -1;
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < start || last >= NUMA_MAX_CPUS) return -1;
+        for (long i=start; i <= last; i++, num++) {
+            if (cpus && num < max) cpus[num] = i;
+        }
+
+        if (*end == ',') end++;
+        else if (*end && *end != '\n') return -1;
+        p = end;
+    }
+    return num;
+}
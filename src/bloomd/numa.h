@@ -0,0 +1,74 @@
+#ifndef BLOOM_NUMA_H
+#define BLOOM_NUMA_H
+
+/*
+ * The NUMA topology of the machine, read from sysfs. The
+ * workers are pinned to the CPUs of one node each, and the
+ * layers of a filter are placed on the node of the worker
+ * that first faults it in. Machines without NUMA, or where
+ * sysfs can not be read, are treated as a single node.
+ *
+ * Threads can also be pinned to an explicit list of CPUs,
+ * written as ranges such as "0-3,8-11".
+ */
+
+/**
+ * The most NUMA nodes that are used. Nodes
+ * beyond this are ignored.
+ */
+#define NUMA_MAX_NODES 64
+
+/**
+ * The most CPUs that can be listed.
+ */
+#define NUMA_MAX_CPUS 1024
+
+/**
+ * Reads the NUMA topology. Must be called
+ * before any threads are pinned.
+ * @return The number of nodes, at least 1.
+ */
+int numa_topology_init(void);
+
+/**
+ * Returns the number of NUMA nodes.
+ * @return The number of nodes, 1 until the topology is read.
+ */
+int numa_nodes(void);
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * @arg node The node
+ * @return 0 on success, -1 if the node has no CPUs
+ * or the thread could not be pinned.
+ */
+int numa_bind_thread(int node);
+
+/**
+ * Returns the node the calling thread is running on.
+ * @return The node, or 0 if it is not known.
+ */
+int numa_this_node(void);
+
+/**
+ * Parses a list of CPUs, such as "0-3,8-11".
+ * @arg list The list
+ * @arg cpus Output, the listed CPUs in order. May be NULL.
+ * @arg max The most CPUs to output
+ * @return The number of CPUs listed, or -1 if the
+ * list is malformed or lists a CPU beyond NUMA_MAX_CPUS.
+ */
+int numa_parse_cpus(const char *list, int *cpus, int max);
+
+/**
+ * Pins the calling thread to a list of CPUs.
+ * @arg list The list of CPUs
+ * @arg index The index of the thread, which is pinned to
+ * a single CPU of the list, wrapping around. -1 to pin
+ * to all the CPUs of the list.
+ * @return 0 on success, -1 if the list is empty or
+ * malformed, or the thread could not be pinned.
+ */
+int numa_pin_thread(const char *list, int index);
+
+#endif
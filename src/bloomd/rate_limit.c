@@ -0,0 +1,35 @@
+#include <time.h>
+#include "rate_limit.h"
+
+/**
+ * Returns the time used by the rate limits.
+ * @return The monotonic time in nanoseconds
+ */
+uint64_t rate_limit_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Takes tokens from a rate limit, if it has any left.
+ * Safe to call from many threads at once.
+ * @arg limit The rate limit
+ * @arg rate The tokens earned per second. A rate of 0 is unlimited.
+ * @arg cost The tokens to take
+ * @arg now The time from rate_limit_now
+ * @return 1 if the tokens were taken, 0 if the bucket is empty.
+ */
+int rate_limit_take(bloom_rate_limit *limit, uint64_t rate, uint64_t cost, uint64_t now) {
+    if (!rate) return 1;
+    uint64_t spend = cost * 1000000000ULL / rate;
+    uint64_t full_at = __atomic_load_n(&limit->full_at, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        // An empty bucket is a full second of debt
+        if (full_at >= now + RATE_LIMIT_BURST_NSEC) return 0;
+        next = ((full_at > now) ? full_at : now) + spend;
+    } while (!__atomic_compare_exchange_n(&limit->full_at, &full_at, next, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
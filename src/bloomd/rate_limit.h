@@ -0,0 +1,44 @@
+#ifndef BLOOM_RATE_LIMIT_H
+#define BLOOM_RATE_LIMIT_H
+#include <stdint.h>
+
+/*
+ * A rate limit is a token bucket that holds one second of its
+ * rate. Rather than counting tokens, it keeps the time at which
+ * the bucket would be full again, so it is a single word that
+ * many threads can take from with a compare and swap, without
+ * a timer to refill it.
+ *
+ * A take is allowed as long as the bucket is not empty, even if
+ * it costs more than is left, and the debt is paid back before
+ * the next one. A command with more keys than the rate is then
+ * not refused forever, but the rate still holds on average.
+ */
+typedef struct {
+    uint64_t full_at;   // Monotonic nanoseconds at which the bucket is full, atomic
+} bloom_rate_limit;
+
+/**
+ * The burst a rate limit allows, as the time it takes
+ * to earn the tokens of a full bucket.
+ */
+#define RATE_LIMIT_BURST_NSEC 1000000000ULL
+
+/**
+ * Returns the time used by the rate limits.
+ * @return The monotonic time in nanoseconds
+ */
+uint64_t rate_limit_now();
+
+/**
+ * Takes tokens from a rate limit, if it has any left.
+ * Safe to call from many threads at once.
+ * @arg limit The rate limit
+ * @arg rate The tokens earned per second. A rate of 0 is unlimited.
+ * @arg cost The tokens to take
+ * @arg now The time from rate_limit_now
+ * @return 1 if the tokens were taken, 0 if the bucket is empty.
+ */
+int rate_limit_take(bloom_rate_limit *limit, uint64_t rate, uint64_t cost, uint64_t now);
+
+#endif
@@ -0,0 +1,2149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "replication.h"
+#include "filter.h"
+#include "art.h"
+
+/**
+ * The most bytes of the log sent in one write
+ */
+#define REPL_BATCH_SIZE (1 << 20)
+
+/**
+ * How long the threads wait before checking
+ * if they should exit, in milliseconds.
+ */
+#define REPL_POLL_MSEC 250
+
+/**
+ * An idle primary sends a ping this often,
+ * and a replica reconnects if it hears nothing
+ * for REPL_TIMEOUT_SEC.
+ */
+#define REPL_PING_SEC 1
+#define REPL_TIMEOUT_SEC 10
+
+/**
+ * How long a replica waits before reconnecting
+ */
+#define REPL_RETRY_SEC 1
+
+/**
+ * The most replicas served at once
+ */
+#define REPL_MAX_REPLICAS 16
+
+/**
+ * How many times a replica waits REPL_WAIT_USEC
+ * for the pending delete of a filter it loads
+ */
+#define REPL_WAIT_RETRIES 1000
+#define REPL_WAIT_USEC 10000
+
+/**
+ * The log starts a new generation this often, if it moved,
+ * and keeps the start of this many generations. A replica
+ * that falls out of the log is caught up if it is within
+ * the kept generations, and bootstrapped otherwise.
+ */
+#define REPL_ROLL_SEC 60
+#define REPL_GENERATIONS 1024
+
+/**
+ * Folder of the data dir the files of a
+ * bootstrapping replica are staged in
+ */
+static const char STAGING_DIR[] = "replica.tmp";
+
+/**
+ * Folder of the data dir imported filters
+ * are staged in
+ */
+static const char IMPORT_DIR[] = "import.tmp";
+
+struct bloom_repl_log {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // Signaled when lines are written
+    char *buf;
+    uint64_t size;
+    uint64_t head;          // Position of the next line
+    uint64_t tail;          // Oldest position still in the buffer
+    uint64_t id;            // Identifies the log to reconnecting replicas
+    uint32_t gen;           // Generation stamped on the changed pages, atomic
+    uint64_t gen_starts[REPL_GENERATIONS];  // Position each kept generation started at
+};
+
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    bloom_repl_log *log;
+    int *should_run;
+    int listen_fd;
+} repl_thread_args;
+
+/*
+ * State of the thread serving a replica
+ */
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    bloom_repl_log *log;
+    int *should_run;
+    int fd;
+    int done;               // Set when the thread exits, atomic
+    pthread_t thread;
+} repl_sender;
+
+/*
+ * Buffered reads of the replication stream
+ */
+typedef struct {
+    int fd;
+    int *should_run;
+    bloom_filtmgr *mgr;
+    char *buf;
+    int size;
+    int start;              // Start of the unread data
+    int end;                // End of the unread data
+    uint64_t last_read;     // Time of the last data
+    const char *staging;    // Folder files are staged in, NULL for STAGING_DIR
+} repl_reader;
+
+/*
+ * Runs of changed pages being copied to a replica
+ */
+typedef struct {
+    char *filter_name;
+    uint32_t *num_layers;   // The layers of the filter being copied
+    char *buf;
+    int size;
+    int len;                // The bytes buffered
+} repl_pages;
+
+/*
+ * The files of an exported filter. They are open
+ * before the export starts, so a later snapshot
+ * does not replace them.
+ */
+struct bloom_export {
+    char *filter_name;
+    int num_files;
+    char **rels;            // Names of the files in the folder
+    int *fds;
+    uint64_t *sizes;
+};
+
+/*
+ * State of the thread of an export or import
+ */
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int fd;
+    bloom_export *export;   // NULL for an import
+    char *filter_name;      // The name to import the filter as
+    char *input;            // Input that followed the import command
+    int input_len;
+} repl_transfer;
+
+/*
+ * Exports and imports run on threads of their own,
+ * which are counted so the shutdown can wait on them.
+ */
+static int TRANSFERS_RUN = 1;
+static int NUM_TRANSFERS = 0;
+
+/*
+ * Static declarations
+ */
+static void log_write(bloom_repl_log *log, char *line, int len);
+static int log_wait(bloom_repl_log *log, uint64_t offset, int msec);
+static int format_create(char *buf, int size, char *filter_name, bloom_config *config);
+static int parse_create_options(bloom_config *config, char *options);
+static int key_needs_escape(char *key, int len);
+static int unescape_key(char *key);
+static int apply_keys(bloom_filtmgr *mgr, char *cmd, char *filter_name, char *keys, int escaped);
+static int apply_create(bloom_config *config, bloom_filtmgr *mgr, char *filter_name, char *options);
+static int apply_merge(bloom_filtmgr *mgr, char *cmd, char *filter_name, char *sources);
+static void wait_pending(bloom_filtmgr *mgr);
+static int bind_repl_listener(bloom_config *config, int *fd_out);
+static void* repl_thread_main(void *in);
+static void* sender_main(void *in);
+static int bootstrap_replica(repl_sender *s);
+static int catch_up_replica(repl_sender *s, uint32_t gen);
+static int catch_up_filter(repl_sender *s, char *filter_name, uint32_t gen, repl_pages *pages, int *replaced);
+static int copy_pages_cb(void *data, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, unsigned char *bytes, uint64_t len);
+static int send_filter_cb(void *data, char *filter_name, bloom_filter *filter);
+static int send_files_cb(void *data, char *filter_name, bloom_filter *filter);
+static int send_tree(repl_sender *s, char *filter_name, char *root, char *rel);
+static int send_file(repl_sender *s, char *filter_name, char *path, char *rel);
+static int send_fd(int sock, int fd, char *filter_name, char *rel, uint64_t size, int *should_run);
+static int open_export_cb(void *data, char *filter_name, bloom_filter *filter);
+static int start_transfer(repl_transfer *t);
+static void* transfer_main(void *in);
+static int send_export(bloom_export *export, int fd);
+static int import_filter(repl_transfer *t);
+static int send_all(int fd, char *buf, int len);
+static void* replica_main(void *in);
+static int connect_primary(bloom_config *config);
+static int replicate(bloom_config *config, bloom_filtmgr *mgr, repl_reader *r, uint64_t *id, uint64_t *offset);
+static int is_cmd(char *line, int len, const char *cmd);
+static int read_line(repl_reader *r, char **line, int *len);
+static int read_more(repl_reader *r);
+static int read_bytes(repl_reader *r, char *out, uint64_t len);
+static int apply_pages(bloom_filtmgr *mgr, repl_reader *r, char *args);
+static void drop_unseen_filters(bloom_filtmgr *mgr, art_tree *seen);
+static int stage_file(bloom_config *config, repl_reader *r, char *filter_name, char *rel, uint64_t size);
+static int splice_file(repl_reader *r, int fd, uint64_t *size);
+static int install_filter(bloom_config *config, bloom_filtmgr *mgr, const char *staging, char *filter_name, int replace);
+static void drop_all_filters(bloom_filtmgr *mgr);
+static char* staged_path(bloom_config *config, const char *staging, char *filter_name);
+static int make_dirs(char *path);
+static void remove_tree(char *path);
+static uint64_t monotonic_sec(void);
+static int filter_exists(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Creates a replication log.
+ * @arg size The size of the log in bytes. Replicas that fall
+ * further behind than this must be bootstrapped again.
+ * @arg log Output, the new log
+ * @return 0 on success.
+ */
+int init_repl_log(uint64_t size, bloom_repl_log **log) {
+    bloom_repl_log *l = calloc(1, sizeof(bloom_repl_log));
+    if (!l) return -1;
+    l->buf = malloc(size);
+    if (!l->buf) {
+        free(l);
+        return -1;
+    }
+    l->size = size;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, NULL);
+
+    // Replicas of an earlier run must not resume from our positions
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    l->id = ((uint64_t)ts.tv_sec << 20) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 40);
+    if (!l->id) l->id = 1;
+
+    // The first generation starts with the log
+    l->gen = 1;
+    *log = l;
+    return 0;
+}
+
+/**
+ * Destroys a replication log
+ * @arg log The log
+ */
+void destroy_repl_log(bloom_repl_log *log) {
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->cond);
+    free(log->buf);
+    free(log);
+}
+
+/**
+ * Records keys applied to a filter. Keys holding a space,
+ * a newline or a zero byte can not be sent in a line as
+ * they are, so a batch with any of them is sent with the
+ * "bx" or "deletex" command, whose keys are escaped.
+ * @arg log The log
+ * @arg cmd The command that applies the keys, "b" or "delete"
+ * @arg filter_name The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Optional, only the keys with a result of 1 are
+ * recorded, so keys that did not change the filter are skipped.
+ */
+void repl_log_keys(bloom_repl_log *log, const char *cmd, char *filter_name, char **keys, int *key_lens,
+        int num_keys, char *result) {
+    int cmd_len = strlen(cmd), name_len = strlen(filter_name);
+    int len = cmd_len + 1 + name_len, included = 0, escape = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (result && result[i] != 1) continue;
+        int key_len = (key_lens) ? key_lens[i] : (int)strlen(keys[i]);
+        len += 1 + key_len;
+        if (!escape) escape = key_needs_escape(keys[i], key_len);
+        included++;
+    }
+    if (!included) return;
+
+    // Escaping at most triples the keys
+    if (escape) len = 3 * len + 1;
+
+    // Build the line, then copy it into the log at once
+    char stack_buf[4096];
+    char *line = (len + 1 <= (int)sizeof(stack_buf)) ? stack_buf : malloc(len + 1);
+    if (!line) {
+        syslog(LOG_ERR, "Failed to allocate a replication line for filter '%s'!", filter_name);
+        return;
+    }
+    char *pos = line;
+    memcpy(pos, cmd, cmd_len);
+    pos += cmd_len;
+    if (escape) *pos++ = 'x';
+    *pos++ = ' ';
+    memcpy(pos, filter_name, name_len);
+    pos += name_len;
+    for (int i=0; i < num_keys; i++) {
+        if (result && result[i] != 1) continue;
+        int key_len = (key_lens) ? key_lens[i] : (int)strlen(keys[i]);
+        *pos++ = ' ';
+        if (!escape) {
+            memcpy(pos, keys[i], key_len);
+            pos += key_len;
+            continue;
+        }
+        for (int j=0; j < key_len; j++) {
+            unsigned char c = keys[i][j];
+            if (c == '%' || c == ' ' || c == '\n' || c == '\0') {
+                pos += sprintf(pos, "%%%02X", c);
+            } else
+                *pos++ = c;
+        }
+    }
+    *pos++ = '\n';
+    log_write(log, line, pos - line);
+    if (line != stack_buf) free(line);
+}
+
+/**
+ * Records the creation of a filter.
+ * @arg log The log
+ * @arg filter_name The name of the filter
+ * @arg config The config the filter was created with
+ */
+void repl_log_create(bloom_repl_log *log, char *filter_name, bloom_config *config) {
+    char line[512];
+    int len = format_create(line, sizeof(line), filter_name, config);
+    if (len < (int)sizeof(line)) log_write(log, line, len);
+}
+
+/**
+ * Records a command on a filter, such as a drop.
+ * @arg log The log
+ * @arg cmd The command, "drop", "clear", "freeze", "compact",
+ * "shrink", "reset" or "alias_drop"
+ * @arg filter_name The name of the filter
+ */
+void repl_log_filter_cmd(bloom_repl_log *log, const char *cmd, char *filter_name) {
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%s %s\n", cmd, filter_name);
+    if (len < (int)sizeof(line)) log_write(log, line, len);
+}
+
+/**
+ * Records the change of an alias.
+ * @arg log The log
+ * @arg cmd The command, "alias" or "alias_swap"
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the filter it resolves to
+ */
+void repl_log_alias(bloom_repl_log *log, const char *cmd, char *alias, char *filter_name) {
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%s %s %s\n", cmd, alias, filter_name);
+    if (len < (int)sizeof(line)) log_write(log, line, len);
+}
+
+/**
+ * Reads lines from the log.
+ * @arg log The log
+ * @arg offset The position to read from. Updated to the
+ * end of what was read.
+ * @arg buf Output buffer. A read may end within a line.
+ * @arg buf_size The size of the buffer
+ * @return The number of bytes read, or -1 if the
+ * position is no longer in the log.
+ */
+int repl_log_read(bloom_repl_log *log, uint64_t *offset, char *buf, int buf_size) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t pos = *offset;
+    if (pos < log->tail || pos > log->head) {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    uint64_t avail = log->head - pos;
+    int n = (avail < (uint64_t)buf_size) ? (int)avail : buf_size;
+    uint64_t start = pos % log->size;
+    uint64_t first = (start + n <= log->size) ? (uint64_t)n : log->size - start;
+    memcpy(buf, log->buf + start, first);
+    memcpy(buf + first, log->buf, n - first);
+    pthread_mutex_unlock(&log->lock);
+
+    *offset = pos + n;
+    return n;
+}
+
+/**
+ * Returns the end of the log, which is the position
+ * of the next line to be written.
+ * @arg log The log
+ * @return The position
+ */
+uint64_t repl_log_head(bloom_repl_log *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t head = log->head;
+    pthread_mutex_unlock(&log->lock);
+    return head;
+}
+
+/**
+ * Returns the clock of the log, which holds the generation
+ * stamped on the pages that change in the filters, see
+ * bloomf_track_changes.
+ * @arg log The log
+ * @return The clock, valid until the log is destroyed
+ */
+uint32_t* repl_log_clock(bloom_repl_log *log) {
+    return &log->gen;
+}
+
+/**
+ * Starts a new generation of the log, if lines were
+ * written since the current one started. The replication
+ * thread rolls the log every minute.
+ * @arg log The log
+ * @return 1 if a new generation was started.
+ */
+int repl_log_roll(bloom_repl_log *log) {
+    pthread_mutex_lock(&log->lock);
+    uint32_t gen = log->gen;
+    int moved = log->head != log->gen_starts[gen % REPL_GENERATIONS];
+    if (moved) {
+        // The generation moves on before its start is taken, so a page
+        // stamped with the old one may be logged in the new one, but
+        // never the other way round
+        __atomic_store_n(&log->gen, gen + 1, __ATOMIC_RELEASE);
+        log->gen_starts[(gen + 1) % REPL_GENERATIONS] = log->head;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return moved;
+}
+
+/**
+ * Finds the oldest generation that may have stamped the
+ * pages changed by the lines from a position on, which is
+ * the one before the generation the position was written in.
+ * @arg log The log
+ * @arg offset The position
+ * @arg gen Output, the generation
+ * @return 0 on success, -1 if the generation of the
+ * position is no longer kept.
+ */
+int repl_log_generation(bloom_repl_log *log, uint64_t offset, uint32_t *gen) {
+    pthread_mutex_lock(&log->lock);
+    int res = -1;
+    uint32_t oldest = (log->gen > REPL_GENERATIONS) ? log->gen - REPL_GENERATIONS + 1 : 1;
+    for (uint32_t g = log->gen; offset <= log->head && g >= oldest; g--) {
+        if (log->gen_starts[g % REPL_GENERATIONS] <= offset) {
+            *gen = g - 1;
+            res = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return res;
+}
+
+/**
+ * Applies a replicated line to the filter manager.
+ * @arg config The configuration, used for created filters
+ * @arg mgr The filter manager
+ * @arg line The line, without the newline. It is modified.
+ * @arg len The length of the line
+ * @return 0 on success, -1 if the line is malformed.
+ * Commands that fail on the replica, such as a set of a
+ * filter that was already dropped, are not errors.
+ */
+int repl_apply_line(bloom_config *config, bloom_filtmgr *mgr, char *line, int len) {
+    line[len] = 0;
+    char *args = line;
+    char *cmd = strsep(&args, " ");
+    char *filter_name = strsep(&args, " ");
+    if (!filter_name || !*filter_name) return -1;
+
+    if (!strcmp(cmd, "b") || !strcmp(cmd, "delete")) {
+        return apply_keys(mgr, cmd, filter_name, args, 0);
+    } else if (!strcmp(cmd, "bx") || !strcmp(cmd, "deletex")) {
+        return apply_keys(mgr, cmd, filter_name, args, 1);
+    } else if (!strcmp(cmd, "create")) {
+        return apply_create(config, mgr, filter_name, args);
+    } else if (!strcmp(cmd, "drop")) {
+        filtmgr_drop_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "clear")) {
+        filtmgr_clear_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "freeze")) {
+        filtmgr_freeze_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "compact")) {
+        filtmgr_compact_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "shrink")) {
+        filtmgr_shrink_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "reset")) {
+        filtmgr_reset_filter(mgr, filter_name);
+    } else if (!strcmp(cmd, "union") || !strcmp(cmd, "intersect")) {
+        return apply_merge(mgr, cmd, filter_name, args);
+    } else if (!strcmp(cmd, "alias")) {
+        if (!args) return -1;
+        filtmgr_create_alias(mgr, filter_name, args);
+    } else if (!strcmp(cmd, "alias_swap")) {
+        if (!args) return -1;
+        filtmgr_swap_alias(mgr, filter_name, args);
+    } else if (!strcmp(cmd, "alias_drop")) {
+        filtmgr_drop_alias(mgr, filter_name);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends the files of a filter over a connection, followed by
+ * a load, in the stream format used to bootstrap a replica.
+ * Used to migrate a filter to another node.
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg fd The connection
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the connection failed, -3 if a snapshot is in
+ * progress, -4 if the filter is in-memory.
+ */
+int repl_send_filter(bloom_config *config, bloom_filtmgr *mgr, int fd, char *filter_name) {
+    repl_sender s;
+    memset(&s, 0, sizeof(s));
+    s.config = config;
+    s.mgr = mgr;
+    s.fd = fd;
+    return filtmgr_copy_filter(mgr, filter_name, send_files_cb, &s);
+}
+
+/**
+ * Sends the lines of a log from a position up
+ * to its head over a connection.
+ * @arg log The log
+ * @arg fd The connection
+ * @arg offset The position to send from, updated
+ * @return 0 on success, -1 if the position is no longer
+ * in the log, -2 if the connection failed.
+ */
+int repl_send_log(bloom_repl_log *log, int fd, uint64_t *offset) {
+    char *batch = malloc(REPL_BATCH_SIZE);
+    int n, res = 0;
+    while ((n = repl_log_read(log, offset, batch, REPL_BATCH_SIZE)) > 0) {
+        if (send_all(fd, batch, n)) {
+            res = -2;
+            break;
+        }
+    }
+    if (n < 0) res = -1;
+    free(batch);
+    return res;
+}
+
+/**
+ * Receives a filter sent with repl_send_filter, and applies
+ * the log lines that follow it. The sender asks for the result
+ * of the load with a "ready" line, and ends the stream with a
+ * "done" line, each answered with "ok" or "error".
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg fd The connection
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the receive should stop.
+ * @arg filter_name Output, the name of the received filter,
+ * to be freed by the caller. Only set on success.
+ * @return 0 once the stream is done, -1 on failure.
+ */
+int repl_receive_filter(bloom_config *config, bloom_filtmgr *mgr, int fd, int *should_run, char **filter_name) {
+    repl_reader r;
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.should_run = should_run;
+    r.mgr = mgr;
+    r.size = REPL_BATCH_SIZE;
+    r.buf = malloc(r.size);
+    r.last_read = monotonic_sec();
+
+    char *name = NULL, *line;
+    int len, loaded = 0, res = -1;
+    while (!read_line(&r, &line, &len)) {
+        if (is_cmd(line, len, "ready")) {
+            if (send_all(fd, (loaded) ? "ok\n" : "error\n", (loaded) ? 3 : 6) || !loaded) break;
+            continue;
+        } else if (is_cmd(line, len, "done")) {
+            if (loaded && !send_all(fd, "ok\n", 3)) res = 0;
+            break;
+        }
+
+        // The log lines are applied once the filter is loaded
+        if (!is_cmd(line, len, "file") && !is_cmd(line, len, "load")) {
+            if (!loaded || repl_apply_line(config, mgr, line, len)) {
+                syslog(LOG_WARNING, "Bad line in a filter migration!");
+                break;
+            }
+            continue;
+        }
+
+        // Every file is of the one filter that is loaded
+        line[len] = 0;
+        char *args = line;
+        char *cmd = strsep(&args, " ");
+        char *file_filter = strsep(&args, " ");
+        if (!file_filter || loaded || (name && strcmp(name, file_filter))) break;
+        if (!name) name = strdup(file_filter);
+        if (!strcmp(cmd, "load")) {
+            loaded = !strchr(name, '/') && !install_filter(config, mgr, NULL, name, 1);
+            continue;
+        }
+        char *rel = strsep(&args, " ");
+        if (!rel || !args) break;
+        if (stage_file(config, &r, file_filter, rel, strtoull(args, NULL, 10))) break;
+    }
+    free(r.buf);
+    filtmgr_client_offline(mgr);
+
+    // Clean up the files of a filter that was not loaded
+    if (name && !loaded && !strchr(name, '/')) {
+        char *staged = staged_path(config, NULL, name);
+        remove_tree(staged);
+        free(staged);
+    }
+    if (res) {
+        free(name);
+    } else {
+        *filter_name = name;
+    }
+    return res;
+}
+
+/**
+ * Writes a snapshot of a filter, and opens its files to
+ * be exported. Sets and checks continue meanwhile, as with
+ * the snapshot command.
+ * @arg mgr The filter manager
+ * @arg filter_name The name of the filter
+ * @arg export Output, the export
+ * @return 0 on success, or the errors of filtmgr_export_filter.
+ */
+int repl_open_export(bloom_filtmgr *mgr, char *filter_name, bloom_export **export) {
+    bloom_export *e = calloc(1, sizeof(bloom_export));
+    if (!e) return -5;
+    e->filter_name = strdup(filter_name);
+    int res = filtmgr_export_filter(mgr, filter_name, open_export_cb, e);
+    if (res) {
+        repl_free_export(e);
+        return res;
+    }
+    *export = e;
+    return 0;
+}
+
+/**
+ * Frees an export that was not started
+ * @arg export The export
+ */
+void repl_free_export(bloom_export *export) {
+    for (int i=0; i < export->num_files; i++) {
+        close(export->fds[i]);
+        free(export->rels[i]);
+    }
+    free(export->rels);
+    free(export->fds);
+    free(export->sizes);
+    free(export->filter_name);
+    free(export);
+}
+
+/**
+ * Starts a thread that sends an export over a connection, in
+ * the stream format of a migration, and then closes it. The
+ * files are sent with sendfile, straight from the page cache.
+ * @arg export The export, freed by the thread
+ * @arg fd The connection, closed by the thread
+ * @return 0 if the thread was started. The export
+ * and the connection are freed either way.
+ */
+int repl_start_export(bloom_export *export, int fd) {
+    repl_transfer *t = calloc(1, sizeof(repl_transfer));
+    if (!t) {
+        repl_free_export(export);
+        close(fd);
+        return -1;
+    }
+    t->fd = fd;
+    t->export = export;
+    return start_transfer(t);
+}
+
+/**
+ * Starts a thread that receives a stream sent by an export
+ * over a connection, and loads it as a new filter. The thread
+ * answers with "Done" or "Import failed", and closes the
+ * connection.
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg filter_name The name to import the filter as
+ * @arg fd The connection, closed by the thread
+ * @arg input The start of the stream that was already read,
+ * freed by the thread. May be NULL.
+ * @arg input_len The length of the input
+ * @return 0 if the thread was started. The input
+ * and the connection are freed either way.
+ */
+int repl_start_import(bloom_config *config, bloom_filtmgr *mgr, char *filter_name,
+        int fd, char *input, int input_len) {
+    repl_transfer *t = calloc(1, sizeof(repl_transfer));
+    if (!t) {
+        free(input);
+        close(fd);
+        return -1;
+    }
+    t->config = config;
+    t->mgr = mgr;
+    t->fd = fd;
+    t->filter_name = strdup(filter_name);
+    t->input = input;
+    t->input_len = input_len;
+    return start_transfer(t);
+}
+
+/**
+ * Stops the exports and imports that are running, and
+ * waits for their threads to exit. Must be called before
+ * the filter manager is destroyed.
+ */
+void repl_stop_transfers(void) {
+    __atomic_store_n(&TRANSFERS_RUN, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&NUM_TRANSFERS, __ATOMIC_ACQUIRE))
+        usleep(REPL_WAIT_USEC);
+}
+
+/**
+ * Starts the replication thread of a primary, which serves
+ * the replicas on the replication port. The replication log
+ * is created and attached to the filter manager before this
+ * returns, so it must be called before the workers start.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_replication_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not a primary
+    if (config->replication_port <= 0) return 0;
+
+    int fd;
+    if (bind_repl_listener(config, &fd)) return 0;
+
+    bloom_repl_log *log;
+    if (init_repl_log((uint64_t)config->replication_buffer_mb * 1024 * 1024, &log)) {
+        syslog(LOG_ERR, "Failed to allocate the replication log!");
+        close(fd);
+        return 0;
+    }
+    filtmgr_set_repl_log(mgr, log);
+
+    repl_thread_args *args = malloc(sizeof(repl_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->log = log;
+    args->should_run = should_run;
+    args->listen_fd = fd;
+    pthread_create(t, NULL, repl_thread_main, args);
+    return 1;
+}
+
+/**
+ * Starts the replica thread, which connects to the primary
+ * set by replicate_from and applies its replication stream.
+ * Reconnects until asked to exit.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_replica_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not a replica
+    if (!config->replicate_from) return 0;
+
+    repl_thread_args *args = malloc(sizeof(repl_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->log = NULL;
+    args->should_run = should_run;
+    args->listen_fd = -1;
+    pthread_create(t, NULL, replica_main, args);
+    return 1;
+}
+
+/**
+ * Copies a line into the log. Lines that do not fit
+ * in the log at all are skipped, and every replica has
+ * to be bootstrapped again.
+ */
+static void log_write(bloom_repl_log *log, char *line, int len) {
+    pthread_mutex_lock(&log->lock);
+    if ((uint64_t)len > log->size) {
+        syslog(LOG_WARNING, "Replication line of %d bytes is larger than the log!", len);
+        log->head += len;
+        log->tail = log->head;
+    } else {
+        uint64_t start = log->head % log->size;
+        uint64_t first = (start + len <= log->size) ? (uint64_t)len : log->size - start;
+        memcpy(log->buf + start, line, first);
+        memcpy(log->buf, line + first, len - first);
+        log->head += len;
+        if (log->head - log->tail > log->size) log->tail = log->head - log->size;
+    }
+    pthread_cond_broadcast(&log->cond);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * Waits for lines to be written after a position.
+ * @return 1 if there are lines to read.
+ */
+static int log_wait(bloom_repl_log *log, uint64_t offset, int msec) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += msec / 1000;
+    ts.tv_nsec += (long)(msec % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    while (log->head == offset) {
+        if (pthread_cond_timedwait(&log->cond, &log->lock, &ts) == ETIMEDOUT) break;
+    }
+    int ready = log->head != offset;
+    pthread_mutex_unlock(&log->lock);
+    return ready;
+}
+
+/**
+ * Formats the create line of a filter, with the
+ * options of the create command.
+ * @return The length of the line
+ */
+static int format_create(char *buf, int size, char *filter_name, bloom_config *config) {
+    return snprintf(buf, size, "create %s capacity=%llu prob=%.17g scale=%d reduction=%.17g in_memory=%d "
+            "layout=%s hash=%s window=%d generations=%d freezable=%d summary=%llu shards=%d warmup=%s pinned=%d\n",
+            filter_name, (unsigned long long)config->initial_capacity,
+            config->default_probability, config->scale_size,
+            config->probability_reduction, config->in_memory,
+            layout_name(config->layout), hash_scheme_name(config->hash_scheme),
+            config->rotate_window, config->rotate_generations, config->freezable,
+            (unsigned long long)config->summary_capacity, config->shards,
+            warmup_name(config->warmup), config->pinned);
+}
+
+// Parses the options written by format_create
+static int parse_create_options(bloom_config *config, char *options) {
+    char *param;
+    while ((param = strsep(&options, " "))) {
+        if (!*param) continue;
+        int match = 0;
+        char name[16];
+        match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
+        match |= sscanf(param, "prob=%lf", &config->default_probability);
+        match |= sscanf(param, "scale=%d", &config->scale_size);
+        match |= sscanf(param, "reduction=%lf", &config->probability_reduction);
+        match |= sscanf(param, "in_memory=%d", &config->in_memory);
+        match |= sscanf(param, "window=%d", &config->rotate_window);
+        match |= sscanf(param, "generations=%d", &config->rotate_generations);
+        match |= sscanf(param, "freezable=%d", &config->freezable);
+        match |= sscanf(param, "summary=%llu", (unsigned long long*)&config->summary_capacity);
+        match |= sscanf(param, "shards=%d", &config->shards);
+        match |= sscanf(param, "pinned=%d", &config->pinned);
+        if (sscanf(param, "layout=%15s", name) == 1) {
+            config->layout = layout_from_name(name);
+            match = 1;
+        }
+        if (sscanf(param, "hash=%15s", name) == 1) {
+            config->hash_scheme = hash_scheme_from_name(name);
+            match = 1;
+        }
+        if (sscanf(param, "warmup=%15s", name) == 1) {
+            config->warmup = warmup_from_name(name);
+            match = 1;
+        }
+        if (!match) return -1;
+    }
+    return 0;
+}
+
+// Applies a set or delete of keys, which are escaped for "bx" and "deletex"
+static int apply_keys(bloom_filtmgr *mgr, char *cmd, char *filter_name, char *keys, int escaped) {
+    if (!keys) return -1;
+
+    // Split the keys in place
+    int num_keys = 1;
+    for (char *c = keys; *c; c++) {
+        if (*c == ' ') num_keys++;
+    }
+    char **key_list = malloc(num_keys * sizeof(char*));
+    int *key_lens = malloc(num_keys * sizeof(int));
+    char *result = malloc(num_keys);
+    if (!key_list || !key_lens || !result) {
+        syslog(LOG_ERR, "Failed to allocate the replicated keys of filter '%s'!", filter_name);
+        num_keys = 0;
+        goto LEAVE;
+    }
+    int num = 0;
+    char *key;
+    while ((key = strsep(&keys, " "))) {
+        if (!*key) continue;
+        key_lens[num] = (escaped) ? unescape_key(key) : (int)strlen(key);
+        if (key_lens[num] <= 0) {
+            num = 0;
+            break;
+        }
+        key_list[num++] = key;
+    }
+
+    // With fault_retry, a filter that is not in memory is only queued,
+    // so fault it in here rather than lose the keys
+    int res = -6;
+    for (int tries=0; num && res == -6 && tries < 2; tries++) {
+        if (tries) filtmgr_warm_filter(mgr, filter_name);
+        if (*cmd == 'b')
+            res = filtmgr_set_keys_len(mgr, filter_name, key_list, key_lens, num, result);
+        else
+            res = filtmgr_delete_keys_len(mgr, filter_name, key_list, key_lens, num, result);
+    }
+    num_keys = num;
+
+LEAVE:
+    free(key_list);
+    free(key_lens);
+    free(result);
+    return (num_keys) ? 0 : -1;
+}
+
+/**
+ * Returns if a key must be escaped to be sent in a line,
+ * as it holds a space, a newline or a zero byte.
+ */
+static int key_needs_escape(char *key, int len) {
+    for (int i=0; i < len; i++) {
+        if (key[i] == ' ' || key[i] == '\n' || key[i] == '\0') return 1;
+    }
+    return 0;
+}
+
+/**
+ * Decodes the %XX escapes of a key in place.
+ * @return The length of the key, or -1 if an escape is malformed.
+ */
+static int unescape_key(char *key) {
+    char *out = key;
+    for (char *in = key; *in; in++) {
+        if (*in != '%') {
+            *out++ = *in;
+            continue;
+        }
+        if (!isxdigit((unsigned char)in[1]) || !isxdigit((unsigned char)in[2])) return -1;
+        char hex[3] = {in[1], in[2], 0};
+        *out++ = (char)strtol(hex, NULL, 16);
+        in += 2;
+    }
+    return out - key;
+}
+
+// Creates a filter, waiting out a pending delete of the same name
+static int apply_create(bloom_config *config, bloom_filtmgr *mgr, char *filter_name, char *options) {
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    if (!custom) {
+        syslog(LOG_ERR, "Failed to allocate the config of filter '%s'!", filter_name);
+        return -1;
+    }
+    memcpy(custom, config, sizeof(bloom_config));
+    if (options && parse_create_options(custom, options)) {
+        free(custom);
+        return -1;
+    }
+
+    int res = -3;
+    for (int i=0; res == -3 && i < REPL_WAIT_RETRIES; i++) {
+        res = filtmgr_create_filter(mgr, filter_name, custom);
+        if (res == -3) wait_pending(mgr);
+    }
+    if (res) {
+        free(custom);
+        if (res != -1) syslog(LOG_WARNING, "Replica failed to create filter '%s'.", filter_name);
+    }
+    return 0;
+}
+
+// Merges the sources into a new filter, waiting out a pending delete
+static int apply_merge(bloom_filtmgr *mgr, char *cmd, char *filter_name, char *sources) {
+    if (!sources) return -1;
+    int num_sources = 1;
+    for (char *c = sources; *c; c++) {
+        if (*c == ' ') num_sources++;
+    }
+    char **source_list = malloc(num_sources * sizeof(char*));
+    if (!source_list) {
+        syslog(LOG_ERR, "Failed to allocate the sources of filter '%s'!", filter_name);
+        return -1;
+    }
+    int num = 0;
+    char *source;
+    while ((source = strsep(&sources, " "))) {
+        if (*source) source_list[num++] = source;
+    }
+
+    int res = -3;
+    for (int i=0; num && res == -3 && i < REPL_WAIT_RETRIES; i++) {
+        res = filtmgr_merge_filters(mgr, filter_name, source_list, num, *cmd == 'i');
+        if (res == -3) wait_pending(mgr);
+    }
+    if (num && res && res != -4) syslog(LOG_WARNING, "Replica failed to merge filter '%s'.", filter_name);
+    free(source_list);
+    return (num) ? 0 : -1;
+}
+
+// Lets the vacuum thread finish pending deletes
+static void wait_pending(bloom_filtmgr *mgr) {
+    filtmgr_client_offline(mgr);
+    usleep(REPL_WAIT_USEC);
+    filtmgr_client_checkpoint(mgr);
+}
+
+/**
+ * Creates the listening socket for the replicas
+ * @arg config The configuration
+ * @arg fd_out Output, the listening socket
+ * @return 0 on success.
+ */
+static int bind_repl_listener(bloom_config *config, int *fd_out) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(config->replication_port);
+    if (inet_pton(AF_INET, config->bind_address, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", config->bind_address);
+        return 1;
+    }
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on replication socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    if (listen(fd, 16) != 0) {
+        syslog(LOG_ERR, "Failed to listen on replication socket! Err: %s", strerror(errno));
+        goto ERROR;
+    }
+    *fd_out = fd;
+    return 0;
+
+ERROR:
+    close(fd);
+    return 1;
+}
+
+/**
+ * Accepts the replicas, and starts a thread
+ * to serve each of them.
+ */
+static void* repl_thread_main(void *in) {
+    repl_thread_args *args = in;
+    bloom_config *config = args->config;
+    bloom_filtmgr *mgr = args->mgr;
+    bloom_repl_log *log = args->log;
+    int *should_run = args->should_run;
+    int listen_fd = args->listen_fd;
+    free(args);
+
+    syslog(LOG_INFO, "Replication thread started. Port: %d.", config->replication_port);
+    repl_sender *senders[REPL_MAX_REPLICAS] = {NULL};
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    uint64_t last_roll = monotonic_sec();
+    while (*should_run) {
+        if (monotonic_sec() - last_roll >= REPL_ROLL_SEC) {
+            repl_log_roll(log);
+            last_roll = monotonic_sec();
+        }
+
+        // Reap the threads of replicas that left
+        for (int i=0; i < REPL_MAX_REPLICAS; i++) {
+            if (senders[i] && __atomic_load_n(&senders[i]->done, __ATOMIC_ACQUIRE)) {
+                pthread_join(senders[i]->thread, NULL);
+                free(senders[i]);
+                senders[i] = NULL;
+            }
+        }
+
+        if (poll(&pfd, 1, REPL_POLL_MSEC) <= 0) continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        int slot = -1;
+        for (int i=0; i < REPL_MAX_REPLICAS && slot < 0; i++) {
+            if (!senders[i]) slot = i;
+        }
+        if (slot < 0) {
+            syslog(LOG_WARNING, "Too many replicas! Rejecting a replica.");
+            close(fd);
+            continue;
+        }
+
+        repl_sender *s = calloc(1, sizeof(repl_sender));
+        s->config = config;
+        s->mgr = mgr;
+        s->log = log;
+        s->should_run = should_run;
+        s->fd = fd;
+        senders[slot] = s;
+        pthread_create(&s->thread, NULL, sender_main, s);
+    }
+
+    for (int i=0; i < REPL_MAX_REPLICAS; i++) {
+        if (!senders[i]) continue;
+        pthread_join(senders[i]->thread, NULL);
+        free(senders[i]);
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+/**
+ * Serves a replica. The replica sends the log id and
+ * position it has replicated to, and is either resumed
+ * from there or bootstrapped. The lines of the log are
+ * then sent as they are written.
+ */
+static void* sender_main(void *in) {
+    repl_sender *s = in;
+
+    int optval = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    struct timeval tv = {REPL_TIMEOUT_SEC, 0};
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Read the hello of the replica
+    char hello[128];
+    int len = 0;
+    while (len < (int)sizeof(hello) - 1) {
+        int n = recv(s->fd, hello + len, sizeof(hello) - 1 - len, 0);
+        if (n <= 0) break;
+        len += n;
+        hello[len] = 0;
+        if (strchr(hello, '\n')) break;
+    }
+    hello[len] = 0;
+
+    unsigned long long id = 0, offset = 0;
+    if (sscanf(hello, "sync %llu %llu", &id, &offset) != 2) {
+        syslog(LOG_WARNING, "Bad hello from replica!");
+        goto LEAVE;
+    }
+
+    char buf[128];
+    uint64_t cursor = offset;
+    char probe;
+    uint32_t gen;
+    if (id == s->log->id && repl_log_read(s->log, &cursor, &probe, 0) == 0) {
+        syslog(LOG_INFO, "Replica resumed at %llu.", offset);
+        if (send_all(s->fd, "resume\n", 7)) goto LEAVE;
+    } else if (id == s->log->id && !repl_log_generation(s->log, offset, &gen)) {
+        syslog(LOG_INFO, "Replica at %llu fell out of the log, catching it up.", offset);
+        cursor = repl_log_head(s->log);
+        if (catch_up_replica(s, gen)) goto LEAVE;
+        len = snprintf(buf, sizeof(buf), "synced %llu %llu\n",
+                (unsigned long long)s->log->id, (unsigned long long)cursor);
+        if (send_all(s->fd, buf, len)) goto LEAVE;
+    } else {
+        syslog(LOG_INFO, "Bootstrapping replica.");
+        cursor = repl_log_head(s->log);
+        if (bootstrap_replica(s)) goto LEAVE;
+        len = snprintf(buf, sizeof(buf), "synced %llu %llu\n",
+                (unsigned long long)s->log->id, (unsigned long long)cursor);
+        if (send_all(s->fd, buf, len)) goto LEAVE;
+        syslog(LOG_INFO, "Replica bootstrapped.");
+    }
+
+    // Stream the log
+    char *batch = malloc(REPL_BATCH_SIZE);
+    uint64_t last_send = monotonic_sec();
+    while (*s->should_run) {
+        int n = repl_log_read(s->log, &cursor, batch, REPL_BATCH_SIZE);
+        if (n < 0) {
+            syslog(LOG_WARNING, "Replica fell behind the replication log!");
+            break;
+        }
+        if (n > 0) {
+            if (send_all(s->fd, batch, n)) break;
+            last_send = monotonic_sec();
+            continue;
+        }
+
+        // Idle, ping so the replica knows we are alive. We
+        // are at the end of a line, so the ping is framed.
+        if (!log_wait(s->log, cursor, REPL_POLL_MSEC) &&
+                monotonic_sec() - last_send >= REPL_PING_SEC) {
+            if (send_all(s->fd, "ping\n", 5)) break;
+            last_send = monotonic_sec();
+        }
+    }
+    free(batch);
+
+LEAVE:
+    close(s->fd);
+    filtmgr_client_leave(s->mgr);
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Sends every filter to a replica. The replica drops its
+ * own filters on the reset, and loads each filter once its
+ * files are sent. In-memory filters have no files, and are
+ * sent as a create.
+ * @return 0 on success.
+ */
+static int bootstrap_replica(repl_sender *s) {
+    if (send_all(s->fd, "reset\n", 6)) return -1;
+
+    filtmgr_client_checkpoint(s->mgr);
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(s->mgr, NULL, &head);
+    if (res) return -1;
+
+    for (bloom_filter_list *node = head->head; node && !res; node = node->next) {
+        res = filtmgr_copy_filter(s->mgr, node->filter_name, send_filter_cb, s);
+        for (int i=0; res == -3 && i < REPL_WAIT_RETRIES; i++) {
+            wait_pending(s->mgr);
+            res = filtmgr_copy_filter(s->mgr, node->filter_name, send_filter_cb, s);
+        }
+        if (res == -1) res = 0;     // Dropped, the log has the drop
+        filtmgr_client_checkpoint(s->mgr);
+    }
+    filtmgr_cleanup_list(head);
+    filtmgr_client_offline(s->mgr);
+    return res;
+}
+
+/**
+ * Sends every filter to a replica that fell out of the log. The
+ * replica keeps its filters on the catchup, and merges in the
+ * pages that changed in a filter since a generation, or has the
+ * filter replaced if they are not known. The filters that are not
+ * sent are dropped at the end.
+ * @return 0 on success.
+ */
+static int catch_up_replica(repl_sender *s, uint32_t gen) {
+    if (send_all(s->fd, "catchup\n", 8)) return -1;
+
+    filtmgr_client_checkpoint(s->mgr);
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(s->mgr, NULL, &head);
+    if (res) return -1;
+
+    // Runs are copied in under the filter lock, and sent after
+    repl_pages pages;
+    pages.size = 2 * REPL_BATCH_SIZE + 512;
+    pages.buf = malloc(pages.size);
+    int replaced = 0;
+    for (bloom_filter_list *node = head->head; node && !res; node = node->next) {
+        res = catch_up_filter(s, node->filter_name, gen, &pages, &replaced);
+        filtmgr_client_checkpoint(s->mgr);
+    }
+    if (!res) syslog(LOG_INFO, "Caught up %d filters of a replica, and replaced %d.",
+            head->size - replaced, replaced);
+    free(pages.buf);
+    filtmgr_cleanup_list(head);
+    filtmgr_client_offline(s->mgr);
+    return res;
+}
+
+/**
+ * Sends the pages of a filter that changed since a generation,
+ * followed by a patched line. A filter whose pages are not known
+ * is sent whole after a replace line instead, as in a bootstrap.
+ * @arg replaced Incremented if the filter is replaced
+ * @return 0 on success.
+ */
+static int catch_up_filter(repl_sender *s, char *filter_name, uint32_t gen, repl_pages *pages, int *replaced) {
+    uint64_t cursor = 0;
+    uint32_t num_layers = 0;
+    pages->filter_name = filter_name;
+    pages->num_layers = &num_layers;
+    char line[512];
+    int len, res;
+    do {
+        pages->len = 0;
+        res = filtmgr_changed_pages(s->mgr, filter_name, gen, &cursor, &num_layers,
+                REPL_BATCH_SIZE, copy_pages_cb, pages);
+        if (res == 1 && !pages->len) return -1;
+        if (res >= 0 && send_all(s->fd, pages->buf, pages->len)) return -1;
+    } while (res == 1 && *s->should_run);
+    if (res == 1) return -1;
+    if (res == -1) return 0;        // Dropped, the log has the drop
+
+    if (!res) {
+        len = snprintf(line, sizeof(line), "patched %s\n", filter_name);
+        return send_all(s->fd, line, len) ? -1 : 0;
+    }
+
+    len = snprintf(line, sizeof(line), "replace %s\n", filter_name);
+    if (send_all(s->fd, line, len)) return -1;
+    (*replaced)++;
+    res = filtmgr_copy_filter(s->mgr, filter_name, send_filter_cb, s);
+    for (int i=0; res == -3 && i < REPL_WAIT_RETRIES; i++) {
+        wait_pending(s->mgr);
+        res = filtmgr_copy_filter(s->mgr, filter_name, send_filter_cb, s);
+    }
+    return (res == -1) ? 0 : res;
+}
+
+// Buffers a run of changed pages, after its page line
+static int copy_pages_cb(void *data, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, unsigned char *bytes, uint64_t len) {
+    repl_pages *p = data;
+    char line[512];
+    int line_len = snprintf(line, sizeof(line), "page %s %u %u %llu %llu %llu\n",
+            p->filter_name, *p->num_layers, layer, (unsigned long long)layer_bytes,
+            (unsigned long long)offset, (unsigned long long)len);
+    if (line_len >= (int)sizeof(line)) return 1;
+    if (p->len + line_len + len > (uint64_t)p->size) return 1;
+    memcpy(p->buf + p->len, line, line_len);
+    memcpy(p->buf + p->len + line_len, bytes, len);
+    p->len += line_len + len;
+    return 0;
+}
+
+// Sends the files of a filter, then has the replica load it
+static int send_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    repl_sender *s = data;
+    char line[512];
+    int len;
+    if (filter->filter_config.in_memory) {
+        bloom_filter_config *fc = &filter->filter_config;
+        bloom_config config = *s->config;
+        config.initial_capacity = fc->initial_capacity;
+        config.default_probability = fc->default_probability;
+        config.in_memory = 1;
+        config.layout = fc->layout;
+        config.hash_scheme = fc->hash_scheme;
+        config.rotate_window = fc->rotate_window;
+        config.rotate_generations = fc->rotate_generations;
+        config.freezable = fc->freezable;
+        config.summary_capacity = fc->summary_capacity;
+        config.shards = fc->shards;
+        config.pinned = fc->pinned;
+        len = format_create(line, sizeof(line), filter_name, &config);
+        return (len < (int)sizeof(line)) ? send_all(s->fd, line, len) : -1;
+    }
+    return send_files_cb(data, filter_name, filter);
+}
+
+// Sends the files of a filter, then has the receiver load it
+static int send_files_cb(void *data, char *filter_name, bloom_filter *filter) {
+    repl_sender *s = data;
+    if (filter->filter_config.in_memory) return -4;
+    if (send_tree(s, filter_name, filter->full_path, NULL)) return -2;
+    char line[256];
+    int len = snprintf(line, sizeof(line), "load %s\n", filter_name);
+    return send_all(s->fd, line, len) ? -2 : 0;
+}
+
+// Sends the files in a directory and its children
+static int send_tree(repl_sender *s, char *filter_name, char *root, char *rel) {
+    DIR *dir = opendir(root);
+    if (!dir) return 0;
+    int res = 0;
+    struct dirent *d;
+    while (!res && (d = readdir(dir))) {
+        if (d->d_name[0] == '.') continue;
+        char *path = join_path(root, d->d_name);
+        char *child = (rel) ? join_path(rel, d->d_name) : strdup(d->d_name);
+        struct stat st;
+        if (!stat(path, &st)) {
+            if (S_ISDIR(st.st_mode))
+                res = send_tree(s, filter_name, path, child);
+            else if (S_ISREG(st.st_mode))
+                res = send_file(s, filter_name, path, child);
+        }
+        free(path);
+        free(child);
+    }
+    closedir(dir);
+    return res;
+}
+
+/**
+ * Sends a file, as a header line followed by its contents.
+ */
+static int send_file(repl_sender *s, char *filter_name, char *path, char *rel) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    int res = 0;
+    if (!fstat(fd, &st))
+        res = send_fd(s->fd, fd, filter_name, rel, st.st_size, s->should_run);
+    close(fd);
+    return res;
+}
+
+/**
+ * Sends an open file, as a header line followed by its
+ * contents. The contents are sent with sendfile, without
+ * copying them through our buffers. The length in the header
+ * is kept even if the file shrinks while it is read, so the
+ * stream stays framed.
+ * @arg should_run Optional, the send stops once it is 0
+ * @return 0 on success.
+ */
+static int send_fd(int sock, int fd, char *filter_name, char *rel, uint64_t size, int *should_run) {
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "file %s %s %llu\n",
+            filter_name, rel, (unsigned long long)size);
+    if (len >= (int)sizeof(buf) || send_all(sock, buf, len)) return -1;
+
+    off_t offset = 0;
+    uint64_t remain = size;
+    while (remain) {
+        if (should_run && !*should_run) return -1;
+        size_t want = (remain < REPL_BATCH_SIZE) ? remain : REPL_BATCH_SIZE;
+        ssize_t n = sendfile(sock, fd, &offset, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            // Pad a file that shrank with zeros
+            memset(buf, 0, sizeof(buf));
+            n = (want < sizeof(buf)) ? (ssize_t)want : (ssize_t)sizeof(buf);
+            if (send_all(sock, buf, n)) return -1;
+        }
+        remain -= n;
+    }
+    return 0;
+}
+
+// Opens the files of the snapshot of an exported filter
+static int open_export_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    bloom_export *e = data;
+    char *path = bloomf_snapshot_path(filter);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        free(path);
+        return -5;
+    }
+
+    // The snapshot folder is flat
+    int res = 0;
+    struct dirent *d;
+    while (!res && (d = readdir(dir))) {
+        if (d->d_name[0] == '.') continue;
+        char *file = join_path(path, d->d_name);
+        int fd = open(file, O_RDONLY);
+        free(file);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st)) {
+            if (fd >= 0) close(fd);
+            res = -5;
+            break;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            close(fd);
+            continue;
+        }
+
+        int num = e->num_files + 1;
+        char **rels = realloc(e->rels, num * sizeof(char*));
+        if (rels) e->rels = rels;
+        int *fds = realloc(e->fds, num * sizeof(int));
+        if (fds) e->fds = fds;
+        uint64_t *sizes = realloc(e->sizes, num * sizeof(uint64_t));
+        if (sizes) e->sizes = sizes;
+        if (!rels || !fds || !sizes) {
+            close(fd);
+            res = -5;
+            break;
+        }
+        e->rels[e->num_files] = strdup(d->d_name);
+        e->fds[e->num_files] = fd;
+        e->sizes[e->num_files] = st.st_size;
+        e->num_files = num;
+    }
+    closedir(dir);
+    free(path);
+    return res;
+}
+
+// Runs a transfer on a thread of its own
+static int start_transfer(repl_transfer *t) {
+    __atomic_add_fetch(&NUM_TRANSFERS, 1, __ATOMIC_RELAXED);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, transfer_main, t);
+    pthread_attr_destroy(&attr);
+    if (!res) return 0;
+
+    syslog(LOG_ERR, "Failed to start a transfer thread!");
+    if (t->export) repl_free_export(t->export);
+    close(t->fd);
+    free(t->input);
+    free(t->filter_name);
+    free(t);
+    __atomic_sub_fetch(&NUM_TRANSFERS, 1, __ATOMIC_RELEASE);
+    return -1;
+}
+
+/**
+ * Sends an export, or receives an import,
+ * and then closes the connection.
+ */
+static void* transfer_main(void *in) {
+    repl_transfer *t = in;
+    struct timeval tv = {REPL_TIMEOUT_SEC, 0};
+    setsockopt(t->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(t->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (t->export) {
+        if (send_export(t->export, t->fd))
+            syslog(LOG_WARNING, "Failed to export filter '%s'!", t->export->filter_name);
+        else
+            syslog(LOG_INFO, "Exported filter '%s'.", t->export->filter_name);
+        repl_free_export(t->export);
+    } else {
+        filtmgr_client_checkpoint(t->mgr);
+        int res = import_filter(t);
+        if (res)
+            syslog(LOG_WARNING, "Failed to import filter '%s'!", t->filter_name);
+        else
+            syslog(LOG_INFO, "Imported filter '%s'.", t->filter_name);
+        if (res == -2)
+            send_all(t->fd, "Exists\n", 7);
+        else if (res)
+            send_all(t->fd, "Import failed\n", 14);
+        else
+            send_all(t->fd, "Done\n", 5);
+        filtmgr_client_leave(t->mgr);
+    }
+
+    close(t->fd);
+    free(t->input);
+    free(t->filter_name);
+    free(t);
+    __atomic_sub_fetch(&NUM_TRANSFERS, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Sends the files of an export, followed by a load
+static int send_export(bloom_export *export, int fd) {
+    for (int i=0; i < export->num_files; i++) {
+        if (send_fd(fd, export->fds[i], export->filter_name, export->rels[i],
+                    export->sizes[i], &TRANSFERS_RUN)) return -1;
+    }
+    char line[256];
+    int len = snprintf(line, sizeof(line), "load %s\n", export->filter_name);
+    return send_all(fd, line, len);
+}
+
+/**
+ * Receives the stream of an export, and loads it under the
+ * name of the import. The name in the stream is ignored, so
+ * a filter can be imported under another name. The whole
+ * stream is read even if the filter exists, so the client
+ * gets the response instead of a reset.
+ * @return 0 on success, -2 if the filter exists.
+ */
+static int import_filter(repl_transfer *t) {
+    repl_reader r;
+    memset(&r, 0, sizeof(r));
+    r.fd = t->fd;
+    r.should_run = &TRANSFERS_RUN;
+    r.mgr = t->mgr;
+    r.size = (t->input_len > REPL_BATCH_SIZE) ? t->input_len : REPL_BATCH_SIZE;
+    r.buf = malloc(r.size);
+    r.last_read = monotonic_sec();
+    r.staging = IMPORT_DIR;
+    if (!r.buf) return -1;
+    if (t->input_len) memcpy(r.buf, t->input, t->input_len);
+    r.end = t->input_len;
+
+    // Start from an empty staging folder
+    char *staged = staged_path(t->config, IMPORT_DIR, t->filter_name);
+    remove_tree(staged);
+
+    char *line;
+    int len, staged_files = 0, res = -1;
+    while (!read_line(&r, &line, &len)) {
+        line[len] = 0;
+        char *args = line;
+        char *cmd = strsep(&args, " ");
+        strsep(&args, " ");
+        if (!strcmp(cmd, "load")) {
+            if (staged_files && filter_exists(t->mgr, t->filter_name)) res = -2;
+            else if (staged_files) res = install_filter(t->config, t->mgr, IMPORT_DIR, t->filter_name, 0);
+            break;
+        }
+        char *rel = strsep(&args, " ");
+        if (strcmp(cmd, "file") || !rel || !args) break;
+        if (stage_file(t->config, &r, t->filter_name, rel, strtoull(args, NULL, 10))) break;
+        staged_files++;
+    }
+    free(r.buf);
+    remove_tree(staged);
+    free(staged);
+    return res;
+}
+
+// Sends the whole buffer, returns 0 on success
+static int send_all(int fd, char *buf, int len) {
+    while (len > 0) {
+        int n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Connects to the primary, and applies its stream
+ * until the connection is lost. The position in the
+ * stream is kept over reconnects.
+ */
+static void* replica_main(void *in) {
+    repl_thread_args *args = in;
+    bloom_config *config = args->config;
+    bloom_filtmgr *mgr = args->mgr;
+    int *should_run = args->should_run;
+    free(args);
+
+    syslog(LOG_INFO, "Replica thread started. Primary: %s.", config->replicate_from);
+    repl_reader r;
+    memset(&r, 0, sizeof(r));
+    r.should_run = should_run;
+    r.mgr = mgr;
+    r.size = REPL_BATCH_SIZE;
+    r.buf = malloc(r.size);
+
+    uint64_t id = 0, offset = 0;
+    while (*should_run) {
+        r.fd = connect_primary(config);
+        if (r.fd >= 0) {
+            r.start = r.end = 0;
+            replicate(config, mgr, &r, &id, &offset);
+            close(r.fd);
+            syslog(LOG_WARNING, "Lost the connection to the primary %s.", config->replicate_from);
+        }
+        for (int i=0; *should_run && i < REPL_RETRY_SEC * 1000 / REPL_POLL_MSEC; i++) {
+            usleep(REPL_POLL_MSEC * 1000);
+        }
+    }
+    free(r.buf);
+    filtmgr_client_leave(mgr);
+    return NULL;
+}
+
+// Connects to the primary given as host:port
+static int connect_primary(bloom_config *config) {
+    char *host = strdup(config->replicate_from);
+    char *port = strrchr(host, ':');
+    *port++ = 0;
+
+    struct addrinfo hints, *addrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int fd = -1;
+    if (getaddrinfo(host, port, &hints, &addrs)) {
+        syslog(LOG_ERR, "Failed to resolve the primary %s!", config->replicate_from);
+        goto LEAVE;
+    }
+
+    fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (fd < 0 || connect(fd, addrs->ai_addr, addrs->ai_addrlen)) {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        goto LEAVE;
+    }
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+LEAVE:
+    if (addrs) freeaddrinfo(addrs);
+    free(host);
+    return fd;
+}
+
+/**
+ * Applies the stream of the primary.
+ * @arg id The id of the primary log, 0 if not yet synced
+ * @arg offset The position replicated to, updated with each line
+ * @return 0 once the connection is lost.
+ */
+static int replicate(bloom_config *config, bloom_filtmgr *mgr, repl_reader *r, uint64_t *id, uint64_t *offset) {
+    char hello[128];
+    int len = snprintf(hello, sizeof(hello), "sync %llu %llu\n",
+            (unsigned long long)*id, (unsigned long long)*offset);
+    if (send_all(r->fd, hello, len)) return 0;
+
+    // The filters sent while catching up, the rest are dropped
+    art_tree seen;
+    init_art_tree(&seen);
+    int catching_up = 0, diverged = 0;
+
+    r->last_read = monotonic_sec();
+    int live = 0;
+    char *line;
+    while (!read_line(r, &line, &len)) {
+        if (is_cmd(line, len, "ping")) continue;
+
+        // Lines of the log, and the creates of in-memory filters
+        if (live || is_cmd(line, len, "create")) {
+            if (repl_apply_line(config, mgr, line, len))
+                syslog(LOG_WARNING, "Bad replication line from the primary!");
+            if (live) *offset += len + 1;
+            continue;
+        }
+
+        line[len] = 0;
+        char *args = line;
+        char *cmd = strsep(&args, " ");
+        unsigned long long new_id, new_offset;
+        if (!strcmp(cmd, "resume")) {
+            syslog(LOG_INFO, "Replica resumed from the primary.");
+            live = 1;
+        } else if (!strcmp(cmd, "reset") || !strcmp(cmd, "catchup")) {
+            catching_up = (*cmd == 'c');
+            syslog(LOG_INFO, (catching_up) ? "Replica is catching up with the primary." :
+                    "Replica is bootstrapping from the primary.");
+            if (!catching_up) {
+                *id = 0;
+                drop_all_filters(mgr);
+            }
+            char *staging = join_path(config->data_dir, (char*)STAGING_DIR);
+            remove_tree(staging);
+            free(staging);
+        } else if (!strcmp(cmd, "page") && catching_up && args) {
+            char *filter_name = strdup(args);
+            *strchrnul(filter_name, ' ') = 0;
+            art_insert(&seen, (unsigned char*)filter_name, strlen(filter_name)+1, (void*)1);
+            int res = apply_pages(mgr, r, args);
+            if (res == -1) {
+                free(filter_name);
+                break;
+            }
+            if (res && !diverged) {
+                syslog(LOG_WARNING, "Replica filter '%s' differs from the primary! It must bootstrap again.",
+                        filter_name);
+                diverged = 1;
+            }
+            free(filter_name);
+        } else if ((!strcmp(cmd, "patched") || !strcmp(cmd, "replace")) && catching_up && args) {
+            art_insert(&seen, (unsigned char*)args, strlen(args)+1, (void*)1);
+            if (*cmd == 'r') filtmgr_drop_filter(mgr, args);
+        } else if (!strcmp(cmd, "file")) {
+            char *filter_name = strsep(&args, " ");
+            char *rel = strsep(&args, " ");
+            if (!rel || !args) break;
+            if (stage_file(config, r, filter_name, rel, strtoull(args, NULL, 10))) break;
+        } else if (!strcmp(cmd, "load")) {
+            if (args) install_filter(config, mgr, NULL, args, 1);
+        } else if (!strcmp(cmd, "synced") && args &&
+                sscanf(args, "%llu %llu", &new_id, &new_offset) == 2) {
+            // Reconnect with no position, so the primary bootstraps us
+            if (diverged) {
+                *id = 0;
+                break;
+            }
+            if (catching_up) drop_unseen_filters(mgr, &seen);
+            *id = new_id;
+            *offset = new_offset;
+            live = 1;
+            syslog(LOG_INFO, "Replica is in sync with the primary.");
+        } else {
+            syslog(LOG_WARNING, "Bad replication line from the primary!");
+            break;
+        }
+    }
+    destroy_art_tree(&seen);
+    return 0;
+}
+
+// Checks if a line is the given command
+static int is_cmd(char *line, int len, const char *cmd) {
+    int cmd_len = strlen(cmd);
+    return len >= cmd_len && !strncmp(line, cmd, cmd_len) &&
+        (len == cmd_len || line[cmd_len] == ' ');
+}
+
+/**
+ * Reads the next line of the stream. The line stays valid
+ * until the next read.
+ * @return 0 on success, -1 once the connection is lost.
+ */
+static int read_line(repl_reader *r, char **line, int *len) {
+    while (1) {
+        char *start = r->buf + r->start;
+        char *nl = memchr(start, '\n', r->end - r->start);
+        if (nl) {
+            *line = start;
+            *len = nl - start;
+            r->start += *len + 1;
+            return 0;
+        }
+        if (read_more(r)) return -1;
+    }
+}
+
+/**
+ * Reads more of the stream into the buffer, moving the
+ * unread data to the front, and growing the buffer for
+ * lines longer than it. Waits offline, so the vacuum thread
+ * is not held back by an idle replica.
+ * @return 0 on success, -1 once the connection is lost.
+ */
+static int read_more(repl_reader *r) {
+    if (r->start) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == r->size) {
+        r->size *= 2;
+        r->buf = realloc(r->buf, r->size);
+    }
+
+    struct pollfd pfd = {r->fd, POLLIN, 0};
+    filtmgr_client_offline(r->mgr);
+    while (*r->should_run) {
+        int ready = poll(&pfd, 1, REPL_POLL_MSEC);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready <= 0) {
+            if (monotonic_sec() - r->last_read >= REPL_TIMEOUT_SEC) break;
+            continue;
+        }
+        int n = recv(r->fd, r->buf + r->end, r->size - r->end, 0);
+        if (n <= 0) break;
+        r->end += n;
+        r->last_read = monotonic_sec();
+        filtmgr_client_checkpoint(r->mgr);
+        return 0;
+    }
+    filtmgr_client_checkpoint(r->mgr);
+    return -1;
+}
+
+/**
+ * Reads bytes of the stream that are not framed as lines.
+ * @return 0 on success, -1 once the connection is lost.
+ */
+static int read_bytes(repl_reader *r, char *out, uint64_t len) {
+    while (len) {
+        if (r->start == r->end && read_more(r)) return -1;
+        uint64_t avail = r->end - r->start;
+        int n = (avail < len) ? (int)avail : (int)len;
+        memcpy(out, r->buf + r->start, n);
+        r->start += n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Reads the run of pages that follows a page line, and
+ * merges it into the filter.
+ * @arg args The arguments of the page line
+ * @return 0 on success, -1 if the stream is lost or bad,
+ * -2 if the run could not be merged.
+ */
+static int apply_pages(bloom_filtmgr *mgr, repl_reader *r, char *args) {
+    char filter_name[256];
+    unsigned num_layers, layer;
+    unsigned long long layer_bytes, offset, len;
+    if (sscanf(args, "%255s %u %u %llu %llu %llu", filter_name, &num_layers, &layer,
+                &layer_bytes, &offset, &len) != 6 || len > 2 * REPL_BATCH_SIZE) {
+        syslog(LOG_WARNING, "Bad replication line from the primary!");
+        return -1;
+    }
+
+    // The name and the bytes are copied out, since reads move the buffer
+    char *bytes = malloc(len);
+    if (!bytes || read_bytes(r, bytes, len)) {
+        free(bytes);
+        return -1;
+    }
+    int res = filtmgr_merge_pages(mgr, filter_name, num_layers, layer, layer_bytes,
+            offset, (unsigned char*)bytes, len);
+    free(bytes);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Writes a file of a bootstrapping filter into the staging
+ * folder, reading its contents from the stream.
+ * @return 0 on success, -1 if the stream is lost or bad.
+ */
+static int stage_file(bloom_config *config, repl_reader *r, char *filter_name, char *rel, uint64_t size) {
+    // The paths come from the network, keep them in the staging folder
+    if (strchr(filter_name, '/') || rel[0] == '/' || strstr(rel, "..")) {
+        syslog(LOG_ERR, "Bad file path '%s' in a replication stream!", rel);
+        return -1;
+    }
+
+    char *dir = staged_path(config, r->staging, filter_name);
+    char *path = join_path(dir, rel);
+    free(dir);
+    *strrchr(path, '/') = 0;
+    make_dirs(path);
+    path[strlen(path)] = '/';
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) syslog(LOG_ERR, "Failed to stage file '%s'. %s", path, strerror(errno));
+    free(path);
+
+    // Write out what is buffered, and splice the rest
+    int res = 0, spliced = 0;
+    while (size) {
+        if (r->start == r->end && fd >= 0 && !spliced) {
+            spliced = 1;
+            res = splice_file(r, fd, &size);
+            if (res || !size) break;
+        }
+        if (r->start == r->end && read_more(r)) {
+            res = -1;
+            break;
+        }
+        uint64_t avail = r->end - r->start;
+        int n = (avail < size) ? (int)avail : (int)size;
+        if (fd >= 0 && write(fd, r->buf + r->start, n) != n) {
+            syslog(LOG_ERR, "Failed to write staged file! %s", strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+        r->start += n;
+        size -= n;
+    }
+    if (fd >= 0) close(fd);
+    return res;
+}
+
+/**
+ * Moves the bytes of a staged file in the stream straight
+ * from the connection into the file through a pipe, without
+ * copying them through our buffers. Waits offline, like
+ * read_more. Stops early if splice is not supported, and the
+ * rest of the file is then read as usual.
+ * @arg size The bytes left to move, updated
+ * @return 0 on success, -1 if the stream is lost or
+ * the file can not be written.
+ */
+static int splice_file(repl_reader *r, int fd, uint64_t *size) {
+    int pipes[2];
+    if (pipe(pipes)) return 0;
+    fcntl(pipes[1], F_SETPIPE_SZ, REPL_BATCH_SIZE);
+    int flags = fcntl(r->fd, F_GETFL);
+    fcntl(r->fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct pollfd pfd = {r->fd, POLLIN, 0};
+    int res = 0, moved = 0;
+    filtmgr_client_offline(r->mgr);
+    while (*size && !res) {
+        size_t want = (*size < REPL_BATCH_SIZE) ? *size : REPL_BATCH_SIZE;
+        ssize_t n = splice(r->fd, NULL, pipes[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINVAL && !moved) break;
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (!*r->should_run || monotonic_sec() - r->last_read >= REPL_TIMEOUT_SEC) res = -1;
+            else if (poll(&pfd, 1, REPL_POLL_MSEC) < 0 && errno != EINTR) res = -1;
+            continue;
+        }
+        if (n <= 0) {
+            res = -1;
+            break;
+        }
+        moved = 1;
+        r->last_read = monotonic_sec();
+        *size -= n;
+
+        // Drain the pipe into the file
+        while (n > 0) {
+            ssize_t w = splice(pipes[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                syslog(LOG_ERR, "Failed to write staged file! %s", strerror(errno));
+                res = -1;
+                break;
+            }
+            n -= w;
+        }
+    }
+    filtmgr_client_checkpoint(r->mgr);
+    fcntl(r->fd, F_SETFL, flags);
+    close(pipes[0]);
+    close(pipes[1]);
+    return res;
+}
+
+/**
+ * Moves a bootstrapped filter from the staging folder into
+ * the data dir, and loads it. The filter of the same name
+ * that was dropped by the reset may still be deleting.
+ * @arg staging The staging folder, NULL for STAGING_DIR
+ * @arg replace If 0, a folder already in the data dir is
+ * never replaced, and the install fails instead.
+ * @return 0 on success.
+ */
+static int install_filter(bloom_config *config, bloom_filtmgr *mgr, const char *staging, char *filter_name, int replace) {
+    char *staged = staged_path(config, staging, filter_name);
+    char *folder;
+    if (asprintf(&folder, "bloomd.%s", filter_name) < 0) {
+        free(staged);
+        return -1;
+    }
+    char *target = join_path(config->data_dir, folder);
+    free(folder);
+
+    int moved = 0, res = -3;
+    for (int i=0; res == -3 && i < REPL_WAIT_RETRIES; i++) {
+        if (!moved && !rename(staged, target)) moved = 1;
+        if (!moved && (!replace || (errno != EEXIST && errno != ENOTEMPTY))) break;
+
+        // A folder that is no longer deleting was left by a
+        // clear, and is replaced on the last attempt
+        if (!moved && i == REPL_WAIT_RETRIES - 1) {
+            remove_tree(target);
+            moved = !rename(staged, target);
+        }
+        if (moved) res = filtmgr_load_filter(mgr, filter_name);
+        if (res == -3) wait_pending(mgr);
+    }
+    if (res) syslog(LOG_ERR, "Failed to load the received filter '%s'.", filter_name);
+    if (!moved) remove_tree(staged);
+    free(staged);
+    free(target);
+    return res;
+}
+
+// Drops every filter, before a bootstrap
+static void drop_all_filters(bloom_filtmgr *mgr) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        filtmgr_drop_filter(mgr, node->filter_name);
+    }
+    filtmgr_cleanup_list(head);
+}
+
+// Drops the filters that were not sent while catching up
+static void drop_unseen_filters(bloom_filtmgr *mgr, art_tree *seen) {
+    bloom_filter_list_head *head;
+    if (filtmgr_list_filters(mgr, NULL, &head)) return;
+    for (bloom_filter_list *node = head->head; node; node = node->next) {
+        char *name = node->filter_name;
+        if (!art_search(seen, (unsigned char*)name, strlen(name)+1)) filtmgr_drop_filter(mgr, name);
+    }
+    filtmgr_cleanup_list(head);
+}
+
+// Returns the staging folder of a filter
+static char* staged_path(bloom_config *config, const char *staging, char *filter_name) {
+    char *folder;
+    if (asprintf(&folder, "%s/bloomd.%s", (staging) ? staging : STAGING_DIR, filter_name) < 0) return NULL;
+    char *path = join_path(config->data_dir, folder);
+    free(folder);
+    return path;
+}
+
+// Checks if a filter exists
+static int filter_exists(bloom_filtmgr *mgr, char *filter_name) {
+    bloom_filter_handle *filt;
+    if (filtmgr_open_handle(mgr, filter_name, &filt)) return 0;
+    filtmgr_release_handle(mgr, filt);
+    return 1;
+}
+
+// Creates a directory and its parents
+static int make_dirs(char *path) {
+    for (char *c = path + 1; *c; c++) {
+        if (*c != '/') continue;
+        *c = 0;
+        mkdir(path, 0755);
+        *c = '/';
+    }
+    return (mkdir(path, 0755) && errno != EEXIST) ? -1 : 0;
+}
+
+// Removes a directory and everything in it. A filter
+// folder linked from one of the data_dirs goes with its link.
+static void remove_tree(char *path) {
+    struct stat st;
+    char *target = (!lstat(path, &st) && S_ISLNK(st.st_mode)) ? realpath(path, NULL) : NULL;
+    if (target) {
+        remove_tree(target);
+        free(target);
+        unlink(path);
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        unlink(path);
+        return;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+        char *child = join_path(path, d->d_name);
+        struct stat st;
+        if (!lstat(child, &st) && S_ISDIR(st.st_mode))
+            remove_tree(child);
+        else
+            unlink(child);
+        free(child);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static uint64_t monotonic_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,291 @@
+#ifndef BLOOM_REPLICATION_H
+#define BLOOM_REPLICATION_H
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+
+/*
+ * Replication streams the changes made on a primary to its
+ * replicas. The filter manager of the primary records every
+ * applied set, delete, create, drop and clear into a replication
+ * log, as lines in the text protocol, with the keys that would
+ * split a line escaped. Each replica connects to the replication
+ * port, and is sent the lines of the log as they are written,
+ * batched into large writes.
+ *
+ * A new replica is first bootstrapped: the data files of every
+ * filter are streamed to it, and loaded as cold filters. Its
+ * position in the log is taken before the files are read, and
+ * the sets since are replayed on top of the files. Sets are
+ * idempotent, so the replica converges on the primary. A replica
+ * that reconnects while its position is still in the log only
+ * receives the lines it missed.
+ *
+ * The pages that change in the plain filters of the primary are
+ * stamped with the generation of the log, which moves on every
+ * minute the log does. A replica that reconnects after its position
+ * left the log, but within the kept generations, is caught up
+ * rather than bootstrapped: only the pages that changed since its
+ * generation are sent, and merged into its filters. Filters that
+ * can not be caught up, such as those whose layers were made or
+ * loaded since, are replaced with their files as in a bootstrap.
+ *
+ * Replicas apply the lines through the filter manager like any
+ * other client, so they serve checks while they replicate. A
+ * replica is a normal server, and can be promoted by pointing
+ * the clients to it.
+ */
+
+/**
+ * Opaque handle to the replication log
+ */
+typedef struct bloom_repl_log bloom_repl_log;
+
+/**
+ * Creates a replication log.
+ * @arg size The size of the log in bytes. Replicas that fall
+ * further behind than this must be bootstrapped again.
+ * @arg log Output, the new log
+ * @return 0 on success.
+ */
+int init_repl_log(uint64_t size, bloom_repl_log **log);
+
+/**
+ * Destroys a replication log
+ * @arg log The log
+ */
+void destroy_repl_log(bloom_repl_log *log);
+
+/**
+ * Records keys applied to a filter. Keys holding a space,
+ * a newline or a zero byte can not be sent in a line as
+ * they are, so a batch with any of them is sent with the
+ * "bx" or "deletex" command, whose keys are escaped.
+ * @arg log The log
+ * @arg cmd The command that applies the keys, "b" or "delete"
+ * @arg filter_name The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Optional, only the keys with a result of 1 are
+ * recorded, so keys that did not change the filter are skipped.
+ */
+void repl_log_keys(bloom_repl_log *log, const char *cmd, char *filter_name, char **keys, int *key_lens,
+        int num_keys, char *result);
+
+/**
+ * Records the creation of a filter.
+ * @arg log The log
+ * @arg filter_name The name of the filter
+ * @arg config The config the filter was created with
+ */
+void repl_log_create(bloom_repl_log *log, char *filter_name, bloom_config *config);
+
+/**
+ * Records a command on a filter, such as a drop.
+ * @arg log The log
+ * @arg cmd The command, "drop", "clear", "freeze", "compact",
+ * "shrink", "reset" or "alias_drop"
+ * @arg filter_name The name of the filter
+ */
+void repl_log_filter_cmd(bloom_repl_log *log, const char *cmd, char *filter_name);
+
+/**
+ * Records the change of an alias.
+ * @arg log The log
+ * @arg cmd The command, "alias" or "alias_swap"
+ * @arg alias The name of the alias
+ * @arg filter_name The name of the filter it resolves to
+ */
+void repl_log_alias(bloom_repl_log *log, const char *cmd, char *alias, char *filter_name);
+
+/**
+ * Reads lines from the log.
+ * @arg log The log
+ * @arg offset The position to read from. Updated to the
+ * end of what was read.
+ * @arg buf Output buffer. A read may end within a line.
+ * @arg buf_size The size of the buffer
+ * @return The number of bytes read, or -1 if the
+ * position is no longer in the log.
+ */
+int repl_log_read(bloom_repl_log *log, uint64_t *offset, char *buf, int buf_size);
+
+/**
+ * Returns the end of the log, which is the position
+ * of the next line to be written.
+ * @arg log The log
+ * @return The position
+ */
+uint64_t repl_log_head(bloom_repl_log *log);
+
+/**
+ * Returns the clock of the log, which holds the generation
+ * stamped on the pages that change in the filters, see
+ * bloomf_track_changes.
+ * @arg log The log
+ * @return The clock, valid until the log is destroyed
+ */
+uint32_t* repl_log_clock(bloom_repl_log *log);
+
+/**
+ * Starts a new generation of the log, if lines were
+ * written since the current one started. The replication
+ * thread rolls the log every minute.
+ * @arg log The log
+ * @return 1 if a new generation was started.
+ */
+int repl_log_roll(bloom_repl_log *log);
+
+/**
+ * Finds the oldest generation that may have stamped the
+ * pages changed by the lines from a position on, which is
+ * the one before the generation the position was written in.
+ * @arg log The log
+ * @arg offset The position
+ * @arg gen Output, the generation
+ * @return 0 on success, -1 if the generation of the
+ * position is no longer kept.
+ */
+int repl_log_generation(bloom_repl_log *log, uint64_t offset, uint32_t *gen);
+
+/**
+ * Applies a replicated line to the filter manager.
+ * @arg config The configuration, used for created filters
+ * @arg mgr The filter manager
+ * @arg line The line, without the newline. It is modified.
+ * @arg len The length of the line
+ * @return 0 on success, -1 if the line is malformed.
+ * Commands that fail on the replica, such as a set of a
+ * filter that was already dropped, are not errors.
+ */
+int repl_apply_line(bloom_config *config, bloom_filtmgr *mgr, char *line, int len);
+
+/**
+ * Sends the files of a filter over a connection, followed by
+ * a load, in the stream format used to bootstrap a replica.
+ * Used to migrate a filter to another node.
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg fd The connection
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the connection failed, -3 if a snapshot is in
+ * progress, -4 if the filter is in-memory.
+ */
+int repl_send_filter(bloom_config *config, bloom_filtmgr *mgr, int fd, char *filter_name);
+
+/**
+ * Sends the lines of a log from a position up
+ * to its head over a connection.
+ * @arg log The log
+ * @arg fd The connection
+ * @arg offset The position to send from, updated
+ * @return 0 on success, -1 if the position is no longer
+ * in the log, -2 if the connection failed.
+ */
+int repl_send_log(bloom_repl_log *log, int fd, uint64_t *offset);
+
+/**
+ * Receives a filter sent with repl_send_filter, and applies
+ * the log lines that follow it. The sender asks for the result
+ * of the load with a "ready" line, and ends the stream with a
+ * "done" line, each answered with "ok" or "error".
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg fd The connection
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the receive should stop.
+ * @arg filter_name Output, the name of the received filter,
+ * to be freed by the caller. Only set on success.
+ * @return 0 once the stream is done, -1 on failure.
+ */
+int repl_receive_filter(bloom_config *config, bloom_filtmgr *mgr, int fd, int *should_run, char **filter_name);
+
+/**
+ * Opaque handle to the files of a filter being exported
+ */
+typedef struct bloom_export bloom_export;
+
+/**
+ * Writes a snapshot of a filter, and opens its files to
+ * be exported. Sets and checks continue meanwhile, as with
+ * the snapshot command.
+ * @arg mgr The filter manager
+ * @arg filter_name The name of the filter
+ * @arg export Output, the export
+ * @return 0 on success, or the errors of filtmgr_export_filter.
+ */
+int repl_open_export(bloom_filtmgr *mgr, char *filter_name, bloom_export **export);
+
+/**
+ * Frees an export that was not started
+ * @arg export The export
+ */
+void repl_free_export(bloom_export *export);
+
+/**
+ * Starts a thread that sends an export over a connection, in
+ * the stream format of a migration, and then closes it. The
+ * files are sent with sendfile, straight from the page cache.
+ * @arg export The export, freed by the thread
+ * @arg fd The connection, closed by the thread
+ * @return 0 if the thread was started. The export
+ * and the connection are freed either way.
+ */
+int repl_start_export(bloom_export *export, int fd);
+
+/**
+ * Starts a thread that receives a stream sent by an export
+ * over a connection, and loads it as a new filter. The thread
+ * answers with "Done", "Exists" or "Import failed" once the
+ * stream is read, and closes the connection.
+ * @arg config The configuration
+ * @arg mgr The filter manager
+ * @arg filter_name The name to import the filter as
+ * @arg fd The connection, closed by the thread
+ * @arg input The start of the stream that was already read,
+ * freed by the thread. May be NULL.
+ * @arg input_len The length of the input
+ * @return 0 if the thread was started. The input
+ * and the connection are freed either way.
+ */
+int repl_start_import(bloom_config *config, bloom_filtmgr *mgr, char *filter_name,
+        int fd, char *input, int input_len);
+
+/**
+ * Stops the exports and imports that are running, and
+ * waits for their threads to exit. Must be called before
+ * the filter manager is destroyed.
+ */
+void repl_stop_transfers(void);
+
+/**
+ * Starts the replication thread of a primary, which serves
+ * the replicas on the replication port. The replication log
+ * is created and attached to the filter manager before this
+ * returns, so it must be called before the workers start.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_replication_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts the replica thread, which connects to the primary
+ * set by replicate_from and applies its replication stream.
+ * Reconnects until asked to exit.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_replica_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+#endif
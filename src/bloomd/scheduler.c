@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include "scheduler.h"
+#include "numa.h"
+
+/**
+ * The resolution of the timer wheel, and its number of
+ * slots. A job further out than a turn of the wheel stays
+ * in its slot until the turn it is due in.
+ */
+#define SCHED_TICK_MSEC 10
+#define SCHED_SLOTS 256
+
+/**
+ * The nice offset of each class, which is added
+ * to the priority of the server.
+ */
+static const int CLASS_NICE[SCHED_CLASSES] = {0, 10, 19};
+
+/*
+ * The IO priorities, as in linux/ioprio.h
+ */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+
+/**
+ * A job of the scheduler
+ */
+typedef struct sched_entry {
+    char *name;
+    sched_class cls;
+    int interval;               // Milliseconds
+    char *cpus;                 // Pinned to while running, or NULL
+    sched_job func;
+    void *data;
+    uint64_t due;               // Tick the job is due in, while on the wheel
+    struct sched_entry *next;   // Next job in the slot or the run queue
+    struct sched_entry *all;    // Next job added
+} sched_entry;
+
+/**
+ * The workers of a class, and the jobs
+ * that are due and waiting for them.
+ */
+typedef struct {
+    bloom_scheduler *sched;
+    sched_class cls;
+    pthread_cond_t cond;        // Signaled when a job is queued
+    sched_entry *head;
+    sched_entry *tail;
+    int num_threads;
+    int started;                // Workers that were started
+    pthread_t *threads;
+} sched_pool;
+
+struct bloom_scheduler {
+    pthread_mutex_t lock;       // Protects all of the state
+    pthread_cond_t cond;        // Wakes the timer thread
+    pthread_t timer;
+    int should_run;
+
+    struct timespec start;      // Tick 0
+    uint64_t tick;              // Last tick that was expired
+    uint64_t wake;              // Tick the timer sleeps until, or UINT64_MAX
+    sched_entry *slots[SCHED_SLOTS];
+    sched_entry *jobs;          // Every job, for cleanup
+    uint64_t runs;
+
+    sched_pool pools[SCHED_CLASSES];
+    sched_hook idle;
+    sched_hook leave;
+    void *arg;
+};
+
+/*
+ * Static declarations
+ */
+static void* timer_main(void *in);
+static void* worker_main(void *in);
+static uint64_t now_tick(bloom_scheduler *s);
+static void tick_deadline(bloom_scheduler *s, uint64_t tick, struct timespec *ts);
+static void wheel_insert(bloom_scheduler *s, sched_entry *e, uint64_t delay_msec);
+static void expire_slot(bloom_scheduler *s, int slot, uint64_t now);
+static uint64_t next_due(bloom_scheduler *s);
+static int start_pool(sched_pool *pool);
+
+
+/**
+ * Creates a scheduler and starts its timer thread.
+ * The workers of a class are started with its first job.
+ * @arg workers The number of workers of each class, indexed
+ * by the class, each at least 1.
+ * @arg idle Optional, invoked by a worker after each job
+ * @arg leave Optional, invoked by a worker before it exits
+ * @arg arg Passed to the hooks
+ * @arg sched Output, the new scheduler
+ * @return 0 on success.
+ */
+int init_scheduler(const int *workers, sched_hook idle, sched_hook leave,
+        void *arg, bloom_scheduler **sched) {
+    bloom_scheduler *s = calloc(1, sizeof(bloom_scheduler));
+    if (!s) return -1;
+    s->should_run = 1;
+    s->wake = UINT64_MAX;
+    s->idle = idle;
+    s->leave = leave;
+    s->arg = arg;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+    // The deadlines are monotonic, so changing the clock does not stall the jobs
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (int i=0; i < SCHED_CLASSES; i++) {
+        sched_pool *pool = s->pools + i;
+        pool->sched = s;
+        pool->cls = i;
+        pool->num_threads = (workers[i] > 0) ? workers[i] : 1;
+        pthread_cond_init(&pool->cond, NULL);
+    }
+
+    if (pthread_create(&s->timer, NULL, timer_main, s)) {
+        syslog(LOG_ERR, "Failed to start the scheduler thread!");
+        for (int i=0; i < SCHED_CLASSES; i++) pthread_cond_destroy(&s->pools[i].cond);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        return -1;
+    }
+    *sched = s;
+    return 0;
+}
+
+/**
+ * Stops the scheduler and destroys it. The running jobs
+ * are waited for, and the jobs that are due are not run.
+ * @arg sched The scheduler
+ */
+void destroy_scheduler(bloom_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->should_run = 0;
+    pthread_cond_signal(&sched->cond);
+    for (int i=0; i < SCHED_CLASSES; i++) pthread_cond_broadcast(&sched->pools[i].cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    pthread_join(sched->timer, NULL);
+    for (int i=0; i < SCHED_CLASSES; i++) {
+        sched_pool *pool = sched->pools + i;
+        for (int t=0; t < pool->started; t++) pthread_join(pool->threads[t], NULL);
+        free(pool->threads);
+        pthread_cond_destroy(&pool->cond);
+    }
+
+    sched_entry *e = sched->jobs, *next;
+    while (e) {
+        next = e->all;
+        free(e->name);
+        free(e->cpus);
+        free(e);
+        e = next;
+    }
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+/**
+ * Adds a job, which first runs once its interval passes.
+ * @arg sched The scheduler
+ * @arg name The name of the job, used for logging
+ * @arg cls The priority class of the job
+ * @arg interval_msec The interval of the job in milliseconds
+ * @arg cpus Optional, a list of CPUs the job is pinned to
+ * while it runs, such as "0-3"
+ * @arg job The job
+ * @arg data Passed to the job
+ * @return 0 on success, -1 if the workers of the
+ * class could not be started.
+ */
+int sched_add_job(bloom_scheduler *sched, const char *name, sched_class cls,
+        int interval_msec, const char *cpus, sched_job job, void *data) {
+    sched_entry *e = calloc(1, sizeof(sched_entry));
+    if (!e) return -1;
+    e->name = strdup(name);
+    e->cls = cls;
+    e->interval = (interval_msec > 0) ? interval_msec : SCHED_TICK_MSEC;
+    e->cpus = (cpus) ? strdup(cpus) : NULL;
+    e->func = job;
+    e->data = data;
+
+    pthread_mutex_lock(&sched->lock);
+    sched_pool *pool = sched->pools + cls;
+    if (!pool->started && start_pool(pool)) {
+        pthread_mutex_unlock(&sched->lock);
+        free(e->name);
+        free(e->cpus);
+        free(e);
+        return -1;
+    }
+    e->all = sched->jobs;
+    sched->jobs = e;
+    wheel_insert(sched, e, e->interval);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+/**
+ * Returns the number of times the jobs have run.
+ * @arg sched The scheduler
+ * @return The number of runs
+ */
+uint64_t sched_runs(bloom_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    uint64_t runs = sched->runs;
+    pthread_mutex_unlock(&sched->lock);
+    return runs;
+}
+
+/**
+ * Lowers the CPU and IO priority of the calling
+ * thread to that of a class. The priority of a thread
+ * can not be raised back without privileges.
+ * @arg cls The class
+ * @return 0 on success, -1 if it could not be lowered.
+ */
+int sched_set_class(sched_class cls) {
+    if (cls == SCHED_CLASS_NORMAL) return 0;
+#ifdef __linux__
+    // The nice value and IO priority of a thread are set
+    // by its id, as each thread has its own on Linux
+    int res = 0;
+    pid_t tid = syscall(SYS_gettid);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0) {
+        nice += CLASS_NICE[cls];
+        if (nice > 19) nice = 19;
+        if (setpriority(PRIO_PROCESS, tid, nice)) res = -1;
+    }
+
+    int ioprio = (cls == SCHED_CLASS_IDLE) ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0) :
+        IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio)) res = -1;
+    return res;
+#else
+    return (setpriority(PRIO_PROCESS, 0, CLASS_NICE[cls])) ? -1 : 0;
+#endif
+}
+
+/**
+ * Starts the workers of a class. Called with the lock.
+ * @arg pool The pool of the class
+ * @return 0 on success.
+ */
+static int start_pool(sched_pool *pool) {
+    pool->threads = calloc(pool->num_threads, sizeof(pthread_t));
+    if (!pool->threads) return -1;
+    for (int i=0; i < pool->num_threads; i++) {
+        if (pthread_create(pool->threads + i, NULL, worker_main, pool)) break;
+        pool->started++;
+    }
+    if (pool->started) return 0;
+    syslog(LOG_ERR, "Failed to start the scheduler workers!");
+    free(pool->threads);
+    pool->threads = NULL;
+    return -1;
+}
+
+/**
+ * Returns the current tick of the timer wheel.
+ */
+static uint64_t now_tick(bloom_scheduler *s) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t msec = (ts.tv_sec - s->start.tv_sec) * 1000 +
+        (ts.tv_nsec - s->start.tv_nsec) / 1000000;
+    return msec / SCHED_TICK_MSEC;
+}
+
+/**
+ * Converts a tick into a deadline for the timer.
+ */
+static void tick_deadline(bloom_scheduler *s, uint64_t tick, struct timespec *ts) {
+    uint64_t nsec = s->start.tv_nsec + (tick * SCHED_TICK_MSEC % 1000) * 1000000;
+    ts->tv_sec = s->start.tv_sec + tick * SCHED_TICK_MSEC / 1000 + nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+}
+
+/**
+ * Puts a job on the wheel, and wakes the timer
+ * if the job is due before it would wake up.
+ * Called with the lock.
+ * @arg s The scheduler
+ * @arg e The job
+ * @arg delay_msec When the job is due
+ */
+static void wheel_insert(bloom_scheduler *s, sched_entry *e, uint64_t delay_msec) {
+    uint64_t due = now_tick(s) + (delay_msec + SCHED_TICK_MSEC - 1) / SCHED_TICK_MSEC;
+
+    // Slots that were expired are only checked on the next turn
+    if (due <= s->tick) due = s->tick + 1;
+    e->due = due;
+    int slot = due % SCHED_SLOTS;
+    e->next = s->slots[slot];
+    s->slots[slot] = e;
+    if (due < s->wake) pthread_cond_signal(&s->cond);
+}
+
+/**
+ * Moves the jobs of a slot that are due to the run
+ * queues of their classes. Called with the lock.
+ * @arg s The scheduler
+ * @arg slot The slot
+ * @arg now The current tick
+ */
+static void expire_slot(bloom_scheduler *s, int slot, uint64_t now) {
+    sched_entry **prev = &s->slots[slot], *e;
+    while ((e = *prev)) {
+        if (e->due > now) {
+            prev = &e->next;
+            continue;
+        }
+        *prev = e->next;
+        e->next = NULL;
+        sched_pool *pool = s->pools + e->cls;
+        if (pool->tail) pool->tail->next = e;
+        else pool->head = e;
+        pool->tail = e;
+        pthread_cond_signal(&pool->cond);
+    }
+}
+
+/**
+ * Finds the tick the earliest job is due in, walking the
+ * wheel from the current tick. Called with the lock.
+ * @return The tick, or UINT64_MAX if there are no jobs on the wheel.
+ */
+static uint64_t next_due(bloom_scheduler *s) {
+    uint64_t earliest = UINT64_MAX;
+    for (uint64_t i=1; i <= SCHED_SLOTS; i++) {
+        uint64_t tick = s->tick + i;
+        for (sched_entry *e = s->slots[tick % SCHED_SLOTS]; e; e = e->next) {
+            // A job due in this tick is the earliest, the others are later turns
+            if (e->due == tick) return tick;
+            if (e->due < earliest) earliest = e->due;
+        }
+    }
+    return earliest;
+}
+
+/**
+ * Entry point of the timer thread. Moves the due jobs to
+ * the workers, and sleeps until the next job is due.
+ */
+static void* timer_main(void *in) {
+    bloom_scheduler *s = in;
+    pthread_mutex_lock(&s->lock);
+    while (s->should_run) {
+        // Expire the slots of the ticks that passed, which
+        // is every slot once if we fell a turn behind
+        uint64_t now = now_tick(s);
+        if (now > s->tick) {
+            if (now - s->tick >= SCHED_SLOTS) {
+                for (int slot=0; slot < SCHED_SLOTS; slot++) expire_slot(s, slot, now);
+            } else {
+                for (uint64_t t = s->tick + 1; t <= now; t++) expire_slot(s, t % SCHED_SLOTS, now);
+            }
+            s->tick = now;
+        }
+
+        // Sleep until the earliest job, or a job is added before it
+        s->wake = next_due(s);
+        if (s->wake == UINT64_MAX) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        } else {
+            struct timespec deadline;
+            tick_deadline(s, s->wake, &deadline);
+            pthread_cond_timedwait(&s->cond, &s->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Entry point of the workers. Runs the jobs queued for the
+ * class, and puts each back on the wheel once it has run.
+ */
+static void* worker_main(void *in) {
+    sched_pool *pool = in;
+    bloom_scheduler *s = pool->sched;
+    if (sched_set_class(pool->cls))
+        syslog(LOG_WARNING, "Failed to lower the priority of a scheduler worker. %s", strerror(errno));
+
+#ifdef __linux__
+    // Restored after the jobs that are pinned
+    cpu_set_t affinity;
+    int have_affinity = !pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+#endif
+
+    pthread_mutex_lock(&s->lock);
+    while (s->should_run) {
+        sched_entry *e = pool->head;
+        if (!e) {
+            pthread_cond_wait(&pool->cond, &s->lock);
+            continue;
+        }
+        pool->head = e->next;
+        if (!pool->head) pool->tail = NULL;
+        s->runs++;
+        pthread_mutex_unlock(&s->lock);
+
+        // The job is off the wheel while it runs, so no other
+        // worker can run it at the same time
+        if (e->cpus && numa_pin_thread(e->cpus, -1))
+            syslog(LOG_WARNING, "Failed to pin the %s job to CPUs %s.", e->name, e->cpus);
+        int delay = e->func(e->data);
+#ifdef __linux__
+        if (e->cpus && have_affinity)
+            pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+#endif
+        if (s->idle) s->idle(s->arg);
+
+        pthread_mutex_lock(&s->lock);
+        if (delay >= 0) wheel_insert(s, e, (delay) ? delay : e->interval);
+        else syslog(LOG_INFO, "Stopped running the %s job.", e->name);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->leave) s->leave(s->arg);
+    return NULL;
+}
@@ -0,0 +1,107 @@
+#ifndef BLOOM_SCHEDULER_H
+#define BLOOM_SCHEDULER_H
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * The scheduler runs the periodic background jobs, such as
+ * the flushes and the cold unmaps, in place of a thread per
+ * job that wakes every few hundred milliseconds to check if
+ * it is due. The due jobs are kept on a hashed timer wheel,
+ * and its thread sleeps until the earliest of them, so an
+ * idle server is not woken at all between the jobs.
+ *
+ * Each job has a priority class, and each class has its own
+ * pool of worker threads, which runs at the CPU and IO
+ * priority of the class so that background work yields to
+ * the commands of the clients. The number of workers of a
+ * class limits how many of its jobs run at once, and a job
+ * never runs concurrently with itself.
+ */
+
+/**
+ * The priority classes of the jobs
+ */
+typedef enum {
+    SCHED_CLASS_NORMAL = 0,     // Runs at the priority of the server
+    SCHED_CLASS_BACKGROUND,     // Lower CPU priority, lowest best effort IO priority
+    SCHED_CLASS_IDLE,           // Lowest CPU priority, only does IO when the disks are idle
+} sched_class;
+
+#define SCHED_CLASSES 3
+
+/**
+ * A job to run. Jobs run with the given data and
+ * return when they should run again.
+ * @arg data The data given when the job was added
+ * @return The milliseconds until the next run, 0 to
+ * wait the interval of the job, or -1 to stop running it.
+ */
+typedef int (*sched_job)(void *data);
+
+/**
+ * Invoked by each worker on events of the worker,
+ * such as once a job has run.
+ * @arg arg The argument given to the scheduler
+ */
+typedef void (*sched_hook)(void *arg);
+
+/**
+ * Opaque handle to a scheduler
+ */
+typedef struct bloom_scheduler bloom_scheduler;
+
+/**
+ * Creates a scheduler and starts its timer thread.
+ * The workers of a class are started with its first job.
+ * @arg workers The number of workers of each class, indexed
+ * by the class, each at least 1.
+ * @arg idle Optional, invoked by a worker after each job
+ * @arg leave Optional, invoked by a worker before it exits
+ * @arg arg Passed to the hooks
+ * @arg sched Output, the new scheduler
+ * @return 0 on success.
+ */
+int init_scheduler(const int *workers, sched_hook idle, sched_hook leave,
+        void *arg, bloom_scheduler **sched);
+
+/**
+ * Stops the scheduler and destroys it. The running jobs
+ * are waited for, and the jobs that are due are not run.
+ * @arg sched The scheduler
+ */
+void destroy_scheduler(bloom_scheduler *sched);
+
+/**
+ * Adds a job, which first runs once its interval passes.
+ * @arg sched The scheduler
+ * @arg name The name of the job, used for logging
+ * @arg cls The priority class of the job
+ * @arg interval_msec The interval of the job in milliseconds
+ * @arg cpus Optional, a list of CPUs the job is pinned to
+ * while it runs, such as "0-3"
+ * @arg job The job
+ * @arg data Passed to the job
+ * @return 0 on success, -1 if the workers of the
+ * class could not be started.
+ */
+int sched_add_job(bloom_scheduler *sched, const char *name, sched_class cls,
+        int interval_msec, const char *cpus, sched_job job, void *data);
+
+/**
+ * Returns the number of times the jobs have run.
+ * @arg sched The scheduler
+ * @return The number of runs
+ */
+uint64_t sched_runs(bloom_scheduler *sched);
+
+/**
+ * Lowers the CPU and IO priority of the calling
+ * thread to that of a class. The priority of a thread
+ * can not be raised back without privileges.
+ * @arg cls The class
+ * @return 0 on success, -1 if it could not be lowered.
+ */
+int sched_set_class(sched_class cls);
+
+#endif
@@ -0,0 +1,498 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "set_log.h"
+
+/*
+ * File names of the current and rotated logs
+ */
+static const char* LOG_FILE_NAME = "set.log";
+static const char* OLD_LOG_FILE_NAME = "set.log.old";
+
+/**
+ * Appends smaller than this are built on the stack
+ */
+#define APPEND_STACK_SIZE 4096
+
+/**
+ * Size of the buffer used to replay logs, and
+ * the number of keys replayed in a batch
+ */
+#define REPLAY_BUF_SIZE 65536
+#define REPLAY_BATCH 128
+
+/**
+ * Size of the header of a record, a zero
+ * byte followed by the length of the key
+ */
+#define RECORD_HEADER_SIZE (1 + sizeof(uint32_t))
+
+/*
+ * The logs waiting to be synced. The pass lock is held
+ * while logs are synced, so that a log cannot be closed
+ * or rotated while its descriptor is being synced.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static bloom_set_log *sync_queue = NULL;
+
+/*
+ * Static declarations
+ */
+static int open_log_file(char *path);
+static int repair_tail(int fd);
+static int sync_dir(char *path);
+static int replay_file(char *path, setlog_replay_cb cb, void *data);
+static int scan_file(int fd, setlog_replay_cb cb, void *data, off_t *valid);
+static size_t parse_record(char *pos, char *end, char **key, int *key_len);
+static int write_all(int fd, char *buf, size_t len);
+
+/**
+ * Opens the set log in a directory, creating it if needed.
+ * @arg dir The directory of the log
+ * @arg log Output, the new log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_open(char *dir, bloom_set_log **log) {
+    bloom_set_log *l = calloc(1, sizeof(bloom_set_log));
+    if (!l) return -ENOMEM;
+    l->path = join_path(dir, (char*)LOG_FILE_NAME);
+    l->old_path = join_path(dir, (char*)OLD_LOG_FILE_NAME);
+    l->old_pending = (access(l->old_path, F_OK) == 0);
+
+    l->fd = open_log_file(l->path);
+    if (l->fd < 0) {
+        int res = l->fd;
+        syslog(LOG_ERR, "Failed to open set log '%s'. %s", l->path, strerror(-res));
+        free(l->path);
+        free(l->old_path);
+        free(l);
+        return res;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    *log = l;
+    return 0;
+}
+
+/**
+ * Closes a set log and frees it. The log files
+ * are left in place.
+ * @arg log The log to close
+ */
+void setlog_close(bloom_set_log *log) {
+    // Wait for any sync pass to finish, and leave the queue
+    pthread_mutex_lock(&pass_lock);
+    pthread_mutex_lock(&queue_lock);
+    bloom_set_log **prev = &sync_queue;
+    while (*prev) {
+        if (*prev == log) {
+            *prev = log->next;
+            break;
+        }
+        prev = &(*prev)->next;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    // Sync anything that is pending before closing
+    if (log->queued) fdatasync(log->fd);
+    close(log->fd);
+    pthread_mutex_unlock(&pass_lock);
+
+    pthread_mutex_destroy(&log->lock);
+    free(log->path);
+    free(log->old_path);
+    free(log);
+}
+
+/**
+ * Appends keys to the log with a single write. The
+ * keys are durable once the log is next synced.
+ * @note Thread safe.
+ * @arg log The log
+ * @arg keys The keys to append
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg result If not NULL, only keys with a non-zero
+ * result are appended.
+ * @arg num_keys The number of keys
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_append(bloom_set_log *log, char **keys, int *key_lens, char *result, int num_keys) {
+    // Determine the size of the records
+    size_t len = 0;
+    for (int i=0; i < num_keys; i++) {
+        if (result && !result[i]) continue;
+        len += RECORD_HEADER_SIZE + ((key_lens) ? (size_t)key_lens[i] : strlen(keys[i]));
+    }
+    if (!len) return 0;
+
+    // Build the records, each key prefixed by its length
+    char stack_buf[APPEND_STACK_SIZE];
+    char *buf = (len <= APPEND_STACK_SIZE) ? stack_buf : malloc(len);
+    if (!buf) return -ENOMEM;
+    char *pos = buf;
+    for (int i=0; i < num_keys; i++) {
+        if (result && !result[i]) continue;
+        uint32_t key_len = (key_lens) ? (uint32_t)key_lens[i] : strlen(keys[i]);
+        *pos = '\0';
+        memcpy(pos + 1, &key_len, sizeof(key_len));
+        memcpy(pos + RECORD_HEADER_SIZE, keys[i], key_len);
+        pos += RECORD_HEADER_SIZE + key_len;
+    }
+
+    // Write the record, and queue the log for a sync
+    pthread_mutex_lock(&log->lock);
+    int res = write_all(log->fd, buf, len);
+    int queue = !res && !log->queued;
+    if (queue) log->queued = 1;
+    pthread_mutex_unlock(&log->lock);
+    if (buf != stack_buf) free(buf);
+
+    if (queue) {
+        pthread_mutex_lock(&queue_lock);
+        log->next = sync_queue;
+        sync_queue = log;
+        pthread_mutex_unlock(&queue_lock);
+    }
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to append to set log '%s'. %s", log->path, strerror(-res));
+    }
+    return res;
+}
+
+/**
+ * Replays the rotated and current logs, in that order.
+ * A partially written key at the end of a log is ignored.
+ * @arg log The log
+ * @arg cb Invoked with batches of keys
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of keys replayed, or negative on error.
+ */
+int setlog_replay(bloom_set_log *log, setlog_replay_cb cb, void *data) {
+    int total = 0, res;
+    if (log->old_pending) {
+        res = replay_file(log->old_path, cb, data);
+        if (res < 0) return res;
+        total += res;
+    }
+    res = replay_file(log->path, cb, data);
+    if (res < 0) return res;
+    return total + res;
+}
+
+/**
+ * Rotates the log before a flush. Keys appended after the
+ * rotation go to a new log. If a previous rotated log was
+ * never released, the log is not rotated again.
+ * @note Thread safe with setlog_append.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_rotate(bloom_set_log *log) {
+    int res = 0, old_fd = -1;
+    pthread_mutex_lock(&pass_lock);
+    pthread_mutex_lock(&log->lock);
+    if (!log->old_pending) {
+        if (rename(log->path, log->old_path)) {
+            res = -errno;
+        } else {
+            old_fd = log->fd;
+            log->old_pending = 1;
+            log->fd = open_log_file(log->path);
+            if (log->fd < 0) {
+                // Move the log back, and keep appending to it
+                res = log->fd;
+                if (!rename(log->old_path, log->path)) log->old_pending = 0;
+                log->fd = old_fd;
+                old_fd = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    // The rotated log must be durable until the flush is
+    if (old_fd >= 0) {
+        fdatasync(old_fd);
+        close(old_fd);
+    }
+    if (!res) res = sync_dir(log->path);
+    pthread_mutex_unlock(&pass_lock);
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to rotate set log '%s'. %s", log->path, strerror(-res));
+    }
+    return res;
+}
+
+/**
+ * Removes the rotated log after a successful flush.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_release(bloom_set_log *log) {
+    int res = 0;
+    pthread_mutex_lock(&log->lock);
+    if (log->old_pending) {
+        if (unlink(log->old_path) && errno != ENOENT) {
+            res = -errno;
+            syslog(LOG_ERR, "Failed to remove set log '%s'. %s", log->old_path, strerror(errno));
+        } else {
+            log->old_pending = 0;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return res;
+}
+
+/**
+ * Empties the current and rotated logs, once the
+ * keys they hold are no longer wanted.
+ * @note Thread safe with setlog_append.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_truncate(bloom_set_log *log) {
+    int res = 0;
+    pthread_mutex_lock(&pass_lock);
+    pthread_mutex_lock(&log->lock);
+    if (log->old_pending) {
+        if (unlink(log->old_path) && errno != ENOENT) res = -errno;
+        else log->old_pending = 0;
+    }
+
+    // Appends are O_APPEND, so they continue from the new end
+    if (!res && (ftruncate(log->fd, 0) || fsync(log->fd))) res = -errno;
+    pthread_mutex_unlock(&log->lock);
+    if (!res) res = sync_dir(log->path);
+    pthread_mutex_unlock(&pass_lock);
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to truncate set log '%s'. %s", log->path, strerror(-res));
+    }
+    return res;
+}
+
+/**
+ * Syncs all the logs that have been appended to since
+ * their last sync, using one fdatasync per log.
+ * @note Thread safe.
+ * @return The number of logs synced.
+ */
+int setlog_sync_all(void) {
+    pthread_mutex_lock(&pass_lock);
+    pthread_mutex_lock(&queue_lock);
+    bloom_set_log *log = sync_queue;
+    sync_queue = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    // Appends after we clear the flag queue the log again,
+    // so we must read the next pointer before clearing it
+    int synced = 0, fd;
+    bloom_set_log *next;
+    while (log) {
+        next = log->next;
+        pthread_mutex_lock(&log->lock);
+        log->queued = 0;
+        fd = log->fd;
+        pthread_mutex_unlock(&log->lock);
+
+        if (fdatasync(fd)) {
+            syslog(LOG_ERR, "Failed to sync set log '%s'. %s", log->path, strerror(errno));
+        }
+        synced++;
+        log = next;
+    }
+    pthread_mutex_unlock(&pass_lock);
+    return synced;
+}
+
+/**
+ * Opens a log file for appending, and drops any
+ * partially written key at the end.
+ * @return The file descriptor, or negative errno.
+ */
+static int open_log_file(char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return -errno;
+    int res = repair_tail(fd);
+    if (res) {
+        close(fd);
+        return res;
+    }
+    return fd;
+}
+
+/**
+ * Truncates a log after the last complete key, so that
+ * new keys are not appended onto a torn one.
+ */
+static int repair_tail(int fd) {
+    struct stat buf;
+    if (fstat(fd, &buf)) return -errno;
+
+    off_t end;
+    int res = scan_file(fd, NULL, NULL, &end);
+    if (res < 0) return res;
+    if (end != buf.st_size) {
+        syslog(LOG_WARNING, "Dropping %lld bytes of a partial set log entry.",
+                (long long)(buf.st_size - end));
+        if (ftruncate(fd, end)) return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Syncs the directory containing a path, so that
+ * a newly created or renamed file is durable.
+ */
+static int sync_dir(char *path) {
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    int fd = open(slash ? dir : ".", O_RDONLY);
+    free(dir);
+    if (fd < 0) return -errno;
+    int res = fsync(fd) ? -errno : 0;
+    close(fd);
+    return res;
+}
+
+/**
+ * Replays a single log file in batches of keys.
+ * @return The number of keys replayed, or negative errno.
+ */
+static int replay_file(char *path, setlog_replay_cb cb, void *data) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return (errno == ENOENT) ? 0 : -errno;
+
+    off_t valid;
+    int res = scan_file(fd, cb, data, &valid);
+    close(fd);
+    if (res < 0) {
+        syslog(LOG_ERR, "Failed to replay set log '%s'. Err: %d", path, res);
+    }
+    return res;
+}
+
+/**
+ * Reads the records of a log from the start, passing the
+ * keys to a callback in batches.
+ * @arg cb Invoked with batches of keys, if not NULL
+ * @arg valid Output, the size of the complete records
+ * @return The number of keys read, or negative errno.
+ */
+static int scan_file(int fd, setlog_replay_cb cb, void *data, off_t *valid) {
+    size_t size = REPLAY_BUF_SIZE, filled = 0;
+    char *buf = malloc(size);
+    if (!buf) return -ENOMEM;
+    char *keys[REPLAY_BATCH];
+    int key_lens[REPLAY_BATCH];
+    int num_keys = 0, total = 0, res = 0;
+    off_t offset = 0;
+    ssize_t n;
+    while (1) {
+        // Grow the buffer if a single key fills it
+        if (filled == size) {
+            char *grown = realloc(buf, size * 2);
+            if (!grown) {
+                res = -ENOMEM;
+                break;
+            }
+            buf = grown;
+            size *= 2;
+        }
+        n = pread(fd, buf + filled, size - filled, offset + filled);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            res = -errno;
+            break;
+        }
+        if (n == 0) break;
+        filled += n;
+
+        // Pass on the complete keys
+        char *pos = buf, *end = buf + filled, *key;
+        int key_len;
+        size_t used;
+        while (pos < end && (used = parse_record(pos, end, &key, &key_len))) {
+            pos += used;
+            if (!cb || !key_len) continue;
+            keys[num_keys] = key;
+            key_lens[num_keys++] = key_len;
+            if (num_keys == REPLAY_BATCH) {
+                if ((res = cb(data, keys, key_lens, num_keys))) goto LEAVE;
+                total += num_keys;
+                num_keys = 0;
+            }
+        }
+        if (num_keys) {
+            if ((res = cb(data, keys, key_lens, num_keys))) goto LEAVE;
+            total += num_keys;
+            num_keys = 0;
+        }
+
+        // Move a partial key to the front
+        offset += pos - buf;
+        filled = end - pos;
+        memmove(buf, pos, filled);
+    }
+    *valid = offset;
+
+LEAVE:
+    free(buf);
+    if (res) return (res < 0) ? res : -EIO;
+    return total;
+}
+
+/**
+ * Parses the record at the start of a buffer. Lines,
+ * as written by older versions, are taken as keys.
+ * @arg pos The start of the record
+ * @arg end The end of the buffer, past pos
+ * @arg key Output, the key of the record
+ * @arg key_len Output, the length of the key
+ * @return The size of the record, or 0 if it is not complete.
+ */
+static size_t parse_record(char *pos, char *end, char **key, int *key_len) {
+    if (*pos) {
+        char *term = memchr(pos, '\n', end - pos);
+        if (!term) return 0;
+        *key = pos;
+        *key_len = term - pos;
+        return term - pos + 1;
+    }
+
+    uint32_t len;
+    if ((size_t)(end - pos) < RECORD_HEADER_SIZE) return 0;
+    memcpy(&len, pos + 1, sizeof(len));
+    if ((size_t)(end - pos) - RECORD_HEADER_SIZE < len) return 0;
+    *key = pos + RECORD_HEADER_SIZE;
+    *key_len = len;
+    return RECORD_HEADER_SIZE + len;
+}
+
+/**
+ * Writes out an entire buffer.
+ * @return 0 on success, negative errno on error.
+ */
+static int write_all(int fd, char *buf, size_t len) {
+    ssize_t n;
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef BLOOM_SET_LOG_H
+#define BLOOM_SET_LOG_H
+#include <pthread.h>
+
+/*
+ * The set log is an append-only log of the keys that
+ * were added to a filter since it was last flushed. Keys
+ * are written to the log as they are set, and the logs are
+ * synced to disk in groups on an interval, so a crash only
+ * loses the sets since the last sync instead of the sets
+ * since the last flush.
+ *
+ * When a filter is flushed, the log is first rotated, and
+ * the rotated log is removed once the flush succeeds. On
+ * startup, any rotated and current logs are replayed.
+ *
+ * Each key is written as a record of a zero byte, its length
+ * as 32bits and its bytes, so keys may hold any byte. Logs
+ * written before, with a key per line, are still replayed,
+ * since a line never starts with a zero byte.
+ */
+typedef struct bloom_set_log {
+    char *path;                 // Path of the current log
+    char *old_path;             // Path of the rotated log
+    int fd;                     // The current log
+    int old_pending;            // Is the rotated log waiting on a flush
+    int queued;                 // Is the log waiting to be synced
+    pthread_mutex_t lock;       // Protects the fields above
+    struct bloom_set_log *next; // Next log waiting to be synced
+} bloom_set_log;
+
+/**
+ * Callback used to replay the keys of a log
+ * @arg data Opaque pointer passed to setlog_replay
+ * @arg keys The keys to replay, which are not null terminated
+ * @arg key_lens The lengths of the keys
+ * @arg num_keys The number of keys
+ * @return 0 on success.
+ */
+typedef int(*setlog_replay_cb)(void *data, char **keys, int *key_lens, int num_keys);
+
+/**
+ * Opens the set log in a directory, creating it if needed.
+ * @arg dir The directory of the log
+ * @arg log Output, the new log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_open(char *dir, bloom_set_log **log);
+
+/**
+ * Closes a set log and frees it. The log files
+ * are left in place.
+ * @arg log The log to close
+ */
+void setlog_close(bloom_set_log *log);
+
+/**
+ * Appends keys to the log with a single write. The
+ * keys are durable once the log is next synced.
+ * @note Thread safe.
+ * @arg log The log
+ * @arg keys The keys to append
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg result If not NULL, only keys with a non-zero
+ * result are appended.
+ * @arg num_keys The number of keys
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_append(bloom_set_log *log, char **keys, int *key_lens, char *result, int num_keys);
+
+/**
+ * Replays the rotated and current logs, in that order.
+ * A partially written key at the end of a log is ignored.
+ * @arg log The log
+ * @arg cb Invoked with batches of keys
+ * @arg data Opaque pointer passed to the callback
+ * @return The number of keys replayed, or negative on error.
+ */
+int setlog_replay(bloom_set_log *log, setlog_replay_cb cb, void *data);
+
+/**
+ * Rotates the log before a flush. Keys appended after the
+ * rotation go to a new log. If a previous rotated log was
+ * never released, the log is not rotated again.
+ * @note Thread safe with setlog_append.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_rotate(bloom_set_log *log);
+
+/**
+ * Removes the rotated log after a successful flush.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_release(bloom_set_log *log);
+
+/**
+ * Empties the current and rotated logs, once the
+ * keys they hold are no longer wanted.
+ * @note Thread safe with setlog_append.
+ * @arg log The log
+ * @return 0 on success, negative errno on error.
+ */
+int setlog_truncate(bloom_set_log *log);
+
+/**
+ * Syncs all the logs that have been appended to since
+ * their last sync, using one fdatasync per log.
+ * @note Thread safe.
+ * @return The number of logs synced.
+ */
+int setlog_sync_all(void);
+
+#endif
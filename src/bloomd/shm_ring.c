@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include "shm_ring.h"
+#include "latency.h"
+
+/*
+ * The binary protocol carried by the rings
+ */
+#define BIN_MAGIC 0xB1
+#define BIN_HEADER_LEN 8
+#define BIN_CHECK 1
+#define BIN_SET 2
+#define BIN_OK 0
+#define BIN_FILT_NOT_EXIST 1
+#define BIN_BAD_ARGS 2
+#define BIN_CMD_NOT_SUP 3
+#define BIN_INTERNAL_ERR 4
+#define BIN_FILT_FROZEN 5
+#define BIN_READ_ONLY 6
+#define BIN_FILT_OVER_QUOTA 8
+#define BIN_FILT_LOADING 9
+
+/*
+ * Most clients served at once
+ */
+#define SHM_MAX_SESSIONS 256
+
+/*
+ * Polling loops between checks of the sockets for new
+ * clients, while the rings keep the thread busy
+ */
+#define SHM_SOCKET_CHECK 4096
+
+/*
+ * How long the thread sleeps at most, so it notices
+ * it should stop
+ */
+#define SHM_SLEEP_MSEC 1000
+
+/*
+ * A connected client
+ */
+typedef struct {
+    int sock;                   // Control socket, closed by the client when done
+    int req_efd;                // Signaled by the client while we sleep
+    int resp_efd;               // Signaled by us while the client sleeps
+    char *region;
+    size_t region_len;
+    shm_ring_ctl *req;
+    shm_ring_ctl *resp;
+    char *req_data;
+    char *resp_data;
+    uint64_t ring_size;
+} shm_session;
+
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    int listen_fd;
+    shm_session *sessions[SHM_MAX_SESSIONS];
+    int num_sessions;
+    char *buf;                  // A copy of the request being handled
+    char **keys;
+    int *key_lens;
+    char *result;
+    uint32_t keys_cap;
+} shm_server;
+
+// Static declarations
+static int bind_shm_socket(char *path);
+static void* shm_thread_main(void *in);
+static int accept_session(shm_server *srv);
+static void close_session(shm_server *srv, int idx);
+static int check_sockets(shm_server *srv, int timeout_msec);
+static int handle_requests(shm_server *srv, shm_session *s);
+static int handle_keys(shm_server *srv, int opcode, char *filter_name,
+        char *body, uint32_t body_len, uint32_t *resp_len);
+
+/**
+ * Starts the shared memory thread, which accepts clients
+ * on the shm_socket and serves their rings.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_shm_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we have no socket to accept clients on
+    if (!config->shm_socket) return 0;
+    int fd = bind_shm_socket(config->shm_socket);
+    if (fd < 0) return 0;
+
+    shm_server *srv = calloc(1, sizeof(shm_server));
+    srv->config = config;
+    srv->mgr = mgr;
+    srv->should_run = should_run;
+    srv->listen_fd = fd;
+    srv->buf = malloc((size_t)config->shm_ring_kb * 1024);
+    pthread_create(t, NULL, shm_thread_main, srv);
+    return 1;
+}
+
+/**
+ * Binds the shm socket. A socket file left by a
+ * previous process is replaced.
+ * @return The listening socket, or -1 on error.
+ */
+static int bind_shm_socket(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    } else {
+        struct stat st;
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create the shm socket! Err: %s", strerror(errno));
+        return -1;
+    }
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) || listen(fd, 64)) {
+        syslog(LOG_ERR, "Failed to listen on the shm socket '%s'! Err: %s",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Serves the rings of the clients. While any ring has work
+ * the thread only polls the rings. Once they have all been
+ * empty for shm_spin_usec, it sleeps on their eventfds and
+ * the sockets.
+ */
+static void* shm_thread_main(void *in) {
+    shm_server *srv = in;
+    syslog(LOG_INFO, "Serving shared memory clients on '%s'.", srv->config->shm_socket);
+
+    // Spinning only delays the clients on a single CPU
+    uint64_t spin_nsec = (uint64_t)srv->config->shm_spin_usec * 1000;
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) spin_nsec = 0;
+
+    uint64_t idle_since = 0;
+    uint32_t loops = 0;
+    while (*srv->should_run) {
+        filtmgr_client_checkpoint(srv->mgr);
+        int work = 0;
+        for (int i=0; i < srv->num_sessions; i++) {
+            int res = handle_requests(srv, srv->sessions[i]);
+            if (res < 0) {
+                syslog(LOG_WARNING, "Closing a shared memory client that sent a bad message!");
+                close_session(srv, i--);
+                continue;
+            }
+            work += res;
+        }
+
+        // Look for new clients now and then, without a system
+        // call on every loop
+        if (++loops % SHM_SOCKET_CHECK == 0) check_sockets(srv, 0);
+        if (work) {
+            idle_since = 0;
+            continue;
+        }
+
+        // Keep spinning for a while, new requests are likely
+        uint64_t now = latency_now();
+        if (!idle_since) idle_since = now;
+        if (now - idle_since < spin_nsec) {
+            __asm__ __volatile__("" ::: "memory");
+            continue;
+        }
+
+        // Tell the clients to wake us, then check the rings once more
+        // in case a request was written before it saw the flag
+        int pending = 0;
+        for (int i=0; i < srv->num_sessions; i++) {
+            shm_session *s = srv->sessions[i];
+            __atomic_store_n(&s->req->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&s->req->tail, __ATOMIC_SEQ_CST) != s->req->head) pending = 1;
+        }
+        if (!pending) {
+            filtmgr_client_offline(srv->mgr);
+            check_sockets(srv, SHM_SLEEP_MSEC);
+        }
+        for (int i=0; i < srv->num_sessions; i++) {
+            __atomic_store_n(&srv->sessions[i]->req->sleeping, 0, __ATOMIC_RELAXED);
+        }
+        idle_since = 0;
+    }
+
+    // Disconnect the clients
+    while (srv->num_sessions) close_session(srv, srv->num_sessions - 1);
+    close(srv->listen_fd);
+    if (srv->config->shm_socket[0] != '@') unlink(srv->config->shm_socket);
+    filtmgr_client_leave(srv->mgr);
+    free(srv->buf);
+    free(srv->keys);
+    free(srv->key_lens);
+    free(srv->result);
+    free(srv);
+    return NULL;
+}
+
+/**
+ * Waits for new clients, clients that left and wakeups.
+ * @arg timeout_msec How long to wait, 0 to only check
+ * @return 0 on success.
+ */
+static int check_sockets(shm_server *srv, int timeout_msec) {
+    int n = srv->num_sessions;
+    struct pollfd fds[1 + 2 * SHM_MAX_SESSIONS];
+    fds[0].fd = srv->listen_fd;
+    fds[0].events = POLLIN;
+    for (int i=0; i < n; i++) {
+        fds[1 + 2 * i].fd = srv->sessions[i]->sock;
+        fds[1 + 2 * i].events = POLLIN;
+        fds[2 + 2 * i].fd = srv->sessions[i]->req_efd;
+        fds[2 + 2 * i].events = POLLIN;
+    }
+    int res = poll(fds, 1 + 2 * n, timeout_msec);
+    if (res <= 0) return res;
+
+    // Clients only send on the control socket by closing it. Go
+    // backwards, so closing a session does not move the others.
+    char buf[64];
+    uint64_t count;
+    for (int i=n - 1; i >= 0; i--) {
+        if (fds[2 + 2 * i].revents & POLLIN) {
+            if (read(srv->sessions[i]->req_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                syslog(LOG_WARNING, "Failed to read a shm eventfd! Err: %s", strerror(errno));
+            }
+        }
+        if (fds[1 + 2 * i].revents) {
+            ssize_t num = read(srv->sessions[i]->sock, buf, sizeof(buf));
+            if (num == 0 || (num < 0 && errno != EAGAIN && errno != EINTR)) close_session(srv, i);
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        while (accept_session(srv) == 0) ;
+    }
+    return 0;
+}
+
+/**
+ * Accepts a client, creating its rings and sending
+ * them over the control socket.
+ * @return 0 if a client was accepted, -1 if none
+ * is waiting, 1 if it failed.
+ */
+static int accept_session(shm_server *srv) {
+    int sock = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (sock < 0) return -1;
+    if (srv->num_sessions == SHM_MAX_SESSIONS) {
+        syslog(LOG_WARNING, "Too many shared memory clients, refusing a client!");
+        close(sock);
+        return 1;
+    }
+
+    shm_session *s = calloc(1, sizeof(shm_session));
+    s->sock = sock;
+    s->ring_size = (uint64_t)srv->config->shm_ring_kb * 1024;
+    s->region_len = SHM_REGION_SIZE(s->ring_size);
+    s->req_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    s->resp_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int memfd = memfd_create("bloomd-shm", MFD_CLOEXEC);
+    if (s->req_efd < 0 || s->resp_efd < 0 || memfd < 0 || ftruncate(memfd, s->region_len)) {
+        syslog(LOG_ERR, "Failed to create the rings of a shm client! Err: %s", strerror(errno));
+        goto ERR;
+    }
+    s->region = mmap(NULL, s->region_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (s->region == MAP_FAILED) {
+        s->region = NULL;
+        syslog(LOG_ERR, "Failed to map the rings of a shm client! Err: %s", strerror(errno));
+        goto ERR;
+    }
+
+    // The new file is zero filled, so only the header is set
+    shm_header *header = (shm_header*)s->region;
+    header->magic = SHM_MAGIC;
+    header->version = SHM_VERSION;
+    header->ring_size = s->ring_size;
+    s->req = (shm_ring_ctl*)(s->region + sizeof(shm_header));
+    s->resp = s->req + 1;
+    s->req_data = (char*)(s->resp + 1);
+    s->resp_data = s->req_data + s->ring_size;
+
+    // Send the memfd and the eventfds of the requests and responses
+    int fds[3] = {memfd, s->req_efd, s->resp_efd};
+    char cmsg_buf[CMSG_SPACE(sizeof(fds))];
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    char byte = SHM_VERSION;
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+        syslog(LOG_ERR, "Failed to send the rings to a shm client! Err: %s", strerror(errno));
+        goto ERR;
+    }
+    close(memfd);
+
+    srv->sessions[srv->num_sessions++] = s;
+    syslog(LOG_DEBUG, "Accepted a shared memory client.");
+    return 0;
+
+ERR:
+    if (memfd >= 0) close(memfd);
+    if (s->region) munmap(s->region, s->region_len);
+    if (s->req_efd >= 0) close(s->req_efd);
+    if (s->resp_efd >= 0) close(s->resp_efd);
+    close(sock);
+    free(s);
+    return 1;
+}
+
+/**
+ * Closes a session, and unmaps its rings.
+ */
+static void close_session(shm_server *srv, int idx) {
+    shm_session *s = srv->sessions[idx];
+    munmap(s->region, s->region_len);
+    close(s->req_efd);
+    close(s->resp_efd);
+    close(s->sock);
+    free(s);
+    srv->sessions[idx] = srv->sessions[--srv->num_sessions];
+}
+
+// Copies bytes out of a ring, wrapping around its end
+static void ring_read(const char *data, uint64_t size, uint64_t pos, void *out, size_t len) {
+    size_t off = pos & (size - 1), first = size - off;
+    if (first >= len) {
+        memcpy(out, data + off, len);
+    } else {
+        memcpy(out, data + off, first);
+        memcpy((char*)out + first, data, len - first);
+    }
+}
+
+// Copies bytes into a ring, wrapping around its end
+static void ring_write(char *data, uint64_t size, uint64_t pos, const void *in, size_t len) {
+    size_t off = pos & (size - 1), first = size - off;
+    if (first >= len) {
+        memcpy(data + off, in, len);
+    } else {
+        memcpy(data + off, in, first);
+        memcpy(data, (const char*)in + first, len - first);
+    }
+}
+
+/**
+ * Handles the requests waiting in the ring of a client,
+ * while its response ring has room.
+ * @return The number of requests handled, or -1 if
+ * the client sent a bad message.
+ */
+static int handle_requests(shm_server *srv, shm_session *s) {
+    uint64_t head = s->req->head;
+    uint64_t tail = __atomic_load_n(&s->req->tail, __ATOMIC_ACQUIRE);
+    uint64_t resp_tail = s->resp->tail;
+    int handled = 0;
+    while (tail - head >= BIN_HEADER_LEN) {
+        unsigned char header[BIN_HEADER_LEN];
+        ring_read(s->req_data, s->ring_size, head, header, BIN_HEADER_LEN);
+        uint16_t name_len;
+        uint32_t body_len;
+        memcpy(&name_len, header + 2, sizeof(name_len));
+        memcpy(&body_len, header + 4, sizeof(body_len));
+        name_len = ntohs(name_len);
+        body_len = ntohl(body_len);
+        uint64_t msg_len = BIN_HEADER_LEN + (uint64_t)name_len + body_len;
+        if (header[0] != BIN_MAGIC || msg_len > s->ring_size) return -1;
+        if (tail - head < msg_len) return -1;
+
+        // The response holds a bit per key, and the request
+        // at least 3 bytes per key
+        uint64_t resp_max = BIN_HEADER_LEN + sizeof(uint32_t) + (body_len / 3 + 7) / 8;
+        uint64_t resp_head = __atomic_load_n(&s->resp->head, __ATOMIC_ACQUIRE);
+        if (s->ring_size - (resp_tail - resp_head) < resp_max) break;
+
+        ring_read(s->req_data, s->ring_size, head, srv->buf, msg_len);
+        uint32_t resp_body = 0;
+        int status;
+
+        // Copy out the filter name, so it is terminated
+        char filter_name[256];
+        if (name_len == 0 || name_len >= sizeof(filter_name)) {
+            status = BIN_BAD_ARGS;
+        } else if (header[1] != BIN_CHECK && header[1] != BIN_SET) {
+            status = BIN_CMD_NOT_SUP;
+        } else {
+            memcpy(filter_name, srv->buf + BIN_HEADER_LEN, name_len);
+            filter_name[name_len] = '\0';
+            status = handle_keys(srv, header[1], filter_name,
+                    srv->buf + BIN_HEADER_LEN + name_len, body_len, &resp_body);
+        }
+
+        // Write the response, the body was built in the result buffer
+        unsigned char resp_header[BIN_HEADER_LEN] = {BIN_MAGIC, status, 0, 0};
+        uint32_t len = htonl(resp_body);
+        memcpy(resp_header + 4, &len, sizeof(len));
+        ring_write(s->resp_data, s->ring_size, resp_tail, resp_header, BIN_HEADER_LEN);
+        if (resp_body) {
+            ring_write(s->resp_data, s->ring_size, resp_tail + BIN_HEADER_LEN, srv->result, resp_body);
+        }
+        resp_tail += BIN_HEADER_LEN + resp_body;
+        __atomic_store_n(&s->resp->tail, resp_tail, __ATOMIC_RELEASE);
+
+        head += msg_len;
+        __atomic_store_n(&s->req->head, head, __ATOMIC_RELEASE);
+        handled++;
+    }
+
+    // Wake the client if it went to sleep waiting
+    if (handled) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->resp->sleeping, __ATOMIC_RELAXED)) {
+            uint64_t one = 1;
+            if (write(s->resp_efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                syslog(LOG_WARNING, "Failed to wake a shm client! Err: %s", strerror(errno));
+            }
+        }
+    }
+    return handled;
+}
+
+/**
+ * Handles a check or set of a key vector, like the binary
+ * commands of the connections. The keys are terminated in
+ * place by shifting each one over its length prefix.
+ * @arg body The message body, modified in place
+ * @arg resp_len Output, the length of the response body on
+ * success. The body is built in the result buffer.
+ * @return The binary status of the response.
+ */
+static int handle_keys(shm_server *srv, int opcode, char *filter_name,
+        char *body, uint32_t body_len, uint32_t *resp_len) {
+    if (opcode == BIN_SET && srv->config->read_only) return BIN_READ_ONLY;
+
+    // Read the key count
+    uint32_t num_keys;
+    uint16_t key_len;
+    if (body_len < sizeof(num_keys)) return BIN_BAD_ARGS;
+    memcpy(&num_keys, body, sizeof(num_keys));
+    num_keys = ntohl(num_keys);
+
+    // Validate the key vector before modifying it
+    uint32_t offset = sizeof(num_keys);
+    uint32_t i;
+    for (i=0; i < num_keys && offset + sizeof(key_len) <= body_len; i++) {
+        memcpy(&key_len, body + offset, sizeof(key_len));
+        key_len = ntohs(key_len);
+        if (key_len == 0) break;
+        offset += sizeof(key_len) + key_len;
+    }
+    if (num_keys == 0 || i != num_keys || offset != body_len) return BIN_BAD_ARGS;
+
+    // Grow the key vectors, the results share space with the response
+    uint32_t bits_len = sizeof(num_keys) + (num_keys + 7) / 8;
+    if (num_keys > srv->keys_cap) {
+        free(srv->keys);
+        free(srv->key_lens);
+        free(srv->result);
+        srv->keys = malloc(num_keys * sizeof(char*));
+        srv->key_lens = malloc(num_keys * sizeof(int));
+        srv->result = malloc(num_keys + bits_len);
+        if (!srv->keys || !srv->key_lens || !srv->result) {
+            srv->keys_cap = 0;
+            return BIN_INTERNAL_ERR;
+        }
+        srv->keys_cap = num_keys;
+    }
+    offset = sizeof(num_keys);
+    for (i=0; i < num_keys; i++) {
+        memcpy(&key_len, body + offset, sizeof(key_len));
+        key_len = ntohs(key_len);
+        char *key = body + offset;
+        memmove(key, key + sizeof(key_len), key_len);
+        key[key_len] = '\0';
+        srv->keys[i] = key;
+        srv->key_lens[i] = key_len;
+        offset += sizeof(key_len) + key_len;
+    }
+
+    char *result = srv->result + bits_len;
+    int res = (opcode == BIN_SET) ?
+        filtmgr_set_keys_len(srv->mgr, filter_name, srv->keys, srv->key_lens, num_keys, result) :
+        filtmgr_check_keys_len(srv->mgr, filter_name, srv->keys, srv->key_lens, num_keys, result);
+    if (res) {
+        return (res == -1) ? BIN_FILT_NOT_EXIST :
+               (res == -4) ? BIN_FILT_FROZEN :
+               (res == -5) ? BIN_FILT_OVER_QUOTA :
+               (res == -6) ? BIN_FILT_LOADING : BIN_INTERNAL_ERR;
+    }
+
+    // Pack the results into the bitset of the response
+    unsigned char *bits = (unsigned char*)srv->result;
+    uint32_t count = htonl(num_keys);
+    memcpy(bits, &count, sizeof(count));
+    memset(bits + sizeof(count), 0, bits_len - sizeof(count));
+    for (i=0; i < num_keys; i++) {
+        if (result[i]) bits[sizeof(count) + (i >> 3)] |= 1 << (i & 7);
+    }
+    *resp_len = bits_len;
+    return BIN_OK;
+}
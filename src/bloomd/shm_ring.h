@@ -0,0 +1,60 @@
+#ifndef BLOOM_SHM_RING_H
+#define BLOOM_SHM_RING_H
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+
+/*
+ * A shared memory transport for clients on the same host.
+ * A client connects to the shm_socket, and is sent a memfd
+ * holding a pair of single producer, single consumer rings,
+ * and an eventfd for each ring. The client writes binary
+ * protocol requests into the request ring, and a poller thread
+ * writes the binary responses into the response ring, so no
+ * system calls are made while both sides are busy. A consumer
+ * that finds its ring empty spins for shm_spin_usec, then sets
+ * the sleeping flag of the ring and waits on its eventfd, which
+ * the producer only signals when the flag is set. The session
+ * ends when the client closes the control socket.
+ *
+ * The region is laid out as the header, the control blocks of
+ * the request and response rings, then the data of each ring.
+ * Messages wrap around the end of the data, and the head and
+ * tail are byte counts that only grow.
+ */
+#define SHM_MAGIC 0x4D485342        // "BSHM"
+#define SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;         // Bytes of data in each ring, a power of 2
+    uint32_t reserved;
+    char pad[48];
+} shm_header;
+
+typedef struct {
+    uint64_t head;              // Bytes read by the consumer
+    char pad1[56];
+    uint64_t tail;              // Bytes written by the producer
+    char pad2[56];
+    uint32_t sleeping;          // Set while the consumer waits on the eventfd
+    char pad3[60];
+} shm_ring_ctl;
+
+#define SHM_REGION_SIZE(ring_size) (sizeof(shm_header) + 2 * sizeof(shm_ring_ctl) + 2 * (size_t)(ring_size))
+
+/**
+ * Starts the shared memory thread, which accepts clients
+ * on the shm_socket and serves their rings.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_shm_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "slowlog.h"
+
+static uint64_t threshold_nsec = 0;
+
+/*
+ * The entries are a ring, next is the slot of the next
+ * entry and used is the number of slots filled.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static slowlog_entry *entries = NULL;
+static int log_size = 0;
+static int used = 0;
+static int next = 0;
+static uint64_t next_id = 0;
+
+/**
+ * Sets the threshold and size of the slow log. Changing
+ * the size empties the log.
+ * @arg usec Commands taking at least this many microseconds
+ * are logged. 0 to disable the log.
+ * @arg size The number of entries kept
+ * @return 0 on success, -1 if the log could not be allocated.
+ */
+int slowlog_init(int usec, int size) {
+    int res = 0;
+    pthread_mutex_lock(&log_lock);
+    if (size != log_size) {
+        slowlog_entry *resized = calloc(size, sizeof(slowlog_entry));
+        if (!resized) {
+            syslog(LOG_ERR, "Failed to allocate the slow log!");
+            usec = 0;
+            res = -1;
+        } else {
+            free(entries);
+            entries = resized;
+            log_size = size;
+            used = next = 0;
+        }
+    }
+    __atomic_store_n(&threshold_nsec, (uint64_t)usec * 1000, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_lock);
+    return res;
+}
+
+/**
+ * Returns the threshold of the slow log.
+ * @return The threshold in nanoseconds, 0 if disabled.
+ */
+uint64_t slowlog_threshold(void) {
+    return __atomic_load_n(&threshold_nsec, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a slow command to the log, replacing the
+ * oldest entry once the log is full.
+ * @arg entry The command. The id is assigned.
+ */
+void slowlog_record(slowlog_entry *entry) {
+    pthread_mutex_lock(&log_lock);
+    if (log_size) {
+        entry->id = next_id++;
+        entries[next] = *entry;
+        next = (next + 1) % log_size;
+        if (used < log_size) used++;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Copies out the entries of the log, newest first.
+ * @arg out Output, the entries
+ * @arg max The most entries to copy
+ * @return The number of entries copied.
+ */
+int slowlog_read(slowlog_entry *out, int max) {
+    pthread_mutex_lock(&log_lock);
+    int num = (used < max) ? used : max;
+    for (int i=0; i < num; i++) {
+        out[i] = entries[(next - 1 - i + log_size) % log_size];
+    }
+    pthread_mutex_unlock(&log_lock);
+    return num;
+}
+
+/**
+ * Empties the slow log.
+ */
+void slowlog_reset(void) {
+    pthread_mutex_lock(&log_lock);
+    used = next = 0;
+    pthread_mutex_unlock(&log_lock);
+}
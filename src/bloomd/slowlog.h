@@ -0,0 +1,70 @@
+#ifndef BLOOM_SLOWLOG_H
+#define BLOOM_SLOWLOG_H
+#include <stdint.h>
+#include <time.h>
+#include "latency.h"
+
+/*
+ * The slow log keeps the last commands whose total time was
+ * over a threshold, with the time of each of their stages, so
+ * a single slow command can be traced to its cause, such as
+ * a filter being faulted in or growing a layer. The histograms
+ * only show that some commands were slow.
+ *
+ * While the slow log is enabled every command is timed, not
+ * only the sampled ones, but only the slow commands take the
+ * lock of the log.
+ */
+
+/**
+ * The longest filter name kept in an entry, longer
+ * names are truncated.
+ */
+#define SLOWLOG_NAME_LEN 64
+
+typedef struct {
+    uint64_t id;                        // Increases with each slow command
+    time_t when;                        // Wall clock time the command finished
+    int command;                        // The type of the command, as given to latency_end
+    int num_keys;                       // Keys checked or set by the command
+    char filter_name[SLOWLOG_NAME_LEN]; // The first filter used, empty if none
+    uint64_t stages[LATENCY_STAGES];    // Nanoseconds in each stage, and the total
+} slowlog_entry;
+
+/**
+ * Sets the threshold and size of the slow log. Changing
+ * the size empties the log.
+ * @arg usec Commands taking at least this many microseconds
+ * are logged. 0 to disable the log.
+ * @arg size The number of entries kept
+ * @return 0 on success, -1 if the log could not be allocated.
+ */
+int slowlog_init(int usec, int size);
+
+/**
+ * Returns the threshold of the slow log.
+ * @return The threshold in nanoseconds, 0 if disabled.
+ */
+uint64_t slowlog_threshold(void);
+
+/**
+ * Adds a slow command to the log, replacing the
+ * oldest entry once the log is full.
+ * @arg entry The command. The id is assigned.
+ */
+void slowlog_record(slowlog_entry *entry);
+
+/**
+ * Copies out the entries of the log, newest first.
+ * @arg out Output, the entries
+ * @arg max The most entries to copy
+ * @return The number of entries copied.
+ */
+int slowlog_read(slowlog_entry *out, int max);
+
+/**
+ * Empties the slow log.
+ */
+void slowlog_reset(void);
+
+#endif
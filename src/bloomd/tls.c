@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "tls.h"
+
+/**
+ * The size of the chunks that the writes of OpenSSL are
+ * gathered into, which is the largest TLS record. Writing
+ * the vectors one by one would cost a record each.
+ */
+#define TLS_WRITE_CHUNK 16384
+
+/**
+ * Identifies our sessions in the session cache
+ */
+#define TLS_SESSION_CONTEXT "bloomd"
+
+struct bloom_tls {
+    SSL_CTX *ctx;
+};
+
+struct bloom_tls_conn {
+    SSL *ssl;
+    int fd;
+    int done;           // Handshake is done
+    int offloaded;      // Bitmask of the directions handled by the kernel
+};
+
+/*
+ * Static declarations
+ */
+static void log_tls_error(int level, const char *msg);
+static ssize_t tls_error(bloom_tls_conn *conn, int ret, ssize_t done);
+
+
+/**
+ * Creates the TLS context from the certificate
+ * and key of the configuration.
+ * @arg config The configuration
+ * @arg tls Output, the new context
+ * @return 0 on success.
+ */
+int init_tls(bloom_config *config, bloom_tls **tls) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_tls_error(LOG_ERR, "Failed to create the TLS context!");
+        return -1;
+    }
+
+    // Only ciphers the kernel can take over, and no renegotiation,
+    // which would need the keys back from the kernel
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+            SSL_OP_CIPHER_SERVER_PREFERENCE);
+    if (!SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20")) {
+        log_tls_error(LOG_ERR, "Failed to set the TLS ciphers!");
+        goto ERROR;
+    }
+
+    // Writes are retried from our buffers, which may move. The
+    // buffers of OpenSSL are released while a connection is idle.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->tls_cert_file) != 1) {
+        syslog(LOG_ERR, "Failed to load the TLS certificate '%s'!", config->tls_cert_file);
+        log_tls_error(LOG_ERR, "TLS error");
+        goto ERROR;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, config->tls_key_file, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        syslog(LOG_ERR, "Failed to load the TLS key '%s'!", config->tls_key_file);
+        log_tls_error(LOG_ERR, "TLS error");
+        goto ERROR;
+    }
+
+    // Resume sessions from the cache or from tickets, so
+    // reconnecting clients skip the key exchange
+    if (config->tls_session_cache) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, config->tls_session_cache);
+        SSL_CTX_set_session_id_context(ctx, (unsigned char*)TLS_SESSION_CONTEXT,
+                strlen(TLS_SESSION_CONTEXT));
+        SSL_CTX_set_num_tickets(ctx, 1);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+
+    bloom_tls *t = calloc(1, sizeof(bloom_tls));
+    if (!t) goto ERROR;
+    t->ctx = ctx;
+    *tls = t;
+    return 0;
+
+ERROR:
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+
+/**
+ * Destroys a TLS context. The connections
+ * using it must be closed first.
+ * @arg tls The context
+ */
+void destroy_tls(bloom_tls *tls) {
+    SSL_CTX_free(tls->ctx);
+    free(tls);
+}
+
+
+/**
+ * Starts the server side of a TLS connection on an
+ * accepted, non-blocking socket.
+ * @arg tls The context
+ * @arg fd The socket
+ * @return The connection, or NULL on error.
+ */
+bloom_tls_conn* tls_new_conn(bloom_tls *tls, int fd) {
+    bloom_tls_conn *conn = calloc(1, sizeof(bloom_tls_conn));
+    if (!conn) return NULL;
+    conn->fd = fd;
+    conn->ssl = SSL_new(tls->ctx);
+    if (!conn->ssl || SSL_set_fd(conn->ssl, fd) != 1) {
+        log_tls_error(LOG_ERR, "Failed to setup a TLS connection!");
+        if (conn->ssl) SSL_free(conn->ssl);
+        free(conn);
+        return NULL;
+    }
+    SSL_set_accept_state(conn->ssl);
+    return conn;
+}
+
+
+/**
+ * Frees the TLS state of a connection. The
+ * socket is not closed.
+ * @arg conn The connection
+ */
+void tls_free_conn(bloom_tls_conn *conn) {
+    // Best effort close_notify, the socket does not block
+    if (conn->done) {
+        ERR_clear_error();
+        SSL_shutdown(conn->ssl);
+    }
+    SSL_free(conn->ssl);
+    ERR_clear_error();
+    free(conn);
+}
+
+
+/**
+ * Continues the handshake of a connection. Once it is
+ * done, the connection is offloaded to the kernel where
+ * possible.
+ * @arg conn The connection
+ * @return 0 once the handshake is done, 1 if it must wait
+ * for the socket to be readable, 2 if it must wait for it
+ * to be writable, -1 if the handshake failed.
+ */
+int tls_handshake(bloom_tls_conn *conn) {
+    if (conn->done) return 0;
+    ERR_clear_error();
+    int ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1) {
+        conn->done = 1;
+        if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) conn->offloaded |= 1;
+        if (BIO_get_ktls_recv(SSL_get_rbio(conn->ssl))) conn->offloaded |= 2;
+        syslog(LOG_DEBUG, "TLS handshake done with %s%s. [%d]",
+                SSL_get_version(conn->ssl),
+                SSL_session_reused(conn->ssl) ? ", resumed" : "", conn->fd);
+        return 0;
+    }
+
+    switch (SSL_get_error(conn->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return 1;
+        case SSL_ERROR_WANT_WRITE:
+            return 2;
+        default:
+            // Usually a client that went away or does not speak
+            // TLS, which is not worth more than a warning
+            syslog(LOG_WARNING, "TLS handshake failed! [%d]", conn->fd);
+            log_tls_error(LOG_WARNING, "TLS error");
+            return -1;
+    }
+}
+
+
+/**
+ * Checks if the handshake of a connection is done.
+ * @arg conn The connection
+ * @return 1 if done.
+ */
+int tls_handshake_done(bloom_tls_conn *conn) {
+    return conn->done;
+}
+
+
+/**
+ * Checks which directions of a connection the kernel handles.
+ * @arg conn The connection
+ * @return A bitmask, 1 if sends are offloaded
+ * and 2 if receives are offloaded.
+ */
+int tls_offloaded(bloom_tls_conn *conn) {
+    return conn->offloaded;
+}
+
+
+/**
+ * Checks if OpenSSL holds decrypted data of a connection that
+ * was not read yet. The socket is not readable for that data.
+ * @arg conn The connection
+ * @return 1 if there is pending data.
+ */
+int tls_pending(bloom_tls_conn *conn) {
+    if (conn->offloaded & 2) return 0;
+    return SSL_has_pending(conn->ssl);
+}
+
+
+/**
+ * Reads from a connection, like readv.
+ * @arg conn The connection
+ * @arg vectors The buffers to read into
+ * @arg num_vectors The number of buffers
+ * @return The number of bytes read, 0 once the client
+ * closed the connection, or -1 with errno set. The errno
+ * is EAGAIN if nothing could be read for now.
+ */
+ssize_t tls_readv(bloom_tls_conn *conn, const struct iovec *vectors, int num_vectors) {
+    // The kernel decrypts the records. Control records, such as
+    // alerts, fail the read, which closes the connection.
+    if (conn->offloaded & 2) return readv(conn->fd, vectors, num_vectors);
+
+    ssize_t total = 0;
+    for (int i=0; i < num_vectors; i++) {
+        char *buf = vectors[i].iov_base;
+        size_t left = vectors[i].iov_len;
+        while (left) {
+            ERR_clear_error();
+            errno = 0;
+            int ret = SSL_read(conn->ssl, buf, left);
+            if (ret <= 0) return tls_error(conn, ret, total);
+            buf += ret;
+            left -= ret;
+            total += ret;
+        }
+    }
+    return total;
+}
+
+
+/**
+ * Writes to a connection, like writev. When a write returns
+ * EAGAIN or a short count, the rest of the bytes must be
+ * written again before any other bytes, but may have moved.
+ * @arg conn The connection
+ * @arg vectors The buffers to write
+ * @arg num_vectors The number of buffers
+ * @return The number of bytes written, or -1 with errno set.
+ * The errno is EAGAIN if nothing could be written for now.
+ */
+ssize_t tls_writev(bloom_tls_conn *conn, const struct iovec *vectors, int num_vectors) {
+    // The kernel frames and encrypts the records
+    if (conn->offloaded & 1) return writev(conn->fd, vectors, num_vectors);
+
+    /*
+     * Gather the vectors into full records. A retry after a
+     * short write gathers the same bytes first, and at least
+     * as many, which is what OpenSSL expects of a retry.
+     */
+    char chunk[TLS_WRITE_CHUNK];
+    ssize_t total = 0;
+    int index = 0;
+    size_t offset = 0;
+    while (index < num_vectors) {
+        int len = 0;
+        while (index < num_vectors && len < TLS_WRITE_CHUNK) {
+            size_t n = vectors[index].iov_len - offset;
+            if (n > (size_t)(TLS_WRITE_CHUNK - len)) n = TLS_WRITE_CHUNK - len;
+            memcpy(chunk + len, (char*)vectors[index].iov_base + offset, n);
+            len += n;
+            offset += n;
+            if (offset == vectors[index].iov_len) {
+                index++;
+                offset = 0;
+            }
+        }
+        if (!len) break;
+
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_write(conn->ssl, chunk, len);
+        if (ret <= 0) return tls_error(conn, ret, total);
+        total += ret;
+        if (ret < len) break;
+    }
+    return total;
+}
+
+
+/**
+ * Converts a failed read or write of OpenSSL to
+ * the result of a readv or writev.
+ * @arg conn The connection
+ * @arg ret The result of the operation
+ * @arg done The bytes already moved by the call
+ * @return The result
+ */
+static ssize_t tls_error(bloom_tls_conn *conn, int ret, ssize_t done) {
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        if (done) return done;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (done) return done;
+
+    // A close_notify, or a close without one, ends the stream
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    if (err == SSL_ERROR_SYSCALL && !errno) return 0;
+    if (err != SSL_ERROR_SYSCALL) {
+        log_tls_error(LOG_DEBUG, "TLS error");
+        errno = EIO;
+    }
+    return -1;
+}
+
+
+/**
+ * Logs and clears the errors queued by OpenSSL
+ * @arg level The syslog level
+ * @arg msg The message logged before each error
+ */
+static void log_tls_error(int level, const char *msg) {
+    unsigned long err;
+    char buf[256];
+    while ((err = ERR_get_error())) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        syslog(level, "%s: %s", msg, buf);
+    }
+}
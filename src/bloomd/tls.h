@@ -0,0 +1,120 @@
+#ifndef BLOOM_TLS_H
+#define BLOOM_TLS_H
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "config.h"
+
+/*
+ * TLS for the clients of the TCP listener. The handshake is done
+ * by OpenSSL on the non-blocking socket of the client. Once it is
+ * done, the keys are handed to the kernel (kTLS) where it supports
+ * the cipher, and the records are framed and encrypted by the kernel.
+ * The reads and writes of an offloaded direction are then plain
+ * readv and writev calls on the socket, without copies through
+ * OpenSSL. A direction that can not be offloaded is handled by
+ * OpenSSL in user space.
+ *
+ * Sessions are cached by the server and tickets are issued, so
+ * clients that reconnect can resume without a full handshake.
+ */
+
+/**
+ * Opaque handle to the TLS context, shared by every connection
+ */
+typedef struct bloom_tls bloom_tls;
+
+/**
+ * Opaque handle to the TLS state of a connection
+ */
+typedef struct bloom_tls_conn bloom_tls_conn;
+
+/**
+ * Creates the TLS context from the certificate
+ * and key of the configuration.
+ * @arg config The configuration
+ * @arg tls Output, the new context
+ * @return 0 on success.
+ */
+int init_tls(bloom_config *config, bloom_tls **tls);
+
+/**
+ * Destroys a TLS context. The connections
+ * using it must be closed first.
+ * @arg tls The context
+ */
+void destroy_tls(bloom_tls *tls);
+
+/**
+ * Starts the server side of a TLS connection on an
+ * accepted, non-blocking socket.
+ * @arg tls The context
+ * @arg fd The socket
+ * @return The connection, or NULL on error.
+ */
+bloom_tls_conn* tls_new_conn(bloom_tls *tls, int fd);
+
+/**
+ * Frees the TLS state of a connection. The
+ * socket is not closed.
+ * @arg conn The connection
+ */
+void tls_free_conn(bloom_tls_conn *conn);
+
+/**
+ * Continues the handshake of a connection. Once it is
+ * done, the connection is offloaded to the kernel where
+ * possible.
+ * @arg conn The connection
+ * @return 0 once the handshake is done, 1 if it must wait
+ * for the socket to be readable, 2 if it must wait for it
+ * to be writable, -1 if the handshake failed.
+ */
+int tls_handshake(bloom_tls_conn *conn);
+
+/**
+ * Checks if the handshake of a connection is done.
+ * @arg conn The connection
+ * @return 1 if done.
+ */
+int tls_handshake_done(bloom_tls_conn *conn);
+
+/**
+ * Checks which directions of a connection the kernel handles.
+ * @arg conn The connection
+ * @return A bitmask, 1 if sends are offloaded
+ * and 2 if receives are offloaded.
+ */
+int tls_offloaded(bloom_tls_conn *conn);
+
+/**
+ * Checks if OpenSSL holds decrypted data of a connection that
+ * was not read yet. The socket is not readable for that data.
+ * @arg conn The connection
+ * @return 1 if there is pending data.
+ */
+int tls_pending(bloom_tls_conn *conn);
+
+/**
+ * Reads from a connection, like readv.
+ * @arg conn The connection
+ * @arg vectors The buffers to read into
+ * @arg num_vectors The number of buffers
+ * @return The number of bytes read, 0 once the client
+ * closed the connection, or -1 with errno set. The errno
+ * is EAGAIN if nothing could be read for now.
+ */
+ssize_t tls_readv(bloom_tls_conn *conn, const struct iovec *vectors, int num_vectors);
+
+/**
+ * Writes to a connection, like writev. When a write returns
+ * EAGAIN or a short count, the rest of the bytes must be
+ * written again before any other bytes, but may have moved.
+ * @arg conn The connection
+ * @arg vectors The buffers to write
+ * @arg num_vectors The number of buffers
+ * @return The number of bytes written, or -1 with errno set.
+ * The errno is EAGAIN if nothing could be written for now.
+ */
+ssize_t tls_writev(bloom_tls_conn *conn, const struct iovec *vectors, int num_vectors);
+
+#endif
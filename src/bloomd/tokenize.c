@@ -0,0 +1,77 @@
+#include <string.h>
+#include "tokenize.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define TOKENIZE_HAVE_SSE2
+#endif
+
+/**
+ * Ends the key before a terminator at pos, if it is not empty.
+ * Leaves tokenize_keys once the keys end or enough are split.
+ */
+#define END_KEY(p) { \
+    int pos = (p); \
+    if (buf[pos] == '\0') { \
+        if (pos > start) { \
+            keys[num] = buf + start; \
+            key_lens[num++] = pos - start; \
+        } \
+        start = pos; \
+        goto LEAVE; \
+    } \
+    if (pos > start) { \
+        keys[num] = buf + start; \
+        key_lens[num++] = pos - start; \
+        buf[pos] = '\0'; \
+    } \
+    start = pos + 1; \
+    if (num == max_keys) goto LEAVE; \
+}
+
+/**
+ * Splits keys from a buffer, up to a number of keys. Each
+ * space after a key is replaced by a null terminator. Runs of
+ * spaces separate keys like a single space, and the keys end
+ * at the first null terminator.
+ * @arg buf The keys. Must be null terminated at len.
+ * @arg len The length of the buffer
+ * @arg offset The offset of the first key, updated to the
+ * offset of the next key.
+ * @arg keys Output, the start of each key
+ * @arg key_lens Output, the length of each key
+ * @arg max_keys The most keys to split
+ * @return The number of keys. Fewer than max_keys
+ * once there are no more keys.
+ */
+int tokenize_keys(char *buf, int len, int *offset, char **keys, int *key_lens, int max_keys) {
+    int num = 0;
+    int start = *offset;
+    int i = start;
+    if (max_keys <= 0 || start >= len) goto LEAVE;
+
+#ifdef TOKENIZE_HAVE_SSE2
+    // Find the spaces and terminators of a block at once
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i nulls = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(block, spaces), _mm_cmpeq_epi8(block, nulls)));
+        while (mask) {
+            END_KEY(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Scan the rest a byte at a time
+    for (; i < len; i++) {
+        if (buf[i] == ' ' || buf[i] == '\0') END_KEY(i);
+    }
+    END_KEY(len);
+
+LEAVE:
+    *offset = start;
+    return num;
+}
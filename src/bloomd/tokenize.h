@@ -0,0 +1,28 @@
+#ifndef BLOOM_TOKENIZE_H
+#define BLOOM_TOKENIZE_H
+
+/*
+ * Splits the space separated keys of the multi key commands.
+ * The buffer is scanned once, 16 bytes at a time where SIMD is
+ * available, and every space and null terminator found in a
+ * block is turned into a key before the next block is loaded.
+ */
+
+/**
+ * Splits keys from a buffer, up to a number of keys. Each
+ * space after a key is replaced by a null terminator. Runs of
+ * spaces separate keys like a single space, and the keys end
+ * at the first null terminator.
+ * @arg buf The keys. Must be null terminated at len.
+ * @arg len The length of the buffer
+ * @arg offset The offset of the first key, updated to the
+ * offset of the next key.
+ * @arg keys Output, the start of each key
+ * @arg key_lens Output, the length of each key
+ * @arg max_keys The most keys to split
+ * @return The number of keys. Fewer than max_keys
+ * once there are no more keys.
+ */
+int tokenize_keys(char *buf, int len, int *offset, char **keys, int *key_lens, int max_keys);
+
+#endif
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * The state of a ring, with pointers into
+ * the queues that are shared with the kernel.
+ */
+struct bloom_uring {
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit;     // Queued since the last submit
+    unsigned in_flight;     // Queued or submitted, without a completion reaped
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Mappings to cleanup
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/*
+ * Static declarations
+ */
+static struct io_uring_sqe* get_sqe(bloom_uring *ring);
+static int prep_rw(bloom_uring *ring, int op, int fd, struct iovec *iov, int num_iov, uint64_t user_data);
+
+int uring_supported(void) {
+    bloom_uring *ring;
+    if (uring_init(1, &ring)) return 0;
+    uring_destroy(ring);
+    return 1;
+}
+
+int uring_init(unsigned entries, bloom_uring **ring_out) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return -errno;
+
+    bloom_uring *ring = calloc(1, sizeof(bloom_uring));
+    if (!ring) {
+        close(fd);
+        return -ENOMEM;
+    }
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+
+    // Map the rings, which may share a single mapping
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto ERR;
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto ERR;
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto ERR;
+
+    // Setup the queue pointers
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    *ring_out = ring;
+    return 0;
+
+ERR:
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size && ring->cq_ring && ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(fd);
+    free(ring);
+    return -ENOMEM;
+}
+
+void uring_destroy(bloom_uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+int uring_fd(bloom_uring *ring) {
+    return ring->fd;
+}
+
+/**
+ * Gets the next free submission entry, submitting
+ * the queued entries if the queue is full.
+ */
+static struct io_uring_sqe* get_sqe(bloom_uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        if (uring_submit(ring) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static int prep_rw(bloom_uring *ring, int op, int fd, struct iovec *iov, int num_iov, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -EBUSY;
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = num_iov;
+    sqe->user_data = user_data;
+    ring->in_flight++;
+    return 0;
+}
+
+int uring_prep_readv(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data) {
+    return prep_rw(ring, IORING_OP_READV, fd, iov, num_iov, user_data);
+}
+
+int uring_prep_writev(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data) {
+    return prep_rw(ring, IORING_OP_WRITEV, fd, iov, num_iov, user_data);
+}
+
+int uring_submit(bloom_uring *ring) {
+    if (!ring->to_submit) return 0;
+    int res;
+    do {
+        res = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0, NULL, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) return -errno;
+    ring->to_submit -= res;
+    return res;
+}
+
+int uring_next_cqe(bloom_uring *ring, uint64_t *user_data, int *res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return -1;
+    struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight--;
+    return 0;
+}
+
+void uring_drain(bloom_uring *ring) {
+    // Entries that could not be submitted never complete
+    if (uring_submit(ring) < 0) {
+        ring->in_flight -= ring->to_submit;
+        ring->to_submit = 0;
+    }
+
+    uint64_t user_data;
+    int res;
+    while (ring->in_flight) {
+        if (!uring_next_cqe(ring, &user_data, &res)) continue;
+        res = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0 && errno != EINTR) break;
+    }
+}
+
+#else
+
+/*
+ * io_uring is only available on Linux. The
+ * stubs allow the networking stack to link,
+ * and configuration validation rejects the option.
+ */
+int uring_supported(void) {
+    return 0;
+}
+
+int uring_init(unsigned entries, bloom_uring **ring) {
+    (void)entries;
+    (void)ring;
+    return -ENOSYS;
+}
+
+void uring_destroy(bloom_uring *ring) {
+    (void)ring;
+}
+
+int uring_fd(bloom_uring *ring) {
+    (void)ring;
+    return -1;
+}
+
+int uring_prep_readv(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data) {
+    (void)ring; (void)fd; (void)iov; (void)num_iov; (void)user_data;
+    return -ENOSYS;
+}
+
+int uring_prep_writev(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data) {
+    (void)ring; (void)fd; (void)iov; (void)num_iov; (void)user_data;
+    return -ENOSYS;
+}
+
+int uring_submit(bloom_uring *ring) {
+    (void)ring;
+    return -ENOSYS;
+}
+
+int uring_next_cqe(bloom_uring *ring, uint64_t *user_data, int *res) {
+    (void)ring; (void)user_data; (void)res;
+    return -1;
+}
+
+void uring_drain(bloom_uring *ring) {
+    (void)ring;
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef BLOOM_URING_H
+#define BLOOM_URING_H
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper used by the networking stack. It
+ * only supports the vectored reads and writes that we need,
+ * and uses the raw system calls so there is no dependency on
+ * liburing. Not thread safe, each worker owns its own ring.
+ */
+typedef struct bloom_uring bloom_uring;
+
+/**
+ * Checks if io_uring is supported by the system
+ * @return 1 if supported, 0 otherwise.
+ */
+int uring_supported(void);
+
+/**
+ * Initializes a new ring
+ * @arg entries The number of submission queue entries
+ * @arg ring Output, the new ring
+ * @return 0 on success, negative errno on error.
+ */
+int uring_init(unsigned entries, bloom_uring **ring);
+
+/**
+ * Destroys a ring. Any operations still in flight
+ * are cancelled by the kernel.
+ * @arg ring The ring to destroy
+ */
+void uring_destroy(bloom_uring *ring);
+
+/**
+ * Returns the file descriptor of the ring. This becomes
+ * readable when there are completions to reap, so it can
+ * be watched by an event loop.
+ * @arg ring The ring
+ * @return The file descriptor
+ */
+int uring_fd(bloom_uring *ring);
+
+/**
+ * Queues a vectored read. The iovecs must stay valid
+ * until the next uring_submit.
+ * @arg ring The ring
+ * @arg fd The file descriptor to read from
+ * @arg iov The vectors to read into
+ * @arg num_iov The number of vectors
+ * @arg user_data Returned with the completion
+ * @return 0 on success, negative errno on error.
+ */
+int uring_prep_readv(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data);
+
+/**
+ * Queues a vectored write. The iovecs must stay valid
+ * until the next uring_submit.
+ * @arg ring The ring
+ * @arg fd The file descriptor to write to
+ * @arg iov The vectors to write from
+ * @arg num_iov The number of vectors
+ * @arg user_data Returned with the completion
+ * @return 0 on success, negative errno on error.
+ */
+int uring_prep_writev(bloom_uring *ring, int fd, struct iovec *iov, int num_iov, uint64_t user_data);
+
+/**
+ * Submits all the queued operations in a single system call.
+ * @arg ring The ring
+ * @return The number submitted, or negative errno on error.
+ */
+int uring_submit(bloom_uring *ring);
+
+/**
+ * Reaps the next completion, if any.
+ * @arg ring The ring
+ * @arg user_data Output, the user data of the operation
+ * @arg res Output, the result of the operation
+ * @return 0 if a completion was reaped, -1 if there are none.
+ */
+int uring_next_cqe(bloom_uring *ring, uint64_t *user_data, int *res);
+
+/**
+ * Submits the queued operations, and waits until every
+ * operation in flight has completed. The completions are
+ * discarded. The caller must make the operations complete,
+ * e.g. by shutting down the sockets they are on.
+ * @arg ring The ring
+ */
+void uring_drain(bloom_uring *ring);
+
+#endif
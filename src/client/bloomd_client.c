@@ -0,0 +1,1232 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "bloomd_client.h"
+
+/*
+ * Static definitions
+ */
+#define DEFAULT_PORT 8673
+#define DEFAULT_IN_FLIGHT 128
+#define DEFAULT_BATCH 256
+
+/*
+ * The binary protocol, see the README
+ */
+#define BIN_MAGIC 0xB1
+#define BIN_HEADER_LEN 8
+#define BIN_MAX_BODY (64 * 1024 * 1024)
+#define BIN_CHECK 1
+#define BIN_SET 2
+
+/*
+ * The most filters with single keys queued at once. Queuing
+ * a key for another filter sends the oldest batch.
+ */
+#define MAX_OPEN_BATCHES 16
+
+/*
+ * How the reply of a request is parsed
+ */
+typedef enum {
+    REPLY_IGNORE,       // A line that is dropped, such as the format reply
+    REPLY_TEXT,         // A line, or a START to END block
+    REPLY_KEY,          // Yes or No for a single key
+    REPLY_KEYS,         // Y or N for each key, or Yes or No in the text format
+    REPLY_BINARY        // A binary reply with a bitset of the keys
+} reply_kind;
+
+/*
+ * A single key callback, waiting on a key of a merged batch
+ */
+typedef struct {
+    bloomd_key_cb cb;
+    void *arg;
+} key_waiter;
+
+/*
+ * A command awaiting its reply
+ */
+typedef struct {
+    reply_kind kind;
+    int num_keys;
+    bloomd_keys_cb keys_cb;     // For many key commands
+    bloomd_reply_cb reply_cb;   // For text commands
+    void *arg;
+    key_waiter *waiters;        // One for each key of merged single keys, or NULL
+} client_request;
+
+/*
+ * A connection of the pool. The requests are a ring, in the
+ * order their replies will arrive.
+ */
+typedef struct {
+    int fd;
+    char *out;
+    size_t out_len, out_sent, out_cap;
+    char *in;
+    size_t in_start, in_len, in_cap;
+    client_request *reqs;
+    uint32_t head, count, cap;
+    uint32_t ignored;           // Requests whose replies are dropped
+} client_conn;
+
+/*
+ * The single keys queued for a filter. The keys are copied
+ * into one buffer, each as a 2 byte length and the key.
+ */
+typedef struct {
+    char *filter;
+    int op;                     // BIN_CHECK or BIN_SET
+    char *keys;
+    size_t keys_len, keys_cap;
+    key_waiter *waiters;
+    int num, cap;
+} open_batch;
+
+struct bloomd_client {
+    bloomd_client_options opts;
+    char *host;
+    client_conn *conns;
+    open_batch batches[MAX_OPEN_BATCHES];
+    int num_batches;
+    char *results;              // Scratch space for the results of a reply
+    int results_cap;
+};
+
+/*
+ * Waits on a blocking call
+ */
+typedef struct {
+    int done;
+    int status;
+    char *results;
+    int num_keys;
+    char **reply;
+} sync_wait;
+
+// Static declarations
+static int connect_conn(bloomd_client *client, client_conn *conn);
+static void fail_conn(bloomd_client *client, client_conn *conn, int *callbacks);
+static client_conn* conn_for(bloomd_client *client, const char *filter, int filter_len);
+static int conn_index(bloomd_client *client, const char *filter, int filter_len);
+static int out_append(client_conn *conn, const void *data, size_t len);
+static int push_request(client_conn *conn, client_request *req);
+static int wait_for_room(bloomd_client *client, client_conn *conn);
+static int check_keys(bloomd_client *client, const char *const *keys, const int *key_lens, int num_keys);
+static int encode_keys(bloomd_client *client, client_conn *conn, int op, const char *filter,
+        const char *const *keys, const int *key_lens, int num_keys, client_request *req);
+static int queue_key(bloomd_client *client, int op, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg);
+static int queue_keys(bloomd_client *client, int op, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg);
+static void close_batch(bloomd_client *client, int idx);
+static void close_filter_batches(bloomd_client *client, const char *filter, int filter_len);
+static void close_all_batches(bloomd_client *client);
+static int progress(bloomd_client *client, int timeout_msec);
+static int send_out(bloomd_client *client, client_conn *conn);
+static int read_in(bloomd_client *client, client_conn *conn);
+static int handle_replies(bloomd_client *client, client_conn *conn);
+static void deliver(bloomd_client *client, client_request *req, int status, const char *data, int len);
+static void deliver_keys(client_request *req, int status, const char *results, int num_keys);
+static int parse_key_line(bloomd_client *client, const char *line, int len, int num_keys);
+static int parse_binary(bloomd_client *client, const unsigned char *msg, uint32_t body_len, int num_keys);
+static int error_status(const char *line, int len);
+static int wait_sync(bloomd_client *client, sync_wait *w, int conn_idx);
+
+/**
+ * Fills in the default options, for localhost:8673
+ * with a single connection.
+ * @arg opts The options to fill in
+ */
+void bloomd_client_defaults(bloomd_client_options *opts) {
+    memset(opts, 0, sizeof(bloomd_client_options));
+    opts->host = "localhost";
+    opts->port = DEFAULT_PORT;
+    opts->connections = 1;
+    opts->max_in_flight = DEFAULT_IN_FLIGHT;
+    opts->max_batch = DEFAULT_BATCH;
+}
+
+/**
+ * Opens a client, connecting its pool of connections.
+ * @arg opts The options, copied into the client
+ * @arg client Output, the new client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if a connection failed.
+ */
+int bloomd_client_open(const bloomd_client_options *opts, bloomd_client **client) {
+    bloomd_client *c = calloc(1, sizeof(bloomd_client));
+    if (!c) return BLOOMD_ERR_NOMEM;
+    c->opts = *opts;
+    if (c->opts.connections < 1) c->opts.connections = 1;
+    if (c->opts.max_in_flight < 1) c->opts.max_in_flight = 1;
+    if (c->opts.max_batch < 1) c->opts.max_batch = 1;
+    c->host = strdup(opts->host ? opts->host : "localhost");
+    c->opts.host = c->host;
+    c->conns = calloc(c->opts.connections, sizeof(client_conn));
+    if (!c->host || !c->conns) {
+        bloomd_client_close(c);
+        return BLOOMD_ERR_NOMEM;
+    }
+    for (int i=0; i < c->opts.connections; i++) c->conns[i].fd = -1;
+    for (int i=0; i < c->opts.connections; i++) {
+        int res = connect_conn(c, c->conns + i);
+        if (res) {
+            bloomd_client_close(c);
+            return res;
+        }
+    }
+    *client = c;
+    return BLOOMD_OK;
+}
+
+/**
+ * Closes a client. The callbacks of the commands still
+ * in flight are called with BLOOMD_ERR_IO.
+ * @arg client The client
+ */
+void bloomd_client_close(bloomd_client *client) {
+    // Keys that were never sent fail too
+    for (int i=0; i < client->num_batches; i++) {
+        open_batch *b = client->batches + i;
+        for (int j=0; j < b->num; j++) b->waiters[j].cb(b->waiters[j].arg, BLOOMD_ERR_IO);
+        free(b->filter);
+        free(b->keys);
+        free(b->waiters);
+    }
+    client->num_batches = 0;
+
+    int callbacks = 0;
+    for (int i=0; client->conns && i < client->opts.connections; i++) {
+        client_conn *conn = client->conns + i;
+        fail_conn(client, conn, &callbacks);
+        free(conn->out);
+        free(conn->in);
+        free(conn->reqs);
+    }
+    free(client->conns);
+    free(client->results);
+    free(client->host);
+    free(client);
+}
+
+/**
+ * Queues a check of a key. The single keys of a filter
+ * are sent together once the client is flushed or polled.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg key The key
+ * @arg key_len The length of the key, or -1 if it is null terminated
+ * @arg cb Called with the result
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_check_async(bloomd_client *client, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg) {
+    return queue_key(client, BIN_CHECK, filter, key, key_len, cb, arg);
+}
+
+/**
+ * Queues a set of a key, like bloomd_check_async.
+ * The result is 1 if the key was added.
+ */
+int bloomd_set_async(bloomd_client *client, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg) {
+    return queue_key(client, BIN_SET, filter, key, key_len, cb, arg);
+}
+
+/**
+ * Queues a check of many keys, sent as one multi command.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg cb Called with the results
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_check_many_async(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg) {
+    return queue_keys(client, BIN_CHECK, filter, keys, key_lens, num_keys, cb, arg);
+}
+
+/**
+ * Queues a set of many keys, sent as one bulk command,
+ * like bloomd_check_many_async.
+ */
+int bloomd_set_many_async(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg) {
+    return queue_keys(client, BIN_SET, filter, keys, key_lens, num_keys, cb, arg);
+}
+
+/**
+ * Queues a text command, such as a create or an info.
+ * It uses the connection of the filter named by its
+ * first argument.
+ * @arg client The client
+ * @arg cmd The command, without the newline
+ * @arg cb Called with the reply
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_command_async(bloomd_client *client, const char *cmd, bloomd_reply_cb cb, void *arg) {
+    size_t len = strlen(cmd);
+    if (!len || memchr(cmd, '\n', len)) return BLOOMD_ERR_ARGS;
+
+    // The command may use any filter, so the queued keys go first
+    close_all_batches(client);
+    const char *filter = memchr(cmd, ' ', len);
+    int filter_len = 0;
+    if (filter) {
+        filter++;
+        while (filter[filter_len] && filter[filter_len] != ' ') filter_len++;
+    }
+    client_conn *conn = conn_for(client, filter, filter_len);
+    if (!conn) return BLOOMD_ERR_IO;
+    int res = wait_for_room(client, conn);
+    if (res) return res;
+
+    client_request req = {REPLY_TEXT, 0, NULL, cb, arg, NULL};
+    if (out_append(conn, cmd, len) || out_append(conn, "\n", 1) || push_request(conn, &req))
+        return BLOOMD_ERR_NOMEM;
+    return BLOOMD_OK;
+}
+
+/**
+ * Sends the queued commands, without waiting for replies.
+ * @arg client The client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if a connection failed.
+ */
+int bloomd_flush(bloomd_client *client) {
+    close_all_batches(client);
+    int res = BLOOMD_OK;
+    for (int i=0; i < client->opts.connections; i++) {
+        client_conn *conn = client->conns + i;
+        if (conn->fd >= 0 && send_out(client, conn)) res = BLOOMD_ERR_IO;
+    }
+    return res;
+}
+
+/**
+ * Sends the queued commands, and runs the callbacks of
+ * the replies that arrive.
+ * @arg client The client
+ * @arg timeout_msec How long to wait for a reply, 0 to only
+ * handle the replies that arrived, -1 to wait for one.
+ * @return The number of callbacks run.
+ */
+int bloomd_poll(bloomd_client *client, int timeout_msec) {
+    close_all_batches(client);
+    if (!bloomd_pending(client)) return 0;
+    return progress(client, timeout_msec);
+}
+
+/**
+ * @arg client The client
+ * @return The number of commands queued or awaiting replies.
+ */
+int bloomd_pending(bloomd_client *client) {
+    int pending = 0;
+    for (int i=0; i < client->num_batches; i++) pending += client->batches[i].num;
+    for (int i=0; i < client->opts.connections; i++) {
+        pending += client->conns[i].count - client->conns[i].ignored;
+    }
+    return pending;
+}
+
+/**
+ * Returns the sockets of the client, so it can be driven
+ * from an event loop. Call bloomd_poll with a timeout of 0
+ * once any is readable.
+ * @arg client The client
+ * @arg fds Output, the sockets, -1 for a closed connection
+ * @arg max_fds The size of fds
+ * @return The number of connections.
+ */
+int bloomd_client_fds(bloomd_client *client, int *fds, int max_fds) {
+    for (int i=0; i < client->opts.connections && i < max_fds; i++) {
+        fds[i] = client->conns[i].fd;
+    }
+    return client->opts.connections;
+}
+
+// Callbacks of the blocking calls
+static void sync_key_cb(void *arg, int status) {
+    sync_wait *w = arg;
+    w->status = status;
+    w->done = 1;
+}
+
+static void sync_keys_cb(void *arg, int status, const char *results, int num_keys) {
+    sync_wait *w = arg;
+    if (results && num_keys == w->num_keys) memcpy(w->results, results, num_keys);
+    w->status = status;
+    w->done = 1;
+}
+
+static void sync_reply_cb(void *arg, int status, const char *reply, int len) {
+    sync_wait *w = arg;
+    if (w->reply && reply) {
+        *w->reply = malloc(len + 1);
+        if (*w->reply) {
+            memcpy(*w->reply, reply, len);
+            (*w->reply)[len] = 0;
+        }
+    }
+    w->status = status;
+    w->done = 1;
+}
+
+/**
+ * Checks a key, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg key The key
+ * @arg key_len The length of the key, or -1 if it is null terminated
+ * @return 1 if the key is in the filter, 0 if not, or an error.
+ */
+int bloomd_check(bloomd_client *client, const char *filter, const char *key, int key_len) {
+    sync_wait w = {0, 0, NULL, 0, NULL};
+    int res = queue_key(client, BIN_CHECK, filter, key, key_len, sync_key_cb, &w);
+    if (res) return res;
+    return wait_sync(client, &w, conn_index(client, filter, strlen(filter)));
+}
+
+/**
+ * Sets a key, waiting for the reply.
+ * @return 1 if the key was added, 0 if it was present, or an error.
+ */
+int bloomd_set(bloomd_client *client, const char *filter, const char *key, int key_len) {
+    sync_wait w = {0, 0, NULL, 0, NULL};
+    int res = queue_key(client, BIN_SET, filter, key, key_len, sync_key_cb, &w);
+    if (res) return res;
+    return wait_sync(client, &w, conn_index(client, filter, strlen(filter)));
+}
+
+/**
+ * Checks many keys, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_check_many(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results) {
+    sync_wait w = {0, 0, results, num_keys, NULL};
+    int res = queue_keys(client, BIN_CHECK, filter, keys, key_lens, num_keys, sync_keys_cb, &w);
+    if (res) return res;
+    return wait_sync(client, &w, conn_index(client, filter, strlen(filter)));
+}
+
+/**
+ * Sets many keys, waiting for the reply.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_set_many(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results) {
+    sync_wait w = {0, 0, results, num_keys, NULL};
+    int res = queue_keys(client, BIN_SET, filter, keys, key_lens, num_keys, sync_keys_cb, &w);
+    if (res) return res;
+    return wait_sync(client, &w, conn_index(client, filter, strlen(filter)));
+}
+
+/**
+ * Sends a text command, waiting for the reply.
+ * @arg client The client
+ * @arg cmd The command, without the newline
+ * @arg reply Output, the reply as for bloomd_reply_cb, null
+ * terminated. Must be freed by the caller. May be NULL.
+ * @return BLOOMD_OK, or an error if the reply was one.
+ */
+int bloomd_command(bloomd_client *client, const char *cmd, char **reply) {
+    sync_wait w = {0, 0, NULL, 0, reply};
+    if (reply) *reply = NULL;
+    int res = bloomd_command_async(client, cmd, sync_reply_cb, &w);
+    if (res) return res;
+
+    const char *filter = strchr(cmd, ' ');
+    int filter_len = 0;
+    if (filter) {
+        filter++;
+        while (filter[filter_len] && filter[filter_len] != ' ') filter_len++;
+    }
+    return wait_sync(client, &w, conn_index(client, filter, filter_len));
+}
+
+/**
+ * Creates a filter, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg options The create options, such as "capacity=1000000", or NULL
+ * @return BLOOMD_OK if created, 1 if it exists, or an error.
+ */
+int bloomd_create(bloomd_client *client, const char *filter, const char *options) {
+    size_t len = strlen(filter) + (options ? strlen(options) : 0) + 9;
+    char *cmd = malloc(len);
+    if (!cmd) return BLOOMD_ERR_NOMEM;
+    snprintf(cmd, len, "create %s%s%s", filter, options ? " " : "", options ? options : "");
+
+    char *reply = NULL;
+    int res = bloomd_command(client, cmd, &reply);
+    free(cmd);
+    if (!res && reply) {
+        if (!strcmp(reply, "Exists")) res = 1;
+        else if (strcmp(reply, "Done")) res = BLOOMD_ERR_ARGS;
+    }
+    free(reply);
+    return res;
+}
+
+/**
+ * Drops a filter, waiting for the reply.
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_drop(bloomd_client *client, const char *filter) {
+    size_t len = strlen(filter) + 6;
+    char *cmd = malloc(len);
+    if (!cmd) return BLOOMD_ERR_NOMEM;
+    snprintf(cmd, len, "drop %s", filter);
+    char *reply = NULL;
+    int res = bloomd_command(client, cmd, &reply);
+    free(cmd);
+    if (!res && reply && strcmp(reply, "Done")) res = BLOOMD_ERR_ARGS;
+    free(reply);
+    return res;
+}
+
+/**
+ * @arg status A bloomd_status
+ * @return A description of the status
+ */
+const char *bloomd_strerror(int status) {
+    switch (status) {
+        case BLOOMD_OK: return "Success";
+        case BLOOMD_ERR_NO_FILTER: return "Filter does not exist";
+        case BLOOMD_ERR_ARGS: return "Bad arguments";
+        case BLOOMD_ERR_INTERNAL: return "Internal server error";
+        case BLOOMD_ERR_FROZEN: return "Filter is frozen";
+        case BLOOMD_ERR_READ_ONLY: return "Server is read-only";
+        case BLOOMD_ERR_MOVED: return "Filter is on another node";
+        case BLOOMD_ERR_OVER_QUOTA: return "Filter is over its quota";
+        case BLOOMD_ERR_LOADING: return "Filter is loading";
+        case BLOOMD_ERR_IO: return "Connection failed";
+        case BLOOMD_ERR_PROTOCOL: return "Bad reply";
+        case BLOOMD_ERR_TIMEOUT: return "Timed out";
+        case BLOOMD_ERR_NOMEM: return "Out of memory";
+        case BLOOMD_ERR_BUSY: return "Server is busy";
+        default: return (status > 0) ? "Success" : "Unknown error";
+    }
+}
+
+/**
+ * Connects a connection of the pool, and asks for the
+ * compact format of the multi and bulk replies.
+ */
+static int connect_conn(bloomd_client *client, client_conn *conn) {
+    const char *host = client->host;
+    int fd = -1;
+    if (host[0] == '/' || host[0] == '@') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        size_t len = strlen(host);
+        if (len >= sizeof(addr.sun_path)) return BLOOMD_ERR_ARGS;
+        memcpy(addr.sun_path, host, len);
+        if (host[0] == '@') addr.sun_path[0] = 0;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr,
+                    offsetof(struct sockaddr_un, sun_path) + len)) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", client->opts.port);
+        struct addrinfo hints, *res, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res)) return BLOOMD_ERR_IO;
+        for (ai=res; ai && fd < 0; ai=ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        }
+        freeaddrinfo(res);
+    }
+    if (fd < 0) return BLOOMD_ERR_IO;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd = fd;
+
+    // The reply is not waited for, the key replies are parsed
+    // in either format
+    static const char FORMAT_CMD[] = "format compact\n";
+    client_request req = {REPLY_IGNORE, 0, NULL, NULL, NULL, NULL};
+    if (out_append(conn, FORMAT_CMD, sizeof(FORMAT_CMD) - 1) || push_request(conn, &req)) {
+        return BLOOMD_ERR_NOMEM;
+    }
+    return BLOOMD_OK;
+}
+
+/**
+ * Closes a failed connection, failing its requests. The
+ * requests are detached first, so the callbacks can queue
+ * new commands, which reconnect.
+ */
+static void fail_conn(bloomd_client *client, client_conn *conn, int *callbacks) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->out_len = conn->out_sent = 0;
+    conn->in_start = conn->in_len = 0;
+
+    client_request *reqs = conn->reqs;
+    uint32_t head = conn->head, count = conn->count, cap = conn->cap;
+    conn->reqs = NULL;
+    conn->head = conn->count = conn->cap = conn->ignored = 0;
+    for (uint32_t i=0; i < count; i++) {
+        client_request *req = reqs + ((head + i) % cap);
+        int num = (req->waiters) ? req->num_keys : 1;
+        deliver(client, req, BLOOMD_ERR_IO, NULL, 0);
+        if (req->kind != REPLY_IGNORE) *callbacks += num;
+    }
+    free(reqs);
+}
+
+/**
+ * Picks the connection of a filter, so the commands of
+ * a filter complete in order.
+ */
+static int conn_index(bloomd_client *client, const char *filter, int filter_len) {
+    uint32_t h = 2166136261U;
+    for (int i=0; i < filter_len; i++) {
+        h ^= (unsigned char)filter[i];
+        h *= 16777619U;
+    }
+    return h % client->opts.connections;
+}
+
+/**
+ * Returns the connection of a filter, reconnecting it
+ * if it failed.
+ * @return The connection, or NULL if it can not connect.
+ */
+static client_conn* conn_for(bloomd_client *client, const char *filter, int filter_len) {
+    client_conn *conn = client->conns + conn_index(client, filter, filter_len);
+    if (conn->fd < 0 && connect_conn(client, conn)) return NULL;
+    return conn;
+}
+
+// Appends to the output buffer of a connection
+static int out_append(client_conn *conn, const void *data, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = (conn->out_cap) ? conn->out_cap : 4096;
+        while (cap < conn->out_len + len) cap *= 2;
+        char *out = realloc(conn->out, cap);
+        if (!out) return -1;
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+// Adds a request to the end of the ring of a connection
+static int push_request(client_conn *conn, client_request *req) {
+    if (conn->count == conn->cap) {
+        uint32_t cap = (conn->cap) ? conn->cap * 2 : 64;
+        client_request *reqs = malloc(cap * sizeof(client_request));
+        if (!reqs) return -1;
+        for (uint32_t i=0; i < conn->count; i++) {
+            reqs[i] = conn->reqs[(conn->head + i) % conn->cap];
+        }
+        free(conn->reqs);
+        conn->reqs = reqs;
+        conn->head = 0;
+        conn->cap = cap;
+    }
+    conn->reqs[(conn->head + conn->count) % conn->cap] = *req;
+    conn->count++;
+    if (req->kind == REPLY_IGNORE) conn->ignored++;
+    return 0;
+}
+
+/**
+ * Waits for the replies of a connection, while it has
+ * max_in_flight commands awaiting them.
+ */
+static int wait_for_room(bloomd_client *client, client_conn *conn) {
+    while (conn->fd >= 0 && conn->count >= (uint32_t)client->opts.max_in_flight) {
+        progress(client, -1);
+    }
+    if (conn->fd < 0 && connect_conn(client, conn)) return BLOOMD_ERR_IO;
+    return BLOOMD_OK;
+}
+
+/**
+ * Checks that keys can be sent. The text protocol splits
+ * keys on whitespace, and the binary one has 2 byte lengths.
+ */
+static int check_keys(bloomd_client *client, const char *const *keys, const int *key_lens, int num_keys) {
+    if (num_keys < 1) return BLOOMD_ERR_ARGS;
+    for (int i=0; i < num_keys; i++) {
+        const char *key = keys[i];
+        int len = (key_lens) ? key_lens[i] : (int)strlen(key);
+        if (len < 1 || len > UINT16_MAX) return BLOOMD_ERR_ARGS;
+        if (client->opts.binary) continue;
+        for (int j=0; j < len; j++) {
+            if (key[j] == ' ' || key[j] == '\n' || key[j] == '\r' || key[j] == '\t' || !key[j])
+                return BLOOMD_ERR_ARGS;
+        }
+    }
+    return BLOOMD_OK;
+}
+
+/**
+ * Encodes a key command onto a connection. Text commands
+ * use check or set for a single key and multi or bulk for
+ * more, and binary commands take any number of keys.
+ * @arg req The request, its kind and number of keys are set
+ */
+static int encode_keys(bloomd_client *client, client_conn *conn, int op, const char *filter,
+        const char *const *keys, const int *key_lens, int num_keys, client_request *req) {
+    size_t filter_len = strlen(filter);
+    req->num_keys = num_keys;
+    if (client->opts.binary) {
+        uint64_t body_len = 4;
+        for (int i=0; i < num_keys; i++) {
+            body_len += 2 + ((key_lens) ? (size_t)key_lens[i] : strlen(keys[i]));
+        }
+        if (filter_len > UINT16_MAX || body_len > BIN_MAX_BODY) return BLOOMD_ERR_ARGS;
+
+        unsigned char header[BIN_HEADER_LEN + 4] = {BIN_MAGIC, op,
+            filter_len >> 8, filter_len,
+            body_len >> 24, body_len >> 16, body_len >> 8, body_len};
+        if (out_append(conn, header, BIN_HEADER_LEN) || out_append(conn, filter, filter_len))
+            return BLOOMD_ERR_NOMEM;
+        header[0] = num_keys >> 24;
+        header[1] = num_keys >> 16;
+        header[2] = num_keys >> 8;
+        header[3] = num_keys;
+        if (out_append(conn, header, 4)) return BLOOMD_ERR_NOMEM;
+        for (int i=0; i < num_keys; i++) {
+            size_t len = (key_lens) ? (size_t)key_lens[i] : strlen(keys[i]);
+            unsigned char klen[2] = {len >> 8, len};
+            if (out_append(conn, klen, 2) || out_append(conn, keys[i], len)) return BLOOMD_ERR_NOMEM;
+        }
+        req->kind = REPLY_BINARY;
+        return BLOOMD_OK;
+    }
+
+    const char *cmd = (num_keys == 1) ? ((op == BIN_SET) ? "s " : "c ") : ((op == BIN_SET) ? "b " : "m ");
+    if (out_append(conn, cmd, 2) || out_append(conn, filter, filter_len)) return BLOOMD_ERR_NOMEM;
+    for (int i=0; i < num_keys; i++) {
+        size_t len = (key_lens) ? (size_t)key_lens[i] : strlen(keys[i]);
+        if (out_append(conn, " ", 1) || out_append(conn, keys[i], len)) return BLOOMD_ERR_NOMEM;
+    }
+    if (out_append(conn, "\n", 1)) return BLOOMD_ERR_NOMEM;
+    req->kind = (num_keys == 1) ? REPLY_KEY : REPLY_KEYS;
+    return BLOOMD_OK;
+}
+
+/**
+ * Queues a single key in the open batch of its filter.
+ */
+static int queue_key(bloomd_client *client, int op, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg) {
+    if (key_len < 0) key_len = strlen(key);
+    int res = check_keys(client, &key, &key_len, 1);
+    if (res) return res;
+    int filter_len = strlen(filter);
+    client_conn *conn = conn_for(client, filter, filter_len);
+    if (!conn) return BLOOMD_ERR_IO;
+    res = wait_for_room(client, conn);
+    if (res) return res;
+
+    // A batch of the other op is sent first, to keep the order
+    open_batch *b = NULL;
+    for (int i=0; i < client->num_batches; i++) {
+        if (strcmp(client->batches[i].filter, filter)) continue;
+        if (client->batches[i].op == op && client->batches[i].num < client->opts.max_batch) {
+            b = client->batches + i;
+        } else {
+            close_batch(client, i);
+        }
+        break;
+    }
+    if (!b) {
+        if (client->num_batches == MAX_OPEN_BATCHES) close_batch(client, 0);
+        b = client->batches + client->num_batches;
+        memset(b, 0, sizeof(open_batch));
+        b->filter = strdup(filter);
+        if (!b->filter) return BLOOMD_ERR_NOMEM;
+        b->op = op;
+        client->num_batches++;
+    }
+
+    // Copy the key, since it is sent later
+    if (b->keys_len + 2 + key_len > b->keys_cap) {
+        size_t cap = (b->keys_cap) ? b->keys_cap : 1024;
+        while (cap < b->keys_len + 2 + key_len) cap *= 2;
+        char *keys = realloc(b->keys, cap);
+        if (!keys) return BLOOMD_ERR_NOMEM;
+        b->keys = keys;
+        b->keys_cap = cap;
+    }
+    if (b->num == b->cap) {
+        int cap = (b->cap) ? b->cap * 2 : 16;
+        key_waiter *waiters = realloc(b->waiters, cap * sizeof(key_waiter));
+        if (!waiters) return BLOOMD_ERR_NOMEM;
+        b->waiters = waiters;
+        b->cap = cap;
+    }
+    uint16_t len = key_len;
+    memcpy(b->keys + b->keys_len, &len, 2);
+    memcpy(b->keys + b->keys_len + 2, key, key_len);
+    b->keys_len += 2 + key_len;
+    b->waiters[b->num].cb = cb;
+    b->waiters[b->num].arg = arg;
+    b->num++;
+
+    if (b->num >= client->opts.max_batch) close_batch(client, b - client->batches);
+    return BLOOMD_OK;
+}
+
+/**
+ * Queues a many key command on the connection of its filter.
+ */
+static int queue_keys(bloomd_client *client, int op, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg) {
+    int res = check_keys(client, keys, key_lens, num_keys);
+    if (res) return res;
+    int filter_len = strlen(filter);
+    close_filter_batches(client, filter, filter_len);
+    client_conn *conn = conn_for(client, filter, filter_len);
+    if (!conn) return BLOOMD_ERR_IO;
+    res = wait_for_room(client, conn);
+    if (res) return res;
+
+    client_request req = {REPLY_KEYS, num_keys, cb, NULL, arg, NULL};
+    size_t out_len = conn->out_len;
+    res = encode_keys(client, conn, op, filter, keys, key_lens, num_keys, &req);
+    if (!res && push_request(conn, &req)) res = BLOOMD_ERR_NOMEM;
+    if (res) conn->out_len = out_len;
+    return res;
+}
+
+/**
+ * Sends an open batch of single keys as one command, and
+ * removes it from the open batches.
+ */
+static void close_batch(bloomd_client *client, int idx) {
+    open_batch b = client->batches[idx];
+    client->batches[idx] = client->batches[--client->num_batches];
+
+    const char *stack_keys[64];
+    int stack_lens[64];
+    const char **keys = (b.num <= 64) ? stack_keys : malloc(b.num * sizeof(char*));
+    int *lens = (b.num <= 64) ? stack_lens : malloc(b.num * sizeof(int));
+    int res = (keys && lens) ? BLOOMD_OK : BLOOMD_ERR_NOMEM;
+    for (int i=0, pos=0; !res && i < b.num; i++) {
+        uint16_t len;
+        memcpy(&len, b.keys + pos, 2);
+        keys[i] = b.keys + pos + 2;
+        lens[i] = len;
+        pos += 2 + len;
+    }
+
+    client_request req = {REPLY_KEYS, b.num, NULL, NULL, NULL, b.waiters};
+    client_conn *conn = (res) ? NULL : conn_for(client, b.filter, strlen(b.filter));
+    if (!res && !conn) res = BLOOMD_ERR_IO;
+    if (!res) {
+        size_t out_len = conn->out_len;
+        res = encode_keys(client, conn, b.op, b.filter, keys, lens, b.num, &req);
+        if (!res && push_request(conn, &req)) res = BLOOMD_ERR_NOMEM;
+        if (res) conn->out_len = out_len;
+    }
+    if (keys != stack_keys) free(keys);
+    if (lens != stack_lens) free(lens);
+    free(b.filter);
+    free(b.keys);
+
+    // The waiters are freed with the request once it completes
+    if (res) {
+        for (int i=0; i < b.num; i++) b.waiters[i].cb(b.waiters[i].arg, res);
+        free(b.waiters);
+    }
+}
+
+// Sends the open batch of a filter, if it has one
+static void close_filter_batches(bloomd_client *client, const char *filter, int filter_len) {
+    for (int i=0; i < client->num_batches; i++) {
+        if (!strncmp(client->batches[i].filter, filter, filter_len) &&
+                !client->batches[i].filter[filter_len]) {
+            close_batch(client, i);
+            return;
+        }
+    }
+}
+
+// Sends all the open batches
+static void close_all_batches(bloomd_client *client) {
+    while (client->num_batches) close_batch(client, 0);
+}
+
+/**
+ * Sends what is buffered, and reads and handles the replies
+ * that arrive within the timeout.
+ * @return The number of callbacks run.
+ */
+static int progress(bloomd_client *client, int timeout_msec) {
+    int n = client->opts.connections, callbacks = 0;
+    struct pollfd pfds[n];
+    for (int i=0; i < n; i++) {
+        client_conn *conn = client->conns + i;
+        pfds[i].fd = -1;
+        pfds[i].events = 0;
+        pfds[i].revents = 0;
+        if (conn->fd < 0) continue;
+
+        // Replies may have arrived with an earlier read
+        if (conn->count && conn->in_start < conn->in_len) {
+            callbacks += handle_replies(client, conn);
+            if (conn->fd < 0) continue;
+        }
+        if (conn->out_sent < conn->out_len && send_out(client, conn)) {
+            fail_conn(client, conn, &callbacks);
+            continue;
+        }
+        pfds[i].fd = conn->fd;
+        if (conn->count) pfds[i].events |= POLLIN;
+        if (conn->out_sent < conn->out_len) pfds[i].events |= POLLOUT;
+    }
+    if (callbacks) timeout_msec = 0;
+    if (poll(pfds, n, timeout_msec) <= 0) return callbacks;
+
+    for (int i=0; i < n; i++) {
+        client_conn *conn = client->conns + i;
+        if (pfds[i].fd < 0 || pfds[i].fd != conn->fd || !pfds[i].revents) continue;
+        if ((pfds[i].revents & POLLOUT) && send_out(client, conn)) {
+            fail_conn(client, conn, &callbacks);
+            continue;
+        }
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int res = read_in(client, conn);
+            callbacks += handle_replies(client, conn);
+            if (res && conn->fd >= 0) fail_conn(client, conn, &callbacks);
+        }
+    }
+    return callbacks;
+}
+
+// Writes out as much of the output buffer as the socket takes
+static int send_out(bloomd_client *client, client_conn *conn) {
+    (void)client;
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent,
+                conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+}
+
+// Reads what has arrived on a connection
+static int read_in(bloomd_client *client, client_conn *conn) {
+    (void)client;
+    for (;;) {
+        // Move the unparsed bytes to the front, or grow
+        if (conn->in_start == conn->in_len) {
+            conn->in_start = conn->in_len = 0;
+        } else if (conn->in_start && conn->in_len == conn->in_cap) {
+            memmove(conn->in, conn->in + conn->in_start, conn->in_len - conn->in_start);
+            conn->in_len -= conn->in_start;
+            conn->in_start = 0;
+        }
+        if (conn->in_len == conn->in_cap) {
+            size_t cap = (conn->in_cap) ? conn->in_cap * 2 : 16384;
+            char *in = realloc(conn->in, cap);
+            if (!in) return -1;
+            conn->in = in;
+            conn->in_cap = cap;
+        }
+
+        ssize_t num = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (num == 0) return -1;
+        if (num < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->in_len += num;
+    }
+}
+
+/**
+ * Handles the replies that have fully arrived, in order.
+ * @return The number of callbacks run.
+ */
+static int handle_replies(bloomd_client *client, client_conn *conn) {
+    int callbacks = 0;
+    while (conn->count && conn->in_start < conn->in_len) {
+        client_request req = conn->reqs[conn->head];
+        char *buf = conn->in + conn->in_start;
+        size_t avail = conn->in_len - conn->in_start, used;
+        int status = BLOOMD_OK;
+        const char *data = NULL;
+        int len = 0;
+
+        if (req.kind == REPLY_BINARY) {
+            if (avail < BIN_HEADER_LEN) break;
+            unsigned char *msg = (unsigned char*)buf;
+            uint32_t body_len = ((uint32_t)msg[4] << 24) | (msg[5] << 16) | (msg[6] << 8) | msg[7];
+            if (msg[0] != BIN_MAGIC || body_len > BIN_MAX_BODY) {
+                fail_conn(client, conn, &callbacks);
+                break;
+            }
+            if (avail < BIN_HEADER_LEN + body_len) break;
+            used = BIN_HEADER_LEN + body_len;
+            status = parse_binary(client, msg, body_len, req.num_keys);
+            data = client->results;
+
+        } else {
+            char *nl = memchr(buf, '\n', avail);
+            if (!nl) break;
+            len = nl - buf;
+            used = len + 1;
+            if (len && buf[len - 1] == '\r') len--;
+
+            // A block runs from START to END
+            if (req.kind == REPLY_TEXT && len == 5 && !memcmp(buf, "START", 5)) {
+                char *line = nl + 1, *end = buf + avail;
+                int found = 0;
+                while (line < end && !found) {
+                    char *lnl = memchr(line, '\n', end - line);
+                    if (!lnl) break;
+                    int llen = lnl - line;
+                    if (llen && line[llen - 1] == '\r') llen--;
+                    if (llen == 3 && !memcmp(line, "END", 3)) {
+                        found = 1;
+                        data = nl + 1;
+                        len = line - data;
+                        used = lnl + 1 - buf;
+                    }
+                    line = lnl + 1;
+                }
+                if (!found) break;
+            } else {
+                data = buf;
+            }
+
+            if (req.kind == REPLY_KEY) {
+                if (len == 3 && !memcmp(buf, "Yes", 3)) status = 1;
+                else if (len == 2 && !memcmp(buf, "No", 2)) status = 0;
+                else status = error_status(buf, len) ? error_status(buf, len) : BLOOMD_ERR_PROTOCOL;
+            } else if (req.kind == REPLY_KEYS) {
+                status = parse_key_line(client, buf, len, req.num_keys);
+                data = client->results;
+            } else if (req.kind == REPLY_TEXT) {
+                status = error_status(buf, len);
+            }
+        }
+
+        // Pop before the callback, which may queue commands
+        conn->head = (conn->head + 1) % conn->cap;
+        conn->count--;
+        conn->in_start += used;
+        deliver(client, &req, status, data, len);
+        if (req.kind == REPLY_IGNORE) conn->ignored--;
+        else callbacks += (req.waiters) ? req.num_keys : 1;
+    }
+    return callbacks;
+}
+
+/**
+ * Runs the callbacks of a request, and frees it.
+ */
+static void deliver(bloomd_client *client, client_request *req, int status, const char *data, int len) {
+    (void)client;
+    switch (req->kind) {
+        case REPLY_IGNORE:
+            break;
+        case REPLY_TEXT:
+            req->reply_cb(req->arg, status, data, len);
+            break;
+        case REPLY_KEY:
+            if (req->waiters) {
+                req->waiters[0].cb(req->waiters[0].arg, status);
+            } else {
+                char result = (status == 1);
+                req->keys_cb(req->arg, (status < 0) ? status : BLOOMD_OK,
+                        (status < 0) ? NULL : &result, 1);
+            }
+            break;
+        case REPLY_KEYS:
+        case REPLY_BINARY:
+            deliver_keys(req, status, data, req->num_keys);
+            break;
+    }
+    free(req->waiters);
+}
+
+// Hands the results of a many key reply to its callbacks
+static void deliver_keys(client_request *req, int status, const char *results, int num_keys) {
+    if (!req->waiters) {
+        req->keys_cb(req->arg, status, (status) ? NULL : results, num_keys);
+        return;
+    }
+    for (int i=0; i < num_keys; i++) {
+        req->waiters[i].cb(req->waiters[i].arg, (status) ? status : results[i]);
+    }
+}
+
+// Makes room for the results of a reply
+static int reserve_results(bloomd_client *client, int num_keys) {
+    if (num_keys <= client->results_cap) return 0;
+    char *results = realloc(client->results, num_keys);
+    if (!results) return -1;
+    client->results = results;
+    client->results_cap = num_keys;
+    return 0;
+}
+
+/**
+ * Parses a multi or bulk reply, "YNY" in the compact format or
+ * "Yes No Yes" in the text one, into the scratch results.
+ * @return BLOOMD_OK, or the error of the reply.
+ */
+static int parse_key_line(bloomd_client *client, const char *line, int len, int num_keys) {
+    if (reserve_results(client, num_keys)) return BLOOMD_ERR_NOMEM;
+    char *results = client->results;
+
+    int i = 0;
+    while (i < len && i < num_keys && (line[i] == 'Y' || line[i] == 'N')) {
+        results[i] = (line[i] == 'Y');
+        i++;
+    }
+    if (i == num_keys && i == len) return BLOOMD_OK;
+
+    // Try the text format
+    int pos = 0, n = 0;
+    while (pos < len && n < num_keys) {
+        if (len - pos >= 3 && !memcmp(line + pos, "Yes", 3)) {
+            results[n++] = 1;
+            pos += 3;
+        } else if (len - pos >= 2 && !memcmp(line + pos, "No", 2)) {
+            results[n++] = 0;
+            pos += 2;
+        } else {
+            break;
+        }
+        if (pos < len && line[pos] == ' ') pos++;
+    }
+    if (n == num_keys && pos == len) return BLOOMD_OK;
+
+    // A failed batch has the results so far, then the error
+    const char *err = memchr(line, ' ', len);
+    int status = error_status(line, len);
+    if (!status && err) status = error_status(err + 1, len - (err + 1 - line));
+    return (status) ? status : BLOOMD_ERR_PROTOCOL;
+}
+
+/**
+ * Parses a binary reply into the scratch results.
+ * @return BLOOMD_OK, or the error of the reply.
+ */
+static int parse_binary(bloomd_client *client, const unsigned char *msg, uint32_t body_len, int num_keys) {
+    static const int STATUSES[] = {BLOOMD_OK, BLOOMD_ERR_NO_FILTER, BLOOMD_ERR_ARGS, BLOOMD_ERR_ARGS,
+        BLOOMD_ERR_INTERNAL, BLOOMD_ERR_FROZEN, BLOOMD_ERR_READ_ONLY, BLOOMD_ERR_MOVED,
+        BLOOMD_ERR_OVER_QUOTA, BLOOMD_ERR_LOADING, BLOOMD_ERR_BUSY};
+    if (msg[1] >= sizeof(STATUSES) / sizeof(STATUSES[0])) return BLOOMD_ERR_PROTOCOL;
+    if (msg[1]) return STATUSES[msg[1]];
+
+    const unsigned char *body = msg + BIN_HEADER_LEN;
+    if (body_len < 4) return BLOOMD_ERR_PROTOCOL;
+    uint32_t num = ((uint32_t)body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3];
+    if (num != (uint32_t)num_keys || body_len < 4 + (num + 7) / 8) return BLOOMD_ERR_PROTOCOL;
+    if (reserve_results(client, num_keys)) return BLOOMD_ERR_NOMEM;
+    for (uint32_t i=0; i < num; i++) {
+        client->results[i] = (body[4 + i / 8] >> (i % 8)) & 1;
+    }
+    return BLOOMD_OK;
+}
+
+/**
+ * Maps an error reply to its status.
+ * @return The status, or 0 if the line is not an error.
+ */
+static int error_status(const char *line, int len) {
+#define MATCHES(str) (len == sizeof(str) - 1 && !memcmp(line, str, len))
+#define STARTS(str) (len >= (int)sizeof(str) - 1 && !memcmp(line, str, sizeof(str) - 1))
+    if (MATCHES("Filter does not exist")) return BLOOMD_ERR_NO_FILTER;
+    if (MATCHES("Filter is frozen")) return BLOOMD_ERR_FROZEN;
+    if (MATCHES("Filter is over its quota")) return BLOOMD_ERR_OVER_QUOTA;
+    if (MATCHES("Filter is loading")) return BLOOMD_ERR_LOADING;
+    if (MATCHES("Busy")) return BLOOMD_ERR_BUSY;
+    if (MATCHES("Internal Error")) return BLOOMD_ERR_INTERNAL;
+    if (STARTS("MOVED ")) return BLOOMD_ERR_MOVED;
+    if (STARTS("Client Error: Server is read-only")) return BLOOMD_ERR_READ_ONLY;
+    if (STARTS("Client Error")) return BLOOMD_ERR_ARGS;
+#undef MATCHES
+#undef STARTS
+    return 0;
+}
+
+// Returns the time in milliseconds
+static int64_t now_msec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits for a blocking call to complete. On a timeout its
+ * connection is closed, since the later replies could no
+ * longer be matched to their commands.
+ */
+static int wait_sync(bloomd_client *client, sync_wait *w, int conn_idx) {
+    close_all_batches(client);
+    int64_t deadline = (client->opts.timeout_msec) ? now_msec() + client->opts.timeout_msec : 0;
+    while (!w->done) {
+        int timeout = -1;
+        if (deadline) {
+            int64_t left = deadline - now_msec();
+            if (left <= 0) {
+                int callbacks = 0;
+                fail_conn(client, client->conns + conn_idx, &callbacks);
+                if (!w->done) return BLOOMD_ERR_IO;
+                return BLOOMD_ERR_TIMEOUT;
+            }
+            timeout = left;
+        }
+        progress(client, timeout);
+    }
+    return w->status;
+}
@@ -0,0 +1,269 @@
+#ifndef BLOOMD_CLIENT_H
+#define BLOOMD_CLIENT_H
+
+/*
+ * A client library for bloomd. A client holds a pool of
+ * connections to one server, and pipelines the commands on them,
+ * so many commands are in flight without waiting on each other.
+ *
+ * Commands are sent asynchronously, and their callbacks run
+ * from bloomd_poll once the replies arrive. The blocking calls
+ * are built on the same queues, and also run the callbacks of
+ * any other replies that arrive while they wait.
+ *
+ * The single key checks and sets queued for a filter are merged
+ * into one multi or bulk command, of at most max_batch keys, when
+ * the client is flushed or polled. Multi and bulk replies are
+ * requested in the compact format on each connection, and with the
+ * binary option the batches use the binary protocol, which also
+ * allows keys with any bytes. All the commands of a filter use the
+ * same connection, so they complete in the order they were queued.
+ *
+ * A client must only be used by one thread at a time, and a
+ * callback may queue more commands, but not close the client.
+ */
+#include <stdint.h>
+
+/**
+ * The statuses of the commands. Key commands report 1 or 0
+ * for a single key, and 0 for many keys on success.
+ */
+typedef enum {
+    BLOOMD_OK = 0,
+    BLOOMD_ERR_NO_FILTER = -1,      // The filter does not exist
+    BLOOMD_ERR_ARGS = -2,           // Bad arguments, or a client error reply
+    BLOOMD_ERR_INTERNAL = -3,       // The server had an internal error
+    BLOOMD_ERR_FROZEN = -4,         // Setting keys in a frozen filter
+    BLOOMD_ERR_READ_ONLY = -5,      // Setting keys on a read-only server
+    BLOOMD_ERR_MOVED = -6,          // The filter is on another node of the cluster
+    BLOOMD_ERR_OVER_QUOTA = -7,     // The filter would grow over its quota
+    BLOOMD_ERR_LOADING = -8,        // The filter is being faulted in, retry later
+    BLOOMD_ERR_IO = -9,             // The connection failed or was closed
+    BLOOMD_ERR_PROTOCOL = -10,      // The reply could not be parsed
+    BLOOMD_ERR_TIMEOUT = -11,       // A blocking call timed out
+    BLOOMD_ERR_NOMEM = -12,         // Out of memory
+    BLOOMD_ERR_BUSY = -13           // Over a rate limit or shed by the server, retry later
+} bloomd_status;
+
+/**
+ * Options of a client. Start from bloomd_client_defaults.
+ */
+typedef struct {
+    const char *host;       // Host or address, or the path of a unix socket, '@' for the abstract namespace
+    int port;               // TCP port of the server
+    int connections;        // Connections in the pool
+    int max_in_flight;      // Commands pipelined on a connection before new ones wait
+    int max_batch;          // Most single keys merged into one command, 1 to never merge
+    int binary;             // Send key batches with the binary protocol
+    int timeout_msec;       // Blocking calls give up after this long, 0 to wait forever
+} bloomd_client_options;
+
+typedef struct bloomd_client bloomd_client;
+
+/**
+ * Called with the reply of a single key command.
+ * @arg arg The opaque argument given with the command
+ * @arg status 1 for Yes, 0 for No, or a bloomd_status error
+ */
+typedef void (*bloomd_key_cb)(void *arg, int status);
+
+/**
+ * Called with the reply of a many key command.
+ * @arg arg The opaque argument given with the command
+ * @arg status BLOOMD_OK or an error
+ * @arg results 1 for each key that was Yes and 0 otherwise,
+ * or NULL on error. Only valid during the call.
+ * @arg num_keys The number of keys
+ */
+typedef void (*bloomd_keys_cb)(void *arg, int status, const char *results, int num_keys);
+
+/**
+ * Called with the reply of a text command.
+ * @arg arg The opaque argument given with the command
+ * @arg status BLOOMD_OK, or an error if the reply was one
+ * @arg reply The reply line without the newline, or the lines
+ * between START and END each ending in a newline. NULL if the
+ * connection failed. Only valid during the call.
+ * @arg len The length of the reply
+ */
+typedef void (*bloomd_reply_cb)(void *arg, int status, const char *reply, int len);
+
+/**
+ * Fills in the default options, for localhost:8673
+ * with a single connection.
+ * @arg opts The options to fill in
+ */
+void bloomd_client_defaults(bloomd_client_options *opts);
+
+/**
+ * Opens a client, connecting its pool of connections.
+ * @arg opts The options, copied into the client
+ * @arg client Output, the new client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if a connection failed.
+ */
+int bloomd_client_open(const bloomd_client_options *opts, bloomd_client **client);
+
+/**
+ * Closes a client. The callbacks of the commands still
+ * in flight are called with BLOOMD_ERR_IO.
+ * @arg client The client
+ */
+void bloomd_client_close(bloomd_client *client);
+
+/**
+ * Queues a check of a key. The single keys of a filter
+ * are sent together once the client is flushed or polled.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg key The key
+ * @arg key_len The length of the key, or -1 if it is null terminated
+ * @arg cb Called with the result
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_check_async(bloomd_client *client, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg);
+
+/**
+ * Queues a set of a key, like bloomd_check_async.
+ * The result is 1 if the key was added.
+ */
+int bloomd_set_async(bloomd_client *client, const char *filter, const char *key, int key_len,
+        bloomd_key_cb cb, void *arg);
+
+/**
+ * Queues a check of many keys, sent as one multi command.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg cb Called with the results
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_check_many_async(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg);
+
+/**
+ * Queues a set of many keys, sent as one bulk command,
+ * like bloomd_check_many_async.
+ */
+int bloomd_set_many_async(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, bloomd_keys_cb cb, void *arg);
+
+/**
+ * Queues a text command, such as a create or an info.
+ * It uses the connection of the filter named by its
+ * first argument.
+ * @arg client The client
+ * @arg cmd The command, without the newline
+ * @arg cb Called with the reply
+ * @arg arg Passed to the callback
+ * @return BLOOMD_OK, or an error if the command can not be queued.
+ */
+int bloomd_command_async(bloomd_client *client, const char *cmd, bloomd_reply_cb cb, void *arg);
+
+/**
+ * Sends the queued commands, without waiting for replies.
+ * @arg client The client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if a connection failed.
+ */
+int bloomd_flush(bloomd_client *client);
+
+/**
+ * Sends the queued commands, and runs the callbacks of
+ * the replies that arrive.
+ * @arg client The client
+ * @arg timeout_msec How long to wait for a reply, 0 to only
+ * handle the replies that arrived, -1 to wait for one.
+ * @return The number of callbacks run.
+ */
+int bloomd_poll(bloomd_client *client, int timeout_msec);
+
+/**
+ * @arg client The client
+ * @return The number of commands queued or awaiting replies.
+ */
+int bloomd_pending(bloomd_client *client);
+
+/**
+ * Returns the sockets of the client, so it can be driven
+ * from an event loop. Call bloomd_poll with a timeout of 0
+ * once any is readable.
+ * @arg client The client
+ * @arg fds Output, the sockets, -1 for a closed connection
+ * @arg max_fds The size of fds
+ * @return The number of connections.
+ */
+int bloomd_client_fds(bloomd_client *client, int *fds, int max_fds);
+
+/**
+ * Checks a key, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg key The key
+ * @arg key_len The length of the key, or -1 if it is null terminated
+ * @return 1 if the key is in the filter, 0 if not, or an error.
+ */
+int bloomd_check(bloomd_client *client, const char *filter, const char *key, int key_len);
+
+/**
+ * Sets a key, waiting for the reply.
+ * @return 1 if the key was added, 0 if it was present, or an error.
+ */
+int bloomd_set(bloomd_client *client, const char *filter, const char *key, int key_len);
+
+/**
+ * Checks many keys, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_check_many(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results);
+
+/**
+ * Sets many keys, waiting for the reply.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_set_many(bloomd_client *client, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results);
+
+/**
+ * Sends a text command, waiting for the reply.
+ * @arg client The client
+ * @arg cmd The command, without the newline
+ * @arg reply Output, the reply as for bloomd_reply_cb, null
+ * terminated. Must be freed by the caller. May be NULL.
+ * @return BLOOMD_OK, or an error if the reply was one.
+ */
+int bloomd_command(bloomd_client *client, const char *cmd, char **reply);
+
+/**
+ * Creates a filter, waiting for the reply.
+ * @arg client The client
+ * @arg filter The name of the filter
+ * @arg options The create options, such as "capacity=1000000", or NULL
+ * @return BLOOMD_OK if created, 1 if it exists, or an error.
+ */
+int bloomd_create(bloomd_client *client, const char *filter, const char *options);
+
+/**
+ * Drops a filter, waiting for the reply.
+ * @return BLOOMD_OK or an error.
+ */
+int bloomd_drop(bloomd_client *client, const char *filter);
+
+/**
+ * @arg status A bloomd_status
+ * @return A description of the status
+ */
+const char *bloomd_strerror(int status);
+
+#endif
@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bloomd_shm.h"
+
+/*
+ * The layout of the rings, see shm_ring.h of the server
+ */
+#define SHM_MAGIC 0x4D485342
+#define SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t reserved;
+    char pad[48];
+} shm_header;
+
+typedef struct {
+    uint64_t head;
+    char pad1[56];
+    uint64_t tail;
+    char pad2[56];
+    uint32_t sleeping;
+    char pad3[60];
+} shm_ring_ctl;
+
+/*
+ * The binary protocol, see the README
+ */
+#define BIN_MAGIC 0xB1
+#define BIN_HEADER_LEN 8
+#define BIN_CHECK 1
+#define BIN_SET 2
+
+/*
+ * How long a sleeping client waits before checking
+ * the ring again
+ */
+#define SLEEP_MSEC 1000
+
+struct bloomd_shm {
+    int sock;               // Control socket, the session ends when it closes
+    int req_efd;            // Wakes the server while it sleeps
+    int resp_efd;           // Wakes us while we sleep
+    char *region;
+    size_t region_len;
+    shm_ring_ctl *req;
+    shm_ring_ctl *resp;
+    char *req_data;
+    char *resp_data;
+    uint64_t ring_size;
+    int spin_usec;
+    unsigned char *reply;   // A copy of the reply being parsed
+};
+
+// Static declarations
+static int shm_keys(bloomd_shm *shm, int op, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results);
+static int wait_reply(bloomd_shm *shm, uint64_t *len);
+
+/**
+ * Connects to the shm_socket of a server.
+ * @arg path The path of the socket, '@' for the abstract namespace
+ * @arg spin_usec Microseconds to poll for a reply before sleeping
+ * @arg shm Output, the client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if the server could not
+ * be reached or sent bad rings.
+ */
+int bloomd_shm_connect(const char *path, int spin_usec, bloomd_shm **shm) {
+    struct sockaddr_un addr;
+    size_t len = strlen(path);
+    if (!len || len >= sizeof(addr.sun_path)) return BLOOMD_ERR_ARGS;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') addr.sun_path[0] = '\0';
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return BLOOMD_ERR_IO;
+    if (connect(sock, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + len)) {
+        close(sock);
+        return BLOOMD_ERR_IO;
+    }
+
+    // Receive the memfd of the rings and the eventfds
+    int fds[3] = {-1, -1, -1};
+    char byte;
+    char cmsg_buf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    ssize_t res;
+    do {
+        res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (res < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = (res == 1) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(sock);
+        return BLOOMD_ERR_IO;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    bloomd_shm *s = calloc(1, sizeof(bloomd_shm));
+    if (!s) goto ERR;
+    s->sock = sock;
+    s->req_efd = fds[1];
+    s->resp_efd = fds[2];
+
+    // Spinning only delays the server on a single CPU
+    s->spin_usec = (sysconf(_SC_NPROCESSORS_ONLN) < 2) ? 0 : spin_usec;
+
+    // Map the header first, to learn the size of the rings
+    shm_header *header = mmap(NULL, sizeof(shm_header), PROT_READ, MAP_SHARED, fds[0], 0);
+    if (header == MAP_FAILED) goto ERR;
+    int valid = (header->magic == SHM_MAGIC && header->version == SHM_VERSION &&
+            header->ring_size && !(header->ring_size & (header->ring_size - 1)));
+    s->ring_size = header->ring_size;
+    munmap(header, sizeof(shm_header));
+    if (!valid) goto ERR;
+
+    s->region_len = sizeof(shm_header) + 2 * sizeof(shm_ring_ctl) + 2 * s->ring_size;
+    s->region = mmap(NULL, s->region_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (s->region == MAP_FAILED) {
+        s->region = NULL;
+        goto ERR;
+    }
+    s->req = (shm_ring_ctl*)(s->region + sizeof(shm_header));
+    s->resp = s->req + 1;
+    s->req_data = (char*)(s->resp + 1);
+    s->resp_data = s->req_data + s->ring_size;
+    s->reply = malloc(s->ring_size);
+    if (!s->reply) goto ERR;
+    close(fds[0]);
+    *shm = s;
+    return BLOOMD_OK;
+
+ERR:
+    if (s && s->region) munmap(s->region, s->region_len);
+    if (s) free(s);
+    for (int i=0; i < 3; i++) close(fds[i]);
+    close(sock);
+    return BLOOMD_ERR_IO;
+}
+
+/**
+ * Disconnects from the server.
+ * @arg shm The client
+ */
+void bloomd_shm_close(bloomd_shm *shm) {
+    munmap(shm->region, shm->region_len);
+    close(shm->req_efd);
+    close(shm->resp_efd);
+    close(shm->sock);
+    free(shm->reply);
+    free(shm);
+}
+
+/**
+ * Checks for many keys.
+ * @arg shm The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_OK, BLOOMD_ERR_ARGS if the batch does not fit
+ * in the rings, or an error.
+ */
+int bloomd_shm_check_many(bloomd_shm *shm, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results) {
+    return shm_keys(shm, BIN_CHECK, filter, keys, key_lens, num_keys, results);
+}
+
+/**
+ * Sets many keys.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_OK, BLOOMD_ERR_ARGS if the batch does not fit
+ * in the rings, or an error.
+ */
+int bloomd_shm_set_many(bloomd_shm *shm, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results) {
+    return shm_keys(shm, BIN_SET, filter, keys, key_lens, num_keys, results);
+}
+
+// Copies bytes into a ring, wrapping around its end
+static uint64_t ring_write(bloomd_shm *shm, uint64_t pos, const void *in, size_t len) {
+    size_t off = pos & (shm->ring_size - 1), first = shm->ring_size - off;
+    if (first >= len) {
+        memcpy(shm->req_data + off, in, len);
+    } else {
+        memcpy(shm->req_data + off, in, first);
+        memcpy(shm->req_data, (const char*)in + first, len - first);
+    }
+    return pos + len;
+}
+
+// Copies bytes out of a ring, wrapping around its end
+static void ring_read(bloomd_shm *shm, uint64_t pos, void *out, size_t len) {
+    size_t off = pos & (shm->ring_size - 1), first = shm->ring_size - off;
+    if (first >= len) {
+        memcpy(out, shm->resp_data + off, len);
+    } else {
+        memcpy(out, shm->resp_data + off, first);
+        memcpy((char*)out + first, shm->resp_data, len - first);
+    }
+}
+
+/**
+ * Writes a binary key command into the request ring,
+ * and waits for its reply.
+ */
+static int shm_keys(bloomd_shm *shm, int op, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results) {
+    if (num_keys < 1) return BLOOMD_ERR_ARGS;
+    size_t filter_len = strlen(filter);
+    uint64_t body_len = 4;
+    for (int i=0; i < num_keys; i++) {
+        size_t len = (key_lens) ? (size_t)key_lens[i] : strlen(keys[i]);
+        if (!len || len > UINT16_MAX) return BLOOMD_ERR_ARGS;
+        body_len += 2 + len;
+    }
+    if (!filter_len || filter_len > UINT16_MAX) return BLOOMD_ERR_ARGS;
+    if (BIN_HEADER_LEN + filter_len + body_len > shm->ring_size) return BLOOMD_ERR_ARGS;
+
+    // The previous reply was read, so the server has consumed the ring
+    uint64_t tail = shm->req->tail;
+    unsigned char header[BIN_HEADER_LEN] = {BIN_MAGIC, op,
+        filter_len >> 8, filter_len,
+        body_len >> 24, body_len >> 16, body_len >> 8, body_len};
+    tail = ring_write(shm, tail, header, BIN_HEADER_LEN);
+    tail = ring_write(shm, tail, filter, filter_len);
+    header[0] = num_keys >> 24;
+    header[1] = num_keys >> 16;
+    header[2] = num_keys >> 8;
+    header[3] = num_keys;
+    tail = ring_write(shm, tail, header, 4);
+    for (int i=0; i < num_keys; i++) {
+        size_t len = (key_lens) ? (size_t)key_lens[i] : strlen(keys[i]);
+        unsigned char klen[2] = {len >> 8, len};
+        tail = ring_write(shm, tail, klen, 2);
+        tail = ring_write(shm, tail, keys[i], len);
+    }
+    __atomic_store_n(&shm->req->tail, tail, __ATOMIC_RELEASE);
+
+    // Wake the server if it went to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->req->sleeping, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        if (write(shm->req_efd, &one, sizeof(one)) < 0 && errno != EAGAIN) return BLOOMD_ERR_IO;
+    }
+
+    uint64_t len;
+    int res = wait_reply(shm, &len);
+    if (res) return res;
+
+    // Parse the reply, the statuses of the binary protocol in order
+    static const int STATUSES[] = {BLOOMD_OK, BLOOMD_ERR_NO_FILTER, BLOOMD_ERR_ARGS, BLOOMD_ERR_ARGS,
+        BLOOMD_ERR_INTERNAL, BLOOMD_ERR_FROZEN, BLOOMD_ERR_READ_ONLY, BLOOMD_ERR_MOVED,
+        BLOOMD_ERR_OVER_QUOTA, BLOOMD_ERR_LOADING, BLOOMD_ERR_BUSY};
+    const unsigned char *msg = shm->reply;
+    if (msg[1] >= sizeof(STATUSES) / sizeof(STATUSES[0])) return BLOOMD_ERR_PROTOCOL;
+    if (msg[1]) return STATUSES[msg[1]];
+    const unsigned char *body = msg + BIN_HEADER_LEN;
+    if (len < BIN_HEADER_LEN + 4) return BLOOMD_ERR_PROTOCOL;
+    uint32_t num = ((uint32_t)body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3];
+    if (num != (uint32_t)num_keys || len < BIN_HEADER_LEN + 4 + (num + 7) / 8) return BLOOMD_ERR_PROTOCOL;
+    for (uint32_t i=0; i < num; i++) {
+        results[i] = (body[4 + i / 8] >> (i % 8)) & 1;
+    }
+    return BLOOMD_OK;
+}
+
+// Returns the monotonic time in microseconds
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Waits for the next reply in the response ring, spinning
+ * first and then sleeping on the eventfd, and copies it out.
+ * @arg len Output, the length of the reply
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if the server went away.
+ */
+static int wait_reply(bloomd_shm *shm, uint64_t *len) {
+    uint64_t head = shm->resp->head;
+    uint64_t start = 0;
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&shm->resp->tail, __ATOMIC_ACQUIRE);
+        if (tail != head) {
+            // The server writes whole replies
+            unsigned char header[BIN_HEADER_LEN];
+            ring_read(shm, head, header, BIN_HEADER_LEN);
+            uint32_t body_len = ((uint32_t)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+            *len = BIN_HEADER_LEN + (uint64_t)body_len;
+            if (header[0] != BIN_MAGIC || *len > tail - head) return BLOOMD_ERR_PROTOCOL;
+            ring_read(shm, head, shm->reply, *len);
+            __atomic_store_n(&shm->resp->head, head + *len, __ATOMIC_RELEASE);
+            return BLOOMD_OK;
+        }
+
+        uint64_t now = now_usec();
+        if (!start) start = now;
+        if (now - start < (uint64_t)shm->spin_usec) continue;
+
+        // Ask to be woken, then check once more before sleeping
+        __atomic_store_n(&shm->resp->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shm->resp->tail, __ATOMIC_SEQ_CST) == head) {
+            struct pollfd fds[2] = {{shm->resp_efd, POLLIN, 0}, {shm->sock, POLLIN, 0}};
+            int res = poll(fds, 2, SLEEP_MSEC);
+            if (res < 0 && errno != EINTR) return BLOOMD_ERR_IO;
+            if (res > 0 && fds[1].revents) {
+                __atomic_store_n(&shm->resp->sleeping, 0, __ATOMIC_RELAXED);
+                return BLOOMD_ERR_IO;
+            }
+            uint64_t count;
+            if (res > 0 && read(shm->resp_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                return BLOOMD_ERR_IO;
+            }
+        }
+        __atomic_store_n(&shm->resp->sleeping, 0, __ATOMIC_RELAXED);
+        start = 0;
+    }
+}
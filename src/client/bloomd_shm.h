@@ -0,0 +1,60 @@
+#ifndef BLOOMD_SHM_H
+#define BLOOMD_SHM_H
+
+/*
+ * A shared memory client for a bloomd on the same host. The
+ * client connects to the shm_socket of the server, which sends
+ * it a pair of rings in shared memory. Key batches are written
+ * to the request ring in the binary protocol, and the replies
+ * read from the response ring, so no system calls are made while
+ * the server keeps up. The client spins on an empty response ring
+ * for spin_usec, then sleeps until the server wakes it.
+ *
+ * The calls block until their reply is read. A client must only
+ * be used by one thread at a time, and a batch must fit in the
+ * rings, whose size is the shm_ring_kb of the server.
+ */
+#include "bloomd_client.h"
+
+typedef struct bloomd_shm bloomd_shm;
+
+/**
+ * Connects to the shm_socket of a server.
+ * @arg path The path of the socket, '@' for the abstract namespace
+ * @arg spin_usec Microseconds to poll for a reply before sleeping
+ * @arg shm Output, the client
+ * @return BLOOMD_OK, or BLOOMD_ERR_IO if the server could not
+ * be reached or sent bad rings.
+ */
+int bloomd_shm_connect(const char *path, int spin_usec, bloomd_shm **shm);
+
+/**
+ * Disconnects from the server.
+ * @arg shm The client
+ */
+void bloomd_shm_close(bloomd_shm *shm);
+
+/**
+ * Checks for many keys.
+ * @arg shm The client
+ * @arg filter The name of the filter
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL if they are null terminated
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_OK, BLOOMD_ERR_ARGS if the batch does not fit
+ * in the rings, or an error.
+ */
+int bloomd_shm_check_many(bloomd_shm *shm, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results);
+
+/**
+ * Sets many keys.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_OK, BLOOMD_ERR_ARGS if the batch does not fit
+ * in the rings, or an error.
+ */
+int bloomd_shm_set_many(bloomd_shm *shm, const char *filter, const char *const *keys,
+        const int *key_lens, int num_keys, char *results);
+
+#endif
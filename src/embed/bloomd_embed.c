@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "bloomd_embed.h"
+#include "config.h"
+#include "filter_manager.h"
+#include "background.h"
+#include "latency.h"
+#include "numa.h"
+
+/*
+ * The background threads of an embedded instance, besides
+ * the scheduled jobs. These are the threads of the server
+ * that do not need the networking.
+ */
+#define EMBED_THREADS 2
+
+struct bloomd_embed {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int should_run;                 // Set to 0 to stop the threads
+    int jobs_on;
+    bloom_background *jobs;         // The periodic background jobs
+    int thread_on[EMBED_THREADS];
+    pthread_t threads[EMBED_THREADS];
+};
+
+/*
+ * Each call is made as a client of the filter manager,
+ * and goes offline when done, so an idle caller never
+ * holds back the vacuum.
+ */
+#define EMBED_ENTER(db) filtmgr_client_checkpoint((db)->mgr)
+#define EMBED_LEAVE(db) filtmgr_client_offline((db)->mgr)
+
+/**
+ * Opens the filters of a data directory, and starts
+ * the background threads.
+ * @arg config_file A bloomd configuration file, or NULL for the defaults
+ * @arg data_dir Overrides the data_dir of the configuration, or NULL
+ * @arg db Output, the embedded instance
+ * @return BLOOMD_EMBED_OK, BLOOMD_EMBED_ARGS if the configuration
+ * is invalid, or BLOOMD_EMBED_INTERNAL.
+ */
+int bloomd_embed_open(const char *config_file, const char *data_dir, bloomd_embed **db) {
+    bloomd_embed *e = calloc(1, sizeof(bloomd_embed));
+    if (!e) return BLOOMD_EMBED_INTERNAL;
+    e->config = calloc(1, sizeof(bloom_config));
+    if (!e->config) {
+        free(e);
+        return BLOOMD_EMBED_INTERNAL;
+    }
+
+    // Read and validate the configuration, as the server does
+    if (config_from_filename((char*)config_file, e->config)) {
+        syslog(LOG_ERR, "Failed to read the configuration file!");
+        goto BAD_CONFIG;
+    }
+    if (data_dir) e->config->data_dir = strdup(data_dir);
+    if (validate_config(e->config)) {
+        syslog(LOG_ERR, "Invalid configuration!");
+        goto BAD_CONFIG;
+    }
+    latency_init(e->config->latency_sample);
+    if (e->config->use_numa) numa_topology_init();
+
+    if (init_filter_manager(e->config, 1, &e->mgr)) {
+        syslog(LOG_ERR, "Failed to initialize bloomd filter manager!");
+        free(e->config);
+        free(e);
+        return BLOOMD_EMBED_INTERNAL;
+    }
+
+    // Start the background tasks
+    e->should_run = 1;
+    e->jobs_on = start_background_jobs(e->config, e->mgr, &e->should_run, &e->jobs);
+    e->thread_on[0] = start_set_log_thread(e->config, e->mgr, &e->should_run, e->threads);
+    e->thread_on[1] = start_fault_thread(e->config, e->mgr, &e->should_run, e->threads + 1);
+
+    *db = e;
+    return BLOOMD_EMBED_OK;
+
+BAD_CONFIG:
+    free(e->config);
+    free(e);
+    return BLOOMD_EMBED_ARGS;
+}
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters. No other calls may be in progress.
+ * @arg db The embedded instance
+ */
+void bloomd_embed_close(bloomd_embed *db) {
+    db->should_run = 0;
+    if (db->jobs_on) stop_background_jobs(db->jobs);
+    for (int i=0; i < EMBED_THREADS; i++) {
+        if (db->thread_on[i]) pthread_join(db->threads[i], NULL);
+    }
+    filtmgr_client_leave(db->mgr);
+    destroy_filter_manager(db->mgr);
+    free(db->config);
+    free(db);
+}
+
+/**
+ * Creates a filter.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg opts The settings of the filter, or NULL for the defaults
+ * @return BLOOMD_EMBED_OK, BLOOMD_EMBED_EXISTS,
+ * BLOOMD_EMBED_DELETE_PENDING or an error.
+ */
+int bloomd_embed_create(bloomd_embed *db, const char *filter, const bloomd_embed_filter_options *opts) {
+    // The filter keeps its config once created
+    bloom_config *config = NULL;
+    if (opts) {
+        config = malloc(sizeof(bloom_config));
+        if (!config) return BLOOMD_EMBED_INTERNAL;
+        memcpy(config, db->config, sizeof(bloom_config));
+        if (opts->capacity) config->initial_capacity = opts->capacity;
+        if (opts->probability) config->default_probability = opts->probability;
+        if (opts->in_memory) config->in_memory = 1;
+        if (sane_initial_capacity(config->initial_capacity) ||
+                sane_default_probability(config->default_probability)) {
+            free(config);
+            return BLOOMD_EMBED_ARGS;
+        }
+    }
+
+    EMBED_ENTER(db);
+    int res = filtmgr_create_filter(db->mgr, (char*)filter, config);
+    EMBED_LEAVE(db);
+    switch (res) {
+        case 0:
+            return BLOOMD_EMBED_OK;
+        case -1:
+            res = BLOOMD_EMBED_EXISTS;
+            break;
+        case -3:
+            res = BLOOMD_EMBED_DELETE_PENDING;
+            break;
+        default:
+            res = BLOOMD_EMBED_INTERNAL;
+            break;
+    }
+    free(config);
+    return res;
+}
+
+/**
+ * Drops a filter, deleting its files.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @return BLOOMD_EMBED_OK or BLOOMD_EMBED_NO_FILTER.
+ */
+int bloomd_embed_drop(bloomd_embed *db, const char *filter) {
+    EMBED_ENTER(db);
+    int res = filtmgr_drop_filter(db->mgr, (char*)filter);
+    EMBED_LEAVE(db);
+    return (res) ? BLOOMD_EMBED_NO_FILTER : BLOOMD_EMBED_OK;
+}
+
+/**
+ * Maps the result of a key command of the filter manager.
+ */
+static int key_status(int res) {
+    switch (res) {
+        case 0: return BLOOMD_EMBED_OK;
+        case -1: return BLOOMD_EMBED_NO_FILTER;
+        case -4: return BLOOMD_EMBED_FROZEN;
+        case -5: return BLOOMD_EMBED_OVER_QUOTA;
+        case -6: return BLOOMD_EMBED_LOADING;
+        default: return BLOOMD_EMBED_INTERNAL;
+    }
+}
+
+/**
+ * Checks for a key.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg key The null terminated key
+ * @return 1 if the key is in the filter, 0 if not, or an error.
+ */
+int bloomd_embed_check(bloomd_embed *db, const char *filter, const char *key) {
+    char result = 0;
+    int res = bloomd_embed_check_many(db, filter, &key, 1, &result);
+    return (res) ? res : result;
+}
+
+/**
+ * Sets a key.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg key The null terminated key
+ * @return 1 if the key was added, 0 if it was present, or an error.
+ */
+int bloomd_embed_set(bloomd_embed *db, const char *filter, const char *key) {
+    char result = 0;
+    int res = bloomd_embed_set_many(db, filter, &key, 1, &result);
+    return (res) ? res : result;
+}
+
+/**
+ * Checks for many keys.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg keys The null terminated keys
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_EMBED_OK or an error.
+ */
+int bloomd_embed_check_many(bloomd_embed *db, const char *filter, const char *const *keys,
+        int num_keys, char *results) {
+    if (num_keys < 1) return BLOOMD_EMBED_ARGS;
+    EMBED_ENTER(db);
+    int res = filtmgr_check_keys(db->mgr, (char*)filter, (char**)keys, num_keys, results);
+    EMBED_LEAVE(db);
+    return key_status(res);
+}
+
+/**
+ * Sets many keys.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_EMBED_OK or an error.
+ */
+int bloomd_embed_set_many(bloomd_embed *db, const char *filter, const char *const *keys,
+        int num_keys, char *results) {
+    if (num_keys < 1) return BLOOMD_EMBED_ARGS;
+    EMBED_ENTER(db);
+    int res = filtmgr_set_keys(db->mgr, (char*)filter, (char**)keys, num_keys, results);
+    EMBED_LEAVE(db);
+    return key_status(res);
+}
+
+/**
+ * Flushes a filter to disk now, rather than on the
+ * next flush interval.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @return BLOOMD_EMBED_OK or BLOOMD_EMBED_NO_FILTER.
+ */
+int bloomd_embed_flush(bloomd_embed *db, const char *filter) {
+    EMBED_ENTER(db);
+    int res = filtmgr_flush_filter(db->mgr, (char*)filter);
+    EMBED_LEAVE(db);
+    return (res) ? BLOOMD_EMBED_NO_FILTER : BLOOMD_EMBED_OK;
+}
@@ -0,0 +1,129 @@
+#ifndef BLOOMD_EMBED_H
+#define BLOOMD_EMBED_H
+
+/*
+ * Runs bloomd inside another process. The filters are kept in a
+ * filter manager of their own, with the same files, settings and
+ * background flush, cold unmap and vacuum threads as the server,
+ * but without the networking, so the calls are plain function
+ * calls. One data directory must only be used by one server or
+ * embedded instance at a time.
+ *
+ * The calls may be made from any number of threads. A thread is
+ * only known to the filter manager during a call, so threads that
+ * stop calling never hold back the vacuum.
+ */
+#include <stdint.h>
+
+/**
+ * The statuses of the calls. Key calls report 1 or 0
+ * for a single key, and 0 for many keys on success.
+ */
+typedef enum {
+    BLOOMD_EMBED_OK = 0,
+    BLOOMD_EMBED_NO_FILTER = -1,        // The filter does not exist
+    BLOOMD_EMBED_INTERNAL = -2,         // Internal error, see the syslog
+    BLOOMD_EMBED_EXISTS = -3,           // Creating a filter that exists
+    BLOOMD_EMBED_DELETE_PENDING = -4,   // Creating a filter that is still being dropped
+    BLOOMD_EMBED_FROZEN = -5,           // Setting keys in a frozen filter
+    BLOOMD_EMBED_OVER_QUOTA = -6,       // The filter would grow over its quota
+    BLOOMD_EMBED_LOADING = -7,          // The filter is being faulted in, retry later
+    BLOOMD_EMBED_ARGS = -8              // Bad arguments or configuration
+} bloomd_embed_status;
+
+/**
+ * Settings of a new filter. Fields left at 0
+ * use the defaults of the configuration.
+ */
+typedef struct {
+    uint64_t capacity;      // Initial capacity of the filter
+    double probability;     // False positive probability
+    int in_memory;          // 1 to never write the filter to disk
+} bloomd_embed_filter_options;
+
+typedef struct bloomd_embed bloomd_embed;
+
+/**
+ * Opens the filters of a data directory, and starts
+ * the background threads.
+ * @arg config_file A bloomd configuration file, or NULL for the defaults
+ * @arg data_dir Overrides the data_dir of the configuration, or NULL
+ * @arg db Output, the embedded instance
+ * @return BLOOMD_EMBED_OK, BLOOMD_EMBED_ARGS if the configuration
+ * is invalid, or BLOOMD_EMBED_INTERNAL.
+ */
+int bloomd_embed_open(const char *config_file, const char *data_dir, bloomd_embed **db);
+
+/**
+ * Stops the background threads, flushes and closes the
+ * filters. No other calls may be in progress.
+ * @arg db The embedded instance
+ */
+void bloomd_embed_close(bloomd_embed *db);
+
+/**
+ * Creates a filter.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg opts The settings of the filter, or NULL for the defaults
+ * @return BLOOMD_EMBED_OK, BLOOMD_EMBED_EXISTS,
+ * BLOOMD_EMBED_DELETE_PENDING or an error.
+ */
+int bloomd_embed_create(bloomd_embed *db, const char *filter, const bloomd_embed_filter_options *opts);
+
+/**
+ * Drops a filter, deleting its files.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @return BLOOMD_EMBED_OK or BLOOMD_EMBED_NO_FILTER.
+ */
+int bloomd_embed_drop(bloomd_embed *db, const char *filter);
+
+/**
+ * Checks for a key.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg key The null terminated key
+ * @return 1 if the key is in the filter, 0 if not, or an error.
+ */
+int bloomd_embed_check(bloomd_embed *db, const char *filter, const char *key);
+
+/**
+ * Sets a key.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg key The null terminated key
+ * @return 1 if the key was added, 0 if it was present, or an error.
+ */
+int bloomd_embed_set(bloomd_embed *db, const char *filter, const char *key);
+
+/**
+ * Checks for many keys.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @arg keys The null terminated keys
+ * @arg num_keys The number of keys
+ * @arg results Output, 1 for each key in the filter and 0 otherwise
+ * @return BLOOMD_EMBED_OK or an error.
+ */
+int bloomd_embed_check_many(bloomd_embed *db, const char *filter, const char *const *keys,
+        int num_keys, char *results);
+
+/**
+ * Sets many keys.
+ * @arg results Output, 1 for each key that was added and 0 otherwise
+ * @return BLOOMD_EMBED_OK or an error.
+ */
+int bloomd_embed_set_many(bloomd_embed *db, const char *filter, const char *const *keys,
+        int num_keys, char *results);
+
+/**
+ * Flushes a filter to disk now, rather than on the
+ * next flush interval.
+ * @arg db The embedded instance
+ * @arg filter The name of the filter
+ * @return BLOOMD_EMBED_OK or BLOOMD_EMBED_NO_FILTER.
+ */
+int bloomd_embed_flush(bloomd_embed *db, const char *filter);
+
+#endif
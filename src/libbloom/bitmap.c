@@ -4,19 +4,110 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
 #include <strings.h>
 #include <errno.h>
 #include <syslog.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include "bitmap.h"
+#include "crc.h"
+#include "probes.h"
+
+/*
+ * The memory policies used with mbind(), from numaif.h,
+ * which is only installed with libnuma.
+ */
+#define BITMAP_MPOL_PREFERRED 1
+#define BITMAP_MPOL_INTERLEAVE 3
+#define BITMAP_MPOL_MF_MOVE (1 << 1)
+
+/**
+ * Runs of dirty pages that are separated by at most
+ * this many clean pages are written out together, since
+ * rewriting a few clean pages is cheaper than a system call.
+ */
+#define FLUSH_MERGE_GAP 4
+
+/**
+ * Existing PERSISTENT bitmaps are read in chunks of this
+ * size, prefetching the following chunk each time.
+ */
+#define FILL_CHUNK_SIZE (4 * 1024 * 1024)
+
+/**
+ * The pages bitmap_resident asks mincore about at once.
+ */
+#define RESIDENT_CHUNK_PAGES 4096
+
+/**
+ * The flags of a bitmap_mode, which are cleared to get the mode
+ */
+#define MODE_FLAGS (NEW_BITMAP | HUGEPAGES | READ_ONLY | DIRECT_IO | POPULATE | NO_READAHEAD | CHECKSUMS)
+
+/**
+ * The header of a checksum file, followed by the CRC32C
+ * of each page. The inode ties the checksums to the file of
+ * the bitmap, so a file replaced under the same name does not
+ * inherit the checksums of the old one.
+ */
+#define CRC_FILE_MAGIC 0x43524342       // "BCRC"
+#define CRC_FILE_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t inode;         // Inode of the file of the bitmap
+    uint64_t size;          // Size of the bitmap
+    char pad[40];
+} crc_file_header;
+
+/*
+ * Faults in a range of a mapping synchronously, from
+ * Linux 5.14. MADV_WILLNEED is used on older kernels.
+ */
+#if defined(__linux__) && !defined(MADV_POPULATE_READ)
+#define MADV_POPULATE_READ 22
+#endif
+
+/*
+ * Deactivates or reclaims a range of a mapping, from
+ * Linux 5.4. Older kernels refuse them with EINVAL.
+ */
+#if defined(__linux__) && !defined(MADV_COLD)
+#define MADV_COLD 20
+#endif
+#if defined(__linux__) && !defined(MADV_PAGEOUT)
+#define MADV_PAGEOUT 21
+#endif
 
 /* Static declarations */
+static int map_file(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, unsigned char *hint, bloom_bitmap *map);
 static void* alloc_dirty_page_bitmap(uint64_t len);
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
-static int flush_dirty_pages(bloom_bitmap *map);
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int fill_buffer(int fileno, uint64_t base, unsigned char* buf, uint64_t len);
+static int fill_range(int fileno, uint64_t base, unsigned char* buf, uint64_t start, uint64_t end);
+static int next_data_range(int fileno, uint64_t base, uint64_t offset, uint64_t len, uint64_t *start, uint64_t *end);
+static int page_is_zero(const unsigned char *buf, uint64_t len);
+static int punch_pages(int fileno, uint64_t offset, uint64_t end);
+static int advise_clean_range(bloom_bitmap *map, uint64_t start, uint64_t end, int advice, uint64_t *hinted);
+static int flush_dirty_pages(bloom_bitmap *map, unsigned char *dirty_pages, int fileno, int sync);
+static int flush_pages(bloom_bitmap *map, int fileno, uint64_t start_page, uint64_t end_page, int sync);
+static void redirty_pages(bloom_bitmap *map, uint64_t start_page, uint64_t end_page);
+static unsigned char* mmap_hugepages(uint64_t len, int flags, uint64_t *mapped_len);
+static int open_direct(int fileno);
+static void open_checksums(char *filename, int fileno, int new_bitmap, bloom_bitmap *map);
+static uint32_t page_crc(bloom_bitmap *map, uint64_t page);
+static void update_checksums(bloom_bitmap *map, uint64_t start_page, uint64_t end_page);
+static int sync_checksums(bloom_bitmap *map, int sync);
+static void close_checksums(bloom_bitmap *map);
+static int page_is_dirty(bloom_bitmap *map, uint64_t page);
+static uint64_t write_direct(bloom_bitmap *map, uint64_t offset, uint64_t end);
+typedef uint64_t(*popcount_fn)(const unsigned char *buf, uint64_t len);
+static uint64_t popcount_resolve(const unsigned char *buf, uint64_t len);
+static uint64_t popcount_scalar(const unsigned char *buf, uint64_t len);
+static popcount_fn popcount_impl = popcount_resolve;
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_dirtybit(bloom_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
 
 /**
@@ -29,55 +120,144 @@ extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
  * @return 0 on success. Negative on error.
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *map) {
+    // Only file backed bitmaps keep a handle, which is dup'ed
+    int direct = (mode & DIRECT_IO) ? 1 : 0;
+    bitmap_mode base_mode = mode & ~MODE_FLAGS;
+    int newfileno = -1;
+    if (base_mode == SHARED || base_mode == PERSISTENT) {
+        newfileno = dup(fileno);
+        if (newfileno < 0) return -errno;
+    }
+
+    int res = map_file(newfileno, 0, len, mode, NULL, map);
+    if (res) {
+        if (newfileno >= 0) close(newfileno);
+        return res;
+    }
+    map->direct_fd = (direct && map->mode == PERSISTENT) ? open_direct(newfileno) : -1;
+    return 0;
+}
+
+/**
+ * Returns a bloom_bitmap of a range of a file holding several
+ * bitmaps. The file handle is not dup'ed, but shared by the
+ * bitmaps of the file, and closed with the last of them.
+ * DIRECT_IO is ignored, since the range is not written alone.
+ * @arg fileno The fileno. Owned by the bitmaps once one is made.
+ * @arg neighbor Optional, a bitmap of the same file. The handle is
+ * shared with it, and the new bitmap is mapped as far from it
+ * in memory as it is in the file, if that address is free, so
+ * the kernel can merge the mappings into one region.
+ * If NULL, this is the first bitmap of the file.
+ * @arg offset The start of the range, aligned to the page size
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap, SHARED or PERSISTENT
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_file_at(int fileno, bloom_bitmap *neighbor, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map) {
+    bitmap_mode base_mode = mode & ~MODE_FLAGS;
+    if (base_mode != SHARED && base_mode != PERSISTENT) return -EINVAL;
+    if (offset % sysconf(_SC_PAGESIZE)) return -EINVAL;
+    if (neighbor && (!neighbor->file_refs || neighbor->fileno != fileno)) return -EINVAL;
+
+    int *refs = (neighbor) ? neighbor->file_refs : calloc(1, sizeof(int));
+    if (!refs) return -ENOMEM;
+
+    // The hint is only taken if the range is free. The offset
+    // may be before the neighbor, and the sum wraps around.
+    unsigned char *hint = NULL;
+    if (neighbor) {
+        hint = (unsigned char*)((uintptr_t)neighbor->mmap + (uintptr_t)(offset - neighbor->offset));
+    }
+    int res = map_file(fileno, offset, len, mode & ~DIRECT_IO, hint, map);
+    if (res) {
+        if (!neighbor) free(refs);
+        return res;
+    }
+    __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+    map->file_refs = refs;
+    return 0;
+}
+
+/**
+ * Maps a bitmap. The file handle is kept by the bitmap
+ * on success, but is not closed on failure.
+ * @arg fileno The file backing, or -1 for ANONYMOUS
+ * @arg offset The start of the bitmap in the file
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap.
+ * @arg hint Optional, the address to prefer for the mapping
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+static int map_file(int fileno, uint64_t offset, uint64_t len, bitmap_mode mode, unsigned char *hint, bloom_bitmap *map) {
     // Hack for old kernels and bad length checking
     if (len == 0) {
         return -EINVAL;
     }
 
-    // Check for and clear NEW_BITMAP from the mode
+    // Check for and clear the flags from the mode
     int new_bitmap = (mode & NEW_BITMAP) ? 1 : 0;
-    mode &= ~NEW_BITMAP;
+    int hugepages = (mode & HUGEPAGES) ? 1 : 0;
+    int read_only = (mode & READ_ONLY) ? 1 : 0;
+    int readahead = (mode & NO_READAHEAD) ? 0 : 1;
+    int advice = MADV_WILLNEED;
+#ifdef MADV_POPULATE_READ
+    if (mode & POPULATE) advice = MADV_POPULATE_READ;
+#endif
+    mode &= ~MODE_FLAGS;
+
+    // Only the file itself can be shared read-only
+    if (read_only && mode != SHARED) return -EINVAL;
 
     // Handle each mode
     int flags;
-    int newfileno;
     if (mode == SHARED) {
         flags = MAP_SHARED;
-        newfileno = dup(fileno);
-        if (newfileno < 0) return -errno;
-
-    } else if (mode == PERSISTENT) {
+    } else if (mode == PERSISTENT || mode == ANONYMOUS) {
         flags = MAP_ANON | MAP_PRIVATE;
-        newfileno = dup(fileno);
-        if (newfileno < 0) return -errno;
-
-    } else if (mode == ANONYMOUS) {
-        flags = MAP_ANON | MAP_PRIVATE;
-        newfileno = -1;
-
     } else {
         return -1;
     }
 
-    // Perform the map in
-    unsigned char* addr = mmap(NULL, len, PROT_READ|PROT_WRITE,
-            flags, ((mode == PERSISTENT) ? -1 : newfileno), 0);
+    // Perform the map in. Only anonymous memory can use hugepages,
+    // since the SHARED mode maps the file itself.
+    uint64_t mapped_len = len;
+    unsigned char* addr = MAP_FAILED;
+    if (hugepages && mode != SHARED) {
+        addr = mmap_hugepages(len, flags, &mapped_len);
+    }
+    if (addr == MAP_FAILED) {
+        addr = mmap(hint, len, (read_only) ? PROT_READ : PROT_READ|PROT_WRITE,
+                flags, ((mode == SHARED) ? fileno : -1), (mode == SHARED) ? offset : 0);
+    }
 
     // Check for an error, otherwise return
     if (addr == MAP_FAILED) {
         perror("mmap failed!");
-        if (newfileno >= 0) {
-            close(newfileno);
-        }
         return -errno;
     }
 
-    // Provide some advise on how the memory will be used
+    // Provide some advise on how the memory will be used. Only
+    // the data of the file is read ahead, since reading the holes
+    // of a sparse layer would fill the page cache with zeros.
+    // Populating waits for the reads, so the first lookups do not
+    // take the faults, and falls back to reading ahead.
     int res;
     if (mode == SHARED) {
-        res = madvise(addr, len, MADV_WILLNEED);
-        if (res != 0) {
-            perror("Failed to call madvise() [MADV_WILLNEED]");
+        uint64_t start, end, pos = 0;
+        while (!new_bitmap && readahead && !next_data_range(fileno, offset, pos, len, &start, &end)) {
+            uint64_t aligned = start - start % sysconf(_SC_PAGESIZE);
+            res = madvise(addr + aligned, end - aligned, advice);
+            if (res != 0 && advice != MADV_WILLNEED) {
+                advice = MADV_WILLNEED;
+                continue;
+            } else if (res != 0) {
+                perror("Failed to call madvise() [MADV_WILLNEED]");
+                break;
+            }
+            pos = end;
         }
         res = madvise(addr, len, MADV_RANDOM);
         if (res != 0) {
@@ -85,37 +265,96 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
         }
     }
 
-    // For the PERSISTENT case, we manually track
-    // dirty pages, and need a bit field for this
+    // For the file backed cases, we manually track
+    // dirty pages, and need a bit field for this.
+    // SHARED uses it to limit the msync to dirty ranges.
+    // Read-only maps are never dirty, and have no field.
     unsigned char* dirty = NULL;
-    if (mode == PERSISTENT) {
+    if (mode == PERSISTENT || (mode == SHARED && !read_only)) {
         // Allocate a dirty bitmap
         dirty = alloc_dirty_page_bitmap(len);
         if (!dirty) {
-            munmap(addr, len);
-            if (newfileno >= 0) close(newfileno);
+            munmap(addr, mapped_len);
             return -errno;
         }
 
         // For existing bitmaps we need to read in the data
         // since we cannot use the kernel to fault it in
-        if (!new_bitmap && (res = fill_buffer(newfileno, addr, len))) {
+        if (mode == PERSISTENT && !new_bitmap && (res = fill_buffer(fileno, offset, addr, len))) {
             free(dirty);
-            munmap(addr, len);
-            if (newfileno >= 0) close(newfileno);
+            munmap(addr, mapped_len);
             return res;
         }
     }
 
     // Allocate space for the map
     map->mode = mode;
-    map->fileno = newfileno;
+    map->fileno = fileno;
     map->size = len;
     map->mmap = addr;
     map->dirty_pages = dirty;
+    map->mapped_size = mapped_len;
+    map->snap_pages = NULL;
+    map->direct_fd = -1;
+    map->offset = offset;
+    map->file_refs = NULL;
+    map->sealed = 0;
+    map->crcs = NULL;
+    map->crcs_size = 0;
+    map->page_gens = NULL;
+    map->gen_clock = NULL;
+    map->gen_start = 0;
     return 0;
 }
 
+/**
+ * Opens a second descriptor of a file with O_DIRECT. It can not
+ * be a dup, since the flag would be shared with the caller.
+ * @return The descriptor, or -1 if direct I/O is unsupported,
+ * in which case the page cache is used.
+ */
+static int open_direct(int fileno) {
+#if defined(O_DIRECT) && defined(__linux__)
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno);
+    return open(path, O_WRONLY | O_DIRECT);
+#else
+    (void)fileno;
+    return -1;
+#endif
+}
+
+/**
+ * Maps anonymous memory backed by hugepages. We first try
+ * for explicit hugepages, which must be reserved by the
+ * administrator, and otherwise fall back to a normal mapping
+ * that is advised to use transparent hugepages.
+ * @arg len The length of the mapping
+ * @arg flags The mmap flags
+ * @arg mapped_len Output, the actual length mapped
+ * @return The address, or MAP_FAILED.
+ */
+static unsigned char* mmap_hugepages(uint64_t len, int flags, uint64_t *mapped_len) {
+    unsigned char* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Explicit hugepages need the length to be a whole number of pages
+    uint64_t huge_len = len + (BITMAP_HUGEPAGE_SIZE - len % BITMAP_HUGEPAGE_SIZE) % BITMAP_HUGEPAGE_SIZE;
+    addr = mmap(NULL, huge_len, PROT_READ|PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+        *mapped_len = huge_len;
+        return addr;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    addr = mmap(NULL, len, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (addr != MAP_FAILED && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+        syslog(LOG_INFO, "Transparent hugepages are not available. Using normal pages.");
+    }
+#endif
+    *mapped_len = len;
+    return addr;
+}
+
 // Allocates a new dirty page bitmap
 static void* alloc_dirty_page_bitmap(uint64_t len) {
     // Calculate how big a bit field we need
@@ -136,20 +375,81 @@ static void* alloc_dirty_page_bitmap(uint64_t len) {
 
 
 /*
- * Populates a buffer with the contents of a file
- */
-static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
-    uint64_t total_read = 0;
-    ssize_t more;
-    while (total_read < len) {
-        more = pread(fileno, buf+total_read, len-total_read, total_read);
-        if (more == 0)
-            break;
-        else if (more < 0 && errno != EINTR) {
-            perror("Failed to fill the bitmap buffer!");
-            return -errno;
-        } else
-            total_read += more;
+ * Populates a buffer with the contents of a file, from
+ * the base offset. Holes in sparse files are skipped, so
+ * the pages of the buffer they cover are never touched.
+ */
+static int fill_buffer(int fileno, uint64_t base, unsigned char* buf, uint64_t len) {
+    posix_fadvise(fileno, base, len, POSIX_FADV_SEQUENTIAL);
+
+    // Skip over holes, since the buffer is already zero
+    int res = 0;
+    uint64_t start, end, offset = 0;
+    while (!res && !next_data_range(fileno, base, offset, len, &start, &end)) {
+        res = fill_range(fileno, base, buf, start, end);
+        offset = end;
+    }
+
+    // We keep a private copy, so the cached pages of the
+    // file are only taking memory from other filters
+    posix_fadvise(fileno, base, len, POSIX_FADV_DONTNEED);
+    return res;
+}
+
+/**
+ * Finds the next range of a file that holds data, so the
+ * holes of sparse files can be skipped. Files that can not
+ * be searched for holes are treated as all data.
+ * @arg base The start of the bitmap in the file. The
+ * other positions are relative to it.
+ * @arg offset The position to search from
+ * @arg len The length of the bitmap
+ * @arg start Output, the start of the data
+ * @arg end Output, the end of the data
+ * @return 0 if data was found, 1 if there is no more.
+ */
+static int next_data_range(int fileno, uint64_t base, uint64_t offset, uint64_t len, uint64_t *start, uint64_t *end) {
+    if (offset >= len) return 1;
+    *start = offset;
+    *end = len;
+    off_t data = lseek(fileno, base + offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) return 1;
+    if (data >= 0) {
+        *start = data - base;
+        off_t hole = lseek(fileno, data, SEEK_HOLE);
+        if (hole > data && (uint64_t)hole - base < len) *end = hole - base;
+    }
+    return (*start >= len) ? 1 : 0;
+}
+
+/**
+ * Reads a range of a file into the buffer in chunks. The
+ * next chunk is prefetched while the current one is copied
+ * in, so the disk stays busy while we read.
+ * @return 0 on success, negative errno on error.
+ */
+static int fill_range(int fileno, uint64_t base, unsigned char* buf, uint64_t start, uint64_t end) {
+    uint64_t pos = start;
+    while (pos < end) {
+        uint64_t chunk_end = pos + FILL_CHUNK_SIZE;
+        if (chunk_end > end) chunk_end = end;
+        if (chunk_end < end) {
+            posix_fadvise(fileno, base + chunk_end, FILL_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+        }
+
+        uint64_t total_read = pos;
+        ssize_t more;
+        while (total_read < chunk_end) {
+            more = pread(fileno, buf+total_read, chunk_end-total_read, base + total_read);
+            if (more == 0)
+                return 0;
+            else if (more < 0 && errno != EINTR) {
+                perror("Failed to fill the bitmap buffer!");
+                return -errno;
+            } else if (more > 0)
+                total_read += more;
+        }
+        pos = chunk_end;
     }
     return 0;
 }
@@ -157,8 +457,15 @@ static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
 
 /**
  * Returns a bloom_bitmap pointer from a filename.
- * Opens the file with read/write privileges. If create
+ * Opens the file with read/write privileges, or only read
+ * privileges for READ_ONLY bitmaps. If create
  * is true, then a file will be created if it does not exist.
+ * New files are sparse, so pages only take disk space and
+ * memory once bits are set in them.
+ * With CHECKSUMS, the checksums of the pages are kept in the
+ * file with BITMAP_CHECKSUM_SUFFIX appended. They are reset when
+ * that file was of another file of the same name, and are not
+ * kept for READ_ONLY bitmaps, whose writer keeps them.
  * If the file cannot be opened, NULL will be returned.
  * @arg fileno The fileno
  * @arg len The length of the bitmap in bytes.
@@ -169,9 +476,12 @@ static int fill_buffer(int fileno, unsigned char* buf, uint64_t len) {
  * @return 0 on success. Negative on error.
  */
 int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode mode, bloom_bitmap *map) {
-    // Get the flags
+    // Get the flags. Read-only files are never created.
     int flags = O_RDWR;
-    if (create) {
+    if (mode & READ_ONLY) {
+        if (create) return -EINVAL;
+        flags = O_RDONLY;
+    } else if (create) {
         flags |= O_CREAT;
     }
 
@@ -215,6 +525,9 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 
     // Use the filehandler mode
     int res = bitmap_from_file(fileno, len, mode | extra_flags, map);
+    if (!res && (mode & CHECKSUMS) && !(mode & READ_ONLY) && map->mode != ANONYMOUS) {
+        open_checksums(filename, fileno, (extra_flags & NEW_BITMAP) ? 1 : 0, map);
+    }
 
     // Handle is dup'ed, we can close
     close(fileno);
@@ -228,10 +541,180 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 }
 
 
+/**
+ * Opens the checksums of a bitmap, resetting them if they are
+ * missing or belong to another file. The pages of a new bitmap
+ * are all zeros, so their checksums are known, while those of an
+ * existing file are left unknown, to be filled in by bitmap_verify.
+ * Failing to keep checksums is logged, but is not an error.
+ * @arg filename The file of the bitmap
+ * @arg fileno The open file of the bitmap
+ * @arg new_bitmap If the file of the bitmap was just created
+ */
+static void open_checksums(char *filename, int fileno, int new_bitmap, bloom_bitmap *map) {
+    char *path = NULL;
+    if (asprintf(&path, "%s%s", filename, BITMAP_CHECKSUM_SUFFIX) == -1) return;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "Failed to open the checksums %s. %s", path, strerror(errno));
+        free(path);
+        return;
+    }
+
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t size = sizeof(crc_file_header) + pages * sizeof(uint32_t);
+    struct stat data_st, crc_st;
+    if (fstat(fileno, &data_st) || fstat(fd, &crc_st)) goto ERR;
+
+    // Map the file, then check it is ours
+    int reset = new_bitmap || (uint64_t)crc_st.st_size != size;
+    if (reset && (ftruncate(fd, 0) || ftruncate(fd, size))) goto ERR;
+    crc_file_header *header = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) goto ERR;
+    if (!reset && (header->magic != CRC_FILE_MAGIC || header->version != CRC_FILE_VERSION ||
+            header->inode != (uint64_t)data_st.st_ino || header->size != map->size)) {
+        reset = 1;
+        memset(header, 0, size);
+    }
+    map->crcs = (uint32_t*)(header + 1);
+    map->crcs_size = size;
+
+    if (reset) {
+        if (new_bitmap) {
+            uint32_t zero = page_crc(map, 0);
+            for (uint64_t i=0; i < pages; i++) map->crcs[i] = zero;
+            if (map->size % 4096) map->crcs[pages - 1] = page_crc(map, pages - 1);
+        }
+        header->magic = CRC_FILE_MAGIC;
+        header->version = CRC_FILE_VERSION;
+        header->inode = data_st.st_ino;
+        header->size = map->size;
+    }
+    close(fd);
+    free(path);
+    return;
+
+ERR:
+    syslog(LOG_WARNING, "Failed to set up the checksums %s. %s", path, strerror(errno));
+    close(fd);
+    free(path);
+}
+
+/**
+ * Returns the checksum of a page as kept in the checksum
+ * file, where 0 means unknown.
+ */
+static uint32_t page_crc(bloom_bitmap *map, uint64_t page) {
+    uint64_t offset = page * 4096;
+    uint64_t len = (map->size - offset < 4096) ? map->size - offset : 4096;
+    uint32_t crc = bf_crc32c(0, map->mmap + offset, len);
+    return (crc) ? crc : 1;
+}
+
+/**
+ * Updates the checksums of a range of pages that was written
+ * to the file. A page changed since it was written is dirty,
+ * and gets the right checksum when it is written again.
+ * @arg start_page The first page
+ * @arg end_page The page after the last page
+ */
+static void update_checksums(bloom_bitmap *map, uint64_t start_page, uint64_t end_page) {
+    if (!map->crcs) return;
+    for (uint64_t i=start_page; i < end_page && i * 4096 < map->size; i++) {
+        map->crcs[i] = page_crc(map, i);
+    }
+}
+
+/**
+ * Writes the checksums back to their file, after the
+ * pages they cover were written.
+ * @arg sync If 0, only start the writeback
+ * @return 0 on success, negative on failure.
+ */
+static int sync_checksums(bloom_bitmap *map, int sync) {
+    if (!map->crcs) return 0;
+    void *base = (char*)map->crcs - sizeof(crc_file_header);
+    if (msync(base, map->crcs_size, (sync) ? MS_SYNC : MS_ASYNC) == -1) return -errno;
+    return 0;
+}
+
+/**
+ * Unmaps the checksums of a bitmap.
+ */
+static void close_checksums(bloom_bitmap *map) {
+    if (!map->crcs) return;
+    munmap((char*)map->crcs - sizeof(crc_file_header), map->crcs_size);
+    map->crcs = NULL;
+    map->crcs_size = 0;
+}
+
+/**
+ * Removes the file of a bitmap, and its checksums if any.
+ * @arg filename The file of the bitmap
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_unlink(char *filename) {
+    int res = unlink(filename);
+    if (res) res = -errno;
+    char *path = NULL;
+    if (asprintf(&path, "%s%s", filename, BITMAP_CHECKSUM_SUFFIX) != -1) {
+        unlink(path);
+        free(path);
+    }
+    return res;
+}
+
+// Checks if a page is waiting to be flushed
+static int page_is_dirty(bloom_bitmap *map, uint64_t page) {
+    if (!map->dirty_pages) return 0;
+    unsigned char byte = __atomic_load_n(map->dirty_pages + (page >> 3), __ATOMIC_ACQUIRE);
+    return (byte >> (7 - page % 8)) & 0x1;
+}
+
+/**
+ * Verifies the checksums of a range of pages of a bitmap
+ * with CHECKSUMS, which are updated as each page is flushed.
+ * Pages without a checksum yet, such as those of a file written
+ * before checksums were kept, are checksummed instead, and dirty
+ * pages are skipped until they are flushed. Safe to call while
+ * bits are being set.
+ * @note The caller must prevent concurrent flushes of the bitmap.
+ * @arg map The bitmap
+ * @arg start_page The first page to verify
+ * @arg num_pages The number of pages to verify
+ * @arg bad_pages Output, the number of pages that do not match
+ * @return The number of pages verified, 0 past the end of the
+ * bitmap, or -EINVAL if it keeps no checksums.
+ */
+int64_t bitmap_verify(bloom_bitmap *map, uint64_t start_page, uint64_t num_pages, uint64_t *bad_pages) {
+    *bad_pages = 0;
+    if (!map || !map->crcs) return -EINVAL;
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    if (start_page >= pages) return 0;
+    if (num_pages > pages - start_page) num_pages = pages - start_page;
+
+    for (uint64_t i=start_page; i < start_page + num_pages; i++) {
+        if (page_is_dirty(map, i)) continue;
+        uint32_t crc = page_crc(map, i);
+        if (!map->crcs[i]) {
+            map->crcs[i] = crc;
+            continue;
+        }
+        if (crc == map->crcs[i]) continue;
+
+        // A bit set while we read the page dirties it
+        if (page_is_dirty(map, i) || page_crc(map, i) != crc) continue;
+        (*bad_pages)++;
+    }
+    return num_pages;
+}
+
 /**
  * Flushes the bitmap back to disk. This is
- * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps.
+ * a syncronous operation. PERSISTENT bitmaps punch
+ * out the pages that were cleared, rather than write
+ * zeros. It is a no-op for
+ * ANONYMOUS and READ_ONLY bitmaps.
  * @arg map The bitmap
  * @returns 0 on success, negative failure.
  */
@@ -239,97 +722,365 @@ int bitmap_flush(bloom_bitmap *map) {
     // Return if there is no map provided
     if (map == NULL) return -EINVAL;
 
-    // Do nothing for anonymous maps
+    // Do nothing for anonymous or read-only maps
     int res;
-    if (map->mode == ANONYMOUS || map->mmap == NULL)
+    if (map->mode == ANONYMOUS || map->mmap == NULL || !map->dirty_pages)
         return 0;
 
-    // For SHARED, we can use an msync and let the kernel deal
-    else if (map->mode == SHARED) {
-        res = msync(map->mmap, map->size, MS_SYNC);
-        if (res == -1) return -errno;
-
-    } else if (map->mode == PERSISTENT) {
-        if ((res = flush_dirty_pages(map)))
-            return res;
-    }
+    // SHARED syncs and PERSISTENT writes the dirty runs.
+    // Skip the fsync entirely if nothing was dirty.
+    if ((res = flush_dirty_pages(map, map->dirty_pages, map->fileno, 1)) <= 0)
+        return res;
 
-    // SHARED / PERSISTENT both have a file backing
+    // SHARED / PERSISTENT both have a file backing. The
+    // checksums follow the pages they cover.
     res = fsync(map->fileno);
     if (res == -1) return -errno;
-    return 0;
+    return sync_checksums(map, 1);
+}
+
+
+/**
+ * Writes the dirty pages of the bitmap back to its file,
+ * like bitmap_flush, but does not wait for them to be
+ * durable. The writeback is only started, so that a later
+ * fsync or syncfs of the file has little left to do.
+ * It is a no-op for ANONYMOUS and READ_ONLY bitmaps.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_write(bloom_bitmap *map) {
+    if (map == NULL) return -EINVAL;
+    if (map->mode == ANONYMOUS || map->mmap == NULL || !map->dirty_pages)
+        return 0;
+
+    int res = flush_dirty_pages(map, map->dirty_pages, map->fileno, 0);
+    if (res <= 0) return res;
+#ifdef SYNC_FILE_RANGE_WRITE
+    // SHARED maps are written back by the msync
+    if (map->mode == PERSISTENT)
+        sync_file_range(map->fileno, map->offset, map->size, SYNC_FILE_RANGE_WRITE);
+#endif
+    return sync_checksums(map, 0);
 }
 
 
 /**
- * Flushes all the dirty pages of the bitmap. We just
- * scan the dirty_pages bitfield and flush every 4K
- * block that is considered dirty. As a bit of a jank hack,
- * we always flush the first block, since it contains headers,
- * and is not reliably marked as dirty.
+ * Flushes all the dirty pages of the bitmap. We scan a
+ * dirty page bitfield, and coalesce the dirty pages into runs
+ * which are written with a single pwrite or msync each. The header
+ * on the first page is marked dirty by its writers like any other page.
+ * @arg dirty_pages The bitfield to scan, cleared as it is scanned
+ * @arg fileno The file to write to. For the file backing of the
+ * bitmap, pages that fail to be written are marked dirty again.
+ * @arg sync If 0, SHARED bitmaps only start the writeback
+ * @return The number of runs flushed, negative on error.
  */
-static int flush_dirty_pages(bloom_bitmap *map) {
+static int flush_dirty_pages(bloom_bitmap *map, unsigned char *dirty_pages, int fileno, int sync) {
     /**
-     * The dirty page bitmap is a problematic
-     * shared data structure since reads and writes are
-     * byte aligned. This means when we set a single bit,
-     * we are doing a read/update/write on the whole byte.
-     * Because of this, concurrent updates are not safe.
-     * To solve this, we allocate a new fresh bitmap, and
-     * swap the old one out. This allows the other threads
-     * to mark bits as dirty, while we go through and flush.
-     * At the end, we free our old version.
+     * The dirty page bitmap is a shared data structure,
+     * since other threads may be setting bits while we
+     * flush. Bits are set atomically, so we atomically
+     * swap each byte of the field with zero as we scan it.
+     * Any page dirtied after we swap its byte out is simply
+     * picked up by the next flush.
      */
-    void *new_dirty = alloc_dirty_page_bitmap(map->size);
-    if (!new_dirty) {
-        syslog(LOG_ERR, "Failed to allocate new dirty page bitmap!");
-        return -1;
-    }
-    unsigned char* dirty_pages = map->dirty_pages;
-    map->dirty_pages = new_dirty;
-
     uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
-    unsigned char byte;
-    int dirty, res = 0;
+    uint64_t run_start = 0, run_end = 0;    // Pending run of pages, [start, end)
+    unsigned char byte = 0;
+    int redirty = (dirty_pages == map->dirty_pages);
+    int res = 0, runs = 0;
     for (uint64_t i=0; i < pages; i++) {
+        // Swap out the next byte of the field, skipping clean bytes
+        if (i % 8 == 0) {
+            if (!dirty_pages[i >> 3]) {
+                i += 7;
+                continue;
+            }
+            byte = __atomic_exchange_n(dirty_pages + (i >> 3), 0, __ATOMIC_ACQUIRE);
+        }
+
         // Check if the page is dirty
-        byte = dirty_pages[i >> 3];
-        dirty = ((byte >> (7 - (i % 8))) & 0x1);
+        if (!((byte >> (7 - (i % 8))) & 0x1)) continue;
 
-        if (dirty || i == 0) {
-            // Flush the page
-            res = flush_page(map, i, map->size, pages - 1);
-            if (res) goto LEAVE;
+        // Extend the pending run if it is close enough
+        if (run_end && i - run_end <= FLUSH_MERGE_GAP) {
+            run_end = i + 1;
+            continue;
+        }
+
+        // Write out the pending run, and start a new one
+        if (run_end && (res = flush_pages(map, fileno, run_start, run_end, sync))) {
+            // Restore the dirty bits we swapped out but did not flush
+            if (redirty) redirty_pages(map, run_start, (i | 7) + 1);
+            return res;
         }
+        if (run_end) runs++;
+        run_start = i;
+        run_end = i + 1;
     }
-LEAVE:
-    // Cleanup the old bitmap
-    free(dirty_pages);
-    return res;
+
+    // Write out the last run
+    if (run_end && (res = flush_pages(map, fileno, run_start, run_end, sync))) {
+        if (redirty) redirty_pages(map, run_start, run_end);
+        return res;
+    }
+    if (run_end) runs++;
+    return runs;
 }
 
 
 /**
- * Flushes out a single page that is dirty
+ * Writes out a contiguous range of pages
+ * @arg fileno The file to write to
+ * @arg start_page The first page to write
+ * @arg end_page The page after the last page to write
+ * @arg sync If 0, SHARED bitmaps only start the writeback
  */
-static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page) {
-    int res, total = 0;
-    uint64_t offset = page * 4096;
+static int flush_pages(bloom_bitmap *map, int fileno, uint64_t start_page, uint64_t end_page, int sync) {
+    BLOOM_PROBE3(flush__pages, start_page, end_page, sync);
+    uint64_t offset = start_page * 4096;
 
     // The last page may need a write size < 4096
-    int should_write = 4096;
-    if (page == max_page && size % 4096) {
-        should_write = size % 4096;
+    uint64_t end = end_page * 4096;
+    if (end > map->size) end = map->size;
+
+    // For SHARED, the kernel writes back the range. msync
+    // requires a start aligned to the system page size.
+    if (map->mode == SHARED && fileno == map->fileno) {
+        offset -= offset % sysconf(_SC_PAGESIZE);
+        if (msync(map->mmap + offset, end - offset, (sync) ? MS_SYNC : MS_ASYNC) == -1)
+            return -errno;
+        update_checksums(map, start_page, end_page);
+        return 0;
+    }
+
+    // Pages of the file backing that were cleared are punched
+    // out rather than written, so the file stays sparse. A bit
+    // set after the check dirties the page for the next flush.
+    if (fileno == map->fileno) {
+        uint64_t pos = offset;
+        while (pos < end) {
+            uint64_t run_end = pos;
+            int zero = page_is_zero(map->mmap + pos, (end - pos < 4096) ? end - pos : 4096);
+            do {
+                run_end += 4096;
+            } while (run_end < end &&
+                page_is_zero(map->mmap + run_end, (end - run_end < 4096) ? end - run_end : 4096) == zero);
+            if (run_end > end) run_end = end;
+
+            if (zero && !punch_pages(fileno, map->offset + pos, map->offset + run_end)) {
+                pos = run_end;
+                continue;
+            }
+            // Whole pages are written around the page cache, so
+            // the file does not keep a second copy of the bitmap
+            if (map->direct_fd >= 0) pos = write_direct(map, pos, run_end);
+            ssize_t res;
+            while (pos < run_end) {
+                res = pwrite(fileno, map->mmap + pos, run_end - pos, map->offset + pos);
+                if (res == -1) {
+                    if (errno == EINTR) continue;
+                    return -errno;
+                }
+                pos += res;
+            }
+        }
+        update_checksums(map, start_page, end_page);
+        return 0;
     }
 
-    while (total < should_write) {
-        res = pwrite(map->fileno, map->mmap + offset + total,
-                should_write - total, offset + total);
-        if (res == -1 && errno != EINTR)
+    ssize_t res;
+    while (offset < end) {
+        res = pwrite(fileno, map->mmap + offset, end - offset, offset);
+        if (res == -1) {
+            if (errno == EINTR) continue;
             return -errno;
-        else
-            total += res;
+        }
+        offset += res;
+    }
+    return 0;
+}
+
+/**
+ * Writes the whole pages of a range with O_DIRECT. The buffer
+ * and offsets are page aligned, and the length is rounded down
+ * to whole pages, since the file may end within a page. Direct
+ * I/O is given up on for the bitmap if the file system refuses it.
+ * @arg offset The page aligned start of the range
+ * @arg end The end of the range
+ * @return The offset the rest of the range is to be written from
+ */
+static uint64_t write_direct(bloom_bitmap *map, uint64_t offset, uint64_t end) {
+    end -= end % 4096;
+    int fd = __atomic_load_n(&map->direct_fd, __ATOMIC_RELAXED);
+    while (fd >= 0 && offset < end) {
+        ssize_t res = pwrite(fd, map->mmap + offset, end - offset, offset);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0 || res % 4096) {
+            if (res == -1 && errno == EINVAL &&
+                    __atomic_exchange_n(&map->direct_fd, -1, __ATOMIC_RELAXED) == fd) {
+                close(fd);
+            }
+            if (res > 0) offset += res;
+            break;
+        }
+        offset += res;
     }
+    return offset;
+}
+
+/**
+ * Checks if a buffer is all zeros
+ */
+static int page_is_zero(const unsigned char *buf, uint64_t len) {
+    uint64_t i = 0, w;
+    for (; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, buf + i, sizeof(w));
+        if (w) return 0;
+    }
+    for (; i < len; i++) {
+        if (buf[i]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Deallocates a range of a file, which then reads as zeros.
+ * @return 0 on success, or -1 if holes are not supported,
+ * and the zeros must be written instead.
+ */
+static int punch_pages(int fileno, uint64_t offset, uint64_t end) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate(fileno, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, end - offset))
+        return 0;
+#else
+    (void)fileno;
+    (void)offset;
+    (void)end;
+#endif
+    return -1;
+}
+
+
+/**
+ * Marks a range of pages as dirty again, after
+ * they could not be flushed.
+ * @arg start_page The first page
+ * @arg end_page The page after the last page
+ */
+static void redirty_pages(bloom_bitmap *map, uint64_t start_page, uint64_t end_page) {
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    if (end_page > pages) end_page = pages;
+    for (uint64_t i=start_page; i < end_page; i++) {
+        bitmap_dirtybit(map, i << 15);
+    }
+}
+
+
+/**
+ * Moves a PERSISTENT bitmap from anonymous memory onto a
+ * shared mapping of its file, making it SHARED. The bitmap is
+ * flushed first, and the mapping is swapped in at the same
+ * address, so concurrent readers see the same bits throughout.
+ * A sealed bitmap stays sealed.
+ * Its pages are then in the page cache, where clean pages can be
+ * evicted under memory pressure and read back on demand.
+ * @note The caller must prevent writes and flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL if the bitmap is not PERSISTENT
+ * or uses explicit hugepages, -EBUSY while it is snapshotted,
+ * negative on other errors.
+ */
+int bitmap_demote(bloom_bitmap *map) {
+    if (map == NULL || map->mode != PERSISTENT || map->mmap == NULL) return -EINVAL;
+    if (map->mapped_size != map->size) return -EINVAL;
+    if (map->snap_pages) return -EBUSY;
+#ifdef MREMAP_FIXED
+    // Write out everything the file is missing
+    int res = bitmap_flush(map);
+    if (res) return res;
+
+    // Map the file elsewhere, and move it over the anonymous
+    // memory, which replaces it in one step or not at all
+    int prot = (map->sealed) ? PROT_READ : PROT_READ|PROT_WRITE;
+    unsigned char *addr = mmap(NULL, map->size, prot, MAP_SHARED, map->fileno, map->offset);
+    if (addr == MAP_FAILED) return -errno;
+    if (mremap(addr, map->size, map->size, MREMAP_MAYMOVE|MREMAP_FIXED, map->mmap) == MAP_FAILED) {
+        res = -errno;
+        munmap(addr, map->size);
+        return res;
+    }
+    if (madvise(map->mmap, map->size, MADV_RANDOM) != 0) {
+        perror("Failed to call madvise() [MADV_RANDOM]");
+    }
+
+    // Writes go through the page cache, and are tracked
+    // in the same dirty page field. A sealed bitmap stays sealed.
+    if (map->direct_fd >= 0) {
+        close(map->direct_fd);
+        map->direct_fd = -1;
+    }
+    map->mode = SHARED;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+
+/**
+ * Seals a bitmap that will not be written again. It is flushed,
+ * its mapping is made read-only, and its dirty page field is
+ * freed, so flushes skip it entirely. A sealed bitmap is
+ * unsealed with bitmap_unseal before it is written.
+ * @note The caller must prevent writes and flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL for ANONYMOUS or read-only
+ * bitmaps, -EBUSY while it is snapshotted, negative on other errors.
+ */
+int bitmap_seal(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return -EINVAL;
+    if (map->sealed) return 0;
+    if (map->mode == ANONYMOUS || !map->dirty_pages) return -EINVAL;
+    if (map->snap_pages) return -EBUSY;
+
+    int res = bitmap_flush(map);
+    if (res) return res;
+
+    // The whole mapping is protected, which keeps
+    // explicit hugepages aligned
+    if (mprotect(map->mmap, map->mapped_size, PROT_READ) != 0) return -errno;
+    unsigned char *dirty = map->dirty_pages;
+    map->dirty_pages = NULL;
+    map->sealed = 1;
+    free(dirty);
+    return 0;
+}
+
+
+/**
+ * Unseals a bitmap sealed by bitmap_seal, so it can be written.
+ * Does nothing if the bitmap is not sealed.
+ * @note The caller must prevent flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, negative on error.
+ */
+int bitmap_unseal(bloom_bitmap *map) {
+    if (map == NULL) return -EINVAL;
+    if (!map->sealed) return 0;
+
+    // Track the dirty pages before any write is possible
+    unsigned char *dirty = alloc_dirty_page_bitmap(map->size);
+    if (!dirty) return -ENOMEM;
+    map->dirty_pages = dirty;
+    if (mprotect(map->mmap, map->mapped_size, PROT_READ|PROT_WRITE) != 0) {
+        int res = -errno;
+        map->dirty_pages = NULL;
+        free(dirty);
+        return res;
+    }
+    map->sealed = 0;
     return 0;
 }
 
@@ -351,20 +1102,37 @@ int bitmap_close(bloom_bitmap *map) {
     if (res != 0) return res;
 
     // Unmap the file
-    res = munmap(map->mmap, map->size);
+    res = munmap(map->mmap, map->mapped_size);
     if (res != 0) return -errno;
 
-    // Close the file descriptor if file backed
-    if (map->mode != ANONYMOUS) {
+    // Close the file descriptor if file backed. A shared
+    // handle is closed with the last bitmap of the file.
+    if (map->direct_fd >= 0) {
+        close(map->direct_fd);
+        map->direct_fd = -1;
+    }
+    int last = 1;
+    if (map->file_refs) {
+        last = (__atomic_sub_fetch(map->file_refs, 1, __ATOMIC_ACQ_REL) == 0);
+        if (last) free(map->file_refs);
+        map->file_refs = NULL;
+    }
+    if (map->mode != ANONYMOUS && last) {
        res = close(map->fileno);
        if (res != 0) return -errno;
     }
 
-    // Remove the dirty bitfield if any
+    // Remove the dirty bitfields if any
     if (map->dirty_pages) {
         free(map->dirty_pages);
         map->dirty_pages = NULL;
     }
+    bitmap_snapshot_end(map);
+    close_checksums(map);
+    if (map->page_gens) {
+        free(map->page_gens);
+        map->page_gens = NULL;
+    }
 
     // Cleanup
     map->mmap = NULL;
@@ -372,3 +1140,439 @@ int bitmap_close(bloom_bitmap *map) {
     return 0;
 }
 
+
+/**
+ * Closes the bitmap without flushing it. The changes
+ * since the last flush are dropped, which is only safe once
+ * the file backing is deleted, or is about to be. The caller
+ * should free() the structure after.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_discard(bloom_bitmap *map) {
+    if (map == NULL) return -EINVAL;
+
+    // Without dirty pages, the close has nothing to write
+    if (map->dirty_pages) {
+        free(map->dirty_pages);
+        map->dirty_pages = NULL;
+    }
+    return bitmap_close(map);
+}
+
+
+/**
+ * Starts tracking the pages that change, so that a copy
+ * of the bitmap made while it is being modified can be
+ * brought up to date with bitmap_snapshot_copy.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_snapshot_begin(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return -EINVAL;
+    if (map->snap_pages) return -EBUSY;
+    map->snap_pages = alloc_dirty_page_bitmap(map->size);
+    return (map->snap_pages) ? 0 : -ENOMEM;
+}
+
+
+/**
+ * Copies the bitmap to a file. Either the whole bitmap is
+ * copied, or only the pages that have changed since they
+ * were last copied. This is safe to call concurrently
+ * with modifications of the bitmap.
+ * @arg map The bitmap
+ * @arg fileno The file to copy to
+ * @arg all If 1, copy the whole bitmap, otherwise only the changed pages
+ * @returns The number of page runs copied, negative on failure.
+ */
+int bitmap_snapshot_copy(bloom_bitmap *map, int fileno, int all) {
+    if (map == NULL || map->snap_pages == NULL) return -EINVAL;
+    if (!all) return flush_dirty_pages(map, map->snap_pages, fileno, 1);
+
+    // Clear the changes first, so any page changed during
+    // the copy is copied again by the next call
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    for (uint64_t i=0; i < pages; i += 8) {
+        __atomic_store_n(map->snap_pages + (i >> 3), 0, __ATOMIC_RELEASE);
+    }
+    int res = flush_pages(map, fileno, 0, pages, 1);
+    return (res) ? res : 1;
+}
+
+
+/**
+ * Stops tracking the pages that change.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ */
+void bitmap_snapshot_end(bloom_bitmap *map) {
+    if (map->snap_pages) {
+        free(map->snap_pages);
+        map->snap_pages = NULL;
+    }
+}
+
+/**
+ * Places the memory of a bitmap on a NUMA node, migrating
+ * the pages that are already resident. Only anonymous memory
+ * can be placed, so this is a no-op for SHARED bitmaps.
+ * @arg map The bitmap
+ * @arg node The node to prefer, or -1 to interleave
+ * the pages over every node
+ * @arg num_nodes The number of NUMA nodes, at most BITMAP_MAX_NUMA_NODES
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_numa_place(bloom_bitmap *map, int node, int num_nodes) {
+    if (node >= num_nodes || num_nodes < 1 || num_nodes > BITMAP_MAX_NUMA_NODES) return -EINVAL;
+    if (map->mode == SHARED) return 0;
+#ifdef SYS_mbind
+    unsigned long mask;
+    int policy;
+    if (node < 0) {
+        mask = (num_nodes == BITMAP_MAX_NUMA_NODES) ? ~0UL : (1UL << num_nodes) - 1;
+        policy = BITMAP_MPOL_INTERLEAVE;
+    } else {
+        mask = 1UL << node;
+        policy = BITMAP_MPOL_PREFERRED;
+    }
+
+    // The kernel reads one less bit than maxnode
+    if (syscall(SYS_mbind, map->mmap, map->mapped_size, policy, &mask,
+                BITMAP_MAX_NUMA_NODES + 1, BITMAP_MPOL_MF_MOVE)) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Locks the memory of a bitmap into RAM with mlock, faulting
+ * in every page first, so checks never wait on the disk and
+ * the pages are never reclaimed or swapped. The lock is
+ * dropped when the bitmap is closed.
+ * @arg map The bitmap
+ * @returns 0 on success, -EINVAL if the bitmap is not mapped,
+ * negative errno if the pages could not be locked, for example
+ * -ENOMEM or -EPERM past RLIMIT_MEMLOCK.
+ */
+int bitmap_lock(bloom_bitmap *map) {
+    if (!map->mmap) return -EINVAL;
+
+    // mlock faults in the whole range before it returns
+    if (mlock(map->mmap, map->size)) return -errno;
+    return 0;
+}
+
+/**
+ * Counts the bytes of a bitmap that are resident in memory,
+ * using mincore. For SHARED bitmaps this is the part of the
+ * file in the page cache, whether or not it is dirty.
+ * @arg map The bitmap
+ * @arg resident Output, the resident bytes, at most the size
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_resident(bloom_bitmap *map, uint64_t *resident) {
+    *resident = 0;
+    if (!map->mmap) return -EINVAL;
+
+    // The mapping may start part way into a page
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)map->mmap & ~(page_size - 1);
+    uint64_t len = (uintptr_t)map->mmap + map->size - start;
+
+    // Ask for a chunk of pages at a time, so the vector stays small
+    unsigned char vec[RESIDENT_CHUNK_PAGES];
+    uint64_t pages = 0;
+    for (uint64_t off=0; off < len; off += RESIDENT_CHUNK_PAGES * page_size) {
+        uint64_t chunk = len - off;
+        if (chunk > RESIDENT_CHUNK_PAGES * page_size) chunk = RESIDENT_CHUNK_PAGES * page_size;
+        if (mincore((void*)(start + off), chunk, vec)) return -errno;
+        uint64_t num = (chunk + page_size - 1) / page_size;
+        for (uint64_t i=0; i < num; i++) pages += vec[i] & 1;
+    }
+
+    *resident = pages * page_size;
+    if (*resident > map->size) *resident = map->size;
+    return 0;
+}
+
+/**
+ * Counts the bytes of a bitmap in pages that are waiting
+ * to be flushed, from the dirty page field. Safe to call
+ * while bits are being set, the count may be slightly stale.
+ * @arg map The bitmap
+ * @return The dirty bytes, at most the size. 0 if the
+ * bitmap is not dirty tracked.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map) {
+    unsigned char *dirty = map->dirty_pages;
+    if (!dirty) return 0;
+
+    // The field is a bit per page, count it a byte at a time
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t field_size = (pages + 7) / 8;
+    uint64_t dirty_pages = 0;
+    for (uint64_t i=0; i < field_size; i++) {
+        unsigned char byte = __atomic_load_n(dirty + i, __ATOMIC_RELAXED);
+        if (byte) dirty_pages += __builtin_popcount(byte);
+    }
+
+    uint64_t bytes = dirty_pages * 4096;
+    return (bytes > map->size) ? map->size : bytes;
+}
+
+/**
+ * Hints that the clean pages of a SHARED bitmap are cold, so the
+ * kernel reclaims them before other memory, or with pageout that
+ * they are reclaimed now. The bitmap stays mapped, and a page
+ * that is used again is read back from the page cache or the file.
+ * Pages waiting to be flushed are skipped. Safe to call while
+ * bits are being set.
+ * @arg map The bitmap
+ * @arg pageout If 1, reclaim the pages now, otherwise mark them cold
+ * @arg hinted Output, the bytes of the pages that were hinted
+ * @returns 0 on success, -EINVAL if the bitmap is not SHARED,
+ * negative errno if the kernel does not support the hint.
+ */
+int bitmap_reclaim(bloom_bitmap *map, int pageout, uint64_t *hinted) {
+    *hinted = 0;
+    if (!(map->mode & SHARED) || !map->mmap) return -EINVAL;
+    int advice = (pageout) ? MADV_PAGEOUT : MADV_COLD;
+
+    // Hint the runs of pages that are not dirty
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t run = 0;
+    for (uint64_t page=0; page < pages; page++) {
+        unsigned char dirty = (map->dirty_pages) ?
+            __atomic_load_n(map->dirty_pages + (page >> 3), __ATOMIC_RELAXED) : 0;
+        if (!((dirty >> (7 - page % 8)) & 0x1)) continue;
+        int res = advise_clean_range(map, run * 4096, page * 4096, advice, hinted);
+        if (res) return res;
+        run = page + 1;
+    }
+    return advise_clean_range(map, run * 4096, map->size, advice, hinted);
+}
+
+/**
+ * Advises the whole pages of a byte range of a bitmap, since
+ * the bitmap may share its first and last page with another.
+ */
+static int advise_clean_range(bloom_bitmap *map, uint64_t start, uint64_t end, int advice, uint64_t *hinted) {
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t first = ((uintptr_t)map->mmap + start + page_size - 1) & ~(page_size - 1);
+    uintptr_t last = ((uintptr_t)map->mmap + ((end > map->size) ? map->size : end)) & ~(page_size - 1);
+    if (last <= first) return 0;
+    if (madvise((void*)first, last - first, advice)) return -errno;
+    *hinted += last - first;
+    return 0;
+}
+
+/**
+ * Combines a bitmap into another of the same size, a 64bit
+ * word at a time. Each page is combined in one pass that the
+ * compiler can vectorize, and only the pages that changed are
+ * marked dirty.
+ * @arg map The bitmap to combine into
+ * @arg other The bitmap to combine, which is not changed
+ * @arg offset The first byte to combine, a multiple of 8
+ * @arg op How the bits are combined
+ * @returns 0 on success, -EINVAL if the bitmaps differ in size
+ * or the bitmap is read-only.
+ */
+int bitmap_merge(bloom_bitmap *map, bloom_bitmap *other, uint64_t offset, bitmap_merge_op op) {
+    if (map->size != other->size || offset % 8 || (map->mode & READ_ONLY)) return -EINVAL;
+
+    for (uint64_t page=offset & ~4095ULL; page < map->size; page += 4096) {
+        uint64_t start = (page > offset) ? page : offset;
+        uint64_t end = (page + 4096 < map->size) ? page + 4096 : map->size;
+        uint64_t *words = (uint64_t*)(map->mmap + start);
+        uint64_t *other_words = (uint64_t*)(other->mmap + start);
+        uint64_t num_words = (end - start) / 8;
+
+        // Track if any bit changed, to skip dirtying clean pages
+        uint64_t changed = 0;
+        if (op == BITMAP_MERGE_OR) {
+            for (uint64_t i=0; i < num_words; i++) {
+                uint64_t word = words[i] | other_words[i];
+                changed |= word ^ words[i];
+                words[i] = word;
+            }
+        } else {
+            for (uint64_t i=0; i < num_words; i++) {
+                uint64_t word = words[i] & other_words[i];
+                changed |= word ^ words[i];
+                words[i] = word;
+            }
+        }
+
+        // A bitmap may end within a word
+        for (uint64_t i=start + num_words * 8; i < end; i++) {
+            unsigned char byte = (op == BITMAP_MERGE_OR) ?
+                map->mmap[i] | other->mmap[i] : map->mmap[i] & other->mmap[i];
+            changed |= byte ^ map->mmap[i];
+            map->mmap[i] = byte;
+        }
+        if (changed) bitmap_dirtybit(map, page * 8);
+    }
+    return 0;
+}
+
+/**
+ * ORs bytes into a range of a bitmap, a 64bit word at a time,
+ * such as the pages of a copy of the bitmap. Only the pages that
+ * changed are marked dirty.
+ * @arg map The bitmap to combine into
+ * @arg offset The first byte of the range, a multiple of 8
+ * @arg data The bytes to combine, which need not be aligned
+ * @arg len The length of the range
+ * @returns 0 on success, -EINVAL if the range is past the end
+ * of the bitmap or the bitmap is read-only.
+ */
+int bitmap_or_bytes(bloom_bitmap *map, uint64_t offset, const unsigned char *data, uint64_t len) {
+    if (offset % 8 || offset > map->size || len > map->size - offset ||
+            (map->mode & READ_ONLY) || map->sealed) return -EINVAL;
+
+    uint64_t end = offset + len;
+    for (uint64_t page=offset & ~4095ULL; page < end; page += 4096) {
+        uint64_t start = (page > offset) ? page : offset;
+        uint64_t stop = (page + 4096 < end) ? page + 4096 : end;
+        uint64_t *words = (uint64_t*)(map->mmap + start);
+        const unsigned char *in = data + (start - offset);
+        uint64_t num_words = (stop - start) / 8;
+
+        // Track if any bit changed, to skip dirtying clean pages
+        uint64_t changed = 0;
+        for (uint64_t i=0; i < num_words; i++) {
+            uint64_t other;
+            memcpy(&other, in + i * 8, 8);
+            uint64_t word = words[i] | other;
+            changed |= word ^ words[i];
+            words[i] = word;
+        }
+
+        // The range may end within a word
+        for (uint64_t i=start + num_words * 8; i < stop; i++) {
+            unsigned char byte = map->mmap[i] | data[i - offset];
+            changed |= byte ^ map->mmap[i];
+            map->mmap[i] = byte;
+        }
+        if (changed) bitmap_dirtybit(map, page * 8);
+    }
+    return 0;
+}
+
+/**
+ * Starts stamping each page of a bitmap with the generation it
+ * last changed in, as read from a clock that the caller advances.
+ * The stamps are kept as the pages are marked dirty, so the pages
+ * changed since any generation can be found without scanning them.
+ * Every page starts out stamped with the current generation, and
+ * calling it again restarts the tracking.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ * @arg clock The current generation, which must outlive the bitmap
+ * @return 0 on success, -EINVAL if the bitmap is not mapped,
+ * -ENOMEM if the stamps can not be allocated.
+ */
+int bitmap_track_changes(bloom_bitmap *map, uint32_t *clock) {
+    if (map == NULL || map->mmap == NULL || clock == NULL) return -EINVAL;
+    uint64_t pages = (map->size + 4095) / 4096;
+    uint32_t *stamps = map->page_gens;
+    if (!stamps) stamps = malloc(pages * sizeof(uint32_t));
+    if (!stamps) return -ENOMEM;
+
+    uint32_t gen = __atomic_load_n(clock, __ATOMIC_ACQUIRE);
+    for (uint64_t i=0; i < pages; i++) stamps[i] = gen;
+    map->gen_clock = clock;
+    map->gen_start = gen;
+    __atomic_store_n(&map->page_gens, stamps, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Checks if a page of a bitmap changed in a generation or
+ * later, see bitmap_track_changes. Safe to call while bits
+ * are being set.
+ * @arg map The bitmap
+ * @arg page The page
+ * @arg gen The generation
+ * @return 1 if the page changed, or if the bitmap is not
+ * tracked. 0 otherwise.
+ */
+int bitmap_page_changed(bloom_bitmap *map, uint64_t page, uint32_t gen) {
+    if (!map->page_gens) return 1;
+    return __atomic_load_n(map->page_gens + page, __ATOMIC_ACQUIRE) >= gen;
+}
+
+/**
+ * Counts the bits set in a range of a bitmap. Uses the
+ * popcnt instruction when the CPU has it, selected on the
+ * first call. Safe to call while bits are being set, but the
+ * count may then miss some of them.
+ * @arg map The bitmap
+ * @arg offset The first byte to count
+ * @arg len The number of bytes to count
+ * @returns The number of bits set.
+ */
+uint64_t bitmap_popcount(bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    if (offset >= map->size) return 0;
+    if (len > map->size - offset) len = map->size - offset;
+    popcount_fn impl = __atomic_load_n(&popcount_impl, __ATOMIC_RELAXED);
+    if (map->mode != SHARED) return impl(map->mmap + offset, len);
+
+    // The holes of a SHARED file have no bits set, and
+    // reading them would fill the page cache with zeros
+    uint64_t count = 0, start, end, pos = offset;
+    while (!next_data_range(map->fileno, map->offset, pos, offset + len, &start, &end)) {
+        count += impl(map->mmap + start, end - start);
+        pos = end;
+    }
+    return count;
+}
+
+/*
+ * Counts four words at a time into separate sums, so the
+ * counts do not wait on each other. The body is shared by
+ * the kernels, which only differ in the instructions the
+ * compiler may use for __builtin_popcountll.
+ */
+#define POPCOUNT_BODY(buf, len) { \
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0; \
+    uint64_t i = 0, w[4]; \
+    for (; i + sizeof(w) <= len; i += sizeof(w)) { \
+        memcpy(w, buf + i, sizeof(w)); \
+        s0 += __builtin_popcountll(w[0]); \
+        s1 += __builtin_popcountll(w[1]); \
+        s2 += __builtin_popcountll(w[2]); \
+        s3 += __builtin_popcountll(w[3]); \
+    } \
+    for (; i < len; i++) s0 += __builtin_popcount(buf[i]); \
+    return s0 + s1 + s2 + s3; \
+}
+
+// Portable kernel
+static uint64_t popcount_scalar(const unsigned char *buf, uint64_t len) POPCOUNT_BODY(buf, len)
+
+#if defined(__x86_64__) || defined(__i386__)
+// Kernel using the popcnt instruction
+__attribute__ ((target ("popcnt")))
+static uint64_t popcount_popcnt(const unsigned char *buf, uint64_t len) POPCOUNT_BODY(buf, len)
+#endif
+
+/**
+ * Selects the kernel on the first call. Racing threads
+ * will all select the same kernel, so no locking is needed.
+ */
+static uint64_t popcount_resolve(const unsigned char *buf, uint64_t len) {
+    popcount_fn impl = popcount_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) impl = popcount_popcnt;
+#endif
+    __atomic_store_n(&popcount_impl, impl, __ATOMIC_RELAXED);
+    return impl(buf, len);
+}
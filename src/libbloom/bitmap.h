@@ -8,15 +8,49 @@ typedef enum {
     SHARED      = 1, // MAP_SHARED mmap used, file backed.
     PERSISTENT  = 2, // MAP_ANONYMOUS used, file backed.
     ANONYMOUS   = 4, // MAP_ANONYMOUS mmap used. No file backing.
-    NEW_BITMAP  = 8  // File contents not read. Used with PERSISTENT
+    NEW_BITMAP  = 8, // File contents not read. Used with PERSISTENT
+    HUGEPAGES   = 16, // Back with hugepages if possible. Ignored for SHARED
+    READ_ONLY   = 32, // Map the file read-only. Only used with SHARED
+    DIRECT_IO   = 64, // Write with O_DIRECT, bypassing the page cache. Used with PERSISTENT
+    POPULATE    = 128, // Fault in the data of the file before returning. Used with SHARED
+    NO_READAHEAD = 256, // Fault in each page on first use. Used with SHARED
+    CHECKSUMS   = 512 // Keep a checksum of each page beside the file. Used by bitmap_from_filename
 } bitmap_mode;
 
+/**
+ * The hugepage size we round mappings up to
+ * when using MAP_HUGETLB.
+ */
+#define BITMAP_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * The suffix of the file holding the page checksums of
+ * a bitmap, beside the file of the bitmap
+ */
+#define BITMAP_CHECKSUM_SUFFIX ".crc"
+
+/**
+ * The most NUMA nodes a bitmap can be placed on
+ */
+#define BITMAP_MAX_NUMA_NODES 64
+
 typedef struct {
     bitmap_mode mode;
     int fileno;          // Underlying fileno
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
-    unsigned char* dirty_pages; // Used for the PERSISTENT mode.
+    unsigned char* dirty_pages; // Used for the PERSISTENT and SHARED modes.
+    uint64_t mapped_size; // Size of the mapping, may be rounded up for hugepages
+    unsigned char* snap_pages; // Pages changed during a snapshot, or NULL
+    int direct_fd;       // The file opened with O_DIRECT for DIRECT_IO, or -1
+    uint64_t offset;     // Start of the bitmap in the file
+    int *file_refs;      // Bitmaps sharing the fileno, or NULL if it is our own
+    int sealed;          // Set once mapped read-only by bitmap_seal, no longer dirty tracked
+    uint32_t *crcs;      // CRC32C of each page as last written, 0 if unknown, or NULL
+    uint64_t crcs_size;  // Size of the mapping of the checksum file
+    uint32_t *page_gens; // Generation each page last changed in, or NULL if not tracked
+    uint32_t *gen_clock; // The current generation, stamped on the pages that change
+    uint32_t gen_start;  // Generation the tracking started in
 } bloom_bitmap;
 
 /**
@@ -30,10 +64,36 @@ typedef struct {
  */
 int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
 
+/**
+ * Returns a bloom_bitmap of a range of a file holding several
+ * bitmaps. The file handle is not dup'ed, but shared by the
+ * bitmaps of the file, and closed with the last of them.
+ * DIRECT_IO is ignored, since the range is not written alone.
+ * @arg fileno The fileno. Owned by the bitmaps once one is made.
+ * @arg neighbor Optional, a bitmap of the same file. The handle is
+ * shared with it, and the new bitmap is mapped as far from it
+ * in memory as it is in the file, if that address is free, so
+ * the kernel can merge the mappings into one region.
+ * If NULL, this is the first bitmap of the file.
+ * @arg offset The start of the range, aligned to the page size
+ * @arg len The length of the bitmap in bytes.
+ * @arg mode The mode to use for the bitmap, SHARED or PERSISTENT
+ * @arg map The output map. Will be initialized.
+ * @return 0 on success. Negative on error.
+ */
+int bitmap_from_file_at(int fileno, bloom_bitmap *neighbor, uint64_t offset, uint64_t len, bitmap_mode mode, bloom_bitmap *map);
+
 /**
  * Returns a bloom_bitmap pointer from a filename.
- * Opens the file with read/write privileges. If create
+ * Opens the file with read/write privileges, or only read
+ * privileges for READ_ONLY bitmaps. If create
  * is true, then a file will be created if it does not exist.
+ * New files are sparse, so pages only take disk space and
+ * memory once bits are set in them.
+ * With CHECKSUMS, the checksums of the pages are kept in the
+ * file with BITMAP_CHECKSUM_SUFFIX appended. They are reset when
+ * that file was of another file of the same name, and are not
+ * kept for READ_ONLY bitmaps, whose writer keeps them.
  * If the file cannot be opened, NULL will be returned.
  * @arg fileno The fileno
  * @arg len The length of the bitmap in bytes.
@@ -44,15 +104,89 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
  */
 int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode mode, bloom_bitmap *map);
 
+/**
+ * Removes the file of a bitmap, and its checksums if any.
+ * @arg filename The file of the bitmap
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_unlink(char *filename);
+
+/**
+ * Verifies the checksums of a range of pages of a bitmap
+ * with CHECKSUMS, which are updated as each page is flushed.
+ * Pages without a checksum yet, such as those of a file written
+ * before checksums were kept, are checksummed instead, and dirty
+ * pages are skipped until they are flushed. Safe to call while
+ * bits are being set.
+ * @note The caller must prevent concurrent flushes of the bitmap.
+ * @arg map The bitmap
+ * @arg start_page The first page to verify
+ * @arg num_pages The number of pages to verify
+ * @arg bad_pages Output, the number of pages that do not match
+ * @return The number of pages verified, 0 past the end of the
+ * bitmap, or -EINVAL if it keeps no checksums.
+ */
+int64_t bitmap_verify(bloom_bitmap *map, uint64_t start_page, uint64_t num_pages, uint64_t *bad_pages);
+
 /**
  * Flushes the bitmap back to disk. This is
- * a syncronous operation. It is a no-op for
+ * a syncronous operation. PERSISTENT bitmaps punch
+ * out the pages that were cleared, rather than write
+ * zeros. It is a no-op for
  * ANONYMOUS bitmaps.
  * @arg map The bitmap
  * @returns 0 on success, negative failure.
  */
 int bitmap_flush(bloom_bitmap *map);
 
+/**
+ * Writes the dirty pages of the bitmap back to its file,
+ * like bitmap_flush, but does not wait for them to be
+ * durable. The writeback is only started, so that a later
+ * fsync or syncfs of the file has little left to do.
+ * It is a no-op for ANONYMOUS and READ_ONLY bitmaps.
+ * @arg map The bitmap
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_write(bloom_bitmap *map);
+
+/**
+ * Moves a PERSISTENT bitmap from anonymous memory onto a
+ * shared mapping of its file, making it SHARED. The bitmap is
+ * flushed first, and the mapping is swapped in at the same
+ * address, so concurrent readers see the same bits throughout.
+ * A sealed bitmap stays sealed.
+ * Its pages are then in the page cache, where clean pages can be
+ * evicted under memory pressure and read back on demand.
+ * @note The caller must prevent writes and flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL if the bitmap is not PERSISTENT
+ * or uses explicit hugepages, -EBUSY while it is snapshotted,
+ * negative on other errors.
+ */
+int bitmap_demote(bloom_bitmap *map);
+
+/**
+ * Seals a bitmap that will not be written again. It is flushed,
+ * its mapping is made read-only, and its dirty page field is
+ * freed, so flushes skip it entirely. A sealed bitmap is
+ * unsealed with bitmap_unseal before it is written.
+ * @note The caller must prevent writes and flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, -EINVAL for ANONYMOUS or read-only
+ * bitmaps, -EBUSY while it is snapshotted, negative on other errors.
+ */
+int bitmap_seal(bloom_bitmap *map);
+
+/**
+ * Unseals a bitmap sealed by bitmap_seal, so it can be written.
+ * Does nothing if the bitmap is not sealed.
+ * @note The caller must prevent flushes of the bitmap.
+ * @arg map The bitmap
+ * @return 0 on success, negative on error.
+ */
+int bitmap_unseal(bloom_bitmap *map);
+
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -63,6 +197,178 @@ int bitmap_flush(bloom_bitmap *map);
  */
 int bitmap_close(bloom_bitmap *map);
 
+/**
+ * Closes the bitmap without flushing it. The changes
+ * since the last flush are dropped, which is only safe once
+ * the file backing is deleted, or is about to be. The caller
+ * should free() the structure after.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_discard(bloom_bitmap *map);
+
+/**
+ * Starts tracking the pages that change, so that a copy
+ * of the bitmap made while it is being modified can be
+ * brought up to date with bitmap_snapshot_copy.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_snapshot_begin(bloom_bitmap *map);
+
+/**
+ * Copies the bitmap to a file. Either the whole bitmap is
+ * copied, or only the pages that have changed since they
+ * were last copied. This is safe to call concurrently
+ * with modifications of the bitmap.
+ * @arg map The bitmap
+ * @arg fileno The file to copy to
+ * @arg all If 1, copy the whole bitmap, otherwise only the changed pages
+ * @returns The number of page runs copied, negative on failure.
+ */
+int bitmap_snapshot_copy(bloom_bitmap *map, int fileno, int all);
+
+/**
+ * Stops tracking the pages that change.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ */
+void bitmap_snapshot_end(bloom_bitmap *map);
+
+/**
+ * Places the memory of a bitmap on a NUMA node, migrating
+ * the pages that are already resident. Only anonymous memory
+ * can be placed, so this is a no-op for SHARED bitmaps.
+ * @arg map The bitmap
+ * @arg node The node to prefer, or -1 to interleave
+ * the pages over every node
+ * @arg num_nodes The number of NUMA nodes, at most BITMAP_MAX_NUMA_NODES
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_numa_place(bloom_bitmap *map, int node, int num_nodes);
+
+/**
+ * Locks the memory of a bitmap into RAM with mlock, faulting
+ * in every page first, so checks never wait on the disk and
+ * the pages are never reclaimed or swapped. The lock is
+ * dropped when the bitmap is closed.
+ * @arg map The bitmap
+ * @returns 0 on success, -EINVAL if the bitmap is not mapped,
+ * negative errno if the pages could not be locked, for example
+ * -ENOMEM or -EPERM past RLIMIT_MEMLOCK.
+ */
+int bitmap_lock(bloom_bitmap *map);
+
+/**
+ * Counts the bytes of a bitmap that are resident in memory,
+ * using mincore. For SHARED bitmaps this is the part of the
+ * file in the page cache, whether or not it is dirty.
+ * @arg map The bitmap
+ * @arg resident Output, the resident bytes, at most the size
+ * @returns 0 on success, negative on failure.
+ */
+int bitmap_resident(bloom_bitmap *map, uint64_t *resident);
+
+/**
+ * Counts the bytes of a bitmap in pages that are waiting
+ * to be flushed, from the dirty page field. Safe to call
+ * while bits are being set, the count may be slightly stale.
+ * @arg map The bitmap
+ * @return The dirty bytes, at most the size. 0 if the
+ * bitmap is not dirty tracked.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map);
+
+/**
+ * Hints that the clean pages of a SHARED bitmap are cold, so the
+ * kernel reclaims them before other memory, or with pageout that
+ * they are reclaimed now. The bitmap stays mapped, and a page
+ * that is used again is read back from the page cache or the file.
+ * Pages waiting to be flushed are skipped. Safe to call while
+ * bits are being set.
+ * @arg map The bitmap
+ * @arg pageout If 1, reclaim the pages now, otherwise mark them cold
+ * @arg hinted Output, the bytes of the pages that were hinted
+ * @returns 0 on success, -EINVAL if the bitmap is not SHARED,
+ * negative errno if the kernel does not support the hint.
+ */
+int bitmap_reclaim(bloom_bitmap *map, int pageout, uint64_t *hinted);
+
+/**
+ * The ways bitmap_merge combines two bitmaps
+ */
+typedef enum {
+    BITMAP_MERGE_OR,        // Keep the bits set in either bitmap
+    BITMAP_MERGE_AND        // Keep the bits set in both bitmaps
+} bitmap_merge_op;
+
+/**
+ * Combines a bitmap into another of the same size, a 64bit
+ * word at a time. Each page is combined in one pass that the
+ * compiler can vectorize, and only the pages that changed are
+ * marked dirty.
+ * @arg map The bitmap to combine into
+ * @arg other The bitmap to combine, which is not changed
+ * @arg offset The first byte to combine, a multiple of 8
+ * @arg op How the bits are combined
+ * @returns 0 on success, -EINVAL if the bitmaps differ in size
+ * or the bitmap is read-only.
+ */
+int bitmap_merge(bloom_bitmap *map, bloom_bitmap *other, uint64_t offset, bitmap_merge_op op);
+
+/**
+ * ORs bytes into a range of a bitmap, a 64bit word at a time,
+ * such as the pages of a copy of the bitmap. Only the pages that
+ * changed are marked dirty.
+ * @arg map The bitmap to combine into
+ * @arg offset The first byte of the range, a multiple of 8
+ * @arg data The bytes to combine, which need not be aligned
+ * @arg len The length of the range
+ * @returns 0 on success, -EINVAL if the range is past the end
+ * of the bitmap or the bitmap is read-only.
+ */
+int bitmap_or_bytes(bloom_bitmap *map, uint64_t offset, const unsigned char *data, uint64_t len);
+
+/**
+ * Starts stamping each page of a bitmap with the generation it
+ * last changed in, as read from a clock that the caller advances.
+ * The stamps are kept as the pages are marked dirty, so the pages
+ * changed since any generation can be found without scanning them.
+ * Every page starts out stamped with the current generation, and
+ * calling it again restarts the tracking.
+ * @note The caller must prevent concurrent modifications.
+ * @arg map The bitmap
+ * @arg clock The current generation, which must outlive the bitmap
+ * @return 0 on success, -EINVAL if the bitmap is not mapped,
+ * -ENOMEM if the stamps can not be allocated.
+ */
+int bitmap_track_changes(bloom_bitmap *map, uint32_t *clock);
+
+/**
+ * Checks if a page of a bitmap changed in a generation or
+ * later, see bitmap_track_changes. Safe to call while bits
+ * are being set.
+ * @arg map The bitmap
+ * @arg page The page
+ * @arg gen The generation
+ * @return 1 if the page changed, or if the bitmap is not
+ * tracked. 0 otherwise.
+ */
+int bitmap_page_changed(bloom_bitmap *map, uint64_t page, uint32_t gen);
+
+/**
+ * Counts the bits set in a range of a bitmap. Uses the
+ * popcnt instruction when the CPU has it, selected on the
+ * first call. Safe to call while bits are being set, but the
+ * count may then miss some of them.
+ * @arg map The bitmap
+ * @arg offset The first byte to count
+ * @arg len The number of bytes to count
+ * @returns The number of bits set.
+ */
+uint64_t bitmap_popcount(bloom_bitmap *map, uint64_t offset, uint64_t len);
+
 /**
  * Returns the value of the bit at index idx for the
  * bloom_bitmap map
@@ -71,25 +377,62 @@ inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx) {
     return (map->mmap[idx >> 3] >> (7 - (idx % 8))) & 0x1;
 }
 
+/*
+ * Marks the page containing the bit at index idx
+ * as dirty if the bitmap is file backed, and as
+ * changed if a snapshot is in progress. The page
+ * is stamped with the current generation if its
+ * changes are tracked. This is safe to call concurrently.
+ */
+inline void bitmap_dirtybit(bloom_bitmap *map, uint64_t idx) {
+    // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
+    uint64_t page = idx >> 15;
+    unsigned char byte_off = 7 - page % 8;
+    unsigned char *dirty;
+    if (map->dirty_pages) {
+        dirty = map->dirty_pages + (page >> 3);
+        if (!((*dirty >> byte_off) & 0x1)) {
+            __atomic_fetch_or(dirty, 1 << byte_off, __ATOMIC_RELEASE);
+        }
+    }
+    if (map->snap_pages) {
+        dirty = map->snap_pages + (page >> 3);
+        if (!((*dirty >> byte_off) & 0x1)) {
+            __atomic_fetch_or(dirty, 1 << byte_off, __ATOMIC_RELEASE);
+        }
+    }
+    if (map->page_gens) {
+        // Stamps only move forward, a racing older stamp loses
+        uint32_t gen = __atomic_load_n(map->gen_clock, __ATOMIC_ACQUIRE);
+        uint32_t *stamp = map->page_gens + page;
+        uint32_t old = __atomic_load_n(stamp, __ATOMIC_RELAXED);
+        while (old < gen && !__atomic_compare_exchange_n(stamp, &old, gen, 1,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
 /*
  * Used to set a bit in the bitmap, and as a side affect,
- * mark the page as dirty if we are in the PERSISTENT mode
+ * mark the page as dirty if the bitmap is file backed.
+ * This is safe to call concurrently with other bitmap_setbit
+ * and bitmap_getbit calls on the same map. The bit is set with
+ * an atomic fetch-or on the 64bit word containing it, and is
+ * skipped entirely if it is already set.
  */
 inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
-    unsigned char byte = map->mmap[idx >> 3];
+    // Check if the bit is already set, and avoid the locked op
     unsigned char byte_off = 7 - idx % 8;
-    byte |= 1 << byte_off;
-    map->mmap[idx >> 3] = byte;
+    if (!((map->mmap[idx >> 3] >> byte_off) & 0x1)) {
+        // Build the mask for the containing word. This keeps the
+        // byte ordering of the bitmap independent of endianness.
+        uint64_t mask = 0;
+        ((unsigned char*)&mask)[(idx >> 3) & 7] = 1 << byte_off;
+        uint64_t *word = (uint64_t*)(map->mmap + ((idx >> 3) & ~7ULL));
+        __atomic_fetch_or(word, mask, __ATOMIC_RELEASE);
+    }
 
     // Check if we need to dirty the page
-    if (map->mode == PERSISTENT) {
-        // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
-        uint64_t page = idx >> 15;
-        byte = map->dirty_pages[page >> 3];
-        byte_off = 7 - page % 8;
-        byte |= 1 << byte_off;
-        map->dirty_pages[page >> 3] = byte;
-    }
+    bitmap_dirtybit(map, idx);
 }
 
 #endif
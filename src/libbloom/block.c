@@ -0,0 +1,133 @@
+#include <string.h>
+#include "block.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_HAVE_AVX2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BLOCK_HAVE_NEON
+#endif
+
+/*
+ * Static definitions
+ */
+typedef int(*block_test_fn)(const unsigned char *block, const bloom_block_mask *mask);
+static int block_test_resolve(const unsigned char *block, const bloom_block_mask *mask);
+static block_test_fn block_test_impl = block_test_resolve;
+static const char *block_kernel_name = NULL;
+
+#ifdef BLOCK_HAVE_AVX2
+/**
+ * AVX2 kernel, tests the block as two 256 bit lanes.
+ */
+__attribute__ ((target ("avx2")))
+static int block_test_avx2(const unsigned char *block, const bloom_block_mask *mask) {
+    __m256i b0 = _mm256_load_si256((const __m256i*)block);
+    __m256i b1 = _mm256_load_si256((const __m256i*)(block + 32));
+    __m256i m0 = _mm256_load_si256((const __m256i*)mask->words);
+    __m256i m1 = _mm256_load_si256((const __m256i*)(mask->words + 4));
+
+    // testc returns 1 if all the bits of the mask are set
+    return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+}
+#endif
+
+#ifdef BLOCK_HAVE_NEON
+/**
+ * NEON kernel, accumulates the missing bits in
+ * four 128 bit lanes.
+ */
+static int block_test_neon(const unsigned char *block, const bloom_block_mask *mask) {
+    const uint64_t *b = (const uint64_t*)block;
+    uint64x2_t miss = vdupq_n_u64(0);
+    int i;
+    for (i=0; i < 8; i += 2) {
+        miss = vorrq_u64(miss, vbicq_u64(vld1q_u64(mask->words + i), vld1q_u64(b + i)));
+    }
+    return (vgetq_lane_u64(miss, 0) | vgetq_lane_u64(miss, 1)) == 0;
+}
+#endif
+
+/**
+ * Portable version of bf_block_test.
+ * @arg block Pointer to the 64 byte aligned block
+ * @arg mask The mask to test
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_test_scalar(const unsigned char *block, const bloom_block_mask *mask) {
+    const uint64_t *b = (const uint64_t*)block;
+    uint64_t miss = 0;
+    int i;
+    for (i=0; i < 8; i++) {
+        miss |= mask->words[i] & ~b[i];
+    }
+    return miss == 0;
+}
+
+/**
+ * Selects the kernel on the first call. Racing threads
+ * will all select the same kernel, so no locking is needed.
+ */
+static int block_test_resolve(const unsigned char *block, const bloom_block_mask *mask) {
+    block_test_fn impl = bf_block_test_scalar;
+    const char *name = "scalar";
+#if defined(BLOCK_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = block_test_avx2;
+        name = "avx2";
+    }
+#elif defined(BLOCK_HAVE_NEON)
+    impl = block_test_neon;
+    name = "neon";
+#endif
+    __atomic_store_n(&block_kernel_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&block_test_impl, impl, __ATOMIC_RELAXED);
+    return impl(block, mask);
+}
+
+/**
+ * Checks if all the bits of a mask are set in a block.
+ * @arg block Pointer to the 64 byte aligned block
+ * @arg mask The mask to test
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_test(const unsigned char *block, const bloom_block_mask *mask) {
+    block_test_fn impl = __atomic_load_n(&block_test_impl, __ATOMIC_RELAXED);
+    return impl(block, mask);
+}
+
+/**
+ * Sets all the bits of a mask in a block.
+ * @arg map The bitmap containing the block
+ * @arg block_bit The bit offset of the 64 byte aligned block in the bitmap
+ * @arg mask The mask to set
+ */
+void bf_block_set(bloom_bitmap *map, uint64_t block_bit, const bloom_block_mask *mask) {
+    uint64_t *b = (uint64_t*)(map->mmap + (block_bit >> 3));
+    uint64_t m;
+    int i;
+    for (i=0; i < 8; i++) {
+        // Only touch the words that are missing bits
+        m = mask->words[i];
+        if ((b[i] & m) != m) {
+            __atomic_fetch_or(b + i, m, __ATOMIC_RELAXED);
+        }
+    }
+
+    // A block never spans pages, so at most one is dirtied
+    bitmap_dirtybit(map, block_bit);
+}
+
+/**
+ * Returns the name of the kernel used by bf_block_test.
+ * @return "avx2", "neon" or "scalar"
+ */
+const char *bf_block_kernel(void) {
+    if (!__atomic_load_n(&block_kernel_name, __ATOMIC_RELAXED)) {
+        bloom_block_mask mask;
+        memset(&mask, 0, sizeof(mask));
+        block_test_resolve((const unsigned char*)mask.words, &mask);
+    }
+    return block_kernel_name;
+}
@@ -0,0 +1,64 @@
+#ifndef BLOOM_BLOCK_H
+#define BLOOM_BLOCK_H
+#include <inttypes.h>
+#include "bitmap.h"
+
+/*
+ * Kernels used to probe a single block of the
+ * BLOOM_LAYOUT_BLOCKED layout. Instead of testing the
+ * k bits one at a time, the bits are gathered into a
+ * mask covering the whole block, which is then tested
+ * or applied using a few wide operations.
+ *
+ * The mask uses the same byte and bit order as the
+ * bitmap, so it can be compared with the block memory
+ * directly regardless of the host endianness.
+ */
+typedef struct {
+    uint64_t words[8];
+} __attribute__ ((aligned (64))) bloom_block_mask;
+
+/**
+ * Sets a bit in a block mask.
+ * @arg mask The mask
+ * @arg bit The bit offset within the block, 0 to 511
+ */
+static inline void bf_block_mask_setbit(bloom_block_mask *mask, uint32_t bit) {
+    ((unsigned char*)mask->words)[(bit >> 3) & 63] |= 0x80 >> (bit & 7);
+}
+
+/**
+ * Checks if all the bits of a mask are set in a block.
+ * Uses the best kernel supported by the CPU, which is
+ * selected on the first call.
+ * @arg block Pointer to the 64 byte aligned block
+ * @arg mask The mask to test
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_test(const unsigned char *block, const bloom_block_mask *mask);
+
+/**
+ * Portable version of bf_block_test.
+ * @arg block Pointer to the 64 byte aligned block
+ * @arg mask The mask to test
+ * @return 1 if all the bits are set, 0 otherwise.
+ */
+int bf_block_test_scalar(const unsigned char *block, const bloom_block_mask *mask);
+
+/**
+ * Sets all the bits of a mask in a block. Each word
+ * is set atomically, so this is safe to call concurrently
+ * with other bf_block_set and bf_block_test calls.
+ * @arg map The bitmap containing the block
+ * @arg block_bit The bit offset of the 64 byte aligned block in the bitmap
+ * @arg mask The mask to set
+ */
+void bf_block_set(bloom_bitmap *map, uint64_t block_bit, const bloom_block_mask *mask);
+
+/**
+ * Returns the name of the kernel used by bf_block_test.
+ * @return "avx2", "neon" or "scalar"
+ */
+const char *bf_block_kernel(void);
+
+#endif
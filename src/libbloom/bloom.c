@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <syslog.h>
 #include "bloom.h"
+#include "block.h"
+#include "crc.h"
+#include "shortkey.h"
 
 /*
  * Static definitions
@@ -13,140 +16,1683 @@ static const uint32_t MAGIC_HEADER = 0xCB1005DD;  // Vaguely like CBLOOMDD
 extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
 extern void SpookyHash128(const void *key, size_t len, uint64_t seed1, uint64_t seed2,
         uint64_t *hash1, uint64_t *hash2);
+static int bf_blocked_size_for_capacity_prob(bloom_filter_params *params, uint32_t slot_bits, uint32_t max_k);
+static double bf_block_fp_probability(uint64_t blocks, uint32_t slots, uint64_t capacity, uint32_t k_num);
+static void bf_derive_hashes(bloom_hashed_key *hk, int scheme, uint32_t num_hashes, uint64_t *hashes);
+static inline uint64_t* bf_base_hashes(bloom_hashed_key *hk, int scheme);
+static void bf_select_ops(bloom_bloomfilter *filter);
+static int bf_generic_add(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_generic_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_generic_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result);
+static int bf_short_add(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_short_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_short_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result);
+static uint64_t bf_sparse_reserve(uint64_t bits_bytes);
+static uint32_t bf_sparse_positions(bloom_bloomfilter *filter, bloom_hashed_key *hk, uint64_t *positions);
+static int bf_sparse_insert(bloom_bloomfilter *filter, uint64_t *table, uint64_t slots, uint64_t pos);
+static int bf_sparse_has(uint64_t *table, uint64_t slots, uint64_t pos);
+static int bf_sparse_add(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_sparse_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+static int bf_sparse_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result);
+static void bf_dirty_range(bloom_bitmap *map, uint64_t offset, uint64_t len);
+static int bf_merge_sparse(bloom_bloomfilter *filter, bloom_bloomfilter *other, int intersect);
+static uint64_t bf_fold_pos(bloom_bloomfilter *filter, uint32_t folds, uint64_t pos);
+static void bf_fold_or(bloom_bitmap *map, uint64_t offset, const unsigned char *src, uint64_t len);
+static void bf_fold_bits(bloom_bloomfilter *filter, uint32_t folds, bloom_bloomfilter *out);
+
+/*
+ * The probe functions of a filter, chosen by bf_select_ops
+ */
+struct bloom_probe_ops {
+    int (*add)(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+    int (*contains)(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+    int (*contains_many)(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys, char *result);
+};
+
+/**
+ * Creates a new bloom filter using a given bitmap and k-value.
+ * @arg map A bloom_bitmap pointer.
+ * @arg k_num The number of hash functions to use. Ignored if the header value is different.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter) {
+    return bf_from_bitmap_format(map, k_num, NULL, new_filter, filter);
+}
+
+/**
+ * Creates a new bloom filter using a given bitmap, k-value and format.
+ * @arg map A bloom_bitmap pointer.
+ * @arg k_num The number of hash functions to use. Ignored if the header value is different.
+ * @arg format The format of a new filter. NULL for the default format.
+ * Ignored unless new_filter is set, since existing filters record their format.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap_format(bloom_bitmap *map, uint32_t k_num, bloom_filter_format *format,
+        int new_filter, bloom_bloomfilter *filter) {
+    // Check our args
+    if (map == NULL || k_num < 1) {
+        return -EINVAL;
+    }
+    if (new_filter && format && format->layout != BLOOM_LAYOUT_PARTITIONED &&
+            format->layout != BLOOM_LAYOUT_BLOCKED && format->layout != BLOOM_LAYOUT_COUNTING &&
+            format->layout != BLOOM_LAYOUT_AGING) {
+        return -EINVAL;
+    }
+    if (new_filter && format && format->layout == BLOOM_LAYOUT_AGING &&
+            (format->age_ticks < 1 || format->age_ticks > BLOOM_AGE_MAX_TICKS)) {
+        return -EINVAL;
+    }
+    if (new_filter && format && format->hash_scheme != BLOOM_HASH_LEGACY &&
+            format->hash_scheme != BLOOM_HASH_MURMUR && format->hash_scheme != BLOOM_HASH_CRC32C &&
+            format->hash_scheme != BLOOM_HASH_SHORT) {
+        return -EINVAL;
+    }
+    if (new_filter && format && format->reduction != BLOOM_REDUCE_MODULO &&
+            format->reduction != BLOOM_REDUCE_MULTIPLY) {
+        return -EINVAL;
+    }
+
+    // Check the size of the map
+    if (map->size < sizeof(bloom_filter_header)) {
+        return -ENOMEM;
+    }
+
+    // Setup the pointers
+    filter->map = map;
+    filter->header = (bloom_filter_header*)map->mmap;
+
+    // Setup the header if it is new
+    if (new_filter) {
+        filter->header->magic = MAGIC_HEADER;
+        filter->header->k_num = k_num;
+        filter->header->count = 0;
+        filter->header->layout = (format) ? format->layout : BLOOM_LAYOUT_PARTITIONED;
+        filter->header->hash_scheme = (format) ? format->hash_scheme : BLOOM_HASH_LEGACY;
+        filter->header->reduction = (format) ? format->reduction : BLOOM_REDUCE_MODULO;
+        if (filter->header->layout == BLOOM_LAYOUT_AGING) {
+            filter->header->age_clock = 0;
+            filter->header->age_now = 1;
+            filter->header->age_ticks = format->age_ticks;
+        }
+        filter->header->sparse_bytes = bf_sparse_bytes(map->size, format);
+        filter->header->sparse_slots = (filter->header->sparse_bytes) ? BLOOM_SPARSE_MIN_SLOTS : 0;
+        filter->header->sparse_used = 0;
+
+        // Since this is a new filter, force a flush of
+        // the headers. This mainly affects bitmaps that
+        // are in the PERSIST mode. Since no flush happens
+        // until the first key is set, it can cause filters
+        // to be created that have no headers, and thus cannot
+        // be loaded.
+        bitmap_dirtybit(map, 0);
+        bf_flush(filter);
+
+    // Check for the header if not new
+    } else if (filter->header->magic != MAGIC_HEADER) {
+        syslog(LOG_ERR, "Magic byte for bloom filter is wrong! Aborting load.");
+        return -1;
+    }
+
+    // Check that we know how to hash
+    if (filter->header->hash_scheme != BLOOM_HASH_LEGACY &&
+            filter->header->hash_scheme != BLOOM_HASH_MURMUR &&
+            filter->header->hash_scheme != BLOOM_HASH_CRC32C &&
+            filter->header->hash_scheme != BLOOM_HASH_SHORT) {
+        syslog(LOG_ERR, "Unsupported bloom filter hash scheme: %d. Aborting load.",
+                filter->header->hash_scheme);
+        return -1;
+    }
+
+    // Check that we know how to reduce
+    if (filter->header->reduction != BLOOM_REDUCE_MODULO &&
+            filter->header->reduction != BLOOM_REDUCE_MULTIPLY) {
+        syslog(LOG_ERR, "Unsupported bloom filter range reduction: %d. Aborting load.",
+                filter->header->reduction);
+        return -1;
+    }
+
+    // Check that the clock of an aging filter is sane
+    if (filter->header->layout == BLOOM_LAYOUT_AGING && (filter->header->age_ticks < 1 ||
+                filter->header->age_ticks > BLOOM_AGE_MAX_TICKS || filter->header->age_now < 1)) {
+        syslog(LOG_ERR, "Bloom filter has a corrupt aging clock! Aborting load.");
+        return -1;
+    }
+
+    // Check that the sparse set fits, and its layout has bits
+    uint64_t sparse_bytes = filter->header->sparse_bytes;
+    if (sparse_bytes && (sparse_bytes % 8 || sparse_bytes >= map->size - sizeof(bloom_filter_header) ||
+                filter->header->sparse_slots * 8 > sparse_bytes ||
+                (filter->header->layout != BLOOM_LAYOUT_PARTITIONED &&
+                 filter->header->layout != BLOOM_LAYOUT_BLOCKED))) {
+        syslog(LOG_ERR, "Bloom filter has a corrupt sparse set! Aborting load.");
+        return -1;
+    }
+
+    // Get the bitmap size, without the space of the sparse set
+    filter->bitmap_size = (map->size - sizeof(bloom_filter_header) - sparse_bytes) * 8;
+
+    // Setup the offset or blocks based on the layout
+    switch (filter->header->layout) {
+        case BLOOM_LAYOUT_PARTITIONED:
+            filter->offset = filter->bitmap_size / filter->header->k_num;
+            filter->num_blocks = 0;
+            break;
+        case BLOOM_LAYOUT_BLOCKED:
+        case BLOOM_LAYOUT_COUNTING:
+        case BLOOM_LAYOUT_AGING:
+            filter->offset = 0;
+            filter->num_blocks = filter->bitmap_size / BLOOM_BLOCK_BITS;
+            if (filter->num_blocks == 0) {
+                syslog(LOG_ERR, "Bloom filter is too small for a block layout!");
+                return -ENOMEM;
+            }
+            break;
+        default:
+            syslog(LOG_ERR, "Unsupported bloom filter layout: %d. Aborting load.",
+                    filter->header->layout);
+            return -1;
+    }
+
+    // Pick the probe functions once, rather than on every key
+    bf_select_ops(filter);
+
+    // Done, return
+    return 0;
+}
+
+/**
+ * Returns the number of hashes that must be computed
+ * for a filter. The partitioned layout needs one per
+ * bit, and the other layouts an extra one to pick the
+ * block. We always compute at least 4.
+ */
+static inline uint32_t bf_num_hashes(bloom_bloomfilter *filter) {
+    uint32_t num = filter->header->k_num;
+    if (filter->header->layout != BLOOM_LAYOUT_PARTITIONED) num++;
+    return (num < 4) ? 4 : num;
+}
+
+/**
+ * Reduces a hash onto the range [0, n) using
+ * the reduction recorded in the filter.
+ * @arg filter The filter
+ * @arg h The hash to reduce
+ * @arg n The size of the range
+ * @return The reduced hash
+ */
+static inline uint64_t bf_reduce(bloom_bloomfilter *filter, uint64_t h, uint64_t n) {
+    if (filter->header->reduction == BLOOM_REDUCE_MULTIPLY) {
+        return (uint64_t)(((__uint128_t)h * n) >> 64);
+    }
+    return h % n;
+}
+
+/**
+ * Converts the hashes of a key into probe offsets in place.
+ * In the partitioned layout, the first k_num values become
+ * the bit offsets of each probe. In the blocked layout, the
+ * first value becomes the bit offset of the block, and the
+ * next k_num values are reduced to a bit within the block.
+ * The counting and aging layouts are the same, except the
+ * values are reduced to a counter or stamp within the block.
+ * @arg filter The filter
+ * @arg hashes Contains at least bf_num_hashes hashes
+ */
+static inline void bf_compute_probes(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint32_t i;
+    uint64_t offset = 8*sizeof(bloom_filter_header);
+    if (filter->header->layout != BLOOM_LAYOUT_PARTITIONED) {
+        // The first hash selects the block, the rest a slot within it
+        uint64_t block = bf_reduce(filter, hashes[0], filter->num_blocks);
+        hashes[0] = offset + block * BLOOM_BLOCK_BITS;
+        if (filter->header->layout == BLOOM_LAYOUT_COUNTING ||
+                filter->header->layout == BLOOM_LAYOUT_AGING) {
+            // The low bits of the hashes repeat too often across only
+            // a few dozen slots, so the high bits are used
+            int slots = (filter->header->layout == BLOOM_LAYOUT_COUNTING) ?
+                BLOOM_BLOCK_COUNTERS : BLOOM_BLOCK_STAMPS;
+            for (i=1; i <= filter->header->k_num; i++) {
+                hashes[i] >>= 64 - __builtin_ctz(slots);
+            }
+            return;
+        }
+        for (i=1; i <= filter->header->k_num; i++) {
+            hashes[i] &= BLOOM_BLOCK_BITS - 1;
+        }
+        return;
+    }
+
+    uint64_t m = filter->offset;
+    for (i=0; i < filter->header->k_num; i++) {
+        hashes[i] = offset + bf_reduce(filter, hashes[i], m);   // Compute the bit offset
+        offset += m;                                            // Get the next partition offset
+    }
+}
+
+/**
+ * Issues prefetches for the memory touched by the probes.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ */
+static inline void bf_prefetch_probes(bloom_bloomfilter *filter, uint64_t *probes) {
+    unsigned char *mmap = filter->map->mmap;
+    if (filter->header->layout != BLOOM_LAYOUT_PARTITIONED) {
+        __builtin_prefetch(mmap + (probes[0] >> 3));
+        return;
+    }
+    for (uint32_t i=0; i < filter->header->k_num; i++) {
+        __builtin_prefetch(mmap + (probes[i] >> 3));
+    }
+}
+
+/**
+ * Builds the mask of the probes in the blocked layout.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @arg mask Output, the mask of the probes
+ */
+static inline void bf_probe_mask(bloom_bloomfilter *filter, uint64_t *probes, bloom_block_mask *mask) {
+    memset(mask, 0, sizeof(bloom_block_mask));
+    for (uint32_t i=1; i <= filter->header->k_num; i++) {
+        bf_block_mask_setbit(mask, probes[i]);
+    }
+}
+
+/**
+ * Returns the byte holding a counter of the counting layout.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @arg i The index of the probe
+ * @arg shift Output, the shift of the counter within the byte
+ */
+static inline unsigned char* bf_counter_byte(bloom_bloomfilter *filter, uint64_t *probes, uint32_t i, int *shift) {
+    *shift = (probes[i] & 1) * BLOOM_COUNTER_BITS;
+    return filter->map->mmap + (probes[0] >> 3) + (probes[i] >> 1);
+}
+
+/**
+ * Checks that every counter of a key is non-zero.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @return 0 if not contained, 1 if contained.
+ */
+static int bf_counters_contain(bloom_bloomfilter *filter, uint64_t *probes) {
+    int shift;
+    for (uint32_t i=1; i <= filter->header->k_num; i++) {
+        unsigned char *byte = bf_counter_byte(filter, probes, i, &shift);
+        if (!((__atomic_load_n(byte, __ATOMIC_RELAXED) >> shift) & BLOOM_COUNTER_MAX)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Adds a delta to every counter of a key. Counters are updated
+ * with a compare and swap of their byte, since the neighbouring
+ * counter may be updated concurrently. Counters at the maximum
+ * are left alone, as are zero counters when decrementing.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @arg delta 1 to increment, -1 to decrement
+ */
+static void bf_counters_update(bloom_bloomfilter *filter, uint64_t *probes, int delta) {
+    int shift;
+    for (uint32_t i=1; i <= filter->header->k_num; i++) {
+        unsigned char *byte = bf_counter_byte(filter, probes, i, &shift);
+        unsigned char old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+        unsigned char new;
+        do {
+            int counter = (old >> shift) & BLOOM_COUNTER_MAX;
+            if (counter == BLOOM_COUNTER_MAX || (delta < 0 && !counter)) break;
+            new = old + (delta << shift);
+        } while (!__atomic_compare_exchange_n(byte, &old, new, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    // A block never spans pages, so at most one is dirtied
+    bitmap_dirtybit(filter->map, probes[0]);
+}
+
+/**
+ * Checks if a stamp of the aging layout is live, meaning
+ * it was set less than ticks ticks before now.
+ * @arg stamp The stamp, 0 if the slot is empty
+ * @arg now The current tick
+ * @arg ticks The ticks a stamp lives for
+ * @return 1 if live.
+ */
+static inline int bf_stamp_live(unsigned char stamp, unsigned char now, unsigned char ticks) {
+    return stamp && (now - stamp + 255) % 255 < ticks;
+}
+
+/**
+ * Checks that every stamp of a key is live.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @return 0 if not contained, 1 if contained.
+ */
+static int bf_stamps_contain(bloom_bloomfilter *filter, uint64_t *probes) {
+    unsigned char now = __atomic_load_n(&filter->header->age_now, __ATOMIC_ACQUIRE);
+    unsigned char ticks = filter->header->age_ticks;
+    unsigned char *block = filter->map->mmap + (probes[0] >> 3);
+    for (uint32_t i=1; i <= filter->header->k_num; i++) {
+        if (!bf_stamp_live(__atomic_load_n(block + probes[i], __ATOMIC_RELAXED), now, ticks)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Stamps every slot of a key with the current tick. A
+ * stamp racing with the clearing of bf_age wins, since
+ * bf_age only clears a slot that still has its old stamp.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ */
+static void bf_stamps_set(bloom_bloomfilter *filter, uint64_t *probes) {
+    unsigned char now = __atomic_load_n(&filter->header->age_now, __ATOMIC_ACQUIRE);
+    unsigned char *block = filter->map->mmap + (probes[0] >> 3);
+    for (uint32_t i=1; i <= filter->header->k_num; i++) {
+        if (__atomic_load_n(block + probes[i], __ATOMIC_RELAXED) != now) {
+            __atomic_store_n(block + probes[i], now, __ATOMIC_RELAXED);
+        }
+    }
+    bitmap_dirtybit(filter->map, probes[0]);
+}
+
+/**
+ * Internal bf_contains method.
+ * @arg filter The filter
+ * @arg probes The probes from bf_compute_probes
+ * @return 0 if not contained, 1 if contained.
+ */
+static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *probes) {
+    if (filter->header->layout == BLOOM_LAYOUT_BLOCKED) {
+        bloom_block_mask mask;
+        bf_probe_mask(filter, probes, &mask);
+        return bf_block_test(filter->map->mmap + (probes[0] >> 3), &mask);
+    } else if (filter->header->layout == BLOOM_LAYOUT_COUNTING) {
+        return bf_counters_contain(filter, probes);
+    } else if (filter->header->layout == BLOOM_LAYOUT_AGING) {
+        return bf_stamps_contain(filter, probes);
+    }
+
+    for (uint32_t i=0; i< filter->header->k_num; i++) {
+        if (bitmap_getbit(filter->map, probes[i]) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Internal bf_add method. In the counting layout, the
+ * counters of a present key are still incremented, and
+ * in the aging layout, its stamps are refreshed.
+ * @arg filter The filter to add to
+ * @arg probes The probes from bf_compute_probes
+ * @returns 1 if the key was added, 0 if present.
+ */
+static int bf_internal_add(bloom_bloomfilter *filter, uint64_t *probes) {
+    if (filter->header->layout == BLOOM_LAYOUT_BLOCKED) {
+        bloom_block_mask mask;
+        bf_probe_mask(filter, probes, &mask);
+        if (bf_block_test(filter->map->mmap + (probes[0] >> 3), &mask)) {
+            return 0;  // Key already present, do not add.
+        }
+        bf_block_set(filter->map, probes[0], &mask);
+
+    } else if (filter->header->layout == BLOOM_LAYOUT_COUNTING) {
+        // Present keys are counted again, otherwise removing the
+        // keys they collide with would cause a false negative
+        int present = bf_counters_contain(filter, probes);
+        bf_counters_update(filter, probes, 1);
+        if (present) return 0;
+
+    } else if (filter->header->layout == BLOOM_LAYOUT_AGING) {
+        int present = bf_stamps_contain(filter, probes);
+        bf_stamps_set(filter, probes);
+        if (present) return 0;
+
+    } else {
+        // Check if the item exists
+        if (bf_internal_contains(filter, probes) == 1) {
+            return 0;  // Key already present, do not add.
+        }
+        for (uint32_t i=0; i< filter->header->k_num; i++) {
+            bitmap_setbit(filter->map, probes[i]);
+        }
+    }
+
+    // Atomically bump the count, as there may be concurrent writers.
+    // The header is on the first page, which must be flushed too.
+    __atomic_fetch_add(&filter->header->count, 1, __ATOMIC_RELAXED);
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
+
+/**
+ * Adds a new key to the bloom filter. Safe to call
+ * concurrently with other bf_add and bf_contains calls.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if
+ * the sparse set is full, see bf_sparse_grow. Negative on failure.
+ */
+int bf_add(bloom_bloomfilter *filter, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return bf_add_hashed(filter, &hk);
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains(bloom_bloomfilter *filter, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return bf_contains_hashed(filter, &hk);
+}
+
+/**
+ * Prepares a key to be used with bf_add_hashed and
+ * bf_contains_hashed. Does not do any hashing yet.
+ * @arg hk The hashed key to initialize
+ * @arg key The key, must outlive hk
+ */
+void bf_hashed_key_init(bloom_hashed_key *hk, char *key) {
+    bf_hashed_key_init_len(hk, key, strlen(key));
+}
+
+/**
+ * Prepares a key of a known length, so callers that
+ * already split the key do not measure it again.
+ * @arg hk The hashed key to initialize
+ * @arg key The key, must outlive hk. It need not be
+ * null terminated.
+ * @arg len The length of the key
+ */
+void bf_hashed_key_init_len(bloom_hashed_key *hk, char *key, uint64_t len) {
+    hk->key = key;
+    hk->len = len;
+    hk->has_murmur = 0;
+    hk->has_spooky = 0;
+    hk->has_crc = 0;
+    hk->has_short = 0;
+    hk->prehashed = 0;
+}
+
+/**
+ * Prepares a key from its MurmurHash3, as computed by
+ * MurmurHash3_x64_128 with a seed of 0, for clients that
+ * already hash their keys. There is no key, so it can only
+ * be used with filters using BLOOM_HASH_MURMUR, quotient
+ * filters and xor filters, which need nothing else.
+ * @arg hk The hashed key to initialize
+ * @arg hash The 128 bits of the hash, as two words
+ */
+void bf_hashed_key_init_hash(bloom_hashed_key *hk, const uint64_t *hash) {
+    hk->key = NULL;
+    hk->len = 0;
+    hk->has_murmur = 1;
+    hk->has_spooky = 0;
+    hk->has_crc = 0;
+    hk->has_short = 0;
+    hk->prehashed = 1;
+    hk->murmur[0] = hash[0];
+    hk->murmur[1] = hash[1];
+}
+
+/**
+ * Returns the MurmurHash3 of a prepared key, computing
+ * it if it is not yet cached.
+ * @arg hk The hashed key
+ * @return The 128 bits of the hash, as two words
+ */
+uint64_t* bf_hashed_key_murmur(bloom_hashed_key *hk) {
+    if (!hk->has_murmur) {
+        MurmurHash3_x64_128(hk->key, hk->len, 0, hk->murmur);
+        hk->has_murmur = 1;
+    }
+    return hk->murmur;
+}
+
+/**
+ * Returns the pair of hashes a scheme starts from,
+ * computing it if it is not yet cached.
+ */
+static inline uint64_t* bf_base_hashes(bloom_hashed_key *hk, int scheme) {
+    if (scheme == BLOOM_HASH_SHORT && hk->len <= BLOOM_SHORT_KEY_MAX && !hk->prehashed) {
+        if (!hk->has_short) {
+            bf_short_hash128(hk->key, hk->len, hk->short_hash);
+            hk->has_short = 1;
+        }
+        return hk->short_hash;
+    }
+    if (scheme != BLOOM_HASH_CRC32C) return bf_hashed_key_murmur(hk);
+    if (!hk->has_crc) {
+        bf_crc_hash128(hk->key, hk->len, hk->crc);
+        hk->has_crc = 1;
+    }
+    return hk->crc;
+}
+
+/**
+ * Adds a new key to the bloom filter, reusing the
+ * hashes cached from previous calls.
+ * @arg filter The filter to add to
+ * @arg hk The hashed key to add
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if
+ * the sparse set is full, see bf_sparse_grow. Negative on failure.
+ */
+int bf_add_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    return filter->ops->add(filter, hk);
+}
+
+/**
+ * Checks the filter for a key, reusing the hashes
+ * cached from previous calls.
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    return filter->ops->contains(filter, hk);
+}
+
+/**
+ * Checks the filter for many keys at once. All the keys
+ * of a batch are hashed and their memory prefetched before
+ * any are tested, so the cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is present.
+ * Keys that already have a result of 1 are skipped, so results can be
+ * accumulated across several filters.
+ * @returns 0 on success, negative on error.
+ */
+int bf_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys, char *result) {
+    return filter->ops->contains_many(filter, keys, num_keys, result);
+}
+
+// Adds a key to a filter of any layout and k_num
+static int bf_generic_add(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    // Allocate the hash space
+    uint32_t num_hashes = bf_num_hashes(filter);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+
+    // Derive the hashes and turn them into probes
+    bf_derive_hashes(hk, filter->header->hash_scheme, num_hashes, hashes);
+    bf_compute_probes(filter, hashes);
+    return bf_internal_add(filter, hashes);
+}
+
+// Checks a filter of any layout and k_num for a key
+static int bf_generic_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    // Allocate the hash space
+    uint32_t num_hashes = bf_num_hashes(filter);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+
+    // Derive the hashes and turn them into probes
+    bf_derive_hashes(hk, filter->header->hash_scheme, num_hashes, hashes);
+    bf_compute_probes(filter, hashes);
+    return bf_internal_contains(filter, hashes);
+}
+
+// Checks a filter of any layout and k_num for a batch of keys
+static int bf_generic_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result) {
+    // Allocate the hash space for a batch
+    uint32_t num_hashes = bf_num_hashes(filter);
+    uint64_t *hashes = alloca(BLOOM_BATCH_SIZE * num_hashes * sizeof(uint64_t));
+
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Hash everything and start the loads
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            uint64_t *probes = hashes + i * num_hashes;
+            bf_derive_hashes(keys + base + i, filter->header->hash_scheme, num_hashes, probes);
+            bf_compute_probes(filter, probes);
+            bf_prefetch_probes(filter, probes);
+        }
+
+        // Resolve the batch
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            result[base+i] = bf_internal_contains(filter, hashes + i * num_hashes);
+        }
+    }
+    return 0;
+}
+
+/*
+ * The partitioned layout has probe functions specialized for
+ * each k_num from BLOOM_MIN_UNROLLED_K to BLOOM_MAX_UNROLLED_K,
+ * the values our probabilities produce. With k_num known at
+ * compile time, the hashes live in a fixed array the compiler
+ * keeps in registers, and the loops over the probes are fully
+ * unrolled. Other filters use the generic functions.
+ */
+#define BLOOM_MIN_UNROLLED_K 7
+#define BLOOM_MAX_UNROLLED_K 20
+
+static const struct bloom_probe_ops GENERIC_OPS = {
+    bf_generic_add, bf_generic_contains, bf_generic_contains_many
+};
+
+static const struct bloom_probe_ops SPARSE_OPS = {
+    bf_sparse_add, bf_sparse_contains, bf_sparse_contains_many
+};
+
+static const struct bloom_probe_ops SHORT_OPS = {
+    bf_short_add, bf_short_contains, bf_short_contains_many
+};
+
+/**
+ * Computes the probes of a key in the partitioned layout,
+ * like bf_derive_hashes and bf_compute_probes, for a k_num
+ * that is a constant once inlined.
+ */
+static inline __attribute__((always_inline)) void bf_partitioned_probes(bloom_bloomfilter *filter,
+        bloom_hashed_key *hk, const uint32_t k, uint64_t *probes) {
+    uint64_t *base = bf_base_hashes(hk, filter->header->hash_scheme);
+    probes[0] = base[0];
+    probes[1] = base[1];
+    if (filter->header->hash_scheme != BLOOM_HASH_LEGACY) {
+        uint64_t step = ((probes[0] << 32) | (probes[0] >> 32)) | 1;
+        #pragma GCC unroll 32
+        for (uint32_t i=2; i < k; i++) {
+            probes[i] = probes[1] + (i - 1) * step;
+        }
+    } else {
+        if (!hk->has_spooky) {
+            SpookyHash128(hk->key, hk->len, 0, 0, hk->spooky, hk->spooky+1);
+            hk->has_spooky = 1;
+        }
+        probes[2] = hk->spooky[0];
+        probes[3] = hk->spooky[1];
+        #pragma GCC unroll 32
+        for (uint32_t i=4; i < k; i++) {
+            probes[i] = probes[1] + ((i * probes[3]) % 18446744073709551557U);
+        }
+    }
+
+    uint64_t offset = 8*sizeof(bloom_filter_header);
+    uint64_t m = filter->offset;
+    if (filter->header->reduction == BLOOM_REDUCE_MULTIPLY) {
+        #pragma GCC unroll 32
+        for (uint32_t i=0; i < k; i++) {
+            probes[i] = offset + i * m + (uint64_t)(((__uint128_t)probes[i] * m) >> 64);
+        }
+    } else {
+        #pragma GCC unroll 32
+        for (uint32_t i=0; i < k; i++) {
+            probes[i] = offset + i * m + probes[i] % m;
+        }
+    }
+}
+
+// Tests the probes of the partitioned layout
+static inline __attribute__((always_inline)) int bf_partitioned_test(bloom_bloomfilter *filter,
+        const uint32_t k, uint64_t *probes) {
+    unsigned char *mmap = filter->map->mmap;
+    int present = 1;
+    #pragma GCC unroll 32
+    for (uint32_t i=0; i < k; i++) {
+        present &= (mmap[probes[i] >> 3] >> (7 - (probes[i] % 8)));
+    }
+    return present & 1;
+}
+
+static inline __attribute__((always_inline)) int bf_partitioned_add(bloom_bloomfilter *filter,
+        bloom_hashed_key *hk, const uint32_t k) {
+    uint64_t probes[BLOOM_MAX_UNROLLED_K];
+    bf_partitioned_probes(filter, hk, k, probes);
+    if (bf_partitioned_test(filter, k, probes)) return 0;
+    #pragma GCC unroll 32
+    for (uint32_t i=0; i < k; i++) {
+        bitmap_setbit(filter->map, probes[i]);
+    }
+    __atomic_fetch_add(&filter->header->count, 1, __ATOMIC_RELAXED);
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
+
+static inline __attribute__((always_inline)) int bf_partitioned_contains(bloom_bloomfilter *filter,
+        bloom_hashed_key *hk, const uint32_t k) {
+    uint64_t probes[BLOOM_MAX_UNROLLED_K];
+    bf_partitioned_probes(filter, hk, k, probes);
+    return bf_partitioned_test(filter, k, probes);
+}
+
+static inline __attribute__((always_inline)) int bf_partitioned_contains_many(bloom_bloomfilter *filter,
+        bloom_hashed_key *keys, int num_keys, char *result, const uint32_t k) {
+    uint64_t probes[BLOOM_BATCH_SIZE][BLOOM_MAX_UNROLLED_K];
+    unsigned char *mmap = filter->map->mmap;
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Hash everything and start the loads
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            bf_partitioned_probes(filter, keys + base + i, k, probes[i]);
+            #pragma GCC unroll 32
+            for (uint32_t j=0; j < k; j++) {
+                __builtin_prefetch(mmap + (probes[i][j] >> 3));
+            }
+        }
+
+        // Resolve the batch
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            result[base+i] = bf_partitioned_test(filter, k, probes[i]);
+        }
+    }
+    return 0;
+}
+
+#define BLOOM_UNROLLED_OPS(K) \
+    static int bf_add_k##K(bloom_bloomfilter *filter, bloom_hashed_key *hk) { \
+        return bf_partitioned_add(filter, hk, K); \
+    } \
+    static int bf_contains_k##K(bloom_bloomfilter *filter, bloom_hashed_key *hk) { \
+        return bf_partitioned_contains(filter, hk, K); \
+    } \
+    static int bf_contains_many_k##K(bloom_bloomfilter *filter, bloom_hashed_key *keys, \
+            int num_keys, char *result) { \
+        return bf_partitioned_contains_many(filter, keys, num_keys, result, K); \
+    }
+
+BLOOM_UNROLLED_OPS(7)
+BLOOM_UNROLLED_OPS(8)
+BLOOM_UNROLLED_OPS(9)
+BLOOM_UNROLLED_OPS(10)
+BLOOM_UNROLLED_OPS(11)
+BLOOM_UNROLLED_OPS(12)
+BLOOM_UNROLLED_OPS(13)
+BLOOM_UNROLLED_OPS(14)
+BLOOM_UNROLLED_OPS(15)
+BLOOM_UNROLLED_OPS(16)
+BLOOM_UNROLLED_OPS(17)
+BLOOM_UNROLLED_OPS(18)
+BLOOM_UNROLLED_OPS(19)
+BLOOM_UNROLLED_OPS(20)
+
+#define UNROLLED_OPS_ENTRY(K) {bf_add_k##K, bf_contains_k##K, bf_contains_many_k##K}
+static const struct bloom_probe_ops UNROLLED_OPS[] = {
+    UNROLLED_OPS_ENTRY(7), UNROLLED_OPS_ENTRY(8), UNROLLED_OPS_ENTRY(9),
+    UNROLLED_OPS_ENTRY(10), UNROLLED_OPS_ENTRY(11), UNROLLED_OPS_ENTRY(12),
+    UNROLLED_OPS_ENTRY(13), UNROLLED_OPS_ENTRY(14), UNROLLED_OPS_ENTRY(15),
+    UNROLLED_OPS_ENTRY(16), UNROLLED_OPS_ENTRY(17), UNROLLED_OPS_ENTRY(18),
+    UNROLLED_OPS_ENTRY(19), UNROLLED_OPS_ENTRY(20),
+};
+
+/**
+ * Chooses the probe functions of a filter from its layout and k_num.
+ * @arg filter The filter, with its header set up
+ */
+static void bf_select_ops(bloom_bloomfilter *filter) {
+    uint32_t k = filter->header->k_num;
+    if (filter->header->sparse_slots) {
+        filter->ops = &SPARSE_OPS;
+    } else if (filter->header->layout == BLOOM_LAYOUT_PARTITIONED &&
+            filter->header->hash_scheme == BLOOM_HASH_SHORT) {
+        filter->ops = &SHORT_OPS;
+    } else if (filter->header->layout == BLOOM_LAYOUT_PARTITIONED &&
+            k >= BLOOM_MIN_UNROLLED_K && k <= BLOOM_MAX_UNROLLED_K) {
+        filter->ops = &UNROLLED_OPS[k - BLOOM_MIN_UNROLLED_K];
+    } else {
+        filter->ops = &GENERIC_OPS;
+    }
+}
+
+/*
+ * Filters of the partitioned layout using the short scheme
+ * generate each probe from the base hashes as it is tested,
+ * like bf_derive_hashes and bf_compute_probes would, without
+ * an array of hashes. A check stops at the first clear bit, so
+ * most keys that are not present touch a single cache line, and
+ * an add sets the bits from the first clear one onwards.
+ */
+
+/**
+ * Walks the probes of a key, stopping at the first clear bit.
+ * @arg filter The filter
+ * @arg base The base hashes of the key
+ * @arg set If set, the bits from the first clear one are set
+ * @return 1 if every bit was already set, 0 otherwise.
+ */
+static inline __attribute__((always_inline)) int bf_short_probe(bloom_bloomfilter *filter,
+        const uint64_t *base, int set) {
+    unsigned char *mmap = filter->map->mmap;
+    uint32_t k = filter->header->k_num;
+    uint64_t m = filter->offset;
+    uint64_t offset = 8*sizeof(bloom_filter_header);
+    uint64_t step = ((base[0] << 32) | (base[0] >> 32)) | 1;
+    uint64_t h = base[0], next = base[1];
+    int multiply = filter->header->reduction == BLOOM_REDUCE_MULTIPLY;
+    uint32_t i = 0;
+    for (; i < k; i++, offset += m, h = next, next += step) {
+        uint64_t bit = offset + ((multiply) ? (uint64_t)(((__uint128_t)h * m) >> 64) : h % m);
+        if (!((mmap[bit >> 3] >> (7 - (bit % 8))) & 1)) break;
+    }
+    if (i == k) return 1;
+    if (!set) return 0;
+    for (; i < k; i++, offset += m, h = next, next += step) {
+        uint64_t bit = offset + ((multiply) ? (uint64_t)(((__uint128_t)h * m) >> 64) : h % m);
+        bitmap_setbit(filter->map, bit);
+    }
+    return 0;
+}
+
+static int bf_short_add(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    uint64_t *base = bf_base_hashes(hk, BLOOM_HASH_SHORT);
+    if (bf_short_probe(filter, base, 1)) return 0;
+    __atomic_fetch_add(&filter->header->count, 1, __ATOMIC_RELAXED);
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
+
+static int bf_short_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    return bf_short_probe(filter, bf_base_hashes(hk, BLOOM_HASH_SHORT), 0);
+}
+
+static int bf_short_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result) {
+    unsigned char *mmap = filter->map->mmap;
+    uint64_t m = filter->offset;
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Hash everything and start the load of the first probe,
+        // which is all that most of the missing keys need
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            uint64_t *hashes = bf_base_hashes(keys + base + i, BLOOM_HASH_SHORT);
+            uint64_t bit = 8*sizeof(bloom_filter_header) + bf_reduce(filter, hashes[0], m);
+            __builtin_prefetch(mmap + (bit >> 3));
+        }
+
+        // Resolve the batch, the hashes are cached in the keys
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            result[base+i] = bf_short_probe(filter, bf_base_hashes(keys + base + i, BLOOM_HASH_SHORT), 0);
+        }
+    }
+    return 0;
+}
+
+/*
+ * A sparse set keeps each set bit as its position plus one, so
+ * an empty slot is zero, in an open addressed table with linear
+ * probing. Adds reserve their slots in sparse_used first, and are
+ * refused once the table would be 3/4 full, so a probe always finds
+ * an empty slot. Slots are only filled with a compare and swap,
+ * which keeps adds and checks safe to run concurrently.
+ */
+
+/**
+ * Returns the sparse set at the end of the bitmap of a filter.
+ */
+static inline uint64_t* bf_sparse_table(bloom_bloomfilter *filter) {
+    return (uint64_t*)(filter->map->mmap + filter->map->size - filter->header->sparse_bytes);
+}
+
+/**
+ * Returns the home slot of a position, by multiply-shift
+ * of the scrambled position onto the slots.
+ */
+static inline uint64_t bf_sparse_slot(uint64_t pos, uint64_t slots) {
+    return (uint64_t)(((__uint128_t)(pos * 0x9E3779B97F4A7C15ULL) * slots) >> 64);
+}
+
+/**
+ * Returns the most positions a sparse set of the given slots holds.
+ */
+static inline uint64_t bf_sparse_limit(uint64_t slots) {
+    return slots / 4 * 3;
+}
+
+/**
+ * Returns the bytes kept for the sparse set of a filter with
+ * the given bytes of bits, about a sixteenth of them in a power
+ * of two number of slots. 0 if the filter is too small.
+ */
+static uint64_t bf_sparse_reserve(uint64_t bits_bytes) {
+    if (bits_bytes < BLOOM_SPARSE_MIN_BYTES) return 0;
+    uint64_t slots = BLOOM_SPARSE_MIN_SLOTS;
+    while (slots * 2 <= bits_bytes / 128) slots *= 2;
+    return slots * 8;
+}
+
+/**
+ * Returns the bytes at the end of a new filter of the given size
+ * that are kept for its sparse set, see bf_params_for_capacity_format.
+ * @arg bytes The size of the filter, including the header
+ * @arg format The format of the filter, NULL for the default format.
+ * @return The bytes of the sparse set, 0 if the filter is dense.
+ */
+uint64_t bf_sparse_bytes(uint64_t bytes, bloom_filter_format *format) {
+    if (!format || !format->sparse || bytes % 8 || bytes <= sizeof(bloom_filter_header)) return 0;
+    if (format->layout != BLOOM_LAYOUT_PARTITIONED && format->layout != BLOOM_LAYOUT_BLOCKED) return 0;
+
+    // The size is the bits plus their reserve, and only one
+    // power of two reserve adds up to it
+    uint64_t bits_bytes = bytes - sizeof(bloom_filter_header);
+    for (uint64_t reserve = bf_sparse_reserve(bits_bytes); reserve; reserve /= 2) {
+        if (reserve < bits_bytes && bf_sparse_reserve(bits_bytes - reserve) == reserve) return reserve;
+        if (reserve == BLOOM_SPARSE_MIN_SLOTS * 8) break;
+    }
+    return 0;
+}
+
+/**
+ * Returns if the bits of a filter are still kept in its sparse set.
+ * @arg filter The filter
+ * @return 1 if the filter is sparse, 0 otherwise.
+ */
+int bf_is_sparse(bloom_bloomfilter *filter) {
+    return __atomic_load_n(&filter->header->sparse_slots, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * Computes the bit positions a key sets in a sparse filter.
+ * @arg filter The filter
+ * @arg hk The hashed key
+ * @arg positions Output, has space for bf_num_hashes values
+ * @return The number of positions, k_num
+ */
+static uint32_t bf_sparse_positions(bloom_bloomfilter *filter, bloom_hashed_key *hk, uint64_t *positions) {
+    uint32_t k = filter->header->k_num;
+    bf_derive_hashes(hk, filter->header->hash_scheme, bf_num_hashes(filter), positions);
+    bf_compute_probes(filter, positions);
+    if (filter->header->layout == BLOOM_LAYOUT_BLOCKED) {
+        // The bits of a block are relative to the block
+        uint64_t block = positions[0];
+        for (uint32_t i=0; i < k; i++) positions[i] = block + positions[i+1];
+    }
+    return k;
+}
 
 /**
- * Creates a new bloom filter using a given bitmap and k-value.
- * @arg map A bloom_bitmap pointer.
- * @arg k_num The number of hash functions to use. Ignored if the header value is different.
- * @arg new_filter 1 if new, sets the magic byte and does not check it.
- * @arg filter The filter to setup
- * @return 0 for success. Negative for error.
+ * Adds a position to a sparse set.
+ * @return 1 if it was added, 0 if present.
  */
-int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter) {
-    // Check our args
-    if (map == NULL || k_num < 1) {
+static int bf_sparse_insert(bloom_bloomfilter *filter, uint64_t *table, uint64_t slots, uint64_t pos) {
+    uint64_t slot = bf_sparse_slot(pos, slots);
+    for (;;) {
+        uint64_t cur = __atomic_load_n(table + slot, __ATOMIC_ACQUIRE);
+        if (cur == pos + 1) return 0;
+        if (!cur) {
+            if (__atomic_compare_exchange_n(table + slot, &cur, pos + 1, 0,
+                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                bitmap_dirtybit(filter->map, 8 * ((unsigned char*)(table + slot) - filter->map->mmap));
+                return 1;
+            }
+            if (cur == pos + 1) return 0;
+        }
+        slot = (slot + 1) & (slots - 1);
+    }
+}
+
+/**
+ * Checks for a position in a sparse set.
+ * @return 1 if present, 0 otherwise.
+ */
+static int bf_sparse_has(uint64_t *table, uint64_t slots, uint64_t pos) {
+    uint64_t slot = bf_sparse_slot(pos, slots);
+    for (;;) {
+        uint64_t cur = __atomic_load_n(table + slot, __ATOMIC_ACQUIRE);
+        if (cur == pos + 1) return 1;
+        if (!cur) return 0;
+        slot = (slot + 1) & (slots - 1);
+    }
+}
+
+// Adds a key to a sparse filter, if its set has room
+static int bf_sparse_add(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    bloom_filter_header *header = filter->header;
+    uint64_t slots = __atomic_load_n(&header->sparse_slots, __ATOMIC_ACQUIRE);
+    if (!slots) return bf_generic_add(filter, hk);
+    uint64_t *table = bf_sparse_table(filter);
+    uint64_t *positions = alloca(bf_num_hashes(filter) * sizeof(uint64_t));
+    uint32_t k = bf_sparse_positions(filter, hk, positions);
+
+    // Check if the item exists
+    uint32_t i = 0;
+    while (i < k && bf_sparse_has(table, slots, positions[i])) i++;
+    if (i == k) return 0;
+
+    // Reserve a slot for each position, and return the
+    // slots of the positions that were already set
+    uint64_t used = __atomic_fetch_add(&header->sparse_used, k, __ATOMIC_RELAXED);
+    if (used + k > bf_sparse_limit(slots)) {
+        __atomic_fetch_sub(&header->sparse_used, k, __ATOMIC_RELAXED);
+        return -EAGAIN;
+    }
+    uint32_t added = 0;
+    for (i=0; i < k; i++) {
+        added += bf_sparse_insert(filter, table, slots, positions[i]);
+    }
+    if (added < k) __atomic_fetch_sub(&header->sparse_used, k - added, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&header->count, 1, __ATOMIC_RELAXED);
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
+
+// Checks a sparse filter for a key
+static int bf_sparse_contains(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    uint64_t slots = __atomic_load_n(&filter->header->sparse_slots, __ATOMIC_ACQUIRE);
+    if (!slots) return bf_generic_contains(filter, hk);
+    uint64_t *table = bf_sparse_table(filter);
+    uint64_t *positions = alloca(bf_num_hashes(filter) * sizeof(uint64_t));
+    uint32_t k = bf_sparse_positions(filter, hk, positions);
+    for (uint32_t i=0; i < k; i++) {
+        if (!bf_sparse_has(table, slots, positions[i])) return 0;
+    }
+    return 1;
+}
+
+// Checks a sparse filter for a batch of keys. The set is
+// small enough to stay in cache, so nothing is prefetched.
+static int bf_sparse_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys,
+        char *result) {
+    for (int i=0; i < num_keys; i++) {
+        if (!result[i]) result[i] = bf_sparse_contains(filter, keys + i);
+    }
+    return 0;
+}
+
+/**
+ * Marks the pages of a byte range of a bitmap as dirty.
+ */
+static void bf_dirty_range(bloom_bitmap *map, uint64_t offset, uint64_t len) {
+    for (uint64_t off = offset & ~4095ULL; off < offset + len; off += 4096) {
+        bitmap_dirtybit(map, off * 8);
+    }
+}
+
+/**
+ * Makes room in the sparse set of a filter, which bf_add refuses
+ * to grow with -EAGAIN. The set is doubled, or once it would
+ * outgrow the space kept for it, its bits are moved into the
+ * bitmap, as with bf_densify.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @returns 0 on success, -EINVAL if the filter is not sparse.
+ */
+int bf_sparse_grow(bloom_bloomfilter *filter) {
+    bloom_filter_header *header = filter->header;
+    uint64_t slots = header->sparse_slots;
+    if (!slots) return -EINVAL;
+    if (slots * 2 * 8 > header->sparse_bytes) return bf_densify(filter);
+
+    // Take out the positions, and insert them into twice the slots
+    uint64_t *table = bf_sparse_table(filter);
+    uint64_t *old = malloc(slots * sizeof(uint64_t));
+    if (!old) return -ENOMEM;
+    memcpy(old, table, slots * sizeof(uint64_t));
+    memset(table, 0, slots * sizeof(uint64_t));
+    for (uint64_t i=0; i < slots; i++) {
+        if (old[i]) bf_sparse_insert(filter, table, slots * 2, old[i] - 1);
+    }
+    free(old);
+    bf_dirty_range(filter->map, (unsigned char*)table - filter->map->mmap, slots * sizeof(uint64_t));
+    __atomic_store_n(&header->sparse_slots, slots * 2, __ATOMIC_RELEASE);
+    bitmap_dirtybit(filter->map, 0);
+    return 0;
+}
+
+/**
+ * Moves the bits of a sparse filter into its bitmap, so it is
+ * used like any other filter. Does nothing if it is not sparse.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @returns 0 on success, negative on failure.
+ */
+int bf_densify(bloom_bloomfilter *filter) {
+    bloom_filter_header *header = filter->header;
+    uint64_t slots = header->sparse_slots;
+    if (!slots) return 0;
+    if (filter->map->mode & READ_ONLY) return -EINVAL;
+
+    // The bits are set before the set is dropped, so a reader
+    // of the file in another process finds the key either way
+    uint64_t *table = bf_sparse_table(filter);
+    for (uint64_t i=0; i < slots; i++) {
+        if (table[i]) bitmap_setbit(filter->map, table[i] - 1);
+    }
+    __atomic_store_n(&header->sparse_slots, 0, __ATOMIC_RELEASE);
+    header->sparse_used = 0;
+    header->fill_stamp = 0;
+    bitmap_dirtybit(filter->map, 0);
+
+    // Clear the set, whose pages PERSISTENT bitmaps then punch out
+    memset(table, 0, slots * sizeof(uint64_t));
+    bf_dirty_range(filter->map, (unsigned char*)table - filter->map->mmap, slots * sizeof(uint64_t));
+    bf_select_ops(filter);
+    return 0;
+}
+
+/**
+ * Removes a key from a filter using the BLOOM_LAYOUT_COUNTING
+ * layout, by decrementing each of its counters. Safe to call
+ * concurrently with bf_add and bf_contains calls. A counting
+ * filter counts every bf_add of a key, so a key must be removed
+ * as many times as it was added. Removing a false positive that
+ * was never added may cause false negatives for other keys.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove(bloom_bloomfilter *filter, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return bf_remove_hashed(filter, &hk);
+}
+
+/**
+ * Removes a key from a counting filter, reusing the
+ * hashes cached from previous calls.
+ * @arg filter The filter to remove from
+ * @arg hk The hashed key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk) {
+    int dropped;
+    return bf_remove_counted(filter, hk, &dropped);
+}
+
+/**
+ * Removes a key from a counting filter like bf_remove_hashed,
+ * and tells if the count of the filter dropped, which it only
+ * does once the last add of the key is removed.
+ * @arg filter The filter to remove from
+ * @arg hk The hashed key to remove
+ * @arg dropped Output, set to 1 if the count dropped
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove_counted(bloom_bloomfilter *filter, bloom_hashed_key *hk, int *dropped) {
+    *dropped = 0;
+    if (filter->header->layout != BLOOM_LAYOUT_COUNTING) {
         return -EINVAL;
     }
 
-    // Check the size of the map
-    if (map->size < sizeof(bloom_filter_header)) {
-        return -ENOMEM;
+    // Allocate the hash space
+    uint32_t num_hashes = bf_num_hashes(filter);
+    uint64_t *hashes = alloca(num_hashes * sizeof(uint64_t));
+
+    // Derive the hashes and turn them into probes
+    bf_derive_hashes(hk, filter->header->hash_scheme, num_hashes, hashes);
+    bf_compute_probes(filter, hashes);
+    if (!bf_counters_contain(filter, hashes)) {
+        return 0;
     }
+    bf_counters_update(filter, hashes, -1);
 
-    // Setup the pointers
-    filter->map = map;
-    filter->header = (bloom_filter_header*)map->mmap;
+    // The count only tracks the keys that are present, so leave
+    // it if the key was added more than once. Otherwise drop it,
+    // without wrapping if removals race.
+    if (bf_counters_contain(filter, hashes)) return 1;
+    uint64_t count = __atomic_load_n(&filter->header->count, __ATOMIC_RELAXED);
+    while (count && !(*dropped = __atomic_compare_exchange_n(&filter->header->count, &count, count - 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {}
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
 
-    // Get the bitmap size
-    filter->bitmap_size = (map->size - sizeof(bloom_filter_header)) * 8;
+/**
+ * Merges another filter into this one, so it has the keys of
+ * either filter for a union, or of both for an intersection.
+ * The filters must have the same size, k_num and format.
+ * Counting and aging filters can not be merged, since their
+ * slots are not combined by bit operations. The count becomes
+ * the most keys the merged filter can have.
+ * @arg filter The filter to merge into
+ * @arg other The filter to merge, which is not changed
+ * @arg intersect 1 to intersect the filters, 0 for a union
+ * @returns 0 on success, -EINVAL if the filters differ.
+ */
+int bf_merge(bloom_bloomfilter *filter, bloom_bloomfilter *other, int intersect) {
+    bloom_filter_header *header = filter->header;
+    bloom_filter_header *other_header = other->header;
+    if (filter->map->size != other->map->size ||
+            header->k_num != other_header->k_num ||
+            header->layout != other_header->layout ||
+            header->hash_scheme != other_header->hash_scheme ||
+            header->reduction != other_header->reduction ||
+            header->layout == BLOOM_LAYOUT_COUNTING ||
+            header->layout == BLOOM_LAYOUT_AGING ||
+            filter->bitmap_size != other->bitmap_size) {
+        return -EINVAL;
+    }
 
-    // Setup the header if it is new
-    if (new_filter) {
-        filter->header->magic = MAGIC_HEADER;
-        filter->header->k_num = k_num;
-        filter->header->count = 0;
+    // The bits of a sparse filter are only in its set
+    int res = bf_densify(filter);
+    if (res) return res;
+    if (bf_is_sparse(other)) {
+        res = bf_merge_sparse(filter, other, intersect);
+    } else {
+        // The header is not part of the bits
+        res = bitmap_merge(filter->map, other->map, sizeof(bloom_filter_header),
+                (intersect) ? BITMAP_MERGE_AND : BITMAP_MERGE_OR);
+    }
+    if (res) return res;
 
-        // Since this is a new filter, force a flush of
-        // the headers. This mainly affects bitmaps that
-        // are in the PERSIST mode. Since no flush happens
-        // until the first key is set, it can cause filters
-        // to be created that have no headers, and thus cannot
-        // be loaded.
-        bf_flush(filter);
+    if (intersect) {
+        if (other_header->count < header->count) header->count = other_header->count;
+    } else {
+        header->count += other_header->count;
+    }
+    header->fill_stamp = 0;
+    bitmap_dirtybit(filter->map, 0);
+    return 0;
+}
 
-    // Check for the header if not new
-    } else if (filter->header->magic != MAGIC_HEADER) {
-        syslog(LOG_ERR, "Magic byte for bloom filter is wrong! Aborting load.");
-        return -1;
+/**
+ * Merges a range of the bitmap of a copy of a filter into it, such
+ * as the pages of the copy that changed, so it has the keys of
+ * either. A range covering the header must cover all of it, and the
+ * header of the copy must match the filter, whose count becomes the
+ * larger of the two. The copy must not be sparse, while a sparse
+ * filter is densified first. Counting and aging filters can not be
+ * merged, since their slots are not combined by bit operations.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter to merge into
+ * @arg offset The first byte of the range, a multiple of 8
+ * @arg data The bytes of the copy in the range
+ * @arg len The length of the range
+ * @returns 0 on success, -EINVAL if the range or the header
+ * does not fit the filter, negative on other failures.
+ */
+int bf_merge_bytes(bloom_bloomfilter *filter, uint64_t offset, const unsigned char *data, uint64_t len) {
+    bloom_filter_header *header = filter->header;
+    uint64_t start = sizeof(bloom_filter_header);
+    if (header->layout == BLOOM_LAYOUT_COUNTING || header->layout == BLOOM_LAYOUT_AGING ||
+            offset > filter->map->size || len > filter->map->size - offset ||
+            (offset < start && (offset || len < start))) {
+        return -EINVAL;
     }
 
-    // Setup the offset
-    filter->offset = filter->bitmap_size / filter->header->k_num;
+    // The header is not part of the bits
+    bloom_filter_header other;
+    uint64_t count = 0;
+    if (!offset) {
+        memcpy(&other, data, start);
+        if (other.magic != header->magic || other.k_num != header->k_num ||
+                other.layout != header->layout || other.hash_scheme != header->hash_scheme ||
+                other.reduction != header->reduction || other.sparse_slots) {
+            return -EINVAL;
+        }
+        count = other.count;
+        data += start;
+        offset = start;
+        len -= start;
+    }
 
-    // Done, return
+    int res = bf_densify(filter);
+    if (!res) res = bitmap_or_bytes(filter->map, offset, data, len);
+    if (res) return res;
+    if (count > header->count) header->count = count;
+    header->fill_stamp = 0;
+    bitmap_dirtybit(filter->map, 0);
     return 0;
 }
 
+/**
+ * Merges a sparse filter into a dense one, by setting the
+ * positions of its set for a union, or clearing the bits that
+ * are not in its set for an intersection.
+ * @return 0 on success, negative on failure.
+ */
+static int bf_merge_sparse(bloom_bloomfilter *filter, bloom_bloomfilter *other, int intersect) {
+    if (filter->map->mode & READ_ONLY) return -EINVAL;
+    uint64_t slots = other->header->sparse_slots;
+    uint64_t *table = bf_sparse_table(other);
+    if (!intersect) {
+        for (uint64_t i=0; i < slots; i++) {
+            uint64_t pos = __atomic_load_n(table + i, __ATOMIC_RELAXED);
+            if (pos) bitmap_setbit(filter->map, pos - 1);
+        }
+        return 0;
+    }
+
+    // Most of the bits are clear, so skip by words
+    unsigned char *bits = filter->map->mmap + sizeof(bloom_filter_header);
+    uint64_t len = filter->bitmap_size / 8;
+    for (uint64_t i=0; i < len; i++) {
+        if (i % 8 == 0 && i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, bits + i, sizeof(word));
+            if (!word) {
+                i += 7;
+                continue;
+            }
+        }
+        if (!bits[i]) continue;
+        unsigned char byte = bits[i];
+        for (int j=0; j < 8; j++) {
+            uint64_t pos = 8 * (sizeof(bloom_filter_header) + i) + j;
+            if ((byte & (0x80 >> j)) && !bf_sparse_has(table, slots, pos)) byte &= ~(0x80 >> j);
+        }
+        if (byte != bits[i]) {
+            bits[i] = byte;
+            bitmap_dirtybit(filter->map, 8 * (sizeof(bloom_filter_header) + i));
+        }
+    }
+    return 0;
+}
 
 /**
- * Internal bf_contains method.
+ * Returns the size of a filter folded onto itself, see bf_fold.
+ * A fold halves the bits of each partition, or the blocks, so
+ * the filter must have a power of two multiple of them, and the
+ * folded size must give back exactly the folded partitions.
  * @arg filter The filter
- * @arg key The key to check
- * @arg hashes Contains at least K num hashes
- * @return 0 if not contained, 1 if contained.
+ * @arg folds The number of times to halve the filter
+ * @return The bytes of the folded filter, including the
+ * header. 0 if the filter can not be folded that far.
  */
-static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
-    int res;
-
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        res = bitmap_getbit(filter->map, bit);
-        if (res == 0) {
-            return 0;
-        }
+uint64_t bf_fold_size(bloom_bloomfilter *filter, uint32_t folds) {
+    bloom_filter_header *header = filter->header;
+    if (folds >= 64) return 0;
+    uint64_t parts = 1ULL << folds;
+    if (header->layout == BLOOM_LAYOUT_BLOCKED) {
+        if (filter->num_blocks % parts) return 0;
+        return sizeof(bloom_filter_header) + (filter->num_blocks / parts) * BLOOM_BLOCK_BYTES;
     }
-    return 1;
+    if (header->layout != BLOOM_LAYOUT_PARTITIONED || filter->offset % parts) return 0;
+
+    // The partitions are found again from the size, so the
+    // bytes rounded up must not fit another bit per partition
+    uint64_t m = filter->offset / parts;
+    if (!m) return 0;
+    uint64_t bytes = (header->k_num * m + 7) / 8;
+    if (bytes * 8 / header->k_num != m) return 0;
+    return sizeof(bloom_filter_header) + bytes;
 }
 
+/**
+ * Folds a filter onto a bitmap that is 2^folds times smaller,
+ * by OR-ing the bits that the hashes of a key reduce to in the
+ * folded filter. The folded filter has every key of the filter,
+ * the same k_num and format, and the false positives of the
+ * filter with 2^folds times the keys. Only the partitioned and
+ * blocked layouts can be folded, and the folded filter is dense.
+ * @arg filter The filter to fold, which is not changed
+ * @arg folds The number of times to halve the filter
+ * @arg map A new bitmap of bf_fold_size bytes
+ * @arg out The folded filter to setup
+ * @returns 0 on success, -EINVAL if the filter can not be folded
+ * or the bitmap has the wrong size. Negative on other failures.
+ */
+int bf_fold(bloom_bloomfilter *filter, uint32_t folds, bloom_bitmap *map, bloom_bloomfilter *out) {
+    bloom_filter_header *header = filter->header;
+    uint64_t bytes = bf_fold_size(filter, folds);
+    if (!bytes || map->size != bytes) return -EINVAL;
+
+    bloom_filter_format format = {
+        .layout = header->layout,
+        .hash_scheme = header->hash_scheme,
+        .reduction = header->reduction,
+    };
+    int res = bf_from_bitmap_format(map, header->k_num, &format, 1, out);
+    if (res) return res;
+
+    bf_fold_bits(filter, folds, out);
+    out->header->count = header->count;
+    out->header->fill_stamp = 0;
+    bitmap_dirtybit(map, 0);
+    return 0;
+}
 
 /**
- * Adds a new key to the bloom filter.
- * @arg filter The filter to add to
- * @arg key The key to add
- * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * Returns the position a bit of a filter folds onto. A modulo
+ * reduction onto half the range takes the position modulo the
+ * half, and a multiply-shift reduction halves the position.
  */
-int bf_add(bloom_bloomfilter *filter, char* key) {
-    // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+static uint64_t bf_fold_pos(bloom_bloomfilter *filter, uint32_t folds, uint64_t pos) {
+    uint64_t start = 8*sizeof(bloom_filter_header);
+    uint64_t m, unit;
+    if (filter->header->layout == BLOOM_LAYOUT_BLOCKED) {
+        m = filter->num_blocks;
+        unit = BLOOM_BLOCK_BITS;
+    } else {
+        m = filter->offset;
+        unit = 1;
+    }
+    uint64_t rel = pos - start;
+    uint64_t part = rel / unit / m;
+    uint64_t r = rel / unit % m;
+    uint64_t folded = m >> folds;
+    r = (filter->header->reduction == BLOOM_REDUCE_MULTIPLY) ? r >> folds : r % folded;
+    return start + (part * folded + r) * unit + rel % unit;
+}
+
+/**
+ * ORs bytes into a bitmap, only writing and dirtying the
+ * pages of the bitmap that a set bit is OR-ed into. Most of
+ * an oversized filter is clear, and stays a hole in its file.
+ */
+static void bf_fold_or(bloom_bitmap *map, uint64_t offset, const unsigned char *src, uint64_t len) {
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t end = ((offset + done) & ~4095ULL) + 4096 - offset;
+        if (end > len) end = len;
+
+        unsigned char any = 0;
+        for (uint64_t i=done; i < end; i++) any |= src[i];
+        if (any) {
+            unsigned char *dst = map->mmap + offset;
+            for (uint64_t i=done; i < end; i++) dst[i] |= src[i];
+            bitmap_dirtybit(map, (offset + done) * 8);
+        }
+        done = end;
+    }
+}
 
-    // Compute the hashes
-    bf_compute_hashes(filter->header->k_num, key, hashes);
+/**
+ * Sets the bits of a filter in the filter it is folded onto.
+ * Where the folded ranges fall on whole bytes, they are OR-ed
+ * a page at a time in loops the compiler vectorizes. Otherwise,
+ * or if the filter is sparse, each set bit is moved.
+ */
+static void bf_fold_bits(bloom_bloomfilter *filter, uint32_t folds, bloom_bloomfilter *out) {
+    bloom_filter_header *header = filter->header;
+    uint64_t start = sizeof(bloom_filter_header);
+    unsigned char *bits = filter->map->mmap;
+    uint64_t parts = 1ULL << folds;
 
-    // Check if the item exists
-    int res = bf_internal_contains(filter, hashes);
-    if (res == 1) {
-        return 0;  // Key already present, do not add.
+    if (bf_is_sparse(filter)) {
+        uint64_t slots = header->sparse_slots;
+        uint64_t *table = bf_sparse_table(filter);
+        for (uint64_t i=0; i < slots; i++) {
+            if (table[i]) bitmap_setbit(out->map, bf_fold_pos(filter, folds, table[i] - 1));
+        }
+        return;
     }
 
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
+    if (header->layout == BLOOM_LAYOUT_BLOCKED && header->reduction == BLOOM_REDUCE_MULTIPLY) {
+        // Neighbouring blocks share a folded block
+        for (uint64_t b=0; b < filter->num_blocks; b++) {
+            bf_fold_or(out->map, start + (b >> folds) * BLOOM_BLOCK_BYTES,
+                    bits + start + b * BLOOM_BLOCK_BYTES, BLOOM_BLOCK_BYTES);
+        }
+        return;
+    }
 
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        bitmap_setbit(filter->map, bit);
+    // Each part of a partition or of the blocks is OR-ed onto the first
+    uint64_t m = (header->layout == BLOOM_LAYOUT_BLOCKED) ?
+        filter->num_blocks * BLOOM_BLOCK_BITS : filter->offset;
+    uint32_t k = (header->layout == BLOOM_LAYOUT_BLOCKED) ? 1 : header->k_num;
+    uint64_t folded = m / parts;
+    if (header->reduction == BLOOM_REDUCE_MODULO && folded % 8 == 0) {
+        for (uint32_t i=0; i < k; i++) {
+            for (uint64_t j=0; j < parts; j++) {
+                bf_fold_or(out->map, start + i * folded / 8,
+                        bits + start + (i * m + j * folded) / 8, folded / 8);
+            }
+        }
+        return;
+    }
+
+    // Most of the bits are clear, so skip by words
+    uint64_t len = (k * m + 7) / 8;
+    for (uint64_t i=0; i < len; i++) {
+        if (i % 8 == 0 && i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, bits + start + i, sizeof(word));
+            if (!word) {
+                i += 7;
+                continue;
+            }
+        }
+        unsigned char byte = bits[start + i];
+        for (int j=0; byte && j < 8; j++) {
+            uint64_t pos = 8 * (start + i) + j;
+            if ((byte & (0x80 >> j)) && pos < 8 * start + k * m)
+                bitmap_setbit(out->map, bf_fold_pos(filter, folds, pos));
+        }
+    }
+}
+
+/**
+ * Advances the clock of a filter using the BLOOM_LAYOUT_AGING
+ * layout. Keys that were not set in the last age_ticks ticks
+ * expire, and their slots are cleared. The count becomes an
+ * estimate of the keys that are still live. The first call only
+ * sets the clock. Safe to call concurrently with bf_add and
+ * bf_contains calls, but not with another bf_age.
+ * @arg filter The filter
+ * @arg clock The current tick, which must not go backwards
+ * @returns 1 if the filter aged, 0 if the clock has not moved
+ * or the filter is read only, -EINVAL for other layouts.
+ */
+int bf_age(bloom_bloomfilter *filter, uint64_t clock) {
+    bloom_filter_header *header = filter->header;
+    if (header->layout != BLOOM_LAYOUT_AGING) return -EINVAL;
+    if (filter->map->mode & READ_ONLY || clock <= header->age_clock) return 0;
+    if (!header->age_clock) {
+        header->age_clock = clock;
+        bitmap_dirtybit(filter->map, 0);
+        return 0;
+    }
+
+    /*
+     * Move the tick first, so new stamps are not cleared below.
+     * A slot may look live until it is cleared, but only if it
+     * was live before, since stamps are at most ticks + step old.
+     * Past ticks everything has expired, so larger steps are cut.
+     */
+    unsigned char ticks = header->age_ticks;
+    uint64_t step = clock - header->age_clock;
+    if (step > (uint64_t)(255 - ticks)) step = 255 - ticks;
+    unsigned char now = (header->age_now - 1 + step) % 255 + 1;
+    __atomic_store_n(&header->age_now, now, __ATOMIC_RELEASE);
+    header->age_clock = clock;
+
+    // Clear the expired stamps, unless a key was set meanwhile.
+    // Most of an aging filter is usually empty, so skip by words.
+    unsigned char *stamps = filter->map->mmap + sizeof(bloom_filter_header);
+    uint64_t num_stamps = filter->num_blocks * BLOOM_BLOCK_STAMPS;
+    uint64_t live = 0;
+    for (uint64_t i=0; i < num_stamps; i += sizeof(uint64_t)) {
+        uint64_t word = __atomic_load_n((uint64_t*)(stamps + i), __ATOMIC_RELAXED);
+        if (!word) continue;
+        for (uint64_t j=i; j < i + sizeof(uint64_t); j++) {
+            unsigned char stamp = __atomic_load_n(stamps + j, __ATOMIC_RELAXED);
+            if (!stamp) continue;
+            if (bf_stamp_live(stamp, now, ticks) ||
+                    !__atomic_compare_exchange_n(stamps + j, &stamp, 0, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                live++;
+                continue;
+            }
+            bitmap_dirtybit(filter->map, 8 * (sizeof(bloom_filter_header) + j));
+        }
     }
 
-    filter->header->count += 1;
+    // Each key stamps about k of the slots at random, as in bf_fill
+    uint64_t keys = num_stamps;
+    if (live < num_stamps) {
+        keys = llround(-(double)num_stamps / header->k_num * log1p(-(double)live / num_stamps));
+    }
+    __atomic_store_n(&header->count, keys, __ATOMIC_RELAXED);
+    bitmap_dirtybit(filter->map, 0);
     return 1;
 }
 
 /**
- * Checks the filter for a key
- * @arg filter The filter to check
- * @arg key The key to check
- * @returns 1 if present, 0 if not present, negative on error.
+ * Estimates the keys in a filter and its current false
+ * positive probability from the bits that are set. The count
+ * of set bits is cached in the header, and only taken again
+ * once keys were added, so repeated calls are cheap.
+ * @arg filter The filter
+ * @arg fill Output, the fill of the filter
+ * @returns 0 on success, -EINVAL for the counting and aging
+ * layouts, which have counters or stamps instead of bits.
  */
-int bf_contains(bloom_bloomfilter *filter, char* key) {
-    // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+int bf_fill(bloom_bloomfilter *filter, bloom_filter_fill *fill) {
+    bloom_filter_header *header = filter->header;
+    if (header->layout == BLOOM_LAYOUT_COUNTING || header->layout == BLOOM_LAYOUT_AGING) return -EINVAL;
+    uint32_t k_num = header->k_num;
+    uint64_t bits = (header->layout == BLOOM_LAYOUT_PARTITIONED) ?
+        filter->offset * k_num : filter->num_blocks * BLOOM_BLOCK_BITS;
 
-    // Compute the hashes
-    bf_compute_hashes(filter->header->k_num, key, hashes);
+    // The stamp is stored after the bits, so a matching
+    // stamp always has the bits of its count
+    uint64_t count = __atomic_load_n(&header->count, __ATOMIC_RELAXED);
+    uint64_t set;
+    if (bf_is_sparse(filter)) {
+        // Every position in the set is a bit that is set
+        set = __atomic_load_n(&header->sparse_used, __ATOMIC_RELAXED);
+    } else if (__atomic_load_n(&header->fill_stamp, __ATOMIC_ACQUIRE) == count + 1) {
+        set = header->bits_set;
+    } else {
+        set = bitmap_popcount(filter->map, sizeof(bloom_filter_header), bits / 8);
+        if (!(filter->map->mode & READ_ONLY)) {
+            header->bits_set = set;
+            __atomic_store_n(&header->fill_stamp, count + 1, __ATOMIC_RELEASE);
+        }
+    }
 
-    // Use the internal contains method
-    return bf_internal_contains(filter, hashes);
+    // Each key sets about k of the bits at random, so the
+    // fraction still clear is exp(-kn/m)
+    fill->bits = bits;
+    fill->bits_set = set;
+    if (!bits) {
+        fill->keys = 0;
+        fill->fp_probability = 0;
+    } else if (set >= bits) {
+        fill->keys = bits;
+        fill->fp_probability = 1;
+    } else {
+        fill->keys = llround(-(double)bits / k_num * log1p(-(double)set / bits));
+        fill->fp_probability = pow((double)set / bits, k_num);
+    }
+    return 0;
 }
 
 /**
@@ -169,6 +1715,18 @@ int bf_flush(bloom_bloomfilter *filter) {
     return bitmap_flush(filter->map);
 }
 
+/**
+ * Writes back the filter like bf_flush, without
+ * waiting for it to be durable.
+ * @return 0 on success, negative on failure.
+ */
+int bf_write(bloom_bloomfilter *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_write(filter->map);
+}
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap,
  * but does not free it.
@@ -191,6 +1749,7 @@ int bf_close(bloom_bloomfilter *filter) {
     filter->header = NULL;
     filter->offset = 0;
     filter->bitmap_size = 0;
+    filter->num_blocks = 0;
 
     return 0;
 }
@@ -205,13 +1764,66 @@ int bf_close(bloom_bloomfilter *filter) {
  * @return 0 on success, negative on error.
  */
 int bf_params_for_capacity(bloom_filter_params *params) {
+    return bf_params_for_capacity_format(params, NULL);
+}
+
+/*
+ * Expects capacity and probability to be set,
+ * and sets the bytes and k_num that should be used
+ * for a filter with the given format. This byte size
+ * accounts for the headers we need, and the sparse set of
+ * the sparse format.
+ * @arg format The filter format, NULL for the default format.
+ * @return 0 on success, negative on error.
+ */
+int bf_params_for_capacity_format(bloom_filter_params *params, bloom_filter_format *format) {
     // Sets the required size
-    int res = bf_size_for_capacity_prob(params);
+    uint32_t max_k = (format) ? format->max_k_num : 0;
+    int res = bf_size_for_capacity_prob_k(params, max_k);
     if (res != 0) return res;
 
-    // Sets the ideal k
+    // Sets the ideal k, within the probe budget
     res = bf_ideal_k_num(params);
     if (res != 0) return res;
+    if (max_k && params->k_num > max_k) params->k_num = max_k;
+
+    // Blocked filters need extra space for the same probability,
+    // and counting and aging filters a counter or stamp per bit
+    if (format && format->layout == BLOOM_LAYOUT_BLOCKED) {
+        res = bf_blocked_size_for_capacity_prob(params, 1, max_k);
+        if (res != 0) return res;
+    } else if (format && format->layout == BLOOM_LAYOUT_COUNTING) {
+        res = bf_blocked_size_for_capacity_prob(params, BLOOM_COUNTER_BITS, max_k);
+        if (res != 0) return res;
+    } else if (format && format->layout == BLOOM_LAYOUT_AGING) {
+        res = bf_blocked_size_for_capacity_prob(params, 8 * BLOOM_BLOCK_BYTES / BLOOM_BLOCK_STAMPS, max_k);
+        if (res != 0) return res;
+    }
+
+    // Foldable filters are rounded up to a power of two of
+    // partition bits or of blocks, which bf_fold can halve
+    if (format && format->foldable && format->layout == BLOOM_LAYOUT_PARTITIONED) {
+        uint64_t m = (params->bytes * 8 + params->k_num - 1) / params->k_num;
+        uint64_t unit = 64;
+        while (unit * 2 * BLOOM_FOLD_SLACK <= m) unit *= 2;
+        m = (m + unit - 1) / unit * unit;
+        params->bytes = params->k_num * m / 8;
+    } else if (format && format->foldable && format->layout == BLOOM_LAYOUT_BLOCKED) {
+        uint64_t blocks = (params->bytes + BLOOM_BLOCK_BYTES - 1) / BLOOM_BLOCK_BYTES;
+        uint64_t unit = 1;
+        while (unit * 2 * BLOOM_FOLD_SLACK <= blocks) unit *= 2;
+        blocks = (blocks + unit - 1) / unit * unit;
+        params->bytes = blocks * BLOOM_BLOCK_BYTES;
+    }
+
+    // The bits of a sparse filter are kept word aligned, with
+    // the space for its set after them
+    if (format && format->sparse && (format->layout == BLOOM_LAYOUT_PARTITIONED ||
+                format->layout == BLOOM_LAYOUT_BLOCKED)) {
+        uint64_t bits_bytes = (params->bytes + 7) & ~7ULL;
+        uint64_t reserve = bf_sparse_reserve(bits_bytes);
+        if (reserve) params->bytes = bits_bytes + reserve;
+    }
 
     // Adjust for the header size
     params->bytes += sizeof(bloom_filter_header);
@@ -224,12 +1836,33 @@ int bf_params_for_capacity(bloom_filter_params *params) {
  * @return 0 on success, negative on error.
  */
 int bf_size_for_capacity_prob(bloom_filter_params *params) {
+    return bf_size_for_capacity_prob_k(params, 0);
+}
+
+/*
+ * Expects capacity and probability to be set, computes the
+ * minimum byte size of a filter probing at most max_k bits
+ * per key. Fewer probes than the ideal k need a sparser filter
+ * for the same probability. Does not include header size.
+ * @arg max_k The most bits probed, 0 for the ideal k
+ * @return 0 on success, negative on error.
+ */
+int bf_size_for_capacity_prob_k(bloom_filter_params *params, uint32_t max_k) {
     uint64_t capacity = params->capacity;
     double fp_prob = params->fp_probability;
     if (capacity == 0 || fp_prob == 0) {
         return -1;
     }
     double bits = -(capacity*log(fp_prob)/(log(2)*log(2)));
+
+    /*
+     * With k probes, p = (1 - e^(-kn/m))^k. Solving for m
+     * gives m = -kn / ln(1 - p^(1/k)), which is the smallest
+     * filter meeting the probability with that many probes.
+     */
+    if (max_k && max_k < round(log(2) * bits / capacity)) {
+        bits = -(max_k * (double)capacity / log(1 - pow(fp_prob, 1.0 / max_k)));
+    }
     uint64_t whole_bits = ceil(bits);
     params->bytes = ceil(whole_bits / 8.0);
     return 0;
@@ -284,8 +1917,132 @@ int bf_ideal_k_num(bloom_filter_params *params) {
     return 0;
 }
 
+/*
+ * Computes the false positive probability of a filter
+ * using the BLOOM_LAYOUT_BLOCKED layout. Blocks are not
+ * evenly loaded, so this is higher than a partitioned
+ * filter of the same size.
+ * @arg bits The number of bits in the filter
+ * @arg capacity The number of items
+ * @arg k_num The number of bits set per item
+ * @return The false positive probability.
+ */
+double bf_blocked_fp_probability(uint64_t bits, uint64_t capacity, uint32_t k_num) {
+    return bf_block_fp_probability(bits / BLOOM_BLOCK_BITS, BLOOM_BLOCK_BITS, capacity, k_num);
+}
+
+/*
+ * Computes the false positive probability of a filter
+ * using the BLOOM_LAYOUT_COUNTING layout.
+ * @arg bytes The number of counter bytes in the filter
+ * @arg capacity The number of items
+ * @arg k_num The number of counters incremented per item
+ * @return The false positive probability.
+ */
+double bf_counting_fp_probability(uint64_t bytes, uint64_t capacity, uint32_t k_num) {
+    return bf_block_fp_probability(bytes / BLOOM_BLOCK_BYTES, BLOOM_BLOCK_COUNTERS, capacity, k_num);
+}
+
+/*
+ * Computes the false positive probability of a filter
+ * made of blocks with a number of slots each.
+ */
+static double bf_block_fp_probability(uint64_t blocks, uint32_t slots, uint64_t capacity, uint32_t k_num) {
+    if (blocks == 0 || k_num == 0) return 1.0;
+
+    /*
+     * Items land in blocks following a Poisson distribution
+     * with a mean of capacity / blocks. Sum the false positive
+     * rate of a standard filter of the block's slots
+     * over each possible block load.
+     */
+    double lambda = (double)capacity / (double)blocks;
+    double p_load = exp(-lambda);
+    double fp = 0;
+    uint64_t max_load = lambda + 12 * sqrt(lambda) + 20;
+    for (uint64_t j=0; j <= max_load; j++) {
+        double p_zero = pow(1.0 - 1.0 / slots, (double)j * k_num);
+        fp += p_load * pow(1.0 - p_zero, k_num);
+        p_load *= lambda / (j + 1);
+    }
+    return fp;
+}
+
+/*
+ * Expects bytes, capacity and probability to be set, with
+ * bytes sized for a partitioned filter. Grows bytes until
+ * a filter of blocks meets the probability, and updates k_num.
+ * @arg slot_bits The bits used by each slot of a block, 1 for
+ * the blocked layout, BLOOM_COUNTER_BITS for the counting layout
+ * and a byte for the aging layout
+ * @arg max_k The most bits probed, 0 for the ideal k
+ * @return 0 on success, negative on error.
+ */
+static int bf_blocked_size_for_capacity_prob(bloom_filter_params *params, uint32_t slot_bits, uint32_t max_k) {
+    // Round up to the nearest block
+    uint64_t bytes = params->bytes * slot_bits;
+    bytes += (BLOOM_BLOCK_BYTES - bytes % BLOOM_BLOCK_BYTES) % BLOOM_BLOCK_BYTES;
+    if (bytes == 0) bytes = BLOOM_BLOCK_BYTES;
+
+    // Grow by roughly 2% a step, bounded to 4x the partitioned size.
+    // The ideal k is based on the number of slots, not bits, and
+    // is lowered while that helps, since a small block saturates
+    // well before the ideal k of the whole filter.
+    bloom_filter_params trial = *params;
+    uint64_t max_bytes = 4 * bytes;
+    uint32_t slots = BLOOM_BLOCK_BITS / slot_bits;
+    while (1) {
+        trial.bytes = bytes / slot_bits;
+        if (bf_ideal_k_num(&trial) != 0) return -1;
+        if (max_k && trial.k_num > max_k) trial.k_num = max_k;
+        if (trial.k_num < 1) trial.k_num = 1;
+        uint64_t blocks = bytes / BLOOM_BLOCK_BYTES;
+        double fp = bf_block_fp_probability(blocks, slots, params->capacity, trial.k_num);
+        while (trial.k_num > 1) {
+            double lower = bf_block_fp_probability(blocks, slots, params->capacity, trial.k_num - 1);
+            if (lower >= fp) break;
+            fp = lower;
+            trial.k_num--;
+        }
+        if (bytes >= max_bytes || fp <= params->fp_probability) {
+            break;
+        }
+        uint64_t step = bytes / 50;
+        bytes += step - step % BLOOM_BLOCK_BYTES + BLOOM_BLOCK_BYTES;
+    }
+
+    params->bytes = bytes;
+    params->k_num = trial.k_num;
+    return 0;
+}
+
 // Computes our hashes
 void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes) {
+    bf_compute_hashes_scheme(BLOOM_HASH_LEGACY, k_num, key, hashes);
+}
+
+/**
+ * Computes the hashes of a key using the given scheme.
+ * @arg scheme The hash scheme, see bloom_hash_scheme
+ * @arg num_hashes The number of hashes to compute, at least 4
+ * @arg key The key to hash
+ * @arg hashes Output, the array of hashes
+ */
+void bf_compute_hashes_scheme(int scheme, uint32_t num_hashes, char *key, uint64_t *hashes) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    bf_derive_hashes(&hk, scheme, num_hashes, hashes);
+}
+
+/**
+ * Derives the hashes of a key for a scheme, computing
+ * and caching the base hashes the scheme needs.
+ * @arg hk The hashed key
+ * @arg scheme The hash scheme, see bloom_hash_scheme
+ * @arg num_hashes The number of hashes to compute, at least 4
+ * @arg hashes Output, the array of hashes
+ */
+static void bf_derive_hashes(bloom_hashed_key *hk, int scheme, uint32_t num_hashes, uint64_t *hashes) {
     /**
      * We use the results of
      * 'Less Hashing, Same Performance: Building a Better Bloom Filter'
@@ -298,32 +2055,39 @@ void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes) {
      *
      */
 
-    // Get the length of the key
-    uint64_t len = strlen(key);
+    // Compute the first hash, and copy it out
+    uint64_t *base = bf_base_hashes(hk, scheme);
+    hashes[0] = base[0];  // Upper 64bits of murmur or crc
+    hashes[1] = base[1];  // Lower 64bits of murmur or crc
 
-    // Compute the first hash
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, len, 0, out);
-
-    // Copy these out
-    hashes[0] = out[0];  // Upper 64bits of murmur
-    hashes[1] = out[1];  // Lower 64bits of murmur
+    if (scheme != BLOOM_HASH_LEGACY) {
+        // The 128 bits of murmur or crc are enough for the linear
+        // combination. The step is taken from the rotated upper
+        // half, so that it is not tied to the low bits of hashes[0]
+        // and is forced odd so it never degenerates modulo a
+        // power of two.
+        uint64_t step = ((hashes[0] << 32) | (hashes[0] >> 32)) | 1;
+        for (uint32_t i=2; i < num_hashes; i++) {
+            hashes[i] = hashes[1] + (i - 1) * step;
+        }
+        return;
+    }
 
     // Compute the second hash
-    uint64_t *hash1 = out;
-    uint64_t *hash2 = hash1+1;
-    SpookyHash128(key, len, 0, 0, hash1, hash2);
+    if (!hk->has_spooky) {
+        SpookyHash128(hk->key, hk->len, 0, 0, hk->spooky, hk->spooky+1);
+        hk->has_spooky = 1;
+    }
 
     // Copy these out
-    hashes[2] = out[0];   // Use the upper 64bits of Spooky
-    hashes[3] = out[1];   // Use the lower 64bits of Spooky
+    hashes[2] = hk->spooky[0];   // Use the upper 64bits of Spooky
+    hashes[3] = hk->spooky[1];   // Use the lower 64bits of Spooky
 
     // Compute an arbitrary k_num using a linear combination
     // Add a mod by the largest 64bit prime. This only reduces the
     // number of addressable bits by 54 but should make the hashes
     // a bit better.
-    for (uint32_t i=4; i < k_num; i++) {
+    for (uint32_t i=4; i < num_hashes; i++) {
         hashes[i] = hashes[1] + ((i * hashes[3]) % 18446744073709551557U);
     }
 }
-
@@ -8,15 +8,135 @@
 
 /**
  * We use a magic header to identify the bloom filters.
+ * Fields added after count must treat 0 as the original
+ * behavior, since older filters have a zero filled buffer.
  */
 struct bloom_filter_header {
     uint32_t magic;     // Magic 4 bytes
     uint32_t k_num;     // K_num value
     uint64_t count;     // Count of items
-    char __buf[496];     // Pad out to 512 bytes
+    uint8_t layout;     // Bit layout, see bloom_layout
+    uint8_t hash_scheme; // Hash scheme, see bloom_hash_scheme
+    uint8_t reduction;  // Range reduction, see bloom_reduction
+    uint64_t bits_set;  // Cached count of the bits set, see bf_fill
+    uint64_t fill_stamp; // One more than the count bits_set was taken at, 0 if stale
+    uint64_t age_clock; // Clock of the last bf_age, for the aging layout
+    uint8_t age_now;    // Current tick of the aging layout, from 1 to 255
+    uint8_t age_ticks;  // Ticks a set slot lives for, for the aging layout
+    uint64_t sparse_bytes; // Bytes at the end kept for the sparse set, 0 if never sparse
+    uint64_t sparse_slots; // Slots of the sparse set, 0 once the bits are in the bitmap
+    uint64_t sparse_used;  // Bit positions held by the sparse set
+    char __buf[443];     // Pad out to 512 bytes
 } __attribute__ ((packed));
 typedef struct bloom_filter_header bloom_filter_header;
 
+/**
+ * The bit layouts a filter can use.
+ */
+typedef enum {
+    BLOOM_LAYOUT_PARTITIONED = 0,   // k partitions, one bit set in each
+    BLOOM_LAYOUT_BLOCKED = 1,       // All k bits set in a single block
+    BLOOM_LAYOUT_COUNTING = 2,      // All k counters in a single block, supports removal
+    BLOOM_LAYOUT_AGING = 3,         // All k stamps in a single block, keys expire
+    BLOOM_LAYOUT_QUOTIENT = 4       // A quotient filter in place of the layers, see quotient.h
+} bloom_layout;
+
+/**
+ * The schemes used to hash keys. All derive the k
+ * hashes from a pair of 64bit values, but the legacy
+ * scheme hashes each key twice. The CRC32C scheme is
+ * the cheapest for keys of a few dozen bytes, see crc.h,
+ * and the short scheme for keys of up to 32 bytes, see
+ * shortkey.h. Filters of the partitioned layout using the
+ * short scheme also generate their probes one at a time,
+ * stopping at the first clear bit.
+ */
+typedef enum {
+    BLOOM_HASH_LEGACY = 0,          // MurmurHash3 and SpookyHash
+    BLOOM_HASH_MURMUR = 1,          // A single MurmurHash3 pass
+    BLOOM_HASH_CRC32C = 2,          // A CRC32C based mixer
+    BLOOM_HASH_SHORT = 3            // Multiply-xor rounds for short keys, MurmurHash3 otherwise
+} bloom_hash_scheme;
+
+/**
+ * The ways a hash can be reduced to a bit or block
+ * offset. Multiply-shift maps a hash h onto [0, n) as
+ * (h * n) >> 64, avoiding a 64bit division per probe.
+ */
+typedef enum {
+    BLOOM_REDUCE_MODULO = 0,        // h % n
+    BLOOM_REDUCE_MULTIPLY = 1       // (h * n) >> 64
+} bloom_reduction;
+
+/**
+ * Size of a block in the BLOOM_LAYOUT_BLOCKED layout.
+ * We use a single 64 byte cache line.
+ */
+#define BLOOM_BLOCK_BYTES 64
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES * 8)
+
+/**
+ * The BLOOM_LAYOUT_COUNTING layout packs 4 bit counters
+ * into the same blocks. A counter that reaches the maximum
+ * is never decremented, since it no longer knows how many
+ * keys it counts.
+ */
+#define BLOOM_COUNTER_BITS 4
+#define BLOOM_COUNTER_MAX ((1 << BLOOM_COUNTER_BITS) - 1)
+#define BLOOM_BLOCK_COUNTERS (BLOOM_BLOCK_BITS / BLOOM_COUNTER_BITS)
+
+/**
+ * The BLOOM_LAYOUT_AGING layout has a byte per slot, holding
+ * the tick the slot was last set at, or 0 if it is empty. The
+ * ticks wrap from 255 back to 1, so a key may live for at most
+ * BLOOM_AGE_MAX_TICKS ticks, which keeps expired stamps from
+ * being mistaken for recent ones.
+ */
+#define BLOOM_BLOCK_STAMPS BLOOM_BLOCK_BYTES
+#define BLOOM_AGE_MAX_TICKS 127
+
+/**
+ * A new filter of the partitioned or blocked layout using the
+ * sparse format keeps the positions of its set bits in a hash set
+ * at the end of its bitmap, so a young filter only touches a few
+ * pages instead of one for every probe. The set starts at
+ * BLOOM_SPARSE_MIN_SLOTS slots, doubles as it fills, and is moved
+ * into the bits once it would outgrow the space kept for it, which
+ * is about a sixteenth of the bits. Filters with fewer than
+ * BLOOM_SPARSE_MIN_BYTES of bits are always dense.
+ */
+#define BLOOM_SPARSE_MIN_BYTES (64 * 1024)
+#define BLOOM_SPARSE_MIN_SLOTS 512
+
+/**
+ * A new filter of the partitioned or blocked layout using the
+ * foldable format has the bits of each partition, or its blocks,
+ * rounded up to a multiple of the largest power of two that is
+ * at most 1/BLOOM_FOLD_SLACK of them, so bf_fold can halve it
+ * until a partition has about BLOOM_FOLD_SLACK bits, or there
+ * are about as many blocks. Partitions are rounded to at least
+ * 64 bits.
+ */
+#define BLOOM_FOLD_SLACK 256
+
+/*
+ * The format of a new bloom filter. This is recorded
+ * in the header, so that existing filters are always
+ * accessed using the format they were created with.
+ */
+typedef struct {
+    bloom_layout layout;
+    bloom_hash_scheme hash_scheme;
+    bloom_reduction reduction;
+    uint32_t age_ticks;     // Ticks a key lives for, for the aging layout
+    uint32_t max_k_num;     // Most bits probed per key, 0 for the space-optimal number
+    uint32_t sparse;        // Start as a sparse set of bits, see BLOOM_SPARSE_MIN_BYTES
+    uint32_t foldable;      // Round the size so it can be folded, see BLOOM_FOLD_SLACK
+} bloom_filter_format;
+
+// The probe functions of a filter, private to bloom.c
+struct bloom_probe_ops;
+
 /*
  * This is the struct we use to represent a bloom filter.
  */
@@ -25,8 +145,49 @@ typedef struct {
     bloom_bitmap *map;             // Underlying bitmap
     uint64_t offset;                // The offset size between hash regions
     uint64_t bitmap_size;           // The size of the bitmap to use, minus buffers
+    uint64_t num_blocks;            // The number of blocks, for all but the partitioned layout
+    const struct bloom_probe_ops *ops; // Probe functions chosen for the layout and k_num at load
 } bloom_bloomfilter;
 
+/*
+ * Caches the base hashes of a key, so that the key can
+ * be checked against many filters, even ones using different
+ * hash schemes, while only being hashed once. The base hashes
+ * are computed lazily, and the key must outlive the struct.
+ */
+typedef struct {
+    char *key;              // The key
+    uint64_t len;           // Length of the key
+    int has_murmur;         // Set once murmur is computed
+    int has_spooky;         // Set once spooky is computed
+    int has_crc;            // Set once crc is computed
+    int has_short;          // Set once short is computed
+    int prehashed;          // The murmur hash was given in place of the key
+    uint64_t murmur[2];     // MurmurHash3 of the key
+    uint64_t spooky[2];     // SpookyHash of the key
+    uint64_t crc[2];        // CRC32C mixer hash of the key
+    uint64_t short_hash[2]; // Short key hash of the key, if it is short
+} bloom_hashed_key;
+
+/**
+ * The number of keys bf_contains_many has in flight
+ * at once. Enough to keep several cache misses
+ * outstanding without spilling the hashes.
+ */
+#define BLOOM_BATCH_SIZE 16
+
+/*
+ * The fill of a filter, from the bits that are set. Unlike the
+ * count, it is still right after filters are merged or their
+ * bitmaps are restored.
+ */
+typedef struct {
+    uint64_t bits;          // The bits keys are hashed to
+    uint64_t bits_set;      // The bits that are set
+    uint64_t keys;          // Estimated number of distinct keys
+    double fp_probability;  // Estimated current false positive probability
+} bloom_filter_fill;
+
 /*
  * Structure used to store the parameter information
  * for configuring bloom filters.
@@ -50,10 +211,25 @@ typedef struct {
 int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloomfilter *filter);
 
 /**
- * Adds a new key to the bloom filter.
+ * Creates a new bloom filter using a given bitmap, k-value and format.
+ * @arg map A bloom_bitmap pointer.
+ * @arg k_num The number of hash functions to use. Ignored if the header value is different.
+ * @arg format The format of a new filter. NULL for the default format.
+ * Ignored unless new_filter is set, since existing filters record their format.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bf_from_bitmap_format(bloom_bitmap *map, uint32_t k_num, bloom_filter_format *format,
+        int new_filter, bloom_bloomfilter *filter);
+
+/**
+ * Adds a new key to the bloom filter. Safe to call
+ * concurrently with other bf_add and bf_contains calls.
  * @arg filter The filter to add to
  * @arg key The key to add
- * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if
+ * the sparse set is full, see bf_sparse_grow. Negative on failure.
  */
 int bf_add(bloom_bloomfilter *filter, char* key);
 
@@ -65,6 +241,236 @@ int bf_add(bloom_bloomfilter *filter, char* key);
  */
 int bf_contains(bloom_bloomfilter *filter, char* key);
 
+/**
+ * Prepares a key to be used with bf_add_hashed and
+ * bf_contains_hashed. Does not do any hashing yet.
+ * @arg hk The hashed key to initialize
+ * @arg key The key, must outlive hk
+ */
+void bf_hashed_key_init(bloom_hashed_key *hk, char *key);
+
+/**
+ * Prepares a key of a known length, so callers that
+ * already split the key do not measure it again.
+ * @arg hk The hashed key to initialize
+ * @arg key The key, must outlive hk. It need not be
+ * null terminated.
+ * @arg len The length of the key
+ */
+void bf_hashed_key_init_len(bloom_hashed_key *hk, char *key, uint64_t len);
+
+/**
+ * Prepares a key from its MurmurHash3, as computed by
+ * MurmurHash3_x64_128 with a seed of 0, for clients that
+ * already hash their keys. There is no key, so it can only
+ * be used with filters using BLOOM_HASH_MURMUR, quotient
+ * filters and xor filters, which need nothing else.
+ * @arg hk The hashed key to initialize
+ * @arg hash The 128 bits of the hash, as two words
+ */
+void bf_hashed_key_init_hash(bloom_hashed_key *hk, const uint64_t *hash);
+
+/**
+ * Returns the MurmurHash3 of a prepared key, computing
+ * it if it is not yet cached.
+ * @arg hk The hashed key
+ * @return The 128 bits of the hash, as two words
+ */
+uint64_t* bf_hashed_key_murmur(bloom_hashed_key *hk);
+
+/**
+ * Adds a new key to the bloom filter, reusing the
+ * hashes cached from previous calls. Safe to call
+ * concurrently with other bf_add and bf_contains calls,
+ * as long as each thread uses its own hashed key.
+ * @arg filter The filter to add to
+ * @arg hk The hashed key to add
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if
+ * the sparse set is full, see bf_sparse_grow. Negative on failure.
+ */
+int bf_add_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+
+/**
+ * Checks the filter for a key, reusing the hashes
+ * cached from previous calls.
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int bf_contains_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+
+/**
+ * Checks the filter for many keys at once. All the keys
+ * of a batch are hashed and their memory prefetched before
+ * any are tested, so the cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is present.
+ * Keys that already have a result of 1 are skipped, so results can be
+ * accumulated across several filters.
+ * @returns 0 on success, negative on error.
+ */
+int bf_contains_many(bloom_bloomfilter *filter, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Removes a key from a filter using the BLOOM_LAYOUT_COUNTING
+ * layout, by decrementing each of its counters. Safe to call
+ * concurrently with bf_add and bf_contains calls. A counting
+ * filter counts every bf_add of a key, so a key must be removed
+ * as many times as it was added. Removing a false positive that
+ * was never added may cause false negatives for other keys.
+ * @arg filter The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove(bloom_bloomfilter *filter, char* key);
+
+/**
+ * Removes a key from a counting filter, reusing the
+ * hashes cached from previous calls.
+ * @arg filter The filter to remove from
+ * @arg hk The hashed key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove_hashed(bloom_bloomfilter *filter, bloom_hashed_key *hk);
+
+/**
+ * Removes a key from a counting filter like bf_remove_hashed,
+ * and tells if the count of the filter dropped, which it only
+ * does once the last add of the key is removed.
+ * @arg filter The filter to remove from
+ * @arg hk The hashed key to remove
+ * @arg dropped Output, set to 1 if the count dropped
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int bf_remove_counted(bloom_bloomfilter *filter, bloom_hashed_key *hk, int *dropped);
+
+/**
+ * Merges another filter into this one, so it has the keys of
+ * either filter for a union, or of both for an intersection.
+ * The filters must have the same size, k_num and format.
+ * Counting and aging filters can not be merged, since their
+ * slots are not combined by bit operations. The count becomes
+ * the most keys the merged filter can have.
+ * @arg filter The filter to merge into
+ * @arg other The filter to merge, which is not changed
+ * @arg intersect 1 to intersect the filters, 0 for a union
+ * @returns 0 on success, -EINVAL if the filters differ.
+ */
+int bf_merge(bloom_bloomfilter *filter, bloom_bloomfilter *other, int intersect);
+
+/**
+ * Merges a range of the bitmap of a copy of a filter into it, such
+ * as the pages of the copy that changed, so it has the keys of
+ * either. A range covering the header must cover all of it, and the
+ * header of the copy must match the filter, whose count becomes the
+ * larger of the two. The copy must not be sparse, while a sparse
+ * filter is densified first. Counting and aging filters can not be
+ * merged, since their slots are not combined by bit operations.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter to merge into
+ * @arg offset The first byte of the range, a multiple of 8
+ * @arg data The bytes of the copy in the range
+ * @arg len The length of the range
+ * @returns 0 on success, -EINVAL if the range or the header
+ * does not fit the filter, negative on other failures.
+ */
+int bf_merge_bytes(bloom_bloomfilter *filter, uint64_t offset, const unsigned char *data, uint64_t len);
+
+/**
+ * Returns the size of a filter folded onto itself, see bf_fold.
+ * A fold halves the bits of each partition, or the blocks, so
+ * the filter must have a power of two multiple of them, and the
+ * folded size must give back exactly the folded partitions.
+ * @arg filter The filter
+ * @arg folds The number of times to halve the filter
+ * @return The bytes of the folded filter, including the
+ * header. 0 if the filter can not be folded that far.
+ */
+uint64_t bf_fold_size(bloom_bloomfilter *filter, uint32_t folds);
+
+/**
+ * Folds a filter onto a bitmap that is 2^folds times smaller,
+ * by OR-ing the bits that the hashes of a key reduce to in the
+ * folded filter. The folded filter has every key of the filter,
+ * the same k_num and format, and the false positives of the
+ * filter with 2^folds times the keys. Only the partitioned and
+ * blocked layouts can be folded, and the folded filter is dense.
+ * @arg filter The filter to fold, which is not changed
+ * @arg folds The number of times to halve the filter
+ * @arg map A new bitmap of bf_fold_size bytes
+ * @arg out The folded filter to setup
+ * @returns 0 on success, -EINVAL if the filter can not be folded
+ * or the bitmap has the wrong size. Negative on other failures.
+ */
+int bf_fold(bloom_bloomfilter *filter, uint32_t folds, bloom_bitmap *map, bloom_bloomfilter *out);
+
+/**
+ * Makes room in the sparse set of a filter, which bf_add refuses
+ * to grow with -EAGAIN. The set is doubled, or once it would
+ * outgrow the space kept for it, its bits are moved into the
+ * bitmap, as with bf_densify.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @returns 0 on success, -EINVAL if the filter is not sparse.
+ */
+int bf_sparse_grow(bloom_bloomfilter *filter);
+
+/**
+ * Moves the bits of a sparse filter into its bitmap, so it is
+ * used like any other filter. Does nothing if it is not sparse.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @returns 0 on success, negative on failure.
+ */
+int bf_densify(bloom_bloomfilter *filter);
+
+/**
+ * Returns if the bits of a filter are still kept in its sparse set.
+ * @arg filter The filter
+ * @return 1 if the filter is sparse, 0 otherwise.
+ */
+int bf_is_sparse(bloom_bloomfilter *filter);
+
+/**
+ * Returns the bytes at the end of a new filter of the given size
+ * that are kept for its sparse set, see bf_params_for_capacity_format.
+ * @arg bytes The size of the filter, including the header
+ * @arg format The format of the filter, NULL for the default format.
+ * @return The bytes of the sparse set, 0 if the filter is dense.
+ */
+uint64_t bf_sparse_bytes(uint64_t bytes, bloom_filter_format *format);
+
+/**
+ * Advances the clock of a filter using the BLOOM_LAYOUT_AGING
+ * layout. Keys that were not set in the last age_ticks ticks
+ * expire, and their slots are cleared. The count becomes an
+ * estimate of the keys that are still live. The first call only
+ * sets the clock. Safe to call concurrently with bf_add and
+ * bf_contains calls, but not with another bf_age.
+ * @arg filter The filter
+ * @arg clock The current tick, which must not go backwards
+ * @returns 1 if the filter aged, 0 if the clock has not moved
+ * or the filter is read only, -EINVAL for other layouts.
+ */
+int bf_age(bloom_bloomfilter *filter, uint64_t clock);
+
+/**
+ * Estimates the keys in a filter and its current false
+ * positive probability from the bits that are set. The count
+ * of set bits is cached in the header, and only taken again
+ * once keys were added, so repeated calls are cheap.
+ * @arg filter The filter
+ * @arg fill Output, the fill of the filter
+ * @returns 0 on success, -EINVAL for the counting and aging
+ * layouts, which have counters or stamps instead of bits.
+ */
+int bf_fill(bloom_bloomfilter *filter, bloom_filter_fill *fill);
+
 /**
  * Returns the size of the bloom filter in item count
  */
@@ -76,6 +482,13 @@ uint64_t bf_size(bloom_bloomfilter *filter);
  */
 int bf_flush(bloom_bloomfilter *filter);
 
+/**
+ * Writes back the filter like bf_flush, without
+ * waiting for it to be durable.
+ * @return 0 on success, negative on failure.
+ */
+int bf_write(bloom_bloomfilter *filter);
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap,
  * but does not free it.
@@ -91,6 +504,15 @@ int bf_close(bloom_bloomfilter *filter);
  */
 void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes);
 
+/**
+ * Computes the hashes of a key using the given scheme.
+ * @arg scheme The hash scheme, see bloom_hash_scheme
+ * @arg num_hashes The number of hashes to compute, at least 4
+ * @arg key The key to hash
+ * @arg hashes Output, the array of hashes
+ */
+void bf_compute_hashes_scheme(int scheme, uint32_t num_hashes, char *key, uint64_t *hashes);
+
 /*
  * Utility methods for computing parameters
  */
@@ -103,6 +525,17 @@ void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes);
  */
 int bf_params_for_capacity(bloom_filter_params *params);
 
+/*
+ * Expects capacity and probability to be set,
+ * and sets the bytes and k_num that should be used
+ * for a filter with the given format. This byte size
+ * accounts for the headers we need, and the sparse set of
+ * the sparse format.
+ * @arg format The filter format, NULL for the default format.
+ * @return 0 on success, negative on error.
+ */
+int bf_params_for_capacity_format(bloom_filter_params *params, bloom_filter_format *format);
+
 /*
  * Expects capacity and probability to be set, computes the
  * minimum byte size required. Does not include header size.
@@ -110,6 +543,16 @@ int bf_params_for_capacity(bloom_filter_params *params);
  */
 int bf_size_for_capacity_prob(bloom_filter_params *params);
 
+/*
+ * Expects capacity and probability to be set, computes the
+ * minimum byte size of a filter probing at most max_k bits
+ * per key. Fewer probes than the ideal k need a sparser filter
+ * for the same probability. Does not include header size.
+ * @arg max_k The most bits probed, 0 for the ideal k
+ * @return 0 on success, negative on error.
+ */
+int bf_size_for_capacity_prob_k(bloom_filter_params *params, uint32_t max_k);
+
 /*
  * Expects capacity and size to be set, computes the best
  * false positive probability given an ideal k.
@@ -131,5 +574,27 @@ int bf_capacity_for_size_prob(bloom_filter_params *params);
  */
 int bf_ideal_k_num(bloom_filter_params *params);
 
+/*
+ * Computes the false positive probability of a filter
+ * using the BLOOM_LAYOUT_BLOCKED layout. Blocks are not
+ * evenly loaded, so this is higher than a partitioned
+ * filter of the same size.
+ * @arg bits The number of bits in the filter
+ * @arg capacity The number of items
+ * @arg k_num The number of bits set per item
+ * @return The false positive probability.
+ */
+double bf_blocked_fp_probability(uint64_t bits, uint64_t capacity, uint32_t k_num);
+
+/*
+ * Computes the false positive probability of a filter
+ * using the BLOOM_LAYOUT_COUNTING layout.
+ * @arg bytes The number of counter bytes in the filter
+ * @arg capacity The number of items
+ * @arg k_num The number of counters incremented per item
+ * @return The false positive probability.
+ */
+double bf_counting_fp_probability(uint64_t bytes, uint64_t capacity, uint32_t k_num);
+
 #endif
 
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compress.h"
+
+/**
+ * Identifies an archive, "BLZ1"
+ */
+#define COMPRESS_MAGIC 0x315a4c42
+
+/**
+ * Block types. Each block starts with a type byte.
+ */
+#define BLOCK_ZERO   0 // uint32 count of zero pages
+#define BLOCK_SPARSE 1 // uint16 count, then count (uint16 offset, uint8 value)
+#define BLOCK_RAW    2 // The page contents
+
+/**
+ * Size of the buffers used to write out archives
+ * and restored bitmaps.
+ */
+#define WRITE_BUF_SIZE (64 * BITMAP_COMPRESS_PAGE_SIZE)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t page_size;
+    uint64_t size;      // Size of the bitmap in bytes
+} archive_header;
+
+typedef struct {
+    int fd;
+    uint64_t len;
+    unsigned char buf[WRITE_BUF_SIZE];
+} write_buffer;
+
+/* Static declarations */
+static int map_file(char *path, unsigned char **data, uint64_t *len);
+static int page_is_zero(const unsigned char *page, uint64_t len);
+static uint64_t page_nonzero_bytes(const unsigned char *page, uint64_t len);
+static int buffer_append(write_buffer *out, const void *data, uint64_t len);
+static int buffer_drain(write_buffer *out);
+static int write_all(int fd, const unsigned char *buf, uint64_t len, uint64_t offset);
+static int open_tmp(char *dst, char **tmp_path);
+static int finish_tmp(int fd, char *tmp_path, char *dst, int res);
+
+int bitmap_compress_file(char *src, char *dst) {
+    unsigned char *data;
+    uint64_t size;
+    int res = map_file(src, &data, &size);
+    if (res) return res;
+
+    char *tmp_path;
+    int fd = open_tmp(dst, &tmp_path);
+    if (fd < 0) {
+        if (size) munmap(data, size);
+        return fd;
+    }
+
+    write_buffer *out = malloc(sizeof(write_buffer));
+    if (!out) {
+        res = -ENOMEM;
+        goto LEAVE;
+    }
+    out->fd = fd;
+    out->len = 0;
+
+    archive_header header = {COMPRESS_MAGIC, BITMAP_COMPRESS_PAGE_SIZE, size};
+    res = buffer_append(out, &header, sizeof(header));
+
+    uint32_t zero_run = 0;
+    for (uint64_t offset=0; offset < size && !res; offset += BITMAP_COMPRESS_PAGE_SIZE) {
+        const unsigned char *page = data + offset;
+        uint64_t len = size - offset;
+        if (len > BITMAP_COMPRESS_PAGE_SIZE) len = BITMAP_COMPRESS_PAGE_SIZE;
+
+        // Extend the current run of zero pages
+        if (page_is_zero(page, len)) {
+            zero_run++;
+            continue;
+        }
+        if (zero_run) {
+            unsigned char type = BLOCK_ZERO;
+            res = buffer_append(out, &type, 1);
+            if (!res) res = buffer_append(out, &zero_run, sizeof(zero_run));
+            zero_run = 0;
+            if (res) break;
+        }
+
+        // Store the non-zero bytes if that is smaller than the page
+        uint16_t count = page_nonzero_bytes(page, len);
+        if (2 + 3 * (uint64_t)count < len) {
+            unsigned char type = BLOCK_SPARSE;
+            res = buffer_append(out, &type, 1);
+            if (!res) res = buffer_append(out, &count, sizeof(count));
+            for (uint16_t i=0; i < len && !res; i++) {
+                if (!page[i]) continue;
+                unsigned char entry[3];
+                memcpy(entry, &i, sizeof(i));
+                entry[2] = page[i];
+                res = buffer_append(out, entry, sizeof(entry));
+            }
+        } else {
+            unsigned char type = BLOCK_RAW;
+            res = buffer_append(out, &type, 1);
+            if (!res) res = buffer_append(out, page, len);
+        }
+    }
+    if (!res && zero_run) {
+        unsigned char type = BLOCK_ZERO;
+        res = buffer_append(out, &type, 1);
+        if (!res) res = buffer_append(out, &zero_run, sizeof(zero_run));
+    }
+    if (!res) res = buffer_drain(out);
+
+LEAVE:
+    free(out);
+    if (size) munmap(data, size);
+    return finish_tmp(fd, tmp_path, dst, res);
+}
+
+int bitmap_decompress_file(char *src, char *dst) {
+    unsigned char *data;
+    uint64_t len;
+    int res = map_file(src, &data, &len);
+    if (res) return res;
+
+    // Check the header
+    archive_header header;
+    if (len < sizeof(header)) {
+        if (len) munmap(data, len);
+        return -EINVAL;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != COMPRESS_MAGIC || header.page_size != BITMAP_COMPRESS_PAGE_SIZE) {
+        munmap(data, len);
+        return -EINVAL;
+    }
+
+    char *tmp_path;
+    int fd = open_tmp(dst, &tmp_path);
+    if (fd < 0) {
+        munmap(data, len);
+        return fd;
+    }
+
+    // Size the file up front, any pages we skip are holes
+    write_buffer *out = malloc(sizeof(write_buffer));
+    if (!out) {
+        res = -ENOMEM;
+        goto LEAVE;
+    }
+    if (ftruncate(fd, header.size)) {
+        res = -errno;
+        goto LEAVE;
+    }
+
+    // Restored pages are gathered into the buffer, which
+    // is written whenever a run of restored pages ends
+    uint64_t pos = sizeof(header);
+    uint64_t offset = 0;
+    uint64_t buf_offset = 0;
+    out->len = 0;
+    while (offset < header.size && !res) {
+        if (pos >= len) {
+            res = -EINVAL;
+            break;
+        }
+        unsigned char type = data[pos++];
+        uint64_t page_len = header.size - offset;
+        if (page_len > BITMAP_COMPRESS_PAGE_SIZE) page_len = BITMAP_COMPRESS_PAGE_SIZE;
+
+        if (type == BLOCK_ZERO) {
+            uint32_t run;
+            if (pos + sizeof(run) > len) {
+                res = -EINVAL;
+                break;
+            }
+            memcpy(&run, data + pos, sizeof(run));
+            pos += sizeof(run);
+            if (!run || run > (header.size - offset + BITMAP_COMPRESS_PAGE_SIZE - 1) / BITMAP_COMPRESS_PAGE_SIZE) {
+                res = -EINVAL;
+                break;
+            }
+            res = write_all(fd, out->buf, out->len, buf_offset);
+            out->len = 0;
+            offset += (uint64_t)run * BITMAP_COMPRESS_PAGE_SIZE;
+            if (offset > header.size) offset = header.size;
+            continue;
+        }
+
+        // Make room for the page
+        if (out->len + page_len > WRITE_BUF_SIZE) {
+            res = write_all(fd, out->buf, out->len, buf_offset);
+            out->len = 0;
+            if (res) break;
+        }
+        if (!out->len) buf_offset = offset;
+        unsigned char *page = out->buf + out->len;
+
+        if (type == BLOCK_SPARSE) {
+            uint16_t count;
+            if (pos + sizeof(count) > len) {
+                res = -EINVAL;
+                break;
+            }
+            memcpy(&count, data + pos, sizeof(count));
+            pos += sizeof(count);
+            if (pos + 3 * (uint64_t)count > len) {
+                res = -EINVAL;
+                break;
+            }
+            memset(page, 0, page_len);
+            for (uint16_t i=0; i < count; i++) {
+                uint16_t byte_offset;
+                memcpy(&byte_offset, data + pos, sizeof(byte_offset));
+                if (byte_offset >= page_len) {
+                    res = -EINVAL;
+                    break;
+                }
+                page[byte_offset] = data[pos + 2];
+                pos += 3;
+            }
+        } else if (type == BLOCK_RAW) {
+            if (pos + page_len > len) {
+                res = -EINVAL;
+                break;
+            }
+            memcpy(page, data + pos, page_len);
+            pos += page_len;
+        } else {
+            res = -EINVAL;
+            break;
+        }
+        out->len += page_len;
+        offset += page_len;
+    }
+    if (!res) res = write_all(fd, out->buf, out->len, buf_offset);
+
+LEAVE:
+    free(out);
+    munmap(data, len);
+    return finish_tmp(fd, tmp_path, dst, res);
+}
+
+/**
+ * Maps a file read-only.
+ * @arg path The file to map
+ * @arg data Output, the mapping. Not mapped if the file is empty.
+ * @arg len Output, the length of the file
+ * @return 0 on success, negative errno on error.
+ */
+static int map_file(char *path, unsigned char **data, uint64_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    struct stat buf;
+    if (fstat(fd, &buf)) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    *len = buf.st_size;
+    *data = NULL;
+    if (*len) {
+        *data = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+        if (*data == MAP_FAILED) {
+            int err = -errno;
+            close(fd);
+            return err;
+        }
+        madvise(*data, *len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Checks if a page is all zeros, a word at a time.
+ */
+static int page_is_zero(const unsigned char *page, uint64_t len) {
+    uint64_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, page + i, sizeof(word));
+        if (word) return 0;
+    }
+    for (; i < len; i++) {
+        if (page[i]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Counts the non-zero bytes of a page.
+ */
+static uint64_t page_nonzero_bytes(const unsigned char *page, uint64_t len) {
+    uint64_t count = 0;
+    for (uint64_t i=0; i < len; i++) {
+        count += (page[i] != 0);
+    }
+    return count;
+}
+
+/**
+ * Appends to a write buffer, writing it
+ * out when it fills.
+ */
+static int buffer_append(write_buffer *out, const void *data, uint64_t len) {
+    const unsigned char *in = data;
+    while (len) {
+        uint64_t avail = WRITE_BUF_SIZE - out->len;
+        uint64_t n = (len < avail) ? len : avail;
+        memcpy(out->buf + out->len, in, n);
+        out->len += n;
+        in += n;
+        len -= n;
+        if (out->len == WRITE_BUF_SIZE) {
+            int res = buffer_drain(out);
+            if (res) return res;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes out the contents of a write buffer
+ * at the current file offset.
+ */
+static int buffer_drain(write_buffer *out) {
+    uint64_t written = 0;
+    while (written < out->len) {
+        ssize_t res = write(out->fd, out->buf + written, out->len - written);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        written += res;
+    }
+    out->len = 0;
+    return 0;
+}
+
+/**
+ * Writes a buffer at an offset.
+ */
+static int write_all(int fd, const unsigned char *buf, uint64_t len, uint64_t offset) {
+    uint64_t written = 0;
+    while (written < len) {
+        ssize_t res = pwrite(fd, buf + written, len - written, offset + written);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        written += res;
+    }
+    return 0;
+}
+
+/**
+ * Opens the temporary file that is renamed to dst.
+ * @arg dst The final path
+ * @arg tmp_path Output, the temporary path. Freed by finish_tmp.
+ * @return The file descriptor, or negative errno on error.
+ */
+static int open_tmp(char *dst, char **tmp_path) {
+    if (asprintf(tmp_path, "%s.tmp", dst) == -1) return -ENOMEM;
+    int fd = open(*tmp_path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        int err = -errno;
+        free(*tmp_path);
+        return err;
+    }
+    return fd;
+}
+
+/**
+ * Syncs and renames the temporary file into place,
+ * or removes it if there was an error.
+ * @arg res The result of writing the file
+ * @return 0 on success, negative errno on error.
+ */
+static int finish_tmp(int fd, char *tmp_path, char *dst, int res) {
+    if (!res && fsync(fd)) res = -errno;
+    close(fd);
+    if (!res && rename(tmp_path, dst)) res = -errno;
+    if (res) unlink(tmp_path);
+    free(tmp_path);
+    return res;
+}
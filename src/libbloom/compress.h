@@ -0,0 +1,45 @@
+#ifndef BLOOM_COMPRESS_H
+#define BLOOM_COMPRESS_H
+#include <inttypes.h>
+
+/*
+ * A compact archival format for bitmap files. The bitmap is
+ * encoded one page at a time: runs of zero pages are stored as
+ * a count, pages with few bits set are stored as a list of the
+ * non-zero bytes, and the remaining pages are stored raw. The
+ * young layers of a scalable filter are mostly zero pages, so
+ * they shrink to a small fraction of their size.
+ *
+ * Pages are encoded with the host byte order, archives are
+ * not portable between hosts of a different endianness.
+ */
+
+/**
+ * The page size the archives are encoded with.
+ */
+#define BITMAP_COMPRESS_PAGE_SIZE 4096
+
+/**
+ * Compresses a bitmap file into an archive. The archive is
+ * written to a temporary file and renamed into place once it
+ * is synced, so dst is either missing or complete. The
+ * source file is left in place.
+ * @arg src The path of the bitmap file
+ * @arg dst The path of the archive to create
+ * @return 0 on success, negative errno on error.
+ */
+int bitmap_compress_file(char *src, char *dst);
+
+/**
+ * Restores a bitmap file from an archive. Zero pages are not
+ * written, so they become holes if the filesystem supports
+ * sparse files. Like compression, the file is synced and
+ * renamed into place, and the archive is left in place.
+ * @arg src The path of the archive
+ * @arg dst The path of the bitmap file to create
+ * @return 0 on success, -EINVAL if the archive is corrupt,
+ * negative errno on other errors.
+ */
+int bitmap_decompress_file(char *src, char *dst);
+
+#endif
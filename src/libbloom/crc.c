@@ -0,0 +1,224 @@
+#include <string.h>
+#include "crc.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HAVE_SSE42
+#endif
+
+/*
+ * Static definitions
+ */
+#define CRC_POLY 0x82F63B78             // CRC32C, reflected
+#define CRC_SEED_A 0xFFFFFFFF
+#define CRC_SEED_B 0x9E3779B9
+#define CRC_LANE_MULT 0xC2B2AE3D27D4EB4FULL
+#define CRC_LEN_MULT 0x9E3779B97F4A7C15ULL
+
+typedef void(*crc_hash_fn)(const void *key, uint64_t len, uint64_t *out);
+static void crc_hash128_resolve(const void *key, uint64_t len, uint64_t *out);
+static crc_hash_fn crc_hash_impl = crc_hash128_resolve;
+typedef uint32_t(*crc32c_fn)(uint32_t crc, const void *buf, uint64_t len);
+static uint32_t crc32c_resolve(uint32_t crc, const void *buf, uint64_t len);
+static crc32c_fn crc32c_impl = crc32c_resolve;
+static const char *crc_kernel_name = NULL;
+static uint32_t CRC_TABLE[8][256];
+
+/**
+ * Fills the slicing tables of the portable kernel.
+ */
+__attribute__ ((constructor))
+static void crc_init_table(void) {
+    uint32_t c;
+    int i, j;
+    for (i=0; i < 256; i++) {
+        c = i;
+        for (j=0; j < 8; j++) {
+            c = (c >> 1) ^ ((c & 1) ? CRC_POLY : 0);
+        }
+        CRC_TABLE[0][i] = c;
+    }
+    for (i=0; i < 256; i++) {
+        for (j=1; j < 8; j++) {
+            CRC_TABLE[j][i] = (CRC_TABLE[j-1][i] >> 8) ^ CRC_TABLE[0][CRC_TABLE[j-1][i] & 0xff];
+        }
+    }
+}
+
+// Folds a word into a CRC32C, like the crc32 instruction
+static inline uint32_t crc_word_soft(uint32_t crc, uint64_t w) {
+    w ^= crc;
+    return CRC_TABLE[7][w & 0xff] ^ CRC_TABLE[6][(w >> 8) & 0xff] ^
+           CRC_TABLE[5][(w >> 16) & 0xff] ^ CRC_TABLE[4][(w >> 24) & 0xff] ^
+           CRC_TABLE[3][(w >> 32) & 0xff] ^ CRC_TABLE[2][(w >> 40) & 0xff] ^
+           CRC_TABLE[1][(w >> 48) & 0xff] ^ CRC_TABLE[0][w >> 56];
+}
+
+// Folds a byte into a CRC32C, like the crc32 instruction
+static inline uint32_t crc_byte_soft(uint32_t crc, unsigned char b) {
+    return (crc >> 8) ^ CRC_TABLE[0][(crc ^ b) & 0xff];
+}
+
+// The MurmurHash3 64bit finalizer
+static inline uint64_t crc_fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * The body of the hash, shared by the kernels so they
+ * only differ in how a word is folded into a lane.
+ */
+#define CRC_HASH_BODY(STEP) do { \
+    const unsigned char *p = key; \
+    uint64_t rest = len, w; \
+    uint32_t a = CRC_SEED_A, b = CRC_SEED_B; \
+    while (rest >= 8) { \
+        memcpy(&w, p, 8); \
+        a = STEP(a, w); \
+        b = STEP(b, ((w << 32) | (w >> 32)) * CRC_LANE_MULT); \
+        p += 8; \
+        rest -= 8; \
+    } \
+    if (rest) { \
+        w = 0; \
+        memcpy(&w, p, rest); \
+        a = STEP(a, w); \
+        b = STEP(b, ((w << 32) | (w >> 32)) * CRC_LANE_MULT); \
+    } \
+    uint64_t h = ((uint64_t)a << 32) | b; \
+    out[0] = crc_fmix64(h ^ len); \
+    out[1] = crc_fmix64((h + len) * CRC_LEN_MULT); \
+} while (0)
+
+/*
+ * The body of the plain CRC32C, shared by the kernels
+ * like the body of the hash.
+ */
+#define CRC32C_BODY(STEP, STEP_BYTE) do { \
+    const unsigned char *p = buf; \
+    uint64_t w; \
+    crc = ~crc; \
+    while (len >= 8) { \
+        memcpy(&w, p, 8); \
+        crc = STEP(crc, w); \
+        p += 8; \
+        len -= 8; \
+    } \
+    while (len--) crc = STEP_BYTE(crc, *p++); \
+    return ~crc; \
+} while (0)
+
+#ifdef CRC_HAVE_SSE42
+/**
+ * SSE4.2 kernel of the plain CRC32C.
+ */
+__attribute__ ((target ("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, uint64_t len) {
+#define CRC_STEP_SSE42(crc, w) ((uint32_t)_mm_crc32_u64((crc), (w)))
+    CRC32C_BODY(CRC_STEP_SSE42, _mm_crc32_u8);
+#undef CRC_STEP_SSE42
+}
+
+/**
+ * SSE4.2 kernel, folds the words with the crc32 instruction.
+ */
+__attribute__ ((target ("sse4.2")))
+static void crc_hash128_sse42(const void *key, uint64_t len, uint64_t *out) {
+#define CRC_STEP_SSE42(crc, w) ((uint32_t)_mm_crc32_u64((crc), (w)))
+    CRC_HASH_BODY(CRC_STEP_SSE42);
+#undef CRC_STEP_SSE42
+}
+#endif
+
+/**
+ * Portable version of bf_crc_hash128.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg out Output, the two 64bit halves of the hash
+ */
+void bf_crc_hash128_soft(const void *key, uint64_t len, uint64_t *out) {
+    CRC_HASH_BODY(crc_word_soft);
+}
+
+/**
+ * Portable version of bf_crc32c.
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The data
+ * @arg len The length of the data
+ * @return The CRC32C of the data
+ */
+uint32_t bf_crc32c_soft(uint32_t crc, const void *buf, uint64_t len) {
+    CRC32C_BODY(crc_word_soft, crc_byte_soft);
+}
+
+/**
+ * Selects the kernel of bf_crc32c on the first call.
+ */
+static uint32_t crc32c_resolve(uint32_t crc, const void *buf, uint64_t len) {
+    crc32c_fn impl = bf_crc32c_soft;
+#ifdef CRC_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) impl = crc32c_sse42;
+#endif
+    __atomic_store_n(&crc32c_impl, impl, __ATOMIC_RELAXED);
+    return impl(crc, buf, len);
+}
+
+/**
+ * Computes the CRC32C of a buffer, as used by iSCSI and ext4.
+ * Uses the crc32 instruction when the CPU has it.
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The data
+ * @arg len The length of the data
+ * @return The CRC32C of the data
+ */
+uint32_t bf_crc32c(uint32_t crc, const void *buf, uint64_t len) {
+    crc32c_fn impl = __atomic_load_n(&crc32c_impl, __ATOMIC_RELAXED);
+    return impl(crc, buf, len);
+}
+
+/**
+ * Selects the kernel on the first call. Racing threads
+ * will all select the same kernel, so no locking is needed.
+ */
+static void crc_hash128_resolve(const void *key, uint64_t len, uint64_t *out) {
+    crc_hash_fn impl = bf_crc_hash128_soft;
+    const char *name = "soft";
+#ifdef CRC_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        impl = crc_hash128_sse42;
+        name = "sse4.2";
+    }
+#endif
+    __atomic_store_n(&crc_kernel_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&crc_hash_impl, impl, __ATOMIC_RELAXED);
+    impl(key, len, out);
+}
+
+/**
+ * Hashes a key with the CRC32C mixer.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg out Output, the two 64bit halves of the hash
+ */
+void bf_crc_hash128(const void *key, uint64_t len, uint64_t *out) {
+    crc_hash_fn impl = __atomic_load_n(&crc_hash_impl, __ATOMIC_RELAXED);
+    impl(key, len, out);
+}
+
+/**
+ * Returns the name of the kernel used by bf_crc_hash128.
+ * @return "sse4.2" or "soft"
+ */
+const char *bf_crc_kernel(void) {
+    if (!__atomic_load_n(&crc_kernel_name, __ATOMIC_RELAXED)) {
+        uint64_t out[2];
+        crc_hash128_resolve("", 0, out);
+    }
+    return __atomic_load_n(&crc_kernel_name, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+#ifndef BLOOM_CRC_H
+#define BLOOM_CRC_H
+#include <inttypes.h>
+
+/*
+ * A 128bit key hash built on CRC32C, used by the
+ * BLOOM_HASH_CRC32C scheme. The key is folded 8 bytes
+ * at a time into two CRC32C lanes, the second over a
+ * multiplied copy of each word so the lanes are not
+ * linearly related, and the lanes are then mixed with the
+ * MurmurHash3 finalizer. On x86 with SSE4.2 the lanes use
+ * the crc32 instruction, which makes short keys several
+ * times cheaper to hash than with MurmurHash3. Elsewhere a
+ * table driven version gives the same hashes.
+ *
+ * The words are read in host order, so like MurmurHash3
+ * the hashes differ between hosts of different endianness.
+ * CRC32C is not keyed, so the hash does not resist keys
+ * that are chosen to collide.
+ */
+
+/**
+ * Hashes a key with the CRC32C mixer.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg out Output, the two 64bit halves of the hash
+ */
+void bf_crc_hash128(const void *key, uint64_t len, uint64_t *out);
+
+/**
+ * Portable version of bf_crc_hash128.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg out Output, the two 64bit halves of the hash
+ */
+void bf_crc_hash128_soft(const void *key, uint64_t len, uint64_t *out);
+
+/**
+ * Computes the CRC32C of a buffer, as used by iSCSI and ext4.
+ * Uses the crc32 instruction when the CPU has it.
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The data
+ * @arg len The length of the data
+ * @return The CRC32C of the data
+ */
+uint32_t bf_crc32c(uint32_t crc, const void *buf, uint64_t len);
+
+/**
+ * Portable version of bf_crc32c.
+ * @arg crc The CRC of the preceding data, or 0 to start
+ * @arg buf The data
+ * @arg len The length of the data
+ * @return The CRC32C of the data
+ */
+uint32_t bf_crc32c_soft(uint32_t crc, const void *buf, uint64_t len);
+
+/**
+ * Returns the name of the kernel used by bf_crc_hash128.
+ * @return "sse4.2" or "soft"
+ */
+const char *bf_crc_kernel(void);
+
+#endif
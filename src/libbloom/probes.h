@@ -0,0 +1,34 @@
+#ifndef BLOOM_PROBES_H
+#define BLOOM_PROBES_H
+
+/*
+ * Static tracepoints on the hot paths, for bpftrace or perf.
+ * When sys/sdt.h is available, each probe is a single nop with
+ * a note in the binary naming its arguments, so it costs nothing
+ * until a tracer attaches. Otherwise the probes compile away.
+ * Define BLOOM_NO_PROBES to leave them out even with sys/sdt.h.
+ *
+ * The probes are under the bloomd provider. A double underscore
+ * in a name is a dash to the tracers, so lock__acquire is
+ * usdt:./bloomd:bloomd:lock-acquire to bpftrace.
+ */
+#if !defined(BLOOM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BLOOM_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef BLOOM_HAVE_PROBES
+#define BLOOM_PROBE(name) DTRACE_PROBE(bloomd, name)
+#define BLOOM_PROBE1(name, a) DTRACE_PROBE1(bloomd, name, a)
+#define BLOOM_PROBE2(name, a, b) DTRACE_PROBE2(bloomd, name, a, b)
+#define BLOOM_PROBE3(name, a, b, c) DTRACE_PROBE3(bloomd, name, a, b, c)
+#else
+#define BLOOM_PROBE(name) do { } while (0)
+#define BLOOM_PROBE1(name, a) do { (void)(a); } while (0)
+#define BLOOM_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define BLOOM_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif
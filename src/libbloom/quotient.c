@@ -0,0 +1,510 @@
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include "quotient.h"
+
+/*
+ * Static definitions
+ */
+static const uint32_t QF_MAGIC_HEADER = 0x31304651;  // "QF01"
+
+/**
+ * The filter is resized once 3/4 of the
+ * quotients are used.
+ */
+#define QF_LOAD_NUM 3
+#define QF_LOAD_DEN 4
+
+/**
+ * The slots of a filter with 6 bits of quotient, which
+ * is the smallest filter that is created.
+ */
+#define QF_MIN_Q_BITS 6
+
+/**
+ * The metadata bits of a slot. The remainder is
+ * stored in the bits above them.
+ */
+#define QF_OCCUPIED 1       // A key has this slot as its quotient
+#define QF_CONTINUATION 2   // The remainder continues the run of the slot before it
+#define QF_SHIFTED 4        // The remainder is not in the slot of its quotient
+#define QF_META_BITS 3
+#define QF_META_MASK 7
+
+/**
+ * Walks the fingerprints of a filter in order.
+ */
+typedef struct {
+    bloom_qf *filter;
+    uint64_t pos;       // The next slot to read
+    uint64_t quotient;  // The quotient of the run being read
+} qf_iter;
+
+/**
+ * Appends fingerprints to an empty filter in order.
+ */
+typedef struct {
+    bloom_qf *filter;
+    uint64_t next_free; // The first slot that was not written
+    uint64_t last_quotient;
+} qf_builder;
+
+static uint64_t qf_extra_slots(uint32_t q_bits);
+static uint64_t qf_run_start(bloom_qf *filter, uint64_t quotient);
+static int qf_find(bloom_qf *filter, uint64_t quotient, uint64_t remainder);
+static int qf_iter_next(qf_iter *it, uint64_t *fp);
+static int qf_append(qf_builder *b, uint64_t fp);
+static void qf_dirty_slots(bloom_qf *filter, uint64_t start, uint64_t end);
+
+static inline int qf_is_empty(uint32_t slot) {
+    return (slot & QF_META_MASK) == 0;
+}
+
+static inline uint64_t qf_remainder(uint32_t slot) {
+    return slot >> QF_META_BITS;
+}
+
+/**
+ * Returns the fingerprint of a key, the top q + r bits of its hash.
+ */
+static inline uint64_t qf_fingerprint(bloom_qf *filter, bloom_hashed_key *hk) {
+    uint32_t bits = filter->header->q_bits + filter->header->r_bits;
+    uint64_t h = bf_hashed_key_murmur(hk)[0];
+    return (bits == 64) ? h : h >> (64 - bits);
+}
+
+/**
+ * Returns the quotient and remainder bits of a new filter
+ * that holds enough keys at a false positive probability.
+ * @arg capacity The keys the filter should hold
+ * @arg fp_probability The target false positive rate
+ * @arg q_bits Output, the bits of quotient
+ * @arg r_bits Output, the bits of remainder
+ * @return 0 on success, -EINVAL if the filter would be too large.
+ */
+int qf_params_for_capacity(uint64_t capacity, double fp_probability, uint32_t *q_bits, uint32_t *r_bits) {
+    if (fp_probability <= 0 || fp_probability >= 1) return -EINVAL;
+
+    // Enough quotients to stay under the load limit
+    uint32_t q = QF_MIN_Q_BITS;
+    while (q < QF_MAX_Q_BITS && ((1ULL << q) * QF_LOAD_NUM / QF_LOAD_DEN) < capacity) q++;
+    if (((1ULL << q) * QF_LOAD_NUM / QF_LOAD_DEN) < capacity) return -EINVAL;
+
+    // A full filter has a false positive rate of about the load over
+    // 2^r, and each resize moves a bit from the remainder to the quotient
+    int r = (int)ceil(log2((double)QF_LOAD_NUM / QF_LOAD_DEN / fp_probability)) + QF_GROWTH_BITS;
+    if (r < 1) r = 1;
+    if (r > QF_MAX_R_BITS) r = QF_MAX_R_BITS;
+    if (q + r > 64) r = 64 - q;
+
+    *q_bits = q;
+    *r_bits = r;
+    return 0;
+}
+
+/**
+ * Returns the bytes of bitmap needed for a filter.
+ * @arg q_bits The bits of quotient
+ * @return The size in bytes, or 0 if the size is invalid.
+ */
+uint64_t qf_bytes_for_q_bits(uint32_t q_bits) {
+    if (q_bits < 1 || q_bits > QF_MAX_Q_BITS) return 0;
+    uint64_t num_slots = (1ULL << q_bits) + qf_extra_slots(q_bits);
+    return sizeof(bloom_qf_header) + num_slots * sizeof(uint32_t);
+}
+
+/**
+ * Initializes a new, empty quotient filter in a bitmap.
+ * @arg map The bitmap, at least qf_bytes_for_q_bits bytes
+ * @arg q_bits The bits of quotient
+ * @arg r_bits The bits of remainder
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL on bad arguments.
+ */
+int qf_init(bloom_bitmap *map, uint32_t q_bits, uint32_t r_bits, bloom_qf *filter) {
+    if (map == NULL || filter == NULL) return -EINVAL;
+    if (r_bits < 1 || r_bits > QF_MAX_R_BITS || q_bits + r_bits > 64) return -EINVAL;
+    uint64_t bytes = qf_bytes_for_q_bits(q_bits);
+    if (!bytes || map->size < bytes) return -EINVAL;
+
+    // Setup the header
+    filter->map = map;
+    filter->header = (bloom_qf_header*)map->mmap;
+    filter->slots = (uint32_t*)(map->mmap + sizeof(bloom_qf_header));
+    memset(map->mmap, 0, bytes);
+    filter->header->magic = QF_MAGIC_HEADER;
+    filter->header->q_bits = q_bits;
+    filter->header->r_bits = r_bits;
+    filter->header->num_slots = (1ULL << q_bits) + qf_extra_slots(q_bits);
+    filter->header->count = 0;
+
+    // The whole table was written
+    for (uint64_t offset=0; offset < bytes; offset += 4096) {
+        bitmap_dirtybit(map, offset * 8);
+    }
+    return 0;
+}
+
+/**
+ * Opens an existing quotient filter stored in a bitmap.
+ * @arg map The bitmap
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL if the bitmap
+ * does not hold a valid filter.
+ */
+int qf_from_bitmap(bloom_bitmap *map, bloom_qf *filter) {
+    if (map == NULL || filter == NULL || map->size < sizeof(bloom_qf_header))
+        return -EINVAL;
+
+    bloom_qf_header *header = (bloom_qf_header*)map->mmap;
+    if (header->magic != QF_MAGIC_HEADER || header->r_bits < 1 ||
+            header->r_bits > QF_MAX_R_BITS || header->q_bits + header->r_bits > 64) {
+        return -EINVAL;
+    }
+    uint64_t bytes = qf_bytes_for_q_bits(header->q_bits);
+    if (!bytes || map->size < bytes ||
+            header->num_slots != (1ULL << header->q_bits) + qf_extra_slots(header->q_bits)) {
+        return -EINVAL;
+    }
+
+    filter->map = map;
+    filter->header = header;
+    filter->slots = (uint32_t*)(map->mmap + sizeof(bloom_qf_header));
+    return 0;
+}
+
+/**
+ * Adds a key to the filter. The remainder is placed in the
+ * run of its quotient, in order, and the slots up to the next
+ * empty slot are shifted right to make room for it.
+ * @arg filter The filter to add to
+ * @arg hk The hashed key to add
+ * @return 1 if the key was added, 0 if it was already present,
+ * -ENOSPC if the filter is full and must be resized.
+ */
+int qf_add(bloom_qf *filter, bloom_hashed_key *hk) {
+    bloom_qf_header *header = filter->header;
+    uint32_t *slots = filter->slots;
+    uint64_t fp = qf_fingerprint(filter, hk);
+    uint64_t fq = fp >> header->r_bits;
+    uint64_t fr = fp & ((1ULL << header->r_bits) - 1);
+    if (qf_find(filter, fq, fr)) return 0;
+    if (header->count >= qf_capacity(filter)) return -ENOSPC;
+
+    // The slots from the quotient to the next empty slot are
+    // part of its cluster, so the shift ends there
+    uint64_t empty = fq;
+    while (empty < header->num_slots && !qf_is_empty(slots[empty])) empty++;
+    if (empty == header->num_slots) return -ENOSPC;
+
+    // Find where the remainder goes in the run of its quotient
+    int was_occupied = slots[fq] & QF_OCCUPIED;
+    slots[fq] |= QF_OCCUPIED;
+    uint64_t start = qf_run_start(filter, fq);
+    uint64_t s = start;
+    uint32_t entry = (uint32_t)(fr << QF_META_BITS);
+    if (was_occupied) {
+        while (qf_remainder(slots[s]) < fr) {
+            s++;
+            if (s >= header->num_slots || !(slots[s] & QF_CONTINUATION)) break;
+        }
+        if (s == start)
+            slots[start] |= QF_CONTINUATION;
+        else
+            entry |= QF_CONTINUATION;
+    }
+    if (s != fq) entry |= QF_SHIFTED;
+
+    // Shift the rest of the cluster right, the occupied
+    // bits stay with their slots
+    for (uint64_t i=empty; i > s; i--) {
+        slots[i] = (slots[i-1] & ~QF_OCCUPIED) | QF_SHIFTED | (slots[i] & QF_OCCUPIED);
+    }
+    slots[s] = entry | (slots[s] & QF_OCCUPIED);
+    header->count++;
+
+    qf_dirty_slots(filter, (fq < s) ? fq : s, empty);
+    bitmap_dirtybit(filter->map, 0);
+    return 1;
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int qf_contains(bloom_qf *filter, bloom_hashed_key *hk) {
+    uint32_t r_bits = filter->header->r_bits;
+    uint64_t fp = qf_fingerprint(filter, hk);
+    return qf_find(filter, fp >> r_bits, fp & ((1ULL << r_bits) - 1));
+}
+
+/**
+ * Checks the filter for many keys at once. The home slots
+ * of a batch are prefetched before any are tested, so the
+ * cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * is present. Keys with a non-zero result are skipped.
+ * @return 0 on success.
+ */
+int qf_contains_many(bloom_qf *filter, bloom_hashed_key *keys, int num_keys, char *result) {
+    uint32_t r_bits = filter->header->r_bits;
+    uint64_t mask = (1ULL << r_bits) - 1;
+    uint64_t fps[BLOOM_BATCH_SIZE];
+
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Hash everything and start the loads
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            fps[i] = qf_fingerprint(filter, keys + base + i);
+            __builtin_prefetch(filter->slots + (fps[i] >> r_bits), 0, 1);
+        }
+
+        // Resolve the batch
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            result[base+i] = qf_find(filter, fps[i] >> r_bits, fps[i] & mask);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Moves the fingerprints of one or two filters into a new,
+ * empty filter, in a single pass over the inputs. With a single
+ * input this resizes it, since the new filter may have more
+ * quotient bits. With two it is either their union, or their
+ * intersection.
+ * @arg a The first filter
+ * @arg b The second filter, or NULL
+ * @arg intersect Keep only the fingerprints in both filters
+ * @arg out The new filter, from qf_init
+ * @return 0 on success, -EINVAL if the filters do not have
+ * the same fingerprint size or out is not empty, -ENOSPC if
+ * out is too small.
+ */
+int qf_merge(bloom_qf *a, bloom_qf *b, int intersect, bloom_qf *out) {
+    uint32_t bits = out->header->q_bits + out->header->r_bits;
+    if (out->header->count || a->header->q_bits + a->header->r_bits != bits ||
+            (b && b->header->q_bits + b->header->r_bits != bits)) {
+        return -EINVAL;
+    }
+
+    // Walk both filters in order, like merging sorted lists
+    qf_iter ia = {a, 0, 0}, ib = {b, 0, 0};
+    qf_builder builder = {out, 0, 0};
+    uint64_t fa = 0, fb = 0;
+    int has_a = qf_iter_next(&ia, &fa);
+    int has_b = b ? qf_iter_next(&ib, &fb) : 0;
+    int res = 0;
+    while (!res && (has_a || has_b)) {
+        if (has_a && has_b && fa == fb) {
+            res = qf_append(&builder, fa);
+            has_a = qf_iter_next(&ia, &fa);
+            has_b = qf_iter_next(&ib, &fb);
+        } else if (has_a && (!has_b || fa < fb)) {
+            if (!intersect) res = qf_append(&builder, fa);
+            has_a = qf_iter_next(&ia, &fa);
+        } else {
+            if (!intersect) res = qf_append(&builder, fb);
+            has_b = qf_iter_next(&ib, &fb);
+        }
+        if (intersect && (!has_a || !has_b)) break;
+    }
+
+    // The whole table may have been written
+    uint64_t bytes = qf_bytes_for_q_bits(out->header->q_bits);
+    for (uint64_t offset=0; offset < bytes; offset += 4096) {
+        bitmap_dirtybit(out->map, offset * 8);
+    }
+    return res;
+}
+
+/**
+ * Returns the number of keys in the filter.
+ * @arg filter The filter
+ * @return The number of keys
+ */
+uint64_t qf_size(bloom_qf *filter) {
+    return filter->header->count;
+}
+
+/**
+ * Returns the number of keys the filter holds before
+ * it must be resized.
+ * @arg filter The filter
+ * @return The capacity
+ */
+uint64_t qf_capacity(bloom_qf *filter) {
+    return (1ULL << filter->header->q_bits) * QF_LOAD_NUM / QF_LOAD_DEN;
+}
+
+/**
+ * Returns the false positive probability of the filter,
+ * once it is filled to its capacity.
+ * @arg filter The filter
+ * @return The false positive probability
+ */
+double qf_fp_probability(bloom_qf *filter) {
+    return (double)QF_LOAD_NUM / QF_LOAD_DEN / (double)(1ULL << filter->header->r_bits);
+}
+
+/**
+ * Flushes the filter to its bitmap.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int qf_flush(bloom_qf *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying
+ * bitmap, but does not free it.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int qf_close(bloom_qf *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    qf_flush(filter);
+    bitmap_close(filter->map);
+    filter->map = NULL;
+    filter->header = NULL;
+    filter->slots = NULL;
+    return 0;
+}
+
+/**
+ * Returns the slots after the last quotient, which hold the
+ * runs shifted past the end. Clusters grow with the log of the
+ * slots at the load limit, so a multiple of the square root is
+ * plenty.
+ */
+static uint64_t qf_extra_slots(uint32_t q_bits) {
+    return 64 + (10ULL << ((q_bits + 1) / 2));
+}
+
+/**
+ * Finds the slot where the run of a quotient starts. The
+ * start of the cluster is found by walking back over the
+ * shifted slots, then a run is skipped for every occupied
+ * quotient between the cluster start and the quotient.
+ * @arg filter The filter
+ * @arg quotient The quotient, which must be occupied
+ * @return The first slot of the run
+ */
+static uint64_t qf_run_start(bloom_qf *filter, uint64_t quotient) {
+    uint32_t *slots = filter->slots;
+    uint64_t b = quotient;
+    while (b > 0 && (slots[b] & QF_SHIFTED)) b--;
+    uint64_t s = b;
+    while (b != quotient) {
+        do { s++; } while (slots[s] & QF_CONTINUATION);
+        do { b++; } while (!(slots[b] & QF_OCCUPIED));
+    }
+    return s;
+}
+
+/**
+ * Checks for a fingerprint in the run of its quotient,
+ * whose remainders are sorted.
+ * @return 1 if found, 0 otherwise.
+ */
+static int qf_find(bloom_qf *filter, uint64_t quotient, uint64_t remainder) {
+    uint32_t *slots = filter->slots;
+    if (!(slots[quotient] & QF_OCCUPIED)) return 0;
+    uint64_t s = qf_run_start(filter, quotient);
+    uint64_t num_slots = filter->header->num_slots;
+    do {
+        uint64_t r = qf_remainder(slots[s]);
+        if (r == remainder) return 1;
+        if (r > remainder) return 0;
+        s++;
+    } while (s < num_slots && (slots[s] & QF_CONTINUATION));
+    return 0;
+}
+
+/**
+ * Returns the next fingerprint of a filter. Since the table
+ * does not wrap, the slots are read in fingerprint order.
+ * The quotient of a slot is its own index at the start of a
+ * cluster, and the next occupied quotient at the start of
+ * every run after it.
+ * @arg it The iterator
+ * @arg fp Output, the fingerprint
+ * @return 1 if there was a fingerprint, 0 at the end.
+ */
+static int qf_iter_next(qf_iter *it, uint64_t *fp) {
+    bloom_qf *filter = it->filter;
+    uint32_t *slots = filter->slots;
+    uint64_t num_slots = filter->header->num_slots;
+    while (it->pos < num_slots) {
+        uint32_t slot = slots[it->pos];
+        if (qf_is_empty(slot)) {
+            it->pos++;
+            continue;
+        }
+        if (!(slot & QF_SHIFTED)) {
+            it->quotient = it->pos;
+        } else if (!(slot & QF_CONTINUATION)) {
+            do { it->quotient++; } while (!(slots[it->quotient] & QF_OCCUPIED));
+        }
+        *fp = (it->quotient << filter->header->r_bits) | qf_remainder(slot);
+        it->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Appends a fingerprint to a filter being built, which
+ * must be larger than every fingerprint appended before.
+ * @arg b The builder
+ * @arg fp The fingerprint
+ * @return 0 on success, -ENOSPC if the filter is full.
+ */
+static int qf_append(qf_builder *b, uint64_t fp) {
+    bloom_qf_header *header = b->filter->header;
+    uint32_t *slots = b->filter->slots;
+    uint64_t fq = fp >> header->r_bits;
+    uint64_t fr = fp & ((1ULL << header->r_bits) - 1);
+    uint64_t pos = (fq > b->next_free) ? fq : b->next_free;
+    if (pos >= header->num_slots || header->count >= qf_capacity(b->filter)) return -ENOSPC;
+
+    uint32_t entry = (uint32_t)(fr << QF_META_BITS);
+    if (header->count && fq == b->last_quotient) entry |= QF_CONTINUATION;
+    if (pos != fq) entry |= QF_SHIFTED;
+    slots[pos] = entry | (slots[pos] & QF_OCCUPIED);
+    slots[fq] |= QF_OCCUPIED;
+
+    b->next_free = pos + 1;
+    b->last_quotient = fq;
+    header->count++;
+    return 0;
+}
+
+/**
+ * Marks the pages holding a range of slots as dirty.
+ * @arg filter The filter
+ * @arg start The first slot
+ * @arg end The last slot, inclusive
+ */
+static void qf_dirty_slots(bloom_qf *filter, uint64_t start, uint64_t end) {
+    uint64_t first = sizeof(bloom_qf_header) + start * sizeof(uint32_t);
+    uint64_t last = sizeof(bloom_qf_header) + end * sizeof(uint32_t);
+    for (uint64_t offset=first & ~4095ULL; offset <= last; offset += 4096) {
+        bitmap_dirtybit(filter->map, offset * 8);
+    }
+}
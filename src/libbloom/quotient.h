@@ -0,0 +1,188 @@
+#ifndef BLOOM_QUOTIENT_H
+#define BLOOM_QUOTIENT_H
+#include <inttypes.h>
+#include "bitmap.h"
+#include "bloom.h"
+
+/*
+ * A quotient filter, used in place of the layers of a scalable
+ * bloom filter. Each key is reduced to a fingerprint of q + r bits.
+ * The high q bits pick a slot, the quotient, and the low r bits,
+ * the remainder, are stored in or after that slot. Remainders of
+ * the same quotient are kept sorted in a run, and runs are shifted
+ * right past the runs before them, so every slot has 3 bits of
+ * metadata to find the run of a quotient: occupied, continuation
+ * and shifted.
+ *
+ * Since the whole fingerprint can be recovered from the slots, the
+ * filter is resized by moving every fingerprint into a table of
+ * twice the slots with one less bit of remainder, and two filters
+ * are merged in one pass over both, in fingerprint order. Unlike
+ * stacked layers, the false positive rate does not depend on the
+ * number of resizes, only on the bits of remainder left.
+ *
+ * The table does not wrap around, there are extra slots after the
+ * last quotient for the runs that are shifted past the end. The
+ * filter is stored in a bitmap like the bloom filters, so it can be
+ * file backed and faulted in the same way.
+ */
+struct bloom_qf_header {
+    uint32_t magic;             // Magic 4 bytes
+    uint32_t q_bits;            // Bits of quotient, the log2 of the slots
+    uint32_t r_bits;            // Bits of remainder stored in each slot
+    uint32_t __pad;
+    uint64_t num_slots;         // Slots in the table, including the extra slots
+    uint64_t count;             // Count of items
+    char __buf[32];             // Pad out to 64 bytes
+} __attribute__ ((packed));
+typedef struct bloom_qf_header bloom_qf_header;
+
+/*
+ * This is the struct we use to represent a quotient filter.
+ */
+typedef struct {
+    bloom_qf_header *header;    // Pointer to the header in the bitmap region
+    bloom_bitmap *map;          // Underlying bitmap
+    uint32_t *slots;            // The slots, after the header
+} bloom_qf;
+
+/**
+ * The most bits of remainder a slot can store,
+ * along with its 3 bits of metadata.
+ */
+#define QF_MAX_R_BITS 29
+
+/**
+ * The most bits of quotient a filter can have.
+ */
+#define QF_MAX_Q_BITS 40
+
+/**
+ * The extra bits of remainder a new filter is given beyond the
+ * false positive rate it is created for, so it can be doubled
+ * this many times before it reaches that rate.
+ */
+#define QF_GROWTH_BITS 4
+
+/**
+ * Returns the quotient and remainder bits of a new filter
+ * that holds enough keys at a false positive probability.
+ * @arg capacity The keys the filter should hold
+ * @arg fp_probability The target false positive rate
+ * @arg q_bits Output, the bits of quotient
+ * @arg r_bits Output, the bits of remainder
+ * @return 0 on success, -EINVAL if the filter would be too large.
+ */
+int qf_params_for_capacity(uint64_t capacity, double fp_probability, uint32_t *q_bits, uint32_t *r_bits);
+
+/**
+ * Returns the bytes of bitmap needed for a filter.
+ * @arg q_bits The bits of quotient
+ * @return The size in bytes, or 0 if the size is invalid.
+ */
+uint64_t qf_bytes_for_q_bits(uint32_t q_bits);
+
+/**
+ * Initializes a new, empty quotient filter in a bitmap.
+ * @arg map The bitmap, at least qf_bytes_for_q_bits bytes
+ * @arg q_bits The bits of quotient
+ * @arg r_bits The bits of remainder
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL on bad arguments.
+ */
+int qf_init(bloom_bitmap *map, uint32_t q_bits, uint32_t r_bits, bloom_qf *filter);
+
+/**
+ * Opens an existing quotient filter stored in a bitmap.
+ * @arg map The bitmap
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL if the bitmap
+ * does not hold a valid filter.
+ */
+int qf_from_bitmap(bloom_bitmap *map, bloom_qf *filter);
+
+/**
+ * Adds a key to the filter.
+ * @arg filter The filter to add to
+ * @arg hk The hashed key to add
+ * @return 1 if the key was added, 0 if it was already present,
+ * -ENOSPC if the filter is full and must be resized.
+ */
+int qf_add(bloom_qf *filter, bloom_hashed_key *hk);
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int qf_contains(bloom_qf *filter, bloom_hashed_key *hk);
+
+/**
+ * Checks the filter for many keys at once. The home slots
+ * of a batch are prefetched before any are tested, so the
+ * cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * is present. Keys with a non-zero result are skipped.
+ * @return 0 on success.
+ */
+int qf_contains_many(bloom_qf *filter, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Moves the fingerprints of one or two filters into a new,
+ * empty filter, in a single pass over the inputs. With a single
+ * input this resizes it, since the new filter may have more
+ * quotient bits. With two it is either their union, or their
+ * intersection.
+ * @arg a The first filter
+ * @arg b The second filter, or NULL
+ * @arg intersect Keep only the fingerprints in both filters
+ * @arg out The new filter, from qf_init
+ * @return 0 on success, -EINVAL if the filters do not have
+ * the same fingerprint size or out is not empty, -ENOSPC if
+ * out is too small.
+ */
+int qf_merge(bloom_qf *a, bloom_qf *b, int intersect, bloom_qf *out);
+
+/**
+ * Returns the number of keys in the filter.
+ * @arg filter The filter
+ * @return The number of keys
+ */
+uint64_t qf_size(bloom_qf *filter);
+
+/**
+ * Returns the number of keys the filter holds before
+ * it must be resized.
+ * @arg filter The filter
+ * @return The capacity
+ */
+uint64_t qf_capacity(bloom_qf *filter);
+
+/**
+ * Returns the false positive probability of the filter,
+ * once it is filled to its capacity.
+ * @arg filter The filter
+ * @return The false positive probability
+ */
+double qf_fp_probability(bloom_qf *filter);
+
+/**
+ * Flushes the filter to its bitmap.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int qf_flush(bloom_qf *filter);
+
+/**
+ * Flushes and closes the filter. Closes the underlying
+ * bitmap, but does not free it.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int qf_close(bloom_qf *filter);
+
+#endif
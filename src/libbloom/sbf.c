@@ -3,13 +3,47 @@
 #include <stdio.h>
 #include <iso646.h>
 #include "sbf.h"
+#include "probes.h"
 
 /**
  * Static declarations
  */
 static int sbf_append_filter(bloom_sbf *sbf);
+static int sbf_internal_add(bloom_sbf *sbf, bloom_hashed_key *hk, int checked, int can_grow);
+static int sbf_internal_add_many(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result, int can_grow);
+static void sbf_init_keys(bloom_hashed_key *hk, char **keys, int *key_lens, int num_keys);
+static int sbf_contains_hashed(bloom_sbf *sbf, bloom_hashed_key *hk);
+static int sbf_find_hashed(bloom_sbf *sbf, bloom_hashed_key *hk);
+static int sbf_count_present(bloom_sbf *sbf, bloom_hashed_key *hk);
+static int sbf_remove_hashed(bloom_sbf *sbf, bloom_hashed_key *hk);
+static int sbf_contains_many_hashed(bloom_sbf *sbf, bloom_hashed_key *hk, int num_keys, char *result);
 static void sbf_init_capacities(bloom_sbf *sbf);
+static int sbf_release(bloom_sbf *sbf, int discard);
+static int sbf_flush_layers(bloom_sbf *sbf, int sync);
 static double sbf_inital_probability(double fp_prob, double r);
+static void sbf_reorder(bloom_sbf *sbf);
+static void sbf_sample_hits(bloom_sbf *sbf, uint32_t layer, uint32_t num);
+static int sbf_summary_rejects(bloom_sbf *sbf, bloom_hashed_key *hk);
+static void sbf_summary_add(bloom_sbf *sbf, bloom_hashed_key *hk);
+static void sbf_init_totals(bloom_sbf *sbf);
+static inline int sbf_counted_add(bloom_sbf *sbf, uint32_t layer, bloom_hashed_key *hk);
+static inline void sbf_mark_dirty(bloom_sbf *sbf, uint32_t layer);
+
+/**
+ * Counts the hits of each thread, so that every
+ * SBF_HIT_SAMPLE hits one is counted for its layer.
+ */
+static __thread uint32_t sbf_hit_ticks = 0;
+
+/**
+ * Returns the layer checked at a position of the check order.
+ * @arg order The packed check order
+ * @arg pos The position
+ * @return The index of the layer
+ */
+static inline uint32_t sbf_order_layer(uint64_t order, uint32_t pos) {
+    return (pos < SBF_ORDER_LAYERS) ? (order >> (4 * pos)) & 0xF : pos;
+}
 
 int sbf_from_filters(bloom_sbf_params *params,
                      bloom_sbf_callback cb,
@@ -25,6 +59,16 @@ int sbf_from_filters(bloom_sbf_params *params,
     sbf->callback = cb;
     sbf->callback_input = cb_in;
 
+    // No hits yet, and no summary until one is attached
+    sbf->check_order = 0;
+    memset(sbf->hits, 0, sizeof(sbf->hits));
+    sbf->samples = 0;
+    sbf->summary = NULL;
+    sbf->summary_bits = 0;
+    sbf->summary_set = 0;
+    sbf->overfill = 0;
+    sbf->capped = 0;
+
     // Copy the filters
     if (num_filters > 0) {
         sbf->num_filters = num_filters;
@@ -35,11 +79,16 @@ int sbf_from_filters(bloom_sbf_params *params,
 
         // Compute the capacities of the existing filters
         sbf_init_capacities(sbf);
+        sbf_reorder(sbf);
+        sbf_init_totals(sbf);
     } else {
         sbf->num_filters = 0;
         sbf->filters = NULL;
         sbf->dirty_filters = NULL;
         sbf->capacities = NULL;
+        sbf->size = 0;
+        sbf->total_capacity = 0;
+        sbf->byte_size = 0;
 
         int res = sbf_append_filter(sbf);
         if (res != 0) {
@@ -51,15 +100,178 @@ int sbf_from_filters(bloom_sbf_params *params,
 }
 
 /**
- * Adds a new key to the bloom filter.
+ * Adds a new key to the bloom filter. If the callback refuses
+ * to grow the filter with -EDQUOT, the SBF is capped, and is not
+ * grown again until capped is cleared. A capped SBF adds the keys
+ * to its newest layer past its capacity if overfill is set, at
+ * the cost of a higher false positive rate.
  * @arg sbf The filter to add to
  * @arg key The key to add
- * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * @returns 1 if the key was added, 0 if present. -EDQUOT if the
+ * SBF is capped and overfill is not set. Negative on failure.
  */
 int sbf_add(bloom_sbf *sbf, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return sbf_internal_add(sbf, &hk, 0, 1);
+}
+
+/**
+ * Adds a new key to the bloom filter, but never grows it.
+ * This is safe to call concurrently with sbf_contains and other
+ * sbf_try_add calls, since the SBF structure is not modified.
+ * @arg sbf The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if the
+ * SBF is at capacity or the sparse set of its newest layer is full,
+ * and sbf_add must be used with exclusive access.
+ * Negative on failure.
+ */
+int sbf_try_add(bloom_sbf *sbf, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return sbf_internal_add(sbf, &hk, 0, 0);
+}
+
+/**
+ * Adds many keys to the bloom filter. The keys are checked
+ * in batches using bf_contains_many, so that the cache misses
+ * of the layers overlap.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns 0 on success. -EDQUOT as with sbf_add. Negative on failure.
+ */
+int sbf_add_many(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    return sbf_add_many_len(sbf, keys, NULL, num_keys, result);
+}
+
+/**
+ * Adds many keys of known lengths, as with sbf_add_many.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns 0 on success. -EDQUOT as with sbf_add. Negative on failure.
+ */
+int sbf_add_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result) {
+    int res = sbf_internal_add_many(sbf, keys, key_lens, num_keys, result, 1);
+    return (res < 0) ? res : 0;
+}
+
+/**
+ * Adds many keys to the bloom filter, but never grows it.
+ * This is safe to call concurrently with sbf_contains and
+ * sbf_try_add calls, since the SBF structure is not modified.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns The number of keys processed. This is less than num_keys
+ * if the SBF reached capacity or the sparse set of its newest layer
+ * filled, and the rest must be added using
+ * sbf_add_many with exclusive access. Negative on failure.
+ */
+int sbf_try_add_many(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    return sbf_internal_add_many(sbf, keys, NULL, num_keys, result, 0);
+}
+
+/**
+ * Adds many keys of known lengths without growing,
+ * as with sbf_try_add_many.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns The number of keys processed, as with sbf_try_add_many.
+ */
+int sbf_try_add_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result) {
+    return sbf_internal_add_many(sbf, keys, key_lens, num_keys, result, 0);
+}
+
+/**
+ * Prepares a batch of keys for hashing.
+ * @arg hk Output, the hashed keys
+ * @arg keys The keys
+ * @arg key_lens The lengths of the keys, or NULL
+ * to measure the keys.
+ * @arg num_keys The number of keys
+ */
+static void sbf_init_keys(bloom_hashed_key *hk, char **keys, int *key_lens, int num_keys) {
+    for (int i=0; i < num_keys; i++) {
+        if (key_lens)
+            bf_hashed_key_init_len(hk + i, keys[i], key_lens[i]);
+        else
+            bf_hashed_key_init(hk + i, keys[i]);
+    }
+}
+
+/**
+ * Internal add many method.
+ * @arg can_grow If we are allowed to append a new filter
+ * @returns The number of keys processed. Negative on failure.
+ */
+static int sbf_internal_add_many(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result, int can_grow) {
+    bloom_hashed_key hk[BLOOM_BATCH_SIZE];
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Check the batch against every layer
+        sbf_init_keys(hk, keys + base, (key_lens) ? key_lens + base : NULL, n);
+        char *found = result + base;
+        memset(found, 0, n);
+        sbf_contains_many_hashed(sbf, hk, n, found);
+
+        // Add the missing keys. If we grow part way through the batch,
+        // earlier keys may now live in the second layer, so recheck.
+        uint32_t num_filters = sbf->num_filters;
+        for (int i=0; i < n; i++) {
+            if (found[i]) {
+                found[i] = 0;
+                sbf_summary_add(sbf, hk + i);
+                int res = sbf_count_present(sbf, hk + i);
+                if (res < 0) return res;
+                continue;
+            }
+            int res = sbf_internal_add(sbf, hk + i, num_filters == sbf->num_filters, can_grow);
+            if (res == -EAGAIN) return base + i;
+            if (res < 0) return res;
+            found[i] = res;
+        }
+    }
+    return num_keys;
+}
+
+/**
+ * Internal add method.
+ * @arg sbf The filter to add to
+ * @arg hk The hashed key to add
+ * @arg checked Set if the key is known to be absent from all the layers
+ * @arg can_grow If we are allowed to append a new filter
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if
+ * we must grow but cannot. -EDQUOT if we are capped and do not
+ * overfill. Negative on failure.
+ */
+static int sbf_internal_add(bloom_sbf *sbf, bloom_hashed_key *hk, int checked, int can_grow) {
+    // A key missing from the summary is in none of the layers.
+    // The summary is set first, so it never misses a key that a
+    // concurrent check finds in a layer.
+    if (!checked) checked = sbf_summary_rejects(sbf, hk);
+    sbf_summary_add(sbf, hk);
+
     // Check if the key is contained first.
-    if (sbf_contains(sbf, key) == 1) {
-        return 0;
+    if (!checked && sbf_contains_hashed(sbf, hk) == 1) {
+        return sbf_count_present(sbf, hk);
     }
 
     // Get the largest filter
@@ -67,19 +279,58 @@ int sbf_add(bloom_sbf *sbf, char* key) {
 
     // Check if we are over capacity
     if (bf_size(filter) >= sbf->capacities[0]) {
-        int res = sbf_append_filter(sbf);
-        if (res != 0) {
-            return res;
+        // A batch may have added the key since it was checked
+        if (checked && sbf_contains_hashed(sbf, hk) == 1) {
+            return sbf_count_present(sbf, hk);
         }
-        filter = sbf->filters[0];
+
+        // A refused growth is not retried until the SBF is uncapped
+        if (!__atomic_load_n(&sbf->capped, __ATOMIC_RELAXED)) {
+            if (!can_grow) return -EAGAIN;
+            int res = sbf_append_filter(sbf);
+            if (res == -EDQUOT) {
+                __atomic_store_n(&sbf->capped, 1, __ATOMIC_RELAXED);
+            } else if (res != 0) {
+                return res;
+            }
+            filter = sbf->filters[0];
+        }
+        if (__atomic_load_n(&sbf->capped, __ATOMIC_RELAXED) && !sbf->overfill) return -EDQUOT;
     }
 
-    // Mark as dirty, add to the largest filter
-    sbf->dirty_filters[0] = 1;
-    int res = bf_add(filter, key);
+    // Add to the largest filter, which marks it dirty
+    int res = sbf_counted_add(sbf, 0, hk);
+
+    // A full sparse layer is grown like the SBF, with exclusive access
+    if (res == -EAGAIN && can_grow) {
+        res = bf_sparse_grow(filter);
+        if (res == 0) res = sbf_counted_add(sbf, 0, hk);
+    }
     return res;
 }
 
+/**
+ * Adds a key to a layer, and counts it in the
+ * size of the SBF if the layer counted it.
+ * @returns 1 if the key was added, 0 if present.
+ */
+static inline int sbf_counted_add(bloom_sbf *sbf, uint32_t layer, bloom_hashed_key *hk) {
+    int res = bf_add_hashed(sbf->filters[layer], hk);
+    if (res >= 0) sbf_mark_dirty(sbf, layer);
+    if (res == 1) __atomic_fetch_add(&sbf->size, 1, __ATOMIC_RELAXED);
+    return res;
+}
+
+/**
+ * Marks a layer dirty once it was changed. The flag is
+ * stored after the change, and even if it is already set,
+ * since a flush may have cleared it after the change began
+ * but before it was written, and would skip it otherwise.
+ */
+static inline void sbf_mark_dirty(bloom_sbf *sbf, uint32_t layer) {
+    __atomic_store_n(sbf->dirty_filters + layer, 1, __ATOMIC_RELEASE);
+}
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -87,24 +338,317 @@ int sbf_add(bloom_sbf *sbf, char* key) {
  * @returns 1 if present, 0 if not present, negative on error.
  */
 int sbf_contains(bloom_sbf *sbf, char* key) {
-    // Check each filter from largest to smallest
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return sbf_contains_hashed(sbf, &hk);
+}
+
+/**
+ * Checks the filter for many keys at once.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_many(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    return sbf_contains_many_len(sbf, keys, NULL, num_keys, result);
+}
+
+/**
+ * Checks the filter for many keys of known lengths.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result) {
+    bloom_hashed_key hk[BLOOM_BATCH_SIZE];
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+        sbf_init_keys(hk, keys + base, (key_lens) ? key_lens + base : NULL, n);
+        memset(result + base, 0, n);
+        int res = sbf_contains_many_hashed(sbf, hk, n, result + base);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+/**
+ * Checks the filter for many keys that are already prepared,
+ * so keys checked against several filters are hashed only once.
+ * @arg sbf The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_hashed_many(bloom_sbf *sbf, bloom_hashed_key *keys, int num_keys, char *result) {
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+        memset(result + base, 0, n);
+        int res = sbf_contains_many_hashed(sbf, keys + base, n, result + base);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+/**
+ * Checks each filter for a batch of prepared keys.
+ * @arg sbf The filter to check
+ * @arg hk The hashed keys to check
+ * @arg num_keys The number of keys, at most BLOOM_BATCH_SIZE
+ * @arg result Output array, must be zeroed. Set to 1 for each present key.
+ * @returns 0 on success, negative on error.
+ */
+static int sbf_contains_many_hashed(bloom_sbf *sbf, bloom_hashed_key *hk, int num_keys, char *result) {
+    // Keys rejected by the summary are marked 2, so the layers skip them
+    int missing = 0;
+    for (int j=0; j < num_keys; j++) {
+        if (sbf_summary_rejects(sbf, hk + j)) result[j] = 2;
+        missing |= !result[j];
+    }
+
+    // Check each filter in the check order, skipping found keys
+    int res = 0;
+    int found = 0;
+    uint64_t order = __atomic_load_n(&sbf->check_order, __ATOMIC_RELAXED);
+    for (uint32_t i=0; i < sbf->num_filters && missing; i++) {
+        uint32_t layer = sbf_order_layer(order, i);
+        res = bf_contains_many(sbf->filters[layer], hk, num_keys, result);
+        if (res < 0) break;
+
+        // Stop once every key is found
+        int hits = -found;
+        missing = 0;
+        for (int j=0; j < num_keys; j++) {
+            missing |= !result[j];
+            found += (result[j] == 1);
+        }
+        hits += found;
+        if (hits) sbf_sample_hits(sbf, layer, hits);
+    }
+
+    for (int j=0; j < num_keys; j++) result[j] = (result[j] == 1);
+    return (res < 0) ? res : 0;
+}
+
+/**
+ * Checks each filter for a key that has already been
+ * prepared, so that it is hashed at most once.
+ * @arg sbf The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present.
+ */
+static int sbf_contains_hashed(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    if (sbf_summary_rejects(sbf, hk)) return 0;
+
+    // Check each filter in the check order
+    uint64_t order = __atomic_load_n(&sbf->check_order, __ATOMIC_RELAXED);
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        uint32_t layer = sbf_order_layer(order, i);
+        if (bf_contains_hashed(sbf->filters[layer], hk) == 1) {
+            sbf_sample_hits(sbf, layer, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds the first filter that contains a prepared key.
+ * @arg sbf The filter to check
+ * @arg hk The hashed key to check
+ * @returns The index of the filter, or -1 if not present.
+ */
+static int sbf_find_hashed(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    // Check each filter from largest to smallest. This ignores the
+    // check order, since counting filters rely on the first match.
     int res;
     for (uint32_t i=0;i<sbf->num_filters;i++) {
-        res = bf_contains(sbf->filters[i], key);
-        if (res == 1) return 1;
+        res = bf_contains_hashed(sbf->filters[i], hk);
+        if (res == 1) return i;
+    }
+    return -1;
+}
+
+/**
+ * Counts another add of a key that is present. Counting
+ * filters increment the counters in the first filter that
+ * contains the key, which is where it is later removed from.
+ * Aging filters stamp the key in the newest filter, so it
+ * lives on even if an older one has it. Other layouts have
+ * nothing to do.
+ * @arg sbf The filter to add to
+ * @arg hk The hashed key, which is present
+ * @returns 0, the result of adding a present key. Negative on failure.
+ */
+static int sbf_count_present(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    int res;
+    if (sbf->filters[0]->header->layout == BLOOM_LAYOUT_AGING) {
+        res = sbf_counted_add(sbf, 0, hk);
+        return (res < 0) ? res : 0;
+    }
+    if (sbf->filters[0]->header->layout != BLOOM_LAYOUT_COUNTING) {
+        return 0;
+    }
+    int idx = sbf_find_hashed(sbf, hk);
+    if (idx < 0) return 0;
+    res = sbf_counted_add(sbf, idx, hk);
+    return (res < 0) ? res : 0;
+}
+
+/**
+ * Removes a key from a filter using the BLOOM_LAYOUT_COUNTING
+ * layout. The key is removed from the first layer that contains
+ * it, which is where repeated adds of the key were counted. A key
+ * must be removed as many times as it was added. This is safe to
+ * call concurrently with sbf_contains and sbf_try_add calls,
+ * since the SBF structure is not modified.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int sbf_remove(bloom_sbf *sbf, char* key) {
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, key);
+    return sbf_remove_hashed(sbf, &hk);
+}
+
+/**
+ * Removes many keys from a counting filter.
+ * @note Same concurrency rules as sbf_remove.
+ * @arg sbf The filter to remove from
+ * @arg keys The keys to remove
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was
+ * removed and 0 for each key that was not present.
+ * @returns 0 on success, -EINVAL if the layout does not
+ * support removal.
+ */
+int sbf_remove_many(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    return sbf_remove_many_len(sbf, keys, NULL, num_keys, result);
+}
+
+/**
+ * Removes many keys of known lengths from a counting filter.
+ * @note Same concurrency rules as sbf_remove.
+ * @arg sbf The filter to remove from
+ * @arg keys The keys to remove
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was
+ * removed and 0 for each key that was not present.
+ * @returns 0 on success, -EINVAL if the layout does not
+ * support removal.
+ */
+int sbf_remove_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result) {
+    bloom_hashed_key hk;
+    for (int i=0; i < num_keys; i++) {
+        sbf_init_keys(&hk, keys + i, (key_lens) ? key_lens + i : NULL, 1);
+        int res = sbf_remove_hashed(sbf, &hk);
+        if (res < 0) return res;
+        result[i] = res;
     }
     return 0;
 }
 
+/**
+ * Removes a prepared key from the first layer that contains it.
+ * @arg sbf The filter to remove from
+ * @arg hk The hashed key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+static int sbf_remove_hashed(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    // Every layer shares the format, so check the newest
+    if (sbf->filters[0]->header->layout != BLOOM_LAYOUT_COUNTING) {
+        return -EINVAL;
+    }
+    int idx = sbf_find_hashed(sbf, hk);
+    if (idx < 0) return 0;
+    int dropped;
+    int res = bf_remove_counted(sbf->filters[idx], hk, &dropped);
+    if (res >= 0) sbf_mark_dirty(sbf, idx);
+    if (dropped) __atomic_fetch_sub(&sbf->size, 1, __ATOMIC_RELAXED);
+    return res;
+}
+
+/**
+ * Estimates the keys in the SBF and its current false positive
+ * probability from the bits set in its layers, see bf_fill. Only
+ * the layers that had keys added since they were last counted
+ * are counted again.
+ * @arg sbf The SBF
+ * @arg fill Output, the combined fill of the layers
+ * @returns 0 on success, -EINVAL for the counting and aging layouts.
+ */
+int sbf_fill(bloom_sbf *sbf, bloom_filter_fill *fill) {
+    memset(fill, 0, sizeof(bloom_filter_fill));
+
+    // A key is a false positive if any layer has it
+    double miss = 1;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        bloom_filter_fill layer;
+        int res = bf_fill(sbf->filters[i], &layer);
+        if (res) return res;
+        fill->bits += layer.bits;
+        fill->bits_set += layer.bits_set;
+        fill->keys += layer.keys;
+        miss *= 1 - layer.fp_probability;
+    }
+    fill->fp_probability = 1 - miss;
+    return 0;
+}
+
+/**
+ * Advances the clock of every layer of an SBF using the
+ * BLOOM_LAYOUT_AGING layout, so keys that were not set in
+ * the last age_ticks ticks expire. Safe to call concurrently
+ * with sbf_contains and sbf_try_add calls, but not sbf_add.
+ * @arg sbf The filter to age
+ * @arg clock The current tick, which must not go backwards
+ * @return 0 on success, -EINVAL for other layouts.
+ */
+int sbf_age(bloom_sbf *sbf, uint64_t clock) {
+    int aged = 0;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        int res = bf_age(sbf->filters[i], clock);
+        if (res < 0) return res;
+        if (res) sbf_mark_dirty(sbf, i);
+        aged |= res;
+    }
+
+    // The counts of the layers are estimated again
+    if (aged) sbf_init_totals(sbf);
+    return 0;
+}
+
 /**
  * Returns the size of the bloom filter in item count
  */
 uint64_t sbf_size(bloom_sbf *sbf) {
-    uint64_t size = 0;
-    for (uint32_t i=0;i<sbf->num_filters;i++) {
-        size += bf_size(sbf->filters[i]);
+    // Read-only layers are written by another process, so only
+    // their headers have the counts. Those have no dirty pages.
+    bloom_bitmap *newest = (sbf->num_filters) ? sbf->filters[0]->map : NULL;
+    if (newest && newest->mode == SHARED && !newest->dirty_pages) {
+        uint64_t size = 0;
+        for (uint32_t i=0; i < sbf->num_filters; i++) {
+            size += bf_size(sbf->filters[i]);
+        }
+        return size;
     }
-    return size;
+    return __atomic_load_n(&sbf->size, __ATOMIC_RELAXED);
 }
 
 /**
@@ -112,17 +656,49 @@ uint64_t sbf_size(bloom_sbf *sbf) {
  * @return 0 on success, negative on failure.
  */
 int sbf_flush(bloom_sbf *sbf) {
+    return sbf_flush_layers(sbf, 1);
+}
+
+/**
+ * Writes back the filter like sbf_flush, without waiting
+ * for it to be durable. A later fsync or syncfs of the
+ * layers makes the writes durable.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_write(bloom_sbf *sbf) {
+    return sbf_flush_layers(sbf, 0);
+}
+
+/**
+ * Flushes or writes back the dirty layers
+ * @arg sync If 0, does not wait for the layers to be durable
+ */
+static int sbf_flush_layers(bloom_sbf *sbf, int sync) {
     // Check if it has been previously closed
     if (sbf == NULL || sbf->num_filters == 0) {
         return -1;
     }
 
+    // The summary is flushed first, so it is never
+    // missing a key that is in a flushed layer
     int res = 0;
+    if (sbf->summary) {
+        res = (sync) ? bitmap_flush(sbf->summary) : bitmap_write(sbf->summary);
+        if (res != 0) return res;
+    }
     for (uint32_t i=0;i<sbf->num_filters;i++) {
-        if (sbf->dirty_filters[i] == 1) {
-            res = bf_flush(sbf->filters[i]);
-            if (res != 0) break;
-            sbf->dirty_filters[i] = 0;
+        // Sealed layers were written out as they were sealed
+        if (sbf->filters[i]->map->sealed) continue;
+        if (__atomic_load_n(sbf->dirty_filters + i, __ATOMIC_ACQUIRE) == 1) {
+            // Clear the flag before flushing. A writer marks the layer
+            // after every change, so a change the flush may miss
+            // marks it again for the next flush.
+            __atomic_store_n(sbf->dirty_filters + i, 0, __ATOMIC_SEQ_CST);
+            res = (sync) ? bf_flush(sbf->filters[i]) : bf_write(sbf->filters[i]);
+            if (res != 0) {
+                sbf_mark_dirty(sbf, i);
+                break;
+            }
         }
     }
     return res;
@@ -134,23 +710,55 @@ int sbf_flush(bloom_sbf *sbf) {
  * @return 0 on success, negative on failure.
  */
 int sbf_close(bloom_sbf *sbf) {
+    return sbf_release(sbf, 0);
+}
+
+/**
+ * Closes the filter without flushing it, dropping the keys
+ * added since the last flush. Used when the files of the
+ * layers are deleted, so their pages are not written back.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_discard(bloom_sbf *sbf) {
+    return sbf_release(sbf, 1);
+}
+
+/**
+ * Closes the layers and frees them, flushing them
+ * first unless they are discarded.
+ */
+static int sbf_release(bloom_sbf *sbf, int discard) {
     // Check if it has been previously closed
     if (sbf == NULL || sbf->num_filters == 0) {
         return -1;
     }
 
     // Flush first
-    sbf_flush(sbf);
+    if (!discard) sbf_flush(sbf);
 
     int res = 0;
     bloom_bitmap *map;
     for (uint32_t i=0;i<sbf->num_filters;i++) {
         map = sbf->filters[i]->map;
-        res |= bf_close(sbf->filters[i]);
+        if (discard) {
+            res |= bitmap_discard(map);
+        } else {
+            res |= bf_close(sbf->filters[i]);
+        }
         free(sbf->filters[i]);
         free(map);
     }
 
+    if (sbf->summary) {
+        if (discard) {
+            res |= bitmap_discard(sbf->summary);
+        } else {
+            res |= bitmap_close(sbf->summary);
+        }
+        free(sbf->summary);
+        sbf->summary = NULL;
+    }
+
     // Clean up memory
     free(sbf->filters);
     sbf->filters = NULL;
@@ -171,44 +779,27 @@ int sbf_close(bloom_sbf *sbf) {
  * Returns the total capacity of the SBF currently.
  */
 uint64_t sbf_total_capacity(bloom_sbf *sbf) {
-    uint64_t total_capacity = 0;
-    for (uint32_t i=0;i<sbf->num_filters;i++) {
-        total_capacity += sbf->capacities[i];
-    }
-    return total_capacity;
+    return __atomic_load_n(&sbf->total_capacity, __ATOMIC_RELAXED);
 }
 
 /**
  * Returns the total bytes size of the SBF currently.
  */
 uint64_t sbf_total_byte_size(bloom_sbf *sbf) {
-    uint64_t size = 0;
-    bloom_bloomfilter *filter;
-    for (uint32_t i=0;i<sbf->num_filters;i++) {
-        filter = sbf->filters[i];
-        size += filter->map->size;
-    }
-    return size;
+    return __atomic_load_n(&sbf->byte_size, __ATOMIC_RELAXED);
 }
 
 /**
  * Appends a new filter to the SBF
  */
 static int sbf_append_filter(bloom_sbf *sbf) {
-    // Start with the initial configs
-    uint64_t capacity = sbf->params.initial_capacity;
-    double fp_prob = sbf_inital_probability(sbf->params.fp_probability, sbf->params.probability_reduction);
-
-    // Get the settings for the new filter
-    capacity *= pow(sbf->params.scale_size, sbf->num_filters);
-    fp_prob *= pow(sbf->params.probability_reduction, sbf->num_filters);
-
     // Compute the new parameters
-    bloom_filter_params params = {0, 0, capacity, fp_prob};
-    int res = bf_params_for_capacity(&params);
+    bloom_filter_params params;
+    int res = sbf_layer_params(&sbf->params, sbf->num_filters, &params);
     if (res != 0) {
         return res;
     }
+    uint64_t capacity = params.capacity;
 
     // Allocate a new bitmap
     bloom_bitmap *map = calloc(1, sizeof(bloom_bitmap));
@@ -226,13 +817,19 @@ static int sbf_append_filter(bloom_sbf *sbf) {
 
     // Create a new bloom filter
     bloom_bloomfilter *filter = calloc(1, sizeof(bloom_bloomfilter));
-    res = bf_from_bitmap(map, params.k_num, 1, filter);
+    res = bf_from_bitmap_format(map, params.k_num, &sbf->params.format, 1, filter);
     if (res != 0) {
         free(filter);
         free(map);
         return res;
     }
 
+    // A new aging layer keeps time with the others
+    if (filter->header->layout == BLOOM_LAYOUT_AGING && sbf->num_filters) {
+        filter->header->age_clock = sbf->filters[0]->header->age_clock;
+        filter->header->age_now = sbf->filters[0]->header->age_now;
+    }
+
     // Hold onto the old filters and dirty state
     bloom_bloomfilter **old_filters = sbf->filters;
     unsigned char *old_dirty = sbf->dirty_filters;
@@ -258,10 +855,139 @@ static int sbf_append_filter(bloom_sbf *sbf) {
     sbf->filters[0] = filter;
     sbf->dirty_filters[0] = 0;
     sbf->capacities[0] = capacity;
+    __atomic_add_fetch(&sbf->total_capacity, capacity, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sbf->byte_size, map->size, __ATOMIC_RELAXED);
+
+    // Shift the hits along with the layers. The new
+    // layer is empty, so it is checked last for now.
+    for (uint32_t i=SBF_ORDER_LAYERS-1; i > 0; i--) {
+        sbf->hits[i] = sbf->hits[i-1];
+    }
+    sbf->hits[0] = 0;
+    sbf_reorder(sbf);
+
+    BLOOM_PROBE3(layer__grow, sbf->num_filters, capacity, map->size);
+    return 0;
+}
+
+/**
+ * Merges another SBF into this one with bf_merge, matching the
+ * layers by age, so both must be created with the same parameters.
+ * A union adds layers until this SBF has as many as the other. An
+ * intersection is only exact for SBFs of a single layer, since a
+ * key can be in a different layer of each. Nothing is changed if
+ * the SBFs can not be merged.
+ * @arg sbf The SBF to merge into. Must not have a summary.
+ * @arg other The SBF to merge, which is not changed
+ * @arg intersect 1 to intersect the SBFs, 0 for a union
+ * @return 0 on success, -EINVAL if the SBFs can not be merged,
+ * negative on other errors.
+ */
+int sbf_merge(bloom_sbf *sbf, bloom_sbf *other, int intersect) {
+    if (sbf->summary) return -EINVAL;
+    if (intersect && (sbf->num_filters != 1 || other->num_filters != 1)) return -EINVAL;
+
+    // Check every layer first, including the ones we would add.
+    // The oldest layer is last, so layer i is at num_filters - 1 - i.
+    for (uint32_t i=0; i < other->num_filters; i++) {
+        bloom_bloomfilter *o = other->filters[other->num_filters - 1 - i];
+        uint64_t bytes, sparse_bytes;
+        uint32_t k_num;
+        bloom_filter_format format;
+        if (i < sbf->num_filters) {
+            bloom_bloomfilter *f = sbf->filters[sbf->num_filters - 1 - i];
+            bytes = f->map->size;
+            sparse_bytes = f->header->sparse_bytes;
+            k_num = f->header->k_num;
+            format.layout = f->header->layout;
+            format.hash_scheme = f->header->hash_scheme;
+            format.reduction = f->header->reduction;
+        } else {
+            bloom_filter_params params;
+            if (sbf_layer_params(&sbf->params, i, &params)) return -EINVAL;
+            bytes = params.bytes;
+            sparse_bytes = bf_sparse_bytes(bytes, &sbf->params.format);
+            k_num = params.k_num;
+            format = sbf->params.format;
+        }
+        if (bytes != o->map->size || sparse_bytes != o->header->sparse_bytes ||
+                k_num != o->header->k_num ||
+                format.layout != o->header->layout ||
+                format.hash_scheme != o->header->hash_scheme ||
+                format.reduction != o->header->reduction ||
+                format.layout == BLOOM_LAYOUT_COUNTING ||
+                format.layout == BLOOM_LAYOUT_AGING) {
+            return -EINVAL;
+        }
+    }
+
+    while (sbf->num_filters < other->num_filters) {
+        int res = sbf_append_filter(sbf);
+        if (res) return res;
+    }
+    for (uint32_t i=0; i < other->num_filters; i++) {
+        uint32_t layer = sbf->num_filters - 1 - i;
+        int res = bf_merge(sbf->filters[layer], other->filters[other->num_filters - 1 - i], intersect);
+        if (res) return res;
+        sbf_mark_dirty(sbf, layer);
+    }
+    sbf_init_totals(sbf);
+    return 0;
+}
+
+/**
+ * Merges a range of a layer of a copy of this SBF into the same
+ * layer, with bf_merge_bytes. The layers are matched by age, so the
+ * SBFs must be created with the same parameters, and have grown to
+ * the same number of layers.
+ * @arg sbf The SBF to merge into. Must not have a summary.
+ * @arg num_layers The number of layers of the copy
+ * @arg layer The layer of the range, counted from the oldest
+ * @arg layer_bytes The size of the layer in the copy
+ * @arg offset The first byte of the range in the layer
+ * @arg data The bytes of the copy in the range
+ * @arg len The length of the range
+ * @return 0 on success, -EINVAL if the layers differ from the
+ * copy, or the range can not be merged. Negative on other errors.
+ */
+int sbf_merge_bytes(bloom_sbf *sbf, uint32_t num_layers, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, const unsigned char *data, uint64_t len) {
+    if (sbf->summary || num_layers != sbf->num_filters || layer >= num_layers) return -EINVAL;
+    uint32_t index = sbf->num_filters - 1 - layer;
+    bloom_bloomfilter *filter = sbf->filters[index];
+    if (filter->map->size != layer_bytes) return -EINVAL;
 
+    int res = bf_merge_bytes(filter, offset, data, len);
+    if (res) return res;
+    sbf_mark_dirty(sbf, index);
+    sbf_init_totals(sbf);
     return 0;
 }
 
+/**
+ * Computes the parameters of a layer of an SBF. Layer 0 is the
+ * first filter created, and each layer after it scales the capacity
+ * and reduces the false positive probability.
+ * @arg params The parameters of the SBF
+ * @arg layer The layer number, starting from 0
+ * @arg out Output, the parameters of the layer
+ * @return 0 on success, negative on error.
+ */
+int sbf_layer_params(bloom_sbf_params *params, uint32_t layer, bloom_filter_params *out) {
+    // Start with the initial configs
+    uint64_t capacity = params->initial_capacity;
+    double fp_prob = sbf_inital_probability(params->fp_probability, params->probability_reduction);
+
+    // Get the settings for the layer
+    capacity *= pow(params->scale_size, layer);
+    fp_prob *= pow(params->probability_reduction, layer);
+
+    bloom_filter_params layer_params = {0, 0, capacity, fp_prob};
+    int res = bf_params_for_capacity_format(&layer_params, &params->format);
+    if (res == 0) *out = layer_params;
+    return res;
+}
+
 /**
  * Based on "Scalable Bloom Filters", Almeida 2007
  * We use : P <= P0 * (1 / (1 - r))
@@ -285,3 +1011,184 @@ static void sbf_init_capacities(bloom_sbf *sbf) {
         sbf->capacities[i] = capacity;
     }
 }
+
+/**
+ * Computes the totals of the layers from scratch, when the
+ * SBF is created from existing layers, or the counts of its
+ * layers were replaced.
+ */
+static void sbf_init_totals(bloom_sbf *sbf) {
+    uint64_t size = 0, capacity = 0, bytes = 0;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        size += bf_size(sbf->filters[i]);
+        capacity += sbf->capacities[i];
+        bytes += sbf->filters[i]->map->size;
+    }
+    if (sbf->summary) bytes += sbf->summary->size;
+    __atomic_store_n(&sbf->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&sbf->total_capacity, capacity, __ATOMIC_RELAXED);
+    __atomic_store_n(&sbf->byte_size, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Attaches a summary to the SBF. The summary has one bit per
+ * key, and a check of a key whose bit is not set is a miss
+ * without probing any layer. The summary must be attached
+ * before any key is added, or already have the bits of every
+ * key in the layers. Once more than half its bits are set, it
+ * rejects too few keys and is no longer checked. The SBF owns
+ * the bitmap, which is flushed with the layers and closed and
+ * freed by sbf_close.
+ * @arg sbf The SBF
+ * @arg map The bitmap of the summary
+ * @return 0 on success, -EINVAL if there is already a summary
+ * or the bitmap is empty.
+ */
+int sbf_set_summary(bloom_sbf *sbf, bloom_bitmap *map) {
+    if (sbf->summary || !map->size) return -EINVAL;
+
+    // Count the bits set by earlier keys
+    uint64_t set = 0;
+    uint64_t i = 0;
+    for (; i + sizeof(uint64_t) <= map->size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, map->mmap + i, sizeof(word));
+        set += __builtin_popcountll(word);
+    }
+    for (; i < map->size; i++) {
+        set += __builtin_popcount(map->mmap[i]);
+    }
+
+    sbf->summary_bits = map->size * 8;
+    sbf->summary_set = set;
+    sbf->summary = map;
+    __atomic_add_fetch(&sbf->byte_size, map->size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Returns the fraction of the bits set in the summary.
+ * @arg sbf The SBF
+ * @return The fill ratio, or 0 if there is no summary.
+ */
+double sbf_summary_fill(bloom_sbf *sbf) {
+    if (!sbf->summary) return 0;
+    return (double)__atomic_load_n(&sbf->summary_set, __ATOMIC_RELAXED) / sbf->summary_bits;
+}
+
+/**
+ * Returns the order the layers are checked in. Layers that
+ * hold more keys and get more hits are checked first.
+ * @arg sbf The SBF
+ * @arg order Output, the index of each layer in check order.
+ * Must have space for num_filters entries.
+ */
+void sbf_check_order(bloom_sbf *sbf, uint32_t *order) {
+    uint64_t packed = __atomic_load_n(&sbf->check_order, __ATOMIC_RELAXED);
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        order[i] = sbf_order_layer(packed, i);
+    }
+}
+
+/**
+ * Recomputes the check order. Layers with more counted hits
+ * are checked first, then those with more keys, since a key
+ * is more likely to be in a fuller layer. The hits are then
+ * halved, so the order follows changes in the workload.
+ * This is safe to call concurrently with checks, which see
+ * either the old or the new order.
+ */
+static void sbf_reorder(bloom_sbf *sbf) {
+    uint32_t num = sbf->num_filters;
+    if (num > SBF_ORDER_LAYERS) num = SBF_ORDER_LAYERS;
+
+    uint32_t layers[SBF_ORDER_LAYERS];
+    uint64_t hits[SBF_ORDER_LAYERS];
+    uint64_t sizes[SBF_ORDER_LAYERS];
+    for (uint32_t i=0; i < num; i++) {
+        layers[i] = i;
+        hits[i] = __atomic_load_n(&sbf->hits[i], __ATOMIC_RELAXED);
+        sizes[i] = bf_size(sbf->filters[i]);
+    }
+
+    // Insertion sort, keeping newer layers first on ties
+    for (uint32_t i=1; i < num; i++) {
+        uint32_t layer = layers[i];
+        uint32_t j = i;
+        for (; j > 0; j--) {
+            uint32_t prev = layers[j-1];
+            if (hits[prev] > hits[layer]) break;
+            if (hits[prev] == hits[layer] && sizes[prev] >= sizes[layer]) break;
+            layers[j] = prev;
+        }
+        layers[j] = layer;
+    }
+
+    uint64_t order = 0;
+    for (uint32_t i=0; i < num; i++) {
+        order |= (uint64_t)layers[i] << (4 * i);
+    }
+    __atomic_store_n(&sbf->check_order, order, __ATOMIC_RELAXED);
+
+    for (uint32_t i=0; i < num; i++) {
+        __atomic_store_n(&sbf->hits[i], hits[i] / 2, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Counts hits of a layer for the check order. Only every
+ * SBF_HIT_SAMPLE hits of a thread are counted, to keep the
+ * shared counters out of the common path.
+ * @arg sbf The SBF
+ * @arg layer The index of the layer that was hit
+ * @arg num The number of hits
+ */
+static void sbf_sample_hits(bloom_sbf *sbf, uint32_t layer, uint32_t num) {
+    if (sbf->num_filters < 2) return;
+    sbf_hit_ticks += num;
+    if (sbf_hit_ticks < SBF_HIT_SAMPLE) return;
+    sbf_hit_ticks %= SBF_HIT_SAMPLE;
+    if (layer >= SBF_ORDER_LAYERS) return;
+
+    __atomic_fetch_add(&sbf->hits[layer], 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&sbf->samples, 1, __ATOMIC_RELAXED) % SBF_REORDER_SAMPLES == 0) {
+        sbf_reorder(sbf);
+    }
+}
+
+/**
+ * Returns the bit of a key in the summary. The halves of the
+ * hash are mixed, so the bit is not tied to the first probe
+ * of the layers.
+ */
+static inline uint64_t sbf_summary_bit(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    uint64_t *murmur = bf_hashed_key_murmur(hk);
+    uint64_t h = murmur[0] ^ (murmur[1] * 0x9E3779B97F4A7C15ULL);
+    return (uint64_t)(((__uint128_t)h * sbf->summary_bits) >> 64);
+}
+
+/**
+ * Checks if the summary shows a key is in none of the layers.
+ * @return 1 if the key is not present, 0 if it may be present.
+ */
+static int sbf_summary_rejects(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    if (!sbf->summary) return 0;
+    if (__atomic_load_n(&sbf->summary_set, __ATOMIC_RELAXED) * 2 > sbf->summary_bits) return 0;
+    return !bitmap_getbit(sbf->summary, sbf_summary_bit(sbf, hk));
+}
+
+/**
+ * Sets the bit of a key in the summary. The bits are set
+ * a byte at a time so that the newly set bits are counted.
+ */
+static void sbf_summary_add(bloom_sbf *sbf, bloom_hashed_key *hk) {
+    if (!sbf->summary) return;
+    uint64_t idx = sbf_summary_bit(sbf, hk);
+    unsigned char mask = 1 << (7 - idx % 8);
+    unsigned char *byte = sbf->summary->mmap + (idx >> 3);
+    if (__atomic_load_n(byte, __ATOMIC_RELAXED) & mask) return;
+    if (!(__atomic_fetch_or(byte, mask, __ATOMIC_RELEASE) & mask)) {
+        __atomic_fetch_add(&sbf->summary_set, 1, __ATOMIC_RELAXED);
+    }
+    bitmap_dirtybit(sbf->summary, idx);
+}
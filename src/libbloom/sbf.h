@@ -19,6 +19,7 @@ typedef struct {
     double fp_probability;          // FP probability
     uint32_t scale_size;              // Scale size for new filters
     double probability_reduction;   // New filter, fp_prob reduciton
+    bloom_filter_format format;     // Format of new filters
 } bloom_sbf_params;
 
 /**
@@ -28,7 +29,7 @@ typedef struct {
  * probability reduction with each new filter. This works well
  * in most situations.
  */
-#define SBF_DEFAULT_PARAMS {1e5, 1e-4, 4, 0.9}
+#define SBF_DEFAULT_PARAMS {1e5, 1e-4, 4, 0.9, {.layout = BLOOM_LAYOUT_PARTITIONED}}
 
 /**
  * These are memory sensitive parameters for bloom_sbf_params.
@@ -38,7 +39,23 @@ typedef struct {
  * false positive rate, 2x scaling, and a 80% false positive
  * probability reduction with each new filter.
  */
-#define SBF_SLOW_GROW_PARAMS {1e5, 1e-4, 2, 0.8}
+#define SBF_SLOW_GROW_PARAMS {1e5, 1e-4, 2, 0.8, {.layout = BLOOM_LAYOUT_PARTITIONED}}
+
+/**
+ * The number of layers whose check order is tracked. The
+ * order is packed into a single word, 4 bits per layer, so
+ * a check always sees a consistent order. Any older layers
+ * are checked last, from largest to smallest.
+ */
+#define SBF_ORDER_LAYERS 16
+
+/**
+ * Every SBF_HIT_SAMPLE hits of a thread are counted towards
+ * the layer that was hit, and the check order is recomputed
+ * every SBF_REORDER_SAMPLES counted hits.
+ */
+#define SBF_HIT_SAMPLE 64
+#define SBF_REORDER_SAMPLES 1024
 
 /**
  * Represents a scalable bloom filters
@@ -55,6 +72,23 @@ typedef struct {
     unsigned char *dirty_filters;   // Used to set a dirty flag
 
     uint64_t *capacities;            // Tracks the per-filter capacity
+
+    uint64_t check_order;           // Packed order the layers are checked in
+    uint64_t hits[SBF_ORDER_LAYERS]; // Counted hits of each layer
+    uint64_t samples;               // Counted hits of all the layers
+
+    bloom_bitmap *summary;          // Optional bit per key summary, or NULL
+    uint64_t summary_bits;          // Number of bits in the summary
+    uint64_t summary_set;           // Number of bits set in the summary
+
+    int overfill;                   // Add past the capacity of the newest layer once capped
+    int capped;                     // The callback refused to grow the SBF with -EDQUOT
+
+    // Totals of the layers, kept as they change, so they are
+    // read without touching the headers of the layers
+    uint64_t size;                  // Keys in the layers, atomic
+    uint64_t total_capacity;        // Capacity of the layers
+    uint64_t byte_size;             // Bytes of the layers and the summary
 } bloom_sbf;
 
 /**
@@ -76,13 +110,87 @@ int sbf_from_filters(bloom_sbf_params *params,
                      bloom_sbf *sbf);
 
 /**
- * Adds a new key to the bloom filter.
+ * Adds a new key to the bloom filter. If the callback refuses
+ * to grow the filter with -EDQUOT, the SBF is capped, and is not
+ * grown again until capped is cleared. A capped SBF adds the keys
+ * to its newest layer past its capacity if overfill is set, at
+ * the cost of a higher false positive rate.
  * @arg sbf The filter to add to
  * @arg key The key to add
- * @returns 1 if the key was added, 0 if present. Negative on failure.
+ * @returns 1 if the key was added, 0 if present. -EDQUOT if the
+ * SBF is capped and overfill is not set. Negative on failure.
  */
 int sbf_add(bloom_sbf *sbf, char* key);
 
+/**
+ * Adds a new key to the bloom filter, but never grows it.
+ * This is safe to call concurrently with sbf_contains and other
+ * sbf_try_add calls, since the SBF structure is not modified.
+ * @arg sbf The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. -EAGAIN if the
+ * SBF is at capacity or the sparse set of its newest layer is full,
+ * and sbf_add must be used with exclusive access.
+ * Negative on failure.
+ */
+int sbf_try_add(bloom_sbf *sbf, char* key);
+
+/**
+ * Adds many keys to the bloom filter. The keys are checked
+ * in batches using bf_contains_many, so that the cache misses
+ * of the layers overlap.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns 0 on success. -EDQUOT as with sbf_add. Negative on failure.
+ */
+int sbf_add_many(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
+/**
+ * Adds many keys of known lengths, as with sbf_add_many.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns 0 on success. -EDQUOT as with sbf_add. Negative on failure.
+ */
+int sbf_add_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Adds many keys to the bloom filter, but never grows it.
+ * This is safe to call concurrently with sbf_contains and
+ * sbf_try_add calls, since the SBF structure is not modified.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns The number of keys processed. This is less than num_keys
+ * if the SBF reached capacity or the sparse set of its newest layer
+ * filled, and the rest must be added using
+ * sbf_add_many with exclusive access. Negative on failure.
+ */
+int sbf_try_add_many(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
+/**
+ * Adds many keys of known lengths without growing,
+ * as with sbf_try_add_many.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was added,
+ * and 0 for each key that was present.
+ * @returns The number of keys processed, as with sbf_try_add_many.
+ */
+int sbf_try_add_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result);
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -92,7 +200,109 @@ int sbf_add(bloom_sbf *sbf, char* key);
 int sbf_contains(bloom_sbf *sbf, char* key);
 
 /**
- * Returns the size of the bloom filter in item count
+ * Checks the filter for many keys at once.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_many(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
+/**
+ * Checks the filter for many keys of known lengths.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Checks the filter for many keys that are already prepared,
+ * so keys checked against several filters are hashed only once.
+ * @arg sbf The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that is
+ * present and 0 otherwise.
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_hashed_many(bloom_sbf *sbf, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Removes a key from a filter using the BLOOM_LAYOUT_COUNTING
+ * layout. The key is removed from the first layer that contains
+ * it, which is where repeated adds of the key were counted. A key
+ * must be removed as many times as it was added. This is safe to
+ * call concurrently with sbf_contains and sbf_try_add calls,
+ * since the SBF structure is not modified.
+ * @arg sbf The filter to remove from
+ * @arg key The key to remove
+ * @returns 1 if the key was removed, 0 if not present,
+ * -EINVAL if the layout does not support removal.
+ */
+int sbf_remove(bloom_sbf *sbf, char* key);
+
+/**
+ * Removes many keys from a counting filter.
+ * @note Same concurrency rules as sbf_remove.
+ * @arg sbf The filter to remove from
+ * @arg keys The keys to remove
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was
+ * removed and 0 for each key that was not present.
+ * @returns 0 on success, -EINVAL if the layout does not
+ * support removal.
+ */
+int sbf_remove_many(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
+/**
+ * Removes many keys of known lengths from a counting filter.
+ * @note Same concurrency rules as sbf_remove.
+ * @arg sbf The filter to remove from
+ * @arg keys The keys to remove
+ * @arg key_lens The lengths of the keys. If NULL, the
+ * keys are null terminated.
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that was
+ * removed and 0 for each key that was not present.
+ * @returns 0 on success, -EINVAL if the layout does not
+ * support removal.
+ */
+int sbf_remove_many_len(bloom_sbf *sbf, char **keys, int *key_lens, int num_keys, char *result);
+
+/**
+ * Estimates the keys in the SBF and its current false positive
+ * probability from the bits set in its layers, see bf_fill. Only
+ * the layers that had keys added since they were last counted
+ * are counted again.
+ * @arg sbf The SBF
+ * @arg fill Output, the combined fill of the layers
+ * @returns 0 on success, -EINVAL for the counting and aging layouts.
+ */
+int sbf_fill(bloom_sbf *sbf, bloom_filter_fill *fill);
+
+/**
+ * Advances the clock of every layer of an SBF using the
+ * BLOOM_LAYOUT_AGING layout, so keys that were not set in
+ * the last age_ticks ticks expire. Safe to call concurrently
+ * with sbf_contains and sbf_try_add calls, but not sbf_add.
+ * @arg sbf The filter to age
+ * @arg clock The current tick, which must not go backwards
+ * @return 0 on success, -EINVAL for other layouts.
+ */
+int sbf_age(bloom_sbf *sbf, uint64_t clock);
+
+/**
+ * Returns the size of the bloom filter in item count.
+ * This is a cached total, which does not touch the layers,
+ * unless they are read-only and written by another process.
  */
 uint64_t sbf_size(bloom_sbf *sbf);
 
@@ -102,6 +312,14 @@ uint64_t sbf_size(bloom_sbf *sbf);
  */
 int sbf_flush(bloom_sbf *sbf);
 
+/**
+ * Writes back the filter like sbf_flush, without waiting
+ * for it to be durable. A later fsync or syncfs of the
+ * layers makes the writes durable.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_write(bloom_sbf *sbf);
+
 /**
  * Flushes and closes the filter. Closes the underlying bitmap and filters,
  * and frees them.
@@ -110,14 +328,100 @@ int sbf_flush(bloom_sbf *sbf);
 
 int sbf_close(bloom_sbf *sbf);
 
+/**
+ * Closes the filter without flushing it, dropping the keys
+ * added since the last flush. Used when the files of the
+ * layers are deleted, so their pages are not written back.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_discard(bloom_sbf *sbf);
+
 /**
  * Returns the total capacity of the SBF currently.
+ * This is a cached total, which does not touch the layers.
  */
 uint64_t sbf_total_capacity(bloom_sbf *sbf);
 
 /**
  * Returns the total bytes size of the SBF currently.
+ * This is a cached total, which does not touch the layers.
  */
 uint64_t sbf_total_byte_size(bloom_sbf *sbf);
 
+/**
+ * Computes the parameters of a layer of an SBF. Layer 0 is the
+ * first filter created, and each layer after it scales the capacity
+ * and reduces the false positive probability.
+ * @arg params The parameters of the SBF
+ * @arg layer The layer number, starting from 0
+ * @arg out Output, the parameters of the layer
+ * @return 0 on success, negative on error.
+ */
+int sbf_layer_params(bloom_sbf_params *params, uint32_t layer, bloom_filter_params *out);
+
+/**
+ * Attaches a summary to the SBF. The summary has one bit per
+ * key, and a check of a key whose bit is not set is a miss
+ * without probing any layer. The summary must be attached
+ * before any key is added, or already have the bits of every
+ * key in the layers. Once more than half its bits are set, it
+ * rejects too few keys and is no longer checked. The SBF owns
+ * the bitmap, which is flushed with the layers and closed and
+ * freed by sbf_close.
+ * @arg sbf The SBF
+ * @arg map The bitmap of the summary
+ * @return 0 on success, -EINVAL if there is already a summary
+ * or the bitmap is empty.
+ */
+int sbf_set_summary(bloom_sbf *sbf, bloom_bitmap *map);
+
+/**
+ * Merges another SBF into this one with bf_merge, matching the
+ * layers by age, so both must be created with the same parameters.
+ * A union adds layers until this SBF has as many as the other. An
+ * intersection is only exact for SBFs of a single layer, since a
+ * key can be in a different layer of each. Nothing is changed if
+ * the SBFs can not be merged.
+ * @arg sbf The SBF to merge into. Must not have a summary.
+ * @arg other The SBF to merge, which is not changed
+ * @arg intersect 1 to intersect the SBFs, 0 for a union
+ * @return 0 on success, -EINVAL if the SBFs can not be merged,
+ * negative on other errors.
+ */
+int sbf_merge(bloom_sbf *sbf, bloom_sbf *other, int intersect);
+
+/**
+ * Merges a range of a layer of a copy of this SBF into the same
+ * layer, with bf_merge_bytes. The layers are matched by age, so the
+ * SBFs must be created with the same parameters, and have grown to
+ * the same number of layers.
+ * @arg sbf The SBF to merge into. Must not have a summary.
+ * @arg num_layers The number of layers of the copy
+ * @arg layer The layer of the range, counted from the oldest
+ * @arg layer_bytes The size of the layer in the copy
+ * @arg offset The first byte of the range in the layer
+ * @arg data The bytes of the copy in the range
+ * @arg len The length of the range
+ * @return 0 on success, -EINVAL if the layers differ from the
+ * copy, or the range can not be merged. Negative on other errors.
+ */
+int sbf_merge_bytes(bloom_sbf *sbf, uint32_t num_layers, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, const unsigned char *data, uint64_t len);
+
+/**
+ * Returns the fraction of the bits set in the summary.
+ * @arg sbf The SBF
+ * @return The fill ratio, or 0 if there is no summary.
+ */
+double sbf_summary_fill(bloom_sbf *sbf);
+
+/**
+ * Returns the order the layers are checked in. Layers that
+ * hold more keys and get more hits are checked first.
+ * @arg sbf The SBF
+ * @arg order Output, the index of each layer in check order.
+ * Must have space for num_filters entries.
+ */
+void sbf_check_order(bloom_sbf *sbf, uint32_t *order);
+
 #endif
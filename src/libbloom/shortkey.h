@@ -0,0 +1,108 @@
+#ifndef BLOOM_SHORTKEY_H
+#define BLOOM_SHORTKEY_H
+#include <inttypes.h>
+#include <string.h>
+
+/*
+ * A 128bit hash of short keys, used by the BLOOM_HASH_SHORT
+ * scheme for keys of up to BLOOM_SHORT_KEY_MAX bytes. The key
+ * is loaded into at most four words with overlapping loads, so
+ * there is no loop or byte by byte tail, and each pair of words
+ * is folded into two lanes with the multiply-xor rounds of
+ * MurmurHash3, followed by its finalizer. The length seeds the
+ * lanes, so keys whose loads overlap differently never collide
+ * by construction. Longer keys use MurmurHash3 in full.
+ *
+ * The words are read in host order, so like MurmurHash3
+ * the hashes differ between hosts of different endianness.
+ * It is not keyed, so the hash does not resist keys that
+ * are chosen to collide.
+ */
+#define BLOOM_SHORT_KEY_MAX 32
+
+#define BLOOM_SHORT_C1 0x87c37b91114253d5ULL
+#define BLOOM_SHORT_C2 0x4cf5ad432745937fULL
+
+static inline uint64_t bf_short_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t bf_short_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t bf_short_load64(const unsigned char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline uint64_t bf_short_load32(const unsigned char *p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+/**
+ * Folds a pair of words into the lanes, as a
+ * block of the body of MurmurHash3_x64_128.
+ */
+static inline void bf_short_round(uint64_t *h1, uint64_t *h2, uint64_t k1, uint64_t k2) {
+    k1 *= BLOOM_SHORT_C1;
+    k1 = bf_short_rotl(k1, 31);
+    k1 *= BLOOM_SHORT_C2;
+    *h1 ^= k1;
+    *h1 = bf_short_rotl(*h1, 27) + *h2;
+    *h1 = *h1 * 5 + 0x52dce729;
+
+    k2 *= BLOOM_SHORT_C2;
+    k2 = bf_short_rotl(k2, 33);
+    k2 *= BLOOM_SHORT_C1;
+    *h2 ^= k2;
+    *h2 = bf_short_rotl(*h2, 31) + *h1;
+    *h2 = *h2 * 5 + 0x38495ab5;
+}
+
+/**
+ * Hashes a key of up to BLOOM_SHORT_KEY_MAX bytes.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @arg out Output, the two 64bit halves of the hash
+ */
+static inline void bf_short_hash128(const void *key, uint64_t len, uint64_t *out) {
+    const unsigned char *p = key;
+    uint64_t w0 = 0, w1 = 0, w2 = 0, w3 = 0;
+    if (len > 16) {
+        w0 = bf_short_load64(p);
+        w1 = bf_short_load64(p + 8);
+        w2 = bf_short_load64(p + len - 16);
+        w3 = bf_short_load64(p + len - 8);
+    } else if (len >= 8) {
+        w0 = bf_short_load64(p);
+        w1 = bf_short_load64(p + len - 8);
+    } else if (len >= 4) {
+        w0 = bf_short_load32(p) | (bf_short_load32(p + len - 4) << 32);
+    } else if (len) {
+        w0 = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+    }
+
+    uint64_t h1 = len * BLOOM_SHORT_C2, h2 = ~len * BLOOM_SHORT_C1;
+    bf_short_round(&h1, &h2, w0, w1);
+    if (len > 16) bf_short_round(&h1, &h2, w2, w3);
+
+    h1 += h2;
+    h2 += h1;
+    h1 = bf_short_fmix(h1);
+    h2 = bf_short_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+#endif
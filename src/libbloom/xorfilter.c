@@ -0,0 +1,396 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "xorfilter.h"
+
+/*
+ * Static definitions
+ */
+static const uint32_t XOR_MAGIC_HEADER = 0x31524F58;  // "XOR1"
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+/**
+ * The number of seeds tried before giving up on a build.
+ * Each attempt fails with a small constant probability,
+ * so this is only reached if the hashes are not unique.
+ */
+#define XOR_MAX_ATTEMPTS 64
+
+/**
+ * The table has 1.23 slots per key, and 32 extra slots
+ * so that small key sets are still likely to peel.
+ */
+#define XOR_SLOTS_NUM 123
+#define XOR_SLOTS_DEN 100
+#define XOR_SLOTS_EXTRA 32
+
+static uint64_t xf_block_length(uint64_t num_keys);
+static int compare_hashes(const void *a, const void *b);
+
+/**
+ * The splitmix64 finalizer, used to apply
+ * the seed of the filter to a key hash.
+ */
+static inline uint64_t xf_mix(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * Maps a hash onto [0, n) using multiply-shift.
+ */
+static inline uint64_t xf_reduce(uint64_t h, uint64_t n) {
+    return (uint64_t)(((__uint128_t)h * n) >> 64);
+}
+
+static inline uint64_t xf_rotl(uint64_t h, int r) {
+    return (h << r) | (h >> (64 - r));
+}
+
+/**
+ * Computes the three slots of a seeded hash,
+ * one in each third of the table.
+ */
+static inline void xf_slots(uint64_t h, uint64_t block_length, uint64_t *slots) {
+    slots[0] = xf_reduce(h, block_length);
+    slots[1] = block_length + xf_reduce(xf_rotl(h, 21), block_length);
+    slots[2] = 2 * block_length + xf_reduce(xf_rotl(h, 42), block_length);
+}
+
+static inline uint32_t xf_fingerprint(uint64_t h, uint32_t bits) {
+    return (uint32_t)(h ^ (h >> 32)) & ((1U << bits) - 1);
+}
+
+static inline uint32_t xf_get(unsigned char *fps, uint32_t bits, uint64_t slot) {
+    if (bits == 8) return fps[slot];
+    return ((uint16_t*)fps)[slot];
+}
+
+static inline void xf_set(unsigned char *fps, uint32_t bits, uint64_t slot, uint32_t val) {
+    if (bits == 8)
+        fps[slot] = val;
+    else
+        ((uint16_t*)fps)[slot] = val;
+}
+
+/**
+ * Hashes a key for use with xf_build. Only the MurmurHash3
+ * of the key is used, which is cached in the hashed key.
+ * @arg hk The hashed key
+ * @return The 64bit hash of the key
+ */
+uint64_t xf_hash_key(bloom_hashed_key *hk) {
+    if (!hk->has_murmur) {
+        MurmurHash3_x64_128(hk->key, hk->len, 0, hk->murmur);
+        hk->has_murmur = 1;
+    }
+    return hk->murmur[0];
+}
+
+/**
+ * Sorts an array of key hashes and removes the duplicates,
+ * which xf_build requires.
+ * @arg hashes The hashes, modified in place
+ * @arg num The number of hashes
+ * @return The number of unique hashes, at the start of the array.
+ */
+uint64_t xf_unique_hashes(uint64_t *hashes, uint64_t num) {
+    if (num < 2) return num;
+    qsort(hashes, num, sizeof(uint64_t), compare_hashes);
+    uint64_t out = 1;
+    for (uint64_t i=1; i < num; i++) {
+        if (hashes[i] != hashes[out-1]) hashes[out++] = hashes[i];
+    }
+    return out;
+}
+
+/**
+ * Returns the fingerprint size needed to reach
+ * a false positive probability.
+ * @arg fp_probability The target false positive rate
+ * @return 8 or 16
+ */
+uint32_t xf_fingerprint_bits(double fp_probability) {
+    return (fp_probability >= 1.0 / 256) ? 8 : 16;
+}
+
+/**
+ * Returns the bytes of bitmap needed to build
+ * a filter over a number of keys.
+ * @arg num_keys The number of unique keys
+ * @arg fingerprint_bits 8 or 16
+ * @return The size in bytes, or 0 if the size is invalid.
+ */
+uint64_t xf_bytes_for_keys(uint64_t num_keys, uint32_t fingerprint_bits) {
+    if (fingerprint_bits != 8 && fingerprint_bits != 16) return 0;
+    return sizeof(bloom_xorfilter_header) +
+        3 * xf_block_length(num_keys) * (fingerprint_bits / 8);
+}
+
+/**
+ * Builds a new xor filter in a bitmap. Keys are placed by
+ * peeling: a slot that only one key maps to can be assigned
+ * last, so it is removed along with its key, until every key
+ * is removed. The keys are then assigned in reverse order.
+ * @arg map The bitmap, at least xf_bytes_for_keys bytes
+ * @arg hashes The unique key hashes, from xf_unique_hashes
+ * @arg num_keys The number of hashes
+ * @arg fingerprint_bits 8 or 16
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL on bad arguments or if
+ * the keys could not be placed, -ENOMEM if the build space
+ * could not be allocated.
+ */
+int xf_build(bloom_bitmap *map, uint64_t *hashes, uint64_t num_keys,
+        uint32_t fingerprint_bits, bloom_xorfilter *filter) {
+    if (map == NULL || filter == NULL) return -EINVAL;
+    uint64_t bytes = xf_bytes_for_keys(num_keys, fingerprint_bits);
+    if (!bytes || map->size < bytes) return -EINVAL;
+
+    // Allocate the build space
+    uint64_t block_length = xf_block_length(num_keys);
+    uint64_t num_slots = 3 * block_length;
+    uint64_t *xormask = malloc(num_slots * sizeof(uint64_t));
+    uint32_t *counts = malloc(num_slots * sizeof(uint32_t));
+    uint64_t *queue = malloc(num_slots * sizeof(uint64_t));
+    uint64_t *stack_hash = malloc((num_keys + 1) * sizeof(uint64_t));
+    uint64_t *stack_slot = malloc((num_keys + 1) * sizeof(uint64_t));
+    int res = 0;
+    if (!xormask || !counts || !queue || !stack_hash || !stack_slot) {
+        res = -ENOMEM;
+        goto LEAVE;
+    }
+
+    uint64_t seed = 0, stacked = 0, slots[3];
+    for (int attempt=0; attempt < XOR_MAX_ATTEMPTS && stacked < num_keys; attempt++) {
+        seed = xf_mix(attempt + 1);
+        memset(xormask, 0, num_slots * sizeof(uint64_t));
+        memset(counts, 0, num_slots * sizeof(uint32_t));
+        for (uint64_t i=0; i < num_keys; i++) {
+            uint64_t h = xf_mix(hashes[i] + seed);
+            xf_slots(h, block_length, slots);
+            for (int j=0; j < 3; j++) {
+                xormask[slots[j]] ^= h;
+                counts[slots[j]]++;
+            }
+        }
+
+        // Start with every slot that only has one key. A slot
+        // is only queued when its count drops to one, so the
+        // queue can not hold more than num_slots entries.
+        uint64_t queued = 0;
+        for (uint64_t i=0; i < num_slots; i++) {
+            if (counts[i] == 1) queue[queued++] = i;
+        }
+
+        stacked = 0;
+        while (queued) {
+            uint64_t slot = queue[--queued];
+            if (counts[slot] != 1) continue;
+            uint64_t h = xormask[slot];
+            stack_hash[stacked] = h;
+            stack_slot[stacked++] = slot;
+            xf_slots(h, block_length, slots);
+            for (int j=0; j < 3; j++) {
+                xormask[slots[j]] ^= h;
+                if (--counts[slots[j]] == 1) queue[queued++] = slots[j];
+            }
+        }
+    }
+    if (stacked < num_keys) {
+        res = -EINVAL;
+        goto LEAVE;
+    }
+
+    // Setup the header
+    filter->map = map;
+    filter->header = (bloom_xorfilter_header*)map->mmap;
+    filter->fingerprints = map->mmap + sizeof(bloom_xorfilter_header);
+    memset(map->mmap, 0, bytes);
+    filter->header->magic = XOR_MAGIC_HEADER;
+    filter->header->fingerprint_bits = fingerprint_bits;
+    filter->header->seed = seed;
+    filter->header->block_length = block_length;
+    filter->header->count = num_keys;
+
+    // Each key is assigned after the keys that were peeled
+    // after it, so its slot is free for it to complete its xor
+    for (uint64_t i=stacked; i > 0; i--) {
+        uint64_t h = stack_hash[i-1];
+        xf_slots(h, block_length, slots);
+        uint32_t fp = xf_fingerprint(h, fingerprint_bits);
+        for (int j=0; j < 3; j++) {
+            fp ^= xf_get(filter->fingerprints, fingerprint_bits, slots[j]);
+        }
+        xf_set(filter->fingerprints, fingerprint_bits, stack_slot[i-1], fp);
+    }
+
+    // The whole table was written
+    for (uint64_t offset=0; offset < bytes; offset += 4096) {
+        bitmap_dirtybit(map, offset * 8);
+    }
+
+LEAVE:
+    free(xormask);
+    free(counts);
+    free(queue);
+    free(stack_hash);
+    free(stack_slot);
+    return res;
+}
+
+/**
+ * Opens an existing xor filter stored in a bitmap.
+ * @arg map The bitmap
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL if the bitmap
+ * does not hold a valid filter.
+ */
+int xf_from_bitmap(bloom_bitmap *map, bloom_xorfilter *filter) {
+    if (map == NULL || filter == NULL || map->size < sizeof(bloom_xorfilter_header))
+        return -EINVAL;
+
+    bloom_xorfilter_header *header = (bloom_xorfilter_header*)map->mmap;
+    if (header->magic != XOR_MAGIC_HEADER ||
+            (header->fingerprint_bits != 8 && header->fingerprint_bits != 16) ||
+            !header->block_length) {
+        return -EINVAL;
+    }
+    uint64_t bytes = sizeof(bloom_xorfilter_header) +
+        3 * header->block_length * (header->fingerprint_bits / 8);
+    if (map->size < bytes) return -EINVAL;
+
+    filter->map = map;
+    filter->header = header;
+    filter->fingerprints = map->mmap + sizeof(bloom_xorfilter_header);
+    return 0;
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int xf_contains(bloom_xorfilter *filter, bloom_hashed_key *hk) {
+    bloom_xorfilter_header *header = filter->header;
+    uint32_t bits = header->fingerprint_bits;
+    uint64_t h = xf_mix(xf_hash_key(hk) + header->seed);
+    uint64_t slots[3];
+    xf_slots(h, header->block_length, slots);
+    uint32_t fp = xf_fingerprint(h, bits);
+    fp ^= xf_get(filter->fingerprints, bits, slots[0]);
+    fp ^= xf_get(filter->fingerprints, bits, slots[1]);
+    fp ^= xf_get(filter->fingerprints, bits, slots[2]);
+    return fp == 0;
+}
+
+/**
+ * Checks the filter for many keys at once. The slots of
+ * a batch are prefetched before any are tested, so the
+ * cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * is present. Keys with a non-zero result are skipped.
+ * @return 0 on success.
+ */
+int xf_contains_many(bloom_xorfilter *filter, bloom_hashed_key *keys, int num_keys, char *result) {
+    bloom_xorfilter_header *header = filter->header;
+    uint32_t bits = header->fingerprint_bits;
+    uint32_t width = bits / 8;
+    uint64_t h[BLOOM_BATCH_SIZE], slots[BLOOM_BATCH_SIZE][3];
+
+    for (int base=0; base < num_keys; base += BLOOM_BATCH_SIZE) {
+        int n = num_keys - base;
+        if (n > BLOOM_BATCH_SIZE) n = BLOOM_BATCH_SIZE;
+
+        // Hash everything and start the loads
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            h[i] = xf_mix(xf_hash_key(keys + base + i) + header->seed);
+            xf_slots(h[i], header->block_length, slots[i]);
+            for (int j=0; j < 3; j++) {
+                __builtin_prefetch(filter->fingerprints + slots[i][j] * width, 0, 1);
+            }
+        }
+
+        // Resolve the batch
+        for (int i=0; i < n; i++) {
+            if (result[base+i]) continue;
+            uint32_t fp = xf_fingerprint(h[i], bits);
+            for (int j=0; j < 3; j++) {
+                fp ^= xf_get(filter->fingerprints, bits, slots[i][j]);
+            }
+            result[base+i] = (fp == 0);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the number of keys in the filter.
+ * @arg filter The filter
+ * @return The number of keys
+ */
+uint64_t xf_size(bloom_xorfilter *filter) {
+    return filter->header->count;
+}
+
+/**
+ * Returns the false positive probability of the filter.
+ * @arg filter The filter
+ * @return The false positive probability
+ */
+double xf_fp_probability(bloom_xorfilter *filter) {
+    return 1.0 / (1U << filter->header->fingerprint_bits);
+}
+
+/**
+ * Flushes the filter to its bitmap.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int xf_flush(bloom_xorfilter *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying
+ * bitmap, but does not free it.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int xf_close(bloom_xorfilter *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    xf_flush(filter);
+    bitmap_close(filter->map);
+    filter->map = NULL;
+    filter->header = NULL;
+    filter->fingerprints = NULL;
+    return 0;
+}
+
+/**
+ * Returns the number of slots in each third of
+ * the table for a number of keys.
+ */
+static uint64_t xf_block_length(uint64_t num_keys) {
+    uint64_t slots = XOR_SLOTS_EXTRA + (num_keys * XOR_SLOTS_NUM + XOR_SLOTS_DEN - 1) / XOR_SLOTS_DEN;
+    return (slots + 2) / 3;
+}
+
+/**
+ * Orders hashes for qsort.
+ */
+static int compare_hashes(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
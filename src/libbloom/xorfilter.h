@@ -0,0 +1,145 @@
+#ifndef BLOOM_XORFILTER_H
+#define BLOOM_XORFILTER_H
+#include <inttypes.h>
+#include "bitmap.h"
+#include "bloom.h"
+
+/*
+ * An immutable xor filter, built once from a known set of
+ * keys. Each key maps to three fingerprint slots, one in each
+ * third of the table, and the slots are assigned so that the
+ * xor of the three equals the fingerprint of the key. A check
+ * is three loads regardless of the false positive rate, and the
+ * table takes about 1.23 fingerprints per key, which is less
+ * than a bloom filter with the same false positive rate.
+ *
+ * Keys cannot be added once the filter is built. The filter
+ * is stored in a bitmap like the bloom filters, so it can be
+ * file backed and faulted in the same way.
+ */
+struct bloom_xorfilter_header {
+    uint32_t magic;             // Magic 4 bytes
+    uint32_t fingerprint_bits;  // Bits per fingerprint, 8 or 16
+    uint64_t seed;              // Seed the keys were hashed with
+    uint64_t block_length;      // Slots in each third of the table
+    uint64_t count;             // Count of items
+    char __buf[32];             // Pad out to 64 bytes
+} __attribute__ ((packed));
+typedef struct bloom_xorfilter_header bloom_xorfilter_header;
+
+/*
+ * This is the struct we use to represent an xor filter.
+ */
+typedef struct {
+    bloom_xorfilter_header *header; // Pointer to the header in the bitmap region
+    bloom_bitmap *map;              // Underlying bitmap
+    unsigned char *fingerprints;    // The fingerprint table, after the header
+} bloom_xorfilter;
+
+/**
+ * Hashes a key for use with xf_build. Only the MurmurHash3
+ * of the key is used, which is cached in the hashed key.
+ * @arg hk The hashed key
+ * @return The 64bit hash of the key
+ */
+uint64_t xf_hash_key(bloom_hashed_key *hk);
+
+/**
+ * Sorts an array of key hashes and removes the duplicates,
+ * which xf_build requires.
+ * @arg hashes The hashes, modified in place
+ * @arg num The number of hashes
+ * @return The number of unique hashes, at the start of the array.
+ */
+uint64_t xf_unique_hashes(uint64_t *hashes, uint64_t num);
+
+/**
+ * Returns the fingerprint size needed to reach
+ * a false positive probability.
+ * @arg fp_probability The target false positive rate
+ * @return 8 or 16
+ */
+uint32_t xf_fingerprint_bits(double fp_probability);
+
+/**
+ * Returns the bytes of bitmap needed to build
+ * a filter over a number of keys.
+ * @arg num_keys The number of unique keys
+ * @arg fingerprint_bits 8 or 16
+ * @return The size in bytes, or 0 if the size is invalid.
+ */
+uint64_t xf_bytes_for_keys(uint64_t num_keys, uint32_t fingerprint_bits);
+
+/**
+ * Builds a new xor filter in a bitmap.
+ * @arg map The bitmap, at least xf_bytes_for_keys bytes
+ * @arg hashes The unique key hashes, from xf_unique_hashes
+ * @arg num_keys The number of hashes
+ * @arg fingerprint_bits 8 or 16
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL on bad arguments,
+ * -ENOMEM if the build space could not be allocated.
+ */
+int xf_build(bloom_bitmap *map, uint64_t *hashes, uint64_t num_keys,
+        uint32_t fingerprint_bits, bloom_xorfilter *filter);
+
+/**
+ * Opens an existing xor filter stored in a bitmap.
+ * @arg map The bitmap
+ * @arg filter The filter to setup
+ * @return 0 on success, -EINVAL if the bitmap
+ * does not hold a valid filter.
+ */
+int xf_from_bitmap(bloom_bitmap *map, bloom_xorfilter *filter);
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg hk The hashed key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int xf_contains(bloom_xorfilter *filter, bloom_hashed_key *hk);
+
+/**
+ * Checks the filter for many keys at once. The slots of
+ * a batch are prefetched before any are tested, so the
+ * cache misses overlap.
+ * @arg filter The filter to check
+ * @arg keys The hashed keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output array, set to 1 for each key that
+ * is present. Keys with a non-zero result are skipped.
+ * @return 0 on success.
+ */
+int xf_contains_many(bloom_xorfilter *filter, bloom_hashed_key *keys, int num_keys, char *result);
+
+/**
+ * Returns the number of keys in the filter.
+ * @arg filter The filter
+ * @return The number of keys
+ */
+uint64_t xf_size(bloom_xorfilter *filter);
+
+/**
+ * Returns the false positive probability of the filter.
+ * @arg filter The filter
+ * @return The false positive probability
+ */
+double xf_fp_probability(bloom_xorfilter *filter);
+
+/**
+ * Flushes the filter to its bitmap.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int xf_flush(bloom_xorfilter *filter);
+
+/**
+ * Flushes and closes the filter. Closes the underlying
+ * bitmap, but does not free it.
+ * @arg filter The filter
+ * @return 0 on success, negative on failure.
+ */
+int xf_close(bloom_xorfilter *filter);
+
+#endif
@@ -5,6 +5,23 @@
 #include "test_filter.c"
 #include "test_filtmgr.c"
 #include "test_art.c"
+#include "test_latency.c"
+#include "test_metrics.c"
+#include "test_numa.c"
+#include "test_replication.c"
+#include "test_cluster.c"
+#include "test_arena.c"
+#include "test_tokenize.c"
+#include "test_executor.c"
+#include "test_mpsc.c"
+#include "test_tls.c"
+#include "test_handoff.c"
+#include "test_capture.c"
+#include "test_client.c"
+#include "test_embed.c"
+#include "test_shm.c"
+#include "test_rate_limit.c"
+#include "test_scheduler.c"
 
 int main(void)
 {
@@ -15,6 +32,23 @@ int main(void)
     TCase *tc3 = tcase_create("filter");
     TCase *tc4 = tcase_create("filter manager");
     TCase *tc5 = tcase_create("art");
+    TCase *tc6 = tcase_create("latency");
+    TCase *tc7 = tcase_create("metrics");
+    TCase *tc8 = tcase_create("numa");
+    TCase *tc9 = tcase_create("replication");
+    TCase *tc10 = tcase_create("cluster");
+    TCase *tc11 = tcase_create("arena");
+    TCase *tc12 = tcase_create("tokenize");
+    TCase *tc13 = tcase_create("executor");
+    TCase *tc14 = tcase_create("mpsc");
+    TCase *tc15 = tcase_create("tls");
+    TCase *tc16 = tcase_create("handoff");
+    TCase *tc17 = tcase_create("capture");
+    TCase *tc18 = tcase_create("client");
+    TCase *tc19 = tcase_create("embed");
+    TCase *tc20 = tcase_create("shm");
+    TCase *tc21 = tcase_create("rate limit");
+    TCase *tc22 = tcase_create("scheduler");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -24,6 +58,7 @@ int main(void)
     tcase_add_test(tc1, test_config_bad_file);
     tcase_add_test(tc1, test_config_empty_file);
     tcase_add_test(tc1, test_config_basic_config);
+    tcase_add_test(tc1, test_config_templates);
     tcase_add_test(tc1, test_validate_default_config);
     tcase_add_test(tc1, test_validate_bad_config);
     tcase_add_test(tc1, test_join_path_no_slash);
@@ -37,11 +72,69 @@ int main(void)
     tcase_add_test(tc1, test_sane_cold_interval);
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
+    tcase_add_test(tc1, test_sane_use_hugepages);
+    tcase_add_test(tc1, test_sane_use_reuseport);
+    tcase_add_test(tc1, test_sane_use_io_uring);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_flush_threads);
+    tcase_add_test(tc1, test_sane_flush_rate_limit);
+    tcase_add_test(tc1, test_sane_flush_dirty_mb);
+    tcase_add_test(tc1, test_sane_max_probes);
+    tcase_add_test(tc1, test_sane_use_set_log);
+    tcase_add_test(tc1, test_sane_set_log_sync_msec);
+    tcase_add_test(tc1, test_sane_compress_cold);
+    tcase_add_test(tc1, test_sane_load_threads);
+    tcase_add_test(tc1, test_sane_prewarm);
+    tcase_add_test(tc1, test_sane_memory_budget_mb);
+    tcase_add_test(tc1, test_sane_rotate_window);
+    tcase_add_test(tc1, test_sane_rotate_generations);
+    tcase_add_test(tc1, test_sane_key_ttl);
+    tcase_add_test(tc1, test_sane_freezable);
+    tcase_add_test(tc1, test_sane_pinned);
+    tcase_add_test(tc1, test_sane_summary_capacity);
+    tcase_add_test(tc1, test_sane_shards);
+    tcase_add_test(tc1, test_sane_latency_sample);
+    tcase_add_test(tc1, test_sane_slowlog);
+    tcase_add_test(tc1, test_sane_metrics);
+    tcase_add_test(tc1, test_sane_numa);
+    tcase_add_test(tc1, test_sane_replication);
+    tcase_add_test(tc1, test_sane_read_only);
+    tcase_add_test(tc1, test_sane_residency_interval);
+    tcase_add_test(tc1, test_sane_snapshot_interval);
+    tcase_add_test(tc1, test_sane_sparse_layers);
+    tcase_add_test(tc1, test_sane_auto_shrink);
+    tcase_add_test(tc1, test_sane_load_dir);
+    tcase_add_test(tc1, test_sane_data_dirs);
+    tcase_add_test(tc1, test_sane_cluster);
+    tcase_add_test(tc1, test_sane_fault_retry);
+    tcase_add_test(tc1, test_sane_flush_syncfs);
+    tcase_add_test(tc1, test_sane_use_direct_io);
+    tcase_add_test(tc1, test_sane_pack_layers);
+    tcase_add_test(tc1, test_sane_warmup);
+    tcase_add_test(tc1, test_sane_tier_layers);
+    tcase_add_test(tc1, test_sane_seal_layers);
+    tcase_add_test(tc1, test_sane_multi_batch_size);
+    tcase_add_test(tc1, test_sane_command_budget);
+    tcase_add_test(tc1, test_sane_rate_limit);
+    tcase_add_test(tc1, test_sane_priority_lane);
+    tcase_add_test(tc1, test_sane_exec_threads);
+    tcase_add_test(tc1, test_sane_fault_park);
+    tcase_add_test(tc1, test_sane_positive_cache);
+    tcase_add_test(tc1, test_sane_tcp_options);
+    tcase_add_test(tc1, test_sane_conn_buf);
+    tcase_add_test(tc1, test_sane_unix_socket);
+    tcase_add_test(tc1, test_sane_handoff_socket);
+    tcase_add_test(tc1, test_sane_shm);
+    tcase_add_test(tc1, test_sane_page_checksums);
+    tcase_add_test(tc1, test_sane_tls);
+    tcase_add_test(tc1, test_reload_config);
+    tcase_add_test(tc1, test_sane_layout);
+    tcase_add_test(tc1, test_sane_hash_scheme);
     tcase_add_test(tc1, test_filter_config_bad_file);
     tcase_add_test(tc1, test_filter_config_empty_file);
     tcase_add_test(tc1, test_filter_config_basic_config);
     tcase_add_test(tc1, test_update_filename_from_filter_config);
+    tcase_add_test(tc1, test_update_binary_from_filter_config);
 
     // Add the filter tests
     suite_add_tcase(s1, tc3);
@@ -53,12 +146,41 @@ int main(void)
     tcase_add_test(tc3, test_filter_add_check);
     tcase_add_test(tc3, test_filter_restore);
     tcase_add_test(tc3, test_filter_flush);
+    tcase_add_test(tc3, test_filter_legacy_config);
     tcase_add_test(tc3, test_filter_add_check_in_mem);
     tcase_add_test(tc3, test_filter_grow);
     tcase_add_test(tc3, test_filter_grow_restore);
     tcase_add_test(tc3, test_filter_restore_order);
     tcase_add_test(tc3, test_filter_page_out);
     tcase_add_test(tc3, test_filter_bounded_fp);
+    tcase_add_test(tc3, test_filter_counters_threads);
+    tcase_add_test(tc3, test_filter_blocked_restore);
+    tcase_add_test(tc3, test_filter_add_many);
+    tcase_add_test(tc3, test_filter_set_log_replay);
+    tcase_add_test(tc3, test_filter_rotating);
+    tcase_add_test(tc3, test_filter_aging);
+    tcase_add_test(tc3, test_filter_max_probes);
+    tcase_add_test(tc3, test_filter_counting);
+    tcase_add_test(tc3, test_filter_freeze);
+    tcase_add_test(tc3, test_filter_compact);
+    tcase_add_test(tc3, test_filter_summary);
+    tcase_add_test(tc3, test_filter_lock_waits);
+    tcase_add_test(tc3, test_filter_meta);
+    tcase_add_test(tc3, test_filter_sharded);
+    tcase_add_test(tc3, test_filter_read_only);
+    tcase_add_test(tc3, test_filter_fill);
+    tcase_add_test(tc3, test_filter_prepare_layer);
+    tcase_add_test(tc3, test_filter_reset);
+    tcase_add_test(tc3, test_filter_shrink);
+    tcase_add_test(tc3, test_filter_detach);
+    tcase_add_test(tc3, test_filter_write_commit);
+    tcase_add_test(tc3, test_filter_packed);
+    tcase_add_test(tc3, test_filter_tiered);
+    tcase_add_test(tc3, test_filter_sealed);
+    tcase_add_test(tc3, test_filter_page_checksums);
+    tcase_add_test(tc3, test_filter_quotient);
+    tcase_add_test(tc3, test_filter_residency);
+    tcase_add_test(tc3, test_filter_set_log_binary_keys);
 
     // Add the filter tests
     suite_add_tcase(s1, tc4);
@@ -88,6 +210,33 @@ int main(void)
     tcase_add_test(tc4, test_mgr_grow);
     tcase_add_test(tc4, test_mgr_restore);
     tcase_add_test(tc4, test_mgr_callback);
+    tcase_add_test(tc4, test_mgr_concurrent_check_keys);
+    tcase_add_test(tc4, test_mgr_concurrent_set_keys);
+    tcase_add_test(tc4, test_mgr_concurrent_set_combined);
+    tcase_add_test(tc4, test_mgr_handle);
+    tcase_add_test(tc4, test_mgr_snapshot);
+    tcase_add_test(tc4, test_mgr_unmap_compress);
+    tcase_add_test(tc4, test_mgr_restore_many);
+    tcase_add_test(tc4, test_mgr_warm);
+    tcase_add_test(tc4, test_mgr_evict_order);
+    tcase_add_test(tc4, test_mgr_pinned);
+    tcase_add_test(tc4, test_mgr_vacuum_wakeup);
+    tcase_add_test(tc4, test_mgr_delta_index);
+    tcase_add_test(tc4, test_mgr_create_drop_multi);
+    tcase_add_test(tc4, test_mgr_rotate_filter);
+    tcase_add_test(tc4, test_mgr_delete_keys);
+    tcase_add_test(tc4, test_mgr_freeze_filter);
+    tcase_add_test(tc4, test_mgr_compact_filter);
+    tcase_add_test(tc4, test_mgr_reset_filter);
+    tcase_add_test(tc4, test_mgr_positive_cache);
+    tcase_add_test(tc4, test_mgr_fault_retry);
+    tcase_add_test(tc4, test_mgr_queue_fault);
+    tcase_add_test(tc4, test_mgr_check_hashed);
+    tcase_add_test(tc4, test_mgr_merge_filters);
+    tcase_add_test(tc4, test_mgr_quotas);
+    tcase_add_test(tc4, test_mgr_manifest);
+    tcase_add_test(tc4, test_mgr_aliases);
+    tcase_add_test(tc4, test_mgr_load_keys);
 
     // Add the art tests
     suite_add_tcase(s1, tc5);
@@ -100,6 +249,106 @@ int main(void)
     tcase_add_test(tc5, test_art_insert_iter);
     tcase_add_test(tc5, test_art_iter_prefix);
     tcase_add_test(tc5, test_art_insert_copy_delete);
+    tcase_add_test(tc5, test_art_node_reuse);
+    tcase_add_test(tc5, test_art_node16_high_keys);
+    tcase_add_test(tc5, test_art_long_prefix_mismatch);
+    tcase_add_test(tc5, test_art_cow_snapshot);
+
+    // Add the latency tests
+    suite_add_tcase(s1, tc6);
+    tcase_add_test(tc6, test_latency_disabled);
+    tcase_add_test(tc6, test_latency_record_stages);
+    tcase_add_test(tc6, test_latency_sampling);
+    tcase_add_test(tc6, test_latency_percentile);
+    tcase_add_test(tc6, test_latency_slowlog);
+
+    // Add the metrics tests
+    suite_add_tcase(s1, tc7);
+    tcase_add_test(tc7, test_metrics_render_server);
+    tcase_add_test(tc7, test_metrics_render_filters);
+
+    // Add the numa tests
+    suite_add_tcase(s1, tc8);
+    tcase_add_test(tc8, test_numa_topology);
+    tcase_add_test(tc8, test_numa_parse_cpus);
+    tcase_add_test(tc8, test_numa_pin_thread);
+    tcase_add_test(tc8, test_numa_filter_placement);
+
+    // Add the replication tests
+    suite_add_tcase(s1, tc9);
+    tcase_add_test(tc9, test_repl_log_read);
+    tcase_add_test(tc9, test_repl_log_wrap);
+    tcase_add_test(tc9, test_repl_apply_line);
+    tcase_add_test(tc9, test_repl_escaped_keys);
+    tcase_add_test(tc9, test_repl_catch_up_pages);
+
+    // Add the cluster tests
+    suite_add_tcase(s1, tc10);
+    tcase_add_test(tc10, test_cluster_placement);
+    tcase_add_test(tc10, test_cluster_moved);
+    tcase_add_test(tc10, test_cluster_migrate_stream);
+
+    // Add the arena tests
+    suite_add_tcase(s1, tc11);
+    tcase_add_test(tc11, test_arena_alloc);
+    tcase_add_test(tc11, test_arena_sprintf);
+
+    // Add the tokenize tests
+    suite_add_tcase(s1, tc12);
+    tcase_add_test(tc12, test_tokenize_keys);
+    tcase_add_test(tc12, test_tokenize_keys_batches);
+
+    // Add the executor tests
+    suite_add_tcase(s1, tc13);
+    tcase_add_test(tc13, test_executor_jobs);
+    tcase_add_test(tc13, test_executor_stealing);
+
+    // Add the mpsc tests
+    suite_add_tcase(s1, tc14);
+    tcase_add_test(tc14, test_mpsc_order);
+    tcase_add_test(tc14, test_mpsc_producers);
+
+    // Add the TLS tests
+    suite_add_tcase(s1, tc15);
+    tcase_add_test(tc15, test_tls_init_missing);
+    tcase_add_test(tc15, test_tls_roundtrip);
+
+    // Add the handoff tests
+    suite_add_tcase(s1, tc16);
+    tcase_add_test(tc16, test_handoff_no_server);
+    tcase_add_test(tc16, test_handoff_roundtrip);
+
+    // Add the capture tests
+    suite_add_tcase(s1, tc17);
+    tcase_add_test(tc17, test_capture_hashed_keys);
+    tcase_add_test(tc17, test_capture_raw_keys);
+
+    // Add the client tests
+    suite_add_tcase(s1, tc18);
+    tcase_add_test(tc18, test_client_merges_singles);
+    tcase_add_test(tc18, test_client_binary);
+    tcase_add_test(tc18, test_client_blocking);
+
+    // Add the embedded tests
+    suite_add_tcase(s1, tc19);
+    tcase_add_test(tc19, test_embed_open_close);
+
+    // Add the shared memory tests
+    suite_add_tcase(s1, tc20);
+    tcase_add_test(tc20, test_shm_check_set);
+
+    // Add the rate limit tests
+    suite_add_tcase(s1, tc21);
+    tcase_add_test(tc21, test_rate_limit_unlimited);
+    tcase_add_test(tc21, test_rate_limit_burst);
+    tcase_add_test(tc21, test_rate_limit_debt);
+
+    // Add the scheduler tests
+    suite_add_tcase(s1, tc22);
+    tcase_add_test(tc22, test_sched_intervals);
+    tcase_add_test(tc22, test_sched_delay);
+    tcase_add_test(tc22, test_sched_concurrency);
+    tcase_add_test(tc22, test_sched_classes);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
@@ -0,0 +1,58 @@
+#include <check.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+START_TEST(test_arena_alloc)
+{
+    bloom_arena *arena;
+    int res = init_arena(1000, &arena);
+    fail_unless(res == 0);
+
+    // Allocations are aligned and do not overlap
+    char *a = arena_alloc(arena, 3);
+    char *b = arena_alloc(arena, 17);
+    fail_unless(((uintptr_t)a & 15) == 0);
+    fail_unless(((uintptr_t)b & 15) == 0);
+    fail_unless(b >= a + 3);
+    memset(a, 'a', 3);
+    memset(b, 'b', 17);
+
+    // Large allocations get their own chunk
+    char *big = arena_alloc(arena, 100000);
+    fail_unless(big != NULL);
+    memset(big, 'c', 100000);
+    fail_unless(a[2] == 'a' && b[16] == 'b');
+
+    // Memory is reused after a reset
+    arena_reset(arena);
+    char *c = arena_alloc(arena, 16);
+    fail_unless(c != NULL);
+    destroy_arena(arena);
+}
+END_TEST
+
+START_TEST(test_arena_sprintf)
+{
+    bloom_arena *arena;
+    int res = init_arena(64, &arena);
+    fail_unless(res == 0);
+
+    // Fits in the chunk
+    int len;
+    char *s = arena_sprintf(arena, &len, "%s %d", "foo", 42);
+    fail_unless(strcmp(s, "foo 42") == 0);
+    fail_unless(len == 6);
+
+    // Does not fit, and is formatted again
+    char *t = arena_sprintf(arena, &len, "%0100d", 7);
+    fail_unless(len == 100);
+    fail_unless(strlen(t) == 100 && t[99] == '7');
+    fail_unless(strcmp(s, "foo 42") == 0);
+
+    // The length is optional
+    char *u = arena_sprintf(arena, NULL, "%s%s", s, "bar");
+    fail_unless(strcmp(u, "foo 42bar") == 0);
+    destroy_arena(arena);
+}
+END_TEST
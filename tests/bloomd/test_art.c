@@ -384,3 +384,185 @@ START_TEST(test_art_insert_copy_delete)
 }
 END_TEST
 
+
+START_TEST(test_art_node_reuse)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Grow and shrink the nodes through all the sizes,
+    // so the freed nodes end up on the free lists
+    unsigned char key[3] = {'a', 0, 0};
+    for (int round=0; round < 10; round++) {
+        for (uintptr_t i=1; i < 256; i++) {
+            key[1] = i;
+            fail_unless(NULL == art_insert(&t, key, 3, (void*)i));
+        }
+        // Leave holes in the node48 before copying
+        for (uintptr_t i=1; i < 256; i++) {
+            if (i % 16 == 0 || round == 9) continue;
+            key[1] = i;
+            fail_unless(i == (uintptr_t)art_delete(&t, key, 3));
+        }
+        if (round == 9) break;
+        for (uintptr_t i=16; i < 256; i += 16) {
+            key[1] = i;
+            fail_unless(i == (uintptr_t)art_delete(&t, key, 3));
+        }
+        fail_unless(art_size(&t) == 0);
+    }
+
+    // The churn should have reused nodes instead of
+    // growing the arena
+    int slabs = 0;
+    for (art_slab *s=t.arena.slabs; s; s=s->next) slabs++;
+    fail_unless(slabs <= 4);
+
+    // Shrink back to a node48 with holes, and copy
+    for (uintptr_t i=1; i < 256; i++) {
+        if (i % 7 == 0) continue;
+        key[1] = i;
+        fail_unless(i == (uintptr_t)art_delete(&t, key, 3));
+    }
+    art_tree t2;
+    fail_unless(art_copy(&t2, &t) == 0);
+    fail_unless(destroy_art_tree(&t) == 0);
+
+    for (uintptr_t i=1; i < 256; i++) {
+        key[1] = i;
+        uintptr_t val = (uintptr_t)art_search(&t2, key, 3);
+        fail_unless(val == ((i % 7 == 0) ? i : 0));
+    }
+    fail_unless(art_size(&t2) == 36);
+    fail_unless(destroy_art_tree(&t2) == 0);
+}
+END_TEST
+
+static int test_order_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)val;
+    fail_unless(k_len == 3);
+    int *last = data;
+    fail_unless((int)k[1] > *last);
+    *last = k[1];
+    return 0;
+}
+
+START_TEST(test_art_node16_high_keys)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Keys above 127 must sort after the others, which
+    // needs the node16 compare to be unsigned
+    unsigned char bytes[] = {200, 3, 129, 77, 255, 128, 1, 90, 140, 60, 250, 12};
+    unsigned char key[3] = {'k', 0, 0};
+    for (uintptr_t i=0; i < sizeof(bytes); i++) {
+        key[1] = bytes[i];
+        fail_unless(NULL == art_insert(&t, key, 3, (void*)(i+1)));
+    }
+    for (uintptr_t i=0; i < sizeof(bytes); i++) {
+        key[1] = bytes[i];
+        fail_unless((i+1) == (uintptr_t)art_search(&t, key, 3));
+    }
+    key[1] = 130;
+    fail_unless(NULL == art_search(&t, key, 3));
+
+    int last = -1;
+    fail_unless(art_iter(&t, test_order_cb, &last) == 0);
+    fail_unless(last == 255);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_long_prefix_mismatch)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Keys sharing a long prefix, differing at each
+    // position within and past the stored prefix
+    char base[] = "tenant-filter-prefix-shared";
+    int base_len = strlen(base) + 1;
+    char keys[32][32];
+    for (int i=0; i < base_len - 1; i++) {
+        memcpy(keys[i], base, base_len);
+        keys[i][i] = '#';
+    }
+    fail_unless(NULL == art_insert(&t, (unsigned char*)base, base_len, (void*)1));
+    for (uintptr_t i=0; i < (uintptr_t)base_len - 1; i++) {
+        fail_unless(NULL == art_insert(&t, (unsigned char*)keys[i], base_len, (void*)(i+2)));
+    }
+
+    fail_unless(1 == (uintptr_t)art_search(&t, (unsigned char*)base, base_len));
+    for (uintptr_t i=0; i < (uintptr_t)base_len - 1; i++) {
+        fail_unless((i+2) == (uintptr_t)art_search(&t, (unsigned char*)keys[i], base_len));
+        keys[i][i] = '$';
+        fail_unless(NULL == art_search(&t, (unsigned char*)keys[i], base_len));
+    }
+    fail_unless(art_size(&t) == (uint64_t)base_len);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_cow_snapshot)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    // Grow through all the node sizes and split prefixes
+    unsigned char key[4] = {'c', 'o', 0, 0};
+    for (uintptr_t i=1; i < 256; i++) {
+        key[2] = i;
+        fail_unless(NULL == art_cow_insert(&t, key, 4, (void*)i, i));
+    }
+    fail_unless(NULL == art_cow_insert(&t, (unsigned char*)"cp", 3, (void*)1000, 256));
+    fail_unless(art_size(&t) == 256);
+    fail_unless(art_oldest_garbage(&t) == 3);
+
+    // Readers of an old root keep seeing it unchanged
+    art_tree snap = t;
+    fail_unless(art_reclaim(&t, 256) > 0);
+    fail_unless(art_oldest_garbage(&t) == 0);
+    for (uintptr_t i=1; i < 256; i++) {
+        key[2] = i;
+        fail_unless(i == (uintptr_t)art_cow_insert(&t, key, 4, (void*)(i+1), 257));
+        if (i % 3) fail_unless(i+1 == (uintptr_t)art_cow_delete(&t, key, 4, 258));
+    }
+    fail_unless(NULL == art_cow_delete(&t, (unsigned char*)"cq", 3, 258));
+    fail_unless(1000 == (uintptr_t)art_cow_delete(&t, (unsigned char*)"cp", 3, 258));
+    fail_unless(art_size(&t) == 85);
+
+    for (uintptr_t i=1; i < 256; i++) {
+        key[2] = i;
+        fail_unless(i == (uintptr_t)art_search(&snap, key, 4));
+        uintptr_t val = (uintptr_t)art_search(&t, key, 4);
+        fail_unless(val == ((i % 3) ? 0 : i+1));
+    }
+    fail_unless(1000 == (uintptr_t)art_search(&snap, (unsigned char*)"cp", 3));
+    fail_unless(NULL == art_search(&t, (unsigned char*)"cp", 3));
+
+    // Only the retired nodes of older epochs are freed
+    fail_unless(art_oldest_garbage(&t) == 257);
+    art_reclaim(&t, 257);
+    fail_unless(art_oldest_garbage(&t) == 258);
+    art_reclaim(&t, 258);
+    fail_unless(t.garbage == NULL);
+
+    // Leave garbage behind for destroy to free
+    for (uintptr_t i=3; i < 256; i += 3) {
+        key[2] = i;
+        fail_unless(i+1 == (uintptr_t)art_cow_delete(&t, key, 4, 259));
+    }
+    fail_unless(art_size(&t) == 0);
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,114 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "capture.h"
+#include "config.h"
+
+/**
+ * Reads back a capture file written by a test.
+ */
+static size_t read_capture(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    fail_unless(f != NULL);
+    size_t num = fread(buf, 1, len, f);
+    fclose(f);
+    return num;
+}
+
+START_TEST(test_capture_hashed_keys)
+{
+    char *path = "/tmp/test_capture_hashed.bin";
+    fail_unless(capture_init(path, CAPTURE_KEYS_HASH) == 0);
+    fail_unless(capture_enabled() == 1);
+    uint32_t id = capture_conn_id();
+    fail_unless(id > 0);
+
+    // The arguments include their NULL terminator
+    char keys[] = "foo key1 key2  key1";
+    capture_command(id, 'b', 1, keys, sizeof(keys));
+    char opts[] = "bar capacity=1000";
+    capture_command(id, 'C', 0, opts, sizeof(opts));
+    capture_command(id, 'L', 0, NULL, 0);
+    capture_close();
+    fail_unless(capture_enabled() == 0);
+
+    // Commands are dropped once closed
+    capture_command(id, 'c', 1, keys, sizeof(keys));
+
+    char buf[512];
+    size_t len = read_capture(path, buf, sizeof(buf));
+    size_t expect = sizeof(capture_header) + 3 * sizeof(capture_record) +
+        3 + 3 * 8 + 3 + 13;
+    fail_unless(len == expect);
+
+    capture_header header;
+    memcpy(&header, buf, sizeof(header));
+    fail_unless(header.magic == CAPTURE_MAGIC);
+    fail_unless(header.version == CAPTURE_VERSION);
+    fail_unless(header.key_mode == CAPTURE_KEYS_HASH);
+
+    capture_record rec;
+    char *p = buf + sizeof(header);
+    memcpy(&rec, p, sizeof(rec));
+    fail_unless(rec.conn_id == id);
+    fail_unless(rec.opcode == 'b');
+    fail_unless(rec.name_len == 3);
+    fail_unless(rec.args_len == 0);
+    fail_unless(rec.num_keys == 3);
+    fail_unless(memcmp(p + sizeof(rec), "foo", 3) == 0);
+
+    // The same key hashes the same
+    uint64_t h1, h2, h3;
+    p += sizeof(rec) + 3;
+    memcpy(&h1, p, 8);
+    memcpy(&h2, p + 8, 8);
+    memcpy(&h3, p + 16, 8);
+    fail_unless(h1 == h3);
+    fail_unless(h1 != h2);
+
+    // The options of other commands are kept
+    p += 24;
+    memcpy(&rec, p, sizeof(rec));
+    fail_unless(rec.opcode == 'C');
+    fail_unless(rec.name_len == 3);
+    fail_unless(rec.args_len == 13);
+    fail_unless(rec.num_keys == 0);
+    fail_unless(memcmp(p + sizeof(rec), "barcapacity=1000", 16) == 0);
+
+    p += sizeof(rec) + 16;
+    memcpy(&rec, p, sizeof(rec));
+    fail_unless(rec.opcode == 'L');
+    fail_unless(rec.name_len == 0);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_capture_raw_keys)
+{
+    char *path = "/tmp/test_capture_raw.bin";
+    fail_unless(capture_init(path, CAPTURE_KEYS_RAW) == 0);
+    char keys[] = "foo abc de";
+    capture_command(7, 'm', 1, keys, sizeof(keys));
+    capture_close();
+
+    char buf[256];
+    size_t len = read_capture(path, buf, sizeof(buf));
+    fail_unless(len == sizeof(capture_header) + sizeof(capture_record) + 3 + 2 + 3 + 2 + 2);
+
+    capture_record rec;
+    char *p = buf + sizeof(capture_header);
+    memcpy(&rec, p, sizeof(rec));
+    fail_unless(rec.conn_id == 7);
+    fail_unless(rec.num_keys == 2);
+
+    uint16_t l;
+    p += sizeof(rec) + 3;
+    memcpy(&l, p, 2);
+    fail_unless(l == 3 && !memcmp(p + 2, "abc", 3));
+    p += 5;
+    memcpy(&l, p, 2);
+    fail_unless(l == 2 && !memcmp(p + 2, "de", 2));
+    unlink(path);
+}
+END_TEST
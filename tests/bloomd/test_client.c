@@ -0,0 +1,191 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "bloomd_client.h"
+
+/**
+ * Listens on a random local port, standing in for the server.
+ */
+static int client_test_listen(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    fail_unless(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    fail_unless(listen(fd, 4) == 0);
+    socklen_t len = sizeof(addr);
+    fail_unless(getsockname(fd, (struct sockaddr*)&addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/**
+ * Reads exactly len bytes of what the client sent.
+ */
+static void client_test_read(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t num = read(fd, buf + got, len - got);
+        fail_unless(num > 0);
+        got += num;
+    }
+}
+
+/**
+ * Opens a client on a single connection to a fake server.
+ */
+static bloomd_client* client_test_open(int binary, int *server) {
+    int port;
+    int listen_fd = client_test_listen(&port);
+    bloomd_client_options opts;
+    bloomd_client_defaults(&opts);
+    opts.host = "127.0.0.1";
+    opts.port = port;
+    opts.binary = binary;
+    opts.timeout_msec = 5000;
+
+    bloomd_client *client = NULL;
+    fail_unless(bloomd_client_open(&opts, &client) == BLOOMD_OK);
+    *server = accept(listen_fd, NULL, NULL);
+    fail_unless(*server >= 0);
+    close(listen_fd);
+    return client;
+}
+
+static void client_test_key_cb(void *arg, int status) {
+    *(int*)arg = status;
+}
+
+START_TEST(test_client_merges_singles)
+{
+    int server;
+    bloomd_client *client = client_test_open(0, &server);
+
+    int res[4] = {-100, -100, -100, -100};
+    fail_unless(bloomd_check_async(client, "foo", "a", -1, client_test_key_cb, res) == 0);
+    fail_unless(bloomd_check_async(client, "foo", "b", -1, client_test_key_cb, res + 1) == 0);
+    fail_unless(bloomd_check_async(client, "foo", "c", 1, client_test_key_cb, res + 2) == 0);
+    fail_unless(bloomd_pending(client) == 3);
+
+    // Keys with spaces can not be sent as text
+    fail_unless(bloomd_check_async(client, "foo", "a b", -1, client_test_key_cb, res + 3) == BLOOMD_ERR_ARGS);
+
+    // The checks are sent as one multi, after the format
+    fail_unless(bloomd_flush(client) == 0);
+    char expect[] = "format compact\nm foo a b c\n";
+    char buf[64];
+    client_test_read(server, buf, sizeof(expect) - 1);
+    fail_unless(memcmp(buf, expect, sizeof(expect) - 1) == 0);
+
+    char reply[] = "Done\nYNY\n";
+    fail_unless(write(server, reply, sizeof(reply) - 1) == sizeof(reply) - 1);
+    int callbacks = 0;
+    while (bloomd_pending(client)) callbacks += bloomd_poll(client, 1000);
+    fail_unless(callbacks == 3);
+    fail_unless(res[0] == 1);
+    fail_unless(res[1] == 0);
+    fail_unless(res[2] == 1);
+    fail_unless(res[3] == -100);
+
+    // A lone set goes as a set, and a closed server fails it
+    fail_unless(bloomd_set_async(client, "foo", "d", -1, client_test_key_cb, res) == 0);
+    fail_unless(bloomd_flush(client) == 0);
+    char expect_set[] = "s foo d\n";
+    client_test_read(server, buf, sizeof(expect_set) - 1);
+    fail_unless(memcmp(buf, expect_set, sizeof(expect_set) - 1) == 0);
+    close(server);
+    while (bloomd_pending(client)) bloomd_poll(client, 1000);
+    fail_unless(res[0] == BLOOMD_ERR_IO);
+    bloomd_client_close(client);
+}
+END_TEST
+
+static void client_test_keys_cb(void *arg, int status, const char *results, int num_keys) {
+    char *out = arg;
+    out[0] = status;
+    if (results) memcpy(out + 1, results, num_keys);
+}
+
+START_TEST(test_client_binary)
+{
+    int server;
+    bloomd_client *client = client_test_open(1, &server);
+
+    const char *keys[] = {"x y", "z"};
+    char out[3] = {-100, -100, -100};
+    fail_unless(bloomd_set_many_async(client, "bar", keys, NULL, 2, client_test_keys_cb, out) == 0);
+    fail_unless(bloomd_flush(client) == 0);
+
+    char buf[64];
+    unsigned char expect[] = {0xB1, 2, 0, 3, 0, 0, 0, 12, 'b', 'a', 'r',
+        0, 0, 0, 2, 0, 3, 'x', ' ', 'y', 0, 1, 'z'};
+    client_test_read(server, buf, 15);
+    fail_unless(memcmp(buf, "format compact\n", 15) == 0);
+    client_test_read(server, buf, sizeof(expect));
+    fail_unless(memcmp(buf, expect, sizeof(expect)) == 0);
+
+    // Only the second key was added
+    unsigned char reply[] = {'D', 'o', 'n', 'e', '\n', 0xB1, 0, 0, 0, 0, 0, 0, 5, 0, 0, 0, 2, 0x2};
+    fail_unless(write(server, reply, sizeof(reply)) == sizeof(reply));
+    while (bloomd_pending(client)) bloomd_poll(client, 1000);
+    fail_unless(out[0] == 0);
+    fail_unless(out[1] == 0);
+    fail_unless(out[2] == 1);
+
+    // A failed batch reports the status to each key
+    int res[2] = {-100, -100};
+    fail_unless(bloomd_check_async(client, "bar", "x", -1, client_test_key_cb, res) == 0);
+    fail_unless(bloomd_check_async(client, "bar", "y", -1, client_test_key_cb, res + 1) == 0);
+    unsigned char err[] = {0xB1, 1, 0, 0, 0, 0, 0, 0};
+    fail_unless(write(server, err, sizeof(err)) == sizeof(err));
+    while (bloomd_pending(client)) bloomd_poll(client, 1000);
+    fail_unless(res[0] == BLOOMD_ERR_NO_FILTER);
+    fail_unless(res[1] == BLOOMD_ERR_NO_FILTER);
+
+    bloomd_client_close(client);
+    close(server);
+}
+END_TEST
+
+START_TEST(test_client_blocking)
+{
+    int server;
+    bloomd_client *client = client_test_open(0, &server);
+
+    // The replies are matched in order, so they can be sent first
+    char replies[] = "Done\nNo\nFilter does not exist\nYes No\nFilter is frozen\n"
+        "START\nfoo 0.01\nbar 0.01\nEND\nExists\n";
+    fail_unless(write(server, replies, sizeof(replies) - 1) == sizeof(replies) - 1);
+
+    fail_unless(bloomd_check(client, "foo", "k", -1) == 0);
+    fail_unless(bloomd_set(client, "bar", "k", -1) == BLOOMD_ERR_NO_FILTER);
+
+    const char *keys[] = {"k1", "k2"};
+    char results[2];
+    fail_unless(bloomd_check_many(client, "foo", keys, NULL, 2, results) == 0);
+    fail_unless(results[0] == 1);
+    fail_unless(results[1] == 0);
+    fail_unless(bloomd_set_many(client, "foo", keys, NULL, 2, results) == BLOOMD_ERR_FROZEN);
+
+    char *reply = NULL;
+    fail_unless(bloomd_command(client, "list", &reply) == 0);
+    fail_unless(strcmp(reply, "foo 0.01\nbar 0.01\n") == 0);
+    free(reply);
+    fail_unless(bloomd_create(client, "foo", "capacity=20000") == 1);
+
+    char expect[] = "format compact\nc foo k\ns bar k\nm foo k1 k2\nb foo k1 k2\n"
+        "list\ncreate foo capacity=20000\n";
+    char buf[128];
+    client_test_read(server, buf, sizeof(expect) - 1);
+    fail_unless(memcmp(buf, expect, sizeof(expect) - 1) == 0);
+
+    bloomd_client_close(client);
+    close(server);
+}
+END_TEST
@@ -0,0 +1,220 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "replication.h"
+#include "cluster.h"
+
+START_TEST(test_cluster_placement)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    // Not in a cluster
+    bloom_cluster *cluster;
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    fail_unless(cluster == NULL);
+
+    config.data_dir = "/tmp/bloomd_cluster1";
+    mkdir(config.data_dir, 0755);
+    config.cluster_nodes = "a:8673:8680,b:8673:8680,c:8673:8680";
+    config.cluster_self = "b:8673";
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    fail_unless(cluster != NULL);
+
+    fail_unless(cluster_find_node(cluster, "a:8673") == 0);
+    fail_unless(cluster_find_node(cluster, "c:8673") == 2);
+    fail_unless(cluster_find_node(cluster, "d:8673") == -1);
+
+    // Every node owns a share of the filters, and only
+    // the filters of other nodes are redirected
+    int counts[3] = {0, 0, 0};
+    char name[32];
+    for (int i=0; i < 300; i++) {
+        snprintf(name, sizeof(name), "filter%d", i);
+        int owner = cluster_owner(cluster, name);
+        fail_unless(owner >= 0 && owner < 3);
+        fail_unless(owner == cluster_owner(cluster, name));
+        counts[owner]++;
+
+        const char *addr = cluster_redirect(cluster, name);
+        if (owner == 1) {
+            fail_unless(addr == NULL);
+        } else {
+            fail_unless(addr != NULL);
+            fail_unless(cluster_find_node(cluster, (char*)addr) == owner);
+        }
+    }
+    fail_unless(counts[0] > 30 && counts[1] > 30 && counts[2] > 30);
+
+    // We can not migrate to ourself
+    fail_unless(cluster_migrate(cluster, "filter0", 1) == -1);
+    fail_unless(cluster_migrate(cluster, "filter0", 3) == -1);
+    destroy_cluster(cluster);
+
+    // Our node must be in the cluster
+    config.cluster_self = "d:8673";
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == -1);
+    fail_unless(cluster == NULL);
+
+    unlink("/tmp/bloomd_cluster1/cluster.moved");
+    rmdir("/tmp/bloomd_cluster1");
+}
+END_TEST
+
+START_TEST(test_cluster_moved)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = "/tmp/bloomd_cluster2";
+    mkdir(config.data_dir, 0755);
+    config.cluster_nodes = "a:8673:8680,b:8673:8680";
+    config.cluster_self = "a:8673";
+
+    bloom_cluster *cluster;
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+
+    // Find a filter we own, and move it away
+    char name[32];
+    for (int i=0; ; i++) {
+        snprintf(name, sizeof(name), "moved%d", i);
+        if (cluster_owner(cluster, name) == 0) break;
+    }
+    fail_unless(cluster_redirect(cluster, name) == NULL);
+    res = cluster_set_moved(cluster, name, 1);
+    fail_unless(res == 0);
+    fail_unless(strcmp(cluster_redirect(cluster, name), "b:8673") == 0);
+    destroy_cluster(cluster);
+
+    // The move is remembered across restarts
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    fail_unless(strcmp(cluster_redirect(cluster, name), "b:8673") == 0);
+
+    // Moving it back forgets the move
+    res = cluster_set_moved(cluster, name, -1);
+    fail_unless(res == 0);
+    fail_unless(cluster_redirect(cluster, name) == NULL);
+    destroy_cluster(cluster);
+
+    res = init_cluster(&config, &cluster);
+    fail_unless(res == 0);
+    fail_unless(cluster_redirect(cluster, name) == NULL);
+    destroy_cluster(cluster);
+
+    unlink("/tmp/bloomd_cluster2/cluster.moved");
+    rmdir("/tmp/bloomd_cluster2");
+}
+END_TEST
+
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int fd;
+    int should_run;
+    int res;
+    char *filter_name;
+} cluster_receiver;
+
+static void* cluster_receive_main(void *in) {
+    cluster_receiver *r = in;
+    r->res = repl_receive_filter(r->config, r->mgr, r->fd, &r->should_run, &r->filter_name);
+    return NULL;
+}
+
+START_TEST(test_cluster_migrate_stream)
+{
+    bloom_config src_config, dst_config;
+    int res = config_from_filename(NULL, &src_config);
+    fail_unless(res == 0);
+    memcpy(&dst_config, &src_config, sizeof(bloom_config));
+    src_config.data_dir = "/tmp/bloomd_migrate_src";
+    dst_config.data_dir = "/tmp/bloomd_migrate_dst";
+    mkdir(src_config.data_dir, 0755);
+    mkdir(dst_config.data_dir, 0755);
+
+    bloom_filtmgr *src, *dst;
+    res = init_filter_manager(&src_config, 0, &src);
+    fail_unless(res == 0);
+    res = init_filter_manager(&dst_config, 0, &dst);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(src, "migrate1", NULL);
+    fail_unless(res == 0);
+    char *keys[] = {"foo", "bar", "baz"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(src, "migrate1", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // Record the sets made while the files are sent
+    bloom_filter_handle *h;
+    res = filtmgr_open_handle(src, "migrate1", &h);
+    fail_unless(res == 0);
+    bloom_repl_log *log;
+    res = init_repl_log(65536, &log);
+    fail_unless(res == 0);
+    uint64_t offset = repl_log_head(log);
+    res = filtmgr_set_migration_log(src, h, log);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_set_migration_log(src, h, log) == -1);
+
+    int fds[2];
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fail_unless(res == 0);
+    cluster_receiver r = {&dst_config, dst, fds[1], 1, -1, NULL};
+    pthread_t t;
+    pthread_create(&t, NULL, cluster_receive_main, &r);
+
+    res = repl_send_filter(&src_config, src, fds[0], "migrate1");
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(src, "migrate1", (char**)&keys + 2, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = repl_send_log(log, fds[0], &offset);
+    fail_unless(res == 0);
+
+    char buf[8];
+    fail_unless(write(fds[0], "ready\n", 6) == 6);
+    fail_unless(read(fds[0], buf, sizeof(buf)) == 3);
+    fail_unless(memcmp(buf, "ok\n", 3) == 0);
+    fail_unless(write(fds[0], "done\n", 5) == 5);
+    fail_unless(read(fds[0], buf, sizeof(buf)) == 3);
+    pthread_join(t, NULL);
+    fail_unless(r.res == 0);
+    fail_unless(strcmp(r.filter_name, "migrate1") == 0);
+    free(r.filter_name);
+    close(fds[0]);
+    close(fds[1]);
+
+    // The target has the keys from the files, and from the log
+    filtmgr_release_handle(src, h);
+    res = filtmgr_check_keys(dst, "migrate1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    res = filtmgr_drop_filter(src, "migrate1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(dst, "migrate1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(src);
+    fail_unless(res == 0);
+    res = destroy_filter_manager(dst);
+    fail_unless(res == 0);
+    unlink("/tmp/bloomd_migrate_src/manifest.bin");
+    unlink("/tmp/bloomd_migrate_dst/manifest.bin");
+    rmdir("/tmp/bloomd_migrate_src");
+    rmdir("/tmp/bloomd_migrate_dst/replica.tmp");
+    rmdir("/tmp/bloomd_migrate_dst");
+}
+END_TEST
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <syslog.h>
 #include "config.h"
 
 START_TEST(test_config_get_default)
@@ -27,6 +28,66 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.layout == 0);
+    fail_unless(config.hash_scheme == 0);
+    fail_unless(config.max_probes == 0);
+    fail_unless(config.use_hugepages == 0);
+    fail_unless(config.use_reuseport == 0);
+    fail_unless(config.use_io_uring == 0);
+    fail_unless(config.flush_threads == 1);
+    fail_unless(config.flush_rate_limit == 0);
+    fail_unless(config.flush_dirty_mb == 0);
+    fail_unless(config.use_set_log == 0);
+    fail_unless(config.set_log_sync_msec == 10);
+    fail_unless(config.compress_cold == 0);
+    fail_unless(config.load_threads == 4);
+    fail_unless(config.prewarm == 0);
+    fail_unless(config.memory_budget_mb == 0);
+    fail_unless(config.rotate_window == 0);
+    fail_unless(config.rotate_generations == 24);
+    fail_unless(config.freezable == 0);
+    fail_unless(config.summary_capacity == 0);
+    fail_unless(config.shards == 0);
+    fail_unless(config.latency_sample == 16);
+    fail_unless(config.slowlog_usec == 0);
+    fail_unless(config.slowlog_size == 128);
+    fail_unless(config.metrics_port == 0);
+    fail_unless(config.metrics_interval == 10);
+    fail_unless(config.use_numa == 0);
+    fail_unless(config.numa_interleave_mb == 1024);
+    fail_unless(config.worker_cpus == NULL);
+    fail_unless(config.flush_cpus == NULL);
+    fail_unless(config.unmap_cpus == NULL);
+    fail_unless(config.vacuum_cpus == NULL);
+    fail_unless(config.unix_socket == NULL);
+    fail_unless(config.handoff_socket == NULL);
+    fail_unless(config.shm_socket == NULL);
+    fail_unless(config.load_dir == NULL);
+    fail_unless(config.data_dirs == NULL);
+    fail_unless(config.shm_ring_kb == 1024);
+    fail_unless(config.shm_spin_usec == 50);
+    fail_unless(config.page_checksums == 0);
+    fail_unless(config.scrub_rate_mb == 16);
+    fail_unless(config.residency_interval == 0);
+    fail_unless(config.snapshot_interval == 0);
+    fail_unless(config.sparse_layers == 0);
+    fail_unless(config.auto_shrink == 0);
+    fail_unless(config.pinned == 0);
+    fail_unless(config.conn_command_rate == 0);
+    fail_unless(config.conn_key_rate == 0);
+    fail_unless(config.filter_key_rate == 0);
+    fail_unless(config.shed_backlog == 0);
+    fail_unless(config.shed_input_kb == 0);
+    fail_unless(config.priority_port == 0);
+    fail_unless(config.priority_workers == 1);
+    fail_unless(config.busy_poll_usec == 0);
+    fail_unless(config.replication_port == 0);
+    fail_unless(config.replicate_from == NULL);
+    fail_unless(config.replication_buffer_mb == 64);
+    fail_unless(config.read_only == 0);
+    fail_unless(config.refresh_interval == 5);
+    fail_unless(config.cluster_nodes == NULL);
+    fail_unless(config.cluster_self == NULL);
 }
 END_TEST
 
@@ -100,6 +161,47 @@ probability_reduction = 0.8\n\
 data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
+layout = blocked\n\
+hash_scheme = murmur\n\
+max_probes = 6\n\
+use_hugepages = 1\n\
+use_reuseport = 1\n\
+flush_threads = 4\n\
+flush_rate_limit = 50\n\
+flush_dirty_mb = 32\n\
+use_set_log = 1\n\
+set_log_sync_msec = 100\n\
+compress_cold = 1\n\
+load_threads = 8\n\
+prewarm = 1\n\
+memory_budget_mb = 2048\n\
+latency_sample = 4\n\
+slowlog_usec = 10000\n\
+slowlog_size = 32\n\
+metrics_port = 10002\n\
+metrics_interval = 30\n\
+use_numa = 1\n\
+numa_interleave_mb = 256\n\
+worker_cpus = 2-5\n\
+flush_cpus = 0\n\
+unmap_cpus = 1\n\
+vacuum_cpus = 0-1\n\
+unix_socket = /tmp/bloomd.sock\n\
+handoff_socket = @bloomd-handoff\n\
+busy_poll_usec = 50\n\
+replication_port = 10003\n\
+replicate_from = primary:10003\n\
+replication_buffer_mb = 16\n\
+read_only = 1\n\
+refresh_interval = 10\n\
+residency_interval = 60\n\
+snapshot_interval = 30\n\
+sparse_layers = 1\n\
+auto_shrink = 1\n\
+load_dir = /var/lib/bloomd/load\n\
+data_dirs = /mnt/nvme1/bloomd, /mnt/nvme2/bloomd\n\
+cluster_nodes = a:8673:8680,b:8673:8680\n\
+cluster_self = b:8673\n\
 log_level = INFO\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
@@ -123,11 +225,85 @@ log_level = INFO\n";
     fail_unless(config.in_memory == 1);
     fail_unless(config.worker_threads == 2);
     fail_unless(config.use_mmap == 1);
+    fail_unless(config.layout == 1);
+    fail_unless(config.hash_scheme == 1);
+    fail_unless(config.max_probes == 6);
+    fail_unless(config.use_hugepages == 1);
+    fail_unless(config.use_reuseport == 1);
+    fail_unless(config.flush_threads == 4);
+    fail_unless(config.flush_rate_limit == 50);
+    fail_unless(config.flush_dirty_mb == 32);
+    fail_unless(config.use_set_log == 1);
+    fail_unless(config.set_log_sync_msec == 100);
+    fail_unless(config.compress_cold == 1);
+    fail_unless(config.load_threads == 8);
+    fail_unless(config.prewarm == 1);
+    fail_unless(config.latency_sample == 4);
+    fail_unless(config.slowlog_usec == 10000);
+    fail_unless(config.slowlog_size == 32);
+    fail_unless(config.metrics_port == 10002);
+    fail_unless(config.metrics_interval == 30);
+    fail_unless(config.use_numa == 1);
+    fail_unless(config.numa_interleave_mb == 256);
+    fail_unless(strcmp(config.worker_cpus, "2-5") == 0);
+    fail_unless(strcmp(config.flush_cpus, "0") == 0);
+    fail_unless(strcmp(config.unmap_cpus, "1") == 0);
+    fail_unless(strcmp(config.vacuum_cpus, "0-1") == 0);
+    fail_unless(strcmp(config.unix_socket, "/tmp/bloomd.sock") == 0);
+    fail_unless(strcmp(config.handoff_socket, "@bloomd-handoff") == 0);
+    fail_unless(config.busy_poll_usec == 50);
+    fail_unless(config.replication_port == 10003);
+    fail_unless(strcmp(config.replicate_from, "primary:10003") == 0);
+    fail_unless(config.replication_buffer_mb == 16);
+    fail_unless(config.read_only == 1);
+    fail_unless(config.refresh_interval == 10);
+    fail_unless(config.residency_interval == 60);
+    fail_unless(config.snapshot_interval == 30);
+    fail_unless(config.sparse_layers == 1);
+    fail_unless(config.auto_shrink == 1);
+    fail_unless(strcmp(config.load_dir, "/var/lib/bloomd/load") == 0);
+    fail_unless(strcmp(config.data_dirs, "/mnt/nvme1/bloomd, /mnt/nvme2/bloomd") == 0);
+    char *dirs_buf, *dirs[MAX_DATA_DIRS];
+    fail_unless(data_dir_list(&config, &dirs_buf, dirs) == 3);
+    fail_unless(strcmp(dirs[0], config.data_dir) == 0);
+    fail_unless(strcmp(dirs[1], "/mnt/nvme1/bloomd") == 0);
+    fail_unless(strcmp(dirs[2], "/mnt/nvme2/bloomd") == 0);
+    free(dirs_buf);
+    fail_unless(strcmp(config.cluster_nodes, "a:8673:8680,b:8673:8680") == 0);
+    fail_unless(strcmp(config.cluster_self, "b:8673") == 0);
+    fail_unless(config.memory_budget_mb == 2048);
 
     unlink("/tmp/basic_config");
 }
 END_TEST
 
+START_TEST(test_config_templates)
+{
+    int fh = open("/tmp/template_config", O_CREAT|O_RDWR, 0777);
+    char *buf = "[bloomd]\n\
+port = 10000\n\
+[templates]\n\
+small = capacity=10000 prob=0.01\n\
+sessions = layout=aging ttl=3600\n";
+    write(fh, buf, strlen(buf));
+    close(fh);
+
+    bloom_config config;
+    int res = config_from_filename("/tmp/template_config", &config);
+    fail_unless(res == 0);
+    fail_unless(config.tcp_port == 10000);
+    fail_unless(strcmp(config_template(&config, "small"), "capacity=10000 prob=0.01") == 0);
+    fail_unless(strcmp(config_template(&config, "sessions"), "layout=aging ttl=3600") == 0);
+    fail_unless(config_template(&config, "missing") == NULL);
+
+    // The defaults have none
+    res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    fail_unless(config_template(&config, "small") == NULL);
+    unlink("/tmp/template_config");
+}
+END_TEST
+
 START_TEST(test_validate_default_config)
 {
     bloom_config config;
@@ -275,6 +451,32 @@ START_TEST(test_sane_use_mmap)
 }
 END_TEST
 
+START_TEST(test_sane_use_hugepages)
+{
+    fail_unless(sane_use_hugepages(-1) == 1);
+    fail_unless(sane_use_hugepages(0) == 0);
+    fail_unless(sane_use_hugepages(1) == 0);
+    fail_unless(sane_use_hugepages(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_use_reuseport)
+{
+    fail_unless(sane_use_reuseport(-1) == 1);
+    fail_unless(sane_use_reuseport(0) == 0);
+    fail_unless(sane_use_reuseport(1) == 0);
+    fail_unless(sane_use_reuseport(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_use_io_uring)
+{
+    fail_unless(sane_use_io_uring(-1) == 1);
+    fail_unless(sane_use_io_uring(0) == 0);
+    fail_unless(sane_use_io_uring(2) == 1);
+}
+END_TEST
+
 START_TEST(test_sane_worker_threads)
 {
     fail_unless(sane_worker_threads(-1) == 1);
@@ -285,6 +487,600 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_flush_threads)
+{
+    fail_unless(sane_flush_threads(-1) == 1);
+    fail_unless(sane_flush_threads(0) == 1);
+    fail_unless(sane_flush_threads(1) == 0);
+    fail_unless(sane_flush_threads(8) == 0);
+    fail_unless(sane_flush_threads(65) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_rate_limit)
+{
+    fail_unless(sane_flush_rate_limit(-1) == 1);
+    fail_unless(sane_flush_rate_limit(0) == 0);
+    fail_unless(sane_flush_rate_limit(100) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_max_probes)
+{
+    fail_unless(sane_max_probes(-1) == 1);
+    fail_unless(sane_max_probes(0) == 0);
+    fail_unless(sane_max_probes(6) == 0);
+    fail_unless(sane_max_probes(MAX_FILTER_PROBES + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_dirty_mb)
+{
+    fail_unless(sane_flush_dirty_mb(-1) == 1);
+    fail_unless(sane_flush_dirty_mb(0) == 0);
+    fail_unless(sane_flush_dirty_mb(64) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_use_set_log)
+{
+    fail_unless(sane_use_set_log(-1) == 1);
+    fail_unless(sane_use_set_log(0) == 0);
+    fail_unless(sane_use_set_log(1) == 0);
+    fail_unless(sane_use_set_log(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_set_log_sync_msec)
+{
+    fail_unless(sane_set_log_sync_msec(-1) == 1);
+    fail_unless(sane_set_log_sync_msec(0) == 1);
+    fail_unless(sane_set_log_sync_msec(10) == 0);
+    fail_unless(sane_set_log_sync_msec(60001) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_load_threads)
+{
+    fail_unless(sane_load_threads(0) == 1);
+    fail_unless(sane_load_threads(1) == 0);
+    fail_unless(sane_load_threads(64) == 0);
+    fail_unless(sane_load_threads(65) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_prewarm)
+{
+    fail_unless(sane_prewarm(0) == 0);
+    fail_unless(sane_prewarm(1) == 0);
+    fail_unless(sane_prewarm(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_memory_budget_mb)
+{
+    fail_unless(sane_memory_budget_mb(-1) == 1);
+    fail_unless(sane_memory_budget_mb(0) == 0);
+    fail_unless(sane_memory_budget_mb(4096) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_rotate_window)
+{
+    fail_unless(sane_rotate_window(-1) == 1);
+    fail_unless(sane_rotate_window(0) == 0);
+    fail_unless(sane_rotate_window(3600) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_key_ttl)
+{
+    fail_unless(sane_key_ttl(-1, 3) == 1);
+    fail_unless(sane_key_ttl(0, 0) == 0);
+    fail_unless(sane_key_ttl(0, 3) == 1);
+    fail_unless(sane_key_ttl(60, 3) == 0);
+    fail_unless(sane_key_ttl(60, 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_rotate_generations)
+{
+    fail_unless(sane_rotate_generations(0) == 1);
+    fail_unless(sane_rotate_generations(1) == 0);
+    fail_unless(sane_rotate_generations(24) == 0);
+    fail_unless(sane_rotate_generations(MAX_ROTATE_GENERATIONS + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_freezable)
+{
+    fail_unless(sane_freezable(-1) == 1);
+    fail_unless(sane_freezable(0) == 0);
+    fail_unless(sane_freezable(1) == 0);
+    fail_unless(sane_freezable(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_pinned)
+{
+    fail_unless(sane_pinned(-1) == 1);
+    fail_unless(sane_pinned(0) == 0);
+    fail_unless(sane_pinned(1) == 0);
+    fail_unless(sane_pinned(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_summary_capacity)
+{
+    fail_unless(sane_summary_capacity(-1) == 1);
+    fail_unless(sane_summary_capacity(0) == 0);
+    fail_unless(sane_summary_capacity(1000) == 1);
+    fail_unless(sane_summary_capacity(10000) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_shards)
+{
+    fail_unless(sane_shards(-1) == 1);
+    fail_unless(sane_shards(0) == 0);
+    fail_unless(sane_shards(16) == 0);
+    fail_unless(sane_shards(MAX_FILTER_SHARDS) == 0);
+    fail_unless(sane_shards(MAX_FILTER_SHARDS + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_latency_sample)
+{
+    fail_unless(sane_latency_sample(-1) == 1);
+    fail_unless(sane_latency_sample(0) == 0);
+    fail_unless(sane_latency_sample(1) == 0);
+    fail_unless(sane_latency_sample(1000) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_slowlog)
+{
+    fail_unless(sane_slowlog(-1, 128) == 1);
+    fail_unless(sane_slowlog(0, 128) == 0);
+    fail_unless(sane_slowlog(10000, 1) == 0);
+    fail_unless(sane_slowlog(10000, 0) == 1);
+    fail_unless(sane_slowlog(10000, 65537) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_metrics)
+{
+    fail_unless(sane_metrics_port(-1) == 1);
+    fail_unless(sane_metrics_port(0) == 0);
+    fail_unless(sane_metrics_port(9100) == 0);
+    fail_unless(sane_metrics_port(65536) == 1);
+    fail_unless(sane_metrics_interval(0) == 1);
+    fail_unless(sane_metrics_interval(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_numa)
+{
+    fail_unless(sane_use_numa(-1) == 1);
+    fail_unless(sane_use_numa(0) == 0);
+    fail_unless(sane_use_numa(1) == 0);
+    fail_unless(sane_use_numa(2) == 1);
+    fail_unless(sane_numa_interleave_mb(-1) == 1);
+    fail_unless(sane_numa_interleave_mb(0) == 0);
+    fail_unless(sane_numa_interleave_mb(1024) == 0);
+    fail_unless(sane_cpu_list("worker_cpus", NULL) == 0);
+    fail_unless(sane_cpu_list("worker_cpus", "0-3,8") == 0);
+    fail_unless(sane_cpu_list("worker_cpus", "") == 1);
+    fail_unless(sane_cpu_list("worker_cpus", "3-1") == 1);
+    fail_unless(sane_cpu_list("worker_cpus", "a,b") == 1);
+    fail_unless(sane_busy_poll_usec(-1) == 1);
+    fail_unless(sane_busy_poll_usec(0) == 0);
+    fail_unless(sane_busy_poll_usec(100) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_replication)
+{
+    fail_unless(sane_replication_port(-1) == 1);
+    fail_unless(sane_replication_port(0) == 0);
+    fail_unless(sane_replication_port(8675) == 0);
+    fail_unless(sane_replication_port(65536) == 1);
+    fail_unless(sane_replicate_from(NULL) == 0);
+    fail_unless(sane_replicate_from("10.0.0.1:8675") == 0);
+    fail_unless(sane_replicate_from("primary") == 1);
+    fail_unless(sane_replicate_from("primary:") == 1);
+    fail_unless(sane_replicate_from(":8675") == 1);
+    fail_unless(sane_replicate_from("primary:99999") == 1);
+    fail_unless(sane_replication_buffer_mb(0) == 1);
+    fail_unless(sane_replication_buffer_mb(64) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_read_only)
+{
+    fail_unless(sane_read_only(0) == 0);
+    fail_unless(sane_read_only(1) == 0);
+    fail_unless(sane_read_only(2) == 1);
+    fail_unless(sane_refresh_interval(0) == 1);
+    fail_unless(sane_refresh_interval(1) == 0);
+    fail_unless(sane_refresh_interval(60) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_residency_interval)
+{
+    fail_unless(sane_residency_interval(-1) == 1);
+    fail_unless(sane_residency_interval(0) == 0);
+    fail_unless(sane_residency_interval(60) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_snapshot_interval)
+{
+    fail_unless(sane_snapshot_interval(-1) == 1);
+    fail_unless(sane_snapshot_interval(0) == 0);
+    fail_unless(sane_snapshot_interval(30) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_sparse_layers)
+{
+    fail_unless(sane_sparse_layers(-1) == 1);
+    fail_unless(sane_sparse_layers(0) == 0);
+    fail_unless(sane_sparse_layers(1) == 0);
+    fail_unless(sane_sparse_layers(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_auto_shrink)
+{
+    fail_unless(sane_auto_shrink(-1) == 1);
+    fail_unless(sane_auto_shrink(0) == 0);
+    fail_unless(sane_auto_shrink(1) == 0);
+    fail_unless(sane_auto_shrink(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_load_dir)
+{
+    fail_unless(sane_load_dir(NULL) == 0);
+    fail_unless(sane_load_dir("/var/lib/bloomd/load") == 0);
+    fail_unless(sane_load_dir("load") == 1);
+    fail_unless(sane_load_dir("") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_data_dirs)
+{
+    fail_unless(sane_data_dirs("/tmp/bloomd", NULL) == 0);
+    fail_unless(sane_data_dirs("/tmp/bloomd", "/tmp/bloomd_dirs1,/tmp/bloomd_dirs2") == 0);
+    fail_unless(sane_data_dirs("/tmp/bloomd", "/tmp/bloomd_dirs1,dirs2") == 1);
+    rmdir("/tmp/bloomd_dirs1");
+    rmdir("/tmp/bloomd_dirs2");
+}
+END_TEST
+
+START_TEST(test_sane_cluster)
+{
+    fail_unless(sane_cluster(NULL, NULL) == 0);
+    fail_unless(sane_cluster("a:8673:8680", NULL) == 1);
+    fail_unless(sane_cluster(NULL, "a:8673") == 1);
+    fail_unless(sane_cluster("a:8673:8680", "a:8673") == 0);
+    fail_unless(sane_cluster("a:8673:8680, b:8674:8681", "b:8674") == 0);
+    fail_unless(sane_cluster("a:8673:8680,b:8674:8681", "c:8674") == 1);
+    fail_unless(sane_cluster("a:8673", "a:8673") == 1);
+    fail_unless(sane_cluster("a:8673:0", "a:8673") == 1);
+    fail_unless(sane_cluster("a:8673:8680x", "a:8673") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_compress_cold)
+{
+    fail_unless(sane_compress_cold(0) == 0);
+    fail_unless(sane_compress_cold(1) == 0);
+    fail_unless(sane_compress_cold(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_fault_retry)
+{
+    fail_unless(sane_fault_retry(0) == 0);
+    fail_unless(sane_fault_retry(1) == 0);
+    fail_unless(sane_fault_retry(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_syncfs)
+{
+    fail_unless(sane_flush_syncfs(0) == 0);
+    fail_unless(sane_flush_syncfs(1) == 0);
+    fail_unless(sane_flush_syncfs(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_use_direct_io)
+{
+    fail_unless(sane_use_direct_io(0) == 0);
+    fail_unless(sane_use_direct_io(1) == 0);
+    fail_unless(sane_use_direct_io(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_warmup)
+{
+    fail_unless(sane_warmup(-1) == 1);
+    fail_unless(sane_warmup(0) == 0);
+    fail_unless(sane_warmup(1) == 0);
+    fail_unless(sane_warmup(2) == 0);
+    fail_unless(sane_warmup(3) == 1);
+    fail_unless(warmup_from_name("willneed") == 0);
+    fail_unless(warmup_from_name("POPULATE") == 1);
+    fail_unless(warmup_from_name("lazy") == 2);
+    fail_unless(warmup_from_name("eager") == -1);
+    fail_unless(strcmp(warmup_name(WARMUP_LAZY), "lazy") == 0);
+}
+END_TEST
+
+START_TEST(test_sane_pack_layers)
+{
+    fail_unless(sane_pack_layers(0) == 0);
+    fail_unless(sane_pack_layers(1) == 0);
+    fail_unless(sane_pack_layers(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_tier_layers)
+{
+    fail_unless(sane_tier_layers(0) == 0);
+    fail_unless(sane_tier_layers(2) == 0);
+    fail_unless(sane_tier_layers(-1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_seal_layers)
+{
+    fail_unless(sane_seal_layers(0) == 0);
+    fail_unless(sane_seal_layers(1) == 0);
+    fail_unless(sane_seal_layers(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_multi_batch_size)
+{
+    fail_unless(sane_multi_batch_size(16) == 1);
+    fail_unless(sane_multi_batch_size(32) == 0);
+    fail_unless(sane_multi_batch_size(1024) == 0);
+    fail_unless(sane_multi_batch_size(100000) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_command_budget)
+{
+    fail_unless(sane_command_budget("command_budget", -1) == 1);
+    fail_unless(sane_command_budget("command_budget", 0) == 0);
+    fail_unless(sane_command_budget("command_budget_kb", 1024) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_rate_limit)
+{
+    fail_unless(sane_rate_limit("conn_key_rate", -1) == 1);
+    fail_unless(sane_rate_limit("conn_key_rate", 0) == 0);
+    fail_unless(sane_rate_limit("shed_input_kb", 4096) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_priority_lane)
+{
+    fail_unless(sane_priority_port(-1, 8673) == 1);
+    fail_unless(sane_priority_port(0, 8673) == 0);
+    fail_unless(sane_priority_port(8673, 8673) == 1);
+    fail_unless(sane_priority_port(8675, 8673) == 0);
+    fail_unless(sane_priority_workers(0) == 1);
+    fail_unless(sane_priority_workers(2) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_exec_threads)
+{
+    fail_unless(sane_exec_threads(-1) == 1);
+    fail_unless(sane_exec_threads(0) == 0);
+    fail_unless(sane_exec_threads(8) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_positive_cache)
+{
+    fail_unless(sane_positive_cache(-1) == 1);
+    fail_unless(sane_positive_cache(0) == 0);
+    fail_unless(sane_positive_cache(4096) == 0);
+    fail_unless(sane_positive_cache(1000) == 1);
+    fail_unless(sane_positive_cache(1 << 25) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_fault_park)
+{
+    fail_unless(sane_fault_park(-1) == 1);
+    fail_unless(sane_fault_park(0) == 0);
+    fail_unless(sane_fault_park(1) == 0);
+    fail_unless(sane_fault_park(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_tcp_options)
+{
+    fail_unless(sane_tcp_backlog(0) == 1);
+    fail_unless(sane_tcp_backlog(1024) == 0);
+    fail_unless(sane_tcp_option("tcp_defer_accept", -1) == 1);
+    fail_unless(sane_tcp_option("tcp_defer_accept", 0) == 0);
+    fail_unless(sane_tcp_option("tcp_rcvbuf_kb", 256) == 0);
+    fail_unless(sane_tcp_quickack(0) == 0);
+    fail_unless(sane_tcp_quickack(1) == 0);
+    fail_unless(sane_tcp_quickack(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_conn_buf)
+{
+    fail_unless(sane_conn_buf(4, 8) == 0);
+    fail_unless(sane_conn_buf(64, 2) == 0);
+    fail_unless(sane_conn_buf(0, 8) == 1);
+    fail_unless(sane_conn_buf(6, 8) == 1);
+    fail_unless(sane_conn_buf(4, 1) == 1);
+    fail_unless(sane_conn_buf(4, 128) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_unix_socket)
+{
+    char long_path[256];
+    memset(long_path, 'a', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    fail_unless(sane_unix_socket(NULL) == 0);
+    fail_unless(sane_unix_socket("/tmp/bloomd.sock") == 0);
+    fail_unless(sane_unix_socket("@bloomd") == 0);
+    fail_unless(sane_unix_socket("") == 1);
+    fail_unless(sane_unix_socket(long_path) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_handoff_socket)
+{
+    fail_unless(sane_handoff_socket(NULL, NULL) == 0);
+    fail_unless(sane_handoff_socket("/tmp/bloomd.handoff", NULL) == 0);
+    fail_unless(sane_handoff_socket("@bloomd-handoff", "/tmp/bloomd.sock") == 0);
+    fail_unless(sane_handoff_socket("", NULL) == 1);
+    fail_unless(sane_handoff_socket("/tmp/bloomd.sock", "/tmp/bloomd.sock") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_shm)
+{
+    fail_unless(sane_shm(NULL, NULL, NULL, 1024, 50) == 0);
+    fail_unless(sane_shm("/tmp/bloomd.shm", "/tmp/bloomd.sock", NULL, 1024, 50) == 0);
+    fail_unless(sane_shm("@bloomd-shm", NULL, NULL, 64, 0) == 0);
+    fail_unless(sane_shm("", NULL, NULL, 1024, 50) == 1);
+    fail_unless(sane_shm("/tmp/bloomd.sock", "/tmp/bloomd.sock", NULL, 1024, 50) == 1);
+    fail_unless(sane_shm("@bloomd-handoff", NULL, "@bloomd-handoff", 1024, 50) == 1);
+    fail_unless(sane_shm("/tmp/bloomd.shm", NULL, NULL, 32, 50) == 1);
+    fail_unless(sane_shm("/tmp/bloomd.shm", NULL, NULL, 1000, 50) == 1);
+    fail_unless(sane_shm("/tmp/bloomd.shm", NULL, NULL, 1024, -1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_page_checksums)
+{
+    fail_unless(sane_page_checksums(0, 16) == 0);
+    fail_unless(sane_page_checksums(1, 0) == 0);
+    fail_unless(sane_page_checksums(2, 16) == 1);
+    fail_unless(sane_page_checksums(-1, 16) == 1);
+    fail_unless(sane_page_checksums(1, -1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_tls)
+{
+    int fd = open("/tmp/bloomd_tls_test.pem", O_CREAT|O_RDWR, 0644);
+    fail_unless(fd >= 0);
+    close(fd);
+    fail_unless(sane_tls(NULL, NULL, 0, 1) == 0);
+    fail_unless(sane_tls("/tmp/bloomd_tls_test.pem", NULL, 0, 0) == 1);
+    fail_unless(sane_tls("/tmp/bloomd_tls_test.pem", "/tmp/bloomd_tls_test.pem", 1024, 0) == 0);
+    fail_unless(sane_tls("/tmp/bloomd_tls_test.pem", "/tmp/bloomd_tls_missing.pem", 1024, 0) == 1);
+    fail_unless(sane_tls("/tmp/bloomd_tls_test.pem", "/tmp/bloomd_tls_test.pem", -1, 0) == 1);
+    fail_unless(sane_tls("/tmp/bloomd_tls_test.pem", "/tmp/bloomd_tls_test.pem", 1024, 1) == 1);
+    unlink("/tmp/bloomd_tls_test.pem");
+}
+END_TEST
+
+START_TEST(test_reload_config)
+{
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    fail_unless(validate_config(&config) == 0);
+
+    int fh = open("/tmp/reload_config", O_CREAT|O_TRUNC|O_RDWR, 0777);
+    char *buf = "[bloomd]\n\
+port = 10000\n\
+flush_interval = 120\n\
+max_memory_percent = 70\n\
+flush_rate_limit = 50\n\
+log_level = debug\n";
+    write(fh, buf, strlen(buf));
+    fsync(fh);
+    close(fh);
+
+    // The runtime settings change, the port needs a restart
+    fail_unless(reload_config("/tmp/reload_config", &config) == 0);
+    fail_unless(config.flush_interval == 120);
+    fail_unless(config.max_memory_percent == 70);
+    fail_unless(config.flush_rate_limit == 50);
+    fail_unless(config.syslog_log_level == LOG_UPTO(LOG_DEBUG));
+    fail_unless(config.tcp_port == 8673);
+
+    // An invalid file changes nothing
+    fh = open("/tmp/reload_config", O_CREAT|O_TRUNC|O_RDWR, 0777);
+    buf = "[bloomd]\n\
+flush_interval = 30\n\
+initial_capacity = 1\n";
+    write(fh, buf, strlen(buf));
+    fsync(fh);
+    close(fh);
+    fail_unless(reload_config("/tmp/reload_config", &config) == -1);
+    fail_unless(config.flush_interval == 120);
+
+    // Intervals can not be disabled while running
+    fh = open("/tmp/reload_config", O_CREAT|O_TRUNC|O_RDWR, 0777);
+    buf = "[bloomd]\n\
+flush_interval = 0\n";
+    write(fh, buf, strlen(buf));
+    fsync(fh);
+    close(fh);
+    fail_unless(reload_config("/tmp/reload_config", &config) == 0);
+    fail_unless(config.flush_interval == 120);
+    fail_unless(config.max_memory_percent == 80);
+    unlink("/tmp/reload_config");
+}
+END_TEST
+
+START_TEST(test_sane_layout)
+{
+    fail_unless(sane_layout(-1) == 1);
+    fail_unless(sane_layout(0) == 0);
+    fail_unless(sane_layout(1) == 0);
+    fail_unless(sane_layout(2) == 0);
+    fail_unless(sane_layout(3) == 0);
+    fail_unless(sane_layout(4) == 0);
+    fail_unless(sane_layout(5) == 1);
+    fail_unless(layout_from_name("partitioned") == 0);
+    fail_unless(layout_from_name("BLOCKED") == 1);
+    fail_unless(layout_from_name("counting") == 2);
+    fail_unless(layout_from_name("Aging") == 3);
+    fail_unless(layout_from_name("quotient") == 4);
+    fail_unless(strcmp(layout_name(4), "quotient") == 0);
+    fail_unless(layout_from_name("striped") == -1);
+}
+END_TEST
+
+START_TEST(test_sane_hash_scheme)
+{
+    fail_unless(sane_hash_scheme(-1) == 1);
+    fail_unless(sane_hash_scheme(0) == 0);
+    fail_unless(sane_hash_scheme(1) == 0);
+    fail_unless(sane_hash_scheme(2) == 0);
+    fail_unless(sane_hash_scheme(3) == 0);
+    fail_unless(sane_hash_scheme(4) == 1);
+    fail_unless(hash_scheme_from_name("legacy") == 0);
+    fail_unless(hash_scheme_from_name("MURMUR") == 1);
+    fail_unless(hash_scheme_from_name("crc32c") == 2);
+    fail_unless(!strcmp(hash_scheme_name(2), "crc32c"));
+    fail_unless(hash_scheme_from_name("short") == 3);
+    fail_unless(!strcmp(hash_scheme_name(3), "short"));
+    fail_unless(hash_scheme_from_name("md5") == -1);
+}
+END_TEST
+
 START_TEST(test_filter_config_bad_file)
 {
     bloom_filter_config config;
@@ -361,6 +1157,82 @@ probability_reduction = 0.8\n";
 }
 END_TEST
 
+START_TEST(test_update_binary_from_filter_config)
+{
+    bloom_filter_config config;
+    memset(&config, 0, sizeof(config));
+    config.initial_capacity = 2000000;
+    config.default_probability = 0.005;
+    config.scale_size = 2;
+    config.probability_reduction = 0.8;
+    config.size = 256;
+    config.capacity = 4000000;
+    config.bytes = 999999;
+    config.layout = 3;
+    config.hash_scheme = 1;
+    config.rotate_window = 3600;
+    config.rotate_generations = 24;
+    config.summary_capacity = 500000;
+    config.shards = 8;
+    config.warmup = WARMUP_POPULATE;
+    config.key_ttl = 60;
+    config.max_probes = 6;
+    config.pinned = 1;
+
+    int res = update_binary_from_filter_config("/tmp/update_binary", &config);
+    fail_unless(res == 0);
+
+    bloom_filter_config config2;
+    memset(&config2, '\0', sizeof(config2));
+    res = filter_config_from_binary("/tmp/update_binary", &config2);
+    fail_unless(res == 0);
+    fail_unless(memcmp(&config, &config2, sizeof(config)) == 0);
+
+    // A damaged record is rejected
+    int fh = open("/tmp/update_binary", O_RDWR);
+    fail_unless(pwrite(fh, "x", 1, 20) == 1);
+    close(fh);
+    fail_unless(filter_config_from_binary("/tmp/update_binary", &config2) == -EINVAL);
+    unlink("/tmp/update_binary");
+    fail_unless(filter_config_from_binary("/tmp/update_binary", &config2) == -ENOENT);
+
+    // A version 1 record ends with its checksum in place of
+    // max_probes, and is read with the space-optimal probes
+    unsigned char rec[256];
+    int len = filter_config_to_record(&config, rec, sizeof(rec));
+    fail_unless(len > 8);
+    uint16_t version = 1, v1_len = len - 8;
+    memcpy(rec + 4, &version, sizeof(version));
+    memcpy(rec + 6, &v1_len, sizeof(v1_len));
+    uint32_t hash = 2166136261u;
+    for (int i=0; i < v1_len - 4; i++) {
+        hash ^= rec[i];
+        hash *= 16777619u;
+    }
+    memcpy(rec + v1_len - 4, &hash, sizeof(hash));
+    memset(&config2, '\0', sizeof(config2));
+    fail_unless(filter_config_from_record(rec, v1_len, &config2) == v1_len);
+    fail_unless(config2.key_ttl == 60);
+    fail_unless(config2.max_probes == 0);
+
+    // A version 2 record has its checksum in place of pinned,
+    // and is read as not pinned
+    len = filter_config_to_record(&config, rec, sizeof(rec));
+    version = 2;
+    memcpy(rec + 4, &version, sizeof(version));
+    hash = 2166136261u;
+    for (int i=0; i < len - 8; i++) {
+        hash ^= rec[i];
+        hash *= 16777619u;
+    }
+    memcpy(rec + len - 8, &hash, sizeof(hash));
+    memset(&config2, '\0', sizeof(config2));
+    fail_unless(filter_config_from_record(rec, len, &config2) == len);
+    fail_unless(config2.max_probes == 6);
+    fail_unless(config2.pinned == 0);
+}
+END_TEST
+
 START_TEST(test_update_filename_from_filter_config)
 {
     bloom_filter_config config;
@@ -372,6 +1244,18 @@ START_TEST(test_update_filename_from_filter_config)
     config.capacity = 4000000;
     config.bytes = 999999;
     config.in_memory = 0;
+    config.layout = 1;
+    config.hash_scheme = 1;
+    config.rotate_window = 3600;
+    config.rotate_generations = 24;
+    config.freezable = 1;
+    config.frozen = 1;
+    config.summary_capacity = 500000;
+    config.shards = 8;
+    config.warmup = WARMUP_POPULATE;
+    config.key_ttl = 0;
+    config.max_probes = 6;
+    config.pinned = 1;
 
     int res = update_filename_from_filter_config("/tmp/update_filter", &config);
     chmod("/tmp/update_filter", 777);
@@ -391,6 +1275,17 @@ START_TEST(test_update_filename_from_filter_config)
     fail_unless(config2.capacity == 4000000);
     fail_unless(config2.bytes == 999999);
     fail_unless(config2.in_memory == 0);
+    fail_unless(config2.layout == 1);
+    fail_unless(config2.hash_scheme == 1);
+    fail_unless(config2.rotate_window == 3600);
+    fail_unless(config2.rotate_generations == 24);
+    fail_unless(config2.freezable == 1);
+    fail_unless(config2.frozen == 1);
+    fail_unless(config2.summary_capacity == 500000);
+    fail_unless(config2.shards == 8);
+    fail_unless(config2.warmup == WARMUP_POPULATE);
+    fail_unless(config2.max_probes == 6);
+    fail_unless(config2.pinned == 1);
 
     unlink("/tmp/update_filter");
 }
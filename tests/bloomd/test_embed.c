@@ -0,0 +1,39 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bloomd_embed.h"
+
+START_TEST(test_embed_open_close)
+{
+    bloomd_embed *db;
+    fail_unless(bloomd_embed_open(NULL, "/tmp/test_embed", &db) == BLOOMD_EMBED_OK);
+
+    bloomd_embed_filter_options opts = {20000, 0.001, 0};
+    fail_unless(bloomd_embed_create(db, "foo", &opts) == BLOOMD_EMBED_OK);
+    fail_unless(bloomd_embed_create(db, "foo", NULL) == BLOOMD_EMBED_EXISTS);
+    opts.probability = 2;
+    fail_unless(bloomd_embed_create(db, "bar", &opts) == BLOOMD_EMBED_ARGS);
+
+    fail_unless(bloomd_embed_set(db, "foo", "a") == 1);
+    fail_unless(bloomd_embed_set(db, "foo", "a") == 0);
+    fail_unless(bloomd_embed_check(db, "foo", "a") == 1);
+    fail_unless(bloomd_embed_check(db, "foo", "b") == 0);
+    fail_unless(bloomd_embed_check(db, "bar", "a") == BLOOMD_EMBED_NO_FILTER);
+
+    const char *keys[] = {"a", "b", "c"};
+    char results[3];
+    fail_unless(bloomd_embed_set_many(db, "foo", keys, 3, results) == 0);
+    fail_unless(results[0] == 0 && results[1] == 1 && results[2] == 1);
+    fail_unless(bloomd_embed_flush(db, "foo") == BLOOMD_EMBED_OK);
+    bloomd_embed_close(db);
+
+    // The filter is loaded again on the next open
+    fail_unless(bloomd_embed_open(NULL, "/tmp/test_embed", &db) == BLOOMD_EMBED_OK);
+    fail_unless(bloomd_embed_check_many(db, "foo", keys, 3, results) == 0);
+    fail_unless(results[0] == 1 && results[1] == 1 && results[2] == 1);
+    fail_unless(bloomd_embed_drop(db, "foo") == BLOOMD_EMBED_OK);
+    fail_unless(bloomd_embed_drop(db, "foo") == BLOOMD_EMBED_NO_FILTER);
+    bloomd_embed_close(db);
+}
+END_TEST
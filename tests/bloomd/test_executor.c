@@ -0,0 +1,66 @@
+#include <check.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "executor.h"
+
+typedef struct {
+    bloom_job job;
+    int thread;
+    int *counter;
+    int sleep_usec;
+} executor_test_job;
+
+static void executor_test_func(bloom_job *job, int thread) {
+    executor_test_job *j = (executor_test_job*)job;
+    if (j->sleep_usec) usleep(j->sleep_usec);
+    j->thread = thread;
+    __atomic_add_fetch(j->counter, 1, __ATOMIC_SEQ_CST);
+}
+
+START_TEST(test_executor_jobs)
+{
+    bloom_executor *exec;
+    int res = init_executor(4, NULL, NULL, NULL, &exec);
+    fail_unless(res == 0);
+    fail_unless(executor_threads(exec) == 4);
+
+    // Every job runs once, even those queued as we exit
+    int counter = 0;
+    executor_test_job *jobs = calloc(1000, sizeof(executor_test_job));
+    for (int i=0; i < 1000; i++) {
+        jobs[i].job.func = executor_test_func;
+        jobs[i].thread = -1;
+        jobs[i].counter = &counter;
+        executor_submit(exec, i, &jobs[i].job);
+    }
+    destroy_executor(exec);
+    fail_unless(counter == 1000);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(jobs[i].thread >= 0 && jobs[i].thread < 4);
+    }
+    free(jobs);
+}
+END_TEST
+
+START_TEST(test_executor_stealing)
+{
+    bloom_executor *exec;
+    int res = init_executor(2, NULL, NULL, NULL, &exec);
+    fail_unless(res == 0);
+
+    // A slow job does not strand the jobs behind it,
+    // the other thread steals them
+    int counter = 0;
+    executor_test_job slow = {{executor_test_func, NULL}, -1, &counter, 500000};
+    executor_test_job fast = {{executor_test_func, NULL}, -1, &counter, 0};
+    executor_submit(exec, 0, &slow.job);
+    usleep(50000);
+    executor_submit(exec, 0, &fast.job);
+    for (int i=0; i < 200 && counter < 1; i++) usleep(1000);
+    fail_unless(counter == 1);
+    fail_unless(fast.thread != slow.thread || slow.thread == -1);
+    destroy_executor(exec);
+    fail_unless(counter == 2);
+    fail_unless(fast.thread != slow.thread);
+}
+END_TEST
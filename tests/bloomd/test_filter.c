@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
 #include "config.h"
 #include "filter.h"
 
@@ -111,13 +112,14 @@ START_TEST(test_filter_init_proxied)
     res = init_bloom_filter(&config, "test_filter3", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
-    fail_unless(counters->check_hits == 0);
-    fail_unless(counters->check_misses == 0);
-    fail_unless(counters->set_hits == 0);
-    fail_unless(counters->set_misses == 0);
-    fail_unless(counters->page_ins == 0);
-    fail_unless(counters->page_outs == 0);
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 0);
+    fail_unless(counters.check_misses == 0);
+    fail_unless(counters.set_hits == 0);
+    fail_unless(counters.set_misses == 0);
+    fail_unless(counters.page_ins == 0);
+    fail_unless(counters.page_outs == 0);
 
     fail_unless(bloomf_is_proxied(filter) == 1);
     fail_unless(bloomf_capacity(filter) == 100000);
@@ -140,7 +142,7 @@ START_TEST(test_filter_add_check)
     res = init_bloom_filter(&config, "test_filter4", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -153,7 +155,8 @@ START_TEST(test_filter_add_check)
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_byte_size(filter) > 32*1024);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->set_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 10000);
 
     // Check all the keys exist
     for (int i=0;i<10000;i++) {
@@ -162,7 +165,8 @@ START_TEST(test_filter_add_check)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -179,7 +183,7 @@ START_TEST(test_filter_restore)
     bloom_filter *filter = NULL;
     res = init_bloom_filter(&config, "test_filter5", 0, &filter);
     fail_unless(res == 0);
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -196,7 +200,6 @@ START_TEST(test_filter_restore)
     // Remake the filter
     res = init_bloom_filter(&config, "test_filter5", 1, &filter);
     fail_unless(res == 0);
-    counters = bloomf_counters(filter);
 
     // Re-check
     fail_unless(bloomf_size(filter) == 10000);
@@ -210,8 +213,9 @@ START_TEST(test_filter_restore)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->set_hits == 0);
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 0);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -242,14 +246,14 @@ START_TEST(test_filter_flush)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter6/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter6/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter6/data.000.mmap", 0777) == 0);
 
     // Remake the filter
     bloom_filter *filter2 = NULL;
     res = init_bloom_filter(&config, "test_filter6", 1, &filter2);
     fail_unless(res == 0);
-    filter_counters *counters2 = bloomf_counters(filter2);
+    filter_counters counters2;
 
     // Re-check
     fail_unless(bloomf_size(filter2) == 10000);
@@ -263,8 +267,9 @@ START_TEST(test_filter_flush)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters2->set_hits == 0);
-    fail_unless(counters2->check_hits == 10000);
+    bloomf_counters(filter2, &counters2);
+    fail_unless(counters2.set_hits == 0);
+    fail_unless(counters2.check_hits == 10000);
 
     // Destroy the filter
     res = destroy_bloom_filter(filter);
@@ -276,6 +281,45 @@ START_TEST(test_filter_flush)
 }
 END_TEST
 
+START_TEST(test_filter_legacy_config)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter_legacy", 0, &filter);
+    fail_unless(res == 0);
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_flush(filter) == 0);
+    fail_unless(destroy_bloom_filter(filter) == 0);
+
+    // Turn the record into the INI file of an older version
+    bloom_filter_config filter_config;
+    memset(&filter_config, 0, sizeof(filter_config));
+    res = filter_config_from_binary("/tmp/bloomd/bloomd.test_filter_legacy/config.bin", &filter_config);
+    fail_unless(res == 0);
+    fail_unless(filter_config.size == 1000);
+    res = update_filename_from_filter_config("/tmp/bloomd/bloomd.test_filter_legacy/config.ini", &filter_config);
+    fail_unless(res == 0);
+    fail_unless(unlink("/tmp/bloomd/bloomd.test_filter_legacy/config.bin") == 0);
+
+    // The INI file is read, and replaced by the record
+    res = init_bloom_filter(&config, "test_filter_legacy", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == 1000);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter_legacy/config.ini", F_OK) == -1);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter_legacy/config.bin", F_OK) == 0);
+
+    fail_unless(bloomf_delete(filter) == 0);
+    fail_unless(destroy_bloom_filter(filter) == 0);
+}
+END_TEST
+
 START_TEST(test_filter_add_check_in_mem)
 {
     bloom_config config;
@@ -287,7 +331,7 @@ START_TEST(test_filter_add_check_in_mem)
     res = init_bloom_filter(&config, "test_filter7", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -300,7 +344,8 @@ START_TEST(test_filter_add_check_in_mem)
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_byte_size(filter) > 32*1024);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->set_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 10000);
 
     // Check all the keys exist
     for (int i=0;i<10000;i++) {
@@ -309,7 +354,8 @@ START_TEST(test_filter_add_check_in_mem)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -328,7 +374,7 @@ START_TEST(test_filter_grow)
     res = init_bloom_filter(&config, "test_filter8", 1, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -339,14 +385,16 @@ START_TEST(test_filter_grow)
     fail_unless(bloomf_size(filter) > 99000);
     fail_unless(bloomf_byte_size(filter) > 512*1024);
     fail_unless(bloomf_capacity(filter) == 210000);
-    fail_unless(counters->set_hits > 99000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits > 99000);
 
     // Check all the keys exist
     for (int i=0;i<100000;i++) {
         snprintf((char*)&buf, 100, "foobar%d", i);
         res = bloomf_contains(filter, (char*)&buf);
     }
-    fail_unless(counters->check_hits == 100000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 100000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -380,7 +428,7 @@ START_TEST(test_filter_grow_restore)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/data.000.mmap", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/data.001.mmap", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter9/data.002.mmap", 0777) == 0);
@@ -443,7 +491,7 @@ START_TEST(test_filter_restore_order)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/data.000.mmap", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.test_filter12/data.001.mmap", 0777) == 0);
 
@@ -481,7 +529,7 @@ START_TEST(test_filter_page_out)
     res = init_bloom_filter(&config, "test_filter10", 0, &filter);
     fail_unless(res == 0);
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
 
     // Check all the keys get added
     char buf[100];
@@ -494,8 +542,10 @@ START_TEST(test_filter_page_out)
     fail_unless(bloomf_close(filter) == 0);
     fail_unless(bloomf_size(filter) == 10000);
     fail_unless(bloomf_capacity(filter) == 100000);
-    fail_unless(counters->page_outs == 1);
-    fail_unless(counters->page_ins == 0);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.page_outs == 1);
+    fail_unless(counters.page_ins == 0);
+    uint64_t fault_nsec = counters.fault_nsec;
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
@@ -508,9 +558,12 @@ START_TEST(test_filter_page_out)
         fail_unless(res == 1);
     }
 
-    fail_unless(counters->check_hits == 10000);
-    fail_unless(counters->page_outs == 1);
-    fail_unless(counters->page_ins == 1);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 10000);
+    fail_unless(counters.page_outs == 1);
+    fail_unless(counters.page_ins == 1);
+    fail_unless(counters.fault_nsec > fault_nsec);
+    fail_unless(counters.fault_lock_waits == 0);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -538,18 +591,20 @@ START_TEST(test_filter_bounded_fp)
         bloomf_add(filter, (char*)&buf);
     }
 
-    filter_counters *counters = bloomf_counters(filter);
+    filter_counters counters;
     fail_unless(bloomf_size(filter) > 999000);
     fail_unless(bloomf_capacity(filter) > 1000000);
-    fail_unless(counters->set_hits > 990000);
-    fail_unless(counters->set_misses < 1000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits > 990000);
+    fail_unless(counters.set_misses < 1000);
 
     // Check all the keys exist
     for (int i=0;i<1000000;i++) {
         snprintf((char*)&buf, 100, "foobar%d", i);
         bloomf_contains(filter, (char*)&buf);
     }
-    fail_unless(counters->check_hits == 1000000);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits == 1000000);
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
@@ -557,3 +612,1658 @@ START_TEST(test_filter_bounded_fp)
 }
 END_TEST
 
+
+static void* test_filter_check_thread(void *in) {
+    bloom_filter *filter = in;
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_contains(filter, (char*)&buf);
+    }
+    return NULL;
+}
+
+START_TEST(test_filter_counters_threads)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    config.in_memory = 1;
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter12", 0, &filter);
+    fail_unless(res == 0);
+
+    // Add half of the keys that will be checked
+    char buf[100];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // Check from many threads, so more than one shard is used
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++) {
+        fail_unless(pthread_create(&threads[i], NULL, test_filter_check_thread, filter) == 0);
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits == 5000);
+    fail_unless(counters.check_hits + counters.check_misses == 40000);
+    fail_unless(counters.check_hits >= 20000);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter12");
+}
+END_TEST
+
+START_TEST(test_filter_blocked_restore)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.layout = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter13", 1, &filter);
+    fail_unless(res == 0);
+
+    // Add enough keys to grow the filter
+    char buf[100];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(bloomf_size(filter) > 19900);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Restore with the default layout, the filter configuration wins
+    config.layout = 0;
+    res = init_bloom_filter(&config, "test_filter13", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.layout == 1);
+    fail_unless(((bloom_sbf*)filter->sbf)->filters[0]->header->layout == 1);
+
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter13");
+}
+END_TEST
+
+START_TEST(test_filter_add_many)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 10000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter14", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[20000][20];
+    char *keys[20000];
+    char result[20000];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+
+    // Without growing, only the first layer is filled
+    res = bloomf_try_add_many(filter, keys, 20000, result);
+    fail_unless(res == 10000);
+    res = bloomf_add_many(filter, keys + res, 20000 - res, result + res);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) > 19900);
+
+    // Check the batch twice, the second half of the keys are new
+    res = bloomf_contains_many(filter, keys + 10000, 10000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<10000;i++) {
+        fail_unless(result[i] == 1);
+    }
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.set_hits + counters.set_misses == 20000);
+    fail_unless(counters.set_hits > 19900);
+    fail_unless(counters.check_hits == 10000);
+    fail_unless(counters.check_misses == 0);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter14");
+}
+END_TEST
+
+START_TEST(test_filter_set_log_replay)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_set_log = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter15", 0, &filter);
+    fail_unless(res == 0);
+
+    // Add keys without flushing, singly and in a batch
+    static char bufs[1000][20];
+    char *keys[1000];
+    char result[1000];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    for (int i=0;i<500;i++) {
+        fail_unless(bloomf_add(filter, keys[i]) == 1);
+    }
+    res = bloomf_add_many(filter, keys + 500, 500, result);
+    fail_unless(res == 0);
+
+    // A second wrapper only sees the keys through the log
+    bloom_filter *filter2 = NULL;
+    res = init_bloom_filter(&config, "test_filter15", 1, &filter2);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter2) == 1000);
+    res = bloomf_contains_many(filter2, keys, 1000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<1000;i++) {
+        fail_unless(result[i] == 1);
+    }
+
+    // The flush on load released the rotated log
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter15/set.log.old", F_OK) == -1);
+
+    res = destroy_bloom_filter(filter2);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter15") == 3);
+}
+END_TEST
+
+START_TEST(test_filter_rotating)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.rotate_window = 60;
+    config.rotate_generations = 3;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter16", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->gens->num == 1);
+
+    uint64_t now = time(NULL);
+    uint64_t bucket = now / 60;
+    fail_unless(bloomf_needs_rotate(filter, now) == 0);
+    fail_unless(bloomf_needs_rotate(filter, now + 60) == 1);
+
+    static char bufs[200][20];
+    char *keys[200];
+    char result[200];
+    for (int i=0;i<200;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    for (int i=0;i<100;i++) {
+        fail_unless(bloomf_add(filter, keys[i]) == 1);
+    }
+
+    // Start a new generation, the keys are still seen
+    res = bloomf_rotate(filter, now + 60);
+    fail_unless(res == 0);
+    fail_unless(filter->gens->num == 2);
+    fail_unless(filter->gens->gens[0].bucket == bucket + 1);
+    res = bloomf_contains_many(filter, keys, 100, result);
+    fail_unless(res == 0);
+    for (int i=0;i<100;i++) {
+        fail_unless(result[i] == 1);
+    }
+
+    // Keys set in an older generation are reported as present,
+    // but are still set in the newest generation
+    res = bloomf_add_many(filter, keys, 200, result);
+    fail_unless(res == 0);
+    for (int i=0;i<200;i++) {
+        fail_unless(result[i] == (i >= 100));
+    }
+    fail_unless(bloomf_contains(filter, keys[150]) == 1);
+    fail_unless(bloomf_size(filter) == 300);
+
+    // The first generation expires
+    res = bloomf_rotate(filter, now + 180);
+    fail_unless(res == 0);
+    fail_unless(filter->gens->num == 2);
+    fail_unless(filter->gens->gens[1].bucket == bucket + 1);
+    fail_unless(bloomf_contains(filter, keys[0]) == 1);
+
+    char path[128];
+    snprintf(path, sizeof(path), "/tmp/bloomd/bloomd.test_filter16/gen.%llu", (unsigned long long)bucket);
+    fail_unless(access(path, F_OK) == -1);
+
+    // Then the generation holding all the keys
+    res = bloomf_rotate(filter, now + 240);
+    fail_unless(res == 0);
+    fail_unless(bloomf_needs_rotate(filter, now + 240) == 0);
+    res = bloomf_contains_many(filter, keys, 200, result);
+    fail_unless(res == 0);
+    int found = 0;
+    for (int i=0;i<200;i++) found += result[i];
+    fail_unless(found < 5);
+
+    // The live generations are discovered on load
+    res = bloomf_add(filter, keys[7]);
+    fail_unless(res == 1);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    res = init_bloom_filter(&config, "test_filter16", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->gens->num == 2);
+    fail_unless(filter->gens->gens[0].bucket == bucket + 4);
+    fail_unless(bloomf_contains(filter, keys[7]) == 1);
+    fail_unless(bloomf_size(filter) == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter16", F_OK) == -1);
+}
+END_TEST
+
+START_TEST(test_filter_aging)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.layout = BLOOM_LAYOUT_AGING;
+    config.key_ttl = 64;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter39", 0, &filter);
+    fail_unless(res == 0);
+
+    // Filters are only aged once faulted in
+    uint64_t now = time(NULL);
+    fail_unless(bloomf_needs_age(filter, now + 4) == 0);
+    fail_unless(bloomf_add(filter, "foo") == 1);
+    fail_unless(bloomf_add(filter, "bar") == 1);
+    fail_unless(bloomf_needs_age(filter, now + 4) == 1);
+    fail_unless(bloomf_age(filter, now + 4) == 0);
+    fail_unless(bloomf_needs_age(filter, now + 4) == 0);
+    fail_unless(bloomf_contains(filter, "foo") == 1);
+
+    // Setting a key again keeps it past the TTL of the first set
+    fail_unless(bloomf_age(filter, now + 40) == 0);
+    fail_unless(bloomf_add(filter, "foo") == 0);
+    fail_unless(bloomf_age(filter, now + 74) == 0);
+    fail_unless(bloomf_contains(filter, "foo") == 1);
+    fail_unless(bloomf_contains(filter, "bar") == 0);
+    fail_unless(bloomf_size(filter) == 1);
+
+    // The stamps are kept on disk
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter39", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.key_ttl == 64);
+    fail_unless(bloomf_contains(filter, "foo") == 1);
+    fail_unless(bloomf_contains(filter, "bar") == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_max_probes)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.max_probes = 6;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter43", 0, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(((bloom_sbf*)filter->sbf)->filters[0]->header->k_num == 6);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // The budget is kept for the layers added after a restore
+    config.max_probes = 0;
+    res = init_bloom_filter(&config, "test_filter43", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.max_probes == 6);
+    fail_unless(((bloom_sbf*)filter->sbf)->params.format.max_k_num == 6);
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_counting)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.layout = BLOOM_LAYOUT_COUNTING;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter17", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->set_log == NULL);
+
+    // Grow into a second layer
+    static char bufs[1500][20];
+    char *keys[1500];
+    char result[1500];
+    for (int i=0;i<1500;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 1500, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 2);
+
+    // Remove the even keys
+    for (int i=0;i<1500;i+=2) {
+        res = bloomf_remove_many(filter, keys + i, 1, result);
+        fail_unless(res == 0 && result[0] == 1);
+    }
+    fail_unless(bloomf_size(filter) == 750);
+    fail_unless(bloomf_contains(filter, keys[0]) == 0);
+    fail_unless(bloomf_contains(filter, keys[1]) == 1);
+
+    // A remove and an add keep the size, but still dirty the filter
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_is_dirty(filter) == 0);
+    res = bloomf_remove_many(filter, keys + 1, 1, result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = bloomf_add(filter, keys[0]);
+    fail_unless(res == 1);
+    fail_unless(bloomf_size(filter) == 750);
+    fail_unless(bloomf_is_dirty(filter) == 1);
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_is_dirty(filter) == 0);
+
+    // The removals are persisted
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.layout = BLOOM_LAYOUT_PARTITIONED;
+    res = init_bloom_filter(&config, "test_filter17", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.layout == BLOOM_LAYOUT_COUNTING);
+    fail_unless(bloomf_size(filter) == 750);
+    res = bloomf_contains_many(filter, keys, 1500, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 0);
+    int found = 0;
+    for (int i=2;i<1500;i+=2) found += result[i];
+    for (int i=3;i<1500;i+=2) fail_unless(result[i] == 1);
+    fail_unless(found < 5);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Other layouts cannot remove keys
+    res = init_bloom_filter(&config, "test_filter18", 0, &filter);
+    fail_unless(res == 0);
+    res = bloomf_remove_many(filter, keys, 1, result);
+    fail_unless(res == -EINVAL);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_freeze)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.freezable = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter19", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->staged != NULL);
+
+    // Set the keys across two layers, with some repeats
+    static char bufs[3000][20];
+    char *keys[3000];
+    char result[3000];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 1500, result);
+    fail_unless(res == 0);
+    res = bloomf_add(filter, keys[0]);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 2);
+
+    // Keys holding a newline or a zero byte are staged whole
+    char *binary[] = {"k\nl", "k\0l", "k", "l"};
+    int binary_lens[] = {3, 3, 1, 1};
+    res = bloomf_add_many_len(filter, binary, binary_lens, 2, result);
+    fail_unless(res == 0);
+
+    // The staged keys survive a restart
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.freezable = 0;
+    res = init_bloom_filter(&config, "test_filter19", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.freezable == 1);
+
+    res = bloomf_freeze(filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.frozen == 1);
+    fail_unless(filter->sbf == NULL && filter->staged == NULL);
+    fail_unless(bloomf_size(filter) == 1502);
+    fail_unless(bloomf_byte_size(filter) < 1500 * 3);
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    res = bloomf_freeze(filter);
+    fail_unless(res == -EEXIST);
+
+    // Every set key is found, and sets are refused
+    res = bloomf_contains_many(filter, keys, 3000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_is_proxied(filter) == 0);
+    int found = 0;
+    for (int i=0;i<1500;i++) fail_unless(result[i] == 1);
+    for (int i=1500;i<3000;i++) found += result[i];
+    fail_unless(found < 5);
+    fail_unless(bloomf_contains(filter, keys[42]) == 1);
+    res = bloomf_contains_many_len(filter, binary, binary_lens, 4, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1);
+    fail_unless(result[2] + result[3] < 2);
+    fail_unless(bloomf_add(filter, keys[2000]) == -EROFS);
+    fail_unless(bloomf_add_many(filter, keys + 2000, 2, result) == -EROFS);
+    fail_unless(bloomf_try_add_many(filter, keys + 2000, 2, result) == -EROFS);
+
+    // The frozen filter is reloaded
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter19", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->frozen != NULL);
+    fail_unless(bloomf_contains(filter, keys[1499]) == 1);
+    fail_unless(bloomf_size(filter) == 1502);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Other filters cannot be frozen
+    res = init_bloom_filter(&config, "test_filter20", 0, &filter);
+    fail_unless(res == 0);
+    res = bloomf_freeze(filter);
+    fail_unless(res == -EINVAL);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_compact)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.freezable = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter21", 0, &filter);
+    fail_unless(res == 0);
+
+    // A single layer is already compact
+    res = bloomf_compact(filter);
+    fail_unless(res == 0);
+
+    // Grow to three layers
+    static char bufs[8000][20];
+    char *keys[8000];
+    char result[8000];
+    for (int i=0;i<8000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 3);
+    uint64_t capacity = bloomf_capacity(filter);
+
+    res = bloomf_compact(filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.initial_capacity == capacity);
+    fail_unless(bloomf_size(filter) <= 6000 && bloomf_size(filter) > 5990);
+
+    // One layer with every key, which can still be set
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 1);
+    fail_unless(bloomf_capacity(filter) == capacity);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+    res = bloomf_add_many(filter, keys + 6000, 2000, result);
+    fail_unless(res == 0);
+
+    // The compacted layer is reloaded
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter21", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 1);
+    res = bloomf_contains_many(filter, keys, 8000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<8000;i++) fail_unless(result[i] == 1);
+
+    // Frozen filters can not be compacted
+    res = bloomf_freeze(filter);
+    fail_unless(res == 0);
+    res = bloomf_compact(filter);
+    fail_unless(res == -EEXIST);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Other filters cannot be compacted
+    config.freezable = 0;
+    res = init_bloom_filter(&config, "test_filter22", 0, &filter);
+    fail_unless(res == 0);
+    res = bloomf_compact(filter);
+    fail_unless(res == -EINVAL);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_summary)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.summary_capacity = 20000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter23", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[3000][20];
+    char *keys[3000];
+    char result[3000];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 1500, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->summary != NULL);
+
+    // The summary is reloaded with the layers
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter23", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.summary_capacity == 20000);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(sbf->summary != NULL);
+    fail_unless(sbf_summary_fill(sbf) > 0.005 && sbf_summary_fill(sbf) < 0.01);
+    fail_unless(bloomf_byte_size(filter) == sbf_total_byte_size(sbf));
+
+    res = bloomf_contains_many(filter, keys, 3000, result);
+    fail_unless(res == 0);
+    int found = 0;
+    for (int i=0;i<1500;i++) fail_unless(result[i] == 1);
+    for (int i=1500;i<3000;i++) found += result[i];
+    fail_unless(found < 5);
+
+    // Layers without their summary are used without one
+    char *path = join_path(filter->full_path, "summary.bits");
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(unlink(path) == 0);
+    free(path);
+    res = init_bloom_filter(&config, "test_filter23", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->summary == NULL);
+    fail_unless(bloomf_contains(filter, keys[42]) == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_lock_waits)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    config.in_memory = 1;
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter24", 0, &filter);
+    fail_unless(res == 0);
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.lock_waits == 0);
+    fail_unless(counters.lock_wait_nsec == 0);
+
+    bloomf_record_lock_wait(filter, 1500);
+    bloomf_record_lock_wait(filter, 2500);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.lock_waits == 2);
+    fail_unless(counters.lock_wait_nsec == 4000);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter24") == 0);
+}
+END_TEST
+
+START_TEST(test_filter_meta)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter25", 0, &filter);
+    fail_unless(res == 0);
+
+    filter_meta meta;
+    bloomf_meta(filter, &meta);
+    fail_unless(meta.size == 0);
+    fail_unless(meta.capacity == bloomf_capacity(filter));
+    fail_unless(meta.bytes == bloomf_byte_size(filter));
+
+    // Sets are tracked, and growth refreshes the rest
+    static char bufs[30000][20];
+    char *keys[30000];
+    char result[30000];
+    for (int i=0;i<30000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 30000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_add(filter, keys[0]) == 0);
+    bloomf_meta(filter, &meta);
+    fail_unless(meta.size == bloomf_size(filter));
+    fail_unless(meta.capacity == bloomf_capacity(filter));
+    fail_unless(meta.capacity > 10000);
+    fail_unless(meta.bytes == bloomf_byte_size(filter));
+
+    // The metadata survives closing and reopening
+    uint64_t size = meta.size;
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    bloomf_meta(filter, &meta);
+    fail_unless(meta.size == size);
+    fail_unless(meta.bytes == bloomf_byte_size(filter));
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter25", 1, &filter);
+    fail_unless(res == 0);
+    bloomf_meta(filter, &meta);
+    fail_unless(meta.size == size);
+    fail_unless(meta.capacity == bloomf_capacity(filter));
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_sharded)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 40000;
+    config.shards = 4;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter26", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->keyshards != NULL);
+    fail_unless(filter->keyshards->num == 4);
+    fail_unless(bloomf_capacity(filter) == 40000);
+
+    // Sets never stop to grow, each shard grows on its own
+    static char bufs[50000][20];
+    char *keys[50000];
+    char result[50000];
+    for (int i=0;i<50000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_try_add_many(filter, keys, 40000, result);
+    fail_unless(res == 40000);
+    fail_unless(bloomf_add(filter, keys[40000]) == 1);
+    fail_unless(bloomf_try_add(filter, keys[40001]) == 1);
+    fail_unless(bloomf_add(filter, keys[0]) == 0);
+    fail_unless(bloomf_capacity(filter) > 40000);
+
+    // The keys are spread over every shard
+    uint64_t total = 0;
+    for (int i=0; i < 4; i++) {
+        uint64_t size = bloomf_size(filter->keyshards->shards[i].filter);
+        fail_unless(size > 8000);
+        total += size;
+    }
+    fail_unless(total == bloomf_size(filter));
+    fail_unless(bloomf_size(filter) >= 40000 && bloomf_size(filter) <= 40002);
+
+    res = bloomf_contains_many(filter, keys, 50000, result);
+    fail_unless(res == 0);
+    int found = 0;
+    for (int i=0;i<40002;i++) fail_unless(result[i] == 1);
+    for (int i=40002;i<50000;i++) found += result[i];
+    fail_unless(found < 20);
+    fail_unless(bloomf_contains(filter, keys[1]) == 1);
+
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.check_hits >= 40003);
+    fail_unless(counters.set_hits >= 40000);
+
+    // The shards are reopened with the filter
+    uint64_t size = bloomf_size(filter);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.shards = 0;
+    res = init_bloom_filter(&config, "test_filter26", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.shards == 4);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_contains(filter, keys[42]) == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_read_only)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_mmap = 1;
+
+    bloom_filter *writer = NULL;
+    res = init_bloom_filter(&config, "test_filter28", 0, &writer);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(writer, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_flush(writer) == 0);
+
+    // Unknown filters can not be created read-only
+    bloom_config ro_config = config;
+    ro_config.read_only = 1;
+    bloom_filter *reader = NULL;
+    res = init_bloom_filter(&ro_config, "test_filter29", 1, &reader);
+    fail_unless(res != 0);
+
+    res = init_bloom_filter(&ro_config, "test_filter28", 1, &reader);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(reader) == 1000);
+    fail_unless(bloomf_contains(reader, "foobar42") == 1);
+    fail_unless(bloomf_contains(reader, "later") == 0);
+
+    // Sets of the writer are seen at once, the metadata on refresh
+    fail_unless(bloomf_add(writer, "later") == 1);
+    fail_unless(bloomf_contains(reader, "later") == 1);
+    fail_unless(bloomf_refresh(reader) == 0);
+    fail_unless(bloomf_flush(writer) == 0);
+    fail_unless(bloomf_refresh(reader) == 1);
+    fail_unless(bloomf_size(reader) == 1001);
+    fail_unless(bloomf_refresh(reader) == 0);
+
+    // Nothing is written by the reader
+    fail_unless(bloomf_flush(reader) == 0);
+    fail_unless(bloomf_close(reader) == 0);
+    fail_unless(bloomf_contains(reader, "foobar42") == 1);
+
+    // The filter is gone once the writer drops it
+    res = bloomf_delete(writer);
+    fail_unless(res == 0);
+    fail_unless(bloomf_refresh(reader) == -1);
+
+    res = destroy_bloom_filter(reader);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(writer);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_fill)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter30", 0, &filter);
+    fail_unless(res == 0);
+
+    // The fill is only known once it is flushed
+    bloom_filter_fill fill;
+    fail_unless(bloomf_fill(filter, &fill) == -1);
+
+    static char bufs[5000][20];
+    char *keys[5000];
+    char result[5000];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 5000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_fill(filter, &fill) == -1);
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_fill(filter, &fill) == 0);
+    fail_unless(fill.keys > 4900 && fill.keys < 5100);
+    fail_unless(fill.fp_probability > 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_prepare_layer)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter31", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[20000][20];
+    char *keys[20000];
+    char result[20000];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+
+    // Nothing is prepared until the layer is nearly full
+    res = bloomf_add_many(filter, keys, 5000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_prepare_layer(filter) == 0);
+    fail_unless(filter->spare == NULL);
+
+    res = bloomf_add_many(filter, keys + 5000, 3000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_prepare_layer(filter) == 0);
+    fail_unless(filter->spare != NULL);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter31/spare.layer", F_OK) == 0);
+
+    // The growth renames the spare into place
+    res = bloomf_add_many(filter, keys + 8000, 12000, result);
+    fail_unless(res == 0);
+    fail_unless(filter->spare == NULL);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter31/spare.layer", F_OK) == -1);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter31/data.001.mmap", F_OK) == 0);
+
+    res = bloomf_contains_many(filter, keys, 20000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<20000;i++) {
+        fail_unless(result[i] == 1);
+    }
+
+    // The layers are found again once faulted in
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    res = bloomf_contains_many(filter, keys, 20000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<20000;i++) {
+        fail_unless(result[i] == 1);
+    }
+    fail_unless(bloomf_size(filter) == 20000);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_reset)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_set_log = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter32", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[5000][20];
+    char *keys[5000];
+    char result[5000];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+
+    // Grow a layer, leaving some keys only in the set log
+    res = bloomf_add_many(filter, keys, 4000, result);
+    fail_unless(res == 0);
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    res = bloomf_add_many(filter, keys + 4000, 1000, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 2);
+
+    // The filter starts over from one empty layer
+    res = bloomf_reset(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == 0);
+    fail_unless(bloomf_capacity(filter) == 1000);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 1);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter32/data.001.mmap", F_OK) == -1);
+    res = bloomf_contains_many(filter, keys, 5000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<5000;i++) fail_unless(result[i] == 0);
+    fail_unless(bloomf_add(filter, keys[0]) == 1);
+
+    // The old keys are not replayed when it is loaded again
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter32", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == 1);
+    res = bloomf_contains_many(filter, keys, 5000, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+    for (int i=1;i<5000;i++) fail_unless(result[i] == 0);
+
+    // A proxied filter is reset without faulting it in
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    res = bloomf_reset(filter);
+    fail_unless(res == 0);
+    fail_unless(filter->sbf == NULL);
+    fail_unless(bloomf_size(filter) == 0);
+    fail_unless(bloomf_contains(filter, keys[0]) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Rotating filters expire on their own
+    config.rotate_window = 60;
+    res = init_bloom_filter(&config, "test_filter33", 0, &filter);
+    fail_unless(res == 0);
+    res = bloomf_reset(filter);
+    fail_unless(res == -EINVAL);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_shrink)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter44", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[5000][20];
+    char *keys[5000];
+    char result[5000];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 4000, result);
+    fail_unless(res == 0);
+    uint64_t bytes = bloomf_byte_size(filter);
+
+    // The layer is halved while it has room for the keys twice over
+    uint32_t folds;
+    res = bloomf_shrink(filter, &folds);
+    fail_unless(res == 0);
+    fail_unless(folds == 6);
+    uint32_t shrunk = folds;
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    fail_unless(bloomf_capacity(filter) == 1000000ULL >> folds);
+    fail_unless(bloomf_capacity(filter) >= 8000);
+    fail_unless(bloomf_byte_size(filter) < bytes >> (folds - 1));
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter44/shrink.tmp", F_OK) == -1);
+
+    // Every key is still there, and there is nothing more to fold
+    res = bloomf_contains_many(filter, keys, 4000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<4000;i++) fail_unless(result[i] == 1);
+    fail_unless(bloomf_size(filter) == 4000);
+    res = bloomf_shrink(filter, &folds);
+    fail_unless(res == 0);
+    fail_unless(folds == 0);
+
+    // The folded capacity is kept when it is loaded again
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter44", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_capacity(filter) == 1000000ULL >> shrunk);
+    res = bloomf_contains_many(filter, keys, 5000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<4000;i++) fail_unless(result[i] == 1);
+    res = bloomf_add_many(filter, keys + 4000, 1000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == 5000);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Counting filters can not be folded
+    config.layout = BLOOM_LAYOUT_COUNTING;
+    res = init_bloom_filter(&config, "test_filter44", 0, &filter);
+    fail_unless(res == 0);
+    res = bloomf_shrink(filter, &folds);
+    fail_unless(res == -ENOTSUP);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_detach)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter34", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[1000][20];
+    char *keys[1000];
+    char result[1000];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 1000, result);
+    fail_unless(res == 0);
+
+    // The detached layers were flushed, so the filter can be
+    // faulted in again before they are unmapped
+    bloom_sbf *detached = bloomf_detach(filter);
+    fail_unless(detached != NULL);
+    fail_unless(filter->sbf == NULL);
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    res = bloomf_contains_many(filter, keys, 1000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<1000;i++) fail_unless(result[i] == 1);
+    bloomf_unmap_detached(detached);
+    fail_unless(bloomf_size(filter) == 1000);
+
+    // Nothing is detached from a proxied filter
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_detach(filter) == NULL);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_packed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.pack_layers = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter36", 0, &filter);
+    fail_unless(res == 0);
+
+    // Grow to three layers, which all go in the pack
+    static char bufs[24000][20];
+    static char *keys[24000];
+    static char result[24000];
+    for (int i=0;i<24000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(sbf->num_filters == 3);
+    fail_unless(sbf->filters[0]->map->fileno == sbf->filters[2]->map->fileno);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter36/data.pack", F_OK) == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter36/data.000.mmap", F_OK) == -1);
+
+    // The layers are faulted back in from the pack
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 3);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // The filter stays packed without pack_layers
+    config.pack_layers = 0;
+    res = init_bloom_filter(&config, "test_filter36", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) <= 6000 && bloomf_size(filter) > 5990);
+    res = bloomf_add_many(filter, keys + 6000, 18000, result);
+    fail_unless(res == 0);
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 4);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter36/data.003.mmap", F_OK) == -1);
+    res = bloomf_contains_many(filter, keys, 24000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<24000;i++) fail_unless(result[i] == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_tiered)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.tier_layers = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter37", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[8000][20];
+    static char *keys[8000];
+    static char result[8000];
+    for (int i=0;i<8000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(sbf->num_filters == 3);
+    fail_unless(sbf->filters[2]->map->mode == PERSISTENT);
+
+    // The older layers move onto the page cache once
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_tier_layers(filter) == 2);
+    fail_unless(bloomf_tier_layers(filter) == 0);
+    fail_unless(sbf->filters[0]->map->mode == PERSISTENT);
+    fail_unless(sbf->filters[1]->map->mode == SHARED);
+    fail_unless(sbf->filters[2]->map->mode == SHARED);
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+
+    // Sets still go to the newest layer
+    res = bloomf_add_many(filter, keys + 6000, 2000, result);
+    fail_unless(res == 0);
+    fail_unless(sbf->num_filters == 3);
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+
+    // Loading maps the older layers directly
+    res = bloomf_contains_many(filter, keys, 8000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<8000;i++) fail_unless(result[i] == 1);
+    sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(sbf->filters[0]->map->mode == PERSISTENT);
+    fail_unless(sbf->filters[1]->map->mode == SHARED);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_sealed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.seal_layers = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter38", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[8000][20];
+    static char *keys[8000];
+    static char result[8000];
+    for (int i=0;i<8000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(sbf->num_filters == 3);
+
+    // Only the older layers are sealed
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_seal_layers(filter) == 2);
+    fail_unless(bloomf_seal_layers(filter) == 0);
+    fail_unless(!sbf->filters[0]->map->sealed);
+    fail_unless(sbf->filters[1]->map->sealed);
+    fail_unless(sbf->filters[2]->map->dirty_pages == NULL);
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+
+    res = bloomf_add_many(filter, keys + 6000, 1000, result);
+    fail_unless(res == 0);
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+
+    // Merging unseals the layers it changes
+    bloom_filter *other = NULL;
+    res = init_bloom_filter(&config, "test_filter38b", 0, &other);
+    fail_unless(res == 0);
+    res = bloomf_add_many(other, keys + 7000, 500, result);
+    fail_unless(res == 0);
+    res = bloomf_merge(filter, other, 0);
+    fail_unless(res == 0);
+    fail_unless(!sbf->filters[2]->map->sealed);
+    res = bloomf_delete(other);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(other);
+    fail_unless(res == 0);
+
+    // Loading seals the older layers directly
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    res = bloomf_contains_many(filter, keys, 7500, result);
+    fail_unless(res == 0);
+    for (int i=0;i<7500;i++) fail_unless(result[i] == 1);
+    sbf = (bloom_sbf*)filter->sbf;
+    fail_unless(!sbf->filters[0]->map->sealed);
+    fail_unless(sbf->filters[1]->map->sealed);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_write_commit)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_set_log = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter35", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[1000][20];
+    char *keys[1000];
+    char result[1000];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 1000, result);
+    fail_unless(res == 0);
+
+    // The write keeps the rotated log until it is committed
+    res = bloomf_write(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_is_dirty(filter) == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter35/set.log.old", F_OK) == 0);
+    res = bloomf_commit(filter);
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter35/set.log.old", F_OK) == -1);
+
+    // The keys are in the data files
+    bloom_filter *filter2 = NULL;
+    res = init_bloom_filter(&config, "test_filter35", 1, &filter2);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter2) == 1000);
+    res = bloomf_contains_many(filter2, keys, 1000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<1000;i++) fail_unless(result[i] == 1);
+
+    res = destroy_bloom_filter(filter2);
+    fail_unless(res == 0);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_page_checksums)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.page_checksums = 1;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter40", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[6000][20];
+    static char *keys[6000];
+    static char result[6000];
+    for (int i=0;i<6000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    res = bloomf_flush(filter);
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter40/data.001.mmap.crc", F_OK) == 0);
+
+    // A scrub is done in steps, then starts over
+    int64_t pages = bloomf_scrub(filter, 1 << 20);
+    fail_unless(pages > 2);
+    fail_unless(bloomf_scrub(filter, 2) == 2);
+    fail_unless(bloomf_scrub(filter, 1 << 20) == pages - 2);
+    filter_counters counters;
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.checksum_errors == 0);
+
+    // Damage a layer while the filter is closed
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    int fd = open("/tmp/bloomd/bloomd.test_filter40/data.001.mmap", O_RDWR);
+    fail_unless(fd >= 0);
+    unsigned char c;
+    fail_unless(pread(fd, &c, 1, 4096 + 7) == 1);
+    c ^= 0x10;
+    fail_unless(pwrite(fd, &c, 1, 4096 + 7) == 1);
+    close(fd);
+
+    res = bloomf_contains_many(filter, keys, 10, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_scrub(filter, 1 << 20) == pages);
+    bloomf_counters(filter, &counters);
+    fail_unless(counters.checksum_errors == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter40/data.001.mmap.crc", F_OK) == -1);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_quotient)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.layout = BLOOM_LAYOUT_QUOTIENT;
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter41", 0, &filter);
+    fail_unless(res == 0);
+
+    static char bufs[8000][20];
+    static char *keys[8000];
+    static char result[8000];
+    for (int i=0;i<8000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+
+    // The filter is resized in place as it fills
+    res = bloomf_contains_many(filter, keys, 1, result);
+    fail_unless(res == 0);
+    uint64_t initial = bloomf_capacity(filter);
+    fail_unless(initial >= 1000);
+    res = bloomf_add_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    fail_unless(bloomf_capacity(filter) > initial);
+    fail_unless(bloomf_capacity(filter) >= 6000);
+    fail_unless(bloomf_size(filter) > 5990);
+    fail_unless(filter->sbf == NULL);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter41/quotient.qf", F_OK) == 0);
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+    fail_unless(access("/tmp/bloomd/bloomd.test_filter41/quotient.qf.tmp", F_OK) == -1);
+
+    // The keys persist once it is closed
+    uint64_t size = bloomf_size(filter);
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    res = bloomf_contains_many(filter, keys, 6000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<6000;i++) fail_unless(result[i] == 1);
+    fail_unless(bloomf_size(filter) == size);
+
+    // Quotient filters only merge with each other
+    bloom_filter *other = NULL;
+    res = init_bloom_filter(&config, "test_filter41b", 0, &other);
+    fail_unless(res == 0);
+    res = bloomf_add_many(other, keys + 6000, 2000, result);
+    fail_unless(res == 0);
+    res = bloomf_merge(filter, other, 0);
+    fail_unless(res == 0);
+    res = bloomf_contains_many(filter, keys, 8000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<8000;i++) fail_unless(result[i] == 1);
+    fail_unless(bloomf_size(filter) > 7980);
+
+    bloom_config plain;
+    res = config_from_filename(NULL, &plain);
+    fail_unless(res == 0);
+    bloom_filter *bloom = NULL;
+    res = init_bloom_filter(&plain, "test_filter41c", 0, &bloom);
+    fail_unless(res == 0);
+    fail_unless(bloomf_merge(filter, bloom, 0) == -EINVAL);
+    fail_unless(bloomf_merge(bloom, filter, 0) == -EINVAL);
+
+    // A reset starts over from the initial capacity
+    res = bloomf_reset(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == 0);
+    fail_unless(bloomf_capacity(filter) == initial);
+    res = bloomf_contains_many(filter, keys, 100, result);
+    fail_unless(res == 0);
+    for (int i=0;i<100;i++) fail_unless(result[i] == 0);
+
+    res = bloomf_delete(bloom);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(bloom);
+    fail_unless(res == 0);
+    res = bloomf_delete(other);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(other);
+    fail_unless(res == 0);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_residency)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter42", 0, &filter);
+    fail_unless(res == 0);
+
+    // Nothing is known before the first scan
+    filter_residency residency;
+    bloomf_residency(filter, &residency);
+    fail_unless(residency.scanned == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+
+    // The pages that were set are resident
+    fail_unless(bloomf_scan_residency(filter) == 0);
+    bloomf_residency(filter, &residency);
+    fail_unless(residency.scanned > 0);
+    fail_unless(residency.num_layers == 1);
+    fail_unless(residency.mapped == bloomf_byte_size(filter));
+    fail_unless(residency.resident > 0);
+    fail_unless(residency.resident <= residency.mapped);
+    fail_unless(residency.layers[0] == residency.resident);
+
+    // A proxied filter has nothing resident
+    res = bloomf_close(filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_scan_residency(filter) == 0);
+    bloomf_residency(filter, &residency);
+    fail_unless(residency.resident == 0);
+    fail_unless(residency.mapped == 0);
+    fail_unless(residency.num_layers == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_set_log_binary_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_set_log = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter45", 0, &filter);
+    fail_unless(res == 0);
+
+    // Keys holding a newline or a zero byte are logged whole
+    char *keys[] = {"a\nb", "x\0y", "a", "b", "x"};
+    int key_lens[] = {3, 3, 1, 1, 1};
+    char result[5];
+    res = bloomf_add_many_len(filter, keys, key_lens, 2, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1);
+
+    // Logs written with a key per line still replay
+    int fd = open("/tmp/bloomd/bloomd.test_filter45/set.log", O_WRONLY | O_APPEND);
+    fail_unless(fd >= 0);
+    fail_unless(write(fd, "legacy1\nlegacy2\n", 16) == 16);
+    close(fd);
+
+    bloom_filter *filter2 = NULL;
+    res = init_bloom_filter(&config, "test_filter45", 1, &filter2);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter2) == 4);
+    res = bloomf_contains_many_len(filter2, keys, key_lens, 5, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1);
+    fail_unless(result[2] == 0 && result[3] == 0 && result[4] == 0);
+    fail_unless(bloomf_contains(filter2, "legacy2") == 1);
+
+    res = destroy_bloom_filter(filter2);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    delete_dir("/tmp/bloomd/bloomd.test_filter45");
+}
+END_TEST
@@ -382,7 +382,7 @@ START_TEST(test_mgr_unmap_add_keys)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.zab5/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.zab5/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.zab5/data.000.mmap", 0777) == 0);
 
     // Try to add keys now
@@ -507,7 +507,7 @@ START_TEST(test_mgr_clear_reload)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.zab9/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.zab9/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.zab9/data.000.mmap", 0777) == 0);
 
     res = filtmgr_clear_filter(mgr, "zab9");
@@ -753,7 +753,7 @@ START_TEST(test_mgr_restore)
 
     // FUCKING annoying umask permissions bullshit
     // Cused by the Check test framework
-    fail_unless(chmod("/tmp/bloomd/bloomd.zab8/config.ini", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.zab8/config.bin", 0777) == 0);
     fail_unless(chmod("/tmp/bloomd/bloomd.zab8/data.000.mmap", 0777) == 0);
 
     // Restrore
@@ -809,3 +809,1704 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+typedef struct {
+    bloom_filtmgr *mgr;
+    char **keys;
+    int num_keys;
+    int found;
+} test_mgr_check_args;
+
+static void* test_mgr_check_thread(void *in) {
+    test_mgr_check_args *args = in;
+    char *result = calloc(args->num_keys, sizeof(char));
+    for (int iter=0; iter < 10; iter++) {
+        int res = filtmgr_check_keys(args->mgr, "zab9", args->keys, args->num_keys, result);
+        if (res) break;
+        for (int i=0; i < args->num_keys; i++) {
+            args->found += result[i];
+        }
+    }
+    free(result);
+    return NULL;
+}
+
+START_TEST(test_mgr_concurrent_check_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab9", NULL);
+    fail_unless(res == 0);
+
+    char *keys[1000];
+    char result[1000];
+    for (int i=0; i < 1000; i++) {
+        res = asprintf(&keys[i], "key%d", i);
+        fail_unless(res != -1);
+    }
+    res = filtmgr_set_keys(mgr, "zab9", (char**)&keys, 1000, (char*)&result);
+    fail_unless(res == 0);
+
+    // Unmap so that the readers race to fault the filter in
+    res = filtmgr_unmap_filter(mgr, "zab9");
+    fail_unless(res == 0);
+
+    // FUCKING annoying umask permissions bullshit
+    // Cused by the Check test framework
+    fail_unless(chmod("/tmp/bloomd/bloomd.zab9/config.bin", 0777) == 0);
+    fail_unless(chmod("/tmp/bloomd/bloomd.zab9/data.000.mmap", 0777) == 0);
+
+    pthread_t threads[4];
+    test_mgr_check_args args[4];
+    for (int i=0; i < 4; i++) {
+        args[i].mgr = mgr;
+        args[i].keys = (char**)&keys;
+        args[i].num_keys = 1000;
+        args[i].found = 0;
+        fail_unless(pthread_create(&threads[i], NULL, test_mgr_check_thread, &args[i]) == 0);
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        fail_unless(args[i].found == 10000);
+    }
+
+    for (int i=0; i < 1000; i++) free(keys[i]);
+
+    res = filtmgr_drop_filter(mgr, "zab9");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* test_mgr_set_thread(void *in) {
+    test_mgr_check_args *args = in;
+    char *result = calloc(args->num_keys, sizeof(char));
+    int res = filtmgr_set_keys(args->mgr, "zab10", args->keys, args->num_keys, result);
+    if (!res) {
+        for (int i=0; i < args->num_keys; i++) {
+            args->found += result[i];
+        }
+    }
+    free(result);
+    return NULL;
+}
+
+START_TEST(test_mgr_concurrent_set_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 10000;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+
+    // Each thread sets distinct keys, forcing the filter to grow
+    char *keys[4][10000];
+    pthread_t threads[4];
+    test_mgr_check_args args[4];
+    for (int i=0; i < 4; i++) {
+        for (int j=0; j < 10000; j++) {
+            res = asprintf(&keys[i][j], "thread%d_key%d", i, j);
+            fail_unless(res != -1);
+        }
+        args[i].mgr = mgr;
+        args[i].keys = (char**)&keys[i];
+        args[i].num_keys = 10000;
+        args[i].found = 0;
+        fail_unless(pthread_create(&threads[i], NULL, test_mgr_set_thread, &args[i]) == 0);
+    }
+    int added = 0;
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        added += args[i].found;
+    }
+
+    // Most keys should be new, allowing for false positives
+    fail_unless(added > 39900);
+
+    // Every key must be present
+    char result[10000];
+    for (int i=0; i < 4; i++) {
+        res = filtmgr_check_keys(mgr, "zab10", (char**)&keys[i], 10000, (char*)&result);
+        fail_unless(res == 0);
+        for (int j=0; j < 10000; j++) {
+            fail_unless(result[j] == 1);
+            free(keys[i][j]);
+        }
+    }
+
+    res = filtmgr_drop_filter(mgr, "zab10");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* test_mgr_set_small_thread(void *in) {
+    test_mgr_check_args *args = in;
+    char result[10];
+    for (int i=0; i < args->num_keys; i += 10) {
+        if (filtmgr_set_keys(args->mgr, "zab10q", args->keys + i, 10, result)) return NULL;
+        for (int j=0; j < 10; j++) args->found += result[j];
+    }
+    return NULL;
+}
+
+START_TEST(test_mgr_concurrent_set_combined)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 10000;
+    config.layout = BLOOM_LAYOUT_QUOTIENT;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab10q", NULL);
+    fail_unless(res == 0);
+
+    // Every set of a quotient filter takes the write lock, so the
+    // small batches of the threads are combined, and it resizes
+    char *keys[4][10000];
+    pthread_t threads[4];
+    test_mgr_check_args args[4];
+    for (int i=0; i < 4; i++) {
+        for (int j=0; j < 10000; j++) {
+            res = asprintf(&keys[i][j], "thread%d_key%d", i, j);
+            fail_unless(res != -1);
+        }
+        args[i].mgr = mgr;
+        args[i].keys = (char**)&keys[i];
+        args[i].num_keys = 10000;
+        args[i].found = 0;
+        fail_unless(pthread_create(&threads[i], NULL, test_mgr_set_small_thread, &args[i]) == 0);
+    }
+    int added = 0;
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        added += args[i].found;
+    }
+    fail_unless(added > 39900);
+
+    // Every key must be present, and be reported once
+    char result[10000];
+    for (int i=0; i < 4; i++) {
+        res = filtmgr_check_keys(mgr, "zab10q", (char**)&keys[i], 10000, (char*)&result);
+        fail_unless(res == 0);
+        for (int j=0; j < 10000; j++) fail_unless(result[j] == 1);
+        res = filtmgr_set_keys(mgr, "zab10q", (char**)&keys[i], 10000, (char*)&result);
+        fail_unless(res == 0);
+        for (int j=0; j < 10000; j++) {
+            fail_unless(result[j] == 0);
+            free(keys[i][j]);
+        }
+    }
+
+    res = filtmgr_drop_filter(mgr, "zab10q");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+
+START_TEST(test_mgr_handle)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_filter_handle *handle;
+    res = filtmgr_open_handle(mgr, "zab11", &handle);
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab11", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_open_handle(mgr, "zab11", &handle);
+    fail_unless(res == 0);
+
+    // Set through the handle, check by name
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys_handle(mgr, handle, (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    res = filtmgr_check_keys(mgr, "zab11", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    // The handle is invalid once dropped
+    res = filtmgr_drop_filter(mgr, "zab11");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys_handle(mgr, handle, (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -1);
+
+    // The handle keeps the filter alive through the vacuum
+    filtmgr_vacuum(mgr);
+    struct stat buf;
+    fail_unless(stat("/tmp/bloomd/bloomd.zab11", &buf) == 0);
+
+    // Releasing the last reference deletes it
+    filtmgr_release_handle(mgr, handle);
+    fail_unless(stat("/tmp/bloomd/bloomd.zab11", &buf) == -1);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_snapshot)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_snapshot_filter(mgr, "zab12");
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab12", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab12", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Snapshot twice, replacing the first one
+    res = filtmgr_snapshot_filter(mgr, "zab12");
+    fail_unless(res == 0);
+    res = filtmgr_snapshot_filter(mgr, "zab12");
+    fail_unless(res == 0);
+
+    // Sets after the snapshot are not in it
+    char *later[] = {"later"};
+    res = filtmgr_set_keys(mgr, "zab12", (char**)&later, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    // The snapshot loads like a regular data dir
+    bloom_config snap_config = config;
+    snap_config.data_dir = "/tmp/bloomd/snapshots";
+    bloom_filter *snap = NULL;
+    res = init_bloom_filter(&snap_config, "zab12", 1, &snap);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(snap) == 3);
+    res = bloomf_contains_many(snap, (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    fail_unless(bloomf_contains(snap, "later") == 0);
+    destroy_bloom_filter(snap);
+    fail_unless(delete_dir("/tmp/bloomd/snapshots/bloomd.zab12") == 3);
+    rmdir("/tmp/bloomd/snapshots");
+
+    res = filtmgr_drop_filter(mgr, "zab12");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_unmap_compress)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.compress_cold = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab13", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab13", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Unmapping compresses the layer
+    res = filtmgr_unmap_filter(mgr, "zab13");
+    fail_unless(res == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.zab13/data.000.cmp", F_OK) == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.zab13/data.000.mmap", F_OK) == -1);
+
+    // Faulting in expands it again
+    res = filtmgr_check_keys(mgr, "zab13", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    fail_unless(access("/tmp/bloomd/bloomd.zab13/data.000.mmap", F_OK) == 0);
+    fail_unless(access("/tmp/bloomd/bloomd.zab13/data.000.cmp", F_OK) == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab13");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_restore_many)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.load_threads = 3;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char name[32];
+    char *keys[] = {name};
+    char result[] = {0};
+    for (int i=0; i < 20; i++) {
+        snprintf(name, sizeof(name), "zab14_%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == 0);
+        res = filtmgr_set_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // Every filter is restored by the loader threads
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    for (int i=0; i < 20; i++) {
+        snprintf(name, sizeof(name), "zab14_%d", i);
+        result[0] = 0;
+        res = filtmgr_check_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+        fail_unless(result[0]);
+        res = filtmgr_drop_filter(mgr, name);
+        fail_unless(res == 0);
+    }
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void proxied_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(int*)data = bloomf_is_proxied(filter);
+}
+
+START_TEST(test_mgr_warm)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_warm_filter(mgr, "zab15");
+    fail_unless(res == -1);
+
+    res = filtmgr_create_filter(mgr, "zab15", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    // Record an access in hour 3
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    res = filtmgr_set_keys(mgr, "zab15", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    bloom_filter_list_head *head;
+    res = filtmgr_list_warm_filters(mgr, 3, -1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    res = filtmgr_unmap_filter(mgr, "zab15");
+    fail_unless(res == 0);
+
+    // Only listed ahead of an hour it was used in
+    res = filtmgr_list_warm_filters(mgr, 1, 2, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+    res = filtmgr_list_warm_filters(mgr, 2, 3, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "zab15") == 0);
+    filtmgr_cleanup_list(head);
+
+    // Warming faults it in
+    int proxied = 0;
+    filtmgr_filter_cb(mgr, "zab15", proxied_cb, &proxied);
+    fail_unless(proxied == 1);
+    res = filtmgr_warm_filter(mgr, "zab15");
+    fail_unless(res == 0);
+    filtmgr_filter_cb(mgr, "zab15", proxied_cb, &proxied);
+    fail_unless(proxied == 0);
+
+    // Entering hour 3 again forgets the access a day ago
+    res = filtmgr_unmap_filter(mgr, "zab15");
+    fail_unless(res == 0);
+    res = filtmgr_list_warm_filters(mgr, 3, -1, &head);
+    filtmgr_cleanup_list(head);
+    res = filtmgr_list_warm_filters(mgr, 2, 3, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    res = filtmgr_drop_filter(mgr, "zab15");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_evict_order)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *names[] = {"zab16a", "zab16b", "zab16c"};
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_create_filter(mgr, names[i], NULL);
+        fail_unless(res == 0);
+    }
+    filtmgr_vacuum(mgr);
+
+    // Use a and c in the first tick, b and c in the second
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    bloom_filter_list_head *head;
+    filtmgr_set_keys(mgr, "zab16a", (char**)&keys, 1, (char*)&result);
+    filtmgr_set_keys(mgr, "zab16c", (char**)&keys, 1, (char*)&result);
+    res = filtmgr_list_evict_filters(mgr, 1ULL << 40, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+    filtmgr_set_keys(mgr, "zab16b", (char**)&keys, 1, (char*)&result);
+    filtmgr_set_keys(mgr, "zab16c", (char**)&keys, 1, (char*)&result);
+    res = filtmgr_list_evict_filters(mgr, 1ULL << 40, &head);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    // The least recent infrequent filter goes first, the frequent one last
+    res = filtmgr_list_evict_filters(mgr, 1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 3);
+    fail_unless(strcmp(head->head->filter_name, "zab16a") == 0);
+    fail_unless(strcmp(head->head->next->filter_name, "zab16b") == 0);
+    fail_unless(strcmp(head->head->next->next->filter_name, "zab16c") == 0);
+    filtmgr_cleanup_list(head);
+
+    // Proxied filters use no memory
+    res = filtmgr_unmap_filter(mgr, "zab16a");
+    fail_unless(res == 0);
+    res = filtmgr_list_evict_filters(mgr, 1, &head);
+    fail_unless(head->size == 2);
+    filtmgr_cleanup_list(head);
+
+    for (int i=0; i < 3; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void pinned_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(int*)data = filter->filter_config.pinned;
+}
+
+START_TEST(test_mgr_pinned)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->pinned = 1;
+    res = filtmgr_create_filter(mgr, "zab92", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab93", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    // Only the plain filter goes cold
+    bloom_filter_list_head *head;
+    res = filtmgr_list_cold_filters(mgr, &head);
+    fail_unless(res == 0);
+    filtmgr_cleanup_list(head);
+    res = filtmgr_list_cold_filters(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "zab93") == 0);
+    filtmgr_cleanup_list(head);
+
+    // Or is evicted, though both are over the budget
+    res = filtmgr_list_evict_filters(mgr, 1ULL << 40, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+    res = filtmgr_list_evict_filters(mgr, 1, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "zab93") == 0);
+    filtmgr_cleanup_list(head);
+
+    // The locked pages are not hinted for reclaim
+    uint64_t bytes = 1;
+    res = filtmgr_reclaim_filter(mgr, "zab92", 1, &bytes);
+    fail_unless(res == 0);
+    fail_unless(bytes == 0);
+
+    // The filter stays pinned after a restart
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+    res = init_filter_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    int pinned = 0;
+    res = filtmgr_filter_cb(mgr, "zab92", pinned_cb, &pinned);
+    fail_unless(res == 0);
+    fail_unless(pinned == 1);
+    res = filtmgr_filter_cb(mgr, "zab93", pinned_cb, &pinned);
+    fail_unless(res == 0);
+    fail_unless(pinned == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab92");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab93");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+/**
+ * Polls the cold list until the filter is in the
+ * primary map, checkpointing like a worker would.
+ * The first listing clears the hot flag, so the filter
+ * is listed from the second time it is seen.
+ * @return The number of polls, or -1 on timeout.
+ */
+static int wait_primary_filter(bloom_filtmgr *mgr, char *filter_name) {
+    for (int i=0; i < 1000; i++) {
+        filtmgr_client_checkpoint(mgr);
+        bloom_filter_list_head *head;
+        filtmgr_list_cold_filters(mgr, &head);
+        int found = 0;
+        for (bloom_filter_list *node=head->head; node; node=node->next) {
+            if (strcmp(node->filter_name, filter_name) == 0) found = 1;
+        }
+        filtmgr_cleanup_list(head);
+        if (found) return i;
+        filtmgr_client_offline(mgr);
+        usleep(1000);
+    }
+    return -1;
+}
+
+START_TEST(test_mgr_vacuum_wakeup)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+    filtmgr_client_checkpoint(mgr);
+
+    // The vacuum thread should apply the create right away,
+    // instead of on its next poll
+    res = filtmgr_create_filter(mgr, "zab17", NULL);
+    fail_unless(res == 0);
+    res = wait_primary_filter(mgr, "zab17");
+    fail_unless(res >= 0 && res < 500);
+
+    // Once the drop is applied to both maps we can create again
+    res = filtmgr_drop_filter(mgr, "zab17");
+    fail_unless(res == 0);
+    for (int i=0; i < 1000; i++) {
+        filtmgr_client_checkpoint(mgr);
+        res = filtmgr_create_filter(mgr, "zab17", NULL);
+        if (res != -1 && res != -3) break;
+        filtmgr_client_offline(mgr);
+        usleep(1000);
+    }
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab17");
+    fail_unless(res == 0);
+    filtmgr_client_leave(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_delta_index)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Pending creates are found through the delta index
+    char name[32];
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    for (int i=0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "zab18_%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == 0);
+    }
+    for (int i=0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "zab18_%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == -1);
+        res = filtmgr_set_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+    res = filtmgr_check_keys(mgr, "zab18_1000", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    // A pending drop hides the pending create
+    res = filtmgr_drop_filter(mgr, "zab18_7");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab18_7", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+    res = filtmgr_create_filter(mgr, "zab18_7", NULL);
+    fail_unless(res == -3);
+
+    // Once merged, the filters are found in the map
+    filtmgr_vacuum(mgr);
+    res = filtmgr_create_filter(mgr, "zab18_2000", NULL);
+    fail_unless(res == 0);
+    for (int i=0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "zab18_%d", i);
+        res = filtmgr_check_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+        fail_unless(res == ((i == 7) ? -1 : 0));
+        if (!res) fail_unless(result[0] == 1);
+    }
+    res = filtmgr_check_keys(mgr, "zab18_2000", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    for (int i=0; i < 1000; i++) {
+        if (i == 7) continue;
+        snprintf(name, sizeof(name), "zab18_%d", i);
+        res = filtmgr_drop_filter(mgr, name);
+        fail_unless(res == 0);
+    }
+    res = filtmgr_drop_filter(mgr, "zab18_2000");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_create_drop_multi)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Duplicates within the batch are found
+    char *names[] = {"zab19a", "zab19b", "zab19a", "zab19c"};
+    int results[4];
+    res = filtmgr_create_filters(mgr, names, 4, NULL, results);
+    fail_unless(res == 3);
+    fail_unless(results[0] == 0 && results[1] == 0 && results[2] == -1 && results[3] == 0);
+
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    for (int i=0; i < 4; i++) {
+        res = filtmgr_set_keys(mgr, names[i], (char**)&keys, 1, (char*)&result);
+        fail_unless(res == 0);
+    }
+
+    // Custom configs are copied for each filter
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->initial_capacity = 20000;
+    char *more[] = {"zab19d", "zab19e"};
+    res = filtmgr_create_filters(mgr, more, 2, custom, results);
+    fail_unless(res == 2);
+    free(custom);
+
+    filtmgr_vacuum(mgr);
+    res = filtmgr_create_filters(mgr, names, 1, NULL, results);
+    fail_unless(res == 0 && results[0] == -1);
+
+    // Drop several, including a missing one and a repeat
+    char *drops[] = {"zab19a", "zab19x", "zab19d", "zab19a"};
+    res = filtmgr_drop_filters(mgr, drops, 4, results);
+    fail_unless(res == 2);
+    fail_unless(results[0] == 0 && results[1] == -1 && results[2] == 0 && results[3] == -1);
+    res = filtmgr_check_keys(mgr, "zab19a", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    // Pending deletes block creates until vacuumed
+    res = filtmgr_create_filters(mgr, drops, 1, NULL, results);
+    fail_unless(res == 0 && results[0] == -3);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_check_keys(mgr, "zab19b", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = filtmgr_check_keys(mgr, "zab19e", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 0);
+
+    char *rest[] = {"zab19b", "zab19c", "zab19e"};
+    res = filtmgr_drop_filters(mgr, rest, 3, results);
+    fail_unless(res == 3);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_rotate_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->rotate_window = 60;
+    custom->rotate_generations = 2;
+    res = filtmgr_create_filter(mgr, "zab20", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab20x", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey"};
+    char result[] = {0};
+    res = filtmgr_set_keys(mgr, "zab20", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+
+    // Only the rotating filter is listed, once its window passed
+    uint64_t now = time(NULL);
+    bloom_filter_list_head *head;
+    res = filtmgr_list_rotate_filters(mgr, now, &head);
+    fail_unless(res == 0 && head->size == 0);
+    filtmgr_cleanup_list(head);
+    res = filtmgr_list_rotate_filters(mgr, now + 60, &head);
+    fail_unless(res == 0 && head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "zab20") == 0);
+    filtmgr_cleanup_list(head);
+
+    // The key is kept for the live generations
+    res = filtmgr_rotate_filter(mgr, "zab20", now + 60);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab20", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = filtmgr_rotate_filter(mgr, "zab20", now + 120);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab20", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 0);
+
+    // Rotating filters cannot be snapshot
+    res = filtmgr_snapshot_filter(mgr, "zab20");
+    fail_unless(res == -6);
+    res = filtmgr_rotate_filter(mgr, "zab20y", now);
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab20");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab20x");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_delete_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->layout = BLOOM_LAYOUT_COUNTING;
+    res = filtmgr_create_filter(mgr, "zab21", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab21x", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab21", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // Only the keys that were set are deleted
+    res = filtmgr_delete_keys(mgr, "zab21", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+    res = filtmgr_check_keys(mgr, "zab21", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 0 && result[2] == 0);
+
+    // Through a handle as well
+    bloom_filter_handle *handle;
+    res = filtmgr_open_handle(mgr, "zab21", &handle);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys_handle(mgr, handle, (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = filtmgr_delete_keys_handle(mgr, handle, (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    filtmgr_release_handle(mgr, handle);
+
+    // Other layouts and missing filters
+    res = filtmgr_delete_keys(mgr, "zab21x", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -3);
+    res = filtmgr_delete_keys(mgr, "zab21y", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab21");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab21x");
+    fail_unless(res == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_freeze_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->freezable = 1;
+    res = filtmgr_create_filter(mgr, "zab22", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab22x", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab22", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_freeze_filter(mgr, "zab22");
+    fail_unless(res == 0);
+    res = filtmgr_freeze_filter(mgr, "zab22");
+    fail_unless(res == -7);
+    res = filtmgr_check_keys(mgr, "zab22", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    // Frozen filters can not be set or snapshot
+    res = filtmgr_set_keys(mgr, "zab22", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -4);
+    res = filtmgr_snapshot_filter(mgr, "zab22");
+    fail_unless(res == -7);
+
+    // Other filters and missing filters
+    res = filtmgr_freeze_filter(mgr, "zab22x");
+    fail_unless(res == -8);
+    res = filtmgr_freeze_filter(mgr, "zab22y");
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab22");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab22x");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_compact_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->freezable = 1;
+    res = filtmgr_create_filter(mgr, "zab23", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab23x", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab23", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_compact_filter(mgr, "zab23");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab23", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    // Frozen, other and missing filters
+    res = filtmgr_freeze_filter(mgr, "zab23");
+    fail_unless(res == 0);
+    res = filtmgr_compact_filter(mgr, "zab23");
+    fail_unless(res == -7);
+    res = filtmgr_compact_filter(mgr, "zab23x");
+    fail_unless(res == -8);
+    res = filtmgr_compact_filter(mgr, "zab23y");
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab23");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab23x");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_positive_cache)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.positive_cache = 1024;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab90", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab90", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // The second check is answered from the cache
+    for (int i=0; i < 2; i++) {
+        res = filtmgr_check_keys(mgr, "zab90", (char**)&keys, 3, (char*)&result);
+        fail_unless(res == 0);
+        fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+    }
+    bloom_hashed_key hashed[3];
+    for (int i=0; i < 3; i++) bf_hashed_key_init(hashed + i, keys[i]);
+    res = filtmgr_check_hashed(mgr, "zab90", hashed, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    // A reset forgets the cached keys
+    res = filtmgr_reset_filter(mgr, "zab90");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab90", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 0 && result[2] == 0);
+
+    // So does dropping and creating the filter again
+    res = filtmgr_set_keys(mgr, "zab90", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab90", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = filtmgr_drop_filter(mgr, "zab90");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_create_filter(mgr, "zab90", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_check_keys(mgr, "zab90", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 0);
+
+    // Keys deleted from counting filters are never cached
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->layout = BLOOM_LAYOUT_COUNTING;
+    res = filtmgr_create_filter(mgr, "zab91", custom);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_set_keys(mgr, "zab91", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab91", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 1);
+    res = filtmgr_delete_keys(mgr, "zab91", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab91", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0 && result[0] == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab90");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab91");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_reset_filter)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab37", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab37", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // The filter is emptied, and still exists
+    res = filtmgr_reset_filter(mgr, "zab37");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab37", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 0 && result[2] == 0);
+    res = filtmgr_set_keys(mgr, "zab37", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+
+    // Frozen and missing filters
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->freezable = 1;
+    res = filtmgr_create_filter(mgr, "zab38", custom);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_freeze_filter(mgr, "zab38");
+    fail_unless(res == 0);
+    res = filtmgr_reset_filter(mgr, "zab38");
+    fail_unless(res == -7);
+    res = filtmgr_reset_filter(mgr, "zab39");
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab37");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab38");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_fault_retry)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.fault_retry = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab40", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    filtmgr_warm_filter(mgr, "zab40");
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab40", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    // A filter that is not in memory is queued, and not faulted in
+    res = filtmgr_unmap_filter(mgr, "zab40");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab40", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -6);
+    res = filtmgr_set_keys(mgr, "zab40", (char**)&keys + 2, 1, (char*)&result);
+    fail_unless(res == -6);
+    fail_unless(filtmgr_wait_faults(mgr, 0) == 1);
+
+    // Once faulted in, the commands succeed
+    fail_unless(filtmgr_run_faults(mgr) == 1);
+    fail_unless(filtmgr_wait_faults(mgr, 0) == 0);
+    res = filtmgr_check_keys(mgr, "zab40", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab40");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void fault_hook_count(void *arg) {
+    (*(int*)arg)++;
+}
+
+START_TEST(test_mgr_queue_fault)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.fault_retry = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    int woken = 0;
+    filtmgr_set_fault_hook(mgr, fault_hook_count, &woken);
+
+    res = filtmgr_create_filter(mgr, "zab41", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    // Filters in memory, or that do not exist, can be used
+    fail_unless(filtmgr_queue_fault(mgr, "zab41") == 0);
+    fail_unless(filtmgr_queue_fault(mgr, "noexist") == 0);
+
+    // A filter that is not in memory is queued once
+    res = filtmgr_unmap_filter(mgr, "zab41");
+    fail_unless(res == 0);
+    fail_unless(filtmgr_queue_fault(mgr, "zab41") == 1);
+    fail_unless(filtmgr_queue_fault(mgr, "zab41") == 1);
+    fail_unless(filtmgr_wait_faults(mgr, 0) == 1);
+
+    // The hook is invoked once the queue is faulted in
+    fail_unless(filtmgr_run_faults(mgr) == 1);
+    fail_unless(woken == 1);
+    fail_unless(filtmgr_queue_fault(mgr, "zab41") == 0);
+
+    // A cleared hook is no longer invoked
+    filtmgr_set_fault_hook(mgr, NULL, NULL);
+    filtmgr_run_faults(mgr);
+    fail_unless(woken == 1);
+
+    res = filtmgr_drop_filter(mgr, "zab41");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_check_hashed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Filters with each hash scheme share the hashed keys
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->hash_scheme = BLOOM_HASH_MURMUR;
+    res = filtmgr_create_filter(mgr, "zab24", custom);
+    fail_unless(res == 0);
+    custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->hash_scheme = BLOOM_HASH_LEGACY;
+    res = filtmgr_create_filter(mgr, "zab25", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab24", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "zab25", (char**)&keys + 1, 1, (char*)&result);
+    fail_unless(res == 0);
+
+    bloom_hashed_key hashed[3];
+    for (int i=0; i < 3; i++) bf_hashed_key_init(hashed + i, keys[i]);
+    res = filtmgr_check_hashed(mgr, "zab24", (bloom_hashed_key*)&hashed, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 0 && result[2] == 0);
+    res = filtmgr_check_hashed(mgr, "zab25", (bloom_hashed_key*)&hashed, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 1 && result[2] == 0);
+
+    // Keys given as their murmur hash are only checked by murmur filters
+    bloom_hashed_key prehashed[3];
+    for (int i=0; i < 3; i++) bf_hashed_key_init_hash(prehashed + i, bf_hashed_key_murmur(hashed + i));
+    res = filtmgr_check_hashed(mgr, "zab24", (bloom_hashed_key*)&prehashed, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 0 && result[2] == 0);
+    res = filtmgr_check_hashed(mgr, "zab25", (bloom_hashed_key*)&prehashed, 3, (char*)&result);
+    fail_unless(res == -8);
+
+    // Missing filters are found even with no keys
+    res = filtmgr_check_hashed(mgr, "zab25", (bloom_hashed_key*)&hashed, 0, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_hashed(mgr, "zab26", (bloom_hashed_key*)&hashed, 0, (char*)&result);
+    fail_unless(res == -1);
+
+    res = filtmgr_drop_filter(mgr, "zab24");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab25");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_merge_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "zab27", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab28", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab27", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "zab28", (char**)&keys + 1, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    char *sources[] = {"zab27", "zab28", "zab29"};
+    res = filtmgr_merge_filters(mgr, "zab30", (char**)&sources, 2, 0);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab30", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 1);
+
+    res = filtmgr_merge_filters(mgr, "zab31", (char**)&sources, 2, 1);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "zab31", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 1 && result[2] == 0);
+
+    // The new filter must not exist, and the sources must
+    res = filtmgr_merge_filters(mgr, "zab31", (char**)&sources, 2, 1);
+    fail_unless(res == -4);
+    res = filtmgr_merge_filters(mgr, "zab32", (char**)&sources, 3, 0);
+    fail_unless(res == -1);
+
+    // Sources of a different shape are rejected, and
+    // leave no filter behind
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->initial_capacity = config.initial_capacity * 2;
+    res = filtmgr_create_filter(mgr, "zab29", custom);
+    fail_unless(res == 0);
+    res = filtmgr_merge_filters(mgr, "zab32", (char**)&sources, 3, 0);
+    fail_unless(res == -5);
+    res = filtmgr_check_keys(mgr, "zab32", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    char *names[] = {"zab27", "zab28", "zab29", "zab30", "zab31"};
+    for (int i=0; i < 5; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+/**
+ * Sets batches of keys in a filter until a set fails.
+ * @return The number of batches that were set.
+ */
+static int set_until_fail(bloom_filtmgr *mgr, char *filter_name, int max_batches, int *res) {
+    static char bufs[1000][20];
+    char *keys[1000];
+    char result[1000];
+    for (int b=0; b < max_batches; b++) {
+        for (int i=0; i < 1000; i++) {
+            snprintf((char*)&bufs[i], 20, "quota%d", b * 1000 + i);
+            keys[i] = bufs[i];
+        }
+        *res = filtmgr_set_keys(mgr, filter_name, (char**)&keys, 1000, (char*)&result);
+        if (*res) return b;
+    }
+    return max_batches;
+}
+
+START_TEST(test_mgr_quotas)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.initial_capacity = 10000;
+    config.filter_quota_mb = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Sets fail once the filter would grow over its quota
+    res = filtmgr_create_filter(mgr, "zab33", NULL);
+    fail_unless(res == 0);
+    int batches = set_until_fail(mgr, "zab33", 500, &res);
+    fail_unless(res == -5);
+    fail_unless(batches >= 10 && batches < 500);
+
+    // Keys that fit in the layers can still be set
+    char *keys[] = {"quota0", "quota1"};
+    char result[] = {0, 0};
+    res = filtmgr_set_keys(mgr, "zab33", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 0 && result[1] == 0);
+    res = filtmgr_drop_filter(mgr, "zab33");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // A degraded filter keeps taking keys in its newest layer
+    config.quota_degrade = 1;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab34", NULL);
+    fail_unless(res == 0);
+    fail_unless(set_until_fail(mgr, "zab34", batches + 20, &res) == batches + 20);
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab34");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // Filters sharing a prefix share its quota, and
+    // other prefixes have their own
+    config.quota_degrade = 0;
+    config.filter_quota_mb = 0;
+    config.prefix_quota_mb = 1;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    char *names[] = {"zab35:a", "zab35:b", "zab36:a", "zab35"};
+    for (int i=0; i < 4; i++) {
+        res = filtmgr_create_filter(mgr, names[i], NULL);
+        fail_unless(res == 0);
+    }
+    filtmgr_vacuum(mgr);
+
+    int first = set_until_fail(mgr, "zab35:a", 500, &res);
+    fail_unless(res == -5);
+    fail_unless(first == batches);
+    fail_unless(set_until_fail(mgr, "zab35:b", 500, &res) < first);
+    fail_unless(res == -5);
+    fail_unless(set_until_fail(mgr, "zab36:a", 500, &res) == first);
+    fail_unless(res == -5);
+
+    // Names without a separator have no prefix quota
+    fail_unless(set_until_fail(mgr, "zab35", first + 20, &res) == first + 20);
+    fail_unless(res == 0);
+
+    for (int i=0; i < 4; i++) {
+        res = filtmgr_drop_filter(mgr, names[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_manifest)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "manifest1", NULL);
+    fail_unless(res == 0);
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "manifest1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // A clean shutdown leaves a manifest, which is
+    // only used by the next startup
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd/manifest.bin", &st) == 0);
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(stat("/tmp/bloomd/manifest.bin", &st) == -1);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_filters(mgr, "manifest1", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    filtmgr_cleanup_list(head);
+    for (int i=0; i < 3; i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "manifest1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    // A filter added while we were down makes the manifest stale,
+    // and the filters are discovered from their folders
+    fail_unless(mkdir("/tmp/bloomd/bloomd.manifest2", 0755) == 0);
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_list_filters(mgr, "manifest", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 2);
+    filtmgr_cleanup_list(head);
+
+    res = filtmgr_drop_filter(mgr, "manifest1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "manifest2");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+    unlink("/tmp/bloomd/manifest.bin");
+}
+END_TEST
+
+START_TEST(test_mgr_aliases)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "alias_v1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "alias_v2", NULL);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_alias(mgr, "alias_live", "alias_v1");
+    fail_unless(res == 0);
+    res = filtmgr_create_alias(mgr, "alias_live", "alias_v2");
+    fail_unless(res == -2);
+    res = filtmgr_create_alias(mgr, "alias_v2", "alias_v1");
+    fail_unless(res == -2);
+    res = filtmgr_create_alias(mgr, "alias_other", "alias_missing");
+    fail_unless(res == -1);
+    res = filtmgr_create_filter(mgr, "alias_live", NULL);
+    fail_unless(res == -1);
+
+    // Commands on the alias resolve to its filter
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "alias_live", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    for (int i=0; i < 3; i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "alias_v1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_aliases(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    fail_unless(strcmp(head->head->filter_name, "alias_live alias_v1") == 0);
+    filtmgr_cleanup_list(head);
+
+    // The aliases survive a restart
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    for (int i=0; i < 3; i++) result[i] = 0;
+    res = filtmgr_check_keys(mgr, "alias_live", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    // A swap drops the filter the alias no longer resolves to
+    res = filtmgr_swap_alias(mgr, "alias_missing", "alias_v2");
+    fail_unless(res == -2);
+    res = filtmgr_swap_alias(mgr, "alias_live", "alias_v2");
+    fail_unless(res == 0);
+    for (int i=0; i < 3; i++) result[i] = 1;
+    res = filtmgr_check_keys(mgr, "alias_live", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(!result[0] && !result[1] && !result[2]);
+    res = filtmgr_check_keys(mgr, "alias_v1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -1);
+    filtmgr_vacuum(mgr);
+
+    // Dropping an alias leaves its filter, dropping
+    // a filter removes its aliases
+    res = filtmgr_create_alias(mgr, "alias_other", "alias_live");
+    fail_unless(res == 0);
+    res = filtmgr_drop_alias(mgr, "alias_other");
+    fail_unless(res == 0);
+    res = filtmgr_drop_alias(mgr, "alias_other");
+    fail_unless(res == -1);
+    res = filtmgr_check_keys(mgr, "alias_v2", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_drop_filter(mgr, "alias_v2");
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "alias_live", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -1);
+    res = filtmgr_list_aliases(mgr, &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 0);
+    filtmgr_cleanup_list(head);
+
+    filtmgr_vacuum(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+    unlink("/tmp/bloomd/aliases");
+}
+END_TEST
+
+START_TEST(test_mgr_load_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "load_keys", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_queue_load(mgr, "load_keys", "keys.txt");
+    fail_unless(res == -4);
+
+    // More keys than fit a chunk, with blank lines and a final
+    // key without a newline
+    mkdir("/tmp/bloomd_load", 0755);
+    FILE *f = fopen("/tmp/bloomd_load/keys.txt", "w");
+    fail_unless(f != NULL);
+    int num_keys = 600000;
+    for (int i=0; i < num_keys - 1; i++) {
+        fprintf(f, (i % 1000) ? "key%d\n" : "key%d\r\n\n", i);
+    }
+    fprintf(f, "key%d", num_keys - 1);
+    fclose(f);
+    struct stat st;
+    fail_unless(stat("/tmp/bloomd_load/keys.txt", &st) == 0);
+
+    config.load_dir = "/tmp/bloomd_load";
+    config.load_threads = 3;
+    res = filtmgr_queue_load(mgr, "load_missing", "keys.txt");
+    fail_unless(res == -1);
+    res = filtmgr_queue_load(mgr, "load_keys", "missing.txt");
+    fail_unless(res == -2);
+    res = filtmgr_queue_load(mgr, "load_keys", "../bloomd_load/../bloomd/config");
+    fail_unless(res == -2);
+    res = filtmgr_queue_load(mgr, "load_keys", "keys.txt");
+    fail_unless(res == 0);
+    res = filtmgr_queue_load(mgr, "load_keys", "keys.txt");
+    fail_unless(res == -3);
+
+    bloom_load_progress progress;
+    res = filtmgr_load_progress(mgr, "load_keys", &progress);
+    fail_unless(res == 0);
+    fail_unless(progress.state == LOAD_QUEUED);
+    fail_unless(progress.size == (uint64_t)st.st_size);
+
+    int should_run = 1;
+    fail_unless(filtmgr_wait_loads(mgr, 10) == 1);
+    fail_unless(filtmgr_run_loads(mgr, &should_run) == 1);
+    fail_unless(filtmgr_wait_loads(mgr, 10) == 0);
+    res = filtmgr_load_progress(mgr, "load_keys", &progress);
+    fail_unless(res == 0);
+    fail_unless(progress.state == LOAD_DONE);
+    fail_unless(progress.bytes == progress.size);
+    fail_unless(progress.keys == (uint64_t)num_keys);
+    fail_unless(progress.added <= progress.keys);
+    fail_unless(progress.added > progress.keys * 99 / 100);
+
+    char *keys[] = {"key0", "key1000", "key299999", "key599999"};
+    char result[] = {0, 0, 0, 0};
+    res = filtmgr_check_keys(mgr, "load_keys", (char**)&keys, 4, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2] && result[3]);
+
+    unlink("/tmp/bloomd_load/keys.txt");
+    rmdir("/tmp/bloomd_load");
+    res = filtmgr_drop_filter(mgr, "load_keys");
+    fail_unless(res == 0);
+    res = filtmgr_load_progress(mgr, "load_keys", &progress);
+    fail_unless(res == -1);
+    filtmgr_vacuum(mgr);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
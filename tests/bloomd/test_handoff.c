@@ -0,0 +1,103 @@
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "handoff.h"
+
+#define HANDOFF_TEST_SOCKET "@bloomd-test-handoff"
+
+typedef struct {
+    int handoff_fd;
+    bloom_listeners *listeners;
+} handoff_test_args;
+
+/**
+ * Hands the listeners off, and exits right away
+ */
+static void* handoff_test_server(void *in) {
+    handoff_test_args *args = in;
+    int peer = send_listeners(args->handoff_fd, args->listeners);
+    if (peer >= 0) close(peer);
+    return NULL;
+}
+
+/**
+ * Binds a UDP socket on a free port of the loopback
+ */
+static int handoff_test_udp(int *port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    fail_unless(getsockname(fd, (struct sockaddr*)&addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+START_TEST(test_handoff_no_server)
+{
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.handoff_socket = "/tmp/bloomd_handoff_missing";
+    bloom_listeners l;
+    fail_unless(inherit_listeners(&config, &l) == 0);
+    fail_unless(l.tcp_fd == -1);
+    fail_unless(l.udp_fd == -1);
+    fail_unless(l.unix_fd == -1);
+    fail_unless(l.num_worker_fds == 0);
+    close_listeners(&l);
+}
+END_TEST
+
+START_TEST(test_handoff_roundtrip)
+{
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.handoff_socket = HANDOFF_TEST_SOCKET;
+
+    // Hand off a UDP listener, and one on the wrong port
+    int udp_port, worker_port;
+    bloom_listeners sent;
+    init_listeners(&sent);
+    sent.udp_fd = handoff_test_udp(&udp_port);
+    int worker_fd = handoff_test_udp(&worker_port);
+    sent.worker_fds = &worker_fd;
+    sent.num_worker_fds = 1;
+    config.udp_port = udp_port;
+
+    int handoff_fd = bind_handoff_socket(HANDOFF_TEST_SOCKET);
+    fail_unless(handoff_fd >= 0);
+    handoff_test_args args = {handoff_fd, &sent};
+    pthread_t t;
+    pthread_create(&t, NULL, handoff_test_server, &args);
+
+    // Returns once the server is done with the connection
+    bloom_listeners got;
+    fail_unless(inherit_listeners(&config, &got) == 0);
+    pthread_join(t, NULL);
+    fail_unless(got.tcp_fd == -1);
+    fail_unless(got.unix_fd == -1);
+    fail_unless(got.udp_fd >= 0);
+    fail_unless(got.udp_fd != sent.udp_fd);
+    fail_unless(got.num_worker_fds == 1);
+    fail_unless(got.worker_fds[0] == -1);
+
+    // The same socket as the one we sent
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    fail_unless(getsockname(got.udp_fd, (struct sockaddr*)&addr, &len) == 0);
+    fail_unless(ntohs(addr.sin_port) == udp_port);
+
+    close_listeners(&got);
+    close(sent.udp_fd);
+    close(worker_fd);
+    close(handoff_fd);
+}
+END_TEST
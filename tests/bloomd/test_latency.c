@@ -0,0 +1,132 @@
+#include <check.h>
+#include <string.h>
+#include "latency.h"
+#include "slowlog.h"
+
+START_TEST(test_latency_disabled)
+{
+    latency_init(0);
+    latency_begin();
+    latency_mark(LATENCY_PARSE);
+    latency_end(1);
+
+    latency_histogram hist;
+    latency_merge(1, LATENCY_TOTAL, &hist);
+    fail_unless(hist.samples == 0);
+    fail_unless(latency_percentile(&hist, 0.5) == 0);
+}
+END_TEST
+
+START_TEST(test_latency_record_stages)
+{
+    latency_init(1);
+
+    // Marks outside of a command are ignored
+    latency_mark(LATENCY_LOCK);
+
+    latency_begin();
+    latency_mark(LATENCY_PARSE);
+    latency_mark(LATENCY_LOOKUP);
+    latency_mark(LATENCY_PARSE);
+    latency_end(3);
+
+    latency_histogram hist, total;
+    latency_merge(3, LATENCY_PARSE, &hist);
+    fail_unless(hist.samples == 1);
+    latency_merge(3, LATENCY_LOOKUP, &hist);
+    fail_unless(hist.samples == 1);
+    latency_merge(3, LATENCY_LOCK, &hist);
+    fail_unless(hist.samples == 0);
+
+    latency_merge(3, LATENCY_TOTAL, &total);
+    fail_unless(total.samples == 1);
+    latency_merge(3, LATENCY_PARSE, &hist);
+    fail_unless(total.max >= hist.max);
+
+    // Other commands are not affected
+    latency_merge(4, LATENCY_TOTAL, &hist);
+    fail_unless(hist.samples == 0);
+}
+END_TEST
+
+START_TEST(test_latency_sampling)
+{
+    latency_init(4);
+    for (int i=0; i < 100; i++) {
+        latency_begin();
+        latency_mark(LATENCY_OP);
+        latency_end(2);
+    }
+    latency_histogram hist;
+    latency_merge(2, LATENCY_OP, &hist);
+    fail_unless(hist.samples == 25);
+}
+END_TEST
+
+START_TEST(test_latency_percentile)
+{
+    latency_histogram hist;
+    memset(&hist, 0, sizeof(hist));
+    hist.counts[5] = 90;
+    hist.counts[7] = 10;
+    hist.samples = 100;
+    hist.max = 7;
+    fail_unless(latency_percentile(&hist, 0) == 5);
+    fail_unless(latency_percentile(&hist, 0.5) == 5);
+    fail_unless(latency_percentile(&hist, 0.9) == 5);
+    fail_unless(latency_percentile(&hist, 0.99) == 7);
+    fail_unless(latency_percentile(&hist, 1) == 7);
+    fail_unless(strcmp(latency_stage_name(LATENCY_LOCK), "lock") == 0);
+}
+END_TEST
+
+// Times a command that takes at least usec
+static void latency_test_command(int command, const char *filter_name, int num_keys, int usec) {
+    latency_begin();
+    latency_mark(LATENCY_PARSE);
+    if (filter_name) latency_note(filter_name, num_keys);
+    uint64_t start = latency_now();
+    while (latency_now() - start < (uint64_t)usec * 1000);
+    latency_mark(LATENCY_FAULT);
+    latency_end(command);
+}
+
+START_TEST(test_latency_slowlog)
+{
+    // Slow commands are logged even if they are not sampled
+    latency_init(0);
+    fail_unless(slowlog_init(100, 4) == 0);
+    fail_unless(slowlog_threshold() == 100000);
+    latency_test_command(6, "foobar", 3, 0);
+    latency_test_command(6, "foobar", 3, 200);
+
+    slowlog_entry entries[8];
+    fail_unless(slowlog_read(entries, 8) == 1);
+    fail_unless(entries[0].command == 6);
+    fail_unless(entries[0].num_keys == 3);
+    fail_unless(strcmp(entries[0].filter_name, "foobar") == 0);
+    fail_unless(entries[0].stages[LATENCY_TOTAL] >= 200000);
+    fail_unless(entries[0].stages[LATENCY_FAULT] >= 200000);
+    fail_unless(entries[0].stages[LATENCY_LOCK] == 0);
+
+    latency_histogram hist;
+    latency_merge(6, LATENCY_TOTAL, &hist);
+    fail_unless(hist.samples == 0);
+
+    // The oldest entries are replaced, and the newest is first
+    for (int i=0; i < 5; i++) latency_test_command(7, NULL, 0, 200);
+    fail_unless(slowlog_read(entries, 8) == 4);
+    fail_unless(entries[0].id == 5);
+    fail_unless(entries[3].id == 2);
+    fail_unless(entries[0].command == 7);
+    fail_unless(entries[0].filter_name[0] == '\0');
+
+    slowlog_reset();
+    fail_unless(slowlog_read(entries, 8) == 0);
+
+    // Nothing is timed once disabled
+    fail_unless(slowlog_init(0, 4) == 0);
+    latency_test_command(7, NULL, 0, 200);
+    fail_unless(slowlog_read(entries, 8) == 0);
+}
+END_TEST
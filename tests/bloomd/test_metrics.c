@@ -0,0 +1,83 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "metrics.h"
+
+START_TEST(test_metrics_render_server)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *out;
+    int len;
+    res = metrics_render(mgr, &out, &len);
+    fail_unless(res == 0);
+    fail_unless(len == (int)strlen(out));
+    fail_unless(strstr(out, "# TYPE bloomd_filters gauge\nbloomd_filters ") != NULL);
+    fail_unless(strstr(out, "# TYPE bloomd_filter_size gauge\n") != NULL);
+    fail_unless(strstr(out, "bloomd_metrics_render_seconds ") != NULL);
+    free(out);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_render_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_create_filter(mgr, "metrics1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "metrics2", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"foo", "bar", "baz"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "metrics1", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys(mgr, "metrics1", (char**)&keys, 2, (char*)&result);
+    fail_unless(res == 0);
+
+    char *out;
+    int len;
+    res = metrics_render(mgr, &out, &len);
+    fail_unless(res == 0);
+    char *filters = strstr(out, "\nbloomd_filters ");
+    fail_unless(filters && atoi(filters + 16) >= 2);
+    fail_unless(strstr(out, "bloomd_filter_size{filter=\"metrics1\"} 3\n") != NULL);
+    fail_unless(strstr(out, "bloomd_filter_size{filter=\"metrics2\"} 0\n") != NULL);
+    fail_unless(strstr(out, "bloomd_filter_check_hits_total{filter=\"metrics1\"} 2\n") != NULL);
+    fail_unless(strstr(out, "bloomd_filter_set_hits_total{filter=\"metrics1\"} 3\n") != NULL);
+    fail_unless(strstr(out, "# TYPE bloomd_filter_fault_seconds_total counter\n") != NULL);
+
+    // Each metric is described once, before all of its filters
+    char *first = strstr(out, "bloomd_filter_capacity{filter=\"metrics1\"}");
+    char *second = strstr(out, "bloomd_filter_capacity{filter=\"metrics2\"}");
+    char *next = strstr(out, "# HELP bloomd_filter_size ");
+    fail_unless(first && second && next);
+    fail_unless(first < next && second < next);
+    free(out);
+
+    res = filtmgr_drop_filter(mgr, "metrics1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "metrics2");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
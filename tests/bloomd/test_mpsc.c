@@ -0,0 +1,83 @@
+#include <check.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "mpsc.h"
+
+typedef struct {
+    bloom_mpsc_node node;
+    int producer;
+    int seq;
+} mpsc_test_msg;
+
+typedef struct {
+    bloom_mpsc *q;
+    mpsc_test_msg *msgs;
+    int producer;
+} mpsc_test_producer;
+
+#define MPSC_TEST_MSGS 10000
+
+static void* mpsc_test_produce(void *in) {
+    mpsc_test_producer *p = in;
+    for (int i=0; i < MPSC_TEST_MSGS; i++) {
+        p->msgs[i].producer = p->producer;
+        p->msgs[i].seq = i;
+        mpsc_push(p->q, &p->msgs[i].node);
+    }
+    return NULL;
+}
+
+START_TEST(test_mpsc_order)
+{
+    bloom_mpsc q;
+    mpsc_init(&q);
+    fail_unless(mpsc_take(&q) == NULL);
+
+    // The first push finds the queue empty
+    mpsc_test_msg msgs[3];
+    fail_unless(mpsc_push(&q, &msgs[0].node) == 1);
+    fail_unless(mpsc_push(&q, &msgs[1].node) == 0);
+    fail_unless(mpsc_push(&q, &msgs[2].node) == 0);
+
+    // Taken in the order they were pushed
+    bloom_mpsc_node *node = mpsc_take(&q);
+    for (int i=0; i < 3; i++, node = node->next) {
+        fail_unless(node == &msgs[i].node);
+    }
+    fail_unless(node == NULL);
+    fail_unless(mpsc_take(&q) == NULL);
+}
+END_TEST
+
+START_TEST(test_mpsc_producers)
+{
+    bloom_mpsc q;
+    mpsc_init(&q);
+    pthread_t threads[4];
+    mpsc_test_producer producers[4];
+    for (int i=0; i < 4; i++) {
+        producers[i].q = &q;
+        producers[i].msgs = calloc(MPSC_TEST_MSGS, sizeof(mpsc_test_msg));
+        producers[i].producer = i;
+        pthread_create(&threads[i], NULL, mpsc_test_produce, &producers[i]);
+    }
+
+    // Every message is taken once, in the order of its producer
+    int next[4] = {0, 0, 0, 0};
+    int taken = 0;
+    while (taken < 4 * MPSC_TEST_MSGS) {
+        for (bloom_mpsc_node *node = mpsc_take(&q); node; node = node->next) {
+            mpsc_test_msg *msg = (mpsc_test_msg*)node;
+            fail_unless(msg->seq == next[msg->producer]);
+            next[msg->producer]++;
+            taken++;
+        }
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        fail_unless(next[i] == MPSC_TEST_MSGS);
+        free(producers[i].msgs);
+    }
+    fail_unless(mpsc_take(&q) == NULL);
+}
+END_TEST
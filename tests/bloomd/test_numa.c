@@ -0,0 +1,103 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "config.h"
+#include "filter.h"
+#include "numa.h"
+
+START_TEST(test_numa_topology)
+{
+    int nodes = numa_topology_init();
+    fail_unless(nodes >= 1);
+    fail_unless(nodes <= NUMA_MAX_NODES);
+    fail_unless(numa_nodes() == nodes);
+
+    int node = numa_this_node();
+    fail_unless(node >= 0 && node < nodes);
+
+    // Invalid nodes are rejected
+    fail_unless(numa_bind_thread(-1) == -1);
+    fail_unless(numa_bind_thread(NUMA_MAX_NODES) == -1);
+}
+END_TEST
+
+START_TEST(test_numa_parse_cpus)
+{
+    int cpus[8];
+    fail_unless(numa_parse_cpus("3", cpus, 8) == 1);
+    fail_unless(cpus[0] == 3);
+    fail_unless(numa_parse_cpus("0-3,8,10-11", cpus, 8) == 7);
+    fail_unless(cpus[0] == 0 && cpus[3] == 3 && cpus[4] == 8 && cpus[6] == 11);
+
+    // Only the first CPUs are output, the rest are counted
+    fail_unless(numa_parse_cpus("0-15", cpus, 8) == 16);
+    fail_unless(cpus[7] == 7);
+    fail_unless(numa_parse_cpus("0-1\n", NULL, 0) == 2);
+
+    // Malformed lists
+    fail_unless(numa_parse_cpus(NULL, cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("", cpus, 8) == 0);
+    fail_unless(numa_parse_cpus("4-2", cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("1,,2", cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("1-", cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("-1", cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("1 2", cpus, 8) == -1);
+    fail_unless(numa_parse_cpus("99999", cpus, 8) == -1);
+}
+END_TEST
+
+START_TEST(test_numa_pin_thread)
+{
+    fail_unless(numa_pin_thread("", 0) == -1);
+    fail_unless(numa_pin_thread("x", -1) == -1);
+
+#ifdef __linux__
+    // Pin to the CPU we run on, then restore the mask
+    cpu_set_t saved;
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    char list[16];
+    snprintf(list, sizeof(list), "%d", sched_getcpu());
+    fail_unless(numa_pin_thread(list, 5) == 0);
+    fail_unless(sched_getcpu() == atoi(list));
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+#endif
+}
+END_TEST
+
+START_TEST(test_numa_filter_placement)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.use_numa = 1;
+    config.numa_interleave_mb = 1;
+    numa_topology_init();
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter27", 0, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->numa_node == -1 || filter->numa_node < numa_nodes());
+
+    char buf[20];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "foobar%d", i);
+        fail_unless(bloomf_add(filter, (char*)&buf) == 1);
+    }
+    fail_unless(bloomf_size(filter) == 1000);
+    fail_unless(bloomf_contains(filter, "foobar42") == 1);
+
+    // Placement is only done on machines with several nodes
+    if (numa_nodes() > 1)
+        fail_unless(filter->numa_node >= 0 && filter->numa_node < numa_nodes());
+    else
+        fail_unless(filter->numa_node == -1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,49 @@
+#include <check.h>
+#include "rate_limit.h"
+
+#define NSEC 1000000000ULL
+
+START_TEST(test_rate_limit_unlimited)
+{
+    bloom_rate_limit limit = {0};
+    uint64_t now = rate_limit_now();
+    for (int i=0; i < 1000; i++) {
+        fail_unless(rate_limit_take(&limit, 0, 1000000, now) == 1);
+    }
+    fail_unless(limit.full_at == 0);
+}
+END_TEST
+
+START_TEST(test_rate_limit_burst)
+{
+    bloom_rate_limit limit = {0};
+    uint64_t now = 100 * NSEC;
+
+    // A second of tokens can be taken at once
+    int taken = 0;
+    while (rate_limit_take(&limit, 100, 1, now)) taken++;
+    fail_unless(taken == 100);
+
+    // Tokens are earned back over time
+    fail_unless(rate_limit_take(&limit, 100, 1, now + NSEC / 100) == 1);
+    fail_unless(rate_limit_take(&limit, 100, 1, now + NSEC / 100) == 0);
+
+    // The bucket does not hold more than a second of tokens
+    taken = 0;
+    while (rate_limit_take(&limit, 100, 1, now + 10 * NSEC)) taken++;
+    fail_unless(taken == 100);
+}
+END_TEST
+
+START_TEST(test_rate_limit_debt)
+{
+    bloom_rate_limit limit = {0};
+    uint64_t now = 100 * NSEC;
+
+    // A large take is allowed, but leaves the bucket in debt
+    fail_unless(rate_limit_take(&limit, 100, 500, now) == 1);
+    fail_unless(rate_limit_take(&limit, 100, 1, now) == 0);
+    fail_unless(rate_limit_take(&limit, 100, 1, now + 3 * NSEC) == 0);
+    fail_unless(rate_limit_take(&limit, 100, 1, now + 4 * NSEC + 1) == 1);
+}
+END_TEST
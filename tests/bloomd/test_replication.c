@@ -0,0 +1,346 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "replication.h"
+#include "filter.h"
+
+START_TEST(test_repl_log_read)
+{
+    bloom_repl_log *log;
+    int res = init_repl_log(4096, &log);
+    fail_unless(res == 0);
+    fail_unless(repl_log_head(log) == 0);
+
+    char *keys[] = {"foo", "bar", "baz"};
+    repl_log_keys(log, "b", "repl1", (char**)&keys, NULL, 3, NULL);
+    repl_log_filter_cmd(log, "drop", "repl1");
+
+    // Only the keys that changed the filter are recorded
+    char result[] = {1, 0, 1};
+    repl_log_keys(log, "delete", "repl1", (char**)&keys, NULL, 3, (char*)&result);
+    char none[] = {0, 0, 0};
+    repl_log_keys(log, "b", "repl1", (char**)&keys, NULL, 3, (char*)&none);
+
+    const char *expected = "b repl1 foo bar baz\ndrop repl1\ndelete repl1 foo baz\n";
+    fail_unless(repl_log_head(log) == strlen(expected));
+
+    char buf[128];
+    uint64_t offset = 0;
+    res = repl_log_read(log, &offset, (char*)&buf, sizeof(buf));
+    fail_unless(res == (int)strlen(expected));
+    fail_unless(offset == strlen(expected));
+    fail_unless(memcmp(buf, expected, res) == 0);
+
+    // Reads are resumed from the offset
+    offset = 5;
+    res = repl_log_read(log, &offset, (char*)&buf, 10);
+    fail_unless(res == 10);
+    fail_unless(memcmp(buf, expected + 5, 10) == 0);
+    fail_unless(offset == 15);
+
+    // Nothing more to read, and offsets past the head are invalid
+    offset = repl_log_head(log);
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == 0);
+    offset++;
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == -1);
+
+    destroy_repl_log(log);
+}
+END_TEST
+
+START_TEST(test_repl_log_wrap)
+{
+    bloom_repl_log *log;
+    int res = init_repl_log(64, &log);
+    fail_unless(res == 0);
+
+    // Write past the size, so the log wraps around
+    for (int i=0; i < 10; i++) {
+        repl_log_filter_cmd(log, "clear", "repl2");
+    }
+    fail_unless(repl_log_head(log) == 120);
+
+    // The oldest lines were overwritten
+    char buf[128];
+    uint64_t offset = 0;
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == -1);
+    offset = 48;
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == -1);
+
+    // The newest lines are intact across the wrap
+    offset = 60;
+    res = repl_log_read(log, &offset, (char*)&buf, sizeof(buf));
+    fail_unless(res == 60);
+    fail_unless(offset == 120);
+    for (int i=0; i < 5; i++) {
+        fail_unless(memcmp(buf + i * 12, "clear repl2\n", 12) == 0);
+    }
+
+    // A line larger than the log invalidates every position
+    char *big = malloc(100);
+    memset(big, 'a', 99);
+    big[99] = 0;
+    char *keys[] = {big};
+    repl_log_keys(log, "b", "repl2", (char**)&keys, NULL, 1, NULL);
+    offset = 120;
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == -1);
+    offset = repl_log_head(log);
+    fail_unless(repl_log_read(log, &offset, (char*)&buf, sizeof(buf)) == 0);
+    free(big);
+
+    destroy_repl_log(log);
+}
+END_TEST
+
+START_TEST(test_repl_apply_line)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Record the changes of a source manager, and replay them
+    bloom_repl_log *log;
+    res = init_repl_log(65536, &log);
+    fail_unless(res == 0);
+    filtmgr_set_repl_log(mgr, log);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->initial_capacity = 50000;
+    custom->default_probability = 0.001;
+    custom->scale_size = 2;
+    res = filtmgr_create_filter(mgr, "repl3", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"foo", "bar", "baz"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "repl3", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    char buf[1024];
+    uint64_t offset = 0;
+    int len = repl_log_read(log, &offset, (char*)&buf, sizeof(buf) - 1);
+    fail_unless(len > 0);
+    fail_unless(strncmp(buf, "create repl3 capacity=50000 ", 28) == 0);
+    fail_unless(strstr(buf, " scale=2 ") != NULL);
+
+    // Drop the source, so the replay creates the filter again
+    res = filtmgr_drop_filter(mgr, "repl3");
+    fail_unless(res == 0);
+    filtmgr_set_repl_log(mgr, NULL);
+    filtmgr_vacuum(mgr);
+
+    char *line = buf;
+    for (char *nl; (nl = memchr(line, '\n', buf + len - line)); line = nl + 1) {
+        res = repl_apply_line(&config, mgr, line, nl - line);
+        fail_unless(res == 0);
+    }
+
+    res = filtmgr_check_keys(mgr, "repl3", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    bloom_filter_list_head *head;
+    res = filtmgr_list_filters(mgr, "repl3", &head);
+    fail_unless(res == 0);
+    fail_unless(head->size == 1);
+    filtmgr_cleanup_list(head);
+
+    // Malformed lines are rejected
+    char bad1[] = "b";
+    fail_unless(repl_apply_line(&config, mgr, bad1, strlen(bad1)) == -1);
+    char bad2[] = "bogus repl3";
+    fail_unless(repl_apply_line(&config, mgr, bad2, strlen(bad2)) == -1);
+    char bad3[] = "create repl4 size=10";
+    fail_unless(repl_apply_line(&config, mgr, bad3, strlen(bad3)) == -1);
+
+    // Drops are replayed
+    char drop[] = "drop repl3";
+    fail_unless(repl_apply_line(&config, mgr, drop, strlen(drop)) == 0);
+    res = filtmgr_check_keys(mgr, "repl3", (char**)&keys, 1, (char*)&result);
+    fail_unless(res == -1);
+
+    destroy_repl_log(log);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_repl_escaped_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "repl6", NULL);
+    fail_unless(res == 0);
+
+    bloom_repl_log *log;
+    res = init_repl_log(65536, &log);
+    fail_unless(res == 0);
+    filtmgr_set_repl_log(mgr, log);
+
+    // Keys that would split the line are escaped
+    char *keys[] = {"a b", "x\ny", "p\0q", "50%", "a", "x", "p"};
+    int key_lens[] = {3, 3, 3, 3, 1, 1, 1};
+    char result[7];
+    res = filtmgr_set_keys_len(mgr, "repl6", keys, key_lens, 4, result);
+    fail_unless(res == 0);
+
+    char buf[1024];
+    uint64_t offset = 0;
+    int len = repl_log_read(log, &offset, (char*)&buf, sizeof(buf));
+    const char *expected = "bx repl6 a%20b x%0Ay p%00q 50%25\n";
+    fail_unless(len == (int)strlen(expected));
+    fail_unless(memcmp(buf, expected, len) == 0);
+
+    // The replayed keys are the same keys
+    filtmgr_set_repl_log(mgr, NULL);
+    res = filtmgr_drop_filter(mgr, "repl6");
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+    res = filtmgr_create_filter(mgr, "repl6", NULL);
+    fail_unless(res == 0);
+    res = repl_apply_line(&config, mgr, buf, len - 1);
+    fail_unless(res == 0);
+    res = filtmgr_check_keys_len(mgr, "repl6", keys, key_lens, 7, result);
+    fail_unless(res == 0);
+    for (int i=0; i < 4; i++) fail_unless(result[i] == 1);
+    for (int i=4; i < 7; i++) fail_unless(result[i] == 0);
+
+    // Malformed escapes are rejected
+    char bad[] = "bx repl6 a%2";
+    fail_unless(repl_apply_line(&config, mgr, bad, strlen(bad)) == -1);
+
+    res = filtmgr_drop_filter(mgr, "repl6");
+    fail_unless(res == 0);
+    destroy_repl_log(log);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    bloom_filtmgr *mgr;
+    uint32_t *num_layers;
+    uint64_t bytes;
+} repl_merge_pages;
+
+static int repl_merge_pages_cb(void *data, uint32_t layer, uint64_t layer_bytes,
+        uint64_t offset, unsigned char *bytes, uint64_t len) {
+    repl_merge_pages *m = data;
+    m->bytes += len;
+    return (filtmgr_merge_pages(m->mgr, "repl5", *m->num_layers, layer, layer_bytes, offset, bytes, len)) ? 1 : 0;
+}
+
+static void repl_byte_size_cb(void *in, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    *(uint64_t*)in = bloomf_byte_size(filter);
+}
+
+START_TEST(test_repl_catch_up_pages)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    // A primary with a log, and a replica that missed its later sets
+    bloom_filtmgr *primary, *replica;
+    res = init_filter_manager(&config, 0, &primary);
+    fail_unless(res == 0);
+    res = init_filter_manager(&config, 0, &replica);
+    fail_unless(res == 0);
+    bloom_repl_log *log;
+    res = init_repl_log(65536, &log);
+    fail_unless(res == 0);
+    filtmgr_set_repl_log(primary, log);
+
+    // The log only moves on a generation once it was written to
+    fail_unless(*repl_log_clock(log) == 1);
+    fail_unless(repl_log_roll(log) == 0);
+    repl_log_filter_cmd(log, "clear", "repl0");
+    fail_unless(repl_log_roll(log) == 1);
+    fail_unless(*repl_log_clock(log) == 2);
+
+    char *keys[] = {"foo", "bar", "baz"};
+    char result[] = {0, 0, 0};
+    bloom_filtmgr *mgrs[] = {primary, replica};
+    for (int i=0; i < 2; i++) {
+        bloom_config *custom = malloc(sizeof(bloom_config));
+        memcpy(custom, &config, sizeof(bloom_config));
+        custom->initial_capacity = 50000;
+        custom->default_probability = 0.001;
+        res = filtmgr_create_filter(mgrs[i], "repl5", custom);
+        fail_unless(res == 0);
+        res = filtmgr_set_keys(mgrs[i], "repl5", (char**)&keys, 2, (char*)&result);
+        fail_unless(res == 0);
+    }
+    fail_unless(repl_log_roll(log) == 1);
+    repl_log_filter_cmd(log, "clear", "repl0");
+    fail_unless(repl_log_roll(log) == 1);
+
+    // Pages changed from a position on may be stamped with the generation before
+    uint64_t offset = repl_log_head(log);
+    res = filtmgr_set_keys(primary, "repl5", (char**)&keys + 2, 1, (char*)&result);
+    fail_unless(res == 0);
+    uint32_t gen;
+    fail_unless(repl_log_generation(log, 0, &gen) == 0);
+    fail_unless(gen == 0);
+    fail_unless(repl_log_generation(log, repl_log_head(log) + 1, &gen) == -1);
+    fail_unless(repl_log_generation(log, offset, &gen) == 0);
+    fail_unless(gen == 3);
+
+    // Only the pages of the new key are merged into the replica
+    uint64_t cursor = 0;
+    uint32_t num_layers = 0;
+    repl_merge_pages m = {replica, &num_layers, 0};
+    res = filtmgr_changed_pages(primary, "repl5", gen, &cursor, &num_layers, 1 << 20, repl_merge_pages_cb, &m);
+    fail_unless(res == 0);
+    fail_unless(num_layers == 1);
+    fail_unless(m.bytes > 0);
+    uint64_t bytes = 0;
+    res = filtmgr_filter_cb(primary, "repl5", repl_byte_size_cb, &bytes);
+    fail_unless(res == 0);
+    fail_unless(m.bytes < bytes / 2);
+
+    res = filtmgr_check_keys(replica, "repl5", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    // A layer tracked since the generation can not be diffed
+    cursor = num_layers = 0;
+    res = filtmgr_changed_pages(primary, "repl5", 2, &cursor, &num_layers, 1 << 20, repl_merge_pages_cb, &m);
+    fail_unless(res == -5);
+    res = filtmgr_changed_pages(primary, "repl6", 3, &cursor, &num_layers, 1 << 20, repl_merge_pages_cb, &m);
+    fail_unless(res == -1);
+
+    // Pages of a filter with other layers are refused
+    unsigned char page[4096];
+    memset(page, 0, sizeof(page));
+    res = filtmgr_merge_pages(replica, "repl5", 2, 0, sizeof(page), 4096, page, sizeof(page));
+    fail_unless(res == -5);
+
+    filtmgr_set_repl_log(primary, NULL);
+    res = filtmgr_drop_filter(primary, "repl5");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(replica, "repl5");
+    fail_unless(res == 0);
+    destroy_repl_log(log);
+    res = destroy_filter_manager(primary);
+    fail_unless(res == 0);
+    res = destroy_filter_manager(replica);
+    fail_unless(res == 0);
+}
+END_TEST
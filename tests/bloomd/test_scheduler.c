@@ -0,0 +1,134 @@
+#include <check.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "scheduler.h"
+
+typedef struct {
+    int runs;
+    int limit;          // Stops the job after this many runs, if set
+    int delay;          // Returned by the job
+    int sleep_usec;
+    int *running;       // Jobs running at once, shared
+    int *max_running;
+    int nice;           // Nice value the job ran at
+} sched_test_job;
+
+static int sched_test_func(void *data) {
+    sched_test_job *j = data;
+    if (j->running) {
+        int now = __atomic_add_fetch(j->running, 1, __ATOMIC_SEQ_CST);
+        int max = __atomic_load_n(j->max_running, __ATOMIC_SEQ_CST);
+        while (now > max && !__atomic_compare_exchange_n(j->max_running, &max, now, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) ;
+    }
+    if (j->sleep_usec) usleep(j->sleep_usec);
+    j->nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    if (j->running) __atomic_sub_fetch(j->running, 1, __ATOMIC_SEQ_CST);
+    int runs = __atomic_add_fetch(&j->runs, 1, __ATOMIC_SEQ_CST);
+    return (j->limit && runs >= j->limit) ? -1 : j->delay;
+}
+
+static void sched_test_hook(void *arg) {
+    __atomic_add_fetch((int*)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+START_TEST(test_sched_intervals)
+{
+    int workers[SCHED_CLASSES] = {1, 1, 1};
+    int idle = 0;
+    bloom_scheduler *sched;
+    fail_unless(init_scheduler(workers, sched_test_hook, NULL, &idle, &sched) == 0);
+
+    // A fast job runs many times while a slow one waits its
+    // interval, and a job ends once it returns -1
+    sched_test_job fast = {0}, slow = {0}, once = {0};
+    once.limit = 1;
+    fail_unless(sched_add_job(sched, "fast", SCHED_CLASS_NORMAL, 20, NULL, sched_test_func, &fast) == 0);
+    fail_unless(sched_add_job(sched, "slow", SCHED_CLASS_NORMAL, 5000, NULL, sched_test_func, &slow) == 0);
+    fail_unless(sched_add_job(sched, "once", SCHED_CLASS_BACKGROUND, 10, NULL, sched_test_func, &once) == 0);
+    usleep(500000);
+    fail_unless(sched_runs(sched) >= (uint64_t)(fast.runs + once.runs));
+    destroy_scheduler(sched);
+
+    fail_unless(fast.runs >= 5 && fast.runs <= 30);
+    fail_unless(slow.runs == 0);
+    fail_unless(once.runs == 1);
+    fail_unless(idle == fast.runs + once.runs);
+}
+END_TEST
+
+START_TEST(test_sched_delay)
+{
+    int workers[SCHED_CLASSES] = {1, 1, 1};
+    bloom_scheduler *sched;
+    fail_unless(init_scheduler(workers, NULL, NULL, NULL, &sched) == 0);
+
+    // The delay a job returns replaces its interval, which
+    // is well past a turn of the wheel
+    sched_test_job job = {0};
+    job.delay = 10;
+    fail_unless(sched_add_job(sched, "delay", SCHED_CLASS_NORMAL, 2600, NULL, sched_test_func, &job) == 0);
+    usleep(2900000);
+    destroy_scheduler(sched);
+    fail_unless(job.runs >= 10);
+}
+END_TEST
+
+START_TEST(test_sched_concurrency)
+{
+    int workers[SCHED_CLASSES] = {1, 1, 3};
+    bloom_scheduler *sched;
+    fail_unless(init_scheduler(workers, NULL, NULL, NULL, &sched) == 0);
+
+    // The background class has one worker, so its
+    // jobs take turns even when they are all due
+    int running = 0, max_running = 0;
+    sched_test_job jobs[3];
+    for (int i=0; i < 3; i++) {
+        jobs[i] = (sched_test_job){0};
+        jobs[i].sleep_usec = 20000;
+        jobs[i].running = &running;
+        jobs[i].max_running = &max_running;
+        fail_unless(sched_add_job(sched, "bg", SCHED_CLASS_BACKGROUND, 10, NULL, sched_test_func, jobs + i) == 0);
+    }
+
+    // A job never runs on two workers at once
+    int idle_running = 0, idle_max = 0;
+    sched_test_job idle = {0};
+    idle.delay = 1;
+    idle.sleep_usec = 20000;
+    idle.running = &idle_running;
+    idle.max_running = &idle_max;
+    fail_unless(sched_add_job(sched, "idle", SCHED_CLASS_IDLE, 10, NULL, sched_test_func, &idle) == 0);
+    usleep(300000);
+    destroy_scheduler(sched);
+
+    fail_unless(max_running == 1);
+    fail_unless(idle_max == 1);
+    for (int i=0; i < 3; i++) fail_unless(jobs[i].runs >= 1);
+    fail_unless(idle.runs >= 2);
+}
+END_TEST
+
+START_TEST(test_sched_classes)
+{
+    int workers[SCHED_CLASSES] = {1, 1, 1};
+    bloom_scheduler *sched;
+    fail_unless(init_scheduler(workers, NULL, NULL, NULL, &sched) == 0);
+
+    // The workers run at the CPU priority of their class
+    int base = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    sched_test_job normal = {0}, idle = {0};
+    normal.limit = idle.limit = 1;
+    fail_unless(sched_add_job(sched, "normal", SCHED_CLASS_NORMAL, 10, NULL, sched_test_func, &normal) == 0);
+    fail_unless(sched_add_job(sched, "idle", SCHED_CLASS_IDLE, 10, NULL, sched_test_func, &idle) == 0);
+    for (int i=0; i < 100 && (!normal.runs || !idle.runs); i++) usleep(10000);
+    destroy_scheduler(sched);
+
+    fail_unless(normal.runs == 1 && idle.runs == 1);
+    fail_unless(normal.nice == base);
+    fail_unless(idle.nice == 19);
+}
+END_TEST
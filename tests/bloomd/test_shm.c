@@ -0,0 +1,75 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "shm_ring.h"
+#include "bloomd_shm.h"
+
+START_TEST(test_shm_check_set)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.data_dir = "/tmp/test_shm";
+    config.shm_socket = "/tmp/test_shm.sock";
+    config.shm_ring_kb = 64;
+    mkdir(config.data_dir, 0755);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    fail_unless(filtmgr_create_filter(mgr, "shm1", NULL) == 0);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_shm_thread(&config, mgr, &should_run, &t) == 1);
+
+    // A client that sleeps right away, so each reply wakes it
+    bloomd_shm *shm;
+    fail_unless(bloomd_shm_connect("/tmp/test_shm.sock", 0, &shm) == BLOOMD_OK);
+    const char *keys[] = {"foo", "bar", "baz"};
+    char results[3];
+    fail_unless(bloomd_shm_set_many(shm, "shm1", keys, NULL, 2, results) == BLOOMD_OK);
+    fail_unless(results[0] == 1 && results[1] == 1);
+    fail_unless(bloomd_shm_check_many(shm, "shm1", keys, NULL, 3, results) == BLOOMD_OK);
+    fail_unless(results[0] == 1 && results[1] == 1 && results[2] == 0);
+    fail_unless(bloomd_shm_check_many(shm, "noshm", keys, NULL, 3, results) == BLOOMD_ERR_NO_FILTER);
+
+    // Keys with any bytes, and many requests around the end of the rings
+    const char *bin_keys[] = {"a\0b", "a\0c"};
+    int lens[] = {3, 3};
+    fail_unless(bloomd_shm_set_many(shm, "shm1", bin_keys, lens, 1, results) == BLOOMD_OK);
+    fail_unless(bloomd_shm_check_many(shm, "shm1", bin_keys, lens, 2, results) == BLOOMD_OK);
+    fail_unless(results[0] == 1 && results[1] == 0);
+    bloomd_shm_close(shm);
+
+    fail_unless(bloomd_shm_connect("/tmp/test_shm.sock", 1000, &shm) == BLOOMD_OK);
+    char key[32];
+    const char *one[] = {key};
+    for (int i=0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(bloomd_shm_set_many(shm, "shm1", one, NULL, 1, results) == BLOOMD_OK);
+        fail_unless(bloomd_shm_check_many(shm, "shm1", one, NULL, 1, results) == BLOOMD_OK);
+        fail_unless(results[0] == 1);
+    }
+
+    // A batch larger than the rings is refused by the client
+    int num = 20000;
+    const char **many = malloc(num * sizeof(char*));
+    char *big = malloc(num);
+    for (int i=0; i < num; i++) many[i] = "abc";
+    fail_unless(bloomd_shm_check_many(shm, "shm1", many, NULL, num, big) == BLOOMD_ERR_ARGS);
+    free(many);
+    free(big);
+    bloomd_shm_close(shm);
+
+    should_run = 0;
+    pthread_join(t, NULL);
+    fail_unless(filtmgr_drop_filter(mgr, "shm1") == 0);
+    fail_unless(destroy_filter_manager(mgr) == 0);
+    rmdir(config.data_dir);
+}
+END_TEST
@@ -0,0 +1,120 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "config.h"
+#include "tls.h"
+
+#define TLS_TEST_CERT "/tmp/bloomd_tls_cert.pem"
+#define TLS_TEST_KEY "/tmp/bloomd_tls_key.pem"
+
+/**
+ * Writes a self-signed certificate and its key
+ */
+static void tls_test_make_cert(void) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    fail_unless(key != NULL);
+    X509 *cert = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char*)"bloomd", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    fail_unless(X509_sign(cert, key, EVP_sha256()) > 0);
+
+    FILE *f = fopen(TLS_TEST_CERT, "w");
+    PEM_write_X509(f, cert);
+    fclose(f);
+    f = fopen(TLS_TEST_KEY, "w");
+    PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+    fclose(f);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+START_TEST(test_tls_init_missing)
+{
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.tls_cert_file = "/tmp/bloomd_tls_missing.pem";
+    config.tls_key_file = "/tmp/bloomd_tls_missing.pem";
+    bloom_tls *tls;
+    fail_unless(init_tls(&config, &tls) == -1);
+}
+END_TEST
+
+START_TEST(test_tls_roundtrip)
+{
+    tls_test_make_cert();
+    bloom_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.tls_cert_file = TLS_TEST_CERT;
+    config.tls_key_file = TLS_TEST_KEY;
+    bloom_tls *tls;
+    fail_unless(init_tls(&config, &tls) == 0);
+
+    int fds[2];
+    fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    bloom_tls_conn *server = tls_new_conn(tls, fds[0]);
+    fail_unless(server != NULL);
+
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL *client = SSL_new(client_ctx);
+    SSL_set_fd(client, fds[1]);
+    SSL_set_connect_state(client);
+
+    // Both sides are non-blocking, so take turns
+    int server_res = 1, client_done = 0;
+    for (int i=0; i < 100 && (server_res || !client_done); i++) {
+        if (!client_done) client_done = SSL_do_handshake(client) == 1;
+        if (server_res) server_res = tls_handshake(server);
+        fail_unless(server_res >= 0);
+    }
+    fail_unless(tls_handshake_done(server));
+    fail_unless(tls_offloaded(server) == 0);
+
+    // Nothing to read yet
+    char buf[64];
+    struct iovec in = {buf, sizeof(buf)};
+    fail_unless(tls_readv(server, &in, 1) == -1);
+    fail_unless(errno == EAGAIN);
+
+    // A command split over two vectors
+    fail_unless(SSL_write(client, "c foo bar\n", 10) == 10);
+    char first[4], second[16];
+    struct iovec split[2] = {{first, sizeof(first)}, {second, sizeof(second)}};
+    fail_unless(tls_readv(server, split, 2) == 10);
+    fail_unless(memcmp(first, "c fo", 4) == 0);
+    fail_unless(memcmp(second, "o bar\n", 6) == 0);
+
+    // Responses gathered from several vectors
+    struct iovec out[3] = {{"Yes", 3}, {" ", 1}, {"No\n", 3}};
+    fail_unless(tls_writev(server, out, 3) == 7);
+    int len = 0, ret;
+    while (len < 7 && (ret = SSL_read(client, buf + len, sizeof(buf) - len)) > 0) len += ret;
+    fail_unless(len == 7);
+    fail_unless(memcmp(buf, "Yes No\n", 7) == 0);
+
+    // A close is the end of the stream
+    SSL_shutdown(client);
+    fail_unless(tls_readv(server, &in, 1) == 0);
+
+    tls_free_conn(server);
+    SSL_free(client);
+    SSL_CTX_free(client_ctx);
+    close(fds[0]);
+    close(fds[1]);
+    destroy_tls(tls);
+    unlink(TLS_TEST_CERT);
+    unlink(TLS_TEST_KEY);
+}
+END_TEST
@@ -0,0 +1,54 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include "tokenize.h"
+
+START_TEST(test_tokenize_keys)
+{
+    char buf[] = "foo  bar baz ";
+    char *keys[8];
+    int lens[8];
+    int offset = 0;
+
+    // Runs of spaces are one separator
+    int num = tokenize_keys(buf, strlen(buf), &offset, keys, lens, 8);
+    fail_unless(num == 3);
+    fail_unless(strcmp(keys[0], "foo") == 0 && lens[0] == 3);
+    fail_unless(strcmp(keys[1], "bar") == 0 && lens[1] == 3);
+    fail_unless(strcmp(keys[2], "baz") == 0 && lens[2] == 3);
+
+    // Nothing is left
+    num = tokenize_keys(buf, sizeof(buf) - 1, &offset, keys, lens, 8);
+    fail_unless(num == 0);
+
+    // The keys end at a null terminator
+    char empty[] = "";
+    offset = 0;
+    fail_unless(tokenize_keys(empty, 0, &offset, keys, lens, 8) == 0);
+}
+END_TEST
+
+START_TEST(test_tokenize_keys_batches)
+{
+    // Keys of every length, crossing the blocks
+    char buf[4096];
+    int len = 0, total = 0;
+    for (int i=0; len < 4000; i++, total++)
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%d%.*s",
+                (i % 7 == 0) ? "  " : " ", i, i % 23, "xxxxxxxxxxxxxxxxxxxxxxx");
+
+    char *keys[32];
+    int lens[32];
+    int offset = 0, num, seen = 0;
+    char expect[64];
+    do {
+        num = tokenize_keys(buf, len, &offset, keys, lens, 32);
+        for (int j=0; j < num; j++, seen++) {
+            int n = snprintf(expect, sizeof(expect), "%d%.*s", seen, seen % 23, "xxxxxxxxxxxxxxxxxxxxxxx");
+            fail_unless(lens[j] == n);
+            fail_unless(strcmp(keys[j], expect) == 0);
+        }
+    } while (num == 32);
+    fail_unless(seen == total);
+}
+END_TEST
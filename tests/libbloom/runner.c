@@ -4,6 +4,10 @@
 #include "test_bitmap.c"
 #include "test_bloom.c"
 #include "test_sbf.c"
+#include "test_block.c"
+#include "test_compress.c"
+#include "test_xor.c"
+#include "test_quotient.c"
 
 int main(void)
 {
@@ -11,12 +15,17 @@ int main(void)
     TCase *tc1 = tcase_create("Bitmap");
     TCase *tc2 = tcase_create("Bloom");
     TCase *tc3 = tcase_create("SBF");
+    TCase *tc4 = tcase_create("Block");
+    TCase *tc5 = tcase_create("Compress");
+    TCase *tc6 = tcase_create("Xor");
+    TCase *tc7 = tcase_create("Quotient");
     SRunner *sr = srunner_create(s1);
     int nf;
 
     // Add the bitmap tests
     suite_add_tcase(s1, tc1);
     tcase_add_test(tc1, make_anonymous_bitmap);
+    tcase_add_test(tc1, make_anonymous_bitmap_hugepages);
     tcase_add_test(tc1, make_bitmap_zero_size);
     tcase_add_test(tc1, make_bitmap_bad_fileno);
     tcase_add_test(tc1, make_bitmap_bad_fileno_persistent);
@@ -24,6 +33,7 @@ int main(void)
     tcase_add_test(tc1, make_bitmap_nofile_persistent);
     tcase_add_test(tc1, make_bitmap_nofile_create);
     tcase_add_test(tc1, make_bitmap_nofile_create_persistent);
+    tcase_add_test(tc1, make_bitmap_sparse_persistent);
 
     tcase_add_test(tc1, flush_bitmap_anonymous);
     tcase_add_test(tc1, flush_bitmap_file);
@@ -50,11 +60,32 @@ int main(void)
     tcase_add_test(tc1, setbit_bitmap_anonymous_one);
     tcase_add_test(tc1, setbit_bitmap_file_one);
     tcase_add_test(tc1, setbit_bitmap_file_persist_one);
+    tcase_add_test(tc1, setbit_bitmap_persist_concurrent);
 
     tcase_add_test(tc1, flush_does_write);
     tcase_add_test(tc1, close_does_flush);
     tcase_add_test(tc1, flush_does_write_persist);
+    tcase_add_test(tc1, write_does_write_persist);
+    tcase_add_test(tc1, flush_does_write_direct);
+    tcase_add_test(tc1, make_bitmaps_at_offsets);
+    tcase_add_test(tc1, make_shared_bitmap_warmup);
+    tcase_add_test(tc1, demote_persistent_bitmap);
+    tcase_add_test(tc1, seal_persistent_bitmap);
+    tcase_add_test(tc1, flush_does_write_persist_scattered);
+    tcase_add_test(tc1, flush_does_write_shared_scattered);
+    tcase_add_test(tc1, snapshot_copies_changed_pages);
     tcase_add_test(tc1, close_does_flush_persist);
+    tcase_add_test(tc1, flush_does_write_persist_hugepages);
+    tcase_add_test(tc1, numa_place_anonymous_bitmap);
+    tcase_add_test(tc1, shared_read_only_bitmap);
+    tcase_add_test(tc1, bitmap_popcount_ranges);
+    tcase_add_test(tc1, persist_flush_keeps_sparse);
+    tcase_add_test(tc1, persist_page_checksums);
+    tcase_add_test(tc1, resident_anonymous_bitmap);
+    tcase_add_test(tc1, dirty_bytes_bitmap);
+    tcase_add_test(tc1, reclaim_bitmap);
+    tcase_add_test(tc1, lock_bitmap);
+    tcase_add_test(tc1, track_bitmap_changes);
 
     // Add the bloom tests
     suite_add_tcase(s1, tc2);
@@ -64,18 +95,30 @@ int main(void)
     tcase_add_test(tc2, bloom_filter_header_size);
     tcase_add_test(tc2, make_bf_fresh_then_restore);
     tcase_add_test(tc2, test_bf_value_sanity);
+    tcase_add_test(tc2, make_bf_blocked_then_restore);
+    tcase_add_test(tc2, make_bf_bad_layout);
+    tcase_add_test(tc2, make_bf_murmur_then_restore);
+    tcase_add_test(tc2, make_bf_multiply_then_restore);
+    tcase_add_test(tc2, make_bf_counting_remove);
+    tcase_add_test(tc2, make_bf_aging_expire);
 
     tcase_add_test(tc2, test_size_for_capacity_prob);
     tcase_add_test(tc2, test_fp_prob_for_capacity_size);
     tcase_add_test(tc2, test_capacity_for_size_prob);
     tcase_add_test(tc2, test_ideal_k_num);
     tcase_add_test(tc2, test_params_for_capacity);
+    tcase_add_test(tc2, test_params_for_capacity_blocked);
+    tcase_add_test(tc2, test_params_for_capacity_max_k);
 
     tcase_add_test(tc2, test_hashes_basic);
     tcase_add_test(tc2, test_hashes_one_byte);
     tcase_add_test(tc2, test_hashes_consistent);
     tcase_add_test(tc2, test_hashes_key_length);
     tcase_add_test(tc2, test_hashes_same_buffer);
+    tcase_add_test(tc2, test_hashes_murmur_scheme);
+    tcase_add_test(tc2, test_hashed_key_reuse);
+    tcase_add_test(tc2, test_hashed_key_from_hash);
+    tcase_add_test(tc2, test_bf_contains_many);
 
     tcase_add_test(tc2, test_add_with_check);
     tcase_add_test(tc2, test_length);
@@ -87,13 +130,33 @@ int main(void)
 
     tcase_add_test(tc2, test_bf_fp_prob);
     tcase_add_test(tc2, test_bf_fp_prob_extended);
+    tcase_add_test(tc2, test_bf_blocked_fp_prob);
+    tcase_add_test(tc2, test_bf_murmur_fp_prob);
+    tcase_add_test(tc2, test_crc_hash_kernels);
+    tcase_add_test(tc2, test_crc32c_kernels);
+    tcase_add_test(tc2, test_bf_crc_then_restore);
+    tcase_add_test(tc2, test_short_hash);
+    tcase_add_test(tc2, test_bf_short_then_restore);
+    tcase_add_test(tc2, test_bf_multiply_fp_prob);
+    tcase_add_test(tc2, test_bf_counting_fp_prob);
 
     tcase_add_test(tc2, test_bf_shared_compatible_persist);
+    tcase_add_test(tc2, test_bf_unrolled_probes);
+    tcase_add_test(tc2, test_bf_merge);
+    tcase_add_test(tc2, test_bf_merge_bytes);
+    tcase_add_test(tc2, test_bf_fill);
+    tcase_add_test(tc2, test_bf_sparse);
+    tcase_add_test(tc2, test_bf_fold);
 
     // Add the sbf tests
     suite_add_tcase(s1, tc3);
     tcase_add_test(tc3, sbf_initial_size);
     tcase_add_test(tc3, sbf_add_filter);
+    tcase_add_test(tc3, sbf_try_add_no_grow);
+    tcase_add_test(tc3, sbf_try_add_sparse);
+    tcase_add_test(tc3, sbf_remove_counting);
+    tcase_add_test(tc3, sbf_age_refresh);
+    tcase_add_test(tc3, sbf_add_many_grow);
     tcase_add_test(tc3, sbf_add_filter_2);
     tcase_add_test(tc3, sbf_callback);
     tcase_add_test(tc3, test_sbf_double_close);
@@ -101,6 +164,45 @@ int main(void)
     tcase_add_test(tc3, test_sbf_flush);
     tcase_add_test(tc3, test_sbf_close_does_flush);
     tcase_add_test(tc3, sbf_fp_prob);
+    tcase_add_test(tc3, sbf_layer_params_grow);
+    tcase_add_test(tc3, sbf_check_order_hits);
+    tcase_add_test(tc3, sbf_summary_rejects);
+    tcase_add_test(tc3, sbf_contains_hashed_keys);
+    tcase_add_test(tc3, sbf_many_key_lens);
+    tcase_add_test(tc3, sbf_merge_layers);
+    tcase_add_test(tc3, sbf_fill_layers);
+    tcase_add_test(tc3, sbf_capped_growth);
+    tcase_add_test(tc3, sbf_cached_totals);
+
+    // Add the block tests
+    suite_add_tcase(s1, tc4);
+    tcase_add_test(tc4, block_mask_bit_order);
+    tcase_add_test(tc4, block_test_kernels_agree);
+    tcase_add_test(tc4, block_set_persist);
+
+    // Add the compress tests
+    suite_add_tcase(s1, tc5);
+    tcase_add_test(tc5, compress_roundtrip);
+    tcase_add_test(tc5, compress_corrupt);
+
+    // Add the xor filter tests
+    suite_add_tcase(s1, tc6);
+    tcase_add_test(tc6, xor_header_size);
+    tcase_add_test(tc6, xor_unique_hashes);
+    tcase_add_test(tc6, xor_bad_args);
+    tcase_add_test(tc6, xor_build_contains);
+    tcase_add_test(tc6, xor_contains_many);
+    tcase_add_test(tc6, xor_build_empty);
+
+    // Add the quotient filter tests
+    suite_add_tcase(s1, tc7);
+    tcase_add_test(tc7, test_qf_header_size);
+    tcase_add_test(tc7, test_qf_bad_args);
+    tcase_add_test(tc7, test_qf_add_contains);
+    tcase_add_test(tc7, test_qf_add_full);
+    tcase_add_test(tc7, test_qf_contains_many);
+    tcase_add_test(tc7, test_qf_resize);
+    tcase_add_test(tc7, test_qf_union_intersect);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
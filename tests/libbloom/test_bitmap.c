@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include "bitmap.h"
 
 /*
@@ -84,6 +85,35 @@ START_TEST(make_bitmap_nofile_create_persistent)
 }
 END_TEST
 
+START_TEST(make_bitmap_sparse_persistent)
+{
+    // Data around holes, spanning several fill chunks
+    uint64_t len = 12 * 1024 * 1024;
+    uint64_t offsets[] = {0, 4096 * 3, 5 * 1024 * 1024 + 7, len - 1};
+    int fh = open("/tmp/mmap_sparse_persist", O_RDWR|O_CREAT|O_TRUNC, 0644);
+    fail_unless(fh >= 0);
+    fail_unless(ftruncate(fh, len) == 0);
+    for (int i=0; i < 4; i++) {
+        unsigned char val = 0x10 + i;
+        fail_unless(pwrite(fh, &val, 1, offsets[i]) == 1);
+    }
+
+    bloom_bitmap map;
+    int res = bitmap_from_file(fh, len, PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int i=0; i < 4; i++) {
+        fail_unless(map.mmap[offsets[i]] == 0x10 + i);
+        map.mmap[offsets[i]] = 0;
+    }
+    for (uint64_t i=0; i < len; i++) {
+        if (map.mmap[i]) fail("unexpected byte at %llu", (unsigned long long)i);
+    }
+
+    fail_unless(bitmap_close(&map) == 0);
+    close(fh);
+    unlink("/tmp/mmap_sparse_persist");
+}
+END_TEST
 
 /*
  * int bitmap_flush(bloom_bitmap *map) {
@@ -344,6 +374,45 @@ START_TEST(setbit_bitmap_file_persist_one)
 END_TEST
 
 
+static void* setbit_thread(void *in) {
+    // Each thread sets every 4th bit, starting at its offset
+    void **args = in;
+    bloom_bitmap *map = args[0];
+    uintptr_t offset = (uintptr_t)args[1];
+    for (uint64_t idx = offset; idx < 4096*8 ; idx += 4) {
+        bitmap_setbit(map, idx);
+    }
+    return NULL;
+}
+
+START_TEST(setbit_bitmap_persist_concurrent)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_setbit_conc", 4096, 1,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+
+    // Interleave the writers, so they all race on the same words
+    pthread_t threads[4];
+    void *args[4][2];
+    for (uintptr_t i = 0; i < 4; i++) {
+        args[i][0] = &map;
+        args[i][1] = (void*)i;
+        fail_unless(pthread_create(&threads[i], NULL, setbit_thread, args[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int idx = 0; idx < 4096; idx++) {
+        fail_unless(map.mmap[idx] == 255);
+    }
+    fail_unless(map.dirty_pages[0] == 128);
+    unlink("/tmp/persist_setbit_conc");
+}
+END_TEST
+
+
 /**
  * Test that flush does indeed write to disk
  */
@@ -407,6 +476,268 @@ START_TEST(flush_does_write_persist) {
 }
 END_TEST
 
+START_TEST(make_shared_bitmap_warmup) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/shared_warmup", 8192 * 4, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 8192*8; idx < 8192*8*2 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Every warm-up sees the same data
+    bitmap_mode modes[] = {SHARED, SHARED | POPULATE, SHARED | NO_READAHEAD, SHARED | READ_ONLY | POPULATE};
+    for (int i=0; i < 4; i++) {
+        res = bitmap_from_filename("/tmp/shared_warmup", 8192 * 4, 0, modes[i], &map);
+        fail_unless(res == 0);
+        fail_unless(map.mode == SHARED);
+        for (int idx = 0; idx < 8192 * 4; idx++) {
+            fail_unless(map.mmap[idx] == ((idx >= 8192 && idx < 8192 * 2) ? 255 : 0));
+        }
+        fail_unless(bitmap_close(&map) == 0);
+    }
+    unlink("/tmp/shared_warmup");
+}
+END_TEST
+
+START_TEST(demote_persistent_bitmap) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_demote", 8192 * 4, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 8192*8; idx < 8192*8*2 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+
+    // The bits set in memory are written out and kept
+    unsigned char *addr = map.mmap;
+    fail_unless(bitmap_demote(&map) == 0);
+    fail_unless(map.mode == SHARED);
+    fail_unless(map.mmap == addr);
+    for (int idx = 0; idx < 8192 * 4; idx++) {
+        fail_unless(map.mmap[idx] == ((idx >= 8192 && idx < 8192 * 2) ? 255 : 0));
+    }
+    fail_unless(bitmap_demote(&map) == -EINVAL);
+
+    // Later sets go through the page cache
+    bitmap_setbit((&map), 0);
+    fail_unless(bitmap_close(&map) == 0);
+    res = bitmap_from_filename("/tmp/persist_demote", 8192 * 4, 0, PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&map), 0) == 1);
+    fail_unless(map.mmap[8192] == 255);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/persist_demote");
+}
+END_TEST
+
+START_TEST(seal_persistent_bitmap) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_seal", 8192 * 4, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+    for (int idx = 8192*8; idx < 8192*8*2 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+
+    // Sealing writes the bitmap out, and drops the dirty tracking
+    fail_unless(bitmap_seal(&map) == 0);
+    fail_unless(map.sealed == 1);
+    fail_unless(map.dirty_pages == NULL);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_getbit((&map), 8192*8) == 1);
+
+    // Sealed bitmaps stay sealed on the page cache
+    fail_unless(bitmap_demote(&map) == 0);
+    fail_unless(map.sealed == 1);
+    fail_unless(map.mmap[8192] == 255);
+
+    // Unsealed bitmaps can be written again
+    fail_unless(bitmap_unseal(&map) == 0);
+    fail_unless(map.sealed == 0);
+    bitmap_setbit((&map), 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_seal", 8192 * 4, 0, PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_getbit((&map), 0) == 1);
+    fail_unless(map.mmap[8192] == 255);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/persist_seal");
+
+    // Anonymous bitmaps have nothing to seal
+    res = bitmap_from_file(-1, 8192, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_seal(&map) == -EINVAL);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(flush_does_write_direct) {
+    // Two whole pages and a partial one, which is not written directly
+    uint64_t len = 8192 + 100;
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_direct", len, 1, PERSISTENT | DIRECT_IO, &map);
+    fail_unless(res == 0);
+    for (uint64_t idx = 4096*8; idx < len*8 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_flush(&map) == 0);
+
+    struct stat buf;
+    fail_unless(stat("/tmp/persist_flush_direct", &buf) == 0);
+    fail_unless((uint64_t)buf.st_size == len);
+
+    bloom_bitmap map2;
+    res = bitmap_from_filename("/tmp/persist_flush_direct", len, 0, PERSISTENT, &map2);
+    fail_unless(res == 0);
+    fail_unless(map2.direct_fd == -1);
+    for (uint64_t idx = 0; idx < len; idx++) {
+        fail_unless(map2.mmap[idx] == ((idx < 4096) ? 0 : 255));
+    }
+    bitmap_close(&map2);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(map.direct_fd == -1);
+    unlink("/tmp/persist_flush_direct");
+}
+END_TEST
+
+START_TEST(make_bitmaps_at_offsets) {
+    int fd = open("/tmp/bitmap_pack", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    fail_unless(fd >= 0);
+    fail_unless(ftruncate(fd, 4096 + 8192 * 2) == 0);
+
+    // Offsets must be page aligned
+    bloom_bitmap first, second, bad;
+    int res = bitmap_from_file_at(fd, NULL, 100, 8192, PERSISTENT, &bad);
+    fail_unless(res == -EINVAL);
+
+    // The bitmaps share the descriptor
+    res = bitmap_from_file_at(fd, NULL, 4096, 8192, SHARED | NEW_BITMAP, &first);
+    fail_unless(res == 0);
+    res = bitmap_from_file_at(fd, &first, 4096 + 8192, 8192, PERSISTENT | NEW_BITMAP, &second);
+    fail_unless(res == 0);
+    fail_unless(first.fileno == fd && second.fileno == fd);
+    fail_unless(first.file_refs == second.file_refs && *first.file_refs == 2);
+    for (int idx = 0; idx < 8; idx++) {
+        bitmap_setbit((&first), idx);
+        bitmap_setbit((&second), 8192*8 - idx - 1);
+    }
+    fail_unless(bitmap_flush(&first) == 0);
+    fail_unless(bitmap_flush(&second) == 0);
+
+    // Each bitmap is written to its own range
+    unsigned char c;
+    fail_unless(pread(fd, &c, 1, 0) == 1 && c == 0);
+    fail_unless(pread(fd, &c, 1, 4096) == 1 && c == 255);
+    fail_unless(pread(fd, &c, 1, 4096 + 8191) == 1 && c == 0);
+    fail_unless(pread(fd, &c, 1, 4096 + 8192 * 2 - 1) == 1 && c == 255);
+
+    // The last bitmap closes the descriptor
+    fail_unless(bitmap_close(&first) == 0);
+    fail_unless(fcntl(fd, F_GETFD) != -1);
+    bloom_bitmap reread;
+    res = bitmap_from_file_at(fd, &second, 4096, 8192, PERSISTENT, &reread);
+    fail_unless(res == 0);
+    fail_unless(reread.mmap[0] == 255 && reread.mmap[1] == 0);
+    fail_unless(bitmap_close(&second) == 0);
+    fail_unless(bitmap_close(&reread) == 0);
+    fail_unless(fcntl(fd, F_GETFD) == -1);
+    unlink("/tmp/bitmap_pack");
+}
+END_TEST
+
+START_TEST(write_does_write_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_write_nosync", 8192, 1, PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    for (int idx = 4096*8; idx < 8192*8 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_write(&map) == 0);
+
+    // The pages are in the file, and there is nothing left to flush
+    bloom_bitmap map2;
+    res = bitmap_from_filename("/tmp/persist_write_nosync", 8192, 0,
+            PERSISTENT, &map2);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 8192; idx++) {
+        fail_unless(map2.mmap[idx] == ((idx < 4096) ? 0 : 255));
+    }
+    fail_unless(map.dirty_pages[0] == 0);
+    fail_unless(bitmap_flush(&map) == 0);
+    bitmap_close(&map2);
+    bitmap_close(&map);
+    unlink("/tmp/persist_write_nosync");
+}
+END_TEST
+
+START_TEST(flush_does_write_persist_scattered) {
+    // 40 pages and a partial one, dirty some runs and gaps
+    uint64_t size = 40 * 4096 + 100;
+    int dirty[] = {0, 1, 2, 5, 11, 12, 30, 40};
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_scattered", size, 1, PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    for (int i = 0; i < 8; i++) {
+        bitmap_setbit((&map), dirty[i] * 4096 * 8 + 7);
+    }
+    fail_unless(bitmap_flush(&map) == 0);
+    for (uint64_t i = 0; i < 6; i++) {
+        fail_unless(map.dirty_pages[i] == 0);
+    }
+
+    bloom_bitmap map2;
+    res = bitmap_from_filename("/tmp/persist_flush_scattered", size, 0,
+            PERSISTENT, &map2);
+    fail_unless(res == 0);
+    for (uint64_t idx = 0; idx < size; idx++) {
+        int expected = 0;
+        for (int i = 0; i < 8; i++) {
+            if (idx == (uint64_t)dirty[i] * 4096) expected = 1;
+        }
+        fail_unless(map2.mmap[idx] == expected);
+    }
+    bitmap_close(&map);
+    bitmap_close(&map2);
+    unlink("/tmp/persist_flush_scattered");
+}
+END_TEST
+
+START_TEST(flush_does_write_shared_scattered) {
+    // SHARED tracks dirty pages and only syncs those runs
+    uint64_t size = 40 * 4096 + 100;
+    int dirty[] = {0, 3, 17, 40};
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/mmap_flush_scattered", size, 1, SHARED, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(map.dirty_pages != NULL);
+    for (int i = 0; i < 4; i++) {
+        bitmap_setbit((&map), dirty[i] * 4096 * 8);
+    }
+    fail_unless(map.dirty_pages[0] == 0x90);
+    fail_unless(bitmap_flush(&map) == 0);
+    for (uint64_t i = 0; i < 6; i++) {
+        fail_unless(map.dirty_pages[i] == 0);
+    }
+
+    // Flushing a clean map is a no-op
+    fail_unless(bitmap_flush(&map) == 0);
+
+    bloom_bitmap map2;
+    res = bitmap_from_filename("/tmp/mmap_flush_scattered", size, 0,
+            PERSISTENT, &map2);
+    fail_unless(res == 0);
+    for (int i = 0; i < 4; i++) {
+        fail_unless(map2.mmap[dirty[i] * 4096] == 128);
+    }
+    bitmap_close(&map);
+    bitmap_close(&map2);
+    unlink("/tmp/mmap_flush_scattered");
+}
+END_TEST
+
 START_TEST(close_does_flush_persist) {
     bloom_bitmap map;
     int res = bitmap_from_filename("/tmp/persist_close_flush", 4096, 1,
@@ -428,3 +759,386 @@ START_TEST(close_does_flush_persist) {
 }
 END_TEST
 
+
+START_TEST(make_anonymous_bitmap_hugepages)
+{
+    // Works whether or not hugepages are available
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 3*1024*1024 + 100, ANONYMOUS | HUGEPAGES, &map);
+    fail_unless(res == 0);
+    fail_unless(map.mode == ANONYMOUS);
+    fail_unless(map.size == 3*1024*1024 + 100);
+    fail_unless(map.mapped_size >= map.size);
+
+    bitmap_setbit((&map), 8 * map.size - 1);
+    fail_unless(bitmap_getbit((&map), 8 * map.size - 1) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(flush_does_write_persist_hugepages) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_flush_huge", 8192, 1,
+            PERSISTENT | HUGEPAGES, &map);
+    fail_unless(res == 0);
+    fail_unless(map.mode == PERSISTENT);
+    for (int idx = 4096*8; idx < 8192*8 ; idx++) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(map.dirty_pages[0] == 64);
+    fail_unless(bitmap_close(&map) == 0);
+
+    bloom_bitmap map2;
+    res = bitmap_from_filename("/tmp/persist_flush_huge", 8192, 0,
+            PERSISTENT | HUGEPAGES, &map2);
+    fail_unless(res == 0);
+    for (int idx = 0; idx < 8192; idx++) {
+        fail_unless(map2.mmap[idx] == ((idx < 4096) ? 0 : 255));
+    }
+    fail_unless(bitmap_close(&map2) == 0);
+    unlink("/tmp/persist_flush_huge");
+}
+END_TEST
+
+START_TEST(snapshot_copies_changed_pages) {
+    uint64_t size = 16 * 4096;
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, size, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 7);
+    fail_unless(bitmap_snapshot_copy(&map, -1, 1) == -EINVAL);
+    fail_unless(bitmap_snapshot_begin(&map) == 0);
+
+    int fd = open("/tmp/bitmap_snapshot", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    fail_unless(fd >= 0);
+    fail_unless(ftruncate(fd, size) == 0);
+    fail_unless(bitmap_snapshot_copy(&map, fd, 1) == 1);
+
+    // Only the changed pages are copied again
+    fail_unless(bitmap_snapshot_copy(&map, fd, 0) == 0);
+    bitmap_setbit((&map), 3 * 4096 * 8);
+    bitmap_setbit((&map), 12 * 4096 * 8);
+    fail_unless(bitmap_snapshot_copy(&map, fd, 0) == 2);
+    fail_unless(bitmap_snapshot_copy(&map, fd, 0) == 0);
+    bitmap_snapshot_end(&map);
+    fail_unless(map.snap_pages == NULL);
+
+    unsigned char buf[16 * 4096];
+    fail_unless(pread(fd, buf, size, 0) == (ssize_t)size);
+    fail_unless(memcmp(buf, map.mmap, size) == 0);
+    fail_unless(buf[3 * 4096] == 128);
+    close(fd);
+    bitmap_close(&map);
+    unlink("/tmp/bitmap_snapshot");
+}
+END_TEST
+
+START_TEST(numa_place_anonymous_bitmap)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 1024*1024, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 100);
+
+    // Every machine has a node 0, and interleaving over
+    // a single node keeps the pages where they are
+    fail_unless(bitmap_numa_place(&map, 0, 1) == 0);
+    fail_unless(bitmap_numa_place(&map, -1, 1) == 0);
+    fail_unless(bitmap_numa_place(&map, 1, 1) == -EINVAL);
+    fail_unless(bitmap_numa_place(&map, 0, BITMAP_MAX_NUMA_NODES + 1) == -EINVAL);
+    fail_unless(bitmap_getbit((&map), 100) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(shared_read_only_bitmap)
+{
+    bloom_bitmap writer;
+    int res = bitmap_from_filename("/tmp/shared_read_only", 8192, 1,
+            SHARED, &writer);
+    fail_unless(res == 0);
+    bitmap_setbit((&writer), 10);
+
+    bloom_bitmap reader;
+    res = bitmap_from_filename("/tmp/shared_read_only", 8192, 0,
+            SHARED | READ_ONLY, &reader);
+    fail_unless(res == 0);
+    fail_unless(reader.mode == SHARED);
+    fail_unless(reader.dirty_pages == NULL);
+    fail_unless(bitmap_getbit((&reader), 10) == 1);
+
+    // Sets of the writer are seen through the shared mapping
+    bitmap_setbit((&writer), 5000 * 8);
+    fail_unless(bitmap_getbit((&reader), 5000 * 8) == 1);
+    fail_unless(bitmap_flush(&reader) == 0);
+    fail_unless(bitmap_close(&reader) == 0);
+    fail_unless(bitmap_close(&writer) == 0);
+
+    // Only shared maps of existing files can be read-only
+    res = bitmap_from_filename("/tmp/shared_read_only", 8192, 0,
+            PERSISTENT | READ_ONLY, &reader);
+    fail_unless(res == -EINVAL);
+    res = bitmap_from_filename("/tmp/shared_read_only", 8192, 1,
+            SHARED | READ_ONLY, &reader);
+    fail_unless(res == -EINVAL);
+    unlink("/tmp/shared_read_only");
+}
+END_TEST
+
+START_TEST(bitmap_popcount_ranges)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 8192, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_popcount(&map, 0, 8192) == 0);
+
+    for (int i=0; i < 8192 * 8; i += 7) bitmap_setbit((&map), i);
+    uint64_t expected = (8192 * 8 + 6) / 7;
+    fail_unless(bitmap_popcount(&map, 0, 8192) == expected);
+
+    // Ranges that do not end on a word, or run past the end
+    fail_unless(bitmap_popcount(&map, 0, 3) == 4);
+    fail_unless(bitmap_popcount(&map, 1, 8192) == expected - 2);
+    fail_unless(bitmap_popcount(&map, 8192, 10) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(persist_flush_keeps_sparse)
+{
+    uint64_t size = 256 * 4096;
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_sparse", size, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+
+    // Only the pages that were set are written
+    for (int idx = 0; idx < 4096*8; idx++) {
+        bitmap_setbit((&map), 100*4096*8 + idx);
+    }
+    fail_unless(bitmap_flush(&map) == 0);
+    struct stat buf;
+    fail_unless(stat("/tmp/persist_sparse", &buf) == 0);
+    fail_unless((uint64_t)buf.st_size == size);
+    fail_unless(buf.st_blocks * 512 < 16 * 4096);
+    fail_unless(buf.st_blocks > 0);
+
+    // A cleared page is punched out again
+    for (int idx = 0; idx < 4096; idx++) {
+        map.mmap[100*4096 + idx] = 0;
+    }
+    bitmap_dirtybit((&map), 100*4096*8);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(stat("/tmp/persist_sparse", &buf) == 0);
+    fail_unless((uint64_t)buf.st_size == size);
+    fail_unless(buf.st_blocks == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // A shared map counts the holes as empty
+    res = bitmap_from_filename("/tmp/persist_sparse", size, 0, SHARED, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_popcount(&map, 0, size) == 0);
+    bitmap_setbit((&map), 200*4096*8 + 5);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_popcount(&map, 0, size) == 1);
+    fail_unless(bitmap_popcount(&map, 0, 200*4096) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/persist_sparse");
+}
+END_TEST
+
+START_TEST(persist_page_checksums)
+{
+    uint64_t size = 16 * 4096 + 100;
+    bloom_bitmap map;
+    unlink("/tmp/persist_crc");
+    unlink("/tmp/persist_crc.crc");
+    int res = bitmap_from_filename("/tmp/persist_crc", size, 1, PERSISTENT | CHECKSUMS, &map);
+    fail_unless(res == 0);
+    fail_unless(map.crcs != NULL);
+
+    // A new file is all zero pages, which all match
+    uint64_t bad;
+    fail_unless(bitmap_verify(&map, 0, 100, &bad) == 17);
+    fail_unless(bad == 0);
+    bitmap_setbit((&map), 3*4096*8 + 9);
+    bitmap_setbit((&map), 16*4096*8 + 9);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    res = bitmap_from_filename("/tmp/persist_crc", size, 0, PERSISTENT | CHECKSUMS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_verify(&map, 0, 17, &bad) == 17);
+    fail_unless(bad == 0);
+    fail_unless(bitmap_verify(&map, 17, 1, &bad) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Damage a page behind the back of the bitmap
+    int fd = open("/tmp/persist_crc", O_RDWR);
+    fail_unless(fd >= 0);
+    char c = 0x40;
+    fail_unless(pwrite(fd, &c, 1, 5*4096 + 12) == 1);
+    close(fd);
+    res = bitmap_from_filename("/tmp/persist_crc", size, 0, PERSISTENT | CHECKSUMS, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_verify(&map, 0, 17, &bad) == 17);
+    fail_unless(bad == 1);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Without checksums there is nothing to verify
+    res = bitmap_from_filename("/tmp/persist_crc", size, 0, PERSISTENT, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_verify(&map, 0, 17, &bad) == -EINVAL);
+    fail_unless(bitmap_close(&map) == 0);
+
+    fail_unless(bitmap_unlink("/tmp/persist_crc") == 0);
+    struct stat buf;
+    fail_unless(stat("/tmp/persist_crc", &buf) == -1);
+    fail_unless(stat("/tmp/persist_crc.crc", &buf) == -1);
+}
+END_TEST
+
+START_TEST(resident_anonymous_bitmap)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 1024*1024, ANONYMOUS, &map);
+    fail_unless(res == 0);
+
+    // Pages become resident as they are written
+    uint64_t resident;
+    for (int i=0; i < 16; i++) bitmap_setbit((&map), i * 4096 * 8);
+    fail_unless(bitmap_resident(&map, &resident) == 0);
+    fail_unless(resident >= 16 * 4096);
+    fail_unless(resident <= 1024*1024);
+
+    memset(map.mmap, 0xff, map.size);
+    fail_unless(bitmap_resident(&map, &resident) == 0);
+    fail_unless(resident == 1024*1024);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(dirty_bytes_bitmap)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/mmap_dirty_bytes", 10000, 1, SHARED, &map);
+    fail_unless(res == 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+
+    // Each page is counted once, the last is partial
+    bitmap_setbit((&map), 1);
+    bitmap_setbit((&map), 2);
+    fail_unless(bitmap_dirty_bytes(&map) == 4096);
+    bitmap_setbit((&map), 9999 * 8);
+    fail_unless(bitmap_dirty_bytes(&map) == 8192);
+    bitmap_setbit((&map), 4096 * 8);
+    fail_unless(bitmap_dirty_bytes(&map) == 10000);
+
+    // Flushing cleans every page
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_dirty_bytes");
+
+    // Anonymous bitmaps are not tracked
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    bitmap_setbit((&map), 1);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(reclaim_bitmap)
+{
+    bloom_bitmap map;
+    uint64_t hinted;
+    int res = bitmap_from_filename("/tmp/mmap_reclaim", 3 * 4096, 1, SHARED, &map);
+    fail_unless(res == 0);
+
+    // Only the clean pages are hinted
+    bitmap_setbit((&map), 4096 * 8 + 1);
+    fail_unless(bitmap_reclaim(&map, 0, &hinted) == 0);
+    fail_unless(hinted == 2 * 4096);
+    fail_unless(bitmap_getbit((&map), 4096 * 8 + 1) == 1);
+
+    // Pages read back after they are paged out
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_reclaim(&map, 1, &hinted) == 0);
+    fail_unless(hinted == 3 * 4096);
+    fail_unless(bitmap_getbit((&map), 4096 * 8 + 1) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_reclaim");
+
+    // Anonymous bitmaps would only be swapped
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(bitmap_reclaim(&map, 0, &hinted) == -EINVAL);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(lock_bitmap)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/mmap_lock", 4 * 4096, 1, SHARED, &map);
+    fail_unless(res == 0);
+
+    // Every page is resident once locked
+    uint64_t resident;
+    fail_unless(bitmap_lock(&map) == 0);
+    fail_unless(bitmap_resident(&map, &resident) == 0);
+    fail_unless(resident == 4 * 4096);
+    bitmap_setbit((&map), 3 * 4096 * 8);
+    fail_unless(bitmap_getbit((&map), 3 * 4096 * 8) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink("/tmp/mmap_lock");
+
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(bitmap_lock(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+}
+END_TEST
+
+START_TEST(track_bitmap_changes)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/mmap_track", 3 * 4096, 1, PERSISTENT, &map);
+    fail_unless(res == 0);
+
+    // Untracked pages always count as changed
+    fail_unless(bitmap_page_changed(&map, 0, 100) == 1);
+
+    // Every page starts out in the current generation
+    uint32_t clock = 1;
+    fail_unless(bitmap_track_changes(&map, &clock) == 0);
+    fail_unless(map.gen_start == 1);
+    fail_unless(bitmap_page_changed(&map, 2, 1) == 1);
+    fail_unless(bitmap_page_changed(&map, 2, 2) == 0);
+
+    // Pages are stamped as they change, even if already dirty
+    clock = 2;
+    bitmap_setbit((&map), 1);
+    bitmap_setbit((&map), 4096 * 8 + 1);
+    clock = 3;
+    bitmap_setbit((&map), 4096 * 8 + 2);
+    fail_unless(bitmap_page_changed(&map, 0, 2) == 1);
+    fail_unless(bitmap_page_changed(&map, 0, 3) == 0);
+    fail_unless(bitmap_page_changed(&map, 1, 3) == 1);
+    fail_unless(bitmap_page_changed(&map, 2, 2) == 0);
+
+    // ORing in bytes only stamps the pages that change
+    unsigned char bytes[4096 + 16];
+    memset(bytes, 0, sizeof(bytes));
+    bytes[4097] = 0x80;
+    clock = 4;
+    fail_unless(bitmap_or_bytes(&map, 4096, bytes + 1, 4096 + 8) == 0);
+    fail_unless(bitmap_getbit((&map), 8192 * 8) == 1);
+    fail_unless(bitmap_getbit((&map), 4096 * 8 + 1) == 1);
+    fail_unless(bitmap_page_changed(&map, 1, 4) == 0);
+    fail_unless(bitmap_page_changed(&map, 2, 4) == 1);
+    fail_unless(bitmap_or_bytes(&map, 3 * 4096 - 8, bytes, 16) == -EINVAL);
+
+    // The stamps are gone once the bitmap is closed
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(map.page_gens == NULL);
+    unlink("/tmp/mmap_track");
+}
+END_TEST
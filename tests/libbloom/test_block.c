@@ -0,0 +1,85 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "block.h"
+
+START_TEST(block_mask_bit_order)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+
+    // The mask must line up with bitmap_getbit
+    for (uint32_t bit = 0; bit < 512; bit++) {
+        bloom_block_mask mask;
+        memset(&mask, 0, sizeof(mask));
+        bf_block_mask_setbit(&mask, bit);
+        memcpy(map.mmap + 64, mask.words, 64);
+        fail_unless(bitmap_getbit((&map), 512 + bit) == 1);
+        fail_unless(bitmap_getbit((&map), 512 + (bit ^ 1)) == 0);
+    }
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(block_test_kernels_agree)
+{
+    bloom_block_mask block, mask;
+    const char *kernel = bf_block_kernel();
+    fail_unless(strcmp(kernel, "avx2") == 0 ||
+                strcmp(kernel, "neon") == 0 ||
+                strcmp(kernel, "scalar") == 0);
+
+    srandom(42);
+    for (int trial = 0; trial < 10000; trial++) {
+        memset(&block, 0, sizeof(block));
+        memset(&mask, 0, sizeof(mask));
+        for (int i = 0; i < 200; i++) {
+            bf_block_mask_setbit(&block, random() & 511);
+        }
+        for (int i = 0; i < 1 + trial % 12; i++) {
+            bf_block_mask_setbit(&mask, random() & 511);
+        }
+        unsigned char *b = (unsigned char*)block.words;
+        int expected = bf_block_test_scalar(b, &mask);
+        fail_unless(bf_block_test(b, &mask) == expected);
+
+        // Setting the mask in the block must make it pass
+        for (int i = 0; i < 8; i++) block.words[i] |= mask.words[i];
+        fail_unless(bf_block_test_scalar(b, &mask) == 1);
+        fail_unless(bf_block_test(b, &mask) == 1);
+    }
+}
+END_TEST
+
+START_TEST(block_set_persist)
+{
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_block_set", 8192, 1,
+            PERSISTENT, &map);
+    fail_unless(res == 0);
+
+    bloom_block_mask mask;
+    memset(&mask, 0, sizeof(mask));
+    bf_block_mask_setbit(&mask, 0);
+    bf_block_mask_setbit(&mask, 100);
+    bf_block_mask_setbit(&mask, 511);
+
+    // Use a block in the second page
+    uint64_t block_bit = (4096 + 128) * 8;
+    fail_unless(bf_block_test(map.mmap + 4096 + 128, &mask) == 0);
+    bf_block_set(&map, block_bit, &mask);
+    fail_unless(bf_block_test(map.mmap + 4096 + 128, &mask) == 1);
+
+    fail_unless(bitmap_getbit((&map), block_bit) == 1);
+    fail_unless(bitmap_getbit((&map), block_bit + 100) == 1);
+    fail_unless(bitmap_getbit((&map), block_bit + 511) == 1);
+    fail_unless(bitmap_getbit((&map), block_bit + 1) == 0);
+    fail_unless(map.dirty_pages[0] == 64);
+
+    bitmap_close(&map);
+    unlink("/tmp/persist_block_set");
+}
+END_TEST
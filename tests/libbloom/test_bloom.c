@@ -2,11 +2,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <math.h>
 #include "bloom.h"
+#include "crc.h"
+#include "shortkey.h"
 
 START_TEST(bloom_filter_header_size)
 {
@@ -509,3 +513,1050 @@ START_TEST(test_bf_shared_compatible_persist)
 }
 END_TEST
 
+
+START_TEST(test_params_for_capacity_blocked)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_LEGACY};
+    bloom_filter_params blocked = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity_format(&blocked, &format) == 0);
+
+    // Blocked filters need more space, and whole blocks
+    fail_unless(blocked.bytes > params.bytes);
+    fail_unless((blocked.bytes - sizeof(bloom_filter_header)) % BLOOM_BLOCK_BYTES == 0);
+    fail_unless(bf_blocked_fp_probability((blocked.bytes - sizeof(bloom_filter_header)) * 8,
+                blocked.capacity, blocked.k_num) <= 1e-4);
+}
+END_TEST
+
+START_TEST(test_params_for_capacity_max_k)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity(&params) == 0);
+
+    // Half the probes cost about 30% more space
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_PARTITIONED, .max_k_num = 6};
+    bloom_filter_params fast = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity_format(&fast, &format) == 0);
+    fail_unless(fast.k_num == 6);
+    fail_unless(fast.bytes > params.bytes * 1.2);
+    fail_unless(fast.bytes < params.bytes * 1.4);
+    double bits = (fast.bytes - sizeof(bloom_filter_header)) * 8.0;
+    fail_unless(pow(1 - exp(-6 * 1e6 / bits), 6) <= 1e-4);
+
+    // A budget over the ideal k changes nothing
+    format.max_k_num = 20;
+    bloom_filter_params ideal = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity_format(&ideal, &format) == 0);
+    fail_unless(ideal.k_num == params.k_num);
+    fail_unless(ideal.bytes == params.bytes);
+
+    // Blocked filters keep to the budget too
+    format.layout = BLOOM_LAYOUT_BLOCKED;
+    format.max_k_num = 4;
+    bloom_filter_params blocked = {0, 0, 1e6, 1e-4};
+    fail_unless(bf_params_for_capacity_format(&blocked, &format) == 0);
+    fail_unless(blocked.k_num <= 4);
+    fail_unless(bf_blocked_fp_probability((blocked.bytes - sizeof(bloom_filter_header)) * 8,
+                blocked.capacity, blocked.k_num) <= 1e-4);
+}
+END_TEST
+
+START_TEST(make_bf_blocked_then_restore)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_LEGACY};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    int res = bf_from_bitmap_format(&map, 10, &format, 1, &filter); // Make fresh
+    fail_unless(res == 0);
+    fail_unless(filter.header->layout == BLOOM_LAYOUT_BLOCKED);
+    fail_unless(filter.num_blocks == 56);
+
+    res = bf_add(&filter, "test");
+    fail_unless(res == 1);
+
+    // Restore ignores the requested format
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.header->layout == BLOOM_LAYOUT_BLOCKED);
+    fail_unless(filter2.num_blocks == 56);
+    fail_unless(bf_contains(&filter2, "test") == 1);
+}
+END_TEST
+
+START_TEST(make_bf_bad_layout)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    int res = bf_from_bitmap(&map, 10, 1, &filter);
+    fail_unless(res == 0);
+
+    // Unknown layouts must fail to load
+    filter.header->layout = 100;
+    res = bf_from_bitmap(&map, 10, 0, &filter);
+    fail_unless(res == -1);
+
+    bloom_filter_format format = {.layout = 100, .hash_scheme = BLOOM_HASH_LEGACY};
+    res = bf_from_bitmap_format(&map, 10, &format, 1, &filter);
+    fail_unless(res == -EINVAL);
+}
+END_TEST
+
+START_TEST(test_bf_blocked_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_LEGACY};
+    bf_params_for_capacity_format(&params, &format);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, params.k_num, &format, 1, &filter) == 0);
+
+    // Check all the keys get added
+    char buf[100];
+    int res;
+    int num_wrong = 0;
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        res = bf_add(&filter, (char*)&buf);
+        if (res == 0) num_wrong++;
+    }
+
+    // We added 100K items, with a capacity of 100K and error of 1/1000.
+    // We should have about 100 false positives, most early on
+    fail_unless(num_wrong <= 100);
+
+    // All the keys must be present
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+    }
+}
+END_TEST
+
+START_TEST(make_bf_counting_remove)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_COUNTING, .hash_scheme = BLOOM_HASH_MURMUR};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    int res = bf_from_bitmap_format(&map, 10, &format, 1, &filter); // Make fresh
+    fail_unless(res == 0);
+    fail_unless(filter.header->layout == BLOOM_LAYOUT_COUNTING);
+    fail_unless(filter.num_blocks == 56);
+
+    fail_unless(bf_add(&filter, "test") == 1);
+    fail_unless(bf_add(&filter, "test") == 0);
+    fail_unless(bf_add(&filter, "other") == 1);
+    fail_unless(bf_size(&filter) == 2);
+
+    // Both adds were counted, so the key is removed twice
+    fail_unless(bf_remove(&filter, "test") == 1);
+    fail_unless(bf_contains(&filter, "test") == 1);
+    fail_unless(bf_remove(&filter, "test") == 1);
+    fail_unless(bf_contains(&filter, "test") == 0);
+    fail_unless(bf_remove(&filter, "test") == 0);
+    fail_unless(bf_contains(&filter, "other") == 1);
+    fail_unless(bf_size(&filter) == 1);
+
+    // Restore keeps the layout
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.header->layout == BLOOM_LAYOUT_COUNTING);
+    fail_unless(bf_contains(&filter2, "other") == 1);
+    fail_unless(bf_remove(&filter2, "other") == 1);
+    fail_unless(bf_size(&filter2) == 0);
+
+    // Other layouts cannot remove
+    bloom_bitmap map2;
+    bloom_bloomfilter filter3;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map2);
+    fail_unless(bf_from_bitmap(&map2, 10, 1, &filter3) == 0);
+    fail_unless(bf_add(&filter3, "test") == 1);
+    fail_unless(bf_remove(&filter3, "test") == -EINVAL);
+}
+END_TEST
+
+START_TEST(make_bf_aging_expire)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_AGING, .hash_scheme = BLOOM_HASH_MURMUR};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+
+    // Keys must live for a tick, and stamps must not wrap
+    fail_unless(bf_from_bitmap_format(&map, 10, &format, 1, &filter) == -EINVAL);
+    format.age_ticks = BLOOM_AGE_MAX_TICKS + 1;
+    fail_unless(bf_from_bitmap_format(&map, 10, &format, 1, &filter) == -EINVAL);
+    format.age_ticks = 3;
+    int res = bf_from_bitmap_format(&map, 10, &format, 1, &filter); // Make fresh
+    fail_unless(res == 0);
+    fail_unless(filter.header->layout == BLOOM_LAYOUT_AGING);
+    fail_unless(filter.num_blocks == 56);
+
+    fail_unless(bf_add(&filter, "test") == 1);
+    fail_unless(bf_add(&filter, "test") == 0);
+    fail_unless(bf_contains(&filter, "test") == 1);
+
+    // The first tick only sets the clock
+    fail_unless(bf_age(&filter, 10) == 0);
+    fail_unless(bf_age(&filter, 10) == 0);
+    fail_unless(bf_age(&filter, 11) == 1);
+    fail_unless(bf_add(&filter, "other") == 1);
+    fail_unless(bf_age(&filter, 12) == 1);
+    fail_unless(bf_contains(&filter, "test") == 1);
+
+    // Setting a key again keeps it live
+    fail_unless(bf_add(&filter, "test") == 0);
+    fail_unless(bf_age(&filter, 13) == 1);
+    fail_unless(bf_contains(&filter, "test") == 1);
+    fail_unless(bf_contains(&filter, "other") == 1);
+    fail_unless(bf_age(&filter, 14) == 1);
+    fail_unless(bf_contains(&filter, "test") == 1);
+    fail_unless(bf_contains(&filter, "other") == 0);
+    fail_unless(bf_size(&filter) == 1);
+
+    // Restore keeps the clock
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.header->layout == BLOOM_LAYOUT_AGING);
+    fail_unless(bf_contains(&filter2, "test") == 1);
+
+    // A long pause expires everything
+    fail_unless(bf_age(&filter2, 1000) == 1);
+    fail_unless(bf_contains(&filter2, "test") == 0);
+    fail_unless(bf_size(&filter2) == 0);
+    fail_unless(bf_add(&filter2, "test") == 1);
+
+    // Stamps have no bits to count or merge
+    bloom_filter_fill fill;
+    fail_unless(bf_fill(&filter2, &fill) == -EINVAL);
+    fail_unless(bf_merge(&filter2, &filter, 0) == -EINVAL);
+
+    // Other layouts do not age
+    bloom_bitmap map2;
+    bloom_bloomfilter filter3;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map2);
+    fail_unless(bf_from_bitmap(&map2, 10, 1, &filter3) == 0);
+    fail_unless(bf_age(&filter3, 1) == -EINVAL);
+}
+END_TEST
+
+START_TEST(test_bf_counting_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_params plain = {0, 0, 1e5, 0.001};
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_COUNTING, .hash_scheme = BLOOM_HASH_MURMUR,
+        .reduction = BLOOM_REDUCE_MULTIPLY};
+    fail_unless(bf_params_for_capacity_format(&params, &format) == 0);
+    fail_unless(bf_params_for_capacity(&plain) == 0);
+
+    // Counters use 4 bits each, in whole blocks
+    uint64_t bytes = params.bytes - sizeof(bloom_filter_header);
+    fail_unless(params.bytes > 4 * (plain.bytes - sizeof(bloom_filter_header)));
+    fail_unless(bytes % BLOOM_BLOCK_BYTES == 0);
+    fail_unless(bf_counting_fp_probability(bytes, params.capacity, params.k_num) <= 0.001);
+
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, params.k_num, &format, 1, &filter) == 0);
+
+    char buf[100];
+    int num_wrong = 0;
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+    }
+    fail_unless(num_wrong <= 100);
+
+    // Remove the odd keys, the even keys must all remain.
+    // False positives were counted too, so none are lost.
+    for (int i=1;i<1e5;i+=2) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(bf_remove(&filter, (char*)&buf) == 1);
+    }
+    int num_present = 0;
+    for (int i=0;i<1e5;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        int res = bf_contains(&filter, (char*)&buf);
+        if (i % 2 == 0) fail_unless(res == 1);
+        else num_present += res;
+    }
+    fail_unless(num_present <= 100);
+}
+END_TEST
+
+START_TEST(test_hashes_murmur_scheme)
+{
+    char *key = "the quick brown fox";
+    uint64_t legacy[1000];
+    uint64_t hashes[1000];
+    bf_compute_hashes_scheme(BLOOM_HASH_LEGACY, 1000, key, (uint64_t*)&legacy);
+    bf_compute_hashes_scheme(BLOOM_HASH_MURMUR, 1000, key, (uint64_t*)&hashes);
+
+    // Both schemes share the murmur pass, the rest differ
+    fail_unless(hashes[0] == legacy[0]);
+    fail_unless(hashes[1] == legacy[1]);
+    fail_unless(hashes[2] != legacy[2]);
+
+    // Check that all the hashes are unique.
+    for (int i=0;i<1000;i++) {
+        for (int j=i+1;j<1000;j++) {
+            fail_unless(hashes[i] != hashes[j]);
+        }
+    }
+}
+END_TEST
+
+START_TEST(make_bf_murmur_then_restore)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_MURMUR};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    int res = bf_from_bitmap_format(&map, 10, &format, 1, &filter); // Make fresh
+    fail_unless(res == 0);
+    fail_unless(filter.header->hash_scheme == BLOOM_HASH_MURMUR);
+
+    res = bf_add(&filter, "test");
+    fail_unless(res == 1);
+
+    // Restore uses the recorded scheme
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.header->hash_scheme == BLOOM_HASH_MURMUR);
+    fail_unless(bf_contains(&filter2, "test") == 1);
+
+    // Unknown schemes must fail to load
+    filter.header->hash_scheme = 100;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == -1);
+}
+END_TEST
+
+START_TEST(test_bf_murmur_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_format formats[2] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_MURMUR},
+        {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_MURMUR}
+    };
+
+    for (int f=0; f < 2; f++) {
+        bf_params_for_capacity_format(&params, formats + f);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, formats + f, 1, &filter) == 0);
+
+        char buf[100];
+        int num_wrong = 0;
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+        }
+
+        // We should have about 100 false positives
+        fail_unless(num_wrong <= 100);
+        bf_close(&filter);
+    }
+}
+END_TEST
+
+/**
+ * The crc32 instruction and the tables must hash alike,
+ * or filters would not move between hosts.
+ */
+START_TEST(test_crc_hash_kernels)
+{
+    char key[64];
+    uint64_t hw[2], soft[2], prev[2] = {0, 0};
+    for (int i=0; i < 64; i++) key[i] = 'a' + i % 26;
+    for (uint64_t len=0; len <= 64; len++) {
+        bf_crc_hash128(key, len, hw);
+        bf_crc_hash128_soft(key, len, soft);
+        fail_unless(hw[0] == soft[0] && hw[1] == soft[1]);
+
+        // Padding the tail must not collide with a shorter key
+        fail_unless(hw[0] != prev[0] && hw[1] != prev[1]);
+        prev[0] = hw[0];
+        prev[1] = hw[1];
+    }
+    fail_unless(bf_crc_kernel() != NULL);
+}
+END_TEST
+
+/**
+ * The plain CRC32C must match the standard check value,
+ * and continuing a CRC must match hashing at once.
+ */
+START_TEST(test_crc32c_kernels)
+{
+    fail_unless(bf_crc32c(0, "123456789", 9) == 0xE3069283);
+    fail_unless(bf_crc32c_soft(0, "123456789", 9) == 0xE3069283);
+    fail_unless(bf_crc32c(bf_crc32c(0, "1234", 4), "56789", 5) == 0xE3069283);
+
+    char buf[4096];
+    for (int i=0; i < 4096; i++) buf[i] = i * 7;
+    for (uint64_t len=0; len < 4096; len += 511) {
+        fail_unless(bf_crc32c(0, buf, len) == bf_crc32c_soft(0, buf, len));
+    }
+}
+END_TEST
+
+START_TEST(test_bf_crc_then_restore)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_format formats[2] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_CRC32C,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_CRC32C,
+            .reduction = BLOOM_REDUCE_MULTIPLY}
+    };
+
+    for (int f=0; f < 2; f++) {
+        bf_params_for_capacity_format(&params, formats + f);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, formats + f, 1, &filter) == 0);
+
+        char buf[100];
+        int num_wrong = 0;
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+        }
+
+        // We should have about 100 false positives
+        fail_unless(num_wrong <= 100);
+
+        // Restore uses the recorded scheme
+        bloom_bloomfilter filter2;
+        fail_unless(bf_from_bitmap(&map, params.k_num, 0, &filter2) == 0);
+        fail_unless(filter2.header->hash_scheme == BLOOM_HASH_CRC32C);
+        fail_unless(bf_contains(&filter2, "test42") == 1);
+        bf_close(&filter);
+    }
+}
+END_TEST
+
+/**
+ * Keys of each length must hash apart, however their
+ * loads overlap, and longer keys fall back to murmur.
+ */
+START_TEST(test_short_hash)
+{
+    char key[64];
+    uint64_t out[2], prev[2] = {0, 0};
+    for (int i=0; i < 64; i++) key[i] = 'a' + i % 26;
+    for (uint64_t len=0; len <= BLOOM_SHORT_KEY_MAX; len++) {
+        bf_short_hash128(key, len, out);
+        fail_unless(out[0] != prev[0] && out[1] != prev[1]);
+        prev[0] = out[0];
+        prev[1] = out[1];
+    }
+
+    // A change of any byte changes the hash
+    for (uint64_t len=1; len <= BLOOM_SHORT_KEY_MAX; len++) {
+        bf_short_hash128(key, len, prev);
+        for (uint64_t i=0; i < len; i++) {
+            key[i] ^= 1;
+            bf_short_hash128(key, len, out);
+            key[i] ^= 1;
+            fail_unless(out[0] != prev[0] && out[1] != prev[1]);
+        }
+    }
+
+    uint64_t hashes[4], murmur[4];
+    key[40] = 0;
+    bf_compute_hashes_scheme(BLOOM_HASH_SHORT, 4, key, hashes);
+    bf_compute_hashes_scheme(BLOOM_HASH_MURMUR, 4, key, murmur);
+    fail_unless(!memcmp(hashes, murmur, sizeof(hashes)));
+    key[8] = 0;
+    bf_compute_hashes_scheme(BLOOM_HASH_SHORT, 4, key, hashes);
+    bf_short_hash128(key, 8, out);
+    fail_unless(hashes[0] == out[0] && hashes[1] == out[1]);
+}
+END_TEST
+
+START_TEST(test_bf_short_then_restore)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_format formats[3] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_SHORT,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_SHORT},
+        {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_SHORT,
+            .reduction = BLOOM_REDUCE_MULTIPLY}
+    };
+
+    for (int f=0; f < 3; f++) {
+        bf_params_for_capacity_format(&params, formats + f);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, formats + f, 1, &filter) == 0);
+
+        char buf[100];
+        int num_wrong = 0;
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+        }
+
+        // We should have about 100 false positives
+        fail_unless(num_wrong <= 100);
+        fail_unless(bf_size(&filter) == 1e5 - num_wrong);
+
+        // Keys past the short limit are hashed with murmur
+        char *long_key = "a key that is well past the thirty two bytes";
+        fail_unless(bf_add(&filter, long_key) == 1);
+        fail_unless(bf_contains(&filter, long_key) == 1);
+
+        // Restore uses the recorded scheme
+        bloom_bloomfilter filter2;
+        fail_unless(bf_from_bitmap(&map, params.k_num, 0, &filter2) == 0);
+        fail_unless(filter2.header->hash_scheme == BLOOM_HASH_SHORT);
+        fail_unless(bf_contains(&filter2, "test42") == 1);
+        fail_unless(bf_contains(&filter2, long_key) == 1);
+        bf_close(&filter);
+    }
+}
+END_TEST
+
+START_TEST(test_hashed_key_reuse)
+{
+    bloom_bitmap map1, map2;
+    bloom_bloomfilter legacy, murmur;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_MURMUR};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map1);
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map2);
+    fail_unless(bf_from_bitmap(&map1, 10, 1, &legacy) == 0);
+    fail_unless(bf_from_bitmap_format(&map2, 10, &format, 1, &murmur) == 0);
+
+    // The murmur scheme never needs spooky
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, "test");
+    fail_unless(bf_contains_hashed(&murmur, &hk) == 0);
+    fail_unless(hk.has_murmur == 1);
+    fail_unless(hk.has_spooky == 0);
+    fail_unless(bf_add_hashed(&murmur, &hk) == 1);
+
+    // Reuse the cached hashes on the legacy filter
+    fail_unless(bf_add_hashed(&legacy, &hk) == 1);
+    fail_unless(hk.has_spooky == 1);
+    fail_unless(bf_add_hashed(&legacy, &hk) == 0);
+
+    // Must agree with the unhashed calls
+    fail_unless(bf_contains(&legacy, "test") == 1);
+    fail_unless(bf_contains(&murmur, "test") == 1);
+    fail_unless(bf_size(&legacy) == 1);
+    fail_unless(bf_size(&murmur) == 1);
+}
+END_TEST
+
+START_TEST(test_hashed_key_from_hash)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_MURMUR};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(bf_from_bitmap_format(&map, 10, &format, 1, &filter) == 0);
+    fail_unless(bf_add(&filter, "http://example.com/a/long/path") == 1);
+
+    // A key given as its murmur hash probes the same bits
+    bloom_hashed_key hk, other;
+    bf_hashed_key_init(&hk, "http://example.com/a/long/path");
+    bf_hashed_key_init_hash(&other, bf_hashed_key_murmur(&hk));
+    fail_unless(other.prehashed == 1);
+    fail_unless(other.key == NULL);
+    fail_unless(bf_contains_hashed(&filter, &other) == 1);
+
+    bf_hashed_key_init(&hk, "http://example.com/another/path");
+    bf_hashed_key_init_hash(&other, bf_hashed_key_murmur(&hk));
+    fail_unless(bf_contains_hashed(&filter, &other) == 0);
+    fail_unless(bf_add_hashed(&filter, &other) == 1);
+    fail_unless(bf_contains(&filter, "http://example.com/another/path") == 1);
+    fail_unless(hk.prehashed == 0);
+}
+END_TEST
+
+START_TEST(make_bf_multiply_then_restore)
+{
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bloom_filter_format format = {.reduction = BLOOM_REDUCE_MULTIPLY};
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    int res = bf_from_bitmap_format(&map, 10, &format, 1, &filter); // Make fresh
+    fail_unless(res == 0);
+    fail_unless(filter.header->reduction == BLOOM_REDUCE_MULTIPLY);
+    fail_unless(bf_add(&filter, "test") == 1);
+
+    // Restore uses the recorded reduction
+    bloom_bloomfilter filter2;
+    res = bf_from_bitmap(&map, 10, 0, &filter2);
+    fail_unless(res == 0);
+    fail_unless(filter2.header->reduction == BLOOM_REDUCE_MULTIPLY);
+    fail_unless(bf_contains(&filter2, "test") == 1);
+
+    // Unknown reductions must fail to load
+    filter.header->reduction = 100;
+    fail_unless(bf_from_bitmap(&map, 10, 0, &filter2) == -1);
+
+    format.reduction = 100;
+    fail_unless(bf_from_bitmap_format(&map, 10, &format, 1, &filter) == -EINVAL);
+}
+END_TEST
+
+START_TEST(test_bf_multiply_fp_prob)
+{
+    bloom_filter_params params = {0, 0, 1e5, 0.001};
+    bloom_filter_format formats[3] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_MURMUR,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_MURMUR,
+            .reduction = BLOOM_REDUCE_MULTIPLY}
+    };
+
+    for (int f=0; f < 3; f++) {
+        bf_params_for_capacity_format(&params, formats + f);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, formats + f, 1, &filter) == 0);
+
+        char buf[100];
+        int num_wrong = 0;
+        for (int i=0;i<1e5;i++) {
+            snprintf((char*)&buf, 100, "test%d", i);
+            if (bf_add(&filter, (char*)&buf) == 0) num_wrong++;
+        }
+
+        // We should have about 100 false positives
+        fail_unless(num_wrong <= 100);
+        bf_close(&filter);
+    }
+}
+END_TEST
+
+START_TEST(test_bf_contains_many)
+{
+    bloom_filter_params params = {0, 0, 1e4, 1e-3};
+    bloom_filter_format formats[3] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED},
+        {.layout = BLOOM_LAYOUT_BLOCKED, .hash_scheme = BLOOM_HASH_MURMUR,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_SHORT,
+            .reduction = BLOOM_REDUCE_MULTIPLY}
+    };
+
+    char bufs[1000][20];
+    bloom_hashed_key keys[1000];
+    char result[1000];
+    for (int f=0; f < 3; f++) {
+        bf_params_for_capacity_format(&params, formats + f);
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, formats + f, 1, &filter) == 0);
+
+        // Add every other key
+        for (int i=0;i<1000;i++) {
+            snprintf((char*)&bufs[i], 20, "test%d", i);
+            if (i % 2 == 0) bf_add(&filter, bufs[i]);
+            bf_hashed_key_init(keys + i, bufs[i]);
+        }
+
+        // The batch must agree with the single key checks
+        memset(result, 0, sizeof(result));
+        fail_unless(bf_contains_many(&filter, keys, 1000, result) == 0);
+        for (int i=0;i<1000;i++) {
+            fail_unless(result[i] == bf_contains(&filter, bufs[i]));
+            if (i % 2 == 0) fail_unless(result[i] == 1);
+        }
+
+        // Keys that are already found are skipped
+        memset(result, 1, sizeof(result));
+        fail_unless(bf_contains_many(&filter, keys, 1000, result) == 0);
+        for (int i=0;i<1000;i++) {
+            fail_unless(result[i] == 1);
+        }
+        bf_close(&filter);
+    }
+}
+END_TEST
+
+/*
+ * The probe functions unrolled for a k_num must set the
+ * same bits as the generic ones, or filters written by one
+ * could not be read with the other.
+ */
+START_TEST(test_bf_unrolled_probes)
+{
+    bloom_filter_format formats[4] = {
+        {.layout = BLOOM_LAYOUT_PARTITIONED},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_MURMUR,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_CRC32C,
+            .reduction = BLOOM_REDUCE_MULTIPLY},
+        {.layout = BLOOM_LAYOUT_PARTITIONED, .hash_scheme = BLOOM_HASH_SHORT}
+    };
+    char key[20];
+    uint64_t hashes[32];
+    for (int f=0; f < 4; f++) {
+        for (uint32_t k=5; k <= 22; k++) {
+            bloom_bitmap map;
+            bloom_bloomfilter filter;
+            fail_unless(bitmap_from_file(-1, 65536, ANONYMOUS, &map) == 0);
+            fail_unless(bf_from_bitmap_format(&map, k, formats + f, 1, &filter) == 0);
+
+            for (int i=0; i < 100; i++) {
+                snprintf(key, sizeof(key), "test%d", i);
+                fail_unless(bf_add(&filter, key) == 1);
+
+                // Each probe lands in its own partition
+                bf_compute_hashes_scheme(formats[f].hash_scheme, (k < 4) ? 4 : k, key, hashes);
+                for (uint32_t j=0; j < k; j++) {
+                    uint64_t m = filter.offset, h = hashes[j];
+                    uint64_t bit = (formats[f].reduction == BLOOM_REDUCE_MULTIPLY) ?
+                        (uint64_t)(((__uint128_t)h * m) >> 64) : h % m;
+                    fail_unless(bitmap_getbit(&map, 8*sizeof(bloom_filter_header) + j*m + bit) == 1);
+                }
+            }
+            for (int i=0; i < 100; i++) {
+                snprintf(key, sizeof(key), "test%d", i);
+                fail_unless(bf_contains(&filter, key) == 1);
+                fail_unless(bf_add(&filter, key) == 0);
+            }
+            fail_unless(bf_size(&filter) == 100);
+            bf_close(&filter);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_bf_merge)
+{
+    bloom_bitmap maps[3];
+    bloom_bloomfilter filters[3];
+    for (int i=0; i < 3; i++) {
+        bitmap_from_file(-1, 65536, ANONYMOUS, maps + i);
+        fail_unless(bf_from_bitmap(maps + i, 10, 1, filters + i) == 0);
+    }
+
+    // Two overlapping key ranges
+    char buf[20];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        if (i < 600) bf_add(filters, buf);
+        if (i >= 400) bf_add(filters + 1, buf);
+    }
+    memcpy(maps[2].mmap, maps[0].mmap, maps[0].size);
+
+    // The union has every key
+    fail_unless(bf_merge(filters, filters + 1, 0) == 0);
+    fail_unless(filters[0].header->count == 1200);
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        fail_unless(bf_contains(filters, buf) == 1);
+    }
+
+    // The intersection has the shared keys
+    fail_unless(bf_merge(filters + 2, filters + 1, 1) == 0);
+    fail_unless(filters[2].header->count == 600);
+    int found = 0;
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        if (i >= 400 && i < 600) fail_unless(bf_contains(filters + 2, buf) == 1);
+        else found += bf_contains(filters + 2, buf);
+    }
+    fail_unless(found < 20);
+
+    // Only filters of the same shape can be merged
+    bloom_bitmap small;
+    bloom_bloomfilter other;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &small);
+    fail_unless(bf_from_bitmap(&small, 10, 1, &other) == 0);
+    fail_unless(bf_merge(filters, &other, 0) == -EINVAL);
+    bf_close(&other);
+    bitmap_from_file(-1, 65536, ANONYMOUS, &small);
+    fail_unless(bf_from_bitmap(&small, 8, 1, &other) == 0);
+    fail_unless(bf_merge(filters, &other, 0) == -EINVAL);
+    bf_close(&other);
+    for (int i=0; i < 3; i++) bf_close(filters + i);
+}
+END_TEST
+
+START_TEST(test_bf_merge_bytes)
+{
+    bloom_bitmap maps[2];
+    bloom_bloomfilter filters[2];
+    for (int i=0; i < 2; i++) {
+        bitmap_from_file(-1, 65536, ANONYMOUS, maps + i);
+        fail_unless(bf_from_bitmap(maps + i, 10, 1, filters + i) == 0);
+    }
+
+    // The copy is ahead of the filter
+    char buf[20];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        if (i < 400) bf_add(filters, buf);
+        bf_add(filters + 1, buf);
+    }
+
+    // Merged a page at a time, the header first
+    for (uint64_t off=0; off < 65536; off += 4096) {
+        fail_unless(bf_merge_bytes(filters, off, maps[1].mmap + off, 4096) == 0);
+    }
+    fail_unless(filters[0].header->count == 1000);
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        fail_unless(bf_contains(filters, buf) == 1);
+    }
+
+    // The header is merged whole, and must match
+    fail_unless(bf_merge_bytes(filters, 8, maps[1].mmap + 8, 4088) == -EINVAL);
+    fail_unless(bf_merge_bytes(filters, 0, maps[1].mmap, 256) == -EINVAL);
+    fail_unless(bf_merge_bytes(filters, 61440, maps[1].mmap, 8192) == -EINVAL);
+    bloom_bitmap other_map;
+    bloom_bloomfilter other;
+    bitmap_from_file(-1, 65536, ANONYMOUS, &other_map);
+    fail_unless(bf_from_bitmap(&other_map, 8, 1, &other) == 0);
+    fail_unless(bf_merge_bytes(filters, 0, other_map.mmap, 4096) == -EINVAL);
+    bf_close(&other);
+    for (int i=0; i < 2; i++) bf_close(filters + i);
+}
+END_TEST
+
+START_TEST(test_bf_fill)
+{
+    bloom_filter_params params = {0, 0, 100000, 1e-3};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap(&map, params.k_num, 1, &filter) == 0);
+
+    bloom_filter_fill fill;
+    fail_unless(bf_fill(&filter, &fill) == 0);
+    fail_unless(fill.bits_set == 0 && fill.keys == 0);
+    fail_unless(fill.bits == filter.offset * params.k_num);
+
+    char buf[20];
+    for (int i=0; i < 50000; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        bf_add(&filter, buf);
+    }
+    fail_unless(bf_fill(&filter, &fill) == 0);
+    fail_unless(fill.keys > 49000 && fill.keys < 51000);
+    fail_unless(fill.fp_probability > 0 && fill.fp_probability < 1e-3);
+    fail_unless(filter.header->fill_stamp == filter.header->count + 1);
+
+    // The fill is found from the bits when the count is lost
+    filter.header->count = 0;
+    fail_unless(bf_fill(&filter, &fill) == 0);
+    fail_unless(fill.keys > 49000 && fill.keys < 51000);
+    bf_close(&filter);
+
+    // Counting filters have no bits to count
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_COUNTING};
+    fail_unless(bitmap_from_file(-1, 65536, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, 4, &format, 1, &filter) == 0);
+    fail_unless(bf_fill(&filter, &fill) == -EINVAL);
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_sparse)
+{
+    bloom_filter_format format = {.layout = BLOOM_LAYOUT_PARTITIONED, .sparse = 1};
+    bloom_filter_params dense = {0, 0, 100000, 1e-3};
+    bloom_filter_params params = {0, 0, 100000, 1e-3};
+    fail_unless(bf_params_for_capacity(&dense) == 0);
+    fail_unless(bf_params_for_capacity_format(&params, &format) == 0);
+
+    // The set is kept after the bits, which are the same
+    uint64_t reserve = bf_sparse_bytes(params.bytes, &format);
+    fail_unless(reserve > 0 && reserve <= params.bytes / 16);
+    fail_unless(params.bytes - reserve >= dense.bytes);
+    fail_unless(params.bytes - reserve < dense.bytes + 8);
+    fail_unless(bf_sparse_bytes(dense.bytes, NULL) == 0);
+
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, params.k_num, &format, 1, &filter) == 0);
+    fail_unless(bf_is_sparse(&filter) == 1);
+
+    // Adds are refused once the set is full, until it is grown
+    char buf[20];
+    int grows = 0, i = 0;
+    for (; i < 20; i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        fail_unless(bf_add(&filter, buf) == 1);
+    }
+    fail_unless(bf_add(&filter, "test0") == 0);
+    bloom_filter_fill fill;
+    fail_unless(bf_fill(&filter, &fill) == 0);
+    fail_unless(fill.bits_set == filter.header->sparse_used);
+    fail_unless(fill.bits_set > 19 * params.k_num && fill.bits_set <= 20 * params.k_num);
+    fail_unless(bitmap_popcount(&map, sizeof(bloom_filter_header), filter.bitmap_size / 8) == 0);
+
+    // The set is read back when the filter is loaded again
+    bloom_bloomfilter loaded;
+    fail_unless(bf_from_bitmap(&map, params.k_num, 0, &loaded) == 0);
+    fail_unless(bf_is_sparse(&loaded) == 1);
+    fail_unless(bf_contains(&loaded, "test19") == 1);
+
+    for (; bf_is_sparse(&filter); i++) {
+        snprintf((char*)&buf, 20, "test%d", i);
+        int res = bf_add(&filter, buf);
+        if (res == -EAGAIN) {
+            grows++;
+            fail_unless(bf_sparse_grow(&filter) == 0);
+            res = bf_add(&filter, buf);
+        }
+        fail_unless(res == 1);
+    }
+    fail_unless(grows >= 2);
+    fail_unless(bf_sparse_grow(&filter) == -EINVAL);
+
+    // Once dense, the keys are in the bits, and the set is gone
+    for (int j=0; j < i; j++) {
+        snprintf((char*)&buf, 20, "test%d", j);
+        fail_unless(bf_contains(&filter, buf) == 1);
+    }
+    fail_unless(filter.header->sparse_used == 0);
+    fail_unless(bitmap_popcount(&map, map.size - reserve, reserve) == 0);
+    fail_unless(bf_fill(&filter, &fill) == 0);
+    fail_unless(fill.keys > (uint64_t)i * 9 / 10 && fill.keys < (uint64_t)i * 11 / 10);
+
+    // A sparse filter merges into a dense one of the same shape
+    bloom_bitmap young_map;
+    bloom_bloomfilter young;
+    fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &young_map) == 0);
+    fail_unless(bf_from_bitmap_format(&young_map, params.k_num, &format, 1, &young) == 0);
+    fail_unless(bf_add(&young, "young") == 1);
+    fail_unless(bf_merge(&filter, &young, 0) == 0);
+    fail_unless(bf_contains(&filter, "young") == 1);
+    fail_unless(bf_contains(&filter, "test0") == 1);
+    fail_unless(bf_merge(&filter, &young, 1) == 0);
+    fail_unless(bf_contains(&filter, "young") == 1);
+    fail_unless(bf_contains(&filter, "test0") == 0);
+    bf_close(&young);
+    bf_close(&filter);
+
+    // Small filters are always dense
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, 4, &format, 1, &filter) == 0);
+    fail_unless(bf_is_sparse(&filter) == 0);
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_fold)
+{
+    bloom_layout layouts[] = {BLOOM_LAYOUT_PARTITIONED, BLOOM_LAYOUT_BLOCKED};
+    bloom_reduction reductions[] = {BLOOM_REDUCE_MODULO, BLOOM_REDUCE_MULTIPLY};
+    char buf[20];
+    for (int c=0; c < 6; c++) {
+        // The last two are partitions that do not fold onto whole
+        // bytes, and a filter that is still sparse
+        bloom_filter_format format = {.layout = layouts[c % 2], .reduction = reductions[(c / 2) % 2],
+            .hash_scheme = BLOOM_HASH_MURMUR, .sparse = (c == 5)};
+        if (c == 4) format.layout = BLOOM_LAYOUT_PARTITIONED;
+        bloom_filter_params params = {0, 0, 40000, 1e-3};
+        fail_unless(bf_params_for_capacity_format(&params, &format) == 0);
+
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        uint64_t bytes = params.bytes;
+        if (c == 4) bytes = sizeof(bloom_filter_header) + (4 * 4 * 1001 + 7) / 8;
+        fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, (c == 4) ? 4 : params.k_num, &format, 1, &filter) == 0);
+        fail_unless(bf_is_sparse(&filter) == (c == 5));
+        for (int i=0; i < 1000; i++) {
+            snprintf((char*)&buf, 20, "test%d", i);
+            int res = bf_add(&filter, buf);
+            if (res == -EAGAIN) {
+                fail_unless(bf_sparse_grow(&filter) == 0);
+                res = bf_add(&filter, buf);
+            }
+            fail_unless(res == 1);
+        }
+
+        // Fold as far as the size allows
+        uint32_t folds = 0;
+        while (folds < 4 && bf_fold_size(&filter, folds + 1)) folds++;
+        fail_unless(folds >= 1);
+        if (c == 4) fail_unless((filter.offset >> folds) % 8 != 0);
+        fail_unless(bf_fold_size(&filter, 63) == 0);
+
+        bloom_bitmap folded_map;
+        bloom_bloomfilter folded;
+        fail_unless(bitmap_from_file(-1, bf_fold_size(&filter, folds), ANONYMOUS, &folded_map) == 0);
+        fail_unless(bf_fold(&filter, folds, &map, &folded) == -EINVAL);
+        fail_unless(bf_fold(&filter, folds, &folded_map, &folded) == 0);
+        fail_unless(folded.header->k_num == filter.header->k_num);
+        fail_unless(folded.header->layout == format.layout);
+        fail_unless(bf_size(&folded) == 1000);
+        fail_unless(bf_is_sparse(&folded) == 0);
+        if (format.layout == BLOOM_LAYOUT_PARTITIONED) fail_unless(folded.offset == filter.offset >> folds);
+        else fail_unless(folded.num_blocks == filter.num_blocks >> folds);
+
+        // Every key is kept, and the bits set are no more than before
+        for (int i=0; i < 1000; i++) {
+            snprintf((char*)&buf, 20, "test%d", i);
+            fail_unless(bf_contains(&folded, buf) == 1);
+        }
+        bloom_filter_fill before, after;
+        fail_unless(bf_fill(&filter, &before) == 0);
+        fail_unless(bf_fill(&folded, &after) == 0);
+        fail_unless(after.bits_set > 0 && after.bits_set <= before.bits_set);
+
+        // Keys still go to the same bits once added to the folded filter
+        fail_unless(bf_add(&folded, "after") == 1);
+        fail_unless(bf_contains(&folded, "after") == 1);
+        fail_unless(bf_close(&folded) == 0);
+        fail_unless(bf_close(&filter) == 0);
+    }
+
+    // Foldable filters are sized to be halved many times
+    for (int c=0; c < 2; c++) {
+        bloom_filter_format dense = {.layout = layouts[c]};
+        bloom_filter_format foldable = {.layout = layouts[c], .foldable = 1};
+        bloom_filter_params plain = {0, 0, 1000000, 1e-4};
+        bloom_filter_params params = {0, 0, 1000000, 1e-4};
+        fail_unless(bf_params_for_capacity_format(&plain, &dense) == 0);
+        fail_unless(bf_params_for_capacity_format(&params, &foldable) == 0);
+        fail_unless(params.bytes >= plain.bytes && params.bytes <= plain.bytes + plain.bytes / 128);
+
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        fail_unless(bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) == 0);
+        fail_unless(bf_from_bitmap_format(&map, params.k_num, &foldable, 1, &filter) == 0);
+        fail_unless(bf_fold_size(&filter, 6) > 0);
+        fail_unless(bf_close(&filter) == 0);
+    }
+
+    // Counting filters can not be folded
+    bloom_filter_format counting = {.layout = BLOOM_LAYOUT_COUNTING};
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_file(-1, sizeof(bloom_filter_header) + 64 * 64, ANONYMOUS, &map) == 0);
+    fail_unless(bf_from_bitmap_format(&map, 4, &counting, 1, &filter) == 0);
+    fail_unless(bf_fold_size(&filter, 1) == 0);
+    fail_unless(bf_close(&filter) == 0);
+}
+END_TEST
@@ -0,0 +1,81 @@
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "compress.h"
+
+/**
+ * Writes a buffer to a file.
+ */
+static void write_test_file(char *path, unsigned char *buf, uint64_t len) {
+    FILE *f = fopen(path, "w");
+    fail_unless(f != NULL);
+    fail_unless(fwrite(buf, 1, len, f) == len);
+    fclose(f);
+}
+
+START_TEST(compress_roundtrip)
+{
+    // Zero pages, a sparse page, a raw page and a partial last page
+    uint64_t len = 10 * BITMAP_COMPRESS_PAGE_SIZE + 100;
+    unsigned char *buf = calloc(1, len);
+    buf[3 * BITMAP_COMPRESS_PAGE_SIZE + 17] = 0x80;
+    buf[3 * BITMAP_COMPRESS_PAGE_SIZE + 4095] = 0x01;
+    srandom(42);
+    for (int i=0; i < BITMAP_COMPRESS_PAGE_SIZE; i++)
+        buf[5 * BITMAP_COMPRESS_PAGE_SIZE + i] = random();
+    buf[len - 1] = 0x42;
+    write_test_file("/tmp/compress_rt", buf, len);
+
+    fail_unless(bitmap_compress_file("/tmp/compress_rt", "/tmp/compress_rt.cmp") == 0);
+    struct stat st;
+    fail_unless(stat("/tmp/compress_rt.cmp", &st) == 0);
+    fail_unless((uint64_t)st.st_size < 2 * BITMAP_COMPRESS_PAGE_SIZE);
+    fail_unless(access("/tmp/compress_rt.cmp.tmp", F_OK) == -1);
+
+    unlink("/tmp/compress_rt");
+    fail_unless(bitmap_decompress_file("/tmp/compress_rt.cmp", "/tmp/compress_rt") == 0);
+
+    unsigned char *out = malloc(len);
+    FILE *f = fopen("/tmp/compress_rt", "r");
+    fail_unless(f != NULL);
+    fail_unless(fread(out, 1, len, f) == len);
+    fail_unless(fgetc(f) == EOF);
+    fclose(f);
+    fail_unless(memcmp(buf, out, len) == 0);
+
+    free(buf);
+    free(out);
+    unlink("/tmp/compress_rt");
+    unlink("/tmp/compress_rt.cmp");
+}
+END_TEST
+
+START_TEST(compress_corrupt)
+{
+    uint64_t len = 4 * BITMAP_COMPRESS_PAGE_SIZE;
+    unsigned char *buf = calloc(1, len);
+    buf[BITMAP_COMPRESS_PAGE_SIZE] = 1;
+    write_test_file("/tmp/compress_bad", buf, len);
+    fail_unless(bitmap_compress_file("/tmp/compress_bad", "/tmp/compress_bad.cmp") == 0);
+
+    // Truncate the archive, dropping the trailing zero run
+    struct stat st;
+    fail_unless(stat("/tmp/compress_bad.cmp", &st) == 0);
+    fail_unless(truncate("/tmp/compress_bad.cmp", st.st_size - 3) == 0);
+    fail_unless(bitmap_decompress_file("/tmp/compress_bad.cmp", "/tmp/compress_bad.out") == -EINVAL);
+    fail_unless(access("/tmp/compress_bad.out", F_OK) == -1);
+    fail_unless(access("/tmp/compress_bad.out.tmp", F_OK) == -1);
+
+    // Not an archive at all
+    fail_unless(bitmap_decompress_file("/tmp/compress_bad", "/tmp/compress_bad.out") == -EINVAL);
+    fail_unless(bitmap_decompress_file("/tmp/compress_missing", "/tmp/compress_bad.out") == -ENOENT);
+
+    free(buf);
+    unlink("/tmp/compress_bad");
+    unlink("/tmp/compress_bad.cmp");
+}
+END_TEST
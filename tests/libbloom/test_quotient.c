@@ -0,0 +1,213 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "quotient.h"
+
+/**
+ * Makes a new quotient filter in an anonymous bitmap.
+ */
+static void qf_test_make(uint32_t q_bits, uint32_t r_bits, bloom_bitmap *map, bloom_qf *filter) {
+    fail_unless(bitmap_from_file(-1, qf_bytes_for_q_bits(q_bits), ANONYMOUS, map) == 0);
+    fail_unless(qf_init(map, q_bits, r_bits, filter) == 0);
+}
+
+/**
+ * Adds the keys "<prefix><start>" to "<prefix><end-1>".
+ * @return The number of keys that were added
+ */
+static int qf_test_add(bloom_qf *filter, const char *prefix, int start, int end) {
+    char buf[32];
+    int added = 0;
+    for (int i=start; i < end; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, buf);
+        int res = qf_add(filter, &hk);
+        fail_unless(res >= 0);
+        added += res;
+    }
+    return added;
+}
+
+/**
+ * Counts the keys "<prefix><start>" to "<prefix><end-1>" that are found.
+ */
+static int qf_test_count(bloom_qf *filter, const char *prefix, int start, int end) {
+    char buf[32];
+    int found = 0;
+    for (int i=start; i < end; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, buf);
+        found += qf_contains(filter, &hk);
+    }
+    return found;
+}
+
+START_TEST(test_qf_header_size)
+{
+    fail_unless(sizeof(bloom_qf_header) == 64);
+}
+END_TEST
+
+START_TEST(test_qf_bad_args)
+{
+    bloom_bitmap map;
+    bloom_qf filter;
+    uint32_t q, r;
+    fail_unless(qf_bytes_for_q_bits(0) == 0);
+    fail_unless(qf_bytes_for_q_bits(QF_MAX_Q_BITS + 1) == 0);
+    fail_unless(qf_params_for_capacity(1000, 0, &q, &r) == -EINVAL);
+    fail_unless(qf_params_for_capacity(1ULL << 50, 0.01, &q, &r) == -EINVAL);
+
+    // Sized for the load limit, with bits left to grow
+    fail_unless(qf_params_for_capacity(100000, 0.001, &q, &r) == 0);
+    fail_unless(q == 18);
+    fail_unless(r == 10 + QF_GROWTH_BITS);
+
+    // Too small, bad remainders, and not a filter
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(qf_init(&map, 16, 8, &filter) == -EINVAL);
+    fail_unless(qf_init(&map, 6, 0, &filter) == -EINVAL);
+    fail_unless(qf_init(&map, 6, QF_MAX_R_BITS + 1, &filter) == -EINVAL);
+    fail_unless(qf_from_bitmap(&map, &filter) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(test_qf_add_contains)
+{
+    bloom_bitmap map;
+    bloom_qf filter;
+    qf_test_make(16, 8, &map, &filter);
+    fail_unless(qf_capacity(&filter) == 49152);
+
+    // Keys are only added once, and all are found. Some keys
+    // share a fingerprint, so they are found before they are added.
+    int added = qf_test_add(&filter, "test", 0, 40000);
+    fail_unless(added > 39800);
+    fail_unless(qf_test_add(&filter, "test", 0, 1000) == 0);
+    fail_unless(qf_size(&filter) == (uint64_t)added);
+    fail_unless(qf_test_count(&filter, "test", 0, 40000) == 40000);
+
+    // The false positives are within the remainder bits
+    int fps = qf_test_count(&filter, "miss", 0, 40000);
+    fail_unless(fps < 40000 * qf_fp_probability(&filter));
+
+    // The filter can be reopened
+    bloom_qf filter2;
+    fail_unless(qf_from_bitmap(&map, &filter2) == 0);
+    fail_unless(qf_size(&filter2) == (uint64_t)added);
+    fail_unless(qf_test_count(&filter2, "test", 0, 1000) == 1000);
+    fail_unless(qf_close(&filter) == 0);
+}
+END_TEST
+
+START_TEST(test_qf_add_full)
+{
+    bloom_bitmap map;
+    bloom_qf filter;
+    qf_test_make(6, 20, &map, &filter);
+
+    // The filter stops at its load limit
+    char buf[32];
+    int i, res = 0;
+    for (i=0; res >= 0; i++) {
+        snprintf(buf, sizeof(buf), "test%d", i);
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, buf);
+        res = qf_add(&filter, &hk);
+    }
+    fail_unless(res == -ENOSPC);
+    fail_unless(qf_size(&filter) == qf_capacity(&filter));
+    fail_unless(qf_test_count(&filter, "test", 0, i-1) == i-1);
+    qf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_qf_contains_many)
+{
+    bloom_bitmap map;
+    bloom_qf filter;
+    qf_test_make(10, 16, &map, &filter);
+    fail_unless(qf_test_add(&filter, "test", 0, 500) == 500);
+
+    char bufs[1000][20];
+    bloom_hashed_key keys[1000];
+    char result[1000];
+    for (int i=0; i < 1000; i++) {
+        snprintf(bufs[i], 20, "test%d", i);
+        bf_hashed_key_init(keys + i, bufs[i]);
+    }
+
+    // The batch must agree with the single key checks
+    memset(result, 0, sizeof(result));
+    fail_unless(qf_contains_many(&filter, keys, 1000, result) == 0);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(result[i] == qf_contains(&filter, keys + i));
+        if (i < 500) fail_unless(result[i] == 1);
+    }
+    qf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_qf_resize)
+{
+    bloom_bitmap map, map2, map3;
+    bloom_qf filter, bigger, smaller;
+    qf_test_make(10, 16, &map, &filter);
+    fail_unless(qf_test_add(&filter, "test", 0, 700) == 700);
+
+    // Doubling keeps every key, with one less bit of remainder
+    qf_test_make(11, 15, &map2, &bigger);
+    fail_unless(qf_merge(&filter, NULL, 0, &bigger) == 0);
+    fail_unless(qf_size(&bigger) == 700);
+    fail_unless(qf_test_count(&bigger, "test", 0, 700) == 700);
+    fail_unless(qf_test_add(&bigger, "test", 0, 700) == 0);
+    fail_unless(qf_test_add(&bigger, "test", 700, 1500) == 800);
+    fail_unless(qf_test_count(&bigger, "test", 0, 1500) == 1500);
+
+    // It can not be merged into a different fingerprint
+    // size, a filter that is not empty, or one too small
+    qf_test_make(11, 16, &map3, &smaller);
+    fail_unless(qf_merge(&filter, NULL, 0, &smaller) == -EINVAL);
+    qf_close(&smaller);
+    fail_unless(qf_merge(&filter, NULL, 0, &bigger) == -EINVAL);
+    qf_test_make(9, 17, &map3, &smaller);
+    fail_unless(qf_merge(&filter, NULL, 0, &smaller) == -ENOSPC);
+    qf_close(&smaller);
+
+    qf_close(&filter);
+    qf_close(&bigger);
+}
+END_TEST
+
+START_TEST(test_qf_union_intersect)
+{
+    bloom_bitmap map1, map2, map3, map4;
+    bloom_qf a, b, both, common;
+    qf_test_make(12, 18, &map1, &a);
+    qf_test_make(11, 19, &map2, &b);
+    fail_unless(qf_test_add(&a, "test", 0, 2000) == 2000);
+    fail_unless(qf_test_add(&b, "test", 1000, 2500) == 1500);
+
+    // The filters differ in size, but share the fingerprint size
+    qf_test_make(12, 18, &map3, &both);
+    fail_unless(qf_merge(&a, &b, 0, &both) == 0);
+    fail_unless(qf_size(&both) == 2500);
+    fail_unless(qf_test_count(&both, "test", 0, 2500) == 2500);
+
+    qf_test_make(11, 19, &map4, &common);
+    fail_unless(qf_merge(&a, &b, 1, &common) == 0);
+    fail_unless(qf_size(&common) == 1000);
+    fail_unless(qf_test_count(&common, "test", 1000, 2000) == 1000);
+    fail_unless(qf_test_count(&common, "test", 0, 1000) < 10);
+
+    qf_close(&a);
+    qf_close(&b);
+    qf_close(&both);
+    qf_close(&common);
+}
+END_TEST
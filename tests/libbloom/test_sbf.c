@@ -56,6 +56,164 @@ START_TEST(sbf_add_filter)
 }
 END_TEST
 
+START_TEST(sbf_try_add_no_grow)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Fill up the first filter
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_try_add(&sbf, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // Existing keys are still reported, new keys are refused
+    res = sbf_try_add(&sbf, "foobar0");
+    fail_unless(res == 0);
+    res = sbf_try_add(&sbf, "foobar1000");
+    fail_unless(res == -EAGAIN);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf_size(&sbf) == 1000);
+
+    // A normal add will grow
+    res = sbf_add(&sbf, "foobar1000");
+    fail_unless(res == 1);
+    fail_unless(sbf.num_filters == 2);
+    res = sbf_try_add(&sbf, "foobar1001");
+    fail_unless(res == 1);
+    fail_unless(sbf_size(&sbf) == 1002);
+}
+END_TEST
+
+START_TEST(sbf_try_add_sparse)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e5;
+    params.format.sparse = 1;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+    fail_unless(bf_is_sparse(sbf.filters[0]));
+
+    // The sparse set fills long before the layer
+    char buf[100];
+    int i = 0;
+    do {
+        snprintf((char*)&buf, 100, "foobar%d", i++);
+        res = sbf_try_add(&sbf, (char*)&buf);
+    } while (res == 1);
+    fail_unless(res == -EAGAIN);
+    fail_unless(i < 1000);
+
+    // A normal add makes room without a new layer
+    res = sbf_add(&sbf, (char*)&buf);
+    fail_unless(res == 1);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf_size(&sbf) == (uint64_t)i);
+    for (int j=0; j < i; j++) {
+        snprintf((char*)&buf, 100, "foobar%d", j);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+    sbf_close(&sbf);
+}
+END_TEST
+
+START_TEST(sbf_remove_counting)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // The default layout cannot remove
+    fail_unless(sbf_add(&sbf, "foobar") == 1);
+    fail_unless(sbf_remove(&sbf, "foobar") == -EINVAL);
+    sbf_close(&sbf);
+
+    params.format.layout = BLOOM_LAYOUT_COUNTING;
+    res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Spread the keys over two layers
+    char buf[100];
+    for (int i=0;i<1500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    // Remove a key from each layer
+    char *keys[] = {"foobar0", "foobar1499", "missing"};
+    char result[3];
+    fail_unless(sbf_remove_many(&sbf, keys, 3, result) == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+    fail_unless(sbf_contains(&sbf, "foobar0") == 0);
+    fail_unless(sbf_contains(&sbf, "foobar1499") == 0);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 1);
+    fail_unless(sbf_size(&sbf) == 1498);
+
+    // The layers are written out on flush
+    fail_unless(sbf.dirty_filters[0] == 1 && sbf.dirty_filters[1] == 1);
+    fail_unless(sbf_remove(&sbf, "foobar0") == 0);
+    fail_unless(sbf_add(&sbf, "foobar0") == 1);
+    sbf_close(&sbf);
+}
+END_TEST
+
+START_TEST(sbf_age_refresh)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    params.format.layout = BLOOM_LAYOUT_AGING;
+    params.format.age_ticks = 2;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Spread the keys over two layers
+    fail_unless(sbf_age(&sbf, 1) == 0);
+    char buf[100];
+    for (int i=0;i<1500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    // A key of the old layer is set again in the new one
+    fail_unless(sbf_age(&sbf, 2) == 0);
+    fail_unless(sbf_contains(&sbf, "foobar0") == 1);
+    fail_unless(sbf_add(&sbf, "foobar0") == 0);
+
+    // The other keys expire, and stop counting
+    memset(sbf.dirty_filters, 0, sbf.num_filters);
+    fail_unless(sbf_age(&sbf, 3) == 0);
+    fail_unless(sbf_contains(&sbf, "foobar0") == 1);
+    fail_unless(sbf_contains(&sbf, "foobar1") == 0);
+    fail_unless(sbf_contains(&sbf, "foobar1499") == 0);
+    fail_unless(sbf_size(&sbf) <= 2);
+    fail_unless(sbf.dirty_filters[0] == 1 && sbf.dirty_filters[1] == 1);
+
+    // Expired keys are added again
+    fail_unless(sbf_add(&sbf, "foobar1") == 1);
+
+    // Aging filters can not be merged
+    bloom_sbf other;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &other) == 0);
+    fail_unless(sbf_merge(&other, &sbf, 0) == -EINVAL);
+    sbf_close(&other);
+    sbf_close(&sbf);
+}
+END_TEST
+
 START_TEST(sbf_add_filter_2)
 {
     bloom_sbf_params params = SBF_DEFAULT_PARAMS;
@@ -311,3 +469,422 @@ START_TEST(sbf_fp_prob)
 }
 END_TEST
 
+
+START_TEST(sbf_add_many_grow)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Every key is added twice in a row
+    static char bufs[3000][20];
+    char *keys[3000];
+    char result[3000];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i / 2);
+        keys[i] = bufs[i];
+    }
+
+    // Without growing we stop at capacity
+    res = sbf_try_add_many(&sbf, keys, 3000, result);
+    fail_unless(res == 2000);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf_size(&sbf) == 1000);
+
+    // The rest must grow, including the duplicate of the last key
+    res = sbf_add_many(&sbf, keys + 1999, 1001, result + 1999);
+    fail_unless(res == 0);
+    fail_unless(sbf.num_filters == 2);
+    for (int i=0;i<3000;i++) {
+        fail_unless(result[i] == (i % 2 == 0));
+    }
+    fail_unless(sbf_size(&sbf) == 1500);
+
+    // Everything is present
+    res = sbf_contains_many(&sbf, keys, 3000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<3000;i++) {
+        fail_unless(result[i] == 1);
+    }
+
+    // Growing in the middle of a batch, right before a duplicate
+    bloom_sbf sbf2;
+    res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf2);
+    fail_unless(res == 0);
+    res = sbf_add_many(&sbf2, keys, 3000, result);
+    fail_unless(res == 0);
+    fail_unless(sbf2.num_filters == 2);
+    for (int i=0;i<3000;i++) {
+        fail_unless(result[i] == (i % 2 == 0));
+    }
+    fail_unless(sbf_size(&sbf2) == 1500);
+}
+END_TEST
+
+START_TEST(sbf_layer_params_grow)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // Layer 0 gets the initial capacity, and tighter probability
+    bloom_filter_params layer;
+    fail_unless(sbf_layer_params(&params, 0, &layer) == 0);
+    fail_unless(layer.capacity == 1000);
+    fail_unless(layer.fp_probability < 1e-4);
+
+    // A new layer matches the params computed for it
+    char buf[20];
+    for (int i=0;i<1001;i++) {
+        snprintf((char*)&buf, 20, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf_layer_params(&params, 1, &layer) == 0);
+    fail_unless(layer.capacity == 4000);
+    fail_unless(sbf.capacities[0] == 4000);
+    fail_unless(layer.k_num == sbf.filters[0]->header->k_num);
+    fail_unless(layer.bytes == sbf.filters[0]->map->size);
+    sbf_close(&sbf);
+}
+END_TEST
+
+START_TEST(sbf_check_order_hits)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // The new layer holds fewer keys, so it is checked last
+    char buf[20];
+    for (int i=0;i<1100;i++) {
+        snprintf((char*)&buf, 20, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+    uint32_t order[2];
+    sbf_check_order(&sbf, order);
+    fail_unless(order[0] == 1 && order[1] == 0);
+
+    // Hits on the new layer move it first
+    for (int i=0;i<SBF_HIT_SAMPLE * SBF_REORDER_SAMPLES;i++) {
+        snprintf((char*)&buf, 20, "foobar%d", 1000 + i % 100);
+        fail_unless(sbf_contains(&sbf, (char*)&buf) == 1);
+    }
+    sbf_check_order(&sbf, order);
+    fail_unless(order[0] == 0 && order[1] == 1);
+
+    // Every key is still found in either order
+    static char bufs[1100][20];
+    char *keys[1100];
+    char result[1100];
+    for (int i=0;i<1100;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = sbf_contains_many(&sbf, keys, 1100, result);
+    fail_unless(res == 0);
+    for (int i=0;i<1100;i++) fail_unless(result[i] == 1);
+    sbf_close(&sbf);
+}
+END_TEST
+
+START_TEST(sbf_summary_rejects)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+    uint64_t bytes = sbf_total_byte_size(&sbf);
+
+    // Four bits per key rejects about 80% of misses
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    fail_unless(bitmap_from_file(-1, 1000, ANONYMOUS, map) == 0);
+    fail_unless(sbf_set_summary(&sbf, map) == 0);
+    fail_unless(sbf_set_summary(&sbf, map) == -EINVAL);
+    fail_unless(sbf_total_byte_size(&sbf) == bytes + 1000);
+    fail_unless(sbf_summary_fill(&sbf) == 0);
+
+    static char bufs[10000][20];
+    char *keys[10000];
+    char result[10000];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+    }
+    res = sbf_add_many(&sbf, keys, 2000, result);
+    fail_unless(res == 0);
+    res = sbf_add(&sbf, keys[2000]);
+    fail_unless(res == 1);
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf_size(&sbf) == 2001);
+    double fill = sbf_summary_fill(&sbf);
+    fail_unless(fill > 0.2 && fill < 0.25);
+
+    // Every key is found, and misses stay misses
+    res = sbf_contains_many(&sbf, keys, 10000, result);
+    fail_unless(res == 0);
+    for (int i=0;i<2001;i++) fail_unless(result[i] == 1);
+    int found = 0;
+    for (int i=2001;i<10000;i++) {
+        fail_unless(result[i] == sbf_contains(&sbf, keys[i]));
+        found += result[i];
+    }
+    fail_unless(found < 5);
+
+    // A full summary is no longer checked, but nothing is lost
+    res = sbf_add_many(&sbf, keys, 10000, result);
+    fail_unless(res == 0);
+    fail_unless(sbf_summary_fill(&sbf) > 0.5);
+    for (int i=0;i<10000;i++) fail_unless(sbf_contains(&sbf, keys[i]) == 1);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_contains_hashed_keys)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    static char bufs[100][20];
+    char *keys[100];
+    char result[100];
+    bloom_hashed_key hashed[100];
+    for (int i=0;i<100;i++) {
+        snprintf((char*)&bufs[i], 20, "foobar%d", i);
+        keys[i] = bufs[i];
+        bf_hashed_key_init(hashed + i, keys[i]);
+    }
+    res = sbf_add_many(&sbf, keys, 50, result);
+    fail_unless(res == 0);
+
+    // The hashes cached by the first check are reused by the second
+    for (int round=0; round < 2; round++) {
+        memset(result, 2, sizeof(result));
+        res = sbf_contains_hashed_many(&sbf, hashed, 100, result);
+        fail_unless(res == 0);
+        for (int i=0;i<100;i++) {
+            fail_unless(result[i] == (i < 50));
+        }
+    }
+}
+END_TEST
+
+START_TEST(sbf_many_key_lens)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    // The keys are not terminated, they share one buffer
+    char buf[] = "foo bar bazzy";
+    char *keys[] = {buf, buf + 4, buf + 8};
+    int lens[] = {3, 3, 3};
+    char result[3];
+    res = sbf_add_many_len(&sbf, keys, lens, 3, result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+
+    // The same keys match when they are terminated
+    char *terminated[] = {"foo", "bar", "baz", "bazzy"};
+    char found[4];
+    res = sbf_contains_many(&sbf, terminated, 4, found);
+    fail_unless(res == 0);
+    fail_unless(found[0] && found[1] && found[2] && !found[3]);
+
+    res = sbf_contains_many_len(&sbf, keys, lens, 3, found);
+    fail_unless(res == 0);
+    fail_unless(found[0] && found[1] && found[2]);
+
+    res = sbf_try_add_many_len(&sbf, keys, lens, 3, result);
+    fail_unless(res == 3);
+    fail_unless(!result[0] && !result[1] && !result[2]);
+}
+END_TEST
+
+START_TEST(sbf_merge_layers)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf big, small, other;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &big) == 0);
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &small) == 0);
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &other) == 0);
+
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&big, (char*)&buf);
+        if (i < 500) sbf_add(&small, (char*)&buf);
+        if (i >= 250 && i < 750) sbf_add(&other, (char*)&buf);
+    }
+    fail_unless(big.num_filters == 2);
+
+    // Layers of the same age are merged, and missing ones added
+    fail_unless(sbf_merge(&small, &big, 0) == 0);
+    fail_unless(small.num_filters == 2);
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_contains(&small, (char*)&buf) == 1);
+    }
+
+    // Keys may be in different layers, so only single
+    // layers are intersected
+    fail_unless(sbf_merge(&other, &big, 1) == -EINVAL);
+    fail_unless(sbf_merge(&small, &other, 1) == -EINVAL);
+
+    bloom_sbf single;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &single) == 0);
+    for (int i=0;i<500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&single, (char*)&buf);
+    }
+    fail_unless(sbf_merge(&single, &other, 1) == 0);
+    int found = 0;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        if (i >= 250 && i < 500) fail_unless(sbf_contains(&single, (char*)&buf) == 1);
+        else found += sbf_contains(&single, (char*)&buf);
+    }
+    fail_unless(found < 5);
+    fail_unless(sbf_close(&big) == 0);
+    fail_unless(sbf_close(&small) == 0);
+    fail_unless(sbf_close(&other) == 0);
+    fail_unless(sbf_close(&single) == 0);
+}
+END_TEST
+
+START_TEST(sbf_fill_layers)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+
+    char buf[100];
+    for (int i=0;i<3000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    bloom_filter_fill fill;
+    fail_unless(sbf_fill(&sbf, &fill) == 0);
+    fail_unless(fill.keys > 2900 && fill.keys < 3100);
+    fail_unless(fill.bits_set < fill.bits);
+    fail_unless(fill.fp_probability > 0 && fill.fp_probability < 1e-3);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+// Makes the first layer, and refuses to grow
+static int sbf_quota_callback(void *in, uint64_t bytes, bloom_bitmap *map) {
+    uint64_t *counter = (uint64_t*)in;
+    if ((*counter)++) return -EDQUOT;
+    return bitmap_from_file(-1, bytes, ANONYMOUS, map);
+}
+
+START_TEST(sbf_capped_growth)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-4;
+    bloom_sbf sbf;
+    uint64_t counter = 0;
+    fail_unless(sbf_from_filters(&params, sbf_quota_callback, &counter, 0, NULL, &sbf) == 0);
+
+    // The refused growth is not retried
+    char buf[100];
+    int res = 0;
+    for (int i=0;i<1010;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(res == -EDQUOT);
+    fail_unless(sbf.capped == 1);
+    fail_unless(counter == 2);
+    fail_unless(sbf_size(&sbf) == 1000);
+
+    // Overfilling adds past the capacity of the layer
+    // at the cost of more false positives
+    sbf.overfill = 1;
+    int added = 0;
+    for (int i=1000;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = sbf_add(&sbf, (char*)&buf);
+        fail_unless(res == 0 || res == 1);
+        added += res;
+    }
+    fail_unless(added > 950);
+    fail_unless(sbf.num_filters == 1);
+    fail_unless(sbf_size(&sbf) == 1000 + (uint64_t)added);
+    fail_unless(counter == 2);
+
+    // Once uncapped, the growth is tried again
+    sbf.capped = 0;
+    sbf.overfill = 0;
+    fail_unless(sbf_add(&sbf, "foobar-last") == -EDQUOT);
+    fail_unless(counter == 3);
+    fail_unless(sbf_close(&sbf) == 0);
+}
+END_TEST
+
+START_TEST(sbf_cached_totals)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.format.layout = BLOOM_LAYOUT_COUNTING;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1500;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(sbf_add(&sbf, (char*)&buf) == 1);
+    }
+    fail_unless(sbf.num_filters == 2);
+
+    // The totals match the layers
+    uint64_t size = 0, capacity = 0, bytes = 0;
+    for (uint32_t i=0; i < sbf.num_filters; i++) {
+        size += bf_size(sbf.filters[i]);
+        capacity += sbf.capacities[i];
+        bytes += sbf.filters[i]->map->size;
+    }
+    fail_unless(sbf_size(&sbf) == size);
+    fail_unless(sbf_size(&sbf) == 1500);
+    fail_unless(sbf_total_capacity(&sbf) == capacity);
+    fail_unless(sbf_total_byte_size(&sbf) == bytes);
+
+    // A key added twice is only dropped once it is removed twice
+    fail_unless(sbf_add(&sbf, "foobar0") == 0);
+    fail_unless(sbf_size(&sbf) == 1500);
+    fail_unless(sbf_remove(&sbf, "foobar0") == 1);
+    fail_unless(sbf_size(&sbf) == 1500);
+    fail_unless(sbf_remove(&sbf, "foobar0") == 1);
+    fail_unless(sbf_size(&sbf) == 1499);
+    fail_unless(bf_size(sbf.filters[0]) + bf_size(sbf.filters[1]) == 1499);
+    sbf_close(&sbf);
+}
+END_TEST
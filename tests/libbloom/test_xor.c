@@ -0,0 +1,145 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xorfilter.h"
+
+/**
+ * Hashes the keys "test0" to "test<num-1>".
+ */
+static uint64_t* xor_test_hashes(uint64_t num) {
+    uint64_t *hashes = malloc(num * sizeof(uint64_t));
+    char buf[32];
+    for (uint64_t i=0; i < num; i++) {
+        snprintf(buf, sizeof(buf), "test%llu", (unsigned long long)i);
+        bloom_hashed_key hk;
+        bf_hashed_key_init(&hk, buf);
+        hashes[i] = xf_hash_key(&hk);
+    }
+    return hashes;
+}
+
+START_TEST(xor_header_size)
+{
+    fail_unless(sizeof(bloom_xorfilter_header) == 64);
+}
+END_TEST
+
+START_TEST(xor_unique_hashes)
+{
+    uint64_t hashes[] = {5, 3, 5, 1, 3, 3, 9};
+    fail_unless(xf_unique_hashes(hashes, 7) == 4);
+    fail_unless(hashes[0] == 1);
+    fail_unless(hashes[1] == 3);
+    fail_unless(hashes[2] == 5);
+    fail_unless(hashes[3] == 9);
+    fail_unless(xf_unique_hashes(hashes, 0) == 0);
+}
+END_TEST
+
+START_TEST(xor_bad_args)
+{
+    bloom_bitmap map;
+    bloom_xorfilter filter;
+    uint64_t hashes[1] = {42};
+    fail_unless(xf_bytes_for_keys(100, 12) == 0);
+    fail_unless(xf_fingerprint_bits(0.01) == 8);
+    fail_unless(xf_fingerprint_bits(1e-4) == 16);
+
+    // Too small, and not a filter
+    fail_unless(bitmap_from_file(-1, 4096, ANONYMOUS, &map) == 0);
+    fail_unless(xf_build(&map, hashes, 10000, 8, &filter) == -EINVAL);
+    fail_unless(xf_build(&map, hashes, 1, 12, &filter) == -EINVAL);
+    fail_unless(xf_from_bitmap(&map, &filter) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(xor_build_contains)
+{
+    uint32_t widths[2] = {8, 16};
+    uint64_t num = 100000;
+    uint64_t *hashes = xor_test_hashes(2 * num);
+    for (int w=0; w < 2; w++) {
+        uint64_t bytes = xf_bytes_for_keys(num, widths[w]);
+        fail_unless(bytes < 64 + num * 125 / 100 * (widths[w] / 8));
+
+        bloom_bitmap map;
+        bloom_xorfilter filter;
+        fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &map) == 0);
+        uint64_t *keys = malloc(num * sizeof(uint64_t));
+        memcpy(keys, hashes, num * sizeof(uint64_t));
+        fail_unless(xf_unique_hashes(keys, num) == num);
+        fail_unless(xf_build(&map, keys, num, widths[w], &filter) == 0);
+        fail_unless(xf_size(&filter) == num);
+        free(keys);
+
+        // Every key is found, and the false positives
+        // are close to the fingerprint width
+        char buf[32];
+        uint64_t fps = 0;
+        for (uint64_t i=0; i < 2 * num; i++) {
+            snprintf(buf, sizeof(buf), "test%llu", (unsigned long long)i);
+            bloom_hashed_key hk;
+            bf_hashed_key_init(&hk, buf);
+            int res = xf_contains(&filter, &hk);
+            if (i < num)
+                fail_unless(res == 1);
+            else
+                fps += res;
+        }
+        fail_unless(fps < 2 * num * xf_fp_probability(&filter));
+
+        // The filter can be reopened
+        bloom_xorfilter filter2;
+        fail_unless(xf_from_bitmap(&map, &filter2) == 0);
+        fail_unless(xf_size(&filter2) == num);
+        fail_unless(xf_close(&filter) == 0);
+    }
+    free(hashes);
+}
+END_TEST
+
+START_TEST(xor_contains_many)
+{
+    uint64_t *hashes = xor_test_hashes(500);
+    uint64_t num = xf_unique_hashes(hashes, 500);
+    bloom_bitmap map;
+    bloom_xorfilter filter;
+    fail_unless(bitmap_from_file(-1, xf_bytes_for_keys(num, 16), ANONYMOUS, &map) == 0);
+    fail_unless(xf_build(&map, hashes, num, 16, &filter) == 0);
+
+    char bufs[1000][20];
+    bloom_hashed_key keys[1000];
+    char result[1000];
+    for (int i=0; i < 1000; i++) {
+        snprintf(bufs[i], 20, "test%d", i);
+        bf_hashed_key_init(keys + i, bufs[i]);
+    }
+
+    // The batch must agree with the single key checks
+    memset(result, 0, sizeof(result));
+    fail_unless(xf_contains_many(&filter, keys, 1000, result) == 0);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(result[i] == xf_contains(&filter, keys + i));
+        if (i < 500) fail_unless(result[i] == 1);
+    }
+    xf_close(&filter);
+    free(hashes);
+}
+END_TEST
+
+START_TEST(xor_build_empty)
+{
+    bloom_bitmap map;
+    bloom_xorfilter filter;
+    fail_unless(bitmap_from_file(-1, xf_bytes_for_keys(0, 16), ANONYMOUS, &map) == 0);
+    fail_unless(xf_build(&map, NULL, 0, 16, &filter) == 0);
+    fail_unless(xf_size(&filter) == 0);
+    bloom_hashed_key hk;
+    bf_hashed_key_init(&hk, "foo");
+    xf_contains(&filter, &hk);
+    xf_close(&filter);
+}
+END_TEST